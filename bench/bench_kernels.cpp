@@ -0,0 +1,425 @@
+#include <benchmark/benchmark.h>
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <string>
+#include <vector>
+#include "../source/op/kernels/cuda/argmax_kernel.cuh"
+#include "../source/op/kernels/cuda/rope_kernel.cuh"
+#include "../source/op/kernels/kernels_interface.h"
+#include "base/alloc.h"
+#include "base/cuda_config.h"
+#include "base/rope.h"
+
+// The kernels of one decode step at the shapes of real models. Every benchmark reports the
+// bytes and the flops it moves per iteration as the GB/s and the GFLOP/s it reaches, and the
+// share of the peak bandwidth and the peak fp32 throughput of the device, so the distance
+// of every kernel from the roofline is read off the table.
+namespace {
+struct ModelShape {
+  const char* name;
+  int32_t dim;
+  int32_t hidden_dim;
+  int32_t head_num;
+  int32_t kv_head_num;
+  int32_t head_size;
+  int32_t vocab_size;
+};
+
+const std::vector<ModelShape> kModelShapes = {
+    {"llama2-7b", 4096, 11008, 32, 32, 128, 32000},
+    {"llama3-8b", 4096, 14336, 32, 8, 128, 128256},
+    {"qwen2-1.5b", 1536, 8960, 12, 2, 128, 151936},
+    {"tinyllama-1.1b", 2048, 5632, 32, 4, 64, 32000},
+};
+
+int32_t kv_dim(const ModelShape& shape) { return shape.kv_head_num * shape.head_size; }
+
+// the weights of a transformer layer and the classifier, wqkv and w13 are the packed ones the
+// models run with
+enum WeightKind : int32_t {
+  kWeightQKV = 0,
+  kWeightO = 1,
+  kWeight13 = 2,
+  kWeight2 = 3,
+  kWeightCls = 4,
+};
+constexpr int32_t kWeightKindNum = 5;
+
+const char* weight_name(int32_t kind) {
+  static const char* names[kWeightKindNum] = {"wqkv", "wo", "w13", "w2", "cls"};
+  return names[kind];
+}
+
+// the rows and the columns of a weight
+std::pair<int32_t, int32_t> weight_shape(const ModelShape& shape, int32_t kind) {
+  switch (kind) {
+    case kWeightQKV:
+      return {shape.dim + 2 * kv_dim(shape), shape.dim};
+    case kWeightO:
+      return {shape.dim, shape.dim};
+    case kWeight13:
+      return {2 * shape.hidden_dim, shape.dim};
+    case kWeight2:
+      return {shape.dim, shape.hidden_dim};
+    default:
+      return {shape.vocab_size, shape.dim};
+  }
+}
+
+struct DevicePeak {
+  double byte_per_second = 0.;
+  double flop_per_second = 0.;
+};
+
+// the fp32 lanes of a streaming multiprocessor, the int8 matmuls are measured against the same
+// peak although the dp4a path reaches more
+int32_t fp32_lane_num(int32_t major, int32_t minor) {
+  if (major == 6) {
+    return minor == 0 ? 64 : 128;
+  }
+  if (major == 7 || (major == 8 && minor == 0)) {
+    return 64;
+  }
+  return 128;
+}
+
+const DevicePeak& device_peak() {
+  static DevicePeak peak = [] {
+    DevicePeak result;
+    int32_t device = 0;
+    cudaGetDevice(&device);
+    int32_t memory_clock_khz = 0;
+    int32_t bus_width = 0;
+    int32_t clock_khz = 0;
+    int32_t sm_num = 0;
+    int32_t major = 0;
+    int32_t minor = 0;
+    cudaDeviceGetAttribute(&memory_clock_khz, cudaDevAttrMemoryClockRate, device);
+    cudaDeviceGetAttribute(&bus_width, cudaDevAttrGlobalMemoryBusWidth, device);
+    cudaDeviceGetAttribute(&clock_khz, cudaDevAttrClockRate, device);
+    cudaDeviceGetAttribute(&sm_num, cudaDevAttrMultiProcessorCount, device);
+    cudaDeviceGetAttribute(&major, cudaDevAttrComputeCapabilityMajor, device);
+    cudaDeviceGetAttribute(&minor, cudaDevAttrComputeCapabilityMinor, device);
+    // double data rate memory, a fused multiply add is two flops
+    result.byte_per_second = 2. * memory_clock_khz * 1e3 * (bus_width / 8.);
+    result.flop_per_second = 2. * sm_num * fp32_lane_num(major, minor) * clock_khz * 1e3;
+    return result;
+  }();
+  return peak;
+}
+
+// a tensor on the cuda device, zeroed so every run reads the same data
+tensor::Tensor device_tensor(base::DataType data_type, std::vector<int32_t> dims) {
+  tensor::Tensor tensor(data_type, std::move(dims), true,
+                        base::CUDADeviceAllocatorFactory::get_instance());
+  CHECK(!tensor.is_empty()) << "Failed to allocate a tensor of " << tensor.byte_size()
+                            << " bytes on the cuda device.";
+  cudaMemset(tensor.get_buffer()->ptr(), 0, tensor.byte_size());
+  return tensor;
+}
+
+class CudaTimer {
+ public:
+  CudaTimer() {
+    cudaStreamCreate(&config_.stream);
+    cudaEventCreate(&start_);
+    cudaEventCreate(&stop_);
+  }
+
+  ~CudaTimer() {
+    cudaEventDestroy(start_);
+    cudaEventDestroy(stop_);
+  }
+
+  kernel::CudaConfig* config() { return &config_; }
+
+  cudaStream_t stream() const { return config_.stream; }
+
+  // times every launch on the stream with events, the manual time of the benchmark is the
+  // device time without the launch overhead of the host
+  template <typename Launch>
+  void run(benchmark::State& state, Launch&& launch, double byte_num, double flop_num) {
+    // the first launch loads the module outside of the timing
+    launch();
+    cudaStreamSynchronize(config_.stream);
+    for (auto _ : state) {
+      cudaEventRecord(start_, config_.stream);
+      launch();
+      cudaEventRecord(stop_, config_.stream);
+      cudaEventSynchronize(stop_);
+      float elapsed_ms = 0.f;
+      cudaEventElapsedTime(&elapsed_ms, start_, stop_);
+      state.SetIterationTime(elapsed_ms * 1e-3);
+    }
+    const cudaError_t err = cudaGetLastError();
+    if (err != cudaSuccess) {
+      state.SkipWithError(cudaGetErrorString(err));
+      return;
+    }
+    const DevicePeak& peak = device_peak();
+    using benchmark::Counter;
+    state.counters["GB/s"] = Counter(byte_num * 1e-9, Counter::kIsIterationInvariantRate);
+    state.counters["GFLOP/s"] = Counter(flop_num * 1e-9, Counter::kIsIterationInvariantRate);
+    if (peak.byte_per_second > 0.) {
+      state.counters["bw%"] = Counter(byte_num * 100. / peak.byte_per_second,
+                                      Counter::kIsIterationInvariantRate);
+    }
+    if (peak.flop_per_second > 0.) {
+      state.counters["flop%"] = Counter(flop_num * 100. / peak.flop_per_second,
+                                        Counter::kIsIterationInvariantRate);
+    }
+  }
+
+ private:
+  kernel::CudaConfig config_;
+  cudaEvent_t start_ = nullptr;
+  cudaEvent_t stop_ = nullptr;
+};
+
+const ModelShape& model_shape(benchmark::State& state) {
+  const ModelShape& shape = kModelShapes.at(state.range(0));
+  state.SetLabel(shape.name);
+  return shape;
+}
+
+// every model shape with every value of the second argument
+void model_args(benchmark::internal::Benchmark* bench, const std::vector<int64_t>& values) {
+  for (int64_t model = 0; model < kModelShapes.size(); ++model) {
+    for (int64_t value : values) {
+      bench->Args({model, value});
+    }
+  }
+}
+
+constexpr int32_t kGroupSize = 64;
+constexpr float kFloatSize = sizeof(float);
+
+void BM_matmul_fp32(benchmark::State& state) {
+  const ModelShape& shape = model_shape(state);
+  const int32_t kind = static_cast<int32_t>(state.range(1));
+  const int32_t token_num = static_cast<int32_t>(state.range(2));
+  state.SetLabel(std::string(shape.name) + "/" + weight_name(kind));
+  const auto [rows, cols] = weight_shape(shape, kind);
+  CudaTimer timer;
+  timer.config()->create_blas();
+  tensor::Tensor input = device_tensor(base::DataType::kDataTypeFp32, {token_num, cols});
+  tensor::Tensor weight = device_tensor(base::DataType::kDataTypeFp32, {rows, cols});
+  tensor::Tensor output = device_tensor(base::DataType::kDataTypeFp32, {token_num, rows});
+  const kernel::MatmulKernel matmul = kernel::get_matmul_kernel(base::DeviceType::kDeviceCUDA);
+  const double byte_num =
+      kFloatSize * (static_cast<double>(rows) * cols + token_num * (double(rows) + cols));
+  timer.run(
+      state, [&] { matmul(input, weight, output, 1.f, timer.config()); }, byte_num,
+      2. * token_num * rows * cols);
+}
+
+void BM_matmul_int8(benchmark::State& state) {
+  const ModelShape& shape = model_shape(state);
+  const int32_t kind = static_cast<int32_t>(state.range(1));
+  const int32_t token_num = static_cast<int32_t>(state.range(2));
+  state.SetLabel(std::string(shape.name) + "/" + weight_name(kind));
+  const auto [rows, cols] = weight_shape(shape, kind);
+  const int32_t group_num = static_cast<int32_t>(static_cast<int64_t>(rows) * cols / kGroupSize);
+  CudaTimer timer;
+  tensor::Tensor input = device_tensor(base::DataType::kDataTypeFp32, {token_num, cols});
+  tensor::Tensor weight = device_tensor(base::DataType::kDataTypeInt8, {rows, cols});
+  tensor::Tensor scale = device_tensor(base::DataType::kDataTypeFp32, {group_num});
+  tensor::Tensor output = device_tensor(base::DataType::kDataTypeFp32, {token_num, rows});
+  const kernel::MatmulKernelQuant matmul =
+      kernel::get_matmul_kernel_quant8(base::DeviceType::kDeviceCUDA);
+  const double byte_num = static_cast<double>(rows) * cols + kFloatSize * group_num +
+                          kFloatSize * token_num * (double(rows) + cols);
+  timer.run(
+      state, [&] { matmul(input, weight, output, kGroupSize, scale, timer.config()); },
+      byte_num, 2. * token_num * rows * cols);
+}
+
+void matmul_args(benchmark::internal::Benchmark* bench) {
+  bench->ArgNames({"model", "weight", "tokens"});
+  for (int64_t model = 0; model < kModelShapes.size(); ++model) {
+    for (int64_t kind = 0; kind < kWeightKindNum; ++kind) {
+      for (int64_t token_num : {1, 256}) {
+        bench->Args({model, kind, token_num});
+      }
+    }
+  }
+}
+
+void BM_mha(benchmark::State& state) {
+  const ModelShape& shape = model_shape(state);
+  const int32_t pos = static_cast<int32_t>(state.range(1));
+  const int32_t seq_len = pos + 1;
+  const int32_t dim = shape.head_num * shape.head_size;
+  const int32_t kv_size = kv_dim(shape);
+  CudaTimer timer;
+  tensor::Tensor query = device_tensor(base::DataType::kDataTypeFp32, {dim});
+  tensor::Tensor output = device_tensor(base::DataType::kDataTypeFp32, {dim});
+  tensor::Tensor score = device_tensor(base::DataType::kDataTypeFp32, {shape.head_num, seq_len});
+  tensor::Tensor key_cache = device_tensor(base::DataType::kDataTypeFp32, {1, seq_len, kv_size});
+  tensor::Tensor val_cache = device_tensor(base::DataType::kDataTypeFp32, {1, seq_len, kv_size});
+  const kernel::MHAKernel mha = kernel::get_mha_kernel(base::DeviceType::kDeviceCUDA);
+  const int32_t kv_mul = shape.head_num / shape.kv_head_num;
+  // the key and the value of every position are read once, the scores are written and read
+  const double byte_num = kFloatSize * (2. * seq_len * kv_size + 2. * dim +
+                                        2. * shape.head_num * seq_len);
+  const double flop_num = 4. * seq_len * dim;
+  timer.run(
+      state,
+      [&] {
+        mha(pos, shape.head_num, 0, seq_len, kv_size, kv_mul, shape.head_size, 0, output, query,
+            score, key_cache, val_cache, tensor::Tensor{}, tensor::Tensor{}, tensor::Tensor{},
+            tensor::Tensor{}, base::AttentionWindow{}, base::DeviceType::kDeviceCUDA,
+            timer.config());
+      },
+      byte_num, flop_num);
+}
+
+void BM_rmsnorm(benchmark::State& state) {
+  const ModelShape& shape = model_shape(state);
+  const int32_t token_num = static_cast<int32_t>(state.range(1));
+  CudaTimer timer;
+  tensor::Tensor input = device_tensor(base::DataType::kDataTypeFp32, {token_num, shape.dim});
+  tensor::Tensor weight = device_tensor(base::DataType::kDataTypeFp32, {shape.dim});
+  tensor::Tensor output = device_tensor(base::DataType::kDataTypeFp32, {token_num, shape.dim});
+  const kernel::RMSNormKernel rmsnorm = kernel::get_rmsnorm_kernel(base::DeviceType::kDeviceCUDA);
+  const double size = static_cast<double>(token_num) * shape.dim;
+  timer.run(
+      state, [&] { rmsnorm(input, weight, output, timer.stream()); },
+      kFloatSize * (2. * size + shape.dim), 4. * size);
+}
+
+void BM_rope(benchmark::State& state) {
+  const ModelShape& shape = model_shape(state);
+  const int32_t pos = static_cast<int32_t>(state.range(1));
+  const int32_t dim = shape.head_num * shape.head_size;
+  const int32_t kv_size = kv_dim(shape);
+  const int32_t max_seq_len = pos + 1;
+  CudaTimer timer;
+  tensor::Tensor query = device_tensor(base::DataType::kDataTypeFp32, {dim});
+  tensor::Tensor key = device_tensor(base::DataType::kDataTypeFp32, {kv_size});
+  const int32_t table_rows = base::rope_table_rows(max_seq_len);
+  tensor::Tensor sin_cache =
+      device_tensor(base::DataType::kDataTypeFp32, {table_rows, shape.head_size / 2});
+  tensor::Tensor cos_cache =
+      device_tensor(base::DataType::kDataTypeFp32, {table_rows, shape.head_size / 2});
+  kernel::sin_cos_cache_calc_cu(shape.head_size, max_seq_len, 10000.f, base::RoPEScaling(),
+                                sin_cache, cos_cache, timer.stream());
+  tensor::Tensor pos_tensor(base::DataType::kDataTypeInt32, 1, true,
+                            base::CPUDeviceAllocatorFactory::get_instance());
+  pos_tensor.index<int32_t>(0) = pos;
+  const kernel::RoPEKernel rope = kernel::get_rope_kernel(base::DeviceType::kDeviceCUDA);
+  // every pair of the query and the key is read and written with the sin and the cos of it
+  const double byte_num = kFloatSize * (2. * (dim + kv_size) + (dim + kv_size));
+  timer.run(
+      state,
+      [&] {
+        rope(dim, kv_size, shape.head_size, false, query, key, pos_tensor, sin_cache, cos_cache,
+             timer.stream());
+      },
+      byte_num, 3. * (dim + kv_size));
+}
+
+void BM_swiglu(benchmark::State& state) {
+  const ModelShape& shape = model_shape(state);
+  const int32_t token_num = static_cast<int32_t>(state.range(1));
+  CudaTimer timer;
+  const std::vector<int32_t> dims = {token_num, shape.hidden_dim};
+  tensor::Tensor input1 = device_tensor(base::DataType::kDataTypeFp32, dims);
+  tensor::Tensor input2 = device_tensor(base::DataType::kDataTypeFp32, dims);
+  tensor::Tensor output = device_tensor(base::DataType::kDataTypeFp32, dims);
+  const kernel::SwigluKernel swiglu =
+      kernel::get_swiglu_kernel(base::DeviceType::kDeviceCUDA, timer.stream());
+  const double size = static_cast<double>(token_num) * shape.hidden_dim;
+  timer.run(
+      state, [&] { swiglu(input1, input2, output, timer.stream()); }, kFloatSize * 3. * size,
+      5. * size);
+}
+
+void BM_add(benchmark::State& state) {
+  const ModelShape& shape = model_shape(state);
+  const int32_t token_num = static_cast<int32_t>(state.range(1));
+  CudaTimer timer;
+  const std::vector<int32_t> dims = {token_num, shape.dim};
+  tensor::Tensor input1 = device_tensor(base::DataType::kDataTypeFp32, dims);
+  tensor::Tensor input2 = device_tensor(base::DataType::kDataTypeFp32, dims);
+  tensor::Tensor output = device_tensor(base::DataType::kDataTypeFp32, dims);
+  const kernel::AddKernel add = kernel::get_add_kernel(base::DeviceType::kDeviceCUDA);
+  const double size = static_cast<double>(token_num) * shape.dim;
+  timer.run(
+      state, [&] { add(input1, input2, output, timer.stream()); }, kFloatSize * 3. * size,
+      size);
+}
+
+void BM_embedding(benchmark::State& state) {
+  const ModelShape& shape = model_shape(state);
+  const int32_t token_num = static_cast<int32_t>(state.range(1));
+  CudaTimer timer;
+  tensor::Tensor tokens = device_tensor(base::DataType::kDataTypeInt32, {token_num});
+  tensor::Tensor weight =
+      device_tensor(base::DataType::kDataTypeFp32, {shape.vocab_size, shape.dim});
+  tensor::Tensor output = device_tensor(base::DataType::kDataTypeFp32, {token_num, shape.dim});
+  const kernel::EmbeddingKernel embedding = kernel::get_emb_kernel(base::DeviceType::kDeviceCUDA);
+  const double size = static_cast<double>(token_num) * shape.dim;
+  timer.run(
+      state, [&] { embedding(tokens, weight, output, shape.vocab_size, timer.stream()); },
+      kFloatSize * (2. * size + token_num), 0.);
+}
+
+void BM_argmax(benchmark::State& state) {
+  const ModelShape& shape = model_shape(state);
+  CudaTimer timer;
+  tensor::Tensor logits = device_tensor(base::DataType::kDataTypeFp32, {shape.vocab_size});
+  tensor::Tensor index = device_tensor(base::DataType::kDataTypeInt32, {1});
+  const int32_t workspace_size =
+      static_cast<int32_t>(kernel::argmax_workspace_byte_size() / sizeof(int8_t));
+  tensor::Tensor workspace = device_tensor(base::DataType::kDataTypeInt8, {workspace_size});
+  timer.run(
+      state,
+      [&] {
+        kernel::argmax_kernel_cu(logits.ptr<float>(), logits.size(), index.ptr<int32_t>(),
+                                 workspace.get_buffer()->ptr(), timer.stream());
+      },
+      kFloatSize * shape.vocab_size, shape.vocab_size);
+}
+}  // namespace
+
+BENCHMARK(BM_matmul_fp32)->Apply(matmul_args)->UseManualTime()->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_matmul_int8)->Apply(matmul_args)->UseManualTime()->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_mha)
+    ->Apply([](benchmark::internal::Benchmark* bench) {
+      bench->ArgNames({"model", "pos"});
+      model_args(bench, {127, 1023, 4095});
+    })
+    ->UseManualTime()
+    ->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_rope)
+    ->Apply([](benchmark::internal::Benchmark* bench) {
+      bench->ArgNames({"model", "pos"});
+      model_args(bench, {127, 4095});
+    })
+    ->UseManualTime()
+    ->Unit(benchmark::kMicrosecond);
+
+#define KERNEL_BENCHMARK_ROWS(func)                                 \
+  BENCHMARK(func)                                                   \
+      ->Apply([](benchmark::internal::Benchmark* bench) {           \
+        bench->ArgNames({"model", "tokens"});                       \
+        model_args(bench, {1, 256});                                \
+      })                                                            \
+      ->UseManualTime()                                             \
+      ->Unit(benchmark::kMicrosecond)
+
+KERNEL_BENCHMARK_ROWS(BM_rmsnorm);
+KERNEL_BENCHMARK_ROWS(BM_swiglu);
+KERNEL_BENCHMARK_ROWS(BM_add);
+KERNEL_BENCHMARK_ROWS(BM_embedding);
+BENCHMARK(BM_argmax)
+    ->ArgName("model")
+    ->DenseRange(0, static_cast<int64_t>(kModelShapes.size()) - 1)
+    ->UseManualTime()
+    ->Unit(benchmark::kMicrosecond);
+
+// perf_regress links the suite and runs it with a main of its own
+#ifndef KUIPER_PERF_REGRESS
+BENCHMARK_MAIN();
+#endif
@@ -0,0 +1,132 @@
+#include <base/base.h>
+#include <glog/logging.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include "base/profiler.h"
+#include "model/llama3.h"
+#include "serving_bench.h"
+using json = nlohmann::json;
+
+static bool parse_concurrencies(const std::string& value, std::vector<int32_t>& concurrencies) {
+  concurrencies.clear();
+  std::stringstream stream(value);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    const int32_t concurrency = std::atoi(item.c_str());
+    if (concurrency <= 0) {
+      return false;
+    }
+    concurrencies.push_back(concurrency);
+  }
+  return !concurrencies.empty();
+}
+
+static bool parse_options(int argc, char* argv[], ServingOptions& options) {
+  if (argc < 3) {
+    return false;
+  }
+  options.checkpoint_path = argv[1];
+  options.tokenizer_path = argv[2];
+  for (int i = 3; i + 1 < argc; i += 2) {
+    const std::string name = argv[i];
+    const char* value = argv[i + 1];
+    if (name == "--prompt-len") {
+      options.prompt_len = std::atoi(value);
+    } else if (name == "--prompt-len-max") {
+      options.prompt_len_max = std::atoi(value);
+    } else if (name == "--output-len") {
+      options.output_len = std::atoi(value);
+    } else if (name == "--output-len-max") {
+      options.output_len_max = std::atoi(value);
+    } else if (name == "--requests") {
+      options.request_num = std::atoi(value);
+    } else if (name == "--warmup") {
+      options.warmup_num = std::atoi(value);
+    } else if (name == "--concurrency") {
+      if (!parse_concurrencies(value, options.concurrencies)) {
+        return false;
+      }
+    } else if (name == "--prefill-chunk") {
+      options.prefill_chunk_size = std::atoi(value);
+    } else if (name == "--step-tokens") {
+      options.step_token_budget = std::atoi(value);
+    } else if (name == "--seed") {
+      options.seed = std::atoi(value);
+    } else if (name == "--ignore-eos") {
+      options.ignore_eos = std::atoi(value) != 0;
+    } else if (name == "--output") {
+      options.output_path = value;
+    } else if (name == "--profile") {
+      options.profile_path = value;
+    } else {
+      return false;
+    }
+  }
+  options.prompt_len_max = std::max(options.prompt_len_max, options.prompt_len);
+  options.output_len_max = std::max(options.output_len_max, options.output_len);
+  return (argc - 3) % 2 == 0 && options.prompt_len > 0 && options.output_len > 0 &&
+         options.request_num > 0 && options.warmup_num >= 0;
+}
+
+int main(int argc, char* argv[]) {
+  ServingOptions options;
+  if (!parse_options(argc, argv, options)) {
+    LOG(INFO) << "Usage: ./bench_serving checkpoint_path tokenizer_path [--prompt-len 128] "
+                 "[--prompt-len-max 128] [--output-len 128] [--output-len-max 128] "
+                 "[--requests 32] [--warmup 2] [--concurrency 1,2,4,8] [--prefill-chunk 512] "
+                 "[--step-tokens 1024] [--seed 0] [--ignore-eos 1] [--output result.json] "
+                 "[--profile trace.json]";
+    return -1;
+  }
+  const bool is_bpe = options.tokenizer_path.size() > 5 &&
+                      options.tokenizer_path.substr(options.tokenizer_path.size() - 5) == ".json";
+  model::LLama2Model model(is_bpe ? base::TokenizerType::kEncodeBpe
+                                  : base::TokenizerType::kEncodeSpe,
+                           options.tokenizer_path, options.checkpoint_path, false);
+  model.set_max_batch_size(
+      *std::max_element(options.concurrencies.begin(), options.concurrencies.end()));
+  auto init_status = model.init(base::DeviceType::kDeviceCUDA);
+  if (!init_status) {
+    LOG(FATAL) << "The model init failed, the error code is: " << init_status.get_err_msg();
+  }
+
+  ServingBench bench(model, options);
+  base::Profiler& profiler = base::Profiler::global();
+  if (!options.profile_path.empty()) {
+    profiler.start();
+  }
+  json results = json::array();
+  for (int32_t concurrency : options.concurrencies) {
+    results.push_back(bench.run(concurrency));
+  }
+  if (!options.profile_path.empty()) {
+    profiler.stop();
+    auto status = profiler.write_chrome_trace(options.profile_path);
+    if (!status) {
+      LOG(FATAL) << status.get_err_msg();
+    }
+    for (const base::ProfileSummary& summary : profiler.op_summary()) {
+      LOG(INFO) << summary.key << ": " << summary.count << " calls, " << summary.total_us * 1e-3
+                << " ms";
+    }
+  }
+  const json output = {{"checkpoint", options.checkpoint_path},
+                       {"prompt_len", {options.prompt_len, options.prompt_len_max}},
+                       {"output_len", {options.output_len, options.output_len_max}},
+                       {"warmup", options.warmup_num},
+                       {"ignore_eos", options.ignore_eos},
+                       {"results", results}};
+  if (options.output_path.empty()) {
+    printf("%s\n", output.dump(2).c_str());
+  } else {
+    std::ofstream file(options.output_path);
+    if (!file) {
+      LOG(FATAL) << "Failed to open " << options.output_path;
+    }
+    file << output.dump(2) << "\n";
+  }
+  return 0;
+}
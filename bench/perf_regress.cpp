@@ -0,0 +1,246 @@
+#include <benchmark/benchmark.h>
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <unistd.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include "model/llama3.h"
+#include "nlohmann/json.hpp"
+#include "serving_bench.h"
+using json = nlohmann::json;
+
+// Runs the kernel suite of bench_kernels and a fixed serving sweep, and compares every number
+// with the baseline of the gpu model in a checked-in json:
+//
+//   {"tolerance": 0.1,
+//    "gpus": {"NVIDIA GeForce RTX 4090": {
+//      "kernel/BM_add/model:0/tokens:1/manual_time": {"value": 3.1, "higher_is_better": false},
+//      "serving/c4/output_tokens_per_s": {"value": 512.0, "higher_is_better": true}}}}
+//
+// A metric regresses when it is worse than its baseline by more than the tolerance, a metric
+// may carry a tolerance of its own. The run fails with a diff table when any metric regresses,
+// --update 1 writes the numbers of this run as the baseline of the gpu instead.
+struct Options {
+  std::string baseline_path;
+  std::string checkpoint_path;
+  std::string tokenizer_path;
+  std::string filter = ".";
+  double tolerance = -1.;
+  bool update = false;
+};
+
+struct Metric {
+  double value = 0.;
+  bool higher_is_better = false;
+};
+
+static bool parse_options(int argc, char* argv[], Options& options) {
+  if (argc < 2) {
+    return false;
+  }
+  options.baseline_path = argv[1];
+  for (int i = 2; i + 1 < argc; i += 2) {
+    const std::string name = argv[i];
+    const char* value = argv[i + 1];
+    if (name == "--checkpoint") {
+      options.checkpoint_path = value;
+    } else if (name == "--tokenizer") {
+      options.tokenizer_path = value;
+    } else if (name == "--filter") {
+      options.filter = value;
+    } else if (name == "--tolerance") {
+      options.tolerance = std::atof(value);
+    } else if (name == "--update") {
+      options.update = std::atoi(value) != 0;
+    } else {
+      return false;
+    }
+  }
+  return (argc - 2) % 2 == 0 && options.checkpoint_path.empty() == options.tokenizer_path.empty();
+}
+
+static std::string gpu_name() {
+  int32_t device = 0;
+  cudaDeviceProp prop;
+  if (cudaGetDevice(&device) != cudaSuccess ||
+      cudaGetDeviceProperties(&prop, device) != cudaSuccess) {
+    LOG(FATAL) << "No cuda device to run the benchmarks on.";
+  }
+  return prop.name;
+}
+
+static double to_us(double time, const std::string& unit) {
+  if (unit == "ns") {
+    return time * 1e-3;
+  } else if (unit == "ms") {
+    return time * 1e3;
+  } else if (unit == "s") {
+    return time * 1e6;
+  }
+  return time;
+}
+
+// the device time of every kernel benchmark in microseconds, read from the json output of the
+// suite so the numbers are the ones bench_kernels prints
+static void run_kernels(const std::string& filter, std::map<std::string, Metric>& metrics) {
+  const std::string out_path = "./perf_regress_kernels." + std::to_string(getpid()) + ".json";
+  std::vector<std::string> flags = {"perf_regress", "--benchmark_filter=" + filter,
+                                    "--benchmark_out=" + out_path,
+                                    "--benchmark_out_format=json"};
+  std::vector<char*> argv;
+  for (std::string& flag : flags) {
+    argv.push_back(flag.data());
+  }
+  int argc = static_cast<int>(argv.size());
+  benchmark::Initialize(&argc, argv.data());
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+
+  std::ifstream file(out_path);
+  const json output = json::parse(file, nullptr, false);
+  std::remove(out_path.c_str());
+  if (output.is_discarded() || !output.contains("benchmarks")) {
+    LOG(FATAL) << "The kernel suite wrote no results.";
+  }
+  for (const json& run : output["benchmarks"]) {
+    if (run.value("run_type", "iteration") != "iteration" || run.contains("error_message")) {
+      continue;
+    }
+    metrics["kernel/" + run["name"].get<std::string>()] = {
+        to_us(run["real_time"].get<double>(), run.value("time_unit", "us")), false};
+  }
+}
+
+static void run_serving(const Options& options, std::map<std::string, Metric>& metrics) {
+  // a short fixed sweep, the lengths do not depend on the end of the sentence
+  ServingOptions serving;
+  serving.checkpoint_path = options.checkpoint_path;
+  serving.tokenizer_path = options.tokenizer_path;
+  serving.prompt_len = 128;
+  serving.prompt_len_max = 128;
+  serving.output_len = 64;
+  serving.output_len_max = 64;
+  serving.request_num = 16;
+  serving.warmup_num = 2;
+  serving.concurrencies = {1, 4};
+
+  const bool is_bpe = serving.tokenizer_path.size() > 5 &&
+                      serving.tokenizer_path.substr(serving.tokenizer_path.size() - 5) == ".json";
+  model::LLama2Model model(is_bpe ? base::TokenizerType::kEncodeBpe
+                                  : base::TokenizerType::kEncodeSpe,
+                           serving.tokenizer_path, serving.checkpoint_path, false);
+  model.set_max_batch_size(4);
+  auto init_status = model.init(base::DeviceType::kDeviceCUDA);
+  if (!init_status) {
+    LOG(FATAL) << "The model init failed, the error code is: " << init_status.get_err_msg();
+  }
+  ServingBench bench(model, serving);
+  for (int32_t concurrency : serving.concurrencies) {
+    const json result = bench.run(concurrency);
+    const std::string prefix = "serving/c" + std::to_string(concurrency) + "/";
+    metrics[prefix + "output_tokens_per_s"] = {result["output_tokens_per_s"].get<double>(), true};
+    metrics[prefix + "ttft_p50_ms"] = {result["ttft_ms"].value("p50", 0.), false};
+    metrics[prefix + "tpot_p50_ms"] = {result["tpot_ms"].value("p50", 0.), false};
+  }
+}
+
+// prints the table and returns the number of the regressed metrics
+static int32_t compare(const json& baseline, double default_tolerance,
+                       const std::map<std::string, Metric>& metrics) {
+  int32_t regressed_num = 0;
+  printf("%-64s %12s %12s %9s  %s\n", "metric", "baseline", "current", "change", "status");
+  for (const auto& [name, expected] : baseline.items()) {
+    const double base = expected["value"].get<double>();
+    const bool higher_is_better = expected.value("higher_is_better", false);
+    const double tolerance = expected.value("tolerance", default_tolerance);
+    auto iter = metrics.find(name);
+    if (iter == metrics.end()) {
+      printf("%-64s %12.3f %12s %9s  %s\n", name.c_str(), base, "-", "-", "skipped");
+      continue;
+    }
+    const double current = iter->second.value;
+    const double change = base != 0. ? (current - base) / std::fabs(base) : 0.;
+    // the change in the direction which is worse
+    const double worse = higher_is_better ? -change : change;
+    const char* status = "ok";
+    if (worse > tolerance) {
+      status = "REGRESSED";
+      regressed_num += 1;
+    } else if (worse < -tolerance) {
+      status = "improved";
+    }
+    printf("%-64s %12.3f %12.3f %+8.1f%%  %s\n", name.c_str(), base, current, change * 100.,
+           status);
+  }
+  for (const auto& [name, metric] : metrics) {
+    if (!baseline.contains(name)) {
+      printf("%-64s %12s %12.3f %9s  %s\n", name.c_str(), "-", metric.value, "-", "new");
+    }
+  }
+  return regressed_num;
+}
+
+int main(int argc, char* argv[]) {
+  Options options;
+  if (!parse_options(argc, argv, options)) {
+    LOG(INFO) << "Usage: ./perf_regress baseline.json [--checkpoint model.bin --tokenizer "
+                 "tokenizer.model] [--filter regex] [--tolerance 0.1] [--update 1]";
+    return -1;
+  }
+  json baselines = json::object();
+  {
+    std::ifstream file(options.baseline_path);
+    if (file) {
+      baselines = json::parse(file, nullptr, false);
+      if (baselines.is_discarded() || !baselines.is_object()) {
+        LOG(FATAL) << "The baseline " << options.baseline_path << " is not a json object.";
+      }
+    } else if (!options.update) {
+      LOG(FATAL) << "Failed to open the baseline " << options.baseline_path;
+    }
+  }
+  const double tolerance =
+      options.tolerance >= 0. ? options.tolerance : baselines.value("tolerance", 0.1);
+  const std::string gpu = gpu_name();
+
+  std::map<std::string, Metric> metrics;
+  run_kernels(options.filter, metrics);
+  if (!options.checkpoint_path.empty()) {
+    run_serving(options, metrics);
+  }
+
+  if (options.update) {
+    json& baseline = baselines["gpus"][gpu];
+    for (const auto& [name, metric] : metrics) {
+      baseline[name] = {{"value", metric.value}, {"higher_is_better", metric.higher_is_better}};
+    }
+    if (!baselines.contains("tolerance")) {
+      baselines["tolerance"] = tolerance;
+    }
+    std::ofstream file(options.baseline_path);
+    if (!file) {
+      LOG(FATAL) << "Failed to write the baseline " << options.baseline_path;
+    }
+    file << baselines.dump(2) << "\n";
+    LOG(INFO) << "Wrote " << metrics.size() << " metrics of " << gpu << " to "
+              << options.baseline_path;
+    return 0;
+  }
+
+  if (!baselines.contains("gpus") || !baselines["gpus"].contains(gpu)) {
+    // a gpu without numbers only prints them, the baseline is recorded with --update 1
+    LOG(WARNING) << "The baseline has no numbers of " << gpu << ", nothing is compared.";
+    compare(json::object(), tolerance, metrics);
+    return 0;
+  }
+  const int32_t regressed_num = compare(baselines["gpus"][gpu], tolerance, metrics);
+  if (regressed_num > 0) {
+    LOG(ERROR) << regressed_num << " metrics regressed by more than " << tolerance * 100.
+               << "% on " << gpu << ".";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,166 @@
+#include <base/base.h>
+#include <glog/logging.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <thread>
+#include "model/llama3.h"
+#include "model/scheduler.h"
+#include "serving_bench.h"
+#include "server/request_trace.h"
+using json = nlohmann::json;
+
+// Replays a trace of llama_server --trace against this build: every request is added to the
+// scheduler at its arrival, divided by the speed, and a request which finished in the trace
+// decodes the tokens it got there. The time to the first token counts from the arrival in the
+// trace, so a replay which falls behind shows it in the numbers instead of hiding it.
+struct Options {
+  std::string checkpoint_path;
+  std::string tokenizer_path;
+  std::string trace_path;
+  std::string output_path;
+  double speed = 1.;
+  int32_t max_batch_size = 8;
+  int32_t prefill_chunk_size = 512;
+  int32_t step_token_budget = 1024;
+  // 0 replays the whole trace
+  int32_t request_num = 0;
+};
+
+static bool parse_options(int argc, char* argv[], Options& options) {
+  if (argc < 4) {
+    return false;
+  }
+  options.checkpoint_path = argv[1];
+  options.tokenizer_path = argv[2];
+  options.trace_path = argv[3];
+  for (int i = 4; i + 1 < argc; i += 2) {
+    const std::string name = argv[i];
+    const char* value = argv[i + 1];
+    if (name == "--speed") {
+      options.speed = std::atof(value);
+    } else if (name == "--batch") {
+      options.max_batch_size = std::atoi(value);
+    } else if (name == "--prefill-chunk") {
+      options.prefill_chunk_size = std::atoi(value);
+    } else if (name == "--step-tokens") {
+      options.step_token_budget = std::atoi(value);
+    } else if (name == "--requests") {
+      options.request_num = std::atoi(value);
+    } else if (name == "--output") {
+      options.output_path = value;
+    } else {
+      return false;
+    }
+  }
+  return (argc - 4) % 2 == 0 && options.speed > 0. && options.max_batch_size > 0 &&
+         options.request_num >= 0;
+}
+
+static json replay(const model::Model& model, const Options& options,
+                   const std::vector<server::TraceRecord>& records) {
+  model::Scheduler scheduler(model);
+  scheduler.set_prefill_chunk_size(options.prefill_chunk_size);
+  scheduler.set_step_token_budget(options.step_token_budget);
+  std::map<int32_t, RequestTiming> timings;
+  scheduler.set_token_callback([&timings](int32_t seq_id, int32_t) {
+    RequestTiming& timing = timings.at(seq_id);
+    const Clock::time_point now = Clock::now();
+    if (timing.output_len == 0) {
+      timing.first_token_time = now;
+    }
+    timing.last_token_time = now;
+    timing.output_len += 1;
+  });
+
+  std::vector<RequestTiming> done;
+  const Clock::time_point begin_time = Clock::now();
+  auto arrival_time = [&](const server::TraceRecord& record) {
+    return begin_time + std::chrono::microseconds(static_cast<int64_t>(
+                            static_cast<double>(record.arrival_us) / options.speed));
+  };
+  size_t next = 0;
+  int32_t in_flight = 0;
+  while (next < records.size() || in_flight > 0) {
+    const Clock::time_point now = Clock::now();
+    while (next < records.size() && arrival_time(records.at(next)) <= now) {
+      const server::TraceRecord& record = records.at(next);
+      // the length of the trace without the end of the sentence of this build
+      const bool ignore_eos = record.output_len >= 0;
+      const int32_t max_new_tokens =
+          ignore_eos ? std::max(record.output_len, 1) : record.max_new_tokens;
+      const int32_t seq_id =
+          scheduler.add_sequence(record.prompt_tokens, max_new_tokens, ignore_eos);
+      RequestTiming& timing = timings[seq_id];
+      timing.submit_time = arrival_time(record);
+      timing.prompt_len = static_cast<int32_t>(record.prompt_tokens.size());
+      next += 1;
+      in_flight += 1;
+    }
+    if (!scheduler.has_unfinished()) {
+      std::this_thread::sleep_until(arrival_time(records.at(next)));
+      continue;
+    }
+    auto status = scheduler.step();
+    if (!status) {
+      LOG(FATAL) << "The scheduler step failed: " << status.get_err_msg();
+    }
+    for (const model::Sequence& seq : scheduler.pop_finished()) {
+      in_flight -= 1;
+      done.push_back(timings.at(seq.seq_id));
+      timings.erase(seq.seq_id);
+    }
+  }
+  json report = summarize_timings(done, Clock::now() - begin_time);
+  report["speed"] = options.speed;
+  return report;
+}
+
+int main(int argc, char* argv[]) {
+  Options options;
+  if (!parse_options(argc, argv, options)) {
+    LOG(INFO) << "Usage: ./replay checkpoint_path tokenizer_path requests.trace [--speed 1.0] "
+                 "[--batch 8] [--prefill-chunk 512] [--step-tokens 1024] [--requests 0] "
+                 "[--output result.json]";
+    return -1;
+  }
+  std::vector<server::TraceRecord> records;
+  auto status = server::read_trace(options.trace_path, records);
+  if (!status) {
+    LOG(FATAL) << status.get_err_msg();
+  }
+  if (options.request_num > 0 && records.size() > options.request_num) {
+    records.resize(options.request_num);
+  }
+  if (records.empty()) {
+    LOG(FATAL) << "The trace " << options.trace_path << " has no requests.";
+  }
+
+  const bool is_bpe = options.tokenizer_path.size() > 5 &&
+                      options.tokenizer_path.substr(options.tokenizer_path.size() - 5) == ".json";
+  model::LLama2Model model(is_bpe ? base::TokenizerType::kEncodeBpe
+                                  : base::TokenizerType::kEncodeSpe,
+                           options.tokenizer_path, options.checkpoint_path, false);
+  model.set_max_batch_size(options.max_batch_size);
+  auto init_status = model.init(base::DeviceType::kDeviceCUDA);
+  if (!init_status) {
+    LOG(FATAL) << "The model init failed, the error code is: " << init_status.get_err_msg();
+  }
+  // a prompt which does not fit this build is reported by the scheduler and counted as done
+  const json output = {{"checkpoint", options.checkpoint_path},
+                       {"trace", options.trace_path},
+                       {"batch", options.max_batch_size},
+                       {"result", replay(model, options, records)}};
+  if (options.output_path.empty()) {
+    printf("%s\n", output.dump(2).c_str());
+  } else {
+    std::ofstream file(options.output_path);
+    if (!file) {
+      LOG(FATAL) << "Failed to open " << options.output_path;
+    }
+    file << output.dump(2) << "\n";
+  }
+  return 0;
+}
@@ -0,0 +1,150 @@
+#include "serving_bench.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include "model/scheduler.h"
+using json = nlohmann::json;
+
+static double to_ms(Clock::duration duration) {
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+static json summarize(std::vector<double> values) {
+  if (values.empty()) {
+    return json::object();
+  }
+  std::sort(values.begin(), values.end());
+  double sum = 0.;
+  for (double value : values) {
+    sum += value;
+  }
+  // the nearest rank percentile
+  auto percentile = [&values](double p) {
+    const size_t rank = static_cast<size_t>(std::ceil(p / 100. * values.size()));
+    return values.at(std::max<size_t>(rank, 1) - 1);
+  };
+  return {{"mean", sum / values.size()}, {"p50", percentile(50.)},
+          {"p90", percentile(90.)},      {"p99", percentile(99.)},
+          {"min", values.front()},       {"max", values.back()}};
+}
+
+json summarize_timings(const std::vector<RequestTiming>& done, Clock::duration elapsed) {
+  std::vector<double> ttfts;
+  std::vector<double> tpots;
+  std::vector<double> latencies;
+  int64_t prompt_token_num = 0;
+  int64_t output_token_num = 0;
+  for (const RequestTiming& timing : done) {
+    prompt_token_num += timing.prompt_len;
+    output_token_num += timing.output_len;
+    if (timing.output_len == 0) {
+      continue;
+    }
+    ttfts.push_back(to_ms(timing.first_token_time - timing.submit_time));
+    latencies.push_back(to_ms(timing.last_token_time - timing.submit_time));
+    // the time per output token leaves out the first one, which waits for the prefill
+    if (timing.output_len > 1) {
+      tpots.push_back(to_ms(timing.last_token_time - timing.first_token_time) /
+                      (timing.output_len - 1));
+    }
+  }
+  const double seconds = std::chrono::duration<double>(elapsed).count();
+  return {{"requests", done.size()},
+          {"duration_s", seconds},
+          {"prompt_tokens", prompt_token_num},
+          {"output_tokens", output_token_num},
+          {"requests_per_s", seconds > 0. ? done.size() / seconds : 0.},
+          {"output_tokens_per_s", seconds > 0. ? output_token_num / seconds : 0.},
+          {"total_tokens_per_s",
+           seconds > 0. ? (prompt_token_num + output_token_num) / seconds : 0.},
+          {"ttft_ms", summarize(ttfts)},
+          {"tpot_ms", summarize(tpots)},
+          {"latency_ms", summarize(latencies)}};
+}
+
+ServingBench::ServingBench(const model::Model& model, const ServingOptions& options)
+    : model_(model), options_(options), random_(options.seed) {
+  // the prompts are windows of the tokens of a text, so every token is in the vocabulary
+  const std::string text =
+      "The history of computing is a story of machines that grew smaller and faster while "
+      "the problems they were asked to solve grew larger. Early computers filled rooms and "
+      "were programmed by rewiring panels, later ones read their programs from punched cards "
+      "and magnetic tape, and today a phone holds more memory than every machine of the "
+      "nineteen sixties together. ";
+  text_tokens_ = model_.encode(text);
+  CHECK(!text_tokens_.empty());
+}
+
+json ServingBench::run(int32_t concurrency) {
+  model::Scheduler scheduler(model_);
+  scheduler.set_prefill_chunk_size(options_.prefill_chunk_size);
+  scheduler.set_step_token_budget(options_.step_token_budget);
+  std::map<int32_t, RequestTiming> timings;
+  scheduler.set_token_callback([&timings](int32_t seq_id, int32_t) {
+    RequestTiming& timing = timings.at(seq_id);
+    const Clock::time_point now = Clock::now();
+    if (timing.output_len == 0) {
+      timing.first_token_time = now;
+    }
+    timing.last_token_time = now;
+    timing.output_len += 1;
+  });
+
+  // the warmup requests run at the same concurrency and are left out of the numbers
+  const int32_t total_num = options_.warmup_num + options_.request_num;
+  int32_t submitted_num = 0;
+  int32_t in_flight = 0;
+  std::vector<RequestTiming> done;
+  Clock::time_point begin_time;
+  Clock::time_point end_time;
+  while (submitted_num < total_num || in_flight > 0) {
+    while (submitted_num < total_num && in_flight < concurrency) {
+      const std::vector<int32_t> prompt_tokens = make_prompt();
+      const int32_t seq_id =
+          scheduler.add_sequence(prompt_tokens, draw(options_.output_len,
+                                                     options_.output_len_max),
+                                 options_.ignore_eos);
+      RequestTiming& timing = timings[seq_id];
+      timing.submit_time = Clock::now();
+      timing.prompt_len = static_cast<int32_t>(prompt_tokens.size());
+      if (submitted_num == options_.warmup_num) {
+        begin_time = timing.submit_time;
+      }
+      submitted_num += 1;
+      in_flight += 1;
+    }
+    auto status = scheduler.step();
+    if (!status) {
+      LOG(FATAL) << "The scheduler step failed: " << status.get_err_msg();
+    }
+    for (const model::Sequence& seq : scheduler.pop_finished()) {
+      in_flight -= 1;
+      if (seq.seq_id >= options_.warmup_num) {
+        done.push_back(timings.at(seq.seq_id));
+      }
+      timings.erase(seq.seq_id);
+    }
+    end_time = Clock::now();
+  }
+  json report = summarize_timings(done, end_time - begin_time);
+  report["concurrency"] = concurrency;
+  return report;
+}
+
+int32_t ServingBench::draw(int32_t min_value, int32_t max_value) {
+  return std::uniform_int_distribution<int32_t>(min_value, max_value)(random_);
+}
+
+std::vector<int32_t> ServingBench::make_prompt() {
+  // the kv cache keeps room for the output
+  const int32_t max_len = std::max(model_.seq_len() - options_.output_len_max - 1, 1);
+  const int32_t prompt_len =
+      std::min(draw(options_.prompt_len, options_.prompt_len_max), max_len);
+  const int32_t offset = draw(0, static_cast<int32_t>(text_tokens_.size()) - 1);
+  std::vector<int32_t> prompt_tokens(prompt_len);
+  for (int32_t i = 0; i < prompt_len; ++i) {
+    prompt_tokens.at(i) = text_tokens_.at((offset + i) % text_tokens_.size());
+  }
+  return prompt_tokens;
+}
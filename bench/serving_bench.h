@@ -0,0 +1,66 @@
+#ifndef KUIPER_BENCH_SERVING_BENCH_H_
+#define KUIPER_BENCH_SERVING_BENCH_H_
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include "model/model.h"
+#include "nlohmann/json.hpp"
+
+// The serving numbers of one model: requests with prompt and output lengths drawn uniformly
+// from their ranges go through the scheduler with a fixed number in flight, a finished request
+// is replaced by the next one. Every concurrency level runs its warmup requests first, then the
+// timed ones, and reports the time to the first token, the time per output token and the
+// latency of the requests with their percentiles as json.
+struct ServingOptions {
+  std::string checkpoint_path;
+  std::string tokenizer_path;
+  std::string output_path;
+  // a chrome trace of the layers of the whole sweep, the events slow the steps down a little
+  std::string profile_path;
+  int32_t prompt_len = 128;
+  int32_t prompt_len_max = 0;
+  int32_t output_len = 128;
+  int32_t output_len_max = 0;
+  int32_t request_num = 32;
+  int32_t warmup_num = 2;
+  int32_t prefill_chunk_size = 512;
+  int32_t step_token_budget = 1024;
+  int32_t seed = 0;
+  bool ignore_eos = true;
+  std::vector<int32_t> concurrencies = {1};
+};
+
+using Clock = std::chrono::steady_clock;
+
+struct RequestTiming {
+  Clock::time_point submit_time;
+  Clock::time_point first_token_time;
+  Clock::time_point last_token_time;
+  int32_t prompt_len = 0;
+  int32_t output_len = 0;
+};
+
+// the throughput over elapsed and the ttft, tpot and latency percentiles of the done requests
+nlohmann::json summarize_timings(const std::vector<RequestTiming>& done,
+                                 Clock::duration elapsed);
+
+class ServingBench {
+ public:
+  ServingBench(const model::Model& model, const ServingOptions& options);
+
+  // the report of one concurrency level
+  nlohmann::json run(int32_t concurrency);
+
+ private:
+  int32_t draw(int32_t min_value, int32_t max_value);
+
+  std::vector<int32_t> make_prompt();
+
+ private:
+  const model::Model& model_;
+  const ServingOptions& options_;
+  std::mt19937 random_;
+  std::vector<int32_t> text_tokens_;
+};
+#endif  // KUIPER_BENCH_SERVING_BENCH_H_
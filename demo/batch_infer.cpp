@@ -0,0 +1,96 @@
+#include <base/base.h>
+#include <glog/logging.h>
+#include <cstdio>
+#include <cstdlib>
+#include "model/batch_runner.h"
+#include "model/llama3.h"
+
+// Runs every line of a prompt file through the batch runner and writes one json line per prompt,
+// for the offline jobs where the tokens per second of the gpu matter and the latency does not.
+struct Options {
+  std::string checkpoint_path;
+  std::string tokenizer_path;
+  std::string input_path;
+  std::string output_path;
+  int32_t max_batch_size = 32;
+  // the prompts which start with the same tokens share the kv of up to this many blocks
+  int32_t prefix_cache_block_num = 0;
+  model::BatchOptions batch;
+};
+
+static bool parse_options(int argc, char* argv[], Options& options) {
+  if (argc < 5) {
+    return false;
+  }
+  options.checkpoint_path = argv[1];
+  options.tokenizer_path = argv[2];
+  options.input_path = argv[3];
+  options.output_path = argv[4];
+  options.batch.prefill_chunk_size = 512;
+  options.batch.step_token_budget = 2048;
+  for (int i = 5; i + 1 < argc; i += 2) {
+    const std::string name = argv[i];
+    const char* value = argv[i + 1];
+    if (name == "--batch") {
+      options.max_batch_size = std::atoi(value);
+    } else if (name == "--max-new-tokens") {
+      options.batch.max_new_tokens = std::atoi(value);
+    } else if (name == "--window") {
+      options.batch.window_size = std::atoi(value);
+    } else if (name == "--bucket") {
+      options.batch.bucket_size = std::atoi(value);
+    } else if (name == "--threads") {
+      options.batch.thread_num = std::atoi(value);
+    } else if (name == "--prefill-chunk") {
+      options.batch.prefill_chunk_size = std::atoi(value);
+    } else if (name == "--step-tokens") {
+      options.batch.step_token_budget = std::atoi(value);
+    } else if (name == "--prefix-cache-blocks") {
+      options.prefix_cache_block_num = std::atoi(value);
+    } else if (name == "--kv-swap-mb") {
+      options.batch.host_kv_swap_byte_size = static_cast<size_t>(std::atoll(value)) << 20;
+    } else {
+      return false;
+    }
+  }
+  return (argc - 5) % 2 == 0 && options.max_batch_size > 0 &&
+         options.batch.max_new_tokens > 0 && options.batch.window_size > 0 &&
+         options.batch.bucket_size > 0 && options.batch.thread_num > 0;
+}
+
+int main(int argc, char* argv[]) {
+  Options options;
+  if (!parse_options(argc, argv, options)) {
+    LOG(INFO) << "Usage: ./batch_infer checkpoint_path tokenizer_path prompts.txt outputs.jsonl "
+                 "[--batch 32] [--max-new-tokens 256] [--window 4096] [--bucket 64] "
+                 "[--threads 4] [--prefill-chunk 512] [--step-tokens 2048] [--kv-swap-mb 0] "
+                 "[--prefix-cache-blocks 0]";
+    return -1;
+  }
+  const bool is_bpe = options.tokenizer_path.size() > 5 &&
+                      options.tokenizer_path.substr(options.tokenizer_path.size() - 5) == ".json";
+  model::LLama2Model model(is_bpe ? base::TokenizerType::kEncodeBpe
+                                  : base::TokenizerType::kEncodeSpe,
+                           options.tokenizer_path, options.checkpoint_path, false);
+  model.set_max_batch_size(options.max_batch_size);
+  auto init_status = model.init(base::DeviceType::kDeviceCUDA);
+  if (!init_status) {
+    LOG(FATAL) << "The model init failed, the error code is: " << init_status.get_err_msg();
+  }
+  if (options.prefix_cache_block_num > 0) {
+    model.set_prefix_cache(options.prefix_cache_block_num);
+  }
+
+  model::BatchRunner runner(model, options.batch);
+  model::BatchStats stats;
+  auto status = runner.run(options.input_path, options.output_path, &stats);
+  if (!status) {
+    LOG(FATAL) << "The batch failed: " << status.get_err_msg();
+  }
+  printf("prompts:%ld failed:%ld prompt tokens:%ld output tokens:%ld seconds:%lf\n",
+         static_cast<long>(stats.prompt_num), static_cast<long>(stats.failed_num),
+         static_cast<long>(stats.prompt_token_num), static_cast<long>(stats.output_token_num),
+         stats.seconds);
+  printf("output tokens/s:%lf\n", static_cast<double>(stats.output_token_num) / stats.seconds);
+  return 0;
+}
@@ -1,6 +1,8 @@
 #include <base/base.h>
 #include <base/tick.h>
 #include <glog/logging.h>
+#include <cstdlib>
+#include "model/detokenize_worker.h"
 #include "model/llama3.h"
 int32_t generate(const model::LLama2Model& model, const std::string& sentence, int total_steps,
                  bool need_output = false) {
@@ -8,48 +10,117 @@ int32_t generate(const model::LLama2Model& model, const std::string& sentence, i
   int32_t prompt_len = tokens.size();
   LOG_IF(FATAL, tokens.empty()) << "The tokens is empty.";
 
-  int32_t pos = 0;
   int32_t next = -1;
-  bool is_prompt = true;
   const auto& prompt_embedding = model.embedding(tokens);
   tensor::Tensor pos_tensor = model.get_buffer(model::ModelBufferType::kInputPos);
+  pos_tensor.index<int32_t>(0) = 0;
+  // the whole prompt goes through the model in a single pass
+  model.prefill(prompt_embedding.input_embeddings, pos_tensor, next);
+  std::vector<int32_t> words(tokens.begin() + 1, tokens.end());
+  // the text is decoded and written on its own thread while the gpu runs the next steps
+  std::unique_ptr<model::DetokenizeWorker> detokenizer;
+  if (need_output) {
+    detokenizer = std::make_unique<model::DetokenizeWorker>(
+        model.stream_decoder(),
+        [](const std::string& text) {
+          printf("%s", text.data());
+          fflush(stdout);
+        });
+  }
 
-  std::vector<int32_t> words;
-  while (pos < total_steps) {
+  // the sampled token stays on the device and the steps stop there at the end of the sentence.
+  // One launch runs ahead of the steps which are waited for, so the gpu does not wait for the host
+  constexpr int32_t device_step_num = 8;
+  total_steps = std::min(total_steps, model.seq_len() - 1);
+  int32_t pos = prompt_len;
+  int32_t launched_pos = prompt_len;
+  bool is_end = model.is_sentence_ending(next);
+  // a model split between the cuda device and the cpu or sharded over the ranks samples every
+  // step on the host, the device decode needs the whole model on one device
+  const bool is_host_decode = model.is_layer_split() || model.is_tensor_parallel();
+  while (is_host_decode && !is_end && pos < total_steps) {
+    words.push_back(next);
+    if (detokenizer) {
+      detokenizer->push({next});
+    }
     pos_tensor.index<int32_t>(0) = pos;
-    if (pos < prompt_len - 1) {
-      tensor::Tensor input = model.fill_input(pos_tensor, prompt_embedding, is_prompt);
-      model.predict(input, pos_tensor, is_prompt, next);
-    } else {
-      is_prompt = false;
-      tokens = std::vector<int32_t>{next};
-      const auto& token_embedding = model.embedding(tokens);
-      tensor::Tensor input = model.fill_input(pos_tensor, token_embedding, is_prompt);
-      model.predict(input, pos_tensor, is_prompt, next);
+    CHECK(model.predict(model.embedding({next}).input_embeddings, pos_tensor, false, next));
+    pos += 1;
+    is_end = model.is_sentence_ending(next);
+  }
+  if (!is_end && !is_host_decode) {
+    words.push_back(next);
+    if (detokenizer) {
+      detokenizer->push({next});
     }
-    if (model.is_sentence_ending(next)) {
-      break;
+    std::vector<std::vector<int32_t>> stop_sequences;
+    for (int32_t token : model.sentence_ending_tokens()) {
+      stop_sequences.push_back({token});
     }
-    if (is_prompt) {
-      next = tokens.at(pos + 1);
-      words.push_back(next);
-    } else {
-      words.push_back(next);
+    CHECK(model.set_device_stop(stop_sequences));
+    CHECK(model.begin_device_decode(next, pos));
+  }
+  while (!is_end && pos < total_steps) {
+    while (launched_pos < total_steps && model.pending_device_decode_num() < 2) {
+      const int32_t step_num = std::min(device_step_num, total_steps - launched_pos);
+      CHECK(model.launch_device_decode(step_num));
+      launched_pos += step_num;
+    }
+    std::vector<int32_t> new_words;
+    CHECK(model.wait_device_decode(new_words));
+    pos += static_cast<int32_t>(new_words.size());
+    if (model.device_stop_reason() != model::DeviceStopReason::kRunning) {
+      // the last token of the wait which stops is the end of the sentence
+      is_end = true;
+      new_words.pop_back();
+    }
+    words.insert(words.end(), new_words.begin(), new_words.end());
+    if (detokenizer) {
+      detokenizer->push(new_words);
     }
-
-    pos += 1;
   }
-  if (need_output) {
-    printf("%s ", model.decode(words).data());
+  // the steps which ran past the end are dropped
+  while (model.pending_device_decode_num() > 0) {
+    std::vector<int32_t> unused_tokens;
+    CHECK(model.wait_device_decode(unused_tokens));
+  }
+  if (detokenizer) {
+    detokenizer->finish();
+    printf(" ");
     fflush(stdout);
   }
   return std::min(pos, total_steps);
 }
 
-
 int main(int argc, char* argv[]) {
-  if (argc != 3) {
-    LOG(INFO) << "Usage: ./demo checkpoint path tokenizer path";
+  // --gpu-layers n keeps the first n transformer layers on the cuda device and runs the others
+  // on the cpu, for a model which does not fit into the device memory
+  int32_t gpu_layer_num = 0;
+  // --tensor-parallel rank world_size id_path runs the model as one of world_size processes, each
+  // on the cuda device of its rank, which find each other through the id file
+  int32_t rank = 0;
+  int32_t world_size = 1;
+  std::string id_path;
+  bool is_valid = argc >= 3;
+  for (int i = 3; is_valid && i < argc;) {
+    const std::string name = argv[i];
+    if (name == "--gpu-layers" && i + 1 < argc) {
+      gpu_layer_num = std::atoi(argv[i + 1]);
+      is_valid = gpu_layer_num > 0;
+      i += 2;
+    } else if (name == "--tensor-parallel" && i + 3 < argc) {
+      rank = std::atoi(argv[i + 1]);
+      world_size = std::atoi(argv[i + 2]);
+      id_path = argv[i + 3];
+      is_valid = world_size > 1 && rank >= 0 && rank < world_size;
+      i += 4;
+    } else {
+      is_valid = false;
+    }
+  }
+  if (!is_valid) {
+    LOG(INFO) << "Usage: ./demo checkpoint path tokenizer path [--gpu-layers n] "
+                 "[--tensor-parallel rank world_size id_path]";
     return -1;
   }
   const char* checkpoint_path = argv[1];  // e.g. out/model.bin
@@ -57,16 +128,25 @@ int main(int argc, char* argv[]) {
 
   model::LLama2Model model(base::TokenizerType::kEncodeSpe, tokenizer_path,
     checkpoint_path, false);
+  if (gpu_layer_num > 0) {
+    model.set_gpu_layer_num(gpu_layer_num);
+  }
+  if (world_size > 1) {
+    model.set_tensor_parallel(rank, world_size, id_path);
+  }
   auto init_status = model.init(base::DeviceType::kDeviceCUDA);
   if (!init_status) {
     LOG(FATAL) << "The model init failed, the error code is: " << init_status.get_err_msg();
   }
+  // the graphs do not capture the sums over the ranks
+  model.set_cuda_graph(!model.is_tensor_parallel());
   const std::string& sentence = "a";
 
   auto start = std::chrono::steady_clock::now();
   printf("Generating...\n");
   fflush(stdout);
-  int steps = generate(model, sentence, 128, true);
+  // every rank runs the same steps, the first one prints the text
+  int steps = generate(model, sentence, 128, rank == 0);
   auto end = std::chrono::steady_clock::now();
   auto duration = std::chrono::duration<double>(end - start).count();
   printf("\nsteps/s:%lf\n", static_cast<double>(steps) / duration);
@@ -9,41 +9,43 @@ int32_t generate(const model::Qwen2Model& model, const std::string& sentence, in
   LOG_IF(FATAL, tokens.empty()) << "The tokens is empty.";
 
   int32_t pos = 0;
-  int32_t next = tokens.at(pos);
+  int32_t next = -1;
   bool is_prompt = true;
   const auto& prompt_embedding = model.embedding(tokens);
   tensor::Tensor pos_tensor = model.get_buffer(model::ModelBufferType::kInputPos);
 
   std::vector<int32_t> words;
-  words.push_back(next);
+  // the text is written as the tokens come, not decoded again at the end
+  model::StreamDecoder decoder = model.stream_decoder();
+  auto output = [&](const std::string& text) {
+    if (need_output && !text.empty()) {
+      printf("%s", text.data());
+      fflush(stdout);
+    }
+  };
   while (pos < total_steps) {
     pos_tensor.index<int32_t>(0) = pos;
-    if (pos < prompt_len - 1) {
-      tensor::Tensor input = model.fill_input(pos_tensor, prompt_embedding, is_prompt);
-      model.predict(input, pos_tensor, is_prompt, next);
-    } else {
+    if (is_prompt) {
+      // the whole prompt goes through the model in a single pass
+      model.prefill(prompt_embedding.input_embeddings, pos_tensor, next);
+      words.assign(tokens.begin(), tokens.end());
+      output(decoder.push(words));
+      pos = prompt_len - 1;
       is_prompt = false;
+    } else {
       tokens = std::vector<int32_t>{next};
       const auto& token_embedding = model.embedding(tokens);
-      tensor::Tensor input = model.fill_input(pos_tensor, token_embedding, is_prompt);
+      const tensor::Tensor& input = model.fill_input(pos_tensor, token_embedding, is_prompt);
       model.predict(input, pos_tensor, is_prompt, next);
     }
     if (model.is_sentence_ending(next)) {
       break;
     }
-    if (is_prompt) {
-      next = tokens.at(pos + 1);
-      words.push_back(next);
-    } else {
-      words.push_back(next);
-    }
-
+    words.push_back(next);
+    output(decoder.push(next));
     pos += 1;
   }
-  if (need_output) {
-    printf("%s ", model.decode(words).data());
-    fflush(stdout);
-  }
+  output(decoder.finish() + " ");
   return std::min(pos, total_steps);
 }
 
@@ -2,6 +2,11 @@
 #define KUIPER_INCLUDE_BASE_ALLOC_H_
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include "base.h"
 namespace base {
 enum class MemcpyKind {
@@ -11,24 +16,85 @@ enum class MemcpyKind {
   kMemcpyCUDA2CUDA = 3,
 };
 
+// the category the bytes of an allocation are counted in
+enum class MemoryTag : uint8_t {
+  kMemoryTagUnknown = 0,
+  kMemoryTagWeight = 1,
+  kMemoryTagKVCache = 2,
+  kMemoryTagActivation = 3,
+};
+
+constexpr int32_t kMemoryTagNum = 4;
+
+struct AllocatorStats {
+  // the live allocations and the highest value they reached
+  size_t allocated_byte_size = 0;
+  size_t peak_allocated_byte_size = 0;
+  // the memory held from the driver, a caching allocator keeps more than it hands out
+  size_t reserved_byte_size = 0;
+  size_t cached_byte_size = 0;
+  size_t largest_cached_byte_size = 0;
+  uint64_t allocation_num = 0;
+  uint64_t release_num = 0;
+  size_t tag_byte_sizes[kMemoryTagNum] = {};
+
+  // the part of the cache which does not fit into its largest block, 0 when it is contiguous
+  double fragmentation() const;
+};
+
 class DeviceAllocator {
  public:
   explicit DeviceAllocator(DeviceType device_type) : device_type_(device_type) {}
 
+  virtual ~DeviceAllocator() = default;
+
   virtual DeviceType device_type() const { return device_type_; }
 
   virtual void release(void* ptr) const = 0;
 
   virtual void* allocate(size_t byte_size) const = 0;
 
+  // the stream-ordered allocators enqueue the allocation and the release on the stream, the
+  // other ones ignore it
+  virtual void* allocate_async(size_t byte_size, void* stream) const {
+    return allocate(byte_size);
+  }
+
+  virtual void release_async(void* ptr, void* stream) const { release(ptr); }
+
   virtual void memcpy(const void* src_ptr, void* dest_ptr, size_t byte_size,
                       MemcpyKind memcpy_kind = MemcpyKind::kMemcpyCPU2CPU, void* stream = nullptr,
                       bool need_sync = false) const;
 
   virtual void memset_zero(void* ptr, size_t byte_size, void* stream, bool need_sync = false);
 
+  // a snapshot of the counters of every device id
+  virtual std::map<int, AllocatorStats> stats() const;
+
+  // the snapshot in a readable form, one line per device
+  std::string dump_stats() const;
+
+  void reset_peak_stats() const;
+
+  // counts the bytes of a live allocation in the category of tag from now on
+  void set_tag(void* ptr, MemoryTag tag) const;
+
+ protected:
+  void record_allocate(int device_id, void* ptr, size_t byte_size) const;
+
+  void record_release(void* ptr) const;
+
  private:
+  struct AllocationRecord {
+    int device_id = 0;
+    size_t byte_size = 0;
+    MemoryTag tag = MemoryTag::kMemoryTagUnknown;
+  };
+
   DeviceType device_type_ = DeviceType::kDeviceUnknown;
+  mutable std::mutex stats_mutex_;
+  mutable std::map<int, AllocatorStats> stats_;
+  mutable std::unordered_map<void*, AllocationRecord> records_;
 };
 
 class CPUDeviceAllocator : public DeviceAllocator {
@@ -40,15 +106,32 @@ class CPUDeviceAllocator : public DeviceAllocator {
   void release(void* ptr) const override;
 };
 
-struct CudaMemoryBuffer {
-  void* data;
-  size_t byte_size;
-  bool busy;
+// A block is a piece of one cudaMalloc segment. The small blocks own a whole segment of their
+// size class, the large segments are split and the free neighbours are merged back.
+struct CudaMemoryBlock {
+  int device_id = -1;
+  void* data = nullptr;
+  size_t byte_size = 0;
+  bool busy = false;
+  bool is_small = false;
+  CudaMemoryBlock* prev = nullptr;
+  CudaMemoryBlock* next = nullptr;
+};
 
-  CudaMemoryBuffer() = default;
+struct CudaMemoryBlockCompare {
+  bool operator()(const CudaMemoryBlock* lhs, const CudaMemoryBlock* rhs) const {
+    if (lhs->byte_size != rhs->byte_size) {
+      return lhs->byte_size < rhs->byte_size;
+    }
+    return reinterpret_cast<uintptr_t>(lhs->data) < reinterpret_cast<uintptr_t>(rhs->data);
+  }
+};
 
-  CudaMemoryBuffer(void* data, size_t byte_size, bool busy)
-      : data(data), byte_size(byte_size), busy(busy) {}
+struct CudaMemoryPool {
+  // the free blocks of every power of two size class up to the small limit
+  std::vector<std::vector<CudaMemoryBlock*>> small_bins;
+  // the free large blocks ordered by size, the allocation takes the best fit
+  std::set<CudaMemoryBlock*, CudaMemoryBlockCompare> large_blocks;
 };
 
 class CUDADeviceAllocator : public DeviceAllocator {
@@ -59,10 +142,60 @@ class CUDADeviceAllocator : public DeviceAllocator {
 
   void release(void* ptr) const override;
 
+  // hands the cached blocks which are not in use back to the driver
+  void empty_cache() const;
+
+  std::map<int, AllocatorStats> stats() const override;
+
  private:
-  mutable std::map<int, size_t> no_busy_cnt_;
-  mutable std::map<int, std::vector<CudaMemoryBuffer>> big_buffers_map_;
-  mutable std::map<int, std::vector<CudaMemoryBuffer>> cuda_buffers_map_;
+  CudaMemoryPool& device_pool(int device_id) const;
+
+  CudaMemoryBlock* allocate_small(int device_id, size_t byte_size) const;
+
+  CudaMemoryBlock* allocate_large(int device_id, size_t byte_size) const;
+
+  void* cuda_malloc(size_t byte_size) const;
+
+  void release_large(CudaMemoryBlock* block) const;
+
+  void empty_cache_locked() const;
+
+ private:
+  mutable std::mutex mutex_;
+  mutable std::map<int, CudaMemoryPool> pools_;
+  mutable std::unordered_map<void*, CudaMemoryBlock*> busy_blocks_;
+};
+
+// Page-locked host memory, the copies between it and the device run asynchronously on a
+// stream and overlap with the kernels. The buffers are host buffers for every other purpose.
+class CUDAHostAllocator : public DeviceAllocator {
+ public:
+  explicit CUDAHostAllocator();
+
+  void* allocate(size_t byte_size) const override;
+
+  void release(void* ptr) const override;
+};
+
+// Allocates from the memory pool of the device in stream order, a block released on a stream is
+// reused by the later work of the same stream without synchronizing the device.
+class CUDAAsyncDeviceAllocator : public DeviceAllocator {
+ public:
+  explicit CUDAAsyncDeviceAllocator();
+
+  void* allocate(size_t byte_size) const override;
+
+  void release(void* ptr) const override;
+
+  void* allocate_async(size_t byte_size, void* stream) const override;
+
+  void release_async(void* ptr, void* stream) const override;
+
+  // the pool keeps up to threshold freed bytes of the current device instead of trimming them
+  // at every synchronization
+  void set_release_threshold(uint64_t threshold) const;
+
+  std::map<int, AllocatorStats> stats() const override;
 };
 
 class CPUDeviceAllocatorFactory {
@@ -91,13 +224,43 @@ class CUDADeviceAllocatorFactory {
   static std::shared_ptr<CUDADeviceAllocator> instance;
 };
 
+class CUDAHostAllocatorFactory {
+ public:
+  static std::shared_ptr<CUDAHostAllocator> get_instance() {
+    if (instance == nullptr) {
+      instance = std::make_shared<CUDAHostAllocator>();
+    }
+    return instance;
+  }
+
+ private:
+  static std::shared_ptr<CUDAHostAllocator> instance;
+};
+
+class CUDAAsyncDeviceAllocatorFactory {
+ public:
+  static std::shared_ptr<CUDAAsyncDeviceAllocator> get_instance() {
+    if (instance == nullptr) {
+      instance = std::make_shared<CUDAAsyncDeviceAllocator>();
+    }
+    return instance;
+  }
+
+ private:
+  static std::shared_ptr<CUDAAsyncDeviceAllocator> instance;
+};
+
 class DeviceAlloctorFactory {
  public:
-  static std::shared_ptr<DeviceAllocator> get_instance(base::DeviceType device_type) {
+  static std::shared_ptr<DeviceAllocator> get_instance(base::DeviceType device_type,
+                                                       bool stream_ordered = false) {
     if (device_type == base::DeviceType::kDeviceCPU) {
       return CPUDeviceAllocatorFactory::get_instance();
     } else if (device_type == base::DeviceType::kDeviceCUDA) {
-      return CPUDeviceAllocatorFactory::get_instance();
+      if (stream_ordered) {
+        return CUDAAsyncDeviceAllocatorFactory::get_instance();
+      }
+      return CUDADeviceAllocatorFactory::get_instance();
     } else {
       LOG(FATAL) << "This device type of allocator is not supported!";
       return nullptr;
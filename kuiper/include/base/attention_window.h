@@ -0,0 +1,69 @@
+#ifndef KUIPER_INCLUDE_BASE_ATTENTION_WINDOW_H_
+#define KUIPER_INCLUDE_BASE_ATTENTION_WINDOW_H_
+#include <cstdint>
+#ifdef __CUDACC__
+#define KUIPER_HOST_DEVICE __host__ __device__
+#else
+#define KUIPER_HOST_DEVICE
+#endif
+namespace base {
+// The position r attends the first sink_num positions of its sequence and the window_size
+// positions which end at r. The kv cache keeps the sinks in place and the later positions in a
+// ring of window_size + chunk_size - 1 rows, so the chunk_size rows of one write are stored
+// before the first of them attends without overwriting the window it needs. A sequence runs
+// past the size of the cache, the memory and the decode cost stay at the window.
+//
+// A window_size of 0 turns it off, every position attends all the positions before it.
+struct AttentionWindow {
+  int32_t sink_num = 0;
+  int32_t window_size = 0;
+  // the most rows which are written into the cache before they attend
+  int32_t chunk_size = 1;
+
+  KUIPER_HOST_DEVICE bool is_enabled() const { return window_size > 0; }
+
+  KUIPER_HOST_DEVICE int32_t ring_size() const { return window_size + chunk_size - 1; }
+
+  // the rows of the cache a sequence needs however long it gets
+  KUIPER_HOST_DEVICE int32_t capacity() const { return sink_num + ring_size(); }
+
+  // the row of the cache which holds the position t
+  KUIPER_HOST_DEVICE int32_t cache_pos(int32_t t) const {
+    if (!is_enabled() || t < sink_num) {
+      return t;
+    }
+    return sink_num + (t - sink_num) % ring_size();
+  }
+
+  // the first position of the window of r, the sinks before it are attended as well
+  KUIPER_HOST_DEVICE int32_t window_begin(int32_t r) const {
+    const int32_t begin = r - window_size + 1;
+    return begin > sink_num ? begin : sink_num;
+  }
+
+  // the number of positions r attends
+  KUIPER_HOST_DEVICE int32_t attended_num(int32_t r) const {
+    if (!is_enabled()) {
+      return r + 1;
+    }
+    const int32_t sink_end = r + 1 < sink_num ? r + 1 : sink_num;
+    const int32_t window_num = r - window_begin(r) + 1;
+    return sink_end + (window_num > 0 ? window_num : 0);
+  }
+
+  // the position of the j-th of the attended_num(r) positions of r, in increasing order
+  KUIPER_HOST_DEVICE int32_t attended_pos(int32_t j, int32_t r) const {
+    if (!is_enabled()) {
+      return j;
+    }
+    const int32_t sink_end = r + 1 < sink_num ? r + 1 : sink_num;
+    return j < sink_end ? j : window_begin(r) + j - sink_end;
+  }
+
+  // the row of the cache of the j-th position r attends
+  KUIPER_HOST_DEVICE int32_t cache_index(int32_t j, int32_t r) const {
+    return cache_pos(attended_pos(j, r));
+  }
+};
+}  // namespace base
+#endif  // KUIPER_INCLUDE_BASE_ATTENTION_WINDOW_H_
@@ -29,6 +29,29 @@ enum class ModelBufferType {
 
   kSinCache = 17,
   kCosCache = 18,
+
+  kKeyOutput = 19,
+  kValueOutput = 20,
+  kInputPosCUDA = 21,
+  kOutputIndexCUDA = 22,
+  kQKVOutput = 23,
+  kInputTokensCUDA = 24,
+  kInputEmbeddingCUDA = 25,
+  kOutputTokensCUDA = 26,
+  // the hidden state of the layers which run on the cpu in a split model
+  kHiddenStateCPU = 27,
+  // the host side of kOutputTokensCUDA, the launched decode steps copy their tokens to it
+  kOutputTokensCPU = 28,
+  // the stop sequences and the stop state of the decode on the device, and the host side of the
+  // state which the launched steps copy behind their tokens
+  kStopTableCUDA = 29,
+  kStopStateCUDA = 30,
+  kStopStateCPU = 31,
+  // the candidates of the fused classifier, the largest logits with their log-sum-exp behind
+  // them, their tokens and the lists of the blocks of the kernel
+  kClsCandidatesCUDA = 32,
+  kClsCandidateTokensCUDA = 33,
+  kClsWorkspaceCUDA = 34,
 };
 }
 
@@ -44,6 +67,10 @@ enum class DataType : uint8_t {
   kDataTypeFp32 = 1,
   kDataTypeInt8 = 2,
   kDataTypeInt32 = 3,
+  kDataTypeFp16 = 4,
+  kDataTypeBf16 = 5,
+  // the e4m3 float of the fp8 tensor cores, a quant matmul weight with one fp32 scale per row
+  kDataTypeFp8E4M3 = 6,
 };
 
 enum class ModelType : uint8_t {
@@ -54,10 +81,12 @@ enum class ModelType : uint8_t {
 inline size_t DataTypeSize(DataType data_type) {
   if (data_type == DataType::kDataTypeFp32) {
     return sizeof(float);
-  } else if (data_type == DataType::kDataTypeInt8) {
+  } else if (data_type == DataType::kDataTypeInt8 || data_type == DataType::kDataTypeFp8E4M3) {
     return sizeof(int8_t);
   } else if (data_type == DataType::kDataTypeInt32) {
     return sizeof(int32_t);
+  } else if (data_type == DataType::kDataTypeFp16 || data_type == DataType::kDataTypeBf16) {
+    return sizeof(uint16_t);
   } else {
     return 0;
   }
@@ -10,12 +10,14 @@ class Buffer : public NoCopyable, std::enable_shared_from_this<Buffer> {
   bool use_external_ = false;
   DeviceType device_type_ = DeviceType::kDeviceUnknown;
   std::shared_ptr<DeviceAllocator> allocator_;
+  // the memory is allocated and released in the order of this stream
+  void* stream_ = nullptr;
 
  public:
   explicit Buffer() = default;
 
   explicit Buffer(size_t byte_size, std::shared_ptr<DeviceAllocator> allocator = nullptr,
-                  void* ptr = nullptr, bool use_external = false);
+                  void* ptr = nullptr, bool use_external = false, void* stream = nullptr);
 
   virtual ~Buffer();
 
@@ -40,6 +42,16 @@ class Buffer : public NoCopyable, std::enable_shared_from_this<Buffer> {
   std::shared_ptr<Buffer> get_shared_from_this();
 
   bool is_external() const;
+
+  // points an external buffer at other memory, it keeps no ownership of either
+  void rebind(void* ptr, size_t byte_size);
+
+  void* stream() const;
+
+  void set_stream(void* stream);
+
+  // counts the memory in the category of tag in the stats of the allocator
+  void set_tag(MemoryTag tag) const;
 };
 }  // namespace base
 
@@ -1,15 +1,193 @@
 #ifndef BLAS_HELPER_H
 #define BLAS_HELPER_H
+#include <cublasLt.h>
 #include <cublas_v2.h>
 #include <cuda_runtime_api.h>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <tuple>
 namespace kernel {
+// the workspace size suggested for the cublaslt gemm on hopper, older gpus need less
+constexpr static size_t kBlasWorkspaceSize = 32 * 1024 * 1024;
+
+// a launch of the gemv kernel, the matmul tuner picks one for every weight shape
+struct GemvLaunch {
+  int32_t thread_num = 128;
+  int32_t row_per_block = 1;
+};
+
+// the rows, the columns and the data type of a weight
+using GemvShape = std::tuple<int32_t, int32_t, int32_t>;
+
+// What the cublaslt algorithm of a gemm depends on: the rows of the input, its columns, the
+// outputs, the data types, the epilogue, a scaled input and the alignments of the pointers
+struct BlasGemmKey {
+  int32_t N = 0;
+  int32_t M = 0;
+  int32_t K = 0;
+  cudaDataType_t data_type = CUDA_R_32F;
+  cublasComputeType_t compute_type = CUBLAS_COMPUTE_32F;
+  cublasLtEpilogue_t epilogue = CUBLASLT_EPILOGUE_DEFAULT;
+  bool has_input_scale = false;
+  uint32_t weight_alignment = 0;
+  uint32_t input_alignment = 0;
+  uint32_t output_alignment = 0;
+
+  bool operator<(const BlasGemmKey& other) const {
+    return std::tie(N, M, K, data_type, compute_type, epilogue, has_input_scale,
+                    weight_alignment, input_alignment, output_alignment) <
+           std::tie(other.N, other.M, other.K, other.data_type, other.compute_type,
+                    other.epilogue, other.has_input_scale, other.weight_alignment,
+                    other.input_alignment, other.output_alignment);
+  }
+};
+
+// the descriptor, the layouts and the algorithm of the gemms of a key, the pointers of the
+// scale and of the bias are set on the descriptor for every call. A key without an algorithm
+// is kept too, its gemms fall back at once
+struct BlasGemmPlan {
+  cublasLtMatmulDesc_t desc = nullptr;
+  cublasLtMatrixLayout_t weight_layout = nullptr;
+  cublasLtMatrixLayout_t input_layout = nullptr;
+  cublasLtMatrixLayout_t output_layout = nullptr;
+  cublasLtMatmulAlgo_t algo;
+  bool has_algo = false;
+
+  ~BlasGemmPlan() {
+    if (output_layout) {
+      cublasLtMatrixLayoutDestroy(output_layout);
+    }
+    if (input_layout) {
+      cublasLtMatrixLayoutDestroy(input_layout);
+    }
+    if (weight_layout) {
+      cublasLtMatrixLayoutDestroy(weight_layout);
+    }
+    if (desc) {
+      cublasLtMatmulDescDestroy(desc);
+    }
+  }
+};
+
 struct CudaConfig {
   cudaStream_t stream = nullptr;
+  // the matmuls of inputs with more than one row run as a cublaslt gemm once the handle is
+  // created, the fp32 weights use the tf32 tensor cores unless use_tf32 is cleared
+  cublasLtHandle_t blas_handle = nullptr;
+  void* blas_workspace = nullptr;
+  size_t blas_workspace_size = 0;
+  bool use_tf32 = true;
+  // filled by the gemms of the stream, a shape asks cublaslt for its algorithm only once
+  mutable std::map<BlasGemmKey, std::unique_ptr<BlasGemmPlan>> blas_gemm_plans;
+  // the compute capability of the device as major * 10 + minor, read by the first gemm which
+  // needs it
+  mutable int32_t compute_capability = -1;
+  // the single row matmuls of a weight shape which is missing here use the default launch
+  std::map<GemvShape, GemvLaunch> gemv_launches;
+  // the copies of the kv of the preempted sequences to the host, on the lowest priority so they
+  // only take the copy engine when the kernels of the steps leave it free. The event orders them
+  // after the step which wrote the kv
+  cudaStream_t swap_stream = nullptr;
+  cudaEvent_t swap_event = nullptr;
+
+  bool create_swap_stream() {
+    if (swap_stream) {
+      return true;
+    }
+    int least_priority = 0;
+    int greatest_priority = 0;
+    if (cudaDeviceGetStreamPriorityRange(&least_priority, &greatest_priority) != cudaSuccess ||
+        cudaStreamCreateWithPriority(&swap_stream, cudaStreamNonBlocking, least_priority) !=
+            cudaSuccess) {
+      cudaGetLastError();
+      swap_stream = nullptr;
+      return false;
+    }
+    if (cudaEventCreateWithFlags(&swap_event, cudaEventDisableTiming) != cudaSuccess) {
+      cudaGetLastError();
+      cudaStreamDestroy(swap_stream);
+      swap_stream = nullptr;
+      swap_event = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  bool create_blas(size_t workspace_size = kBlasWorkspaceSize) {
+    if (blas_handle) {
+      return true;
+    }
+    if (cublasLtCreate(&blas_handle) != CUBLAS_STATUS_SUCCESS) {
+      blas_handle = nullptr;
+      return false;
+    }
+    if (workspace_size > 0 && cudaMalloc(&blas_workspace, workspace_size) != cudaSuccess) {
+      cudaGetLastError();
+      blas_workspace = nullptr;
+      workspace_size = 0;
+    }
+    blas_workspace_size = workspace_size;
+    return true;
+  }
+
   ~CudaConfig() {
+    if (blas_workspace) {
+      cudaFree(blas_workspace);
+    }
+    if (blas_handle) {
+      cublasLtDestroy(blas_handle);
+    }
+    if (swap_event) {
+      cudaEventDestroy(swap_event);
+    }
+    if (swap_stream) {
+      cudaStreamDestroy(swap_stream);
+    }
     if (stream) {
       cudaStreamDestroy(stream);
     }
   }
 };
+
+// An instantiated graph of one decode step. The kernels keep the addresses they were captured
+// with, so the graph is captured again when the input buffer moves.
+struct CudaGraph {
+  cudaGraph_t graph = nullptr;
+  cudaGraphExec_t graph_exec = nullptr;
+  const void* input_ptr = nullptr;
+
+  void reset() {
+    if (graph_exec) {
+      cudaGraphExecDestroy(graph_exec);
+      graph_exec = nullptr;
+    }
+    if (graph) {
+      cudaGraphDestroy(graph);
+      graph = nullptr;
+    }
+    input_ptr = nullptr;
+  }
+
+  ~CudaGraph() { reset(); }
+};
+// The decode steps launched on the stream whose tokens the host has not taken yet. Every launch
+// records an event behind the copy of its tokens, the host waits for the oldest one while the
+// stream runs the later ones.
+struct CudaDecodeQueue {
+  struct Launch {
+    int32_t begin_pos = 0;
+    int32_t step_num = 0;
+    cudaEvent_t done = nullptr;
+  };
+  std::deque<Launch> launches;
+
+  ~CudaDecodeQueue() {
+    for (const Launch& launch : launches) {
+      cudaEventDestroy(launch.done);
+    }
+  }
+};
 }  // namespace kernel
 #endif  // BLAS_HELPER_H
@@ -0,0 +1,144 @@
+#ifndef KUIPER_INCLUDE_BASE_HALF_H_
+#define KUIPER_INCLUDE_BASE_HALF_H_
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+namespace base {
+// the host conversions of the 16 bit floats of the weight files, the float to half and the
+// float to bf16 ones round to the nearest even
+inline float half_to_float(uint16_t half) {
+  const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+  uint32_t exponent = (half >> 10) & 0x1f;
+  uint32_t mantissa = half & 0x3ff;
+  uint32_t bits = 0;
+  if (exponent == 0x1f) {
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa != 0) {
+    // a subnormal half is a normal float
+    exponent = 113;
+    while ((mantissa & 0x400) == 0) {
+      mantissa <<= 1;
+      exponent -= 1;
+    }
+    bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+  } else {
+    bits = sign;
+  }
+  float value = 0.f;
+  memcpy(&value, &bits, sizeof(float));
+  return value;
+}
+
+inline uint16_t float_to_half(float value) {
+  uint32_t bits = 0;
+  memcpy(&bits, &value, sizeof(float));
+  const uint16_t sign = (bits >> 16) & 0x8000;
+  const int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xff) - 112;
+  uint32_t mantissa = bits & 0x7fffff;
+  if (((bits >> 23) & 0xff) == 0xff) {
+    return sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0);
+  }
+  if (exponent >= 0x1f) {
+    return sign | 0x7c00;
+  }
+  if (exponent <= 0) {
+    if (exponent < -10) {
+      return sign;
+    }
+    // the half is subnormal, the implicit bit joins the mantissa before the shift
+    mantissa |= 0x800000;
+    const uint32_t shift = static_cast<uint32_t>(14 - exponent);
+    uint32_t half = mantissa >> shift;
+    const uint32_t rest = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1))) {
+      half += 1;
+    }
+    return sign | half;
+  }
+  uint32_t half = (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+  const uint32_t rest = mantissa & 0x1fff;
+  // round to the nearest even, a carry moves into the exponent
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+    half += 1;
+  }
+  return sign | static_cast<uint16_t>(half);
+}
+
+inline float bf16_to_float(uint16_t bf16) {
+  const uint32_t bits = static_cast<uint32_t>(bf16) << 16;
+  float value = 0.f;
+  memcpy(&value, &bits, sizeof(float));
+  return value;
+}
+
+inline uint16_t float_to_bf16(float value) {
+  uint32_t bits = 0;
+  memcpy(&bits, &value, sizeof(float));
+  if ((bits & 0x7fffffff) > 0x7f800000) {
+    return static_cast<uint16_t>((bits >> 16) | 0x40);
+  }
+  bits += 0x7fff + ((bits >> 16) & 1);
+  return static_cast<uint16_t>(bits >> 16);
+}
+
+// the e4m3 fp8 of the nvidia tensor cores has no infinity, 0x7f is its nan and 448 its largest
+// value
+constexpr float kFp8E4M3Max = 448.f;
+
+inline float fp8_e4m3_to_float(uint8_t fp8) {
+  const float sign = (fp8 & 0x80) ? -1.f : 1.f;
+  const int32_t exponent = (fp8 >> 3) & 0xf;
+  const int32_t mantissa = fp8 & 0x7;
+  if (exponent == 0xf && mantissa == 0x7) {
+    return sign * __builtin_nanf("");
+  }
+  if (exponent == 0) {
+    return sign * static_cast<float>(mantissa) * (1.f / 512.f);
+  }
+  return sign * (1.f + static_cast<float>(mantissa) / 8.f) *
+         static_cast<float>(1 << exponent) / 128.f;
+}
+
+// rounds to the nearest even and saturates at the largest value, as the cuda conversion with
+// __NV_SATFINITE does
+inline uint8_t float_to_fp8_e4m3(float value) {
+  uint32_t bits = 0;
+  memcpy(&bits, &value, sizeof(float));
+  const auto sign = static_cast<uint8_t>((bits >> 24) & 0x80);
+  if ((bits & 0x7fffffff) > 0x7f800000) {
+    return sign | 0x7f;
+  }
+  const int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xff) - 120;
+  uint32_t mantissa = bits & 0x7fffff;
+  uint32_t fp8 = 0;
+  if (exponent <= 0) {
+    if (exponent < -3) {
+      return sign;
+    }
+    // the fp8 is subnormal, the implicit bit joins the mantissa before the shift
+    mantissa |= 0x800000;
+    const uint32_t shift = static_cast<uint32_t>(21 - exponent);
+    fp8 = mantissa >> shift;
+    const uint32_t rest = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (fp8 & 1))) {
+      fp8 += 1;
+    }
+  } else {
+    if (exponent > 0xf) {
+      return sign | 0x7e;
+    }
+    fp8 = (static_cast<uint32_t>(exponent) << 3) | (mantissa >> 20);
+    const uint32_t rest = mantissa & 0xfffff;
+    // a carry moves into the exponent
+    if (rest > 0x80000 || (rest == 0x80000 && (fp8 & 1))) {
+      fp8 += 1;
+    }
+  }
+  return sign | static_cast<uint8_t>(std::min<uint32_t>(fp8, 0x7e));
+}
+}  // namespace base
+#endif  // KUIPER_INCLUDE_BASE_HALF_H_
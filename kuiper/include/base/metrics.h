@@ -0,0 +1,120 @@
+#ifndef KUIPER_INCLUDE_BASE_METRICS_H_
+#define KUIPER_INCLUDE_BASE_METRICS_H_
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "base/base.h"
+namespace base {
+class Counter : public NoCopyable {
+ public:
+  void add(int64_t value = 1) { value_.fetch_add(value, std::memory_order_relaxed); }
+
+  int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> value_{0};
+};
+
+class Gauge : public NoCopyable {
+ public:
+  void set(double value) { value_.store(value, std::memory_order_relaxed); }
+
+  void add(double value);
+
+  double value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<double> value_{0.};
+};
+
+// counts the observations into buckets of fixed upper bounds, the last bucket is +Inf
+class Histogram : public NoCopyable {
+ public:
+  explicit Histogram(std::vector<double> bounds);
+
+  void observe(double value);
+
+  const std::vector<double>& bounds() const { return bounds_; }
+
+  // the observations up to every bound and the total one, cumulative like prometheus reads them
+  std::vector<uint64_t> cumulative_counts() const;
+
+  uint64_t count() const;
+
+  double sum() const { return sum_.load(std::memory_order_relaxed); }
+
+ private:
+  std::vector<double> bounds_;
+  std::unique_ptr<std::atomic<uint64_t>[]> bucket_counts_;
+  std::atomic<double> sum_{0.};
+};
+
+enum class MetricType : uint8_t {
+  kMetricCounter = 0,
+  kMetricGauge = 1,
+  kMetricHistogram = 2,
+};
+
+// one value of the pull api, a histogram gives its _bucket, _sum and _count samples
+struct MetricSample {
+  std::string name;
+  // the prometheus labels without the braces, like device="cuda"
+  std::string labels;
+  double value = 0.;
+};
+
+// The process wide metrics. A metric is registered once by its name and labels and the pointer
+// stays valid for the life of the process, so the hot paths keep it and update it with relaxed
+// atomics only, the mutex is taken by the registration and by the readers.
+class MetricsRegistry : public NoCopyable {
+ public:
+  static MetricsRegistry& global();
+
+  // returns the registered metric when the name and the labels are taken already
+  Counter* counter(const std::string& name, const std::string& help,
+                   const std::string& labels = "");
+
+  Gauge* gauge(const std::string& name, const std::string& help, const std::string& labels = "");
+
+  Histogram* histogram(const std::string& name, const std::string& help,
+                       const std::vector<double>& bounds, const std::string& labels = "");
+
+  // the text exposition format of prometheus, version 0.0.4
+  std::string prometheus_text() const;
+
+  std::vector<MetricSample> snapshot() const;
+
+  // the bounds in seconds of the step latencies
+  static std::vector<double> latency_bounds();
+
+ private:
+  MetricsRegistry() = default;
+
+  struct Metric {
+    std::string labels;
+    std::unique_ptr<Counter> counter;
+    std::unique_ptr<Gauge> gauge;
+    std::unique_ptr<Histogram> histogram;
+  };
+
+  struct Family {
+    std::string name;
+    std::string help;
+    MetricType type = MetricType::kMetricCounter;
+    std::vector<Metric> metrics;
+  };
+
+  Metric& find_or_add(const std::string& name, const std::string& help, MetricType type,
+                      const std::string& labels);
+
+  void append_samples(const Family& family, std::vector<MetricSample>& samples) const;
+
+ private:
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<Family>> families_;
+};
+}  // namespace base
+#endif  // KUIPER_INCLUDE_BASE_METRICS_H_
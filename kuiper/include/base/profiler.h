@@ -0,0 +1,119 @@
+#ifndef KUIPER_INCLUDE_BASE_PROFILER_H_
+#define KUIPER_INCLUDE_BASE_PROFILER_H_
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "base/base.h"
+namespace base {
+// one timed range, the times are in microseconds since the profiler started
+struct ProfileRecord {
+  std::string name;
+  // the op type the totals are summed by
+  const char* category = "";
+  int32_t layer_idx = -1;
+  bool is_cuda = false;
+  double begin_us = 0.;
+  double duration_us = 0.;
+};
+
+struct ProfileSummary {
+  std::string key;
+  int32_t count = 0;
+  double total_us = 0.;
+};
+
+// An opt-in profiler of the layers. While it runs every range on the cuda device is timed with
+// a pair of events on its stream and every range on the cpu with the host clock, so the time
+// of the asynchronous kernels is the time they take on the device. The events are read at
+// stop, the records then give the totals per op type and per transformer layer and a trace in
+// the chrome trace event format, which chrome://tracing and perfetto open.
+//
+// The ranges are skipped while their stream is captured into a cuda graph, the profiled steps
+// have to run without the graphs.
+class Profiler : public NoCopyable {
+ public:
+  static Profiler& global();
+
+  ~Profiler();
+
+  // drops the records of the last run and starts timing the ranges
+  void start();
+
+  // stops timing and waits for the events of the recorded ranges
+  void stop();
+
+  bool is_enabled() const { return is_enabled_.load(std::memory_order_relaxed); }
+
+  // a range on the stream of the cuda device or on the cpu, returns its index or -1 when it is
+  // not recorded
+  int32_t begin(const char* category, const std::string& name, int32_t layer_idx, bool is_cuda,
+                void* stream);
+
+  void end(int32_t record_idx, void* stream);
+
+  // the records of the last run, after stop
+  const std::vector<ProfileRecord>& records() const;
+
+  // the totals of every op type, the largest first
+  std::vector<ProfileSummary> op_summary() const;
+
+  // the totals of every transformer layer in the layer order, the ranges out of the layers are
+  // left out
+  std::vector<ProfileSummary> layer_summary() const;
+
+  // the records as complete events, the cuda ranges on one track and the cpu ones on another
+  base::Status write_chrome_trace(const std::string& path) const;
+
+  // the transformer layer of the ranges which begin on this thread, -1 out of the layers
+  static int32_t current_layer_idx();
+
+  static void set_current_layer_idx(int32_t layer_idx);
+
+ private:
+  Profiler() = default;
+
+  struct PendingEvents {
+    void* begin_event = nullptr;
+    void* end_event = nullptr;
+  };
+
+  double host_now_us() const;
+
+ private:
+  std::atomic<bool> is_enabled_{false};
+  mutable std::mutex mutex_;
+  std::vector<ProfileRecord> records_;
+  std::vector<PendingEvents> events_;
+  // the event recorded at start, the cuda ranges are measured from it
+  void* base_event_ = nullptr;
+  int64_t base_host_ns_ = 0;
+};
+
+// times the scope when the profiler runs and no range of this thread is open already, so a
+// step of the execution plan which calls a layer is recorded once
+class ProfileRange {
+ public:
+  ProfileRange(const char* category, const char* name, bool is_cuda, void* stream);
+
+  ~ProfileRange();
+
+ private:
+  int32_t record_idx_ = -1;
+  bool is_open_ = false;
+  void* stream_ = nullptr;
+};
+
+// the ranges which begin in the scope belong to the transformer layer layer_idx
+class ProfileLayerScope {
+ public:
+  explicit ProfileLayerScope(int32_t layer_idx);
+
+  ~ProfileLayerScope();
+
+ private:
+  int32_t last_layer_idx_ = -1;
+};
+}  // namespace base
+#endif  // KUIPER_INCLUDE_BASE_PROFILER_H_
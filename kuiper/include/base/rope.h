@@ -0,0 +1,57 @@
+#ifndef KUIPER_INCLUDE_BASE_ROPE_H_
+#define KUIPER_INCLUDE_BASE_ROPE_H_
+#include <cstdint>
+#include <string>
+#include <vector>
+namespace base {
+// how the rope frequencies of a model are stretched past the context it was trained on
+enum class RoPEScalingType : uint8_t {
+  kRoPEScalingNone = 0,
+  // the positions are divided by the factor
+  kRoPEScalingLinear = 1,
+  // ntk aware, the base is raised so the low frequencies are interpolated and the high ones kept
+  kRoPEScalingNTK = 2,
+  // yarn, a ramp between the kept and the interpolated frequencies plus an attention factor
+  kRoPEScalingYaRN = 3,
+  // llama 3.1, the frequencies are interpolated by their wavelength against the old context
+  kRoPEScalingLlama3 = 4,
+};
+
+struct RoPEScaling {
+  RoPEScalingType type = RoPEScalingType::kRoPEScalingNone;
+  float factor = 1.f;
+  // the context the model was trained on, the yarn and the llama3 ramps are measured on it
+  int32_t original_max_pos = 0;
+  float low_freq_factor = 1.f;
+  float high_freq_factor = 4.f;
+  float beta_fast = 32.f;
+  float beta_slow = 1.f;
+  // scales the sin and the cos of the yarn scaling, 0 takes 0.1 * ln(factor) + 1
+  float attention_factor = 0.f;
+};
+
+// the scaling type of its huggingface name: linear, dynamic, yarn or llama3. The dynamic ntk
+// of huggingface grows the base with the current length, here it is fixed at the factor
+bool parse_rope_scaling_type(const std::string& name, RoPEScalingType& type);
+
+const char* rope_scaling_name(RoPEScalingType type);
+
+// the angle per position of the element pairs [0, head_size / 2) of a head
+std::vector<float> rope_inv_freq(int32_t head_size, float theta, const RoPEScaling& scaling);
+
+// the factor of the sin and the cos, 1 unless the scaling is yarn
+float rope_attention_factor(const RoPEScaling& scaling);
+
+// The sin and the cos tables of the rope do not grow with the whole context. Every row has
+// head_size / 2 columns, one per element pair:
+//   row 0 of the sin table holds the inverse frequencies and row 0 of the cos table the
+//   attention factor, the cuda kernels compute the angles from them in place
+//   rows [1, 1 + kRoPETileSize) hold the angles of the offsets in a tile of positions, scaled
+//   by the attention factor
+//   the rows after them hold the angles of the first position of every tile
+// the cpu kernel turns the angle of the tile by the angle of the offset
+constexpr int32_t kRoPETileSize = 256;
+
+int32_t rope_table_rows(int32_t max_seq_len);
+}  // namespace base
+#endif  // KUIPER_INCLUDE_BASE_ROPE_H_
@@ -0,0 +1,68 @@
+#ifndef KUIPER_INCLUDE_BASE_THREAD_POOL_H_
+#define KUIPER_INCLUDE_BASE_THREAD_POOL_H_
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+namespace base {
+// The worker threads of the cpu kernels, they are started once and sleep between the jobs. A
+// job splits a range of tasks into one contiguous part per thread, the calling thread runs the
+// first part itself.
+class ThreadPool {
+ public:
+  explicit ThreadPool(int32_t thread_num);
+
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // the threads including the calling one
+  int32_t thread_num() const;
+
+  // calls func(begin, end) on the parts of [0, task_num) and returns when all of them are done,
+  // a part has at least min_task_num tasks. A job started from inside a job runs serially
+  void parallel_for(int32_t task_num, int32_t min_task_num,
+                    const std::function<void(int32_t, int32_t)>& func);
+
+  // pins the threads, the calling one as thread 0, to the cpus of the numa nodes in contiguous
+  // groups, so a job part runs on the node of its thread. Returns the number of nodes, nothing
+  // is pinned on a machine with one node
+  int32_t pin_to_numa_nodes();
+
+  int32_t numa_node_num() const;
+
+ private:
+  void work(int32_t worker_idx);
+
+ private:
+  int32_t thread_num_ = 1;
+  int32_t numa_node_num_ = 1;
+  std::vector<std::thread> workers_;
+  // one job at a time, the callers from other threads wait for it
+  std::mutex job_mutex_;
+  std::mutex mutex_;
+  std::condition_variable job_ready_;
+  std::condition_variable job_done_;
+  const std::function<void(int32_t, int32_t)>* func_ = nullptr;
+  int32_t task_num_ = 0;
+  int32_t part_num_ = 0;
+  int32_t pending_num_ = 0;
+  uint64_t generation_ = 0;
+  bool stop_ = false;
+};
+
+// the cpus of every online numa node, read from the sysfs, empty when the kernel has no numa
+std::vector<std::vector<int32_t>> numa_node_cpus();
+
+// the pool shared by the cpu kernels, the thread number is taken from KUIPER_NUM_THREADS or the
+// number of the hardware threads
+class ThreadPoolFactory {
+ public:
+  static ThreadPool* get_instance();
+};
+}  // namespace base
+#endif  // KUIPER_INCLUDE_BASE_THREAD_POOL_H_
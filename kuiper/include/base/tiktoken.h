@@ -1,110 +1,126 @@
 #pragma once
 
 #include <re2/re2.h>
+#include "thread_pool.h"
+#include "token_cache.h"
 #include "unordered_dense.h"
 
 #include <cassert>
+#include <cctype>
+#include <functional>
 #include <limits>
+#include <list>
+#include <mutex>
 #include <optional>
+#include <queue>
 #include <regex>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
 namespace tiktoken {
 
+// merges the lowest ranked pair of adjacent parts until no pair is in the ranks, the parts
+// are a linked list over the byte offsets of the piece and a heap keeps the ranks of the pairs,
+// so a merge costs a log instead of a scan of all the parts. rank_of gives the rank of some
+// bytes, -1 when they are not in the ranks
+template <typename RankOf>
 static auto _byte_pair_merge(
 	const std::string &piece,
-	const ankerl::unordered_dense::map<std::string, int> &ranks,
+	const RankOf &rank_of,
 	std::function<int (int, int)> func
 ) -> std::vector<int> {
-	std::vector<std::pair<int, int>> parts;
-	parts.reserve(piece.size() + 1);
-	for (auto idx = 0U; idx < piece.size() + 1; ++idx) {
-		parts.emplace_back(idx, std::numeric_limits<int>::max());
+	const int max_rank = std::numeric_limits<int>::max();
+	const int part_num = static_cast<int>(piece.size()) + 1;
+	std::vector<int> next(part_num);
+	std::vector<int> prev(part_num);
+	std::vector<int> part_ranks(part_num, max_rank);
+	std::vector<bool> is_alive(part_num, true);
+	for (int i = 0; i < part_num; ++i) {
+		next[i] = i + 1 < part_num ? i + 1 : -1;
+		prev[i] = i - 1;
 	}
 
-	auto get_rank = [&piece, &ranks](
-		const std::vector<std::pair<int, int>> &parts,
-		int start_idx,
-		int skip
-	) -> std::optional<int> {
-		if (start_idx + skip + 2 < parts.size()) {
-			auto s = parts[start_idx].first;
-			auto e = parts[start_idx + skip + 2].first;
-			auto key = piece.substr(s, e - s);
-			auto iter = ranks.find(key);
-			if (iter != ranks.end()) {
-				return iter->second;
-			}
+	// the rank of the pair which starts at the part i
+	auto get_rank = [&piece, &rank_of, &next](int i) -> int {
+		if (next[i] == -1 || next[next[i]] == -1) {
+			return std::numeric_limits<int>::max();
 		}
-		return std::nullopt;
+		const int rank = rank_of(std::string_view(piece).substr(i, next[next[i]] - i));
+		return rank >= 0 ? rank : std::numeric_limits<int>::max();
 	};
 
-	for (auto i = 0U; i < parts.size() - 2; ++i) {
-		auto rank = get_rank(parts, i, 0);
-		if (rank) {
-			assert(*rank != std::numeric_limits<int>::max());
-			parts[i].second = *rank;
+	// the ties go to the leftmost pair, the same order as a scan of the parts
+	std::priority_queue<std::pair<int, int>, std::vector<std::pair<int, int>>,
+		std::greater<std::pair<int, int>>> heap;
+	for (int i = 0; i < part_num; ++i) {
+		part_ranks[i] = get_rank(i);
+		if (part_ranks[i] != max_rank) {
+			heap.emplace(part_ranks[i], i);
 		}
 	}
 
-	while (true) {
-		if (parts.size() == 1) break;
-
-		auto min_rank = std::make_pair<int, int>(std::numeric_limits<int>::max(), 0);
-		for (auto i = 0U; i < parts.size() - 1; ++i) {
-			auto rank = parts[i].second;
-			if (rank < min_rank.first) {
-				min_rank = { rank, i };
-			}
+	while (!heap.empty()) {
+		auto [rank, i] = heap.top();
+		heap.pop();
+		// a pair which changed after it was pushed
+		if (!is_alive[i] || part_ranks[i] != rank) {
+			continue;
+		}
+		const int merged = next[i];
+		is_alive[merged] = false;
+		next[i] = next[merged];
+		if (next[merged] != -1) {
+			prev[next[merged]] = i;
 		}
 
-		if (min_rank.first != std::numeric_limits<int>::max()) {
-			auto i = min_rank.second;
-			auto rank = get_rank(parts, i, 1);
-			if (rank) {
-				parts[i].second = *rank;
-			} else {
-				parts[i].second = std::numeric_limits<int>::max();
-			}
-			if (i > 0) {
-				auto rank = get_rank(parts, i - 1, 1);
-				if (rank) {
-					parts[i - 1].second = *rank;
-				} else {
-					parts[i - 1].second = std::numeric_limits<int>::max();
-				}
+		part_ranks[i] = get_rank(i);
+		if (part_ranks[i] != max_rank) {
+			heap.emplace(part_ranks[i], i);
+		}
+		if (prev[i] != -1) {
+			part_ranks[prev[i]] = get_rank(prev[i]);
+			if (part_ranks[prev[i]] != max_rank) {
+				heap.emplace(part_ranks[prev[i]], prev[i]);
 			}
-
-			parts.erase(parts.begin() + (i + 1));
-		} else {
-			break;
 		}
 	}
 	std::vector<int> out;
-	out.reserve(parts.size() - 1);
-	for (auto i = 0U; i < parts.size() - 1; ++i) {
-		out.push_back(func(parts[i].first, parts[i + 1].first));
+	for (int i = 0; next[i] != -1; i = next[i]) {
+		out.push_back(func(i, next[i]));
 	}
 	return out;
 }
 
-static auto byte_pair_encode(
+template <typename RankOf>
+static auto byte_pair_encode_with(
 	const std::string &piece,
-	const ankerl::unordered_dense::map<std::string, int> &ranks
+	const RankOf &rank_of
 ) -> std::vector<int> {
+	auto func = [&piece, &rank_of](int start, int stop) -> int {
+		const int rank = rank_of(std::string_view(piece).substr(start, stop - start));
+		if (rank < 0) {
+			throw std::out_of_range("the bytes of a piece are not in the ranks");
+		}
+		return rank;
+	};
 	if (piece.size() == 1) {
-		return {ranks.at(piece)};
+		return {func(0, 1)};
 	}
 
-	auto func = [&piece, &ranks](int start, int stop) -> int {
-		std::string key = piece.substr(start, stop - start);
-		return ranks.at(key);
-	};
+	return _byte_pair_merge(piece, rank_of, func);
+}
 
-	return _byte_pair_merge(piece, ranks, func);
+static auto byte_pair_encode(
+	const std::string &piece,
+	const ankerl::unordered_dense::map<std::string, int> &ranks
+) -> std::vector<int> {
+	return byte_pair_encode_with(piece, [&ranks](std::string_view bytes) -> int {
+		auto iter = ranks.find(std::string(bytes));
+		return iter != ranks.end() ? iter->second : -1;
+	});
 }
 
 class tiktoken {
@@ -113,34 +129,24 @@ class tiktoken {
 		tiktoken(
 			ankerl::unordered_dense::map<std::string, int> encoder,
 			ankerl::unordered_dense::map<std::string, int> special_encoder,
-			const std::string &pattern
-		) {
-			regex_ = std::make_unique<re2::RE2>("(" + pattern + ")");
-
-			std::string special_pattern;
-			for (const auto &item : special_encoder) {
-				if (!special_pattern.empty()) {
-					special_pattern += "|";
-				}
-				special_pattern += re2::RE2::QuoteMeta(item.first);
-			}
-			if (special_pattern.empty()) {
-				special_regex_ = nullptr;
-			} else {
-				special_regex_ = std::make_unique<re2::RE2>("(" + special_pattern + ")");
-			}
-
+			const std::string &pattern,
+			size_t piece_cache_capacity = 16384
+		) : piece_cache_capacity_(piece_cache_capacity) {
 			encoder_ = std::move(encoder);
-			special_tokens_encoder = std::move(special_encoder);
-
 			for (const auto &[k, v] : encoder_) {
 				decoder_.emplace(v, k);
 			}
 			// assert(encoder_.size() != decoder_.size() && "Encoder and decoder must be of equal length; maybe you had duplicate token indices in your encoder?");
+			init_special_tokens(std::move(special_encoder), pattern);
+		}
 
-			for (const auto &[k, v] : special_tokens_encoder) {
-				special_tokens_decoder.emplace(v, k);
-			}
+		// the ordinary tokens are looked up in the mapped cache, no table of them is built
+		tiktoken(
+			std::shared_ptr<const base::TokenCache> cache,
+			const std::string &pattern,
+			size_t piece_cache_capacity = 16384
+		) : cache_(std::move(cache)), piece_cache_capacity_(piece_cache_capacity) {
+			init_special_tokens(cache_->special_encoder(), pattern);
 		}
 
     auto encode_ordinary(const std::string &text) const -> std::vector<int> {
@@ -152,18 +158,60 @@ class tiktoken {
     }
 
     auto encode_single_piece(const std::string &text) const -> std::vector<int> {
-      auto iter = encoder_.find(text);
-      if (iter != encoder_.end()) {
-        return {iter->second};
+      const int rank = rank_of(text);
+      if (rank >= 0) {
+        return {rank};
       }
-      return byte_pair_encode(text, encoder_);
+      std::vector<int> ret;
+      encode_piece(text, ret);
+      return ret;
     }
 
 		auto decode(const std::vector<int> &tokens) const -> std::string {
 			return _decode_native(tokens);
 		}
 
+		// the texts longer than two segments are pre-tokenized in parallel, it is only valid for a
+		// pattern with no match across a newline followed by an ascii letter, 0 turns it off
+		void set_parallel_segment_size(size_t min_segment_size) {
+			min_segment_size_ = min_segment_size;
+		}
+
 	private:
+		void init_special_tokens(
+			ankerl::unordered_dense::map<std::string, int> special_encoder,
+			const std::string &pattern
+		) {
+			regex_ = std::make_unique<re2::RE2>("(" + pattern + ")");
+
+			std::string special_pattern;
+			for (const auto &item : special_encoder) {
+				if (!special_pattern.empty()) {
+					special_pattern += "|";
+				}
+				special_pattern += re2::RE2::QuoteMeta(item.first);
+			}
+			if (special_pattern.empty()) {
+				special_regex_ = nullptr;
+			} else {
+				special_regex_ = std::make_unique<re2::RE2>("(" + special_pattern + ")");
+			}
+
+			special_tokens_encoder = std::move(special_encoder);
+			for (const auto &[k, v] : special_tokens_encoder) {
+				special_tokens_decoder.emplace(v, k);
+			}
+		}
+
+		// the rank of an ordinary token, -1 when the bytes are not one
+		int rank_of(std::string_view bytes) const {
+			if (cache_) {
+				return cache_->find(bytes);
+			}
+			auto iter = encoder_.find(std::string(bytes));
+			return iter != encoder_.end() ? iter->second : -1;
+		}
+
 		auto split_with_allowed_special_token(
 			re2::StringPiece &input,
 			const ankerl::unordered_dense::map<std::string, int> &allowed_special
@@ -187,18 +235,7 @@ class tiktoken {
 
     auto _encode_ordinary_native(const std::string &text) const -> std::vector<int> {
       std::vector<int> ret;
-      re2::StringPiece input(text);
-
-      std::string piece;
-      while (re2::RE2::FindAndConsume(&input, *regex_, &piece)) {
-        auto iter = encoder_.find(piece);
-        if (iter != encoder_.end()) {
-          ret.push_back(iter->second);
-          continue;
-        }
-        auto tokens = byte_pair_encode(piece, encoder_);
-        ret.insert(ret.end(), tokens.begin(), tokens.end());
-      }
+      encode_pieces(re2::StringPiece(text), ret);
       return ret;
     }
 
@@ -212,17 +249,9 @@ class tiktoken {
 
 			while (true) {
 				auto [special, sub_input] = split_with_allowed_special_token(input, allowed_special);
-				std::string piece;
-				while (re2::RE2::FindAndConsume(&sub_input, *regex_, &piece)) {
-					auto iter = encoder_.find(piece);
-					if (iter != encoder_.end()) {
-						last_piece_token_len = 1;
-						ret.push_back(iter->second);
-						continue;
-					}
-					auto tokens = byte_pair_encode(piece, encoder_);
-					last_piece_token_len = tokens.size();
-					ret.insert(ret.end(), tokens.begin(), tokens.end());
+				const int segment_token_len = encode_pieces(sub_input, ret);
+				if (!sub_input.empty()) {
+					last_piece_token_len = segment_token_len;
 				}
 
 				if (special) {
@@ -237,11 +266,103 @@ class tiktoken {
 			return { ret, last_piece_token_len };
 		}
 
+		// the pieces of a pre-token which is not in the vocab, the merges of the recent ones are
+		// kept in a lru cache
+		void encode_piece(const std::string &piece, std::vector<int> &ret) const {
+			{
+				std::lock_guard<std::mutex> lock(piece_cache_mutex_);
+				auto iter = piece_cache_index_.find(piece);
+				if (iter != piece_cache_index_.end()) {
+					piece_cache_.splice(piece_cache_.begin(), piece_cache_, iter->second);
+					const auto &tokens = iter->second->second;
+					ret.insert(ret.end(), tokens.begin(), tokens.end());
+					return;
+				}
+			}
+			auto tokens = byte_pair_encode_with(
+				piece, [this](std::string_view bytes) { return rank_of(bytes); });
+			ret.insert(ret.end(), tokens.begin(), tokens.end());
+			if (piece_cache_capacity_ == 0) {
+				return;
+			}
+			std::lock_guard<std::mutex> lock(piece_cache_mutex_);
+			if (piece_cache_index_.count(piece) == 1) {
+				return;
+			}
+			piece_cache_.emplace_front(piece, std::move(tokens));
+			piece_cache_index_.emplace(piece, piece_cache_.begin());
+			if (piece_cache_.size() > piece_cache_capacity_) {
+				piece_cache_index_.erase(piece_cache_.back().first);
+				piece_cache_.pop_back();
+			}
+		}
+
+		// the pieces of one regex scan, returns the token number of the last piece
+		auto encode_segment(re2::StringPiece input, std::vector<int> &ret) const -> int {
+			int last_piece_token_len = 0;
+			std::string piece;
+			while (re2::RE2::FindAndConsume(&input, *regex_, &piece)) {
+				const int rank = rank_of(piece);
+				if (rank >= 0) {
+					last_piece_token_len = 1;
+					ret.push_back(rank);
+					continue;
+				}
+				const size_t token_num = ret.size();
+				encode_piece(piece, ret);
+				last_piece_token_len = static_cast<int>(ret.size() - token_num);
+			}
+			return last_piece_token_len;
+		}
+
+		// a long text is cut where a line starts with an ascii letter and the segments are
+		// scanned on the threads of the pool
+		auto encode_pieces(re2::StringPiece input, std::vector<int> &ret) const -> int {
+			auto *pool = base::ThreadPoolFactory::get_instance();
+			if (min_segment_size_ == 0 || input.size() < 2 * min_segment_size_ ||
+					pool->thread_num() == 1) {
+				return encode_segment(input, ret);
+			}
+			const size_t segment_size = std::max(min_segment_size_, input.size() / pool->thread_num());
+			std::vector<re2::StringPiece> segments;
+			size_t segment_begin = 0;
+			while (segment_begin < input.size()) {
+				size_t segment_end = segment_begin + segment_size;
+				while (segment_end < input.size() && !(input[segment_end - 1] == '\n' &&
+						std::isalpha(static_cast<unsigned char>(input[segment_end])))) {
+					++segment_end;
+				}
+				segment_end = std::min(segment_end, input.size());
+				segments.push_back(input.substr(segment_begin, segment_end - segment_begin));
+				segment_begin = segment_end;
+			}
+			if (segments.size() == 1) {
+				return encode_segment(input, ret);
+			}
+			std::vector<std::vector<int>> segment_tokens(segments.size());
+			std::vector<int> last_piece_token_lens(segments.size(), 0);
+			const int32_t segment_num = static_cast<int32_t>(segments.size());
+			pool->parallel_for(segment_num, 1, [&](int32_t begin, int32_t end) {
+				for (int32_t segment = begin; segment < end; ++segment) {
+					last_piece_token_lens[segment] =
+						encode_segment(segments[segment], segment_tokens[segment]);
+				}
+			});
+			for (const auto &tokens : segment_tokens) {
+				ret.insert(ret.end(), tokens.begin(), tokens.end());
+			}
+			return last_piece_token_lens.back();
+		}
+
 		auto _decode_native(const std::vector<int> &tokens) const -> std::string {
 			std::string ret;
 			ret.reserve(tokens.size() * 2);
 			for (auto token : tokens) {
-				std::string token_bytes;
+				std::string_view token_bytes;
+				if (cache_ && cache_->token(token, token_bytes)) {
+					ret += token_bytes;
+					continue;
+				}
 				auto iter = decoder_.find(token);
 				if (iter != decoder_.end()) {
 					token_bytes = iter->second;
@@ -258,12 +379,20 @@ class tiktoken {
 			return ret;
 		}
 
+		std::shared_ptr<const base::TokenCache> cache_;
 		ankerl::unordered_dense::map<std::string, int> encoder_;
 		ankerl::unordered_dense::map<std::string, int> special_tokens_encoder;
 		ankerl::unordered_dense::map<int, std::string> decoder_;
 		ankerl::unordered_dense::map<int, std::string> special_tokens_decoder;
 		std::unique_ptr<re2::RE2> regex_;
 		std::unique_ptr<re2::RE2> special_regex_;
+		size_t piece_cache_capacity_ = 16384;
+		size_t min_segment_size_ = 0;
+		mutable std::mutex piece_cache_mutex_;
+		mutable std::list<std::pair<std::string, std::vector<int>>> piece_cache_;
+		mutable ankerl::unordered_dense::map<
+			std::string, std::list<std::pair<std::string, std::vector<int>>>::iterator>
+			piece_cache_index_;
 };
 
 } // namespace tiktoken
\ No newline at end of file
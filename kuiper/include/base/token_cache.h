@@ -0,0 +1,84 @@
+#ifndef KUIPER_INCLUDE_BASE_TOKEN_CACHE_H_
+#define KUIPER_INCLUDE_BASE_TOKEN_CACHE_H_
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include "base/base.h"
+#include "base/unordered_dense.h"
+namespace base {
+constexpr uint32_t kTokenCacheMagic = 0x3143544b;  // "KTC1"
+constexpr uint32_t kTokenCacheVersion = 1;
+
+struct TokenCacheHeader {
+  uint32_t magic = kTokenCacheMagic;
+  uint32_t version = kTokenCacheVersion;
+  // the size and the modification time of the tokenizer file the tables were read from, a cache
+  // of another version of it is rebuilt
+  uint64_t source_size = 0;
+  int64_t source_mtime_ns = 0;
+  // the entries are indexed by the token id, the ids without a token have an empty entry
+  int32_t entry_num = 0;
+  int32_t token_num = 0;
+  int32_t special_num = 0;
+  int32_t bucket_num = 0;
+  int32_t slot_num = 0;
+  int32_t reserved = 0;
+  uint64_t bytes_size = 0;
+};
+
+// The byte level vocab of a bpe tokenizer after the conversions of tokenizer.json, in one file
+// which is mapped as it is. The ordinary tokens are found by a perfect hash with displacement:
+// the hash of the bytes picks a bucket, the seed of the bucket places them on a slot which no
+// other token has, so a lookup is two hashes of one pass over the bytes and one compare. The
+// special tokens are few and are read into a map.
+class TokenCache : public NoCopyable {
+ public:
+  using Encoder = ankerl::unordered_dense::map<std::string, int>;
+
+  ~TokenCache();
+
+  // builds the perfect hash of the encoder and writes the cache aside first, then renames it to
+  // path
+  static Status write_file(const std::string& path, const std::string& source_path,
+                           const Encoder& encoder, const Encoder& special_encoder);
+
+  // fails when the file is not a cache of this version or of the current source file
+  static Status map_file(const std::string& path, const std::string& source_path,
+                         std::shared_ptr<TokenCache>& cache);
+
+  // the id of the ordinary token with the bytes, -1 when there is none
+  int32_t find(std::string_view bytes) const;
+
+  // the bytes of an ordinary token, false when the id has none
+  bool token(int32_t id, std::string_view& bytes) const;
+
+  int32_t token_num() const;
+
+  Encoder special_encoder() const;
+
+ private:
+  TokenCache() = default;
+
+  struct Entry {
+    uint32_t offset;
+    uint32_t size;
+  };
+
+  struct Special {
+    int32_t id;
+    uint32_t offset;
+    uint32_t size;
+  };
+
+  void* mapped_ptr_ = nullptr;
+  size_t mapped_size_ = 0;
+  TokenCacheHeader header_;
+  const Entry* entries_ = nullptr;
+  const Special* specials_ = nullptr;
+  const uint32_t* seeds_ = nullptr;
+  const int32_t* slots_ = nullptr;
+  const char* bytes_ = nullptr;
+};
+}  // namespace base
+#endif  // KUIPER_INCLUDE_BASE_TOKEN_CACHE_H_
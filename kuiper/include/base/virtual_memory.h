@@ -0,0 +1,48 @@
+#ifndef KUIPER_INCLUDE_BASE_VIRTUAL_MEMORY_H_
+#define KUIPER_INCLUDE_BASE_VIRTUAL_MEMORY_H_
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "base/base.h"
+namespace base {
+// An address range of byte_size bytes which is reserved up front and backed by memory only in
+// the parts which are committed, so a buffer can grow and shrink without moving. The cuda
+// device maps physical chunks of the allocation granularity into the range, the host maps the
+// range without a reserve and hands the pages of the released parts back to the system
+class VirtualMemory : public NoCopyable {
+ public:
+  explicit VirtualMemory(DeviceType device_type, size_t byte_size);
+
+  ~VirtualMemory();
+
+  void* ptr() const;
+
+  size_t byte_size() const;
+
+  // the unit of the memory which is committed, a range is rounded out to it
+  size_t granularity() const;
+
+  size_t committed_byte_size() const;
+
+  // backs exactly the chunks which the [offset, offset + size) ranges touch, the chunks out of
+  // them are released. The released memory must not be in use by a kernel which is running
+  bool commit(const std::vector<std::pair<size_t, size_t>>& ranges);
+
+ private:
+  bool map_chunk(size_t chunk);
+
+  void unmap_chunk(size_t chunk);
+
+ private:
+  DeviceType device_type_ = DeviceType::kDeviceUnknown;
+  size_t byte_size_ = 0;
+  size_t granularity_ = 0;
+  void* ptr_ = nullptr;
+  int32_t device_id_ = 0;
+  // the physical allocation of every mapped chunk of the cuda range, 0 for the host
+  std::vector<uint64_t> handles_;
+  std::vector<bool> is_mapped_;
+  size_t mapped_chunk_num_ = 0;
+};
+}  // namespace base
+#endif  // KUIPER_INCLUDE_BASE_VIRTUAL_MEMORY_H_
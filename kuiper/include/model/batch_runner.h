@@ -0,0 +1,85 @@
+#ifndef KUIPER_INCLUDE_MODEL_BATCH_RUNNER_H_
+#define KUIPER_INCLUDE_MODEL_BATCH_RUNNER_H_
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "base/thread_pool.h"
+#include "model/scheduler.h"
+namespace model {
+struct BatchOptions {
+  int32_t max_new_tokens = 256;
+  bool ignore_eos = false;
+  // the prompts which are tokenized, sorted by length and scheduled together, the next window
+  // is read and tokenized while this one runs on the gpu
+  int32_t window_size = 4096;
+  // the prompts of close lengths which are added to the scheduler at once, a bucket is added
+  // when fewer than that wait for a slot, so a freed slot is taken in the next step
+  int32_t bucket_size = 64;
+  // the threads which tokenize and detokenize
+  int32_t thread_num = 4;
+  // see model::Scheduler
+  int32_t prefill_chunk_size = 0;
+  int32_t step_token_budget = 0;
+  size_t host_kv_swap_byte_size = 0;
+};
+
+struct BatchStats {
+  int64_t prompt_num = 0;
+  int64_t prompt_token_num = 0;
+  int64_t output_token_num = 0;
+  // the prompts which were not run, their lines hold the error
+  int64_t failed_num = 0;
+  double seconds = 0.;
+};
+
+// Offline inference over a file of prompts for throughput instead of latency. Every line of the
+// input is one prompt, every finished one is written as a json line with the index of its input
+// line, in the order they finish. The prompts of a window run the longest first and in buckets of
+// close lengths through the continuous batching scheduler, which keeps every slot of the model
+// busy. The tokenize of the next window and the detokenize and the write of the outputs run on a
+// thread pool of their own, so the decode loop only steps the batch.
+class BatchRunner {
+ public:
+  explicit BatchRunner(const Model& model, const BatchOptions& options = BatchOptions());
+
+  base::Status run(const std::string& input_path, const std::string& output_path,
+                   BatchStats* stats = nullptr);
+
+ private:
+  struct Prompt {
+    int64_t index = 0;
+    std::vector<int32_t> tokens;
+  };
+
+  struct Output {
+    int64_t index = 0;
+    int32_t prompt_token_num = 0;
+    std::vector<int32_t> tokens;
+    // "stop", "length" or the error of a prompt which did not run
+    std::string finish_reason;
+  };
+
+  // reads the next window of the input and tokenizes it, sorted by the length descending
+  std::vector<Prompt> read_window(std::ifstream& input, int64_t& line_index);
+
+  void push_output(std::vector<Output> outputs);
+
+  // detokenizes and writes the outputs until the finish
+  void write_outputs(std::ofstream& output);
+
+ private:
+  const Model& model_;
+  BatchOptions options_;
+  base::ThreadPool pool_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::vector<Output> pending_outputs_;
+  bool is_finished_ = false;
+};
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_BATCH_RUNNER_H_
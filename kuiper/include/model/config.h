@@ -1,7 +1,21 @@
 #ifndef KUIPER_INCLUDE_MODEL_LLAMA_CONFIG_H_
 #define KUIPER_INCLUDE_MODEL_LLAMA_CONFIG_H_
 #include <ostream>
+#include "base/rope.h"
 namespace model {
+// the rope of the model family this build reads, llama3 and qwen2 rotate the two halves of a
+// head, llama2 the adjacent element pairs
+#if defined(LLAMA3_SUPPORT)
+constexpr float kDefaultRoPETheta = 500000.f;
+constexpr bool kDefaultRoPERotateHalf = true;
+#elif defined(QWEN2_SUPPORT)
+constexpr float kDefaultRoPETheta = 1000000.f;
+constexpr bool kDefaultRoPERotateHalf = true;
+#else
+constexpr float kDefaultRoPETheta = 10000.f;
+constexpr bool kDefaultRoPERotateHalf = false;
+#endif
+
 struct ModelConfig {
   int32_t dim = 0;
   int32_t hidden_dim = 0;
@@ -19,20 +33,34 @@ struct TransformerConfig {
   int32_t vocab_size_ = 0;
 
   int32_t dim_ = 0;
+  // the width of the query and of the attention output, dim_ unless the heads are split over
+  // the ranks of a tensor parallel model
+  int32_t q_dim_ = 0;
   int32_t hidden_dim_ = 0;
   int32_t layer_num_ = 0;
   int32_t head_num_ = 0;
   int32_t kv_head_num_ = 0;
   int32_t seq_len_ = 0;
+  // the seq_len of the model file, its rope tables take that many rows before the classifier
+  // even when set_max_seq_len overrides seq_len_
+  int32_t file_seq_len_ = 0;
   bool is_shared_weight_ = false;
+  float rope_theta_ = kDefaultRoPETheta;
+  bool is_rope_rotate_half_ = kDefaultRoPERotateHalf;
+  base::RoPEScaling rope_scaling_;
 
   friend std::ostream& operator<<(std::ostream& os, const TransformerConfig& obj) {
     return os << "\nkv_dim: " << obj.kv_dim_ << "\nkv_mul_: " << obj.kv_mul_ << "\n"
               << "head_size: " << obj.head_size_ << "\nvocab_size_: " << obj.vocab_size_ << "\n"
-              << "dim: " << obj.dim_ << "\nhidden_dim_: " << obj.hidden_dim_ << "\n"
+              << "dim: " << obj.dim_ << "\nq_dim: " << obj.q_dim_ << "\n"
+              << "hidden_dim_: " << obj.hidden_dim_ << "\n"
               << "layer_num: " << obj.layer_num_ << "\nhead_num_: " << obj.head_num_ << "\n"
               << "kv_head_num: " << obj.kv_head_num_ << "\nseq_len_: " << obj.seq_len_ << "\n"
-              << "is_shared_weight: " << obj.is_shared_weight_;
+              << "is_shared_weight: " << obj.is_shared_weight_ << "\n"
+              << "rope_theta: " << obj.rope_theta_
+              << "\nis_rope_rotate_half: " << obj.is_rope_rotate_half_
+              << "\nrope_scaling: " << base::rope_scaling_name(obj.rope_scaling_.type) << " x"
+              << obj.rope_scaling_.factor;
   }
 };
 }  // namespace model
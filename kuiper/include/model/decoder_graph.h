@@ -0,0 +1,157 @@
+#ifndef KUIPER_INCLUDE_MODEL_DECODER_GRAPH_H_
+#define KUIPER_INCLUDE_MODEL_DECODER_GRAPH_H_
+#include <memory>
+#include <vector>
+#include "config.h"
+#include "op/layer.h"
+namespace model {
+// the ops of one decode step, the fused ones replace a sequence of the others
+enum class GraphOp : uint8_t {
+  // the hidden state is copied to the host before the first cpu layer of a split model
+  kMoveToHost = 0,
+  kAttentionNorm = 1,
+  kQuery = 2,
+  kQueryBias = 3,
+  kKey = 4,
+  kKeyBias = 5,
+  kValue = 6,
+  kValueBias = 7,
+  kRope = 8,
+  kKVWrite = 9,
+  kAttention = 10,
+  kAttentionOutput = 11,
+  kAttentionResidual = 12,
+  kFFNNorm = 13,
+  kGate = 14,
+  kUp = 15,
+  kSwiGLU = 16,
+  kDown = 17,
+  kFFNResidual = 18,
+  kFinalNorm = 19,
+  kClassifier = 20,
+
+  // the query, key and value matmuls over the packed weight
+  kQKV = 21,
+  // the rope of the query and the key fused with the cache write
+  kRopeKVWrite = 22,
+  // the residual add of the attention and the ffn rmsnorm in one pass
+  kAttentionResidualNorm = 23,
+  // the gate and up matmuls with the swiglu over the packed weight
+  kGateUpSwiGLU = 24,
+  // the residual add of the ffn and the attention rmsnorm of the next layer in one pass
+  kFFNResidualNorm = 25,
+
+  // the sums over the ranks of a tensor parallel model, of the partial attention output and
+  // of the partial ffn output
+  kAttentionAllReduce = 26,
+  kFFNAllReduce = 27,
+};
+
+// the name of the op in the profiles
+const char* graph_op_name(GraphOp op);
+
+struct GraphNode {
+  GraphOp op = GraphOp::kAttentionNorm;
+  // the transformer layer, the layer number for the final norm and the classifier
+  int32_t layer_idx = 0;
+  // the op runs on the cpu, the layers of a split model from host_layer_begin on
+  bool is_host = false;
+};
+
+// the fusions the layers and the kv caches of a model can run
+struct FusionOptions {
+  bool pack_qkv = false;
+  bool gate_up_swiglu = false;
+  bool add_rmsnorm = false;
+  // the rope fused cache write of the model device and of the cpu of a split model
+  bool rope_kv_write = false;
+  bool host_rope_kv_write = false;
+};
+
+// The ops of one decode step of a llama or a qwen2 decoder in their order. It is built from
+// the config with one op per kernel of the reference model and the fusion pass rewrites the
+// known sequences into the fused ops, which the execution plan of the model is lowered from
+class DecoderGraph {
+ public:
+  // the layers from host_layer_begin on run on the cpu, has_qkv_bias adds the bias ops of the
+  // query, key and value projections and is_tensor_parallel the sums after wo and w2
+  static DecoderGraph build(const TransformerConfig& config, int32_t host_layer_begin,
+                            bool has_qkv_bias, bool is_tensor_parallel = false);
+
+  // the matmul layers add their bias in the kernel, the bias ops are folded always. The
+  // others are fused when options allow it and the ops of the sequence run on one device
+  void fuse(const FusionOptions& options);
+
+  const std::vector<GraphNode>& nodes() const;
+
+  // the number of the nodes with the op
+  int32_t count(GraphOp op) const;
+
+ private:
+  // replaces every run of the ops on one device, whose layers are consecutive when
+  // spans_layers is set and the same otherwise, by one node of the fused op
+  void fuse_sequence(const std::vector<GraphOp>& ops, GraphOp fused_op, bool spans_layers,
+                     bool device_enabled, bool host_enabled);
+
+  std::vector<GraphNode> nodes_;
+};
+
+// the raw pointers of the layers of a model, the graph is lowered onto them
+struct DecoderLayers {
+  // the attention norms, the ffn norms and the final norm
+  std::vector<op::Layer*> rmsnorm_layers;
+  std::vector<op::Layer*> wq_layers;
+  std::vector<op::Layer*> wk_layers;
+  std::vector<op::Layer*> wv_layers;
+  std::vector<op::Layer*> wqkv_layers;
+  std::vector<op::Layer*> wo_layers;
+  std::vector<op::Layer*> w1_layers;
+  std::vector<op::Layer*> w3_layers;
+  std::vector<op::Layer*> w13_layers;
+  std::vector<op::Layer*> w2_layers;
+  op::Layer* cls_layer = nullptr;
+  // the layers without weights of the model device and of the cpu of a split model
+  op::Layer* rope_layer[2] = {nullptr, nullptr};
+  op::Layer* mha_layer[2] = {nullptr, nullptr};
+  op::Layer* add_layer[2] = {nullptr, nullptr};
+  op::Layer* swiglu_layer[2] = {nullptr, nullptr};
+};
+
+namespace detail {
+inline std::vector<op::Layer*> raw_layers(const std::vector<std::shared_ptr<op::Layer>>& layers) {
+  std::vector<op::Layer*> raw;
+  raw.reserve(layers.size());
+  for (const auto& layer : layers) {
+    raw.push_back(layer.get());
+  }
+  return raw;
+}
+}  // namespace detail
+
+// the layer table of the llama and the qwen2 layer structs, which name their layers alike
+template <typename Layers>
+DecoderLayers make_decoder_layers(const Layers& layers) {
+  DecoderLayers decoder_layers;
+  decoder_layers.rmsnorm_layers = detail::raw_layers(layers.rmsnorm_layers_);
+  decoder_layers.wq_layers = detail::raw_layers(layers.wq_layers_);
+  decoder_layers.wk_layers = detail::raw_layers(layers.wk_layers_);
+  decoder_layers.wv_layers = detail::raw_layers(layers.wv_layers_);
+  decoder_layers.wqkv_layers = detail::raw_layers(layers.wqkv_layers_);
+  decoder_layers.wo_layers = detail::raw_layers(layers.wo_layers_);
+  decoder_layers.w1_layers = detail::raw_layers(layers.w1_layers_);
+  decoder_layers.w3_layers = detail::raw_layers(layers.w3_layers_);
+  decoder_layers.w13_layers = detail::raw_layers(layers.w13_layers_);
+  decoder_layers.w2_layers = detail::raw_layers(layers.w2_layers_);
+  decoder_layers.cls_layer = layers.cls_layer_.get();
+  decoder_layers.rope_layer[0] = layers.rope_layer_.get();
+  decoder_layers.rope_layer[1] = layers.cpu_rope_layer_.get();
+  decoder_layers.mha_layer[0] = layers.mha_layer_.get();
+  decoder_layers.mha_layer[1] = layers.cpu_mha_layer_.get();
+  decoder_layers.add_layer[0] = layers.add_layer_.get();
+  decoder_layers.add_layer[1] = layers.cpu_add_layer_.get();
+  decoder_layers.swiglu_layer[0] = layers.swiglu_layer_.get();
+  decoder_layers.swiglu_layer[1] = layers.cpu_swiglu_layer_.get();
+  return decoder_layers;
+}
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_DECODER_GRAPH_H_
@@ -0,0 +1,50 @@
+#ifndef KUIPER_INCLUDE_MODEL_DETOKENIZE_WORKER_H_
+#define KUIPER_INCLUDE_MODEL_DETOKENIZE_WORKER_H_
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "model/stream_decoder.h"
+namespace model {
+// Turns the sampled tokens into text on a thread of its own, so the host waits for the next
+// decode steps while the last ones are decoded and written. The tokens go through a stream
+// decoder, the sink gets the text they complete
+class DetokenizeWorker {
+ public:
+  using SinkFunc = std::function<void(const std::string&)>;
+
+  DetokenizeWorker(StreamDecoder decoder, SinkFunc sink);
+
+  ~DetokenizeWorker();
+
+  DetokenizeWorker(const DetokenizeWorker&) = delete;
+
+  DetokenizeWorker& operator=(const DetokenizeWorker&) = delete;
+
+  void push(const std::vector<int32_t>& tokens);
+
+  // writes the text of all the pushed tokens and stops the thread
+  void finish();
+
+  // the text which went to the sink
+  const std::string& text() const;
+
+ private:
+  void run();
+
+ private:
+  StreamDecoder decoder_;
+  SinkFunc sink_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::vector<int32_t> pending_tokens_;
+  bool is_finished_ = false;
+  // only touched by the thread until it is joined
+  std::string text_;
+  std::thread thread_;
+};
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_DETOKENIZE_WORKER_H_
@@ -0,0 +1,58 @@
+#ifndef KUIPER_INCLUDE_MODEL_EXECUTION_PLAN_H_
+#define KUIPER_INCLUDE_MODEL_EXECUTION_PLAN_H_
+#include <vector>
+#include "decoder_graph.h"
+#include "kv_cache.h"
+#include "op/layer.h"
+#include "op/mha.h"
+#include "op/rmsnorm.h"
+#include "tensor/tensor.h"
+namespace model {
+// one node of the decoder graph with its layer and its operands resolved, the layers and the
+// tensors belong to the model and outlive the plan
+struct PlanStep {
+  GraphOp op = GraphOp::kAttentionNorm;
+  int32_t layer_idx = 0;
+  // the first step of its transformer layer, a streamed layer acquires its weights here
+  bool begins_layer = false;
+  // the op runs on the cpu, in the layers of a split model
+  bool is_host = false;
+  op::Layer* layer = nullptr;
+  // the layer of the fused residual add and rmsnorm
+  op::RmsNormLayer* rmsnorm = nullptr;
+  op::MultiHeadAttention* mha = nullptr;
+
+  // a null input or output stands for the hidden state, the input of the decode step or its
+  // host copy in the cpu layers of a split model
+  const tensor::Tensor* input = nullptr;
+  const tensor::Tensor* input2 = nullptr;
+  const tensor::Tensor* output = nullptr;
+
+  // the operands of the rope, the kv cache write and the attention
+  const PagedKVCache* kv_cache = nullptr;
+  int32_t kv_layer_idx = 0;
+  tensor::Tensor block_table;
+  const tensor::Tensor* query = nullptr;
+  const tensor::Tensor* key = nullptr;
+  const tensor::Tensor* value = nullptr;
+  const tensor::Tensor* sin_cache = nullptr;
+  const tensor::Tensor* cos_cache = nullptr;
+  const tensor::Tensor* key_cache = nullptr;
+  const tensor::Tensor* value_cache = nullptr;
+  const tensor::Tensor* score_storage = nullptr;
+};
+
+// the decode step of slot 0 as a flat list of layer invocations, lowered once at init from the
+// fused decoder graph so that the forward does no buffer lookup, no shared pointer copy and no
+// cast per layer
+struct ExecutionPlan {
+  std::vector<PlanStep> steps;
+  // the steps as the phases of one persistent kernel on the device, see Model::set_megakernel
+  std::shared_ptr<base::Buffer> megakernel_steps;
+  int32_t megakernel_step_num = 0;
+  int32_t megakernel_grid_size = 0;
+  // the final norm of the megakernel can not normalize the hidden state in place
+  tensor::Tensor megakernel_norm;
+};
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_EXECUTION_PLAN_H_
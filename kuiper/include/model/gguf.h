@@ -0,0 +1,79 @@
+#ifndef KUIPER_INCLUDE_MODEL_GGUF_H_
+#define KUIPER_INCLUDE_MODEL_GGUF_H_
+#include <base/base.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "config.h"
+#include "raw_model_data.h"
+#include "tensor_file.h"
+namespace model {
+// "GGUF", the files of llama.cpp in the versions 2 and 3
+constexpr uint32_t kGgufMagic = 0x46554747;
+// the context of a gguf model is cut to this length, the kv cache is sized by it
+constexpr int32_t kGgufMaxSeqLen = 8192;
+
+// the block types of the tensors, the values of ggml_type
+enum class GgufType : int32_t {
+  kF32 = 0,
+  kF16 = 1,
+  kQ4_0 = 2,
+  kQ8_0 = 8,
+  kQ4_K = 12,
+  kQ6_K = 14,
+  kBF16 = 30,
+};
+
+struct GgufTensor {
+  std::string name;
+  int32_t type = 0;
+  // the outermost dimension first, the reverse of the ne order of ggml
+  std::vector<int64_t> dims;
+  // from the start of the file
+  size_t offset = 0;
+  size_t byte_size = 0;
+};
+
+class GgufFile {
+ public:
+  // reads the header, the metadata and the tensor infos of the file mapped at data, the array
+  // values of the metadata such as the vocabulary are skipped
+  base::Status parse(const void* data, size_t file_size);
+
+  int64_t get_int(const std::string& key, int64_t default_value) const;
+
+  double get_float(const std::string& key, double default_value) const;
+
+  std::string get_string(const std::string& key) const;
+
+  const std::vector<GgufTensor>& tensors() const;
+
+  const GgufTensor* find(const std::string& name) const;
+
+ private:
+  std::map<std::string, double> numbers_;
+  std::map<std::string, std::string> strings_;
+  std::vector<GgufTensor> tensors_;
+};
+
+struct GgufModelInfo {
+  ModelConfig config;
+  // fp32, fp16 or bf16 for a float model, int8 for a quant one
+  base::DataType weight_data_type = base::DataType::kDataTypeFp32;
+  bool is_int4 = false;
+  int32_t group_size = 0;
+  float rope_theta = kDefaultRoPETheta;
+  bool is_rope_rotate_half = kDefaultRoPERotateHalf;
+  base::RoPEScaling rope_scaling;
+};
+
+// Adds the tensors of the gguf file mapped by raw_data to directory, under the names which
+// tools/export.py writes. The layout of the model follows the type of its first query weight:
+// f32, f16 and bf16 stay float, q8_0 and q4_0 blocks become the int8 and the int4 groups of 32
+// of the quant kernels without a loss, q4_k and q6_k are requantized to int8 groups. A tensor
+// which is in the layout already is viewed in place, the others are converted into
+// raw_data.converted
+base::Status load_gguf_model(RawModelDataGguf& raw_data, TensorDirectory& directory,
+                             GgufModelInfo& info);
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_GGUF_H_
@@ -0,0 +1,54 @@
+#ifndef KUIPER_INCLUDE_MODEL_INT4_IMPORT_H_
+#define KUIPER_INCLUDE_MODEL_INT4_IMPORT_H_
+#include <base/base.h>
+#include <string>
+#include <vector>
+namespace model {
+// the per channel autogptq and autoawq checkpoints are imported with groups of this size, every
+// group of a row gets the scale and the zero point of the row
+constexpr int32_t kInt4PerChannelGroupSize = 128;
+
+enum class Int4Format : int32_t {
+  // qweight [cols / 8, rows] packed along the input, qzeros [groups, rows / 8]
+  kGptq = 0,
+  // qweight [cols, rows / 8] and qzeros [groups, rows / 8] packed along the output in the
+  // interleaved order of the awq kernels
+  kAwq = 1,
+};
+
+// the int32 tensors of one linear layer of a 4 bit autogptq or autoawq checkpoint, the weight
+// has rows output and cols input channels
+struct Int4Source {
+  Int4Format format = Int4Format::kGptq;
+  int32_t rows = 0;
+  int32_t cols = 0;
+  // the input channels of a group of the checkpoint, cols for a per channel one
+  int32_t group_size = 0;
+  // the gptq v1 checkpoints store every zero point minus one
+  bool is_zero_point_offset = false;
+  const int32_t* qweight = nullptr;
+  const int32_t* qzeros = nullptr;
+  // fp16 [groups, rows]
+  const uint16_t* scales = nullptr;
+  // the group of every input channel of an act order checkpoint, nullptr without one
+  const int32_t* g_idx = nullptr;
+};
+
+// Repacks src into the int4 layout of MatmulLayer with zero points and groups of group_size.
+// The input channels of an act order checkpoint are sorted by their group, so every group is
+// contiguous again, order gets the input channel of every column of the repacked weight then
+// and stays empty when the channels keep their places. Nothing is requantized, the scales and
+// the zero points of the checkpoint are copied to the groups they cover
+base::Status repack_int4_weight(const Int4Source& src, int32_t group_size,
+                                std::vector<uint8_t>& packed, std::vector<int32_t>& order);
+
+// "<layer>.order" for the weight "<layer>.weight", the int32 input channel of every column of
+// an act order weight in the directory
+std::string int4_order_name(const std::string& weight_name);
+
+// quantizes the row of cols values at row_idx of a rows x cols weight into the int4 layout
+// with zero points at dst, the asymmetric groups of the classifier of an int4 checkpoint
+void quantize_int4_row(const float* row, int64_t row_idx, int64_t rows, int64_t cols,
+                       int32_t group_size, uint8_t* dst);
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_INT4_IMPORT_H_
@@ -0,0 +1,209 @@
+#ifndef KUIPER_INCLUDE_MODEL_KV_CACHE_H_
+#define KUIPER_INCLUDE_MODEL_KV_CACHE_H_
+#include <memory>
+#include <vector>
+#include "base/alloc.h"
+#include "base/attention_window.h"
+#include "base/virtual_memory.h"
+#include "kv_snapshot.h"
+#include "tensor/tensor.h"
+namespace model {
+// The key and value caches are pools of fixed-size blocks, every sequence slot maps its
+// positions to blocks through a block table, so the memory grows with the tokens really stored.
+//
+// key/value cache: [layer_num, block_num * block_size, kv_dim], stored in fp32, fp16, bf16 or int8
+// key/value scale: [layer_num, block_num * block_size, kv_dim / head_size], the fp32 scale of
+//                  every head of every int8 row, empty for the other data types
+// block table:     [max_seq_num, max_block_num], the block id of every block_size positions
+//
+// The head major cache is [layer_num, kv_dim / head_size, block_num * block_size, head_size]
+// instead, the positions of one head in a block are contiguous for the attention scan, it is
+// not available for the int8 cache
+//
+// With a chunk_block_num the block_num blocks are only reserved as address space, the memory of
+// the blocks is committed chunk_block_num blocks at a time when the free ones run out, and shrink
+// hands it back once the sequences are released
+//
+// With an attention window the positions of a slot past its sinks go around a ring, the slot
+// never holds more than window.capacity() rows and a sequence can run past max_seq_len
+class PagedKVCache {
+ public:
+  explicit PagedKVCache(base::DeviceType device_type, base::DataType data_type, int32_t layer_num,
+                        int32_t kv_dim, int32_t block_size, int32_t block_num,
+                        int32_t max_seq_num, int32_t max_seq_len, int32_t head_size = 0,
+                        bool is_head_major = false, int32_t chunk_block_num = 0);
+
+  bool reserve(int32_t slot, int32_t token_num);
+
+  // the positions are stored in the rows of the window, it has to be set while the slots are
+  // empty
+  void set_window(const base::AttentionWindow& window);
+
+  const base::AttentionWindow& window() const;
+
+  void release(int32_t slot);
+
+  // keeps the blocks of the first token_num positions, the later ones go back to the pool
+  void truncate(int32_t slot, int32_t token_num);
+
+  // the empty slot starts with the given blocks, a block held by several slots is copied before
+  // one of them writes it
+  void share(int32_t slot, const std::vector<int32_t>& blocks);
+
+  // the empty dst_slot shares the blocks of the first token_num positions of src_slot, so the
+  // branches of one prompt keep a single copy of its kv
+  void fork(int32_t src_slot, int32_t dst_slot, int32_t token_num);
+
+  // the shared blocks of slot which hold positions in [begin_pos, end_pos)
+  int32_t shared_block_num(int32_t slot, int32_t begin_pos, int32_t end_pos) const;
+
+  // copies the shared blocks of the positions in [begin_pos, end_pos) into blocks of the slot's
+  // own before they are written, the copies on the cuda device are queued on the stream. False
+  // when the blocks run out
+  bool make_writable(int32_t slot, int32_t begin_pos, int32_t end_pos, void* stream = nullptr);
+
+  // a block goes back to the pool when the last slot or cache holding it lets it go
+  void ref_block(int32_t block);
+
+  void unref_block(int32_t block);
+
+  int32_t block_ref(int32_t block) const;
+
+  const std::vector<int32_t>& blocks(int32_t slot) const;
+
+  int32_t physical_pos(int32_t slot, int32_t token_pos) const;
+
+  void write(int32_t layer_idx, int32_t slot, int32_t token_pos, const tensor::Tensor& key,
+             const tensor::Tensor& value, void* stream = nullptr) const;
+
+  // a position on the device is read by the kernel, the write can be replayed in a cuda graph
+  void write(int32_t layer_idx, int32_t slot, const tensor::Tensor& pos_tensor,
+             const tensor::Tensor& key, const tensor::Tensor& value, void* stream = nullptr) const;
+
+  // the rope of the query and key and the cache write run as one kernel, only on the cuda
+  // device and for the caches which are not quantized per head
+  bool is_rope_fused() const;
+
+  // rotates the query in place and stores the rotated key and the value of every row, the key
+  // tensor keeps the projection before the rotation
+  void write_rotated(int32_t layer_idx, int32_t slot, const tensor::Tensor& pos_tensor,
+                     const tensor::Tensor& query, const tensor::Tensor& key,
+                     const tensor::Tensor& value, const tensor::Tensor& sin_cache,
+                     const tensor::Tensor& cos_cache, bool is_rotate_half,
+                     void* stream = nullptr) const;
+
+  // the row of the slot in the block tables, a view made once
+  const tensor::Tensor& block_table(int32_t slot) const;
+
+  const tensor::Tensor& key_cache() const;
+
+  const tensor::Tensor& value_cache() const;
+
+  const tensor::Tensor& key_scale() const;
+
+  const tensor::Tensor& value_scale() const;
+
+  int32_t block_size() const;
+
+  int32_t block_num() const;
+
+  int32_t free_block_num() const;
+
+  int32_t reserved_token_num(int32_t slot) const;
+
+  base::DataType data_type() const;
+
+  bool is_head_major() const;
+
+  bool is_growable() const;
+
+  // releases the committed memory past the highest block in use, it keeps at least
+  // keep_block_num blocks committed so the next sequence does not grow the pool again
+  void shrink(int32_t keep_block_num);
+
+  int32_t committed_block_num() const;
+
+  // the memory behind the caches and the scales
+  size_t committed_byte_size() const;
+
+  // the element at offset of a cache or of a scale, in the data type of that tensor
+  void* cache_ptr(const tensor::Tensor& cache, int64_t offset) const;
+
+  // copies the blocks of the first token_num positions of slot into the host memory of the
+  // snapshot, the copies from the cuda device are queued on the stream and the snapshot waits
+  // for them before it is read, the blocks can be released at once
+  void save(int32_t slot, int32_t token_num, KVSnapshot& snapshot, void* stream = nullptr) const;
+
+  // the header of a snapshot of the first token_num positions of a slot
+  KVSnapshotHeader snapshot_header(int32_t token_num) const;
+
+  // reserves the positions of the snapshot in the empty slot and copies its blocks in, false
+  // when the snapshot is of another cache layout or the blocks run out
+  bool restore(int32_t slot, const KVSnapshot& snapshot, void* stream = nullptr);
+
+ private:
+  struct BlockSection {
+    const tensor::Tensor* cache;
+    int32_t strip_num;
+    int32_t row_width;
+  };
+
+  // the caches and the scales, their strips are the layers, or the heads of every layer of a
+  // head major cache
+  std::vector<BlockSection> block_sections() const;
+
+  // copies the blocks of slot between the caches and the sections of a snapshot
+  void copy_snapshot_blocks(int32_t slot, int32_t block_num, uint8_t* const* sections,
+                            bool is_save, void* stream) const;
+
+  void upload_table(int32_t slot, int32_t first_block_idx);
+
+  // the rows of a slot which hold its first token_num positions
+  int32_t cache_token_num(int32_t token_num) const;
+
+  // the rows which hold the positions in [begin_pos, end_pos), the whole ring after the first
+  // of them once the range wraps around it
+  void cache_range(int32_t& begin_pos, int32_t& end_pos) const;
+
+  // commits chunks until need_block_num blocks are free
+  bool grow(int32_t need_block_num);
+
+  bool commit_blocks(int32_t block_num, bool restore = true);
+
+ private:
+  base::DeviceType device_type_ = base::DeviceType::kDeviceUnknown;
+  base::DataType data_type_ = base::DataType::kDataTypeFp32;
+  int32_t layer_num_ = 0;
+  int32_t kv_dim_ = 0;
+  int32_t head_size_ = 0;
+  int32_t block_size_ = 0;
+  int32_t block_num_ = 0;
+  int32_t max_block_num_ = 0;
+  int32_t chunk_block_num_ = 0;
+  int32_t committed_block_num_ = 0;
+  bool is_head_major_ = false;
+  base::AttentionWindow window_;
+  std::shared_ptr<base::DeviceAllocator> alloc_;
+
+  std::vector<int32_t> free_blocks_;
+  std::vector<int32_t> block_refs_;
+  std::vector<std::vector<int32_t>> block_tables_;
+  tensor::Tensor block_table_tensor_;
+  std::vector<tensor::Tensor> slot_block_tables_;
+  // the position and the rows of a write, rebound for every write so it allocates nothing
+  tensor::Tensor write_pos_;
+  mutable tensor::Tensor key_run_;
+  mutable tensor::Tensor value_run_;
+  mutable tensor::Tensor key_cache_run_;
+  mutable tensor::Tensor value_cache_run_;
+  tensor::Tensor key_cache_;
+  tensor::Tensor value_cache_;
+  tensor::Tensor key_scale_;
+  tensor::Tensor value_scale_;
+  std::unique_ptr<base::VirtualMemory> key_memory_;
+  std::unique_ptr<base::VirtualMemory> value_memory_;
+  std::unique_ptr<base::VirtualMemory> key_scale_memory_;
+  std::unique_ptr<base::VirtualMemory> value_scale_memory_;
+};
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_KV_CACHE_H_
@@ -0,0 +1,96 @@
+#ifndef KUIPER_INCLUDE_MODEL_KV_SNAPSHOT_H_
+#define KUIPER_INCLUDE_MODEL_KV_SNAPSHOT_H_
+#include <memory>
+#include <string>
+#include "base/buffer.h"
+namespace model {
+constexpr uint32_t kKVSnapshotMagic = 0x3153564b;  // "KVS1"
+constexpr uint32_t kKVSnapshotVersion = 1;
+// the header and the sections start at this alignment, so a mapped file is copied from directly
+constexpr size_t kKVSnapshotAlignment = 4096;
+
+enum class KVSection : int32_t {
+  kKey = 0,
+  kValue = 1,
+  kKeyScale = 2,
+  kValueScale = 3,
+};
+constexpr int32_t kKVSectionNum = 4;
+
+struct KVSnapshotHeader {
+  uint32_t magic = kKVSnapshotMagic;
+  uint32_t version = kKVSnapshotVersion;
+  int32_t data_type = 0;
+  int32_t layer_num = 0;
+  int32_t kv_dim = 0;
+  int32_t head_size = 0;
+  int32_t block_size = 0;
+  int32_t is_head_major = 0;
+  // the whole blocks which hold the token_num positions
+  int32_t block_num = 0;
+  int32_t token_num = 0;
+  // the scale sections are empty unless the cache is int8
+  uint64_t section_byte_sizes[kKVSectionNum] = {0, 0, 0, 0};
+};
+
+// The kv of the first positions of one sequence, so an evicted session resumes with a copy
+// instead of a prefill. Every section keeps the blocks of the sequence strip after strip in the
+// layout of the cache, and the memory is laid out like the snapshot file: the header and every
+// section start at kKVSnapshotAlignment, so map_file gives a snapshot which is restored straight
+// from the page cache.
+class KVSnapshot : public base::NoCopyable {
+ public:
+  KVSnapshot() = default;
+
+  ~KVSnapshot();
+
+  // the host memory of the sections, page-locked when is_pinned so the copies from the cuda
+  // device run asynchronously
+  void allocate(const KVSnapshotHeader& header, bool is_pinned);
+
+  // waits for the pending copies and writes the snapshot aside first, then renames it to path
+  base::Status write_file(const std::string& path) const;
+
+  base::Status map_file(const std::string& path);
+
+  bool is_empty() const;
+
+  const KVSnapshotHeader& header() const;
+
+  int32_t token_num() const;
+
+  // the byte size of the snapshot file
+  size_t byte_size() const;
+
+  // the byte size of a snapshot with the header, before it is allocated
+  static size_t byte_size(const KVSnapshotHeader& header);
+
+  const uint8_t* section(KVSection section) const;
+
+  uint8_t* mutable_section(KVSection section);
+
+  // the copies into the snapshot were queued on stream, it is synchronized before the memory
+  // is read
+  void set_pending_stream(void* stream);
+
+  void wait() const;
+
+  // true once the pending copies are done, without a wait
+  bool is_ready() const;
+
+ private:
+  void reset();
+
+  size_t section_offset(int32_t section) const;
+
+  const uint8_t* data() const;
+
+ private:
+  KVSnapshotHeader header_;
+  std::shared_ptr<base::Buffer> buffer_;
+  void* mapped_ptr_ = nullptr;
+  size_t mapped_size_ = 0;
+  mutable void* pending_stream_ = nullptr;
+};
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_KV_SNAPSHOT_H_
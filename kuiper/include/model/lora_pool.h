@@ -0,0 +1,74 @@
+#ifndef KUIPER_INCLUDE_MODEL_LORA_POOL_H_
+#define KUIPER_INCLUDE_MODEL_LORA_POOL_H_
+#include <string>
+#include <vector>
+#include "decoder_graph.h"
+#include "op/lora.h"
+#include "op/matmul.h"
+namespace model {
+// Keeps the low rank weights of up to adapter_num LoRA adapters of the model resident on its
+// device, every adapter in a slot of its own with the rank of the pool. The matmuls of the
+// target modules share one row binding, so the rows of a batch can run different adapters,
+// or the base model, without merging any of them into the weights.
+class LoraPool {
+ public:
+  explicit LoraPool(int32_t adapter_num, int32_t rank, std::vector<std::string> target_modules);
+
+  LoraPool(const LoraPool&) = delete;
+
+  LoraPool& operator=(const LoraPool&) = delete;
+
+  // allocates the weights of the target modules of every transformer layer on the device of
+  // the model and attaches them to the unfused matmuls. The rows of the query and the key
+  // projections are permuted for a model whose rope rotates the interleaved pairs
+  base::Status attach(const DecoderLayers& layers, int32_t head_size, bool is_rope_rotate_half,
+                      int32_t max_batch_size, base::DeviceType device_type);
+
+  // reads the peft adapter in the directory path, its adapter_config.json and its
+  // adapter_model.safetensors, into a free slot whose index is returned in adapter_id. The
+  // target modules the adapter does not have are zero
+  base::Status load(const std::string& path, int32_t& adapter_id);
+
+  base::Status unload(int32_t adapter_id);
+
+  bool is_loaded(int32_t adapter_id) const;
+
+  // the adapter of every row of the next forwards, one adapter is used for all the rows. The
+  // rows are unbound when none of them has an adapter, so the base model runs without the low
+  // rank kernels, unless keep_rows holds them for a cuda graph which is replayed later
+  base::Status bind(const std::vector<int32_t>& row_adapters, bool keep_rows, void* stream);
+
+  int32_t rank() const;
+
+ private:
+  struct Target {
+    int32_t layer_idx = 0;
+    std::string module;
+    op::MatmulLayer* layer = nullptr;
+    // the rows of the lora b follow the interleaved rope of the model
+    bool is_rope_permuted = false;
+    std::shared_ptr<op::LoraWeights> weights;
+  };
+
+  // copies element_num floats of the host src into the tensor from the element offset on
+  void upload(const tensor::Tensor& tensor, size_t offset, const float* src,
+              size_t element_num) const;
+
+  int32_t adapter_num_ = 0;
+  int32_t rank_ = 0;
+  int32_t head_size_ = 0;
+  std::vector<std::string> target_modules_;
+  std::vector<Target> targets_;
+  std::vector<bool> is_loaded_;
+  // alpha / rank of every slot, shared by the targets
+  tensor::Tensor scales_;
+  std::vector<float> host_scales_;
+  // the bound adapters are copied from the host mirror into a device buffer of max_batch_size
+  // rows, the rows of a forward are a view of its front
+  tensor::Tensor adapters_;
+  std::vector<int32_t> host_adapters_;
+  std::shared_ptr<op::LoraRows> rows_ = std::make_shared<op::LoraRows>();
+  base::DeviceType device_type_ = base::DeviceType::kDeviceUnknown;
+};
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_LORA_POOL_H_
@@ -0,0 +1,36 @@
+#ifndef KUIPER_INCLUDE_MODEL_MATMUL_TUNER_H_
+#define KUIPER_INCLUDE_MODEL_MATMUL_TUNER_H_
+#include <base/cuda_config.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "tensor/tensor.h"
+namespace model {
+// Times the gemv launches of every weight shape and keeps the fastest one in the cuda config.
+// The winners are cached in a text file by the name of the gpu, so a later run on the same gpu
+// model only times the shapes it has not seen. One line of the file is
+// "<gpu name> <rows> <cols> <data type> <thread num> <row per block>"
+class MatmulTuner {
+ public:
+  explicit MatmulTuner(std::string cache_path = "");
+
+  // the weight of a fp32, fp16 or bf16 matmul on the cuda device
+  void tune(const tensor::Tensor& weight, kernel::CudaConfig* config);
+
+  // writes the launches of this gpu next to the cached ones of the other gpus
+  base::Status save() const;
+
+  size_t tuned_num() const;
+
+ private:
+  kernel::GemvLaunch time_launches(const tensor::Tensor& weight, cudaStream_t stream) const;
+
+ private:
+  std::string cache_path_;
+  std::string device_name_;
+  std::map<kernel::GemvShape, kernel::GemvLaunch> launches_;
+  std::vector<std::string> other_device_lines_;
+  size_t tuned_num_ = 0;
+};
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_MATMUL_TUNER_H_
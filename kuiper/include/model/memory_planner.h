@@ -0,0 +1,42 @@
+#ifndef KUIPER_INCLUDE_MODEL_MEMORY_PLANNER_H_
+#define KUIPER_INCLUDE_MODEL_MEMORY_PLANNER_H_
+#include <vector>
+#include "base/alloc.h"
+#include "tensor/tensor.h"
+namespace model {
+// Places the activations of one op sequence into a single arena. A tensor is live from the
+// step which writes it first to the step which reads it last, two tensors share memory when
+// their lifetimes do not overlap. The placement is greedy by size, which keeps the arena close
+// to the peak of the live bytes.
+class MemoryPlanner {
+ public:
+  int32_t add_tensor(base::DataType data_type, const std::vector<int32_t>& dims,
+                     int32_t first_step, int32_t last_step);
+
+  bool allocate(std::shared_ptr<base::DeviceAllocator> alloc);
+
+  // a view into the arena, valid while the planner is alive
+  tensor::Tensor get_tensor(int32_t tensor_id) const;
+
+  size_t arena_byte_size() const;
+
+  bool is_allocated() const;
+
+ private:
+  void plan();
+
+ private:
+  struct TensorInfo {
+    base::DataType data_type = base::DataType::kDataTypeUnknown;
+    std::vector<int32_t> dims;
+    int32_t first_step = 0;
+    int32_t last_step = 0;
+    size_t byte_size = 0;
+    size_t offset = 0;
+  };
+  std::vector<TensorInfo> tensors_;
+  size_t arena_byte_size_ = 0;
+  tensor::Tensor arena_;
+};
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_MEMORY_PLANNER_H_
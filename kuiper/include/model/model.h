@@ -1,17 +1,86 @@
 #ifndef KUIPER_INCLUDE_MODEL_MODEL_H_
 #define KUIPER_INCLUDE_MODEL_MODEL_H_
+#include <base/cuda_config.h>
 #include <op/embedding.h>
 #include <map>
 #include <string>
 #include "config.h"
+#include "execution_plan.h"
+#include "kv_cache.h"
+#include "lora_pool.h"
+#include "memory_planner.h"
 #include "op/encode.h"
 #include "op/layer.h"
+#include "op/matmul.h"
+#include "prefix_cache.h"
 #include "raw_model_data.h"
 #include "sampler/argmax_sampler.h"
+#include "sampler/logits_processor.h"
+#include "sampler/random_sampler.h"
 #include "sentencepiece_processor.h"
+#include "shared_weights.h"
+#include "weight_cache.h"
+#include "stream_decoder.h"
+#include "tensor_file.h"
+#include "tensor_parallel.h"
 #include "tensor/tensor.h"
+#include "weight_streamer.h"
 
 namespace model {
+// the tokens of several prompts one after another, the prompt i has the tokens in
+// [offsets[i], offsets[i + 1])
+struct TokenBatch {
+  std::vector<int32_t> tokens;
+  std::vector<int32_t> offsets{0};
+
+  int32_t size() const { return static_cast<int32_t>(offsets.size()) - 1; }
+
+  int32_t token_num(int32_t idx) const { return offsets.at(idx + 1) - offsets.at(idx); }
+
+  void push_back(const std::vector<int32_t>& prompt_tokens);
+};
+
+// the values of the stop reason slot of the device stop state
+enum class DeviceStopReason : int32_t {
+  kRunning = 0,
+  kStopSequence = 1,
+  kLength = 2,
+};
+
+// how embed reduces the normalized hidden states of the prompt positions
+enum class EmbeddingPooling : int32_t {
+  // one vector for every position
+  kNone = 0,
+  kMean = 1,
+  kLast = 2,
+};
+
+// The activations of the batched decode, planned once for the max batch size with the same
+// lifetimes as in prefill. A step binds the batch tensors to the first rows of the planned ones
+// and every sequence binds the row tensors to its row, the bindings after the first allocate
+// nothing
+struct BatchActivations {
+  std::unique_ptr<MemoryPlanner> planner;
+  int32_t max_batch_size = 0;
+  // rms_output, query, key, val, w1_output, w3_output and logits with max_batch_size rows
+  std::vector<tensor::Tensor> planned;
+
+  tensor::Tensor rms_output;
+  tensor::Tensor query;
+  tensor::Tensor key;
+  tensor::Tensor val;
+  tensor::Tensor w1_output;
+  tensor::Tensor w3_output;
+  tensor::Tensor logits;
+
+  // the position on the host and the rows of one sequence
+  tensor::Tensor pos_tensor;
+  tensor::Tensor query_row;
+  tensor::Tensor key_row;
+  tensor::Tensor val_row;
+  tensor::Tensor output_row;
+};
+
 class Model {
  public:
   explicit Model(base::TokenizerType tokenizer_type, base::ModelType model_type,
@@ -25,6 +94,262 @@ class Model {
   virtual base::Status forward(const tensor::Tensor& input, const tensor::Tensor& pos_tensor,
                                int& next) const = 0;
 
+  virtual base::Status prefill(const tensor::Tensor& input, const tensor::Tensor& pos_tensor,
+                               int& next, int32_t slot = 0) const = 0;
+
+  // writes the kv of the tokens like prefill but stops after the transformer layers, the final
+  // norm, the classifier and the sampler are skipped. For the chunks of a prompt before its last
+  // one, whose logits nobody reads
+  virtual base::Status prefill_kv(const tensor::Tensor& input, const tensor::Tensor& pos_tensor,
+                                  int32_t slot = 0) const = 0;
+
+  // runs the tokens like prefill but samples after every position, next.at(i) follows the
+  // token i of the input
+  virtual base::Status verify(const tensor::Tensor& input, const tensor::Tensor& pos_tensor,
+                              std::vector<int32_t>& next, int32_t slot = 0) const = 0;
+
+  // runs the tokens like prefill but stops after the final rmsnorm, the classifier is skipped
+  // and no logits are written. output gets the pooled [dim] vector, or [num_tokens, dim] for
+  // kNone, on the host
+  virtual base::Status embed(const tensor::Tensor& input, const tensor::Tensor& pos_tensor,
+                             EmbeddingPooling pooling, std::vector<float>& output,
+                             int32_t slot = 0) const = 0;
+
+  // embeds every prompt on its own from position 0 in slot, the kv of a prompt is released
+  // before the next one runs. outputs.at(i) is what embed puts out for the prompt i, the
+  // positions of one prompt are never pooled with the ones of another
+  base::Status embed_batch(const std::vector<std::vector<int32_t>>& prompts,
+                           EmbeddingPooling pooling, std::vector<std::vector<float>>& outputs,
+                           int32_t slot = 0) const;
+
+  // one decode step of every slot, a host copy of the [batch_size, vocab_size] logits is put in
+  // host_logits when it is given
+  virtual base::Status decode_batch(const tensor::Tensor& input,
+                                    const std::vector<int32_t>& slots,
+                                    const std::vector<int32_t>& positions,
+                                    std::vector<int32_t>& next,
+                                    std::vector<float>* host_logits = nullptr) const = 0;
+
+  // the decode steps of slot 0 keep the token and the position on the cuda device, token is the
+  // input of the step at pos, its kv cache is not written yet
+  virtual base::Status begin_device_decode(int32_t token, int32_t pos) const = 0;
+
+  // replays step_num decode steps from a cuda graph without a host write or a sync between
+  // them, the sampled tokens are appended to tokens up to a stop set by set_device_stop
+  base::Status decode_device(int32_t step_num, std::vector<int32_t>& tokens) const;
+
+  // queues step_num decode steps like decode_device and returns before they run, their tokens
+  // are copied to the host behind them. Further launches can be queued before the first one is
+  // waited for, so the gpu computes the next steps while the host handles the last ones, up to
+  // the sequence length of steps in all. The steps queued past a stop are computed for nothing
+  virtual base::Status launch_device_decode(int32_t step_num) const = 0;
+
+  // waits for the oldest launched steps and appends their tokens
+  base::Status wait_device_decode(std::vector<int32_t>& tokens) const;
+
+  // the launched steps which are not waited for
+  int32_t pending_device_decode_num() const;
+
+  // the decode steps on the device stop by themselves at one of the stop sequences, a stop token
+  // is a sequence of one, or after max_new_tokens sampled tokens, -1 for no limit. The steps
+  // queued behind a stop keep its token and position and append nothing, so the host launches
+  // steps ahead and only looks at device_stop_reason after a wait. It takes effect at the next
+  // begin_device_decode
+  base::Status set_device_stop(const std::vector<std::vector<int32_t>>& stop_sequences,
+                               int32_t max_new_tokens = -1);
+
+  // why the decode on the device stopped, as of the steps waited for
+  DeviceStopReason device_stop_reason() const;
+
+  void set_max_batch_size(int32_t max_batch_size);
+
+  int32_t max_batch_size() const;
+
+  int32_t seq_len() const;
+
+  void set_kv_cache_blocks(int32_t block_size, int32_t block_num);
+
+  void set_kv_cache_data_type(base::DataType data_type);
+
+  // the kv cache keeps the positions of every head together, so the attention reads them
+  // contiguously, on the cuda device the lanes of a warp share the loads of a position. It is
+  // not supported by the int8 cache and has to be set before init
+  void set_kv_cache_head_major(bool is_head_major);
+
+  // the kv cache blocks are only reserved and get their memory chunk_block_num blocks at a time
+  // as the sequences grow, a released sequence shrinks the cache down to keep_block_num blocks,
+  // it has to be set before init
+  void set_kv_cache_growth(int32_t chunk_block_num, int32_t keep_block_num = 0);
+
+  // the host buffers of the model input and output are page-locked on the cuda device, it has
+  // to be set before init
+  void set_pinned_memory(bool use_pinned_memory);
+
+  // at most device_budget_byte_size bytes of weights are kept on the cuda device, the
+  // transformer layers which do not fit are streamed in from the host one at a time, it has
+  // to be set before init
+  void set_weight_offload(size_t device_budget_byte_size);
+
+  // the cuda weights live in one allocation shared by the processes on the gpu, the owner
+  // exports it to handle_path at init and the others map it instead of uploading a copy of
+  // their own. The owner has to be initialized first, it has to be set before init
+  void set_shared_weights(const std::string& handle_path, bool is_owner);
+
+  // the fused cuda weights are kept in one image file at cache_path, an init with the same
+  // model file and gpu reads the image into the device instead of fusing and uploading the weights
+  // again, a missing or stale image is written at init. It has to be set before init
+  void set_weight_cache(const std::string& cache_path);
+
+  // the gemv launch of every weight shape is timed at init and the fastest one is used, the
+  // winners are cached in cache_path for the next run on the same gpu model, it has to be set
+  // before init
+  void set_matmul_tuning(bool use_matmul_tuning, const std::string& cache_path = "");
+
+  // the cpu threads are pinned to the numa nodes and the rows of every matmul weight are copied
+  // to the node whose threads compute them, it has to be set before init
+  void set_numa(bool use_numa);
+
+  // the int8 cuda weights are laid out in tiles of rows at init, so every warp of the int8 gemv
+  // streams one contiguous range with the scales next to it. It is on by default and has to be
+  // set before init
+  void set_weight_tiling(bool use_weight_tiling);
+
+  // the first gpu_layer_num transformer layers run on the cuda device and the others, with the
+  // final norm and the classifier, on the cpu. Every device keeps the kv cache of its own
+  // layers, the hidden state moves to the host once per step. It has to be set before init
+  void set_gpu_layer_num(int32_t gpu_layer_num);
+
+  // some of the transformer layers run on the cpu, the batched and the device decode need the
+  // whole model on the device
+  bool is_layer_split() const;
+
+  // the model runs as the rank of world_size processes, each one on the cuda device of its
+  // rank. The rank keeps 1 / world_size of the heads and of the feed forward, the embedding and
+  // the classifier are replicated. Rank 0 publishes the nccl id through id_path, the ranks
+  // block in init until all of them have joined. It has to be set before init
+  void set_tensor_parallel(int32_t rank, int32_t world_size, const std::string& id_path);
+
+  // the model has joined a tensor parallel group of more than one rank, it decodes one step
+  // at a time through predict
+  bool is_tensor_parallel() const;
+
+  // how the weight file is read into the host memory, it has to be set before init
+  void set_weight_load_options(const WeightLoadOptions& options);
+
+  // the decode step runs from an execution plan whose layers skip their tensor checks, the
+  // validation keeps the checks of every forward for debugging. It has to be set before init
+  void set_step_validation(bool validate_steps);
+
+  // Experimental. The decode step of slot 0 runs as one persistent cooperative kernel whose
+  // phases are the unfused ops of the plan with a grid barrier between two of them, so a step
+  // costs one launch instead of one per op. It needs an fp32 model on one cuda device with an
+  // fp32 token major kv cache, init fails otherwise. It has to be set before init
+  void set_megakernel(bool use_megakernel);
+
+  // replaces the rope scaling which the model file carries, for a model file without one or to
+  // stretch the context further. It has to be set before init
+  void set_rope_scaling(const base::RoPEScaling& scaling);
+
+  // the longest sequence the kv cache and the rope tables are sized for instead of the context
+  // of the model file, a context past the trained one needs a rope scaling. It has to be set
+  // before init
+  void set_max_seq_len(int32_t max_seq_len);
+
+  // every position attends the first sink_num positions and the window_size positions up to
+  // it, the kv cache keeps only those in a ring, so a sequence runs past the sequence length
+  // at the memory and the decode cost of the window. A prompt is written chunk_size rows at a
+  // time before they attend. It has to be set before init
+  void set_attention_window(int32_t sink_num, int32_t window_size, int32_t chunk_size = 64);
+
+  const base::AttentionWindow& attention_window() const;
+
+  // the positions a sequence can reach, the sequence length without an attention window
+  int32_t max_position() const;
+
+  int32_t kv_block_size() const;
+
+  int32_t free_kv_block_num() const;
+
+  // the blocks of the paged kv cache, the reserved ones of a growable cache included
+  int32_t kv_block_num() const;
+
+  void release_kv_cache(int32_t slot) const;
+
+  // the empty dst_slot shares the kv of the first token_num positions of src_slot, a shared
+  // block is copied when one of the slots writes into it
+  void fork_kv_cache(int32_t src_slot, int32_t dst_slot, int32_t token_num) const;
+
+  // drops the positions from token_num on, the rejected tokens of a speculative step
+  void truncate_kv_cache(int32_t slot, int32_t token_num) const;
+
+  // copies the kv of the first token_num positions of slot into the host memory of the
+  // snapshot, which write_file can put on the disk. The copies from the cuda device are queued
+  // on the stream of the model, so the slot can be released at once
+  base::Status save_kv_snapshot(int32_t slot, int32_t token_num, KVSnapshot& snapshot) const;
+
+  // fills the empty slot with the kv of a saved or mapped snapshot, the decode continues at
+  // snapshot.token_num() without a prefill of the history
+  base::Status restore_kv_snapshot(int32_t slot, const KVSnapshot& snapshot) const;
+
+  // save_kv_snapshot for a preempted sequence, the copies from the cuda device run on a stream
+  // of the lowest priority behind the steps queued so far, so they overlap the next steps. The
+  // blocks of the slot are read until snapshot.is_ready(), only then is it released
+  base::Status swap_out_kv(int32_t slot, int32_t token_num, KVSnapshot& snapshot) const;
+
+  // the host memory which a swap of the first token_num positions of a sequence takes
+  size_t kv_swap_byte_size(int32_t token_num) const;
+
+  // keeps up to max_block_num filled kv blocks of earlier prompts for reuse, it has to be set
+  // after init
+  void set_prefix_cache(int32_t max_block_num);
+
+  // shares the longest cached prefix of tokens into the empty slot and returns its token count,
+  // the prefill of the prompt starts at that position
+  int32_t match_prefix(const std::vector<int32_t>& tokens, int32_t slot = 0) const;
+
+  // caches the full kv blocks of slot, tokens are the ids whose kv is computed
+  void cache_prefix(const std::vector<int32_t>& tokens, int32_t slot = 0) const;
+
+  // evicts the cached prefix blocks no sequence uses until block_num blocks are free, false when
+  // they can not be freed
+  bool reclaim_kv_blocks(int32_t block_num) const;
+
+  // the single token decode steps on the cuda device are captured once and replayed
+  void set_cuda_graph(bool use_cuda_graph);
+
+  // Keeps up to adapter_num lora adapters of a rank up to max_rank resident on the device of
+  // the model, for the peft target modules of every transformer layer. The decode step runs the
+  // unfused projections then, and the megakernel, the layer split, the tensor parallel and the
+  // contexts are not supported. It has to be set before init
+  void set_lora_pool(int32_t adapter_num, int32_t max_rank,
+                     const std::vector<std::string>& target_modules = {
+                         "q_proj", "k_proj", "v_proj", "o_proj", "gate_proj", "up_proj",
+                         "down_proj"});
+
+  // reads the peft adapter in the directory path into the pool, after init
+  base::Status load_lora_adapter(const std::string& path, int32_t& adapter_id);
+
+  // frees the slot of the adapter in the pool, no sequence slot may still run it
+  base::Status unload_lora_adapter(int32_t adapter_id);
+
+  // the sequence slot runs the adapter from its next forward on, -1 runs the base model. The
+  // kv of a slot with an adapter is not shared with the prefix cache
+  base::Status set_slot_adapter(int32_t slot, int32_t adapter_id);
+
+  int32_t slot_adapter(int32_t slot) const;
+
+  // replaces the argmax sampler created by init
+  void set_sampler(std::unique_ptr<sampler::Sampler> sampler);
+
+  // The classifier of a step on the cuda device keeps only the largest logits the sampler draws
+  // from, the argmax or its top-k, and kForwardOutput is not written. A sampler which needs all
+  // the logits, a quant classifier and the megakernel keep the full logits
+  void set_fused_sampling(bool use_fused_sampling);
+
+  // the number of the candidates the classifier of the next step keeps, zero when it writes the
+  // full logits
+  int32_t fused_candidate_num() const;
+
   base::ModelType model_type() const;
 
   const std::string& token_path() const;
@@ -37,36 +362,232 @@ class Model {
 
   virtual bool is_sentence_ending(int32_t token_idx) const;
 
+  std::vector<int32_t> sentence_ending_tokens() const;
+
+  // the bytes of every token of the vocab, what a grammar compiles its token masks from
+  std::vector<std::string> vocab_bytes() const;
+
   virtual std::string decode(int32_t token_idx) const;
 
   virtual std::string decode(std::vector<int32_t> token_idxs) const;
 
+  // a decoder of one sequence which writes the text token by token
+  StreamDecoder stream_decoder() const;
+
   /////////////////////////////////////////////////////
   /////////////////////////////////////////////////////
   virtual std::vector<int32_t> encode(const std::string& sentence) const;
 
-  virtual std::pair<tensor::Tensor, tensor::Tensor> slice_kv_cache(int32_t layer_idx,
-                                                                   int32_t token_pos) const;
+  // tokenizes the sentences on the threads of the pool
+  TokenBatch encode_batch(const std::vector<std::string>& sentences) const;
 
-  virtual op::EmbeddingOutput embedding(const std::vector<int>& tokens) const = 0;
+  // the tokens and their embeddings in the input buffers of the model, valid until the next call
+  virtual const op::EmbeddingOutput& embedding(const std::vector<int>& tokens) const = 0;
 
-  virtual tensor::Tensor fill_input(const tensor::Tensor& pos_tensor,
-                                    const op::EmbeddingOutput& embedding_output,
-                                    bool is_prompt) const;
+  // an inference context of the initialized model for another thread. It shares the weights,
+  // the layer settings and the tokenizer, and has a kv cache, step buffers, positions, sampler
+  // and cuda stream of its own. The model has to outlive its contexts, which can not be made
+  // for streamed weights, a layer split or tensor parallelism
+  virtual base::Status create_context(std::unique_ptr<Model>& context) const = 0;
+
+  // the embeddings of all the prompts of the batch in rows of its token order. The tokens go to
+  // the device in one copy and one kernel looks them up, the model buffers are not touched
+  op::EmbeddingOutput embedding_batch(const TokenBatch& batch) const;
+
+  // the embedding row of the step as a tensor of the model which is bound again by every call,
+  // so the decode loop allocates nothing for its input
+  virtual const tensor::Tensor& fill_input(const tensor::Tensor& pos_tensor,
+                                           const op::EmbeddingOutput& embedding_output,
+                                           bool is_prompt) const;
 
  protected:
   virtual base::Status insert_buffer(ModelBufferType buffer_idx, const tensor::Tensor& tensor);
 
   virtual base::Status read_model_file();
 
+  // the config and the weight type of a legacy file, header_size is the byte size up to the
+  // first tensor
+  base::Status read_legacy_header(FILE* file, ModelConfig& config, size_t& header_size);
+
+  // the weight type of a tensor file, its header is authoritative over the quant flag given to
+  // the constructor
+  base::Status read_tensor_file_header(const TensorFileHeader& header);
+
+  // maps a gguf file and reads its config and tensors, the weight type follows the file
+  base::Status read_gguf_file(int32_t fd, size_t file_size);
+
+  // maps the shards of a huggingface safetensors checkpoint, a directory or a single file
+  base::Status read_safetensors_model();
+
   virtual base::Status create_encode_layer();
 
+  // the config, the options and the weight sources of the model which a context is made of
+  base::Status copy_context_from(const Model& model);
+
   virtual base::Status gen_model_from_file();
 
   virtual base::Status generate_model_infos(const ModelConfig& config) const;
 
+  virtual void init_kv_cache();
+
+  // reserves the positions up to end_pos and copies the shared blocks which the positions in
+  // [begin_pos, end_pos) are written to, evicts unused prefix blocks when the pool runs out
+  bool reserve_kv_cache(int32_t slot, int32_t begin_pos, int32_t end_pos) const;
+
   virtual int32_t post_processing(const tensor::Tensor& pos, bool is_prompt) const = 0;
 
+  // the row of a [rows, cols] tensor as a [cols] view
+  tensor::TensorView slice_row(const tensor::Tensor& tensor, int32_t row) const;
+
+  // the rows [row, row + row_num) of a [rows, cols] fp32 tensor, as a [row_num, cols] view
+  tensor::Tensor slice_rows(const tensor::Tensor& tensor, int32_t row, int32_t row_num) const;
+
+  // binds the tensors of the embedding output to the input buffers of token_num tokens
+  void bind_embedding_output(int32_t token_num) const;
+
+  // binds the batch activations to a batch of batch_size sequences, plans them on first use
+  bool bind_batch_activations(int32_t batch_size) const;
+
+  // copies the normalized [num_tokens, dim] hidden states to the host and pools them
+  void pool_hidden(const tensor::Tensor& hidden, EmbeddingPooling pooling,
+                   std::vector<float>& output, void* stream) const;
+
+  // the layers from the returned index on do not fit into the weight budget
+  int32_t resident_layer_num(size_t layer_byte_size, size_t shared_byte_size) const;
+
+  void stream_layer_weights(int32_t layer_idx, void* stream) const;
+
+  // times the matmuls whose weights are on the cuda device, before the cuda graph is captured
+  void tune_matmuls(const std::vector<std::shared_ptr<op::Layer>>& layers,
+                    kernel::CudaConfig* cuda_config) const;
+
+  // moves the cpu matmul weights out of the model file, every part of the rows into the memory
+  // of the numa node which runs it
+  void place_numa_weights(const std::vector<std::shared_ptr<op::Layer>>& layers) const;
+
+  // tiles the int8 cuda matmul weights, a fused weight is tiled once for all of its parts when
+  // every part starts on a tile and the other weights keep the row major layout
+  void tile_int8_weights(const std::vector<std::shared_ptr<op::Layer>>& layers,
+                         kernel::CudaConfig* cuda_config) const;
+
+  // checks the options against the tensor parallel and joins the group of the ranks, on the
+  // cuda device of the rank
+  base::Status init_tensor_parallel(base::DeviceType device_type);
+
+  // replaces the matmuls by the part of the rank, the output rows of the column parallel ones
+  // and the input columns of the row parallel ones, and shards the heads of the config
+  base::Status shard_tensor_parallel(
+      const std::vector<std::vector<std::shared_ptr<op::Layer>>*>& column_groups,
+      const std::vector<std::vector<std::shared_ptr<op::Layer>>*>& row_groups);
+
+  // sums the partial output of a row parallel matmul over the ranks, nothing without the
+  // tensor parallel
+  base::Status reduce_tensor_parallel(const tensor::Tensor& tensor, void* stream) const;
+
+  // the index of the first transformer layer on the cpu, the layer number when nothing is split
+  int32_t host_layer_begin() const;
+
+  // the cuda device reads the weights from the registered mapping of the model file
+  bool is_unified_memory() const;
+
+  bool is_host_layer(int32_t layer_idx) const;
+
+  base::DeviceType layer_device_type(int32_t layer_idx) const;
+
+  // the cache which holds the layer and the index of the layer in it
+  const PagedKVCache& layer_kv_cache(int32_t layer_idx) const;
+
+  int32_t kv_layer_idx(int32_t layer_idx) const;
+
+  // the buffer of the device which runs the layer
+  const tensor::Tensor& layer_buffer(int32_t layer_idx, ModelBufferType buffer_idx) const;
+
+  base::Status insert_host_buffer(ModelBufferType buffer_idx, const tensor::Tensor& tensor);
+
+  // the buffer of the device which runs the layer, nullptr when the model has none
+  const tensor::Tensor* find_layer_buffer(int32_t layer_idx, ModelBufferType buffer_idx) const;
+
+  // resolves the layer and the buffers of the node onto step
+  base::Status lower_graph_node(const GraphNode& node, const DecoderLayers& layers,
+                                PlanStep& step) const;
+
+  // builds the decoder graph of the config, fuses it as far as the layers and the kv caches
+  // allow and lowers it into the execution plan, after init_mem
+  base::Status build_decoder_plan(const DecoderLayers& layers, bool has_qkv_bias);
+
+  // turns the lowered plan into the steps of the megakernel, see set_megakernel
+  base::Status build_megakernel();
+
+  // checks the buffers of the matmuls in the plan once and turns off the checks of the
+  // planned layers unless the steps are validated
+  base::Status check_execution_plan();
+
+  // the decode step of slot 0, the logits are written to the forward output
+  void run_execution_plan(const tensor::Tensor& input, const tensor::Tensor& pos_tensor,
+                          void* stream) const;
+
+  // logits = classifier(input) into kForwardOutput, or only the candidates of the sampler into
+  // kClsCandidatesCUDA when the sampling is fused
+  void classify(const tensor::Tensor& input, void* stream) const;
+
+  // samples the output of classify into a device buffer without waiting for it, false when the
+  // sampler can only run on the host
+  bool sample_device(int32_t* output_idx, void* stream) const;
+
+  // samples the output of classify on the host
+  int32_t sample(void* stream) const;
+
+  // the next samples belong to the sequence in slot, a host position 0 starts a new one
+  void select_sampler_slot(int32_t slot, const tensor::Tensor& pos_tensor) const;
+
+  // the decode step of slot 0 in one launch of the megakernel, at the position on the device
+  // which pos_ptr points at or at pos when it is nullptr
+  void run_megakernel(const tensor::Tensor& input, const int32_t* pos_ptr, int32_t pos,
+                      void* stream) const;
+
+  // copies the hidden state of the last cuda layer to the host once the stream reaches it
+  void move_hidden_to_host(const tensor::Tensor& hidden, const tensor::Tensor& host_hidden,
+                           void* stream) const;
+
+  // points the quant layer at its weight in the model file and returns the bytes it takes, the
+  // weight is at pos of a legacy file or called name in the directory of a tensor file
+  size_t set_quant_weight(const std::shared_ptr<op::MatmulLayer>& layer,
+                          const std::vector<int32_t>& dims, size_t pos,
+                          const std::string& name) const;
+
+  // the tensor at pos of a legacy model file, or the one called name in the directory of a
+  // tensor file whose shape has to match dims
+  const void* model_weight(const std::string& name, size_t pos,
+                           const std::vector<int32_t>& dims) const;
+
+  // model_weight of the tensor called name in the transformer layer
+  const void* layer_weight(int32_t layer_idx, const char* name, size_t pos,
+                           const std::vector<int32_t>& dims) const;
+
+  base::Status forward_cuda_graph(const tensor::Tensor& input, const tensor::Tensor& pos_tensor,
+                                  bool is_prompt, kernel::CudaConfig* cuda_config,
+                                  int& next) const;
+
+  // the stream of the cuda kernels of the model, nullptr on the cpu
+  virtual void* cuda_stream() const = 0;
+
+  // the cuda config with the swap stream created, nullptr on the cpu or when it can not be
+  virtual kernel::CudaConfig* kv_swap_config() const = 0;
+
+  // looks up the embedding of the tokens, which are on the host or on the cuda device
+  virtual base::Status embedding_device(const tensor::Tensor& token_cu,
+                                        const tensor::Tensor& output) const = 0;
+
+  base::Status start_device_decode(int32_t token, int32_t pos,
+                                   kernel::CudaConfig* cuda_config) const;
+
+  // binds the adapters of the sequence slots to the rows of the next forwards, one slot gives
+  // its adapter to all the rows. Nothing without a lora pool, see LoraPool::bind for keep_rows
+  base::Status bind_lora_rows(const std::vector<int32_t>& slots, bool keep_rows,
+                              void* stream) const;
+
+  base::Status launch_device_graph(int32_t step_num, kernel::CudaConfig* cuda_config) const;
+
  private:
   virtual void init_mem() = 0;
 
@@ -80,15 +601,84 @@ class Model {
 
  protected:
   int32_t group_size_ = 1;
+  int32_t max_batch_size_ = 1;
+  int32_t kv_block_size_ = 16;
+  int32_t kv_block_num_ = 0;
+  base::DataType kv_data_type_ = base::DataType::kDataTypeFp32;
+  bool is_kv_head_major_ = false;
+  int32_t kv_chunk_block_num_ = 0;
+  int32_t kv_keep_block_num_ = 0;
+  bool use_cuda_graph_ = false;
+  bool use_pinned_memory_ = true;
+  size_t weight_device_budget_ = 0;
+  bool use_matmul_tuning_ = false;
+  std::string matmul_tuning_path_;
+  bool use_numa_ = false;
+  bool use_weight_tiling_ = true;
+  int32_t gpu_layer_num_ = -1;
+  WeightLoadOptions weight_load_options_;
+  bool validate_steps_ = false;
+  bool use_megakernel_ = false;
+  bool use_fused_sampling_ = false;
+  bool has_rope_scaling_ = false;
+  base::RoPEScaling rope_scaling_;
+  int32_t max_seq_len_ = 0;
+  base::AttentionWindow attention_window_;
+  int32_t tensor_parallel_rank_ = 0;
+  int32_t tensor_parallel_size_ = 1;
+  std::string tensor_parallel_id_path_;
+  std::unique_ptr<TensorParallelGroup> tensor_parallel_;
+  // the input columns of the row parallel matmuls of the rank, copied out of the model file
+  std::vector<std::vector<uint8_t>> tensor_parallel_weights_;
   bool is_quant_model_ = false;
+  bool is_int4_model_ = false;
+  bool is_fp8_model_ = false;
+  bool has_zero_point_ = false;
+  base::DataType weight_data_type_ = base::DataType::kDataTypeFp32;
   std::unique_ptr<TransformerConfig> config_;
 
   std::string token_path_;
   std::string model_path_;
-  std::unique_ptr<op::EncodeLayerBase> encode_layer_;
+  std::shared_ptr<op::EncodeLayerBase> encode_layer_;
   std::map<ModelBufferType, tensor::Tensor> buffers_;
+  std::unique_ptr<PagedKVCache> kv_cache_;
+  // the kv cache and the activations of the layers on the cpu in a split model
+  std::unique_ptr<PagedKVCache> host_kv_cache_;
+  std::unique_ptr<MemoryPlanner> host_activation_planner_;
+  std::map<ModelBufferType, tensor::Tensor> host_buffers_;
+  std::unique_ptr<PrefixCache> prefix_cache_;
+  std::unique_ptr<MemoryPlanner> activation_planner_;
+  std::unique_ptr<kernel::CudaGraph> cuda_graph_;
+  // the embedding, the forward, the sampler and the position advance of one decode step
+  std::unique_ptr<kernel::CudaGraph> device_graph_ = std::make_unique<kernel::CudaGraph>();
+  // the host copy of the position on the device after the launched steps, -1 before
+  // begin_device_decode
+  mutable int32_t device_pos_ = -1;
+  // the rows of the stop table, uploaded by begin_device_decode
+  std::vector<int32_t> device_stop_table_;
+  int32_t device_max_new_tokens_ = -1;
+  mutable DeviceStopReason device_stop_reason_ = DeviceStopReason::kRunning;
+  std::unique_ptr<kernel::CudaDecodeQueue> decode_queue_ =
+      std::make_unique<kernel::CudaDecodeQueue>();
+  std::unique_ptr<WeightStreamer> weight_streamer_;
+  std::unique_ptr<SharedWeights> shared_weights_;
+  std::unique_ptr<WeightCache> weight_cache_;
+  std::unique_ptr<LoraPool> lora_pool_;
+  // the adapter of every sequence slot, -1 for the base model
+  std::vector<int32_t> slot_adapters_;
+  // bound to the embedding row of every fill_input
+  mutable tensor::Tensor input_view_;
+  // bound to the input buffers by every embedding
+  mutable op::EmbeddingOutput embedding_output_;
+  // the input buffers of more than one token, they grow to the longest input
+  mutable tensor::Tensor prompt_tokens_;
+  mutable tensor::Tensor prompt_embeddings_;
+  mutable BatchActivations batch_activations_;
   std::unique_ptr<sampler::Sampler> sampler_;
   std::shared_ptr<RawModelData> raw_model_data_;
+  // empty for a legacy model file
+  TensorDirectory tensor_directory_;
+  ExecutionPlan execution_plan_;
   base::DeviceType device_type_ = base::DeviceType::kDeviceUnknown;
   base::ModelType model_type_ = base::ModelType::kModelTypeUnknown;
   base::TokenizerType tokenizer_type_ = base::TokenizerType::kEncodeUnknown;
@@ -0,0 +1,50 @@
+#ifndef KUIPER_INCLUDE_MODEL_PARALLEL_DECODER_H_
+#define KUIPER_INCLUDE_MODEL_PARALLEL_DECODER_H_
+#include <vector>
+#include "model.h"
+namespace model {
+struct Candidate {
+  // the end of the sentence is not included
+  std::vector<int32_t> tokens;
+  // the sum of the log probabilities of the tokens and of the end, only set by beam_search
+  float log_prob = 0.f;
+};
+
+// Decodes several continuations of one prompt as one batch. The prompt is prefilled once and the
+// other slots share its kv blocks, so the prefix is computed and stored once, and the kv cache
+// copies a shared block only when a branch writes into it. The decoder uses the slots the caller
+// gives it, which have to be distinct slots of the batch, and releases them at the end.
+class ParallelDecoder {
+ public:
+  explicit ParallelDecoder(const Model& model);
+
+  // one draw from the sampler of the model in every slot, the candidate i decodes in slots[i].
+  // Each one ends at the end of the sentence or after max_new_tokens tokens
+  base::Status sample(const std::vector<int32_t>& prompt_tokens,
+                      const std::vector<int32_t>& slots, int32_t max_new_tokens,
+                      std::vector<Candidate>& candidates);
+
+  // the slots.size() continuations with the highest log probability per token, best first. The
+  // search stops when slots.size() of them ended or after max_new_tokens tokens
+  base::Status beam_search(const std::vector<int32_t>& prompt_tokens,
+                           const std::vector<int32_t>& slots, int32_t max_new_tokens,
+                           std::vector<Candidate>& candidates);
+
+ private:
+  base::Status check_prompt(const std::vector<int32_t>& prompt_tokens,
+                            const std::vector<int32_t>& slots) const;
+
+  // prefills all but the last token of the prompt into the first slot and shares it into the
+  // next branch_num - 1 slots, the last token is the input of the first batched step of every
+  // branch
+  base::Status prefill_shared(const std::vector<int32_t>& prompt_tokens,
+                              const std::vector<int32_t>& slots, int32_t branch_num);
+
+  void release_slots(const std::vector<int32_t>& slots) const;
+
+ private:
+  const Model& model_;
+  tensor::Tensor pos_tensor_;
+};
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_PARALLEL_DECODER_H_
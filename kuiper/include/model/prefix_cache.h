@@ -0,0 +1,61 @@
+#ifndef KUIPER_INCLUDE_MODEL_PREFIX_CACHE_H_
+#define KUIPER_INCLUDE_MODEL_PREFIX_CACHE_H_
+#include <map>
+#include <memory>
+#include <vector>
+#include "kv_cache.h"
+namespace model {
+// Keeps the filled kv blocks of finished prompts in a radix tree whose edges are one block of
+// token ids, a later prompt with the same leading tokens shares the blocks instead of computing
+// them again. The cache holds a reference on every block of the tree, the blocks no sequence
+// uses any more are evicted in least recently used order.
+class PrefixCache {
+ public:
+  explicit PrefixCache(PagedKVCache* kv_cache, int32_t max_block_num);
+
+  ~PrefixCache();
+
+  PrefixCache(const PrefixCache&) = delete;
+
+  PrefixCache& operator=(const PrefixCache&) = delete;
+
+  // shares the blocks of the longest cached prefix into the empty slot and returns its token
+  // count, the prefill starts at that position. The last token of the prompt is never matched,
+  // its logits are needed to sample the first output.
+  int32_t match(const std::vector<int32_t>& tokens, int32_t slot);
+
+  // adds the full blocks of slot to the tree, tokens are the ids whose kv is in the slot
+  void insert(const std::vector<int32_t>& tokens, int32_t slot);
+
+  // evicts unused blocks until the kv cache has block_num free blocks, false when it can not
+  bool evict(int32_t block_num);
+
+  int32_t cached_block_num() const;
+
+ private:
+  struct Node {
+    std::vector<int32_t> tokens;
+    int32_t block = -1;
+    uint64_t last_access = 0;
+    Node* parent = nullptr;
+    std::map<std::vector<int32_t>, std::unique_ptr<Node>> children;
+  };
+
+  // a leaf whose block is held by the cache alone
+  bool is_evictable(const Node* node) const;
+
+  Node* oldest_evictable(Node* node) const;
+
+  bool evict_one();
+
+  void release_tree(Node* node);
+
+ private:
+  PagedKVCache* kv_cache_ = nullptr;
+  int32_t max_block_num_ = 0;
+  int32_t cached_block_num_ = 0;
+  uint64_t access_tick_ = 0;
+  Node root_;
+};
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_PREFIX_CACHE_H_
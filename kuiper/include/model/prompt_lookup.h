@@ -0,0 +1,30 @@
+#ifndef KUIPER_INCLUDE_MODEL_PROMPT_LOOKUP_H_
+#define KUIPER_INCLUDE_MODEL_PROMPT_LOOKUP_H_
+#include <vector>
+#include "model/speculative.h"
+namespace model {
+// the tokens which followed the latest earlier occurrence of the longest suffix of history, of
+// max_ngram down to min_ngram tokens, at most draft_len of them. Empty when no suffix recurs
+std::vector<int32_t> lookup_ngram_draft(const std::vector<int32_t>& history, int32_t min_ngram,
+                                        int32_t max_ngram, int32_t draft_len);
+
+// Greedy speculative decoding without a draft model. The proposal is copied from an n-gram
+// match against the prompt and the generated tokens, the model scores it in a single
+// prefill-like pass, and the agreeing prefix advances the position in one go together with the
+// model's own next token. A step without a match decodes one token the same way. The output is
+// the one of the greedy decode of the model alone.
+class PromptLookupDecoder : public DraftVerifyDecoder {
+ public:
+  explicit PromptLookupDecoder(const Model& model, int32_t draft_len, int32_t min_ngram = 1,
+                               int32_t max_ngram = 3);
+
+ protected:
+  base::Status propose(const std::vector<int32_t>& history, int32_t pos, int32_t max_len,
+                       std::vector<int32_t>& draft) override;
+
+ private:
+  int32_t min_ngram_ = 0;
+  int32_t max_ngram_ = 0;
+};
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_PROMPT_LOOKUP_H_
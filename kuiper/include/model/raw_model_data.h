@@ -2,13 +2,48 @@
 #define RAW_MODEL_DATA_H
 #include <cstddef>
 #include <cstdint>
+#include <memory>
+#include <vector>
 namespace model {
+// how the weight file is brought into the host memory, the default is a lazy private mapping
+// which faults the pages in at their first read
+struct WeightLoadOptions {
+  // every page of the file is read in at load time, so the first step does not fault
+  bool populate = false;
+  // the file is copied into an anonymous region aligned to the transparent huge pages, which
+  // cuts the tlb misses of the cpu matmuls. The copy implies populate
+  bool huge_page = false;
+  // the pages are locked in the memory, the lock is skipped with a warning when the memlock
+  // limit of the process is too small
+  bool lock = false;
+  // the mapping is registered with the cuda device and the weights are read from it in place
+  // instead of being copied into device allocations, for the integrated gpus which share the
+  // dram with the cpu. The registration pins the pages
+  bool unified_memory = false;
+};
+
+// the kernels load the weights in 16 byte vectors, the weights of a registered mapping at other
+// addresses are copied into device allocations
+constexpr size_t kDeviceWeightAlignment = 16;
+
 struct RawModelData {
   ~RawModelData();
   int32_t fd = -1;
   size_t file_size = 0;
+  // the length of the region at data, a huge page copy is rounded up to whole huge pages
+  size_t map_size = 0;
   void* data = nullptr;
   void* weight_data = nullptr;
+  // the address of data on the cuda device when the mapping is registered with it
+  void* device_data = nullptr;
+
+  // maps the file_size bytes of fd to data, false when the file can not be mapped or read
+  bool map(const WeightLoadOptions& options);
+
+  // the device address of the byte_size bytes at host_ptr, nullptr when they are not in a
+  // registered mapping or not aligned to kDeviceWeightAlignment, like the weights after the
+  // config of an fp32 file or the 8 byte aligned tensors of safetensors
+  virtual void* device_ptr(const void* host_ptr, size_t byte_size) const;
 
   virtual const void* weight(size_t offset) const = 0;
 };
@@ -21,5 +56,26 @@ struct RawModelDataInt8 : RawModelData {
   const void* weight(size_t offset) const override;
 };
 
+// the offset counts 16 bit values, of a fp16 or a bf16 model file
+struct RawModelDataFp16 : RawModelData {
+  const void* weight(size_t offset) const override;
+};
+
+// a mapped gguf file, the offset counts bytes. The tensors whose block layout the matmul
+// kernels do not read are converted at load and kept in converted
+struct RawModelDataGguf : RawModelData {
+  const void* weight(size_t offset) const override;
+
+  std::vector<std::vector<uint8_t>> converted;
+};
+
+// the shards of a safetensors model, each one is mapped on its own and the tensors of the
+// directory point into them or into converted
+struct RawModelDataSafetensors : RawModelDataGguf {
+  void* device_ptr(const void* host_ptr, size_t byte_size) const override;
+
+  std::vector<std::unique_ptr<RawModelDataGguf>> shards;
+};
+
 }  // namespace model
 #endif  // RAW_MODEL_DATA_H
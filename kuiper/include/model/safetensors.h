@@ -0,0 +1,54 @@
+#ifndef KUIPER_INCLUDE_MODEL_SAFETENSORS_H_
+#define KUIPER_INCLUDE_MODEL_SAFETENSORS_H_
+#include <base/base.h>
+#include <string>
+#include <vector>
+#include "config.h"
+#include "raw_model_data.h"
+#include "tensor_file.h"
+namespace model {
+// the context of a safetensors model is cut to this length, the kv cache is sized by it
+constexpr int32_t kSafetensorsMaxSeqLen = 8192;
+
+struct SafetensorsTensor {
+  std::string name;
+  base::DataType data_type = base::DataType::kDataTypeUnknown;
+  std::vector<int32_t> dims;
+  // from the start of the shard
+  size_t offset = 0;
+  size_t byte_size = 0;
+};
+
+// reads the json header of the safetensors shard mapped at data, the tensors of a type other
+// than F32, F16, BF16 and I32 are kept with an unknown data type
+base::Status parse_safetensors(const void* data, size_t file_size,
+                               std::vector<SafetensorsTensor>& tensors);
+
+struct SafetensorsModelInfo {
+  ModelConfig config;
+  base::DataType weight_data_type = base::DataType::kDataTypeFp32;
+  // the matmul weights of an autogptq or autoawq checkpoint are int4 groups with zero points
+  bool is_int4 = false;
+  int32_t group_size = 0;
+  float rope_theta = kDefaultRoPETheta;
+  // the huggingface checkpoints keep the halves of the heads for the rope
+  bool is_rope_rotate_half = true;
+  base::RoPEScaling rope_scaling;
+};
+
+// true when path is a directory or a file with the .safetensors suffix
+bool is_safetensors_path(const std::string& path);
+
+// Maps the shards of the huggingface checkpoint at path, a directory with a config.json and
+// its *.safetensors files or a single file next to its config.json, and adds their tensors
+// to directory under the names which tools/export.py writes. The shards are mapped and parsed
+// in parallel. The weight type follows the first query weight, a tensor of that type is viewed
+// in the shard in place and the others are converted into raw_data.converted. A qwen2 model
+// is loaded as fp32. The 4 bit gptq and awq checkpoints, named by the quantization_config of
+// their config.json, are repacked into the int4 groups of MatmulLayer with their zero points,
+// an act order weight gets the order of its input next to it, see repack_int4_weight
+base::Status load_safetensors_model(const std::string& path, const WeightLoadOptions& options,
+                                    RawModelDataSafetensors& raw_data, TensorDirectory& directory,
+                                    SafetensorsModelInfo& info);
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_SAFETENSORS_H_
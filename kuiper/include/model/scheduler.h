@@ -0,0 +1,133 @@
+#ifndef KUIPER_INCLUDE_MODEL_SCHEDULER_H_
+#define KUIPER_INCLUDE_MODEL_SCHEDULER_H_
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "model.h"
+namespace model {
+struct Sequence {
+  int32_t seq_id = -1;
+  int32_t slot = -1;
+  // the position of the next token to be written into the kv cache, the sequence decodes once the
+  // chunks of its prompt reach prefill_len
+  int32_t pos = 0;
+  // the prompt length, a sequence preempted without a swap prefills its outputs again as well
+  int32_t prefill_len = 0;
+  int32_t next_token = -1;
+  int32_t max_new_tokens = 0;
+  // the end of the sentence is an output token like the others, every sequence then decodes
+  // max_new_tokens tokens, which a benchmark needs for fixed output lengths
+  bool ignore_eos = false;
+  bool is_cancelled = false;
+  // a prefill of the prompt failed, the sequence is handed back with the finished ones
+  bool is_failed = false;
+  std::vector<int32_t> prompt_tokens;
+  std::vector<int32_t> output_tokens;
+  // the kv of a preempted sequence in the host memory until it runs again
+  std::shared_ptr<KVSnapshot> swapped_kv;
+};
+
+// Keeps a running batch of sequences on one model instance. Sequences are admitted into a free
+// slot when the paged kv cache has room for them and retired as soon as they finish, so the
+// batch changes at token granularity and every step runs a single batched decode over all the
+// running sequences.
+//
+// With a prefill chunk size a long prompt is written in chunks over several steps, and a step
+// token budget bounds the prompt tokens of a step together with its decodes, so a long prompt
+// never stalls the decodes of the other sequences for more than one chunk.
+//
+// When the running sequences outgrow the kv cache the latest admitted ones are preempted. With a
+// host swap budget their kv is copied to the host memory while the next steps run and their
+// blocks are freed once the copy is done, they are swapped back in before any waiting sequence
+// is admitted. Without one, or when the budget is taken, the kv is dropped and prefilled again.
+class Scheduler {
+ public:
+  // called with the seq id of a sequence for every token added to its output
+  using TokenCallback = std::function<void(int32_t, int32_t)>;
+
+  explicit Scheduler(const Model& model);
+
+  int32_t add_sequence(const std::vector<int32_t>& prompt_tokens, int32_t max_new_tokens,
+                       bool ignore_eos = false);
+
+  void set_token_callback(TokenCallback callback);
+
+  // the most prompt tokens of one sequence in a step, 0 prefills the whole prompt at once
+  void set_prefill_chunk_size(int32_t chunk_size);
+
+  // the most tokens of a step, the decodes of the running sequences count first and the chunks
+  // of the prompts take the rest, 0 is no limit
+  void set_step_token_budget(int32_t token_budget);
+
+  // the host memory which the kv of the preempted sequences may take, a sequence whose kv does
+  // not fit into the rest of it is prefilled again, 0 prefills them all again
+  void set_host_kv_swap(size_t max_byte_size);
+
+  // a waiting or swapped sequence is finished at once, a running one at the end of the next
+  // step. Returns false when the sequence is not scheduled
+  bool cancel(int32_t seq_id);
+
+  // one step of the batch, it also updates the process metrics, see base::MetricsRegistry
+  base::Status step();
+
+  bool has_unfinished() const;
+
+  int32_t running_size() const;
+
+  int32_t waiting_size() const;
+
+  std::vector<Sequence> pop_finished();
+
+ private:
+  base::Status admit_waiting();
+
+  // the swapped sequences first, false when the oldest one does not fit yet
+  bool admit_swapped();
+
+  // the blocks which a sequence with the kv of its first token_num positions takes to decode
+  int32_t admit_block_num(const Sequence& seq, int32_t token_num) const;
+
+  // moves the sequences whose kv is on the host to swapped_ and frees their slots
+  void finish_swaps();
+
+  // preempts the latest running sequences until the next step has the blocks it writes
+  void preempt_for_growth();
+
+  void preempt(Sequence seq);
+
+  // prefills the next chunks of the prompts in the order of admission within token_budget
+  base::Status prefill_chunks(int32_t token_budget);
+
+  // the blocks which the prompts in their prefill still take
+  int32_t pending_block_num() const;
+
+  bool is_finished(const Sequence& seq) const;
+
+  void retire_finished();
+
+  void add_output(Sequence& seq);
+
+  // admits, prefills and decodes, the batch size is the number of decoded sequences
+  base::Status step_batch(int32_t& batch_size);
+
+  void update_metrics(int32_t batch_size) const;
+
+ private:
+  const Model& model_;
+  int32_t next_seq_id_ = 0;
+  int32_t prefill_chunk_size_ = 0;
+  int32_t step_token_budget_ = 0;
+  size_t max_swap_byte_size_ = 0;
+  size_t swap_byte_size_ = 0;
+  std::vector<int32_t> free_slots_;
+  std::deque<Sequence> waiting_;
+  std::vector<Sequence> running_;
+  // the sequences whose kv is still copied to the host, they keep their slots and blocks
+  std::vector<Sequence> swapping_;
+  std::deque<Sequence> swapped_;
+  std::vector<Sequence> finished_;
+  TokenCallback token_callback_;
+};
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_SCHEDULER_H_
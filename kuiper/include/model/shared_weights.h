@@ -0,0 +1,70 @@
+#ifndef KUIPER_INCLUDE_MODEL_SHARED_WEIGHTS_H_
+#define KUIPER_INCLUDE_MODEL_SHARED_WEIGHTS_H_
+#include <cuda_runtime_api.h>
+#include <string>
+#include <vector>
+#include "op/layer.h"
+#include "tensor/tensor.h"
+namespace model {
+// The weights of a set of layers placed one after another in one allocation. A tensor which lies
+// in another one, a part of a fused weight, is placed with that root, and the roots are laid out
+// in the order of the layers, so every process which builds the same layers gets the same
+// offsets
+struct WeightLayout {
+  struct Range {
+    tensor::Tensor* tensor = nullptr;
+    const int8_t* begin = nullptr;
+    size_t byte_size = 0;
+    int32_t root = -1;
+    size_t root_offset = 0;
+  };
+
+  // the weights of the layers still have to be in the cpu memory
+  base::Status build(const std::vector<std::shared_ptr<op::Layer>>& layers);
+
+  // points every tensor into the cuda allocation at ptr
+  void assign(void* ptr) const;
+
+  std::vector<Range> ranges;
+  // the indices of the root ranges and their offsets in the allocation
+  std::vector<size_t> roots;
+  std::vector<size_t> root_offsets;
+  size_t byte_size = 0;
+};
+
+// Places the weights of a model in one device allocation which the other processes on the gpu
+// map through cuda ipc. The owner uploads the weights and writes the ipc handle to a file, the
+// other processes open the handle and point their weight tensors into the allocation without a
+// copy. Every process has to build the same layers from the same model file, and the owner has
+// to outlive the processes which attached to it.
+class SharedWeights {
+ public:
+  explicit SharedWeights(std::string handle_path, bool is_owner);
+
+  ~SharedWeights();
+
+  SharedWeights(const SharedWeights&) = delete;
+
+  SharedWeights& operator=(const SharedWeights&) = delete;
+
+  // moves the weights of the layers, which are still in the cpu memory, into the shared
+  // allocation, the layers have to be listed in the same order in every process
+  base::Status bind(const std::vector<std::shared_ptr<op::Layer>>& layers);
+
+  bool is_owner() const;
+
+  size_t byte_size() const;
+
+ private:
+  base::Status export_handle() const;
+
+  base::Status open_handle();
+
+ private:
+  std::string handle_path_;
+  bool is_owner_ = false;
+  size_t byte_size_ = 0;
+  void* ptr_ = nullptr;
+};
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_SHARED_WEIGHTS_H_
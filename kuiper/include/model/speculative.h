@@ -0,0 +1,75 @@
+#ifndef KUIPER_INCLUDE_MODEL_SPECULATIVE_H_
+#define KUIPER_INCLUDE_MODEL_SPECULATIVE_H_
+#include <vector>
+#include "model.h"
+namespace model {
+// The draft, verify and accept loop of greedy speculative decoding. A subclass proposes the
+// tokens which follow the committed ones, the target model scores all of them in a single
+// prefill-like pass, and the longest prefix the target agrees with is kept together with the
+// target's own next token. The output is the one the target model would produce alone.
+class DraftVerifyDecoder {
+ public:
+  virtual ~DraftVerifyDecoder() = default;
+
+  // at most max_new_tokens tokens, fewer when the target samples an ending token or the
+  // sequence is full
+  base::Status generate(const std::vector<int32_t>& prompt_tokens, int32_t max_new_tokens,
+                        std::vector<int32_t>& output_tokens);
+
+  int64_t proposed_num() const;
+
+  int64_t accepted_num() const;
+
+ protected:
+  explicit DraftVerifyDecoder(const Model& target, int32_t draft_len);
+
+  // the positions the proposals and the verify passes may reach
+  virtual int32_t seq_len() const;
+
+  // called before the target prefills the prompt
+  virtual base::Status begin(const std::vector<int32_t>& prompt_tokens);
+
+  // at most max_len tokens which follow history, the last token of history is at pos
+  virtual base::Status propose(const std::vector<int32_t>& history, int32_t pos,
+                               int32_t max_len, std::vector<int32_t>& draft) = 0;
+
+  // proposal is the token at pos and the draft which follows it, of which the target accepted
+  // the first accept_num tokens
+  virtual base::Status accept(const std::vector<int32_t>& proposal, int32_t pos,
+                              int32_t accept_num);
+
+ protected:
+  const Model& target_;
+  int32_t draft_len_ = 0;
+  tensor::Tensor pos_tensor_;
+
+ private:
+  int64_t proposed_num_ = 0;
+  int64_t accepted_num_ = 0;
+};
+
+// Greedy speculative decoding with two models sharing one tokenizer. The draft model proposes
+// draft_len tokens one at a time.
+class SpeculativeDecoder : public DraftVerifyDecoder {
+ public:
+  explicit SpeculativeDecoder(const Model& draft, const Model& target, int32_t draft_len);
+
+ protected:
+  int32_t seq_len() const override;
+
+  base::Status begin(const std::vector<int32_t>& prompt_tokens) override;
+
+  base::Status propose(const std::vector<int32_t>& history, int32_t pos, int32_t max_len,
+                       std::vector<int32_t>& draft) override;
+
+  base::Status accept(const std::vector<int32_t>& proposal, int32_t pos,
+                      int32_t accept_num) override;
+
+ private:
+  base::Status draft_step(int32_t token, int32_t pos, int32_t& next) const;
+
+ private:
+  const Model& draft_;
+};
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_SPECULATIVE_H_
@@ -0,0 +1,39 @@
+#ifndef KUIPER_INCLUDE_MODEL_STREAM_DECODER_H_
+#define KUIPER_INCLUDE_MODEL_STREAM_DECODER_H_
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+namespace model {
+// Decodes the tokens of one sequence one at a time, push returns only the text the token
+// completes. The bytes of a character which is split over tokens, the byte fallback pieces of
+// sentencepiece or the byte level tokens of bpe, are held back until its last byte arrives, so
+// a token costs the length of its own bytes and never a decode of the history
+class StreamDecoder {
+ public:
+  // the bytes a token adds to the text, is_first when nothing has been decoded before it
+  using TokenBytesFunc = std::function<std::string(int32_t, bool)>;
+
+  explicit StreamDecoder(TokenBytesFunc token_bytes);
+
+  std::string push(int32_t token);
+
+  std::string push(const std::vector<int32_t>& tokens);
+
+  // the held back bytes of an unfinished character are written as one U+FFFD
+  std::string finish();
+
+  // starts a new sequence
+  void reset();
+
+ private:
+  TokenBytesFunc token_bytes_;
+  std::string pending_;
+  bool is_first_ = true;
+};
+
+// the length of the prefix of text which ends on a complete utf-8 character, the bytes after it
+// are the beginning of a character. An invalid byte counts as a character of its own
+size_t utf8_complete_size(const std::string& text);
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_STREAM_DECODER_H_
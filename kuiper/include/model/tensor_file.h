@@ -0,0 +1,86 @@
+#ifndef KUIPER_INCLUDE_MODEL_TENSOR_FILE_H_
+#define KUIPER_INCLUDE_MODEL_TENSOR_FILE_H_
+#include <base/base.h>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "config.h"
+namespace model {
+// The versioned model file of tools/export.py --version 6. A fixed header is followed by a
+// directory with one entry per tensor and the tensors themselves, every tensor starts on a
+// 4KB boundary of the file so it can be viewed in place by the loader or read with O_DIRECT.
+// "KTF1"
+constexpr int32_t kTensorFileMagic = 0x3146544b;
+constexpr int32_t kTensorFileVersion = 1;
+constexpr size_t kTensorFileAlignment = 4096;
+constexpr int32_t kTensorFileMaxDims = 4;
+constexpr int32_t kTensorFileNameSize = 80;
+// the matmul weights are int4 groups, otherwise int8 groups when the weight type is int8
+constexpr int32_t kTensorFileInt4Flag = 1;
+constexpr int32_t kTensorFileZeroPointFlag = 2;
+
+struct TensorFileHeader {
+  int32_t magic = kTensorFileMagic;
+  int32_t version = kTensorFileVersion;
+  ModelConfig config;
+  // the base::DataType of the matmul weights, a quant file keeps its other tensors in fp32
+  int32_t weight_data_type = 0;
+  int32_t group_size = 0;
+  int32_t flags = 0;
+  int32_t tensor_num = 0;
+  int32_t reserved[3] = {0, 0, 0};
+};
+static_assert(sizeof(TensorFileHeader) == 64, "the header of the tensor file is 64 bytes");
+
+struct TensorFileEntry {
+  char name[kTensorFileNameSize] = {};
+  // the base::DataType of the elements, a quant matmul is int8, or packed int4 with the int4
+  // flag, and its byte_size takes in the scales and zero points behind the weight
+  int32_t data_type = 0;
+  int32_t dim_num = 0;
+  int32_t dims[kTensorFileMaxDims] = {0, 0, 0, 0};
+  int64_t offset = 0;
+  int64_t byte_size = 0;
+  int32_t reserved[2] = {0, 0};
+};
+static_assert(sizeof(TensorFileEntry) == 128, "a directory entry of the tensor file is 128 bytes");
+
+struct TensorInfo {
+  base::DataType data_type = base::DataType::kDataTypeUnknown;
+  std::vector<int32_t> dims;
+  size_t offset = 0;
+  size_t byte_size = 0;
+  // a tensor converted at load lives outside of the mapped file, the offset is unused then
+  const void* data = nullptr;
+
+  size_t size() const;
+};
+
+class TensorDirectory {
+ public:
+  // reads the header and the directory from the start of file, is_tensor_file is false and
+  // nothing is read when the file is a legacy one which starts with its config. The bounds and
+  // the alignment of every tensor are checked against file_size
+  base::Status read(FILE* file, size_t file_size, bool& is_tensor_file);
+
+  const TensorFileHeader& header() const;
+
+  // nullptr when the file has no tensor with the name
+  const TensorInfo* find(const std::string& name) const;
+
+  bool empty() const;
+
+  // adds a tensor of a file format whose directory is read elsewhere, false when the name is
+  // taken already
+  bool add(const std::string& name, TensorInfo info);
+
+ private:
+  TensorFileHeader header_;
+  std::unordered_map<std::string, TensorInfo> tensors_;
+};
+
+// "layers.<layer_idx>.<name>", the name of a transformer layer tensor in the directory
+std::string layer_tensor_name(int32_t layer_idx, const char* name);
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_TENSOR_FILE_H_
@@ -0,0 +1,58 @@
+#ifndef KUIPER_INCLUDE_MODEL_TENSOR_PARALLEL_H_
+#define KUIPER_INCLUDE_MODEL_TENSOR_PARALLEL_H_
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "base/base.h"
+#include "tensor/tensor.h"
+namespace model {
+// the part [begin, begin + size) of a dimension which a rank keeps
+struct ShardRange {
+  int32_t begin = 0;
+  int32_t size = 0;
+};
+
+// the equal part of dim of the rank, dim has to be divisible by the world size
+ShardRange shard_range(int32_t dim, int32_t rank, int32_t world_size);
+
+// copies the columns of the range out of a row major [rows, cols] matrix whose elements take
+// element_size bytes
+std::vector<uint8_t> slice_columns(const void* data, int32_t rows, int32_t cols,
+                                   size_t element_size, const ShardRange& range);
+
+// The ranks of a tensor parallel model, one process per cuda device. Every rank keeps its part
+// of the heads and of the feed forward, and the partial outputs of the attention and of the
+// feed forward are summed over an nccl communicator. Rank 0 writes the nccl id to id_path and
+// the other ranks wait for it, every rank removes the file as soon as the communicator is joined
+class TensorParallelGroup {
+ public:
+  ~TensorParallelGroup();
+
+  TensorParallelGroup(const TensorParallelGroup&) = delete;
+
+  TensorParallelGroup& operator=(const TensorParallelGroup&) = delete;
+
+  // joins the communicator of world_size ranks on the current cuda device, it blocks until
+  // every rank has joined
+  static base::Status create(int32_t rank, int32_t world_size, const std::string& id_path,
+                             std::unique_ptr<TensorParallelGroup>& group);
+
+  int32_t rank() const;
+
+  int32_t world_size() const;
+
+  // sums the fp32 tensor on the cuda device over the ranks in place, in the order of stream
+  base::Status all_reduce(const tensor::Tensor& tensor, void* stream) const;
+
+ private:
+  TensorParallelGroup(int32_t rank, int32_t world_size);
+
+ private:
+  int32_t rank_ = 0;
+  int32_t world_size_ = 1;
+  // the nccl communicator
+  void* comm_ = nullptr;
+};
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_TENSOR_PARALLEL_H_
@@ -0,0 +1,152 @@
+#ifndef KUIPER_INCLUDE_MODEL_TRANSFORMER_H_
+#define KUIPER_INCLUDE_MODEL_TRANSFORMER_H_
+#include <base/cuda_config.h>
+#include "model.h"
+#include "op/add.h"
+#include "op/embedding.h"
+#include "op/rope.h"
+#include "op/swiglu.h"
+namespace model {
+
+// the layers of a llama style decoder, the same for every model which TransformerModel runs
+struct TransformerLayers {
+  std::shared_ptr<op::Layer> add_layer_;
+  std::shared_ptr<op::Layer> rope_layer_;
+  std::shared_ptr<op::Layer> swiglu_layer_;
+  std::shared_ptr<op::Layer> mha_layer_;
+
+  std::vector<std::shared_ptr<op::Layer>> wq_layers_;
+  std::vector<std::shared_ptr<op::Layer>> wk_layers_;
+  std::vector<std::shared_ptr<op::Layer>> wv_layers_;
+  // wq, wk and wv packed into one [dim + 2 * kv_dim, dim] weight, the three layers above are
+  // views into it
+  std::vector<std::shared_ptr<op::Layer>> wqkv_layers_;
+  std::vector<std::shared_ptr<op::Layer>> wo_layers_;
+
+  std::vector<std::shared_ptr<op::Layer>> w1_layers_;
+  std::vector<std::shared_ptr<op::Layer>> w2_layers_;
+  std::vector<std::shared_ptr<op::Layer>> rmsnorm_layers_;
+  std::vector<std::shared_ptr<op::Layer>> w3_layers_;
+  // w1 and w3 packed into one [2 * hidden_dim, dim] weight with a swiglu output
+  std::vector<std::shared_ptr<op::Layer>> w13_layers_;
+  std::shared_ptr<op::Layer> cls_layer_;
+
+  std::shared_ptr<op::Layer> embedding_layer_;
+
+  // the layers without weights of the transformer layers which a split model runs on the cpu
+  std::shared_ptr<op::Layer> cpu_add_layer_;
+  std::shared_ptr<op::Layer> cpu_rope_layer_;
+  std::shared_ptr<op::Layer> cpu_swiglu_layer_;
+  std::shared_ptr<op::Layer> cpu_mha_layer_;
+
+  // the transformer layers from resident_layer_num on are left in the host memory, the weights
+  // in the registered mapping of mapped_data are read by the device in place
+  void to_cuda(std::shared_ptr<kernel::CudaConfig> config, int32_t resident_layer_num,
+               const RawModelData* mapped_data = nullptr);
+
+  // the layers run on the cuda device, their weights are left where they are
+  void set_cuda_config(std::shared_ptr<kernel::CudaConfig> config);
+
+  // the layers with weights, in the same order in every process
+  std::vector<std::shared_ptr<op::Layer>> param_layers() const;
+
+  // layers of their own which share the weights of these ones
+  std::unique_ptr<TransformerLayers> clone() const;
+};
+
+// The prefill, decode, batch, verify and embedding pipeline of the llama style decoders. The
+// models differ in how their weights are read: a model with has_qkv_bias reads a bias after
+// each of the wq, wk and wv weights of its fp32 file, the quant files carry no biases
+class TransformerModel : public Model {
+ public:
+  base::Status init(base::DeviceType device_type) override;
+
+  base::Status predict(const tensor::Tensor& input, const tensor::Tensor& pos_tensor,
+                       bool is_prompt, int& next) const override;
+
+  base::Status forward(const tensor::Tensor& input, const tensor::Tensor& pos_tensor,
+                       int& next) const override;
+
+  base::Status prefill(const tensor::Tensor& input, const tensor::Tensor& pos_tensor,
+                       int& next, int32_t slot = 0) const override;
+
+  base::Status prefill_kv(const tensor::Tensor& input, const tensor::Tensor& pos_tensor,
+                          int32_t slot = 0) const override;
+
+  base::Status verify(const tensor::Tensor& input, const tensor::Tensor& pos_tensor,
+                      std::vector<int32_t>& next, int32_t slot = 0) const override;
+
+  base::Status embed(const tensor::Tensor& input, const tensor::Tensor& pos_tensor,
+                     EmbeddingPooling pooling, std::vector<float>& output,
+                     int32_t slot = 0) const override;
+
+  base::Status decode_batch(const tensor::Tensor& input, const std::vector<int32_t>& slots,
+                            const std::vector<int32_t>& positions, std::vector<int32_t>& next,
+                            std::vector<float>* host_logits = nullptr) const override;
+
+  base::Status begin_device_decode(int32_t token, int32_t pos) const override;
+
+  base::Status launch_device_decode(int32_t step_num) const override;
+
+  const op::EmbeddingOutput& embedding(const std::vector<int>& tokens) const override;
+
+  base::Status create_context(std::unique_ptr<Model>& context) const override;
+
+ protected:
+  explicit TransformerModel(base::TokenizerType tokenizer_type, base::ModelType model_type,
+                            std::string token_path, std::string model_path, bool is_quant_model,
+                            bool has_qkv_bias);
+
+  // a model of the same kind and files which is not initialized yet, for create_context
+  virtual std::unique_ptr<TransformerModel> create_session() const = 0;
+
+  base::Status embedding_device(const tensor::Tensor& token_cu,
+                                const tensor::Tensor& output) const override;
+
+  void* cuda_stream() const override;
+
+  kernel::CudaConfig* kv_swap_config() const override;
+
+ private:
+  void init_mem() override;
+
+  // the kv cache and the buffers of the steps, after the weights are placed
+  void init_buffers();
+
+  // the rope tables, the execution plan and the sampler over the buffers
+  base::Status init_session();
+
+  // resolves the layers and the buffers of the decode step once, after init_mem
+  base::Status build_execution_plan();
+
+  // plans the activations of one decode step on the model device, or on the cpu for the layers
+  // of a split model which run there
+  void init_step_activations(bool is_host);
+
+  base::Status create_layers() override;
+
+  void create_param_layers() override;
+
+  void create_nonparam_layers() override;
+
+  void create_param_quant_layers() override;
+
+  void cls_logits(const tensor::Tensor& input) const;
+
+  // runs the prompt through the transformer layers, hidden is the input or, when the last
+  // layers run on the cpu, a host copy of it with the residuals of all the layers added
+  base::Status prefill_layers(const tensor::Tensor& input, const tensor::Tensor& pos_tensor,
+                              int32_t slot, tensor::Tensor& hidden) const;
+
+  int32_t post_processing(const tensor::Tensor& pos, bool is_prompt) const override;
+
+  // the wq, wk and wv layers add their biases
+  bool has_qkv_bias() const;
+
+  bool has_qkv_bias_ = false;
+  std::shared_ptr<kernel::CudaConfig> cuda_config_;
+  std::unique_ptr<TransformerLayers> layers_;
+};
+}  // namespace model
+
+#endif
\ No newline at end of file
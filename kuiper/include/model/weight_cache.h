@@ -0,0 +1,51 @@
+#ifndef KUIPER_INCLUDE_MODEL_WEIGHT_CACHE_H_
+#define KUIPER_INCLUDE_MODEL_WEIGHT_CACHE_H_
+#include <cuda_runtime_api.h>
+#include <string>
+#include <vector>
+#include "shared_weights.h"
+namespace model {
+// Keeps the device ready weights of a model in one file, the fused weights in the layout of
+// their device allocation. The key of the file covers the model file, the shapes and the data
+// types of the weights and the gpu architecture. The first init fuses and uploads the weights as
+// usual and writes the image, an init with the same key fuses the layers without their data and
+// reads the image into one device allocation through pinned staging buffers, so the pages of the
+// model file are never read.
+class WeightCache {
+ public:
+  explicit WeightCache(std::string cache_path);
+
+  ~WeightCache();
+
+  WeightCache(const WeightCache&) = delete;
+
+  WeightCache& operator=(const WeightCache&) = delete;
+
+  // computes the key from the layers before they are fused and checks it against the header of
+  // the cache file, a missing or a stale file is a miss
+  void open(const std::string& model_path,
+            const std::vector<std::shared_ptr<op::Layer>>& layers);
+
+  // the layers can be fused without copying their weights
+  bool is_hit() const;
+
+  // moves the weights of the layers, which are still in the cpu memory, into one device
+  // allocation, from the cache file on a hit and from the layers otherwise
+  base::Status bind(const std::vector<std::shared_ptr<op::Layer>>& layers, cudaStream_t stream);
+
+  size_t byte_size() const;
+
+ private:
+  base::Status read_image(cudaStream_t stream) const;
+
+  base::Status write_image(const WeightLayout& layout) const;
+
+ private:
+  std::string cache_path_;
+  uint64_t key_ = 0;
+  bool is_hit_ = false;
+  size_t byte_size_ = 0;
+  void* ptr_ = nullptr;
+};
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_WEIGHT_CACHE_H_
@@ -0,0 +1,62 @@
+#ifndef KUIPER_INCLUDE_MODEL_WEIGHT_STREAMER_H_
+#define KUIPER_INCLUDE_MODEL_WEIGHT_STREAMER_H_
+#include <cuda_runtime_api.h>
+#include <map>
+#include <vector>
+#include "op/layer.h"
+#include "tensor/tensor.h"
+namespace model {
+// Keeps the weights of some transformer layers in page-locked host memory and copies them into
+// a window of two device slots right before they are used. The copy of the next streamed layer
+// runs on a stream of its own while the current layer is computed.
+class WeightStreamer {
+ public:
+  explicit WeightStreamer();
+
+  ~WeightStreamer();
+
+  WeightStreamer(const WeightStreamer&) = delete;
+
+  WeightStreamer& operator=(const WeightStreamer&) = delete;
+
+  // the bytes of the distinct weights the layers read, views into another weight count once
+  static size_t param_byte_size(const std::vector<std::shared_ptr<op::Layer>>& layers);
+
+  // moves the weights of the layers, which are still in the cpu memory, into one pinned buffer
+  void add_layer(int32_t layer_idx, const std::vector<std::shared_ptr<op::Layer>>& layers);
+
+  // the weights of layer_idx point into a device slot once the work enqueued next on stream
+  // runs, a layer which was never added is left as it is
+  void acquire(int32_t layer_idx, cudaStream_t stream);
+
+  bool is_streamed(int32_t layer_idx) const;
+
+  size_t window_byte_size() const;
+
+ private:
+  struct Binding {
+    tensor::Tensor* tensor = nullptr;
+    size_t offset = 0;
+  };
+
+  struct StreamedLayer {
+    std::shared_ptr<base::Buffer> host;
+    std::vector<Binding> bindings;
+  };
+
+  void load(int32_t layer_idx, int32_t slot);
+
+  void bind(const StreamedLayer& layer, void* base_ptr, base::DeviceType device_type);
+
+ private:
+  std::map<int32_t, StreamedLayer> layers_;
+  size_t slot_byte_size_ = 0;
+  std::shared_ptr<base::Buffer> slots_[2];
+  int32_t slot_layers_[2] = {-1, -1};
+  int32_t current_slot_ = -1;
+  cudaStream_t copy_stream_ = nullptr;
+  cudaEvent_t copy_done_[2] = {nullptr, nullptr};
+  cudaEvent_t compute_done_[2] = {nullptr, nullptr};
+};
+}  // namespace model
+#endif  // KUIPER_INCLUDE_MODEL_WEIGHT_STREAMER_H_
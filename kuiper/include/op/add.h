@@ -10,6 +10,8 @@ class VecAddLayer : public Layer {
   base::Status check() const override;
 
   base::Status forward() override;
+
+  std::shared_ptr<Layer> clone() const override;
 };
 }  // namespace op
 #endif  // KUIPER_INCLUDE_OP_ADD_H
\ No newline at end of file
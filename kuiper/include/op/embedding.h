@@ -8,6 +8,8 @@ struct EmbeddingOutput {
   tensor::Tensor input_tokens;
   tensor::Tensor input_embeddings;
   tensor::Tensor input_token_num;
+  EmbeddingOutput() = default;
+
   explicit EmbeddingOutput(tensor::Tensor input_tokens, tensor::Tensor input_embeddings,
                            tensor::Tensor input_token_num)
       : input_tokens(std::move(input_tokens)),
@@ -24,6 +26,8 @@ class EmbeddingLayer : public LayerParam {
 
   base::Status forward() override;
 
+  std::shared_ptr<Layer> clone() const override;
+
  private:
   int32_t dim_ = 0;
   int32_t seq_len_ = 0;
@@ -26,8 +26,15 @@ class EncodeLayerBase : public Layer {
 
   virtual std::string decode(const std::vector<int32_t>& token_ids) const = 0;
 
+  // the bytes the token adds to the decoded text, a byte fallback token is one byte which may be
+  // a part of a character, is_first drops the space of the first piece like a decode does
+  virtual std::string token_bytes(int32_t token_id, bool is_first) const = 0;
+
   virtual bool is_sentence_ending(int32_t token_id) const = 0;
 
+  // the tokens for which is_sentence_ending holds
+  virtual std::vector<int32_t> sentence_ending_tokens() const = 0;
+
   virtual int32_t vocab_size() const = 0;
 
  protected:
@@ -46,8 +53,12 @@ class SpeEncodeLayer : public EncodeLayerBase {
 
   std::string decode(const std::vector<int32_t>& token_ids) const override;
 
+  std::string token_bytes(int32_t token_id, bool is_first) const override;
+
   bool is_sentence_ending(int32_t token_id) const override;
 
+  std::vector<int32_t> sentence_ending_tokens() const override;
+
   int32_t vocab_size() const override;
 
  private:
@@ -65,10 +76,20 @@ public:
 
   std::string decode(const std::vector<int32_t>& token_ids) const override;
 
+  std::string token_bytes(int32_t token_id, bool is_first) const override;
+
   bool is_sentence_ending(int32_t token_id) const override;
 
+  std::vector<int32_t> sentence_ending_tokens() const override;
+
   int32_t vocab_size() const override;
 
+ protected:
+  // loads the vocab of the tokenizer.json, the special tokens are found by their content
+  explicit BpeEncodeLayer(std::string token_model_path, bool has_bos, bool has_eos,
+                          const std::string& bos_token, const std::string& eos_token,
+                          const std::string& stop_token);
+
  protected:
   int32_t bos_id_ = -1;
   int32_t eos_id_ = -1;
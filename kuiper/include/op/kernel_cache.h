@@ -0,0 +1,20 @@
+#ifndef KUIPER_INCLUDE_OP_KERNEL_CACHE_H_
+#define KUIPER_INCLUDE_OP_KERNEL_CACHE_H_
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "base/base.h"
+namespace kernel {
+// The kernel which a launch site of a layer selected from the registry, with the op and the key
+// it was selected for and the generation of the registry then. The site selects again only when
+// one of them changed, so the forward of a layer neither locks the registry nor builds a key
+struct KernelCache {
+  std::string op;
+  base::DeviceType device_type = base::DeviceType::kDeviceUnknown;
+  base::DataType data_type = base::DataType::kDataTypeUnknown;
+  std::vector<int32_t> dims;
+  uint64_t generation = 0;
+  void (*kernel)() = nullptr;
+};
+}  // namespace kernel
+#endif  // KUIPER_INCLUDE_OP_KERNEL_CACHE_H_
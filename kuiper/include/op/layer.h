@@ -1,10 +1,12 @@
 #ifndef KUIPER_INCLUDE_OP_LAYER_H_
 #define KUIPER_INCLUDE_OP_LAYER_H_
 #include <base/cuda_config.h>
+#include <memory>
 #include <string>
 #include <vector>
 #include "base/base.h"
 #include "tensor/tensor.h"
+#include "tensor/upload_queue.h"
 
 namespace op {
 class Layer;
@@ -22,6 +24,9 @@ enum class LayerType : uint8_t {
   kLayerSwiGLU = 10,
 };
 
+// the op type of a layer in the profiles
+const char* layer_type_name(LayerType layer_type);
+
 class BaseLayer {
  public:
   explicit BaseLayer(base::DeviceType device_type, LayerType layer_type, base::DataType data_type,
@@ -83,11 +88,18 @@ class BaseLayer {
 
   void set_device_type(base::DeviceType device_type);
 
+  // the forward checks its tensors before the kernels run, a model whose execution plan checked
+  // the operands once at init turns it off
+  void set_check_enabled(bool check_enabled);
+
+  bool is_check_enabled() const;
+
  protected:
   std::string layer_name_;
   LayerType layer_type_ = LayerType::kLayerUnknown;
   base::DataType data_type_ = base::DataType::kDataTypeUnknown;
   base::DeviceType device_type_ = base::DeviceType::kDeviceUnknown;
+  bool check_enabled_ = true;
 };
 
 class Layer : public BaseLayer {
@@ -102,6 +114,10 @@ class Layer : public BaseLayer {
   base::Status check_tensor_with_dim(const tensor::Tensor& tensor, base::DeviceType device_type,
                                      base::DataType data_type, ...) const;
 
+  base::Status check_tensor_with_row_dim(const tensor::Tensor& tensor,
+                                         base::DeviceType device_type, base::DataType data_type,
+                                         int32_t dim) const;
+
   base::Status check() const override;
 
   base::Status forward() override;
@@ -144,14 +160,28 @@ class Layer : public BaseLayer {
 
   virtual void to_cuda();
 
+  // a copy with inputs, outputs and a position of its own whose weights are the ones of this
+  // layer, for another inference context of the model
+  virtual std::shared_ptr<Layer> clone() const;
+
   void set_cuda_config(std::shared_ptr<kernel::CudaConfig> config);
 
   std::shared_ptr<kernel::CudaConfig> cuda_config() const;
 
+  // while it is set, to_cuda hands the weights to the queue instead of copying them one by one
+  void set_upload_queue(tensor::UploadQueue* upload_queue);
+
+ protected:
+  void upload_to_cuda(tensor::Tensor& tensor) const;
+
+  // the forward of the layer in a profile range of its type while the profiler runs
+  base::Status profiled_forward();
+
  protected:
   std::vector<tensor::Tensor> inputs_;
   std::vector<tensor::Tensor> outputs_;
   std::shared_ptr<kernel::CudaConfig> cuda_config_;
+  tensor::UploadQueue* upload_queue_ = nullptr;
 };
 
 class LayerParam : public Layer {
@@ -180,9 +210,25 @@ class LayerParam : public Layer {
 
   int32_t get_scale_num() const;
 
+  bool is_quant_layer() const;
+
+  int32_t get_group_size() const;
+
+  const tensor::Tensor& get_scales() const;
+
+  // the weights of a fp16 or bf16 model file are laid out like the fp32 ones, they are set as
+  // fp32 and viewed again in the data type afterwards
+  void set_weight_data_type(base::DataType data_type);
+
+  base::DataType weight_data_type() const;
+
+  // every tensor loaded from the model file, the weight streaming re-points them
+  virtual std::vector<tensor::Tensor*> param_tensors();
+
  protected:
   int32_t group_size_ = 0;
   bool is_quant_layer_ = false;
+  base::DataType weight_data_type_ = base::DataType::kDataTypeFp32;
   tensor::Tensor scales_;
   std::vector<tensor::Tensor> weights_;
 };
@@ -0,0 +1,24 @@
+#ifndef KUIPER_INCLUDE_OP_LORA_H_
+#define KUIPER_INCLUDE_OP_LORA_H_
+#include "tensor/tensor.h"
+namespace op {
+// the low rank weights of one projection for all the adapters of a pool, an adapter with a
+// smaller rank is padded with zero rows, so every adapter has the rank of the pool
+struct LoraWeights {
+  // [adapter_num, rank, in_dim]
+  tensor::Tensor a;
+  // the lora b transposed to [adapter_num, rank, out_dim]
+  tensor::Tensor b;
+  // alpha / rank of every adapter, 0 for a free slot of the pool
+  tensor::Tensor scales;
+};
+
+// the adapter of every row of the batch a forward runs on, shared by the layers of a model
+struct LoraRows {
+  // int32 of one adapter for all the rows or one per row, -1 runs the base model
+  tensor::Tensor adapters;
+  // fp32 [max_batch_size, rank] for the shrunk rows
+  tensor::Tensor workspace;
+};
+}  // namespace op
+#endif  // KUIPER_INCLUDE_OP_LORA_H_
@@ -5,7 +5,9 @@
 #ifndef KUIPER_INCLUDE_OP_MATMUL_H_
 #define KUIPER_INCLUDE_OP_MATMUL_H_
 #include <base/cuda_config.h>
+#include "kernel_cache.h"
 #include "layer.h"
+#include "lora.h"
 namespace op {
 class MatmulLayer : public LayerParam {
  public:
@@ -16,20 +18,102 @@ class MatmulLayer : public LayerParam {
 
   base::Status forward() override;
 
+  std::shared_ptr<Layer> clone() const override;
+
   base::Status set_bias(int32_t idx, int32_t& dims, const void* bias_ptr,
                           base::DeviceType device_type);
 
+  // the weight is packed in four bits, two columns per byte with the even one in the low
+  // nibble. It is followed by one fp16 scale per group and, with has_zero_point, one uint8 zero
+  // point per group, the value of q is (q - zero point) * scale and the zero point is 8 without
+  // them. Every part starts on a 16 byte boundary of the model file
+  base::Status set_weight_int4(const std::vector<int32_t>& dims, const void* weight_ptr,
+                               bool has_zero_point, base::DeviceType device_type);
+
+  // the bytes of an int4 weight with its scales and zero points in the model file
+  static size_t int4_byte_size(int32_t dim0, int32_t dim1, int32_t group_size,
+                               bool has_zero_point);
+
+  bool is_int4() const;
+
+  // the weight is e4m3 fp8 of dims followed by one fp32 scale per row, a per tensor scaled
+  // weight gives every row the same scale
+  base::Status set_weight_fp8(const std::vector<int32_t>& dims, const void* weight_ptr,
+                              base::DeviceType device_type);
+
+  bool is_fp8() const;
+
+  // the int8 weight and its scales on the cuda device are in the tiled layout of
+  // kernel::tile_int8_weight_cu, the parts of a fused weight are tiled with it
+  void set_tiled(bool is_tiled);
+
+  bool is_tiled() const;
+
+  // the input column which every column of the weight reads, the input is gathered in this
+  // order before the matmul. The act order weights of a gptq checkpoint sort their columns by
+  // the group, so the groups of the int4 kernels stay contiguous
+  base::Status set_input_order(int32_t dim, const void* order_ptr, base::DeviceType device_type);
+
+  bool has_input_order() const;
+
+  bool has_bias() const;
+
+  // the fp32 bias is added by the epilogue of the matmul kernel instead of an add after it
+  bool is_bias_fused() const;
+
+  // the output gets the low rank update of the adapters of lora, the adapter of every row is
+  // the one of rows at the forward. Both are shared with the other projections of the model
+  void set_lora(std::shared_ptr<LoraWeights> lora, std::shared_ptr<LoraRows> rows);
+
+  // the rows have no adapters before they are bound by the model
+  bool has_lora() const;
+
   tensor::Tensor& get_bias(int32_t idx);
 
   const tensor::Tensor& get_bias(int32_t idx) const;
 
   void to_cuda() override;
 
+  std::vector<tensor::Tensor*> param_tensors() override;
+
+  // Packs layers which share the same input into one layer, the output rows of layers[i]
+  // follow the ones of layers[i - 1]. The given layers are left with views into the packed
+  // weights, so they stay usable for as long as the returned layer is alive. The packed
+  // weights come from alloc when it is given, otherwise from the device of the layers. Without
+  // copy_weights the packed weights are only allocated, the caller fills them.
+  static std::shared_ptr<MatmulLayer> fuse(
+      const std::vector<std::shared_ptr<MatmulLayer>>& layers,
+      std::shared_ptr<base::DeviceAllocator> alloc = nullptr, bool copy_weights = true);
+
+  int32_t output_dim() const;
+
+  int32_t input_dim() const;
+
+  // the weight holds the gate rows followed by the up rows, and the output is
+  // silu(gate) * up with half of the rows
+  void set_swiglu_output(bool swiglu_output);
+
+  bool is_swiglu_output() const;
+
+ private:
+  // the variant of op for the data type and the shape of the weight, it is selected from the
+  // kernel registry once and again only after the registry or the weight changed
+  template <typename Kernel>
+  Kernel weight_kernel(const char* op);
+
  private:
   int32_t dim0_ = 0;
   int32_t dim1_ = 0;
   bool has_bias_ = false;
+  bool swiglu_output_ = false;
+  bool is_tiled_ = false;
+  int32_t weight_bits_ = 8;
+  tensor::Tensor zero_points_;
+  tensor::Tensor input_order_;
   std::vector<tensor::Tensor> bias_;
+  std::shared_ptr<LoraWeights> lora_;
+  std::shared_ptr<LoraRows> lora_rows_;
+  kernel::KernelCache kernel_cache_;
 };
 }  // namespace op
 #endif  // KUIPER_INCLUDE_OP_MATMUL_H_
@@ -1,6 +1,8 @@
 #ifndef KUIPER_INLCUDE_MHA_H
 #define KUIPER_INLCUDE_MHA_H
+#include <base/attention_window.h>
 #include <base/cuda_config.h>
+#include "kernel_cache.h"
 #include "layer.h"
 namespace op {
 class MultiHeadAttention : public op::Layer {
@@ -12,10 +14,31 @@ class MultiHeadAttention : public op::Layer {
   base::Status check() const override;
 
   void set_pos(int32_t pos);
+  // the position is read on the device from this tensor until the next set_pos
+  void set_pos_tensor(const tensor::Tensor& pos_tensor);
   void set_layer_idx(int32_t layer_idx);
+  void set_block_size(int32_t block_size);
+  // the per head scales of an int8 kv cache
+  void set_kv_scales(const tensor::Tensor& key_scale, const tensor::Tensor& value_scale);
+  // the rows attend only the sinks and the window, the cache is read as a ring
+  void set_window(const base::AttentionWindow& window);
 
   base::Status forward() override;
 
+  // the causal attention of the rows of a prompt from pos on in one launch, the keys and values
+  // of the rows are stored into the caches by the kernel, a windowed prompt is passed one chunk
+  // at a time. The rope has to be applied to query and key before
+  base::Status forward_prefill(const tensor::Tensor& query, const tensor::Tensor& key,
+                               const tensor::Tensor& value, const tensor::Tensor& key_cache,
+                               const tensor::Tensor& value_cache,
+                               const tensor::Tensor& block_table, const tensor::Tensor& output);
+
+  // the cuda device runs forward_prefill for the 32 bit and the 16 bit caches of the heads the
+  // shared memory holds
+  bool is_flash_prefill_supported(base::DataType cache_data_type) const;
+
+  std::shared_ptr<Layer> clone() const override;
+
  private:
   int32_t layer_index_ = 0;
   int32_t pos_ = 0;
@@ -24,6 +47,12 @@ class MultiHeadAttention : public op::Layer {
   int32_t seq_len_ = 0;
   int32_t head_num_ = 0;
   int32_t head_size_ = 0;
+  int32_t block_size_ = 0;
+  base::AttentionWindow window_;
+  tensor::Tensor pos_tensor_;
+  tensor::Tensor key_scale_;
+  tensor::Tensor value_scale_;
+  kernel::KernelCache kernel_cache_;
 };
 }  // namespace op
 #endif  // KUIPER_INLCUDE_MHA_H
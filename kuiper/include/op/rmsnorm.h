@@ -10,6 +10,13 @@ class RmsNormLayer : public LayerParam {
 
   base::Status forward() override;
 
+  std::shared_ptr<Layer> clone() const override;
+
+  // adds input to the residual stream in place and normalizes the sum into output, one pass
+  // instead of the add layer followed by the rmsnorm
+  base::Status forward_add(const tensor::Tensor& residual, const tensor::Tensor& input,
+                           const tensor::Tensor& output);
+
  private:
   int32_t dim_ = 0;
 };
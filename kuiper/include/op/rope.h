@@ -4,16 +4,20 @@
 namespace op {
 class RoPELayer : public Layer {
  public:
-  explicit RoPELayer(base::DeviceType device_type, int32_t dim, int32_t kv_dim, int32_t head_size);
+  explicit RoPELayer(base::DeviceType device_type, int32_t dim, int32_t kv_dim, int32_t head_size,
+                     bool is_rotate_half);
 
   base::Status check() const override;
 
   base::Status forward() override;
 
+  std::shared_ptr<Layer> clone() const override;
+
  private:
   int32_t dim_ = 0;
   int32_t kv_dim_ = 0;
   int32_t head_size_ = 0;
+  bool is_rotate_half_ = false;
 };
 }  // namespace op
 #endif  // KUIPER_INCLUDE_OP_ROPE_H_
@@ -10,6 +10,8 @@ class SwiGLULayer : public op::Layer {
 
   base::Status forward() override;
 
+  std::shared_ptr<Layer> clone() const override;
+
  private:
   int32_t hidden_dim_ = 0;
 };
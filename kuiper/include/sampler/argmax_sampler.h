@@ -5,13 +5,26 @@
 #ifndef LLAMA_INFER_NON_SAMPLER_H
 #define LLAMA_INFER_NON_SAMPLER_H
 #include <base/base.h>
+#include <base/buffer.h>
 #include "sampler.h"
 namespace sampler {
 class ArgmaxSampler : public Sampler {
  public:
-  explicit ArgmaxSampler(base::DeviceType device_type) : Sampler(device_type) {}
+  explicit ArgmaxSampler(base::DeviceType device_type);
 
   size_t sample(const float* logits, size_t size, void* stream) override;
+
+  bool sample_device(const float* logits, size_t size, int32_t* output_idx,
+                     void* stream) override;
+
+  int32_t candidate_num() const override;
+
+  bool sample_candidates_device(const float* values, const int32_t* tokens, int32_t* output_idx,
+                                void* stream) override;
+
+ private:
+  std::shared_ptr<base::Buffer> workspace_;
+  std::shared_ptr<base::Buffer> index_;
 };
 }  // namespace sampler
 #endif  // LLAMA_INFER_NON_SAMPLER_H
@@ -0,0 +1,66 @@
+#ifndef LLAMA_INFER_GRAMMAR_SAMPLER_H
+#define LLAMA_INFER_GRAMMAR_SAMPLER_H
+#include <base/base.h>
+#include <base/buffer.h>
+#include <memory>
+#include <vector>
+#include "sampler.h"
+#include "token_grammar.h"
+namespace sampler {
+// constrains the sequences to a grammar: the logits of the tokens which leave the language of
+// the current state are set to -inf by the precompiled mask of the state before the wrapped
+// sampler, then the state advances by the sampled token. Every slot of the model keeps its own
+// state, which starts over with the prefill of a new sequence unless reset gave it the output
+// before. On cuda the mask is applied on the device and only the sampled token comes back, the
+// grammar has to be on the device already. The next state is chosen on the host, so the sampler
+// does not run in a cuda graph
+class GrammarSampler : public Sampler {
+ public:
+  explicit GrammarSampler(base::DeviceType device_type,
+                          std::shared_ptr<const TokenGrammar> grammar,
+                          std::unique_ptr<Sampler> sampler, int32_t slot_num = 1);
+
+  // a finished slot is not sampled, the token which finished it is returned again and
+  // last_status() is an error
+  size_t sample(const float* logits, size_t size, void* stream) override;
+
+  void set_slot(int32_t slot) override;
+
+  void begin_sequence(int32_t slot, void* stream) override;
+
+  base::Status last_status() const override;
+
+  // back to the start of the grammar for the next output of the current slot
+  void reset();
+
+  // walks the state of the slot from the start through the output so far, before the next
+  // sample. For a sequence whose prefill starts again or whose draft tokens were rejected
+  base::Status reset(int32_t slot, const std::vector<int32_t>& output_tokens);
+
+  // the state of the current slot
+  int32_t state() const;
+
+  // the output of the current slot so far is a whole sentence of the grammar
+  bool is_accepting() const;
+
+  // an ending token was sampled in the current slot, or a token the grammar does not allow
+  // when no token was left
+  bool is_finished() const;
+
+ private:
+  std::shared_ptr<const TokenGrammar> grammar_;
+  std::unique_ptr<Sampler> sampler_;
+  int32_t slot_num_ = 1;
+  int32_t slot_ = 0;
+  std::vector<int32_t> states_;
+  std::vector<bool> is_finished_;
+  // the token which finished a slot
+  std::vector<int32_t> last_tokens_;
+  // the slots whose state was reset for the sequence of their next prefill
+  std::vector<bool> is_reset_;
+  base::Status last_status_;
+  std::vector<float> logits_cpu_;
+  std::shared_ptr<base::Buffer> logits_;
+};
+}  // namespace sampler
+#endif  // LLAMA_INFER_GRAMMAR_SAMPLER_H
@@ -0,0 +1,77 @@
+#ifndef LLAMA_INFER_LOGITS_PROCESSOR_H
+#define LLAMA_INFER_LOGITS_PROCESSOR_H
+#include <base/base.h>
+#include <base/buffer.h>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "sampler.h"
+namespace sampler {
+struct LogitsParams {
+  // one keeps the logits, above one it lowers the tokens which are in the sequence
+  float repetition_penalty = 1.f;
+  // subtracted once from the tokens in the sequence
+  float presence_penalty = 0.f;
+  // subtracted from the tokens in the sequence once per occurrence
+  float frequency_penalty = 0.f;
+  // added to the logits of the tokens
+  std::vector<std::pair<int32_t, float>> logit_bias;
+  // never sampled
+  std::vector<int32_t> banned_tokens;
+};
+
+// applies the penalties and the biases in one pass over the logits before the wrapped sampler.
+// Every slot of the model keeps the counts of the tokens of its sequence on the device of the
+// sampler, every sampled token is added to the counts of the current slot behind the sample, so
+// the steps of a cuda graph keep them without a host write. The counts of a slot start empty
+// with the prefill of a new sequence unless reset gave them its tokens before
+class LogitsProcessor : public Sampler {
+ public:
+  explicit LogitsProcessor(base::DeviceType device_type, int32_t vocab_size,
+                           const LogitsParams& params, std::unique_ptr<Sampler> sampler,
+                           int32_t slot_num = 1);
+
+  size_t sample(const float* logits, size_t size, void* stream) override;
+
+  bool sample_device(const float* logits, size_t size, int32_t* output_idx,
+                     void* stream) override;
+
+  void set_slot(int32_t slot) override;
+
+  void begin_sequence(int32_t slot, void* stream) override;
+
+  base::Status last_status() const override;
+
+  // replaces the counts of the slot with the tokens which are in its sequence before the next
+  // sample, the prompt and the output so far
+  void reset(int32_t slot, const std::vector<int32_t>& tokens, void* stream = nullptr);
+
+  // reset of the current slot
+  void reset(const std::vector<int32_t>& tokens, void* stream = nullptr);
+
+  const LogitsParams& params() const;
+
+ private:
+  void process_cpu(const float* logits, size_t size);
+
+  int32_t* slot_counts() const;
+
+ private:
+  LogitsParams params_;
+  int32_t vocab_size_ = 0;
+  std::unique_ptr<Sampler> sampler_;
+  int32_t slot_num_ = 1;
+  int32_t slot_ = 0;
+  // the slots whose counts were reset for the sequence of their next prefill
+  std::vector<bool> is_reset_;
+  // [slot_num, vocab_size]
+  std::vector<int32_t> counts_cpu_;
+  std::vector<float> bias_cpu_;
+  std::vector<float> logits_cpu_;
+  std::shared_ptr<base::Buffer> counts_;
+  std::shared_ptr<base::Buffer> bias_;
+  std::shared_ptr<base::Buffer> logits_;
+  std::shared_ptr<base::Buffer> index_;
+};
+}  // namespace sampler
+#endif  // LLAMA_INFER_LOGITS_PROCESSOR_H
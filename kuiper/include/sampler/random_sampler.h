@@ -0,0 +1,47 @@
+#ifndef LLAMA_INFER_RANDOM_SAMPLER_H
+#define LLAMA_INFER_RANDOM_SAMPLER_H
+#include <base/base.h>
+#include <base/buffer.h>
+#include <random>
+#include "sampler.h"
+namespace sampler {
+struct SamplingParams {
+  // a temperature of zero or below selects the most probable token
+  float temperature = 1.f;
+  // zero keeps every token
+  int32_t top_k = 0;
+  float top_p = 1.f;
+  uint64_t seed = 0;
+};
+
+// samples from softmax(logits / temperature) after the top-k and top-p cuts, on the cuda
+// device only the token id is copied back to the host
+class RandomSampler : public Sampler {
+ public:
+  explicit RandomSampler(base::DeviceType device_type, const SamplingParams& params);
+
+  size_t sample(const float* logits, size_t size, void* stream) override;
+
+  bool sample_device(const float* logits, size_t size, int32_t* output_idx,
+                     void* stream) override;
+
+  int32_t candidate_num() const override;
+
+  bool sample_candidates_device(const float* values, const int32_t* tokens, int32_t* output_idx,
+                                void* stream) override;
+
+  const SamplingParams& params() const;
+
+ private:
+  size_t sample_cpu(const float* logits, size_t size);
+
+ private:
+  SamplingParams params_;
+  std::mt19937_64 engine_;
+  std::vector<std::pair<float, int32_t>> candidates_;
+  std::shared_ptr<base::Buffer> counter_;
+  std::shared_ptr<base::Buffer> index_;
+  std::shared_ptr<base::Buffer> argmax_workspace_;
+};
+}  // namespace sampler
+#endif  // LLAMA_INFER_RANDOM_SAMPLER_H
@@ -1,5 +1,6 @@
 #ifndef LLAMA_INFER_SAMPLER_H
 #define LLAMA_INFER_SAMPLER_H
+#include <base/base.h>
 #include <cstddef>
 #include <cstdint>
 namespace sampler {
@@ -9,6 +10,35 @@ class Sampler {
 
   virtual size_t sample(const float* logits, size_t size, void* stream = nullptr) = 0;
 
+  // the slot of the sequence which the next samples belong to, a sampler with a state per
+  // sequence keeps one for every slot
+  virtual void set_slot(int32_t slot) {}
+
+  // a prefill from position 0 starts a new sequence in the slot, it becomes the current one
+  virtual void begin_sequence(int32_t slot, void* stream) { set_slot(slot); }
+
+  // samples into a device buffer without waiting for the result, returns false when the
+  // sampler can only run on the host
+  virtual bool sample_device(const float* logits, size_t size, int32_t* output_idx,
+                             void* stream) {
+    return false;
+  }
+
+  // the error of the last sample, a sampler which can not sample the sequence of the slot
+  // returns a token anyway and reports why here
+  virtual base::Status last_status() const { return base::error::Success(); }
+
+  // the number of the largest logits the sampler draws from, zero when it needs all of them. A
+  // sampler with candidates samples the output of the fused classifier
+  virtual int32_t candidate_num() const { return 0; }
+
+  // samples from the candidate_num() largest logits in descending order and their tokens into a
+  // device buffer without waiting for the result
+  virtual bool sample_candidates_device(const float* values, const int32_t* tokens,
+                                        int32_t* output_idx, void* stream) {
+    return false;
+  }
+
  protected:
   base::DeviceType device_type_;
 };
@@ -0,0 +1,82 @@
+#ifndef LLAMA_INFER_TOKEN_GRAMMAR_H
+#define LLAMA_INFER_TOKEN_GRAMMAR_H
+#include <base/base.h>
+#include <base/buffer.h>
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+namespace sampler {
+// A deterministic automaton over the bytes of the output, -1 is the dead state.
+struct ByteDfa {
+  int32_t start = 0;
+  std::vector<std::array<int32_t, 256>> next;
+  std::vector<bool> accepting;
+
+  int32_t state_num() const;
+
+  // the state after the bytes from state, -1 when they leave the language
+  int32_t walk(int32_t state, const std::string& bytes) const;
+
+  bool matches(const std::string& text) const;
+
+  // compiles a regular expression of literal bytes, ., [] classes with ranges and ^, the
+  // escapes \d \w \s \xHH and of the meta characters, groups, | and the * + ? repetitions. The
+  // whole output has to match it, the result is minimized
+  static base::Status from_regex(const std::string& pattern, ByteDfa& dfa);
+};
+
+// the regex of one json value of any type, the objects and the arrays nest up to max_depth
+std::string json_value_regex(int32_t max_depth = 3);
+
+// the regex of the json values of a schema: the types, enum, const, anyOf, oneOf, the items of
+// an array and the properties of an object, which are all written in the declared order. A
+// schema without a type is any json value
+base::Status json_schema_regex(const std::string& schema, std::string& regex);
+
+// The vocabulary masks of every state of a byte automaton, compiled once ahead of the decode
+// and shared by the samplers of all the sequences which use the grammar. A token is allowed in
+// a state when all its bytes stay in the language, the ending tokens only when the state
+// accepts. The masks are bit sets of 32 tokens a word, a copy of them lives on the cuda device.
+class TokenGrammar {
+ public:
+  // token_bytes holds the bytes of every token of the model vocab, an empty one is never
+  // allowed unless it is one of the ending tokens
+  explicit TokenGrammar(ByteDfa dfa, const std::vector<std::string>& token_bytes,
+                        const std::vector<int32_t>& ending_tokens);
+
+  int32_t start_state() const;
+
+  // the state after the token, -1 when it is not allowed
+  int32_t advance(int32_t state, int32_t token) const;
+
+  bool is_accepting(int32_t state) const;
+
+  bool is_ending_token(int32_t token) const;
+
+  bool is_allowed(int32_t state, int32_t token) const;
+
+  int32_t vocab_size() const;
+
+  int32_t word_num() const;
+
+  // the word_num() words of the mask of the state
+  const uint32_t* mask(int32_t state) const;
+
+  // uploads the masks of all the states once, mask_device then points into them
+  void to_cuda();
+
+  const uint32_t* mask_device(int32_t state) const;
+
+ private:
+  ByteDfa dfa_;
+  int32_t vocab_size_ = 0;
+  int32_t word_num_ = 0;
+  std::vector<std::string> token_bytes_;
+  std::vector<bool> is_ending_;
+  // [state_num, word_num]
+  std::vector<uint32_t> masks_;
+  std::shared_ptr<base::Buffer> masks_cu_;
+};
+}  // namespace sampler
+#endif  // LLAMA_INFER_TOKEN_GRAMMAR_H
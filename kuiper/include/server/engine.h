@@ -0,0 +1,182 @@
+#ifndef KUIPER_INCLUDE_SERVER_ENGINE_H_
+#define KUIPER_INCLUDE_SERVER_ENGINE_H_
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "model/scheduler.h"
+#include "model/stream_decoder.h"
+#include "server/request_trace.h"
+namespace server {
+struct GenerationResult {
+  // "stop" at the end of the sentence, "length" at the token limit, "cancelled" or "error"
+  std::string finish_reason;
+  int32_t prompt_token_num = 0;
+  int32_t output_token_num = 0;
+};
+
+struct GenerationRequest {
+  std::vector<int32_t> prompt_tokens;
+  int32_t max_new_tokens = 0;
+  // the sampling the client asked for, it goes into the traces, the sequences are sampled by
+  // the sampler of the model
+  sampler::SamplingParams sampling;
+  // set by the request queue
+  std::chrono::steady_clock::time_point arrival_time;
+  // the text of the new tokens, returning false cancels the request
+  std::function<bool(const std::string&)> on_text;
+  std::function<void(const GenerationResult&)> on_done;
+};
+
+// The requests between the network threads and the decode loop. It admits a request only while
+// fewer than max_waiting_num wait and its prompt fits, so an overload is answered at once
+// instead of growing the queue
+class RequestQueue {
+ public:
+  explicit RequestQueue(int32_t max_waiting_num, int32_t max_prompt_len);
+
+  // fails when the queue is full or closed, or the prompt is too long
+  base::Status push(GenerationRequest request);
+
+  // waits up to timeout_ms for a request when wait is set, returns all the queued ones
+  std::vector<GenerationRequest> pop_all(bool wait, int32_t timeout_ms = 100);
+
+  // the requests pushed later fail
+  void close();
+
+  int32_t size() const;
+
+ private:
+  int32_t max_waiting_num_ = 0;
+  int32_t max_prompt_len_ = 0;
+  bool is_closed_ = false;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<GenerationRequest> requests_;
+};
+
+// Runs the continuous batching scheduler of one model on a thread of its own. The tokens of the
+// running sequences go through their stream decoders to the callbacks of the requests, which
+// only queue the text for the network threads, so the decode loop never waits on a client.
+// swap_model loads another checkpoint while the current one serves, the requests admitted after
+// the load run on the new model and the running ones drain on the old one, which is released
+// with its weights and kv cache when its last sequence is done.
+class Engine {
+ public:
+  using ModelLoader = std::function<base::Status(std::shared_ptr<model::Model>& model)>;
+
+  // the model is not owned and outlives the engine
+  explicit Engine(const model::Model& model, RequestQueue& queue);
+
+  explicit Engine(std::shared_ptr<const model::Model> model, RequestQueue& queue);
+
+  ~Engine();
+
+  Engine(const Engine&) = delete;
+
+  Engine& operator=(const Engine&) = delete;
+
+  // the chunks of the long prompts and the token budget of a step, see model::Scheduler. They
+  // have to be set before start
+  void set_prefill_chunk_size(int32_t chunk_size);
+
+  void set_step_token_budget(int32_t token_budget);
+
+  // the host memory of the kv of the preempted requests, see model::Scheduler::set_host_kv_swap.
+  // It has to be set before start
+  void set_host_kv_swap(size_t max_byte_size);
+
+  // every finished request is appended to the trace, which has to outlive the engine. It has
+  // to be set before start
+  void set_trace_writer(TraceWriter* trace_writer);
+
+  void start();
+
+  // finishes the running requests as cancelled and stops the thread, a load in flight is
+  // waited for and dropped, its on_swapped is called with an error
+  void stop();
+
+  int32_t running_size() const;
+
+  // runs loader on a thread of its own, it creates and initializes the new model in the memory
+  // the current one leaves free. The model is swapped in by the decode loop between two steps,
+  // on_swapped is called after that or with the error of the load. Fails while another swap is
+  // in flight
+  base::Status swap_model(ModelLoader loader,
+                          std::function<void(const base::Status&)> on_swapped = nullptr);
+
+  bool is_swapping() const;
+
+  // the model the new requests run on, the tokenizer of the handlers. The pointer keeps it
+  // alive after a swap
+  std::shared_ptr<const model::Model> model() const;
+
+ private:
+  struct Active {
+    GenerationRequest request;
+    model::StreamDecoder decoder;
+    // set when the step of the sequence failed
+    std::string finish_reason;
+  };
+
+  // one model with its scheduler and its sequences, the last generation admits the requests
+  // and the earlier ones drain
+  struct Generation {
+    explicit Generation(std::shared_ptr<const model::Model> model);
+
+    std::shared_ptr<const model::Model> model;
+    model::Scheduler scheduler;
+    std::map<int32_t, Active> actives;
+    std::vector<int32_t> cancelled;
+  };
+
+  void run();
+
+  void add_generation(std::shared_ptr<const model::Model> model);
+
+  // the loaded model becomes the one the new requests run on
+  void install_loaded_model();
+
+  void admit(Generation& generation, std::vector<GenerationRequest> requests);
+
+  void step(Generation& generation);
+
+  bool has_unfinished() const;
+
+  void update_running_size();
+
+  void on_token(Generation& generation, int32_t seq_id, int32_t token);
+
+  void finish(Generation& generation, const model::Sequence& seq,
+              const std::string& finish_reason);
+
+ private:
+  RequestQueue& queue_;
+  int32_t prefill_chunk_size_ = 0;
+  int32_t step_token_budget_ = 0;
+  size_t host_kv_swap_byte_size_ = 0;
+  std::vector<std::unique_ptr<Generation>> generations_;
+  TraceWriter* trace_writer_ = nullptr;
+  std::atomic<bool> is_stopped_{false};
+  std::atomic<int32_t> running_size_{0};
+  std::thread thread_;
+
+  // the swap, the loader thread hands the model over to the decode loop
+  mutable std::mutex model_mutex_;
+  std::shared_ptr<const model::Model> current_model_;
+  std::shared_ptr<const model::Model> loaded_model_;
+  std::function<void(const base::Status&)> on_swapped_;
+  std::atomic<bool> is_swapping_{false};
+  // guards the loader thread against a swap and a stop at the same time
+  std::mutex swap_mutex_;
+  std::thread load_thread_;
+};
+}  // namespace server
+#endif  // KUIPER_INCLUDE_SERVER_ENGINE_H_
@@ -0,0 +1,97 @@
+#ifndef KUIPER_INCLUDE_SERVER_HTTP_SERVER_H_
+#define KUIPER_INCLUDE_SERVER_HTTP_SERVER_H_
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "base/base.h"
+namespace server {
+struct HttpRequest {
+  std::string method;
+  std::string path;
+  // the names are lower case
+  std::map<std::string, std::string> headers;
+  std::string body;
+};
+
+class HttpChannel;
+
+// Writes the response of one request. The handler may keep it and write from any thread, the
+// bytes are queued and flushed by the event loop of the connection, so a writer never waits
+// for the network
+class HttpResponder {
+ public:
+  explicit HttpResponder(std::shared_ptr<HttpChannel> channel);
+
+  ~HttpResponder();
+
+  HttpResponder(const HttpResponder&) = delete;
+
+  HttpResponder& operator=(const HttpResponder&) = delete;
+
+  void reply(int32_t status, const std::string& content_type, const std::string& body,
+             const std::map<std::string, std::string>& headers = {});
+
+  // sends the headers of a server-sent event stream, the connection is closed by finish
+  void start_events();
+
+  // returns false once the client is gone
+  bool send_event(const std::string& data);
+
+  void finish();
+
+  bool is_gone() const;
+
+ private:
+  std::shared_ptr<HttpChannel> channel_;
+  bool is_replied_ = false;
+};
+
+using HttpHandler = std::function<void(const HttpRequest&, std::shared_ptr<HttpResponder>)>;
+
+class EventLoop;
+
+// A small http/1.1 server over epoll. The connections are spread over io_thread_num event
+// loops which only parse the requests, call the handlers and flush the queued responses, the
+// handlers should hand the slow work to other threads
+class HttpServer : public base::NoCopyable {
+ public:
+  explicit HttpServer(int32_t io_thread_num = 2);
+
+  ~HttpServer();
+
+  // has to be called before start
+  void route(const std::string& method, const std::string& path, HttpHandler handler);
+
+  // binds the port and starts the event loops, port 0 picks a free one
+  base::Status start(const std::string& host, int32_t port);
+
+  void stop();
+
+  int32_t port() const;
+
+  // the handler of a request, a 404 response when no route matches
+  void dispatch(const HttpRequest& request, std::shared_ptr<HttpResponder> responder) const;
+
+ private:
+  void accept_connections();
+
+ private:
+  int32_t io_thread_num_ = 2;
+  int32_t port_ = 0;
+  int listen_fd_ = -1;
+  int stop_fd_ = -1;
+  std::atomic<bool> is_running_{false};
+  std::map<std::pair<std::string, std::string>, HttpHandler> routes_;
+  std::vector<std::unique_ptr<EventLoop>> loops_;
+  std::thread accept_thread_;
+};
+
+// the reason phrase of a status code
+const char* http_status_text(int32_t status);
+}  // namespace server
+#endif  // KUIPER_INCLUDE_SERVER_HTTP_SERVER_H_
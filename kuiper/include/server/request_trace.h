@@ -0,0 +1,57 @@
+#ifndef KUIPER_INCLUDE_SERVER_REQUEST_TRACE_H_
+#define KUIPER_INCLUDE_SERVER_REQUEST_TRACE_H_
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "base/base.h"
+#include "sampler/random_sampler.h"
+namespace server {
+constexpr uint32_t kRequestTraceMagic = 0x3154524b;  // "KRT1"
+constexpr uint32_t kRequestTraceVersion = 1;
+
+// one request of the traffic of a server
+struct TraceRecord {
+  // since the capture started
+  int64_t arrival_us = 0;
+  int32_t max_new_tokens = 0;
+  // the tokens the request got, -1 when it did not finish
+  int32_t output_len = -1;
+  sampler::SamplingParams sampling;
+  std::vector<int32_t> prompt_tokens;
+};
+
+// Appends the requests of a server to a trace file. The file is the magic and the version
+// followed by one record per request in the order they finish: the arrival, the lengths and
+// the sampling in fixed width, then the prompt tokens as varints, which keeps a trace of
+// real prompts near a byte and a half per token.
+class TraceWriter : public base::NoCopyable {
+ public:
+  TraceWriter() = default;
+
+  ~TraceWriter();
+
+  // the arrivals are measured from the open
+  base::Status open(const std::string& path);
+
+  bool is_open() const;
+
+  // the arrival of a request which arrived at time
+  int64_t arrival_us(std::chrono::steady_clock::time_point time) const;
+
+  // safe to call from every thread, the record is flushed at once so a crash keeps it
+  base::Status write(const TraceRecord& record);
+
+  base::Status close();
+
+ private:
+  mutable std::mutex mutex_;
+  FILE* file_ = nullptr;
+  std::chrono::steady_clock::time_point start_time_;
+};
+
+// the records of a trace in the order of their arrival
+base::Status read_trace(const std::string& path, std::vector<TraceRecord>& records);
+}  // namespace server
+#endif  // KUIPER_INCLUDE_SERVER_REQUEST_TRACE_H_
@@ -7,6 +7,7 @@
 #include <vector>
 #include "base/base.h"
 #include "base/buffer.h"
+#include "tensor/tensor_view.h"
 namespace tensor {
 
 class Tensor {
@@ -71,7 +72,14 @@ class Tensor {
 
   base::DeviceType device_type() const;
 
-  bool allocate(std::shared_ptr<base::DeviceAllocator> allocator, bool need_realloc = false);
+  bool allocate(std::shared_ptr<base::DeviceAllocator> allocator, bool need_realloc = false,
+                void* stream = nullptr);
+
+  // the buffer is released in the order of this stream, the stream-ordered allocators need it
+  // to be the stream which last used the tensor
+  void set_stream(void* stream) const;
+
+  void* stream() const;
 
   template <typename T>
   T* ptr(int64_t index);
@@ -87,6 +95,11 @@ class Tensor {
 
   tensor::Tensor clone() const;
 
+  // points the tensor at the memory of the view without owning it, for the layers and the
+  // kernels which take a tensor. A tensor with an external buffer keeps the buffer and the
+  // storage of its dims, so binding it again allocates nothing. Its copies see the new memory
+  void bind(const TensorView& view);
+
  private:
   size_t size_ = 0;
   std::vector<int32_t> dims_;
@@ -0,0 +1,73 @@
+#ifndef KUIPER_INCLUDE_TENSOR_TENSOR_VIEW_H_
+#define KUIPER_INCLUDE_TENSOR_TENSOR_VIEW_H_
+#include <glog/logging.h>
+#include <initializer_list>
+#include "base/base.h"
+namespace tensor {
+class Tensor;
+
+// A non-owning view of a contiguous tensor or of a part of one: the pointer, the dims with their
+// strides, the data type and the device. It holds no buffer and no heap storage, so the hot paths
+// can slice rows and cache positions per token without an allocation or a refcount. The viewed
+// memory has to outlive the view.
+class TensorView {
+ public:
+  static constexpr int32_t kMaxDims = 4;
+
+  TensorView() = default;
+
+  // the whole tensor
+  TensorView(const Tensor& tensor);
+
+  TensorView(base::DataType data_type, base::DeviceType device_type, void* ptr,
+             std::initializer_list<int32_t> dims);
+
+  bool is_empty() const;
+
+  template <typename T>
+  T* ptr() const;
+
+  template <typename T>
+  T* ptr(int64_t index) const;
+
+  int32_t dims_size() const;
+
+  int32_t get_dim(int32_t idx) const;
+
+  // in elements, the views are contiguous so the last dimension has a stride of 1
+  int64_t stride(int32_t idx) const;
+
+  size_t size() const;
+
+  size_t byte_size() const;
+
+  base::DataType data_type() const;
+
+  base::DeviceType device_type() const;
+
+  // the row of the outermost dimension, with one dimension less
+  TensorView row(int32_t row) const;
+
+  // the rows [row, row + row_num) of the outermost dimension
+  TensorView rows(int32_t row, int32_t row_num) const;
+
+ private:
+  void* ptr_ = nullptr;
+  base::DataType data_type_ = base::DataType::kDataTypeUnknown;
+  base::DeviceType device_type_ = base::DeviceType::kDeviceUnknown;
+  int32_t dims_size_ = 0;
+  int32_t dims_[kMaxDims] = {0, 0, 0, 0};
+};
+
+template <typename T>
+T* TensorView::ptr() const {
+  return reinterpret_cast<T*>(ptr_);
+}
+
+template <typename T>
+T* TensorView::ptr(int64_t index) const {
+  CHECK(ptr_ != nullptr) << "The tensor view points to a null pointer.";
+  return reinterpret_cast<T*>(ptr_) + index;
+}
+}  // namespace tensor
+#endif  // KUIPER_INCLUDE_TENSOR_TENSOR_VIEW_H_
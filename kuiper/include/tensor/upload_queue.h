@@ -0,0 +1,46 @@
+#ifndef KUIPER_INCLUDE_TENSOR_UPLOAD_QUEUE_H_
+#define KUIPER_INCLUDE_TENSOR_UPLOAD_QUEUE_H_
+#include <cuda_runtime_api.h>
+#include <functional>
+#include <vector>
+#include "tensor/tensor.h"
+namespace tensor {
+// Moves a set of host tensors to the cuda device in one pipeline. Worker threads fault the
+// source pages in ahead of the copy, the main thread packs them into a ring of pinned staging
+// buffers and every staging buffer is sent with an async copy while the next one is filled.
+// The tensors keep their host memory until flush returns.
+class UploadQueue {
+ public:
+  explicit UploadQueue(cudaStream_t stream, int32_t thread_num = 4,
+                       size_t staging_byte_size = 16 * 1024 * 1024, int32_t staging_num = 4);
+
+  ~UploadQueue();
+
+  // the device address of host memory which the device reads in place, nullptr for memory
+  // which has to be copied
+  using DeviceMapping = std::function<void*(const void* host_ptr, size_t byte_size)>;
+
+  // the tensors in mapped memory become views of their device address at push, nothing is
+  // copied for them
+  void set_device_mapping(DeviceMapping device_mapping);
+
+  // the tensor has to stay at the same address until flush. The tensors of the same host
+  // memory get one device buffer
+  void push(Tensor& tensor);
+
+  void flush();
+
+ private:
+  void prefetch(int32_t thread_idx) const;
+
+ private:
+  cudaStream_t stream_ = nullptr;
+  int32_t thread_num_ = 0;
+  size_t staging_byte_size_ = 0;
+  std::vector<Tensor*> tensors_;
+  std::vector<std::shared_ptr<base::Buffer>> staging_buffers_;
+  std::vector<cudaEvent_t> staging_events_;
+  DeviceMapping device_mapping_;
+};
+}  // namespace tensor
+#endif  // KUIPER_INCLUDE_TENSOR_UPLOAD_QUEUE_H_
@@ -1,6 +1,30 @@
 #include "base/alloc.h"
 #include <cuda_runtime_api.h>
+#include <algorithm>
+#include <sstream>
+#include "base/metrics.h"
 namespace base {
+// the live bytes of all the allocators of a device type
+static Gauge* allocated_bytes_gauge(DeviceType device_type) {
+  static Gauge* cpu_gauge = MetricsRegistry::global().gauge(
+      "kuiper_allocator_allocated_bytes", "The bytes of the live allocations.", "device=\"cpu\"");
+  static Gauge* cuda_gauge = MetricsRegistry::global().gauge(
+      "kuiper_allocator_allocated_bytes", "The bytes of the live allocations.",
+      "device=\"cuda\"");
+  return device_type == DeviceType::kDeviceCUDA ? cuda_gauge : cpu_gauge;
+}
+static const char* memory_tag_name(int32_t tag) {
+  static const char* names[kMemoryTagNum] = {"untagged", "weight", "kv cache", "activation"};
+  return names[tag];
+}
+
+double AllocatorStats::fragmentation() const {
+  if (cached_byte_size == 0) {
+    return 0.;
+  }
+  return 1. - static_cast<double>(largest_cached_byte_size) / static_cast<double>(cached_byte_size);
+}
+
 void DeviceAllocator::memcpy(const void* src_ptr, void* dest_ptr, size_t byte_size,
                              MemcpyKind memcpy_kind, void* stream, bool need_sync) const {
   CHECK_NE(src_ptr, nullptr);
@@ -59,4 +83,77 @@ void DeviceAllocator::memset_zero(void* ptr, size_t byte_size, void* stream,
   }
 }
 
-}  // namespace base
\ No newline at end of file
+std::map<int, AllocatorStats> DeviceAllocator::stats() const {
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  return stats_;
+}
+
+std::string DeviceAllocator::dump_stats() const {
+  constexpr double mb = 1024. * 1024.;
+  std::ostringstream os;
+  os.precision(2);
+  os << std::fixed;
+  for (const auto& [device_id, stats] : this->stats()) {
+    os << "device " << device_id << ": allocated " << stats.allocated_byte_size / mb
+       << " MB (peak " << stats.peak_allocated_byte_size / mb << " MB), reserved "
+       << stats.reserved_byte_size / mb << " MB, cached " << stats.cached_byte_size / mb
+       << " MB, fragmentation " << stats.fragmentation() << ", " << stats.allocation_num
+       << " allocations, " << stats.release_num << " releases";
+    for (int32_t tag = 0; tag < kMemoryTagNum; ++tag) {
+      os << ", " << memory_tag_name(tag) << " " << stats.tag_byte_sizes[tag] / mb << " MB";
+    }
+    os << "\n";
+  }
+  return os.str();
+}
+
+void DeviceAllocator::reset_peak_stats() const {
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  for (auto& [device_id, stats] : stats_) {
+    stats.peak_allocated_byte_size = stats.allocated_byte_size;
+  }
+}
+
+void DeviceAllocator::set_tag(void* ptr, MemoryTag tag) const {
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  auto iter = records_.find(ptr);
+  if (iter == records_.end()) {
+    return;
+  }
+  AllocationRecord& record = iter->second;
+  AllocatorStats& stats = stats_[record.device_id];
+  stats.tag_byte_sizes[static_cast<int32_t>(record.tag)] -= record.byte_size;
+  stats.tag_byte_sizes[static_cast<int32_t>(tag)] += record.byte_size;
+  record.tag = tag;
+}
+
+void DeviceAllocator::record_allocate(int device_id, void* ptr, size_t byte_size) const {
+  if (!ptr) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  AllocatorStats& stats = stats_[device_id];
+  stats.allocated_byte_size += byte_size;
+  stats.peak_allocated_byte_size =
+      std::max(stats.peak_allocated_byte_size, stats.allocated_byte_size);
+  stats.allocation_num += 1;
+  stats.tag_byte_sizes[static_cast<int32_t>(MemoryTag::kMemoryTagUnknown)] += byte_size;
+  records_[ptr] = {device_id, byte_size, MemoryTag::kMemoryTagUnknown};
+  allocated_bytes_gauge(device_type_)->add(static_cast<double>(byte_size));
+}
+
+void DeviceAllocator::record_release(void* ptr) const {
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  auto iter = records_.find(ptr);
+  if (iter == records_.end()) {
+    return;
+  }
+  const AllocationRecord& record = iter->second;
+  AllocatorStats& stats = stats_[record.device_id];
+  stats.allocated_byte_size -= record.byte_size;
+  stats.release_num += 1;
+  stats.tag_byte_sizes[static_cast<int32_t>(record.tag)] -= record.byte_size;
+  allocated_bytes_gauge(device_type_)->add(-static_cast<double>(record.byte_size));
+  records_.erase(iter);
+}
+}  // namespace base
@@ -23,15 +23,17 @@ void* CPUDeviceAllocator::allocate(size_t byte_size) const {
   if (status != 0) {
     return nullptr;
   }
-  return data;
 #else
   void* data = malloc(byte_size);
-  return data;
 #endif
+  // the host memory is counted as device 0
+  record_allocate(0, data, byte_size);
+  return data;
 }
 
 void CPUDeviceAllocator::release(void* ptr) const {
   if (ptr) {
+    record_release(ptr);
     free(ptr);
   }
 }
@@ -1,55 +1,44 @@
 #include <cuda_runtime_api.h>
+#include <algorithm>
 #include "base/alloc.h"
 namespace base {
+// every size is rounded to the block granularity, the classes are powers of two from it
+constexpr static size_t kMinBlockSize = 512;
+constexpr static size_t kSmallSize = 1024 * 1024;
+constexpr static size_t kLargeSegmentSize = 2 * 1024 * 1024;
+constexpr static int32_t kSmallBinNum = 12;
 
-CUDADeviceAllocator::CUDADeviceAllocator() : DeviceAllocator(DeviceType::kDeviceCUDA) {}
+static int32_t small_bin_index(size_t byte_size) {
+  int32_t index = 0;
+  size_t class_size = kMinBlockSize;
+  while (class_size < byte_size) {
+    class_size <<= 1;
+    index += 1;
+  }
+  return index;
+}
 
-void* CUDADeviceAllocator::allocate(size_t byte_size) const {
-  int id = -1;
-  cudaError_t state = cudaGetDevice(&id);
-  CHECK(state == cudaSuccess);
-  if (byte_size > 1024 * 1024) {
-    auto& big_buffers = big_buffers_map_[id];
-    int sel_id = -1;
-    for (int i = 0; i < big_buffers.size(); i++) {
-      if (big_buffers[i].byte_size >= byte_size && !big_buffers[i].busy &&
-          big_buffers[i].byte_size - byte_size < 1 * 1024 * 1024) {
-        if (sel_id == -1 || big_buffers[sel_id].byte_size > big_buffers[i].byte_size) {
-          sel_id = i;
-        }
-      }
-    }
-    if (sel_id != -1) {
-      big_buffers[sel_id].busy = true;
-      return big_buffers[sel_id].data;
-    }
+CUDADeviceAllocator::CUDADeviceAllocator() : DeviceAllocator(DeviceType::kDeviceCUDA) {}
 
-    void* ptr = nullptr;
-    state = cudaMalloc(&ptr, byte_size);
-    if (cudaSuccess != state) {
-      char buf[256];
-      snprintf(buf, 256,
-               "Error: CUDA error when allocating %lu MB memory! maybe there's no enough memory "
-               "left on  device.",
-               byte_size >> 20);
-      LOG(ERROR) << buf;
-      return nullptr;
-    }
-    big_buffers.emplace_back(ptr, byte_size, true);
-    return ptr;
+CudaMemoryPool& CUDADeviceAllocator::device_pool(int device_id) const {
+  CudaMemoryPool& pool = pools_[device_id];
+  if (pool.small_bins.empty()) {
+    pool.small_bins.resize(kSmallBinNum);
   }
+  return pool;
+}
 
-  auto& cuda_buffers = cuda_buffers_map_[id];
-  for (int i = 0; i < cuda_buffers.size(); i++) {
-    if (cuda_buffers[i].byte_size >= byte_size && !cuda_buffers[i].busy) {
-      cuda_buffers[i].busy = true;
-      no_busy_cnt_[id] -= cuda_buffers[i].byte_size;
-      return cuda_buffers[i].data;
-    }
-  }
+void* CUDADeviceAllocator::cuda_malloc(size_t byte_size) const {
   void* ptr = nullptr;
-  state = cudaMalloc(&ptr, byte_size);
-  if (cudaSuccess != state) {
+  cudaError_t state = cudaMalloc(&ptr, byte_size);
+  if (state != cudaSuccess) {
+    // the cached blocks may be enough once they are merged by the driver
+    cudaGetLastError();
+    empty_cache_locked();
+    state = cudaMalloc(&ptr, byte_size);
+  }
+  if (state != cudaSuccess) {
+    cudaGetLastError();
     char buf[256];
     snprintf(buf, 256,
              "Error: CUDA error when allocating %lu MB memory! maybe there's no enough memory "
@@ -58,58 +47,201 @@ void* CUDADeviceAllocator::allocate(size_t byte_size) const {
     LOG(ERROR) << buf;
     return nullptr;
   }
-  cuda_buffers.emplace_back(ptr, byte_size, true);
   return ptr;
 }
 
+CudaMemoryBlock* CUDADeviceAllocator::allocate_small(int device_id, size_t byte_size) const {
+  const int32_t bin_index = small_bin_index(byte_size);
+  auto& bin = device_pool(device_id).small_bins.at(bin_index);
+  if (!bin.empty()) {
+    CudaMemoryBlock* block = bin.back();
+    bin.pop_back();
+    return block;
+  }
+  const size_t class_size = kMinBlockSize << bin_index;
+  void* ptr = cuda_malloc(class_size);
+  if (!ptr) {
+    return nullptr;
+  }
+  CudaMemoryBlock* block = new CudaMemoryBlock();
+  block->device_id = device_id;
+  block->data = ptr;
+  block->byte_size = class_size;
+  block->is_small = true;
+  return block;
+}
+
+CudaMemoryBlock* CUDADeviceAllocator::allocate_large(int device_id, size_t byte_size) const {
+  auto& large_blocks = device_pool(device_id).large_blocks;
+  CudaMemoryBlock key;
+  key.byte_size = byte_size;
+  CudaMemoryBlock* block = nullptr;
+  auto iter = large_blocks.lower_bound(&key);
+  if (iter != large_blocks.end()) {
+    block = *iter;
+    large_blocks.erase(iter);
+  } else {
+    const size_t segment_size =
+        (byte_size + kLargeSegmentSize - 1) / kLargeSegmentSize * kLargeSegmentSize;
+    void* ptr = cuda_malloc(segment_size);
+    if (!ptr) {
+      return nullptr;
+    }
+    block = new CudaMemoryBlock();
+    block->device_id = device_id;
+    block->data = ptr;
+    block->byte_size = segment_size;
+  }
+
+  // a remainder too small for the large blocks stays with this one
+  if (block->byte_size - byte_size >= kSmallSize) {
+    CudaMemoryBlock* remain = new CudaMemoryBlock();
+    remain->device_id = device_id;
+    remain->data = static_cast<int8_t*>(block->data) + byte_size;
+    remain->byte_size = block->byte_size - byte_size;
+    remain->prev = block;
+    remain->next = block->next;
+    if (block->next) {
+      block->next->prev = remain;
+    }
+    block->next = remain;
+    block->byte_size = byte_size;
+    large_blocks.insert(remain);
+  }
+  return block;
+}
+
+void* CUDADeviceAllocator::allocate(size_t byte_size) const {
+  int id = -1;
+  cudaError_t state = cudaGetDevice(&id);
+  CHECK(state == cudaSuccess);
+  if (byte_size == 0) {
+    return nullptr;
+  }
+  byte_size = (byte_size + kMinBlockSize - 1) / kMinBlockSize * kMinBlockSize;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  CudaMemoryBlock* block =
+      byte_size <= kSmallSize ? allocate_small(id, byte_size) : allocate_large(id, byte_size);
+  if (!block) {
+    return nullptr;
+  }
+  block->busy = true;
+  busy_blocks_.emplace(block->data, block);
+  record_allocate(id, block->data, byte_size);
+  return block->data;
+}
+
+void CUDADeviceAllocator::release_large(CudaMemoryBlock* block) const {
+  auto& large_blocks = device_pool(block->device_id).large_blocks;
+  // merge with the free neighbours of the same segment
+  CudaMemoryBlock* prev = block->prev;
+  if (prev && !prev->busy) {
+    large_blocks.erase(prev);
+    prev->byte_size += block->byte_size;
+    prev->next = block->next;
+    if (block->next) {
+      block->next->prev = prev;
+    }
+    delete block;
+    block = prev;
+  }
+  CudaMemoryBlock* next = block->next;
+  if (next && !next->busy) {
+    large_blocks.erase(next);
+    block->byte_size += next->byte_size;
+    block->next = next->next;
+    if (next->next) {
+      next->next->prev = block;
+    }
+    delete next;
+  }
+  large_blocks.insert(block);
+}
+
 void CUDADeviceAllocator::release(void* ptr) const {
   if (!ptr) {
     return;
   }
-  if (cuda_buffers_map_.empty()) {
+  record_release(ptr);
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto iter = busy_blocks_.find(ptr);
+  if (iter == busy_blocks_.end()) {
+    lock.unlock();
+    cudaError_t state = cudaFree(ptr);
+    CHECK(state == cudaSuccess) << "Error: CUDA error when release memory on device";
     return;
   }
-  cudaError_t state = cudaSuccess;
-  for (auto& it : cuda_buffers_map_) {
-    if (no_busy_cnt_[it.first] > 1024 * 1024 * 1024) {
-      auto& cuda_buffers = it.second;
-      std::vector<CudaMemoryBuffer> temp;
-      for (int i = 0; i < cuda_buffers.size(); i++) {
-        if (!cuda_buffers[i].busy) {
-          state = cudaSetDevice(it.first);
-          state = cudaFree(cuda_buffers[i].data);
-          CHECK(state == cudaSuccess)
-              << "Error: CUDA error when release memory on device " << it.first;
-        } else {
-          temp.push_back(cuda_buffers[i]);
-        }
+  CudaMemoryBlock* block = iter->second;
+  busy_blocks_.erase(iter);
+  block->busy = false;
+  if (block->is_small) {
+    auto& bin = device_pool(block->device_id).small_bins.at(small_bin_index(block->byte_size));
+    bin.push_back(block);
+  } else {
+    release_large(block);
+  }
+}
+
+void CUDADeviceAllocator::empty_cache_locked() const {
+  int current_id = -1;
+  cudaGetDevice(&current_id);
+  for (auto& [device_id, pool] : pools_) {
+    cudaSetDevice(device_id);
+    for (auto& bin : pool.small_bins) {
+      for (CudaMemoryBlock* block : bin) {
+        CHECK(cudaFree(block->data) == cudaSuccess)
+            << "Error: CUDA error when release memory on device " << device_id;
+        delete block;
       }
-      cuda_buffers.clear();
-      it.second = temp;
-      no_busy_cnt_[it.first] = 0;
+      bin.clear();
+    }
+    // only the segments which are free as a whole can be returned
+    for (auto iter = pool.large_blocks.begin(); iter != pool.large_blocks.end();) {
+      CudaMemoryBlock* block = *iter;
+      if (block->prev || block->next) {
+        ++iter;
+        continue;
+      }
+      CHECK(cudaFree(block->data) == cudaSuccess)
+          << "Error: CUDA error when release memory on device " << device_id;
+      delete block;
+      iter = pool.large_blocks.erase(iter);
     }
   }
+  cudaSetDevice(current_id);
+}
+
+void CUDADeviceAllocator::empty_cache() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  empty_cache_locked();
+}
 
-  for (auto& it : cuda_buffers_map_) {
-    auto& cuda_buffers = it.second;
-    for (int i = 0; i < cuda_buffers.size(); i++) {
-      if (cuda_buffers[i].data == ptr) {
-        no_busy_cnt_[it.first] += cuda_buffers[i].byte_size;
-        cuda_buffers[i].busy = false;
-        return;
+std::map<int, AllocatorStats> CUDADeviceAllocator::stats() const {
+  std::map<int, AllocatorStats> stats = DeviceAllocator::stats();
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& [ptr, block] : busy_blocks_) {
+    stats[block->device_id].reserved_byte_size += block->byte_size;
+  }
+  for (const auto& [device_id, pool] : pools_) {
+    AllocatorStats& device_stats = stats[device_id];
+    for (const auto& bin : pool.small_bins) {
+      for (const CudaMemoryBlock* block : bin) {
+        device_stats.cached_byte_size += block->byte_size;
+        device_stats.largest_cached_byte_size =
+            std::max(device_stats.largest_cached_byte_size, block->byte_size);
       }
     }
-    auto& big_buffers = big_buffers_map_[it.first];
-    for (int i = 0; i < big_buffers.size(); i++) {
-      if (big_buffers[i].data == ptr) {
-        big_buffers[i].busy = false;
-        return;
-      }
+    for (const CudaMemoryBlock* block : pool.large_blocks) {
+      device_stats.cached_byte_size += block->byte_size;
+      device_stats.largest_cached_byte_size =
+          std::max(device_stats.largest_cached_byte_size, block->byte_size);
     }
+    device_stats.reserved_byte_size += device_stats.cached_byte_size;
   }
-  state = cudaFree(ptr);
-  CHECK(state == cudaSuccess) << "Error: CUDA error when release memory on device";
+  return stats;
 }
+
 std::shared_ptr<CUDADeviceAllocator> CUDADeviceAllocatorFactory::instance = nullptr;
 
-}  // namespace base
\ No newline at end of file
+}  // namespace base
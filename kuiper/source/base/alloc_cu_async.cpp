@@ -0,0 +1,81 @@
+#include <cuda_runtime_api.h>
+#include <cstdint>
+#include "base/alloc.h"
+namespace base {
+CUDAAsyncDeviceAllocator::CUDAAsyncDeviceAllocator()
+    : DeviceAllocator(DeviceType::kDeviceCUDA) {
+  // by default the pool never trims, the blocks stay cached for the next steps
+  set_release_threshold(UINT64_MAX);
+}
+
+void CUDAAsyncDeviceAllocator::set_release_threshold(uint64_t threshold) const {
+  int id = -1;
+  cudaError_t state = cudaGetDevice(&id);
+  CHECK(state == cudaSuccess);
+  cudaMemPool_t pool;
+  state = cudaDeviceGetDefaultMemPool(&pool, id);
+  CHECK(state == cudaSuccess) << "The device " << id << " does not support memory pools.";
+  state = cudaMemPoolSetAttribute(pool, cudaMemPoolAttrReleaseThreshold, &threshold);
+  CHECK(state == cudaSuccess);
+}
+
+void* CUDAAsyncDeviceAllocator::allocate(size_t byte_size) const {
+  return allocate_async(byte_size, nullptr);
+}
+
+void CUDAAsyncDeviceAllocator::release(void* ptr) const { release_async(ptr, nullptr); }
+
+void* CUDAAsyncDeviceAllocator::allocate_async(size_t byte_size, void* stream) const {
+  if (byte_size == 0) {
+    return nullptr;
+  }
+  int id = -1;
+  cudaError_t state = cudaGetDevice(&id);
+  CHECK(state == cudaSuccess);
+  void* ptr = nullptr;
+  state = cudaMallocAsync(&ptr, byte_size, static_cast<cudaStream_t>(stream));
+  if (state != cudaSuccess) {
+    cudaGetLastError();
+    char buf[256];
+    snprintf(buf, 256,
+             "Error: CUDA error when allocating %lu MB memory! maybe there's no enough memory "
+             "left on  device.",
+             byte_size >> 20);
+    LOG(ERROR) << buf;
+    return nullptr;
+  }
+  record_allocate(id, ptr, byte_size);
+  return ptr;
+}
+
+void CUDAAsyncDeviceAllocator::release_async(void* ptr, void* stream) const {
+  if (!ptr) {
+    return;
+  }
+  record_release(ptr);
+  cudaError_t state = cudaFreeAsync(ptr, static_cast<cudaStream_t>(stream));
+  CHECK(state == cudaSuccess) << "Error: CUDA error when release memory on device";
+}
+
+std::map<int, AllocatorStats> CUDAAsyncDeviceAllocator::stats() const {
+  std::map<int, AllocatorStats> stats = DeviceAllocator::stats();
+  for (auto& [device_id, device_stats] : stats) {
+    cudaMemPool_t pool;
+    if (cudaDeviceGetDefaultMemPool(&pool, device_id) != cudaSuccess) {
+      cudaGetLastError();
+      continue;
+    }
+    uint64_t reserved = 0;
+    uint64_t used = 0;
+    cudaMemPoolGetAttribute(pool, cudaMemPoolAttrReservedMemCurrent, &reserved);
+    cudaMemPoolGetAttribute(pool, cudaMemPoolAttrUsedMemCurrent, &used);
+    // the driver does not expose the free ranges of the pool, they count as one block
+    device_stats.reserved_byte_size = reserved;
+    device_stats.cached_byte_size = reserved - used;
+    device_stats.largest_cached_byte_size = reserved - used;
+  }
+  return stats;
+}
+
+std::shared_ptr<CUDAAsyncDeviceAllocator> CUDAAsyncDeviceAllocatorFactory::instance = nullptr;
+}  // namespace base
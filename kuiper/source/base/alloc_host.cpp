@@ -0,0 +1,33 @@
+#include <cuda_runtime_api.h>
+#include "base/alloc.h"
+namespace base {
+CUDAHostAllocator::CUDAHostAllocator() : DeviceAllocator(DeviceType::kDeviceCPU) {}
+
+void* CUDAHostAllocator::allocate(size_t byte_size) const {
+  if (!byte_size) {
+    return nullptr;
+  }
+  void* ptr = nullptr;
+  // portable, so that the buffers are pinned for every device of the process
+  cudaError_t state = cudaHostAlloc(&ptr, byte_size, cudaHostAllocPortable);
+  if (state != cudaSuccess) {
+    cudaGetLastError();
+    LOG(ERROR) << "Error: CUDA error when allocating " << (byte_size >> 20)
+               << " MB pinned host memory.";
+    return nullptr;
+  }
+  record_allocate(0, ptr, byte_size);
+  return ptr;
+}
+
+void CUDAHostAllocator::release(void* ptr) const {
+  if (!ptr) {
+    return;
+  }
+  record_release(ptr);
+  cudaError_t state = cudaFreeHost(ptr);
+  CHECK(state == cudaSuccess) << "Error: CUDA error when release pinned host memory";
+}
+
+std::shared_ptr<CUDAHostAllocator> CUDAHostAllocatorFactory::instance = nullptr;
+}  // namespace base
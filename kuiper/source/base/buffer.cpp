@@ -3,22 +3,23 @@
 
 namespace base {
 Buffer::Buffer(size_t byte_size, std::shared_ptr<DeviceAllocator> allocator, void* ptr,
-               bool use_external)
+               bool use_external, void* stream)
     : byte_size_(byte_size),
       allocator_(allocator),
       ptr_(ptr),
-      use_external_(use_external) {
+      use_external_(use_external),
+      stream_(stream) {
   if (!ptr_ && allocator_) {
     device_type_ = allocator_->device_type();
     use_external_ = false;
-    ptr_ = allocator_->allocate(byte_size);
+    ptr_ = allocator_->allocate_async(byte_size, stream_);
   }
 }
 
 Buffer::~Buffer() {
   if (!use_external_) {
     if (ptr_ && allocator_) {
-      allocator_->release(ptr_);
+      allocator_->release_async(ptr_, stream_);
       ptr_ = nullptr;
     }
   }
@@ -39,7 +40,7 @@ size_t Buffer::byte_size() const {
 bool Buffer::allocate() {
   if (allocator_ && byte_size_ != 0) {
     use_external_ = false;
-    ptr_ = allocator_->allocate(byte_size_);
+    ptr_ = allocator_->allocate_async(byte_size_, stream_);
     if (!ptr_) {
       return false;
     } else {
@@ -127,4 +128,19 @@ bool Buffer::is_external() const {
   return this->use_external_;
 }
 
-}  // namespace base
\ No newline at end of file
+void Buffer::rebind(void* ptr, size_t byte_size) {
+  CHECK(use_external_) << "Only an external buffer can be rebound.";
+  ptr_ = ptr;
+  byte_size_ = byte_size;
+}
+
+void* Buffer::stream() const { return stream_; }
+
+void Buffer::set_stream(void* stream) { stream_ = stream; }
+
+void Buffer::set_tag(MemoryTag tag) const {
+  if (!use_external_ && allocator_ && ptr_) {
+    allocator_->set_tag(ptr_, tag);
+  }
+}
+}  // namespace base
@@ -0,0 +1,192 @@
+#include "base/metrics.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+namespace base {
+static const char* metric_type_name(MetricType type) {
+  switch (type) {
+    case MetricType::kMetricCounter:
+      return "counter";
+    case MetricType::kMetricGauge:
+      return "gauge";
+    default:
+      return "histogram";
+  }
+}
+
+static std::string format_value(double value) {
+  char text[32];
+  std::snprintf(text, sizeof(text), "%.12g", value);
+  return text;
+}
+
+static std::string join_labels(const std::string& labels, const std::string& extra) {
+  if (labels.empty()) {
+    return extra;
+  }
+  if (extra.empty()) {
+    return labels;
+  }
+  return labels + "," + extra;
+}
+
+static void add_atomic(std::atomic<double>& target, double value) {
+  double expected = target.load(std::memory_order_relaxed);
+  while (!target.compare_exchange_weak(expected, expected + value, std::memory_order_relaxed)) {
+  }
+}
+
+void Gauge::add(double value) { add_atomic(value_, value); }
+
+Histogram::Histogram(std::vector<double> bounds) : bounds_(std::move(bounds)) {
+  CHECK(std::is_sorted(bounds_.begin(), bounds_.end()))
+      << "The bounds of a histogram should be ascending.";
+  bucket_counts_.reset(new std::atomic<uint64_t>[bounds_.size() + 1]);
+  for (size_t i = 0; i <= bounds_.size(); ++i) {
+    bucket_counts_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+void Histogram::observe(double value) {
+  const size_t bucket =
+      std::lower_bound(bounds_.begin(), bounds_.end(), value) - bounds_.begin();
+  bucket_counts_[bucket].fetch_add(1, std::memory_order_relaxed);
+  add_atomic(sum_, value);
+}
+
+std::vector<uint64_t> Histogram::cumulative_counts() const {
+  std::vector<uint64_t> counts(bounds_.size() + 1);
+  uint64_t total = 0;
+  for (size_t i = 0; i <= bounds_.size(); ++i) {
+    total += bucket_counts_[i].load(std::memory_order_relaxed);
+    counts.at(i) = total;
+  }
+  return counts;
+}
+
+uint64_t Histogram::count() const { return cumulative_counts().back(); }
+
+MetricsRegistry& MetricsRegistry::global() {
+  // never destroyed, the allocators still release the buffers of the static tensors at exit
+  static MetricsRegistry* registry = new MetricsRegistry();
+  return *registry;
+}
+
+std::vector<double> MetricsRegistry::latency_bounds() {
+  return {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1., 2.5, 5.};
+}
+
+MetricsRegistry::Metric& MetricsRegistry::find_or_add(const std::string& name,
+                                                      const std::string& help, MetricType type,
+                                                      const std::string& labels) {
+  auto family_iter =
+      std::find_if(families_.begin(), families_.end(),
+                   [&name](const std::unique_ptr<Family>& family) { return family->name == name; });
+  if (family_iter == families_.end()) {
+    auto family = std::make_unique<Family>();
+    family->name = name;
+    family->help = help;
+    family->type = type;
+    families_.push_back(std::move(family));
+    family_iter = families_.end() - 1;
+  }
+  Family& family = **family_iter;
+  CHECK(family.type == type) << "The metric " << name << " is registered as a "
+                             << metric_type_name(family.type) << ".";
+  for (Metric& metric : family.metrics) {
+    if (metric.labels == labels) {
+      return metric;
+    }
+  }
+  // the metrics live in the vector of their family, the pointers handed out are to their values
+  family.metrics.emplace_back();
+  family.metrics.back().labels = labels;
+  return family.metrics.back();
+}
+
+Counter* MetricsRegistry::counter(const std::string& name, const std::string& help,
+                                  const std::string& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Metric& metric = find_or_add(name, help, MetricType::kMetricCounter, labels);
+  if (!metric.counter) {
+    metric.counter = std::make_unique<Counter>();
+  }
+  return metric.counter.get();
+}
+
+Gauge* MetricsRegistry::gauge(const std::string& name, const std::string& help,
+                              const std::string& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Metric& metric = find_or_add(name, help, MetricType::kMetricGauge, labels);
+  if (!metric.gauge) {
+    metric.gauge = std::make_unique<Gauge>();
+  }
+  return metric.gauge.get();
+}
+
+Histogram* MetricsRegistry::histogram(const std::string& name, const std::string& help,
+                                      const std::vector<double>& bounds,
+                                      const std::string& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Metric& metric = find_or_add(name, help, MetricType::kMetricHistogram, labels);
+  if (!metric.histogram) {
+    metric.histogram = std::make_unique<Histogram>(bounds);
+  }
+  return metric.histogram.get();
+}
+
+void MetricsRegistry::append_samples(const Family& family,
+                                     std::vector<MetricSample>& samples) const {
+  for (const Metric& metric : family.metrics) {
+    if (metric.counter) {
+      samples.push_back(
+          {family.name, metric.labels, static_cast<double>(metric.counter->value())});
+    } else if (metric.gauge) {
+      samples.push_back({family.name, metric.labels, metric.gauge->value()});
+    } else if (metric.histogram) {
+      const Histogram& histogram = *metric.histogram;
+      const std::vector<uint64_t> counts = histogram.cumulative_counts();
+      for (size_t i = 0; i < counts.size(); ++i) {
+        const std::string bound =
+            i < histogram.bounds().size() ? format_value(histogram.bounds().at(i)) : "+Inf";
+        samples.push_back({family.name + "_bucket",
+                           join_labels(metric.labels, "le=\"" + bound + "\""),
+                           static_cast<double>(counts.at(i))});
+      }
+      samples.push_back({family.name + "_sum", metric.labels, histogram.sum()});
+      samples.push_back(
+          {family.name + "_count", metric.labels, static_cast<double>(counts.back())});
+    }
+  }
+}
+
+std::vector<MetricSample> MetricsRegistry::snapshot() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<MetricSample> samples;
+  for (const std::unique_ptr<Family>& family : families_) {
+    append_samples(*family, samples);
+  }
+  return samples;
+}
+
+std::string MetricsRegistry::prometheus_text() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::ostringstream os;
+  std::vector<MetricSample> samples;
+  for (const std::unique_ptr<Family>& family : families_) {
+    os << "# HELP " << family->name << " " << family->help << "\n";
+    os << "# TYPE " << family->name << " " << metric_type_name(family->type) << "\n";
+    samples.clear();
+    append_samples(*family, samples);
+    for (const MetricSample& sample : samples) {
+      os << sample.name;
+      if (!sample.labels.empty()) {
+        os << "{" << sample.labels << "}";
+      }
+      os << " " << format_value(sample.value) << "\n";
+    }
+  }
+  return os.str();
+}
+}  // namespace base
@@ -0,0 +1,270 @@
+#include "base/profiler.h"
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <map>
+namespace base {
+// a long run keeps the first ranges, the later ones are dropped
+constexpr static size_t kMaxProfileRecordNum = 1 << 20;
+
+static thread_local int32_t current_layer = -1;
+// the ranges open on this thread, only the outermost one is recorded
+static thread_local int32_t open_range_num = 0;
+
+static bool is_capturing(void* stream) {
+  cudaStreamCaptureStatus status = cudaStreamCaptureStatusNone;
+  if (cudaStreamIsCapturing(static_cast<cudaStream_t>(stream), &status) != cudaSuccess) {
+    cudaGetLastError();
+    return true;
+  }
+  return status != cudaStreamCaptureStatusNone;
+}
+
+static std::string escape_json(const std::string& text) {
+  std::string escaped;
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      escaped.push_back('\\');
+    }
+    escaped.push_back(c);
+  }
+  return escaped;
+}
+
+Profiler& Profiler::global() {
+  static Profiler profiler;
+  return profiler;
+}
+
+Profiler::~Profiler() {
+  if (base_event_) {
+    cudaEventDestroy(static_cast<cudaEvent_t>(base_event_));
+  }
+}
+
+double Profiler::host_now_us() const {
+  const int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::steady_clock::now().time_since_epoch())
+                             .count();
+  return static_cast<double>(now_ns - base_host_ns_) * 1e-3;
+}
+
+void Profiler::start() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  records_.clear();
+  events_.clear();
+  if (!base_event_) {
+    cudaEvent_t event = nullptr;
+    if (cudaEventCreate(&event) == cudaSuccess) {
+      base_event_ = event;
+    } else {
+      // without a cuda device only the cpu ranges are timed
+      cudaGetLastError();
+    }
+  }
+  if (base_event_) {
+    // the host clock starts when the device reaches the event, so the two tracks line up
+    cudaEventRecord(static_cast<cudaEvent_t>(base_event_), nullptr);
+    cudaEventSynchronize(static_cast<cudaEvent_t>(base_event_));
+  }
+  base_host_ns_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now().time_since_epoch())
+                      .count();
+  is_enabled_.store(true, std::memory_order_relaxed);
+}
+
+void Profiler::stop() {
+  is_enabled_.store(false, std::memory_order_relaxed);
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < records_.size(); ++i) {
+    PendingEvents& events = events_.at(i);
+    if (!events.begin_event) {
+      continue;
+    }
+    cudaEvent_t begin_event = static_cast<cudaEvent_t>(events.begin_event);
+    cudaEvent_t end_event = static_cast<cudaEvent_t>(events.end_event);
+    float begin_ms = 0.f;
+    float duration_ms = 0.f;
+    // a range which was never ended keeps its zero duration
+    if (end_event && cudaEventSynchronize(end_event) == cudaSuccess) {
+      cudaEventElapsedTime(&begin_ms, static_cast<cudaEvent_t>(base_event_), begin_event);
+      cudaEventElapsedTime(&duration_ms, begin_event, end_event);
+    }
+    cudaGetLastError();
+    records_.at(i).begin_us = begin_ms * 1e3;
+    records_.at(i).duration_us = duration_ms * 1e3;
+    cudaEventDestroy(begin_event);
+    if (end_event) {
+      cudaEventDestroy(end_event);
+    }
+  }
+  events_.clear();
+}
+
+int32_t Profiler::begin(const char* category, const std::string& name, int32_t layer_idx,
+                        bool is_cuda, void* stream) {
+  if (!is_enabled()) {
+    return -1;
+  }
+  PendingEvents events;
+  if (is_cuda) {
+    if (!base_event_ || is_capturing(stream)) {
+      return -1;
+    }
+    cudaEvent_t begin_event = nullptr;
+    cudaEvent_t end_event = nullptr;
+    if (cudaEventCreate(&begin_event) != cudaSuccess) {
+      cudaGetLastError();
+      return -1;
+    }
+    if (cudaEventCreate(&end_event) != cudaSuccess) {
+      cudaGetLastError();
+      cudaEventDestroy(begin_event);
+      return -1;
+    }
+    cudaEventRecord(begin_event, static_cast<cudaStream_t>(stream));
+    events.begin_event = begin_event;
+    events.end_event = end_event;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (records_.size() >= kMaxProfileRecordNum) {
+    if (events.begin_event) {
+      cudaEventDestroy(static_cast<cudaEvent_t>(events.begin_event));
+      cudaEventDestroy(static_cast<cudaEvent_t>(events.end_event));
+    }
+    return -1;
+  }
+  ProfileRecord record;
+  record.name = name;
+  record.category = category;
+  record.layer_idx = layer_idx;
+  record.is_cuda = is_cuda;
+  if (!is_cuda) {
+    record.begin_us = host_now_us();
+  }
+  records_.push_back(std::move(record));
+  events_.push_back(events);
+  return static_cast<int32_t>(records_.size()) - 1;
+}
+
+void Profiler::end(int32_t record_idx, void* stream) {
+  if (record_idx < 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  // the records were dropped by a start in between
+  if (record_idx >= records_.size()) {
+    return;
+  }
+  ProfileRecord& record = records_.at(record_idx);
+  if (record.is_cuda) {
+    cudaEventRecord(static_cast<cudaEvent_t>(events_.at(record_idx).end_event),
+                    static_cast<cudaStream_t>(stream));
+  } else {
+    record.duration_us = host_now_us() - record.begin_us;
+  }
+}
+
+const std::vector<ProfileRecord>& Profiler::records() const {
+  CHECK(!is_enabled()) << "The records are read after the profiler stops.";
+  return records_;
+}
+
+std::vector<ProfileSummary> Profiler::op_summary() const {
+  std::map<std::string, ProfileSummary> totals;
+  for (const ProfileRecord& record : records()) {
+    ProfileSummary& summary = totals[record.category];
+    summary.key = record.category;
+    summary.count += 1;
+    summary.total_us += record.duration_us;
+  }
+  std::vector<ProfileSummary> summaries;
+  for (auto& [key, summary] : totals) {
+    summaries.push_back(std::move(summary));
+  }
+  std::sort(summaries.begin(), summaries.end(),
+            [](const ProfileSummary& a, const ProfileSummary& b) {
+              return a.total_us > b.total_us;
+            });
+  return summaries;
+}
+
+std::vector<ProfileSummary> Profiler::layer_summary() const {
+  std::map<int32_t, ProfileSummary> totals;
+  for (const ProfileRecord& record : records()) {
+    if (record.layer_idx < 0) {
+      continue;
+    }
+    ProfileSummary& summary = totals[record.layer_idx];
+    summary.key = std::to_string(record.layer_idx);
+    summary.count += 1;
+    summary.total_us += record.duration_us;
+  }
+  std::vector<ProfileSummary> summaries;
+  for (auto& [layer_idx, summary] : totals) {
+    summaries.push_back(std::move(summary));
+  }
+  return summaries;
+}
+
+base::Status Profiler::write_chrome_trace(const std::string& path) const {
+  FILE* file = std::fopen(path.c_str(), "w");
+  if (!file) {
+    return base::error::PathNotValid(path);
+  }
+  std::fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  std::fprintf(file,
+               "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,"
+               "\"args\":{\"name\":\"cuda\"}},\n"
+               "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":1,"
+               "\"args\":{\"name\":\"cpu\"}}");
+  for (const ProfileRecord& record : records()) {
+    const std::string name = record.name.empty() ? record.category : record.name;
+    std::fprintf(file,
+                 ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                 "\"pid\":0,\"tid\":%d,\"args\":{\"layer_idx\":%d}}",
+                 escape_json(name).c_str(), escape_json(record.category).c_str(),
+                 record.begin_us, record.duration_us, record.is_cuda ? 0 : 1, record.layer_idx);
+  }
+  std::fprintf(file, "\n]}\n");
+  if (std::fclose(file) != 0) {
+    return base::error::InternalError("Failed to write the trace " + path);
+  }
+  return base::error::Success();
+}
+
+int32_t Profiler::current_layer_idx() { return current_layer; }
+
+void Profiler::set_current_layer_idx(int32_t layer_idx) { current_layer = layer_idx; }
+
+ProfileRange::ProfileRange(const char* category, const char* name, bool is_cuda, void* stream)
+    : stream_(stream) {
+  Profiler& profiler = Profiler::global();
+  if (!profiler.is_enabled()) {
+    return;
+  }
+  is_open_ = true;
+  if (open_range_num == 0) {
+    record_idx_ =
+        profiler.begin(category, name, Profiler::current_layer_idx(), is_cuda, stream);
+  }
+  open_range_num += 1;
+}
+
+ProfileRange::~ProfileRange() {
+  if (!is_open_) {
+    return;
+  }
+  open_range_num -= 1;
+  Profiler::global().end(record_idx_, stream_);
+}
+
+ProfileLayerScope::ProfileLayerScope(int32_t layer_idx)
+    : last_layer_idx_(Profiler::current_layer_idx()) {
+  Profiler::set_current_layer_idx(layer_idx);
+}
+
+ProfileLayerScope::~ProfileLayerScope() { Profiler::set_current_layer_idx(last_layer_idx_); }
+}  // namespace base
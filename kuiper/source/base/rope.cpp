@@ -0,0 +1,115 @@
+#include "base/rope.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <cmath>
+namespace base {
+static constexpr double kPi = 3.14159265358979323846;
+
+bool parse_rope_scaling_type(const std::string& name, RoPEScalingType& type) {
+  if (name.empty() || name == "none" || name == "default") {
+    type = RoPEScalingType::kRoPEScalingNone;
+  } else if (name == "linear") {
+    type = RoPEScalingType::kRoPEScalingLinear;
+  } else if (name == "dynamic" || name == "ntk") {
+    type = RoPEScalingType::kRoPEScalingNTK;
+  } else if (name == "yarn") {
+    type = RoPEScalingType::kRoPEScalingYaRN;
+  } else if (name == "llama3") {
+    type = RoPEScalingType::kRoPEScalingLlama3;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* rope_scaling_name(RoPEScalingType type) {
+  switch (type) {
+    case RoPEScalingType::kRoPEScalingLinear:
+      return "linear";
+    case RoPEScalingType::kRoPEScalingNTK:
+      return "ntk";
+    case RoPEScalingType::kRoPEScalingYaRN:
+      return "yarn";
+    case RoPEScalingType::kRoPEScalingLlama3:
+      return "llama3";
+    default:
+      return "none";
+  }
+}
+
+// the pair whose wavelength turns num_rotations times over the old context
+static double yarn_correction_dim(double num_rotations, int32_t head_size, double theta,
+                                  int32_t max_pos) {
+  return head_size * std::log(max_pos / (num_rotations * 2 * kPi)) / (2 * std::log(theta));
+}
+
+std::vector<float> rope_inv_freq(int32_t head_size, float theta, const RoPEScaling& scaling) {
+  CHECK_GT(head_size, 0);
+  CHECK_EQ(head_size % 2, 0);
+  const int32_t pair_num = head_size / 2;
+  const double factor = scaling.factor;
+  double base = theta;
+  if (scaling.type == RoPEScalingType::kRoPEScalingNTK) {
+    base *= std::pow(factor, static_cast<double>(head_size) / (head_size - 2));
+  }
+  std::vector<double> inv_freq(pair_num);
+  for (int32_t j = 0; j < pair_num; ++j) {
+    inv_freq.at(j) = 1.0 / std::pow(base, 2.0 * j / head_size);
+  }
+
+  if (scaling.type == RoPEScalingType::kRoPEScalingLinear) {
+    for (double& freq : inv_freq) {
+      freq /= factor;
+    }
+  } else if (scaling.type == RoPEScalingType::kRoPEScalingYaRN) {
+    CHECK_GT(scaling.original_max_pos, 0) << "The yarn scaling needs the original context.";
+    double low = std::floor(
+        yarn_correction_dim(scaling.beta_fast, head_size, base, scaling.original_max_pos));
+    double high = std::ceil(
+        yarn_correction_dim(scaling.beta_slow, head_size, base, scaling.original_max_pos));
+    low = std::max(low, 0.0);
+    high = std::min(high, static_cast<double>(head_size - 1));
+    if (low == high) {
+      high += 0.001;
+    }
+    for (int32_t j = 0; j < pair_num; ++j) {
+      // the pairs under low turn fast enough to keep, the ones over high are interpolated
+      const double ramp = std::clamp((j - low) / (high - low), 0.0, 1.0);
+      const double extrapolation = 1.0 - ramp;
+      inv_freq.at(j) = inv_freq.at(j) / factor * ramp + inv_freq.at(j) * extrapolation;
+    }
+  } else if (scaling.type == RoPEScalingType::kRoPEScalingLlama3) {
+    CHECK_GT(scaling.original_max_pos, 0) << "The llama3 scaling needs the original context.";
+    CHECK_GT(scaling.high_freq_factor, scaling.low_freq_factor);
+    const double old_context = scaling.original_max_pos;
+    const double low_freq_wavelen = old_context / scaling.low_freq_factor;
+    const double high_freq_wavelen = old_context / scaling.high_freq_factor;
+    for (double& freq : inv_freq) {
+      const double wavelen = 2 * kPi / freq;
+      if (wavelen > low_freq_wavelen) {
+        freq /= factor;
+      } else if (wavelen >= high_freq_wavelen) {
+        const double smooth = (old_context / wavelen - scaling.low_freq_factor) /
+                              (scaling.high_freq_factor - scaling.low_freq_factor);
+        freq = (1 - smooth) * freq / factor + smooth * freq;
+      }
+    }
+  }
+  return std::vector<float>(inv_freq.begin(), inv_freq.end());
+}
+
+float rope_attention_factor(const RoPEScaling& scaling) {
+  if (scaling.type != RoPEScalingType::kRoPEScalingYaRN) {
+    return 1.f;
+  }
+  if (scaling.attention_factor > 0.f) {
+    return scaling.attention_factor;
+  }
+  return scaling.factor > 1.f ? 0.1f * std::log(scaling.factor) + 1.f : 1.f;
+}
+
+int32_t rope_table_rows(int32_t max_seq_len) {
+  CHECK_GT(max_seq_len, 0);
+  return 1 + kRoPETileSize + (max_seq_len + kRoPETileSize - 1) / kRoPETileSize;
+}
+}  // namespace base
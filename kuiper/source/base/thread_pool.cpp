@@ -0,0 +1,175 @@
+#include "base/thread_pool.h"
+#include <glog/logging.h>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+namespace base {
+// set on the thread which runs a part of a job
+static thread_local bool in_parallel_job = false;
+
+static std::pair<int32_t, int32_t> part_range(int32_t task_num, int32_t part_num,
+                                              int32_t part_idx) {
+  const int32_t part_size = task_num / part_num;
+  const int32_t remainder = task_num % part_num;
+  const int32_t begin = part_idx * part_size + std::min(part_idx, remainder);
+  return {begin, begin + part_size + (part_idx < remainder ? 1 : 0)};
+}
+
+ThreadPool::ThreadPool(int32_t thread_num) : thread_num_(std::max(thread_num, 1)) {
+  for (int32_t i = 1; i < thread_num_; ++i) {
+    workers_.emplace_back(&ThreadPool::work, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  job_ready_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+int32_t ThreadPool::thread_num() const { return thread_num_; }
+
+void ThreadPool::parallel_for(int32_t task_num, int32_t min_task_num,
+                              const std::function<void(int32_t, int32_t)>& func) {
+  if (task_num <= 0) {
+    return;
+  }
+  const int32_t part_num =
+      std::min(thread_num_, std::max(task_num / std::max(min_task_num, 1), 1));
+  if (part_num == 1 || in_parallel_job) {
+    func(0, task_num);
+    return;
+  }
+
+  std::lock_guard<std::mutex> job_lock(job_mutex_);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    func_ = &func;
+    task_num_ = task_num;
+    part_num_ = part_num;
+    pending_num_ = part_num - 1;
+    generation_ += 1;
+  }
+  job_ready_.notify_all();
+
+  in_parallel_job = true;
+  const auto [begin, end] = part_range(task_num, part_num, 0);
+  func(begin, end);
+  in_parallel_job = false;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  job_done_.wait(lock, [this] { return pending_num_ == 0; });
+  func_ = nullptr;
+}
+
+void ThreadPool::work(int32_t worker_idx) {
+  in_parallel_job = true;
+  uint64_t generation = 0;
+  while (true) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    job_ready_.wait(lock, [this, generation] { return stop_ || generation_ != generation; });
+    if (stop_) {
+      return;
+    }
+    generation = generation_;
+    // the workers past the part number of a small job skip it
+    if (worker_idx >= part_num_) {
+      continue;
+    }
+    const auto* func = func_;
+    const auto [begin, end] = part_range(task_num_, part_num_, worker_idx);
+    lock.unlock();
+
+    (*func)(begin, end);
+
+    lock.lock();
+    if (--pending_num_ == 0) {
+      job_done_.notify_one();
+    }
+  }
+}
+
+int32_t ThreadPool::pin_to_numa_nodes() {
+  const std::vector<std::vector<int32_t>> nodes = numa_node_cpus();
+  if (nodes.size() <= 1) {
+    return 1;
+  }
+  const int32_t node_num = static_cast<int32_t>(nodes.size());
+  // one task per thread, the task index is the thread index
+  parallel_for(thread_num_, 1, [&](int32_t begin, int32_t end) {
+    const std::vector<int32_t>& cpus = nodes.at(begin * node_num / thread_num_);
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for (int32_t cpu : cpus) {
+      CPU_SET(cpu, &cpu_set);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_set) != 0) {
+      LOG(WARNING) << "Failed to pin the thread " << begin << " to its numa node.";
+    }
+  });
+  numa_node_num_ = node_num;
+  return node_num;
+}
+
+int32_t ThreadPool::numa_node_num() const { return numa_node_num_; }
+
+// a cpu list of the sysfs looks like 0-15,32-47
+static std::vector<int32_t> parse_cpu_list(const std::string& cpu_list) {
+  std::vector<int32_t> cpus;
+  std::stringstream stream(cpu_list);
+  std::string range;
+  while (std::getline(stream, range, ',')) {
+    if (range.empty() || range == "\n") {
+      continue;
+    }
+    const size_t dash = range.find('-');
+    const int32_t first = std::atoi(range.substr(0, dash).c_str());
+    const int32_t last =
+        dash == std::string::npos ? first : std::atoi(range.substr(dash + 1).c_str());
+    for (int32_t cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+std::vector<std::vector<int32_t>> numa_node_cpus() {
+  std::vector<std::vector<int32_t>> nodes;
+  std::ifstream online("/sys/devices/system/node/online");
+  std::string node_list;
+  if (!online || !std::getline(online, node_list)) {
+    return nodes;
+  }
+  for (int32_t node : parse_cpu_list(node_list)) {
+    std::ifstream cpu_file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string cpu_list;
+    if (cpu_file && std::getline(cpu_file, cpu_list)) {
+      std::vector<int32_t> cpus = parse_cpu_list(cpu_list);
+      // a node with memory only has no cpu to pin to
+      if (!cpus.empty()) {
+        nodes.push_back(std::move(cpus));
+      }
+    }
+  }
+  return nodes;
+}
+
+ThreadPool* ThreadPoolFactory::get_instance() {
+  static ThreadPool pool([] {
+    const char* env = std::getenv("KUIPER_NUM_THREADS");
+    if (env && std::atoi(env) > 0) {
+      return std::atoi(env);
+    }
+    return static_cast<int32_t>(std::max(std::thread::hardware_concurrency(), 1u));
+  }());
+  return &pool;
+}
+}  // namespace base
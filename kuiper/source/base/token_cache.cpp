@@ -0,0 +1,298 @@
+#include "base/token_cache.h"
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <vector>
+namespace base {
+// the seeds tried for one bucket before the build gives up, a bucket of keys with the same full
+// hash never fits
+static constexpr uint32_t kMaxSeed = 1u << 20;
+
+static size_t align_up(size_t byte_size) { return (byte_size + 7) / 8 * 8; }
+
+// fnv-1a, the hash has to be the same on every machine which maps the file
+static uint64_t hash_bytes(std::string_view bytes) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (char c : bytes) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// the murmur3 finalizer over the hash and a seed
+static uint64_t mix_hash(uint64_t hash, uint32_t seed) {
+  hash ^= seed * 0x9e3779b97f4a7c15ull;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static bool source_stat(const std::string& source_path, uint64_t& size, int64_t& mtime_ns) {
+  struct stat file_stat;
+  if (stat(source_path.c_str(), &file_stat) != 0) {
+    return false;
+  }
+  size = file_stat.st_size;
+  mtime_ns = static_cast<int64_t>(file_stat.st_mtim.tv_sec) * 1000000000 +
+             file_stat.st_mtim.tv_nsec;
+  return true;
+}
+
+// the offsets of the sections after the header
+struct TokenCacheLayout {
+  size_t entries = 0;
+  size_t specials = 0;
+  size_t seeds = 0;
+  size_t slots = 0;
+  size_t bytes = 0;
+  size_t byte_size = 0;
+
+  explicit TokenCacheLayout(const TokenCacheHeader& header) {
+    entries = align_up(sizeof(TokenCacheHeader));
+    specials = align_up(entries + static_cast<size_t>(header.entry_num) * 8);
+    seeds = align_up(specials + static_cast<size_t>(header.special_num) * 12);
+    slots = align_up(seeds + static_cast<size_t>(header.bucket_num) * 4);
+    bytes = align_up(slots + static_cast<size_t>(header.slot_num) * 4);
+    byte_size = bytes + header.bytes_size;
+  }
+};
+
+TokenCache::~TokenCache() {
+  if (mapped_ptr_) {
+    munmap(mapped_ptr_, mapped_size_);
+  }
+}
+
+Status TokenCache::write_file(const std::string& path, const std::string& source_path,
+                              const Encoder& encoder, const Encoder& special_encoder) {
+  TokenCacheHeader header;
+  if (!source_stat(source_path, header.source_size, header.source_mtime_ns)) {
+    return error::PathNotValid(source_path);
+  }
+  int32_t max_id = -1;
+  for (const auto& [bytes, id] : encoder) {
+    if (id < 0) {
+      return error::InvalidArgument("The token " + bytes + " has a negative id.");
+    }
+    max_id = std::max(max_id, id);
+  }
+  header.entry_num = max_id + 1;
+  header.token_num = static_cast<int32_t>(encoder.size());
+  header.special_num = static_cast<int32_t>(special_encoder.size());
+  // four keys a bucket on slots which are four fifths full, a bucket finds its seed in a few
+  // tries and the table stays small
+  header.bucket_num = std::max(header.token_num / 4, 1);
+  header.slot_num = header.token_num + header.token_num / 4 + 1;
+  for (const auto& [bytes, id] : encoder) {
+    header.bytes_size += bytes.size();
+  }
+  for (const auto& [bytes, id] : special_encoder) {
+    header.bytes_size += bytes.size();
+  }
+  if (header.bytes_size > std::numeric_limits<uint32_t>::max()) {
+    return error::InvalidArgument("The vocab is too large for a token cache.");
+  }
+
+  const TokenCacheLayout layout(header);
+  std::vector<char> data(layout.byte_size, 0);
+  std::memcpy(data.data(), &header, sizeof(TokenCacheHeader));
+  auto* entries = reinterpret_cast<Entry*>(data.data() + layout.entries);
+  auto* specials = reinterpret_cast<Special*>(data.data() + layout.specials);
+  auto* seeds = reinterpret_cast<uint32_t*>(data.data() + layout.seeds);
+  auto* slots = reinterpret_cast<int32_t*>(data.data() + layout.slots);
+  char* bytes_data = data.data() + layout.bytes;
+  uint32_t offset = 0;
+  for (int32_t id = 0; id < header.entry_num; ++id) {
+    entries[id] = {0, 0};
+  }
+  std::vector<std::vector<std::pair<uint64_t, int32_t>>> buckets(header.bucket_num);
+  for (const auto& [bytes, id] : encoder) {
+    std::memcpy(bytes_data + offset, bytes.data(), bytes.size());
+    entries[id] = {offset, static_cast<uint32_t>(bytes.size())};
+    offset += static_cast<uint32_t>(bytes.size());
+    const uint64_t hash = hash_bytes(bytes);
+    buckets[mix_hash(hash, 0) % header.bucket_num].emplace_back(hash, id);
+  }
+  int32_t special_index = 0;
+  for (const auto& [bytes, id] : special_encoder) {
+    std::memcpy(bytes_data + offset, bytes.data(), bytes.size());
+    specials[special_index++] = {id, offset, static_cast<uint32_t>(bytes.size())};
+    offset += static_cast<uint32_t>(bytes.size());
+  }
+
+  // the largest buckets are placed first, while most of the slots are free
+  std::vector<int32_t> bucket_order(header.bucket_num);
+  for (int32_t b = 0; b < header.bucket_num; ++b) {
+    bucket_order[b] = b;
+  }
+  std::stable_sort(bucket_order.begin(), bucket_order.end(), [&](int32_t a, int32_t b) {
+    return buckets[a].size() > buckets[b].size();
+  });
+  std::fill(slots, slots + header.slot_num, -1);
+  std::vector<int32_t> bucket_slots;
+  for (int32_t b : bucket_order) {
+    const auto& bucket = buckets[b];
+    seeds[b] = 0;
+    if (bucket.empty()) {
+      continue;
+    }
+    uint32_t seed = 1;
+    for (; seed < kMaxSeed; ++seed) {
+      bucket_slots.clear();
+      bool is_placed = true;
+      for (const auto& [hash, id] : bucket) {
+        const int32_t slot = static_cast<int32_t>(mix_hash(hash, seed) % header.slot_num);
+        if (slots[slot] != -1 ||
+            std::find(bucket_slots.begin(), bucket_slots.end(), slot) != bucket_slots.end()) {
+          is_placed = false;
+          break;
+        }
+        bucket_slots.push_back(slot);
+      }
+      if (is_placed) {
+        break;
+      }
+    }
+    if (seed == kMaxSeed) {
+      return error::InternalError("Failed to build the perfect hash of the vocab.");
+    }
+    seeds[b] = seed;
+    for (size_t i = 0; i < bucket.size(); ++i) {
+      slots[bucket_slots[i]] = bucket[i].second;
+    }
+  }
+
+  // written aside first, so a start never maps a half written cache
+  const std::string temp_path = path + ".tmp";
+  FILE* file = std::fopen(temp_path.c_str(), "wb");
+  if (!file) {
+    return error::PathNotValid(temp_path);
+  }
+  const size_t written_size = std::fwrite(data.data(), 1, data.size(), file);
+  const bool is_closed = std::fclose(file) == 0;
+  if (written_size != data.size() || !is_closed) {
+    std::remove(temp_path.c_str());
+    return error::InternalError("Failed to write the token cache " + temp_path);
+  }
+  if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+    std::remove(temp_path.c_str());
+    return error::InternalError("Failed to write the token cache " + path);
+  }
+  return error::Success();
+}
+
+Status TokenCache::map_file(const std::string& path, const std::string& source_path,
+                            std::shared_ptr<TokenCache>& cache) {
+  uint64_t source_size = 0;
+  int64_t source_mtime_ns = 0;
+  if (!source_stat(source_path, source_size, source_mtime_ns)) {
+    return error::PathNotValid(source_path);
+  }
+  const int32_t fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return error::PathNotValid(path);
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size < sizeof(TokenCacheHeader)) {
+    close(fd);
+    return error::InvalidArgument("The token cache " + path + " is too short.");
+  }
+  const size_t file_size = file_stat.st_size;
+  void* ptr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    return error::InternalError("Failed to map the token cache " + path);
+  }
+  std::shared_ptr<TokenCache> mapped(new TokenCache());
+  mapped->mapped_ptr_ = ptr;
+  mapped->mapped_size_ = file_size;
+  TokenCacheHeader& header = mapped->header_;
+  std::memcpy(&header, ptr, sizeof(TokenCacheHeader));
+  if (header.magic != kTokenCacheMagic || header.version != kTokenCacheVersion) {
+    return error::InvalidArgument("The file " + path + " is not a token cache.");
+  }
+  if (header.source_size != source_size || header.source_mtime_ns != source_mtime_ns) {
+    return error::InvalidArgument("The token cache " + path + " is of another " + source_path);
+  }
+  if (header.entry_num < 0 || header.token_num < 0 || header.special_num < 0 ||
+      header.bucket_num <= 0 || header.slot_num <= 0 ||
+      TokenCacheLayout(header).byte_size != file_size) {
+    return error::InvalidArgument("The token cache " + path + " is truncated.");
+  }
+  const TokenCacheLayout layout(header);
+  const char* data = static_cast<const char*>(ptr);
+  mapped->entries_ = reinterpret_cast<const Entry*>(data + layout.entries);
+  mapped->specials_ = reinterpret_cast<const Special*>(data + layout.specials);
+  mapped->seeds_ = reinterpret_cast<const uint32_t*>(data + layout.seeds);
+  mapped->slots_ = reinterpret_cast<const int32_t*>(data + layout.slots);
+  mapped->bytes_ = data + layout.bytes;
+  // a damaged cache is found here instead of at a lookup, the scan is over the small tables
+  for (int32_t i = 0; i < header.entry_num; ++i) {
+    const Entry& entry = mapped->entries_[i];
+    if (static_cast<uint64_t>(entry.offset) + entry.size > header.bytes_size) {
+      return error::InvalidArgument("The token cache " + path + " is damaged.");
+    }
+  }
+  for (int32_t i = 0; i < header.special_num; ++i) {
+    const Special& special = mapped->specials_[i];
+    if (static_cast<uint64_t>(special.offset) + special.size > header.bytes_size) {
+      return error::InvalidArgument("The token cache " + path + " is damaged.");
+    }
+  }
+  for (int32_t i = 0; i < header.slot_num; ++i) {
+    if (mapped->slots_[i] < -1 || mapped->slots_[i] >= header.entry_num) {
+      return error::InvalidArgument("The token cache " + path + " is damaged.");
+    }
+  }
+  cache = std::move(mapped);
+  return error::Success();
+}
+
+int32_t TokenCache::find(std::string_view bytes) const {
+  const uint64_t hash = hash_bytes(bytes);
+  const uint32_t seed = seeds_[mix_hash(hash, 0) % header_.bucket_num];
+  const int32_t id = slots_[mix_hash(hash, seed) % header_.slot_num];
+  if (id < 0) {
+    return -1;
+  }
+  const Entry& entry = entries_[id];
+  if (entry.size != bytes.size() || std::memcmp(bytes_ + entry.offset, bytes.data(), entry.size)) {
+    return -1;
+  }
+  return id;
+}
+
+bool TokenCache::token(int32_t id, std::string_view& bytes) const {
+  if (id < 0 || id >= header_.entry_num) {
+    return false;
+  }
+  const Entry& entry = entries_[id];
+  // the entries of the ids without a token are empty, no token of the vocab is
+  if (entry.size == 0) {
+    return false;
+  }
+  bytes = std::string_view(bytes_ + entry.offset, entry.size);
+  return true;
+}
+
+int32_t TokenCache::token_num() const { return header_.token_num; }
+
+TokenCache::Encoder TokenCache::special_encoder() const {
+  Encoder special_encoder;
+  for (int32_t i = 0; i < header_.special_num; ++i) {
+    const Special& special = specials_[i];
+    special_encoder.insert({std::string(bytes_ + special.offset, special.size), special.id});
+  }
+  return special_encoder;
+}
+}  // namespace base
@@ -0,0 +1,143 @@
+#include "base/virtual_memory.h"
+#include <cuda.h>
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <sys/mman.h>
+#include <unistd.h>
+namespace base {
+// the host commits in larger steps than a page, so a growth does not madvise page by page
+static constexpr size_t kHostGranularity = 2 * 1024 * 1024;
+
+static CUmemAllocationProp device_allocation_prop(int32_t device_id) {
+  CUmemAllocationProp prop = {};
+  prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
+  prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+  prop.location.id = device_id;
+  return prop;
+}
+
+VirtualMemory::VirtualMemory(DeviceType device_type, size_t byte_size)
+    : device_type_(device_type) {
+  CHECK_GT(byte_size, 0);
+  if (device_type == DeviceType::kDeviceCPU) {
+    granularity_ = kHostGranularity;
+    byte_size_ = (byte_size + granularity_ - 1) / granularity_ * granularity_;
+    // the pages are only backed once they are touched
+    ptr_ = mmap(nullptr, byte_size_, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    CHECK(ptr_ != MAP_FAILED) << "Failed to reserve " << byte_size_ << " bytes on the host.";
+  } else {
+    CHECK(device_type == DeviceType::kDeviceCUDA);
+    int device_id = 0;
+    CHECK(cudaGetDevice(&device_id) == cudaSuccess);
+    device_id_ = device_id;
+    const CUmemAllocationProp prop = device_allocation_prop(device_id_);
+    CHECK(cuMemGetAllocationGranularity(&granularity_, &prop,
+                                        CU_MEM_ALLOC_GRANULARITY_MINIMUM) == CUDA_SUCCESS);
+    byte_size_ = (byte_size + granularity_ - 1) / granularity_ * granularity_;
+    CUdeviceptr ptr = 0;
+    CHECK(cuMemAddressReserve(&ptr, byte_size_, granularity_, 0, 0) == CUDA_SUCCESS)
+        << "Failed to reserve " << byte_size_ << " bytes of the cuda address space.";
+    ptr_ = reinterpret_cast<void*>(ptr);
+  }
+  const size_t chunk_num = byte_size_ / granularity_;
+  handles_.resize(chunk_num, 0);
+  is_mapped_.resize(chunk_num, false);
+}
+
+VirtualMemory::~VirtualMemory() {
+  if (device_type_ == DeviceType::kDeviceCPU) {
+    munmap(ptr_, byte_size_);
+    return;
+  }
+  cuCtxSynchronize();
+  for (size_t chunk = 0; chunk < is_mapped_.size(); ++chunk) {
+    if (is_mapped_.at(chunk)) {
+      unmap_chunk(chunk);
+    }
+  }
+  cuMemAddressFree(reinterpret_cast<CUdeviceptr>(ptr_), byte_size_);
+}
+
+void* VirtualMemory::ptr() const { return ptr_; }
+
+size_t VirtualMemory::byte_size() const { return byte_size_; }
+
+size_t VirtualMemory::granularity() const { return granularity_; }
+
+size_t VirtualMemory::committed_byte_size() const { return mapped_chunk_num_ * granularity_; }
+
+bool VirtualMemory::map_chunk(size_t chunk) {
+  if (device_type_ == DeviceType::kDeviceCPU) {
+    is_mapped_.at(chunk) = true;
+    mapped_chunk_num_ += 1;
+    return true;
+  }
+  const CUmemAllocationProp prop = device_allocation_prop(device_id_);
+  CUmemGenericAllocationHandle handle = 0;
+  if (cuMemCreate(&handle, granularity_, &prop, 0) != CUDA_SUCCESS) {
+    return false;
+  }
+  const CUdeviceptr chunk_ptr = reinterpret_cast<CUdeviceptr>(ptr_) + chunk * granularity_;
+  CUmemAccessDesc access = {};
+  access.location = prop.location;
+  access.flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
+  if (cuMemMap(chunk_ptr, granularity_, 0, handle, 0) != CUDA_SUCCESS) {
+    cuMemRelease(handle);
+    return false;
+  }
+  if (cuMemSetAccess(chunk_ptr, granularity_, &access, 1) != CUDA_SUCCESS) {
+    cuMemUnmap(chunk_ptr, granularity_);
+    cuMemRelease(handle);
+    return false;
+  }
+  handles_.at(chunk) = handle;
+  is_mapped_.at(chunk) = true;
+  mapped_chunk_num_ += 1;
+  return true;
+}
+
+void VirtualMemory::unmap_chunk(size_t chunk) {
+  uint8_t* chunk_ptr = static_cast<uint8_t*>(ptr_) + chunk * granularity_;
+  if (device_type_ == DeviceType::kDeviceCPU) {
+    madvise(chunk_ptr, granularity_, MADV_DONTNEED);
+  } else {
+    cuMemUnmap(reinterpret_cast<CUdeviceptr>(chunk_ptr), granularity_);
+    cuMemRelease(handles_.at(chunk));
+    handles_.at(chunk) = 0;
+  }
+  is_mapped_.at(chunk) = false;
+  mapped_chunk_num_ -= 1;
+}
+
+bool VirtualMemory::commit(const std::vector<std::pair<size_t, size_t>>& ranges) {
+  std::vector<bool> is_needed(is_mapped_.size(), false);
+  for (const auto& [offset, size] : ranges) {
+    if (size == 0) {
+      continue;
+    }
+    CHECK_LE(offset + size, byte_size_);
+    const size_t first_chunk = offset / granularity_;
+    const size_t last_chunk = (offset + size - 1) / granularity_;
+    for (size_t chunk = first_chunk; chunk <= last_chunk; ++chunk) {
+      is_needed.at(chunk) = true;
+    }
+  }
+  bool has_unmap = false;
+  for (size_t chunk = 0; chunk < is_mapped_.size(); ++chunk) {
+    has_unmap |= is_mapped_.at(chunk) && !is_needed.at(chunk);
+  }
+  // the kernels in flight may still read the chunks which are released
+  if (has_unmap && device_type_ == DeviceType::kDeviceCUDA) {
+    cuCtxSynchronize();
+  }
+  for (size_t chunk = 0; chunk < is_mapped_.size(); ++chunk) {
+    if (is_mapped_.at(chunk) && !is_needed.at(chunk)) {
+      unmap_chunk(chunk);
+    } else if (!is_mapped_.at(chunk) && is_needed.at(chunk) && !map_chunk(chunk)) {
+      return false;
+    }
+  }
+  return true;
+}
+}  // namespace base
@@ -0,0 +1,236 @@
+#include "model/batch_runner.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <map>
+namespace model {
+namespace {
+std::string json_escape(const std::string& text) {
+  std::string escaped;
+  escaped.reserve(text.size() + 2);
+  for (char c : text) {
+    switch (c) {
+      case '"':
+        escaped += "\\\"";
+        break;
+      case '\\':
+        escaped += "\\\\";
+        break;
+      case '\n':
+        escaped += "\\n";
+        break;
+      case '\r':
+        escaped += "\\r";
+        break;
+      case '\t':
+        escaped += "\\t";
+        break;
+      default:
+        if (static_cast<uint8_t>(c) < 0x20) {
+          char code[8];
+          snprintf(code, sizeof(code), "\\u%04x", static_cast<uint8_t>(c));
+          escaped += code;
+        } else {
+          escaped.push_back(c);
+        }
+    }
+  }
+  return escaped;
+}
+}  // namespace
+
+BatchRunner::BatchRunner(const Model& model, const BatchOptions& options)
+    : model_(model), options_(options), pool_(options.thread_num) {
+  CHECK_GT(options_.max_new_tokens, 0);
+  CHECK_GT(options_.window_size, 0);
+  CHECK_GT(options_.bucket_size, 0);
+}
+
+std::vector<BatchRunner::Prompt> BatchRunner::read_window(std::ifstream& input,
+                                                          int64_t& line_index) {
+  std::vector<Prompt> prompts;
+  std::vector<std::string> lines;
+  std::string line;
+  while (static_cast<int32_t>(lines.size()) < options_.window_size &&
+         std::getline(input, line)) {
+    const int64_t index = line_index++;
+    if (line.empty()) {
+      continue;
+    }
+    lines.push_back(std::move(line));
+    prompts.emplace_back();
+    prompts.back().index = index;
+  }
+  pool_.parallel_for(static_cast<int32_t>(lines.size()), 1, [&](int32_t begin, int32_t end) {
+    for (int32_t i = begin; i < end; ++i) {
+      prompts[i].tokens = model_.encode(lines[i]);
+    }
+  });
+  // the longest first, so the long tail of a window is made of the short prompts
+  std::stable_sort(prompts.begin(), prompts.end(), [](const Prompt& a, const Prompt& b) {
+    return a.tokens.size() > b.tokens.size();
+  });
+  return prompts;
+}
+
+void BatchRunner::push_output(std::vector<Output> outputs) {
+  if (outputs.empty()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (Output& output : outputs) {
+      pending_outputs_.push_back(std::move(output));
+    }
+  }
+  cond_.notify_one();
+}
+
+void BatchRunner::write_outputs(std::ofstream& output) {
+  std::vector<Output> outputs;
+  std::vector<std::string> texts;
+  while (true) {
+    bool is_final = false;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this] { return is_finished_ || !pending_outputs_.empty(); });
+      outputs.swap(pending_outputs_);
+      is_final = is_finished_;
+    }
+    texts.assign(outputs.size(), std::string());
+    pool_.parallel_for(static_cast<int32_t>(outputs.size()), 1, [&](int32_t begin, int32_t end) {
+      for (int32_t i = begin; i < end; ++i) {
+        if (!outputs[i].tokens.empty()) {
+          texts[i] = model_.decode(outputs[i].tokens);
+        }
+      }
+    });
+    for (size_t i = 0; i < outputs.size(); ++i) {
+      output << "{\"index\": " << outputs[i].index
+             << ", \"prompt_tokens\": " << outputs[i].prompt_token_num
+             << ", \"output_tokens\": " << outputs[i].tokens.size() << ", \"finish_reason\": \""
+             << json_escape(outputs[i].finish_reason) << "\", \"text\": \""
+             << json_escape(texts[i]) << "\"}\n";
+    }
+    output.flush();
+    outputs.clear();
+    if (is_final) {
+      return;
+    }
+  }
+}
+
+base::Status BatchRunner::run(const std::string& input_path, const std::string& output_path,
+                              BatchStats* stats) {
+  std::ifstream input(input_path);
+  if (!input.is_open()) {
+    return base::error::PathNotValid("The prompt file " + input_path + " can not be opened.");
+  }
+  std::ofstream output(output_path, std::ios::out | std::ios::trunc);
+  if (!output.is_open()) {
+    return base::error::PathNotValid("The output file " + output_path + " can not be opened.");
+  }
+  const auto start_time = std::chrono::steady_clock::now();
+  Scheduler scheduler(model_);
+  scheduler.set_prefill_chunk_size(options_.prefill_chunk_size);
+  scheduler.set_step_token_budget(options_.step_token_budget);
+  scheduler.set_host_kv_swap(options_.host_kv_swap_byte_size);
+
+  pending_outputs_.clear();
+  is_finished_ = false;
+  std::thread writer(&BatchRunner::write_outputs, this, std::ref(output));
+
+  int64_t line_index = 0;
+  std::vector<Prompt> window = read_window(input, line_index);
+  // one window ahead, the input and the line index are only touched by the read in flight
+  auto read_next = [&] { return read_window(input, line_index); };
+  std::future<std::vector<Prompt>> next_window = std::async(std::launch::async, read_next);
+  size_t next_prompt = 0;
+  // the input line of every scheduled sequence
+  std::map<int32_t, int64_t> line_indices;
+  BatchStats batch_stats;
+  base::Status status;
+  while (true) {
+    while (scheduler.waiting_size() < options_.bucket_size) {
+      if (next_prompt == window.size()) {
+        if (!next_window.valid()) {
+          break;
+        }
+        window = next_window.get();
+        next_prompt = 0;
+        // a window is only empty at the end of the input
+        if (window.empty()) {
+          break;
+        }
+        next_window = std::async(std::launch::async, read_next);
+        continue;
+      }
+      const size_t bucket_end = std::min(window.size(), next_prompt + options_.bucket_size);
+      std::vector<Output> rejected;
+      for (; next_prompt < bucket_end; ++next_prompt) {
+        const Prompt& prompt = window.at(next_prompt);
+        const int32_t prompt_len = static_cast<int32_t>(prompt.tokens.size());
+        batch_stats.prompt_num += 1;
+        if (prompt_len == 0 || prompt_len >= model_.max_position()) {
+          Output failed;
+          failed.index = prompt.index;
+          failed.prompt_token_num = prompt_len;
+          failed.finish_reason = "error: the prompt has " + std::to_string(prompt_len) +
+                                 " tokens, the model has " +
+                                 std::to_string(model_.max_position()) + " positions";
+          rejected.push_back(std::move(failed));
+          batch_stats.failed_num += 1;
+          continue;
+        }
+        batch_stats.prompt_token_num += prompt_len;
+        const int32_t seq_id =
+            scheduler.add_sequence(prompt.tokens, options_.max_new_tokens, options_.ignore_eos);
+        line_indices.emplace(seq_id, prompt.index);
+      }
+      push_output(std::move(rejected));
+    }
+    if (!scheduler.has_unfinished()) {
+      break;
+    }
+    status = scheduler.step();
+    if (!status) {
+      break;
+    }
+    std::vector<Output> outputs;
+    for (Sequence& seq : scheduler.pop_finished()) {
+      auto it = line_indices.find(seq.seq_id);
+      CHECK(it != line_indices.end());
+      Output finished;
+      finished.index = it->second;
+      finished.prompt_token_num = static_cast<int32_t>(seq.prompt_tokens.size());
+      // the end of the sentence is not added to the output
+      finished.finish_reason =
+          !seq.ignore_eos && model_.is_sentence_ending(seq.next_token) ? "stop" : "length";
+      batch_stats.output_token_num += static_cast<int64_t>(seq.output_tokens.size());
+      finished.tokens = std::move(seq.output_tokens);
+      outputs.push_back(std::move(finished));
+      line_indices.erase(it);
+    }
+    push_output(std::move(outputs));
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_finished_ = true;
+  }
+  cond_.notify_one();
+  writer.join();
+  // the read in flight when a step failed
+  if (next_window.valid()) {
+    next_window.wait();
+  }
+  batch_stats.seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+  if (stats) {
+    *stats = batch_stats;
+  }
+  return status;
+}
+}  // namespace model
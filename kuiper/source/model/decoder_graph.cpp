@@ -0,0 +1,168 @@
+#include "model/decoder_graph.h"
+#include <glog/logging.h>
+#include <algorithm>
+namespace model {
+const char* graph_op_name(GraphOp op) {
+  switch (op) {
+    case GraphOp::kMoveToHost:
+      return "move_to_host";
+    case GraphOp::kAttentionNorm:
+      return "attention_norm";
+    case GraphOp::kQuery:
+      return "wq";
+    case GraphOp::kQueryBias:
+      return "wq_bias";
+    case GraphOp::kKey:
+      return "wk";
+    case GraphOp::kKeyBias:
+      return "wk_bias";
+    case GraphOp::kValue:
+      return "wv";
+    case GraphOp::kValueBias:
+      return "wv_bias";
+    case GraphOp::kRope:
+      return "rope";
+    case GraphOp::kKVWrite:
+      return "kv_write";
+    case GraphOp::kAttention:
+      return "attention";
+    case GraphOp::kAttentionOutput:
+      return "wo";
+    case GraphOp::kAttentionResidual:
+      return "attention_residual";
+    case GraphOp::kFFNNorm:
+      return "ffn_norm";
+    case GraphOp::kGate:
+      return "w1";
+    case GraphOp::kUp:
+      return "w3";
+    case GraphOp::kSwiGLU:
+      return "swiglu";
+    case GraphOp::kDown:
+      return "w2";
+    case GraphOp::kFFNResidual:
+      return "ffn_residual";
+    case GraphOp::kFinalNorm:
+      return "final_norm";
+    case GraphOp::kClassifier:
+      return "cls";
+    case GraphOp::kQKV:
+      return "wqkv";
+    case GraphOp::kRopeKVWrite:
+      return "rope_kv_write";
+    case GraphOp::kAttentionResidualNorm:
+      return "attention_residual_norm";
+    case GraphOp::kGateUpSwiGLU:
+      return "w13_swiglu";
+    case GraphOp::kFFNResidualNorm:
+      return "ffn_residual_norm";
+    case GraphOp::kAttentionAllReduce:
+      return "attention_all_reduce";
+    case GraphOp::kFFNAllReduce:
+      return "ffn_all_reduce";
+    default:
+      return "unknown";
+  }
+}
+
+DecoderGraph DecoderGraph::build(const TransformerConfig& config, int32_t host_layer_begin,
+                                 bool has_qkv_bias, bool is_tensor_parallel) {
+  DecoderGraph graph;
+  std::vector<GraphNode>& nodes = graph.nodes_;
+  for (int32_t layer_idx = 0; layer_idx < config.layer_num_; ++layer_idx) {
+    const bool is_host = layer_idx >= host_layer_begin;
+    auto add = [&](GraphOp op) { nodes.push_back({op, layer_idx, is_host}); };
+    if (layer_idx == host_layer_begin) {
+      add(GraphOp::kMoveToHost);
+    }
+    add(GraphOp::kAttentionNorm);
+    add(GraphOp::kQuery);
+    if (has_qkv_bias) {
+      add(GraphOp::kQueryBias);
+    }
+    add(GraphOp::kKey);
+    if (has_qkv_bias) {
+      add(GraphOp::kKeyBias);
+    }
+    add(GraphOp::kValue);
+    if (has_qkv_bias) {
+      add(GraphOp::kValueBias);
+    }
+    add(GraphOp::kRope);
+    add(GraphOp::kKVWrite);
+    add(GraphOp::kAttention);
+    add(GraphOp::kAttentionOutput);
+    if (is_tensor_parallel) {
+      add(GraphOp::kAttentionAllReduce);
+    }
+    add(GraphOp::kAttentionResidual);
+    add(GraphOp::kFFNNorm);
+    add(GraphOp::kGate);
+    add(GraphOp::kUp);
+    add(GraphOp::kSwiGLU);
+    add(GraphOp::kDown);
+    if (is_tensor_parallel) {
+      add(GraphOp::kFFNAllReduce);
+    }
+    add(GraphOp::kFFNResidual);
+  }
+  // the final norm and the classifier run with the last layer
+  const bool is_last_host = config.layer_num_ > host_layer_begin;
+  nodes.push_back({GraphOp::kFinalNorm, config.layer_num_, is_last_host});
+  nodes.push_back({GraphOp::kClassifier, config.layer_num_, is_last_host});
+  return graph;
+}
+
+void DecoderGraph::fuse(const FusionOptions& options) {
+  fuse_sequence({GraphOp::kQuery, GraphOp::kQueryBias}, GraphOp::kQuery, false, true, true);
+  fuse_sequence({GraphOp::kKey, GraphOp::kKeyBias}, GraphOp::kKey, false, true, true);
+  fuse_sequence({GraphOp::kValue, GraphOp::kValueBias}, GraphOp::kValue, false, true, true);
+  fuse_sequence({GraphOp::kQuery, GraphOp::kKey, GraphOp::kValue}, GraphOp::kQKV, false,
+                options.pack_qkv, options.pack_qkv);
+  fuse_sequence({GraphOp::kRope, GraphOp::kKVWrite}, GraphOp::kRopeKVWrite, false,
+                options.rope_kv_write, options.host_rope_kv_write);
+  fuse_sequence({GraphOp::kAttentionResidual, GraphOp::kFFNNorm},
+                GraphOp::kAttentionResidualNorm, false, options.add_rmsnorm,
+                options.add_rmsnorm);
+  fuse_sequence({GraphOp::kGate, GraphOp::kUp, GraphOp::kSwiGLU}, GraphOp::kGateUpSwiGLU, false,
+                options.gate_up_swiglu, options.gate_up_swiglu);
+  fuse_sequence({GraphOp::kFFNResidual, GraphOp::kAttentionNorm}, GraphOp::kFFNResidualNorm,
+                true, options.add_rmsnorm, options.add_rmsnorm);
+}
+
+void DecoderGraph::fuse_sequence(const std::vector<GraphOp>& ops, GraphOp fused_op,
+                                 bool spans_layers, bool device_enabled, bool host_enabled) {
+  CHECK(!ops.empty());
+  std::vector<GraphNode> fused_nodes;
+  fused_nodes.reserve(nodes_.size());
+  size_t i = 0;
+  while (i < nodes_.size()) {
+    const GraphNode& first = nodes_[i];
+    bool is_match = i + ops.size() <= nodes_.size() &&
+                    (first.is_host ? host_enabled : device_enabled);
+    for (size_t j = 0; is_match && j < ops.size(); ++j) {
+      const GraphNode& node = nodes_[i + j];
+      const int32_t layer_idx = spans_layers ? first.layer_idx + static_cast<int32_t>(j)
+                                             : first.layer_idx;
+      is_match = node.op == ops[j] && node.is_host == first.is_host &&
+                 node.layer_idx == layer_idx;
+    }
+    if (!is_match) {
+      fused_nodes.push_back(first);
+      i += 1;
+      continue;
+    }
+    // the fused node belongs to the layer of the first op of the sequence
+    fused_nodes.push_back({fused_op, first.layer_idx, first.is_host});
+    i += ops.size();
+  }
+  nodes_ = std::move(fused_nodes);
+}
+
+const std::vector<GraphNode>& DecoderGraph::nodes() const { return nodes_; }
+
+int32_t DecoderGraph::count(GraphOp op) const {
+  return static_cast<int32_t>(std::count_if(
+      nodes_.begin(), nodes_.end(), [op](const GraphNode& node) { return node.op == op; }));
+}
+}  // namespace model
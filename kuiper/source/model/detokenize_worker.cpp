@@ -0,0 +1,61 @@
+#include "model/detokenize_worker.h"
+#include <glog/logging.h>
+namespace model {
+DetokenizeWorker::DetokenizeWorker(StreamDecoder decoder, SinkFunc sink)
+    : decoder_(std::move(decoder)), sink_(std::move(sink)) {
+  CHECK(sink_ != nullptr);
+  thread_ = std::thread(&DetokenizeWorker::run, this);
+}
+
+DetokenizeWorker::~DetokenizeWorker() { finish(); }
+
+void DetokenizeWorker::push(const std::vector<int32_t>& tokens) {
+  if (tokens.empty()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    CHECK(!is_finished_) << "The tokens are pushed after the finish of the detokenize.";
+    pending_tokens_.insert(pending_tokens_.end(), tokens.begin(), tokens.end());
+  }
+  cond_.notify_one();
+}
+
+void DetokenizeWorker::finish() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_finished_ = true;
+  }
+  cond_.notify_one();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+const std::string& DetokenizeWorker::text() const { return text_; }
+
+void DetokenizeWorker::run() {
+  std::vector<int32_t> tokens;
+  while (true) {
+    bool is_final = false;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this] { return is_finished_ || !pending_tokens_.empty(); });
+      tokens.swap(pending_tokens_);
+      is_final = is_finished_;
+    }
+    std::string text = decoder_.push(tokens);
+    tokens.clear();
+    if (is_final) {
+      text += decoder_.finish();
+    }
+    if (!text.empty()) {
+      text_ += text;
+      sink_(text);
+    }
+    if (is_final) {
+      return;
+    }
+  }
+}
+}  // namespace model
@@ -0,0 +1,688 @@
+#include "model/gguf.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "base/half.h"
+#include "base/thread_pool.h"
+namespace model {
+namespace {
+// the element number and the byte size of one block of the type, false for the types which
+// can not be read
+bool block_layout(int32_t type, int64_t& block_elems, int64_t& block_bytes) {
+  switch (static_cast<GgufType>(type)) {
+    case GgufType::kF32:
+      block_elems = 1, block_bytes = 4;
+      return true;
+    case GgufType::kF16:
+    case GgufType::kBF16:
+      block_elems = 1, block_bytes = 2;
+      return true;
+    case GgufType::kQ4_0:
+      block_elems = 32, block_bytes = 18;
+      return true;
+    case GgufType::kQ8_0:
+      block_elems = 32, block_bytes = 34;
+      return true;
+    case GgufType::kQ4_K:
+      block_elems = 256, block_bytes = 144;
+      return true;
+    case GgufType::kQ6_K:
+      block_elems = 256, block_bytes = 210;
+      return true;
+    default:
+      return false;
+  }
+}
+
+void get_scale_min_k4(int32_t j, const uint8_t* q, uint8_t& scale, uint8_t& min) {
+  if (j < 4) {
+    scale = q[j] & 63;
+    min = q[j + 4] & 63;
+  } else {
+    scale = (q[j + 4] & 0xf) | ((q[j - 4] >> 6) << 4);
+    min = (q[j + 4] >> 4) | ((q[j] >> 6) << 4);
+  }
+}
+
+uint16_t read_u16(const uint8_t* src) {
+  uint16_t value = 0;
+  memcpy(&value, src, sizeof(uint16_t));
+  return value;
+}
+
+// the n values of one row in the block type, n is a multiple of the block size
+void dequant_row(int32_t type, const uint8_t* src, float* dst, int64_t n) {
+  switch (static_cast<GgufType>(type)) {
+    case GgufType::kF32:
+      memcpy(dst, src, n * sizeof(float));
+      break;
+    case GgufType::kF16:
+      for (int64_t i = 0; i < n; ++i) {
+        dst[i] = base::half_to_float(read_u16(src + 2 * i));
+      }
+      break;
+    case GgufType::kBF16:
+      for (int64_t i = 0; i < n; ++i) {
+        dst[i] = base::bf16_to_float(read_u16(src + 2 * i));
+      }
+      break;
+    case GgufType::kQ4_0:
+      for (int64_t block = 0; block < n / 32; ++block, src += 18, dst += 32) {
+        const float d = base::half_to_float(read_u16(src));
+        for (int32_t j = 0; j < 16; ++j) {
+          dst[j] = d * static_cast<float>((src[2 + j] & 0xf) - 8);
+          dst[j + 16] = d * static_cast<float>((src[2 + j] >> 4) - 8);
+        }
+      }
+      break;
+    case GgufType::kQ8_0:
+      for (int64_t block = 0; block < n / 32; ++block, src += 34, dst += 32) {
+        const float d = base::half_to_float(read_u16(src));
+        for (int32_t j = 0; j < 32; ++j) {
+          dst[j] = d * static_cast<float>(static_cast<int8_t>(src[2 + j]));
+        }
+      }
+      break;
+    case GgufType::kQ4_K:
+      for (int64_t block = 0; block < n / 256; ++block, src += 144) {
+        const float d = base::half_to_float(read_u16(src));
+        const float dmin = base::half_to_float(read_u16(src + 2));
+        const uint8_t* scales = src + 4;
+        const uint8_t* q = src + 16;
+        for (int32_t j = 0, is = 0; j < 256; j += 64, is += 2, q += 32) {
+          uint8_t scale = 0, min = 0;
+          get_scale_min_k4(is, scales, scale, min);
+          const float d1 = d * scale, m1 = dmin * min;
+          get_scale_min_k4(is + 1, scales, scale, min);
+          const float d2 = d * scale, m2 = dmin * min;
+          for (int32_t l = 0; l < 32; ++l) {
+            *dst++ = d1 * static_cast<float>(q[l] & 0xf) - m1;
+          }
+          for (int32_t l = 0; l < 32; ++l) {
+            *dst++ = d2 * static_cast<float>(q[l] >> 4) - m2;
+          }
+        }
+      }
+      break;
+    case GgufType::kQ6_K:
+      for (int64_t block = 0; block < n / 256; ++block, src += 210) {
+        const uint8_t* ql = src;
+        const uint8_t* qh = src + 128;
+        const auto* sc = reinterpret_cast<const int8_t*>(src + 192);
+        const float d = base::half_to_float(read_u16(src + 208));
+        for (int32_t half = 0; half < 2; ++half, dst += 128, ql += 64, qh += 32, sc += 8) {
+          for (int32_t l = 0; l < 32; ++l) {
+            const int32_t is = l / 16;
+            const int32_t q1 = ((ql[l] & 0xf) | (((qh[l] >> 0) & 3) << 4)) - 32;
+            const int32_t q2 = ((ql[l + 32] & 0xf) | (((qh[l] >> 2) & 3) << 4)) - 32;
+            const int32_t q3 = ((ql[l] >> 4) | (((qh[l] >> 4) & 3) << 4)) - 32;
+            const int32_t q4 = ((ql[l + 32] >> 4) | (((qh[l] >> 6) & 3) << 4)) - 32;
+            dst[l] = d * sc[is] * static_cast<float>(q1);
+            dst[l + 32] = d * sc[is + 2] * static_cast<float>(q2);
+            dst[l + 64] = d * sc[is + 4] * static_cast<float>(q3);
+            dst[l + 96] = d * sc[is + 6] * static_cast<float>(q4);
+          }
+        }
+      }
+      break;
+    default:
+      LOG(FATAL) << "The gguf type " << type << " can not be dequantized.";
+  }
+}
+
+// the layouts the model reads, int8 and int4 are the groups of MatmulLayer
+enum class Layout : int32_t { kFp32, kFp16, kBf16, kInt8, kInt4 };
+
+constexpr int32_t kGgufGroupSize = 32;
+
+size_t align_int4_part(size_t byte_size) { return (byte_size + 15) / 16 * 16; }
+
+size_t layout_byte_size(Layout layout, size_t element_num) {
+  const size_t group_num = element_num / kGgufGroupSize;
+  switch (layout) {
+    case Layout::kFp32:
+      return element_num * sizeof(float);
+    case Layout::kFp16:
+    case Layout::kBf16:
+      return element_num * sizeof(uint16_t);
+    case Layout::kInt8:
+      return element_num + group_num * sizeof(float);
+    case Layout::kInt4:
+      return align_int4_part(element_num / 2) + align_int4_part(group_num * sizeof(uint16_t));
+  }
+  return 0;
+}
+
+base::DataType layout_data_type(Layout layout) {
+  switch (layout) {
+    case Layout::kFp32:
+      return base::DataType::kDataTypeFp32;
+    case Layout::kFp16:
+      return base::DataType::kDataTypeFp16;
+    case Layout::kBf16:
+      return base::DataType::kDataTypeBf16;
+    default:
+      return base::DataType::kDataTypeInt8;
+  }
+}
+
+bool is_in_place(int32_t type, Layout layout) {
+  const auto gguf_type = static_cast<GgufType>(type);
+  return (gguf_type == GgufType::kF32 && layout == Layout::kFp32) ||
+         (gguf_type == GgufType::kF16 && layout == Layout::kFp16) ||
+         (gguf_type == GgufType::kBF16 && layout == Layout::kBf16);
+}
+
+// writes the row of cols values at row_idx of a rows x cols tensor in the layout to dst
+void encode_row(Layout layout, const float* row, int64_t row_idx, int64_t rows, int64_t cols,
+                uint8_t* dst) {
+  const int64_t begin = row_idx * cols;
+  switch (layout) {
+    case Layout::kFp32:
+      memcpy(dst + begin * sizeof(float), row, cols * sizeof(float));
+      break;
+    case Layout::kFp16:
+    case Layout::kBf16: {
+      auto* out = reinterpret_cast<uint16_t*>(dst) + begin;
+      for (int64_t i = 0; i < cols; ++i) {
+        out[i] =
+            layout == Layout::kFp16 ? base::float_to_half(row[i]) : base::float_to_bf16(row[i]);
+      }
+      break;
+    }
+    case Layout::kInt8: {
+      auto* weight = reinterpret_cast<int8_t*>(dst) + begin;
+      uint8_t* scales = dst + rows * cols;
+      for (int64_t group = 0; group < cols / kGgufGroupSize; ++group) {
+        const float* values = row + group * kGgufGroupSize;
+        float max_value = 0.f;
+        for (int32_t i = 0; i < kGgufGroupSize; ++i) {
+          max_value = std::max(max_value, std::fabs(values[i]));
+        }
+        const float scale = max_value / 127.f;
+        const float inv_scale = scale > 0.f ? 1.f / scale : 0.f;
+        for (int32_t i = 0; i < kGgufGroupSize; ++i) {
+          weight[group * kGgufGroupSize + i] =
+              static_cast<int8_t>(std::lround(values[i] * inv_scale));
+        }
+        memcpy(scales + ((begin / kGgufGroupSize) + group) * sizeof(float), &scale,
+               sizeof(float));
+      }
+      break;
+    }
+    case Layout::kInt4: {
+      uint8_t* weight = dst + begin / 2;
+      uint8_t* scales = dst + align_int4_part(rows * cols / 2);
+      for (int64_t group = 0; group < cols / kGgufGroupSize; ++group) {
+        const float* values = row + group * kGgufGroupSize;
+        float max_value = 0.f;
+        for (int32_t i = 0; i < kGgufGroupSize; ++i) {
+          max_value = std::max(max_value, std::fabs(values[i]));
+        }
+        // the scale is stored in fp16, the values are rounded with the stored one
+        const uint16_t half_scale = base::float_to_half(max_value / 7.f);
+        const float scale = base::half_to_float(half_scale);
+        const float inv_scale = scale > 0.f ? 1.f / scale : 0.f;
+        for (int32_t i = 0; i < kGgufGroupSize; i += 2) {
+          const auto lo = static_cast<uint8_t>(
+              std::clamp(std::lround(values[i] * inv_scale) + 8, long(0), long(15)));
+          const auto hi = static_cast<uint8_t>(
+              std::clamp(std::lround(values[i + 1] * inv_scale) + 8, long(0), long(15)));
+          weight[(group * kGgufGroupSize + i) / 2] = lo | (hi << 4);
+        }
+        memcpy(scales + ((begin / kGgufGroupSize) + group) * sizeof(uint16_t), &half_scale,
+               sizeof(uint16_t));
+      }
+      break;
+    }
+  }
+}
+
+// q8_0 and q4_0 blocks are the groups of the quant kernels in another order, they are moved
+// without a requantization
+bool repack_row(int32_t type, Layout layout, const uint8_t* src, int64_t row_idx, int64_t rows,
+                int64_t cols, uint8_t* dst) {
+  const int64_t begin = row_idx * cols;
+  if (static_cast<GgufType>(type) == GgufType::kQ8_0 && layout == Layout::kInt8) {
+    uint8_t* scales = dst + rows * cols;
+    for (int64_t block = 0; block < cols / 32; ++block, src += 34) {
+      const float scale = base::half_to_float(read_u16(src));
+      memcpy(dst + begin + block * 32, src + 2, 32);
+      memcpy(scales + (begin / 32 + block) * sizeof(float), &scale, sizeof(float));
+    }
+    return true;
+  }
+  if (static_cast<GgufType>(type) == GgufType::kQ4_0 && layout == Layout::kInt4) {
+    uint8_t* weight = dst + begin / 2;
+    uint8_t* scales = dst + align_int4_part(rows * cols / 2);
+    for (int64_t block = 0; block < cols / 32; ++block, src += 18) {
+      memcpy(scales + (begin / 32 + block) * sizeof(uint16_t), src, sizeof(uint16_t));
+      // the block holds the element j in the low and j + 16 in the high nibble of byte j, the
+      // kernels read the adjacent pairs from one byte
+      uint8_t values[32];
+      for (int32_t j = 0; j < 16; ++j) {
+        values[j] = src[2 + j] & 0xf;
+        values[j + 16] = src[2 + j] >> 4;
+      }
+      for (int32_t j = 0; j < 32; j += 2) {
+        weight[(block * 32 + j) / 2] = values[j] | (values[j + 1] << 4);
+      }
+    }
+    return true;
+  }
+  return false;
+}
+
+class GgufReader {
+ public:
+  GgufReader(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+  template <typename T>
+  bool read(T& value) {
+    if (size_ - pos_ < sizeof(T)) {
+      return false;
+    }
+    memcpy(&value, data_ + pos_, sizeof(T));
+    pos_ += sizeof(T);
+    return true;
+  }
+
+  bool read_string(std::string* value) {
+    uint64_t length = 0;
+    if (!read(length) || size_ - pos_ < length) {
+      return false;
+    }
+    if (value != nullptr) {
+      value->assign(reinterpret_cast<const char*>(data_ + pos_), length);
+    }
+    pos_ += length;
+    return true;
+  }
+
+  bool skip(uint64_t byte_size) {
+    if (size_ - pos_ < byte_size) {
+      return false;
+    }
+    pos_ += byte_size;
+    return true;
+  }
+
+  // a scalar metadata value of the type as a number
+  bool read_number(uint32_t type, double& value) {
+    switch (type) {
+      case 0:
+        return read_as<uint8_t>(value);
+      case 1:
+        return read_as<int8_t>(value);
+      case 2:
+        return read_as<uint16_t>(value);
+      case 3:
+        return read_as<int16_t>(value);
+      case 4:
+        return read_as<uint32_t>(value);
+      case 5:
+        return read_as<int32_t>(value);
+      case 6:
+        return read_as<float>(value);
+      case 7:
+        return read_as<uint8_t>(value);
+      case 10:
+        return read_as<uint64_t>(value);
+      case 11:
+        return read_as<int64_t>(value);
+      case 12:
+        return read_as<double>(value);
+      default:
+        return false;
+    }
+  }
+
+  size_t pos() const { return pos_; }
+
+ private:
+  template <typename T>
+  bool read_as(double& value) {
+    T typed_value{};
+    if (!read(typed_value)) {
+      return false;
+    }
+    value = static_cast<double>(typed_value);
+    return true;
+  }
+
+ private:
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  size_t pos_ = 0;
+};
+
+constexpr uint32_t kGgufString = 8;
+constexpr uint32_t kGgufArray = 9;
+
+// the export name of a gguf tensor, empty for the tensors the model does not read
+std::string export_name(const std::string& name) {
+  static const std::map<std::string, std::string> kModelNames = {
+      {"token_embd.weight", "tok_embeddings.weight"},
+      {"output_norm.weight", "norm.weight"},
+      {"output.weight", "output.weight"}};
+  static const std::map<std::string, std::string> kLayerNames = {
+      {"attn_norm.weight", "attention_norm.weight"},
+      {"attn_q.weight", "attention.wq.weight"},
+      {"attn_q.bias", "attention.wq.bias"},
+      {"attn_k.weight", "attention.wk.weight"},
+      {"attn_k.bias", "attention.wk.bias"},
+      {"attn_v.weight", "attention.wv.weight"},
+      {"attn_v.bias", "attention.wv.bias"},
+      {"attn_output.weight", "attention.wo.weight"},
+      {"ffn_norm.weight", "ffn_norm.weight"},
+      {"ffn_gate.weight", "feed_forward.w1.weight"},
+      {"ffn_down.weight", "feed_forward.w2.weight"},
+      {"ffn_up.weight", "feed_forward.w3.weight"}};
+  auto model_iter = kModelNames.find(name);
+  if (model_iter != kModelNames.end()) {
+    return model_iter->second;
+  }
+  if (name.compare(0, 4, "blk.") != 0) {
+    return "";
+  }
+  const size_t dot = name.find('.', 4);
+  if (dot == std::string::npos) {
+    return "";
+  }
+  auto layer_iter = kLayerNames.find(name.substr(dot + 1));
+  if (layer_iter == kLayerNames.end()) {
+    return "";
+  }
+  return "layers." + name.substr(4, dot - 4) + "." + layer_iter->second;
+}
+}  // namespace
+
+base::Status GgufFile::parse(const void* data, size_t file_size) {
+  using namespace base;
+  GgufReader reader(static_cast<const uint8_t*>(data), file_size);
+  uint32_t magic = 0;
+  uint32_t version = 0;
+  uint64_t tensor_num = 0;
+  uint64_t kv_num = 0;
+  if (!reader.read(magic) || magic != kGgufMagic || !reader.read(version)) {
+    return error::ModelParseError("The model file is not a gguf file.");
+  }
+  if (version != 2 && version != 3) {
+    return error::ModelParseError("The gguf version " + std::to_string(version) +
+                                  " is not supported.");
+  }
+  if (!reader.read(tensor_num) || !reader.read(kv_num)) {
+    return error::ModelParseError("Failed to read the header of the gguf file.");
+  }
+
+  for (uint64_t i = 0; i < kv_num; ++i) {
+    std::string key;
+    uint32_t type = 0;
+    if (!reader.read_string(&key) || !reader.read(type)) {
+      return error::ModelParseError("Failed to read the metadata of the gguf file.");
+    }
+    bool is_read = false;
+    if (type == kGgufString) {
+      is_read = reader.read_string(&strings_[key]);
+    } else if (type == kGgufArray) {
+      uint32_t item_type = 0;
+      uint64_t item_num = 0;
+      is_read = reader.read(item_type) && reader.read(item_num);
+      for (uint64_t item = 0; is_read && item < item_num; ++item) {
+        double ignored = 0.;
+        is_read = item_type == kGgufString ? reader.read_string(nullptr)
+                                           : reader.read_number(item_type, ignored);
+      }
+    } else {
+      is_read = reader.read_number(type, numbers_[key]);
+    }
+    if (!is_read) {
+      return error::ModelParseError("Failed to read the metadata " + key + " of the gguf file.");
+    }
+  }
+
+  tensors_.resize(tensor_num);
+  for (GgufTensor& tensor : tensors_) {
+    uint32_t dim_num = 0;
+    if (!reader.read_string(&tensor.name) || !reader.read(dim_num) || dim_num == 0 ||
+        dim_num > 4) {
+      return error::ModelParseError("Failed to read the tensor infos of the gguf file.");
+    }
+    tensor.dims.resize(dim_num);
+    for (uint32_t dim = 0; dim < dim_num; ++dim) {
+      uint64_t ne = 0;
+      if (!reader.read(ne)) {
+        return error::ModelParseError("Failed to read the shape of " + tensor.name + ".");
+      }
+      tensor.dims.at(dim_num - 1 - dim) = static_cast<int64_t>(ne);
+    }
+    uint64_t offset = 0;
+    if (!reader.read(tensor.type) || !reader.read(offset)) {
+      return error::ModelParseError("Failed to read the tensor info of " + tensor.name + ".");
+    }
+    tensor.offset = offset;
+  }
+
+  const auto alignment = static_cast<size_t>(get_int("general.alignment", 32));
+  if (alignment == 0) {
+    return error::ModelParseError("The gguf file has an invalid alignment.");
+  }
+  const size_t data_begin = (reader.pos() + alignment - 1) / alignment * alignment;
+  for (GgufTensor& tensor : tensors_) {
+    tensor.offset += data_begin;
+    int64_t block_elems = 0;
+    int64_t block_bytes = 0;
+    if (!block_layout(tensor.type, block_elems, block_bytes)) {
+      // a type the model can not read is rejected once the tensor is used
+      continue;
+    }
+    int64_t element_num = 1;
+    for (int64_t dim : tensor.dims) {
+      element_num *= dim;
+    }
+    if (tensor.dims.back() % block_elems != 0) {
+      return error::ModelParseError("The rows of " + tensor.name + " are not whole blocks.");
+    }
+    tensor.byte_size = static_cast<size_t>(element_num / block_elems * block_bytes);
+    if (tensor.offset + tensor.byte_size > file_size) {
+      return error::ModelParseError("The tensor " + tensor.name + " lies outside of the file.");
+    }
+  }
+  return error::Success();
+}
+
+int64_t GgufFile::get_int(const std::string& key, int64_t default_value) const {
+  auto iter = numbers_.find(key);
+  return iter == numbers_.end() ? default_value : static_cast<int64_t>(iter->second);
+}
+
+double GgufFile::get_float(const std::string& key, double default_value) const {
+  auto iter = numbers_.find(key);
+  return iter == numbers_.end() ? default_value : iter->second;
+}
+
+std::string GgufFile::get_string(const std::string& key) const {
+  auto iter = strings_.find(key);
+  return iter == strings_.end() ? std::string() : iter->second;
+}
+
+const std::vector<GgufTensor>& GgufFile::tensors() const { return tensors_; }
+
+const GgufTensor* GgufFile::find(const std::string& name) const {
+  for (const GgufTensor& tensor : tensors_) {
+    if (tensor.name == name) {
+      return &tensor;
+    }
+  }
+  return nullptr;
+}
+
+// the tensor in the layout, in place or converted into raw_data.converted
+static base::Status add_gguf_tensor(RawModelDataGguf& raw_data, TensorDirectory& directory,
+                                    const GgufTensor& tensor, const std::string& name,
+                                    Layout layout) {
+  using namespace base;
+  int64_t block_elems = 0;
+  int64_t block_bytes = 0;
+  if (!block_layout(tensor.type, block_elems, block_bytes)) {
+    return error::ModelParseError("The tensor " + tensor.name + " has the unsupported gguf type " +
+                                  std::to_string(tensor.type) + ".");
+  }
+  TensorInfo info;
+  info.data_type = layout_data_type(layout);
+  for (int64_t dim : tensor.dims) {
+    info.dims.push_back(static_cast<int32_t>(dim));
+  }
+  const int64_t cols = tensor.dims.back();
+  const int64_t rows = static_cast<int64_t>(info.size()) / cols;
+  if (is_in_place(tensor.type, layout)) {
+    info.offset = tensor.offset;
+    info.byte_size = tensor.byte_size;
+    directory.add(name, std::move(info));
+    return error::Success();
+  }
+  if ((layout == Layout::kInt8 || layout == Layout::kInt4) && cols % kGgufGroupSize != 0) {
+    return error::ModelParseError("The rows of " + tensor.name +
+                                  " are not whole quant groups.");
+  }
+
+  info.byte_size = layout_byte_size(layout, info.size());
+  raw_data.converted.emplace_back(info.byte_size, 0);
+  uint8_t* dst = raw_data.converted.back().data();
+  const uint8_t* src = static_cast<const uint8_t*>(raw_data.data) + tensor.offset;
+  const int64_t row_bytes = cols / block_elems * block_bytes;
+  base::ThreadPoolFactory::get_instance()->parallel_for(
+      static_cast<int32_t>(rows), 16, [&](int32_t begin, int32_t end) {
+        std::vector<float> row(cols);
+        for (int32_t row_idx = begin; row_idx < end; ++row_idx) {
+          const uint8_t* row_src = src + row_idx * row_bytes;
+          if (repack_row(tensor.type, layout, row_src, row_idx, rows, cols, dst)) {
+            continue;
+          }
+          dequant_row(tensor.type, row_src, row.data(), cols);
+          encode_row(layout, row.data(), row_idx, rows, cols, dst);
+        }
+      });
+  info.data = dst;
+  directory.add(name, std::move(info));
+  return error::Success();
+}
+
+base::Status load_gguf_model(RawModelDataGguf& raw_data, TensorDirectory& directory,
+                             GgufModelInfo& info) {
+  using namespace base;
+  GgufFile file;
+  auto parse_status = file.parse(raw_data.data, raw_data.file_size);
+  if (!parse_status) {
+    return parse_status;
+  }
+  const std::string arch = file.get_string("general.architecture");
+  if (arch != "llama" && arch != "qwen2") {
+    return error::ModelParseError("The gguf architecture " + arch + " is not supported.");
+  }
+  const GgufTensor* embedding = file.find("token_embd.weight");
+  const GgufTensor* query = file.find("blk.0.attn_q.weight");
+  if (embedding == nullptr || query == nullptr || embedding->dims.size() != 2) {
+    return error::ModelParseError("The gguf file has no embedding or attention weights.");
+  }
+  const bool is_shared_weight = file.find("output.weight") == nullptr;
+
+  ModelConfig& config = info.config;
+  config.dim = static_cast<int32_t>(file.get_int(arch + ".embedding_length", 0));
+  config.hidden_dim = static_cast<int32_t>(file.get_int(arch + ".feed_forward_length", 0));
+  config.layer_num = static_cast<int32_t>(file.get_int(arch + ".block_count", 0));
+  config.head_num = static_cast<int32_t>(file.get_int(arch + ".attention.head_count", 0));
+  config.kv_head_num =
+      static_cast<int32_t>(file.get_int(arch + ".attention.head_count_kv", config.head_num));
+  const auto vocab_size = static_cast<int32_t>(embedding->dims.at(0));
+  // the legacy sign of the vocabulary size, negative when the classifier has its own weight
+  config.vocab_size = is_shared_weight ? vocab_size : -vocab_size;
+  config.seq_len = static_cast<int32_t>(
+      std::min<int64_t>(file.get_int(arch + ".context_length", 2048), kGgufMaxSeqLen));
+  if (config.dim <= 0 || config.hidden_dim <= 0 || config.layer_num <= 0 ||
+      config.head_num <= 0 || config.kv_head_num <= 0) {
+    return error::ModelParseError("The gguf file misses the config of the " + arch + " model.");
+  }
+  info.rope_theta = static_cast<float>(file.get_float(arch + ".rope.freq_base", 10000.));
+  // llama.cpp writes the llama3 scaling as a tensor of frequency factors, only the scalings
+  // of the metadata are read
+  const std::string scaling_name = file.get_string(arch + ".rope.scaling.type");
+  if (!base::parse_rope_scaling_type(scaling_name, info.rope_scaling.type)) {
+    return error::ModelParseError("The rope scaling " + scaling_name + " is not supported.");
+  }
+  info.rope_scaling.factor =
+      static_cast<float>(file.get_float(arch + ".rope.scaling.factor", 1.));
+  info.rope_scaling.original_max_pos = static_cast<int32_t>(
+      file.get_int(arch + ".rope.scaling.original_context_length", 0));
+  if (info.rope_scaling.original_max_pos == 0 && info.rope_scaling.factor > 1.f) {
+    info.rope_scaling.original_max_pos = static_cast<int32_t>(
+        file.get_int(arch + ".context_length", 2048) / info.rope_scaling.factor);
+  }
+  info.rope_scaling.attention_factor =
+      static_cast<float>(file.get_float(arch + ".rope.scaling.attn_factor", 0.));
+  // llama.cpp stores the llama queries and keys permuted for the rope of the adjacent pairs,
+  // qwen2 keeps the halves of the heads
+  info.is_rope_rotate_half = arch == "qwen2";
+
+  Layout matmul_layout = Layout::kFp32;
+  switch (static_cast<GgufType>(query->type)) {
+    case GgufType::kF32:
+      break;
+    case GgufType::kF16:
+      matmul_layout = Layout::kFp16;
+      break;
+    case GgufType::kBF16:
+      matmul_layout = Layout::kBf16;
+      break;
+    case GgufType::kQ4_0:
+      matmul_layout = Layout::kInt4;
+      break;
+    case GgufType::kQ8_0:
+      matmul_layout = Layout::kInt8;
+      break;
+    case GgufType::kQ4_K:
+    case GgufType::kQ6_K:
+      LOG(WARNING) << "The k quant weights of the gguf file are requantized to int8 groups of "
+                   << kGgufGroupSize;
+      matmul_layout = Layout::kInt8;
+      break;
+    default:
+      return error::ModelParseError("The gguf weight type " + std::to_string(query->type) +
+                                    " is not supported.");
+  }
+  const bool is_quant = matmul_layout == Layout::kInt8 || matmul_layout == Layout::kInt4;
+  if (is_quant && arch == "qwen2") {
+    return error::ModelParseError(
+        "The quant qwen2 layers have no attention bias, the gguf file needs float weights.");
+  }
+  info.weight_data_type = layout_data_type(matmul_layout);
+  info.is_int4 = matmul_layout == Layout::kInt4;
+  info.group_size = is_quant ? kGgufGroupSize : 0;
+  // the embedding, the norms and the biases of a quant model are fp32
+  const Layout other_layout = is_quant ? Layout::kFp32 : matmul_layout;
+
+  for (const GgufTensor& tensor : file.tensors()) {
+    const std::string name = export_name(tensor.name);
+    if (name.empty()) {
+      LOG(INFO) << "The gguf tensor " << tensor.name << " is not used by the model";
+      continue;
+    }
+    const bool is_matmul = tensor.dims.size() == 2 && name != "tok_embeddings.weight";
+    const Layout layout = is_matmul ? matmul_layout : other_layout;
+    auto tensor_status = add_gguf_tensor(raw_data, directory, tensor, name, layout);
+    if (!tensor_status) {
+      return tensor_status;
+    }
+  }
+  if (is_quant && is_shared_weight) {
+    // the quant classifier can not read the fp32 embedding, it gets a quant copy
+    auto cls_status =
+        add_gguf_tensor(raw_data, directory, *embedding, "output.weight", matmul_layout);
+    if (!cls_status) {
+      return cls_status;
+    }
+  }
+  return error::Success();
+}
+}  // namespace model
@@ -0,0 +1,149 @@
+#include "model/int4_import.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+#include "base/half.h"
+#include "base/thread_pool.h"
+#include "op/matmul.h"
+namespace model {
+namespace {
+// the nibble of the output channel o % 8 in an int32 of an awq checkpoint
+constexpr int32_t kAwqShift[8] = {0, 4, 1, 5, 2, 6, 3, 7};
+
+size_t align_int4_part(size_t byte_size) { return (byte_size + 15) / 16 * 16; }
+
+int32_t nibble(int32_t packed, int32_t idx) {
+  return static_cast<int32_t>((static_cast<uint32_t>(packed) >> (4 * idx)) & 0xf);
+}
+
+int32_t weight_value(const Int4Source& src, int32_t col, int32_t row) {
+  if (src.format == Int4Format::kGptq) {
+    return nibble(src.qweight[static_cast<int64_t>(col / 8) * src.rows + row], col % 8);
+  }
+  return nibble(src.qweight[static_cast<int64_t>(col) * (src.rows / 8) + row / 8],
+                kAwqShift[row % 8]);
+}
+
+int32_t zero_point_value(const Int4Source& src, int32_t group, int32_t row) {
+  const int32_t shift = src.format == Int4Format::kGptq ? row % 8 : kAwqShift[row % 8];
+  const int32_t value =
+      nibble(src.qzeros[static_cast<int64_t>(group) * (src.rows / 8) + row / 8], shift);
+  return src.is_zero_point_offset ? value + 1 : value;
+}
+}  // namespace
+
+base::Status repack_int4_weight(const Int4Source& src, int32_t group_size,
+                                std::vector<uint8_t>& packed, std::vector<int32_t>& order) {
+  using namespace base;
+  const int32_t rows = src.rows;
+  const int32_t cols = src.cols;
+  if (rows <= 0 || cols <= 0 || rows % 8 != 0 || cols % 8 != 0 || src.group_size <= 0 ||
+      cols % src.group_size != 0 || group_size <= 0 || cols % group_size != 0) {
+    return error::InvalidArgument("The int4 weight of " + std::to_string(rows) + " x " +
+                                  std::to_string(cols) + " does not split into groups.");
+  }
+  if (!src.qweight || !src.qzeros || !src.scales) {
+    return error::InvalidArgument("The int4 weight misses its qweight, qzeros or scales.");
+  }
+  const int32_t src_group_num = cols / src.group_size;
+  std::vector<int32_t> col_groups(cols);
+  for (int32_t col = 0; col < cols; ++col) {
+    col_groups[col] = src.g_idx ? src.g_idx[col] : col / src.group_size;
+    if (col_groups[col] < 0 || col_groups[col] >= src_group_num) {
+      return error::InvalidArgument("The g_idx of the int4 weight points past its groups.");
+    }
+  }
+  order.resize(cols);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&col_groups](int32_t a, int32_t b) {
+    return col_groups[a] < col_groups[b];
+  });
+  // a group of the repacked weight takes the scale of the group of its first column
+  const int32_t group_num_per_row = cols / group_size;
+  std::vector<int32_t> group_sources(group_num_per_row);
+  for (int32_t group = 0; group < group_num_per_row; ++group) {
+    group_sources[group] = col_groups[order[group * group_size]];
+    for (int32_t i = 1; i < group_size; ++i) {
+      if (col_groups[order[group * group_size + i]] != group_sources[group]) {
+        return error::InvalidArgument("The int4 groups of " + std::to_string(group_size) +
+                                      " columns do not line up with the groups of the "
+                                      "checkpoint.");
+      }
+    }
+  }
+  bool is_in_place = true;
+  for (int32_t col = 0; col < cols && is_in_place; ++col) {
+    is_in_place = order[col] == col;
+  }
+  if (is_in_place) {
+    order.clear();
+  }
+
+  const size_t weight_num = static_cast<size_t>(rows) * cols;
+  const size_t group_num = weight_num / group_size;
+  packed.assign(op::MatmulLayer::int4_byte_size(rows, cols, group_size, true), 0);
+  uint8_t* weight = packed.data();
+  uint8_t* scales = weight + align_int4_part(weight_num / 2);
+  uint8_t* zero_points = scales + align_int4_part(group_num * sizeof(uint16_t));
+  ThreadPoolFactory::get_instance()->parallel_for(rows, 16, [&](int32_t begin, int32_t end) {
+    for (int32_t row = begin; row < end; ++row) {
+      uint8_t* row_weight = weight + static_cast<size_t>(row) * cols / 2;
+      for (int32_t col = 0; col < cols; col += 2) {
+        const int32_t lo = weight_value(src, order.empty() ? col : order[col], row);
+        const int32_t hi = weight_value(src, order.empty() ? col + 1 : order[col + 1], row);
+        row_weight[col / 2] = static_cast<uint8_t>(lo | (hi << 4));
+      }
+      for (int32_t group = 0; group < group_num_per_row; ++group) {
+        const int32_t src_group = group_sources[group];
+        const size_t idx = static_cast<size_t>(row) * group_num_per_row + group;
+        memcpy(scales + idx * sizeof(uint16_t),
+               src.scales + static_cast<int64_t>(src_group) * rows + row, sizeof(uint16_t));
+        zero_points[idx] = static_cast<uint8_t>(zero_point_value(src, src_group, row));
+      }
+    }
+  });
+  return error::Success();
+}
+
+std::string int4_order_name(const std::string& weight_name) {
+  const std::string suffix = ".weight";
+  CHECK(weight_name.size() > suffix.size() &&
+        weight_name.compare(weight_name.size() - suffix.size(), suffix.size(), suffix) == 0);
+  return weight_name.substr(0, weight_name.size() - suffix.size()) + ".order";
+}
+
+void quantize_int4_row(const float* row, int64_t row_idx, int64_t rows, int64_t cols,
+                       int32_t group_size, uint8_t* dst) {
+  const int64_t group_num = rows * cols / group_size;
+  uint8_t* weight = dst + row_idx * cols / 2;
+  uint8_t* scales = dst + align_int4_part(rows * cols / 2);
+  uint8_t* zero_points = scales + align_int4_part(group_num * sizeof(uint16_t));
+  for (int64_t group = 0; group < cols / group_size; ++group) {
+    const float* values = row + group * group_size;
+    // the range keeps the zero, so a group of one sign still has a zero point in its nibbles
+    float min_value = 0.f;
+    float max_value = 0.f;
+    for (int32_t i = 0; i < group_size; ++i) {
+      min_value = std::min(min_value, values[i]);
+      max_value = std::max(max_value, values[i]);
+    }
+    // the scale is stored in fp16, the values are rounded with the stored one
+    const uint16_t half_scale = base::float_to_half((max_value - min_value) / 15.f);
+    const float scale = base::half_to_float(half_scale);
+    const float inv_scale = scale > 0.f ? 1.f / scale : 0.f;
+    const long zero_point = std::clamp(std::lround(-min_value * inv_scale), 0L, 15L);
+    for (int32_t i = 0; i < group_size; i += 2) {
+      const auto lo = static_cast<uint8_t>(
+          std::clamp(std::lround(values[i] * inv_scale) + zero_point, 0L, 15L));
+      const auto hi = static_cast<uint8_t>(
+          std::clamp(std::lround(values[i + 1] * inv_scale) + zero_point, 0L, 15L));
+      weight[(group * group_size + i) / 2] = lo | (hi << 4);
+    }
+    const int64_t idx = row_idx * (cols / group_size) + group;
+    memcpy(scales + idx * sizeof(uint16_t), &half_scale, sizeof(uint16_t));
+    zero_points[idx] = static_cast<uint8_t>(zero_point);
+  }
+}
+}  // namespace model
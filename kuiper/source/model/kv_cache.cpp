@@ -0,0 +1,709 @@
+#include "model/kv_cache.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <functional>
+#include "../op/kernels/kernels_interface.h"
+namespace model {
+// a tensor over an address range of its full size, the rows are backed as the blocks are used
+static tensor::Tensor reserved_tensor(base::DeviceType device_type, base::DataType data_type,
+                                      const std::vector<int32_t>& dims,
+                                      std::unique_ptr<base::VirtualMemory>& memory) {
+  size_t byte_size = base::DataTypeSize(data_type);
+  for (int32_t dim : dims) {
+    byte_size *= dim;
+  }
+  memory = std::make_unique<base::VirtualMemory>(device_type, byte_size);
+  tensor::Tensor tensor(data_type, dims, false, nullptr, memory->ptr());
+  tensor.set_device_type(device_type);
+  return tensor;
+}
+
+PagedKVCache::PagedKVCache(base::DeviceType device_type, base::DataType data_type,
+                           int32_t layer_num, int32_t kv_dim, int32_t block_size,
+                           int32_t block_num, int32_t max_seq_num, int32_t max_seq_len,
+                           int32_t head_size, bool is_head_major, int32_t chunk_block_num)
+    : device_type_(device_type),
+      data_type_(data_type),
+      layer_num_(layer_num),
+      kv_dim_(kv_dim),
+      head_size_(head_size > 0 ? head_size : kv_dim),
+      block_size_(block_size),
+      block_num_(block_num),
+      chunk_block_num_(chunk_block_num),
+      committed_block_num_(chunk_block_num > 0 ? 0 : block_num),
+      is_head_major_(is_head_major) {
+  CHECK_GT(block_size, 0);
+  CHECK_GT(block_num, 0);
+  CHECK_GT(max_seq_num, 0);
+  CHECK_GE(chunk_block_num, 0);
+  max_block_num_ = (max_seq_len + block_size - 1) / block_size;
+  if (device_type_ == base::DeviceType::kDeviceCPU) {
+    alloc_ = base::CPUDeviceAllocatorFactory::get_instance();
+  } else {
+    alloc_ = base::CUDADeviceAllocatorFactory::get_instance();
+  }
+
+  CHECK(data_type == base::DataType::kDataTypeFp32 || data_type == base::DataType::kDataTypeFp16 ||
+        data_type == base::DataType::kDataTypeBf16 || data_type == base::DataType::kDataTypeInt8);
+  CHECK(data_type == base::DataType::kDataTypeFp32 || data_type == base::DataType::kDataTypeInt8 ||
+        device_type == base::DeviceType::kDeviceCUDA)
+      << "The half precision kv cache is only supported on the cuda device.";
+  CHECK_EQ(kv_dim % head_size_, 0);
+  CHECK(!is_head_major || data_type != base::DataType::kDataTypeInt8)
+      << "The head major kv cache has no int8 scales.";
+  const int32_t kv_head_num = kv_dim / head_size_;
+  if (is_growable()) {
+    // the whole pool is reserved and only the committed blocks have memory behind them, the
+    // caches never move so the layers, the plans and the captured graphs keep their pointers
+    std::vector<int32_t> cache_dims = {layer_num, block_num * block_size, kv_dim};
+    if (is_head_major) {
+      cache_dims = {layer_num, kv_head_num, block_num * block_size, head_size_};
+    }
+    key_cache_ = reserved_tensor(device_type, data_type, cache_dims, key_memory_);
+    value_cache_ = reserved_tensor(device_type, data_type, cache_dims, value_memory_);
+    if (data_type == base::DataType::kDataTypeInt8) {
+      const std::vector<int32_t> scale_dims = {layer_num, block_num * block_size, kv_head_num};
+      key_scale_ = reserved_tensor(device_type, base::DataType::kDataTypeFp32, scale_dims,
+                                   key_scale_memory_);
+      value_scale_ = reserved_tensor(device_type, base::DataType::kDataTypeFp32, scale_dims,
+                                     value_scale_memory_);
+    }
+  } else if (is_head_major) {
+    key_cache_ = tensor::Tensor(data_type, layer_num, kv_head_num, block_num * block_size,
+                                head_size_, true, alloc_);
+    value_cache_ = tensor::Tensor(data_type, layer_num, kv_head_num, block_num * block_size,
+                                  head_size_, true, alloc_);
+  } else {
+    key_cache_ =
+        tensor::Tensor(data_type, layer_num, block_num * block_size, kv_dim, true, alloc_);
+    value_cache_ =
+        tensor::Tensor(data_type, layer_num, block_num * block_size, kv_dim, true, alloc_);
+  }
+  block_table_tensor_ =
+      tensor::Tensor(base::DataType::kDataTypeInt32, max_seq_num, max_block_num_, true, alloc_);
+  key_cache_.get_buffer()->set_tag(base::MemoryTag::kMemoryTagKVCache);
+  value_cache_.get_buffer()->set_tag(base::MemoryTag::kMemoryTagKVCache);
+  if (data_type == base::DataType::kDataTypeInt8 && !is_growable()) {
+    key_scale_ = tensor::Tensor(base::DataType::kDataTypeFp32, layer_num, block_num * block_size,
+                                kv_head_num, true, alloc_);
+    value_scale_ = tensor::Tensor(base::DataType::kDataTypeFp32, layer_num,
+                                  block_num * block_size, kv_head_num, true, alloc_);
+    key_scale_.get_buffer()->set_tag(base::MemoryTag::kMemoryTagKVCache);
+    value_scale_.get_buffer()->set_tag(base::MemoryTag::kMemoryTagKVCache);
+  }
+  block_table_tensor_.get_buffer()->set_tag(base::MemoryTag::kMemoryTagKVCache);
+  for (int32_t slot = 0; slot < max_seq_num; ++slot) {
+    int32_t* table_ptr =
+        const_cast<int32_t*>(block_table_tensor_.ptr<int32_t>(slot * max_block_num_));
+    tensor::Tensor table(base::DataType::kDataTypeInt32, max_block_num_, false, nullptr, table_ptr);
+    table.set_device_type(device_type);
+    slot_block_tables_.push_back(std::move(table));
+  }
+  write_pos_ = tensor::Tensor(base::DataType::kDataTypeInt32, 1, true,
+                              base::CPUDeviceAllocatorFactory::get_instance());
+
+  // hand out the low block ids first
+  for (int32_t block = committed_block_num_ - 1; block >= 0; --block) {
+    free_blocks_.push_back(block);
+  }
+  block_refs_.resize(block_num, 0);
+  block_tables_.resize(max_seq_num);
+}
+
+bool PagedKVCache::is_growable() const { return chunk_block_num_ > 0; }
+
+bool PagedKVCache::commit_blocks(int32_t block_num, bool restore) {
+  // every layer, and every head of a head major layer, keeps the rows of the blocks in its own
+  // stretch of the range
+  auto commit = [&](const std::unique_ptr<base::VirtualMemory>& memory, size_t element_size,
+                    int32_t strip_num, int32_t row_width) {
+    if (!memory) {
+      return true;
+    }
+    const size_t strip_size =
+        static_cast<size_t>(block_num_) * block_size_ * row_width * element_size;
+    const size_t used_size =
+        static_cast<size_t>(block_num) * block_size_ * row_width * element_size;
+    std::vector<std::pair<size_t, size_t>> ranges;
+    for (int32_t strip = 0; strip < strip_num; ++strip) {
+      ranges.emplace_back(strip * strip_size, used_size);
+    }
+    return memory->commit(ranges);
+  };
+  const int32_t kv_head_num = kv_dim_ / head_size_;
+  const size_t element_size = base::DataTypeSize(data_type_);
+  const int32_t strip_num = is_head_major_ ? layer_num_ * kv_head_num : layer_num_;
+  const int32_t row_width = is_head_major_ ? head_size_ : kv_dim_;
+  if (!commit(key_memory_, element_size, strip_num, row_width) ||
+      !commit(value_memory_, element_size, strip_num, row_width) ||
+      !commit(key_scale_memory_, sizeof(float), layer_num_, kv_head_num) ||
+      !commit(value_scale_memory_, sizeof(float), layer_num_, kv_head_num)) {
+    LOG(ERROR) << "Failed to commit the memory of " << block_num << " kv cache blocks.";
+    // the blocks in use stay committed
+    if (restore) {
+      const bool is_restored = commit_blocks(committed_block_num_, false);
+      CHECK(is_restored);
+    }
+    return false;
+  }
+  committed_block_num_ = block_num;
+  return true;
+}
+
+bool PagedKVCache::grow(int32_t need_block_num) {
+  const int32_t free_block_num = static_cast<int32_t>(free_blocks_.size());
+  if (!is_growable() || need_block_num <= free_block_num) {
+    return need_block_num <= free_block_num;
+  }
+  const int32_t grow_block_num = need_block_num - free_block_num;
+  int32_t block_num = committed_block_num_ + grow_block_num;
+  block_num = (block_num + chunk_block_num_ - 1) / chunk_block_num_ * chunk_block_num_;
+  block_num = std::min(block_num, block_num_);
+  if (block_num - committed_block_num_ < grow_block_num) {
+    return false;
+  }
+  const int32_t old_block_num = committed_block_num_;
+  if (!commit_blocks(block_num)) {
+    return false;
+  }
+  // the new blocks have the highest ids, they go behind the free ones which are committed
+  std::vector<int32_t> new_blocks;
+  for (int32_t block = block_num - 1; block >= old_block_num; --block) {
+    new_blocks.push_back(block);
+  }
+  free_blocks_.insert(free_blocks_.begin(), new_blocks.begin(), new_blocks.end());
+  return true;
+}
+
+void PagedKVCache::shrink(int32_t keep_block_num) {
+  if (!is_growable()) {
+    return;
+  }
+  // the blocks are handed out from the lowest id, so the memory behind the highest block in
+  // use can go back
+  int32_t used_end = 0;
+  for (int32_t block = 0; block < committed_block_num_; ++block) {
+    if (block_refs_.at(block) > 0) {
+      used_end = block + 1;
+    }
+  }
+  int32_t block_num = std::max(used_end, keep_block_num);
+  block_num = (block_num + chunk_block_num_ - 1) / chunk_block_num_ * chunk_block_num_;
+  block_num = std::min(block_num, block_num_);
+  if (block_num >= committed_block_num_) {
+    return;
+  }
+  free_blocks_.erase(std::remove_if(free_blocks_.begin(), free_blocks_.end(),
+                                    [block_num](int32_t block) { return block >= block_num; }),
+                     free_blocks_.end());
+  const bool is_committed = commit_blocks(block_num);
+  CHECK(is_committed);
+}
+
+int32_t PagedKVCache::committed_block_num() const { return committed_block_num_; }
+
+size_t PagedKVCache::committed_byte_size() const {
+  size_t byte_size = 0;
+  for (const auto* memory :
+       {&key_memory_, &value_memory_, &key_scale_memory_, &value_scale_memory_}) {
+    if (*memory) {
+      byte_size += (*memory)->committed_byte_size();
+    }
+  }
+  if (!is_growable()) {
+    byte_size = key_cache_.byte_size() + value_cache_.byte_size() + key_scale_.byte_size() +
+                value_scale_.byte_size();
+  }
+  return byte_size;
+}
+
+std::vector<PagedKVCache::BlockSection> PagedKVCache::block_sections() const {
+  const int32_t kv_head_num = kv_dim_ / head_size_;
+  const int32_t strip_num = is_head_major_ ? layer_num_ * kv_head_num : layer_num_;
+  const int32_t row_width = is_head_major_ ? head_size_ : kv_dim_;
+  // in the order of the snapshot sections
+  return {{&key_cache_, strip_num, row_width},
+          {&value_cache_, strip_num, row_width},
+          {&key_scale_, layer_num_, kv_head_num},
+          {&value_scale_, layer_num_, kv_head_num}};
+}
+
+void PagedKVCache::copy_snapshot_blocks(int32_t slot, int32_t block_num,
+                                        uint8_t* const* sections, bool is_save,
+                                        void* stream) const {
+  const std::vector<int32_t>& table = block_tables_.at(slot);
+  CHECK_LE(block_num, table.size());
+  const std::vector<BlockSection> layouts = block_sections();
+  base::MemcpyKind memcpy_kind = base::MemcpyKind::kMemcpyCPU2CPU;
+  if (device_type_ == base::DeviceType::kDeviceCUDA) {
+    memcpy_kind = is_save ? base::MemcpyKind::kMemcpyCUDA2CPU : base::MemcpyKind::kMemcpyCPU2CUDA;
+  }
+  for (int32_t section = 0; section < kKVSectionNum; ++section) {
+    const BlockSection& layout = layouts.at(section);
+    if (layout.cache->is_empty()) {
+      continue;
+    }
+    const int64_t block_elem_num = static_cast<int64_t>(block_size_) * layout.row_width;
+    const size_t block_byte_size = block_elem_num * base::DataTypeSize(layout.cache->data_type());
+    const int64_t strip_elem_num = static_cast<int64_t>(block_num_) * block_elem_num;
+    for (int32_t strip = 0; strip < layout.strip_num; ++strip) {
+      uint8_t* strip_ptr = sections[section] + strip * block_num * block_byte_size;
+      // the blocks are handed out from the lowest id, so runs of consecutive ids are common
+      int32_t block_idx = 0;
+      while (block_idx < block_num) {
+        int32_t run = 1;
+        while (block_idx + run < block_num &&
+               table.at(block_idx + run) == table.at(block_idx) + run) {
+          ++run;
+        }
+        void* cache =
+            cache_ptr(*layout.cache, strip * strip_elem_num + table.at(block_idx) * block_elem_num);
+        uint8_t* host = strip_ptr + block_idx * block_byte_size;
+        if (is_save) {
+          alloc_->memcpy(cache, host, run * block_byte_size, memcpy_kind, stream);
+        } else {
+          alloc_->memcpy(host, cache, run * block_byte_size, memcpy_kind, stream);
+        }
+        block_idx += run;
+      }
+    }
+  }
+}
+
+void PagedKVCache::save(int32_t slot, int32_t token_num, KVSnapshot& snapshot,
+                        void* stream) const {
+  CHECK(slot >= 0 && slot < block_tables_.size());
+  CHECK_GT(token_num, 0);
+  const KVSnapshotHeader header = snapshot_header(token_num);
+  const int32_t block_num = header.block_num;
+  CHECK_LE(block_num, block_tables_.at(slot).size())
+      << "The positions to save are not reserved in the slot " << slot << ".";
+  snapshot.allocate(header, device_type_ == base::DeviceType::kDeviceCUDA);
+  uint8_t* sections[kKVSectionNum];
+  for (int32_t section = 0; section < kKVSectionNum; ++section) {
+    sections[section] = snapshot.mutable_section(static_cast<KVSection>(section));
+  }
+  copy_snapshot_blocks(slot, block_num, sections, true, stream);
+  if (device_type_ == base::DeviceType::kDeviceCUDA) {
+    snapshot.set_pending_stream(stream);
+  }
+}
+
+KVSnapshotHeader PagedKVCache::snapshot_header(int32_t token_num) const {
+  CHECK_GT(token_num, 0);
+  const int32_t block_num = (token_num + block_size_ - 1) / block_size_;
+  KVSnapshotHeader header;
+  header.data_type = static_cast<int32_t>(data_type_);
+  header.layer_num = layer_num_;
+  header.kv_dim = kv_dim_;
+  header.head_size = head_size_;
+  header.block_size = block_size_;
+  header.is_head_major = is_head_major_ ? 1 : 0;
+  header.block_num = block_num;
+  header.token_num = token_num;
+  const size_t row_num = static_cast<size_t>(layer_num_) * block_num * block_size_;
+  const size_t cache_byte_size = row_num * kv_dim_ * base::DataTypeSize(data_type_);
+  header.section_byte_sizes[0] = cache_byte_size;
+  header.section_byte_sizes[1] = cache_byte_size;
+  if (!key_scale_.is_empty()) {
+    const size_t scale_byte_size = row_num * (kv_dim_ / head_size_) * sizeof(float);
+    header.section_byte_sizes[2] = scale_byte_size;
+    header.section_byte_sizes[3] = scale_byte_size;
+  }
+  return header;
+}
+
+bool PagedKVCache::restore(int32_t slot, const KVSnapshot& snapshot, void* stream) {
+  CHECK(slot >= 0 && slot < block_tables_.size());
+  CHECK(block_tables_.at(slot).empty()) << "The snapshot is restored into the slot " << slot
+                                        << " which is in use.";
+  const KVSnapshotHeader& header = snapshot.header();
+  if (snapshot.is_empty() || header.data_type != static_cast<int32_t>(data_type_) ||
+      header.layer_num != layer_num_ || header.kv_dim != kv_dim_ ||
+      header.head_size != head_size_ || header.block_size != block_size_ ||
+      header.is_head_major != (is_head_major_ ? 1 : 0)) {
+    LOG(ERROR) << "The kv snapshot does not match the layout of the kv cache.";
+    return false;
+  }
+  if (!reserve(slot, header.token_num)) {
+    return false;
+  }
+  // a snapshot saved on another stream
+  snapshot.wait();
+  uint8_t* sections[kKVSectionNum];
+  for (int32_t section = 0; section < kKVSectionNum; ++section) {
+    sections[section] = const_cast<uint8_t*>(snapshot.section(static_cast<KVSection>(section)));
+  }
+  copy_snapshot_blocks(slot, header.block_num, sections, false, stream);
+  return true;
+}
+
+bool PagedKVCache::reserve(int32_t slot, int32_t token_num) {
+  CHECK(slot >= 0 && slot < block_tables_.size());
+  token_num = cache_token_num(token_num);
+  const int32_t need_block_num = (token_num + block_size_ - 1) / block_size_;
+  if (need_block_num > max_block_num_) {
+    return false;
+  }
+  std::vector<int32_t>& table = block_tables_.at(slot);
+  const int32_t old_block_num = static_cast<int32_t>(table.size());
+  if (need_block_num <= old_block_num) {
+    return true;
+  }
+  if (!grow(need_block_num - old_block_num)) {
+    return false;
+  }
+  while (table.size() < need_block_num) {
+    table.push_back(free_blocks_.back());
+    free_blocks_.pop_back();
+    block_refs_.at(table.back()) = 1;
+  }
+  upload_table(slot, old_block_num);
+  return true;
+}
+
+void PagedKVCache::set_window(const base::AttentionWindow& window) {
+  CHECK_GE(window.sink_num, 0);
+  CHECK_GT(window.chunk_size, 0);
+  for (const std::vector<int32_t>& table : block_tables_) {
+    CHECK(table.empty()) << "The attention window is set while the kv cache is in use.";
+  }
+  CHECK(!window.is_enabled() || window.capacity() <= max_block_num_ * block_size_)
+      << "The attention window needs more rows than a slot of the kv cache has.";
+  window_ = window;
+}
+
+const base::AttentionWindow& PagedKVCache::window() const { return window_; }
+
+int32_t PagedKVCache::cache_token_num(int32_t token_num) const {
+  if (!window_.is_enabled()) {
+    return token_num;
+  }
+  return std::min(token_num, window_.capacity());
+}
+
+void PagedKVCache::cache_range(int32_t& begin_pos, int32_t& end_pos) const {
+  if (!window_.is_enabled() || end_pos <= window_.capacity()) {
+    return;
+  }
+  begin_pos = std::min(begin_pos, window_.sink_num);
+  end_pos = window_.capacity();
+}
+
+void PagedKVCache::share(int32_t slot, const std::vector<int32_t>& blocks) {
+  CHECK(slot >= 0 && slot < block_tables_.size());
+  CHECK_LE(blocks.size(), max_block_num_);
+  std::vector<int32_t>& table = block_tables_.at(slot);
+  CHECK(table.empty()) << "The blocks are shared into the slot " << slot << " which is in use.";
+  for (int32_t block : blocks) {
+    ref_block(block);
+    table.push_back(block);
+  }
+  upload_table(slot, 0);
+}
+
+void PagedKVCache::fork(int32_t src_slot, int32_t dst_slot, int32_t token_num) {
+  CHECK(src_slot >= 0 && src_slot < block_tables_.size());
+  CHECK_NE(src_slot, dst_slot);
+  const std::vector<int32_t>& src_table = block_tables_.at(src_slot);
+  const int32_t block_num = (cache_token_num(token_num) + block_size_ - 1) / block_size_;
+  CHECK_LE(block_num, src_table.size())
+      << "The positions to fork are not reserved in the slot " << src_slot << ".";
+  share(dst_slot, std::vector<int32_t>(src_table.begin(), src_table.begin() + block_num));
+}
+
+int32_t PagedKVCache::shared_block_num(int32_t slot, int32_t begin_pos, int32_t end_pos) const {
+  CHECK(slot >= 0 && slot < block_tables_.size());
+  cache_range(begin_pos, end_pos);
+  const std::vector<int32_t>& table = block_tables_.at(slot);
+  const int32_t end_block_idx =
+      std::min<int32_t>((end_pos + block_size_ - 1) / block_size_, table.size());
+  int32_t shared_num = 0;
+  for (int32_t block_idx = begin_pos / block_size_; block_idx < end_block_idx; ++block_idx) {
+    if (block_refs_.at(table.at(block_idx)) > 1) {
+      shared_num += 1;
+    }
+  }
+  return shared_num;
+}
+
+bool PagedKVCache::make_writable(int32_t slot, int32_t begin_pos, int32_t end_pos,
+                                 void* stream) {
+  const int32_t shared_num = shared_block_num(slot, begin_pos, end_pos);
+  if (shared_num == 0) {
+    return true;
+  }
+  cache_range(begin_pos, end_pos);
+  if (!grow(shared_num)) {
+    return false;
+  }
+  std::vector<int32_t>& table = block_tables_.at(slot);
+  const int32_t first_block_idx = begin_pos / block_size_;
+  const int32_t end_block_idx =
+      std::min<int32_t>((end_pos + block_size_ - 1) / block_size_, table.size());
+  const base::MemcpyKind memcpy_kind = device_type_ == base::DeviceType::kDeviceCUDA
+                                           ? base::MemcpyKind::kMemcpyCUDA2CUDA
+                                           : base::MemcpyKind::kMemcpyCPU2CPU;
+  const std::vector<BlockSection> sections = block_sections();
+  for (int32_t block_idx = first_block_idx; block_idx < end_block_idx; ++block_idx) {
+    const int32_t src_block = table.at(block_idx);
+    if (block_refs_.at(src_block) == 1) {
+      continue;
+    }
+    const int32_t dst_block = free_blocks_.back();
+    free_blocks_.pop_back();
+    block_refs_.at(dst_block) = 1;
+    for (const BlockSection& section : sections) {
+      if (section.cache->is_empty()) {
+        continue;
+      }
+      const int64_t block_elem_num = static_cast<int64_t>(block_size_) * section.row_width;
+      const size_t block_byte_size =
+          block_elem_num * base::DataTypeSize(section.cache->data_type());
+      const int64_t strip_elem_num = static_cast<int64_t>(block_num_) * block_elem_num;
+      for (int32_t strip = 0; strip < section.strip_num; ++strip) {
+        const int64_t strip_offset = strip * strip_elem_num;
+        alloc_->memcpy(cache_ptr(*section.cache, strip_offset + src_block * block_elem_num),
+                       cache_ptr(*section.cache, strip_offset + dst_block * block_elem_num),
+                       block_byte_size, memcpy_kind, stream);
+      }
+    }
+    // the other holders keep reading the old block
+    unref_block(src_block);
+    table.at(block_idx) = dst_block;
+  }
+  upload_table(slot, first_block_idx);
+  return true;
+}
+
+void PagedKVCache::upload_table(int32_t slot, int32_t first_block_idx) {
+  // only the new entries are uploaded, the ones in use by the kernels are never touched
+  const std::vector<int32_t>& table = block_tables_.at(slot);
+  if (table.size() <= first_block_idx) {
+    return;
+  }
+  int32_t* table_ptr = block_table_tensor_.ptr<int32_t>(slot * max_block_num_ + first_block_idx);
+  const size_t byte_size = (table.size() - first_block_idx) * sizeof(int32_t);
+  if (device_type_ == base::DeviceType::kDeviceCPU) {
+    alloc_->memcpy(table.data() + first_block_idx, table_ptr, byte_size,
+                   base::MemcpyKind::kMemcpyCPU2CPU);
+  } else {
+    alloc_->memcpy(table.data() + first_block_idx, table_ptr, byte_size,
+                   base::MemcpyKind::kMemcpyCPU2CUDA);
+  }
+}
+
+void PagedKVCache::ref_block(int32_t block) {
+  CHECK(block >= 0 && block < block_num_);
+  CHECK_GT(block_refs_.at(block), 0) << "The block " << block << " is not in use.";
+  block_refs_.at(block) += 1;
+}
+
+void PagedKVCache::unref_block(int32_t block) {
+  CHECK(block >= 0 && block < block_num_);
+  CHECK_GT(block_refs_.at(block), 0) << "The block " << block << " is not in use.";
+  block_refs_.at(block) -= 1;
+  if (block_refs_.at(block) == 0) {
+    if (is_growable()) {
+      // kept in descending order, the lowest block is handed out next so the pool can shrink
+      auto iter = std::lower_bound(free_blocks_.begin(), free_blocks_.end(), block,
+                                   std::greater<int32_t>());
+      free_blocks_.insert(iter, block);
+    } else {
+      free_blocks_.push_back(block);
+    }
+  }
+}
+
+int32_t PagedKVCache::block_ref(int32_t block) const {
+  CHECK(block >= 0 && block < block_num_);
+  return block_refs_.at(block);
+}
+
+const std::vector<int32_t>& PagedKVCache::blocks(int32_t slot) const {
+  CHECK(slot >= 0 && slot < block_tables_.size());
+  return block_tables_.at(slot);
+}
+
+void PagedKVCache::release(int32_t slot) {
+  CHECK(slot >= 0 && slot < block_tables_.size());
+  std::vector<int32_t>& table = block_tables_.at(slot);
+  for (auto iter = table.rbegin(); iter != table.rend(); ++iter) {
+    unref_block(*iter);
+  }
+  table.clear();
+}
+
+void PagedKVCache::truncate(int32_t slot, int32_t token_num) {
+  CHECK(slot >= 0 && slot < block_tables_.size());
+  CHECK_GE(token_num, 0);
+  std::vector<int32_t>& table = block_tables_.at(slot);
+  const int32_t keep_block_num = (cache_token_num(token_num) + block_size_ - 1) / block_size_;
+  // the entries kept on the device are still valid, only the host side shrinks
+  while (table.size() > keep_block_num) {
+    unref_block(table.back());
+    table.pop_back();
+  }
+}
+
+int32_t PagedKVCache::physical_pos(int32_t slot, int32_t token_pos) const {
+  CHECK(slot >= 0 && slot < block_tables_.size());
+  const std::vector<int32_t>& table = block_tables_.at(slot);
+  const int32_t cache_pos = window_.cache_pos(token_pos);
+  const int32_t block_idx = cache_pos / block_size_;
+  CHECK_LT(block_idx, table.size()) << "The position " << token_pos << " is not reserved.";
+  return table.at(block_idx) * block_size_ + cache_pos % block_size_;
+}
+
+void PagedKVCache::write(int32_t layer_idx, int32_t slot, int32_t token_pos,
+                         const tensor::Tensor& key, const tensor::Tensor& value,
+                         void* stream) const {
+  CHECK_EQ(key.size(), value.size());
+  CHECK_EQ(key.size() % kv_dim_, 0);
+  const int32_t token_num = static_cast<int32_t>(key.size()) / kv_dim_;
+  if (data_type_ == base::DataType::kDataTypeInt8 ||
+      (is_head_major_ && device_type_ == base::DeviceType::kDeviceCUDA)) {
+    // the scales of a row are computed before it is stored, the kernel quantizes every head, and
+    // the heads of a row of a head major device cache are scattered by the kernel
+    CHECK_GE(physical_pos(slot, token_pos + token_num - 1), 0);
+    const_cast<int32_t*>(write_pos_.ptr<int32_t>())[0] = token_pos;
+    kernel::get_kv_cache_write_kernel(device_type_)(key, value, key_cache_, value_cache_,
+                                                    key_scale_, value_scale_, block_table(slot),
+                                                    write_pos_, layer_idx, block_size_, window_,
+                                                    stream);
+    return;
+  }
+  const int32_t layer_offset = layer_idx * block_num_ * block_size_ * kv_dim_;
+  if (is_head_major_) {
+    // every head of a row goes to the positions of its own head
+    const int32_t cache_len = block_num_ * block_size_;
+    float* key_cache_ptr = const_cast<float*>(key_cache_.ptr<float>(layer_offset));
+    float* value_cache_ptr = const_cast<float*>(value_cache_.ptr<float>(layer_offset));
+    for (int32_t row = 0; row < token_num; ++row) {
+      const int32_t physical = physical_pos(slot, token_pos + row);
+      for (int32_t head = 0; head < kv_dim_ / head_size_; ++head) {
+        const int32_t cache_offset = (head * cache_len + physical) * head_size_;
+        const float* key_head = key.ptr<float>(row * kv_dim_ + head * head_size_);
+        const float* value_head = value.ptr<float>(row * kv_dim_ + head * head_size_);
+        std::copy(key_head, key_head + head_size_, key_cache_ptr + cache_offset);
+        std::copy(value_head, value_head + head_size_, value_cache_ptr + cache_offset);
+      }
+    }
+    return;
+  }
+  base::MemcpyKind memcpy_kind = device_type_ == base::DeviceType::kDeviceCPU
+                                     ? base::MemcpyKind::kMemcpyCPU2CPU
+                                     : base::MemcpyKind::kMemcpyCUDA2CUDA;
+
+  // the rows inside one block are contiguous, so copy them one block at a time, a run of a
+  // windowed slot also ends where its ring wraps around
+  int32_t row = 0;
+  while (row < token_num) {
+    const int32_t pos = token_pos + row;
+    const int32_t cache_pos = window_.cache_pos(pos);
+    int32_t run = std::min(block_size_ - cache_pos % block_size_, token_num - row);
+    if (window_.is_enabled()) {
+      run = std::min(run, window_.capacity() - cache_pos);
+    }
+    const int32_t cache_offset = layer_offset + physical_pos(slot, pos) * kv_dim_;
+    void* key_ptr = cache_ptr(key_cache_, cache_offset);
+    void* value_ptr = cache_ptr(value_cache_, cache_offset);
+    if (data_type_ == base::DataType::kDataTypeFp32) {
+      const size_t byte_size = run * kv_dim_ * sizeof(float);
+      alloc_->memcpy(key.ptr<float>(row * kv_dim_), key_ptr, byte_size, memcpy_kind, stream);
+      alloc_->memcpy(value.ptr<float>(row * kv_dim_), value_ptr, byte_size, memcpy_kind, stream);
+    } else {
+      // the projections are computed in fp32 and narrowed when they are stored
+      const int32_t run_size = run * kv_dim_;
+      key_run_.bind(tensor::TensorView(base::DataType::kDataTypeFp32, device_type_,
+                                       const_cast<float*>(key.ptr<float>(row * kv_dim_)),
+                                       {run_size}));
+      value_run_.bind(tensor::TensorView(base::DataType::kDataTypeFp32, device_type_,
+                                         const_cast<float*>(value.ptr<float>(row * kv_dim_)),
+                                         {run_size}));
+      key_cache_run_.bind(tensor::TensorView(data_type_, device_type_, key_ptr, {run_size}));
+      value_cache_run_.bind(tensor::TensorView(data_type_, device_type_, value_ptr, {run_size}));
+      kernel::get_cast_kernel(device_type_)(key_run_, key_cache_run_, stream);
+      kernel::get_cast_kernel(device_type_)(value_run_, value_cache_run_, stream);
+    }
+    row += run;
+  }
+}
+
+void PagedKVCache::write(int32_t layer_idx, int32_t slot, const tensor::Tensor& pos_tensor,
+                         const tensor::Tensor& key, const tensor::Tensor& value,
+                         void* stream) const {
+  CHECK_EQ(pos_tensor.is_empty(), false);
+  if (pos_tensor.device_type() == base::DeviceType::kDeviceCPU) {
+    write(layer_idx, slot, pos_tensor.index<int32_t>(0), key, value, stream);
+    return;
+  }
+  CHECK(device_type_ == base::DeviceType::kDeviceCUDA);
+  CHECK_EQ(key.size() % kv_dim_, 0);
+  kernel::get_kv_cache_write_kernel(device_type_)(key, value, key_cache_, value_cache_,
+                                                  key_scale_, value_scale_, block_table(slot),
+                                                  pos_tensor, layer_idx, block_size_, window_,
+                                                  stream);
+}
+
+bool PagedKVCache::is_rope_fused() const {
+  // the fused kernel stores the positions in place and token major, not in the rows of a window
+  return device_type_ == base::DeviceType::kDeviceCUDA &&
+         data_type_ != base::DataType::kDataTypeInt8 && !window_.is_enabled() && !is_head_major_;
+}
+
+void PagedKVCache::write_rotated(int32_t layer_idx, int32_t slot,
+                                 const tensor::Tensor& pos_tensor, const tensor::Tensor& query,
+                                 const tensor::Tensor& key, const tensor::Tensor& value,
+                                 const tensor::Tensor& sin_cache,
+                                 const tensor::Tensor& cos_cache, bool is_rotate_half,
+                                 void* stream) const {
+  CHECK(is_rope_fused());
+  CHECK_EQ(pos_tensor.is_empty(), false);
+  CHECK_EQ(key.size() % kv_dim_, 0);
+  const int32_t token_num = static_cast<int32_t>(key.size()) / kv_dim_;
+  if (pos_tensor.device_type() == base::DeviceType::kDeviceCPU) {
+    CHECK_GE(physical_pos(slot, pos_tensor.index<int32_t>(0) + token_num - 1), 0);
+  }
+  const int32_t dim = static_cast<int32_t>(query.size()) / token_num;
+  kernel::get_rope_kv_cache_write_kernel(device_type_)(
+      dim, kv_dim_, head_size_, is_rotate_half, query, key, value, key_cache_, value_cache_,
+      block_table(slot), pos_tensor, sin_cache, cos_cache, layer_idx, block_size_, stream);
+}
+
+const tensor::Tensor& PagedKVCache::block_table(int32_t slot) const {
+  CHECK(slot >= 0 && slot < slot_block_tables_.size());
+  return slot_block_tables_.at(slot);
+}
+
+const tensor::Tensor& PagedKVCache::key_cache() const { return key_cache_; }
+
+const tensor::Tensor& PagedKVCache::value_cache() const { return value_cache_; }
+
+const tensor::Tensor& PagedKVCache::key_scale() const { return key_scale_; }
+
+const tensor::Tensor& PagedKVCache::value_scale() const { return value_scale_; }
+
+int32_t PagedKVCache::block_size() const { return block_size_; }
+
+int32_t PagedKVCache::block_num() const { return block_num_; }
+
+int32_t PagedKVCache::free_block_num() const {
+  // the blocks which are not committed yet are free as well
+  return static_cast<int32_t>(free_blocks_.size()) + block_num_ - committed_block_num_;
+}
+
+base::DataType PagedKVCache::data_type() const { return data_type_; }
+
+bool PagedKVCache::is_head_major() const { return is_head_major_; }
+
+void* PagedKVCache::cache_ptr(const tensor::Tensor& cache, int64_t offset) const {
+  const int8_t* base_ptr = cache.ptr<int8_t>();
+  return const_cast<int8_t*>(base_ptr) + offset * base::DataTypeSize(cache.data_type());
+}
+
+int32_t PagedKVCache::reserved_token_num(int32_t slot) const {
+  CHECK(slot >= 0 && slot < block_tables_.size());
+  return static_cast<int32_t>(block_tables_.at(slot).size()) * block_size_;
+}
+}  // namespace model
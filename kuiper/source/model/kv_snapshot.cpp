@@ -0,0 +1,157 @@
+#include "model/kv_snapshot.h"
+#include <cuda_runtime_api.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+namespace model {
+static size_t align_up(size_t byte_size) {
+  return (byte_size + kKVSnapshotAlignment - 1) / kKVSnapshotAlignment * kKVSnapshotAlignment;
+}
+
+KVSnapshot::~KVSnapshot() { reset(); }
+
+void KVSnapshot::reset() {
+  wait();
+  buffer_.reset();
+  if (mapped_ptr_) {
+    munmap(mapped_ptr_, mapped_size_);
+    mapped_ptr_ = nullptr;
+    mapped_size_ = 0;
+  }
+  header_ = KVSnapshotHeader();
+}
+
+void KVSnapshot::allocate(const KVSnapshotHeader& header, bool is_pinned) {
+  reset();
+  header_ = header;
+  std::shared_ptr<base::DeviceAllocator> alloc = base::CPUDeviceAllocatorFactory::get_instance();
+  if (is_pinned) {
+    alloc = base::CUDAHostAllocatorFactory::get_instance();
+  }
+  buffer_ = std::make_shared<base::Buffer>(byte_size(), alloc);
+  CHECK(buffer_->ptr() != nullptr) << "Failed to allocate a kv snapshot of " << byte_size()
+                                   << " bytes.";
+  // the padding after the header is written too, the file is one copy of the memory
+  std::memset(buffer_->ptr(), 0, align_up(sizeof(KVSnapshotHeader)));
+  std::memcpy(buffer_->ptr(), &header_, sizeof(KVSnapshotHeader));
+}
+
+base::Status KVSnapshot::write_file(const std::string& path) const {
+  if (is_empty()) {
+    return base::error::InvalidArgument("The kv snapshot is empty.");
+  }
+  wait();
+  // written aside first, so a resume never maps a half written snapshot
+  const std::string temp_path = path + ".tmp";
+  FILE* file = std::fopen(temp_path.c_str(), "wb");
+  if (!file) {
+    return base::error::PathNotValid(temp_path);
+  }
+  const size_t written_size = std::fwrite(data(), 1, byte_size(), file);
+  const bool is_closed = std::fclose(file) == 0;
+  if (written_size != byte_size() || !is_closed) {
+    std::remove(temp_path.c_str());
+    return base::error::InternalError("Failed to write the kv snapshot " + temp_path);
+  }
+  if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+    return base::error::InternalError("Failed to write the kv snapshot " + path);
+  }
+  return base::error::Success();
+}
+
+base::Status KVSnapshot::map_file(const std::string& path) {
+  reset();
+  const int32_t fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return base::error::PathNotValid(path);
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size < sizeof(KVSnapshotHeader)) {
+    close(fd);
+    return base::error::InvalidArgument("The kv snapshot " + path + " is too short.");
+  }
+  const size_t file_size = file_stat.st_size;
+  void* ptr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    return base::error::InternalError("Failed to map the kv snapshot " + path);
+  }
+  // the restore reads all of it once
+  madvise(ptr, file_size, MADV_WILLNEED);
+  mapped_ptr_ = ptr;
+  mapped_size_ = file_size;
+  std::memcpy(&header_, ptr, sizeof(KVSnapshotHeader));
+  if (header_.magic != kKVSnapshotMagic || header_.version != kKVSnapshotVersion) {
+    reset();
+    return base::error::InvalidArgument("The file " + path + " is not a kv snapshot.");
+  }
+  if (byte_size() != file_size) {
+    reset();
+    return base::error::InvalidArgument("The kv snapshot " + path + " is truncated.");
+  }
+  return base::error::Success();
+}
+
+bool KVSnapshot::is_empty() const { return !buffer_ && !mapped_ptr_; }
+
+const KVSnapshotHeader& KVSnapshot::header() const { return header_; }
+
+int32_t KVSnapshot::token_num() const { return header_.token_num; }
+
+size_t KVSnapshot::byte_size() const { return section_offset(kKVSectionNum); }
+
+size_t KVSnapshot::byte_size(const KVSnapshotHeader& header) {
+  size_t byte_size = align_up(sizeof(KVSnapshotHeader));
+  for (int32_t i = 0; i < kKVSectionNum; ++i) {
+    byte_size += align_up(header.section_byte_sizes[i]);
+  }
+  return byte_size;
+}
+
+size_t KVSnapshot::section_offset(int32_t section) const {
+  size_t offset = align_up(sizeof(KVSnapshotHeader));
+  for (int32_t i = 0; i < section; ++i) {
+    offset += align_up(header_.section_byte_sizes[i]);
+  }
+  return offset;
+}
+
+const uint8_t* KVSnapshot::data() const {
+  if (buffer_) {
+    return static_cast<const uint8_t*>(buffer_->ptr());
+  }
+  return static_cast<const uint8_t*>(mapped_ptr_);
+}
+
+const uint8_t* KVSnapshot::section(KVSection section) const {
+  CHECK(!is_empty());
+  return data() + section_offset(static_cast<int32_t>(section));
+}
+
+uint8_t* KVSnapshot::mutable_section(KVSection section) {
+  CHECK(buffer_ != nullptr) << "A mapped kv snapshot is only read.";
+  return static_cast<uint8_t*>(buffer_->ptr()) + section_offset(static_cast<int32_t>(section));
+}
+
+void KVSnapshot::set_pending_stream(void* stream) { pending_stream_ = stream; }
+
+void KVSnapshot::wait() const {
+  if (pending_stream_) {
+    cudaStreamSynchronize(static_cast<cudaStream_t>(pending_stream_));
+    pending_stream_ = nullptr;
+  }
+}
+
+bool KVSnapshot::is_ready() const {
+  if (pending_stream_ &&
+      cudaStreamQuery(static_cast<cudaStream_t>(pending_stream_)) != cudaSuccess) {
+    return false;
+  }
+  pending_stream_ = nullptr;
+  return true;
+}
+}  // namespace model
@@ -0,0 +1,331 @@
+#include "model/lora_pool.h"
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include "base/half.h"
+#include "model/safetensors.h"
+#if defined(LLAMA3_SUPPORT) || defined(QWEN2_SUPPORT)
+#include "nlohmann/json.hpp"
+#endif
+namespace model {
+// the matmuls of the peft module names
+static std::vector<op::Layer*> module_layers(const DecoderLayers& layers,
+                                             const std::string& module) {
+  if (module == "q_proj") {
+    return layers.wq_layers;
+  } else if (module == "k_proj") {
+    return layers.wk_layers;
+  } else if (module == "v_proj") {
+    return layers.wv_layers;
+  } else if (module == "o_proj") {
+    return layers.wo_layers;
+  } else if (module == "gate_proj") {
+    return layers.w1_layers;
+  } else if (module == "up_proj") {
+    return layers.w3_layers;
+  } else if (module == "down_proj") {
+    return layers.w2_layers;
+  }
+  return {};
+}
+
+LoraPool::LoraPool(int32_t adapter_num, int32_t rank, std::vector<std::string> target_modules)
+    : adapter_num_(adapter_num), rank_(rank), target_modules_(std::move(target_modules)) {
+  CHECK_GT(adapter_num_, 0);
+  CHECK_GT(rank_, 0);
+  CHECK(!target_modules_.empty());
+}
+
+base::Status LoraPool::attach(const DecoderLayers& layers, int32_t head_size,
+                              bool is_rope_rotate_half, int32_t max_batch_size,
+                              base::DeviceType device_type) {
+  using namespace base;
+  if (!targets_.empty()) {
+    return error::InternalError("The lora pool is attached already.");
+  }
+  std::shared_ptr<DeviceAllocator> alloc;
+  if (device_type == DeviceType::kDeviceCPU) {
+    alloc = CPUDeviceAllocatorFactory::get_instance();
+  } else {
+    alloc = CUDADeviceAllocatorFactory::get_instance();
+  }
+  device_type_ = device_type;
+  head_size_ = head_size;
+  scales_ = tensor::Tensor(DataType::kDataTypeFp32, adapter_num_, true, alloc);
+  host_scales_.assign(adapter_num_, 0.f);
+  upload(scales_, 0, host_scales_.data(), host_scales_.size());
+  adapters_ = tensor::Tensor(DataType::kDataTypeInt32, max_batch_size, true, alloc);
+  host_adapters_.assign(max_batch_size, -1);
+  rows_->workspace = tensor::Tensor(DataType::kDataTypeFp32, max_batch_size, rank_, true, alloc);
+  is_loaded_.assign(adapter_num_, false);
+
+  for (const std::string& module : target_modules_) {
+    const std::vector<op::Layer*> module_layer_vec = module_layers(layers, module);
+    if (module_layer_vec.empty()) {
+      return error::InvalidArgument("The lora target module " + module + " is not supported.");
+    }
+    for (int32_t layer_idx = 0; layer_idx < module_layer_vec.size(); ++layer_idx) {
+      auto matmul = dynamic_cast<op::MatmulLayer*>(module_layer_vec.at(layer_idx));
+      if (!matmul) {
+        return error::InternalError("The lora target " + module + " is not a matmul.");
+      }
+      Target target;
+      target.layer_idx = layer_idx;
+      target.module = module;
+      target.layer = matmul;
+      target.is_rope_permuted = !is_rope_rotate_half && (module == "q_proj" || module == "k_proj");
+      target.weights = std::make_shared<op::LoraWeights>();
+      target.weights->a = tensor::Tensor(DataType::kDataTypeFp32, adapter_num_, rank_,
+                                         matmul->input_dim(), true, alloc);
+      target.weights->b = tensor::Tensor(DataType::kDataTypeFp32, adapter_num_, rank_,
+                                         matmul->output_dim(), true, alloc);
+      target.weights->scales = scales_;
+      matmul->set_lora(target.weights, rows_);
+      targets_.push_back(std::move(target));
+    }
+  }
+  return error::Success();
+}
+
+void LoraPool::upload(const tensor::Tensor& tensor, size_t offset, const float* src,
+                      size_t element_num) const {
+  float* dst = const_cast<float*>(tensor.ptr<float>()) + offset;
+  if (device_type_ == base::DeviceType::kDeviceCPU) {
+    memcpy(dst, src, element_num * sizeof(float));
+  } else {
+    CHECK_EQ(cudaMemcpy(dst, src, element_num * sizeof(float), cudaMemcpyHostToDevice),
+             cudaSuccess);
+  }
+}
+
+#if defined(LLAMA3_SUPPORT) || defined(QWEN2_SUPPORT)
+using json = nlohmann::json;
+
+// the element idx of a safetensors tensor of the fp32, fp16 or bf16 type
+static float lora_element(base::DataType data_type, const uint8_t* src, size_t idx) {
+  if (data_type == base::DataType::kDataTypeFp32) {
+    float value = 0.f;
+    memcpy(&value, src + idx * sizeof(float), sizeof(float));
+    return value;
+  }
+  uint16_t half = 0;
+  memcpy(&half, src + idx * sizeof(uint16_t), sizeof(uint16_t));
+  return data_type == base::DataType::kDataTypeFp16 ? base::half_to_float(half)
+                                                    : base::bf16_to_float(half);
+}
+
+// splits a peft tensor name, base_model.model.model.layers.{i}.self_attn.q_proj.lora_A.weight,
+// into its layer, its module and the side of the low rank pair
+static bool parse_lora_name(const std::string& name, int32_t& layer_idx, std::string& module,
+                            bool& is_lora_a) {
+  const std::string layer_prefix = "layers.";
+  const size_t layer_pos = name.find(layer_prefix);
+  size_t side_pos = name.find(".lora_A");
+  is_lora_a = side_pos != std::string::npos;
+  if (!is_lora_a) {
+    side_pos = name.find(".lora_B");
+  }
+  if (layer_pos == std::string::npos || side_pos == std::string::npos) {
+    return false;
+  }
+  const size_t idx_begin = layer_pos + layer_prefix.size();
+  const size_t idx_end = name.find('.', idx_begin);
+  if (idx_end == std::string::npos || idx_end >= side_pos) {
+    return false;
+  }
+  layer_idx = std::atoi(name.substr(idx_begin, idx_end - idx_begin).c_str());
+  const size_t module_begin = name.rfind('.', side_pos - 1) + 1;
+  module = name.substr(module_begin, side_pos - module_begin);
+  return true;
+}
+
+base::Status LoraPool::load(const std::string& path, int32_t& adapter_id) {
+  using namespace base;
+  if (targets_.empty()) {
+    return error::InternalError("The lora pool is not attached to the model.");
+  }
+  auto free_iter = std::find(is_loaded_.begin(), is_loaded_.end(), false);
+  if (free_iter == is_loaded_.end()) {
+    return error::InternalError("There are no free slots left in the lora pool.");
+  }
+  const int32_t slot = static_cast<int32_t>(free_iter - is_loaded_.begin());
+
+  const std::string config_path = path + "/adapter_config.json";
+  std::ifstream config_file(config_path);
+  if (!config_file.is_open()) {
+    return error::PathNotValid("Failed to open the adapter config " + config_path + ".");
+  }
+  json config_json;
+  try {
+    config_json = json::parse(config_file);
+  } catch (json::exception&) {
+    return error::ModelParseError("The adapter config " + config_path + " is not valid json.");
+  }
+  const int32_t adapter_rank = config_json.value("r", 0);
+  const float alpha = config_json.value("lora_alpha", static_cast<float>(adapter_rank));
+  if (adapter_rank <= 0 || adapter_rank > rank_) {
+    return error::InvalidArgument("The rank of the adapter " + path +
+                                  " does not fit into the lora pool.");
+  }
+  const float scale = config_json.value("use_rslora", false)
+                          ? alpha / std::sqrt(static_cast<float>(adapter_rank))
+                          : alpha / static_cast<float>(adapter_rank);
+
+  const std::string weight_path = path + "/adapter_model.safetensors";
+  std::ifstream weight_file(weight_path, std::ios::binary);
+  if (!weight_file.is_open()) {
+    return error::PathNotValid("Failed to open the adapter weights " + weight_path + ".");
+  }
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(weight_file)),
+                            std::istreambuf_iterator<char>());
+  std::vector<SafetensorsTensor> tensors;
+  Status status = parse_safetensors(data.data(), data.size(), tensors);
+  if (!status) {
+    return status;
+  }
+
+  std::map<std::pair<int32_t, std::string>, int32_t> target_indices;
+  for (int32_t i = 0; i < targets_.size(); ++i) {
+    target_indices[{targets_.at(i).layer_idx, targets_.at(i).module}] = i;
+  }
+  // the rows past the rank of the adapter and the modules it does not have stay zero
+  std::vector<std::vector<float>> host_a(targets_.size());
+  std::vector<std::vector<float>> host_b(targets_.size());
+  for (int32_t i = 0; i < targets_.size(); ++i) {
+    host_a.at(i).assign(static_cast<size_t>(rank_) * targets_.at(i).layer->input_dim(), 0.f);
+    host_b.at(i).assign(static_cast<size_t>(rank_) * targets_.at(i).layer->output_dim(), 0.f);
+  }
+  for (const SafetensorsTensor& tensor : tensors) {
+    int32_t layer_idx = 0;
+    std::string module;
+    bool is_lora_a = false;
+    if (!parse_lora_name(tensor.name, layer_idx, module, is_lora_a)) {
+      return error::ModelParseError("The adapter tensor " + tensor.name + " is not supported.");
+    }
+    auto target_iter = target_indices.find({layer_idx, module});
+    if (target_iter == target_indices.end()) {
+      return error::InvalidArgument("The adapter tensor " + tensor.name +
+                                    " is not a target module of the lora pool.");
+    }
+    if (tensor.data_type != DataType::kDataTypeFp32 &&
+        tensor.data_type != DataType::kDataTypeFp16 &&
+        tensor.data_type != DataType::kDataTypeBf16) {
+      return error::ModelParseError("The adapter tensor " + tensor.name +
+                                    " is not a float tensor.");
+    }
+    const Target& target = targets_.at(target_iter->second);
+    const int32_t in_dim = target.layer->input_dim();
+    const int32_t out_dim = target.layer->output_dim();
+    const uint8_t* src = data.data() + tensor.offset;
+    // lora_A is [r, in_dim] and lora_B is [out_dim, r]
+    const std::vector<int32_t> dims =
+        is_lora_a ? std::vector<int32_t>{adapter_rank, in_dim}
+                  : std::vector<int32_t>{out_dim, adapter_rank};
+    if (tensor.dims != dims) {
+      return error::ModelParseError("The shape of the adapter tensor " + tensor.name +
+                                    " does not match the model.");
+    }
+    if (is_lora_a) {
+      std::vector<float>& a = host_a.at(target_iter->second);
+      for (size_t i = 0; i < static_cast<size_t>(adapter_rank) * in_dim; ++i) {
+        a[i] = lora_element(tensor.data_type, src, i);
+      }
+      continue;
+    }
+    std::vector<float>& b = host_b.at(target_iter->second);
+    const int32_t half_head = head_size_ / 2;
+    for (int32_t k = 0; k < out_dim; ++k) {
+      // the interleaved rope takes the row i of the first half of a head next to the row i of
+      // the second half, as the export of the legacy model files permutes them
+      int32_t src_row = k;
+      if (target.is_rope_permuted) {
+        const int32_t head = k / head_size_;
+        const int32_t in_head = k % head_size_;
+        src_row = head * head_size_ + (in_head % 2) * half_head + in_head / 2;
+      }
+      for (int32_t r = 0; r < adapter_rank; ++r) {
+        b[static_cast<size_t>(r) * out_dim + k] =
+            lora_element(tensor.data_type, src, static_cast<size_t>(src_row) * adapter_rank + r);
+      }
+    }
+  }
+
+  for (int32_t i = 0; i < targets_.size(); ++i) {
+    const op::LoraWeights& weights = *targets_.at(i).weights;
+    upload(weights.a, static_cast<size_t>(slot) * host_a.at(i).size(), host_a.at(i).data(),
+           host_a.at(i).size());
+    upload(weights.b, static_cast<size_t>(slot) * host_b.at(i).size(), host_b.at(i).data(),
+           host_b.at(i).size());
+  }
+  host_scales_.at(slot) = scale;
+  upload(scales_, slot, &host_scales_.at(slot), 1);
+  is_loaded_.at(slot) = true;
+  adapter_id = slot;
+  LOG(INFO) << "The lora adapter " << path << " of rank " << adapter_rank << " is in slot "
+            << slot << " of the pool.";
+  return error::Success();
+}
+#else
+base::Status LoraPool::load(const std::string& path, int32_t& adapter_id) {
+  return base::error::ModelParseError(
+      "The lora adapters need the json support of the LLAMA3_SUPPORT or the QWEN2_SUPPORT "
+      "build.");
+}
+#endif
+
+base::Status LoraPool::unload(int32_t adapter_id) {
+  if (!is_loaded(adapter_id)) {
+    return base::error::InvalidArgument("The lora adapter " + std::to_string(adapter_id) +
+                                        " is not loaded.");
+  }
+  is_loaded_.at(adapter_id) = false;
+  host_scales_.at(adapter_id) = 0.f;
+  upload(scales_, adapter_id, &host_scales_.at(adapter_id), 1);
+  return base::error::Success();
+}
+
+bool LoraPool::is_loaded(int32_t adapter_id) const {
+  return adapter_id >= 0 && adapter_id < adapter_num_ && is_loaded_.at(adapter_id);
+}
+
+base::Status LoraPool::bind(const std::vector<int32_t>& row_adapters, bool keep_rows,
+                            void* stream) {
+  if (row_adapters.empty() || row_adapters.size() > host_adapters_.size()) {
+    return base::error::InvalidArgument("The rows of the lora binding do not fit the batch.");
+  }
+  bool has_adapter = false;
+  for (int32_t i = 0; i < row_adapters.size(); ++i) {
+    if (row_adapters.at(i) >= 0 && !is_loaded(row_adapters.at(i))) {
+      return base::error::InvalidArgument("The lora adapter " +
+                                          std::to_string(row_adapters.at(i)) + " is not loaded.");
+    }
+    has_adapter |= row_adapters.at(i) >= 0;
+    host_adapters_.at(i) = row_adapters.at(i);
+  }
+  if (!has_adapter && !keep_rows) {
+    rows_->adapters = tensor::Tensor();
+    return base::error::Success();
+  }
+  // the buffer stays at the same address, a captured graph reads the adapters of the replay
+  const size_t row_num = row_adapters.size();
+  int32_t* adapters_ptr = const_cast<int32_t*>(adapters_.ptr<int32_t>());
+  if (device_type_ == base::DeviceType::kDeviceCPU) {
+    memcpy(adapters_ptr, host_adapters_.data(), row_num * sizeof(int32_t));
+  } else {
+    cudaMemcpyAsync(adapters_ptr, host_adapters_.data(), row_num * sizeof(int32_t),
+                    cudaMemcpyHostToDevice, static_cast<cudaStream_t>(stream));
+  }
+  tensor::Tensor rows(base::DataType::kDataTypeInt32, static_cast<int32_t>(row_adapters.size()),
+                      false, nullptr, adapters_ptr);
+  rows.set_device_type(device_type_);
+  rows_->adapters = rows;
+  return base::error::Success();
+}
+
+int32_t LoraPool::rank() const { return rank_; }
+}  // namespace model
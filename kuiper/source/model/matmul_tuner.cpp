@@ -0,0 +1,136 @@
+#include "model/matmul_tuner.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include "../op/kernels/cuda/matmul_kernel.cuh"
+namespace model {
+static constexpr int32_t kWarmupNum = 2;
+static constexpr int32_t kTimingNum = 20;
+
+MatmulTuner::MatmulTuner(std::string cache_path) : cache_path_(std::move(cache_path)) {
+  int32_t device_id = 0;
+  cudaGetDevice(&device_id);
+  cudaDeviceProp prop;
+  CHECK_EQ(cudaGetDeviceProperties(&prop, device_id), cudaSuccess);
+  // the name is the first field of a line
+  device_name_ = prop.name;
+  std::replace(device_name_.begin(), device_name_.end(), ' ', '_');
+  if (cache_path_.empty()) {
+    return;
+  }
+
+  std::ifstream file(cache_path_);
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    std::string device_name;
+    int32_t rows = 0;
+    int32_t cols = 0;
+    int32_t data_type = 0;
+    kernel::GemvLaunch launch;
+    if (!(fields >> device_name >> rows >> cols >> data_type >> launch.thread_num >>
+          launch.row_per_block)) {
+      continue;
+    }
+    if (device_name != device_name_) {
+      other_device_lines_.push_back(line);
+      continue;
+    }
+    // a launch which is not a candidate any more is timed again
+    const auto& candidates = kernel::gemv_launch_candidates();
+    const bool is_candidate =
+        std::any_of(candidates.begin(), candidates.end(), [&launch](const auto& candidate) {
+          return candidate.thread_num == launch.thread_num &&
+                 candidate.row_per_block == launch.row_per_block;
+        });
+    if (is_candidate) {
+      launches_[kernel::GemvShape{rows, cols, data_type}] = launch;
+    }
+  }
+}
+
+void MatmulTuner::tune(const tensor::Tensor& weight, kernel::CudaConfig* config) {
+  CHECK_NE(config, nullptr);
+  CHECK(weight.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK_EQ(weight.dims_size(), 2);
+  const kernel::GemvShape shape{weight.get_dim(0), weight.get_dim(1),
+                                static_cast<int32_t>(weight.data_type())};
+  auto launch = launches_.find(shape);
+  if (launch == launches_.end()) {
+    launch = launches_.emplace(shape, time_launches(weight, config->stream)).first;
+    tuned_num_ += 1;
+    LOG(INFO) << "The gemv of the weight [" << weight.get_dim(0) << ", " << weight.get_dim(1)
+              << "] runs with " << launch->second.thread_num << " threads and "
+              << launch->second.row_per_block << " rows per block.";
+  }
+  config->gemv_launches[shape] = launch->second;
+}
+
+kernel::GemvLaunch MatmulTuner::time_launches(const tensor::Tensor& weight,
+                                              cudaStream_t stream) const {
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  tensor::Tensor input(base::DataType::kDataTypeFp32, weight.get_dim(1), true, alloc_cu);
+  tensor::Tensor output(base::DataType::kDataTypeFp32, weight.get_dim(0), true, alloc_cu);
+  cudaMemsetAsync(input.ptr<float>(), 0, input.byte_size(), stream);
+
+  cudaEvent_t start;
+  cudaEvent_t stop;
+  CHECK_EQ(cudaEventCreate(&start), cudaSuccess);
+  CHECK_EQ(cudaEventCreate(&stop), cudaSuccess);
+  kernel::GemvLaunch best_launch;
+  float best_time = -1.f;
+  for (const kernel::GemvLaunch& launch : kernel::gemv_launch_candidates()) {
+    for (int32_t i = 0; i < kWarmupNum; ++i) {
+      kernel::gemv_kernel_cu(input, weight, output, launch, stream);
+    }
+    cudaEventRecord(start, stream);
+    for (int32_t i = 0; i < kTimingNum; ++i) {
+      kernel::gemv_kernel_cu(input, weight, output, launch, stream);
+    }
+    cudaEventRecord(stop, stream);
+    cudaEventSynchronize(stop);
+    float time = 0.f;
+    cudaEventElapsedTime(&time, start, stop);
+    if (best_time < 0.f || time < best_time) {
+      best_time = time;
+      best_launch = launch;
+    }
+  }
+  cudaEventDestroy(start);
+  cudaEventDestroy(stop);
+  return best_launch;
+}
+
+base::Status MatmulTuner::save() const {
+  if (cache_path_.empty() || tuned_num_ == 0) {
+    return base::error::Success();
+  }
+  // written aside first, so another process never reads a half written cache
+  const std::string temp_path = cache_path_ + ".tmp";
+  {
+    std::ofstream file(temp_path);
+    if (!file) {
+      return base::error::PathNotValid(temp_path);
+    }
+    for (const std::string& line : other_device_lines_) {
+      file << line << "\n";
+    }
+    for (const auto& [shape, launch] : launches_) {
+      file << device_name_ << " " << std::get<0>(shape) << " " << std::get<1>(shape) << " "
+           << std::get<2>(shape) << " " << launch.thread_num << " " << launch.row_per_block
+           << "\n";
+    }
+    if (!file) {
+      return base::error::InternalError("Failed to write the matmul tuning cache " + temp_path);
+    }
+  }
+  if (std::rename(temp_path.c_str(), cache_path_.c_str()) != 0) {
+    return base::error::InternalError("Failed to write the matmul tuning cache " + cache_path_);
+  }
+  return base::error::Success();
+}
+
+size_t MatmulTuner::tuned_num() const { return tuned_num_; }
+}  // namespace model
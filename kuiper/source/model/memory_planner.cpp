@@ -0,0 +1,83 @@
+#include "model/memory_planner.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <numeric>
+namespace model {
+// every tensor starts on its own cache line
+constexpr static size_t kTensorAlignment = 256;
+
+int32_t MemoryPlanner::add_tensor(base::DataType data_type, const std::vector<int32_t>& dims,
+                                  int32_t first_step, int32_t last_step) {
+  CHECK(!is_allocated()) << "The tensors have to be added before the arena is allocated.";
+  CHECK_LE(first_step, last_step);
+  TensorInfo info;
+  info.data_type = data_type;
+  info.dims = dims;
+  info.first_step = first_step;
+  info.last_step = last_step;
+  size_t size = std::accumulate(dims.begin(), dims.end(), size_t(1), std::multiplies<size_t>());
+  info.byte_size = (size * base::DataTypeSize(data_type) + kTensorAlignment - 1) /
+                   kTensorAlignment * kTensorAlignment;
+  tensors_.push_back(info);
+  return static_cast<int32_t>(tensors_.size()) - 1;
+}
+
+void MemoryPlanner::plan() {
+  std::vector<int32_t> order(tensors_.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](int32_t lhs, int32_t rhs) {
+    return tensors_.at(lhs).byte_size > tensors_.at(rhs).byte_size;
+  });
+
+  // the lowest offset which is free for the whole lifetime of the tensor
+  std::vector<int32_t> placed;
+  arena_byte_size_ = 0;
+  for (int32_t id : order) {
+    TensorInfo& info = tensors_.at(id);
+    std::vector<std::pair<size_t, size_t>> used;
+    for (int32_t other_id : placed) {
+      const TensorInfo& other = tensors_.at(other_id);
+      if (other.first_step <= info.last_step && info.first_step <= other.last_step) {
+        used.emplace_back(other.offset, other.offset + other.byte_size);
+      }
+    }
+    std::sort(used.begin(), used.end());
+    size_t offset = 0;
+    for (const auto& [begin, end] : used) {
+      if (offset + info.byte_size <= begin) {
+        break;
+      }
+      offset = std::max(offset, end);
+    }
+    info.offset = offset;
+    arena_byte_size_ = std::max(arena_byte_size_, offset + info.byte_size);
+    placed.push_back(id);
+  }
+}
+
+bool MemoryPlanner::allocate(std::shared_ptr<base::DeviceAllocator> alloc) {
+  CHECK(alloc != nullptr);
+  CHECK(!tensors_.empty());
+  plan();
+  arena_ = tensor::Tensor(base::DataType::kDataTypeInt8, static_cast<int32_t>(arena_byte_size_),
+                          true, alloc);
+  if (arena_.is_empty()) {
+    return false;
+  }
+  arena_.get_buffer()->set_tag(base::MemoryTag::kMemoryTagActivation);
+  return true;
+}
+
+tensor::Tensor MemoryPlanner::get_tensor(int32_t tensor_id) const {
+  CHECK(is_allocated());
+  const TensorInfo& info = tensors_.at(tensor_id);
+  int8_t* ptr = const_cast<int8_t*>(arena_.ptr<int8_t>()) + info.offset;
+  tensor::Tensor tensor(info.data_type, info.dims, false, nullptr, ptr);
+  tensor.set_device_type(arena_.device_type());
+  return tensor;
+}
+
+size_t MemoryPlanner::arena_byte_size() const { return arena_byte_size_; }
+
+bool MemoryPlanner::is_allocated() const { return !arena_.is_empty(); }
+}  // namespace model
@@ -1,8 +1,41 @@
 #include "model/model.h"
+#include <algorithm>
+#include <cstring>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#include "../op/kernels/cpu/gemv_kernel.h"
+#include "../op/kernels/cuda/cls_topk_kernel.cuh"
+#include "../op/kernels/cuda/emb_kernel.cuh"
+#include "../op/kernels/cuda/matmul_kernel.cuh"
+#include "../op/kernels/cuda/megakernel.cuh"
+#include "base/profiler.h"
+#include "base/thread_pool.h"
+#include "model/gguf.h"
+#include "model/int4_import.h"
+#include "model/safetensors.h"
+#include "model/matmul_tuner.h"
 namespace model {
+// "KQ4\0", an int8 model file has its group size there
+static constexpr int32_t kInt4ModelMagic = 0x0034514b;
+static constexpr int32_t kInt4ZeroPointFlag = 1;
+
+struct Int4Header {
+  int32_t group_size = 0;
+  int32_t flags = 0;
+  int32_t reserved[2] = {0, 0};
+};
+
+// "KF2\0" after the config of a model file with 16 bit weights, an fp32 file has its first
+// embedding value there
+static constexpr int32_t kHalfModelMagic = 0x0032464b;
+
+struct HalfHeader {
+  int32_t data_type = 0;
+  int32_t reserved[3] = {0, 0, 0};
+};
+
 Model::Model(base::TokenizerType tokenizer_type, base::ModelType model_type, std::string token_path,
              std::string model_path, bool is_quant_model)
     : tokenizer_type_(tokenizer_type),
@@ -11,11 +44,1522 @@ Model::Model(base::TokenizerType tokenizer_type, base::ModelType model_type, std
       model_path_(std::move(model_path)),
       is_quant_model_(is_quant_model) {}
 
-base::ModelType Model::model_type() const { return model_type_; }
+base::ModelType Model::model_type() const { return model_type_; }
+
+const std::string& Model::token_path() const { return token_path_; }
+
+const std::string& Model::model_path() const { return model_path_; }
+
+void Model::set_max_batch_size(int32_t max_batch_size) {
+  CHECK_GT(max_batch_size, 0);
+  CHECK(buffers_.empty()) << "The max batch size should be set before the model is initialized.";
+  max_batch_size_ = max_batch_size;
+}
+
+int32_t Model::max_batch_size() const { return max_batch_size_; }
+
+int32_t Model::seq_len() const {
+  CHECK(config_ != nullptr);
+  return config_->seq_len_;
+}
+
+void Model::set_kv_cache_blocks(int32_t block_size, int32_t block_num) {
+  CHECK_GT(block_size, 0);
+  CHECK_GE(block_num, 0);
+  CHECK(buffers_.empty()) << "The kv cache blocks should be set before the model is initialized.";
+  kv_block_size_ = block_size;
+  kv_block_num_ = block_num;
+}
+
+void Model::set_kv_cache_data_type(base::DataType data_type) {
+  CHECK(data_type == base::DataType::kDataTypeFp32 || data_type == base::DataType::kDataTypeFp16 ||
+        data_type == base::DataType::kDataTypeBf16 || data_type == base::DataType::kDataTypeInt8);
+  CHECK(buffers_.empty())
+      << "The kv cache data type should be set before the model is initialized.";
+  kv_data_type_ = data_type;
+}
+
+void Model::set_kv_cache_head_major(bool is_head_major) {
+  CHECK(buffers_.empty())
+      << "The kv cache layout should be set before the model is initialized.";
+  is_kv_head_major_ = is_head_major;
+}
+
+void Model::set_kv_cache_growth(int32_t chunk_block_num, int32_t keep_block_num) {
+  CHECK_GE(chunk_block_num, 0);
+  CHECK_GE(keep_block_num, 0);
+  CHECK(buffers_.empty()) << "The kv cache growth should be set before the model is initialized.";
+  kv_chunk_block_num_ = chunk_block_num;
+  kv_keep_block_num_ = keep_block_num;
+}
+
+void Model::set_pinned_memory(bool use_pinned_memory) {
+  CHECK(buffers_.empty()) << "The pinned memory should be set before the model is initialized.";
+  use_pinned_memory_ = use_pinned_memory;
+}
+
+void Model::set_weight_offload(size_t device_budget_byte_size) {
+  CHECK(buffers_.empty()) << "The weight offload should be set before the model is initialized.";
+  weight_device_budget_ = device_budget_byte_size;
+}
+
+void Model::set_shared_weights(const std::string& handle_path, bool is_owner) {
+  CHECK(buffers_.empty()) << "The shared weights should be set before the model is initialized.";
+  shared_weights_ = std::make_unique<SharedWeights>(handle_path, is_owner);
+}
+
+void Model::set_weight_cache(const std::string& cache_path) {
+  CHECK(buffers_.empty()) << "The weight cache should be set before the model is initialized.";
+  weight_cache_ = std::make_unique<WeightCache>(cache_path);
+}
+
+void Model::set_matmul_tuning(bool use_matmul_tuning, const std::string& cache_path) {
+  CHECK(buffers_.empty()) << "The matmul tuning should be set before the model is initialized.";
+  use_matmul_tuning_ = use_matmul_tuning;
+  matmul_tuning_path_ = cache_path;
+}
+
+void Model::set_numa(bool use_numa) {
+  CHECK(buffers_.empty()) << "The numa placement should be set before the model is initialized.";
+  use_numa_ = use_numa;
+}
+
+void Model::set_weight_tiling(bool use_weight_tiling) {
+  CHECK(buffers_.empty()) << "The weight tiling should be set before the model is initialized.";
+  use_weight_tiling_ = use_weight_tiling;
+}
+
+void Model::set_weight_load_options(const WeightLoadOptions& options) {
+  CHECK(buffers_.empty()) << "The weight load options should be set before the model is "
+                             "initialized.";
+  weight_load_options_ = options;
+}
+
+void Model::set_step_validation(bool validate_steps) {
+  CHECK(buffers_.empty()) << "The step validation should be set before the model is "
+                             "initialized.";
+  validate_steps_ = validate_steps;
+}
+
+void Model::set_megakernel(bool use_megakernel) {
+  CHECK(buffers_.empty()) << "The megakernel should be set before the model is initialized.";
+  use_megakernel_ = use_megakernel;
+}
+
+void Model::set_rope_scaling(const base::RoPEScaling& scaling) {
+  CHECK_GT(scaling.factor, 0.f);
+  CHECK(buffers_.empty()) << "The rope scaling should be set before the model is initialized.";
+  has_rope_scaling_ = true;
+  rope_scaling_ = scaling;
+}
+
+void Model::set_max_seq_len(int32_t max_seq_len) {
+  CHECK_GT(max_seq_len, 1);
+  CHECK(buffers_.empty()) << "The max sequence length should be set before the model is "
+                             "initialized.";
+  max_seq_len_ = max_seq_len;
+}
+
+void Model::set_attention_window(int32_t sink_num, int32_t window_size, int32_t chunk_size) {
+  CHECK_GE(sink_num, 0);
+  CHECK_GT(window_size, 0);
+  CHECK_GT(chunk_size, 0);
+  CHECK(buffers_.empty()) << "The attention window should be set before the model is "
+                             "initialized.";
+  attention_window_.sink_num = sink_num;
+  attention_window_.window_size = window_size;
+  attention_window_.chunk_size = chunk_size;
+}
+
+const base::AttentionWindow& Model::attention_window() const { return attention_window_; }
+
+int32_t Model::max_position() const {
+  CHECK(config_ != nullptr);
+  if (!attention_window_.is_enabled()) {
+    return config_->seq_len_;
+  }
+  // the rope kernels take the position in fp32, which is exact up to here
+  return 1 << 24;
+}
+
+void Model::set_gpu_layer_num(int32_t gpu_layer_num) {
+  CHECK_GT(gpu_layer_num, 0);
+  CHECK(buffers_.empty()) << "The layer split should be set before the model is initialized.";
+  gpu_layer_num_ = gpu_layer_num;
+}
+
+void Model::set_tensor_parallel(int32_t rank, int32_t world_size, const std::string& id_path) {
+  CHECK_GT(world_size, 0);
+  CHECK_GE(rank, 0);
+  CHECK_LT(rank, world_size);
+  CHECK(world_size == 1 || !id_path.empty());
+  CHECK(buffers_.empty()) << "The tensor parallel should be set before the model is initialized.";
+  tensor_parallel_rank_ = rank;
+  tensor_parallel_size_ = world_size;
+  tensor_parallel_id_path_ = id_path;
+}
+
+base::Status Model::init_tensor_parallel(base::DeviceType device_type) {
+  if (tensor_parallel_size_ == 1) {
+    return base::error::Success();
+  }
+  if (device_type != base::DeviceType::kDeviceCUDA) {
+    return base::error::InternalError("The tensor parallel needs the cuda device.");
+  }
+  if (gpu_layer_num_ > 0 || weight_device_budget_ > 0 || shared_weights_ || weight_cache_) {
+    return base::error::InternalError(
+        "The tensor parallel can not split the layers, stream, share or cache the weights.");
+  }
+  if (use_cuda_graph_) {
+    return base::error::InternalError("The cuda graphs do not capture the tensor parallel sums.");
+  }
+  return TensorParallelGroup::create(tensor_parallel_rank_, tensor_parallel_size_,
+                                     tensor_parallel_id_path_, tensor_parallel_);
+}
+
+base::Status Model::shard_tensor_parallel(
+    const std::vector<std::vector<std::shared_ptr<op::Layer>>*>& column_groups,
+    const std::vector<std::vector<std::shared_ptr<op::Layer>>*>& row_groups) {
+  CHECK(tensor_parallel_ != nullptr);
+  const int32_t rank = tensor_parallel_->rank();
+  const int32_t world_size = tensor_parallel_->world_size();
+  if (is_quant_model_) {
+    return base::error::InternalError("The tensor parallel does not split the quant weights.");
+  }
+  if (config_->head_num_ % world_size != 0 || config_->kv_head_num_ % world_size != 0 ||
+      config_->hidden_dim_ % world_size != 0) {
+    return base::error::InternalError("The heads and the ffn of the model do not split over " +
+                                      std::to_string(world_size) + " ranks.");
+  }
+  // the weights are still the fp32 views of the model file, whatever the file stores
+  const size_t element_size = base::DataTypeSize(weight_data_type_);
+  const base::DeviceType cpu_device_type = base::DeviceType::kDeviceCPU;
+  for (auto* group : column_groups) {
+    for (auto& layer : *group) {
+      auto matmul = std::dynamic_pointer_cast<op::MatmulLayer>(layer);
+      CHECK(matmul != nullptr);
+      const tensor::Tensor& weight = matmul->get_weight(0);
+      const int32_t cols = weight.get_dim(1);
+      const ShardRange range = shard_range(weight.get_dim(0), rank, world_size);
+      auto shard = std::make_shared<op::MatmulLayer>(matmul->device_type(), range.size, cols,
+                                                     false, matmul->has_bias());
+      shard->set_weight(0, {range.size, cols},
+                        weight.ptr<uint8_t>() + range.begin * cols * element_size,
+                        cpu_device_type);
+      if (matmul->has_bias()) {
+        int32_t bias_dim = range.size;
+        shard->set_bias(0, bias_dim, matmul->get_bias(0).ptr<float>(range.begin),
+                        cpu_device_type);
+      }
+      layer = shard;
+    }
+  }
+  for (auto* group : row_groups) {
+    for (auto& layer : *group) {
+      auto matmul = std::dynamic_pointer_cast<op::MatmulLayer>(layer);
+      CHECK(matmul != nullptr);
+      // every rank would add the bias to its part of the sum
+      if (matmul->has_bias()) {
+        return base::error::InternalError("The row parallel matmul can not have a bias.");
+      }
+      const tensor::Tensor& weight = matmul->get_weight(0);
+      const int32_t rows = weight.get_dim(0);
+      const int32_t cols = weight.get_dim(1);
+      const ShardRange range = shard_range(cols, rank, world_size);
+      tensor_parallel_weights_.push_back(
+          slice_columns(weight.ptr<uint8_t>(), rows, cols, element_size, range));
+      auto shard =
+          std::make_shared<op::MatmulLayer>(matmul->device_type(), rows, range.size);
+      shard->set_weight(0, {rows, range.size}, tensor_parallel_weights_.back().data(),
+                        cpu_device_type);
+      layer = shard;
+    }
+  }
+
+  config_->head_num_ /= world_size;
+  config_->kv_head_num_ /= world_size;
+  config_->kv_dim_ /= world_size;
+  config_->hidden_dim_ /= world_size;
+  config_->q_dim_ /= world_size;
+  LOG(INFO) << "The rank " << rank << " keeps " << config_->head_num_ << " heads and "
+            << config_->hidden_dim_ << " ffn rows.";
+  return base::error::Success();
+}
+
+base::Status Model::reduce_tensor_parallel(const tensor::Tensor& tensor, void* stream) const {
+  if (!tensor_parallel_) {
+    return base::error::Success();
+  }
+  return tensor_parallel_->all_reduce(tensor, stream);
+}
+
+int32_t Model::kv_block_size() const { return kv_block_size_; }
+
+int32_t Model::free_kv_block_num() const {
+  CHECK(kv_cache_ != nullptr);
+  return kv_cache_->free_block_num();
+}
+
+int32_t Model::kv_block_num() const {
+  CHECK(kv_cache_ != nullptr);
+  return kv_cache_->block_num();
+}
+
+void Model::fork_kv_cache(int32_t src_slot, int32_t dst_slot, int32_t token_num) const {
+  CHECK(kv_cache_ != nullptr);
+  kv_cache_->fork(src_slot, dst_slot, token_num);
+  if (host_kv_cache_) {
+    host_kv_cache_->fork(src_slot, dst_slot, token_num);
+  }
+}
+
+void Model::release_kv_cache(int32_t slot) const {
+  CHECK(kv_cache_ != nullptr);
+  kv_cache_->release(slot);
+  if (host_kv_cache_) {
+    host_kv_cache_->release(slot);
+  }
+  if (kv_chunk_block_num_ > 0) {
+    kv_cache_->shrink(kv_keep_block_num_);
+    if (host_kv_cache_) {
+      host_kv_cache_->shrink(kv_keep_block_num_);
+    }
+  }
+}
+
+void Model::truncate_kv_cache(int32_t slot, int32_t token_num) const {
+  CHECK(kv_cache_ != nullptr);
+  kv_cache_->truncate(slot, token_num);
+  if (host_kv_cache_) {
+    host_kv_cache_->truncate(slot, token_num);
+  }
+}
+
+base::Status Model::save_kv_snapshot(int32_t slot, int32_t token_num,
+                                     KVSnapshot& snapshot) const {
+  CHECK(kv_cache_ != nullptr);
+  if (host_kv_cache_) {
+    return base::error::InvalidArgument("The kv snapshot does not support the layer split.");
+  }
+  if (attention_window_.is_enabled()) {
+    return base::error::InvalidArgument("The kv snapshot does not support the attention window.");
+  }
+  if (token_num <= 0 || token_num > kv_cache_->reserved_token_num(slot)) {
+    return base::error::InvalidArgument("The positions of the kv snapshot are not in the slot.");
+  }
+  kv_cache_->save(slot, token_num, snapshot, cuda_stream());
+  return base::error::Success();
+}
+
+base::Status Model::restore_kv_snapshot(int32_t slot, const KVSnapshot& snapshot) const {
+  CHECK(kv_cache_ != nullptr);
+  if (host_kv_cache_) {
+    return base::error::InvalidArgument("The kv snapshot does not support the layer split.");
+  }
+  if (!kv_cache_->blocks(slot).empty()) {
+    return base::error::InvalidArgument("The kv snapshot is restored into a slot in use.");
+  }
+  if (attention_window_.is_enabled()) {
+    return base::error::InvalidArgument("The kv snapshot does not support the attention window.");
+  }
+  if (snapshot.token_num() > config_->seq_len_) {
+    return base::error::InvalidArgument("The kv snapshot is longer than the sequence length.");
+  }
+  if (!kv_cache_->restore(slot, snapshot, cuda_stream())) {
+    return base::error::InternalError("The kv snapshot can not be restored into the kv cache.");
+  }
+  // the snapshot may be released once this returns
+  if (cuda_stream()) {
+    cudaStreamSynchronize(static_cast<cudaStream_t>(cuda_stream()));
+  }
+  return base::error::Success();
+}
+
+base::Status Model::swap_out_kv(int32_t slot, int32_t token_num, KVSnapshot& snapshot) const {
+  if (!cuda_stream()) {
+    return save_kv_snapshot(slot, token_num, snapshot);
+  }
+  CHECK(kv_cache_ != nullptr);
+  if (host_kv_cache_) {
+    return base::error::InvalidArgument("The kv swap does not support the layer split.");
+  }
+  if (attention_window_.is_enabled()) {
+    return base::error::InvalidArgument("The kv swap does not support the attention window.");
+  }
+  if (token_num <= 0 || token_num > kv_cache_->reserved_token_num(slot)) {
+    return base::error::InvalidArgument("The positions of the kv swap are not in the slot.");
+  }
+  kernel::CudaConfig* swap_config = kv_swap_config();
+  if (!swap_config) {
+    return base::error::InternalError("The stream of the kv swap can not be created.");
+  }
+  // the copies start once the steps which wrote the kv are done
+  cudaEventRecord(swap_config->swap_event, static_cast<cudaStream_t>(cuda_stream()));
+  cudaStreamWaitEvent(swap_config->swap_stream, swap_config->swap_event, 0);
+  kv_cache_->save(slot, token_num, snapshot, swap_config->swap_stream);
+  return base::error::Success();
+}
+
+size_t Model::kv_swap_byte_size(int32_t token_num) const {
+  CHECK(kv_cache_ != nullptr);
+  return KVSnapshot::byte_size(kv_cache_->snapshot_header(token_num));
+}
+
+void Model::set_prefix_cache(int32_t max_block_num) {
+  CHECK(kv_cache_ != nullptr) << "The prefix cache should be set after the model is initialized.";
+  CHECK(!host_kv_cache_) << "The prefix cache does not support the layer split.";
+  // the blocks of a windowed prompt are overwritten as its ring turns
+  CHECK(!attention_window_.is_enabled())
+      << "The prefix cache does not support the attention window.";
+  prefix_cache_ = std::make_unique<PrefixCache>(kv_cache_.get(), max_block_num);
+}
+
+int32_t Model::match_prefix(const std::vector<int32_t>& tokens, int32_t slot) const {
+  // the kv of an adapter differs from the one of the base model
+  if (!prefix_cache_ || slot_adapter(slot) >= 0) {
+    return 0;
+  }
+  return prefix_cache_->match(tokens, slot);
+}
+
+void Model::cache_prefix(const std::vector<int32_t>& tokens, int32_t slot) const {
+  if (prefix_cache_ && slot_adapter(slot) < 0) {
+    prefix_cache_->insert(tokens, slot);
+  }
+}
+
+bool Model::reclaim_kv_blocks(int32_t block_num) const {
+  if (free_kv_block_num() >= block_num) {
+    return true;
+  }
+  return prefix_cache_ && prefix_cache_->evict(block_num);
+}
+
+bool Model::reserve_kv_cache(int32_t slot, int32_t begin_pos, int32_t end_pos) const {
+  CHECK(kv_cache_ != nullptr);
+  // both caches of a split model have the same blocks and take them in the same order, so the
+  // blocks are reserved in both of them or in neither
+  if (host_kv_cache_) {
+    const int32_t reserved_token_num = kv_cache_->reserved_token_num(slot);
+    CHECK_EQ(reserved_token_num, host_kv_cache_->reserved_token_num(slot));
+    if (kv_cache_->reserve(slot, end_pos) && host_kv_cache_->reserve(slot, end_pos) &&
+        kv_cache_->make_writable(slot, begin_pos, end_pos, cuda_stream()) &&
+        host_kv_cache_->make_writable(slot, begin_pos, end_pos)) {
+      return true;
+    }
+    // the blocks go back in the reverse order they were taken, the free lists match again
+    kv_cache_->truncate(slot, reserved_token_num);
+    host_kv_cache_->truncate(slot, reserved_token_num);
+    return false;
+  }
+  if (kv_cache_->reserve(slot, end_pos) &&
+      kv_cache_->make_writable(slot, begin_pos, end_pos, cuda_stream())) {
+    return true;
+  }
+  if (!prefix_cache_) {
+    return false;
+  }
+  const int32_t block_size = kv_cache_->block_size();
+  int32_t need_block_num =
+      (end_pos + block_size - 1) / block_size - kv_cache_->reserved_token_num(slot) / block_size;
+  need_block_num = std::max(need_block_num, 0) +
+                   kv_cache_->shared_block_num(slot, begin_pos, end_pos);
+  return prefix_cache_->evict(need_block_num) && kv_cache_->reserve(slot, end_pos) &&
+         kv_cache_->make_writable(slot, begin_pos, end_pos, cuda_stream());
+}
+
+void Model::set_cuda_graph(bool use_cuda_graph) {
+  use_cuda_graph_ = use_cuda_graph;
+  if (use_cuda_graph) {
+    cuda_graph_ = std::make_unique<kernel::CudaGraph>();
+  } else {
+    cuda_graph_.reset();
+  }
+}
+
+void Model::set_sampler(std::unique_ptr<sampler::Sampler> sampler) {
+  CHECK(sampler != nullptr);
+  sampler_ = std::move(sampler);
+  // the captured graph holds the launch of the previous sampler
+  if (cuda_graph_) {
+    cuda_graph_->reset();
+  }
+  device_graph_->reset();
+}
+
+void Model::set_lora_pool(int32_t adapter_num, int32_t max_rank,
+                          const std::vector<std::string>& target_modules) {
+  CHECK(buffers_.empty()) << "The lora pool should be set before the model is initialized.";
+  lora_pool_ = std::make_unique<LoraPool>(adapter_num, max_rank, target_modules);
+}
+
+base::Status Model::load_lora_adapter(const std::string& path, int32_t& adapter_id) {
+  if (!lora_pool_) {
+    return base::error::InvalidArgument("The model has no lora pool.");
+  }
+  return lora_pool_->load(path, adapter_id);
+}
+
+base::Status Model::unload_lora_adapter(int32_t adapter_id) {
+  if (!lora_pool_) {
+    return base::error::InvalidArgument("The model has no lora pool.");
+  }
+  if (std::find(slot_adapters_.begin(), slot_adapters_.end(), adapter_id) !=
+      slot_adapters_.end()) {
+    return base::error::InvalidArgument("The lora adapter " + std::to_string(adapter_id) +
+                                        " is still run by a sequence slot.");
+  }
+  return lora_pool_->unload(adapter_id);
+}
+
+base::Status Model::set_slot_adapter(int32_t slot, int32_t adapter_id) {
+  if (!lora_pool_) {
+    return base::error::InvalidArgument("The model has no lora pool.");
+  }
+  if (slot < 0 || slot >= max_batch_size_) {
+    return base::error::InvalidArgument("The sequence slot " + std::to_string(slot) +
+                                        " is out of range.");
+  }
+  if (adapter_id >= 0 && !lora_pool_->is_loaded(adapter_id)) {
+    return base::error::InvalidArgument("The lora adapter " + std::to_string(adapter_id) +
+                                        " is not loaded.");
+  }
+  slot_adapters_.resize(max_batch_size_, -1);
+  slot_adapters_.at(slot) = adapter_id < 0 ? -1 : adapter_id;
+  return base::error::Success();
+}
+
+int32_t Model::slot_adapter(int32_t slot) const {
+  return slot >= 0 && slot < slot_adapters_.size() ? slot_adapters_.at(slot) : -1;
+}
+
+base::Status Model::bind_lora_rows(const std::vector<int32_t>& slots, bool keep_rows,
+                                   void* stream) const {
+  if (!lora_pool_) {
+    return base::error::Success();
+  }
+  std::vector<int32_t> row_adapters;
+  row_adapters.reserve(slots.size());
+  for (int32_t slot : slots) {
+    row_adapters.push_back(slot_adapter(slot));
+  }
+  return lora_pool_->bind(row_adapters, keep_rows, stream);
+}
+
+void Model::set_fused_sampling(bool use_fused_sampling) {
+  use_fused_sampling_ = use_fused_sampling;
+  // the captured graphs hold the classifier and the sample of the other path
+  if (cuda_graph_) {
+    cuda_graph_->reset();
+  }
+  device_graph_->reset();
+}
+
+// the classifier of the plan when its weight can be read by the fused classifier
+static const op::MatmulLayer* fusable_classifier(const ExecutionPlan& plan) {
+  if (plan.steps.empty() || plan.steps.back().op != GraphOp::kClassifier) {
+    return nullptr;
+  }
+  auto matmul = dynamic_cast<const op::MatmulLayer*>(plan.steps.back().layer);
+  if (!matmul || matmul->is_int4() || matmul->is_fp8() || matmul->has_bias() ||
+      matmul->has_input_order()) {
+    return nullptr;
+  }
+  const tensor::Tensor& weight = matmul->get_weight(0);
+  const base::DataType data_type = weight.data_type();
+  const bool is_float = data_type == base::DataType::kDataTypeFp32 ||
+                        data_type == base::DataType::kDataTypeFp16 ||
+                        data_type == base::DataType::kDataTypeBf16;
+  return is_float && weight.device_type() == base::DeviceType::kDeviceCUDA ? matmul : nullptr;
+}
+
+int32_t Model::fused_candidate_num() const {
+  // the split and the sharded models hold the classifier or its logits on another device
+  if (!use_fused_sampling_ || device_type_ != base::DeviceType::kDeviceCUDA || !sampler_ ||
+      tensor_parallel_ || is_layer_split() || execution_plan_.megakernel_step_num > 0 ||
+      !fusable_classifier(execution_plan_)) {
+    return 0;
+  }
+  const int32_t k = sampler_->candidate_num();
+  return k > 0 && k <= kernel::kClsTopKMaxNum && k <= config_->vocab_size_ ? k : 0;
+}
+
+void Model::classify(const tensor::Tensor& input, void* stream) const {
+  const int32_t k = fused_candidate_num();
+  if (k == 0) {
+    CHECK(!execution_plan_.steps.empty());
+    STATUS_CHECK(execution_plan_.steps.back().layer->forward(
+        input, get_buffer(ModelBufferType::kForwardOutput)));
+    return;
+  }
+  const tensor::Tensor& candidates = get_buffer(ModelBufferType::kClsCandidatesCUDA);
+  const tensor::Tensor& tokens = get_buffer(ModelBufferType::kClsCandidateTokensCUDA);
+  const tensor::Tensor& workspace = get_buffer(ModelBufferType::kClsWorkspaceCUDA);
+  kernel::cls_topk_kernel_cu(input, fusable_classifier(execution_plan_)->get_weight(0), k,
+                             const_cast<float*>(candidates.ptr<float>()),
+                             const_cast<int32_t*>(tokens.ptr<int32_t>()),
+                             const_cast<float*>(workspace.ptr<float>()), stream);
+}
+
+bool Model::sample_device(int32_t* output_idx, void* stream) const {
+  if (fused_candidate_num() == 0) {
+    const tensor::Tensor& forward_output = get_buffer(ModelBufferType::kForwardOutput);
+    return sampler_->sample_device(forward_output.ptr<float>(), forward_output.size(),
+                                   output_idx, stream);
+  }
+  return sampler_->sample_candidates_device(
+      get_buffer(ModelBufferType::kClsCandidatesCUDA).ptr<float>(),
+      get_buffer(ModelBufferType::kClsCandidateTokensCUDA).ptr<int32_t>(), output_idx, stream);
+}
+
+void Model::select_sampler_slot(int32_t slot, const tensor::Tensor& pos_tensor) const {
+  if (pos_tensor.device_type() == base::DeviceType::kDeviceCPU &&
+      pos_tensor.index<int32_t>(0) == 0) {
+    sampler_->begin_sequence(slot, cuda_stream());
+  } else {
+    sampler_->set_slot(slot);
+  }
+}
+
+int32_t Model::sample(void* stream) const {
+  if (fused_candidate_num() == 0) {
+    const tensor::Tensor& forward_output = get_buffer(ModelBufferType::kForwardOutput);
+    return static_cast<int32_t>(
+        sampler_->sample(forward_output.ptr<float>(), forward_output.size(), stream));
+  }
+  const tensor::Tensor& index_cu = get_buffer(ModelBufferType::kOutputIndexCUDA);
+  CHECK(sample_device(const_cast<int32_t*>(index_cu.ptr<int32_t>()), stream));
+  int32_t next = 0;
+  cudaStream_t cuda_stream = static_cast<cudaStream_t>(stream);
+  cudaMemcpyAsync(&next, index_cu.ptr<int32_t>(), sizeof(int32_t), cudaMemcpyDeviceToHost,
+                  cuda_stream);
+  cudaStreamSynchronize(cuda_stream);
+  return next;
+}
+
+base::Status Model::forward_cuda_graph(const tensor::Tensor& input,
+                                       const tensor::Tensor& pos_tensor, bool is_prompt,
+                                       kernel::CudaConfig* cuda_config, int& next) const {
+  CHECK(cuda_graph_ != nullptr);
+  CHECK(cuda_config != nullptr);
+  if (tensor_parallel_) {
+    return base::error::InternalError("The cuda graphs do not capture the tensor parallel sums.");
+  }
+  if (input.is_empty()) {
+    return base::error::InvalidArgument("The input tensor is empty.");
+  }
+  // the blocks are reserved on the host, the graph only reads the block table
+  const int32_t pos = pos_tensor.index<int32_t>(0);
+  if (!reserve_kv_cache(0, pos, pos + 1)) {
+    return base::error::InternalError("There are no free blocks left in the kv cache.");
+  }
+
+  cudaStream_t stream = cuda_config->stream;
+  // the graph reads the adapter of slot 0 from the bound rows at every replay
+  base::Status lora_status = bind_lora_rows({0}, true, stream);
+  if (!lora_status) {
+    return lora_status;
+  }
+  const tensor::Tensor& pos_cu = get_buffer(ModelBufferType::kInputPosCUDA);
+  const tensor::Tensor& index_cu = get_buffer(ModelBufferType::kOutputIndexCUDA);
+  cudaMemcpyAsync(const_cast<int32_t*>(pos_cu.ptr<int32_t>()), pos_tensor.ptr<int32_t>(),
+                  sizeof(int32_t), cudaMemcpyHostToDevice, stream);
+
+  if (!cuda_graph_->graph_exec || cuda_graph_->input_ptr != input.ptr<float>()) {
+    cuda_graph_->reset();
+    // every kernel of the step reads the position from pos_cu
+    cudaStreamBeginCapture(stream, cudaStreamCaptureModeThreadLocal);
+    int unused = -1;
+    base::Status status = forward(input, pos_cu, unused);
+    if (status && !sample_device(const_cast<int32_t*>(index_cu.ptr<int32_t>()), stream)) {
+      status = base::error::InternalError("The sampler can not run in a cuda graph.");
+    }
+    cudaError_t err = cudaStreamEndCapture(stream, &cuda_graph_->graph);
+    if (!status) {
+      cuda_graph_->reset();
+      return status;
+    }
+    if (err != cudaSuccess ||
+        cudaGraphInstantiateWithFlags(&cuda_graph_->graph_exec, cuda_graph_->graph, 0) !=
+            cudaSuccess) {
+      cuda_graph_->reset();
+      return base::error::InternalError("The cuda graph of the decode step capture failed.");
+    }
+    cuda_graph_->input_ptr = input.ptr<float>();
+  }
+
+  if (cudaGraphLaunch(cuda_graph_->graph_exec, stream) != cudaSuccess) {
+    return base::error::InternalError("The cuda graph of the decode step launch failed.");
+  }
+  if (is_prompt) {
+    next = -1;
+    return base::error::Success();
+  }
+  int32_t index = 0;
+  cudaMemcpyAsync(&index, index_cu.ptr<int32_t>(), sizeof(int32_t), cudaMemcpyDeviceToHost,
+                  stream);
+  cudaStreamSynchronize(stream);
+  next = index;
+  return base::error::Success();
+}
+
+base::Status Model::start_device_decode(int32_t token, int32_t pos,
+                                        kernel::CudaConfig* cuda_config) const {
+  if (device_type_ != base::DeviceType::kDeviceCUDA) {
+    return base::error::InvalidArgument("The decode on the device needs the cuda device.");
+  }
+  if (tensor_parallel_) {
+    return base::error::InvalidArgument("The decode on the device has no tensor parallel.");
+  }
+  if (!decode_queue_->launches.empty()) {
+    return base::error::InvalidArgument("The launched decode steps are not waited for.");
+  }
+  CHECK(cuda_config != nullptr);
+  if (pos < 0 || pos >= max_position()) {
+    return base::error::InvalidArgument("The position of the decode is out of the sequence.");
+  }
+  // the only host writes of the decode, every later step reads them from the device
+  cudaStream_t stream = cuda_config->stream;
+  base::Status lora_status = bind_lora_rows({0}, true, stream);
+  if (!lora_status) {
+    return lora_status;
+  }
+  const tensor::Tensor& token_cu = get_buffer(ModelBufferType::kInputTokensCUDA);
+  const tensor::Tensor& pos_cu = get_buffer(ModelBufferType::kInputPosCUDA);
+  cudaMemcpyAsync(const_cast<int32_t*>(token_cu.ptr<int32_t>()), &token, sizeof(int32_t),
+                  cudaMemcpyHostToDevice, stream);
+  cudaMemcpyAsync(const_cast<int32_t*>(pos_cu.ptr<int32_t>()), &pos, sizeof(int32_t),
+                  cudaMemcpyHostToDevice, stream);
+  // the stop table and a running stop state, the sampled tokens start after pos
+  const tensor::Tensor& stop_table_cu = get_buffer(ModelBufferType::kStopTableCUDA);
+  const tensor::Tensor& stop_state_cu = get_buffer(ModelBufferType::kStopStateCUDA);
+  std::vector<int32_t> stop_table = device_stop_table_;
+  stop_table.resize(stop_table_cu.size(), 0);
+  std::vector<int32_t> stop_state(kernel::kStopStateSize, 0);
+  stop_state[kernel::kStopRemaining] = device_max_new_tokens_;
+  stop_state[kernel::kStopBegin] = pos + 1;
+  stop_state[kernel::kStopPos] = -1;
+  cudaMemcpyAsync(const_cast<int32_t*>(stop_table_cu.ptr<int32_t>()), stop_table.data(),
+                  stop_table.size() * sizeof(int32_t), cudaMemcpyHostToDevice, stream);
+  cudaMemcpyAsync(const_cast<int32_t*>(stop_state_cu.ptr<int32_t>()), stop_state.data(),
+                  stop_state.size() * sizeof(int32_t), cudaMemcpyHostToDevice, stream);
+  // the source of the copies is on the stack
+  cudaStreamSynchronize(stream);
+  const tensor::Tensor& stop_state_cpu = get_buffer(ModelBufferType::kStopStateCPU);
+  std::copy(stop_state.begin(), stop_state.end(),
+            const_cast<int32_t*>(stop_state_cpu.ptr<int32_t>()));
+  device_pos_ = pos;
+  device_stop_reason_ = DeviceStopReason::kRunning;
+  return base::error::Success();
+}
+
+base::Status Model::launch_device_graph(int32_t step_num,
+                                        kernel::CudaConfig* cuda_config) const {
+  if (device_pos_ < 0) {
+    return base::error::InvalidArgument("The decode on the device is not started.");
+  }
+  CHECK(cuda_config != nullptr);
+  if (step_num <= 0) {
+    return base::error::InvalidArgument("The step number of the decode has to be positive.");
+  }
+  // the token sampled at the last position has no place in the sequence
+  if (device_pos_ + step_num >= max_position()) {
+    return base::error::InvalidArgument("The decode steps run past the sequence length.");
+  }
+  // the sampled tokens are kept in a ring of the token buffers, which has to hold the tokens of
+  // all the launches which are not waited for
+  const tensor::Tensor& tokens_cpu = get_buffer(ModelBufferType::kOutputTokensCPU);
+  const auto ring_size = static_cast<int32_t>(tokens_cpu.size());
+  int32_t pending_step_num = step_num;
+  for (const auto& pending : decode_queue_->launches) {
+    pending_step_num += pending.step_num;
+  }
+  if (pending_step_num > ring_size) {
+    return base::error::InvalidArgument("The launched decode steps overflow the token buffer.");
+  }
+  // the blocks of all the steps are reserved up front, the graph only reads the block table
+  if (!reserve_kv_cache(0, device_pos_, device_pos_ + step_num)) {
+    return base::error::InternalError("There are no free blocks left in the kv cache.");
+  }
+
+  cudaStream_t stream = cuda_config->stream;
+  const tensor::Tensor& token_cu = get_buffer(ModelBufferType::kInputTokensCUDA);
+  const tensor::Tensor& embedding_cu = get_buffer(ModelBufferType::kInputEmbeddingCUDA);
+  const tensor::Tensor& pos_cu = get_buffer(ModelBufferType::kInputPosCUDA);
+  const tensor::Tensor& tokens_cu = get_buffer(ModelBufferType::kOutputTokensCUDA);
+  if (!device_graph_->graph_exec) {
+    // the sampler writes the next token over the input of the step, so the replays chain
+    cudaStreamBeginCapture(stream, cudaStreamCaptureModeThreadLocal);
+    base::Status status = embedding_device(token_cu, embedding_cu);
+    tensor::Tensor input = embedding_cu;
+    input.reshape({config_->dim_});
+    int unused = -1;
+    if (status) {
+      status = forward(input, pos_cu, unused);
+    }
+    if (status && !sample_device(const_cast<int32_t*>(token_cu.ptr<int32_t>()), stream)) {
+      status = base::error::InternalError("The sampler can not run in a cuda graph.");
+    }
+    if (status) {
+      kernel::advance_token_stop_kernel_cu(token_cu, pos_cu, tokens_cu,
+                                           get_buffer(ModelBufferType::kStopTableCUDA),
+                                           get_buffer(ModelBufferType::kStopStateCUDA), stream);
+    }
+    cudaError_t err = cudaStreamEndCapture(stream, &device_graph_->graph);
+    if (!status) {
+      device_graph_->reset();
+      return status;
+    }
+    if (err != cudaSuccess ||
+        cudaGraphInstantiateWithFlags(&device_graph_->graph_exec, device_graph_->graph, 0) !=
+            cudaSuccess) {
+      device_graph_->reset();
+      return base::error::InternalError("The cuda graph of the device decode capture failed.");
+    }
+  }
+
+  for (int32_t step = 0; step < step_num; ++step) {
+    if (cudaGraphLaunch(device_graph_->graph_exec, stream) != cudaSuccess) {
+      return base::error::InternalError("The cuda graph of the device decode launch failed.");
+    }
+  }
+  // one copy for all the steps, the event marks it done without a sync of the stream
+  kernel::CudaDecodeQueue::Launch launch;
+  launch.begin_pos = device_pos_ + 1;
+  launch.step_num = step_num;
+  if (cudaEventCreateWithFlags(&launch.done, cudaEventDisableTiming) != cudaSuccess) {
+    return base::error::InternalError("The event of the device decode create failed.");
+  }
+  // the tokens wrap around the end of the ring in at most two copies
+  for (int32_t copied = 0; copied < step_num;) {
+    const int32_t offset = (launch.begin_pos + copied) % ring_size;
+    const int32_t copy_num = std::min(step_num - copied, ring_size - offset);
+    cudaMemcpyAsync(const_cast<int32_t*>(tokens_cpu.ptr<int32_t>(offset)),
+                    tokens_cu.ptr<int32_t>(offset), copy_num * sizeof(int32_t),
+                    cudaMemcpyDeviceToHost, stream);
+    copied += copy_num;
+  }
+  // the state tells the wait which of the tokens come after a stop
+  const tensor::Tensor& stop_state_cu = get_buffer(ModelBufferType::kStopStateCUDA);
+  const tensor::Tensor& stop_state_cpu = get_buffer(ModelBufferType::kStopStateCPU);
+  cudaMemcpyAsync(const_cast<int32_t*>(stop_state_cpu.ptr<int32_t>()), stop_state_cu.ptr<int32_t>(),
+                  kernel::kStopStateSize * sizeof(int32_t), cudaMemcpyDeviceToHost, stream);
+  cudaEventRecord(launch.done, stream);
+  decode_queue_->launches.push_back(launch);
+  device_pos_ += step_num;
+  return base::error::Success();
+}
+
+base::Status Model::decode_device(int32_t step_num, std::vector<int32_t>& tokens) const {
+  auto status = launch_device_decode(step_num);
+  if (!status) {
+    return status;
+  }
+  while (status && !decode_queue_->launches.empty()) {
+    status = wait_device_decode(tokens);
+  }
+  return status;
+}
+
+base::Status Model::wait_device_decode(std::vector<int32_t>& tokens) const {
+  if (decode_queue_->launches.empty()) {
+    return base::error::InvalidArgument("There are no launched decode steps to wait for.");
+  }
+  const kernel::CudaDecodeQueue::Launch launch = decode_queue_->launches.front();
+  decode_queue_->launches.pop_front();
+  const cudaError_t err = cudaEventSynchronize(launch.done);
+  cudaEventDestroy(launch.done);
+  if (err != cudaSuccess) {
+    return base::error::InternalError("The launched decode steps failed.");
+  }
+  // a later launch may have written the state already, it only moves from running to a stop
+  const int32_t* stop_state = get_buffer(ModelBufferType::kStopStateCPU).ptr<int32_t>();
+  int32_t token_num = launch.step_num;
+  const int32_t stop_pos = stop_state[kernel::kStopPos];
+  if (stop_state[kernel::kStopReason] != 0 && stop_pos < launch.begin_pos + launch.step_num) {
+    token_num = std::max(stop_pos - launch.begin_pos + 1, 0);
+    if (device_stop_reason_ == DeviceStopReason::kRunning) {
+      device_stop_reason_ = static_cast<DeviceStopReason>(stop_state[kernel::kStopReason]);
+      // the steps behind the stop keep the position on the device
+      device_pos_ = stop_pos;
+    }
+  }
+  const tensor::Tensor& tokens_cpu = get_buffer(ModelBufferType::kOutputTokensCPU);
+  const auto ring_size = static_cast<int32_t>(tokens_cpu.size());
+  for (int32_t copied = 0; copied < token_num;) {
+    const int32_t offset = (launch.begin_pos + copied) % ring_size;
+    const int32_t copy_num = std::min(token_num - copied, ring_size - offset);
+    const int32_t* ring = tokens_cpu.ptr<int32_t>(offset);
+    tokens.insert(tokens.end(), ring, ring + copy_num);
+    copied += copy_num;
+  }
+  return base::error::Success();
+}
+
+int32_t Model::pending_device_decode_num() const {
+  return static_cast<int32_t>(decode_queue_->launches.size());
+}
+
+base::Status Model::set_device_stop(const std::vector<std::vector<int32_t>>& stop_sequences,
+                                    int32_t max_new_tokens) {
+  if (stop_sequences.size() > static_cast<size_t>(kernel::kMaxStopSequenceNum)) {
+    return base::error::InvalidArgument("There are too many stop sequences for the device.");
+  }
+  if (max_new_tokens == 0 || max_new_tokens < -1) {
+    return base::error::InvalidArgument("The token limit of the decode has to be positive.");
+  }
+  std::vector<int32_t> stop_table;
+  stop_table.reserve(stop_sequences.size() * kernel::kStopSequenceWidth);
+  for (const std::vector<int32_t>& stop_sequence : stop_sequences) {
+    if (stop_sequence.empty() ||
+        stop_sequence.size() > static_cast<size_t>(kernel::kMaxStopSequenceLen)) {
+      return base::error::InvalidArgument("The length of a stop sequence is out of range.");
+    }
+    stop_table.push_back(static_cast<int32_t>(stop_sequence.size()));
+    stop_table.insert(stop_table.end(), stop_sequence.begin(), stop_sequence.end());
+    stop_table.resize(stop_table.size() + kernel::kMaxStopSequenceLen - stop_sequence.size(), 0);
+  }
+  device_stop_table_ = std::move(stop_table);
+  device_max_new_tokens_ = max_new_tokens;
+  return base::error::Success();
+}
+
+DeviceStopReason Model::device_stop_reason() const { return device_stop_reason_; }
+
+void Model::init_kv_cache() {
+  int32_t block_num = kv_block_num_;
+  if (block_num == 0) {
+    // enough blocks for every slot to reach the max sequence length, or to fill its window
+    const int32_t slot_len = attention_window_.is_enabled()
+                                 ? std::min(attention_window_.capacity(), config_->seq_len_)
+                                 : config_->seq_len_;
+    block_num = max_batch_size_ * ((slot_len + kv_block_size_ - 1) / kv_block_size_);
+  }
+  kv_cache_ = std::make_unique<PagedKVCache>(device_type_, kv_data_type_, host_layer_begin(),
+                                             config_->kv_dim_, kv_block_size_, block_num,
+                                             max_batch_size_, config_->seq_len_,
+                                             config_->head_size_, is_kv_head_major_,
+                                             kv_chunk_block_num_);
+  kv_cache_->set_window(attention_window_);
+  CHECK(insert_buffer(ModelBufferType::kKeyCache, kv_cache_->key_cache()));
+  CHECK(insert_buffer(ModelBufferType::kValueCache, kv_cache_->value_cache()));
+  if (is_layer_split()) {
+    // the cpu keeps the int8 cache and stores the 16 bit caches in fp32
+    const base::DataType host_data_type = kv_data_type_ == base::DataType::kDataTypeInt8
+                                              ? base::DataType::kDataTypeInt8
+                                              : base::DataType::kDataTypeFp32;
+    host_kv_cache_ = std::make_unique<PagedKVCache>(
+        base::DeviceType::kDeviceCPU, host_data_type, config_->layer_num_ - host_layer_begin(),
+        config_->kv_dim_, kv_block_size_, block_num, max_batch_size_, config_->seq_len_,
+        config_->head_size_, false, kv_chunk_block_num_);
+    host_kv_cache_->set_window(attention_window_);
+    CHECK(insert_host_buffer(ModelBufferType::kKeyCache, host_kv_cache_->key_cache()));
+    CHECK(insert_host_buffer(ModelBufferType::kValueCache, host_kv_cache_->value_cache()));
+  }
+}
+
+int32_t Model::host_layer_begin() const {
+  CHECK(config_ != nullptr);
+  if (device_type_ != base::DeviceType::kDeviceCUDA || gpu_layer_num_ < 0 ||
+      gpu_layer_num_ >= config_->layer_num_) {
+    return config_->layer_num_;
+  }
+  return gpu_layer_num_;
+}
+
+bool Model::is_layer_split() const { return host_layer_begin() < config_->layer_num_; }
+
+bool Model::is_tensor_parallel() const { return tensor_parallel_ != nullptr; }
+
+bool Model::is_unified_memory() const {
+  return device_type_ == base::DeviceType::kDeviceCUDA && weight_load_options_.unified_memory;
+}
+
+bool Model::is_host_layer(int32_t layer_idx) const { return layer_idx >= host_layer_begin(); }
+
+base::DeviceType Model::layer_device_type(int32_t layer_idx) const {
+  return is_host_layer(layer_idx) ? base::DeviceType::kDeviceCPU : device_type_;
+}
+
+const PagedKVCache& Model::layer_kv_cache(int32_t layer_idx) const {
+  if (is_host_layer(layer_idx)) {
+    CHECK(host_kv_cache_ != nullptr);
+    return *host_kv_cache_;
+  }
+  CHECK(kv_cache_ != nullptr);
+  return *kv_cache_;
+}
+
+int32_t Model::kv_layer_idx(int32_t layer_idx) const {
+  return is_host_layer(layer_idx) ? layer_idx - host_layer_begin() : layer_idx;
+}
+
+const tensor::Tensor& Model::layer_buffer(int32_t layer_idx, ModelBufferType buffer_idx) const {
+  if (!is_host_layer(layer_idx)) {
+    return get_buffer(buffer_idx);
+  }
+  CHECK_GT(host_buffers_.count(buffer_idx), 0) << int(buffer_idx);
+  return host_buffers_.at(buffer_idx);
+}
+
+const tensor::Tensor* Model::find_layer_buffer(int32_t layer_idx,
+                                               ModelBufferType buffer_idx) const {
+  const auto& buffers = is_host_layer(layer_idx) ? host_buffers_ : buffers_;
+  auto iter = buffers.find(buffer_idx);
+  return iter == buffers.end() ? nullptr : &iter->second;
+}
+
+base::Status Model::lower_graph_node(const GraphNode& node, const DecoderLayers& layers,
+                                     PlanStep& step) const {
+  using BT = ModelBufferType;
+  const int32_t idx = node.layer_idx;
+  const int32_t layer_num = config_->layer_num_;
+  const int32_t device = node.is_host ? 1 : 0;
+  auto buffer = [&](int32_t layer_idx, BT buffer_idx) {
+    return find_layer_buffer(layer_idx, buffer_idx);
+  };
+  auto at = [](const std::vector<op::Layer*>& layer_vec, int32_t layer_idx) -> op::Layer* {
+    return layer_idx < layer_vec.size() ? layer_vec.at(layer_idx) : nullptr;
+  };
+  step.op = node.op;
+  step.layer_idx = idx;
+  if (idx < layer_num) {
+    step.kv_cache = &layer_kv_cache(idx);
+    step.kv_layer_idx = kv_layer_idx(idx);
+    step.query = buffer(idx, BT::kQuery);
+    step.key = buffer(idx, BT::kKeyOutput);
+    step.value = buffer(idx, BT::kValueOutput);
+    step.sin_cache = buffer(idx, BT::kSinCache);
+    step.cos_cache = buffer(idx, BT::kCosCache);
+  }
+  switch (node.op) {
+    case GraphOp::kMoveToHost:
+      step.output = buffer(idx, BT::kHiddenStateCPU);
+      return step.output ? base::error::Success()
+                         : base::error::InternalError("The split model has no host hidden state.");
+    case GraphOp::kAttentionNorm:
+      step.layer = at(layers.rmsnorm_layers, idx);
+      step.output = buffer(idx, BT::kOutputRMSNorm);
+      break;
+    case GraphOp::kQuery:
+      step.layer = at(layers.wq_layers, idx);
+      step.input = buffer(idx, BT::kOutputRMSNorm);
+      step.output = step.query;
+      break;
+    case GraphOp::kKey:
+      step.layer = at(layers.wk_layers, idx);
+      step.input = buffer(idx, BT::kOutputRMSNorm);
+      step.output = step.key;
+      break;
+    case GraphOp::kValue:
+      step.layer = at(layers.wv_layers, idx);
+      step.input = buffer(idx, BT::kOutputRMSNorm);
+      step.output = step.value;
+      break;
+    case GraphOp::kQKV:
+      step.layer = at(layers.wqkv_layers, idx);
+      step.input = buffer(idx, BT::kOutputRMSNorm);
+      step.output = buffer(idx, BT::kQKVOutput);
+      break;
+    case GraphOp::kRope:
+      step.layer = layers.rope_layer[device];
+      break;
+    case GraphOp::kKVWrite:
+    case GraphOp::kRopeKVWrite:
+      return base::error::Success();
+    case GraphOp::kAttention:
+      step.layer = layers.mha_layer[device];
+      step.mha = dynamic_cast<op::MultiHeadAttention*>(step.layer);
+      step.block_table = step.kv_cache->block_table(0);
+      step.key_cache = buffer(idx, BT::kKeyCache);
+      step.value_cache = buffer(idx, BT::kValueCache);
+      step.score_storage = buffer(idx, BT::kScoreStorage);
+      step.input = step.query;
+      step.output = buffer(idx, BT::kOutputMHA);
+      if (!step.mha || !step.key_cache || !step.value_cache || !step.score_storage) {
+        return base::error::InternalError("The attention of the layer " + std::to_string(idx) +
+                                          " misses its operands.");
+      }
+      break;
+    case GraphOp::kAttentionOutput:
+      step.layer = at(layers.wo_layers, idx);
+      step.input = buffer(idx, BT::kOutputMHA);
+      step.output = buffer(idx, BT::kAttnOutput);
+      break;
+    case GraphOp::kAttentionAllReduce:
+      step.output = buffer(idx, BT::kAttnOutput);
+      return base::error::Success();
+    case GraphOp::kAttentionResidual:
+      step.layer = layers.add_layer[device];
+      step.input = buffer(idx, BT::kAttnOutput);
+      break;
+    case GraphOp::kFFNNorm:
+      step.layer = at(layers.rmsnorm_layers, idx + layer_num);
+      step.output = buffer(idx, BT::kFFNRMSNorm);
+      break;
+    case GraphOp::kAttentionResidualNorm:
+      step.layer = at(layers.rmsnorm_layers, idx + layer_num);
+      step.rmsnorm = dynamic_cast<op::RmsNormLayer*>(step.layer);
+      step.input = buffer(idx, BT::kAttnOutput);
+      step.output = buffer(idx, BT::kFFNRMSNorm);
+      break;
+    case GraphOp::kGate:
+      step.layer = at(layers.w1_layers, idx);
+      step.input = buffer(idx, BT::kFFNRMSNorm);
+      step.output = buffer(idx, BT::kW1Output);
+      break;
+    case GraphOp::kUp:
+      step.layer = at(layers.w3_layers, idx);
+      step.input = buffer(idx, BT::kFFNRMSNorm);
+      step.output = buffer(idx, BT::kW3Output);
+      break;
+    case GraphOp::kSwiGLU:
+      step.layer = layers.swiglu_layer[device];
+      step.input = buffer(idx, BT::kW1Output);
+      step.input2 = buffer(idx, BT::kW3Output);
+      step.output = step.input;
+      break;
+    case GraphOp::kGateUpSwiGLU:
+      step.layer = at(layers.w13_layers, idx);
+      step.input = buffer(idx, BT::kFFNRMSNorm);
+      step.output = buffer(idx, BT::kW1Output);
+      break;
+    case GraphOp::kDown:
+      step.layer = at(layers.w2_layers, idx);
+      step.input = buffer(idx, BT::kW1Output);
+      step.output = buffer(idx, BT::kW2Output);
+      break;
+    case GraphOp::kFFNAllReduce:
+      step.output = buffer(idx, BT::kW2Output);
+      return base::error::Success();
+    case GraphOp::kFFNResidual:
+      step.layer = layers.add_layer[device];
+      step.input = buffer(idx, BT::kW2Output);
+      break;
+    case GraphOp::kFFNResidualNorm:
+      step.layer = at(layers.rmsnorm_layers, idx + 1);
+      step.rmsnorm = dynamic_cast<op::RmsNormLayer*>(step.layer);
+      step.input = buffer(idx, BT::kW2Output);
+      step.output = buffer(idx + 1, BT::kOutputRMSNorm);
+      break;
+    case GraphOp::kFinalNorm:
+      step.layer = at(layers.rmsnorm_layers, 2 * layer_num);
+      return step.layer ? base::error::Success()
+                        : base::error::InternalError("The final norm layer is null pointer.");
+    case GraphOp::kClassifier:
+      step.layer = layers.cls_layer;
+      step.output = &get_buffer(BT::kForwardOutput);
+      return step.layer ? base::error::Success()
+                        : base::error::InternalError("The cls layer is null pointer.");
+    default:
+      // the bias ops are folded into the matmuls by the fusion pass
+      return base::error::InternalError("The graph op " + std::to_string(int(node.op)) +
+                                        " has no kernel, it has to be fused.");
+  }
+  const bool is_fused_norm = node.op == GraphOp::kAttentionResidualNorm ||
+                             node.op == GraphOp::kFFNResidualNorm;
+  const bool reads_hidden = node.op == GraphOp::kAttentionNorm || node.op == GraphOp::kFFNNorm ||
+                            node.op == GraphOp::kRope;
+  if (!step.layer || (is_fused_norm && !step.rmsnorm) || (!step.input && !reads_hidden) ||
+      (!step.output && node.op != GraphOp::kRope && node.op != GraphOp::kAttentionResidual &&
+       node.op != GraphOp::kFFNResidual)) {
+    return base::error::InternalError("The graph op " + std::to_string(int(node.op)) +
+                                      " of the layer " + std::to_string(idx) +
+                                      " misses its layer or its buffers.");
+  }
+  return base::error::Success();
+}
+
+base::Status Model::build_decoder_plan(const DecoderLayers& layers, bool has_qkv_bias) {
+  DecoderGraph graph = DecoderGraph::build(*config_, host_layer_begin(), has_qkv_bias,
+                                           tensor_parallel_ != nullptr);
+  FusionOptions options;
+  auto all_of = [](const std::vector<op::Layer*>& layer_vec) {
+    return !layer_vec.empty() &&
+           std::all_of(layer_vec.begin(), layer_vec.end(), [](op::Layer* l) { return l; });
+  };
+  options.pack_qkv = all_of(layers.wqkv_layers);
+  options.gate_up_swiglu = all_of(layers.w13_layers);
+  if (lora_pool_) {
+    if (use_megakernel_ || is_layer_split() || tensor_parallel_) {
+      return base::error::InvalidArgument(
+          "The lora adapters need all the layers of the model on one device without the "
+          "megakernel.");
+    }
+    base::Status status = lora_pool_->attach(layers, config_->head_size_,
+                                             config_->is_rope_rotate_half_, max_batch_size_,
+                                             device_type_);
+    if (!status) {
+      return status;
+    }
+    // the low rank update follows every projection, the swiglu of the fused w13 would come
+    // before it
+    options.pack_qkv = false;
+    options.gate_up_swiglu = false;
+  }
+  // the megakernel runs the norms, the rope and the cache write as phases of their own
+  options.add_rmsnorm = !use_megakernel_;
+  options.rope_kv_write = !use_megakernel_ && kv_cache_ && kv_cache_->is_rope_fused();
+  options.host_rope_kv_write = host_kv_cache_ && host_kv_cache_->is_rope_fused();
+  graph.fuse(options);
 
-const std::string& Model::token_path() const { return token_path_; }
+  execution_plan_.steps.clear();
+  int32_t last_layer_idx = -1;
+  for (const GraphNode& node : graph.nodes()) {
+    PlanStep step;
+    auto status = lower_graph_node(node, layers, step);
+    if (!status) {
+      return status;
+    }
+    step.begins_layer = node.layer_idx != last_layer_idx && node.layer_idx < config_->layer_num_;
+    step.is_host = node.is_host;
+    last_layer_idx = node.layer_idx;
+    execution_plan_.steps.push_back(std::move(step));
+  }
+  LOG(INFO) << "The decode step runs " << execution_plan_.steps.size() << " fused graph ops";
+  auto status = check_execution_plan();
+  if (!status || !use_megakernel_) {
+    return status;
+  }
+  return build_megakernel();
+}
 
-const std::string& Model::model_path() const { return model_path_; }
+// the fp32 weight of a layer on the cuda device, nullptr for any other
+static const float* megakernel_weight(const op::Layer* layer) {
+  auto param_layer = dynamic_cast<const op::LayerParam*>(layer);
+  if (!param_layer) {
+    return nullptr;
+  }
+  auto matmul = dynamic_cast<const op::MatmulLayer*>(layer);
+  if (matmul && (matmul->is_int4() || matmul->is_fp8() || matmul->has_input_order())) {
+    return nullptr;
+  }
+  const tensor::Tensor& weight = param_layer->get_weight(0);
+  if (weight.is_empty() || weight.data_type() != base::DataType::kDataTypeFp32 ||
+      weight.device_type() != base::DeviceType::kDeviceCUDA) {
+    return nullptr;
+  }
+  return weight.ptr<float>();
+}
+
+base::Status Model::build_megakernel() {
+  using namespace base;
+  if (device_type_ != DeviceType::kDeviceCUDA || tensor_parallel_ || is_layer_split() ||
+      weight_streamer_) {
+    return error::InvalidArgument(
+        "The megakernel needs all the layers of the model resident on one cuda device.");
+  }
+  if (!kv_cache_ || kv_cache_->data_type() != DataType::kDataTypeFp32 ||
+      kv_cache_->is_head_major()) {
+    return error::InvalidArgument("The megakernel needs an fp32 token major kv cache.");
+  }
+  if (config_->dim_ % 4 != 0 || config_->q_dim_ != config_->dim_) {
+    return error::InvalidArgument("The megakernel needs a dim of a multiple of 4 which is the "
+                                  "width of the query.");
+  }
+  const int32_t grid_size = kernel::megakernel_grid_size();
+  if (grid_size <= 0) {
+    return error::InvalidArgument("The cuda device can not launch a cooperative kernel.");
+  }
+  auto alloc = CUDADeviceAllocatorFactory::get_instance();
+  execution_plan_.megakernel_norm = tensor::Tensor(DataType::kDataTypeFp32, config_->dim_, true,
+                                                   alloc);
+  float* norm = execution_plan_.megakernel_norm.ptr<float>();
+  auto mutable_ptr = [](const tensor::Tensor* tensor) {
+    return tensor ? const_cast<float*>(tensor->ptr<float>()) : nullptr;
+  };
+  const int64_t cache_len = kv_cache_->key_cache().get_dim(1);
+
+  std::vector<kernel::MegaStep> mega_steps;
+  for (const PlanStep& step : execution_plan_.steps) {
+    kernel::MegaStep mega_step;
+    mega_step.input = step.input ? step.input->ptr<float>() : nullptr;
+    mega_step.input2 = step.input2 ? step.input2->ptr<float>() : nullptr;
+    mega_step.output = mutable_ptr(step.output);
+    const int64_t layer_offset = step.kv_layer_idx * cache_len * config_->kv_dim_;
+    bool is_supported = true;
+    switch (step.op) {
+      case GraphOp::kAttentionNorm:
+      case GraphOp::kFFNNorm:
+      case GraphOp::kFinalNorm:
+        mega_step.op = kernel::MegaOp::kRMSNorm;
+        mega_step.cols = config_->dim_;
+        mega_step.weight = megakernel_weight(step.layer);
+        is_supported = mega_step.weight != nullptr;
+        if (step.op == GraphOp::kFinalNorm) {
+          mega_step.output = norm;
+        }
+        break;
+      case GraphOp::kQKV:
+      case GraphOp::kAttentionOutput:
+      case GraphOp::kGateUpSwiGLU:
+      case GraphOp::kDown:
+      case GraphOp::kClassifier: {
+        auto matmul = dynamic_cast<const op::MatmulLayer*>(step.layer);
+        mega_step.weight = megakernel_weight(step.layer);
+        is_supported = matmul && mega_step.weight && matmul->get_weight(0).get_dim(1) % 4 == 0;
+        if (!is_supported) {
+          break;
+        }
+        mega_step.rows = matmul->get_weight(0).get_dim(0);
+        mega_step.cols = matmul->get_weight(0).get_dim(1);
+        if (matmul->is_swiglu_output()) {
+          mega_step.op = kernel::MegaOp::kMatmulSwiGLU;
+          mega_step.rows /= 2;
+        } else {
+          mega_step.op = kernel::MegaOp::kMatmul;
+          mega_step.bias = matmul->has_bias() ? matmul->get_bias(0).ptr<float>() : nullptr;
+        }
+        if (step.op == GraphOp::kClassifier) {
+          mega_step.input = norm;
+        }
+        break;
+      }
+      case GraphOp::kRope:
+        mega_step.op = kernel::MegaOp::kRope;
+        mega_step.output = mutable_ptr(step.query);
+        mega_step.output2 = mutable_ptr(step.key);
+        break;
+      case GraphOp::kKVWrite:
+        mega_step.op = kernel::MegaOp::kKVWrite;
+        mega_step.input = step.key->ptr<float>();
+        mega_step.input2 = step.value->ptr<float>();
+        mega_step.key_cache = mutable_ptr(&kv_cache_->key_cache()) + layer_offset;
+        mega_step.value_cache = mutable_ptr(&kv_cache_->value_cache()) + layer_offset;
+        break;
+      case GraphOp::kAttention:
+        mega_step.op = kernel::MegaOp::kAttention;
+        mega_step.input = step.query->ptr<float>();
+        mega_step.key_cache = mutable_ptr(step.key_cache) + layer_offset;
+        mega_step.value_cache = mutable_ptr(step.value_cache) + layer_offset;
+        break;
+      case GraphOp::kAttentionResidual:
+      case GraphOp::kFFNResidual:
+        mega_step.op = kernel::MegaOp::kAdd;
+        mega_step.cols = config_->dim_;
+        break;
+      default:
+        is_supported = false;
+        break;
+    }
+    if (!is_supported) {
+      return error::InvalidArgument("The graph op " + std::string(graph_op_name(step.op)) +
+                                    " of the layer " + std::to_string(step.layer_idx) +
+                                    " can not run in the megakernel, it needs fp32 weights on "
+                                    "the cuda device.");
+    }
+    mega_steps.push_back(mega_step);
+  }
+
+  const size_t byte_size = mega_steps.size() * sizeof(kernel::MegaStep);
+  execution_plan_.megakernel_steps = std::make_shared<Buffer>(byte_size, alloc);
+  if (!execution_plan_.megakernel_steps->ptr()) {
+    return error::InternalError("The steps of the megakernel can not be allocated.");
+  }
+  cudaMemcpy(execution_plan_.megakernel_steps->ptr(), mega_steps.data(), byte_size,
+             cudaMemcpyHostToDevice);
+  execution_plan_.megakernel_step_num = static_cast<int32_t>(mega_steps.size());
+  execution_plan_.megakernel_grid_size = grid_size;
+  LOG(INFO) << "The decode step runs as one megakernel of " << mega_steps.size() << " phases on "
+            << grid_size << " blocks";
+  return error::Success();
+}
+
+static bool is_matmul_op(GraphOp op) {
+  switch (op) {
+    case GraphOp::kQuery:
+    case GraphOp::kKey:
+    case GraphOp::kValue:
+    case GraphOp::kQKV:
+    case GraphOp::kAttentionOutput:
+    case GraphOp::kGate:
+    case GraphOp::kUp:
+    case GraphOp::kGateUpSwiGLU:
+    case GraphOp::kDown:
+      return true;
+    default:
+      return false;
+  }
+}
+
+base::Status Model::check_execution_plan() {
+  // the matmuls read and write the same buffers in every step, they are checked once here
+  for (const PlanStep& step : execution_plan_.steps) {
+    // a streamed layer points at its host weights until the step acquires them
+    if (!is_matmul_op(step.op) ||
+        (weight_streamer_ && weight_streamer_->is_streamed(step.layer_idx))) {
+      continue;
+    }
+    step.layer->set_input(0, *step.input);
+    step.layer->set_output(0, *step.output);
+    if (!step.layer->check()) {
+      return base::error::InternalError("The execution plan of the layer " +
+                                        std::to_string(step.layer_idx) +
+                                        " does not match its buffers.");
+    }
+  }
+  if (validate_steps_) {
+    return base::error::Success();
+  }
+  for (const PlanStep& step : execution_plan_.steps) {
+    if (step.layer != nullptr) {
+      step.layer->set_check_enabled(false);
+    }
+  }
+  return base::error::Success();
+}
+
+// the op type of a step in the profiles, the type of its layer unless it runs no layer
+static const char* plan_step_category(const PlanStep& step) {
+  switch (step.op) {
+    case GraphOp::kMoveToHost:
+      return "copy";
+    case GraphOp::kKVWrite:
+      return "kv_write";
+    case GraphOp::kRopeKVWrite:
+      return "rope_kv_write";
+    case GraphOp::kAttentionAllReduce:
+    case GraphOp::kFFNAllReduce:
+      return "all_reduce";
+    case GraphOp::kAttentionResidualNorm:
+    case GraphOp::kFFNResidualNorm:
+      return "add_rmsnorm";
+    default:
+      return step.layer ? op::layer_type_name(step.layer->layer_type()) : "unknown";
+  }
+}
+
+void Model::run_execution_plan(const tensor::Tensor& input, const tensor::Tensor& pos_tensor,
+                               void* stream) const {
+  const bool is_device_pos = pos_tensor.device_type() == base::DeviceType::kDeviceCUDA;
+  const int32_t pos = is_device_pos ? 0 : pos_tensor.index<int32_t>(0);
+  if (execution_plan_.megakernel_step_num > 0) {
+    run_megakernel(input, is_device_pos ? pos_tensor.ptr<int32_t>() : nullptr, pos, stream);
+    return;
+  }
+  // the cpu layers of a split model add their residuals to a host copy of the input
+  const tensor::Tensor* hidden = &input;
+  const bool is_cuda = device_type_ == base::DeviceType::kDeviceCUDA;
+  for (const PlanStep& step : execution_plan_.steps) {
+    if (step.begins_layer) {
+      stream_layer_weights(step.layer_idx, stream);
+    }
+    // the layer of the step is timed as the op of the plan, the final norm and the classifier
+    // are out of the transformer layers
+    base::ProfileLayerScope profile_scope(
+        step.layer_idx < config_->layer_num_ ? step.layer_idx : -1);
+    base::ProfileRange profile_range(plan_step_category(step), graph_op_name(step.op),
+                                     is_cuda && !step.is_host, stream);
+    const tensor::Tensor& step_input = step.input ? *step.input : *hidden;
+    const tensor::Tensor& step_output = step.output ? *step.output : *hidden;
+    switch (step.op) {
+      case GraphOp::kMoveToHost:
+        move_hidden_to_host(*hidden, step_output, stream);
+        hidden = step.output;
+        break;
+      case GraphOp::kRope:
+        STATUS_CHECK(step.layer->forward(*step.query, *step.key, pos_tensor, *step.sin_cache,
+                                         *step.cos_cache, tensor::Tensor{}));
+        break;
+      case GraphOp::kKVWrite:
+        step.kv_cache->write(step.kv_layer_idx, 0, pos_tensor, *step.key, *step.value, stream);
+        break;
+      case GraphOp::kRopeKVWrite:
+        step.kv_cache->write_rotated(step.kv_layer_idx, 0, pos_tensor, *step.query, *step.key,
+                                     *step.value, *step.sin_cache, *step.cos_cache,
+                                     config_->is_rope_rotate_half_, stream);
+        break;
+      case GraphOp::kAttention:
+        if (is_device_pos) {
+          step.mha->set_pos_tensor(pos_tensor);
+        } else {
+          step.mha->set_pos(pos);
+        }
+        step.mha->set_layer_idx(step.kv_layer_idx);
+        STATUS_CHECK(step.layer->forward(*step.query, *step.score_storage, *step.key_cache,
+                                         *step.value_cache, step.block_table, step_output));
+        break;
+      case GraphOp::kAttentionAllReduce:
+      case GraphOp::kFFNAllReduce:
+        STATUS_CHECK(tensor_parallel_->all_reduce(step_output, stream));
+        break;
+      case GraphOp::kAttentionResidual:
+      case GraphOp::kFFNResidual:
+        STATUS_CHECK(step.layer->forward(*hidden, step_input, *hidden));
+        break;
+      case GraphOp::kAttentionResidualNorm:
+      case GraphOp::kFFNResidualNorm:
+        STATUS_CHECK(step.rmsnorm->forward_add(*hidden, step_input, step_output));
+        break;
+      case GraphOp::kSwiGLU:
+        STATUS_CHECK(step.layer->forward(step_input, *step.input2, step_output));
+        break;
+      case GraphOp::kClassifier:
+        classify(step_input, stream);
+        break;
+      default:
+        // the norms and the matmuls
+        STATUS_CHECK(step.layer->forward(step_input, step_output));
+        break;
+    }
+  }
+}
+
+void Model::run_megakernel(const tensor::Tensor& input, const int32_t* pos_ptr, int32_t pos,
+                           void* stream) const {
+  // every layer rotates with the same tables and attends over the same block table
+  auto attention =
+      std::find_if(execution_plan_.steps.begin(), execution_plan_.steps.end(),
+                   [](const PlanStep& step) { return step.op == GraphOp::kAttention; });
+  CHECK(attention != execution_plan_.steps.end());
+  kernel::MegakernelParams params;
+  params.steps = static_cast<const kernel::MegaStep*>(execution_plan_.megakernel_steps->ptr());
+  params.step_num = execution_plan_.megakernel_step_num;
+  params.hidden = const_cast<float*>(input.ptr<float>());
+  params.pos = pos;
+  params.pos_ptr = pos_ptr;
+  params.dim = config_->dim_;
+  params.kv_dim = config_->kv_dim_;
+  params.head_num = config_->head_num_;
+  params.head_size = config_->head_size_;
+  params.kv_mul = config_->kv_mul_;
+  params.seq_len = config_->seq_len_;
+  params.is_rotate_half = config_->is_rope_rotate_half_;
+  params.sin_cache = attention->sin_cache->ptr<float>();
+  params.cos_cache = attention->cos_cache->ptr<float>();
+  params.block_table = attention->block_table.ptr<int32_t>();
+  params.block_size = kv_cache_->block_size();
+  params.window = attention_window_;
+  params.score = const_cast<float*>(attention->score_storage->ptr<float>());
+  base::ProfileRange profile_range("megakernel", "decode_step", true, stream);
+  const cudaError_t err = kernel::launch_megakernel(
+      params, execution_plan_.megakernel_grid_size, static_cast<cudaStream_t>(stream));
+  CHECK_EQ(err, cudaSuccess) << "The megakernel launch failed: " << cudaGetErrorString(err);
+}
+
+base::Status Model::insert_host_buffer(ModelBufferType buffer_idx, const tensor::Tensor& tensor) {
+  if (host_buffers_.count(buffer_idx) > 0) {
+    return base::error::KeyHasExits(std::to_string(int(buffer_idx)) +
+                                    " has exits in the host buffers");
+  }
+  if (tensor.is_empty()) {
+    return base::error::InvalidArgument("The tensor is empty for inserting buffer.");
+  }
+  host_buffers_.insert({buffer_idx, tensor});
+  return base::error::Success();
+}
+
+void Model::move_hidden_to_host(const tensor::Tensor& hidden, const tensor::Tensor& host_hidden,
+                                void* stream) const {
+  CHECK(hidden.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(host_hidden.device_type() == base::DeviceType::kDeviceCPU);
+  CHECK_EQ(hidden.byte_size(), host_hidden.byte_size());
+  cudaStream_t cuda_stream = static_cast<cudaStream_t>(stream);
+  cudaMemcpyAsync(const_cast<float*>(host_hidden.ptr<float>()), hidden.ptr<float>(),
+                  hidden.byte_size(), cudaMemcpyDeviceToHost, cuda_stream);
+  // the cpu layers read it right away
+  cudaStreamSynchronize(cuda_stream);
+}
 
 base::Status Model::insert_buffer(ModelBufferType buffer_idx, const tensor::Tensor& tensor) {
   if (buffers_.count(buffer_idx) > 0) {
@@ -38,11 +1582,157 @@ const tensor::Tensor& Model::get_buffer(ModelBufferType buffer_idx) const {
   return buffers_.at(buffer_idx);
 }
 
+base::Status Model::read_legacy_header(FILE* file, ModelConfig& config, size_t& header_size) {
+  using namespace base;
+  if (fread(&config, sizeof(ModelConfig), 1, file) != 1) {
+    return error::ModelParseError(
+        "Failed to retrieve the configuration information from the model "
+        "file.");
+  }
+  header_size = sizeof(ModelConfig);
+  if (is_quant_model_) {
+    if (fread(&group_size_, sizeof(int32_t), 1, file) != 1) {
+      return error::ModelParseError(
+          "Failed to retrieve the group size information from the model "
+          "file.");
+    }
+    header_size += sizeof(group_size_);
+    // the int4 export writes a magic in place of the int8 group size
+    if (group_size_ == kInt4ModelMagic) {
+      Int4Header header;
+      if (fread(&header, sizeof(Int4Header), 1, file) != 1) {
+        return error::ModelParseError(
+            "Failed to retrieve the int4 quant information from the model file.");
+      }
+      is_int4_model_ = true;
+      group_size_ = header.group_size;
+      has_zero_point_ = (header.flags & kInt4ZeroPointFlag) != 0;
+      header_size += sizeof(Int4Header);
+    }
+  } else {
+    int32_t magic = 0;
+    if (fread(&magic, sizeof(int32_t), 1, file) == 1 && magic == kHalfModelMagic) {
+      HalfHeader header;
+      if (fread(&header, sizeof(HalfHeader), 1, file) != 1) {
+        return error::ModelParseError(
+            "Failed to retrieve the weight data type from the model file.");
+      }
+      weight_data_type_ = static_cast<DataType>(header.data_type);
+      if (weight_data_type_ != DataType::kDataTypeFp16 &&
+          weight_data_type_ != DataType::kDataTypeBf16) {
+        return error::ModelParseError("The model file has an unknown weight data type.");
+      }
+      header_size += sizeof(magic) + sizeof(HalfHeader);
+    }
+  }
+  return error::Success();
+}
+
+base::Status Model::read_tensor_file_header(const TensorFileHeader& header) {
+  using namespace base;
+  const auto weight_data_type = static_cast<DataType>(header.weight_data_type);
+  is_int4_model_ = false;
+  is_fp8_model_ = false;
+  has_zero_point_ = false;
+  if (weight_data_type == DataType::kDataTypeFp8E4M3) {
+    // an fp8 matmul weight has one scale per row and no groups
+    is_quant_model_ = true;
+    is_fp8_model_ = true;
+    group_size_ = 0;
+    weight_data_type_ = DataType::kDataTypeFp32;
+  } else if (weight_data_type == DataType::kDataTypeInt8) {
+    if (header.group_size <= 0) {
+      return error::ModelParseError("The quant tensor file has an invalid group size.");
+    }
+    is_quant_model_ = true;
+    group_size_ = header.group_size;
+    is_int4_model_ = (header.flags & kTensorFileInt4Flag) != 0;
+    has_zero_point_ = (header.flags & kTensorFileZeroPointFlag) != 0;
+    weight_data_type_ = DataType::kDataTypeFp32;
+  } else if (weight_data_type == DataType::kDataTypeFp32 ||
+             weight_data_type == DataType::kDataTypeFp16 ||
+             weight_data_type == DataType::kDataTypeBf16) {
+    is_quant_model_ = false;
+    weight_data_type_ = weight_data_type;
+  } else {
+    return error::ModelParseError("The tensor file has an unknown weight data type.");
+  }
+  return error::Success();
+}
+
+base::Status Model::read_gguf_file(int32_t fd, size_t file_size) {
+  using namespace base;
+  auto raw_data = std::make_shared<RawModelDataGguf>();
+  raw_data->fd = fd;
+  raw_data->file_size = file_size;
+  raw_model_data_ = raw_data;
+  if (!raw_data->map(weight_load_options_)) {
+    return error::ModelParseError("Failed to map the weight file " + model_path_ + " into memory.");
+  }
+  raw_data->weight_data = raw_data->data;
+
+  GgufModelInfo info;
+  auto load_status = load_gguf_model(*raw_data, tensor_directory_, info);
+  if (!load_status) {
+    return load_status;
+  }
+  is_quant_model_ = info.weight_data_type == DataType::kDataTypeInt8;
+  is_int4_model_ = info.is_int4;
+  has_zero_point_ = false;
+  group_size_ = is_quant_model_ ? info.group_size : 1;
+  weight_data_type_ = is_quant_model_ ? DataType::kDataTypeFp32 : info.weight_data_type;
+
+  auto gen_status = generate_model_infos(info.config);
+  if (!gen_status) {
+    return gen_status;
+  }
+  config_->rope_theta_ = info.rope_theta;
+  config_->is_rope_rotate_half_ = info.is_rope_rotate_half;
+  config_->rope_scaling_ = info.rope_scaling;
+  LOG(INFO) << "The model path: " << model_path_;
+  LOG(INFO) << "The gguf model file size: " << file_size << " byte";
+  LOG(INFO) << "\nThe model info: " << *config_;
+  return error::Success();
+}
+
+base::Status Model::read_safetensors_model() {
+  using namespace base;
+  auto raw_data = std::make_shared<RawModelDataSafetensors>();
+  raw_model_data_ = raw_data;
+  SafetensorsModelInfo info;
+  auto load_status =
+      load_safetensors_model(model_path_, weight_load_options_, *raw_data, tensor_directory_, info);
+  if (!load_status) {
+    return load_status;
+  }
+  // the int4 checkpoints keep their zero points, the other tensors are fp32 then
+  is_quant_model_ = info.is_int4;
+  is_int4_model_ = info.is_int4;
+  has_zero_point_ = info.is_int4;
+  group_size_ = info.is_int4 ? info.group_size : 1;
+  weight_data_type_ = info.weight_data_type;
+
+  auto gen_status = generate_model_infos(info.config);
+  if (!gen_status) {
+    return gen_status;
+  }
+  config_->rope_theta_ = info.rope_theta;
+  config_->is_rope_rotate_half_ = info.is_rope_rotate_half;
+  config_->rope_scaling_ = info.rope_scaling;
+  LOG(INFO) << "The model path: " << model_path_;
+  LOG(INFO) << "The safetensors model shards: " << raw_data->shards.size();
+  LOG(INFO) << "\nThe model info: " << *config_;
+  return error::Success();
+}
+
 base::Status Model::read_model_file() {
   using namespace base;
   if (model_path_.empty()) {
     return error::PathNotValid("Failed to open the weight file, the model path is empty!");
   }
+  if (is_safetensors_path(model_path_)) {
+    return read_safetensors_model();
+  }
   int32_t fd = open(model_path_.data(), O_RDONLY);
   if (fd == -1) {
     return error::PathNotValid("Failed to open the weight file " + model_path_ +
@@ -54,38 +1744,60 @@ base::Status Model::read_model_file() {
     return error::PathNotValid("Failed to open the file. The path may be invalid.");
   }
 
-  auto config = ModelConfig{};
-  if (fread(&config, sizeof(ModelConfig), 1, file) != 1) {
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
     return error::ModelParseError(
-        "Failed to retrieve the configuration information from the model "
+        "Failed to retrieve the file size information from the model "
         "file.");
   }
-  if (is_quant_model_) {
-    if (fread(&group_size_, sizeof(int32_t), 1, file) != 1) {
-      return error::ModelParseError(
-          "Failed to retrieve the group size information from the model "
-          "file.");
+
+  uint32_t magic = 0;
+  if (pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) && magic == kGgufMagic) {
+    fclose(file);
+    return read_gguf_file(fd, st.st_size);
+  }
+
+  bool is_tensor_file = false;
+  auto directory_status = tensor_directory_.read(file, st.st_size, is_tensor_file);
+  if (!directory_status) {
+    fclose(file);
+    close(fd);
+    return directory_status;
+  }
+  auto config = ModelConfig{};
+  size_t header_size = 0;
+  if (is_tensor_file) {
+    config = tensor_directory_.header().config;
+    auto header_status = read_tensor_file_header(tensor_directory_.header());
+    if (!header_status) {
+      fclose(file);
+      close(fd);
+      return header_status;
+    }
+  } else {
+    auto header_status = read_legacy_header(file, config, header_size);
+    if (!header_status) {
+      fclose(file);
+      close(fd);
+      return header_status;
     }
   }
+  fclose(file);
 
   auto gen_status = generate_model_infos(config);
   if (!gen_status) {
     return gen_status;
   }
 
-  if (!is_quant_model_) {
+  if (weight_data_type_ != DataType::kDataTypeFp32) {
+    raw_model_data_ = std::make_shared<RawModelDataFp16>();
+  } else if (!is_quant_model_) {
     raw_model_data_ = std::make_shared<RawModelDataFp32>();
   } else {
     raw_model_data_ = std::make_shared<RawModelDataInt8>();
   }
 
-  struct stat st;
-  if (fstat(fd, &st) == -1) {
-    close(fd);
-    return error::ModelParseError(
-        "Failed to retrieve the file size information from the model "
-        "file.");
-  }
   raw_model_data_->file_size = st.st_size;
   LOG(INFO) << "The tokenizer model path: " << token_path_;
   std::string tokenizer_type_str = tokenizer_type_ == TokenizerType::kEncodeBpe ? "Bpe" : "Spe";
@@ -94,26 +1806,30 @@ base::Status Model::read_model_file() {
   LOG(INFO) << "The model path: " << model_path_;
   LOG(INFO) << "The model file size: " << raw_model_data_->file_size << " byte";
   std::string quant_info = is_quant_model_ ? "quant" : "not quant";
+  if (is_int4_model_) {
+    quant_info = "int4 quant";
+  } else if (is_fp8_model_) {
+    quant_info = "fp8 quant";
+  } else if (weight_data_type_ == DataType::kDataTypeFp16) {
+    quant_info = "fp16";
+  } else if (weight_data_type_ == DataType::kDataTypeBf16) {
+    quant_info = "bf16";
+  }
   LOG(INFO) << "The model is " << quant_info << " model";
+  if (is_tensor_file) {
+    LOG(INFO) << "The model file has a directory of " << tensor_directory_.header().tensor_num
+              << " tensors";
+  }
 
   if (config_) {
     LOG(INFO) << "\nThe model info: " << *config_;
   }
 
   raw_model_data_->fd = fd;
-  raw_model_data_->data =
-      mmap(nullptr, raw_model_data_->file_size, PROT_READ, MAP_PRIVATE, raw_model_data_->fd, 0);
-
-  if (raw_model_data_->data == MAP_FAILED || raw_model_data_->data == nullptr) {
+  if (!raw_model_data_->map(weight_load_options_)) {
     return error::ModelParseError("Failed to map the weight file " + model_path_ + " into memory.");
   }
-  if (!is_quant_model_) {
-    raw_model_data_->weight_data =
-        static_cast<int8_t*>(raw_model_data_->data) + sizeof(ModelConfig);
-  } else {
-    raw_model_data_->weight_data =
-        static_cast<int8_t*>(raw_model_data_->data) + sizeof(ModelConfig) + sizeof(group_size_);
-  }
+  raw_model_data_->weight_data = static_cast<int8_t*>(raw_model_data_->data) + header_size;
   if (raw_model_data_ == nullptr) {
     LOG(ERROR);
     return error::ModelParseError("Failed to map the weight file " + model_path_ +
@@ -122,13 +1838,86 @@ base::Status Model::read_model_file() {
   return error::Success();
 }
 
+static const void* directory_weight(const TensorDirectory& directory, const RawModelData& data,
+                                    const std::string& name, const std::vector<int32_t>& dims,
+                                    base::DataType data_type) {
+  const TensorInfo* info = directory.find(name);
+  CHECK(info != nullptr) << "The model file has no tensor " << name;
+  CHECK(info->dims == dims) << "The shape of the tensor " << name
+                            << " does not match the model config";
+  CHECK(info->data_type == data_type) << "The tensor " << name << " has an unexpected data type";
+  if (info->data != nullptr) {
+    return info->data;
+  }
+  return static_cast<const int8_t*>(data.data) + info->offset;
+}
+
+const void* Model::model_weight(const std::string& name, size_t pos,
+                                const std::vector<int32_t>& dims) const {
+  if (tensor_directory_.empty()) {
+    return raw_model_data_->weight(pos);
+  }
+  // the norms and the embedding of a quant file stay in fp32
+  const base::DataType data_type = is_quant_model_ ? base::DataType::kDataTypeFp32
+                                                   : weight_data_type_;
+  return directory_weight(tensor_directory_, *raw_model_data_, name, dims, data_type);
+}
+
+const void* Model::layer_weight(int32_t layer_idx, const char* name, size_t pos,
+                                const std::vector<int32_t>& dims) const {
+  if (tensor_directory_.empty()) {
+    return raw_model_data_->weight(pos);
+  }
+  return model_weight(layer_tensor_name(layer_idx, name), pos, dims);
+}
+
+size_t Model::set_quant_weight(const std::shared_ptr<op::MatmulLayer>& layer,
+                               const std::vector<int32_t>& dims, size_t pos,
+                               const std::string& name) const {
+  CHECK(is_quant_model_);
+  CHECK_EQ(dims.size(), 2);
+  layer->set_group_size(group_size_);
+  if (is_fp8_model_) {
+    // the fp8 weights only come in a tensor file
+    const void* weight = directory_weight(tensor_directory_, *raw_model_data_, name, dims,
+                                          base::DataType::kDataTypeFp8E4M3);
+    const base::Status status = layer->set_weight_fp8(dims, weight, base::DeviceType::kDeviceCPU);
+    CHECK(status) << status.get_err_msg();
+    return static_cast<size_t>(dims.at(0)) * dims.at(1) + dims.at(0) * sizeof(float);
+  }
+  const void* weight =
+      tensor_directory_.empty()
+          ? raw_model_data_->weight(pos)
+          : directory_weight(tensor_directory_, *raw_model_data_, name, dims,
+                             base::DataType::kDataTypeInt8);
+  if (is_int4_model_) {
+    const base::Status status =
+        layer->set_weight_int4(dims, weight, has_zero_point_, base::DeviceType::kDeviceCPU);
+    CHECK(status) << status.get_err_msg();
+    // the act order weights of a gptq checkpoint have the order of their input next to them
+    const TensorInfo* order =
+        tensor_directory_.empty() ? nullptr : tensor_directory_.find(int4_order_name(name));
+    if (order != nullptr) {
+      CHECK(order->data_type == base::DataType::kDataTypeInt32 && order->data != nullptr);
+      const base::Status order_status =
+          layer->set_input_order(dims.at(1), order->data, base::DeviceType::kDeviceCPU);
+      CHECK(order_status) << order_status.get_err_msg();
+    }
+    return op::MatmulLayer::int4_byte_size(dims.at(0), dims.at(1), group_size_, has_zero_point_);
+  }
+  layer->set_weight(0, dims, weight, base::DeviceType::kDeviceCPU);
+  return static_cast<size_t>(dims.at(0)) * dims.at(1) + layer->get_scale_num() * sizeof(float);
+}
+
 base::Status Model::generate_model_infos(const ModelConfig& config) const {
   config_->dim_ = config.dim;
+  config_->q_dim_ = config.dim;
   config_->hidden_dim_ = config.hidden_dim;
   config_->layer_num_ = config.layer_num;
   config_->head_num_ = config.head_num;
   config_->kv_head_num_ = config.kv_head_num;
   config_->seq_len_ = config.seq_len;
+  config_->file_seq_len_ = config.seq_len;
 
   config_->kv_dim_ = (config.dim * config.kv_head_num) / config.head_num;
   config_->kv_mul_ = config.head_num / config.kv_head_num;
@@ -150,6 +1939,52 @@ base::Status Model::generate_model_infos(const ModelConfig& config) const {
   return base::error::Success();
 }
 
+base::Status Model::copy_context_from(const Model& model) {
+  if (!model.config_ || !model.encode_layer_) {
+    return base::error::InvalidArgument("The model has to be initialized before its contexts.");
+  }
+  if (model.weight_streamer_) {
+    return base::error::InvalidArgument("The streamed weights can not be shared by contexts.");
+  }
+  if (model.is_layer_split() || model.tensor_parallel_size_ > 1) {
+    return base::error::InvalidArgument(
+        "The contexts need all the layers of the model on one device.");
+  }
+  if (model.lora_pool_) {
+    return base::error::InvalidArgument("The lora adapters can not be shared by contexts.");
+  }
+  device_type_ = model.device_type_;
+  group_size_ = model.group_size_;
+  max_batch_size_ = model.max_batch_size_;
+  kv_block_size_ = model.kv_block_size_;
+  kv_block_num_ = model.kv_block_num_;
+  kv_data_type_ = model.kv_data_type_;
+  is_kv_head_major_ = model.is_kv_head_major_;
+  kv_chunk_block_num_ = model.kv_chunk_block_num_;
+  kv_keep_block_num_ = model.kv_keep_block_num_;
+  use_cuda_graph_ = model.use_cuda_graph_;
+  use_pinned_memory_ = model.use_pinned_memory_;
+  gpu_layer_num_ = model.gpu_layer_num_;
+  weight_load_options_ = model.weight_load_options_;
+  validate_steps_ = model.validate_steps_;
+  use_megakernel_ = model.use_megakernel_;
+  use_fused_sampling_ = model.use_fused_sampling_;
+  has_rope_scaling_ = model.has_rope_scaling_;
+  rope_scaling_ = model.rope_scaling_;
+  max_seq_len_ = model.max_seq_len_;
+  attention_window_ = model.attention_window_;
+  is_int4_model_ = model.is_int4_model_;
+  is_fp8_model_ = model.is_fp8_model_;
+  has_zero_point_ = model.has_zero_point_;
+  weight_data_type_ = model.weight_data_type_;
+  config_ = std::make_unique<TransformerConfig>(*model.config_);
+  // the layers keep pointing into the model file and the tokenizer is only read
+  encode_layer_ = model.encode_layer_;
+  raw_model_data_ = model.raw_model_data_;
+  tensor_directory_ = model.tensor_directory_;
+  return base::error::Success();
+}
+
 base::Status Model::create_encode_layer() {
   using namespace base;
 
@@ -193,6 +2028,12 @@ base::Status Model::gen_model_from_file() {
     LOG(ERROR) << "Read model file " << model_path_ << " failed! " << mmap_status.get_err_msg();
     return mmap_status;
   }
+  if (has_rope_scaling_) {
+    config_->rope_scaling_ = rope_scaling_;
+  }
+  if (max_seq_len_ > 0) {
+    config_->seq_len_ = max_seq_len_;
+  }
   auto layer_create_status = create_layers();
   if (!layer_create_status) {
     LOG(ERROR) << "Create layers for the model file " << model_path_ << " failed! "
@@ -208,11 +2049,75 @@ std::vector<int32_t> Model::encode(const std::string& sentence) const {
   return encode_layer_->encode(sentence);
 }
 
+void TokenBatch::push_back(const std::vector<int32_t>& prompt_tokens) {
+  tokens.insert(tokens.end(), prompt_tokens.begin(), prompt_tokens.end());
+  offsets.push_back(static_cast<int32_t>(tokens.size()));
+}
+
+TokenBatch Model::encode_batch(const std::vector<std::string>& sentences) const {
+  CHECK(encode_layer_ != nullptr);
+  const int32_t sentence_num = static_cast<int32_t>(sentences.size());
+  std::vector<std::vector<int32_t>> sentence_tokens(sentence_num);
+  base::ThreadPoolFactory::get_instance()->parallel_for(
+      sentence_num, 1, [&](int32_t begin, int32_t end) {
+        for (int32_t i = begin; i < end; ++i) {
+          sentence_tokens[i] = encode_layer_->encode(sentences[i]);
+        }
+      });
+
+  size_t token_num = 0;
+  for (const auto& tokens : sentence_tokens) {
+    token_num += tokens.size();
+  }
+  TokenBatch batch;
+  batch.tokens.reserve(token_num);
+  batch.offsets.reserve(sentence_num + 1);
+  for (const auto& tokens : sentence_tokens) {
+    batch.push_back(tokens);
+  }
+  return batch;
+}
+
+op::EmbeddingOutput Model::embedding_batch(const TokenBatch& batch) const {
+  CHECK(!batch.tokens.empty());
+  CHECK_EQ(batch.offsets.back(), batch.tokens.size());
+  const int32_t token_num = static_cast<int32_t>(batch.tokens.size());
+  // a pinned buffer lets the embedding kernel upload the tokens asynchronously
+  std::shared_ptr<base::DeviceAllocator> alloc_host =
+      base::CPUDeviceAllocatorFactory::get_instance();
+  if (device_type_ == base::DeviceType::kDeviceCUDA) {
+    alloc_host = base::CUDAHostAllocatorFactory::get_instance();
+  }
+  tensor::Tensor input_tokens(base::DataType::kDataTypeInt32, token_num, true, alloc_host);
+  std::memcpy(input_tokens.ptr<int32_t>(), batch.tokens.data(), input_tokens.byte_size());
+
+  tensor::Tensor input_embeddings(base::DataType::kDataTypeFp32, token_num, config_->dim_, true,
+                                  base::DeviceAlloctorFactory::get_instance(device_type_));
+  tensor::Tensor input_token_num(base::DataType::kDataTypeInt32, token_num);
+  STATUS_CHECK(embedding_device(input_tokens, input_embeddings));
+  return op::EmbeddingOutput(input_tokens, input_embeddings, input_token_num);
+}
+
 bool Model::is_sentence_ending(int32_t token_idx) const {
   CHECK(this->encode_layer_ != nullptr);
   return this->encode_layer_->is_sentence_ending(token_idx);
 }
 
+std::vector<int32_t> Model::sentence_ending_tokens() const {
+  CHECK(this->encode_layer_ != nullptr);
+  return this->encode_layer_->sentence_ending_tokens();
+}
+
+std::vector<std::string> Model::vocab_bytes() const {
+  CHECK(this->encode_layer_ != nullptr);
+  const int32_t vocab_size = this->encode_layer_->vocab_size();
+  std::vector<std::string> bytes(vocab_size);
+  for (int32_t token = 0; token < vocab_size; ++token) {
+    bytes[token] = this->encode_layer_->token_bytes(token, false);
+  }
+  return bytes;
+}
+
 std::string Model::decode(int32_t token_idx) const {
   CHECK(this->encode_layer_ != nullptr);
   return this->encode_layer_->decode(token_idx);
@@ -223,43 +2128,359 @@ std::string Model::decode(std::vector<int32_t> token_idxs) const {
   return this->encode_layer_->decode(token_idxs);
 }
 
-std::pair<tensor::Tensor, tensor::Tensor> Model::slice_kv_cache(int32_t layer_idx,
-                                                                int32_t token_pos) const {
-  int32_t layer_offset = layer_idx * config_->seq_len_ * config_->kv_dim_;
-  int32_t cache_offset = layer_offset + token_pos * config_->kv_dim_;
+StreamDecoder Model::stream_decoder() const {
+  CHECK(this->encode_layer_ != nullptr);
+  const op::EncodeLayerBase* encode_layer = encode_layer_.get();
+  return StreamDecoder([encode_layer](int32_t token, bool is_first) {
+    return encode_layer->token_bytes(token, is_first);
+  });
+}
+
+void Model::bind_embedding_output(int32_t token_num) const {
+  CHECK_GT(token_num, 0);
+  // one token is embedded into the input buffers, which a captured decode step reads
+  const tensor::Tensor* input_tokens = &get_buffer(ModelBufferType::kInputTokens);
+  const tensor::Tensor* input_embeddings = &get_buffer(ModelBufferType::kInputEmbeddings);
+  if (token_num > input_tokens->size()) {
+    if (token_num > prompt_tokens_.size()) {
+      prompt_tokens_ = tensor::Tensor(base::DataType::kDataTypeInt32, token_num, true,
+                                      input_tokens->get_buffer()->allocator());
+      prompt_embeddings_ = tensor::Tensor(input_embeddings->data_type(), token_num,
+                                          config_->dim_, true,
+                                          input_embeddings->get_buffer()->allocator());
+    }
+    input_tokens = &prompt_tokens_;
+    input_embeddings = &prompt_embeddings_;
+  }
+  const tensor::TensorView tokens_view = tensor::TensorView(*input_tokens).rows(0, token_num);
+  embedding_output_.input_tokens.bind(tokens_view);
+  embedding_output_.input_embeddings.bind(
+      tensor::TensorView(*input_embeddings).rows(0, token_num));
+  // the embedding layer reads only the size of it
+  embedding_output_.input_token_num.bind(tokens_view);
+}
+
+bool Model::bind_batch_activations(int32_t batch_size) const {
+  CHECK(batch_size > 0 && batch_size <= max_batch_size_);
+  BatchActivations& batch = batch_activations_;
+  if (batch.max_batch_size != max_batch_size_) {
+    std::shared_ptr<base::DeviceAllocator> alloc;
+    if (device_type_ == base::DeviceType::kDeviceCPU) {
+      alloc = base::CPUDeviceAllocatorFactory::get_instance();
+    } else {
+      alloc = base::CUDADeviceAllocatorFactory::get_instance();
+    }
+    // the same lifetimes as in prefill, the logits are written after the last layer
+    const int32_t rows = max_batch_size_;
+    const int32_t dim = config_->dim_;
+    const int32_t kv_dim = config_->kv_dim_;
+    const base::DataType fp32 = base::DataType::kDataTypeFp32;
+    batch.planner = std::make_unique<MemoryPlanner>();
+    MemoryPlanner& planner = *batch.planner;
+    const std::vector<int32_t> tensor_ids = {
+        planner.add_tensor(fp32, {rows, dim}, 0, 10),
+        planner.add_tensor(fp32, {rows, dim}, 1, 5),
+        planner.add_tensor(fp32, {rows, kv_dim}, 1, 2),
+        planner.add_tensor(fp32, {rows, kv_dim}, 1, 2),
+        planner.add_tensor(fp32, {rows, config_->hidden_dim_}, 7, 9),
+        planner.add_tensor(fp32, {rows, config_->hidden_dim_}, 7, 8),
+        planner.add_tensor(fp32, {rows, config_->vocab_size_}, 11, 11)};
+    batch.max_batch_size = 0;
+    batch.planned.clear();
+    if (!planner.allocate(alloc)) {
+      return false;
+    }
+    for (int32_t tensor_id : tensor_ids) {
+      batch.planned.push_back(planner.get_tensor(tensor_id));
+    }
+    batch.pos_tensor = tensor::Tensor(base::DataType::kDataTypeInt32, 1, true,
+                                      base::CPUDeviceAllocatorFactory::get_instance());
+    batch.max_batch_size = max_batch_size_;
+  }
+
+  tensor::Tensor* batch_tensors[] = {&batch.rms_output, &batch.query,     &batch.key,
+                                     &batch.val,        &batch.w1_output, &batch.w3_output,
+                                     &batch.logits};
+  for (int32_t i = 0; i < batch.planned.size(); ++i) {
+    batch_tensors[i]->bind(tensor::TensorView(batch.planned.at(i)).rows(0, batch_size));
+  }
+  return true;
+}
+
+tensor::TensorView Model::slice_row(const tensor::Tensor& tensor, int32_t row) const {
+  CHECK_EQ(tensor.dims_size(), 2);
+  return tensor::TensorView(tensor).row(row);
+}
+
+tensor::Tensor Model::slice_rows(const tensor::Tensor& tensor, int32_t row,
+                                 int32_t row_num) const {
+  CHECK_EQ(tensor.dims_size(), 2);
+  CHECK(row >= 0 && row_num > 0 && row + row_num <= tensor.get_dim(0));
+  const int32_t row_size = tensor.get_dim(1);
+  float* row_ptr = const_cast<float*>(tensor.ptr<float>(row * row_size));
+  tensor::Tensor rows_tensor(base::DataType::kDataTypeFp32, row_num, row_size, false, nullptr,
+                             row_ptr);
+  rows_tensor.set_device_type(tensor.device_type());
+  return rows_tensor;
+}
+
+base::Status Model::embed_batch(const std::vector<std::vector<int32_t>>& prompts,
+                                EmbeddingPooling pooling,
+                                std::vector<std::vector<float>>& outputs, int32_t slot) const {
+  tensor::Tensor pos_tensor(base::DataType::kDataTypeInt32, 1, true,
+                            base::CPUDeviceAllocatorFactory::get_instance());
+  pos_tensor.index<int32_t>(0) = 0;
+  outputs.assign(prompts.size(), {});
+  for (int32_t i = 0; i < prompts.size(); ++i) {
+    if (prompts.at(i).empty()) {
+      return base::error::InvalidArgument("The prompt " + std::to_string(i) + " is empty.");
+    }
+    auto status =
+        embed(embedding(prompts.at(i)).input_embeddings, pos_tensor, pooling, outputs.at(i), slot);
+    release_kv_cache(slot);
+    if (!status) {
+      return status;
+    }
+  }
+  return base::error::Success();
+}
+
+void Model::pool_hidden(const tensor::Tensor& hidden, EmbeddingPooling pooling,
+                        std::vector<float>& output, void* stream) const {
+  CHECK_EQ(hidden.dims_size(), 2);
+  const int32_t num_tokens = hidden.get_dim(0);
+  const int32_t dim = hidden.get_dim(1);
+  std::vector<float> host_hidden(hidden.size());
+  std::shared_ptr<base::DeviceAllocator> alloc;
+  base::MemcpyKind memcpy_kind = base::MemcpyKind::kMemcpyCPU2CPU;
+  if (hidden.device_type() == base::DeviceType::kDeviceCPU) {
+    alloc = base::CPUDeviceAllocatorFactory::get_instance();
+  } else {
+    alloc = base::CUDADeviceAllocatorFactory::get_instance();
+    memcpy_kind = base::MemcpyKind::kMemcpyCUDA2CPU;
+  }
+  alloc->memcpy(hidden.ptr<float>(), host_hidden.data(), hidden.size() * sizeof(float),
+                memcpy_kind, stream, true);
+  if (pooling == EmbeddingPooling::kNone) {
+    output = std::move(host_hidden);
+    return;
+  }
+  if (pooling == EmbeddingPooling::kLast) {
+    output.assign(host_hidden.end() - dim, host_hidden.end());
+    return;
+  }
+  output.assign(dim, 0.f);
+  for (int32_t n = 0; n < num_tokens; ++n) {
+    for (int32_t i = 0; i < dim; ++i) {
+      output[i] += host_hidden[static_cast<size_t>(n) * dim + i];
+    }
+  }
+  for (float& value : output) {
+    value /= static_cast<float>(num_tokens);
+  }
+}
+
+int32_t Model::resident_layer_num(size_t layer_byte_size, size_t shared_byte_size) const {
+  CHECK(config_ != nullptr);
+  const int32_t layer_num = config_->layer_num_;
+  if (weight_device_budget_ == 0 || device_type_ != base::DeviceType::kDeviceCUDA) {
+    return layer_num;
+  }
+  CHECK_GT(layer_byte_size, 0);
+  // the embedding, the classifier and the norms always stay on the device
+  if (weight_device_budget_ < shared_byte_size + 2 * layer_byte_size) {
+    LOG(FATAL) << "The weight budget of " << weight_device_budget_
+               << " bytes does not hold the shared weights and a window of two layers.";
+  }
+  const size_t layer_budget = weight_device_budget_ - shared_byte_size;
+  if (layer_budget >= layer_num * layer_byte_size) {
+    return layer_num;
+  }
+  // the streamed layers need two slots of their own
+  return static_cast<int32_t>((layer_budget - 2 * layer_byte_size) / layer_byte_size);
+}
+
+void Model::stream_layer_weights(int32_t layer_idx, void* stream) const {
+  if (weight_streamer_) {
+    weight_streamer_->acquire(layer_idx, static_cast<cudaStream_t>(stream));
+  }
+}
+
+void Model::tune_matmuls(const std::vector<std::shared_ptr<op::Layer>>& layers,
+                         kernel::CudaConfig* cuda_config) const {
+  CHECK_NE(cuda_config, nullptr);
+  MatmulTuner tuner(matmul_tuning_path_);
+  for (const auto& layer : layers) {
+    auto matmul_layer = std::dynamic_pointer_cast<op::MatmulLayer>(layer);
+    // the int8 and int4 kernels and the fused swiglu keep their own launches
+    if (!matmul_layer || matmul_layer->is_swiglu_output()) {
+      continue;
+    }
+    const tensor::Tensor& weight = matmul_layer->get_weight(0);
+    const base::DataType data_type = weight.data_type();
+    if (weight.device_type() != base::DeviceType::kDeviceCUDA ||
+        (data_type != base::DataType::kDataTypeFp32 &&
+         data_type != base::DataType::kDataTypeFp16 &&
+         data_type != base::DataType::kDataTypeBf16)) {
+      continue;
+    }
+    tuner.tune(weight, cuda_config);
+  }
+  const base::Status status = tuner.save();
+  // the launches stay tuned for this run when the cache can not be written
+  if (!status) {
+    LOG(ERROR) << status.get_err_msg();
+  }
+}
+
+void Model::place_numa_weights(const std::vector<std::shared_ptr<op::Layer>>& layers) const {
+  const int32_t node_num = base::ThreadPoolFactory::get_instance()->pin_to_numa_nodes();
+  if (node_num <= 1) {
+    LOG(INFO) << "The cpu has one numa node, the weights stay in place.";
+    return;
+  }
+
+  struct WeightRange {
+    tensor::Tensor* tensor = nullptr;
+    const int8_t* begin = nullptr;
+    size_t byte_size = 0;
+  };
+  std::vector<WeightRange> ranges;
+  for (const auto& layer : layers) {
+    auto matmul_layer = std::dynamic_pointer_cast<op::MatmulLayer>(layer);
+    if (!matmul_layer) {
+      continue;
+    }
+    // the scales are small and read by every row, they stay where they are
+    tensor::Tensor* weight = matmul_layer->param_tensors().front();
+    const base::DataType data_type = weight->data_type();
+    if (weight->device_type() != base::DeviceType::kDeviceCPU || weight->dims_size() != 2 ||
+        (data_type != base::DataType::kDataTypeFp32 &&
+         data_type != base::DataType::kDataTypeInt8)) {
+      continue;
+    }
+    ranges.push_back({weight, weight->ptr<int8_t>(), weight->byte_size()});
+  }
 
-  float* key_cache_ptr =
-      const_cast<float*>(get_buffer(ModelBufferType::kKeyCache).ptr<float>(cache_offset));
-  float* val_cache_ptr =
-      const_cast<float*>(get_buffer(ModelBufferType::kValueCache).ptr<float>(cache_offset));
+  // a part of a fused weight lies in its root, only the root is copied and the part is pointed
+  // into the copy
+  std::sort(ranges.begin(), ranges.end(), [](const WeightRange& a, const WeightRange& b) {
+    if (a.begin != b.begin) {
+      return a.begin < b.begin;
+    }
+    return a.byte_size > b.byte_size;
+  });
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const int8_t* root_begin = nullptr;
+  const int8_t* root_end = nullptr;
+  int8_t* root_copy = nullptr;
+  size_t placed_byte_size = 0;
+  for (WeightRange& range : ranges) {
+    tensor::Tensor* weight = range.tensor;
+    if (range.begin + range.byte_size > root_end) {
+      CHECK(range.begin >= root_end) << "The weights of two layers overlap partially.";
+      // the allocator leaves the pages untouched, they land on the node of the first write
+      tensor::Tensor copy(weight->data_type(), weight->dims(), true, alloc_cpu);
+      kernel::gemv_place_rows_cpu(range.begin, copy.ptr<int8_t>(), weight->get_dim(0),
+                                  weight->get_dim(1), base::DataTypeSize(weight->data_type()));
+      root_begin = range.begin;
+      root_end = range.begin + range.byte_size;
+      root_copy = copy.ptr<int8_t>();
+      placed_byte_size += range.byte_size;
+      *weight = copy;
+    } else {
+      tensor::Tensor view(weight->data_type(), weight->dims(), false, nullptr,
+                          root_copy + (range.begin - root_begin));
+      view.set_device_type(base::DeviceType::kDeviceCPU);
+      *weight = view;
+    }
+  }
+  LOG(INFO) << "Placed " << placed_byte_size << " bytes of weights on " << node_num
+            << " numa nodes.";
+}
 
-  tensor::Tensor key(base::DataType::kDataTypeFp32, config_->kv_dim_, false, nullptr,
-                     key_cache_ptr);
-  tensor::Tensor val(base::DataType::kDataTypeFp32, config_->kv_dim_, false, nullptr,
-                     val_cache_ptr);
-  key.set_device_type(device_type_);
-  val.set_device_type(device_type_);
-  return {key, val};
+void Model::tile_int8_weights(const std::vector<std::shared_ptr<op::Layer>>& layers,
+                              kernel::CudaConfig* cuda_config) const {
+  struct TiledRange {
+    std::shared_ptr<op::MatmulLayer> layer;
+    const int8_t* begin = nullptr;
+    size_t byte_size = 0;
+  };
+  std::vector<TiledRange> ranges;
+  for (const auto& layer : layers) {
+    auto matmul_layer = std::dynamic_pointer_cast<op::MatmulLayer>(layer);
+    if (!matmul_layer || !matmul_layer->is_quant_layer() || matmul_layer->is_int4() ||
+        matmul_layer->is_fp8() || matmul_layer->is_tiled() ||
+        matmul_layer->device_type() != base::DeviceType::kDeviceCUDA) {
+      continue;
+    }
+    // a streamed layer keeps its weight in the host memory
+    const tensor::Tensor& weight = matmul_layer->get_weight(0);
+    if (weight.device_type() != base::DeviceType::kDeviceCUDA) {
+      continue;
+    }
+    ranges.push_back({matmul_layer, weight.ptr<int8_t>(), weight.byte_size()});
+  }
+  // the parts of a fused weight lie in it and are tiled with it
+  std::sort(ranges.begin(), ranges.end(), [](const TiledRange& a, const TiledRange& b) {
+    if (a.begin != b.begin) {
+      return a.begin < b.begin;
+    }
+    return a.byte_size > b.byte_size;
+  });
+  const int32_t tile_rows = kernel::kInt8TileRows;
+  size_t tiled_byte_size = 0;
+  for (size_t i = 0; i < ranges.size();) {
+    const TiledRange& root = ranges.at(i);
+    size_t end = i + 1;
+    while (end < ranges.size() && ranges.at(end).begin < root.begin + root.byte_size) {
+      ++end;
+    }
+    const tensor::Tensor& weight = root.layer->get_weight(0);
+    const int32_t cols = weight.get_dim(1);
+    bool is_tileable = kernel::can_tile_int8_weight(weight, root.layer->get_group_size(),
+                                                    root.layer->get_scales());
+    for (size_t j = i; j < end && is_tileable; ++j) {
+      const auto& part = ranges.at(j).layer;
+      const int32_t rows = part->get_weight(0).get_dim(0);
+      const size_t row_offset = (ranges.at(j).begin - root.begin) / cols;
+      // the gate and the up half of a swiglu weight are tiles of their own
+      const int32_t part_tile_rows = part->is_swiglu_output() ? 2 * tile_rows : tile_rows;
+      is_tileable = row_offset % tile_rows == 0 && rows % part_tile_rows == 0 &&
+                    part->get_group_size() == root.layer->get_group_size() &&
+                    part->get_scales().ptr<float>() ==
+                        root.layer->get_scales().ptr<float>() +
+                            row_offset * (cols / root.layer->get_group_size());
+    }
+    if (is_tileable) {
+      kernel::tile_int8_weight_cu(weight, root.layer->get_group_size(), root.layer->get_scales(),
+                                  cuda_config->stream);
+      for (size_t j = i; j < end; ++j) {
+        ranges.at(j).layer->set_tiled(true);
+      }
+      tiled_byte_size += root.byte_size;
+    }
+    i = end;
+  }
+  if (tiled_byte_size > 0) {
+    LOG(INFO) << "Tiled " << tiled_byte_size << " bytes of int8 weights.";
+  }
 }
 
-tensor::Tensor Model::fill_input(const tensor::Tensor& pos_tensor,
-                                 const op::EmbeddingOutput& embedding_output,
-                                 bool is_prompt) const {
+const tensor::Tensor& Model::fill_input(const tensor::Tensor& pos_tensor,
+                                        const op::EmbeddingOutput& embedding_output,
+                                        bool is_prompt) const {
   const int32_t pos = pos_tensor.index<int32_t>(0);
-  auto [input_tokens, input_embeddings, input_token_num] = embedding_output;
+  const tensor::Tensor& input_embeddings = embedding_output.input_embeddings;
 
   int32_t index = 0;
   if (is_prompt) {
     index = pos;
   }
-  std::shared_ptr<base::Buffer> input_emb_buffer =
-      std::make_shared<base::Buffer>(config_->dim_ * sizeof(float), nullptr,
-                                     input_embeddings.ptr<float>(index * config_->dim_), true);
-
-  tensor::Tensor input(base::DataType::kDataTypeFp32, config_->dim_);
-  input.assign(input_emb_buffer);
-  input.set_device_type(device_type_);
-  return input;
+  input_view_.bind(tensor::TensorView(
+      base::DataType::kDataTypeFp32, device_type_,
+      const_cast<float*>(input_embeddings.ptr<float>(index * config_->dim_)), {config_->dim_}));
+  return input_view_;
 }
 
 }  // namespace model
\ No newline at end of file
@@ -0,0 +1,256 @@
+#include "model/parallel_decoder.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+namespace model {
+ParallelDecoder::ParallelDecoder(const Model& model) : model_(model) {
+  pos_tensor_ = tensor::Tensor(base::DataType::kDataTypeInt32, 1, true,
+                               base::CPUDeviceAllocatorFactory::get_instance());
+}
+
+base::Status ParallelDecoder::check_prompt(const std::vector<int32_t>& prompt_tokens,
+                                           const std::vector<int32_t>& slots) const {
+  const int32_t batch_size = model_.max_batch_size();
+  if (slots.empty() || slots.size() > batch_size) {
+    return base::error::InvalidArgument("The branch number has to fit the max batch size.");
+  }
+  std::vector<bool> is_used(batch_size, false);
+  for (int32_t slot : slots) {
+    if (slot < 0 || slot >= batch_size || is_used.at(slot)) {
+      return base::error::InvalidArgument("The slots have to be distinct slots of the batch.");
+    }
+    is_used.at(slot) = true;
+  }
+  const int32_t prompt_len = static_cast<int32_t>(prompt_tokens.size());
+  if (prompt_len == 0 || prompt_len >= model_.seq_len()) {
+    return base::error::InvalidArgument("The prompt length is out of range.");
+  }
+  return base::error::Success();
+}
+
+base::Status ParallelDecoder::prefill_shared(const std::vector<int32_t>& prompt_tokens,
+                                             const std::vector<int32_t>& slots,
+                                             int32_t branch_num) {
+  release_slots(slots);
+  const int32_t shared_len = static_cast<int32_t>(prompt_tokens.size()) - 1;
+  if (shared_len > 0) {
+    const std::vector<int32_t> shared_tokens(prompt_tokens.begin(), prompt_tokens.end() - 1);
+    pos_tensor_.index<int32_t>(0) = 0;
+    int32_t unused = -1;
+    base::Status status = model_.prefill(model_.embedding(shared_tokens).input_embeddings,
+                                         pos_tensor_, unused, slots.front());
+    if (!status) {
+      return status;
+    }
+  }
+  for (int32_t i = 1; i < branch_num; ++i) {
+    model_.fork_kv_cache(slots.front(), slots.at(i), shared_len);
+  }
+  return base::error::Success();
+}
+
+void ParallelDecoder::release_slots(const std::vector<int32_t>& slots) const {
+  for (int32_t slot : slots) {
+    model_.release_kv_cache(slot);
+  }
+}
+
+base::Status ParallelDecoder::sample(const std::vector<int32_t>& prompt_tokens,
+                                     const std::vector<int32_t>& slots, int32_t max_new_tokens,
+                                     std::vector<Candidate>& candidates) {
+  base::Status status = check_prompt(prompt_tokens, slots);
+  if (!status) {
+    return status;
+  }
+  const int32_t n = static_cast<int32_t>(slots.size());
+  status = prefill_shared(prompt_tokens, slots, n);
+  if (!status) {
+    release_slots(slots);
+    return status;
+  }
+  candidates.assign(n, Candidate());
+  // the candidates which go on and their slots, all of them are at the same position
+  std::vector<int32_t> live(n);
+  std::iota(live.begin(), live.end(), 0);
+  std::vector<int32_t> live_slots = slots;
+  std::vector<int32_t> tokens(n, prompt_tokens.back());
+  int32_t pos = static_cast<int32_t>(prompt_tokens.size()) - 1;
+  std::vector<int32_t> next;
+  while (!live.empty() && max_new_tokens > 0 && pos + 1 < model_.seq_len()) {
+    const std::vector<int32_t> positions(live.size(), pos);
+    status = model_.decode_batch(model_.embedding(tokens).input_embeddings, live_slots, positions,
+                                 next);
+    if (!status) {
+      break;
+    }
+    pos += 1;
+    std::vector<int32_t> next_live;
+    std::vector<int32_t> next_slots;
+    std::vector<int32_t> next_tokens;
+    for (size_t i = 0; i < live.size(); ++i) {
+      Candidate& candidate = candidates.at(live.at(i));
+      if (model_.is_sentence_ending(next.at(i))) {
+        continue;
+      }
+      candidate.tokens.push_back(next.at(i));
+      if (candidate.tokens.size() < max_new_tokens) {
+        next_live.push_back(live.at(i));
+        next_slots.push_back(live_slots.at(i));
+        next_tokens.push_back(next.at(i));
+      }
+    }
+    live = std::move(next_live);
+    live_slots = std::move(next_slots);
+    tokens = std::move(next_tokens);
+  }
+  release_slots(slots);
+  return status;
+}
+
+base::Status ParallelDecoder::beam_search(const std::vector<int32_t>& prompt_tokens,
+                                          const std::vector<int32_t>& slots,
+                                          int32_t max_new_tokens,
+                                          std::vector<Candidate>& candidates) {
+  base::Status status = check_prompt(prompt_tokens, slots);
+  if (!status) {
+    return status;
+  }
+  const int32_t beam_width = static_cast<int32_t>(slots.size());
+  // the first step runs on the prompt alone, its best tokens fork it
+  status = prefill_shared(prompt_tokens, slots, 1);
+  if (!status) {
+    release_slots(slots);
+    return status;
+  }
+
+  struct Beam {
+    Candidate candidate;
+    // the index of its slot in slots
+    int32_t slot_idx = 0;
+    int32_t last = 0;
+    // the index of the beam it extends in the last step
+    int32_t parent = 0;
+  };
+  struct Expansion {
+    float log_prob = 0.f;
+    int32_t beam_idx = 0;
+    int32_t token = 0;
+  };
+  auto score = [](const Candidate& candidate, bool has_end) {
+    return candidate.log_prob / static_cast<float>(candidate.tokens.size() + (has_end ? 1 : 0));
+  };
+  std::vector<Beam> beams(1);
+  beams.front().last = prompt_tokens.back();
+  std::vector<std::pair<float, Candidate>> finished;
+  int32_t pos = static_cast<int32_t>(prompt_tokens.size()) - 1;
+  std::vector<int32_t> next;
+  std::vector<float> logits;
+  std::vector<int32_t> order;
+  for (int32_t step = 0; step < max_new_tokens && !beams.empty() && pos + 1 < model_.seq_len();
+       ++step) {
+    std::vector<int32_t> beam_slots;
+    std::vector<int32_t> tokens;
+    for (const Beam& beam : beams) {
+      beam_slots.push_back(slots.at(beam.slot_idx));
+      tokens.push_back(beam.last);
+    }
+    const std::vector<int32_t> positions(beams.size(), pos);
+    status = model_.decode_batch(model_.embedding(tokens).input_embeddings, beam_slots, positions,
+                                 next, &logits);
+    if (!status) {
+      break;
+    }
+    pos += 1;
+
+    // the best beam_width tokens of every beam hold the best beam_width expansions
+    const int32_t vocab_size = static_cast<int32_t>(logits.size() / beams.size());
+    const int32_t top_num = std::min(beam_width, vocab_size);
+    std::vector<Expansion> expansions;
+    for (int32_t beam_idx = 0; beam_idx < beams.size(); ++beam_idx) {
+      const float* row = logits.data() + static_cast<size_t>(beam_idx) * vocab_size;
+      const float max_logit = *std::max_element(row, row + vocab_size);
+      float sum = 0.f;
+      for (int32_t i = 0; i < vocab_size; ++i) {
+        sum += std::exp(row[i] - max_logit);
+      }
+      const float log_norm = max_logit + std::log(sum);
+      order.resize(vocab_size);
+      std::iota(order.begin(), order.end(), 0);
+      std::partial_sort(order.begin(), order.begin() + top_num, order.end(),
+                        [row](int32_t a, int32_t b) { return row[a] > row[b]; });
+      for (int32_t i = 0; i < top_num; ++i) {
+        const float log_prob = beams.at(beam_idx).candidate.log_prob + row[order.at(i)] - log_norm;
+        expansions.push_back({log_prob, beam_idx, order.at(i)});
+      }
+    }
+    std::sort(expansions.begin(), expansions.end(),
+              [](const Expansion& a, const Expansion& b) { return a.log_prob > b.log_prob; });
+
+    // the ended expansions among the best ones are finished, the others become the beams
+    std::vector<Beam> next_beams;
+    std::vector<int32_t> child_num(beams.size(), 0);
+    for (const Expansion& expansion : expansions) {
+      if (next_beams.size() + finished.size() >= beam_width) {
+        break;
+      }
+      Candidate candidate = beams.at(expansion.beam_idx).candidate;
+      candidate.log_prob = expansion.log_prob;
+      if (model_.is_sentence_ending(expansion.token)) {
+        finished.emplace_back(score(candidate, true), std::move(candidate));
+        continue;
+      }
+      candidate.tokens.push_back(expansion.token);
+      Beam beam;
+      beam.candidate = std::move(candidate);
+      beam.parent = expansion.beam_idx;
+      beam.last = expansion.token;
+      child_num.at(expansion.beam_idx) += 1;
+      next_beams.push_back(std::move(beam));
+    }
+
+    // a beam without a child frees its slot, the first child of a beam keeps the slot and the
+    // others fork it, which shares every block written so far
+    std::vector<int32_t> free_slots;
+    std::vector<bool> is_used(beam_width, false);
+    for (size_t beam_idx = 0; beam_idx < beams.size(); ++beam_idx) {
+      is_used.at(beams.at(beam_idx).slot_idx) = child_num.at(beam_idx) > 0;
+    }
+    for (int32_t slot_idx = beam_width - 1; slot_idx >= 0; --slot_idx) {
+      if (!is_used.at(slot_idx)) {
+        model_.release_kv_cache(slots.at(slot_idx));
+        free_slots.push_back(slot_idx);
+      }
+    }
+    std::vector<bool> is_claimed(beams.size(), false);
+    for (Beam& beam : next_beams) {
+      const int32_t parent_slot_idx = beams.at(beam.parent).slot_idx;
+      if (!is_claimed.at(beam.parent)) {
+        is_claimed.at(beam.parent) = true;
+        beam.slot_idx = parent_slot_idx;
+      } else {
+        CHECK(!free_slots.empty());
+        beam.slot_idx = free_slots.back();
+        free_slots.pop_back();
+        model_.fork_kv_cache(slots.at(parent_slot_idx), slots.at(beam.slot_idx), pos);
+      }
+    }
+    beams = std::move(next_beams);
+    if (finished.size() >= beam_width) {
+      break;
+    }
+  }
+
+  for (Beam& beam : beams) {
+    finished.emplace_back(score(beam.candidate, false), std::move(beam.candidate));
+  }
+  std::stable_sort(finished.begin(), finished.end(),
+                   [](const auto& a, const auto& b) { return a.first > b.first; });
+  candidates.clear();
+  for (int32_t i = 0; i < finished.size() && i < beam_width; ++i) {
+    candidates.push_back(std::move(finished.at(i).second));
+  }
+  release_slots(slots);
+  return status;
+}
+}  // namespace model
@@ -0,0 +1,116 @@
+#include "model/prefix_cache.h"
+#include <glog/logging.h>
+#include <algorithm>
+namespace model {
+PrefixCache::PrefixCache(PagedKVCache* kv_cache, int32_t max_block_num)
+    : kv_cache_(kv_cache), max_block_num_(max_block_num) {
+  CHECK(kv_cache_ != nullptr);
+  CHECK_GT(max_block_num_, 0);
+}
+
+PrefixCache::~PrefixCache() { release_tree(&root_); }
+
+int32_t PrefixCache::match(const std::vector<int32_t>& tokens, int32_t slot) {
+  const int32_t block_size = kv_cache_->block_size();
+  const int32_t max_match_num = (static_cast<int32_t>(tokens.size()) - 1) / block_size;
+  std::vector<int32_t> blocks;
+  Node* node = &root_;
+  access_tick_ += 1;
+  for (int32_t i = 0; i < max_match_num; ++i) {
+    std::vector<int32_t> key(tokens.begin() + i * block_size,
+                             tokens.begin() + (i + 1) * block_size);
+    auto iter = node->children.find(key);
+    if (iter == node->children.end()) {
+      break;
+    }
+    node = iter->second.get();
+    node->last_access = access_tick_;
+    blocks.push_back(node->block);
+  }
+  if (!blocks.empty()) {
+    kv_cache_->share(slot, blocks);
+  }
+  return static_cast<int32_t>(blocks.size()) * block_size;
+}
+
+void PrefixCache::insert(const std::vector<int32_t>& tokens, int32_t slot) {
+  const int32_t block_size = kv_cache_->block_size();
+  const std::vector<int32_t>& slot_blocks = kv_cache_->blocks(slot);
+  const int32_t full_block_num =
+      std::min(static_cast<int32_t>(tokens.size()) / block_size,
+               static_cast<int32_t>(slot_blocks.size()));
+  Node* node = &root_;
+  access_tick_ += 1;
+  for (int32_t i = 0; i < full_block_num; ++i) {
+    std::vector<int32_t> key(tokens.begin() + i * block_size,
+                             tokens.begin() + (i + 1) * block_size);
+    auto iter = node->children.find(key);
+    if (iter == node->children.end()) {
+      // a prefix computed twice keeps the block which was cached first
+      auto child = std::make_unique<Node>();
+      child->tokens = key;
+      child->block = slot_blocks.at(i);
+      child->parent = node;
+      kv_cache_->ref_block(child->block);
+      cached_block_num_ += 1;
+      iter = node->children.emplace(std::move(key), std::move(child)).first;
+    }
+    node = iter->second.get();
+    node->last_access = access_tick_;
+  }
+  while (cached_block_num_ > max_block_num_) {
+    if (!evict_one()) {
+      break;
+    }
+  }
+}
+
+bool PrefixCache::evict(int32_t block_num) {
+  while (kv_cache_->free_block_num() < block_num) {
+    if (!evict_one()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int32_t PrefixCache::cached_block_num() const { return cached_block_num_; }
+
+bool PrefixCache::is_evictable(const Node* node) const {
+  return node != &root_ && node->children.empty() && kv_cache_->block_ref(node->block) == 1;
+}
+
+PrefixCache::Node* PrefixCache::oldest_evictable(Node* node) const {
+  if (is_evictable(node)) {
+    return node;
+  }
+  Node* oldest = nullptr;
+  for (auto& [key, child] : node->children) {
+    Node* candidate = oldest_evictable(child.get());
+    if (candidate && (!oldest || candidate->last_access < oldest->last_access)) {
+      oldest = candidate;
+    }
+  }
+  return oldest;
+}
+
+bool PrefixCache::evict_one() {
+  Node* node = oldest_evictable(&root_);
+  if (!node) {
+    return false;
+  }
+  kv_cache_->unref_block(node->block);
+  cached_block_num_ -= 1;
+  const std::vector<int32_t> key = node->tokens;
+  node->parent->children.erase(key);
+  return true;
+}
+
+void PrefixCache::release_tree(Node* node) {
+  for (auto& [key, child] : node->children) {
+    release_tree(child.get());
+    kv_cache_->unref_block(child->block);
+  }
+  node->children.clear();
+}
+}  // namespace model
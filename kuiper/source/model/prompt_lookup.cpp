@@ -0,0 +1,36 @@
+#include "model/prompt_lookup.h"
+#include <glog/logging.h>
+#include <algorithm>
+namespace model {
+std::vector<int32_t> lookup_ngram_draft(const std::vector<int32_t>& history, int32_t min_ngram,
+                                        int32_t max_ngram, int32_t draft_len) {
+  const int32_t history_len = static_cast<int32_t>(history.size());
+  for (int32_t n = std::min(max_ngram, history_len - 1); n >= min_ngram; --n) {
+    const int32_t suffix_begin = history_len - n;
+    // the latest match is the closest to the current context
+    for (int32_t begin = suffix_begin - 1; begin >= 0; --begin) {
+      if (!std::equal(history.begin() + begin, history.begin() + begin + n,
+                      history.begin() + suffix_begin)) {
+        continue;
+      }
+      const int32_t draft_begin = begin + n;
+      const int32_t draft_end = std::min(draft_begin + draft_len, history_len);
+      return std::vector<int32_t>(history.begin() + draft_begin, history.begin() + draft_end);
+    }
+  }
+  return {};
+}
+
+PromptLookupDecoder::PromptLookupDecoder(const Model& model, int32_t draft_len,
+                                         int32_t min_ngram, int32_t max_ngram)
+    : DraftVerifyDecoder(model, draft_len), min_ngram_(min_ngram), max_ngram_(max_ngram) {
+  CHECK_GT(min_ngram, 0);
+  CHECK_GE(max_ngram, min_ngram);
+}
+
+base::Status PromptLookupDecoder::propose(const std::vector<int32_t>& history, int32_t pos,
+                                          int32_t max_len, std::vector<int32_t>& draft) {
+  draft = lookup_ngram_draft(history, min_ngram_, max_ngram_, max_len);
+  return base::error::Success();
+}
+}  // namespace model
@@ -1,10 +1,19 @@
 #include "model/raw_model_data.h"
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
 #include <sys/mman.h>
 #include <unistd.h>
 namespace model {
+// the size of a transparent huge page on x86-64 and on the 4k granule of arm64
+constexpr size_t kHugePageSize = size_t(2) << 20;
+
 RawModelData::~RawModelData() {
+  if (device_data != nullptr) {
+    cudaHostUnregister(data);
+    device_data = nullptr;
+  }
   if (data != nullptr && data != MAP_FAILED) {
-    munmap(data, file_size);
+    munmap(data, map_size);
     data = nullptr;
   }
   if (fd != -1) {
@@ -13,6 +22,119 @@ RawModelData::~RawModelData() {
   }
 }
 
+static void* map_huge_page_copy(int32_t fd, size_t file_size, size_t& map_size) {
+  map_size = (file_size + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+  // one extra huge page leaves room to move the start onto a huge page boundary
+  const size_t reserve_size = map_size + kHugePageSize;
+  void* reserved =
+      mmap(nullptr, reserve_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (reserved == MAP_FAILED) {
+    return MAP_FAILED;
+  }
+  uintptr_t begin = reinterpret_cast<uintptr_t>(reserved);
+  uintptr_t aligned = (begin + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+  if (aligned > begin) {
+    munmap(reserved, aligned - begin);
+  }
+  uintptr_t end = aligned + map_size;
+  if (begin + reserve_size > end) {
+    munmap(reinterpret_cast<void*>(end), begin + reserve_size - end);
+  }
+  void* region = reinterpret_cast<void*>(aligned);
+  if (madvise(region, map_size, MADV_HUGEPAGE) != 0) {
+    LOG(WARNING) << "The transparent huge pages are not available for the weights, they are "
+                    "copied into normal pages.";
+  }
+
+  auto* dst = static_cast<char*>(region);
+  size_t offset = 0;
+  while (offset < file_size) {
+    ssize_t read_size = pread(fd, dst + offset, file_size - offset, static_cast<off_t>(offset));
+    if (read_size <= 0) {
+      munmap(region, map_size);
+      return MAP_FAILED;
+    }
+    offset += static_cast<size_t>(read_size);
+  }
+  // the weights are read only from here on
+  mprotect(region, map_size, PROT_READ);
+  return region;
+}
+
+bool RawModelData::map(const WeightLoadOptions& options) {
+  if (options.huge_page) {
+    data = map_huge_page_copy(fd, file_size, map_size);
+  } else {
+    map_size = file_size;
+    int32_t flags = MAP_PRIVATE;
+    if (options.populate) {
+      flags |= MAP_POPULATE;
+    }
+    data = mmap(nullptr, map_size, PROT_READ, flags, fd, 0);
+    if (data != MAP_FAILED && options.populate) {
+      // MAP_POPULATE is only a hint on some kernels, the read ahead makes up for it
+      madvise(data, map_size, MADV_WILLNEED);
+    }
+  }
+  if (data == MAP_FAILED || data == nullptr) {
+    data = nullptr;
+    return false;
+  }
+  if (options.lock && mlock(data, map_size) != 0) {
+    LOG(WARNING) << "Failed to lock the " << map_size
+                 << " bytes of the weights in the memory, raise the memlock limit to pin them.";
+  }
+  if (options.unified_memory) {
+    int device = 0;
+    int integrated = 0;
+    cudaGetDevice(&device);
+    cudaDeviceGetAttribute(&integrated, cudaDevAttrIntegrated, device);
+    if (!integrated) {
+      LOG(WARNING) << "The cuda device is not integrated, it reads the weights in place over "
+                      "the bus.";
+    }
+    // the mapping is read only, so the device gets a read only view of it
+    if (cudaHostRegister(data, map_size, cudaHostRegisterMapped | cudaHostRegisterReadOnly) !=
+        cudaSuccess) {
+      cudaGetLastError();
+      LOG(WARNING) << "Failed to register the weights with the cuda device, they are copied "
+                      "into device allocations.";
+    } else if (cudaHostGetDevicePointer(&device_data, data, 0) != cudaSuccess) {
+      cudaGetLastError();
+      cudaHostUnregister(data);
+      device_data = nullptr;
+      LOG(WARNING) << "The registered weights have no device address, they are copied into "
+                      "device allocations.";
+    }
+  }
+  return true;
+}
+
+void* RawModelData::device_ptr(const void* host_ptr, size_t byte_size) const {
+  if (device_data == nullptr) {
+    return nullptr;
+  }
+  const auto* begin = static_cast<const uint8_t*>(data);
+  const auto* ptr = static_cast<const uint8_t*>(host_ptr);
+  if (ptr < begin || ptr + byte_size > begin + map_size) {
+    return nullptr;
+  }
+  auto* device_ptr = static_cast<uint8_t*>(device_data) + (ptr - begin);
+  if (reinterpret_cast<uintptr_t>(device_ptr) % kDeviceWeightAlignment != 0) {
+    return nullptr;
+  }
+  return device_ptr;
+}
+
+void* RawModelDataSafetensors::device_ptr(const void* host_ptr, size_t byte_size) const {
+  for (const auto& shard : shards) {
+    if (void* ptr = shard->device_ptr(host_ptr, byte_size)) {
+      return ptr;
+    }
+  }
+  return nullptr;
+}
+
 const void* RawModelDataFp32::weight(size_t offset) const {
   return static_cast<float*>(weight_data) + offset;
 }
@@ -20,4 +142,12 @@ const void* RawModelDataFp32::weight(size_t offset) const {
 const void* RawModelDataInt8::weight(size_t offset) const {
   return static_cast<int8_t*>(weight_data) + offset;
 }
-}  // namespace model
\ No newline at end of file
+
+const void* RawModelDataFp16::weight(size_t offset) const {
+  return static_cast<uint16_t*>(weight_data) + offset;
+}
+
+const void* RawModelDataGguf::weight(size_t offset) const {
+  return static_cast<int8_t*>(data) + offset;
+}
+}  // namespace model
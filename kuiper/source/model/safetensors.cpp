@@ -0,0 +1,672 @@
+#include "model/safetensors.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include "base/half.h"
+#include "base/thread_pool.h"
+#include "model/int4_import.h"
+#include "op/matmul.h"
+#if defined(LLAMA3_SUPPORT) || defined(QWEN2_SUPPORT)
+#include "nlohmann/json.hpp"
+#endif
+namespace model {
+namespace {
+const std::string kSafetensorsSuffix = ".safetensors";
+
+bool ends_with(const std::string& value, const std::string& suffix) {
+  return value.size() >= suffix.size() &&
+         value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+base::DataType safetensors_data_type(const std::string& dtype) {
+  if (dtype == "F32") {
+    return base::DataType::kDataTypeFp32;
+  } else if (dtype == "F16") {
+    return base::DataType::kDataTypeFp16;
+  } else if (dtype == "BF16") {
+    return base::DataType::kDataTypeBf16;
+  } else if (dtype == "I32") {
+    return base::DataType::kDataTypeInt32;
+  }
+  return base::DataType::kDataTypeUnknown;
+}
+
+float read_element(base::DataType data_type, const uint8_t* src, size_t idx) {
+  if (data_type == base::DataType::kDataTypeFp32) {
+    float value = 0.f;
+    memcpy(&value, src + idx * sizeof(float), sizeof(float));
+    return value;
+  }
+  uint16_t half = 0;
+  memcpy(&half, src + idx * sizeof(uint16_t), sizeof(uint16_t));
+  return data_type == base::DataType::kDataTypeFp16 ? base::half_to_float(half)
+                                                    : base::bf16_to_float(half);
+}
+
+void write_element(base::DataType data_type, float value, uint8_t* dst, size_t idx) {
+  if (data_type == base::DataType::kDataTypeFp32) {
+    reinterpret_cast<float*>(dst)[idx] = value;
+  } else if (data_type == base::DataType::kDataTypeFp16) {
+    reinterpret_cast<uint16_t*>(dst)[idx] = base::float_to_half(value);
+  } else {
+    reinterpret_cast<uint16_t*>(dst)[idx] = base::float_to_bf16(value);
+  }
+}
+
+// the export name of a huggingface tensor, empty for the tensors the model does not read
+std::string export_name(const std::string& name) {
+  static const std::map<std::string, std::string> kModelNames = {
+      {"model.embed_tokens.weight", "tok_embeddings.weight"},
+      {"model.norm.weight", "norm.weight"},
+      {"lm_head.weight", "output.weight"}};
+  static const std::map<std::string, std::string> kLayerNames = {
+      {"input_layernorm.weight", "attention_norm.weight"},
+      {"self_attn.q_proj.weight", "attention.wq.weight"},
+      {"self_attn.q_proj.bias", "attention.wq.bias"},
+      {"self_attn.k_proj.weight", "attention.wk.weight"},
+      {"self_attn.k_proj.bias", "attention.wk.bias"},
+      {"self_attn.v_proj.weight", "attention.wv.weight"},
+      {"self_attn.v_proj.bias", "attention.wv.bias"},
+      {"self_attn.o_proj.weight", "attention.wo.weight"},
+      {"post_attention_layernorm.weight", "ffn_norm.weight"},
+      {"mlp.gate_proj.weight", "feed_forward.w1.weight"},
+      {"mlp.down_proj.weight", "feed_forward.w2.weight"},
+      {"mlp.up_proj.weight", "feed_forward.w3.weight"}};
+  auto model_iter = kModelNames.find(name);
+  if (model_iter != kModelNames.end()) {
+    return model_iter->second;
+  }
+  const std::string layer_prefix = "model.layers.";
+  if (name.compare(0, layer_prefix.size(), layer_prefix) != 0) {
+    return "";
+  }
+  const size_t dot = name.find('.', layer_prefix.size());
+  if (dot == std::string::npos) {
+    return "";
+  }
+  auto layer_iter = kLayerNames.find(name.substr(dot + 1));
+  if (layer_iter == kLayerNames.end()) {
+    return "";
+  }
+  return "layers." + name.substr(layer_prefix.size(), dot - layer_prefix.size()) + "." +
+         layer_iter->second;
+}
+
+// the quantization_config of an autogptq or autoawq checkpoint
+struct Int4Config {
+  bool is_int4 = false;
+  Int4Format format = Int4Format::kGptq;
+  // of the layout of MatmulLayer
+  int32_t group_size = 0;
+  bool is_zero_point_offset = false;
+};
+
+// a tensor of a linear layer of an int4 checkpoint in its shard
+struct Int4Part {
+  const SafetensorsTensor* tensor = nullptr;
+  const uint8_t* shard_data = nullptr;
+};
+
+struct Int4Parts {
+  Int4Part qweight;
+  Int4Part qzeros;
+  Int4Part scales;
+  Int4Part g_idx;
+};
+
+// the export name of the weight of a tensor, part is the name of the int4 part of the weight
+// which the tensor is and empty for a tensor of its own
+std::string weight_export_name(const std::string& name, std::string& part) {
+  part.clear();
+  for (const char* int4_part : {"qweight", "qzeros", "scales", "g_idx"}) {
+    const std::string suffix = std::string(".") + int4_part;
+    if (ends_with(name, suffix)) {
+      part = int4_part;
+      return export_name(name.substr(0, name.size() - suffix.size()) + ".weight");
+    }
+  }
+  return export_name(name);
+}
+
+// the shard files of path in the name order and the directory of its config.json
+base::Status list_shards(const std::string& path, std::vector<std::string>& shards,
+                         std::string& model_dir) {
+  struct stat st;
+  if (stat(path.data(), &st) == -1) {
+    return base::error::PathNotValid("Failed to open the safetensors model " + path + ".");
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    shards.push_back(path);
+    const size_t slash = path.rfind('/');
+    model_dir = slash == std::string::npos ? "." : path.substr(0, slash);
+    return base::error::Success();
+  }
+  model_dir = path;
+  DIR* dir = opendir(path.data());
+  if (dir == nullptr) {
+    return base::error::PathNotValid("Failed to list the safetensors model " + path + ".");
+  }
+  while (dirent* entry = readdir(dir)) {
+    const std::string name = entry->d_name;
+    if (ends_with(name, kSafetensorsSuffix)) {
+      shards.push_back(path + "/" + name);
+    }
+  }
+  closedir(dir);
+  std::sort(shards.begin(), shards.end());
+  if (shards.empty()) {
+    return base::error::PathNotValid("The directory " + path + " has no safetensors files.");
+  }
+  return base::error::Success();
+}
+}  // namespace
+
+bool is_safetensors_path(const std::string& path) {
+  struct stat st;
+  if (stat(path.data(), &st) == 0 && S_ISDIR(st.st_mode)) {
+    return true;
+  }
+  return ends_with(path, kSafetensorsSuffix);
+}
+
+#if defined(LLAMA3_SUPPORT) || defined(QWEN2_SUPPORT)
+using json = nlohmann::json;
+
+base::Status parse_safetensors(const void* data, size_t file_size,
+                               std::vector<SafetensorsTensor>& tensors) {
+  using namespace base;
+  uint64_t header_size = 0;
+  if (file_size < sizeof(header_size)) {
+    return error::ModelParseError("The safetensors file is too small for its header.");
+  }
+  memcpy(&header_size, data, sizeof(header_size));
+  if (header_size > file_size - sizeof(header_size)) {
+    return error::ModelParseError("The safetensors header runs past the end of the file.");
+  }
+  const char* header = static_cast<const char*>(data) + sizeof(header_size);
+  json root;
+  try {
+    root = json::parse(header, header + header_size);
+  } catch (json::exception&) {
+    return error::ModelParseError("The safetensors header is not valid json.");
+  }
+  if (!root.is_object()) {
+    return error::ModelParseError("The safetensors header is not a json object.");
+  }
+  const size_t data_begin = sizeof(header_size) + header_size;
+  for (const auto& item : root.items()) {
+    if (item.key() == "__metadata__") {
+      continue;
+    }
+    const json& value = item.value();
+    if (!value.is_object() || !value.contains("dtype") || !value.contains("shape") ||
+        !value.contains("data_offsets") || value["data_offsets"].size() != 2) {
+      return error::ModelParseError("The safetensors tensor " + item.key() +
+                                    " has no dtype, shape or data offsets.");
+    }
+    SafetensorsTensor tensor;
+    tensor.name = item.key();
+    tensor.data_type = safetensors_data_type(value["dtype"].get<std::string>());
+    size_t element_num = 1;
+    for (const json& dim : value["shape"]) {
+      tensor.dims.push_back(dim.get<int32_t>());
+      element_num *= tensor.dims.back();
+    }
+    const auto begin = value["data_offsets"][0].get<size_t>();
+    const auto end = value["data_offsets"][1].get<size_t>();
+    if (begin > end || end > file_size - data_begin) {
+      return error::ModelParseError("The safetensors tensor " + tensor.name +
+                                    " runs past the end of the file.");
+    }
+    tensor.offset = data_begin + begin;
+    tensor.byte_size = end - begin;
+    if (tensor.data_type != DataType::kDataTypeUnknown &&
+        tensor.byte_size != element_num * DataTypeSize(tensor.data_type)) {
+      return error::ModelParseError("The byte size of the safetensors tensor " + tensor.name +
+                                    " does not match its shape.");
+    }
+    tensors.push_back(std::move(tensor));
+  }
+  return error::Success();
+}
+
+// the config of the model from the config.json of the checkpoint
+static base::Status read_hf_config(const std::string& model_dir, std::string& model_type,
+                                   SafetensorsModelInfo& info, Int4Config& int4_config) {
+  using namespace base;
+  const std::string config_path = model_dir + "/config.json";
+  std::ifstream f(config_path);
+  if (!f.is_open()) {
+    return error::PathNotValid("Failed to open the model config " + config_path + ".");
+  }
+  json config_json;
+  try {
+    config_json = json::parse(f);
+  } catch (json::exception&) {
+    return error::ModelParseError("The model config " + config_path + " is not valid json.");
+  }
+  model_type = config_json.value("model_type", std::string());
+  if (model_type != "llama" && model_type != "mistral" && model_type != "qwen2") {
+    return error::ModelParseError("The model type " + model_type + " is not supported.");
+  }
+  ModelConfig& config = info.config;
+  config.dim = config_json.value("hidden_size", 0);
+  config.hidden_dim = config_json.value("intermediate_size", 0);
+  config.layer_num = config_json.value("num_hidden_layers", 0);
+  config.head_num = config_json.value("num_attention_heads", 0);
+  config.kv_head_num = config_json.value("num_key_value_heads", config.head_num);
+  config.seq_len = std::min(config_json.value("max_position_embeddings", 2048),
+                            kSafetensorsMaxSeqLen);
+  if (config.dim <= 0 || config.hidden_dim <= 0 || config.layer_num <= 0 ||
+      config.head_num <= 0 || config.kv_head_num <= 0) {
+    return error::ModelParseError("The model config " + config_path +
+                                  " misses the size of the model.");
+  }
+  info.rope_theta = config_json.value("rope_theta", 10000.f);
+  // the scaling the checkpoint was extended with, rope_type in the newer configs
+  const auto scaling_iter = config_json.find("rope_scaling");
+  if (scaling_iter != config_json.end() && scaling_iter->is_object()) {
+    const auto& scaling_json = *scaling_iter;
+    const std::string type_name =
+        scaling_json.value("rope_type", scaling_json.value("type", std::string()));
+    base::RoPEScaling& scaling = info.rope_scaling;
+    if (!base::parse_rope_scaling_type(type_name, scaling.type)) {
+      return error::ModelParseError("The rope scaling " + type_name + " is not supported.");
+    }
+    scaling.factor = scaling_json.value("factor", 1.f);
+    scaling.original_max_pos = scaling_json.value(
+        "original_max_position_embeddings", config_json.value("max_position_embeddings", 0));
+    scaling.low_freq_factor = scaling_json.value("low_freq_factor", scaling.low_freq_factor);
+    scaling.high_freq_factor = scaling_json.value("high_freq_factor", scaling.high_freq_factor);
+    scaling.beta_fast = scaling_json.value("beta_fast", scaling.beta_fast);
+    scaling.beta_slow = scaling_json.value("beta_slow", scaling.beta_slow);
+    scaling.attention_factor = scaling_json.value("attention_factor", 0.f);
+  }
+  // the 4 bit checkpoints of autogptq and autoawq, the version of awq names its packing
+  const auto quant_iter = config_json.find("quantization_config");
+  if (quant_iter != config_json.end() && quant_iter->is_object()) {
+    const auto& quant_json = *quant_iter;
+    const std::string method = quant_json.value("quant_method", std::string());
+    if (method == "gptq") {
+      int4_config.format = Int4Format::kGptq;
+      // the zero points of the v1 format are stored minus one
+      int4_config.is_zero_point_offset =
+          quant_json.value("checkpoint_format", std::string("gptq")) != "gptq_v2";
+    } else if (method == "awq") {
+      int4_config.format = Int4Format::kAwq;
+      const std::string version = quant_json.value("version", std::string("gemm"));
+      if (version != "gemm" && version != "GEMM") {
+        return error::ModelParseError("The awq version " + version + " is not supported.");
+      }
+      if (!quant_json.value("zero_point", true)) {
+        return error::ModelParseError("The awq checkpoints without zero points are not "
+                                      "supported.");
+      }
+    } else {
+      return error::ModelParseError("The quant method " + method + " is not supported.");
+    }
+    if (quant_json.value("bits", quant_json.value("w_bit", 0)) != 4) {
+      return error::ModelParseError("The " + method + " checkpoint is not a 4 bit one.");
+    }
+    const int32_t group_size = quant_json.value("group_size", quant_json.value("q_group_size", -1));
+    int4_config.is_int4 = true;
+    int4_config.group_size = group_size > 0 ? group_size : kInt4PerChannelGroupSize;
+    if (int4_config.group_size % 32 != 0) {
+      return error::ModelParseError("The int4 kernels need groups of a multiple of 32 columns.");
+    }
+  }
+  return error::Success();
+}
+
+// the int32 tensor at part, copied into storage when the shard does not align it
+static const int32_t* int4_part_data(const Int4Part& part, std::vector<int32_t>& storage) {
+  const uint8_t* data = part.shard_data + part.tensor->offset;
+  if (reinterpret_cast<uintptr_t>(data) % sizeof(int32_t) == 0) {
+    return reinterpret_cast<const int32_t*>(data);
+  }
+  storage.resize(part.tensor->byte_size / sizeof(int32_t));
+  memcpy(storage.data(), data, storage.size() * sizeof(int32_t));
+  return storage.data();
+}
+
+static bool has_dims(const Int4Part& part, base::DataType data_type,
+                     const std::vector<int32_t>& dims) {
+  return part.tensor != nullptr && part.tensor->data_type == data_type &&
+         part.tensor->dims == dims;
+}
+
+// repacks the linear layer of an int4 checkpoint at parts into the layout of MatmulLayer, the
+// order of an act order one is added as the tensor <name>.order next to the weight
+static base::Status add_int4_parts(const std::string& name, const Int4Parts& parts,
+                                   const Int4Config& int4_config,
+                                   RawModelDataSafetensors& raw_data, TensorDirectory& directory) {
+  using namespace base;
+  if (parts.qweight.tensor == nullptr || parts.scales.tensor == nullptr ||
+      parts.qweight.tensor->dims.size() != 2 || parts.scales.tensor->dims.size() != 2) {
+    return error::ModelParseError("The int4 weight " + name + " misses its qweight or scales.");
+  }
+  Int4Source src;
+  src.format = int4_config.format;
+  src.is_zero_point_offset = int4_config.is_zero_point_offset;
+  const std::vector<int32_t>& qweight_dims = parts.qweight.tensor->dims;
+  if (src.format == Int4Format::kGptq) {
+    src.rows = qweight_dims.at(1);
+    src.cols = qweight_dims.at(0) * 8;
+  } else {
+    src.rows = qweight_dims.at(1) * 8;
+    src.cols = qweight_dims.at(0);
+  }
+  const int32_t src_group_num = parts.scales.tensor->dims.at(0);
+  if (src_group_num <= 0 || src.cols % src_group_num != 0) {
+    return error::ModelParseError("The scales of the int4 weight " + name +
+                                  " do not split its columns into groups.");
+  }
+  src.group_size = src.cols / src_group_num;
+  if (!has_dims(parts.qweight, DataType::kDataTypeInt32, qweight_dims) ||
+      !has_dims(parts.qzeros, DataType::kDataTypeInt32, {src_group_num, src.rows / 8}) ||
+      !has_dims(parts.scales, DataType::kDataTypeFp16, {src_group_num, src.rows}) ||
+      (parts.g_idx.tensor && !has_dims(parts.g_idx, DataType::kDataTypeInt32, {src.cols}))) {
+    return error::ModelParseError("The int4 weight " + name +
+                                  " has parts of an unexpected type or shape.");
+  }
+  std::vector<int32_t> qweight_storage;
+  std::vector<int32_t> qzeros_storage;
+  std::vector<int32_t> g_idx_storage;
+  src.qweight = int4_part_data(parts.qweight, qweight_storage);
+  src.qzeros = int4_part_data(parts.qzeros, qzeros_storage);
+  src.scales = reinterpret_cast<const uint16_t*>(parts.scales.shard_data +
+                                                 parts.scales.tensor->offset);
+  if (reinterpret_cast<uintptr_t>(src.scales) % sizeof(uint16_t) != 0) {
+    return error::ModelParseError("The scales of the int4 weight " + name + " are not aligned.");
+  }
+  if (parts.g_idx.tensor) {
+    src.g_idx = int4_part_data(parts.g_idx, g_idx_storage);
+  }
+
+  raw_data.converted.emplace_back();
+  std::vector<uint8_t>& packed = raw_data.converted.back();
+  std::vector<int32_t> order;
+  auto repack_status = repack_int4_weight(src, int4_config.group_size, packed, order);
+  if (!repack_status) {
+    return error::ModelParseError("The int4 weight " + name + ": " + repack_status.get_err_msg());
+  }
+  TensorInfo weight_info;
+  weight_info.data_type = DataType::kDataTypeInt8;
+  weight_info.dims = {src.rows, src.cols};
+  weight_info.byte_size = packed.size();
+  weight_info.data = packed.data();
+  if (!directory.add(name, std::move(weight_info))) {
+    return error::ModelParseError("The safetensors tensor " + name + " is in more than one shard.");
+  }
+  if (order.empty()) {
+    return error::Success();
+  }
+  raw_data.converted.emplace_back(order.size() * sizeof(int32_t));
+  memcpy(raw_data.converted.back().data(), order.data(), order.size() * sizeof(int32_t));
+  TensorInfo order_info;
+  order_info.data_type = DataType::kDataTypeInt32;
+  order_info.dims = {src.cols};
+  order_info.byte_size = raw_data.converted.back().size();
+  order_info.data = raw_data.converted.back().data();
+  directory.add(int4_order_name(name), std::move(order_info));
+  return error::Success();
+}
+
+// quantizes the float weight tensor at src into the int4 layout of MatmulLayer, for the layers an
+// int4 checkpoint keeps in float
+static base::Status add_quantized_int4_tensor(const std::string& name,
+                                              const SafetensorsTensor& tensor,
+                                              const uint8_t* src, int32_t group_size,
+                                              RawModelDataSafetensors& raw_data,
+                                              TensorDirectory& directory) {
+  using namespace base;
+  const int32_t rows = tensor.dims.at(0);
+  const int32_t cols = tensor.dims.at(1);
+  if (cols % group_size != 0) {
+    return error::ModelParseError("The columns of the safetensors tensor " + tensor.name +
+                                  " do not split into the int4 groups.");
+  }
+  LOG(WARNING) << "The float tensor " << tensor.name << " is quantized to int4 groups of "
+               << group_size;
+  raw_data.converted.emplace_back(op::MatmulLayer::int4_byte_size(rows, cols, group_size, true));
+  uint8_t* dst = raw_data.converted.back().data();
+  ThreadPoolFactory::get_instance()->parallel_for(rows, 16, [&](int32_t begin, int32_t end) {
+    std::vector<float> row(cols);
+    for (int32_t row_idx = begin; row_idx < end; ++row_idx) {
+      for (int32_t j = 0; j < cols; ++j) {
+        row[j] = read_element(tensor.data_type, src, static_cast<size_t>(row_idx) * cols + j);
+      }
+      quantize_int4_row(row.data(), row_idx, rows, cols, group_size, dst);
+    }
+  });
+  TensorInfo info;
+  info.data_type = DataType::kDataTypeInt8;
+  info.dims = tensor.dims;
+  info.byte_size = raw_data.converted.back().size();
+  info.data = dst;
+  if (!directory.add(name, std::move(info))) {
+    return error::ModelParseError("The safetensors tensor " + tensor.name +
+                                  " is in more than one shard.");
+  }
+  return error::Success();
+}
+
+base::Status load_safetensors_model(const std::string& path, const WeightLoadOptions& options,
+                                    RawModelDataSafetensors& raw_data, TensorDirectory& directory,
+                                    SafetensorsModelInfo& info) {
+  using namespace base;
+  std::vector<std::string> shard_paths;
+  std::string model_dir;
+  auto list_status = list_shards(path, shard_paths, model_dir);
+  if (!list_status) {
+    return list_status;
+  }
+  std::string model_type;
+  Int4Config int4_config;
+  auto config_status = read_hf_config(model_dir, model_type, info, int4_config);
+  if (!config_status) {
+    return config_status;
+  }
+
+  // the shards are mapped and their headers parsed in parallel, the populate and the huge
+  // page copy of the options read the shards concurrently then
+  const auto shard_num = static_cast<int32_t>(shard_paths.size());
+  std::vector<std::vector<SafetensorsTensor>> shard_tensors(shard_num);
+  std::vector<Status> shard_status(shard_num, error::Success());
+  raw_data.shards.resize(shard_num);
+  ThreadPoolFactory::get_instance()->parallel_for(shard_num, 1, [&](int32_t begin, int32_t end) {
+    for (int32_t i = begin; i < end; ++i) {
+      auto shard = std::make_unique<RawModelDataGguf>();
+      shard->fd = open(shard_paths[i].data(), O_RDONLY);
+      struct stat st;
+      if (shard->fd == -1 || fstat(shard->fd, &st) == -1) {
+        shard_status[i] = error::PathNotValid("Failed to open the shard " + shard_paths[i]);
+        continue;
+      }
+      shard->file_size = st.st_size;
+      if (!shard->map(options)) {
+        shard_status[i] = error::ModelParseError("Failed to map the shard " + shard_paths[i] +
+                                                 " into memory.");
+        continue;
+      }
+      shard->weight_data = shard->data;
+      shard_status[i] = parse_safetensors(shard->data, shard->file_size, shard_tensors[i]);
+      raw_data.shards[i] = std::move(shard);
+    }
+  });
+  for (int32_t i = 0; i < shard_num; ++i) {
+    if (!shard_status[i]) {
+      return shard_status[i];
+    }
+  }
+
+  const SafetensorsTensor* query = nullptr;
+  const SafetensorsTensor* embedding = nullptr;
+  int32_t embedding_shard = 0;
+  bool is_shared_weight = true;
+  std::string part;
+  for (int32_t i = 0; i < shard_num; ++i) {
+    for (const SafetensorsTensor& tensor : shard_tensors[i]) {
+      const std::string name = weight_export_name(tensor.name, part);
+      if (name == "layers.0.attention.wq.weight" && (part.empty() || part == "qweight")) {
+        query = &tensor;
+      } else if (name == "tok_embeddings.weight") {
+        embedding = &tensor;
+        embedding_shard = i;
+      } else if (name == "output.weight") {
+        is_shared_weight = false;
+      }
+    }
+  }
+  if (query == nullptr || embedding == nullptr || embedding->dims.size() != 2) {
+    return error::ModelParseError("The safetensors model has no embedding or attention weights.");
+  }
+  const int32_t vocab_size = embedding->dims.at(0);
+  // the legacy sign of the vocabulary size, negative when the classifier has its own weight
+  info.config.vocab_size = is_shared_weight ? vocab_size : -vocab_size;
+  if (int4_config.is_int4 && model_type == "qwen2") {
+    return error::ModelParseError(
+        "The quant qwen2 layers have no attention bias, the int4 checkpoints are not supported.");
+  }
+  info.is_int4 = int4_config.is_int4;
+  info.group_size = int4_config.group_size;
+  // the qwen2 layers read fp32 weights only, the embedding and the norms of an int4 model too
+  info.weight_data_type = model_type == "qwen2" || info.is_int4 ? DataType::kDataTypeFp32
+                                                                 : query->data_type;
+  if (info.weight_data_type == DataType::kDataTypeUnknown ||
+      info.weight_data_type == DataType::kDataTypeInt32) {
+    return error::ModelParseError("The safetensors weights are not of the F32, F16 or BF16 type.");
+  }
+
+  std::map<std::string, Int4Parts> int4_parts;
+  for (int32_t i = 0; i < shard_num; ++i) {
+    const auto* shard_data = static_cast<const uint8_t*>(raw_data.shards[i]->data);
+    for (const SafetensorsTensor& tensor : shard_tensors[i]) {
+      const std::string name = weight_export_name(tensor.name, part);
+      if (name.empty()) {
+        LOG(INFO) << "The safetensors tensor " << tensor.name << " is not used by the model";
+        continue;
+      }
+      if (!part.empty()) {
+        if (!info.is_int4) {
+          return error::ModelParseError("The safetensors tensor " + tensor.name +
+                                        " is quantized, but the config has no "
+                                        "quantization_config.");
+        }
+        Int4Parts& parts = int4_parts[name];
+        Int4Part& int4_part = part == "qweight"  ? parts.qweight
+                              : part == "qzeros" ? parts.qzeros
+                              : part == "scales" ? parts.scales
+                                                 : parts.g_idx;
+        int4_part.tensor = &tensor;
+        int4_part.shard_data = shard_data;
+        continue;
+      }
+      if (tensor.data_type == DataType::kDataTypeUnknown ||
+          tensor.data_type == DataType::kDataTypeInt32) {
+        return error::ModelParseError("The safetensors tensor " + tensor.name +
+                                      " is not of the F32, F16 or BF16 type.");
+      }
+      const uint8_t* src = shard_data + tensor.offset;
+      // the classifier and the layers an int4 checkpoint keeps in float
+      if (info.is_int4 && tensor.dims.size() == 2 && name != "tok_embeddings.weight") {
+        auto quant_status = add_quantized_int4_tensor(name, tensor, src, info.group_size,
+                                                      raw_data, directory);
+        if (!quant_status) {
+          return quant_status;
+        }
+        continue;
+      }
+      TensorInfo tensor_info;
+      tensor_info.data_type = info.weight_data_type;
+      tensor_info.dims = tensor.dims;
+      tensor_info.offset = tensor.offset;
+      const size_t element_size = DataTypeSize(info.weight_data_type);
+      if (tensor.data_type == info.weight_data_type &&
+          reinterpret_cast<uintptr_t>(src) % element_size == 0) {
+        tensor_info.byte_size = tensor.byte_size;
+        tensor_info.data = src;
+      } else {
+        const size_t element_num = tensor.byte_size / DataTypeSize(tensor.data_type);
+        tensor_info.byte_size = element_num * element_size;
+        raw_data.converted.emplace_back(tensor_info.byte_size, 0);
+        uint8_t* dst = raw_data.converted.back().data();
+        const auto chunk_num = static_cast<int32_t>((element_num + 4095) / 4096);
+        ThreadPoolFactory::get_instance()->parallel_for(
+            chunk_num, 16, [&](int32_t begin, int32_t end) {
+              const size_t last = std::min(element_num, static_cast<size_t>(end) * 4096);
+              for (size_t j = static_cast<size_t>(begin) * 4096; j < last; ++j) {
+                const float value = read_element(tensor.data_type, src, j);
+                write_element(info.weight_data_type, value, dst, j);
+              }
+            });
+        tensor_info.data = dst;
+      }
+      if (!directory.add(name, std::move(tensor_info))) {
+        return error::ModelParseError("The safetensors tensor " + tensor.name +
+                                      " is in more than one shard.");
+      }
+    }
+  }
+  if (!info.is_int4) {
+    return error::Success();
+  }
+
+  for (const auto& [name, parts] : int4_parts) {
+    auto parts_status = add_int4_parts(name, parts, int4_config, raw_data, directory);
+    if (!parts_status) {
+      return parts_status;
+    }
+  }
+  if (is_shared_weight) {
+    // the quant classifier can not read the fp32 embedding, it gets a quant copy
+    const auto* shard_data = static_cast<const uint8_t*>(raw_data.shards[embedding_shard]->data);
+    auto cls_status =
+        add_quantized_int4_tensor("output.weight", *embedding, shard_data + embedding->offset,
+                                  info.group_size, raw_data, directory);
+    if (!cls_status) {
+      return cls_status;
+    }
+  }
+  // the layers which read the same input are fused, so they have to gather it in one order
+  const std::vector<std::vector<std::string>> shared_inputs = {
+      {"attention.wq.weight", "attention.wk.weight", "attention.wv.weight"},
+      {"feed_forward.w1.weight", "feed_forward.w3.weight"}};
+  for (int32_t layer_idx = 0; layer_idx < info.config.layer_num; ++layer_idx) {
+    for (const auto& names : shared_inputs) {
+      const TensorInfo* first =
+          directory.find(int4_order_name(layer_tensor_name(layer_idx, names.front().c_str())));
+      for (const std::string& name : names) {
+        const TensorInfo* order =
+            directory.find(int4_order_name(layer_tensor_name(layer_idx, name.c_str())));
+        if ((first == nullptr) != (order == nullptr) ||
+            (first && memcmp(first->data, order->data, first->byte_size) != 0)) {
+          return error::ModelParseError("The act order of the weights of layer " +
+                                        std::to_string(layer_idx) +
+                                        " which read the same input differs.");
+        }
+      }
+    }
+  }
+  return error::Success();
+}
+#else
+base::Status parse_safetensors(const void* data, size_t file_size,
+                               std::vector<SafetensorsTensor>& tensors) {
+  return base::error::ModelParseError("The safetensors header needs the json support.");
+}
+
+base::Status load_safetensors_model(const std::string& path, const WeightLoadOptions& options,
+                                    RawModelDataSafetensors& raw_data, TensorDirectory& directory,
+                                    SafetensorsModelInfo& info) {
+  return base::error::ModelParseError(
+      "The safetensors models need the json support of the LLAMA3_SUPPORT or the "
+      "QWEN2_SUPPORT build.");
+}
+#endif
+}  // namespace model
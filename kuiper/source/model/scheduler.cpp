@@ -0,0 +1,495 @@
+#include "model/scheduler.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <chrono>
+#include "base/metrics.h"
+namespace model {
+namespace {
+// registered once, the steps only touch the atomics
+struct SchedulerMetrics {
+  base::Counter* prefill_tokens = nullptr;
+  base::Counter* decode_tokens = nullptr;
+  base::Counter* generated_tokens = nullptr;
+  base::Counter* finished_sequences = nullptr;
+  base::Histogram* step_seconds = nullptr;
+  base::Gauge* batch_size = nullptr;
+  base::Gauge* running_sequences = nullptr;
+  base::Gauge* waiting_sequences = nullptr;
+  base::Gauge* kv_used_blocks = nullptr;
+  base::Gauge* kv_free_blocks = nullptr;
+  base::Counter* preemptions = nullptr;
+  base::Gauge* swapped_sequences = nullptr;
+  base::Gauge* kv_swap_bytes = nullptr;
+};
+
+const SchedulerMetrics& scheduler_metrics() {
+  static const SchedulerMetrics metrics = [] {
+    base::MetricsRegistry& registry = base::MetricsRegistry::global();
+    SchedulerMetrics metrics;
+    metrics.prefill_tokens =
+        registry.counter("kuiper_prefill_tokens_total", "The prompt tokens prefilled.");
+    metrics.decode_tokens =
+        registry.counter("kuiper_decode_tokens_total", "The tokens of the batched decodes.");
+    metrics.generated_tokens =
+        registry.counter("kuiper_generated_tokens_total", "The tokens added to the outputs.");
+    metrics.finished_sequences =
+        registry.counter("kuiper_finished_sequences_total", "The sequences retired.");
+    metrics.step_seconds = registry.histogram("kuiper_step_seconds",
+                                              "The latency of a scheduler step in seconds.",
+                                              base::MetricsRegistry::latency_bounds());
+    metrics.batch_size =
+        registry.gauge("kuiper_batch_size", "The sequences of the last batched decode.");
+    metrics.running_sequences =
+        registry.gauge("kuiper_running_sequences", "The sequences in the running batch.");
+    metrics.waiting_sequences =
+        registry.gauge("kuiper_waiting_sequences", "The sequences waiting for a slot.");
+    metrics.kv_used_blocks =
+        registry.gauge("kuiper_kv_cache_used_blocks", "The kv cache blocks taken.");
+    metrics.kv_free_blocks =
+        registry.gauge("kuiper_kv_cache_free_blocks", "The kv cache blocks left.");
+    metrics.preemptions = registry.counter("kuiper_preemptions_total",
+                                           "The sequences preempted for the kv cache.");
+    metrics.swapped_sequences = registry.gauge(
+        "kuiper_swapped_sequences", "The preempted sequences with their kv on the host.");
+    metrics.kv_swap_bytes =
+        registry.gauge("kuiper_kv_swap_bytes", "The host memory of the swapped kv.");
+    return metrics;
+  }();
+  return metrics;
+}
+
+// the token of the position pos of a sequence, a preempted one prefills its outputs too
+int32_t position_token(const Sequence& seq, int32_t pos) {
+  const int32_t prompt_len = static_cast<int32_t>(seq.prompt_tokens.size());
+  return pos < prompt_len ? seq.prompt_tokens.at(pos) : seq.output_tokens.at(pos - prompt_len);
+}
+
+// the tokens which the prefill of a sequence puts in its kv
+std::vector<int32_t> prefill_tokens(const Sequence& seq) {
+  std::vector<int32_t> tokens(seq.prefill_len);
+  for (int32_t pos = 0; pos < seq.prefill_len; ++pos) {
+    tokens[pos] = position_token(seq, pos);
+  }
+  return tokens;
+}
+}  // namespace
+
+Scheduler::Scheduler(const Model& model) : model_(model) {
+  for (int32_t slot = model_.max_batch_size() - 1; slot >= 0; --slot) {
+    free_slots_.push_back(slot);
+  }
+}
+
+int32_t Scheduler::add_sequence(const std::vector<int32_t>& prompt_tokens,
+                                int32_t max_new_tokens, bool ignore_eos) {
+  Sequence seq;
+  seq.seq_id = next_seq_id_++;
+  seq.max_new_tokens = max_new_tokens;
+  seq.ignore_eos = ignore_eos;
+  seq.prompt_tokens = prompt_tokens;
+  seq.prefill_len = static_cast<int32_t>(prompt_tokens.size());
+  waiting_.push_back(std::move(seq));
+  return waiting_.back().seq_id;
+}
+
+void Scheduler::set_token_callback(TokenCallback callback) {
+  token_callback_ = std::move(callback);
+}
+
+void Scheduler::set_prefill_chunk_size(int32_t chunk_size) {
+  CHECK_GE(chunk_size, 0);
+  prefill_chunk_size_ = chunk_size;
+}
+
+void Scheduler::set_step_token_budget(int32_t token_budget) {
+  CHECK_GE(token_budget, 0);
+  step_token_budget_ = token_budget;
+}
+
+void Scheduler::set_host_kv_swap(size_t max_byte_size) { max_swap_byte_size_ = max_byte_size; }
+
+bool Scheduler::cancel(int32_t seq_id) {
+  for (auto iter = waiting_.begin(); iter != waiting_.end(); ++iter) {
+    if (iter->seq_id == seq_id) {
+      iter->is_cancelled = true;
+      finished_.push_back(std::move(*iter));
+      waiting_.erase(iter);
+      return true;
+    }
+  }
+  for (auto iter = swapped_.begin(); iter != swapped_.end(); ++iter) {
+    if (iter->seq_id == seq_id) {
+      iter->is_cancelled = true;
+      swap_byte_size_ -= iter->swapped_kv->byte_size();
+      iter->swapped_kv.reset();
+      finished_.push_back(std::move(*iter));
+      swapped_.erase(iter);
+      return true;
+    }
+  }
+  // a swapping sequence is finished once its copy is done
+  for (std::vector<Sequence>* sequences : {&running_, &swapping_}) {
+    for (Sequence& seq : *sequences) {
+      if (seq.seq_id == seq_id) {
+        seq.is_cancelled = true;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void Scheduler::add_output(Sequence& seq) {
+  if (!seq.ignore_eos && model_.is_sentence_ending(seq.next_token)) {
+    return;
+  }
+  seq.output_tokens.push_back(seq.next_token);
+  scheduler_metrics().generated_tokens->add();
+  if (token_callback_) {
+    token_callback_(seq.seq_id, seq.next_token);
+  }
+}
+
+bool Scheduler::has_unfinished() const {
+  return !waiting_.empty() || !running_.empty() || !swapping_.empty() || !swapped_.empty();
+}
+
+int32_t Scheduler::running_size() const { return static_cast<int32_t>(running_.size()); }
+
+int32_t Scheduler::waiting_size() const {
+  return static_cast<int32_t>(waiting_.size() + swapping_.size() + swapped_.size());
+}
+
+std::vector<Sequence> Scheduler::pop_finished() {
+  std::vector<Sequence> finished;
+  finished.swap(finished_);
+  return finished;
+}
+
+bool Scheduler::is_finished(const Sequence& seq) const {
+  if (seq.is_cancelled || seq.is_failed) {
+    return true;
+  }
+  // no token is sampled before the last chunk of the prompt
+  if (seq.pos < seq.prefill_len) {
+    return false;
+  }
+  if (!seq.ignore_eos && model_.is_sentence_ending(seq.next_token)) {
+    return true;
+  }
+  if (static_cast<int32_t>(seq.output_tokens.size()) >= seq.max_new_tokens) {
+    return true;
+  }
+  return seq.pos >= model_.max_position();
+}
+
+int32_t Scheduler::pending_block_num() const {
+  const int32_t block_size = model_.kv_block_size();
+  int32_t block_num = 0;
+  for (const Sequence& seq : running_) {
+    if (seq.pos < seq.prefill_len) {
+      block_num += (seq.prefill_len + block_size) / block_size - seq.pos / block_size;
+    }
+  }
+  return block_num;
+}
+
+int32_t Scheduler::admit_block_num(const Sequence& seq, int32_t token_num) const {
+  const int32_t block_size = model_.kv_block_size();
+  return (std::max(seq.prefill_len, token_num) + block_size) / block_size;
+}
+
+bool Scheduler::admit_swapped() {
+  while (!free_slots_.empty() && !swapped_.empty()) {
+    Sequence& front = swapped_.front();
+    // keep one free block for each running sequence so that they can keep growing
+    if (!model_.reclaim_kv_blocks(admit_block_num(front, front.swapped_kv->token_num()) +
+                                  pending_block_num() + static_cast<int32_t>(running_.size()))) {
+      return false;
+    }
+    Sequence seq = std::move(front);
+    swapped_.pop_front();
+    seq.slot = free_slots_.back();
+    free_slots_.pop_back();
+    swap_byte_size_ -= seq.swapped_kv->byte_size();
+    auto status = model_.restore_kv_snapshot(seq.slot, *seq.swapped_kv);
+    if (status) {
+      seq.pos = seq.swapped_kv->token_num();
+    } else {
+      LOG(WARNING) << "The kv of the sequence " << seq.seq_id
+                   << " can not be swapped in, it is prefilled again: "
+                   << status.get_err_msg();
+      model_.release_kv_cache(seq.slot);
+      seq.prefill_len = std::max(seq.prefill_len, seq.swapped_kv->token_num());
+      seq.pos = 0;
+    }
+    seq.swapped_kv.reset();
+    running_.push_back(std::move(seq));
+  }
+  return swapped_.empty();
+}
+
+base::Status Scheduler::admit_waiting() {
+  // a later sequence does not take the blocks which a swapped one waits for
+  if (!admit_swapped()) {
+    return base::error::Success();
+  }
+  while (!free_slots_.empty() && !waiting_.empty()) {
+    const int32_t prompt_len = static_cast<int32_t>(waiting_.front().prompt_tokens.size());
+    if (prompt_len == 0 || prompt_len >= model_.max_position() ||
+        waiting_.front().max_new_tokens <= 0) {
+      LOG(ERROR) << "The sequence " << waiting_.front().seq_id
+                 << " can not be scheduled, prompt length " << prompt_len << ".";
+      finished_.push_back(std::move(waiting_.front()));
+      waiting_.pop_front();
+      continue;
+    }
+    // keep one free block for each running sequence so that they can keep growing
+    const int32_t need_block_num = admit_block_num(waiting_.front(), 0);
+    // the prompts in their prefill still take the blocks of their later chunks, the cached
+    // prefixes no sequence uses make room first
+    if (!model_.reclaim_kv_blocks(need_block_num + pending_block_num() +
+                                  static_cast<int32_t>(running_.size()))) {
+      break;
+    }
+    Sequence seq = std::move(waiting_.front());
+    waiting_.pop_front();
+
+    seq.slot = free_slots_.back();
+    free_slots_.pop_back();
+    // the kv of a cached prefix is shared into the slot, the prefill starts after it
+    seq.pos = model_.match_prefix(prefill_tokens(seq), seq.slot);
+    running_.push_back(std::move(seq));
+  }
+  return base::error::Success();
+}
+
+void Scheduler::finish_swaps() {
+  auto iter = swapping_.begin();
+  while (iter != swapping_.end()) {
+    if (!iter->swapped_kv->is_ready()) {
+      ++iter;
+      continue;
+    }
+    model_.release_kv_cache(iter->slot);
+    free_slots_.push_back(iter->slot);
+    iter->slot = -1;
+    if (iter->is_cancelled) {
+      swap_byte_size_ -= iter->swapped_kv->byte_size();
+      iter->swapped_kv.reset();
+      finished_.push_back(std::move(*iter));
+    } else {
+      swapped_.push_back(std::move(*iter));
+    }
+    iter = swapping_.erase(iter);
+  }
+}
+
+void Scheduler::preempt(Sequence seq) {
+  scheduler_metrics().preemptions->add();
+  if (seq.pos > 0 && swap_byte_size_ + model_.kv_swap_byte_size(seq.pos) <= max_swap_byte_size_) {
+    auto snapshot = std::make_shared<KVSnapshot>();
+    auto status = model_.swap_out_kv(seq.slot, seq.pos, *snapshot);
+    if (status) {
+      swap_byte_size_ += snapshot->byte_size();
+      seq.swapped_kv = std::move(snapshot);
+      swapping_.push_back(std::move(seq));
+      return;
+    }
+    LOG(WARNING) << "The kv of the sequence " << seq.seq_id
+                 << " can not be swapped out, it is prefilled again: " << status.get_err_msg();
+  }
+  model_.release_kv_cache(seq.slot);
+  free_slots_.push_back(seq.slot);
+  seq.slot = -1;
+  // the outputs so far are prefilled with the prompt, the token sampled last is kept
+  seq.prefill_len = std::max(seq.prefill_len, seq.pos);
+  seq.pos = 0;
+  waiting_.push_front(std::move(seq));
+}
+
+void Scheduler::preempt_for_growth() {
+  const int32_t block_size = model_.kv_block_size();
+  // the blocks of the prompts in their prefill and of the decodes which start a block
+  auto need_block_num = [&] {
+    int32_t block_num = pending_block_num();
+    for (const Sequence& seq : running_) {
+      if (seq.pos >= seq.prefill_len && seq.pos % block_size == 0) {
+        block_num += 1;
+      }
+    }
+    return block_num;
+  };
+  // the blocks of the sequences in their swap are free soon
+  auto swapping_block_num = [&] {
+    int32_t block_num = 0;
+    for (const Sequence& seq : swapping_) {
+      block_num += (seq.pos + block_size - 1) / block_size;
+    }
+    return block_num;
+  };
+  model_.reclaim_kv_blocks(need_block_num());
+  while (running_.size() > 1 &&
+         model_.free_kv_block_num() + swapping_block_num() < need_block_num()) {
+    Sequence seq = std::move(running_.back());
+    running_.pop_back();
+    preempt(std::move(seq));
+  }
+  // the step needs the blocks now, the oldest copies are waited for
+  while (!swapping_.empty() && model_.free_kv_block_num() < need_block_num()) {
+    swapping_.front().swapped_kv->wait();
+    finish_swaps();
+  }
+}
+
+base::Status Scheduler::prefill_chunks(int32_t token_budget) {
+  tensor::Tensor pos_tensor(base::DataType::kDataTypeInt32, 1, true,
+                            base::CPUDeviceAllocatorFactory::get_instance());
+  for (Sequence& seq : running_) {
+    if (seq.pos >= seq.prefill_len || seq.is_cancelled) {
+      continue;
+    }
+    int32_t chunk_len = seq.prefill_len - seq.pos;
+    if (prefill_chunk_size_ > 0) {
+      chunk_len = std::min(chunk_len, prefill_chunk_size_);
+    }
+    if (token_budget >= 0) {
+      chunk_len = std::min(chunk_len, token_budget);
+      token_budget -= chunk_len;
+    }
+    if (chunk_len <= 0) {
+      break;
+    }
+    // the chunk continues the kv of the earlier ones in the slot of the sequence
+    std::vector<int32_t> chunk_tokens(chunk_len);
+    for (int32_t i = 0; i < chunk_len; ++i) {
+      chunk_tokens[i] = position_token(seq, seq.pos + i);
+    }
+    pos_tensor.index<int32_t>(0) = seq.pos;
+    const op::EmbeddingOutput& chunk = model_.embedding(chunk_tokens);
+    // only the last chunk of a prompt samples, a preempted sequence which prefills its outputs
+    // again keeps the token it sampled
+    const bool is_sampled = seq.pos + chunk_len == seq.prefill_len && seq.next_token < 0;
+    int32_t next = -1;
+    auto status = is_sampled
+                      ? model_.prefill(chunk.input_embeddings, pos_tensor, next, seq.slot)
+                      : model_.prefill_kv(chunk.input_embeddings, pos_tensor, seq.slot);
+    if (!status) {
+      seq.is_failed = true;
+      return status;
+    }
+    seq.pos += chunk_len;
+    scheduler_metrics().prefill_tokens->add(chunk_len);
+    // the next prompts with the same leading tokens share the kv of the whole prefill
+    if (seq.pos == seq.prefill_len) {
+      model_.cache_prefix(prefill_tokens(seq), seq.slot);
+    }
+    if (is_sampled) {
+      seq.next_token = next;
+      add_output(seq);
+    }
+  }
+  return base::error::Success();
+}
+
+void Scheduler::retire_finished() {
+  auto iter = running_.begin();
+  while (iter != running_.end()) {
+    if (is_finished(*iter)) {
+      model_.release_kv_cache(iter->slot);
+      free_slots_.push_back(iter->slot);
+      finished_.push_back(std::move(*iter));
+      iter = running_.erase(iter);
+      scheduler_metrics().finished_sequences->add();
+    } else {
+      ++iter;
+    }
+  }
+}
+
+void Scheduler::update_metrics(int32_t batch_size) const {
+  const SchedulerMetrics& metrics = scheduler_metrics();
+  metrics.batch_size->set(batch_size);
+  metrics.running_sequences->set(static_cast<double>(running_.size()));
+  metrics.waiting_sequences->set(static_cast<double>(waiting_.size()));
+  metrics.swapped_sequences->set(static_cast<double>(swapping_.size() + swapped_.size()));
+  metrics.kv_swap_bytes->set(static_cast<double>(swap_byte_size_));
+  const int32_t free_block_num = model_.free_kv_block_num();
+  metrics.kv_free_blocks->set(free_block_num);
+  metrics.kv_used_blocks->set(model_.kv_block_num() - free_block_num);
+}
+
+base::Status Scheduler::step() {
+  const auto start = std::chrono::steady_clock::now();
+  int32_t batch_size = 0;
+  auto status = step_batch(batch_size);
+  scheduler_metrics().step_seconds->observe(
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  update_metrics(batch_size);
+  return status;
+}
+
+base::Status Scheduler::step_batch(int32_t& batch_size) {
+  finish_swaps();
+  auto status = admit_waiting();
+  if (!status) {
+    return status;
+  }
+  retire_finished();
+  preempt_for_growth();
+  if (running_.empty()) {
+    return base::error::Success();
+  }
+
+  // the sequences past their prompt decode in this step, the ones which finish the prompt in it
+  // start with the next step
+  std::vector<int32_t> decode_indices;
+  for (int32_t i = 0; i < static_cast<int32_t>(running_.size()); ++i) {
+    if (running_.at(i).pos >= running_.at(i).prefill_len) {
+      decode_indices.push_back(i);
+    }
+  }
+  int32_t prefill_budget = -1;
+  if (step_token_budget_ > 0) {
+    prefill_budget =
+        std::max(step_token_budget_ - static_cast<int32_t>(decode_indices.size()), 0);
+  }
+  status = prefill_chunks(prefill_budget);
+  if (!status) {
+    retire_finished();
+    return status;
+  }
+
+  if (!decode_indices.empty()) {
+    std::vector<int32_t> tokens;
+    std::vector<int32_t> slots;
+    std::vector<int32_t> positions;
+    for (int32_t i : decode_indices) {
+      const Sequence& seq = running_.at(i);
+      tokens.push_back(seq.next_token);
+      slots.push_back(seq.slot);
+      positions.push_back(seq.pos);
+    }
+
+    const auto& token_embedding = model_.embedding(tokens);
+    std::vector<int32_t> next;
+    status = model_.decode_batch(token_embedding.input_embeddings, slots, positions, next);
+    if (!status) {
+      return status;
+    }
+    CHECK_EQ(next.size(), decode_indices.size());
+    batch_size = static_cast<int32_t>(decode_indices.size());
+    scheduler_metrics().decode_tokens->add(batch_size);
+
+    for (size_t i = 0; i < decode_indices.size(); ++i) {
+      Sequence& seq = running_.at(decode_indices.at(i));
+      seq.pos += 1;
+      seq.next_token = next.at(i);
+      add_output(seq);
+    }
+  }
+  // a sequence may already be finished right after its prompt
+  retire_finished();
+  return base::error::Success();
+}
+}  // namespace model
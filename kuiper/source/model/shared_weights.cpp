@@ -0,0 +1,203 @@
+#include "model/shared_weights.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <cstdio>
+namespace model {
+// the weights start on this boundary of the shared allocation
+static constexpr size_t kSharedAlignment = 256;
+static constexpr uint32_t kHandleMagic = 0x4b495043;
+
+struct HandleFile {
+  uint32_t magic = kHandleMagic;
+  int32_t device_id = 0;
+  uint64_t byte_size = 0;
+  cudaIpcMemHandle_t handle;
+};
+
+static size_t align_up(size_t byte_size) {
+  return (byte_size + kSharedAlignment - 1) / kSharedAlignment * kSharedAlignment;
+}
+
+SharedWeights::SharedWeights(std::string handle_path, bool is_owner)
+    : handle_path_(std::move(handle_path)), is_owner_(is_owner) {
+  CHECK(!handle_path_.empty());
+}
+
+SharedWeights::~SharedWeights() {
+  if (!ptr_) {
+    return;
+  }
+  if (is_owner_) {
+    std::remove(handle_path_.c_str());
+    cudaFree(ptr_);
+  } else {
+    cudaIpcCloseMemHandle(ptr_);
+  }
+}
+
+base::Status WeightLayout::build(const std::vector<std::shared_ptr<op::Layer>>& layers) {
+  ranges.clear();
+  roots.clear();
+  root_offsets.clear();
+  byte_size = 0;
+  for (const auto& layer : layers) {
+    auto param_layer = std::dynamic_pointer_cast<op::LayerParam>(layer);
+    if (!param_layer) {
+      continue;
+    }
+    for (tensor::Tensor* tensor : param_layer->param_tensors()) {
+      if (tensor->device_type() != base::DeviceType::kDeviceCPU) {
+        return base::error::InternalError("The laid out weights have to be in the cpu memory.");
+      }
+      ranges.push_back({tensor, tensor->ptr<int8_t>(), tensor->byte_size()});
+    }
+  }
+
+  // the addresses differ between the processes, so the roots are laid out in the order of the
+  // layers instead
+  std::vector<size_t> sorted(ranges.size());
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    sorted.at(i) = i;
+  }
+  std::sort(sorted.begin(), sorted.end(), [this](size_t a, size_t b) {
+    if (ranges.at(a).begin != ranges.at(b).begin) {
+      return ranges.at(a).begin < ranges.at(b).begin;
+    }
+    return ranges.at(a).byte_size > ranges.at(b).byte_size;
+  });
+  const int8_t* root_end = nullptr;
+  for (size_t i : sorted) {
+    Range& range = ranges.at(i);
+    if (range.begin + range.byte_size > root_end) {
+      if (range.begin < root_end) {
+        return base::error::InternalError("The weights of two layers overlap partially.");
+      }
+      root_end = range.begin + range.byte_size;
+      roots.push_back(i);
+    }
+    const Range& root = ranges.at(roots.back());
+    range.root = static_cast<int32_t>(roots.size()) - 1;
+    range.root_offset = range.begin - root.begin;
+  }
+  std::vector<size_t> first_use(roots.size(), ranges.size());
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    first_use.at(ranges.at(i).root) = std::min(first_use.at(ranges.at(i).root), i);
+  }
+  std::vector<int32_t> root_order(roots.size());
+  for (int32_t i = 0; i < root_order.size(); ++i) {
+    root_order.at(i) = i;
+  }
+  std::sort(root_order.begin(), root_order.end(),
+            [&first_use](int32_t a, int32_t b) { return first_use.at(a) < first_use.at(b); });
+  root_offsets.assign(roots.size(), 0);
+  for (int32_t root : root_order) {
+    root_offsets.at(root) = byte_size;
+    byte_size += align_up(ranges.at(roots.at(root)).byte_size);
+  }
+  if (byte_size == 0) {
+    return base::error::InvalidArgument("The layers have no weights to lay out.");
+  }
+  return base::error::Success();
+}
+
+void WeightLayout::assign(void* ptr) const {
+  for (const Range& range : ranges) {
+    tensor::Tensor& tensor = *range.tensor;
+    tensor::Tensor view(tensor.data_type(), tensor.dims(), false, nullptr,
+                        static_cast<int8_t*>(ptr) + root_offsets.at(range.root) +
+                            range.root_offset);
+    view.set_device_type(base::DeviceType::kDeviceCUDA);
+    tensor = view;
+  }
+}
+
+base::Status SharedWeights::bind(const std::vector<std::shared_ptr<op::Layer>>& layers) {
+  if (ptr_) {
+    return base::error::InternalError("The shared weights are bound already.");
+  }
+  WeightLayout layout;
+  const base::Status status = layout.build(layers);
+  if (!status) {
+    return status;
+  }
+  byte_size_ = layout.byte_size;
+
+  if (is_owner_) {
+    if (cudaMalloc(&ptr_, byte_size_) != cudaSuccess) {
+      cudaGetLastError();
+      ptr_ = nullptr;
+      return base::error::InternalError("Failed to allocate the shared weights.");
+    }
+    for (int32_t root = 0; root < layout.roots.size(); ++root) {
+      const WeightLayout::Range& range = layout.ranges.at(layout.roots.at(root));
+      const cudaError_t state =
+          cudaMemcpy(static_cast<int8_t*>(ptr_) + layout.root_offsets.at(root), range.begin,
+                     range.byte_size, cudaMemcpyHostToDevice);
+      if (state != cudaSuccess) {
+        return base::error::InternalError("Failed to upload the shared weights.");
+      }
+    }
+    STATUS_CHECK(export_handle());
+  } else {
+    STATUS_CHECK(open_handle());
+  }
+  layout.assign(ptr_);
+  return base::error::Success();
+}
+
+base::Status SharedWeights::export_handle() const {
+  HandleFile handle_file;
+  handle_file.byte_size = byte_size_;
+  cudaGetDevice(&handle_file.device_id);
+  if (cudaIpcGetMemHandle(&handle_file.handle, ptr_) != cudaSuccess) {
+    return base::error::InternalError("Failed to export the ipc handle of the shared weights.");
+  }
+  // written aside first, so a process which polls the path never reads half a handle
+  const std::string temp_path = handle_path_ + ".tmp";
+  FILE* file = fopen(temp_path.c_str(), "wb");
+  if (!file) {
+    return base::error::PathNotValid(temp_path);
+  }
+  const bool written = fwrite(&handle_file, sizeof(HandleFile), 1, file) == 1;
+  fclose(file);
+  if (!written || std::rename(temp_path.c_str(), handle_path_.c_str()) != 0) {
+    return base::error::InternalError("Failed to write the ipc handle to " + handle_path_);
+  }
+  return base::error::Success();
+}
+
+base::Status SharedWeights::open_handle() {
+  FILE* file = fopen(handle_path_.c_str(), "rb");
+  if (!file) {
+    return base::error::PathNotValid(handle_path_);
+  }
+  HandleFile handle_file;
+  const bool read = fread(&handle_file, sizeof(HandleFile), 1, file) == 1;
+  fclose(file);
+  if (!read || handle_file.magic != kHandleMagic) {
+    return base::error::ModelParseError("The ipc handle file " + handle_path_ + " is broken.");
+  }
+  if (handle_file.byte_size != byte_size_) {
+    return base::error::InvalidArgument(
+        "The shared weights were exported from another model, they have " +
+        std::to_string(handle_file.byte_size) + " bytes instead of " + std::to_string(byte_size_));
+  }
+  int32_t device_id = 0;
+  cudaGetDevice(&device_id);
+  if (device_id != handle_file.device_id) {
+    return base::error::InvalidArgument("The shared weights are on the cuda device " +
+                                        std::to_string(handle_file.device_id));
+  }
+  if (cudaIpcOpenMemHandle(&ptr_, handle_file.handle, cudaIpcMemLazyEnablePeerAccess) !=
+      cudaSuccess) {
+    cudaGetLastError();
+    ptr_ = nullptr;
+    return base::error::InternalError("Failed to open the ipc handle of the shared weights.");
+  }
+  return base::error::Success();
+}
+
+bool SharedWeights::is_owner() const { return is_owner_; }
+
+size_t SharedWeights::byte_size() const { return byte_size_; }
+}  // namespace model
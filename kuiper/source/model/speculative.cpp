@@ -0,0 +1,170 @@
+#include "model/speculative.h"
+#include <glog/logging.h>
+#include <algorithm>
+namespace model {
+DraftVerifyDecoder::DraftVerifyDecoder(const Model& target, int32_t draft_len)
+    : target_(target), draft_len_(draft_len) {
+  CHECK_GT(draft_len, 0);
+  pos_tensor_ = tensor::Tensor(base::DataType::kDataTypeInt32, 1, true,
+                               base::CPUDeviceAllocatorFactory::get_instance());
+}
+
+int64_t DraftVerifyDecoder::proposed_num() const { return proposed_num_; }
+
+int64_t DraftVerifyDecoder::accepted_num() const { return accepted_num_; }
+
+int32_t DraftVerifyDecoder::seq_len() const { return target_.seq_len(); }
+
+base::Status DraftVerifyDecoder::begin(const std::vector<int32_t>& prompt_tokens) {
+  return base::error::Success();
+}
+
+base::Status DraftVerifyDecoder::accept(const std::vector<int32_t>& proposal, int32_t pos,
+                                        int32_t accept_num) {
+  return base::error::Success();
+}
+
+base::Status DraftVerifyDecoder::generate(const std::vector<int32_t>& prompt_tokens,
+                                          int32_t max_new_tokens,
+                                          std::vector<int32_t>& output_tokens) {
+  const int32_t prompt_len = static_cast<int32_t>(prompt_tokens.size());
+  const int32_t seq_len = this->seq_len();
+  if (prompt_len == 0 || prompt_len >= seq_len) {
+    return base::error::InvalidArgument("The prompt length is out of range.");
+  }
+  if (max_new_tokens <= 0) {
+    return base::error::InvalidArgument("The max new tokens is not positive.");
+  }
+  output_tokens.clear();
+  target_.release_kv_cache(0);
+  base::Status status = begin(prompt_tokens);
+  if (!status) {
+    return status;
+  }
+
+  // the target holds the kv entries of the positions [0, pos), last is the token at pos
+  pos_tensor_.index<int32_t>(0) = 0;
+  int32_t last = -1;
+  status = target_.prefill(target_.embedding(prompt_tokens).input_embeddings, pos_tensor_, last);
+  if (!status) {
+    return status;
+  }
+
+  const size_t max_output_num = static_cast<size_t>(max_new_tokens);
+  int32_t pos = prompt_len;
+  // the prompt and the committed tokens
+  std::vector<int32_t> history = prompt_tokens;
+  std::vector<int32_t> draft;
+  std::vector<int32_t> proposal;
+  std::vector<int32_t> verified;
+  while (true) {
+    if (target_.is_sentence_ending(last)) {
+      break;
+    }
+    output_tokens.push_back(last);
+    history.push_back(last);
+    if (output_tokens.size() >= max_output_num || pos + 1 >= seq_len) {
+      break;
+    }
+
+    // the verify pass must fit the sequence
+    status = propose(history, pos, std::min(draft_len_, seq_len - pos - 1), draft);
+    if (!status) {
+      return status;
+    }
+    const int32_t draft_len = static_cast<int32_t>(draft.size());
+    proposal.assign(1, last);
+    proposal.insert(proposal.end(), draft.begin(), draft.end());
+
+    pos_tensor_.index<int32_t>(0) = pos;
+    status = target_.verify(target_.embedding(proposal).input_embeddings, pos_tensor_, verified);
+    if (!status) {
+      return status;
+    }
+    int32_t accept_num = 0;
+    while (accept_num < draft_len && proposal.at(accept_num + 1) == verified.at(accept_num)) {
+      accept_num += 1;
+    }
+    proposed_num_ += draft_len;
+    accepted_num_ += accept_num;
+    status = accept(proposal, pos, accept_num);
+    if (!status) {
+      return status;
+    }
+
+    bool is_ending = false;
+    for (int32_t i = 1; i <= accept_num; ++i) {
+      if (target_.is_sentence_ending(proposal.at(i)) || output_tokens.size() >= max_output_num) {
+        is_ending = true;
+        break;
+      }
+      output_tokens.push_back(proposal.at(i));
+      history.push_back(proposal.at(i));
+    }
+    // a draft which is accepted up to the limit leaves no room for the target's own token
+    if (is_ending || output_tokens.size() >= max_output_num) {
+      break;
+    }
+
+    // the entries written for the rejected tokens are dropped
+    pos += accept_num + 1;
+    last = verified.at(accept_num);
+    target_.truncate_kv_cache(0, pos);
+  }
+  return base::error::Success();
+}
+
+SpeculativeDecoder::SpeculativeDecoder(const Model& draft, const Model& target,
+                                       int32_t draft_len)
+    : DraftVerifyDecoder(target, draft_len), draft_(draft) {}
+
+int32_t SpeculativeDecoder::seq_len() const {
+  return std::min(draft_.seq_len(), target_.seq_len());
+}
+
+base::Status SpeculativeDecoder::begin(const std::vector<int32_t>& prompt_tokens) {
+  draft_.release_kv_cache(0);
+  pos_tensor_.index<int32_t>(0) = 0;
+  int32_t unused = -1;
+  return draft_.prefill(draft_.embedding(prompt_tokens).input_embeddings, pos_tensor_, unused);
+}
+
+base::Status SpeculativeDecoder::draft_step(int32_t token, int32_t pos, int32_t& next) const {
+  tensor::Tensor pos_tensor = pos_tensor_;
+  pos_tensor.index<int32_t>(0) = pos;
+  const auto& token_embedding = draft_.embedding({token});
+  const tensor::Tensor& input = draft_.fill_input(pos_tensor, token_embedding, false);
+  return draft_.predict(input, pos_tensor, false, next);
+}
+
+base::Status SpeculativeDecoder::propose(const std::vector<int32_t>& history, int32_t pos,
+                                         int32_t max_len, std::vector<int32_t>& draft) {
+  // the draft runs ahead of the committed tokens
+  draft.clear();
+  int32_t token = history.back();
+  for (int32_t i = 0; i < max_len; ++i) {
+    base::Status status = draft_step(token, pos + i, token);
+    if (!status) {
+      return status;
+    }
+    draft.push_back(token);
+  }
+  return base::error::Success();
+}
+
+base::Status SpeculativeDecoder::accept(const std::vector<int32_t>& proposal, int32_t pos,
+                                        int32_t accept_num) {
+  const int32_t draft_len = static_cast<int32_t>(proposal.size()) - 1;
+  // the draft never saw its own last proposal, feed it when everything is accepted
+  if (accept_num == draft_len) {
+    int32_t unused = -1;
+    base::Status status = draft_step(proposal.back(), pos + draft_len, unused);
+    if (!status) {
+      return status;
+    }
+  }
+  // the entries written for the rejected tokens are dropped
+  draft_.truncate_kv_cache(0, pos + accept_num + 1);
+  return base::error::Success();
+}
+}  // namespace model
@@ -0,0 +1,62 @@
+#include "model/stream_decoder.h"
+#include <glog/logging.h>
+namespace model {
+static const std::string kReplacementChar = "\xEF\xBF\xBD";
+
+size_t utf8_complete_size(const std::string& text) {
+  // a character is at most 4 bytes, only its lead byte can be among the last 3
+  const size_t size = text.size();
+  for (size_t back = 1; back <= 3 && back <= size; ++back) {
+    const uint8_t byte = static_cast<uint8_t>(text[size - back]);
+    if ((byte & 0xC0) == 0x80) {
+      continue;
+    }
+    size_t char_size = 1;
+    if ((byte & 0xE0) == 0xC0) {
+      char_size = 2;
+    } else if ((byte & 0xF0) == 0xE0) {
+      char_size = 3;
+    } else if ((byte & 0xF8) == 0xF0) {
+      char_size = 4;
+    }
+    return char_size > back ? size - back : size;
+  }
+  return size;
+}
+
+StreamDecoder::StreamDecoder(TokenBytesFunc token_bytes) : token_bytes_(std::move(token_bytes)) {
+  CHECK(token_bytes_ != nullptr);
+}
+
+std::string StreamDecoder::push(int32_t token) {
+  const std::string bytes = token_bytes_(token, is_first_);
+  if (bytes.empty()) {
+    return "";
+  }
+  is_first_ = false;
+  pending_ += bytes;
+  const size_t complete_size = utf8_complete_size(pending_);
+  std::string text = pending_.substr(0, complete_size);
+  pending_.erase(0, complete_size);
+  return text;
+}
+
+std::string StreamDecoder::push(const std::vector<int32_t>& tokens) {
+  std::string text;
+  for (int32_t token : tokens) {
+    text += push(token);
+  }
+  return text;
+}
+
+std::string StreamDecoder::finish() {
+  const std::string text = pending_.empty() ? "" : kReplacementChar;
+  pending_.clear();
+  return text;
+}
+
+void StreamDecoder::reset() {
+  pending_.clear();
+  is_first_ = true;
+}
+}  // namespace model
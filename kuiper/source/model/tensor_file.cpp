@@ -0,0 +1,92 @@
+#include "model/tensor_file.h"
+#include <cstring>
+namespace model {
+size_t TensorInfo::size() const {
+  size_t size = 1;
+  for (int32_t dim : dims) {
+    size *= static_cast<size_t>(dim);
+  }
+  return size;
+}
+
+base::Status TensorDirectory::read(FILE* file, size_t file_size, bool& is_tensor_file) {
+  using namespace base;
+  is_tensor_file = false;
+  tensors_.clear();
+  int32_t magic = 0;
+  if (fseek(file, 0, SEEK_SET) != 0 || fread(&magic, sizeof(int32_t), 1, file) != 1) {
+    return error::ModelParseError("Failed to read the start of the model file.");
+  }
+  fseek(file, 0, SEEK_SET);
+  if (magic != kTensorFileMagic) {
+    return error::Success();
+  }
+  is_tensor_file = true;
+
+  if (fread(&header_, sizeof(TensorFileHeader), 1, file) != 1) {
+    return error::ModelParseError("Failed to read the header of the tensor file.");
+  }
+  if (header_.version != kTensorFileVersion) {
+    return error::ModelParseError("The tensor file has the unsupported version " +
+                                  std::to_string(header_.version) + ".");
+  }
+  if (header_.tensor_num <= 0) {
+    return error::ModelParseError("The tensor file has no tensors.");
+  }
+
+  for (int32_t i = 0; i < header_.tensor_num; ++i) {
+    TensorFileEntry entry;
+    if (fread(&entry, sizeof(TensorFileEntry), 1, file) != 1) {
+      return error::ModelParseError("Failed to read the directory of the tensor file.");
+    }
+    entry.name[kTensorFileNameSize - 1] = '\0';
+    const std::string name(entry.name);
+    if (entry.dim_num <= 0 || entry.dim_num > kTensorFileMaxDims) {
+      return error::ModelParseError("The tensor " + name + " has an invalid shape.");
+    }
+    if (entry.offset < 0 || entry.offset % kTensorFileAlignment != 0 || entry.byte_size <= 0 ||
+        static_cast<size_t>(entry.offset + entry.byte_size) > file_size) {
+      return error::ModelParseError("The tensor " + name +
+                                    " is not aligned or lies outside of the file.");
+    }
+    TensorInfo info;
+    info.data_type = static_cast<DataType>(entry.data_type);
+    info.dims.assign(entry.dims, entry.dims + entry.dim_num);
+    info.offset = static_cast<size_t>(entry.offset);
+    info.byte_size = static_cast<size_t>(entry.byte_size);
+    const size_t element_byte_size = DataTypeSize(info.data_type);
+    if (element_byte_size == 0) {
+      return error::ModelParseError("The tensor " + name + " has an unknown data type.");
+    }
+    size_t data_byte_size = info.size() * element_byte_size;
+    if (info.data_type == DataType::kDataTypeInt8 && (header_.flags & kTensorFileInt4Flag)) {
+      // two int4 values share a byte
+      data_byte_size = (info.size() + 1) / 2;
+    }
+    if (data_byte_size > info.byte_size) {
+      return error::ModelParseError("The data of the tensor " + name + " is truncated.");
+    }
+    if (!tensors_.emplace(name, std::move(info)).second) {
+      return error::ModelParseError("The tensor " + name + " is in the directory twice.");
+    }
+  }
+  return error::Success();
+}
+
+const TensorFileHeader& TensorDirectory::header() const { return header_; }
+
+const TensorInfo* TensorDirectory::find(const std::string& name) const {
+  auto iter = tensors_.find(name);
+  return iter == tensors_.end() ? nullptr : &iter->second;
+}
+
+bool TensorDirectory::empty() const { return tensors_.empty(); }
+
+bool TensorDirectory::add(const std::string& name, TensorInfo info) {
+  return tensors_.emplace(name, std::move(info)).second;
+}
+
+std::string layer_tensor_name(int32_t layer_idx, const char* name) {
+  return "layers." + std::to_string(layer_idx) + "." + name;
+}
+}  // namespace model
@@ -0,0 +1,152 @@
+#include "model/tensor_parallel.h"
+#include <glog/logging.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#ifdef KUIPER_USE_NCCL
+#include <cuda_runtime_api.h>
+#include <nccl.h>
+#endif
+namespace model {
+// the ranks wait this long for rank 0 to write the nccl id
+static constexpr int32_t kIdWaitMs = 60 * 1000;
+static constexpr int32_t kIdPollMs = 10;
+
+ShardRange shard_range(int32_t dim, int32_t rank, int32_t world_size) {
+  CHECK_GT(world_size, 0);
+  CHECK_GE(rank, 0);
+  CHECK_LT(rank, world_size);
+  CHECK_EQ(dim % world_size, 0) << "The dim " << dim << " does not split over " << world_size
+                                << " ranks.";
+  const int32_t size = dim / world_size;
+  return {rank * size, size};
+}
+
+std::vector<uint8_t> slice_columns(const void* data, int32_t rows, int32_t cols,
+                                   size_t element_size, const ShardRange& range) {
+  CHECK_NE(data, nullptr);
+  CHECK_GE(range.begin, 0);
+  CHECK_LE(range.begin + range.size, cols);
+  const size_t row_byte_size = static_cast<size_t>(range.size) * element_size;
+  std::vector<uint8_t> slice(static_cast<size_t>(rows) * row_byte_size);
+  const auto* src = static_cast<const uint8_t*>(data) + range.begin * element_size;
+  for (int32_t row = 0; row < rows; ++row) {
+    std::memcpy(slice.data() + row * row_byte_size, src + row * cols * element_size,
+                row_byte_size);
+  }
+  return slice;
+}
+
+TensorParallelGroup::TensorParallelGroup(int32_t rank, int32_t world_size)
+    : rank_(rank), world_size_(world_size) {}
+
+TensorParallelGroup::~TensorParallelGroup() {
+#ifdef KUIPER_USE_NCCL
+  if (comm_) {
+    ncclCommDestroy(static_cast<ncclComm_t>(comm_));
+  }
+#endif
+}
+
+int32_t TensorParallelGroup::rank() const { return rank_; }
+
+int32_t TensorParallelGroup::world_size() const { return world_size_; }
+
+#ifdef KUIPER_USE_NCCL
+static base::Status write_nccl_id(const std::string& id_path, const ncclUniqueId& id) {
+  // written next to the path and renamed, a waiting rank never reads a part of it
+  const std::string tmp_path = id_path + ".tmp";
+  FILE* file = fopen(tmp_path.c_str(), "wb");
+  if (!file) {
+    return base::error::PathNotValid("Failed to write the nccl id to " + tmp_path);
+  }
+  const bool is_written = fwrite(&id, sizeof(id), 1, file) == 1;
+  fclose(file);
+  if (!is_written || std::rename(tmp_path.c_str(), id_path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+    return base::error::PathNotValid("Failed to write the nccl id to " + id_path);
+  }
+  return base::error::Success();
+}
+
+static base::Status read_nccl_id(const std::string& id_path, ncclUniqueId& id) {
+  for (int32_t waited_ms = 0; waited_ms < kIdWaitMs; waited_ms += kIdPollMs) {
+    FILE* file = fopen(id_path.c_str(), "rb");
+    if (file) {
+      const bool is_read = fread(&id, sizeof(id), 1, file) == 1;
+      fclose(file);
+      if (is_read) {
+        return base::error::Success();
+      }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(kIdPollMs));
+  }
+  return base::error::PathNotValid("The rank 0 did not write the nccl id to " + id_path);
+}
+#endif
+
+base::Status TensorParallelGroup::create(int32_t rank, int32_t world_size,
+                                         const std::string& id_path,
+                                         std::unique_ptr<TensorParallelGroup>& group) {
+  if (world_size < 1 || rank < 0 || rank >= world_size) {
+    return base::error::InvalidArgument("The rank " + std::to_string(rank) +
+                                        " is not in the world of " +
+                                        std::to_string(world_size) + " ranks.");
+  }
+#ifdef KUIPER_USE_NCCL
+  ncclUniqueId id;
+  if (rank == 0) {
+    if (ncclGetUniqueId(&id) != ncclSuccess) {
+      return base::error::InternalError("Failed to create the nccl id.");
+    }
+    auto status = write_nccl_id(id_path, id);
+    if (!status) {
+      return status;
+    }
+  } else {
+    auto status = read_nccl_id(id_path, id);
+    if (!status) {
+      return status;
+    }
+  }
+  ncclComm_t comm = nullptr;
+  const ncclResult_t result = ncclCommInitRank(&comm, world_size, id, rank);
+  // the init returns once every rank has read the id, so whichever rank gets here first removes
+  // it, a rank 0 which fails after the rendezvous leaves no id for the next group
+  std::remove(id_path.c_str());
+  if (result != ncclSuccess) {
+    return base::error::InternalError(std::string("Failed to join the nccl communicator: ") +
+                                      ncclGetErrorString(result));
+  }
+  group.reset(new TensorParallelGroup(rank, world_size));
+  group->comm_ = comm;
+  LOG(INFO) << "Joined the tensor parallel group as the rank " << rank << " of " << world_size;
+  return base::error::Success();
+#else
+  (void)id_path;
+  (void)group;
+  return base::error::InternalError(
+      "The tensor parallel needs nccl, configure the build with USE_NCCL.");
+#endif
+}
+
+base::Status TensorParallelGroup::all_reduce(const tensor::Tensor& tensor, void* stream) const {
+  CHECK(tensor.data_type() == base::DataType::kDataTypeFp32);
+  CHECK(tensor.device_type() == base::DeviceType::kDeviceCUDA);
+#ifdef KUIPER_USE_NCCL
+  float* ptr = const_cast<float*>(tensor.ptr<float>());
+  const ncclResult_t result =
+      ncclAllReduce(ptr, ptr, tensor.size(), ncclFloat, ncclSum, static_cast<ncclComm_t>(comm_),
+                    static_cast<cudaStream_t>(stream));
+  if (result != ncclSuccess) {
+    return base::error::InternalError(std::string("The nccl all reduce failed: ") +
+                                      ncclGetErrorString(result));
+  }
+  return base::error::Success();
+#else
+  (void)stream;
+  return base::error::InternalError("The build has no nccl.");
+#endif
+}
+}  // namespace model
@@ -0,0 +1,1466 @@
+#include "model/transformer.h"
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <op/matmul.h>
+#include <op/mha.h>
+#include <op/rmsnorm.h>
+#include <sentencepiece_processor.h>
+#include <algorithm>
+#include <utility>
+#include "../op/kernels/cpu/rope_kernel.h"
+#include "../op/kernels/cuda/cls_topk_kernel.cuh"
+#include "../op/kernels/cuda/emb_kernel.cuh"
+#include "../op/kernels/cuda/rope_kernel.cuh"
+#include "base/profiler.h"
+#include "base/tick.h"
+namespace model {
+static op::RmsNormLayer* as_rmsnorm(const std::shared_ptr<op::Layer>& layer) {
+  auto rmsnorm_layer = dynamic_cast<op::RmsNormLayer*>(layer.get());
+  CHECK(rmsnorm_layer != nullptr) << "The layer is not an rmsnorm layer.";
+  return rmsnorm_layer;
+}
+
+static op::MultiHeadAttention* as_mha(const std::shared_ptr<op::Layer>& layer) {
+  auto mha_layer = dynamic_cast<op::MultiHeadAttention*>(layer.get());
+  CHECK(mha_layer != nullptr) << "The layer is not a multi head attention layer.";
+  return mha_layer;
+}
+
+// the first rows * cols values of tensor as a [rows, cols] tensor
+static tensor::Tensor row_view(const tensor::Tensor& tensor, int32_t rows, int32_t cols) {
+  CHECK_LE(static_cast<size_t>(rows) * cols, tensor.size());
+  tensor::Tensor view(base::DataType::kDataTypeFp32, rows, cols, false, nullptr,
+                      const_cast<float*>(tensor.ptr<float>()));
+  view.set_device_type(tensor.device_type());
+  return view;
+}
+
+// the stream and the cublas handle of one inference context
+static base::Status create_cuda_config(std::shared_ptr<kernel::CudaConfig>& cuda_config) {
+  cuda_config = std::make_shared<kernel::CudaConfig>();
+  cudaStreamCreate(&cuda_config->stream);
+  if (!cuda_config->create_blas()) {
+    return base::error::InternalError("The cublas handle create failed.");
+  }
+  cudaError_t err = cudaGetLastError();
+  if (err != cudaSuccess) {
+    return base::error::InternalError("The cuda handle create failed.");
+  }
+  return base::error::Success();
+}
+
+// the activations of a prompt on one device, rms_output is reused by every step of a layer, the
+// key and value are dead once they are in the cache and give their memory to the feed forward
+struct PrefillActivations {
+  MemoryPlanner planner;
+  tensor::Tensor rms_output;
+  tensor::Tensor query;
+  tensor::Tensor key;
+  tensor::Tensor val;
+  tensor::Tensor w1_output;
+  tensor::Tensor w3_output;
+  // the attention is written over rms_output and wo over the query, the views have the width
+  // of the heads of the rank
+  tensor::Tensor mha_output;
+  tensor::Tensor attn_output;
+
+  bool allocate(const TransformerConfig& config, int32_t num_tokens,
+                std::shared_ptr<base::DeviceAllocator> alloc) {
+    const int32_t dim = config.dim_;
+    const base::DataType fp32 = base::DataType::kDataTypeFp32;
+    const int32_t rms_id = planner.add_tensor(fp32, {num_tokens, dim}, 0, 10);
+    // a dim wide row holds the query of the rank and the wo output after it
+    const int32_t query_id = planner.add_tensor(fp32, {num_tokens, dim}, 1, 5);
+    const int32_t key_id = planner.add_tensor(fp32, {num_tokens, config.kv_dim_}, 1, 2);
+    const int32_t val_id = planner.add_tensor(fp32, {num_tokens, config.kv_dim_}, 1, 2);
+    const int32_t w1_id = planner.add_tensor(fp32, {num_tokens, config.hidden_dim_}, 7, 9);
+    const int32_t w3_id = planner.add_tensor(fp32, {num_tokens, config.hidden_dim_}, 7, 8);
+    if (!planner.allocate(alloc)) {
+      return false;
+    }
+    rms_output = planner.get_tensor(rms_id);
+    attn_output = planner.get_tensor(query_id);
+    query = row_view(attn_output, num_tokens, config.q_dim_);
+    mha_output = row_view(rms_output, num_tokens, config.q_dim_);
+    key = planner.get_tensor(key_id);
+    val = planner.get_tensor(val_id);
+    w1_output = planner.get_tensor(w1_id);
+    w3_output = planner.get_tensor(w3_id);
+    return true;
+  }
+};
+
+void TransformerLayers::to_cuda(std::shared_ptr<kernel::CudaConfig> config,
+                                int32_t resident_layer_num, const RawModelData* mapped_data) {
+  // the weights of all the layers are collected first and sent in one pipelined upload
+  tensor::UploadQueue upload_queue(config->stream);
+  if (mapped_data) {
+    upload_queue.set_device_mapping([mapped_data](const void* host_ptr, size_t byte_size) {
+      return mapped_data->device_ptr(host_ptr, byte_size);
+    });
+  }
+  std::vector<std::shared_ptr<op::Layer>> layers = {add_layer_, rope_layer_,      swiglu_layer_,
+                                                    cls_layer_, embedding_layer_, mha_layer_};
+  layers.insert(layers.end(), rmsnorm_layers_.begin(), rmsnorm_layers_.end());
+  for (const auto& group : {wq_layers_, wk_layers_, wv_layers_, wo_layers_, w1_layers_, w2_layers_,
+                            w3_layers_}) {
+    for (int32_t i = 0; i < group.size(); ++i) {
+      if (i < resident_layer_num) {
+        layers.push_back(group.at(i));
+      } else if (group.at(i)->device_type() == base::DeviceType::kDeviceCUDA) {
+        // the weights of a streamed layer stay in the host memory
+        group.at(i)->set_cuda_config(config);
+      }
+    }
+  }
+  for (auto& layer : layers) {
+    // the layers of a split model which run on the cpu keep their weights in the host memory
+    if (layer && layer->device_type() == base::DeviceType::kDeviceCUDA) {
+      layer->set_cuda_config(config);
+      layer->set_upload_queue(&upload_queue);
+      layer->to_cuda();
+      layer->set_upload_queue(nullptr);
+    }
+  }
+  upload_queue.flush();
+}
+
+void TransformerLayers::set_cuda_config(std::shared_ptr<kernel::CudaConfig> config) {
+  std::vector<std::shared_ptr<op::Layer>> layers = param_layers();
+  layers.insert(layers.end(), {add_layer_, rope_layer_, swiglu_layer_, mha_layer_});
+  for (auto& layer : layers) {
+    if (layer) {
+      layer->set_cuda_config(config);
+    }
+  }
+}
+
+std::vector<std::shared_ptr<op::Layer>> TransformerLayers::param_layers() const {
+  std::vector<std::shared_ptr<op::Layer>> layers = {embedding_layer_, cls_layer_};
+  layers.insert(layers.end(), rmsnorm_layers_.begin(), rmsnorm_layers_.end());
+  for (const auto& group : {wq_layers_, wk_layers_, wv_layers_, wqkv_layers_, wo_layers_,
+                            w1_layers_, w2_layers_, w3_layers_, w13_layers_}) {
+    layers.insert(layers.end(), group.begin(), group.end());
+  }
+  return layers;
+}
+
+std::unique_ptr<TransformerLayers> TransformerLayers::clone() const {
+  auto clone_layer = [](const std::shared_ptr<op::Layer>& layer) {
+    return layer ? layer->clone() : nullptr;
+  };
+  auto clone_group = [&clone_layer](const std::vector<std::shared_ptr<op::Layer>>& group) {
+    std::vector<std::shared_ptr<op::Layer>> layers;
+    layers.reserve(group.size());
+    for (const auto& layer : group) {
+      layers.push_back(clone_layer(layer));
+    }
+    return layers;
+  };
+  auto layers = std::make_unique<TransformerLayers>();
+  layers->add_layer_ = clone_layer(add_layer_);
+  layers->rope_layer_ = clone_layer(rope_layer_);
+  layers->swiglu_layer_ = clone_layer(swiglu_layer_);
+  layers->mha_layer_ = clone_layer(mha_layer_);
+  layers->cls_layer_ = clone_layer(cls_layer_);
+  layers->embedding_layer_ = clone_layer(embedding_layer_);
+  layers->cpu_add_layer_ = clone_layer(cpu_add_layer_);
+  layers->cpu_rope_layer_ = clone_layer(cpu_rope_layer_);
+  layers->cpu_swiglu_layer_ = clone_layer(cpu_swiglu_layer_);
+  layers->cpu_mha_layer_ = clone_layer(cpu_mha_layer_);
+  layers->wq_layers_ = clone_group(wq_layers_);
+  layers->wk_layers_ = clone_group(wk_layers_);
+  layers->wv_layers_ = clone_group(wv_layers_);
+  layers->wqkv_layers_ = clone_group(wqkv_layers_);
+  layers->wo_layers_ = clone_group(wo_layers_);
+  layers->w1_layers_ = clone_group(w1_layers_);
+  layers->w2_layers_ = clone_group(w2_layers_);
+  layers->rmsnorm_layers_ = clone_group(rmsnorm_layers_);
+  layers->w3_layers_ = clone_group(w3_layers_);
+  layers->w13_layers_ = clone_group(w13_layers_);
+  return layers;
+}
+
+TransformerModel::TransformerModel(base::TokenizerType tokenizer_type, base::ModelType model_type,
+                                   std::string token_path, std::string model_path,
+                                   bool is_quant_model, bool has_qkv_bias)
+    : Model(tokenizer_type, model_type, std::move(token_path), std::move(model_path),
+            is_quant_model),
+      has_qkv_bias_(has_qkv_bias) {}
+
+bool TransformerModel::has_qkv_bias() const { return has_qkv_bias_ && !is_quant_model_; }
+
+base::Status TransformerModel::init(base::DeviceType device_type) {
+  using namespace base;
+  if (token_path_.empty()) {
+    return error::PathNotValid(token_path_);
+  }
+  if (device_type == base::DeviceType::kDeviceCPU &&
+      kv_data_type_ != base::DataType::kDataTypeFp32 &&
+      kv_data_type_ != base::DataType::kDataTypeInt8) {
+    return error::InternalError("The cpu device only supports the fp32 and int8 kv cache.");
+  }
+  if (is_kv_head_major_ && kv_data_type_ == base::DataType::kDataTypeInt8) {
+    return error::InternalError("The head major kv cache does not support the int8 cache.");
+  }
+  if (device_type == base::DeviceType::kDeviceCPU && (shared_weights_ || weight_cache_)) {
+    return error::InternalError("The shared and the cached weights need the cuda device.");
+  }
+  if (shared_weights_ && weight_cache_) {
+    return error::InternalError("The shared weights can not be cached.");
+  }
+  if (device_type != base::DeviceType::kDeviceCPU && use_numa_) {
+    return error::InternalError("The numa placement is for the cpu device.");
+  }
+  if (gpu_layer_num_ > 0 && device_type != base::DeviceType::kDeviceCUDA) {
+    return error::InternalError("The layer split needs the cuda device.");
+  }
+  if (gpu_layer_num_ > 0 && (weight_device_budget_ > 0 || shared_weights_ || weight_cache_)) {
+    return error::InternalError("The layer split can not stream, share or cache the weights.");
+  }
+
+  device_type_ = device_type;
+  if (device_type == DeviceType::kDeviceCUDA) {
+    cudaSetDevice(tensor_parallel_rank_);
+    Status cuda_status = create_cuda_config(cuda_config_);
+    if (!cuda_status) {
+      return cuda_status;
+    }
+  }
+
+  Status parallel_status = init_tensor_parallel(device_type);
+  if (!parallel_status) {
+    return parallel_status;
+  }
+
+  Status read_status = gen_model_from_file();
+  if (!read_status) {
+    return read_status;
+  }
+  // the int8 models run on the cpu, the int4 header is only known after the file is read
+  if ((device_type_ == base::DeviceType::kDeviceCPU || is_layer_split()) && is_int4_model_) {
+    return error::InternalError("The cpu device do not support int4 quant model.");
+  }
+  if ((device_type_ == base::DeviceType::kDeviceCPU || is_layer_split()) && is_fp8_model_) {
+    return error::InternalError("The cpu device do not support fp8 quant model.");
+  }
+  init_mem();
+  return init_session();
+}
+
+base::Status TransformerModel::init_session() {
+  using namespace base;
+  if (is_layer_split()) {
+    kernel::sin_cos_cache_calc_cpu(
+        config_->head_size_, config_->seq_len_, config_->rope_theta_, config_->rope_scaling_,
+        const_cast<float*>(host_buffers_.at(ModelBufferType::kSinCache).ptr<float>()),
+        const_cast<float*>(host_buffers_.at(ModelBufferType::kCosCache).ptr<float>()));
+  }
+  if (device_type_ == base::DeviceType::kDeviceCPU) {
+    kernel::sin_cos_cache_calc_cpu(config_->head_size_, config_->seq_len_, config_->rope_theta_,
+                                   config_->rope_scaling_,
+                                   get_buffer(ModelBufferType::kSinCache).ptr<float>(),
+                                   get_buffer(ModelBufferType::kCosCache).ptr<float>());
+  } else {
+    CHECK_NE(cuda_config_, nullptr);
+    kernel::sin_cos_cache_calc_cu(config_->head_size_, config_->seq_len_, config_->rope_theta_,
+                                  config_->rope_scaling_, get_buffer(ModelBufferType::kSinCache),
+                                  get_buffer(ModelBufferType::kCosCache), cuda_config_->stream);
+  }
+
+  Status plan_status = build_execution_plan();
+  if (!plan_status) {
+    return plan_status;
+  }
+
+  // the logits of a split model are written by the classifier on the cpu
+  sampler_ = std::make_unique<sampler::ArgmaxSampler>(layer_device_type(config_->layer_num_ - 1));
+  return error::Success();
+}
+
+base::Status TransformerModel::create_context(std::unique_ptr<Model>& context) const {
+  std::unique_ptr<TransformerModel> session = create_session();
+  base::Status status = session->copy_context_from(*this);
+  if (!status) {
+    return status;
+  }
+  if (device_type_ == base::DeviceType::kDeviceCUDA) {
+    status = create_cuda_config(session->cuda_config_);
+    if (!status) {
+      return status;
+    }
+  }
+  CHECK(layers_ != nullptr);
+  session->layers_ = layers_->clone();
+  if (session->cuda_config_) {
+    session->layers_->set_cuda_config(session->cuda_config_);
+  }
+  session->init_buffers();
+  status = session->init_session();
+  if (!status) {
+    return status;
+  }
+  context = std::move(session);
+  return base::error::Success();
+}
+
+base::Status TransformerModel::forward(const tensor::Tensor& input,
+                                       const tensor::Tensor& pos_tensor, int& next) const {
+  if (input.is_empty()) {
+    return base::error::InvalidArgument("The input tensor is empty.");
+  }
+
+  // a position on the device comes from a cuda graph capture, its blocks are reserved already
+  if (pos_tensor.device_type() == base::DeviceType::kDeviceCPU &&
+      !reserve_kv_cache(0, pos_tensor.index<int32_t>(0), pos_tensor.index<int32_t>(0) + 1)) {
+    return base::error::InternalError("There are no free blocks left in the kv cache.");
+  }
+  if (pos_tensor.device_type() == base::DeviceType::kDeviceCPU) {
+    base::Status lora_status =
+        bind_lora_rows({0}, false, cuda_config_ ? cuda_config_->stream : nullptr);
+    if (!lora_status) {
+      return lora_status;
+    }
+  }
+
+  run_execution_plan(input, pos_tensor, cuda_config_ ? cuda_config_->stream : nullptr);
+  return base::error::Success();
+}
+
+base::Status TransformerModel::build_execution_plan() {
+  CHECK(layers_ != nullptr);
+  return build_decoder_plan(make_decoder_layers(*layers_), has_qkv_bias());
+}
+
+base::Status TransformerModel::prefill(const tensor::Tensor& input,
+                                       const tensor::Tensor& pos_tensor, int& next,
+                                       int32_t slot) const {
+  tensor::Tensor hidden;
+  base::Status status = prefill_layers(input, pos_tensor, slot, hidden);
+  if (!status) {
+    return status;
+  }
+  const int32_t num_tokens = input.get_dim(0);
+  const int32_t dim = config_->dim_;
+  // only the logits of the last position are needed
+  float* last_ptr = const_cast<float*>(hidden.ptr<float>((num_tokens - 1) * dim));
+  tensor::Tensor last_hidden(base::DataType::kDataTypeFp32, dim, false, nullptr, last_ptr);
+  last_hidden.set_device_type(hidden.device_type());
+  cls_logits(last_hidden);
+
+  select_sampler_slot(slot, pos_tensor);
+  next = post_processing(pos_tensor, false);
+  return sampler_->last_status();
+}
+
+base::Status TransformerModel::prefill_kv(const tensor::Tensor& input,
+                                          const tensor::Tensor& pos_tensor, int32_t slot) const {
+  tensor::Tensor hidden;
+  base::Status status = prefill_layers(input, pos_tensor, slot, hidden);
+  if (!status) {
+    return status;
+  }
+  // the first chunk of a prompt starts the sequence of the slot in the sampler
+  select_sampler_slot(slot, pos_tensor);
+  return base::error::Success();
+}
+
+base::Status TransformerModel::verify(const tensor::Tensor& input, const tensor::Tensor& pos_tensor,
+                                      std::vector<int32_t>& next, int32_t slot) const {
+  tensor::Tensor hidden;
+  base::Status status = prefill_layers(input, pos_tensor, slot, hidden);
+  if (!status) {
+    return status;
+  }
+  std::shared_ptr<base::DeviceAllocator> alloc;
+  if (hidden.device_type() == base::DeviceType::kDeviceCPU) {
+    alloc = base::CPUDeviceAllocatorFactory::get_instance();
+  } else {
+    alloc = base::CUDADeviceAllocatorFactory::get_instance();
+  }
+  // every position is scored, the caller compares them with the proposed tokens
+  const int32_t num_tokens = input.get_dim(0);
+  tensor::Tensor logits(base::DataType::kDataTypeFp32, num_tokens, config_->vocab_size_, true,
+                        alloc);
+  const auto& norm = layers_->rmsnorm_layers_.at(2 * config_->layer_num_);
+  STATUS_CHECK(norm->forward(hidden, hidden));
+  STATUS_CHECK(layers_->cls_layer_->forward(hidden, logits));
+
+  void* stream = cuda_config_ ? cuda_config_->stream : nullptr;
+  // the positions of the draft count into the slot, a caller which rejects some of them resets
+  // a logits processor or a grammar sampler with the accepted tokens. The positions after an
+  // ending token of a grammar repeat it, they are never accepted
+  sampler_->set_slot(slot);
+  next.resize(num_tokens);
+  for (int32_t i = 0; i < num_tokens; ++i) {
+    next.at(i) = static_cast<int32_t>(sampler_->sample(
+        logits.ptr<float>(i * config_->vocab_size_), config_->vocab_size_, stream));
+  }
+  return base::error::Success();
+}
+
+base::Status TransformerModel::embed(const tensor::Tensor& input, const tensor::Tensor& pos_tensor,
+                                     EmbeddingPooling pooling, std::vector<float>& output,
+                                     int32_t slot) const {
+  tensor::Tensor hidden;
+  base::Status status = prefill_layers(input, pos_tensor, slot, hidden);
+  if (!status) {
+    return status;
+  }
+  // the last token pooling only normalizes its own row
+  if (pooling == EmbeddingPooling::kLast) {
+    hidden = slice_rows(hidden, input.get_dim(0) - 1, 1);
+  }
+  const auto& norm = layers_->rmsnorm_layers_.at(2 * config_->layer_num_);
+  STATUS_CHECK(norm->forward(hidden, hidden));
+  pool_hidden(hidden, pooling, output, cuda_config_ ? cuda_config_->stream : nullptr);
+  return base::error::Success();
+}
+
+base::Status TransformerModel::prefill_layers(const tensor::Tensor& input,
+                                              const tensor::Tensor& pos_tensor, int32_t slot,
+                                              tensor::Tensor& hidden) const {
+  if (input.is_empty()) {
+    return base::error::InvalidArgument("The input tensor is empty.");
+  }
+  if (input.dims_size() != 2 || input.get_dim(1) != config_->dim_) {
+    return base::error::InvalidArgument("The prefill input should be a [num_tokens, dim] tensor.");
+  }
+
+  const int32_t num_tokens = input.get_dim(0);
+  const int32_t start_pos = pos_tensor.index<int32_t>(0);
+  if (start_pos < 0 || start_pos + num_tokens > max_position()) {
+    return base::error::InvalidArgument("The prompt exceeds the max sequence length.");
+  }
+  if (!reserve_kv_cache(slot, start_pos, start_pos + num_tokens)) {
+    return base::error::InternalError("There are no free blocks left in the kv cache.");
+  }
+  // all the tokens of the prompt run the adapter of its slot
+  base::Status lora_status =
+      bind_lora_rows({slot}, false, cuda_config_ ? cuda_config_->stream : nullptr);
+  if (!lora_status) {
+    return lora_status;
+  }
+
+  std::shared_ptr<base::DeviceAllocator> alloc;
+  if (device_type_ == base::DeviceType::kDeviceCPU) {
+    alloc = base::CPUDeviceAllocatorFactory::get_instance();
+  } else {
+    alloc = base::CUDADeviceAllocatorFactory::get_instance();
+  }
+  PrefillActivations device_activations;
+  if (!device_activations.allocate(*config_, num_tokens, alloc)) {
+    return base::error::InternalError("Failed to allocate the prefill activations.");
+  }
+  // the cpu layers of a split model have activations of their own
+  PrefillActivations host_activations;
+  if (is_layer_split() &&
+      !host_activations.allocate(*config_, num_tokens,
+                                 base::CPUDeviceAllocatorFactory::get_instance())) {
+    return base::error::InternalError("Failed to allocate the prefill activations.");
+  }
+  void* stream = cuda_config_ ? cuda_config_->stream : nullptr;
+
+  // attn rmsnorm, the later layers get it from the residual add of the previous one
+  hidden = input;
+  STATUS_CHECK(layers_->rmsnorm_layers_.at(0)->forward(input, device_activations.rms_output));
+  for (int32_t layer_idx = 0; layer_idx < config_->layer_num_; ++layer_idx) {
+    base::ProfileLayerScope profile_scope(layer_idx);
+    stream_layer_weights(layer_idx, stream);
+    if (layer_idx == host_layer_begin()) {
+      std::shared_ptr<base::DeviceAllocator> alloc_host =
+          base::CPUDeviceAllocatorFactory::get_instance();
+      if (use_pinned_memory_) {
+        alloc_host = base::CUDAHostAllocatorFactory::get_instance();
+      }
+      hidden = tensor::Tensor(base::DataType::kDataTypeFp32, num_tokens, config_->dim_, true,
+                              alloc_host);
+      move_hidden_to_host(input, hidden, stream);
+      STATUS_CHECK(layers_->rmsnorm_layers_.at(layer_idx)->forward(
+          hidden, host_activations.rms_output));
+    }
+    const bool is_host = is_host_layer(layer_idx);
+    const PrefillActivations& activations = is_host ? host_activations : device_activations;
+    const tensor::Tensor& rms_output = activations.rms_output;
+    const tensor::Tensor& query = activations.query;
+    const tensor::Tensor& key = activations.key;
+    const tensor::Tensor& val = activations.val;
+    const tensor::Tensor& w1_output = activations.w1_output;
+    const tensor::Tensor& w3_output = activations.w3_output;
+    const tensor::Tensor& mha_output = activations.mha_output;
+    const tensor::Tensor& attn_output = activations.attn_output;
+    const PagedKVCache& kv_cache = layer_kv_cache(layer_idx);
+    const int32_t kv_layer = kv_layer_idx(layer_idx);
+    const auto& rope_layer = is_host ? layers_->cpu_rope_layer_ : layers_->rope_layer_;
+    const auto& mha_layer = is_host ? layers_->cpu_mha_layer_ : layers_->mha_layer_;
+
+    // wq wk wv @ input, the key and value rows are scattered into the cache blocks
+    STATUS_CHECK(layers_->wq_layers_.at(layer_idx)->forward(rms_output, query));
+    STATUS_CHECK(layers_->wk_layers_.at(layer_idx)->forward(rms_output, key));
+    STATUS_CHECK(layers_->wv_layers_.at(layer_idx)->forward(rms_output, val));
+    const tensor::Tensor& sin_cache = layer_buffer(layer_idx, ModelBufferType::kSinCache);
+    const tensor::Tensor& cos_cache = layer_buffer(layer_idx, ModelBufferType::kCosCache);
+    // the flash kernel stores the rotated keys itself, so the rope is not fused with the write
+    op::MultiHeadAttention* mha = as_mha(mha_layer);
+    const bool is_flash = mha->is_flash_prefill_supported(kv_cache.data_type());
+    const bool is_rope_fused = !is_flash && kv_cache.is_rope_fused();
+    if (is_rope_fused) {
+      kv_cache.write_rotated(kv_layer, slot, pos_tensor, query, key, val, sin_cache, cos_cache,
+                             config_->is_rope_rotate_half_, stream);
+    } else {
+      STATUS_CHECK(
+          rope_layer->forward(query, key, pos_tensor, sin_cache, cos_cache, tensor::Tensor{}));
+    }
+
+    // causal multi-head attention over the prompt, a windowed prompt is written and attended
+    // chunk_size rows at a time so a write never overwrites the window of its first row
+    const int32_t chunk_size =
+        attention_window_.is_enabled() ? attention_window_.chunk_size : num_tokens;
+    mha->set_layer_idx(kv_layer);
+    for (int32_t begin = 0; begin < num_tokens; begin += chunk_size) {
+      const int32_t row_num = std::min(chunk_size, num_tokens - begin);
+      mha->set_pos(start_pos + begin);
+      if (is_flash) {
+        STATUS_CHECK(mha->forward_prefill(
+            slice_rows(query, begin, row_num), slice_rows(key, begin, row_num),
+            slice_rows(val, begin, row_num), kv_cache.key_cache(), kv_cache.value_cache(),
+            kv_cache.block_table(slot), slice_rows(mha_output, begin, row_num)));
+        continue;
+      }
+      if (!is_rope_fused) {
+        kv_cache.write(kv_layer, slot, start_pos + begin, slice_rows(key, begin, row_num),
+                       slice_rows(val, begin, row_num), stream);
+      }
+      STATUS_CHECK(mha_layer->forward(
+          slice_rows(query, begin, row_num),
+          layer_buffer(layer_idx, ModelBufferType::kScoreStorage), kv_cache.key_cache(),
+          kv_cache.value_cache(), kv_cache.block_table(slot),
+          slice_rows(mha_output, begin, row_num)));
+    }
+    STATUS_CHECK(layers_->wo_layers_.at(layer_idx)->forward(mha_output, attn_output));
+    STATUS_CHECK(reduce_tensor_parallel(attn_output, stream));
+
+    // feed forward
+    const auto& ffn_rmsnorm = layers_->rmsnorm_layers_.at(layer_idx + config_->layer_num_);
+    STATUS_CHECK(as_rmsnorm(ffn_rmsnorm)->forward_add(hidden, attn_output, rms_output));
+    STATUS_CHECK(layers_->w1_layers_.at(layer_idx)->forward(rms_output, w1_output));
+    STATUS_CHECK(layers_->w3_layers_.at(layer_idx)->forward(rms_output, w3_output));
+    const auto& swiglu_layer =
+        is_host ? layers_->cpu_swiglu_layer_ : layers_->swiglu_layer_;
+    STATUS_CHECK(swiglu_layer->forward(w1_output, w3_output, w1_output));
+    STATUS_CHECK(layers_->w2_layers_.at(layer_idx)->forward(w1_output, rms_output));
+    STATUS_CHECK(reduce_tensor_parallel(rms_output, stream));
+    if (layer_idx + 1 < config_->layer_num_ && layer_idx + 1 != host_layer_begin()) {
+      STATUS_CHECK(as_rmsnorm(layers_->rmsnorm_layers_.at(layer_idx + 1))
+                       ->forward_add(hidden, rms_output, rms_output));
+    } else {
+      const auto& add_layer = is_host ? layers_->cpu_add_layer_ : layers_->add_layer_;
+      STATUS_CHECK(add_layer->forward(hidden, rms_output, hidden));
+    }
+  }
+  return base::error::Success();
+}
+
+base::Status TransformerModel::decode_batch(const tensor::Tensor& input,
+                                            const std::vector<int32_t>& slots,
+                                            const std::vector<int32_t>& positions,
+                                            std::vector<int32_t>& next,
+                                            std::vector<float>* host_logits) const {
+  if (input.is_empty()) {
+    return base::error::InvalidArgument("The input tensor is empty.");
+  }
+  const int32_t batch_size = static_cast<int32_t>(slots.size());
+  if (input.dims_size() != 2 || input.get_dim(0) != batch_size ||
+      input.get_dim(1) != config_->dim_) {
+    return base::error::InvalidArgument("The batch input should be a [batch_size, dim] tensor.");
+  }
+  if (positions.size() != slots.size()) {
+    return base::error::InvalidArgument("The number of positions and slots is mismatched.");
+  }
+  if (is_layer_split()) {
+    return base::error::InvalidArgument("The batched decode does not support the layer split.");
+  }
+  if (tensor_parallel_) {
+    return base::error::InvalidArgument("The batched decode does not support the tensor parallel.");
+  }
+  for (int32_t i = 0; i < batch_size; ++i) {
+    if (slots.at(i) < 0 || slots.at(i) >= max_batch_size_) {
+      return base::error::InvalidArgument("The sequence slot " + std::to_string(slots.at(i)) +
+                                          " is out of range.");
+    }
+    if (positions.at(i) < 0 || positions.at(i) >= max_position()) {
+      return base::error::InvalidArgument("The sequence exceeds the max sequence length.");
+    }
+    if (!reserve_kv_cache(slots.at(i), positions.at(i), positions.at(i) + 1)) {
+      return base::error::InternalError("There are no free blocks left in the kv cache.");
+    }
+  }
+  base::Status lora_status =
+      bind_lora_rows(slots, false, cuda_config_ ? cuda_config_->stream : nullptr);
+  if (!lora_status) {
+    return lora_status;
+  }
+
+  if (!bind_batch_activations(batch_size)) {
+    return base::error::InternalError("Failed to allocate the batch activations.");
+  }
+  BatchActivations& batch = batch_activations_;
+  tensor::Tensor& rms_output = batch.rms_output;
+  tensor::Tensor& query = batch.query;
+  tensor::Tensor& key = batch.key;
+  tensor::Tensor& val = batch.val;
+  tensor::Tensor& w1_output = batch.w1_output;
+  tensor::Tensor& w3_output = batch.w3_output;
+  tensor::Tensor& logits = batch.logits;
+  tensor::Tensor& pos_tensor = batch.pos_tensor;
+  tensor::Tensor& query_row = batch.query_row;
+  tensor::Tensor& key_row = batch.key_row;
+  tensor::Tensor& val_row = batch.val_row;
+  tensor::Tensor& output_row = batch.output_row;
+  const tensor::Tensor& score_storage = get_buffer(ModelBufferType::kScoreStorage);
+  const auto& mha_layer = layers_->mha_layer_;
+  op::MultiHeadAttention* mha = as_mha(mha_layer);
+  void* stream = cuda_config_ ? cuda_config_->stream : nullptr;
+
+  STATUS_CHECK(layers_->rmsnorm_layers_.at(0)->forward(input, rms_output));
+  for (int32_t layer_idx = 0; layer_idx < config_->layer_num_; ++layer_idx) {
+    base::ProfileLayerScope profile_scope(layer_idx);
+    stream_layer_weights(layer_idx, stream);
+    // the projections share one weight read across the whole batch
+    STATUS_CHECK(layers_->wq_layers_.at(layer_idx)->forward(rms_output, query));
+    STATUS_CHECK(layers_->wk_layers_.at(layer_idx)->forward(rms_output, key));
+    STATUS_CHECK(layers_->wv_layers_.at(layer_idx)->forward(rms_output, val));
+
+    // every sequence has its own position and its own slot in the kv cache
+    mha->set_layer_idx(layer_idx);
+    for (int32_t i = 0; i < batch_size; ++i) {
+      const int32_t pos = positions.at(i);
+      pos_tensor.index<int32_t>(0) = pos;
+      query_row.bind(slice_row(query, i));
+      key_row.bind(slice_row(key, i));
+      val_row.bind(slice_row(val, i));
+      output_row.bind(slice_row(rms_output, i));
+      if (kv_cache_->is_rope_fused()) {
+        kv_cache_->write_rotated(layer_idx, slots.at(i), pos_tensor, query_row, key_row,
+                                 val_row, get_buffer(ModelBufferType::kSinCache),
+                                 get_buffer(ModelBufferType::kCosCache),
+                                 config_->is_rope_rotate_half_, stream);
+      } else {
+        STATUS_CHECK(layers_->rope_layer_->forward(
+            query_row, key_row, pos_tensor, get_buffer(ModelBufferType::kSinCache),
+            get_buffer(ModelBufferType::kCosCache), tensor::Tensor{}));
+        kv_cache_->write(layer_idx, slots.at(i), pos, key_row, val_row, stream);
+      }
+
+      mha->set_pos(pos);
+      STATUS_CHECK(mha_layer->forward(query_row, score_storage, kv_cache_->key_cache(),
+                                      kv_cache_->value_cache(), kv_cache_->block_table(slots.at(i)),
+                                      output_row));
+    }
+    STATUS_CHECK(layers_->wo_layers_.at(layer_idx)->forward(rms_output, query));
+
+    // feed forward
+    const auto& ffn_rmsnorm = layers_->rmsnorm_layers_.at(layer_idx + config_->layer_num_);
+    STATUS_CHECK(as_rmsnorm(ffn_rmsnorm)->forward_add(input, query, rms_output));
+    STATUS_CHECK(layers_->w1_layers_.at(layer_idx)->forward(rms_output, w1_output));
+    STATUS_CHECK(layers_->w3_layers_.at(layer_idx)->forward(rms_output, w3_output));
+    STATUS_CHECK(layers_->swiglu_layer_->forward(w1_output, w3_output, w1_output));
+    STATUS_CHECK(layers_->w2_layers_.at(layer_idx)->forward(w1_output, rms_output));
+    if (layer_idx + 1 < config_->layer_num_) {
+      STATUS_CHECK(as_rmsnorm(layers_->rmsnorm_layers_.at(layer_idx + 1))
+                       ->forward_add(input, rms_output, rms_output));
+    } else {
+      STATUS_CHECK(layers_->add_layer_->forward(input, rms_output, input));
+    }
+  }
+
+  const auto& norm = layers_->rmsnorm_layers_.at(2 * config_->layer_num_);
+  STATUS_CHECK(norm->forward(input, input));
+  STATUS_CHECK(layers_->cls_layer_->forward(input, logits));
+
+  if (host_logits) {
+    host_logits->resize(logits.size());
+    const base::MemcpyKind memcpy_kind = device_type_ == base::DeviceType::kDeviceCUDA
+                                             ? base::MemcpyKind::kMemcpyCUDA2CPU
+                                             : base::MemcpyKind::kMemcpyCPU2CPU;
+    base::DeviceAlloctorFactory::get_instance(device_type_)
+        ->memcpy(logits.ptr<float>(), host_logits->data(), logits.size() * sizeof(float),
+                 memcpy_kind, stream, true);
+  }
+  next.resize(batch_size);
+  for (int32_t i = 0; i < batch_size; ++i) {
+    sampler_->set_slot(slots.at(i));
+    next.at(i) = static_cast<int32_t>(sampler_->sample(
+        logits.ptr<float>(i * config_->vocab_size_), config_->vocab_size_, stream));
+    // a grammar sampler fails the step of a slot whose output is finished
+    auto sample_status = sampler_->last_status();
+    if (!sample_status) {
+      return sample_status;
+    }
+  }
+  return base::error::Success();
+}
+
+void TransformerModel::create_nonparam_layers() {
+  CHECK(layers_ != nullptr);
+  layers_->rope_layer_ = std::make_shared<op::RoPELayer>(
+      device_type_, config_->q_dim_, config_->kv_dim_, config_->head_size_,
+      config_->is_rope_rotate_half_);
+
+  auto mha_layer = std::make_shared<op::MultiHeadAttention>(
+      device_type_, 0, config_->kv_mul_, config_->kv_dim_, config_->seq_len_, config_->head_num_,
+      config_->head_size_);
+  mha_layer->set_block_size(kv_block_size_);
+  mha_layer->set_window(attention_window_);
+  layers_->mha_layer_ = mha_layer;
+
+  layers_->add_layer_ = std::make_shared<op::VecAddLayer>(device_type_);
+
+  layers_->swiglu_layer_ =
+      std::make_shared<op::SwiGLULayer>(device_type_, config_->hidden_dim_);
+
+  if (is_layer_split()) {
+    const base::DeviceType cpu_device_type = base::DeviceType::kDeviceCPU;
+    layers_->cpu_rope_layer_ = std::make_shared<op::RoPELayer>(
+        cpu_device_type, config_->q_dim_, config_->kv_dim_, config_->head_size_,
+        config_->is_rope_rotate_half_);
+    auto cpu_mha_layer = std::make_shared<op::MultiHeadAttention>(
+        cpu_device_type, 0, config_->kv_mul_, config_->kv_dim_, config_->seq_len_,
+        config_->head_num_, config_->head_size_);
+    cpu_mha_layer->set_block_size(kv_block_size_);
+    cpu_mha_layer->set_window(attention_window_);
+    layers_->cpu_mha_layer_ = cpu_mha_layer;
+    layers_->cpu_add_layer_ = std::make_shared<op::VecAddLayer>(cpu_device_type);
+    layers_->cpu_swiglu_layer_ =
+        std::make_shared<op::SwiGLULayer>(cpu_device_type, config_->hidden_dim_);
+  }
+}
+
+void TransformerModel::create_param_quant_layers() {
+  CHECK(is_quant_model_);
+  CHECK(layers_ != nullptr);
+
+  size_t pos = 0;
+  int32_t dim = config_->dim_;
+  auto cpu_device_type = base::DeviceType::kDeviceCPU;
+
+  // query
+  for (int32_t i = 0; i < config_->layer_num_; ++i) {
+    auto wq = std::make_shared<op::MatmulLayer>(layer_device_type(i), dim, dim, true);
+    pos += set_quant_weight(wq, {dim, dim}, pos, layer_tensor_name(i, "attention.wq.weight"));
+    layers_->wq_layers_.push_back(wq);
+  }
+
+  // key
+  for (int32_t i = 0; i < config_->layer_num_; ++i) {
+    auto wk = std::make_shared<op::MatmulLayer>(layer_device_type(i), config_->kv_dim_, dim, true);
+    pos += set_quant_weight(wk, {config_->kv_dim_, dim}, pos,
+                            layer_tensor_name(i, "attention.wk.weight"));
+    layers_->wk_layers_.push_back(wk);
+  }
+
+  // value
+  for (int32_t i = 0; i < config_->layer_num_; ++i) {
+    auto wv = std::make_shared<op::MatmulLayer>(layer_device_type(i), config_->kv_dim_, dim, true);
+    pos += set_quant_weight(wv, {config_->kv_dim_, dim}, pos,
+                            layer_tensor_name(i, "attention.wv.weight"));
+    layers_->wv_layers_.push_back(wv);
+  }
+
+  // output
+  for (int32_t i = 0; i < config_->layer_num_; ++i) {
+    auto wo = std::make_shared<op::MatmulLayer>(layer_device_type(i), dim, dim, true);
+    pos += set_quant_weight(wo, {dim, dim}, pos, layer_tensor_name(i, "attention.wo.weight"));
+    layers_->wo_layers_.push_back(wo);
+  }
+
+  // w1 layers
+  int32_t hidden_dim = config_->hidden_dim_;
+  for (int32_t i = 0; i < config_->layer_num_; ++i) {
+    auto w1 = std::make_shared<op::MatmulLayer>(layer_device_type(i), hidden_dim, dim, true);
+    pos += set_quant_weight(w1, {hidden_dim, dim}, pos,
+                            layer_tensor_name(i, "feed_forward.w1.weight"));
+    layers_->w1_layers_.push_back(w1);
+  }
+
+  // w2 layers
+  for (int32_t i = 0; i < config_->layer_num_; ++i) {
+    auto w2 = std::make_shared<op::MatmulLayer>(layer_device_type(i), dim, hidden_dim, true);
+    pos += set_quant_weight(w2, {dim, hidden_dim}, pos,
+                            layer_tensor_name(i, "feed_forward.w2.weight"));
+    layers_->w2_layers_.push_back(w2);
+  }
+
+  // w3 layers
+  for (int32_t i = 0; i < config_->layer_num_; ++i) {
+    auto w3 = std::make_shared<op::MatmulLayer>(layer_device_type(i), hidden_dim, dim, true);
+    pos += set_quant_weight(w3, {hidden_dim, dim}, pos,
+                            layer_tensor_name(i, "feed_forward.w3.weight"));
+    layers_->w3_layers_.push_back(w3);
+  }
+
+  // wcls layer
+  // the final norm and the classifier run on the device of the last transformer layer
+  const base::DeviceType head_device_type = layer_device_type(config_->layer_num_ - 1);
+  auto cls_layer =
+      std::make_shared<op::MatmulLayer>(head_device_type, config_->vocab_size_, dim, true);
+  if (config_->is_shared_weight_) {
+    // using token embedding weight, a tensor file has a quant copy of it
+    set_quant_weight(cls_layer, {config_->vocab_size_, dim}, pos, "output.weight");
+  } else {
+    // no shared
+    pos += set_quant_weight(cls_layer, {config_->vocab_size_, dim}, pos, "output.weight");
+  }
+  layers_->cls_layer_ = cls_layer;
+
+  // embedding layer
+  const void* weight_embedding =
+      model_weight("tok_embeddings.weight", pos, {std::abs(config_->vocab_size_), dim});
+  layers_->embedding_layer_ = std::make_shared<op::EmbeddingLayer>(
+      device_type_, config_->dim_, config_->seq_len_, std::abs(config_->vocab_size_));
+  layers_->embedding_layer_->set_weight(0, {std::abs(config_->vocab_size_), dim},
+                                        weight_embedding, cpu_device_type);
+  // the fp32 norms follow the embedding table, the offsets are in bytes
+  size_t norm_pos = pos + static_cast<size_t>(config_->vocab_size_) * dim * sizeof(float);
+
+  // rmsnorm attention attention,ffn,final
+  for (int32_t i = 0; i < 2 * config_->layer_num_ + 1; ++i) {
+    const base::DeviceType norm_device_type =
+        i < 2 * config_->layer_num_ ? layer_device_type(i % config_->layer_num_) : head_device_type;
+    std::shared_ptr<op::RmsNormLayer> rms_norm_layer =
+        std::make_shared<op::RmsNormLayer>(norm_device_type, dim);
+
+    const void* weight_rmsnorm = nullptr;
+    if (i < config_->layer_num_) {
+      weight_rmsnorm = layer_weight(i, "attention_norm.weight", norm_pos, {dim});
+    } else if (i < 2 * config_->layer_num_) {
+      weight_rmsnorm = layer_weight(i - config_->layer_num_, "ffn_norm.weight", norm_pos, {dim});
+    } else {
+      weight_rmsnorm = model_weight("norm.weight", norm_pos, {dim});
+    }
+    rms_norm_layer->set_weight(0, {dim}, weight_rmsnorm, cpu_device_type);
+    layers_->rmsnorm_layers_.push_back(rms_norm_layer);
+    norm_pos += dim * sizeof(float);
+  }
+}
+
+void TransformerModel::create_param_layers() {
+  CHECK(!is_quant_model_);
+  CHECK(layers_ != nullptr);
+  // The embedding layer
+  auto cpu_device_type = base::DeviceType::kDeviceCPU;
+  layers_->embedding_layer_ = std::make_shared<op::EmbeddingLayer>(
+      device_type_, config_->dim_, config_->seq_len_, std::abs(config_->vocab_size_));
+
+  const void* weight_embedding =
+      model_weight("tok_embeddings.weight", 0, {std::abs(config_->vocab_size_), config_->dim_});
+  layers_->embedding_layer_->set_weight(0, {std::abs(config_->vocab_size_), config_->dim_},
+                                        weight_embedding, cpu_device_type);
+
+  // create all matmul layer
+  int32_t dim = config_->dim_;
+  size_t pos = dim * std::abs(config_->vocab_size_) + dim * config_->layer_num_;
+  // create weight matrix for query
+  for (int32_t i = 0; i < config_->layer_num_; ++i) {
+    auto wq = std::make_shared<op::MatmulLayer>(layer_device_type(i), dim, dim, false,
+                                                has_qkv_bias_);
+    wq->set_weight(0, {dim, dim}, layer_weight(i, "attention.wq.weight", pos, {dim, dim}),
+                   cpu_device_type);
+    pos += dim * dim;
+    if (has_qkv_bias_) {
+      wq->set_bias(0, dim, layer_weight(i, "attention.wq.bias", pos, {dim}), cpu_device_type);
+      pos += dim;
+    }
+    layers_->wq_layers_.push_back(wq);
+  }
+
+  // create weight matrix for key
+  for (int32_t i = 0; i < config_->layer_num_; ++i) {
+    auto wk = std::make_shared<op::MatmulLayer>(layer_device_type(i), config_->kv_dim_, dim,
+                                                false, has_qkv_bias_);
+    wk->set_weight(0, {config_->kv_dim_, dim},
+                   layer_weight(i, "attention.wk.weight", pos, {config_->kv_dim_, dim}),
+                   cpu_device_type);
+    pos += config_->kv_dim_ * dim;
+    if (has_qkv_bias_) {
+      wk->set_bias(0, config_->kv_dim_,
+                   layer_weight(i, "attention.wk.bias", pos, {config_->kv_dim_}),
+                   cpu_device_type);
+      pos += config_->kv_dim_;
+    }
+    layers_->wk_layers_.push_back(wk);
+  }
+
+  // create weight matrix for value
+  for (int32_t i = 0; i < config_->layer_num_; ++i) {
+    auto wv = std::make_shared<op::MatmulLayer>(layer_device_type(i), config_->kv_dim_, dim,
+                                                false, has_qkv_bias_);
+    wv->set_weight(0, {config_->kv_dim_, dim},
+                   layer_weight(i, "attention.wv.weight", pos, {config_->kv_dim_, dim}),
+                   cpu_device_type);
+    pos += config_->kv_dim_ * dim;
+    if (has_qkv_bias_) {
+      wv->set_bias(0, config_->kv_dim_,
+                   layer_weight(i, "attention.wv.bias", pos, {config_->kv_dim_}),
+                   cpu_device_type);
+      pos += config_->kv_dim_;
+    }
+    layers_->wv_layers_.push_back(wv);
+  }
+
+  // create weight matrix for output
+  for (int32_t i = 0; i < config_->layer_num_; ++i) {
+    auto wo = std::make_shared<op::MatmulLayer>(layer_device_type(i), dim, dim);
+    wo->set_weight(0, {dim, dim}, layer_weight(i, "attention.wo.weight", pos, {dim, dim}),
+                   cpu_device_type);
+    layers_->wo_layers_.push_back(wo);
+    pos += dim * dim;
+  }
+
+  // skip ffn rmsnorm
+  pos += config_->layer_num_ * dim;
+
+  // w1 layers
+  int32_t hidden_dim = config_->hidden_dim_;
+  for (int32_t i = 0; i < config_->layer_num_; ++i) {
+    auto w1 = std::make_shared<op::MatmulLayer>(layer_device_type(i), hidden_dim, dim);
+    w1->set_weight(0, {hidden_dim, dim},
+                   layer_weight(i, "feed_forward.w1.weight", pos, {hidden_dim, dim}),
+                   cpu_device_type);
+    layers_->w1_layers_.push_back(w1);
+    pos += dim * hidden_dim;
+  }
+
+  // w2 layers
+  for (int32_t i = 0; i < config_->layer_num_; ++i) {
+    auto w2 = std::make_shared<op::MatmulLayer>(layer_device_type(i), dim, hidden_dim);
+    w2->set_weight(0, {dim, hidden_dim},
+                   layer_weight(i, "feed_forward.w2.weight", pos, {dim, hidden_dim}),
+                   cpu_device_type);
+    layers_->w2_layers_.push_back(w2);
+    pos += dim * hidden_dim;
+  }
+
+  // w3 layers
+  for (int32_t i = 0; i < config_->layer_num_; ++i) {
+    auto w3 = std::make_shared<op::MatmulLayer>(layer_device_type(i), hidden_dim, dim);
+    w3->set_weight(0, {hidden_dim, dim},
+                   layer_weight(i, "feed_forward.w3.weight", pos, {hidden_dim, dim}),
+                   cpu_device_type);
+    layers_->w3_layers_.push_back(w3);
+    pos += dim * hidden_dim;
+  }
+
+  // skip final rms weight
+  pos += dim;
+  // skip freqs_cos and freqs_sin weight
+  pos += config_->file_seq_len_ * config_->head_size_;
+
+  // the final norm and the classifier run on the device of the last transformer layer
+  const base::DeviceType head_device_type = layer_device_type(config_->layer_num_ - 1);
+  layers_->cls_layer_ =
+      std::make_shared<op::MatmulLayer>(head_device_type, config_->vocab_size_, dim);
+  if (config_->is_shared_weight_) {
+    // using token embedding weight
+    layers_->cls_layer_->set_weight(
+        0, {config_->vocab_size_, dim},
+        model_weight("tok_embeddings.weight", 0, {config_->vocab_size_, dim}), cpu_device_type);
+  } else {
+    layers_->cls_layer_->set_weight(
+        0, {config_->vocab_size_, dim},
+        model_weight("output.weight", pos, {config_->vocab_size_, dim}), cpu_device_type);
+  }
+
+  // create rmsnorm layer
+  size_t rmsnorm_pos = config_->dim_ * std::abs(config_->vocab_size_);
+
+  for (int32_t i = 0; i < config_->layer_num_; ++i) {
+    std::shared_ptr<op::RmsNormLayer> rms_norm_layer =
+        std::make_shared<op::RmsNormLayer>(layer_device_type(i), config_->dim_);
+
+    const void* weight_rmsnorm =
+        layer_weight(i, "attention_norm.weight", rmsnorm_pos, {config_->dim_});
+    rms_norm_layer->set_weight(0, {config_->dim_}, weight_rmsnorm, cpu_device_type);
+    layers_->rmsnorm_layers_.push_back(rms_norm_layer);
+    rmsnorm_pos += config_->dim_;
+  }
+
+  // skip attention.wq attention.wk attention.wv attention.wo and the biases of the first three
+  const int32_t q_bias_size = has_qkv_bias_ ? config_->dim_ : 0;
+  const int32_t kv_bias_size = has_qkv_bias_ ? config_->kv_dim_ : 0;
+  rmsnorm_pos += config_->layer_num_ * (config_->dim_ * config_->dim_ + q_bias_size);
+  rmsnorm_pos += config_->layer_num_ * (config_->dim_ * config_->kv_dim_ + kv_bias_size);
+  rmsnorm_pos += config_->layer_num_ * (config_->dim_ * config_->kv_dim_ + kv_bias_size);
+  rmsnorm_pos += config_->layer_num_ * config_->dim_ * config_->dim_;
+
+  for (int32_t i = 0; i < config_->layer_num_; ++i) {
+    std::shared_ptr<op::RmsNormLayer> rms_norm_layer =
+        std::make_shared<op::RmsNormLayer>(layer_device_type(i), config_->dim_);
+    const void* weight_rmsnorm = layer_weight(i, "ffn_norm.weight", rmsnorm_pos, {config_->dim_});
+    rms_norm_layer->set_weight(0, {config_->dim_}, weight_rmsnorm, cpu_device_type);
+    layers_->rmsnorm_layers_.push_back(rms_norm_layer);
+
+    rmsnorm_pos += config_->dim_;
+  }
+
+  // skip ffn.w1 ffn.w2 ffn.w3
+  rmsnorm_pos += config_->layer_num_ * config_->hidden_dim_ * config_->dim_;
+  rmsnorm_pos += config_->layer_num_ * config_->hidden_dim_ * config_->dim_;
+  rmsnorm_pos += config_->layer_num_ * config_->hidden_dim_ * config_->dim_;
+
+  std::shared_ptr<op::RmsNormLayer> rms_final_layer =
+      std::make_shared<op::RmsNormLayer>(head_device_type, config_->dim_);
+
+  const void* weight_rmsnorm_final = model_weight("norm.weight", rmsnorm_pos, {config_->dim_});
+  rms_final_layer->set_weight(0, {config_->dim_}, weight_rmsnorm_final, cpu_device_type);
+  layers_->rmsnorm_layers_.push_back(rms_final_layer);
+}
+
+void TransformerModel::init_mem() {
+  int32_t resident_layer_num = config_->layer_num_;
+  CHECK(!is_unified_memory() || (!shared_weights_ && !weight_cache_))
+      << "The weights read in place can not be shared or cached.";
+  if (device_type_ == base::DeviceType::kDeviceCUDA && shared_weights_) {
+    CHECK_NE(cuda_config_, nullptr);
+    CHECK_EQ(weight_device_budget_, 0) << "The shared weights can not be streamed.";
+    // the weights are fused in the cpu memory and moved into the shared allocation after that
+    resident_layer_num = 0;
+    layers_->set_cuda_config(cuda_config_);
+  } else if (device_type_ == base::DeviceType::kDeviceCUDA && weight_cache_) {
+    CHECK_NE(cuda_config_, nullptr);
+    CHECK_EQ(weight_device_budget_, 0) << "The cached weights can not be streamed.";
+    // the weights are fused in the cpu memory, a hit only allocates the fused weights and
+    // reads the image over them
+    resident_layer_num = 0;
+    layers_->set_cuda_config(cuda_config_);
+    weight_cache_->open(model_path_, layers_->param_layers());
+  } else if (device_type_ == base::DeviceType::kDeviceCUDA) {
+    CHECK_NE(cuda_config_, nullptr);
+    // every transformer layer has the same shape, so the first one stands for all of them
+    const size_t layer_byte_size = WeightStreamer::param_byte_size(
+        {layers_->wq_layers_.at(0), layers_->wk_layers_.at(0),
+         layers_->wv_layers_.at(0), layers_->wo_layers_.at(0),
+         layers_->w1_layers_.at(0), layers_->w2_layers_.at(0),
+         layers_->w3_layers_.at(0)});
+    std::vector<std::shared_ptr<op::Layer>> shared_layers = {layers_->embedding_layer_,
+                                                             layers_->cls_layer_};
+    shared_layers.insert(shared_layers.end(), layers_->rmsnorm_layers_.begin(),
+                         layers_->rmsnorm_layers_.end());
+    resident_layer_num =
+        this->resident_layer_num(layer_byte_size, WeightStreamer::param_byte_size(shared_layers));
+    // the layers of a split model from host_layer_begin on are cpu layers, not streamed ones
+    resident_layer_num = std::min(resident_layer_num, host_layer_begin());
+    // an integrated gpu reads the registered weight file in place
+    layers_->to_cuda(cuda_config_, resident_layer_num,
+                     is_unified_memory() ? raw_model_data_.get() : nullptr);
+  }
+  // fused after the weights are moved, so the device only keeps the packed copy, the weights
+  // of a streamed layer are packed in the host memory. The weights read in place are not
+  // fused, a packed copy would be a second one
+  const bool copy_weights = !weight_cache_ || !weight_cache_->is_hit();
+  for (int32_t i = 0; i < config_->layer_num_ && !is_unified_memory(); ++i) {
+    std::shared_ptr<base::DeviceAllocator> alloc_fuse;
+    if (i >= resident_layer_num) {
+      alloc_fuse = base::CPUDeviceAllocatorFactory::get_instance();
+    }
+    auto wq = std::dynamic_pointer_cast<op::MatmulLayer>(layers_->wq_layers_.at(i));
+    auto wk = std::dynamic_pointer_cast<op::MatmulLayer>(layers_->wk_layers_.at(i));
+    auto wv = std::dynamic_pointer_cast<op::MatmulLayer>(layers_->wv_layers_.at(i));
+    CHECK(wq != nullptr && wk != nullptr && wv != nullptr);
+    layers_->wqkv_layers_.push_back(
+        op::MatmulLayer::fuse({wq, wk, wv}, alloc_fuse, copy_weights));
+
+    auto w1 = std::dynamic_pointer_cast<op::MatmulLayer>(layers_->w1_layers_.at(i));
+    auto w3 = std::dynamic_pointer_cast<op::MatmulLayer>(layers_->w3_layers_.at(i));
+    CHECK(w1 != nullptr && w3 != nullptr);
+    auto w13 = op::MatmulLayer::fuse({w1, w3}, alloc_fuse, copy_weights);
+    w13->set_swiglu_output(true);
+    layers_->w13_layers_.push_back(w13);
+  }
+  if (shared_weights_) {
+    const base::Status status = shared_weights_->bind(layers_->param_layers());
+    CHECK(status) << status.get_err_msg();
+    LOG(INFO) << (shared_weights_->is_owner() ? "Exported " : "Attached to ")
+              << shared_weights_->byte_size() << " bytes of shared weights.";
+  } else if (weight_cache_) {
+    const base::Status status =
+        weight_cache_->bind(layers_->param_layers(), cuda_config_->stream);
+    CHECK(status) << status.get_err_msg();
+    LOG(INFO) << (weight_cache_->is_hit() ? "Read " : "Cached ") << weight_cache_->byte_size()
+              << " bytes of device weights.";
+  } else if (resident_layer_num < host_layer_begin()) {
+    weight_streamer_ = std::make_unique<WeightStreamer>();
+    for (int32_t i = resident_layer_num; i < host_layer_begin(); ++i) {
+      weight_streamer_->add_layer(
+          i, {layers_->wq_layers_.at(i), layers_->wk_layers_.at(i),
+              layers_->wv_layers_.at(i), layers_->wqkv_layers_.at(i),
+              layers_->wo_layers_.at(i), layers_->w1_layers_.at(i),
+              layers_->w2_layers_.at(i), layers_->w3_layers_.at(i),
+              layers_->w13_layers_.at(i)});
+    }
+    LOG(INFO) << "Streaming " << host_layer_begin() - resident_layer_num
+              << " layers through a weight window of " << weight_streamer_->window_byte_size()
+              << " bytes.";
+  }
+  // the attached processes read the weights of the owner, which are kept in the file layout
+  if (device_type_ == base::DeviceType::kDeviceCUDA && use_weight_tiling_ && !shared_weights_ &&
+      !is_unified_memory()) {
+    tile_int8_weights(layers_->param_layers(), cuda_config_.get());
+  }
+  if (device_type_ == base::DeviceType::kDeviceCUDA && use_matmul_tuning_) {
+    tune_matmuls(layers_->param_layers(), cuda_config_.get());
+  }
+  if (device_type_ == base::DeviceType::kDeviceCPU && use_numa_) {
+    place_numa_weights(layers_->param_layers());
+  }
+  init_buffers();
+}
+
+void TransformerModel::init_buffers() {
+  std::shared_ptr<base::DeviceAllocator> alloc;
+  if (device_type_ == base::DeviceType::kDeviceCPU) {
+    alloc = base::CPUDeviceAllocatorFactory::get_instance();
+  } else {
+    alloc = base::CUDADeviceAllocatorFactory::get_instance();
+  }
+  std::shared_ptr<base::DeviceAllocator> alloc_cpu =
+      base::CPUDeviceAllocatorFactory::get_instance();
+  std::shared_ptr<base::DeviceAllocator> alloc_cu =
+      base::CUDADeviceAllocatorFactory::get_instance();
+  // the host side of the per-step copies, pinned so that they run on the stream
+  std::shared_ptr<base::DeviceAllocator> alloc_io = alloc_cpu;
+  if (device_type_ == base::DeviceType::kDeviceCUDA && use_pinned_memory_) {
+    alloc_io = base::CUDAHostAllocatorFactory::get_instance();
+  }
+
+  tensor::Tensor input_tokens(base::DataType::kDataTypeInt32, 1, true, alloc_io);
+  tensor::Tensor input_embeddings(base::DataType::kDataTypeFp32, 1, config_->dim_, true, alloc);
+  // the rope tables do not grow with the context, see base/rope.h
+  const int32_t rope_size = base::rope_table_rows(config_->seq_len_) * config_->head_size_ / 2;
+  tensor::Tensor sin_cache(base::DataType::kDataTypeFp32, rope_size, true, alloc);
+  tensor::Tensor cos_cache(base::DataType::kDataTypeFp32, rope_size, true, alloc);
+
+  CHECK(insert_buffer(ModelBufferType::kSinCache, sin_cache));
+  CHECK(insert_buffer(ModelBufferType::kCosCache, cos_cache));
+
+  CHECK(insert_buffer(ModelBufferType::kInputTokens, input_tokens));
+  CHECK(insert_buffer(ModelBufferType::kInputEmbeddings, input_embeddings));
+
+  // kv cache
+  // paged kv cache shared by all the sequence slots
+  init_kv_cache();
+  auto mha_layer = std::dynamic_pointer_cast<op::MultiHeadAttention>(layers_->mha_layer_);
+  CHECK_NE(mha_layer, nullptr) << "The multi head attention layer is null pointer.";
+  mha_layer->set_kv_scales(kv_cache_->key_scale(), kv_cache_->value_scale());
+  init_step_activations(false);
+  if (is_layer_split()) {
+    auto cpu_mha_layer =
+        std::dynamic_pointer_cast<op::MultiHeadAttention>(layers_->cpu_mha_layer_);
+    CHECK_NE(cpu_mha_layer, nullptr) << "The multi head attention layer is null pointer.";
+    cpu_mha_layer->set_kv_scales(host_kv_cache_->key_scale(), host_kv_cache_->value_scale());
+    init_step_activations(true);
+
+    CHECK(insert_host_buffer(ModelBufferType::kSinCache,
+                             tensor::Tensor(base::DataType::kDataTypeFp32, rope_size, true,
+                                            alloc_cpu)));
+    CHECK(insert_host_buffer(ModelBufferType::kCosCache,
+                             tensor::Tensor(base::DataType::kDataTypeFp32, rope_size, true,
+                                            alloc_cpu)));
+    CHECK(insert_host_buffer(
+        ModelBufferType::kHiddenStateCPU,
+        tensor::Tensor(base::DataType::kDataTypeFp32, config_->dim_, true, alloc_io)));
+  }
+
+  // Pos tensor
+  tensor::Tensor pos_tensor(base::DataType::kDataTypeInt32, 1, true, alloc_io);
+  CHECK(insert_buffer(ModelBufferType::kInputPos, pos_tensor));
+  if (device_type_ == base::DeviceType::kDeviceCUDA) {
+    // the position and the sampled token of a decode step replayed from a cuda graph
+    tensor::Tensor pos_cu(base::DataType::kDataTypeInt32, 1, true, alloc_cu);
+    tensor::Tensor index_cu(base::DataType::kDataTypeInt32, 1, true, alloc_cu);
+    CHECK(insert_buffer(ModelBufferType::kInputPosCUDA, pos_cu));
+    CHECK(insert_buffer(ModelBufferType::kOutputIndexCUDA, index_cu));
+    // the token, its embedding and the sampled tokens of the decode steps which stay on the device
+    tensor::Tensor token_cu(base::DataType::kDataTypeInt32, 1, true, alloc_cu);
+    tensor::Tensor embedding_cu(base::DataType::kDataTypeFp32, 1, config_->dim_, true, alloc_cu);
+    tensor::Tensor tokens_cu(base::DataType::kDataTypeInt32, config_->seq_len_, true, alloc_cu);
+    CHECK(insert_buffer(ModelBufferType::kInputTokensCUDA, token_cu));
+    CHECK(insert_buffer(ModelBufferType::kInputEmbeddingCUDA, embedding_cu));
+    CHECK(insert_buffer(ModelBufferType::kOutputTokensCUDA, tokens_cu));
+    tensor::Tensor tokens_cpu(base::DataType::kDataTypeInt32, config_->seq_len_, true, alloc_io);
+    CHECK(insert_buffer(ModelBufferType::kOutputTokensCPU, tokens_cpu));
+    tensor::Tensor stop_table_cu(base::DataType::kDataTypeInt32,
+                                 kernel::kMaxStopSequenceNum * kernel::kStopSequenceWidth, true,
+                                 alloc_cu);
+    tensor::Tensor stop_state_cu(base::DataType::kDataTypeInt32, kernel::kStopStateSize, true,
+                                 alloc_cu);
+    tensor::Tensor stop_state_cpu(base::DataType::kDataTypeInt32, kernel::kStopStateSize, true,
+                                  alloc_io);
+    CHECK(insert_buffer(ModelBufferType::kStopTableCUDA, stop_table_cu));
+    CHECK(insert_buffer(ModelBufferType::kStopStateCUDA, stop_state_cu));
+    CHECK(insert_buffer(ModelBufferType::kStopStateCPU, stop_state_cpu));
+    tensor::Tensor candidates_cu(base::DataType::kDataTypeFp32, kernel::kClsTopKMaxNum + 1, true,
+                                 alloc_cu);
+    tensor::Tensor candidate_tokens_cu(base::DataType::kDataTypeInt32, kernel::kClsTopKMaxNum,
+                                       true, alloc_cu);
+    const size_t workspace_byte_size = kernel::cls_topk_workspace_byte_size(config_->vocab_size_);
+    tensor::Tensor cls_workspace_cu(base::DataType::kDataTypeFp32,
+                                    static_cast<int32_t>(workspace_byte_size / sizeof(float)),
+                                    true, alloc_cu);
+    CHECK(insert_buffer(ModelBufferType::kClsCandidatesCUDA, candidates_cu));
+    CHECK(insert_buffer(ModelBufferType::kClsCandidateTokensCUDA, candidate_tokens_cu));
+    CHECK(insert_buffer(ModelBufferType::kClsWorkspaceCUDA, cls_workspace_cu));
+  }
+
+  // final forward output, on the host when the classifier of a split model runs there
+  tensor::Tensor forward_output(base::DataType::kDataTypeFp32, config_->vocab_size_, true,
+                                is_layer_split() ? alloc_io : alloc);
+  if (device_type_ == base::DeviceType::kDeviceCUDA) {
+    tensor::Tensor forward_output_cpu(base::DataType::kDataTypeFp32, config_->vocab_size_, true,
+                                      alloc_io);
+    CHECK(insert_buffer(ModelBufferType::kForwardOutputCPU, forward_output_cpu));
+  }
+
+  CHECK(insert_buffer(ModelBufferType::kForwardOutput, forward_output));
+}
+
+void TransformerModel::init_step_activations(bool is_host) {
+  const base::DeviceType device_type = is_host ? base::DeviceType::kDeviceCPU : device_type_;
+  std::shared_ptr<base::DeviceAllocator> alloc;
+  if (device_type == base::DeviceType::kDeviceCPU) {
+    alloc = base::CPUDeviceAllocatorFactory::get_instance();
+  } else {
+    alloc = base::CUDADeviceAllocatorFactory::get_instance();
+  }
+  std::unique_ptr<MemoryPlanner>& planner =
+      is_host ? host_activation_planner_ : activation_planner_;
+  auto insert = [this, is_host](ModelBufferType buffer_idx, const tensor::Tensor& tensor) {
+    return is_host ? insert_host_buffer(buffer_idx, tensor) : insert_buffer(buffer_idx, tensor);
+  };
+
+  // The activations of one decode step live in one arena, the steps are the ops in the order
+  // of forward: 0 attention rmsnorm, 1 wqkv, 2 rope, 3 mha, 4 wo, 5 residual add,
+  // 6 ffn rmsnorm, 7 w13 with swiglu, 8 w2, 9 residual add
+  const base::DataType fp32 = base::DataType::kDataTypeFp32;
+  const int32_t dim = config_->dim_;
+  const int32_t q_dim = config_->q_dim_;
+  const int32_t qkv_dim = q_dim + 2 * config_->kv_dim_;
+  planner = std::make_unique<MemoryPlanner>();
+  const int32_t rms_id = planner->add_tensor(fp32, {dim}, 0, 1);
+  // the wo output is written over the query part, the query of a tensor parallel rank can be
+  // narrower than it
+  const int32_t qkv_id = planner->add_tensor(fp32, {std::max(qkv_dim, dim)}, 1, 5);
+  const int32_t score_id =
+      planner->add_tensor(fp32, {config_->head_num_, config_->seq_len_}, 3, 3);
+  const int32_t mha_id = planner->add_tensor(fp32, {q_dim}, 3, 4);
+  const int32_t ffn_rms_id = planner->add_tensor(fp32, {dim}, 6, 7);
+  const int32_t w1_id = planner->add_tensor(fp32, {config_->hidden_dim_}, 7, 8);
+  const int32_t w2_id = planner->add_tensor(fp32, {dim}, 8, 9);
+  CHECK(planner->allocate(alloc));
+
+  CHECK(insert(ModelBufferType::kOutputRMSNorm, planner->get_tensor(rms_id)));
+  CHECK(insert(ModelBufferType::kOutputMHA, planner->get_tensor(mha_id)));
+  CHECK(insert(ModelBufferType::kFFNRMSNorm, planner->get_tensor(ffn_rms_id)));
+  // silu(w1 @ x) * (w3 @ x), written by the fused w13 layer
+  CHECK(insert(ModelBufferType::kW1Output, planner->get_tensor(w1_id)));
+  CHECK(insert(ModelBufferType::kW2Output, planner->get_tensor(w2_id)));
+  CHECK(insert(ModelBufferType::kScoreStorage, planner->get_tensor(score_id)));
+
+  // Wqkv output, the query, key and value are consecutive parts of it. The key and value are
+  // stored into the kv cache after rope
+  float* qkv_ptr = planner->get_tensor(qkv_id).ptr<float>();
+  tensor::Tensor qkv_output(base::DataType::kDataTypeFp32, qkv_dim, false, nullptr, qkv_ptr);
+  tensor::Tensor query(base::DataType::kDataTypeFp32, q_dim, false, nullptr, qkv_ptr);
+  tensor::Tensor key_output(base::DataType::kDataTypeFp32, config_->kv_dim_, false, nullptr,
+                            qkv_ptr + q_dim);
+  tensor::Tensor value_output(base::DataType::kDataTypeFp32, config_->kv_dim_, false, nullptr,
+                              qkv_ptr + q_dim + config_->kv_dim_);
+  tensor::Tensor attn_output(base::DataType::kDataTypeFp32, dim, false, nullptr, qkv_ptr);
+  qkv_output.set_device_type(device_type);
+  query.set_device_type(device_type);
+  key_output.set_device_type(device_type);
+  value_output.set_device_type(device_type);
+  attn_output.set_device_type(device_type);
+  CHECK(insert(ModelBufferType::kQKVOutput, qkv_output));
+  CHECK(insert(ModelBufferType::kQuery, query));
+  CHECK(insert(ModelBufferType::kKeyOutput, key_output));
+  CHECK(insert(ModelBufferType::kValueOutput, value_output));
+
+  // Attention output
+  CHECK(insert(ModelBufferType::kAttnOutput, attn_output));
+}
+
+base::Status TransformerModel::create_layers() {
+  using namespace base;
+  if (!layers_) {
+    layers_ = std::make_unique<TransformerLayers>();
+  }
+
+  // the biases are read as fp32
+  if (has_qkv_bias_ && weight_data_type_ != base::DataType::kDataTypeFp32) {
+    return error::InternalError("The model with the qkv biases does not support the 16 bit "
+                                "weights.");
+  }
+  if (!is_quant_model_) {
+    create_param_layers();
+  } else {
+    create_param_quant_layers();
+  }
+  if (tensor_parallel_) {
+    Status shard_status = shard_tensor_parallel(
+        {&layers_->wq_layers_, &layers_->wk_layers_, &layers_->wv_layers_,
+         &layers_->w1_layers_, &layers_->w3_layers_},
+        {&layers_->wo_layers_, &layers_->w2_layers_});
+    if (!shard_status) {
+      return shard_status;
+    }
+  }
+  create_nonparam_layers();
+  if (weight_data_type_ != base::DataType::kDataTypeFp32) {
+    if (device_type_ == base::DeviceType::kDeviceCPU || is_layer_split()) {
+      return error::InternalError("The cpu device does not support the 16 bit weights.");
+    }
+    for (const auto& layer : layers_->param_layers()) {
+      std::dynamic_pointer_cast<op::LayerParam>(layer)->set_weight_data_type(weight_data_type_);
+    }
+  }
+
+  if (!layers_->embedding_layer_) {
+    return error::InternalError("Create the embedding layer for the model failed!");
+  }
+
+  if (layers_->rmsnorm_layers_.size() != 2 * config_->layer_num_ + 1) {
+    return error::InternalError("Create the rmsnorm layers for the model failed!");
+  }
+
+  if (layers_->wq_layers_.size() != config_->layer_num_ ||
+      layers_->wk_layers_.size() != config_->layer_num_ ||
+      layers_->wv_layers_.size() != config_->layer_num_ ||
+      layers_->wo_layers_.size() != config_->layer_num_) {
+    return error::InternalError(
+        "Create the matmul layer in the attention and ffn attention layers for "
+        "the model "
+        "failed.");
+  }
+
+  for (int32_t i = 0; i < config_->layer_num_; ++i) {
+    if (!layers_->wq_layers_.at(i) || !layers_->wk_layers_.at(i) ||
+        !layers_->wv_layers_.at(i) || !layers_->wo_layers_.at(i)) {
+      return error::InternalError(
+          "Create the matmul layer in the attention and ffn attention layers for "
+          "the model "
+          "failed.");
+    }
+  }
+
+  if (layers_->w1_layers_.size() != config_->layer_num_ ||
+      layers_->w2_layers_.size() != config_->layer_num_ ||
+      layers_->w3_layers_.size() != config_->layer_num_) {
+    return error::InternalError(
+        "Create the matmul layer in the feedforward layers for the model "
+        "failed.");
+  }
+
+  for (int32_t i = 0; i < config_->layer_num_; ++i) {
+    if (!layers_->w1_layers_.at(i) || !layers_->w2_layers_.at(i) ||
+        !layers_->w3_layers_.at(i)) {
+      return error::InternalError(
+          "Create the matmul layer in the feedforward layers for the model "
+          "failed.");
+    }
+  }
+
+  if (!layers_->rope_layer_) {
+    return error::InternalError("Create the rope layer for the model failed!");
+  }
+
+  if (!layers_->add_layer_) {
+    return error::InternalError("Create the add layer for the model failed!");
+  }
+
+  if (!layers_->mha_layer_) {
+    return error::InternalError("Create the mha layer for the model failed!");
+  }
+
+  if (!layers_->swiglu_layer_) {
+    return error::InternalError("Create the SwiGLU layer for the model failed!");
+  }
+  return error::Success();
+}
+
+const op::EmbeddingOutput& TransformerModel::embedding(const std::vector<int>& tokens) const {
+  bind_embedding_output(static_cast<int32_t>(tokens.size()));
+  std::copy(tokens.begin(), tokens.end(), embedding_output_.input_tokens.ptr<int32_t>());
+  const auto& embedding_layer = layers_->embedding_layer_;
+  LOG_IF(FATAL, !embedding_layer) << "The embedding layer in the model is null pointer.";
+  STATUS_CHECK(embedding_layer->forward(embedding_output_.input_tokens,
+                                        embedding_output_.input_token_num,
+                                        embedding_output_.input_embeddings));
+  return embedding_output_;
+}
+
+base::Status TransformerModel::begin_device_decode(int32_t token, int32_t pos) const {
+  sampler_->set_slot(0);
+  return start_device_decode(token, pos, cuda_config_.get());
+}
+
+base::Status TransformerModel::launch_device_decode(int32_t step_num) const {
+  // the streamed weights move between the window slots, a captured graph would pin them
+  if (weight_streamer_) {
+    return base::error::InvalidArgument("The decode on the device can not stream the weights.");
+  }
+  if (is_layer_split()) {
+    return base::error::InvalidArgument("The decode on the device needs all the layers on it.");
+  }
+  return launch_device_graph(step_num, cuda_config_.get());
+}
+
+void* TransformerModel::cuda_stream() const {
+  return cuda_config_ ? cuda_config_->stream : nullptr;
+}
+
+kernel::CudaConfig* TransformerModel::kv_swap_config() const {
+  if (!cuda_config_ || !cuda_config_->create_swap_stream()) {
+    return nullptr;
+  }
+  return cuda_config_.get();
+}
+
+base::Status TransformerModel::embedding_device(const tensor::Tensor& token_cu,
+                                               const tensor::Tensor& output) const {
+  CHECK_NE(layers_->embedding_layer_, nullptr);
+  tensor::Tensor token_num(base::DataType::kDataTypeInt32, static_cast<int32_t>(token_cu.size()));
+  return layers_->embedding_layer_->forward(token_cu, token_num, output);
+}
+
+base::Status TransformerModel::predict(const tensor::Tensor& input,
+                                       const tensor::Tensor& pos_tensor, bool is_prompt,
+                                       int& next) const {
+  select_sampler_slot(0, pos_tensor);
+  // the streamed weights move between the window slots, a captured graph would pin them
+  if (use_cuda_graph_ && !weight_streamer_ && !is_layer_split() &&
+      device_type_ == base::DeviceType::kDeviceCUDA) {
+    return forward_cuda_graph(input, pos_tensor, is_prompt, cuda_config_.get(), next);
+  }
+  auto status = forward(input, pos_tensor, next);
+  if (!status) {
+    return status;
+  }
+  next = post_processing(pos_tensor, is_prompt);
+  return is_prompt ? base::error::Success() : sampler_->last_status();
+}
+
+void TransformerModel::cls_logits(const tensor::Tensor& input) const {
+  CHECK(layers_ != nullptr);
+  const auto& norm = layers_->rmsnorm_layers_.at(2 * config_->layer_num_);
+  CHECK_NE(norm, nullptr);
+  STATUS_CHECK(norm->forward(input, input));
+
+  classify(input, cuda_stream());
+}
+
+int32_t TransformerModel::post_processing(const tensor::Tensor& pos, bool is_prompt) const {
+  return is_prompt ? -1 : sample(cuda_stream());
+}
+
+}  // namespace model
\ No newline at end of file
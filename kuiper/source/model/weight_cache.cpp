@@ -0,0 +1,244 @@
+#include "model/weight_cache.h"
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+namespace model {
+static constexpr uint32_t kCacheMagic = 0x4b574348;
+static constexpr uint32_t kCacheVersion = 1;
+// the image starts on a page, so it can be read with direct io
+static constexpr size_t kCacheDataOffset = 4096;
+static constexpr size_t kCacheStagingByteSize = 16 * 1024 * 1024;
+static constexpr int32_t kCacheStagingNum = 4;
+
+struct CacheHeader {
+  uint32_t magic = kCacheMagic;
+  uint32_t version = kCacheVersion;
+  uint64_t key = 0;
+  uint64_t byte_size = 0;
+};
+
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t byte_size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < byte_size; ++i) {
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+template <typename T>
+static uint64_t hash_value(uint64_t hash, const T& value) {
+  return hash_bytes(hash, &value, sizeof(T));
+}
+
+WeightCache::WeightCache(std::string cache_path) : cache_path_(std::move(cache_path)) {
+  CHECK(!cache_path_.empty());
+}
+
+WeightCache::~WeightCache() {
+  if (ptr_) {
+    cudaFree(ptr_);
+  }
+}
+
+void WeightCache::open(const std::string& model_path,
+                       const std::vector<std::shared_ptr<op::Layer>>& layers) {
+  // the size and the modification time stand for the content of the model file, hashing
+  // the weights would read all the pages the cache is there to skip
+  uint64_t key = 14695981039346656037ull;
+  key = hash_value(key, kCacheVersion);
+  key = hash_bytes(key, model_path.data(), model_path.size());
+  struct stat model_stat {};
+  if (stat(model_path.c_str(), &model_stat) == 0) {
+    key = hash_value(key, static_cast<int64_t>(model_stat.st_size));
+    key = hash_value(key, static_cast<int64_t>(model_stat.st_mtim.tv_sec));
+    key = hash_value(key, static_cast<int64_t>(model_stat.st_mtim.tv_nsec));
+  }
+  int32_t device_id = 0;
+  cudaDeviceProp prop{};
+  if (cudaGetDevice(&device_id) == cudaSuccess &&
+      cudaGetDeviceProperties(&prop, device_id) == cudaSuccess) {
+    key = hash_value(key, prop.major);
+    key = hash_value(key, prop.minor);
+    key = hash_bytes(key, prop.name, strnlen(prop.name, sizeof(prop.name)));
+  }
+  for (const auto& layer : layers) {
+    auto param_layer = std::dynamic_pointer_cast<op::LayerParam>(layer);
+    if (!param_layer) {
+      continue;
+    }
+    for (tensor::Tensor* tensor : param_layer->param_tensors()) {
+      key = hash_value(key, static_cast<int32_t>(tensor->data_type()));
+      for (int32_t dim : tensor->dims()) {
+        key = hash_value(key, dim);
+      }
+    }
+  }
+  key_ = key;
+
+  is_hit_ = false;
+  FILE* file = fopen(cache_path_.c_str(), "rb");
+  if (!file) {
+    return;
+  }
+  CacheHeader header;
+  const bool read = fread(&header, sizeof(CacheHeader), 1, file) == 1;
+  fclose(file);
+  is_hit_ = read && header.magic == kCacheMagic && header.version == kCacheVersion &&
+            header.key == key_;
+  byte_size_ = is_hit_ ? header.byte_size : 0;
+  if (read && !is_hit_) {
+    LOG(INFO) << "The weight cache " << cache_path_ << " is stale, it will be written again.";
+  }
+}
+
+bool WeightCache::is_hit() const { return is_hit_; }
+
+base::Status WeightCache::bind(const std::vector<std::shared_ptr<op::Layer>>& layers,
+                               cudaStream_t stream) {
+  if (ptr_) {
+    return base::error::InternalError("The cached weights are bound already.");
+  }
+  WeightLayout layout;
+  base::Status status = layout.build(layers);
+  if (!status) {
+    return status;
+  }
+  if (is_hit_ && layout.byte_size != byte_size_) {
+    return base::error::ModelParseError("The weight cache " + cache_path_ +
+                                        " does not match the layers, remove it.");
+  }
+  byte_size_ = layout.byte_size;
+  if (cudaMalloc(&ptr_, byte_size_) != cudaSuccess) {
+    cudaGetLastError();
+    ptr_ = nullptr;
+    return base::error::InternalError("Failed to allocate the cached weights.");
+  }
+
+  if (is_hit_) {
+    status = read_image(stream);
+    if (!status) {
+      return status;
+    }
+  } else {
+    for (int32_t root = 0; root < layout.roots.size(); ++root) {
+      const WeightLayout::Range& range = layout.ranges.at(layout.roots.at(root));
+      const cudaError_t state =
+          cudaMemcpyAsync(static_cast<int8_t*>(ptr_) + layout.root_offsets.at(root),
+                          range.begin, range.byte_size, cudaMemcpyHostToDevice, stream);
+      if (state != cudaSuccess) {
+        return base::error::InternalError("Failed to upload the cached weights.");
+      }
+    }
+    // the image is written from the host weights while the copies run
+    status = write_image(layout);
+    if (!status) {
+      LOG(WARNING) << "Failed to write the weight cache: " << status.get_err_msg();
+    }
+    if (cudaStreamSynchronize(stream) != cudaSuccess) {
+      return base::error::InternalError("Failed to upload the cached weights.");
+    }
+  }
+  layout.assign(ptr_);
+  return base::error::Success();
+}
+
+base::Status WeightCache::read_image(cudaStream_t stream) const {
+  int32_t fd = ::open(cache_path_.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return base::error::PathNotValid(cache_path_);
+  }
+  posix_fadvise(fd, kCacheDataOffset, byte_size_, POSIX_FADV_SEQUENTIAL);
+  auto alloc_host = base::CUDAHostAllocatorFactory::get_instance();
+  std::vector<std::shared_ptr<base::Buffer>> staging_buffers;
+  std::vector<cudaEvent_t> staging_events;
+  for (int32_t i = 0; i < kCacheStagingNum; ++i) {
+    auto buffer = std::make_shared<base::Buffer>(kCacheStagingByteSize, alloc_host);
+    CHECK(buffer->ptr() != nullptr) << "Failed to allocate the pinned staging buffers.";
+    staging_buffers.push_back(buffer);
+    cudaEvent_t event;
+    CHECK(cudaEventCreateWithFlags(&event, cudaEventDisableTiming) == cudaSuccess);
+    staging_events.push_back(event);
+  }
+
+  // the read of a chunk overlaps the copies of the chunks before it
+  bool is_read = true;
+  std::vector<bool> event_recorded(staging_buffers.size(), false);
+  size_t chunk_idx = 0;
+  for (size_t offset = 0; offset < byte_size_ && is_read; offset += kCacheStagingByteSize) {
+    const size_t slot = chunk_idx++ % staging_buffers.size();
+    const size_t chunk_size = std::min(kCacheStagingByteSize, byte_size_ - offset);
+    if (event_recorded.at(slot)) {
+      cudaEventSynchronize(staging_events.at(slot));
+    }
+    int8_t* staging_ptr = static_cast<int8_t*>(staging_buffers.at(slot)->ptr());
+    size_t read_size = 0;
+    while (read_size < chunk_size) {
+      const ssize_t size = pread(fd, staging_ptr + read_size, chunk_size - read_size,
+                                 kCacheDataOffset + offset + read_size);
+      if (size <= 0) {
+        is_read = false;
+        break;
+      }
+      read_size += size;
+    }
+    cudaMemcpyAsync(static_cast<int8_t*>(ptr_) + offset, staging_ptr, chunk_size,
+                    cudaMemcpyHostToDevice, stream);
+    cudaEventRecord(staging_events.at(slot), stream);
+    event_recorded.at(slot) = true;
+  }
+  const bool is_copied = cudaStreamSynchronize(stream) == cudaSuccess;
+  for (cudaEvent_t event : staging_events) {
+    cudaEventDestroy(event);
+  }
+  close(fd);
+  if (!is_read) {
+    return base::error::ModelParseError("The weight cache " + cache_path_ +
+                                        " is truncated, remove it.");
+  }
+  if (!is_copied) {
+    return base::error::InternalError("Failed to upload the cached weights.");
+  }
+  return base::error::Success();
+}
+
+base::Status WeightCache::write_image(const WeightLayout& layout) const {
+  // written aside first, so a crash never leaves half an image behind the right key
+  const std::string temp_path = cache_path_ + ".tmp";
+  int32_t fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    return base::error::PathNotValid(temp_path);
+  }
+  CacheHeader header;
+  header.key = key_;
+  header.byte_size = byte_size_;
+  bool written = pwrite(fd, &header, sizeof(CacheHeader), 0) == sizeof(CacheHeader);
+  // the padding between the roots is left as a hole
+  written = written && ftruncate(fd, kCacheDataOffset + byte_size_) == 0;
+  for (int32_t root = 0; root < layout.roots.size() && written; ++root) {
+    const WeightLayout::Range& range = layout.ranges.at(layout.roots.at(root));
+    size_t write_size = 0;
+    while (write_size < range.byte_size) {
+      const ssize_t size =
+          pwrite(fd, range.begin + write_size, range.byte_size - write_size,
+                 kCacheDataOffset + layout.root_offsets.at(root) + write_size);
+      if (size <= 0) {
+        written = false;
+        break;
+      }
+      write_size += size;
+    }
+  }
+  close(fd);
+  if (!written || std::rename(temp_path.c_str(), cache_path_.c_str()) != 0) {
+    std::remove(temp_path.c_str());
+    return base::error::InternalError("Failed to write the weight cache to " + cache_path_);
+  }
+  return base::error::Success();
+}
+
+size_t WeightCache::byte_size() const { return byte_size_; }
+}  // namespace model
@@ -0,0 +1,190 @@
+#include "model/weight_streamer.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <cstring>
+#include "base/alloc.h"
+namespace model {
+// the device slots and the host copies start on this boundary
+static constexpr size_t kStreamAlignment = 256;
+
+struct ParamRange {
+  tensor::Tensor* tensor = nullptr;
+  const int8_t* begin = nullptr;
+  size_t byte_size = 0;
+};
+
+// sorted by the address, a tensor which lies in an earlier one follows it
+static std::vector<ParamRange> collect_params(
+    const std::vector<std::shared_ptr<op::Layer>>& layers) {
+  std::vector<ParamRange> ranges;
+  for (const auto& layer : layers) {
+    auto param_layer = std::dynamic_pointer_cast<op::LayerParam>(layer);
+    if (!param_layer) {
+      continue;
+    }
+    for (tensor::Tensor* tensor : param_layer->param_tensors()) {
+      ranges.push_back({tensor, tensor->ptr<int8_t>(), tensor->byte_size()});
+    }
+  }
+  std::sort(ranges.begin(), ranges.end(), [](const ParamRange& a, const ParamRange& b) {
+    if (a.begin != b.begin) {
+      return a.begin < b.begin;
+    }
+    return a.byte_size > b.byte_size;
+  });
+  return ranges;
+}
+
+static size_t align_up(size_t byte_size) {
+  return (byte_size + kStreamAlignment - 1) / kStreamAlignment * kStreamAlignment;
+}
+
+WeightStreamer::WeightStreamer() {
+  CHECK_EQ(cudaStreamCreateWithFlags(&copy_stream_, cudaStreamNonBlocking), cudaSuccess);
+  for (int32_t slot = 0; slot < 2; ++slot) {
+    CHECK_EQ(cudaEventCreateWithFlags(&copy_done_[slot], cudaEventDisableTiming), cudaSuccess);
+    CHECK_EQ(cudaEventCreateWithFlags(&compute_done_[slot], cudaEventDisableTiming), cudaSuccess);
+  }
+}
+
+WeightStreamer::~WeightStreamer() {
+  if (copy_stream_) {
+    cudaStreamSynchronize(copy_stream_);
+  }
+  for (int32_t slot = 0; slot < 2; ++slot) {
+    if (compute_done_[slot]) {
+      cudaEventSynchronize(compute_done_[slot]);
+      cudaEventDestroy(compute_done_[slot]);
+    }
+    if (copy_done_[slot]) {
+      cudaEventDestroy(copy_done_[slot]);
+    }
+  }
+  if (copy_stream_) {
+    cudaStreamDestroy(copy_stream_);
+  }
+}
+
+size_t WeightStreamer::param_byte_size(const std::vector<std::shared_ptr<op::Layer>>& layers) {
+  size_t byte_size = 0;
+  const int8_t* root_end = nullptr;
+  for (const ParamRange& range : collect_params(layers)) {
+    if (range.begin + range.byte_size <= root_end) {
+      continue;
+    }
+    CHECK(range.begin >= root_end) << "The weights of a layer overlap partially.";
+    byte_size += align_up(range.byte_size);
+    root_end = range.begin + range.byte_size;
+  }
+  return byte_size;
+}
+
+void WeightStreamer::add_layer(int32_t layer_idx,
+                               const std::vector<std::shared_ptr<op::Layer>>& layers) {
+  CHECK(!layers_.count(layer_idx)) << "The layer " << layer_idx << " is streamed already.";
+  const std::vector<ParamRange> ranges = collect_params(layers);
+  if (ranges.empty()) {
+    return;
+  }
+
+  StreamedLayer streamed;
+  streamed.host = std::make_shared<base::Buffer>(param_byte_size(layers),
+                                                 base::CUDAHostAllocatorFactory::get_instance());
+  CHECK(streamed.host->ptr() != nullptr) << "Failed to allocate the pinned weights of a layer.";
+  streamed.host->set_tag(base::MemoryTag::kMemoryTagWeight);
+
+  // every root range is copied once, the tensors inside it keep their offset to the root
+  int8_t* host_ptr = static_cast<int8_t*>(streamed.host->ptr());
+  const int8_t* root_begin = nullptr;
+  const int8_t* root_end = nullptr;
+  size_t root_offset = 0;
+  size_t offset = 0;
+  for (const ParamRange& range : ranges) {
+    CHECK(range.tensor->device_type() == base::DeviceType::kDeviceCPU)
+        << "The streamed weights have to be in the cpu memory.";
+    if (range.begin + range.byte_size > root_end) {
+      root_begin = range.begin;
+      root_end = range.begin + range.byte_size;
+      root_offset = offset;
+      std::memcpy(host_ptr + offset, range.begin, range.byte_size);
+      offset += align_up(range.byte_size);
+    }
+    streamed.bindings.push_back({range.tensor, root_offset + (range.begin - root_begin)});
+  }
+  CHECK_EQ(offset, streamed.host->byte_size());
+
+  bind(streamed, host_ptr, base::DeviceType::kDeviceCPU);
+  slot_byte_size_ = std::max(slot_byte_size_, offset);
+  layers_.emplace(layer_idx, std::move(streamed));
+}
+
+void WeightStreamer::acquire(int32_t layer_idx, cudaStream_t stream) {
+  auto iter = layers_.find(layer_idx);
+  if (iter == layers_.end()) {
+    return;
+  }
+  if (!slots_[0]) {
+    std::shared_ptr<base::DeviceAllocator> alloc_cu =
+        base::CUDADeviceAllocatorFactory::get_instance();
+    for (int32_t slot = 0; slot < 2; ++slot) {
+      slots_[slot] = std::make_shared<base::Buffer>(slot_byte_size_, alloc_cu);
+      CHECK(slots_[slot]->ptr() != nullptr) << "Failed to allocate the weight window.";
+      slots_[slot]->set_tag(base::MemoryTag::kMemoryTagWeight);
+    }
+  }
+
+  // the slot of the previous layer is free once the work enqueued so far is done
+  if (current_slot_ >= 0) {
+    CHECK_EQ(cudaEventRecord(compute_done_[current_slot_], stream), cudaSuccess);
+  }
+  int32_t slot = -1;
+  for (int32_t i = 0; i < 2; ++i) {
+    if (slot_layers_[i] == layer_idx) {
+      slot = i;
+    }
+  }
+  if (slot < 0) {
+    slot = current_slot_ < 0 ? 0 : 1 - current_slot_;
+    load(layer_idx, slot);
+  }
+  CHECK_EQ(cudaStreamWaitEvent(stream, copy_done_[slot]), cudaSuccess);
+  bind(iter->second, slots_[slot]->ptr(), base::DeviceType::kDeviceCUDA);
+  current_slot_ = slot;
+
+  // the next streamed layer, the first one again after the last layer of a step
+  auto next = std::next(iter);
+  if (next == layers_.end()) {
+    next = layers_.begin();
+  }
+  const int32_t other = 1 - slot;
+  if (next->first != layer_idx && slot_layers_[other] != next->first) {
+    load(next->first, other);
+  }
+}
+
+void WeightStreamer::load(int32_t layer_idx, int32_t slot) {
+  const StreamedLayer& layer = layers_.at(layer_idx);
+  // an event which was never recorded does not block the copy
+  CHECK_EQ(cudaStreamWaitEvent(copy_stream_, compute_done_[slot]), cudaSuccess);
+  CHECK_EQ(cudaMemcpyAsync(slots_[slot]->ptr(), layer.host->ptr(), layer.host->byte_size(),
+                           cudaMemcpyHostToDevice, copy_stream_),
+           cudaSuccess);
+  CHECK_EQ(cudaEventRecord(copy_done_[slot], copy_stream_), cudaSuccess);
+  slot_layers_[slot] = layer_idx;
+}
+
+void WeightStreamer::bind(const StreamedLayer& layer, void* base_ptr,
+                          base::DeviceType device_type) {
+  for (const Binding& binding : layer.bindings) {
+    tensor::Tensor& tensor = *binding.tensor;
+    tensor::Tensor view(tensor.data_type(), tensor.dims(), false, nullptr,
+                        static_cast<int8_t*>(base_ptr) + binding.offset);
+    view.set_device_type(device_type);
+    tensor = view;
+  }
+}
+
+bool WeightStreamer::is_streamed(int32_t layer_idx) const { return layers_.count(layer_idx); }
+
+size_t WeightStreamer::window_byte_size() const { return 2 * slot_byte_size_; }
+}  // namespace model
@@ -12,30 +12,37 @@ base::Status VecAddLayer::check() const {
   tensor::Tensor input2 = this->get_input(1);
   int32_t size = input1.size();
   base::Status status;
-  status = check_tensor_with_dim(input1, device_type_, data_type_, size);
+  status = check_tensor(input1, device_type_, data_type_);
   if (!status) {
     LOG(ERROR) << "The input tensor 1 error in the add layer.";
     return status;
   }
 
-  status = check_tensor_with_dim(input2, device_type_, data_type_, size);
+  status = check_tensor(input2, device_type_, data_type_);
   if (!status) {
     LOG(ERROR) << "The input tensor 2 error in the add layer.";
     return status;
   }
 
-  status = check_tensor_with_dim(get_output(0), device_type_, data_type_, size);
+  status = check_tensor(get_output(0), device_type_, data_type_);
   if (!status) {
     LOG(ERROR) << "The output tensor error in the add layer.";
     return status;
   }
+
+  if (input2.size() != size || get_output(0).size() != size) {
+    LOG(ERROR) << "The input and output tensor have different sizes in the add layer.";
+    return base::error::InvalidArgument("The size of input and output tensor is mismatched.");
+  }
   return base::error::Success();
 }
 
 base::Status VecAddLayer::forward() {
-  auto status = this->check();
-  if (!status) {
-    return status;
+  if (check_enabled_) {
+    auto status = this->check();
+    if (!status) {
+      return status;
+    }
   }
   auto input1 = this->get_input(0);
   auto input2 = this->get_input(1);
@@ -48,4 +55,5 @@ base::Status VecAddLayer::forward() {
   return base::error::Success();
 }
 
+std::shared_ptr<Layer> VecAddLayer::clone() const { return std::make_shared<VecAddLayer>(*this); }
 }  // namespace op
\ No newline at end of file
@@ -21,14 +21,21 @@ base::Status EmbeddingLayer::check() const {
     return base::error::InvalidArgument("The number of input tensor is greater than seq len.");
   }
 
-  base::Status status = check_tensor_with_dim(input_tensor, base::DeviceType::kDeviceCPU,
+  // the cuda kernel also reads the tokens which a sampler left on the device
+  base::DeviceType input_device = base::DeviceType::kDeviceCPU;
+  if (device_type_ == base::DeviceType::kDeviceCUDA &&
+      input_tensor.device_type() == base::DeviceType::kDeviceCUDA) {
+    input_device = base::DeviceType::kDeviceCUDA;
+  }
+  base::Status status = check_tensor_with_dim(input_tensor, input_device,
                                               base::DataType::kDataTypeInt32, token_size);
   if (!status) {
     LOG(ERROR) << "The input tensor error in the embedding layer.";
     return status;
   }
 
-  status = check_tensor_with_dim(get_weight(0), device_type_, data_type_, vocab_size_, dim_);
+  status =
+      check_tensor_with_dim(get_weight(0), device_type_, weight_data_type_, vocab_size_, dim_);
   if (!status) {
     LOG(ERROR) << "The weight tensor error in the embedding layer.";
     return status;
@@ -43,9 +50,11 @@ base::Status EmbeddingLayer::check() const {
 }
 
 base::Status EmbeddingLayer::forward() {
-  base::Status status = check();
-  if (!status) {
-    return status;
+  if (check_enabled_) {
+    auto status = check();
+    if (!status) {
+      return status;
+    }
   }
   if (device_type_ == base::DeviceType::kDeviceCUDA) {
     CHECK(cuda_config_ != nullptr);
@@ -54,4 +63,8 @@ base::Status EmbeddingLayer::forward() {
                                        cuda_config_ ? cuda_config_->stream : nullptr);
   return base::StatusCode::kSuccess;
 }
+
+std::shared_ptr<Layer> EmbeddingLayer::clone() const {
+  return std::make_shared<EmbeddingLayer>(*this);
+}
 }  // namespace op
\ No newline at end of file
@@ -1,5 +1,9 @@
 #include "op/encode.h"
 #include <glog/logging.h>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include "base/token_cache.h"
 #include "base/unicode.h"
 namespace op {
 
@@ -10,6 +14,21 @@ namespace op {
 //       has_eos_(has_eos),
 //       spe(std::move(sentence_piece_processor)) {}
 
+// replaces every from in one pass over the text
+static std::string replace_all(const std::string& text, const std::string& from,
+                               const std::string& to) {
+  std::string result;
+  result.reserve(text.size() + text.size() / 4);
+  size_t begin = 0;
+  for (size_t pos = text.find(from); pos != std::string::npos; pos = text.find(from, begin)) {
+    result.append(text, begin, pos - begin);
+    result.append(to);
+    begin = pos + from.size();
+  }
+  result.append(text, begin, std::string::npos);
+  return result;
+}
+
 std::string SpeEncodeLayer::decode(int32_t token_id) const {
   CHECK(spe != nullptr);
   std::vector<int32_t> token_ids{token_id};
@@ -45,11 +64,39 @@ std::vector<int32_t> SpeEncodeLayer::encode(const std::string& sentence) const {
   return input_ids;
 }
 
+std::string SpeEncodeLayer::token_bytes(int32_t token_id, bool is_first) const {
+  CHECK(spe != nullptr);
+  if (spe->IsControl(token_id)) {
+    return "";
+  }
+  if (spe->IsUnknown(token_id)) {
+    // the surface of the unknown piece in a decode
+    return is_first ? "\xE2\x81\x87 " : " \xE2\x81\x87 ";
+  }
+  const std::string& piece = spe->IdToPiece(token_id);
+  if (spe->IsByte(token_id)) {
+    // the pieces of the byte fallback are written as <0xAB>
+    CHECK_EQ(piece.size(), 6);
+    return std::string(1, static_cast<char>(std::stoi(piece.substr(3, 2), nullptr, 16)));
+  }
+  // the pieces use U+2581 for the space
+  std::string bytes = replace_all(piece, "\xE2\x96\x81", " ");
+  if (is_first && !bytes.empty() && bytes.front() == ' ') {
+    bytes.erase(0, 1);
+  }
+  return bytes;
+}
+
 bool SpeEncodeLayer::is_sentence_ending(int32_t token_id) const {
   CHECK(this->spe != nullptr);
   return token_id == this->spe->eos_id();
 }
 
+std::vector<int32_t> SpeEncodeLayer::sentence_ending_tokens() const {
+  CHECK(this->spe != nullptr);
+  return {this->spe->eos_id()};
+}
+
 int32_t SpeEncodeLayer::vocab_size() const {
   CHECK(spe != nullptr);
   return spe->GetPieceSize();
@@ -59,56 +106,93 @@ int32_t SpeEncodeLayer::vocab_size() const {
 static const std::string PAT_STR =
     R"((?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?:$|[^\S])|\s+)";
 
+// the pieces of PAT_STR never cross a newline followed by a letter, a long prompt is cut there
+// and pre-tokenized on the thread pool
+static constexpr size_t kMinSegmentSize = 8192;
+
+// the cache of the processed vocab next to the tokenizer.json, KUIPER_TOKENIZER_CACHE gives
+// another path for it or turns it off with 0
+static std::string token_cache_path(const std::string& token_model_path) {
+  const char* env = std::getenv("KUIPER_TOKENIZER_CACHE");
+  if (env == nullptr || *env == '\0') {
+    return token_model_path + ".kcache";
+  }
+  if (std::string(env) == "0") {
+    return "";
+  }
+  return env;
+}
+
 BpeEncodeLayer::BpeEncodeLayer(std::string token_model_path, bool has_bos, bool has_eos)
+    : BpeEncodeLayer(std::move(token_model_path), has_bos, has_eos, "<|begin_of_text|>",
+                     "<|end_of_text|>", "<|eot_id|>") {}
+
+BpeEncodeLayer::BpeEncodeLayer(std::string token_model_path, bool has_bos, bool has_eos,
+                               const std::string& bos_token, const std::string& eos_token,
+                               const std::string& stop_token)
     : EncodeLayerBase(std::move(token_model_path), has_bos, has_eos) {
-  using json = nlohmann::json;
-  std::ifstream f(token_model_path_);
-  CHECK(f.is_open())
-      << "The token model path is not valid, please check the path and type of token model.";
-  json data;
-  try {
-    data = json::parse(f);
-  } catch (json::parse_error&) {
-    LOG(FATAL)
+  ankerl::unordered_dense::map<std::string, int> special_tokens;
+  // a start after the first maps the tables instead of parsing and converting the json
+  const std::string cache_path = token_cache_path(token_model_path_);
+  std::shared_ptr<base::TokenCache> cache;
+  if (!cache_path.empty() && base::TokenCache::map_file(cache_path, token_model_path_, cache)) {
+    special_tokens = cache->special_encoder();
+    num_token_ = cache->token_num() + special_tokens.size();
+    tiktoken_ = std::make_unique<tiktoken::tiktoken>(std::move(cache), PAT_STR);
+  } else {
+    using json = nlohmann::json;
+    std::ifstream f(token_model_path_);
+    CHECK(f.is_open())
         << "The token model path is not valid, please check the path and type of token model.";
-  }
+    json data;
+    try {
+      data = json::parse(f);
+    } catch (json::parse_error&) {
+      LOG(FATAL)
+          << "The token model path is not valid, please check the path and type of token model.";
+    }
 
-  const auto& datas = data["added_tokens"];
-  ankerl::unordered_dense::map<std::string, int> special_tokens;
-  for (const auto& data1 : datas) {
-    int id = data1["id"];
-    std::string content = data1["content"];
-    special_tokens.insert({content, id});
-  }
+    const auto& datas = data["added_tokens"];
+    for (const auto& data1 : datas) {
+      int id = data1["id"];
+      std::string content = data1["content"];
+      special_tokens.insert({content, id});
+    }
 
-  ankerl::unordered_dense::map<std::string, int> encoder;
-  const auto& vocabs = data["model"]["vocab"];
-  const auto& vocab_items = vocabs.items();
-  for (const auto& v : vocab_items) {
-    const auto cpts = unicode_cpts_from_utf8(v.key());
-    std::string key;
-    for (const auto cpt : cpts) {
-      const auto utf8 = unicode_cpt_to_utf8(cpt);
-      key += unicode_utf8_to_byte(utf8);
+    ankerl::unordered_dense::map<std::string, int> encoder;
+    const auto& vocabs = data["model"]["vocab"];
+    const auto& vocab_items = vocabs.items();
+    for (const auto& v : vocab_items) {
+      const auto cpts = unicode_cpts_from_utf8(v.key());
+      std::string key;
+      for (const auto cpt : cpts) {
+        const auto utf8 = unicode_cpt_to_utf8(cpt);
+        key += unicode_utf8_to_byte(utf8);
+      }
+      const int32_t id = v.value();
+      encoder[key] = id;
+    }
+    if (!cache_path.empty()) {
+      // a directory which is only read keeps the parse on every start
+      auto status =
+          base::TokenCache::write_file(cache_path, token_model_path_, encoder, special_tokens);
+      if (!status) {
+        LOG(WARNING) << "Failed to write the tokenizer cache: " << status.get_err_msg();
+      }
     }
-    const int32_t id = v.value();
-    encoder[key] = id;
+    num_token_ = encoder.size() + special_tokens.size();
+    tiktoken_ = std::make_unique<tiktoken::tiktoken>(std::move(encoder), special_tokens, PAT_STR);
   }
-  bos_id_ = special_tokens["<|begin_of_text|>"];
-  eos_id_ = special_tokens["<|end_of_text|>"];
+  bos_id_ = special_tokens[bos_token];
+  eos_id_ = special_tokens[eos_token];
   stop_token1_ = eos_id_;
-  stop_token2_ = special_tokens["<|eot_id|>"];
-
-  num_token_ = encoder.size() + special_tokens.size();
-  tiktoken_ = std::make_unique<tiktoken::tiktoken>(encoder, special_tokens, PAT_STR);
+  stop_token2_ = special_tokens[stop_token];
+  tiktoken_->set_parallel_segment_size(kMinSegmentSize);
 }
 
 std::vector<int32_t> BpeEncodeLayer::encode(const std::string& sentence) const {
   CHECK(this->tiktoken_ != nullptr);
-  std::map<std::string, std::string> replacements;
-  replacements[" "] = "Ġ";
-  std::string s = absl::StrReplaceAll(sentence, replacements);
-  auto input_ids = this->tiktoken_->encode(s);
+  auto input_ids = this->tiktoken_->encode(replace_all(sentence, " ", "Ġ"));
 
   if (has_bos_) {
     input_ids.insert(input_ids.begin(), bos_id_);
@@ -119,15 +203,19 @@ std::vector<int32_t> BpeEncodeLayer::encode(const std::string& sentence) const {
   return input_ids;
 }
 
-std::string BpeEncodeLayer::decode(int32_t token_id) const { return ""; }
+std::string BpeEncodeLayer::decode(int32_t token_id) const {
+  CHECK(this->tiktoken_ != nullptr);
+  return replace_all(tiktoken_->decode({token_id}), "Ġ", " ");
+}
 
 std::string BpeEncodeLayer::decode(const std::vector<int32_t>& token_ids) const {
   CHECK(this->tiktoken_ != nullptr);
-  auto s = tiktoken_->decode(token_ids);
-  std::map<std::string, std::string> reverse_replacements;
-  reverse_replacements["Ġ"] = " ";
-  const std::string& sentence = absl::StrReplaceAll(s, reverse_replacements);
-  return sentence;
+  return replace_all(tiktoken_->decode(token_ids), "Ġ", " ");
+}
+
+std::string BpeEncodeLayer::token_bytes(int32_t token_id, bool is_first) const {
+  // the byte level tokens decode to their bytes, a character of several bytes can be split
+  return decode(token_id);
 }
 
 bool BpeEncodeLayer::is_sentence_ending(int32_t token_id) const {
@@ -138,46 +226,24 @@ bool BpeEncodeLayer::is_sentence_ending(int32_t token_id) const {
   }
 }
 
+std::vector<int32_t> BpeEncodeLayer::sentence_ending_tokens() const {
+  std::vector<int32_t> tokens;
+  for (int32_t token_id : {stop_token1_, stop_token2_}) {
+    if (token_id >= 0 && std::find(tokens.begin(), tokens.end(), token_id) == tokens.end()) {
+      tokens.push_back(token_id);
+    }
+  }
+  return tokens;
+}
+
 int32_t BpeEncodeLayer::vocab_size() const {
   CHECK(this->tiktoken_ != nullptr);
   return num_token_;
 }
 
 QwenEncodeLayer::QwenEncodeLayer(std::string token_model_path, bool has_bos, bool has_eos)
-    : BpeEncodeLayer(std::move(token_model_path), has_bos, has_eos) {
-  using json = nlohmann::json;
-  std::ifstream f(token_model_path_);
-
-  json data = json::parse(f);
-  const auto& datas = data["added_tokens"];
-  ankerl::unordered_dense::map<std::string, int> special_tokens;
-  for (const auto& data1 : datas) {
-    int id = data1["id"];
-    std::string content = data1["content"];
-    special_tokens.insert({content, id});
-  }
-
-  ankerl::unordered_dense::map<std::string, int> encoder;
-  const auto& vocabs = data["model"]["vocab"];
-  const auto& vocab_items = vocabs.items();
-  for (const auto& v : vocab_items) {
-    const auto cpts = unicode_cpts_from_utf8(v.key());
-    std::string key;
-    for (const auto cpt : cpts) {
-      const auto utf8 = unicode_cpt_to_utf8(cpt);
-      key += unicode_utf8_to_byte(utf8);
-    }
-    const int32_t id = v.value();
-    encoder[key] = id;
-  }
-  bos_id_ = special_tokens["<|im_start|>"];
-  eos_id_ = special_tokens["<|im_end|>"];
-  stop_token1_ = eos_id_;
-  stop_token2_ = special_tokens["<|endoftext|>"];
-
-  num_token_ = encoder.size() + special_tokens.size();
-  tiktoken_ = std::make_unique<tiktoken::tiktoken>(encoder, special_tokens, PAT_STR);
-}
+    : BpeEncodeLayer(std::move(token_model_path), has_bos, has_eos, "<|im_start|>", "<|im_end|>",
+                     "<|endoftext|>") {}
 
 #endif
 }  // namespace op
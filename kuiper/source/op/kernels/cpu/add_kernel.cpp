@@ -9,8 +9,19 @@ void add_kernel_cpu(const tensor::Tensor& input1, const tensor::Tensor& input2,
   CHECK_EQ(input2.is_empty(), false);
   CHECK_EQ(output.is_empty(), false);
 
-  CHECK_EQ(input1.size(), input2.size());
   CHECK_EQ(input1.size(), output.size());
+  if (input1.size() != input2.size()) {
+    // input2 is a row (such as the bias) added to every row of input1
+    const size_t row_size = input2.size();
+    CHECK_EQ(input1.size() % row_size, 0);
+    arma::fvec row_vec(const_cast<float*>(input2.ptr<float>()), row_size, false, true);
+    for (size_t i = 0; i < input1.size(); i += row_size) {
+      arma::fvec input_vec(const_cast<float*>(input1.ptr<float>()) + i, row_size, false, true);
+      arma::fvec output_vec(const_cast<float*>(output.ptr<float>()) + i, row_size, false, true);
+      output_vec = input_vec + row_vec;
+    }
+    return;
+  }
 
   arma::fvec input_vec1(const_cast<float*>(input1.ptr<float>()), input1.size(), false, true);
   arma::fvec input_vec2(const_cast<float*>(input2.ptr<float>()), input2.size(), false, true);
@@ -28,4 +28,21 @@ void emb_kernel_normal(const tensor::Tensor& input, const tensor::Tensor& weight
   }
 }
 
+void gather_columns_kernel_cpu(const tensor::Tensor& input, const tensor::Tensor& order,
+                               const tensor::Tensor& output, void* stream) {
+  UNUSED(stream);
+  CHECK(!input.is_empty() && !order.is_empty());
+  CHECK_EQ(input.size(), output.size());
+  const int32_t cols = static_cast<int32_t>(order.size());
+  CHECK_EQ(input.size() % cols, 0);
+  const int32_t rows = static_cast<int32_t>(input.size() / cols);
+  const int32_t* order_ptr = order.ptr<int32_t>();
+  for (int32_t i = 0; i < rows; ++i) {
+    const float* src = input.ptr<float>() + static_cast<int64_t>(i) * cols;
+    float* dst = const_cast<float*>(output.ptr<float>()) + static_cast<int64_t>(i) * cols;
+    for (int32_t j = 0; j < cols; ++j) {
+      dst[j] = src[order_ptr[j]];
+    }
+  }
+}
 }  // namespace kernel
\ No newline at end of file
@@ -10,5 +10,9 @@ namespace kernel {
 void emb_kernel_normal(const tensor::Tensor& input, const tensor::Tensor& weight,
                        const tensor::Tensor& output, int32_t vocab_size,
                        void* stream = nullptr);
+
+// output[n][j] = input[n][order[j]] for every row n of the input
+void gather_columns_kernel_cpu(const tensor::Tensor& input, const tensor::Tensor& order,
+                               const tensor::Tensor& output, void* stream = nullptr);
 }  // namespace kernel
 #endif  // KUIPER_INFER_EMB_KERNEL_H
@@ -0,0 +1,685 @@
+#include "gemv_kernel.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include "base/thread_pool.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KUIPER_GEMV_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define KUIPER_GEMV_NEON
+#endif
+namespace kernel {
+// a part of the rows on one thread has at least this many multiply adds
+static constexpr int32_t kGemvMinPartWork = 1 << 16;
+
+static int32_t gemv_min_part_rows(int32_t cols) { return std::max(kGemvMinPartWork / cols, 4); }
+
+// the input rows of the gemm which are kept in the cache together
+static constexpr int32_t kGemmRowBlock = 16;
+
+using GemvRows = void (*)(const float* input, const float* weight, float* output,
+                          int32_t row_begin, int32_t row_end, int32_t cols, float scale);
+
+static void gemv_rows_scalar(const float* input, const float* weight, float* output,
+                             int32_t row_begin, int32_t row_end, int32_t cols, float scale) {
+  for (int32_t row = row_begin; row < row_end; ++row) {
+    const float* weight_row = weight + static_cast<size_t>(row) * cols;
+    float sum = 0.f;
+    for (int32_t i = 0; i < cols; ++i) {
+      sum += weight_row[i] * input[i];
+    }
+    output[row] = sum * scale;
+  }
+}
+
+// the gemm tile, four weight rows with two input rows, so a loaded vector of the weights is used
+// for two rows and a loaded vector of the input for four. out0 and out1 get the four outputs of
+// the two input rows
+using GemmTile = void (*)(const float* input0, const float* input1, const float* weight,
+                          float* out0, float* out1, int32_t cols, float scale);
+
+static void gemm_tile_scalar(const float* input0, const float* input1, const float* weight,
+                             float* out0, float* out1, int32_t cols, float scale) {
+  for (int32_t r = 0; r < 4; ++r) {
+    const float* weight_row = weight + static_cast<size_t>(r) * cols;
+    float sum0 = 0.f;
+    float sum1 = 0.f;
+    for (int32_t i = 0; i < cols; ++i) {
+      sum0 += weight_row[i] * input0[i];
+      sum1 += weight_row[i] * input1[i];
+    }
+    out0[r] = sum0 * scale;
+    out1[r] = sum1 * scale;
+  }
+}
+
+// Every kernel runs four rows at a time, so a vector of the input is loaded once for four
+// weight rows, and the weight rows are streamed through the cache only once.
+#ifdef KUIPER_GEMV_X86
+__attribute__((target("avx2,fma"))) static float reduce_avx2(__m256 value) {
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(value), _mm256_extractf128_ps(value, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+  return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx2,fma"))) static void gemv_rows_avx2(
+    const float* input, const float* weight, float* output, int32_t row_begin, int32_t row_end,
+    int32_t cols, float scale) {
+  const int32_t vec_cols = cols / 8 * 8;
+  int32_t row = row_begin;
+  for (; row + 4 <= row_end; row += 4) {
+    const float* w0 = weight + static_cast<size_t>(row) * cols;
+    const float* w1 = w0 + cols;
+    const float* w2 = w1 + cols;
+    const float* w3 = w2 + cols;
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps();
+    __m256 acc3 = _mm256_setzero_ps();
+    for (int32_t i = 0; i < vec_cols; i += 8) {
+      const __m256 x = _mm256_loadu_ps(input + i);
+      acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(w0 + i), x, acc0);
+      acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(w1 + i), x, acc1);
+      acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(w2 + i), x, acc2);
+      acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(w3 + i), x, acc3);
+    }
+    float sum0 = reduce_avx2(acc0);
+    float sum1 = reduce_avx2(acc1);
+    float sum2 = reduce_avx2(acc2);
+    float sum3 = reduce_avx2(acc3);
+    for (int32_t i = vec_cols; i < cols; ++i) {
+      sum0 += w0[i] * input[i];
+      sum1 += w1[i] * input[i];
+      sum2 += w2[i] * input[i];
+      sum3 += w3[i] * input[i];
+    }
+    output[row] = sum0 * scale;
+    output[row + 1] = sum1 * scale;
+    output[row + 2] = sum2 * scale;
+    output[row + 3] = sum3 * scale;
+  }
+  for (; row < row_end; ++row) {
+    const float* w0 = weight + static_cast<size_t>(row) * cols;
+    __m256 acc0 = _mm256_setzero_ps();
+    for (int32_t i = 0; i < vec_cols; i += 8) {
+      acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(w0 + i), _mm256_loadu_ps(input + i), acc0);
+    }
+    float sum0 = reduce_avx2(acc0);
+    for (int32_t i = vec_cols; i < cols; ++i) {
+      sum0 += w0[i] * input[i];
+    }
+    output[row] = sum0 * scale;
+  }
+}
+
+__attribute__((target("avx2,fma"))) static void gemm_tile_avx2(
+    const float* input0, const float* input1, const float* weight, float* out0, float* out1,
+    int32_t cols, float scale) {
+  const int32_t vec_cols = cols / 8 * 8;
+  __m256 acc0[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(),
+                    _mm256_setzero_ps()};
+  __m256 acc1[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(),
+                    _mm256_setzero_ps()};
+  for (int32_t i = 0; i < vec_cols; i += 8) {
+    const __m256 x0 = _mm256_loadu_ps(input0 + i);
+    const __m256 x1 = _mm256_loadu_ps(input1 + i);
+    for (int32_t r = 0; r < 4; ++r) {
+      const __m256 w = _mm256_loadu_ps(weight + static_cast<size_t>(r) * cols + i);
+      acc0[r] = _mm256_fmadd_ps(w, x0, acc0[r]);
+      acc1[r] = _mm256_fmadd_ps(w, x1, acc1[r]);
+    }
+  }
+  for (int32_t r = 0; r < 4; ++r) {
+    const float* weight_row = weight + static_cast<size_t>(r) * cols;
+    float sum0 = reduce_avx2(acc0[r]);
+    float sum1 = reduce_avx2(acc1[r]);
+    for (int32_t i = vec_cols; i < cols; ++i) {
+      sum0 += weight_row[i] * input0[i];
+      sum1 += weight_row[i] * input1[i];
+    }
+    out0[r] = sum0 * scale;
+    out1[r] = sum1 * scale;
+  }
+}
+
+__attribute__((target("avx512f"))) static void gemv_rows_avx512(
+    const float* input, const float* weight, float* output, int32_t row_begin, int32_t row_end,
+    int32_t cols, float scale) {
+  const int32_t vec_cols = cols / 16 * 16;
+  // the tail columns are loaded under a mask instead of a scalar loop
+  const __mmask16 tail_mask = static_cast<__mmask16>((1u << (cols - vec_cols)) - 1);
+  int32_t row = row_begin;
+  for (; row + 4 <= row_end; row += 4) {
+    const float* w0 = weight + static_cast<size_t>(row) * cols;
+    const float* w1 = w0 + cols;
+    const float* w2 = w1 + cols;
+    const float* w3 = w2 + cols;
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    __m512 acc2 = _mm512_setzero_ps();
+    __m512 acc3 = _mm512_setzero_ps();
+    for (int32_t i = 0; i < vec_cols; i += 16) {
+      const __m512 x = _mm512_loadu_ps(input + i);
+      acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(w0 + i), x, acc0);
+      acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(w1 + i), x, acc1);
+      acc2 = _mm512_fmadd_ps(_mm512_loadu_ps(w2 + i), x, acc2);
+      acc3 = _mm512_fmadd_ps(_mm512_loadu_ps(w3 + i), x, acc3);
+    }
+    if (tail_mask) {
+      const __m512 x = _mm512_maskz_loadu_ps(tail_mask, input + vec_cols);
+      acc0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail_mask, w0 + vec_cols), x, acc0);
+      acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail_mask, w1 + vec_cols), x, acc1);
+      acc2 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail_mask, w2 + vec_cols), x, acc2);
+      acc3 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail_mask, w3 + vec_cols), x, acc3);
+    }
+    output[row] = _mm512_reduce_add_ps(acc0) * scale;
+    output[row + 1] = _mm512_reduce_add_ps(acc1) * scale;
+    output[row + 2] = _mm512_reduce_add_ps(acc2) * scale;
+    output[row + 3] = _mm512_reduce_add_ps(acc3) * scale;
+  }
+  for (; row < row_end; ++row) {
+    const float* w0 = weight + static_cast<size_t>(row) * cols;
+    __m512 acc0 = _mm512_setzero_ps();
+    for (int32_t i = 0; i < vec_cols; i += 16) {
+      acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(w0 + i), _mm512_loadu_ps(input + i), acc0);
+    }
+    if (tail_mask) {
+      acc0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail_mask, w0 + vec_cols),
+                             _mm512_maskz_loadu_ps(tail_mask, input + vec_cols), acc0);
+    }
+    output[row] = _mm512_reduce_add_ps(acc0) * scale;
+  }
+}
+
+__attribute__((target("avx512f"))) static void gemm_tile_avx512(
+    const float* input0, const float* input1, const float* weight, float* out0, float* out1,
+    int32_t cols, float scale) {
+  const int32_t vec_cols = cols / 16 * 16;
+  const __mmask16 tail_mask = static_cast<__mmask16>((1u << (cols - vec_cols)) - 1);
+  __m512 acc0[4] = {_mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps(),
+                    _mm512_setzero_ps()};
+  __m512 acc1[4] = {_mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps(),
+                    _mm512_setzero_ps()};
+  for (int32_t i = 0; i < vec_cols; i += 16) {
+    const __m512 x0 = _mm512_loadu_ps(input0 + i);
+    const __m512 x1 = _mm512_loadu_ps(input1 + i);
+    for (int32_t r = 0; r < 4; ++r) {
+      const __m512 w = _mm512_loadu_ps(weight + static_cast<size_t>(r) * cols + i);
+      acc0[r] = _mm512_fmadd_ps(w, x0, acc0[r]);
+      acc1[r] = _mm512_fmadd_ps(w, x1, acc1[r]);
+    }
+  }
+  if (tail_mask) {
+    const __m512 x0 = _mm512_maskz_loadu_ps(tail_mask, input0 + vec_cols);
+    const __m512 x1 = _mm512_maskz_loadu_ps(tail_mask, input1 + vec_cols);
+    for (int32_t r = 0; r < 4; ++r) {
+      const __m512 w =
+          _mm512_maskz_loadu_ps(tail_mask, weight + static_cast<size_t>(r) * cols + vec_cols);
+      acc0[r] = _mm512_fmadd_ps(w, x0, acc0[r]);
+      acc1[r] = _mm512_fmadd_ps(w, x1, acc1[r]);
+    }
+  }
+  for (int32_t r = 0; r < 4; ++r) {
+    out0[r] = _mm512_reduce_add_ps(acc0[r]) * scale;
+    out1[r] = _mm512_reduce_add_ps(acc1[r]) * scale;
+  }
+}
+#endif
+
+#ifdef KUIPER_GEMV_NEON
+static void gemv_rows_neon(const float* input, const float* weight, float* output,
+                           int32_t row_begin, int32_t row_end, int32_t cols, float scale) {
+  const int32_t vec_cols = cols / 4 * 4;
+  int32_t row = row_begin;
+  for (; row + 4 <= row_end; row += 4) {
+    const float* w0 = weight + static_cast<size_t>(row) * cols;
+    const float* w1 = w0 + cols;
+    const float* w2 = w1 + cols;
+    const float* w3 = w2 + cols;
+    float32x4_t acc0 = vdupq_n_f32(0.f);
+    float32x4_t acc1 = vdupq_n_f32(0.f);
+    float32x4_t acc2 = vdupq_n_f32(0.f);
+    float32x4_t acc3 = vdupq_n_f32(0.f);
+    for (int32_t i = 0; i < vec_cols; i += 4) {
+      const float32x4_t x = vld1q_f32(input + i);
+      acc0 = vfmaq_f32(acc0, vld1q_f32(w0 + i), x);
+      acc1 = vfmaq_f32(acc1, vld1q_f32(w1 + i), x);
+      acc2 = vfmaq_f32(acc2, vld1q_f32(w2 + i), x);
+      acc3 = vfmaq_f32(acc3, vld1q_f32(w3 + i), x);
+    }
+    float sum0 = vaddvq_f32(acc0);
+    float sum1 = vaddvq_f32(acc1);
+    float sum2 = vaddvq_f32(acc2);
+    float sum3 = vaddvq_f32(acc3);
+    for (int32_t i = vec_cols; i < cols; ++i) {
+      sum0 += w0[i] * input[i];
+      sum1 += w1[i] * input[i];
+      sum2 += w2[i] * input[i];
+      sum3 += w3[i] * input[i];
+    }
+    output[row] = sum0 * scale;
+    output[row + 1] = sum1 * scale;
+    output[row + 2] = sum2 * scale;
+    output[row + 3] = sum3 * scale;
+  }
+  for (; row < row_end; ++row) {
+    const float* w0 = weight + static_cast<size_t>(row) * cols;
+    float32x4_t acc0 = vdupq_n_f32(0.f);
+    for (int32_t i = 0; i < vec_cols; i += 4) {
+      acc0 = vfmaq_f32(acc0, vld1q_f32(w0 + i), vld1q_f32(input + i));
+    }
+    float sum0 = vaddvq_f32(acc0);
+    for (int32_t i = vec_cols; i < cols; ++i) {
+      sum0 += w0[i] * input[i];
+    }
+    output[row] = sum0 * scale;
+  }
+}
+
+static void gemm_tile_neon(const float* input0, const float* input1, const float* weight,
+                           float* out0, float* out1, int32_t cols, float scale) {
+  const int32_t vec_cols = cols / 4 * 4;
+  float32x4_t acc0[4] = {vdupq_n_f32(0.f), vdupq_n_f32(0.f), vdupq_n_f32(0.f), vdupq_n_f32(0.f)};
+  float32x4_t acc1[4] = {vdupq_n_f32(0.f), vdupq_n_f32(0.f), vdupq_n_f32(0.f), vdupq_n_f32(0.f)};
+  for (int32_t i = 0; i < vec_cols; i += 4) {
+    const float32x4_t x0 = vld1q_f32(input0 + i);
+    const float32x4_t x1 = vld1q_f32(input1 + i);
+    for (int32_t r = 0; r < 4; ++r) {
+      const float32x4_t w = vld1q_f32(weight + static_cast<size_t>(r) * cols + i);
+      acc0[r] = vfmaq_f32(acc0[r], w, x0);
+      acc1[r] = vfmaq_f32(acc1[r], w, x1);
+    }
+  }
+  for (int32_t r = 0; r < 4; ++r) {
+    const float* weight_row = weight + static_cast<size_t>(r) * cols;
+    float sum0 = vaddvq_f32(acc0[r]);
+    float sum1 = vaddvq_f32(acc1[r]);
+    for (int32_t i = vec_cols; i < cols; ++i) {
+      sum0 += weight_row[i] * input0[i];
+      sum1 += weight_row[i] * input1[i];
+    }
+    out0[r] = sum0 * scale;
+    out1[r] = sum1 * scale;
+  }
+}
+#endif
+
+using Axpy = void (*)(float alpha, const float* input, float* output, int32_t size);
+
+static void axpy_scalar(float alpha, const float* input, float* output, int32_t size) {
+  for (int32_t i = 0; i < size; ++i) {
+    output[i] += alpha * input[i];
+  }
+}
+
+#ifdef KUIPER_GEMV_X86
+__attribute__((target("avx2,fma"))) static void axpy_avx2(float alpha, const float* input,
+                                                          float* output, int32_t size) {
+  const __m256 alpha_vec = _mm256_set1_ps(alpha);
+  int32_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    _mm256_storeu_ps(output + i, _mm256_fmadd_ps(alpha_vec, _mm256_loadu_ps(input + i),
+                                                 _mm256_loadu_ps(output + i)));
+  }
+  for (; i < size; ++i) {
+    output[i] += alpha * input[i];
+  }
+}
+
+__attribute__((target("avx512f"))) static void axpy_avx512(float alpha, const float* input,
+                                                           float* output, int32_t size) {
+  const __m512 alpha_vec = _mm512_set1_ps(alpha);
+  int32_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    _mm512_storeu_ps(output + i, _mm512_fmadd_ps(alpha_vec, _mm512_loadu_ps(input + i),
+                                                 _mm512_loadu_ps(output + i)));
+  }
+  for (; i < size; ++i) {
+    output[i] += alpha * input[i];
+  }
+}
+#endif
+
+#ifdef KUIPER_GEMV_NEON
+static void axpy_neon(float alpha, const float* input, float* output, int32_t size) {
+  int32_t i = 0;
+  for (; i + 4 <= size; i += 4) {
+    vst1q_f32(output + i, vfmaq_n_f32(vld1q_f32(output + i), vld1q_f32(input + i), alpha));
+  }
+  for (; i < size; ++i) {
+    output[i] += alpha * input[i];
+  }
+}
+#endif
+
+struct GemvIsa {
+  GemvRows rows;
+  GemmTile tile;
+  Axpy axpy;
+  const char* name;
+};
+
+static GemvIsa select_gemv_isa() {
+#ifdef KUIPER_GEMV_X86
+  if (__builtin_cpu_supports("avx512f")) {
+    return {gemv_rows_avx512, gemm_tile_avx512, axpy_avx512, "avx512"};
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return {gemv_rows_avx2, gemm_tile_avx2, axpy_avx2, "avx2"};
+  }
+#elif defined(KUIPER_GEMV_NEON)
+  return {gemv_rows_neon, gemm_tile_neon, axpy_neon, "neon"};
+#endif
+  return {gemv_rows_scalar, gemm_tile_scalar, axpy_scalar, "scalar"};
+}
+
+static const GemvIsa& gemv_isa() {
+  static const GemvIsa isa = select_gemv_isa();
+  return isa;
+}
+
+void gemv_kernel_cpu(const float* input, const float* weight, float* output, int32_t rows,
+                     int32_t cols, float scale) {
+  CHECK(input != nullptr && weight != nullptr && output != nullptr);
+  CHECK_GT(cols, 0);
+  const GemvRows gemv_rows = gemv_isa().rows;
+  const int32_t min_part_rows = gemv_min_part_rows(cols);
+  base::ThreadPoolFactory::get_instance()->parallel_for(
+      rows, min_part_rows, [&](int32_t row_begin, int32_t row_end) {
+        gemv_rows(input, weight, output, row_begin, row_end, cols, scale);
+      });
+}
+
+void gemm_kernel_cpu(const float* input, const float* weight, float* output, int32_t in_rows,
+                     int32_t rows, int32_t cols, float scale) {
+  CHECK(input != nullptr && weight != nullptr && output != nullptr);
+  CHECK_GT(in_rows, 0);
+  CHECK_GT(cols, 0);
+  if (in_rows == 1) {
+    gemv_kernel_cpu(input, weight, output, rows, cols, scale);
+    return;
+  }
+  const GemvIsa& isa = gemv_isa();
+  // a part has at least the multiply adds of a gemv part and whole tiles of four weight rows
+  const int32_t min_part_rows =
+      std::max((kGemvMinPartWork / cols / in_rows + 3) / 4 * 4, static_cast<int32_t>(4));
+  base::ThreadPoolFactory::get_instance()->parallel_for(
+      rows, min_part_rows, [&](int32_t row_begin, int32_t row_end) {
+        // the input rows of a block stay in the cache while the weight rows of the part pass
+        // over them, so the weights are read once per block instead of once per input row
+        for (int32_t block_begin = 0; block_begin < in_rows; block_begin += kGemmRowBlock) {
+          const int32_t block_end = std::min(in_rows, block_begin + kGemmRowBlock);
+          int32_t row = row_begin;
+          for (; row + 4 <= row_end; row += 4) {
+            const float* weight_rows = weight + static_cast<size_t>(row) * cols;
+            int32_t n = block_begin;
+            for (; n + 2 <= block_end; n += 2) {
+              isa.tile(input + static_cast<size_t>(n) * cols,
+                       input + static_cast<size_t>(n + 1) * cols, weight_rows,
+                       output + static_cast<size_t>(n) * rows + row,
+                       output + static_cast<size_t>(n + 1) * rows + row, cols, scale);
+            }
+            if (n < block_end) {
+              isa.rows(input + static_cast<size_t>(n) * cols, weight,
+                       output + static_cast<size_t>(n) * rows, row, row + 4, cols, scale);
+            }
+          }
+          if (row < row_end) {
+            for (int32_t n = block_begin; n < block_end; ++n) {
+              isa.rows(input + static_cast<size_t>(n) * cols, weight,
+                       output + static_cast<size_t>(n) * rows, row, row_end, cols, scale);
+            }
+          }
+        }
+      });
+}
+
+void gemv_place_rows_cpu(const void* source, void* dest, int32_t rows, int32_t cols,
+                         size_t elem_size) {
+  CHECK(source != nullptr && dest != nullptr);
+  CHECK_GT(cols, 0);
+  const size_t row_bytes = static_cast<size_t>(cols) * elem_size;
+  base::ThreadPoolFactory::get_instance()->parallel_for(
+      rows, gemv_min_part_rows(cols), [&](int32_t row_begin, int32_t row_end) {
+        std::memcpy(static_cast<int8_t*>(dest) + row_begin * row_bytes,
+                    static_cast<const int8_t*>(source) + row_begin * row_bytes,
+                    (row_end - row_begin) * row_bytes);
+      });
+}
+
+float dot_kernel_cpu(const float* input1, const float* input2, int32_t size) {
+  float output = 0.f;
+  gemv_isa().rows(input1, input2, &output, 0, 1, size, 1.f);
+  return output;
+}
+
+void axpy_kernel_cpu(float alpha, const float* input, float* output, int32_t size) {
+  gemv_isa().axpy(alpha, input, output, size);
+}
+
+const char* gemv_isa_name() { return gemv_isa().name; }
+
+// the int8 dot product of one weight row with the quantized input, a group has group_size
+// columns and its sum is scaled by the input and the weight scale of the group
+using GemvQ8Row = float (*)(const int8_t* q_input, const float* input_scales,
+                            const int8_t* weight_row, const float* weight_scales, int32_t cols,
+                            int32_t group_size);
+
+static float gemv_q8_row_scalar(const int8_t* q_input, const float* input_scales,
+                                const int8_t* weight_row, const float* weight_scales,
+                                int32_t cols, int32_t group_size) {
+  float sum = 0.f;
+  for (int32_t g = 0; g < cols / group_size; ++g) {
+    int32_t dot = 0;
+    for (int32_t i = g * group_size; i < (g + 1) * group_size; ++i) {
+      dot += static_cast<int32_t>(q_input[i]) * weight_row[i];
+    }
+    sum += static_cast<float>(dot) * input_scales[g] * weight_scales[g];
+  }
+  return sum;
+}
+
+// The x86 kernels take 32 columns at a time. The unsigned by signed byte products of maddubs
+// and vpdpbusd get the magnitude of the weight and the input with the sign of the weight, which
+// is the same product
+#ifdef KUIPER_GEMV_X86
+__attribute__((target("avx2,fma"))) static float gemv_q8_row_avx2(
+    const int8_t* q_input, const float* input_scales, const int8_t* weight_row,
+    const float* weight_scales, int32_t cols, int32_t group_size) {
+  const __m256i ones = _mm256_set1_epi16(1);
+  __m256 sum = _mm256_setzero_ps();
+  for (int32_t g = 0; g < cols / group_size; ++g) {
+    __m256i dot = _mm256_setzero_si256();
+    for (int32_t i = g * group_size; i < (g + 1) * group_size; i += 32) {
+      const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(q_input + i));
+      const __m256i w = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(weight_row + i));
+      const __m256i pair_sum =
+          _mm256_maddubs_epi16(_mm256_sign_epi8(w, w), _mm256_sign_epi8(x, w));
+      dot = _mm256_add_epi32(dot, _mm256_madd_epi16(pair_sum, ones));
+    }
+    sum = _mm256_fmadd_ps(_mm256_cvtepi32_ps(dot),
+                          _mm256_set1_ps(input_scales[g] * weight_scales[g]), sum);
+  }
+  return reduce_avx2(sum);
+}
+
+__attribute__((target("avx2,fma,avx512f,avx512vl,avx512vnni"))) static float gemv_q8_row_vnni(
+    const int8_t* q_input, const float* input_scales, const int8_t* weight_row,
+    const float* weight_scales, int32_t cols, int32_t group_size) {
+  __m256 sum = _mm256_setzero_ps();
+  for (int32_t g = 0; g < cols / group_size; ++g) {
+    __m256i dot = _mm256_setzero_si256();
+    for (int32_t i = g * group_size; i < (g + 1) * group_size; i += 32) {
+      const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(q_input + i));
+      const __m256i w = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(weight_row + i));
+      dot = _mm256_dpbusd_epi32(dot, _mm256_sign_epi8(w, w), _mm256_sign_epi8(x, w));
+    }
+    sum = _mm256_fmadd_ps(_mm256_cvtepi32_ps(dot),
+                          _mm256_set1_ps(input_scales[g] * weight_scales[g]), sum);
+  }
+  return reduce_avx2(sum);
+}
+#endif
+
+#ifdef KUIPER_GEMV_NEON
+// 16 columns at a time, sdot sums four byte products into every int32 lane
+static float gemv_q8_row_neon(const int8_t* q_input, const float* input_scales,
+                              const int8_t* weight_row, const float* weight_scales, int32_t cols,
+                              int32_t group_size) {
+  float32x4_t sum = vdupq_n_f32(0.f);
+  for (int32_t g = 0; g < cols / group_size; ++g) {
+    int32x4_t dot = vdupq_n_s32(0);
+    for (int32_t i = g * group_size; i < (g + 1) * group_size; i += 16) {
+      const int8x16_t x = vld1q_s8(q_input + i);
+      const int8x16_t w = vld1q_s8(weight_row + i);
+#ifdef __ARM_FEATURE_DOTPROD
+      dot = vdotq_s32(dot, x, w);
+#else
+      dot = vpadalq_s16(dot, vmull_s8(vget_low_s8(x), vget_low_s8(w)));
+      dot = vpadalq_s16(dot, vmull_s8(vget_high_s8(x), vget_high_s8(w)));
+#endif
+    }
+    sum = vmlaq_n_f32(sum, vcvtq_f32_s32(dot), input_scales[g] * weight_scales[g]);
+  }
+  return vaddvq_f32(sum);
+}
+#endif
+
+struct GemvQ8Isa {
+  GemvQ8Row row;
+  // the group size has to be a multiple of the columns of one step
+  int32_t step;
+  const char* name;
+};
+
+static GemvQ8Isa select_gemv_q8_isa() {
+#ifdef KUIPER_GEMV_X86
+  if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512vl")) {
+    return {gemv_q8_row_vnni, 32, "avx512vnni"};
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return {gemv_q8_row_avx2, 32, "avx2"};
+  }
+#elif defined(KUIPER_GEMV_NEON)
+#ifdef __ARM_FEATURE_DOTPROD
+  return {gemv_q8_row_neon, 16, "neon sdot"};
+#else
+  return {gemv_q8_row_neon, 16, "neon"};
+#endif
+#endif
+  return {gemv_q8_row_scalar, 1, "scalar"};
+}
+
+static const GemvQ8Isa& gemv_q8_isa() {
+  static const GemvQ8Isa isa = select_gemv_q8_isa();
+  return isa;
+}
+
+// one scale per group maps its largest magnitude to 127, as the cuda dp4a kernel does
+static void quantize_row_q8(const float* input, int8_t* q_input, float* input_scales,
+                            int32_t cols, int32_t group_size) {
+  const int32_t group_num = cols / group_size;
+  for (int32_t g = 0; g < group_num; ++g) {
+    const float* group = input + g * group_size;
+    float max_abs = 0.f;
+    for (int32_t i = 0; i < group_size; ++i) {
+      max_abs = std::max(max_abs, std::fabs(group[i]));
+    }
+    const float inv_scale = max_abs > 0.f ? 127.f / max_abs : 0.f;
+    for (int32_t i = 0; i < group_size; ++i) {
+      q_input[g * group_size + i] = static_cast<int8_t>(std::lrintf(group[i] * inv_scale));
+    }
+    input_scales[g] = max_abs / 127.f;
+  }
+}
+
+void gemv_q8_kernel_cpu(const float* input, const int8_t* weight, const float* scales,
+                        float* output, int32_t rows, int32_t cols, int32_t group_size) {
+  CHECK(input != nullptr && weight != nullptr && scales != nullptr && output != nullptr);
+  CHECK_GT(cols, 0);
+  CHECK_GT(group_size, 0);
+  auto* pool = base::ThreadPoolFactory::get_instance();
+  const int32_t min_part_rows = gemv_min_part_rows(cols);
+  if (cols % group_size != 0) {
+    // the groups run across the rows, the weights are widened one by one
+    pool->parallel_for(rows, min_part_rows, [&](int32_t row_begin, int32_t row_end) {
+      for (int32_t row = row_begin; row < row_end; ++row) {
+        const size_t row_offset = static_cast<size_t>(row) * cols;
+        float sum = 0.f;
+        for (int32_t i = 0; i < cols; ++i) {
+          sum += input[i] * weight[row_offset + i] * scales[(row_offset + i) / group_size];
+        }
+        output[row] = sum;
+      }
+    });
+    return;
+  }
+
+  const int32_t group_num = cols / group_size;
+  std::vector<int8_t> q_input(cols);
+  std::vector<float> input_scales(group_num);
+  quantize_row_q8(input, q_input.data(), input_scales.data(), cols, group_size);
+
+  const GemvQ8Isa& isa = gemv_q8_isa();
+  const GemvQ8Row gemv_row = group_size % isa.step == 0 ? isa.row : gemv_q8_row_scalar;
+  pool->parallel_for(rows, min_part_rows, [&](int32_t row_begin, int32_t row_end) {
+    for (int32_t row = row_begin; row < row_end; ++row) {
+      output[row] = gemv_row(q_input.data(), input_scales.data(),
+                             weight + static_cast<size_t>(row) * cols,
+                             scales + static_cast<size_t>(row) * group_num, cols, group_size);
+    }
+  });
+}
+
+void gemm_q8_kernel_cpu(const float* input, const int8_t* weight, const float* scales,
+                        float* output, int32_t in_rows, int32_t rows, int32_t cols,
+                        int32_t group_size) {
+  CHECK(input != nullptr && weight != nullptr && scales != nullptr && output != nullptr);
+  CHECK_GT(in_rows, 0);
+  CHECK_GT(cols, 0);
+  CHECK_GT(group_size, 0);
+  if (in_rows == 1 || cols % group_size != 0) {
+    for (int32_t n = 0; n < in_rows; ++n) {
+      gemv_q8_kernel_cpu(input + static_cast<size_t>(n) * cols, weight, scales,
+                         output + static_cast<size_t>(n) * rows, rows, cols, group_size);
+    }
+    return;
+  }
+  auto* pool = base::ThreadPoolFactory::get_instance();
+  const int32_t group_num = cols / group_size;
+  std::vector<int8_t> q_input(static_cast<size_t>(in_rows) * cols);
+  std::vector<float> input_scales(static_cast<size_t>(in_rows) * group_num);
+  pool->parallel_for(in_rows, 1, [&](int32_t begin, int32_t end) {
+    for (int32_t n = begin; n < end; ++n) {
+      quantize_row_q8(input + static_cast<size_t>(n) * cols,
+                      q_input.data() + static_cast<size_t>(n) * cols,
+                      input_scales.data() + static_cast<size_t>(n) * group_num, cols,
+                      group_size);
+    }
+  });
+
+  const GemvQ8Isa& isa = gemv_q8_isa();
+  const GemvQ8Row gemv_row = group_size % isa.step == 0 ? isa.row : gemv_q8_row_scalar;
+  const int32_t min_part_rows = std::max(kGemvMinPartWork / cols / in_rows, 1);
+  pool->parallel_for(rows, min_part_rows, [&](int32_t row_begin, int32_t row_end) {
+    // a weight row is read from the memory once and stays in the cache for all the input rows
+    for (int32_t row = row_begin; row < row_end; ++row) {
+      const int8_t* weight_row = weight + static_cast<size_t>(row) * cols;
+      const float* weight_scales = scales + static_cast<size_t>(row) * group_num;
+      for (int32_t n = 0; n < in_rows; ++n) {
+        output[static_cast<size_t>(n) * rows + row] =
+            gemv_row(q_input.data() + static_cast<size_t>(n) * cols,
+                     input_scales.data() + static_cast<size_t>(n) * group_num, weight_row,
+                     weight_scales, cols, group_size);
+      }
+    }
+  });
+}
+
+const char* gemv_q8_isa_name() { return gemv_q8_isa().name; }
+}  // namespace kernel
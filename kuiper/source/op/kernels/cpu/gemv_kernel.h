@@ -0,0 +1,49 @@
+#ifndef LLAMA_INFER_GEMV_KERNEL_H
+#define LLAMA_INFER_GEMV_KERNEL_H
+#include <cstddef>
+#include <cstdint>
+namespace kernel {
+// output = scale * weight @ input for one input row, weight is [rows, cols] in row major. The
+// rows are split across the cpu thread pool and the dot products use the widest simd set of
+// the cpu, picked once at the first call
+void gemv_kernel_cpu(const float* input, const float* weight, float* output, int32_t rows,
+                     int32_t cols, float scale = 1.f);
+
+// output = scale * input @ weight^T for in_rows input rows, input is [in_rows, cols] and output
+// is [in_rows, rows]. The weight rows are split across the thread pool and every tile of four
+// weight rows is applied to two input rows at a time, so the weights are read from the memory
+// once per block of input rows instead of once per row
+void gemm_kernel_cpu(const float* input, const float* weight, float* output, int32_t in_rows,
+                     int32_t rows, int32_t cols, float scale = 1.f);
+
+// output = weight @ input with int8 weights, every group_size consecutive weights share one of
+// the scales. The input is quantized to int8 by the same groups and the products are summed in
+// int32, with vnni or sdot where the cpu has them
+void gemv_q8_kernel_cpu(const float* input, const int8_t* weight, const float* scales,
+                        float* output, int32_t rows, int32_t cols, int32_t group_size);
+
+// gemv_q8_kernel_cpu for in_rows input rows, every input row is quantized once and every weight
+// row is applied to all of them while it is in the cache
+void gemm_q8_kernel_cpu(const float* input, const int8_t* weight, const float* scales,
+                        float* output, int32_t in_rows, int32_t rows, int32_t cols,
+                        int32_t group_size);
+
+// copies a [rows, cols] weight into untouched memory with the row split of the gemv kernels, so
+// the first touch of every page is on the thread, and after ThreadPool::pin_to_numa_nodes the
+// numa node, which later reads those rows
+void gemv_place_rows_cpu(const void* source, void* dest, int32_t rows, int32_t cols,
+                         size_t elem_size);
+
+// the dot product of two vectors with the row kernel of gemv_kernel_cpu, on the calling thread
+float dot_kernel_cpu(const float* input1, const float* input2, int32_t size);
+
+// output += alpha * input on the calling thread
+void axpy_kernel_cpu(float alpha, const float* input, float* output, int32_t size);
+
+// the name of the simd set which gemv_kernel_cpu uses
+const char* gemv_isa_name();
+
+// the name of the simd set which gemv_q8_kernel_cpu uses
+const char* gemv_q8_isa_name();
+}  // namespace kernel
+#endif  // LLAMA_INFER_GEMV_KERNEL_H
@@ -0,0 +1,69 @@
+#include "kv_cache_kernel.h"
+#include <algorithm>
+#include <cmath>
+namespace kernel {
+// every head of the row gets the scale which maps its largest magnitude to 127
+static void quantize_row(const float* row, int32_t kv_dim, int32_t head_size, int8_t* out,
+                         float* scale) {
+  for (int32_t head = 0; head < kv_dim / head_size; ++head) {
+    const float* head_ptr = row + head * head_size;
+    float max_abs = 0.f;
+    for (int32_t i = 0; i < head_size; ++i) {
+      max_abs = std::max(max_abs, std::abs(head_ptr[i]));
+    }
+    const float head_scale = max_abs / 127.f;
+    const float inv_scale = max_abs > 0.f ? 127.f / max_abs : 0.f;
+    for (int32_t i = 0; i < head_size; ++i) {
+      out[head * head_size + i] = static_cast<int8_t>(std::lrint(head_ptr[i] * inv_scale));
+    }
+    scale[head] = head_scale;
+  }
+}
+
+void kv_cache_write_kernel_cpu(const tensor::Tensor& key, const tensor::Tensor& value,
+                               const tensor::Tensor& key_cache, const tensor::Tensor& value_cache,
+                               const tensor::Tensor& key_scale, const tensor::Tensor& value_scale,
+                               const tensor::Tensor& block_table, const tensor::Tensor& pos_tensor,
+                               int32_t layer_index, int32_t block_size,
+                               const base::AttentionWindow& window, void* stream) {
+  UNUSED(stream);
+  CHECK_EQ(key.is_empty(), false);
+  CHECK_EQ(key.size(), value.size());
+  CHECK_EQ(key_cache.dims_size(), 3);
+  CHECK(pos_tensor.device_type() == base::DeviceType::kDeviceCPU);
+  CHECK(block_table.device_type() == base::DeviceType::kDeviceCPU);
+
+  const int32_t kv_dim = key_cache.get_dim(2);
+  const int32_t cache_len = key_cache.get_dim(1);
+  const int32_t token_num = static_cast<int32_t>(key.size()) / kv_dim;
+  const int32_t start_pos = pos_tensor.index<int32_t>(0);
+  const bool is_int8 = key_cache.data_type() == base::DataType::kDataTypeInt8;
+  CHECK(is_int8 || key_cache.data_type() == base::DataType::kDataTypeFp32)
+      << "The cpu kv cache is stored in fp32 or int8.";
+  const int32_t kv_head_num = is_int8 ? key_scale.get_dim(2) : 0;
+
+  for (int32_t row = 0; row < token_num; ++row) {
+    // a position of a windowed sequence is stored in its row of the ring
+    const int32_t pos = window.cache_pos(start_pos + row);
+    const int64_t physical =
+        static_cast<int64_t>(layer_index) * cache_len +
+        block_table.index<int32_t>(pos / block_size) * block_size + pos % block_size;
+    const float* key_row = key.ptr<float>(row * kv_dim);
+    const float* value_row = value.ptr<float>(row * kv_dim);
+    if (is_int8) {
+      const int32_t head_size = kv_dim / kv_head_num;
+      quantize_row(key_row, kv_dim, head_size,
+                   const_cast<int8_t*>(key_cache.ptr<int8_t>(physical * kv_dim)),
+                   const_cast<float*>(key_scale.ptr<float>(physical * kv_head_num)));
+      quantize_row(value_row, kv_dim, head_size,
+                   const_cast<int8_t*>(value_cache.ptr<int8_t>(physical * kv_dim)),
+                   const_cast<float*>(value_scale.ptr<float>(physical * kv_head_num)));
+    } else {
+      std::copy(key_row, key_row + kv_dim,
+                const_cast<float*>(key_cache.ptr<float>(physical * kv_dim)));
+      std::copy(value_row, value_row + kv_dim,
+                const_cast<float*>(value_cache.ptr<float>(physical * kv_dim)));
+    }
+  }
+}
+}  // namespace kernel
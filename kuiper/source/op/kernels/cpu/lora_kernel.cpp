@@ -0,0 +1,50 @@
+#include "lora_kernel.h"
+#include "base/base.h"
+namespace kernel {
+void lora_kernel_cpu(const tensor::Tensor& input, const tensor::Tensor& lora_a,
+                     const tensor::Tensor& lora_b, const tensor::Tensor& lora_scales,
+                     const tensor::Tensor& adapters, const tensor::Tensor& workspace,
+                     const tensor::Tensor& output, const CudaConfig* config) {
+  UNUSED(workspace);
+  UNUSED(config);
+  CHECK(input.device_type() == base::DeviceType::kDeviceCPU);
+  CHECK(lora_a.device_type() == base::DeviceType::kDeviceCPU);
+  CHECK(adapters.device_type() == base::DeviceType::kDeviceCPU);
+  CHECK_EQ(lora_a.dims_size(), 3);
+  CHECK_EQ(lora_b.dims_size(), 3);
+  const int32_t adapter_num = lora_a.get_dim(0);
+  const int32_t rank = lora_a.get_dim(1);
+  const int32_t M = lora_a.get_dim(2);
+  const int32_t K = lora_b.get_dim(2);
+  const int32_t N = input.dims_size() == 2 ? input.get_dim(0) : 1;
+  CHECK_EQ(M, input.get_dim(input.dims_size() - 1));
+  CHECK_EQ(output.size(), N * K);
+  CHECK(adapters.size() == 1 || adapters.size() == N);
+
+  std::vector<float> shrunk(rank);
+  float* output_ptr = const_cast<float*>(output.ptr<float>());
+  for (int32_t n = 0; n < N; ++n) {
+    const int32_t adapter = adapters.index<int32_t>(adapters.size() == 1 ? 0 : n);
+    if (adapter < 0) {
+      continue;
+    }
+    CHECK_LT(adapter, adapter_num);
+    const float* input_row = input.ptr<float>() + n * M;
+    const float* a = lora_a.ptr<float>() + static_cast<size_t>(adapter) * rank * M;
+    for (int32_t r = 0; r < rank; ++r) {
+      float sum = 0.f;
+      for (int32_t i = 0; i < M; ++i) {
+        sum += input_row[i] * a[r * M + i];
+      }
+      shrunk[r] = sum * lora_scales.index<float>(adapter);
+    }
+    const float* b = lora_b.ptr<float>() + static_cast<size_t>(adapter) * rank * K;
+    float* output_row = output_ptr + n * K;
+    for (int32_t r = 0; r < rank; ++r) {
+      for (int32_t k = 0; k < K; ++k) {
+        output_row[k] += shrunk[r] * b[r * K + k];
+      }
+    }
+  }
+}
+}  // namespace kernel
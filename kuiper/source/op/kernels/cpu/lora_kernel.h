@@ -0,0 +1,11 @@
+#ifndef KUIPER_SOURCE_OP_KERNELS_CPU_LORA_KERNEL_H_
+#define KUIPER_SOURCE_OP_KERNELS_CPU_LORA_KERNEL_H_
+#include "base/cuda_config.h"
+#include "tensor/tensor.h"
+namespace kernel {
+void lora_kernel_cpu(const tensor::Tensor& input, const tensor::Tensor& lora_a,
+                     const tensor::Tensor& lora_b, const tensor::Tensor& lora_scales,
+                     const tensor::Tensor& adapters, const tensor::Tensor& workspace,
+                     const tensor::Tensor& output, const CudaConfig* config);
+}  // namespace kernel
+#endif  // KUIPER_SOURCE_OP_KERNELS_CPU_LORA_KERNEL_H_
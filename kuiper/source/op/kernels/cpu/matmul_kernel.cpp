@@ -1,6 +1,8 @@
 #include "matmul_kernel.h"
 #include "../kernels_interface.h"
 #include "base/base.h"
+#include "gemv_kernel.h"
+#include "vec_kernel.h"
 namespace kernel {
 void matmul_kernel_cpu(const tensor::Tensor& input, const tensor::Tensor& weight,
                        const tensor::Tensor& output, float scale,
@@ -17,13 +19,13 @@ void matmul_kernel_cpu(const tensor::Tensor& input, const tensor::Tensor& weight
   const float* weight_ptr = weight.ptr<float>();
   const float* output_ptr = output.ptr<float>();
 
-  int32_t in_dim1 = 1;
-  int32_t in_dim0 = 1;
+  int32_t in_rows = 1;
+  int32_t in_dim = 1;
   if (input.dims_size() == 2) {
-    in_dim0 = input.get_dim(0);
-    in_dim1 = input.get_dim(1);
+    in_rows = input.get_dim(0);
+    in_dim = input.get_dim(1);
   } else if (input.dims_size() == 1) {
-    in_dim0 = input.get_dim(0);
+    in_dim = input.get_dim(0);
   } else {
     LOG(FATAL) << "The input tensor has a wrong dim size.";
   }
@@ -31,12 +33,113 @@ void matmul_kernel_cpu(const tensor::Tensor& input, const tensor::Tensor& weight
   CHECK_EQ(weight.dims_size(), 2);
   const int32_t wei_dim0 = weight.get_dim(0);
   const int32_t wei_dim1 = weight.get_dim(1);
-  CHECK_EQ(in_dim0, wei_dim1);
+  CHECK_EQ(in_dim, wei_dim1);
 
-  CHECK_EQ(output.size(), wei_dim0 * in_dim1);
-  arma::fmat input_mat(const_cast<float*>(input_ptr), in_dim1, in_dim0, false, true);
-  arma::fmat weight_mat(const_cast<float*>(weight_ptr), wei_dim1, wei_dim0, false, true);
-  arma::fmat output_mat(const_cast<float*>(output_ptr), in_dim1, wei_dim0, false, true);
-  output_mat = ((input_mat * weight_mat)) * scale;
+  CHECK_EQ(output.size(), wei_dim0 * in_rows);
+  // a decode step has one row and runs the gemv kernel, a prefill runs the blocked gemm which
+  // reads every weight row once for a block of tokens
+  gemm_kernel_cpu(input_ptr, weight_ptr, const_cast<float*>(output_ptr), in_rows, wei_dim0,
+                  wei_dim1, scale);
+}
+
+void matmul_swiglu_kernel_cpu(const tensor::Tensor& input, const tensor::Tensor& weight,
+                              const tensor::Tensor& output, const CudaConfig* config) {
+  UNUSED(config);
+  CHECK(input.is_empty() == false);
+  CHECK(weight.is_empty() == false);
+  CHECK(output.is_empty() == false);
+  CHECK(input.device_type() == base::DeviceType::kDeviceCPU);
+  CHECK(weight.device_type() == base::DeviceType::kDeviceCPU);
+  CHECK(output.device_type() == base::DeviceType::kDeviceCPU);
+
+  const int32_t in_rows = input.dims_size() == 2 ? input.get_dim(0) : 1;
+  const int32_t in_dim = input.get_dim(input.dims_size() - 1);
+  CHECK_EQ(weight.dims_size(), 2);
+  CHECK_EQ(weight.get_dim(0) % 2, 0);
+  const int32_t hidden_dim = weight.get_dim(0) / 2;
+  CHECK_EQ(in_dim, weight.get_dim(1));
+  CHECK_EQ(output.size(), hidden_dim * in_rows);
+
+  // the first hidden_dim outputs of a row are the gate projection, the others the up projection
+  std::vector<float> gate_up(static_cast<size_t>(in_rows) * 2 * hidden_dim);
+  gemm_kernel_cpu(input.ptr<float>(), weight.ptr<float>(), gate_up.data(), in_rows,
+                  2 * hidden_dim, in_dim);
+  float* output_ptr = const_cast<float*>(output.ptr<float>());
+  for (int32_t row = 0; row < in_rows; ++row) {
+    const float* gate = gate_up.data() + static_cast<size_t>(row) * 2 * hidden_dim;
+    swiglu_row_kernel_cpu(gate, gate + hidden_dim, output_ptr + row * hidden_dim, hidden_dim);
+  }
+}
+
+void matmul_kernel_cpu_qint8(const tensor::Tensor& input, const tensor::Tensor& weight,
+                             const tensor::Tensor& output, int32_t group_size,
+                             const tensor::Tensor& scale, const CudaConfig* config) {
+  UNUSED(config);
+  CHECK(input.is_empty() == false && input.dims_size() <= 2);
+  CHECK(input.device_type() == base::DeviceType::kDeviceCPU);
+  CHECK(weight.is_empty() == false && weight.dims_size() == 2);
+  CHECK(weight.device_type() == base::DeviceType::kDeviceCPU);
+  CHECK(scale.device_type() == base::DeviceType::kDeviceCPU);
+  const int32_t K = weight.get_dim(0);  // row
+  const int32_t M = weight.get_dim(1);  // col
+  const int32_t N = input.dims_size() == 2 ? input.get_dim(0) : 1;
+  CHECK_EQ(M, input.get_dim(input.dims_size() - 1));
+  CHECK_EQ(output.size(), N * K);
+  gemm_q8_kernel_cpu(input.ptr<float>(), weight.ptr<int8_t>(), scale.ptr<float>(),
+                     const_cast<float*>(output.ptr<float>()), N, K, M, group_size);
+}
+
+// the output rows are still in the cache after the matmul, so the bias is added in place
+static void add_bias_rows_cpu(const tensor::Tensor& bias, const tensor::Tensor& output) {
+  CHECK(bias.device_type() == base::DeviceType::kDeviceCPU);
+  const int32_t K = static_cast<int32_t>(bias.size());
+  CHECK_EQ(output.size() % K, 0);
+  const float* bias_ptr = bias.ptr<float>();
+  float* output_ptr = const_cast<float*>(output.ptr<float>());
+  for (size_t i = 0; i < output.size(); i += K) {
+    for (int32_t k = 0; k < K; ++k) {
+      output_ptr[i + k] += bias_ptr[k];
+    }
+  }
+}
+
+void matmul_bias_kernel_cpu(const tensor::Tensor& input, const tensor::Tensor& weight,
+                            const tensor::Tensor& bias, const tensor::Tensor& output,
+                            const CudaConfig* config) {
+  matmul_kernel_cpu(input, weight, output, 1.f, config);
+  add_bias_rows_cpu(bias, output);
+}
+
+void matmul_bias_kernel_cpu_qint8(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                  const tensor::Tensor& bias, const tensor::Tensor& output,
+                                  int32_t group_size, const tensor::Tensor& scale,
+                                  const CudaConfig* config) {
+  matmul_kernel_cpu_qint8(input, weight, output, group_size, scale, config);
+  add_bias_rows_cpu(bias, output);
+}
+
+void matmul_swiglu_kernel_cpu_qint8(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                    const tensor::Tensor& output, int32_t group_size,
+                                    const tensor::Tensor& scale, const CudaConfig* config) {
+  UNUSED(config);
+  CHECK(input.is_empty() == false && input.dims_size() <= 2);
+  CHECK(input.device_type() == base::DeviceType::kDeviceCPU);
+  CHECK(weight.is_empty() == false && weight.dims_size() == 2);
+  CHECK(weight.device_type() == base::DeviceType::kDeviceCPU);
+  CHECK(scale.device_type() == base::DeviceType::kDeviceCPU);
+  CHECK_EQ(weight.get_dim(0) % 2, 0);
+  const int32_t K = weight.get_dim(0) / 2;  // hidden dim
+  const int32_t M = weight.get_dim(1);      // col
+  const int32_t N = input.dims_size() == 2 ? input.get_dim(0) : 1;
+  CHECK_EQ(M, input.get_dim(input.dims_size() - 1));
+  CHECK_EQ(output.size(), N * K);
+  std::vector<float> gate_up(static_cast<size_t>(N) * 2 * K);
+  gemm_q8_kernel_cpu(input.ptr<float>(), weight.ptr<int8_t>(), scale.ptr<float>(),
+                     gate_up.data(), N, 2 * K, M, group_size);
+  float* output_ptr = const_cast<float*>(output.ptr<float>());
+  for (int32_t n = 0; n < N; ++n) {
+    const float* gate = gate_up.data() + static_cast<size_t>(n) * 2 * K;
+    swiglu_row_kernel_cpu(gate, gate + K, output_ptr + n * K, K);
+  }
 }
 }  // namespace kernel
\ No newline at end of file
@@ -6,5 +6,27 @@ namespace kernel {
 void matmul_kernel_cpu(const tensor::Tensor& input, const tensor::Tensor& weight,
                        const tensor::Tensor& output, float scale = 1.f,
                        const CudaConfig* config = nullptr);
+
+void matmul_swiglu_kernel_cpu(const tensor::Tensor& input, const tensor::Tensor& weight,
+                              const tensor::Tensor& output, const CudaConfig* config);
+
+// weight: [K, M] int8, scale: one fp32 scale per group_size weights
+void matmul_kernel_cpu_qint8(const tensor::Tensor& input, const tensor::Tensor& weight,
+                             const tensor::Tensor& output, int32_t group_size,
+                             const tensor::Tensor& scale, const CudaConfig* config);
+
+// the matmuls followed by the bias of the output rows
+void matmul_bias_kernel_cpu(const tensor::Tensor& input, const tensor::Tensor& weight,
+                            const tensor::Tensor& bias, const tensor::Tensor& output,
+                            const CudaConfig* config);
+
+void matmul_bias_kernel_cpu_qint8(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                  const tensor::Tensor& bias, const tensor::Tensor& output,
+                                  int32_t group_size, const tensor::Tensor& scale,
+                                  const CudaConfig* config);
+
+void matmul_swiglu_kernel_cpu_qint8(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                    const tensor::Tensor& output, int32_t group_size,
+                                    const tensor::Tensor& scale, const CudaConfig* config);
 }  // namespace kernel
 #endif  // LLAMA_INFER_MATMUL_KERNEL_H
@@ -1,62 +1,120 @@
 #include "../cpu/mha_kernel.h"
-#include <cuda_runtime_api.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
 #include "../kernels_interface.h"
+#include "base/thread_pool.h"
+#include "gemv_kernel.h"
+#include "vec_kernel.h"
 namespace kernel {
 void mha_kernel(int32_t pos, int32_t head_num, int32_t layer_index, int32_t seq_len, int32_t kv_dim,
-                int32_t kv_mul, int32_t head_size, const tensor::Tensor& mha_out,
-                const tensor::Tensor& query_tensor, const tensor::Tensor& score_tensor,
-                const tensor::Tensor& key_cache_tensor, const tensor::Tensor& value_cache_tensor,
+                int32_t kv_mul, int32_t head_size, int32_t block_size,
+                const tensor::Tensor& mha_out, const tensor::Tensor& query_tensor,
+                const tensor::Tensor& score_tensor, const tensor::Tensor& key_cache_tensor,
+                const tensor::Tensor& value_cache_tensor, const tensor::Tensor& key_scale_tensor,
+                const tensor::Tensor& value_scale_tensor, const tensor::Tensor& block_table,
+                const tensor::Tensor& pos_tensor, const base::AttentionWindow& window,
                 base::DeviceType device_type, CudaConfig* config) {
-  int32_t layer_offset = layer_index * seq_len * kv_dim;
+  // the cache is [layer_num, cache_len, kv_dim], cache_len is the capacity of the block pool,
+  // or [layer_num, kv_head_num, cache_len, head_size] when it is head major
+  const bool is_head_major = key_cache_tensor.dims_size() == 4;
+  CHECK(is_head_major || key_cache_tensor.dims_size() == 3);
+  const int32_t cache_len = key_cache_tensor.get_dim(is_head_major ? 2 : 1);
+  // an int8 row carries one fp32 scale per head, [layer_num, cache_len, kv_dim / head_size]
+  const bool is_int8 = key_cache_tensor.data_type() == base::DataType::kDataTypeInt8;
+  CHECK(is_int8 || key_cache_tensor.data_type() == base::DataType::kDataTypeFp32)
+      << "The cpu mha kernel only supports the fp32 and the int8 kv cache.";
+  CHECK(!is_int8 || (!key_scale_tensor.is_empty() && !value_scale_tensor.is_empty()));
+  CHECK(pos_tensor.is_empty()) << "The cpu mha kernel reads the position on the host.";
+  CHECK(device_type == base::DeviceType::kDeviceCPU);
+  UNUSED(config);
+  CHECK(!is_head_major || !is_int8) << "The head major kv cache is stored in fp32.";
+  int32_t layer_offset = layer_index * cache_len * kv_dim;
   float scale = 1.f / std::sqrt(static_cast<float>(head_size));
-
-  std::shared_ptr<base::DeviceAllocator> allocator;
-    if (device_type == base::DeviceType::kDeviceCPU) {
-      allocator = base::CPUDeviceAllocatorFactory::get_instance();
-    } else {
-      allocator = base::CUDADeviceAllocatorFactory::get_instance();
+  // without a block table the positions of a sequence are contiguous in the cache
+  const bool is_paged = !block_table.is_empty();
+  if (!is_paged) {
+    block_size = seq_len;
+  }
+  // the block table is read on the host, so it has to live in the cpu memory
+  CHECK(!is_paged || block_table.device_type() == base::DeviceType::kDeviceCPU);
+  auto physical_pos = [&](int32_t t) {
+    if (!is_paged) {
+      return t;
     }
-  for (int32_t h = 0; h < head_num; ++h) {
-    float* score_head_addr = const_cast<float*>(score_tensor.ptr<float>() + h * seq_len);
-    float* query_head_addr = const_cast<float*>(query_tensor.ptr<float>() + h * head_size);
-
-    
-    tensor::Tensor query_mat(base::DataType::kDataTypeFp32, head_size, false, nullptr,
-                               query_head_addr);
-    query_mat.set_device_type(device_type);
-    
-    for (int32_t t = 0; t <= pos; t++) {
-      int32_t cache_offset = t * kv_dim + (h / kv_mul) * head_size;
-      const float* key_head_addr = key_cache_tensor.ptr<float>() + layer_offset + cache_offset;
-      tensor::Tensor key_mat(base::DataType::kDataTypeFp32, 1, head_size, false, nullptr,
-                             const_cast<float*>(key_head_addr));
-      
-      tensor::Tensor score_mat(base::DataType::kDataTypeFp32, 1, false, nullptr,
-                               score_head_addr + t);
-      key_mat.set_device_type(device_type);
-      score_mat.set_device_type(device_type);
-      get_matmul_kernel(device_type)(query_mat, key_mat, score_mat, scale, config);
+    return block_table.index<int32_t>(t / block_size) * block_size + t % block_size;
+  };
+  // the j-th position attended by row_pos, the sinks and the window of a windowed sequence
+  auto cache_offset_of = [&](int32_t j, int32_t row_pos, int32_t kv_head) {
+    const int32_t t = window.cache_index(j, row_pos);
+    if (is_head_major) {
+      return layer_offset + (kv_head * cache_len + physical_pos(t)) * head_size;
     }
+    return layer_offset + physical_pos(t) * kv_dim + kv_head * head_size;
+  };
 
-    tensor::Tensor score_head_tensor(base::DataType::kDataTypeFp32, pos + 1, false, nullptr,
-                                     score_head_addr);
-    score_head_tensor.set_device_type(device_type);
-    get_softmax_kernel(device_type)(score_head_tensor, config ? config->stream : nullptr);
+  // the query of a prompt is [num_tokens, dim], the i-th row is located at pos + i
+  const int32_t num_tokens = query_tensor.dims_size() == 2 ? query_tensor.get_dim(0) : 1;
+  const int32_t dim = head_num * head_size;
+  // a decode step runs the heads on the threads of the pool, every head owns its row of the
+  // score tensor. A prompt runs every row of every head as a task of its own, the rows of a head
+  // are next to each other so a part reads the keys of few heads, and a part keeps the scores in
+  // a buffer of its own
+  const int32_t task_num = head_num * num_tokens;
+  base::ThreadPoolFactory::get_instance()->parallel_for(task_num, 1, [&](int32_t task_begin,
+                                                                         int32_t task_end) {
+    std::vector<float> part_score(num_tokens > 1 ? seq_len : 0);
+    for (int32_t task = task_begin; task < task_end; ++task) {
+      const int32_t h = task / num_tokens;
+      const int32_t row = task % num_tokens;
+      float* score_head_addr = num_tokens > 1
+                                   ? part_score.data()
+                                   : const_cast<float*>(score_tensor.ptr<float>() + h * seq_len);
+      const int32_t kv_head = h / kv_mul;
+      const int32_t row_pos = pos + row;
+      const int32_t attended_num = window.attended_num(row_pos);
+      const float* query_head_addr = query_tensor.ptr<float>() + row * dim + h * head_size;
+      for (int32_t t = 0; t < attended_num; t++) {
+        const int32_t cache_offset = cache_offset_of(t, row_pos, kv_head);
+        if (is_int8) {
+          const int8_t* key_head_addr = key_cache_tensor.ptr<int8_t>() + cache_offset;
+          float score = 0.f;
+          for (int32_t i = 0; i < head_size; ++i) {
+            score += query_head_addr[i] * static_cast<float>(key_head_addr[i]);
+          }
+          score_head_addr[t] =
+              score * scale * key_scale_tensor.index<float>(cache_offset / head_size);
+        } else {
+          score_head_addr[t] =
+              dot_kernel_cpu(query_head_addr, key_cache_tensor.ptr<float>() + cache_offset,
+                             head_size) *
+              scale;
+        }
+      }
 
-    float* output_head_ptr = const_cast<float*>(mha_out.ptr<float>()) + h * head_size;
-    allocator->memset_zero(output_head_ptr, sizeof(float) * head_size,
-                              config ? config->stream : nullptr, false);
-    tensor::Tensor output_tensor(base::DataType::kDataTypeFp32, head_size, false, nullptr,
-                                 output_head_ptr);
-    output_tensor.set_device_type(device_type);
+      // the normalization is folded into the weights of the values below
+      const float max_score = max_kernel_cpu(score_head_addr, attended_num);
+      const float inv_sum = 1.f / exp_sum_kernel_cpu(score_head_addr, attended_num, max_score);
 
-    int32_t cache_offset = (h / kv_mul) * head_size;
-    float* value_head_addr =
-        const_cast<float*>(value_cache_tensor.ptr<float>()) + layer_offset + cache_offset;
-    tensor::Tensor value_tensor(base::DataType::kDataTypeFp32, head_size, false, nullptr,
-                                value_head_addr);
-    get_scale_sum_kernel(device_type)(value_tensor, score_head_tensor, output_tensor, pos,
-                                      head_size, kv_dim, config ? config->stream : nullptr);
-  }
+      float* output_head_ptr =
+          const_cast<float*>(mha_out.ptr<float>()) + row * dim + h * head_size;
+      std::fill(output_head_ptr, output_head_ptr + head_size, 0.f);
+      for (int32_t t = 0; t < attended_num; ++t) {
+        const int32_t cache_offset = cache_offset_of(t, row_pos, kv_head);
+        if (is_int8) {
+          const int8_t* value_head_addr = value_cache_tensor.ptr<int8_t>() + cache_offset;
+          const float weight = score_head_addr[t] * inv_sum *
+                               value_scale_tensor.index<float>(cache_offset / head_size);
+          for (int32_t i = 0; i < head_size; ++i) {
+            output_head_ptr[i] += weight * static_cast<float>(value_head_addr[i]);
+          }
+        } else {
+          axpy_kernel_cpu(score_head_addr[t] * inv_sum,
+                          value_cache_tensor.ptr<float>() + cache_offset, output_head_ptr,
+                          head_size);
+        }
+      }
+    }
+  });
 }
 }  // namespace kernel
\ No newline at end of file
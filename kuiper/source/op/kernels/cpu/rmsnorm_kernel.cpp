@@ -1,4 +1,6 @@
 #include "rmsnorm_kernel.h"
+#include "base/thread_pool.h"
+#include "vec_kernel.h"
 
 namespace kernel {
 void rmsnorm_kernel_cpu(const tensor::Tensor& input, const tensor::Tensor& weight,
@@ -15,11 +17,10 @@ void rmsnorm_kernel_cpu(const tensor::Tensor& input, const tensor::Tensor& weigh
   const float* in_ptr = input.ptr<float>();
   const float* wei_ptr = weight.ptr<float>();
   const float* out_ptr = output.ptr<float>();
-  const int32_t dim = static_cast<int32_t>(input.size());
-
-  arma::fvec in_tensor(const_cast<float*>(in_ptr), dim, false, true);
-  arma::fvec out_tensor(const_cast<float*>(out_ptr), dim, false, true);
-  arma::fvec wei_tensor(const_cast<float*>(wei_ptr), dim, false, true);
+  const int32_t dim = static_cast<int32_t>(weight.size());
+  CHECK_EQ(input.size() % dim, 0);
+  CHECK_EQ(input.size(), output.size());
+  const int32_t rows = static_cast<int32_t>(input.size()) / dim;
 
 #ifdef QWEN2_SUPPORT
   const float eps = 1e-6f;
@@ -27,8 +28,35 @@ void rmsnorm_kernel_cpu(const tensor::Tensor& input, const tensor::Tensor& weigh
   const float eps = 1e-5f;
 #endif
 
-  const float mean = arma::as_scalar(arma::mean(arma::pow(in_tensor, 2))) + eps;
-  const float rsqrt = 1.f / std::sqrt(mean);
-  out_tensor = wei_tensor % (rsqrt * in_tensor);
+  const auto norm_rows = [&](int32_t row_begin, int32_t row_end) {
+    for (int32_t row = row_begin; row < row_end; ++row) {
+      const float* in_row = in_ptr + row * dim;
+      const float mean = square_sum_kernel_cpu(in_row, dim) / static_cast<float>(dim) + eps;
+      scale_mul_kernel_cpu(1.f / std::sqrt(mean), in_row, wei_ptr,
+                           const_cast<float*>(out_ptr) + row * dim, dim);
+    }
+  };
+  // a decode step has one row, the rows of a prompt are split over the threads
+  if (rows == 1) {
+    norm_rows(0, 1);
+  } else {
+    base::ThreadPoolFactory::get_instance()->parallel_for(rows, 1, norm_rows);
+  }
+}
+
+void add_rmsnorm_kernel_cpu(const tensor::Tensor& residual, const tensor::Tensor& input,
+                            const tensor::Tensor& weight, const tensor::Tensor& output,
+                            void* stream) {
+  UNUSED(stream);
+  CHECK(!residual.is_empty());
+  CHECK(!input.is_empty());
+  CHECK_EQ(residual.size(), input.size());
+  CHECK(residual.device_type() == base::DeviceType::kDeviceCPU &&
+        input.device_type() == base::DeviceType::kDeviceCPU);
+  arma::fvec residual_tensor(const_cast<float*>(residual.ptr<float>()), residual.size(), false,
+                             true);
+  arma::fvec in_tensor(const_cast<float*>(input.ptr<float>()), input.size(), false, true);
+  residual_tensor += in_tensor;
+  rmsnorm_kernel_cpu(residual, weight, output, stream);
 }
-}  // namespace kernel
\ No newline at end of file
+}  // namespace kernel
@@ -4,5 +4,9 @@
 namespace kernel {
 void rmsnorm_kernel_cpu(const tensor::Tensor& input, const tensor::Tensor& weight,
                         const tensor::Tensor& output, void* stream = nullptr);
+
+void add_rmsnorm_kernel_cpu(const tensor::Tensor& residual, const tensor::Tensor& input,
+                            const tensor::Tensor& weight, const tensor::Tensor& output,
+                            void* stream = nullptr);
 }  // namespace kernel
 #endif  // LLAMA_INFER_RMSNORM_KERNEL_H
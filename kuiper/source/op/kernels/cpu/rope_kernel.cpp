@@ -1,123 +1,103 @@
 #include "rope_kernel.h"
+#include <cmath>
+#include <vector>
 namespace kernel {
-#if defined (LLAMA3_SUPPORT)
-void sin_cos_cache_calc_cpu(int head_size, int max_seq_len, float* sin_cache, float* cos_cache) {
-  for (int pos = 0; pos < max_seq_len; ++pos) {
-    for (int head_dim = 0; head_dim < head_size; ++head_dim) {
-      float freq =
-          1.0f / std::pow(500000.0f, static_cast<float>(head_dim) / static_cast<float>(head_size));
-      float val = static_cast<float>(pos) * freq;
-      float fcr = cosf(val);
-      float fci = sinf(val);
-      *(sin_cache + pos * head_size + head_dim) = fci;
-      *(cos_cache + pos * head_size + head_dim) = fcr;
-    }
+void sin_cos_cache_calc_cpu(int head_size, int max_seq_len, float theta,
+                            const base::RoPEScaling& scaling, float* sin_cache,
+                            float* cos_cache) {
+  const int pair_num = head_size / 2;
+  const std::vector<float> inv_freq = base::rope_inv_freq(head_size, theta, scaling);
+  const float attention_factor = base::rope_attention_factor(scaling);
+  for (int j = 0; j < pair_num; ++j) {
+    sin_cache[j] = inv_freq.at(j);
+    cos_cache[j] = attention_factor;
   }
-}
-
-void rope_kernel_cpu(int32_t dim, int32_t kv_dim, int32_t head_size, const tensor::Tensor& input_q,
-                     const tensor::Tensor& input_k, const tensor::Tensor& input_pos,
-                     const tensor::Tensor& sin_cache, const tensor::Tensor& cos_cache,
-                     void* stream) {
-  UNUSED(stream);
-  const int32_t pos = *input_pos.ptr<int32_t>(0);
-
-  for (int32_t i = 0; i < dim; i += head_size) {
-    for (int32_t head_dim = i % head_size; head_dim < head_size / 2; head_dim ++) {
-      float fci = *(sin_cache.ptr<float>() + pos * head_size + head_dim * 2);
-      float fcr = *(cos_cache.ptr<float>() + pos * head_size + head_dim * 2);
-
-      int32_t rotn = i < kv_dim ? 2 : 1;  // how many vectors? 2 = q & k, 1 = q only
-      for (int32_t v = 0; v < rotn; v++) {
-        float* vec =
-            const_cast<float*>(v == 0 ? input_q.ptr<float>()
-                                      : input_k.ptr<float>());  // the vector to rotate (query or key)
-        float v0 = vec[i + head_dim];
-        float v1 = vec[i + head_dim + head_size / 2];
-        vec[i + head_dim] = v0 * fcr - v1 * fci;
-        vec[i + head_dim + head_size / 2] = v0 * fci + v1 * fcr;
-      }
+  // the offsets in a tile carry the attention factor, so a product of two rows has it once
+  for (int offset = 0; offset < base::kRoPETileSize; ++offset) {
+    const int row = (1 + offset) * pair_num;
+    for (int j = 0; j < pair_num; ++j) {
+      const double val = static_cast<double>(offset) * inv_freq.at(j);
+      sin_cache[row + j] = attention_factor * static_cast<float>(std::sin(val));
+      cos_cache[row + j] = attention_factor * static_cast<float>(std::cos(val));
     }
   }
-}
-#elif defined (QWEN2_SUPPORT)
-void sin_cos_cache_calc_cpu(int head_size, int max_seq_len, float* sin_cache, float* cos_cache) {
-  for (int pos = 0; pos < max_seq_len; ++pos) {
-    for (int head_dim = 0; head_dim < head_size; ++head_dim) {
-      float freq =
-          1.0f / std::pow(1000000.0f, static_cast<float>(head_dim) / static_cast<float>(head_size));
-      float val = static_cast<float>(pos) * freq;
-      float fcr = cosf(val);
-      float fci = sinf(val);
-      *(sin_cache + pos * head_size + head_dim) = fci;
-      *(cos_cache + pos * head_size + head_dim) = fcr;
+  // the angles of the far tiles are large, they are taken in double so the tables stay exact
+  const int tile_num = base::rope_table_rows(max_seq_len) - 1 - base::kRoPETileSize;
+  for (int tile = 0; tile < tile_num; ++tile) {
+    const int row = (1 + base::kRoPETileSize + tile) * pair_num;
+    for (int j = 0; j < pair_num; ++j) {
+      const double val = static_cast<double>(tile * base::kRoPETileSize) * inv_freq.at(j);
+      sin_cache[row + j] = static_cast<float>(std::sin(val));
+      cos_cache[row + j] = static_cast<float>(std::cos(val));
     }
   }
 }
 
-void rope_kernel_cpu(int32_t dim, int32_t kv_dim, int32_t head_size, const tensor::Tensor& input_q,
-                     const tensor::Tensor& input_k, const tensor::Tensor& input_pos,
-                     const tensor::Tensor& sin_cache, const tensor::Tensor& cos_cache,
-                     void* stream) {
-  UNUSED(stream);
-  const int32_t pos = *input_pos.ptr<int32_t>(0);
-
-  for (int32_t i = 0; i < dim; i += head_size) {
-    for (int32_t head_dim = i % head_size; head_dim < head_size / 2; head_dim ++) {
-      float fci = *(sin_cache.ptr<float>() + pos * head_size + head_dim * 2);
-      float fcr = *(cos_cache.ptr<float>() + pos * head_size + head_dim * 2);
-
-      int32_t rotn = i < kv_dim ? 2 : 1;  // how many vectors? 2 = q & k, 1 = q only
-      for (int32_t v = 0; v < rotn; v++) {
-        float* vec =
-            const_cast<float*>(v == 0 ? input_q.ptr<float>()
-                                      : input_k.ptr<float>());  // the vector to rotate (query or key)
-        float v0 = vec[i + head_dim];
-        float v1 = vec[i + head_dim + head_size / 2];
-        vec[i + head_dim] = v0 * fcr - v1 * fci;
-        vec[i + head_dim + head_size / 2] = v0 * fci + v1 * fcr;
-      }
+// the sin and the cos of every pair of a head at pos, the angle of its tile turned by the angle
+// of its offset in the tile. A position past the tile_num tiles of the tables, which a windowed
+// sequence reaches, takes its angles from row 0 like the cuda kernels
+static void rope_sin_cos(int32_t pos, int32_t pair_num, int32_t tile_num, const float* sin_cache,
+                         const float* cos_cache, float* sin_row, float* cos_row) {
+  if (pos / base::kRoPETileSize >= tile_num) {
+    for (int32_t j = 0; j < pair_num; ++j) {
+      const double val = static_cast<double>(pos) * sin_cache[j];
+      sin_row[j] = cos_cache[j] * static_cast<float>(std::sin(val));
+      cos_row[j] = cos_cache[j] * static_cast<float>(std::cos(val));
     }
+    return;
   }
-}
-#else
-void sin_cos_cache_calc_cpu(int head_size, int max_seq_len, float* sin_cache, float* cos_cache) {
-  for (int pos = 0; pos < max_seq_len; ++pos) {
-    for (int head_dim = 0; head_dim < head_size; ++head_dim) {
-      float freq =
-          1.0f / std::pow(10000.0f, static_cast<float>(head_dim) / static_cast<float>(head_size));
-      float val = static_cast<float>(pos) * freq;
-      float fcr = cosf(val);
-      float fci = sinf(val);
-      *(sin_cache + pos * head_size + head_dim) = fci;
-      *(cos_cache + pos * head_size + head_dim) = fcr;
-    }
+  const int32_t offset_row = (1 + pos % base::kRoPETileSize) * pair_num;
+  const int32_t tile_row = (1 + base::kRoPETileSize + pos / base::kRoPETileSize) * pair_num;
+  for (int32_t j = 0; j < pair_num; ++j) {
+    const float so = sin_cache[offset_row + j];
+    const float co = cos_cache[offset_row + j];
+    const float st = sin_cache[tile_row + j];
+    const float ct = cos_cache[tile_row + j];
+    sin_row[j] = st * co + ct * so;
+    cos_row[j] = ct * co - st * so;
   }
 }
 
-void rope_kernel_cpu(int32_t dim, int32_t kv_dim, int32_t head_size, const tensor::Tensor& input_q,
-                     const tensor::Tensor& input_k, const tensor::Tensor& input_pos,
-                     const tensor::Tensor& sin_cache, const tensor::Tensor& cos_cache,
-                     void* stream) {
+void rope_kernel_cpu(int32_t dim, int32_t kv_dim, int32_t head_size, bool is_rotate_half,
+                     const tensor::Tensor& input_q, const tensor::Tensor& input_k,
+                     const tensor::Tensor& input_pos, const tensor::Tensor& sin_cache,
+                     const tensor::Tensor& cos_cache, void* stream) {
   UNUSED(stream);
-  const int32_t pos = *input_pos.ptr<int32_t>(0);
+  const int32_t start_pos = *input_pos.ptr<int32_t>(0);
+  const int32_t num_tokens = input_q.dims_size() == 2 ? input_q.get_dim(0) : 1;
+  // the rotate half models pair element i of a head with element i + head_size / 2, the
+  // others pair the adjacent elements
+  const int32_t pair_stride = is_rotate_half ? head_size / 2 : 1;
+  const int32_t pair_num = head_size / 2;
+  const int32_t tile_num =
+      static_cast<int32_t>(sin_cache.size()) / pair_num - 1 - base::kRoPETileSize;
+  std::vector<float> sin_row(pair_num);
+  std::vector<float> cos_row(pair_num);
 
-  for (int32_t i = 0; i < dim; i += 2) {
-    int32_t head_dim = i % head_size;
-    float fci = *(sin_cache.ptr<float>() + pos * head_size + head_dim);
-    float fcr = *(cos_cache.ptr<float>() + pos * head_size + head_dim);
+  for (int32_t row = 0; row < num_tokens; ++row) {
+    const int32_t pos = start_pos + row;
+    // the heads of a token share the angles
+    rope_sin_cos(pos, pair_num, tile_num, sin_cache.ptr<float>(), cos_cache.ptr<float>(),
+                 sin_row.data(), cos_row.data());
+    float* query = const_cast<float*>(input_q.ptr<float>()) + row * dim;
+    float* key = const_cast<float*>(input_k.ptr<float>()) + row * kv_dim;
+    for (int32_t i = 0; i < dim; i += head_size) {
+      for (int32_t pair = 0; pair < pair_num; ++pair) {
+        const int32_t v0_idx = i + (is_rotate_half ? pair : pair * 2);
+        const int32_t v1_idx = v0_idx + pair_stride;
+        float fci = sin_row[pair];
+        float fcr = cos_row[pair];
 
-    int32_t rotn = i < kv_dim ? 2 : 1;  // how many vectors? 2 = q & k, 1 = q only
-    for (int32_t v = 0; v < rotn; v++) {
-      float* vec =
-          const_cast<float*>(v == 0 ? input_q.ptr<float>()
-                                    : input_k.ptr<float>());  // the vector to rotate (query or key)
-      float v0 = vec[i];
-      float v1 = vec[i + 1];
-      vec[i] = v0 * fcr - v1 * fci;
-      vec[i + 1] = v0 * fci + v1 * fcr;
+        int32_t rotn = i < kv_dim ? 2 : 1;  // how many vectors? 2 = q & k, 1 = q only
+        for (int32_t v = 0; v < rotn; v++) {
+          float* vec = v == 0 ? query : key;  // the vector to rotate (query or key)
+          float v0 = vec[v0_idx];
+          float v1 = vec[v1_idx];
+          vec[v0_idx] = v0 * fcr - v1 * fci;
+          vec[v1_idx] = v0 * fci + v1 * fcr;
+        }
+      }
     }
   }
 }
-#endif
-}  // namespace kernel
\ No newline at end of file
+}  // namespace kernel
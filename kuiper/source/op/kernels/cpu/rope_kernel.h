@@ -1,12 +1,17 @@
 #ifndef LLAMA_INFER_ROPE_KERNEL_H
 #define LLAMA_INFER_ROPE_KERNEL_H
+#include "base/rope.h"
 #include "tensor/tensor.h"
 namespace kernel {
-void sin_cos_cache_calc_cpu(int head_size, int max_seq_len, float* sin_cache, float* cos_cache);
+// fills the tables of base::rope_table_rows(max_seq_len) rows. The angle of the element pair j
+// of a head at a position is pos * inv_freq[j], pos / theta^(2j / head_size) without a scaling
+void sin_cos_cache_calc_cpu(int head_size, int max_seq_len, float theta,
+                            const base::RoPEScaling& scaling, float* sin_cache,
+                            float* cos_cache);
 
-void rope_kernel_cpu(int32_t dim, int32_t kv_dim, int32_t head_size, const tensor::Tensor& input_q,
-                     const tensor::Tensor& input_k, const tensor::Tensor& input_pos,
-                     const tensor::Tensor& sin_cache, const tensor::Tensor& cos_cache,
-                     void* stream);
+void rope_kernel_cpu(int32_t dim, int32_t kv_dim, int32_t head_size, bool is_rotate_half,
+                     const tensor::Tensor& input_q, const tensor::Tensor& input_k,
+                     const tensor::Tensor& input_pos, const tensor::Tensor& sin_cache,
+                     const tensor::Tensor& cos_cache, void* stream);
 }  // namespace kernel
 #endif  // LLAMA_INFER_ROPE_KERNEL_H
@@ -1,4 +1,5 @@
 #include "swiglu_kernel.h"
+#include "vec_kernel.h"
 namespace kernel {
 void swiglu_kernel_cpu(const tensor::Tensor& input1, const tensor::Tensor& input2,
                        const tensor::Tensor& output, void* stream) {
@@ -11,14 +12,10 @@ void swiglu_kernel_cpu(const tensor::Tensor& input1, const tensor::Tensor& input
   CHECK(input2.device_type() == base::DeviceType::kDeviceCPU);
   CHECK(output.device_type() == base::DeviceType::kDeviceCPU);
 
-  arma::fvec input1_vec(const_cast<float*>(input1.ptr<float>()), input1.size(), false,
-                        true);
-  arma::fvec input2_vec(const_cast<float*>(input2.ptr<float>()), input2.size(), false,
-                        true);
-  arma::fvec output_vec(const_cast<float*>(output.ptr<float>()), output.size(), false,
-                        true);
-
-  input1_vec %= (1.0f / (1.0f + arma::exp(-input1_vec)));
-  output_vec = input1_vec % input2_vec;
+  CHECK_EQ(input1.size(), input2.size());
+  CHECK_EQ(input1.size(), output.size());
+  swiglu_row_kernel_cpu(input1.ptr<float>(), input2.ptr<float>(),
+                        const_cast<float*>(output.ptr<float>()),
+                        static_cast<int32_t>(output.size()));
 }
 }  // namespace kernel
\ No newline at end of file
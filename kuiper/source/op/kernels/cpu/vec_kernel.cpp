@@ -0,0 +1,489 @@
+#include "vec_kernel.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KUIPER_VEC_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define KUIPER_VEC_NEON
+#endif
+namespace kernel {
+// exp(x) = 2^n * exp(r) with n = round(x / ln2) and |r| <= ln2 / 2, exp(r) is the polynomial
+// of cephes. The input is clamped so 2^n stays a normal float, ln2 is split in two parts so
+// r keeps its low bits
+static constexpr float kExpMax = 88.0f;
+static constexpr float kExpMin = -87.3f;
+static constexpr float kLog2e = 1.44269504088896341f;
+static constexpr float kLn2Hi = 0.693359375f;
+static constexpr float kLn2Lo = -2.12194440e-4f;
+static constexpr float kExpP0 = 1.9875691500e-4f;
+static constexpr float kExpP1 = 1.3981999507e-3f;
+static constexpr float kExpP2 = 8.3334519073e-3f;
+static constexpr float kExpP3 = 4.1665795894e-2f;
+static constexpr float kExpP4 = 1.6666665459e-1f;
+static constexpr float kExpP5 = 5.0000001201e-1f;
+
+struct VecIsa {
+  float (*max)(const float* input, int32_t size);
+  float (*exp_sum)(float* input, int32_t size, float shift);
+  void (*scal)(float alpha, float* input, int32_t size);
+  float (*square_sum)(const float* input, int32_t size);
+  void (*scale_mul)(float alpha, const float* input, const float* weight, float* output,
+                    int32_t size);
+  void (*swiglu)(const float* gate, const float* up, float* output, int32_t size);
+  const char* name;
+};
+
+static float silu_scalar(float x) { return x / (1.f + std::exp(-x)); }
+
+static float max_scalar(const float* input, int32_t size) {
+  float max_value = -FLT_MAX;
+  for (int32_t i = 0; i < size; ++i) {
+    max_value = std::max(max_value, input[i]);
+  }
+  return max_value;
+}
+
+static float exp_sum_scalar(float* input, int32_t size, float shift) {
+  float sum = 0.f;
+  for (int32_t i = 0; i < size; ++i) {
+    input[i] = std::exp(input[i] - shift);
+    sum += input[i];
+  }
+  return sum;
+}
+
+static void scal_scalar(float alpha, float* input, int32_t size) {
+  for (int32_t i = 0; i < size; ++i) {
+    input[i] *= alpha;
+  }
+}
+
+static float square_sum_scalar(const float* input, int32_t size) {
+  float sum = 0.f;
+  for (int32_t i = 0; i < size; ++i) {
+    sum += input[i] * input[i];
+  }
+  return sum;
+}
+
+static void scale_mul_scalar(float alpha, const float* input, const float* weight,
+                             float* output, int32_t size) {
+  for (int32_t i = 0; i < size; ++i) {
+    output[i] = alpha * input[i] * weight[i];
+  }
+}
+
+static void swiglu_scalar(const float* gate, const float* up, float* output, int32_t size) {
+  for (int32_t i = 0; i < size; ++i) {
+    output[i] = silu_scalar(gate[i]) * up[i];
+  }
+}
+
+#ifdef KUIPER_VEC_X86
+__attribute__((target("avx2,fma"))) static inline __m256 exp_avx2(__m256 x) {
+  x = _mm256_max_ps(_mm256_min_ps(x, _mm256_set1_ps(kExpMax)), _mm256_set1_ps(kExpMin));
+  const __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(kLog2e)),
+                                   _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(kLn2Hi), x);
+  r = _mm256_fnmadd_ps(n, _mm256_set1_ps(kLn2Lo), r);
+  __m256 p = _mm256_set1_ps(kExpP0);
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(kExpP1));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(kExpP2));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(kExpP3));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(kExpP4));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(kExpP5));
+  p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.f)));
+  const __m256i exponent =
+      _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+  return _mm256_mul_ps(p, _mm256_castsi256_ps(exponent));
+}
+
+__attribute__((target("avx2,fma"))) static inline float reduce_add_avx2(__m256 value) {
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(value), _mm256_extractf128_ps(value, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+  return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx2,fma"))) static inline float reduce_max_avx2(__m256 value) {
+  __m128 max_value = _mm_max_ps(_mm256_castps256_ps128(value), _mm256_extractf128_ps(value, 1));
+  max_value = _mm_max_ps(max_value, _mm_movehl_ps(max_value, max_value));
+  max_value = _mm_max_ss(max_value, _mm_movehdup_ps(max_value));
+  return _mm_cvtss_f32(max_value);
+}
+
+__attribute__((target("avx2,fma"))) static float max_avx2(const float* input, int32_t size) {
+  __m256 max_vec = _mm256_set1_ps(-FLT_MAX);
+  int32_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    max_vec = _mm256_max_ps(max_vec, _mm256_loadu_ps(input + i));
+  }
+  float max_value = reduce_max_avx2(max_vec);
+  for (; i < size; ++i) {
+    max_value = std::max(max_value, input[i]);
+  }
+  return max_value;
+}
+
+__attribute__((target("avx2,fma"))) static float exp_sum_avx2(float* input, int32_t size,
+                                                              float shift) {
+  const __m256 shift_vec = _mm256_set1_ps(shift);
+  __m256 sum_vec = _mm256_setzero_ps();
+  int32_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    const __m256 value = exp_avx2(_mm256_sub_ps(_mm256_loadu_ps(input + i), shift_vec));
+    _mm256_storeu_ps(input + i, value);
+    sum_vec = _mm256_add_ps(sum_vec, value);
+  }
+  float sum = reduce_add_avx2(sum_vec);
+  for (; i < size; ++i) {
+    input[i] = std::exp(input[i] - shift);
+    sum += input[i];
+  }
+  return sum;
+}
+
+__attribute__((target("avx2,fma"))) static void scal_avx2(float alpha, float* input,
+                                                          int32_t size) {
+  const __m256 alpha_vec = _mm256_set1_ps(alpha);
+  int32_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    _mm256_storeu_ps(input + i, _mm256_mul_ps(alpha_vec, _mm256_loadu_ps(input + i)));
+  }
+  for (; i < size; ++i) {
+    input[i] *= alpha;
+  }
+}
+
+__attribute__((target("avx2,fma"))) static float square_sum_avx2(const float* input,
+                                                                 int32_t size) {
+  __m256 sum_vec = _mm256_setzero_ps();
+  int32_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    const __m256 value = _mm256_loadu_ps(input + i);
+    sum_vec = _mm256_fmadd_ps(value, value, sum_vec);
+  }
+  float sum = reduce_add_avx2(sum_vec);
+  for (; i < size; ++i) {
+    sum += input[i] * input[i];
+  }
+  return sum;
+}
+
+__attribute__((target("avx2,fma"))) static void scale_mul_avx2(float alpha, const float* input,
+                                                               const float* weight,
+                                                               float* output, int32_t size) {
+  const __m256 alpha_vec = _mm256_set1_ps(alpha);
+  int32_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    const __m256 value = _mm256_mul_ps(alpha_vec, _mm256_loadu_ps(input + i));
+    _mm256_storeu_ps(output + i, _mm256_mul_ps(value, _mm256_loadu_ps(weight + i)));
+  }
+  for (; i < size; ++i) {
+    output[i] = alpha * input[i] * weight[i];
+  }
+}
+
+__attribute__((target("avx2,fma"))) static void swiglu_avx2(const float* gate, const float* up,
+                                                            float* output, int32_t size) {
+  const __m256 one = _mm256_set1_ps(1.f);
+  int32_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    const __m256 x = _mm256_loadu_ps(gate + i);
+    const __m256 denom = _mm256_add_ps(one, exp_avx2(_mm256_sub_ps(_mm256_setzero_ps(), x)));
+    const __m256 silu = _mm256_div_ps(x, denom);
+    _mm256_storeu_ps(output + i, _mm256_mul_ps(silu, _mm256_loadu_ps(up + i)));
+  }
+  for (; i < size; ++i) {
+    output[i] = silu_scalar(gate[i]) * up[i];
+  }
+}
+
+// the avx512 kernels load the tail under a mask instead of a scalar loop
+__attribute__((target("avx512f"))) static inline __m512 exp_avx512(__m512 x) {
+  x = _mm512_max_ps(_mm512_min_ps(x, _mm512_set1_ps(kExpMax)), _mm512_set1_ps(kExpMin));
+  const __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(kLog2e)),
+                                        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(kLn2Hi), x);
+  r = _mm512_fnmadd_ps(n, _mm512_set1_ps(kLn2Lo), r);
+  __m512 p = _mm512_set1_ps(kExpP0);
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(kExpP1));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(kExpP2));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(kExpP3));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(kExpP4));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(kExpP5));
+  p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1.f)));
+  const __m512i exponent =
+      _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23);
+  return _mm512_mul_ps(p, _mm512_castsi512_ps(exponent));
+}
+
+static inline __mmask16 tail_mask16(int32_t remain) {
+  return static_cast<__mmask16>((1u << remain) - 1);
+}
+
+__attribute__((target("avx512f"))) static float max_avx512(const float* input, int32_t size) {
+  __m512 max_vec = _mm512_set1_ps(-FLT_MAX);
+  int32_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    max_vec = _mm512_max_ps(max_vec, _mm512_loadu_ps(input + i));
+  }
+  if (i < size) {
+    max_vec = _mm512_mask_max_ps(max_vec, tail_mask16(size - i), max_vec,
+                                 _mm512_maskz_loadu_ps(tail_mask16(size - i), input + i));
+  }
+  return _mm512_reduce_max_ps(max_vec);
+}
+
+__attribute__((target("avx512f"))) static float exp_sum_avx512(float* input, int32_t size,
+                                                               float shift) {
+  const __m512 shift_vec = _mm512_set1_ps(shift);
+  __m512 sum_vec = _mm512_setzero_ps();
+  int32_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const __m512 value = exp_avx512(_mm512_sub_ps(_mm512_loadu_ps(input + i), shift_vec));
+    _mm512_storeu_ps(input + i, value);
+    sum_vec = _mm512_add_ps(sum_vec, value);
+  }
+  if (i < size) {
+    const __mmask16 mask = tail_mask16(size - i);
+    const __m512 value =
+        exp_avx512(_mm512_sub_ps(_mm512_maskz_loadu_ps(mask, input + i), shift_vec));
+    _mm512_mask_storeu_ps(input + i, mask, value);
+    sum_vec = _mm512_mask_add_ps(sum_vec, mask, sum_vec, value);
+  }
+  return _mm512_reduce_add_ps(sum_vec);
+}
+
+__attribute__((target("avx512f"))) static void scal_avx512(float alpha, float* input,
+                                                           int32_t size) {
+  const __m512 alpha_vec = _mm512_set1_ps(alpha);
+  int32_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    _mm512_storeu_ps(input + i, _mm512_mul_ps(alpha_vec, _mm512_loadu_ps(input + i)));
+  }
+  if (i < size) {
+    const __mmask16 mask = tail_mask16(size - i);
+    _mm512_mask_storeu_ps(input + i, mask,
+                          _mm512_mul_ps(alpha_vec, _mm512_maskz_loadu_ps(mask, input + i)));
+  }
+}
+
+__attribute__((target("avx512f"))) static float square_sum_avx512(const float* input,
+                                                                  int32_t size) {
+  __m512 sum_vec = _mm512_setzero_ps();
+  int32_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const __m512 value = _mm512_loadu_ps(input + i);
+    sum_vec = _mm512_fmadd_ps(value, value, sum_vec);
+  }
+  if (i < size) {
+    const __m512 value = _mm512_maskz_loadu_ps(tail_mask16(size - i), input + i);
+    sum_vec = _mm512_fmadd_ps(value, value, sum_vec);
+  }
+  return _mm512_reduce_add_ps(sum_vec);
+}
+
+__attribute__((target("avx512f"))) static void scale_mul_avx512(float alpha, const float* input,
+                                                                const float* weight,
+                                                                float* output, int32_t size) {
+  const __m512 alpha_vec = _mm512_set1_ps(alpha);
+  int32_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const __m512 value = _mm512_mul_ps(alpha_vec, _mm512_loadu_ps(input + i));
+    _mm512_storeu_ps(output + i, _mm512_mul_ps(value, _mm512_loadu_ps(weight + i)));
+  }
+  if (i < size) {
+    const __mmask16 mask = tail_mask16(size - i);
+    const __m512 value = _mm512_mul_ps(alpha_vec, _mm512_maskz_loadu_ps(mask, input + i));
+    _mm512_mask_storeu_ps(output + i, mask,
+                          _mm512_mul_ps(value, _mm512_maskz_loadu_ps(mask, weight + i)));
+  }
+}
+
+__attribute__((target("avx512f"))) static inline __m512 silu_avx512(__m512 x) {
+  const __m512 denom =
+      _mm512_add_ps(_mm512_set1_ps(1.f), exp_avx512(_mm512_sub_ps(_mm512_setzero_ps(), x)));
+  return _mm512_div_ps(x, denom);
+}
+
+__attribute__((target("avx512f"))) static void swiglu_avx512(const float* gate, const float* up,
+                                                             float* output, int32_t size) {
+  int32_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const __m512 silu = silu_avx512(_mm512_loadu_ps(gate + i));
+    _mm512_storeu_ps(output + i, _mm512_mul_ps(silu, _mm512_loadu_ps(up + i)));
+  }
+  if (i < size) {
+    const __mmask16 mask = tail_mask16(size - i);
+    const __m512 silu = silu_avx512(_mm512_maskz_loadu_ps(mask, gate + i));
+    _mm512_mask_storeu_ps(output + i, mask,
+                          _mm512_mul_ps(silu, _mm512_maskz_loadu_ps(mask, up + i)));
+  }
+}
+#endif
+
+#ifdef KUIPER_VEC_NEON
+static inline float32x4_t exp_neon(float32x4_t x) {
+  x = vmaxq_f32(vminq_f32(x, vdupq_n_f32(kExpMax)), vdupq_n_f32(kExpMin));
+  const float32x4_t n = vrndnq_f32(vmulq_n_f32(x, kLog2e));
+  float32x4_t r = vfmsq_f32(x, n, vdupq_n_f32(kLn2Hi));
+  r = vfmsq_f32(r, n, vdupq_n_f32(kLn2Lo));
+  float32x4_t p = vdupq_n_f32(kExpP0);
+  p = vfmaq_f32(vdupq_n_f32(kExpP1), p, r);
+  p = vfmaq_f32(vdupq_n_f32(kExpP2), p, r);
+  p = vfmaq_f32(vdupq_n_f32(kExpP3), p, r);
+  p = vfmaq_f32(vdupq_n_f32(kExpP4), p, r);
+  p = vfmaq_f32(vdupq_n_f32(kExpP5), p, r);
+  p = vfmaq_f32(vaddq_f32(r, vdupq_n_f32(1.f)), p, vmulq_f32(r, r));
+  const int32x4_t exponent = vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(n), vdupq_n_s32(127)), 23);
+  return vmulq_f32(p, vreinterpretq_f32_s32(exponent));
+}
+
+static float max_neon(const float* input, int32_t size) {
+  float32x4_t max_vec = vdupq_n_f32(-FLT_MAX);
+  int32_t i = 0;
+  for (; i + 4 <= size; i += 4) {
+    max_vec = vmaxq_f32(max_vec, vld1q_f32(input + i));
+  }
+  float max_value = vmaxvq_f32(max_vec);
+  for (; i < size; ++i) {
+    max_value = std::max(max_value, input[i]);
+  }
+  return max_value;
+}
+
+static float exp_sum_neon(float* input, int32_t size, float shift) {
+  const float32x4_t shift_vec = vdupq_n_f32(shift);
+  float32x4_t sum_vec = vdupq_n_f32(0.f);
+  int32_t i = 0;
+  for (; i + 4 <= size; i += 4) {
+    const float32x4_t value = exp_neon(vsubq_f32(vld1q_f32(input + i), shift_vec));
+    vst1q_f32(input + i, value);
+    sum_vec = vaddq_f32(sum_vec, value);
+  }
+  float sum = vaddvq_f32(sum_vec);
+  for (; i < size; ++i) {
+    input[i] = std::exp(input[i] - shift);
+    sum += input[i];
+  }
+  return sum;
+}
+
+static void scal_neon(float alpha, float* input, int32_t size) {
+  int32_t i = 0;
+  for (; i + 4 <= size; i += 4) {
+    vst1q_f32(input + i, vmulq_n_f32(vld1q_f32(input + i), alpha));
+  }
+  for (; i < size; ++i) {
+    input[i] *= alpha;
+  }
+}
+
+static float square_sum_neon(const float* input, int32_t size) {
+  float32x4_t sum_vec = vdupq_n_f32(0.f);
+  int32_t i = 0;
+  for (; i + 4 <= size; i += 4) {
+    const float32x4_t value = vld1q_f32(input + i);
+    sum_vec = vfmaq_f32(sum_vec, value, value);
+  }
+  float sum = vaddvq_f32(sum_vec);
+  for (; i < size; ++i) {
+    sum += input[i] * input[i];
+  }
+  return sum;
+}
+
+static void scale_mul_neon(float alpha, const float* input, const float* weight, float* output,
+                           int32_t size) {
+  int32_t i = 0;
+  for (; i + 4 <= size; i += 4) {
+    const float32x4_t value = vmulq_n_f32(vld1q_f32(input + i), alpha);
+    vst1q_f32(output + i, vmulq_f32(value, vld1q_f32(weight + i)));
+  }
+  for (; i < size; ++i) {
+    output[i] = alpha * input[i] * weight[i];
+  }
+}
+
+static void swiglu_neon(const float* gate, const float* up, float* output, int32_t size) {
+  int32_t i = 0;
+  for (; i + 4 <= size; i += 4) {
+    const float32x4_t x = vld1q_f32(gate + i);
+    const float32x4_t denom = vaddq_f32(vdupq_n_f32(1.f), exp_neon(vnegq_f32(x)));
+    vst1q_f32(output + i, vmulq_f32(vdivq_f32(x, denom), vld1q_f32(up + i)));
+  }
+  for (; i < size; ++i) {
+    output[i] = silu_scalar(gate[i]) * up[i];
+  }
+}
+#endif
+
+static VecIsa select_vec_isa() {
+#ifdef KUIPER_VEC_X86
+  if (__builtin_cpu_supports("avx512f")) {
+    return {max_avx512,       exp_sum_avx512, scal_avx512, square_sum_avx512,
+            scale_mul_avx512, swiglu_avx512,  "avx512"};
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return {max_avx2,       exp_sum_avx2, scal_avx2, square_sum_avx2,
+            scale_mul_avx2, swiglu_avx2,  "avx2"};
+  }
+#elif defined(KUIPER_VEC_NEON)
+  return {max_neon, exp_sum_neon, scal_neon, square_sum_neon, scale_mul_neon, swiglu_neon,
+          "neon"};
+#endif
+  return {max_scalar,       exp_sum_scalar, scal_scalar, square_sum_scalar,
+          scale_mul_scalar, swiglu_scalar,  "scalar"};
+}
+
+static const VecIsa& vec_isa() {
+  static const VecIsa isa = select_vec_isa();
+  return isa;
+}
+
+float max_kernel_cpu(const float* input, int32_t size) {
+  CHECK(input != nullptr);
+  return vec_isa().max(input, size);
+}
+
+float exp_sum_kernel_cpu(float* input, int32_t size, float shift) {
+  CHECK(input != nullptr);
+  return vec_isa().exp_sum(input, size, shift);
+}
+
+void scal_kernel_cpu(float alpha, float* input, int32_t size) {
+  CHECK(input != nullptr);
+  vec_isa().scal(alpha, input, size);
+}
+
+float square_sum_kernel_cpu(const float* input, int32_t size) {
+  CHECK(input != nullptr);
+  return vec_isa().square_sum(input, size);
+}
+
+void scale_mul_kernel_cpu(float alpha, const float* input, const float* weight, float* output,
+                          int32_t size) {
+  CHECK(input != nullptr && weight != nullptr && output != nullptr);
+  vec_isa().scale_mul(alpha, input, weight, output, size);
+}
+
+void swiglu_row_kernel_cpu(const float* gate, const float* up, float* output, int32_t size) {
+  CHECK(gate != nullptr && up != nullptr && output != nullptr);
+  vec_isa().swiglu(gate, up, output, size);
+}
+
+void softmax_row_kernel_cpu(float* input, int32_t size) {
+  if (size <= 0) {
+    return;
+  }
+  const float sum = exp_sum_kernel_cpu(input, size, max_kernel_cpu(input, size));
+  scal_kernel_cpu(1.f / sum, input, size);
+}
+
+const char* vec_isa_name() { return vec_isa().name; }
+}  // namespace kernel
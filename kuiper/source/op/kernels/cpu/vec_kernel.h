@@ -0,0 +1,35 @@
+#ifndef LLAMA_INFER_VEC_KERNEL_H
+#define LLAMA_INFER_VEC_KERNEL_H
+#include <cstdint>
+namespace kernel {
+// The element wise kernels of the cpu on one row, on the calling thread. They use the widest
+// simd set of the cpu, picked once at the first call, and a polynomial exp whose relative
+// error stays below 2e-7 on the range where the result is a normal float
+
+// the largest element of the row
+float max_kernel_cpu(const float* input, int32_t size);
+
+// input = exp(input - shift), returns the sum of the results, the exponent and the sum are
+// taken in the same pass
+float exp_sum_kernel_cpu(float* input, int32_t size, float shift);
+
+// input = alpha * input
+void scal_kernel_cpu(float alpha, float* input, int32_t size);
+
+// the sum of the squared elements
+float square_sum_kernel_cpu(const float* input, int32_t size);
+
+// output = alpha * input * weight element wise
+void scale_mul_kernel_cpu(float alpha, const float* input, const float* weight, float* output,
+                          int32_t size);
+
+// output = silu(gate) * up element wise
+void swiglu_row_kernel_cpu(const float* gate, const float* up, float* output, int32_t size);
+
+// the softmax of the row in place
+void softmax_row_kernel_cpu(float* input, int32_t size);
+
+// the name of the simd set which the kernels above use
+const char* vec_isa_name();
+}  // namespace kernel
+#endif  // LLAMA_INFER_VEC_KERNEL_H
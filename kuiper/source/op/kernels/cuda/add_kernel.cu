@@ -11,16 +11,34 @@ __global__ void add_kernel_cu_fp32(int32_t size, const float* in1, const float*
   out[tid] = in_val1 + in_val2;
 }
 
+__global__ void add_kernel_cu_fp32_broadcast(int32_t size, int32_t size2, const float* in1,
+                                             const float* in2, float* out) {
+  int32_t tid = threadIdx.x + blockDim.x * blockIdx.x;
+  if (tid >= size) {
+    return;
+  }
+  out[tid] = in1[tid] + in2[tid % size2];
+}
+
 void add_kernel_cu(const tensor::Tensor& input1, const tensor::Tensor& input2,
                    const tensor::Tensor& output, void* stream) {
   CHECK_EQ(input1.is_empty(), false);
   CHECK_EQ(input2.is_empty(), false);
   CHECK_EQ(output.is_empty(), false);
   int32_t size = static_cast<int32_t>(input1.size());
-  CHECK_EQ(size, input2.size());
   CHECK_EQ(size, output.size());
   int32_t thread_num = 512;
   int32_t block_num = (size + thread_num - 1) / thread_num;
+  const int32_t size2 = static_cast<int32_t>(input2.size());
+  if (size2 != size) {
+    // input2 is a row (such as the bias) added to every row of input1
+    CHECK_EQ(size % size2, 0);
+    cudaStream_t stream_ = static_cast<CUstream_st*>(stream);
+    add_kernel_cu_fp32_broadcast<<<block_num, thread_num, 0, stream_>>>(
+        size, size2, input1.ptr<float>(), input2.ptr<float>(),
+        const_cast<float*>(output.ptr<float>()));
+    return;
+  }
   if (stream) {
     cudaStream_t stream_ = static_cast<CUstream_st*>(stream);
     add_kernel_cu_fp32<<<block_num, thread_num, 0, stream_>>>(
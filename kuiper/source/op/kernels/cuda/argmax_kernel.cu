@@ -1,7 +1,15 @@
+#include <algorithm>
+#include <cfloat>
 #include "../kernels_interface.h"
 #include "argmax_kernel.cuh"
 #include "tensor/tensor.h"
 namespace kernel {
+// the partial maxima of the first stage, one per block, are reduced by a single block
+constexpr static int argmax_thread_num = 256;
+constexpr static int argmax_max_block_num = 128;
+// a block only pays off once every thread has a few logits of its own
+constexpr static int argmax_elems_per_thread = 4;
+
 __forceinline__ __device__ void warp_reduce_argmax(float& val, size_t& ptr) {
   float tmp_val;
   size_t tmp_ptr;
@@ -9,8 +17,10 @@ __forceinline__ __device__ void warp_reduce_argmax(float& val, size_t& ptr) {
   for (unsigned int k = (warpSize >> 1); k > 0; k >>= 1) {
     tmp_val = __shfl_down_sync(mask, val, k, warpSize);
     tmp_ptr = __shfl_down_sync(mask, ptr, k, warpSize);
-    if (ptr == SIZE_MAX || tmp_ptr == SIZE_MAX) continue;
-    if (tmp_val > val) {
+    if (tmp_ptr == SIZE_MAX) {
+      continue;
+    }
+    if (ptr == SIZE_MAX || tmp_val > val) {
       val = tmp_val;
       ptr = tmp_ptr;
     } else if (tmp_val == val && tmp_ptr < ptr) {
@@ -46,43 +56,62 @@ __forceinline__ __device__ void block_reduce_argmax(float& val, size_t& ptr, flo
   }
 }
 
-__global__ void argmax_kernel_fp32(const float* input_ptr, size_t size, size_t* output_idx) {
+// every block reduces a grid strided part of the input to one partial maximum
+__global__ void argmax_partial_kernel(const float* input_ptr, size_t size, float* partial_value,
+                                      int32_t* partial_idx) {
   __shared__ size_t shared_max_ptr[32];
   __shared__ float shared_max_value[32];
-  uint32_t tid = threadIdx.x;
-  if (tid >= size) {
-    return;
-  }
-
-  size_t max_index = threadIdx.x;
-  float max_value = input_ptr[max_index];
-  for (size_t i = tid; i < size; i += blockDim.x) {
-    if (input_ptr[i] > max_value) {
+  size_t max_index = SIZE_MAX;
+  float max_value = -FLT_MAX;
+  const size_t step = static_cast<size_t>(gridDim.x) * blockDim.x;
+  for (size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < size; i += step) {
+    const float value = input_ptr[i];
+    if (max_index == SIZE_MAX || value > max_value) {
       max_index = i;
-      max_value = input_ptr[i];
+      max_value = value;
     }
   }
 
   block_reduce_argmax(max_value, max_index, shared_max_value, shared_max_ptr);
-  __syncthreads();
   if (threadIdx.x == 0) {
-    *output_idx = max_index;
+    partial_value[blockIdx.x] = max_value;
+    partial_idx[blockIdx.x] = static_cast<int32_t>(max_index);
   }
 }
 
-size_t argmax_kernel_cu(const float* input_ptr, size_t size, void* stream) {
-  std::shared_ptr<base::DeviceAllocator> alloc_cu =
-      base::CUDADeviceAllocatorFactory::get_instance();
-  size_t* index = static_cast<size_t*>(alloc_cu->allocate(sizeof(size_t)));
-  size_t output_index = 0;
-  if (!stream) {
-    argmax_kernel_fp32<<<1, 512>>>(input_ptr, size, index);
-    cudaMemcpy(&output_index, index, sizeof(size_t), cudaMemcpyDeviceToHost);
-  } else {
-    cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
-    argmax_kernel_fp32<<<1, 512, 0, stream_>>>(input_ptr, size, index);
-    cudaMemcpyAsync(&output_index, index, sizeof(size_t), cudaMemcpyDeviceToHost, stream_);
+__global__ void argmax_final_kernel(int32_t partial_num, const float* partial_value,
+                                    const int32_t* partial_idx, int32_t* output_idx) {
+  __shared__ size_t shared_max_ptr[32];
+  __shared__ float shared_max_value[32];
+  size_t max_index = SIZE_MAX;
+  float max_value = -FLT_MAX;
+  if (threadIdx.x < partial_num) {
+    max_index = partial_idx[threadIdx.x];
+    max_value = partial_value[threadIdx.x];
   }
-  return output_index;
+  block_reduce_argmax(max_value, max_index, shared_max_value, shared_max_ptr);
+  if (threadIdx.x == 0) {
+    *output_idx = static_cast<int32_t>(max_index);
+  }
+}
+
+size_t argmax_workspace_byte_size() {
+  return argmax_max_block_num * (sizeof(float) + sizeof(int32_t));
+}
+
+void argmax_kernel_cu(const float* input_ptr, size_t size, int32_t* output_idx, void* workspace,
+                      void* stream) {
+  CHECK(input_ptr != nullptr && output_idx != nullptr && workspace != nullptr);
+  CHECK_GT(size, 0);
+  const size_t block_elems = argmax_thread_num * argmax_elems_per_thread;
+  const int32_t block_num = static_cast<int32_t>(
+      std::min<size_t>((size + block_elems - 1) / block_elems, argmax_max_block_num));
+  float* partial_value = static_cast<float*>(workspace);
+  int32_t* partial_idx = reinterpret_cast<int32_t*>(partial_value + argmax_max_block_num);
+  cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+  argmax_partial_kernel<<<block_num, argmax_thread_num, 0, stream_>>>(input_ptr, size,
+                                                                       partial_value, partial_idx);
+  argmax_final_kernel<<<1, argmax_max_block_num, 0, stream_>>>(block_num, partial_value,
+                                                                partial_idx, output_idx);
 }
-}  // namespace kernel
\ No newline at end of file
+}  // namespace kernel
@@ -1,6 +1,14 @@
 #ifndef ARGMAX_KERNEL_CUH
 #define ARGMAX_KERNEL_CUH
+#include <cstddef>
+#include <cstdint>
 namespace kernel {
-size_t argmax_kernel_cu(const float* input_ptr, size_t size, void* stream);
-}
+// the bytes of device memory the partial maxima of the grid need
+size_t argmax_workspace_byte_size();
+
+// the blocks of the grid reduce their parts of the input into the workspace and a last block
+// picks the maximum among them, the index stays on the device and nothing is synchronized
+void argmax_kernel_cu(const float* input_ptr, size_t size, int32_t* output_idx, void* workspace,
+                      void* stream);
+}  // namespace kernel
 #endif  // ARGMAX_KERNEL_CUH
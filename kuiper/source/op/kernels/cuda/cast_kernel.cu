@@ -0,0 +1,44 @@
+#include <cuda_bf16.h>
+#include <cuda_fp16.h>
+#include <tensor/tensor.h>
+#include "cast_kernel.cuh"
+namespace kernel {
+__global__ void cast_kernel_cu_fp16(int size, const float* in, half* out) {
+  int idx = threadIdx.x + blockDim.x * blockIdx.x;
+  if (idx >= size) {
+    return;
+  }
+  out[idx] = __float2half(in[idx]);
+}
+
+__global__ void cast_kernel_cu_bf16(int size, const float* in, __nv_bfloat16* out) {
+  int idx = threadIdx.x + blockDim.x * blockIdx.x;
+  if (idx >= size) {
+    return;
+  }
+  out[idx] = __float2bfloat16(in[idx]);
+}
+
+void cast_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& output, void* stream) {
+  CHECK_EQ(input.is_empty(), false);
+  CHECK_EQ(output.is_empty(), false);
+  CHECK(input.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(output.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(input.data_type() == base::DataType::kDataTypeFp32);
+  CHECK_EQ(input.size(), output.size());
+
+  int size = static_cast<int32_t>(input.size());
+  int threads = 128;
+  int blocks = (size + threads - 1) / threads;
+  cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+  if (output.data_type() == base::DataType::kDataTypeFp16) {
+    cast_kernel_cu_fp16<<<blocks, threads, 0, stream_>>>(
+        size, input.ptr<float>(), const_cast<half*>(output.ptr<half>()));
+  } else if (output.data_type() == base::DataType::kDataTypeBf16) {
+    cast_kernel_cu_bf16<<<blocks, threads, 0, stream_>>>(
+        size, input.ptr<float>(), const_cast<__nv_bfloat16*>(output.ptr<__nv_bfloat16>()));
+  } else {
+    LOG(FATAL) << "Unsupported output data type for the cast kernel.";
+  }
+}
+}  // namespace kernel
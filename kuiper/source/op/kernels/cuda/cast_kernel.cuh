@@ -0,0 +1,7 @@
+#ifndef CAST_KERNEL_CU_CUH
+#define CAST_KERNEL_CU_CUH
+#include <tensor/tensor.h>
+namespace kernel {
+void cast_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& output, void* stream);
+}
+#endif  // CAST_KERNEL_CU_CUH
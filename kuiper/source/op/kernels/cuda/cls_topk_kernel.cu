@@ -0,0 +1,203 @@
+#include <cuda_bf16.h>
+#include <cuda_fp16.h>
+#include <cfloat>
+#include <cub/block/block_reduce.cuh>
+#include "cls_topk_kernel.cuh"
+namespace kernel {
+// every block takes cls_topk_rows logits, one per thread
+constexpr static int cls_topk_thread_num = 256;
+constexpr static int cls_topk_rows = cls_topk_thread_num;
+constexpr static int cls_topk_merge_thread_num = 1024;
+
+__device__ __forceinline__ float to_float(float value) { return value; }
+
+__device__ __forceinline__ float to_float(half value) { return __half2float(value); }
+
+__device__ __forceinline__ float to_float(__nv_bfloat16 value) { return __bfloat162float(value); }
+
+using Candidate = cub::KeyValuePair<int, float>;
+
+// the largest value of the block, the smaller key among equal ones, on every thread
+template <int kThreadNum>
+__device__ __forceinline__ Candidate block_argmax(Candidate candidate, Candidate& shared) {
+  using BlockReduce = cub::BlockReduce<Candidate, kThreadNum>;
+  __shared__ typename BlockReduce::TempStorage temp;
+  candidate = BlockReduce(temp).Reduce(candidate, cub::ArgMax());
+  if (threadIdx.x == 0) {
+    shared = candidate;
+  }
+  __syncthreads();
+  candidate = shared;
+  __syncthreads();
+  return candidate;
+}
+
+template <typename T>
+__global__ void cls_topk_partial_kernel(const float* input, const T* weight, int rows, int cols,
+                                        int k, float* partial_values, int32_t* partial_indices,
+                                        float* partial_max, float* partial_sum) {
+  __shared__ float logits[cls_topk_rows];
+  __shared__ Candidate best;
+  using BlockReduce = cub::BlockReduce<float, cls_topk_thread_num>;
+  __shared__ typename BlockReduce::TempStorage temp;
+  const int row_begin = blockIdx.x * cls_topk_rows;
+  const int lane = threadIdx.x % 32;
+  for (int r = threadIdx.x / 32; r < cls_topk_rows; r += cls_topk_thread_num / 32) {
+    const int row = row_begin + r;
+    float sum = 0.f;
+    if (row < rows) {
+      const T* weight_row = weight + static_cast<int64_t>(row) * cols;
+      for (int i = lane; i < cols; i += 32) {
+        sum += to_float(weight_row[i]) * input[i];
+      }
+    }
+#pragma unroll
+    for (int offset = 16; offset > 0; offset /= 2) {
+      sum += __shfl_xor_sync(0xffffffff, sum, offset);
+    }
+    if (lane == 0) {
+      logits[r] = row < rows ? sum : -FLT_MAX;
+    }
+  }
+  __syncthreads();
+
+  // the thread keeps its logit for the sum of the exponents, the list takes them out one by one
+  const bool is_row = row_begin + threadIdx.x < rows;
+  const float logit = logits[threadIdx.x];
+  float block_max = -FLT_MAX;
+  for (int j = 0; j < k; ++j) {
+    const float value = logits[threadIdx.x];
+    const Candidate top = block_argmax<cls_topk_thread_num>(
+        Candidate(is_row && value > -FLT_MAX ? threadIdx.x : cls_topk_rows, value), best);
+    if (j == 0) {
+      block_max = top.value;
+    }
+    if (threadIdx.x == 0) {
+      const bool is_valid = top.key < cls_topk_rows;
+      partial_values[blockIdx.x * k + j] = is_valid ? top.value : -FLT_MAX;
+      partial_indices[blockIdx.x * k + j] = is_valid ? row_begin + top.key : -1;
+    }
+    if (threadIdx.x == top.key) {
+      logits[threadIdx.x] = -FLT_MAX;
+    }
+    __syncthreads();
+  }
+  const float sum = BlockReduce(temp).Sum(is_row ? __expf(logit - block_max) : 0.f);
+  if (threadIdx.x == 0) {
+    partial_max[blockIdx.x] = block_max;
+    partial_sum[blockIdx.x] = sum;
+  }
+}
+
+// the lists of the blocks are sorted, so each round takes the largest head among them and
+// moves that list on by one
+__global__ void cls_topk_merge_kernel(int block_num, int k, const float* partial_values,
+                                      const int32_t* partial_indices, const float* partial_max,
+                                      const float* partial_sum, int32_t* heads, float* values,
+                                      int32_t* indices) {
+  __shared__ Candidate best;
+  using BlockReduce = cub::BlockReduce<float, cls_topk_merge_thread_num>;
+  __shared__ typename BlockReduce::TempStorage temp;
+  __shared__ float shared_max;
+  for (int b = threadIdx.x; b < block_num; b += blockDim.x) {
+    heads[b] = 0;
+  }
+  __syncthreads();
+  for (int j = 0; j < k; ++j) {
+    // the key orders the blocks, a smaller block holds the smaller tokens
+    Candidate candidate(block_num, -FLT_MAX);
+    for (int b = threadIdx.x; b < block_num; b += blockDim.x) {
+      const int head = heads[b];
+      if (head < k && partial_indices[b * k + head] >= 0 &&
+          (candidate.key == block_num || partial_values[b * k + head] > candidate.value)) {
+        candidate = Candidate(b, partial_values[b * k + head]);
+      }
+    }
+    const Candidate top = block_argmax<cls_topk_merge_thread_num>(candidate, best);
+    if (threadIdx.x == 0) {
+      const bool is_valid = top.key < block_num;
+      values[j] = is_valid ? top.value : -FLT_MAX;
+      indices[j] = is_valid ? partial_indices[top.key * k + heads[top.key]] : 0;
+      if (is_valid) {
+        heads[top.key] += 1;
+      }
+    }
+    __syncthreads();
+  }
+
+  float thread_max = -FLT_MAX;
+  for (int b = threadIdx.x; b < block_num; b += blockDim.x) {
+    thread_max = fmaxf(thread_max, partial_max[b]);
+  }
+  const float max_value = BlockReduce(temp).Reduce(thread_max, cub::Max());
+  if (threadIdx.x == 0) {
+    shared_max = max_value;
+  }
+  __syncthreads();
+  float thread_sum = 0.f;
+  for (int b = threadIdx.x; b < block_num; b += blockDim.x) {
+    thread_sum += partial_sum[b] * __expf(partial_max[b] - shared_max);
+  }
+  const float sum = BlockReduce(temp).Sum(thread_sum);
+  if (threadIdx.x == 0) {
+    values[k] = shared_max + logf(sum);
+  }
+}
+
+static int32_t cls_topk_block_num(int32_t vocab_size) {
+  return (vocab_size + cls_topk_rows - 1) / cls_topk_rows;
+}
+
+size_t cls_topk_workspace_byte_size(int32_t vocab_size) {
+  // the lists of the blocks, their max and sum and the heads of the merge
+  const size_t block_num = cls_topk_block_num(vocab_size);
+  return block_num * kClsTopKMaxNum * (sizeof(float) + sizeof(int32_t)) +
+         block_num * (2 * sizeof(float) + sizeof(int32_t));
+}
+
+template <typename T>
+static void launch_cls_topk(const float* input, const T* weight, int32_t rows, int32_t cols,
+                            int32_t k, float* values, int32_t* indices, void* workspace,
+                            cudaStream_t stream) {
+  const int32_t block_num = cls_topk_block_num(rows);
+  float* partial_values = static_cast<float*>(workspace);
+  int32_t* partial_indices = reinterpret_cast<int32_t*>(partial_values + block_num * k);
+  float* partial_max = reinterpret_cast<float*>(partial_indices + block_num * k);
+  float* partial_sum = partial_max + block_num;
+  int32_t* heads = reinterpret_cast<int32_t*>(partial_sum + block_num);
+  cls_topk_partial_kernel<T><<<block_num, cls_topk_thread_num, 0, stream>>>(
+      input, weight, rows, cols, k, partial_values, partial_indices, partial_max, partial_sum);
+  cls_topk_merge_kernel<<<1, cls_topk_merge_thread_num, 0, stream>>>(
+      block_num, k, partial_values, partial_indices, partial_max, partial_sum, heads, values,
+      indices);
+}
+
+void cls_topk_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& weight, int32_t k,
+                        float* values, int32_t* indices, void* workspace, void* stream) {
+  CHECK(!input.is_empty() && weight.dims_size() == 2);
+  CHECK(values != nullptr && indices != nullptr && workspace != nullptr);
+  const int32_t rows = weight.get_dim(0);
+  const int32_t cols = weight.get_dim(1);
+  CHECK_EQ(input.size(), cols);
+  CHECK(k > 0 && k <= kClsTopKMaxNum && k <= rows);
+  cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+  switch (weight.data_type()) {
+    case base::DataType::kDataTypeFp32:
+      launch_cls_topk(input.ptr<float>(), weight.ptr<float>(), rows, cols, k, values, indices,
+                      workspace, stream_);
+      break;
+    case base::DataType::kDataTypeFp16:
+      launch_cls_topk(input.ptr<float>(), reinterpret_cast<const half*>(weight.ptr<uint16_t>()),
+                      rows, cols, k, values, indices, workspace, stream_);
+      break;
+    case base::DataType::kDataTypeBf16:
+      launch_cls_topk(input.ptr<float>(),
+                      reinterpret_cast<const __nv_bfloat16*>(weight.ptr<uint16_t>()), rows, cols,
+                      k, values, indices, workspace, stream_);
+      break;
+    default:
+      LOG(FATAL) << "The fused classifier does not support the weight data type "
+                 << int(weight.data_type());
+  }
+}
+}  // namespace kernel
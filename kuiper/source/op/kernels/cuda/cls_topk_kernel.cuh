@@ -0,0 +1,21 @@
+#ifndef CLS_TOPK_KERNEL_CUH
+#define CLS_TOPK_KERNEL_CUH
+#include <cstddef>
+#include <cstdint>
+#include "tensor/tensor.h"
+namespace kernel {
+// the most candidates the fused classifier keeps, a sampler with a larger top-k reads the logits
+constexpr int32_t kClsTopKMaxNum = 64;
+
+// the bytes of device memory the candidates of the blocks of a classifier need
+size_t cls_topk_workspace_byte_size(int32_t vocab_size);
+
+// logits = weight @ input without writing them: every block computes the logits of its rows
+// and keeps its k largest ones in shared memory with the max and the sum of the exponents of
+// its rows, a second kernel merges the sorted lists of the blocks. values and indices get the k
+// largest logits in descending order and their tokens, values[k] the log-sum-exp of all of
+// them. The weight is fp32, fp16 or bf16 and nothing is synchronized
+void cls_topk_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& weight, int32_t k,
+                        float* values, int32_t* indices, void* workspace, void* stream);
+}  // namespace kernel
+#endif  // CLS_TOPK_KERNEL_CUH
@@ -1,31 +1,44 @@
+#include <algorithm>
+#include <cuda_bf16.h>
+#include <cuda_fp16.h>
 #include "emb_kernel.cuh"
 namespace kernel {
+__device__ __forceinline__ float to_float(float value) { return value; }
+
+__device__ __forceinline__ float to_float(half value) { return __half2float(value); }
+
+__device__ __forceinline__ float to_float(__nv_bfloat16 value) { return __bfloat162float(value); }
+
+template <typename T>
 __global__ void emb_kernel_cu_fp32(int32_t vocab_size, int32_t token_num, int32_t weight_dim,
-                                   const int32_t* input_ptr, const float* weight_ptr,
+                                   const int32_t* input_ptr, const T* weight_ptr,
                                    float* output_ptr) {
-  int32_t token_idx = blockIdx.x;
-  if (token_idx >= token_num) {
-    return;
-  }
-  int32_t token = input_ptr[token_idx];
-  if (token >= vocab_size) {
-    return;
-  }
+  // a batch of prompts has more tokens than blocks
+  for (int32_t token_idx = blockIdx.x; token_idx < token_num; token_idx += gridDim.x) {
+    int32_t token = input_ptr[token_idx];
+    if (token >= vocab_size) {
+      continue;
+    }
 
-  float* output_ptr_start = output_ptr + token_idx * weight_dim;
-  const float* weight_ptr_start = weight_ptr + token * weight_dim;
+    float* output_ptr_start = output_ptr + static_cast<int64_t>(token_idx) * weight_dim;
+    const T* weight_ptr_start = weight_ptr + static_cast<int64_t>(token) * weight_dim;
 
-  for (int32_t i = threadIdx.x; i < weight_dim; i += blockDim.x) {
-    output_ptr_start[i] = weight_ptr_start[i];
+    for (int32_t i = threadIdx.x; i < weight_dim; i += blockDim.x) {
+      output_ptr_start[i] = to_float(weight_ptr_start[i]);
+    }
   }
 }
 
 void emb_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& weight,
                    const tensor::Tensor& output, int32_t vocab_size, void* stream) {
-  tensor::Tensor input_cu;
+  // the tokens are uploaded on the stream of the kernel, a pinned input makes it asynchronous
+  tensor::Tensor input_cu = input;
   if (input.device_type() != base::DeviceType::kDeviceCUDA) {
-    input_cu = input.clone();
-    input_cu.to_cuda();
+    auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+    input_cu = tensor::Tensor(base::DataType::kDataTypeInt32, static_cast<int32_t>(input.size()),
+                              true, alloc_cu);
+    alloc_cu->memcpy(input.ptr<int32_t>(), input_cu.ptr<int32_t>(), input.byte_size(),
+                     base::MemcpyKind::kMemcpyCPU2CUDA, stream);
   }
   const int32_t input_num = static_cast<int32_t>(input.size());
   const int32_t weight_dim = weight.get_dim(1);
@@ -35,15 +48,125 @@ void emb_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& weight,
   constexpr int32_t max_seq_len = 512;
   constexpr int32_t thread_num = 128;
   int32_t* in_ptr = input_cu.ptr<int32_t>();
-  float* wei_ptr = const_cast<float*>(weight.ptr<float>());
   float* out_ptr = const_cast<float*>(output.ptr<float>());
-  if (stream) {
-    cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
-    emb_kernel_cu_fp32<<<max_seq_len, thread_num, 0, stream_>>>(vocab_size, input_num, weight_dim,
-                                                                in_ptr, wei_ptr, out_ptr);
+  cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+  // the table of a 16 bit model is widened row by row as the tokens are looked up
+  if (weight.data_type() == base::DataType::kDataTypeFp16) {
+    emb_kernel_cu_fp32<<<max_seq_len, thread_num, 0, stream_>>>(
+        vocab_size, input_num, weight_dim, in_ptr,
+        reinterpret_cast<const half*>(weight.ptr<uint16_t>()), out_ptr);
+  } else if (weight.data_type() == base::DataType::kDataTypeBf16) {
+    emb_kernel_cu_fp32<<<max_seq_len, thread_num, 0, stream_>>>(
+        vocab_size, input_num, weight_dim, in_ptr,
+        reinterpret_cast<const __nv_bfloat16*>(weight.ptr<uint16_t>()), out_ptr);
   } else {
-    emb_kernel_cu_fp32<<<max_seq_len, thread_num>>>(vocab_size, input_num, weight_dim, in_ptr,
-                                                    wei_ptr, out_ptr);
+    emb_kernel_cu_fp32<<<max_seq_len, thread_num, 0, stream_>>>(
+        vocab_size, input_num, weight_dim, in_ptr, weight.ptr<float>(), out_ptr);
+  }
+}
+
+__global__ void advance_token_kernel(const int32_t* token_ptr, int32_t* pos_ptr,
+                                     int32_t* tokens_ptr, int32_t max_token_num) {
+  const int32_t next_pos = *pos_ptr + 1;
+  if (next_pos < max_token_num) {
+    tokens_ptr[next_pos] = *token_ptr;
+  }
+  *pos_ptr = next_pos;
+}
+
+void advance_token_kernel_cu(const tensor::Tensor& token, const tensor::Tensor& pos,
+                             const tensor::Tensor& tokens, void* stream) {
+  CHECK(token.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(pos.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(tokens.device_type() == base::DeviceType::kDeviceCUDA);
+  cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+  advance_token_kernel<<<1, 1, 0, stream_>>>(
+      token.ptr<int32_t>(), const_cast<int32_t*>(pos.ptr<int32_t>()),
+      const_cast<int32_t*>(tokens.ptr<int32_t>()), static_cast<int32_t>(tokens.size()));
+}
+
+__global__ void advance_token_stop_kernel(int32_t* token_ptr, int32_t* pos_ptr,
+                                          int32_t* tokens_ptr, int32_t max_token_num,
+                                          const int32_t* stop_ptr, int32_t* state_ptr) {
+  // the tokens are a ring, a decode past max_token_num positions overwrites the oldest ones
+  if (state_ptr[kStopReason] != 0) {
+    // the step overwrote the token with one sampled after the stop
+    *token_ptr = tokens_ptr[*pos_ptr % max_token_num];
+    return;
+  }
+  const int32_t next_pos = *pos_ptr + 1;
+  tokens_ptr[next_pos % max_token_num] = *token_ptr;
+  *pos_ptr = next_pos;
+
+  int32_t reason = 0;
+  for (int32_t s = 0; s < kMaxStopSequenceNum && reason == 0; ++s) {
+    const int32_t* stop = stop_ptr + s * kStopSequenceWidth;
+    const int32_t len = stop[0];
+    // only the sampled tokens are matched, the prompt is not on the device
+    const int32_t first_pos = next_pos - len + 1;
+    if (len <= 0 || len > max_token_num || first_pos < state_ptr[kStopBegin]) {
+      continue;
+    }
+    bool is_match = true;
+    for (int32_t i = 0; i < len && is_match; ++i) {
+      is_match = tokens_ptr[(first_pos + i) % max_token_num] == stop[1 + i];
+    }
+    if (is_match) {
+      reason = 1;
+    }
+  }
+  if (reason == 0 && state_ptr[kStopRemaining] > 0) {
+    state_ptr[kStopRemaining] -= 1;
+    if (state_ptr[kStopRemaining] == 0) {
+      reason = 2;
+    }
+  }
+  if (reason != 0) {
+    state_ptr[kStopReason] = reason;
+    state_ptr[kStopPos] = next_pos;
+  }
+}
+
+void advance_token_stop_kernel_cu(const tensor::Tensor& token, const tensor::Tensor& pos,
+                                  const tensor::Tensor& tokens, const tensor::Tensor& stop_table,
+                                  const tensor::Tensor& stop_state, void* stream) {
+  CHECK(token.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(pos.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(tokens.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(stop_table.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(stop_state.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK_EQ(stop_table.size(), kMaxStopSequenceNum * kStopSequenceWidth);
+  CHECK_EQ(stop_state.size(), kStopStateSize);
+  cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+  advance_token_stop_kernel<<<1, 1, 0, stream_>>>(
+      const_cast<int32_t*>(token.ptr<int32_t>()), const_cast<int32_t*>(pos.ptr<int32_t>()),
+      const_cast<int32_t*>(tokens.ptr<int32_t>()), static_cast<int32_t>(tokens.size()),
+      stop_table.ptr<int32_t>(), const_cast<int32_t*>(stop_state.ptr<int32_t>()));
+}
+
+__global__ void gather_columns_kernel(const float* input, const int32_t* order, float* output,
+                                      int32_t cols, int64_t size) {
+  for (int64_t i = blockIdx.x * static_cast<int64_t>(blockDim.x) + threadIdx.x; i < size;
+       i += static_cast<int64_t>(gridDim.x) * blockDim.x) {
+    const int64_t row_begin = i / cols * cols;
+    output[i] = input[row_begin + order[i - row_begin]];
   }
 }
+
+void gather_columns_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& order,
+                              const tensor::Tensor& output, void* stream) {
+  CHECK(input.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(order.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(output.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK_EQ(input.size(), output.size());
+  const auto cols = static_cast<int32_t>(order.size());
+  CHECK_EQ(input.size() % cols, 0);
+  const auto size = static_cast<int64_t>(input.size());
+  constexpr int thread_num = 256;
+  const int block_num = static_cast<int>(std::min<int64_t>((size + thread_num - 1) / thread_num,
+                                                           4096));
+  gather_columns_kernel<<<block_num, thread_num, 0, static_cast<cudaStream_t>(stream)>>>(
+      input.ptr<float>(), order.ptr<int32_t>(), const_cast<float*>(output.ptr<float>()), cols,
+      size);
+}
 }  // namespace kernel
\ No newline at end of file
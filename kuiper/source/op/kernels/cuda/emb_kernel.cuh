@@ -4,5 +4,39 @@
 namespace kernel {
 void emb_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& weight,
                    const tensor::Tensor& output, int32_t vocab_size, void* stream = nullptr);
+
+// stores the sampled token at the next position of tokens and advances the position, both stay
+// on the device so the decode steps need no host write
+void advance_token_kernel_cu(const tensor::Tensor& token, const tensor::Tensor& pos,
+                             const tensor::Tensor& tokens, void* stream = nullptr);
+
+// the stop table holds kMaxStopSequenceNum rows of kStopSequenceWidth ints, the length of a stop
+// sequence and its tokens, a row of length 0 is unused
+constexpr int32_t kMaxStopSequenceNum = 16;
+constexpr int32_t kMaxStopSequenceLen = 15;
+constexpr int32_t kStopSequenceWidth = kMaxStopSequenceLen + 1;
+
+// the slots of the stop state: the reason of the stop, 0 while the decode runs, 1 at a stop
+// sequence and 2 at the token limit, the tokens left before the limit or -1 without one, the
+// position of the first sampled token and the position of the token which stopped the decode
+enum StopState : int32_t {
+  kStopReason = 0,
+  kStopRemaining = 1,
+  kStopBegin = 2,
+  kStopPos = 3,
+  kStopStateSize = 4,
+};
+
+// advances like advance_token_kernel_cu and then checks the sampled tokens for a stop. The token
+// at pos is stored at pos % tokens.size(), so the decode runs past the length of tokens. Once
+// the decode stopped the token and the position are kept, so the steps queued behind it repeat
+// the last step and store nothing
+void advance_token_stop_kernel_cu(const tensor::Tensor& token, const tensor::Tensor& pos,
+                                  const tensor::Tensor& tokens, const tensor::Tensor& stop_table,
+                                  const tensor::Tensor& stop_state, void* stream = nullptr);
+
+// output[n][j] = input[n][order[j]] for every row n of the input
+void gather_columns_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& order,
+                              const tensor::Tensor& output, void* stream = nullptr);
 }
 #endif  // EMB_KERNEL_H
@@ -0,0 +1,25 @@
+#ifndef HEAD_SIZE_CUH
+#define HEAD_SIZE_CUH
+#include <cstdint>
+#include <type_traits>
+namespace kernel {
+// the head sizes of the common models have kernels of their own, the loops over a head unroll
+// fully and the divisions by the head size become shifts. func gets the head size as an
+// std::integral_constant, 0 for the other sizes which keep reading it from the argument
+template <typename Func>
+void dispatch_head_size(int32_t head_size, Func&& func) {
+  if (head_size == 64) {
+    func(std::integral_constant<int, 64>{});
+  } else if (head_size == 128) {
+    func(std::integral_constant<int, 128>{});
+  } else {
+    func(std::integral_constant<int, 0>{});
+  }
+}
+
+template <int kHeadSize>
+__device__ __forceinline__ int fixed_head_size(int head_size) {
+  return kHeadSize > 0 ? kHeadSize : head_size;
+}
+}  // namespace kernel
+#endif  // HEAD_SIZE_CUH
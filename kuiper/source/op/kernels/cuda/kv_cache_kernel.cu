@@ -0,0 +1,148 @@
+#include <cuda_bf16.h>
+#include <cuda_fp16.h>
+#include <tensor/tensor.h>
+#include <cub/cub.cuh>
+#include "kv_cache_kernel.cuh"
+namespace kernel {
+constexpr static int quant_thread_num = 128;
+__device__ __forceinline__ void store(float val, float* out) { *out = val; }
+
+__device__ __forceinline__ void store(float val, half* out) { *out = __float2half(val); }
+
+__device__ __forceinline__ void store(float val, __nv_bfloat16* out) {
+  *out = __float2bfloat16(val);
+}
+
+// every row y of key/value is stored at the position pos_ptr[0] + y of the block table, the
+// position comes from start_pos when pos_ptr is null, a windowed one goes to its row of the ring.
+// A head major cache has a cache_len rows strip per head, it is token major when cache_len is 0
+template <typename T>
+__global__ void kv_cache_write_kernel(int32_t kv_dim, int32_t head_size, int32_t cache_len,
+                                      int32_t start_pos, const int32_t* pos_ptr,
+                                      const int32_t* block_table, int32_t block_size,
+                                      base::AttentionWindow window, const float* key,
+                                      const float* value, T* key_cache, T* value_cache) {
+  int idx = threadIdx.x + blockDim.x * blockIdx.x;
+  if (idx >= kv_dim) {
+    return;
+  }
+  const int row = blockIdx.y;
+  const int pos = window.cache_pos((pos_ptr ? *pos_ptr : start_pos) + row);
+  const int physical = block_table[pos / block_size] * block_size + pos % block_size;
+  int64_t dst_offset = static_cast<int64_t>(physical) * kv_dim + idx;
+  if (cache_len > 0) {
+    const int head = idx / head_size;
+    dst_offset = (static_cast<int64_t>(head) * cache_len + physical) * head_size + idx % head_size;
+  }
+  store(key[row * kv_dim + idx], key_cache + dst_offset);
+  store(value[row * kv_dim + idx], value_cache + dst_offset);
+}
+
+__device__ __forceinline__ void quantize_head(const float* head, int32_t head_size, int8_t* out,
+                                              float* scale) {
+  using BlockReduce = cub::BlockReduce<float, quant_thread_num>;
+  __shared__ typename BlockReduce::TempStorage temp;
+  __shared__ float shared_max;
+  float max_abs = 0.f;
+  for (int i = threadIdx.x; i < head_size; i += blockDim.x) {
+    max_abs = fmaxf(max_abs, fabsf(head[i]));
+  }
+  max_abs = BlockReduce(temp).Reduce(max_abs, cub::Max());
+  if (threadIdx.x == 0) {
+    shared_max = max_abs;
+    *scale = max_abs / 127.f;
+  }
+  __syncthreads();
+  const float inv_scale = shared_max > 0.f ? 127.f / shared_max : 0.f;
+  for (int i = threadIdx.x; i < head_size; i += blockDim.x) {
+    out[i] = static_cast<int8_t>(__float2int_rn(head[i] * inv_scale));
+  }
+}
+
+// one block per head and row, the head is stored in int8 with the scale of its largest magnitude
+__global__ void kv_cache_quant_write_kernel(int32_t kv_dim, int32_t head_size, int32_t start_pos,
+                                            const int32_t* pos_ptr, const int32_t* block_table,
+                                            int32_t block_size, base::AttentionWindow window,
+                                            const float* key, const float* value,
+                                            int8_t* key_cache, int8_t* value_cache,
+                                            float* key_scale, float* value_scale) {
+  const int head = blockIdx.x;
+  const int row = blockIdx.y;
+  const int kv_head_num = gridDim.x;
+  const int pos = window.cache_pos((pos_ptr ? *pos_ptr : start_pos) + row);
+  const int physical = block_table[pos / block_size] * block_size + pos % block_size;
+  const int64_t src_offset = static_cast<int64_t>(row) * kv_dim + head * head_size;
+  const int64_t dst_offset = static_cast<int64_t>(physical) * kv_dim + head * head_size;
+  const int64_t scale_offset = static_cast<int64_t>(physical) * kv_head_num + head;
+  quantize_head(key + src_offset, head_size, key_cache + dst_offset, key_scale + scale_offset);
+  __syncthreads();
+  quantize_head(value + src_offset, head_size, value_cache + dst_offset,
+                value_scale + scale_offset);
+}
+
+void kv_cache_write_kernel_cu(const tensor::Tensor& key, const tensor::Tensor& value,
+                              const tensor::Tensor& key_cache, const tensor::Tensor& value_cache,
+                              const tensor::Tensor& key_scale, const tensor::Tensor& value_scale,
+                              const tensor::Tensor& block_table, const tensor::Tensor& pos_tensor,
+                              int32_t layer_index, int32_t block_size,
+                              const base::AttentionWindow& window, void* stream) {
+  CHECK_EQ(key.is_empty(), false);
+  CHECK_EQ(key.size(), value.size());
+  // [layer_num, cache_len, kv_dim] or [layer_num, kv_head_num, cache_len, head_size]
+  const bool is_head_major = key_cache.dims_size() == 4;
+  CHECK(is_head_major || key_cache.dims_size() == 3);
+  CHECK(block_table.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(key.data_type() == base::DataType::kDataTypeFp32);
+  // a position on the host is passed by value, the launch is then tied to it
+  const bool pos_on_device = pos_tensor.device_type() == base::DeviceType::kDeviceCUDA;
+  const int32_t start_pos = pos_on_device ? 0 : pos_tensor.index<int32_t>(0);
+  const int32_t* pos_ptr = pos_on_device ? pos_tensor.ptr<int32_t>() : nullptr;
+
+  const int32_t cache_len = key_cache.get_dim(is_head_major ? 2 : 1);
+  const int32_t head_size = is_head_major ? key_cache.get_dim(3) : 0;
+  const int32_t kv_dim = is_head_major ? key_cache.get_dim(1) * head_size : key_cache.get_dim(2);
+  const int32_t token_num = static_cast<int32_t>(key.size()) / kv_dim;
+  const int64_t layer_offset = static_cast<int64_t>(layer_index) * cache_len * kv_dim;
+  // the token major kernel is told so by a cache_len of 0
+  const int32_t head_cache_len = is_head_major ? cache_len : 0;
+  int threads = 128;
+  dim3 blocks((kv_dim + threads - 1) / threads, token_num);
+  cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+  const base::DataType data_type = key_cache.data_type();
+  if (data_type == base::DataType::kDataTypeInt8) {
+    CHECK(!is_head_major) << "The head major kv cache has no scales.";
+    CHECK_EQ(key_scale.dims_size(), 3);
+    const int32_t kv_head_num = key_scale.get_dim(2);
+    const int64_t scale_offset = static_cast<int64_t>(layer_index) * key_scale.get_dim(1) *
+                                 kv_head_num;
+    dim3 quant_blocks(kv_head_num, token_num);
+    kv_cache_quant_write_kernel<<<quant_blocks, quant_thread_num, 0, stream_>>>(
+        kv_dim, kv_dim / kv_head_num, start_pos, pos_ptr, block_table.ptr<int32_t>(), block_size,
+        window, key.ptr<float>(), value.ptr<float>(),
+        const_cast<int8_t*>(key_cache.ptr<int8_t>()) + layer_offset,
+        const_cast<int8_t*>(value_cache.ptr<int8_t>()) + layer_offset,
+        const_cast<float*>(key_scale.ptr<float>()) + scale_offset,
+        const_cast<float*>(value_scale.ptr<float>()) + scale_offset);
+  } else if (data_type == base::DataType::kDataTypeFp16) {
+    kv_cache_write_kernel<half><<<blocks, threads, 0, stream_>>>(
+        kv_dim, head_size, head_cache_len, start_pos, pos_ptr, block_table.ptr<int32_t>(),
+        block_size, window, key.ptr<float>(), value.ptr<float>(),
+        const_cast<half*>(key_cache.ptr<half>()) + layer_offset,
+        const_cast<half*>(value_cache.ptr<half>()) + layer_offset);
+  } else if (data_type == base::DataType::kDataTypeBf16) {
+    kv_cache_write_kernel<__nv_bfloat16><<<blocks, threads, 0, stream_>>>(
+        kv_dim, head_size, head_cache_len, start_pos, pos_ptr, block_table.ptr<int32_t>(),
+        block_size, window, key.ptr<float>(), value.ptr<float>(),
+        const_cast<__nv_bfloat16*>(key_cache.ptr<__nv_bfloat16>()) + layer_offset,
+        const_cast<__nv_bfloat16*>(value_cache.ptr<__nv_bfloat16>()) + layer_offset);
+  } else if (data_type == base::DataType::kDataTypeFp32) {
+    kv_cache_write_kernel<float><<<blocks, threads, 0, stream_>>>(
+        kv_dim, head_size, head_cache_len, start_pos, pos_ptr, block_table.ptr<int32_t>(),
+        block_size, window, key.ptr<float>(), value.ptr<float>(),
+        const_cast<float*>(key_cache.ptr<float>()) + layer_offset,
+        const_cast<float*>(value_cache.ptr<float>()) + layer_offset);
+  } else {
+    LOG(FATAL) << "Unsupported data type for the kv cache write kernel.";
+  }
+}
+}  // namespace kernel
@@ -0,0 +1,13 @@
+#ifndef KV_CACHE_KERNEL_CU_CUH
+#define KV_CACHE_KERNEL_CU_CUH
+#include <base/attention_window.h>
+#include <tensor/tensor.h>
+namespace kernel {
+void kv_cache_write_kernel_cu(const tensor::Tensor& key, const tensor::Tensor& value,
+                              const tensor::Tensor& key_cache, const tensor::Tensor& value_cache,
+                              const tensor::Tensor& key_scale, const tensor::Tensor& value_scale,
+                              const tensor::Tensor& block_table, const tensor::Tensor& pos_tensor,
+                              int32_t layer_index, int32_t block_size,
+                              const base::AttentionWindow& window, void* stream);
+}
+#endif  // KV_CACHE_KERNEL_CU_CUH
@@ -0,0 +1,63 @@
+#include "logits_kernel.cuh"
+namespace kernel {
+constexpr static int logits_thread_num = 256;
+
+__global__ void logits_process_kernel(const float* logits, size_t size, const int32_t* counts,
+                                      const float* bias, float repetition_penalty,
+                                      float presence_penalty, float frequency_penalty,
+                                      float* output) {
+  const size_t i = static_cast<size_t>(blockIdx.x) * blockDim.x + threadIdx.x;
+  if (i >= size) {
+    return;
+  }
+  float value = logits[i] + bias[i];
+  const int32_t count = counts[i];
+  if (count > 0) {
+    value = value > 0.f ? value / repetition_penalty : value * repetition_penalty;
+    value -= presence_penalty + frequency_penalty * static_cast<float>(count);
+  }
+  output[i] = value;
+}
+
+__global__ void count_token_kernel(const int32_t* token, int32_t* counts, size_t size) {
+  const int32_t token_id = *token;
+  if (token_id >= 0 && token_id < size) {
+    counts[token_id] += 1;
+  }
+}
+
+__global__ void token_mask_kernel(const float* logits, size_t size, const uint32_t* mask,
+                                  int32_t vocab_size, float* output) {
+  const size_t i = static_cast<size_t>(blockIdx.x) * blockDim.x + threadIdx.x;
+  if (i >= size) {
+    return;
+  }
+  const bool allowed = i < static_cast<size_t>(vocab_size) && ((mask[i / 32] >> (i % 32)) & 1u);
+  output[i] = allowed ? logits[i] : -INFINITY;
+}
+
+void logits_process_kernel_cu(const float* logits, size_t size, const int32_t* counts,
+                              const float* bias, float repetition_penalty, float presence_penalty,
+                              float frequency_penalty, float* output, void* stream) {
+  const int32_t block_num =
+      static_cast<int32_t>((size + logits_thread_num - 1) / logits_thread_num);
+  cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+  logits_process_kernel<<<block_num, logits_thread_num, 0, stream_>>>(
+      logits, size, counts, bias, repetition_penalty, presence_penalty, frequency_penalty,
+      output);
+}
+
+void count_token_kernel_cu(const int32_t* token, int32_t* counts, size_t size, void* stream) {
+  cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+  count_token_kernel<<<1, 1, 0, stream_>>>(token, counts, size);
+}
+
+void token_mask_kernel_cu(const float* logits, size_t size, const uint32_t* mask,
+                          int32_t vocab_size, float* output, void* stream) {
+  const int32_t block_num =
+      static_cast<int32_t>((size + logits_thread_num - 1) / logits_thread_num);
+  cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+  token_mask_kernel<<<block_num, logits_thread_num, 0, stream_>>>(logits, size, mask, vocab_size,
+                                                                  output);
+}
+}  // namespace kernel
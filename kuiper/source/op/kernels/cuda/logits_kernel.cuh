@@ -0,0 +1,21 @@
+#ifndef LOGITS_KERNEL_CUH
+#define LOGITS_KERNEL_CUH
+#include <cstddef>
+#include <cstdint>
+namespace kernel {
+// one pass over the logits into output: the bias is added, -inf bans a token, then the tokens
+// with a count above zero get the repetition penalty, logits above zero are divided by it and the
+// others multiplied, and the presence and frequency penalties are subtracted
+void logits_process_kernel_cu(const float* logits, size_t size, const int32_t* counts,
+                              const float* bias, float repetition_penalty, float presence_penalty,
+                              float frequency_penalty, float* output, void* stream);
+
+// adds the token which stays on the device to the counts, so replayed steps need no host write
+void count_token_kernel_cu(const int32_t* token, int32_t* counts, size_t size, void* stream);
+
+// copies the logits into output with -inf for the tokens whose bit is clear in the mask, the
+// tokens from vocab_size on are never allowed
+void token_mask_kernel_cu(const float* logits, size_t size, const uint32_t* mask,
+                          int32_t vocab_size, float* output, void* stream);
+}  // namespace kernel
+#endif  // LOGITS_KERNEL_CUH
@@ -0,0 +1,85 @@
+#include "lora_kernel.cuh"
+namespace kernel {
+constexpr static int lora_warp_num = 4;
+constexpr static int lora_expand_thread_num = 256;
+
+// every warp computes one rank of the row blockIdx.y, the adapter stride is 0 when all the rows
+// use the same adapter
+__global__ void lora_shrink_kernel_cu(const float* input, const float* lora_a,
+                                      const float* lora_scales, const int32_t* adapters,
+                                      int adapter_stride, float* shrunk, int M, int rank) {
+  const int n = blockIdx.y;
+  const int adapter = adapters[n * adapter_stride];
+  const int r = blockIdx.x * lora_warp_num + threadIdx.x / 32;
+  if (adapter < 0 || r >= rank) {
+    return;
+  }
+  const int lane = threadIdx.x % 32;
+  const float* input_row = input + static_cast<int64_t>(n) * M;
+  const float* a_row = lora_a + (static_cast<int64_t>(adapter) * rank + r) * M;
+  float sum = 0.f;
+  for (int i = lane; i < M; i += 32) {
+    sum += input_row[i] * a_row[i];
+  }
+  for (int offset = 16; offset > 0; offset >>= 1) {
+    sum += __shfl_xor_sync(0xffffffff, sum, offset);
+  }
+  if (lane == 0) {
+    shrunk[n * rank + r] = sum * lora_scales[adapter];
+  }
+}
+
+// the lora b is kept as [rank, K], so the threads of a block read the outputs coalesced
+__global__ void lora_expand_kernel_cu(const float* shrunk, const float* lora_b,
+                                      const int32_t* adapters, int adapter_stride,
+                                      float* output, int K, int rank) {
+  const int n = blockIdx.y;
+  const int adapter = adapters[n * adapter_stride];
+  const int k = blockIdx.x * blockDim.x + threadIdx.x;
+  if (adapter < 0 || k >= K) {
+    return;
+  }
+  const float* b = lora_b + static_cast<int64_t>(adapter) * rank * K;
+  const float* shrunk_row = shrunk + n * rank;
+  float sum = 0.f;
+  for (int r = 0; r < rank; ++r) {
+    sum += shrunk_row[r] * b[static_cast<int64_t>(r) * K + k];
+  }
+  output[static_cast<int64_t>(n) * K + k] += sum;
+}
+
+void lora_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& lora_a,
+                    const tensor::Tensor& lora_b, const tensor::Tensor& lora_scales,
+                    const tensor::Tensor& adapters, const tensor::Tensor& workspace,
+                    const tensor::Tensor& output, const CudaConfig* config) {
+  CHECK(input.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(lora_a.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(adapters.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK_EQ(lora_a.dims_size(), 3);
+  CHECK_EQ(lora_b.dims_size(), 3);
+  const int32_t rank = lora_a.get_dim(1);
+  const int32_t M = lora_a.get_dim(2);
+  const int32_t K = lora_b.get_dim(2);
+  const int32_t N = input.dims_size() == 2 ? input.get_dim(0) : 1;
+  CHECK_EQ(M, input.get_dim(input.dims_size() - 1));
+  CHECK_EQ(output.size(), N * K);
+  CHECK(adapters.size() == 1 || adapters.size() == N);
+  const int adapter_stride = adapters.size() == 1 ? 0 : 1;
+  cudaStream_t stream = config ? config->stream : nullptr;
+
+  // the decode steps fit in the workspace, only a prompt takes a buffer of its own
+  tensor::Tensor shrunk = workspace;
+  if (workspace.size() < static_cast<size_t>(N) * rank) {
+    shrunk = tensor::Tensor(base::DataType::kDataTypeFp32, N, rank, true,
+                            base::CUDADeviceAllocatorFactory::get_instance());
+  }
+  dim3 shrink_grid((rank + lora_warp_num - 1) / lora_warp_num, N);
+  lora_shrink_kernel_cu<<<shrink_grid, lora_warp_num * 32, 0, stream>>>(
+      input.ptr<float>(), lora_a.ptr<float>(), lora_scales.ptr<float>(), adapters.ptr<int32_t>(),
+      adapter_stride, shrunk.ptr<float>(), M, rank);
+  dim3 expand_grid((K + lora_expand_thread_num - 1) / lora_expand_thread_num, N);
+  lora_expand_kernel_cu<<<expand_grid, lora_expand_thread_num, 0, stream>>>(
+      shrunk.ptr<float>(), lora_b.ptr<float>(), adapters.ptr<int32_t>(), adapter_stride,
+      const_cast<float*>(output.ptr<float>()), K, rank);
+}
+}  // namespace kernel
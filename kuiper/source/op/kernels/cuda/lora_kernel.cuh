@@ -0,0 +1,14 @@
+#ifndef KUIPER_SOURCE_OP_KERNELS_CUDA_LORA_KERNEL_CUH_
+#define KUIPER_SOURCE_OP_KERNELS_CUDA_LORA_KERNEL_CUH_
+#include "base/cuda_config.h"
+#include "tensor/tensor.h"
+namespace kernel {
+// the shrink gathers the lora a of the adapter of every row and the expand its lora b, so the
+// rows of one batch can use different adapters. The shrunk rows are kept in the workspace, a
+// temporary buffer is taken when it is too small
+void lora_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& lora_a,
+                    const tensor::Tensor& lora_b, const tensor::Tensor& lora_scales,
+                    const tensor::Tensor& adapters, const tensor::Tensor& workspace,
+                    const tensor::Tensor& output, const CudaConfig* config);
+}  // namespace kernel
+#endif  // KUIPER_SOURCE_OP_KERNELS_CUDA_LORA_KERNEL_CUH_
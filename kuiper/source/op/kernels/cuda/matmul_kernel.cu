@@ -1,16 +1,47 @@
+#include <cuda_bf16.h>
+#include <cuda_fp16.h>
+#include <cuda_fp8.h>
 #include <tensor/tensor.h>
 #include <cub/block/block_reduce.cuh>
 #include "../kernels_interface.h"
+#include "cast_kernel.cuh"
 #include "matmul_kernel.cuh"
 namespace kernel {
-template <int THREAD_PER_BLOCK, int ROW_PER_BLOCK>
-__global__ void matmul_kernel_cu_fp32(const float* input, const float* weight, float* output, int M,
-                                      int K) {
+// the 16 bit weights are widened to fp32 as they are loaded, the sums stay in fp32
+__device__ __forceinline__ float to_float(float value) { return value; }
+
+__device__ __forceinline__ float to_float(half value) { return __half2float(value); }
+
+__device__ __forceinline__ float to_float(__nv_bfloat16 value) { return __bfloat162float(value); }
+
+__device__ __forceinline__ float4 load_float4(const float* ptr) {
+  return *reinterpret_cast<const float4*>(ptr);
+}
+
+__device__ __forceinline__ float4 load_float4(const half* ptr) {
+  const uint2 packed = __ldg(reinterpret_cast<const uint2*>(ptr));
+  const float2 low = __half22float2(*reinterpret_cast<const half2*>(&packed.x));
+  const float2 high = __half22float2(*reinterpret_cast<const half2*>(&packed.y));
+  return make_float4(low.x, low.y, high.x, high.y);
+}
+
+__device__ __forceinline__ float4 load_float4(const __nv_bfloat16* ptr) {
+  const uint2 packed = __ldg(reinterpret_cast<const uint2*>(ptr));
+  const float2 low = __bfloat1622float2(*reinterpret_cast<const __nv_bfloat162*>(&packed.x));
+  const float2 high = __bfloat1622float2(*reinterpret_cast<const __nv_bfloat162*>(&packed.y));
+  return make_float4(low.x, low.y, high.x, high.y);
+}
+
+template <int THREAD_PER_BLOCK, int ROW_PER_BLOCK, typename T = float>
+__global__ void matmul_kernel_cu_fp32(const float* input, const T* weight, const float* bias,
+                                      float* output, int M, int K) {
   __shared__ float sdata[THREAD_PER_BLOCK];
   unsigned int tid = threadIdx.x;
+  input += blockIdx.y * M;
+  output += blockIdx.y * K;
 
   int start_row = blockIdx.x * ROW_PER_BLOCK;
-  int end_row = start_row + ROW_PER_BLOCK;
+  int end_row = min(start_row + ROW_PER_BLOCK, K);
   if (start_row >= K) {
     return;
   }
@@ -23,20 +54,20 @@ __global__ void matmul_kernel_cu_fp32(const float* input, const float* weight, f
   for (int p = start_row; p < end_row; ++p) {
     sdata[tid] = 0;
     int row_offset = p * M;
-    float4* input_float4_ptr = (float4*)input;
-    float4* weight_float4_ptr = (float4*)(weight + row_offset);
+    const float4* input_float4_ptr = reinterpret_cast<const float4*>(input);
+    const T* weight_row = weight + row_offset;
 
 #pragma unroll
     for (int i = tid; i < pack_num; i += blockDim.x) {
       float4 input_float4 = *(input_float4_ptr + i);
-      float4 weight_float4 = *(weight_float4_ptr + i);
+      float4 weight_float4 = load_float4(weight_row + i * pack_size);
       float part_sum = input_float4.x * weight_float4.x + input_float4.y * weight_float4.y +
                        input_float4.z * weight_float4.z + input_float4.w * weight_float4.w;
       sdata[tid] += part_sum;
     }
 
     for (int i = pack_off + tid; i < M; i += blockDim.x) {
-      sdata[tid] += input[i] * weight[row_offset + i];
+      sdata[tid] += input[i] * to_float(weight_row[i]);
     }
 
     __syncthreads();
@@ -47,16 +78,48 @@ __global__ void matmul_kernel_cu_fp32(const float* input, const float* weight, f
     __syncthreads();
 
     if (tid == 0) {
-      output[p] = part_sum;
+      output[p] = bias ? part_sum + bias[p] : part_sum;
     }
     __syncthreads();
   }
 }
 
+template <int TILE>
+__global__ void matmul_kernel_cu_fp32_gemm(const float* input, const float* weight,
+                                           const float* bias, float* output, int N, int M, int K,
+                                           float scale) {
+  // input: [N, M], weight: [K, M], output: [N, K]
+  __shared__ float input_tile[TILE][TILE];
+  __shared__ float weight_tile[TILE][TILE + 1];
+
+  const int tx = threadIdx.x;
+  const int ty = threadIdx.y;
+  const int row = blockIdx.y * TILE + ty;
+  const int col = blockIdx.x * TILE + tx;
+  const int weight_row = blockIdx.x * TILE + ty;
+
+  float sum = 0.f;
+  for (int k = 0; k < M; k += TILE) {
+    input_tile[ty][tx] = (row < N && k + tx < M) ? input[row * M + k + tx] : 0.f;
+    weight_tile[ty][tx] = (weight_row < K && k + tx < M) ? weight[weight_row * M + k + tx] : 0.f;
+    __syncthreads();
+
+#pragma unroll
+    for (int i = 0; i < TILE; ++i) {
+      sum += input_tile[ty][i] * weight_tile[tx][i];
+    }
+    __syncthreads();
+  }
+
+  if (row < N && col < K) {
+    output[row * K + col] = bias ? sum * scale + bias[col] : sum * scale;
+  }
+}
+
 template <int THREAD_PER_BLOCK, int ROW_PER_BLOCK>
 __global__ void matmul_kernel_cu_fp32int8(const float* input, const int8_t* weight,
                                           const float* scales, const int32_t group_size,
-                                          float* output, int M, int K) {
+                                          const float* bias, float* output, int M, int K) {
   __shared__ float sdata[THREAD_PER_BLOCK];
   unsigned int tid = threadIdx.x;
 
@@ -65,6 +128,8 @@ __global__ void matmul_kernel_cu_fp32int8(const float* input, const int8_t* weig
   if (start_row >= K) {
     return;
   }
+  input += blockIdx.y * M;
+  output += blockIdx.y * K;
   for (int p = start_row; p < end_row; ++p) {
     sdata[tid] = 0;
     for (int i = tid; i < M; i += THREAD_PER_BLOCK) {
@@ -80,14 +145,783 @@ __global__ void matmul_kernel_cu_fp32int8(const float* input, const int8_t* weig
     __syncthreads();
 
     if (tid == 0) {
-      output[p] = part_sum;
+      output[p] = bias ? part_sum + bias[p] : part_sum;
     }
     __syncthreads();
   }
 }
 
-void matmul_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& weight,
-                      const tensor::Tensor& output, const float scale, const CudaConfig* config) {
+// the warps of a block quantize the groups of the input row to int8, one scale per group maps
+// its largest magnitude to 127
+__device__ void quantize_input_groups(const float* input, int M, int group_size, int8_t* q_input,
+                                      float* input_scales) {
+  const int warp = threadIdx.x / 32;
+  const int lane = threadIdx.x % 32;
+  const int group_num = M / group_size;
+  for (int g = warp; g < group_num; g += blockDim.x / 32) {
+    const float* group = input + g * group_size;
+    float max_abs = 0.f;
+    for (int i = lane; i < group_size; i += 32) {
+      max_abs = fmaxf(max_abs, fabsf(group[i]));
+    }
+    for (int offset = 16; offset > 0; offset >>= 1) {
+      max_abs = fmaxf(max_abs, __shfl_xor_sync(0xffffffff, max_abs, offset));
+    }
+    const float inv_scale = max_abs > 0.f ? 127.f / max_abs : 0.f;
+    for (int i = lane; i < group_size; i += 32) {
+      q_input[g * group_size + i] = static_cast<int8_t>(__float2int_rn(group[i] * inv_scale));
+    }
+    if (lane == 0) {
+      input_scales[g] = max_abs / 127.f;
+    }
+  }
+}
+
+// the dot products of the quantized input with ROW_NUM weight rows for one warp. A lane takes
+// 16 columns at a time with one 128 bit load per row, sums them with dp4a and applies the scales
+// of the group once for the 16 columns
+template <int ROW_NUM>
+__device__ void dot_rows_dp4a(const int8_t* q_input, const float* input_scales,
+                              const int8_t* weight, const float* scales, const int (&rows)[ROW_NUM],
+                              int M, int group_size, float (&sums)[ROW_NUM]) {
+  const int lane = threadIdx.x % 32;
+  const int chunk_num = M / 16;
+  const int group_num = M / group_size;
+  const int chunk_per_group = group_size / 16;
+#pragma unroll
+  for (int r = 0; r < ROW_NUM; ++r) {
+    sums[r] = 0.f;
+  }
+  for (int c = lane; c < chunk_num; c += 32) {
+    const int4 x = reinterpret_cast<const int4*>(q_input)[c];
+    const int g = c / chunk_per_group;
+    const float input_scale = input_scales[g];
+#pragma unroll
+    for (int r = 0; r < ROW_NUM; ++r) {
+      const int4 w =
+          __ldg(reinterpret_cast<const int4*>(weight + static_cast<int64_t>(rows[r]) * M) + c);
+      int dot = __dp4a(x.x, w.x, 0);
+      dot = __dp4a(x.y, w.y, dot);
+      dot = __dp4a(x.z, w.z, dot);
+      dot = __dp4a(x.w, w.w, dot);
+      sums[r] += static_cast<float>(dot) * input_scale * __ldg(scales + rows[r] * group_num + g);
+    }
+  }
+#pragma unroll
+  for (int r = 0; r < ROW_NUM; ++r) {
+    for (int offset = 16; offset > 0; offset >>= 1) {
+      sums[r] += __shfl_xor_sync(0xffffffff, sums[r], offset);
+    }
+  }
+}
+
+// every warp computes ROW_PER_WARP outputs, the quantized input row lives in the dynamic shared
+// memory: M int8 values followed by the M / group_size scales
+template <int ROW_PER_WARP>
+__global__ void matmul_kernel_cu_dp4a(const float* input, const int8_t* weight,
+                                      const float* scales, int group_size, const float* bias,
+                                      float* output, int M, int K) {
+  extern __shared__ int4 dp4a_smem[];
+  int8_t* q_input = reinterpret_cast<int8_t*>(dp4a_smem);
+  float* input_scales = reinterpret_cast<float*>(q_input + M);
+  input += blockIdx.y * M;
+  output += blockIdx.y * K;
+  quantize_input_groups(input, M, group_size, q_input, input_scales);
+  __syncthreads();
+
+  const int first_row = (blockIdx.x * (blockDim.x / 32) + threadIdx.x / 32) * ROW_PER_WARP;
+  int rows[ROW_PER_WARP];
+#pragma unroll
+  for (int r = 0; r < ROW_PER_WARP; ++r) {
+    rows[r] = min(first_row + r, K - 1);
+  }
+  float sums[ROW_PER_WARP];
+  dot_rows_dp4a<ROW_PER_WARP>(q_input, input_scales, weight, scales, rows, M, group_size, sums);
+  if (threadIdx.x % 32 == 0) {
+#pragma unroll
+    for (int r = 0; r < ROW_PER_WARP; ++r) {
+      if (first_row + r < K) {
+        output[first_row + r] = bias ? sums[r] + bias[first_row + r] : sums[r];
+      }
+    }
+  }
+}
+
+// the swiglu variant, the gate row p and the up row K + p of an output are read together
+template <int OUT_PER_WARP>
+__global__ void matmul_swiglu_kernel_cu_dp4a(const float* input, const int8_t* weight,
+                                             const float* scales, int group_size, float* output,
+                                             int M, int K) {
+  extern __shared__ int4 dp4a_smem[];
+  int8_t* q_input = reinterpret_cast<int8_t*>(dp4a_smem);
+  float* input_scales = reinterpret_cast<float*>(q_input + M);
+  input += blockIdx.y * M;
+  output += blockIdx.y * K;
+  quantize_input_groups(input, M, group_size, q_input, input_scales);
+  __syncthreads();
+
+  const int first_out = (blockIdx.x * (blockDim.x / 32) + threadIdx.x / 32) * OUT_PER_WARP;
+  int rows[2 * OUT_PER_WARP];
+#pragma unroll
+  for (int o = 0; o < OUT_PER_WARP; ++o) {
+    const int p = min(first_out + o, K - 1);
+    rows[2 * o] = p;
+    rows[2 * o + 1] = K + p;
+  }
+  float sums[2 * OUT_PER_WARP];
+  dot_rows_dp4a<2 * OUT_PER_WARP>(q_input, input_scales, weight, scales, rows, M, group_size,
+                                  sums);
+  if (threadIdx.x % 32 == 0) {
+#pragma unroll
+    for (int o = 0; o < OUT_PER_WARP; ++o) {
+      if (first_out + o < K) {
+        const float gate = sums[2 * o];
+        output[first_out + o] = gate / (1.f + expf(-gate)) * sums[2 * o + 1];
+      }
+    }
+  }
+}
+
+// The tiled int8 layout takes the rows in tiles of kInt8TileRows, the 16 byte chunks of the
+// rows of a tile follow each other and the scales of a group of the tile sit side by side. A
+// lane reads one chunk of every row of its tiles with one 64 byte access and the scales with
+// one 128 bit load, so the warp streams one contiguous range per tile
+template <int TILE_NUM>
+__device__ void dot_tiles_dp4a(const int8_t* q_input, const float* input_scales,
+                               const int8_t* weight, const float* scales,
+                               const int (&tiles)[TILE_NUM], int M, int group_size,
+                               float (&sums)[TILE_NUM * kInt8TileRows]) {
+  static_assert(kInt8TileRows == 4, "The scales of a tile are read as one float4.");
+  const int lane = threadIdx.x % 32;
+  const int chunk_num = M / 16;
+  const int group_num = M / group_size;
+  const int chunk_per_group = group_size / 16;
+#pragma unroll
+  for (int r = 0; r < TILE_NUM * kInt8TileRows; ++r) {
+    sums[r] = 0.f;
+  }
+  for (int c = lane; c < chunk_num; c += 32) {
+    const int4 x = reinterpret_cast<const int4*>(q_input)[c];
+    const int g = c / chunk_per_group;
+    const float input_scale = input_scales[g];
+#pragma unroll
+    for (int t = 0; t < TILE_NUM; ++t) {
+      const int4* chunk = reinterpret_cast<const int4*>(weight) +
+                          (static_cast<int64_t>(tiles[t]) * chunk_num + c) * kInt8TileRows;
+      const float4 scale = __ldg(reinterpret_cast<const float4*>(scales) +
+                                 static_cast<int64_t>(tiles[t]) * group_num + g);
+      const float row_scales[kInt8TileRows] = {scale.x, scale.y, scale.z, scale.w};
+#pragma unroll
+      for (int r = 0; r < kInt8TileRows; ++r) {
+        const int4 w = __ldg(chunk + r);
+        int dot = __dp4a(x.x, w.x, 0);
+        dot = __dp4a(x.y, w.y, dot);
+        dot = __dp4a(x.z, w.z, dot);
+        dot = __dp4a(x.w, w.w, dot);
+        sums[t * kInt8TileRows + r] += static_cast<float>(dot) * input_scale * row_scales[r];
+      }
+    }
+  }
+#pragma unroll
+  for (int r = 0; r < TILE_NUM * kInt8TileRows; ++r) {
+    for (int offset = 16; offset > 0; offset >>= 1) {
+      sums[r] += __shfl_xor_sync(0xffffffff, sums[r], offset);
+    }
+  }
+}
+
+// every warp computes the rows of one tile
+__global__ void matmul_kernel_cu_dp4a_tiled(const float* input, const int8_t* weight,
+                                            const float* scales, int group_size,
+                                            const float* bias, float* output, int M, int K) {
+  extern __shared__ int4 dp4a_smem[];
+  int8_t* q_input = reinterpret_cast<int8_t*>(dp4a_smem);
+  float* input_scales = reinterpret_cast<float*>(q_input + M);
+  input += blockIdx.y * M;
+  output += blockIdx.y * K;
+  quantize_input_groups(input, M, group_size, q_input, input_scales);
+  __syncthreads();
+
+  const int tile = blockIdx.x * (blockDim.x / 32) + threadIdx.x / 32;
+  if (tile >= K / kInt8TileRows) {
+    return;
+  }
+  const int tiles[1] = {tile};
+  float sums[kInt8TileRows];
+  dot_tiles_dp4a<1>(q_input, input_scales, weight, scales, tiles, M, group_size, sums);
+  if (threadIdx.x % 32 == 0) {
+#pragma unroll
+    for (int r = 0; r < kInt8TileRows; ++r) {
+      const int row = tile * kInt8TileRows + r;
+      output[row] = bias ? sums[r] + bias[row] : sums[r];
+    }
+  }
+}
+
+// the swiglu variant, a warp reads the gate tile of its outputs and the up tile K rows after it
+__global__ void matmul_swiglu_kernel_cu_dp4a_tiled(const float* input, const int8_t* weight,
+                                                   const float* scales, int group_size,
+                                                   float* output, int M, int K) {
+  extern __shared__ int4 dp4a_smem[];
+  int8_t* q_input = reinterpret_cast<int8_t*>(dp4a_smem);
+  float* input_scales = reinterpret_cast<float*>(q_input + M);
+  input += blockIdx.y * M;
+  output += blockIdx.y * K;
+  quantize_input_groups(input, M, group_size, q_input, input_scales);
+  __syncthreads();
+
+  const int tile = blockIdx.x * (blockDim.x / 32) + threadIdx.x / 32;
+  const int tile_num = K / kInt8TileRows;
+  if (tile >= tile_num) {
+    return;
+  }
+  const int tiles[2] = {tile, tile_num + tile};
+  float sums[2 * kInt8TileRows];
+  dot_tiles_dp4a<2>(q_input, input_scales, weight, scales, tiles, M, group_size, sums);
+  if (threadIdx.x % 32 == 0) {
+#pragma unroll
+    for (int r = 0; r < kInt8TileRows; ++r) {
+      const float gate = sums[r];
+      output[tile * kInt8TileRows + r] = gate / (1.f + expf(-gate)) * sums[kInt8TileRows + r];
+    }
+  }
+}
+
+// one thread moves one 16 byte chunk of the row major weight, and one scale, into its tile
+__global__ void tile_int8_weight_kernel_cu(const int4* weight, const float* scales,
+                                           int4* tiled_weight, float* tiled_scales, int K,
+                                           int chunk_num, int group_num) {
+  const int64_t idx = static_cast<int64_t>(blockIdx.x) * blockDim.x + threadIdx.x;
+  if (idx < static_cast<int64_t>(K) * chunk_num) {
+    const int64_t row = idx / chunk_num;
+    const int64_t c = idx % chunk_num;
+    tiled_weight[((row / kInt8TileRows) * chunk_num + c) * kInt8TileRows +
+                 row % kInt8TileRows] = weight[idx];
+  }
+  if (idx < static_cast<int64_t>(K) * group_num) {
+    const int64_t row = idx / group_num;
+    const int64_t g = idx % group_num;
+    tiled_scales[((row / kInt8TileRows) * group_num + g) * kInt8TileRows +
+                 row % kInt8TileRows] = scales[idx];
+  }
+}
+
+// the dot products of 32 input columns with ROW_NUM int4 weight rows for one warp, a lane reads
+// the 32 weights of a row with one 128 bit load. The zero point is taken out of the sum once per
+// 32 columns: sum((q - z) * x) * s = (sum(q * x) - z * sum(x)) * s
+template <int ROW_NUM>
+__device__ void dot_rows_int4(const float* input, const uint8_t* weight, const half* scales,
+                              const uint8_t* zero_points, const int (&rows)[ROW_NUM], int M,
+                              int group_size, float (&sums)[ROW_NUM]) {
+  const int lane = threadIdx.x % 32;
+  const int chunk_num = M / 32;
+  const int group_num = M / group_size;
+  const int chunk_per_group = group_size / 32;
+#pragma unroll
+  for (int r = 0; r < ROW_NUM; ++r) {
+    sums[r] = 0.f;
+  }
+  for (int c = lane; c < chunk_num; c += 32) {
+    float x[32];
+    const float4* input_float4_ptr = reinterpret_cast<const float4*>(input + c * 32);
+#pragma unroll
+    for (int i = 0; i < 8; ++i) {
+      const float4 value = __ldg(input_float4_ptr + i);
+      x[4 * i] = value.x;
+      x[4 * i + 1] = value.y;
+      x[4 * i + 2] = value.z;
+      x[4 * i + 3] = value.w;
+    }
+    float input_sum = 0.f;
+#pragma unroll
+    for (int i = 0; i < 32; ++i) {
+      input_sum += x[i];
+    }
+    const int g = c / chunk_per_group;
+#pragma unroll
+    for (int r = 0; r < ROW_NUM; ++r) {
+      const uint4 packed = __ldg(
+          reinterpret_cast<const uint4*>(weight + static_cast<int64_t>(rows[r]) * (M / 2)) + c);
+      const uint32_t words[4] = {packed.x, packed.y, packed.z, packed.w};
+      float dot = 0.f;
+#pragma unroll
+      for (int w = 0; w < 4; ++w) {
+#pragma unroll
+        for (int k = 0; k < 8; ++k) {
+          dot += static_cast<float>((words[w] >> (4 * k)) & 0xF) * x[8 * w + k];
+        }
+      }
+      const int64_t group = static_cast<int64_t>(rows[r]) * group_num + g;
+      const float zero_point = zero_points ? static_cast<float>(__ldg(zero_points + group)) : 8.f;
+      sums[r] += (dot - zero_point * input_sum) * __half2float(__ldg(scales + group));
+    }
+  }
+#pragma unroll
+  for (int r = 0; r < ROW_NUM; ++r) {
+    for (int offset = 16; offset > 0; offset >>= 1) {
+      sums[r] += __shfl_xor_sync(0xffffffff, sums[r], offset);
+    }
+  }
+}
+
+template <int ROW_PER_WARP>
+__global__ void matmul_kernel_cu_int4(const float* input, const uint8_t* weight,
+                                      const half* scales, const uint8_t* zero_points,
+                                      int group_size, float* output, int M, int K) {
+  input += blockIdx.y * M;
+  output += blockIdx.y * K;
+  const int first_row = (blockIdx.x * (blockDim.x / 32) + threadIdx.x / 32) * ROW_PER_WARP;
+  if (first_row >= K) {
+    return;
+  }
+  int rows[ROW_PER_WARP];
+#pragma unroll
+  for (int r = 0; r < ROW_PER_WARP; ++r) {
+    rows[r] = min(first_row + r, K - 1);
+  }
+  float sums[ROW_PER_WARP];
+  dot_rows_int4<ROW_PER_WARP>(input, weight, scales, zero_points, rows, M, group_size, sums);
+  if (threadIdx.x % 32 == 0) {
+#pragma unroll
+    for (int r = 0; r < ROW_PER_WARP; ++r) {
+      if (first_row + r < K) {
+        output[first_row + r] = sums[r];
+      }
+    }
+  }
+}
+
+template <int OUT_PER_WARP>
+__global__ void matmul_swiglu_kernel_cu_int4(const float* input, const uint8_t* weight,
+                                             const half* scales, const uint8_t* zero_points,
+                                             int group_size, float* output, int M, int K) {
+  input += blockIdx.y * M;
+  output += blockIdx.y * K;
+  const int first_out = (blockIdx.x * (blockDim.x / 32) + threadIdx.x / 32) * OUT_PER_WARP;
+  if (first_out >= K) {
+    return;
+  }
+  int rows[2 * OUT_PER_WARP];
+#pragma unroll
+  for (int o = 0; o < OUT_PER_WARP; ++o) {
+    const int p = min(first_out + o, K - 1);
+    rows[2 * o] = p;
+    rows[2 * o + 1] = K + p;
+  }
+  float sums[2 * OUT_PER_WARP];
+  dot_rows_int4<2 * OUT_PER_WARP>(input, weight, scales, zero_points, rows, M, group_size, sums);
+  if (threadIdx.x % 32 == 0) {
+#pragma unroll
+    for (int o = 0; o < OUT_PER_WARP; ++o) {
+      if (first_out + o < K) {
+        const float gate = sums[2 * o];
+        output[first_out + o] = gate / (1.f + expf(-gate)) * sums[2 * o + 1];
+      }
+    }
+  }
+}
+
+// input: [N, M], weight: [K, M / 2] int4 pairs, output: [N, K]. The weight tile is dequantized
+// in registers on its way into the shared memory
+template <int TILE>
+__global__ void matmul_kernel_cu_int4_gemm(const float* input, const uint8_t* weight,
+                                           const half* scales, const uint8_t* zero_points,
+                                           int group_size, float* output, int N, int M, int K) {
+  __shared__ float input_tile[TILE][TILE];
+  __shared__ float weight_tile[TILE][TILE + 1];
+
+  const int tx = threadIdx.x;
+  const int ty = threadIdx.y;
+  const int row = blockIdx.y * TILE + ty;
+  const int col = blockIdx.x * TILE + tx;
+  const int weight_row = blockIdx.x * TILE + ty;
+
+  float sum = 0.f;
+  for (int k = 0; k < M; k += TILE) {
+    input_tile[ty][tx] = (row < N && k + tx < M) ? input[row * M + k + tx] : 0.f;
+    float value = 0.f;
+    if (weight_row < K && k + tx < M) {
+      const int64_t idx = static_cast<int64_t>(weight_row) * M + k + tx;
+      const uint8_t pair = weight[idx / 2];
+      const int q = (idx & 1) ? (pair >> 4) : (pair & 0xF);
+      const int64_t group = idx / group_size;
+      const float zero_point = zero_points ? static_cast<float>(zero_points[group]) : 8.f;
+      value = (static_cast<float>(q) - zero_point) * __half2float(scales[group]);
+    }
+    weight_tile[ty][tx] = value;
+    __syncthreads();
+
+#pragma unroll
+    for (int i = 0; i < TILE; ++i) {
+      sum += input_tile[ty][i] * weight_tile[tx][i];
+    }
+    __syncthreads();
+  }
+
+  if (row < N && col < K) {
+    output[row * K + col] = sum;
+  }
+}
+
+// weight: [2K, M], the row p is the gate of the output p and the row K + p is its up projection
+template <int THREAD_PER_BLOCK, typename T = float>
+__global__ void matmul_swiglu_kernel_cu_fp32(const float* input, const T* weight, float* output,
+                                             int M, int K) {
+  unsigned int tid = threadIdx.x;
+  const int p = blockIdx.x;
+  if (p >= K) {
+    return;
+  }
+  input += blockIdx.y * M;
+  output += blockIdx.y * K;
+
+  constexpr int pack_size = 4;
+  const int pack_num = M / pack_size;
+  const int pack_off = pack_size * pack_num;
+  const T* gate_weight = weight + p * M;
+  const T* up_weight = weight + (K + p) * M;
+  const float4* input_float4_ptr = reinterpret_cast<const float4*>(input);
+
+  float gate = 0.f;
+  float up = 0.f;
+  for (int i = tid; i < pack_num; i += blockDim.x) {
+    float4 input_float4 = *(input_float4_ptr + i);
+    float4 gate_float4 = load_float4(gate_weight + i * pack_size);
+    float4 up_float4 = load_float4(up_weight + i * pack_size);
+    gate += input_float4.x * gate_float4.x + input_float4.y * gate_float4.y +
+            input_float4.z * gate_float4.z + input_float4.w * gate_float4.w;
+    up += input_float4.x * up_float4.x + input_float4.y * up_float4.y +
+          input_float4.z * up_float4.z + input_float4.w * up_float4.w;
+  }
+  for (int i = pack_off + tid; i < M; i += blockDim.x) {
+    gate += input[i] * to_float(gate_weight[i]);
+    up += input[i] * to_float(up_weight[i]);
+  }
+
+  using BlockReduce = cub::BlockReduce<float, THREAD_PER_BLOCK>;
+  __shared__ typename BlockReduce::TempStorage temp;
+  gate = BlockReduce(temp).Sum(gate);
+  __syncthreads();
+  up = BlockReduce(temp).Sum(up);
+  if (tid == 0) {
+    output[p] = gate / (1.f + expf(-gate)) * up;
+  }
+}
+
+// gate_up: [N, 2K] from the gemm of the swiglu weight, output: [N, K]
+__global__ void swiglu_rows_kernel_cu_fp32(const float* gate_up, float* output, int N, int K) {
+  const int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx >= N * K) {
+    return;
+  }
+  const int row = idx / K;
+  const int col = idx % K;
+  const float gate = gate_up[row * 2 * K + col];
+  const float up = gate_up[row * 2 * K + K + col];
+  output[idx] = gate / (1.f + expf(-gate)) * up;
+}
+
+// the largest power of two up to 256 the address is aligned to, the cublaslt algorithms which
+// need more are excluded by the preference
+static uint32_t pointer_alignment(const void* ptr) {
+  const uintptr_t address = reinterpret_cast<uintptr_t>(ptr);
+  uint32_t alignment = 256;
+  while (alignment > 4 && address % alignment != 0) {
+    alignment >>= 1;
+  }
+  return alignment;
+}
+
+// the plan of the gemms of the key, created on the first gemm of the key and kept in the config.
+// Nullptr when cublaslt finds no algorithm for it
+static const BlasGemmPlan* blas_gemm_plan(const BlasGemmKey& key, const CudaConfig* config) {
+  auto iter = config->blas_gemm_plans.find(key);
+  if (iter != config->blas_gemm_plans.end()) {
+    return iter->second->has_algo ? iter->second.get() : nullptr;
+  }
+  auto success = [](cublasStatus_t status) { return status == CUBLAS_STATUS_SUCCESS; };
+  auto plan = std::make_unique<BlasGemmPlan>();
+  const cublasOperation_t trans_weight = CUBLAS_OP_T;
+  bool is_ok =
+      success(cublasLtMatmulDescCreate(&plan->desc, key.compute_type, CUDA_R_32F)) &&
+      success(cublasLtMatmulDescSetAttribute(plan->desc, CUBLASLT_MATMUL_DESC_TRANSA,
+                                             &trans_weight, sizeof(trans_weight))) &&
+      success(cublasLtMatmulDescSetAttribute(plan->desc, CUBLASLT_MATMUL_DESC_EPILOGUE,
+                                             &key.epilogue, sizeof(key.epilogue))) &&
+      success(
+          cublasLtMatrixLayoutCreate(&plan->weight_layout, key.data_type, key.M, key.K, key.M)) &&
+      success(
+          cublasLtMatrixLayoutCreate(&plan->input_layout, key.data_type, key.M, key.N, key.M)) &&
+      success(cublasLtMatrixLayoutCreate(&plan->output_layout, CUDA_R_32F, key.K, key.N, key.K));
+
+  // the heuristic looks for an algorithm which reads the scale, its value is set for every gemm
+  if (key.has_input_scale) {
+    const float* input_scale = nullptr;
+    is_ok = is_ok && success(cublasLtMatmulDescSetAttribute(
+                         plan->desc, CUBLASLT_MATMUL_DESC_B_SCALE_POINTER, &input_scale,
+                         sizeof(input_scale)));
+  }
+  cublasLtMatmulPreference_t preference = nullptr;
+  const size_t workspace_size = config->blas_workspace_size;
+  is_ok = is_ok && success(cublasLtMatmulPreferenceCreate(&preference)) &&
+          success(cublasLtMatmulPreferenceSetAttribute(
+              preference, CUBLASLT_MATMUL_PREF_MAX_WORKSPACE_BYTES, &workspace_size,
+              sizeof(workspace_size))) &&
+          success(cublasLtMatmulPreferenceSetAttribute(
+              preference, CUBLASLT_MATMUL_PREF_MIN_ALIGNMENT_A_BYTES, &key.weight_alignment,
+              sizeof(key.weight_alignment))) &&
+          success(cublasLtMatmulPreferenceSetAttribute(
+              preference, CUBLASLT_MATMUL_PREF_MIN_ALIGNMENT_B_BYTES, &key.input_alignment,
+              sizeof(key.input_alignment))) &&
+          success(cublasLtMatmulPreferenceSetAttribute(
+              preference, CUBLASLT_MATMUL_PREF_MIN_ALIGNMENT_C_BYTES, &key.output_alignment,
+              sizeof(key.output_alignment))) &&
+          success(cublasLtMatmulPreferenceSetAttribute(
+              preference, CUBLASLT_MATMUL_PREF_MIN_ALIGNMENT_D_BYTES, &key.output_alignment,
+              sizeof(key.output_alignment)));
+
+  cublasLtMatmulHeuristicResult_t heuristic;
+  int result_num = 0;
+  plan->has_algo =
+      is_ok &&
+      success(cublasLtMatmulAlgoGetHeuristic(config->blas_handle, plan->desc, plan->weight_layout,
+                                             plan->input_layout, plan->output_layout,
+                                             plan->output_layout, preference, 1, &heuristic,
+                                             &result_num)) &&
+      result_num > 0;
+  if (preference) {
+    cublasLtMatmulPreferenceDestroy(preference);
+  }
+  if (plan->has_algo) {
+    plan->algo = heuristic.algo;
+  }
+  const BlasGemmPlan* result = plan->has_algo ? plan.get() : nullptr;
+  config->blas_gemm_plans.emplace(key, std::move(plan));
+  return result;
+}
+
+// the key of the gemm of blas_gemm
+static BlasGemmKey blas_gemm_key(const void* input, const void* weight, cudaDataType_t data_type,
+                                 const float* output, int32_t N, int32_t M, int32_t K,
+                                 bool has_input_scale, bool has_bias, const CudaConfig* config) {
+  BlasGemmKey key;
+  key.N = N;
+  key.M = M;
+  key.K = K;
+  key.data_type = data_type;
+  key.compute_type = config->use_tf32 && data_type == CUDA_R_32F ? CUBLAS_COMPUTE_32F_FAST_TF32
+                                                                 : CUBLAS_COMPUTE_32F;
+  // the rows of the column major output are the K outputs
+  key.epilogue = has_bias ? CUBLASLT_EPILOGUE_BIAS : CUBLASLT_EPILOGUE_DEFAULT;
+  key.has_input_scale = has_input_scale;
+  key.weight_alignment = pointer_alignment(weight);
+  key.input_alignment = pointer_alignment(input);
+  key.output_alignment = pointer_alignment(output);
+  return key;
+}
+
+// output: [N, K] = input: [N, M] @ weight: [K, M]^T as a cublaslt gemm, false when the config
+// has no blas handle or cublaslt finds no algorithm, the caller falls back to its own kernel.
+// Seen column major the row major output is [K, N] = weight^T(T) [K, M] @ input^T [M, N].
+// The input and the weight have the data type, the output is fp32. An fp8 input is scaled by
+// the fp32 on the device at input_scale, a bias of K values is added by the epilogue
+static bool blas_gemm(const void* input, const void* weight, cudaDataType_t data_type,
+                      float* output, int32_t N, int32_t M, int32_t K, float scale,
+                      const CudaConfig* config, const float* input_scale = nullptr,
+                      const float* bias = nullptr) {
+  if (!config || !config->blas_handle) {
+    return false;
+  }
+  const BlasGemmKey key = blas_gemm_key(input, weight, data_type, output, N, M, K,
+                                        input_scale != nullptr, bias != nullptr, config);
+  const BlasGemmPlan* plan = blas_gemm_plan(key, config);
+  if (!plan) {
+    return false;
+  }
+
+  auto success = [](cublasStatus_t status) { return status == CUBLAS_STATUS_SUCCESS; };
+  // the b of the column major gemm is the input
+  if (input_scale && !success(cublasLtMatmulDescSetAttribute(
+                         plan->desc, CUBLASLT_MATMUL_DESC_B_SCALE_POINTER, &input_scale,
+                         sizeof(input_scale)))) {
+    return false;
+  }
+  if (bias && !success(cublasLtMatmulDescSetAttribute(
+                  plan->desc, CUBLASLT_MATMUL_DESC_BIAS_POINTER, &bias, sizeof(bias)))) {
+    return false;
+  }
+  const float beta = 0.f;
+  return success(cublasLtMatmul(config->blas_handle, plan->desc, &scale, weight,
+                                plan->weight_layout, input, plan->input_layout, &beta, output,
+                                plan->output_layout, output, plan->output_layout, &plan->algo,
+                                config->blas_workspace, config->blas_workspace_size,
+                                config->stream));
+}
+
+template <int THREAD_PER_BLOCK>
+__global__ void matmul_swiglu_kernel_cu_fp32int8(const float* input, const int8_t* weight,
+                                                 const float* scales, const int32_t group_size,
+                                                 float* output, int M, int K) {
+  unsigned int tid = threadIdx.x;
+  const int p = blockIdx.x;
+  if (p >= K) {
+    return;
+  }
+  input += blockIdx.y * M;
+  output += blockIdx.y * K;
+
+  float gate = 0.f;
+  float up = 0.f;
+  for (int i = tid; i < M; i += THREAD_PER_BLOCK) {
+    const int gate_idx = p * M + i;
+    const int up_idx = (K + p) * M + i;
+    gate += input[i] * scales[gate_idx / group_size] * static_cast<float>(weight[gate_idx]);
+    up += input[i] * scales[up_idx / group_size] * static_cast<float>(weight[up_idx]);
+  }
+
+  using BlockReduce = cub::BlockReduce<float, THREAD_PER_BLOCK>;
+  __shared__ typename BlockReduce::TempStorage temp;
+  gate = BlockReduce(temp).Sum(gate);
+  __syncthreads();
+  up = BlockReduce(temp).Sum(up);
+  if (tid == 0) {
+    output[p] = gate / (1.f + expf(-gate)) * up;
+  }
+}
+
+constexpr static int kDp4aWarpNum = 4;
+constexpr static int kDp4aRowPerWarp = 4;
+constexpr static int kDp4aOutPerWarp = 2;
+constexpr static size_t kDp4aMaxSmemSize = 48 * 1024;
+
+static size_t dp4a_smem_size(int32_t M, int32_t group_size) {
+  return M + M / group_size * sizeof(float);
+}
+
+// the groups have to line up with the 16 column loads and must not span two rows
+static bool use_dp4a(const tensor::Tensor& weight, int32_t M, int32_t group_size) {
+  return M % 16 == 0 && group_size % 16 == 0 && M % group_size == 0 &&
+         reinterpret_cast<uintptr_t>(weight.ptr<int8_t>()) % 16 == 0 &&
+         dp4a_smem_size(M, group_size) <= kDp4aMaxSmemSize;
+}
+
+template <int THREAD_NUM, typename T>
+static void launch_gemv(const float* input, const T* weight, const float* bias, float* output,
+                        int32_t N, int32_t M, int32_t K, int32_t row_per_block,
+                        cudaStream_t stream) {
+  dim3 grid((K + row_per_block - 1) / row_per_block, N);
+  if (row_per_block == 4) {
+    matmul_kernel_cu_fp32<THREAD_NUM, 4, T><<<grid, THREAD_NUM, 0, stream>>>(input, weight, bias,
+                                                                             output, M, K);
+  } else if (row_per_block == 2) {
+    matmul_kernel_cu_fp32<THREAD_NUM, 2, T><<<grid, THREAD_NUM, 0, stream>>>(input, weight, bias,
+                                                                             output, M, K);
+  } else {
+    CHECK_EQ(row_per_block, 1);
+    matmul_kernel_cu_fp32<THREAD_NUM, 1, T><<<grid, THREAD_NUM, 0, stream>>>(input, weight, bias,
+                                                                             output, M, K);
+  }
+}
+
+template <typename T>
+static void launch_gemv(const float* input, const T* weight, const float* bias, float* output,
+                        int32_t N, int32_t M, int32_t K, const GemvLaunch& launch,
+                        cudaStream_t stream) {
+  switch (launch.thread_num) {
+    case 64:
+      launch_gemv<64>(input, weight, bias, output, N, M, K, launch.row_per_block, stream);
+      break;
+    case 128:
+      launch_gemv<128>(input, weight, bias, output, N, M, K, launch.row_per_block, stream);
+      break;
+    case 256:
+      launch_gemv<256>(input, weight, bias, output, N, M, K, launch.row_per_block, stream);
+      break;
+    case 512:
+      launch_gemv<512>(input, weight, bias, output, N, M, K, launch.row_per_block, stream);
+      break;
+    default:
+      LOG(FATAL) << "Unsupported thread number " << launch.thread_num << " of the gemv launch.";
+  }
+}
+
+const std::vector<GemvLaunch>& gemv_launch_candidates() {
+  static const std::vector<GemvLaunch> candidates = [] {
+    std::vector<GemvLaunch> launches;
+    for (int32_t thread_num : {64, 128, 256, 512}) {
+      for (int32_t row_per_block : {1, 2, 4}) {
+        launches.push_back({thread_num, row_per_block});
+      }
+    }
+    return launches;
+  }();
+  return candidates;
+}
+
+void gemv_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& weight,
+                    const tensor::Tensor& output, const GemvLaunch& launch, cudaStream_t stream,
+                    const float* bias) {
+  CHECK(input.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(weight.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK_EQ(weight.dims_size(), 2);
+  const int32_t K = weight.get_dim(0);
+  const int32_t M = weight.get_dim(1);
+  const int32_t N = input.dims_size() == 2 ? input.get_dim(0) : 1;
+  CHECK_EQ(M, input.get_dim(input.dims_size() - 1));
+  CHECK_EQ(output.size(), N * K);
+  const float* input_ptr = input.ptr<float>();
+  float* output_ptr = const_cast<float*>(output.ptr<float>());
+  if (weight.data_type() == base::DataType::kDataTypeFp16) {
+    launch_gemv(input_ptr, reinterpret_cast<const half*>(weight.ptr<uint16_t>()), bias,
+                output_ptr, N, M, K, launch, stream);
+  } else if (weight.data_type() == base::DataType::kDataTypeBf16) {
+    launch_gemv(input_ptr, reinterpret_cast<const __nv_bfloat16*>(weight.ptr<uint16_t>()), bias,
+                output_ptr, N, M, K, launch, stream);
+  } else {
+    CHECK(weight.data_type() == base::DataType::kDataTypeFp32);
+    launch_gemv(input_ptr, weight.ptr<float>(), bias, output_ptr, N, M, K, launch, stream);
+  }
+}
+
+// the launch the tuner picked for the shape of the weight, or the default one
+static GemvLaunch find_gemv_launch(const tensor::Tensor& weight, const CudaConfig* config) {
+  if (config && !config->gemv_launches.empty()) {
+    const GemvShape shape{weight.get_dim(0), weight.get_dim(1),
+                          static_cast<int32_t>(weight.data_type())};
+    auto launch = config->gemv_launches.find(shape);
+    if (launch != config->gemv_launches.end()) {
+      return launch->second;
+    }
+  }
+  return GemvLaunch{};
+}
+
+static bool is_half_weight(const tensor::Tensor& weight) {
+  return weight.data_type() == base::DataType::kDataTypeFp16 ||
+         weight.data_type() == base::DataType::kDataTypeBf16;
+}
+
+// several rows with a 16 bit weight run as a gemm of the input cast to the weight type, which
+// accumulates in fp32 as well. The temporary input is only taken outside of the decode step
+static bool blas_gemm_half(const tensor::Tensor& input, const tensor::Tensor& weight,
+                           float* output, int32_t N, int32_t M, int32_t K, float scale,
+                           const CudaConfig* config, const float* bias = nullptr) {
+  if (!config || !config->blas_handle) {
+    return false;
+  }
+  tensor::Tensor input_half(weight.data_type(), N, M, true,
+                            base::CUDADeviceAllocatorFactory::get_instance());
+  cast_kernel_cu(input, input_half, config->stream);
+  const cudaDataType_t data_type =
+      weight.data_type() == base::DataType::kDataTypeFp16 ? CUDA_R_16F : CUDA_R_16BF;
+  return blas_gemm(input_half.ptr<uint16_t>(), weight.ptr<uint16_t>(), data_type, output, N, M, K,
+                   scale, config, nullptr, bias);
+}
+
+// the bias of K values is added by the epilogue of every path when it is not empty
+static void matmul_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& weight,
+                             const tensor::Tensor& bias, const tensor::Tensor& output,
+                             const float scale, const CudaConfig* config) {
   CHECK(input.is_empty() == false && input.dims_size() <= 2);
   CHECK(input.device_type() == base::DeviceType::kDeviceCUDA);
 
@@ -98,19 +932,52 @@ void matmul_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& weight,
   int packet_size = 4;
   // CHECK_EQ(M % packet_size, 0);
 
-  CHECK_EQ(M, input.get_dim(0));
-  if (config && config->stream) {
-    matmul_kernel_cu_fp32<128, 1><<<K, 128, 0, config->stream>>>(
-        input.ptr<float>(), weight.ptr<float>(), const_cast<float*>(output.ptr<float>()), M, K);
-  } else {
-    matmul_kernel_cu_fp32<128, 1><<<K, 128>>>(input.ptr<float>(), weight.ptr<float>(),
-                                              const_cast<float*>(output.ptr<float>()), M, K);
+  const int32_t N = input.dims_size() == 2 ? input.get_dim(0) : 1;
+  CHECK_EQ(M, input.get_dim(input.dims_size() - 1));
+  CHECK_EQ(output.size(), N * K);
+  CHECK(bias.is_empty() || bias.size() == K);
+  const float* bias_ptr = bias.is_empty() ? nullptr : bias.ptr<float>();
+  cudaStream_t stream = config ? config->stream : nullptr;
+  if (is_half_weight(weight)) {
+    if (N > 1 && blas_gemm_half(input, weight, const_cast<float*>(output.ptr<float>()), N, M, K,
+                                scale, config, bias_ptr)) {
+      return;
+    }
+    gemv_kernel_cu(input, weight, output, find_gemv_launch(weight, config), stream, bias_ptr);
+    return;
+  }
+  if (N > 1 && blas_gemm(input.ptr<float>(), weight.ptr<float>(), CUDA_R_32F,
+                         const_cast<float*>(output.ptr<float>()), N, M, K, scale, config, nullptr,
+                         bias_ptr)) {
+    return;
   }
+  if (N > 1) {
+    constexpr int tile = 16;
+    dim3 block(tile, tile);
+    dim3 grid((K + tile - 1) / tile, (N + tile - 1) / tile);
+    matmul_kernel_cu_fp32_gemm<tile><<<grid, block, 0, stream>>>(
+        input.ptr<float>(), weight.ptr<float>(), bias_ptr, const_cast<float*>(output.ptr<float>()),
+        N, M, K, scale);
+    return;
+  }
+  gemv_kernel_cu(input, weight, output, find_gemv_launch(weight, config), stream, bias_ptr);
 }
 
-void matmul_kernel_cu_qint8(const tensor::Tensor& input, const tensor::Tensor& weight,
-                            const tensor::Tensor& output, int32_t group_size,
-                            const tensor::Tensor& scale, const CudaConfig* config) {
+void matmul_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& weight,
+                      const tensor::Tensor& output, const float scale, const CudaConfig* config) {
+  matmul_kernel_cu(input, weight, tensor::Tensor(), output, scale, config);
+}
+
+void matmul_bias_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& weight,
+                           const tensor::Tensor& bias, const tensor::Tensor& output,
+                           const CudaConfig* config) {
+  matmul_kernel_cu(input, weight, bias, output, 1.f, config);
+}
+
+static void matmul_kernel_cu_qint8(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                   const tensor::Tensor& bias, const tensor::Tensor& output,
+                                   int32_t group_size, const tensor::Tensor& scale,
+                                   const CudaConfig* config) {
   CHECK(config != nullptr);
   CHECK(input.is_empty() == false && input.dims_size() <= 2);
   CHECK(input.device_type() == base::DeviceType::kDeviceCUDA);
@@ -121,15 +988,581 @@ void matmul_kernel_cu_qint8(const tensor::Tensor& input, const tensor::Tensor& w
   const int32_t M = weight.get_dim(1);  // col
   int packet_size = 4;
   CHECK_EQ(M % packet_size, 0);
-  CHECK_EQ(M, input.get_dim(0));
+  const int32_t N = input.dims_size() == 2 ? input.get_dim(0) : 1;
+  CHECK_EQ(M, input.get_dim(input.dims_size() - 1));
+  CHECK_EQ(output.size(), N * K);
+  CHECK(bias.is_empty() || bias.size() == K);
+  const float* bias_ptr = bias.is_empty() ? nullptr : bias.ptr<float>();
+  if (use_dp4a(weight, M, group_size)) {
+    constexpr int row_per_block = kDp4aWarpNum * kDp4aRowPerWarp;
+    dim3 grid((K + row_per_block - 1) / row_per_block, N);
+    matmul_kernel_cu_dp4a<kDp4aRowPerWarp>
+        <<<grid, kDp4aWarpNum * 32, dp4a_smem_size(M, group_size), config->stream>>>(
+            input.ptr<float>(), weight.ptr<int8_t>(), scale.ptr<float>(), group_size, bias_ptr,
+            const_cast<float*>(output.ptr<float>()), M, K);
+    return;
+  }
+  dim3 grid(K, N);
   if (config->stream) {
-    matmul_kernel_cu_fp32int8<128, 1><<<K, 128, 0, config->stream>>>(
-        input.ptr<float>(), weight.ptr<int8_t>(), scale.ptr<float>(), group_size,
+    matmul_kernel_cu_fp32int8<128, 1><<<grid, 128, 0, config->stream>>>(
+        input.ptr<float>(), weight.ptr<int8_t>(), scale.ptr<float>(), group_size, bias_ptr,
         const_cast<float*>(output.ptr<float>()), M, K);
   } else {
-    matmul_kernel_cu_fp32int8<128, 1><<<K, 128>>>(input.ptr<float>(), weight.ptr<int8_t>(),
-                                                  scale.ptr<float>(), group_size,
-                                                  const_cast<float*>(output.ptr<float>()), M, K);
+    matmul_kernel_cu_fp32int8<128, 1><<<grid, 128>>>(
+        input.ptr<float>(), weight.ptr<int8_t>(), scale.ptr<float>(), group_size, bias_ptr,
+        const_cast<float*>(output.ptr<float>()), M, K);
+  }
+}
+
+void matmul_kernel_cu_qint8(const tensor::Tensor& input, const tensor::Tensor& weight,
+                            const tensor::Tensor& output, int32_t group_size,
+                            const tensor::Tensor& scale, const CudaConfig* config) {
+  matmul_kernel_cu_qint8(input, weight, tensor::Tensor(), output, group_size, scale, config);
+}
+
+void matmul_bias_kernel_cu_qint8(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                 const tensor::Tensor& bias, const tensor::Tensor& output,
+                                 int32_t group_size, const tensor::Tensor& scale,
+                                 const CudaConfig* config) {
+  matmul_kernel_cu_qint8(input, weight, bias, output, group_size, scale, config);
+}
+
+void matmul_swiglu_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& weight,
+                             const tensor::Tensor& output, const CudaConfig* config) {
+  CHECK(input.is_empty() == false && input.dims_size() <= 2);
+  CHECK(input.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(weight.is_empty() == false && weight.dims_size() == 2);
+  CHECK(weight.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK_EQ(weight.get_dim(0) % 2, 0);
+  const int32_t K = weight.get_dim(0) / 2;  // hidden dim
+  const int32_t M = weight.get_dim(1);      // col
+  CHECK_EQ(M % 4, 0);
+  const int32_t N = input.dims_size() == 2 ? input.get_dim(0) : 1;
+  CHECK_EQ(M, input.get_dim(input.dims_size() - 1));
+  CHECK_EQ(output.size(), N * K);
+  cudaStream_t stream = config ? config->stream : nullptr;
+  if (N > 1 && config && config->blas_handle) {
+    // the gate and up rows of every input row are computed by one gemm and combined after it
+    tensor::Tensor gate_up(base::DataType::kDataTypeFp32, N, 2 * K, true,
+                           base::CUDADeviceAllocatorFactory::get_instance());
+    const bool is_done =
+        is_half_weight(weight)
+            ? blas_gemm_half(input, weight, gate_up.ptr<float>(), N, M, 2 * K, 1.f, config)
+            : blas_gemm(input.ptr<float>(), weight.ptr<float>(), CUDA_R_32F, gate_up.ptr<float>(),
+                        N, M, 2 * K, 1.f, config);
+    if (is_done) {
+      constexpr int thread_num = 256;
+      const int block_num = (N * K + thread_num - 1) / thread_num;
+      swiglu_rows_kernel_cu_fp32<<<block_num, thread_num, 0, stream>>>(
+          gate_up.ptr<float>(), const_cast<float*>(output.ptr<float>()), N, K);
+      return;
+    }
+  }
+  dim3 grid(K, N);
+  float* output_ptr = const_cast<float*>(output.ptr<float>());
+  if (weight.data_type() == base::DataType::kDataTypeFp16) {
+    matmul_swiglu_kernel_cu_fp32<128, half><<<grid, 128, 0, stream>>>(
+        input.ptr<float>(), reinterpret_cast<const half*>(weight.ptr<uint16_t>()), output_ptr, M,
+        K);
+  } else if (weight.data_type() == base::DataType::kDataTypeBf16) {
+    matmul_swiglu_kernel_cu_fp32<128, __nv_bfloat16><<<grid, 128, 0, stream>>>(
+        input.ptr<float>(), reinterpret_cast<const __nv_bfloat16*>(weight.ptr<uint16_t>()),
+        output_ptr, M, K);
+  } else {
+    matmul_swiglu_kernel_cu_fp32<128><<<grid, 128, 0, stream>>>(input.ptr<float>(),
+                                                                weight.ptr<float>(), output_ptr,
+                                                                M, K);
+  }
+}
+
+void matmul_swiglu_kernel_cu_qint8(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                   const tensor::Tensor& output, int32_t group_size,
+                                   const tensor::Tensor& scale, const CudaConfig* config) {
+  CHECK(input.is_empty() == false && input.dims_size() <= 2);
+  CHECK(input.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(weight.is_empty() == false && weight.dims_size() == 2);
+  CHECK(weight.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK_EQ(weight.get_dim(0) % 2, 0);
+  const int32_t K = weight.get_dim(0) / 2;  // hidden dim
+  const int32_t M = weight.get_dim(1);      // col
+  const int32_t N = input.dims_size() == 2 ? input.get_dim(0) : 1;
+  CHECK_EQ(M, input.get_dim(input.dims_size() - 1));
+  CHECK_EQ(output.size(), N * K);
+  cudaStream_t stream = config ? config->stream : nullptr;
+  if (use_dp4a(weight, M, group_size)) {
+    constexpr int out_per_block = kDp4aWarpNum * kDp4aOutPerWarp;
+    dim3 grid((K + out_per_block - 1) / out_per_block, N);
+    matmul_swiglu_kernel_cu_dp4a<kDp4aOutPerWarp>
+        <<<grid, kDp4aWarpNum * 32, dp4a_smem_size(M, group_size), stream>>>(
+            input.ptr<float>(), weight.ptr<int8_t>(), scale.ptr<float>(), group_size,
+            const_cast<float*>(output.ptr<float>()), M, K);
+    return;
+  }
+  dim3 grid(K, N);
+  matmul_swiglu_kernel_cu_fp32int8<128><<<grid, 128, 0, stream>>>(
+      input.ptr<float>(), weight.ptr<int8_t>(), scale.ptr<float>(), group_size,
+      const_cast<float*>(output.ptr<float>()), M, K);
+}
+
+bool can_tile_int8_weight(const tensor::Tensor& weight, int32_t group_size,
+                          const tensor::Tensor& scale) {
+  if (weight.is_empty() || weight.dims_size() != 2 ||
+      weight.data_type() != base::DataType::kDataTypeInt8 ||
+      weight.device_type() != base::DeviceType::kDeviceCUDA || group_size <= 0) {
+    return false;
+  }
+  const int32_t K = weight.get_dim(0);
+  const int32_t M = weight.get_dim(1);
+  return K % kInt8TileRows == 0 && use_dp4a(weight, M, group_size) &&
+         scale.size() == static_cast<size_t>(K) * (M / group_size) &&
+         reinterpret_cast<uintptr_t>(scale.ptr<float>()) % 16 == 0;
+}
+
+void tile_int8_weight_cu(const tensor::Tensor& weight, int32_t group_size,
+                         const tensor::Tensor& scale, cudaStream_t stream) {
+  CHECK(can_tile_int8_weight(weight, group_size, scale));
+  const int32_t K = weight.get_dim(0);
+  const int32_t M = weight.get_dim(1);
+  const int32_t chunk_num = M / 16;
+  const int32_t group_num = M / group_size;
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  tensor::Tensor tiled_weight(base::DataType::kDataTypeInt8, K, M, true, alloc_cu);
+  tensor::Tensor tiled_scale(base::DataType::kDataTypeFp32, static_cast<int32_t>(scale.size()),
+                             true, alloc_cu);
+  constexpr int thread_num = 256;
+  const int64_t chunk_total = static_cast<int64_t>(K) * chunk_num;
+  const int block_num = static_cast<int>((chunk_total + thread_num - 1) / thread_num);
+  tile_int8_weight_kernel_cu<<<block_num, thread_num, 0, stream>>>(
+      reinterpret_cast<const int4*>(weight.ptr<int8_t>()), scale.ptr<float>(),
+      reinterpret_cast<int4*>(tiled_weight.ptr<int8_t>()), tiled_scale.ptr<float>(), K,
+      chunk_num, group_num);
+  // written back over the row major copy, the views of the parts of a fused weight stay valid
+  cudaMemcpyAsync(const_cast<int8_t*>(weight.ptr<int8_t>()), tiled_weight.ptr<int8_t>(),
+                  weight.byte_size(), cudaMemcpyDeviceToDevice, stream);
+  cudaMemcpyAsync(const_cast<float*>(scale.ptr<float>()), tiled_scale.ptr<float>(),
+                  scale.byte_size(), cudaMemcpyDeviceToDevice, stream);
+  cudaStreamSynchronize(stream);
+}
+
+static void matmul_kernel_cu_qint8_tiled(const tensor::Tensor& input,
+                                         const tensor::Tensor& weight,
+                                         const tensor::Tensor& bias,
+                                         const tensor::Tensor& output, int32_t group_size,
+                                         const tensor::Tensor& scale, const CudaConfig* config) {
+  CHECK(config != nullptr);
+  CHECK(input.is_empty() == false && input.dims_size() <= 2);
+  CHECK(input.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(can_tile_int8_weight(weight, group_size, scale));
+  const int32_t K = weight.get_dim(0);
+  const int32_t M = weight.get_dim(1);
+  const int32_t N = input.dims_size() == 2 ? input.get_dim(0) : 1;
+  CHECK_EQ(M, input.get_dim(input.dims_size() - 1));
+  CHECK_EQ(output.size(), N * K);
+  CHECK(bias.is_empty() || bias.size() == K);
+  constexpr int row_per_block = kDp4aWarpNum * kInt8TileRows;
+  dim3 grid((K + row_per_block - 1) / row_per_block, N);
+  matmul_kernel_cu_dp4a_tiled<<<grid, kDp4aWarpNum * 32, dp4a_smem_size(M, group_size),
+                                config->stream>>>(
+      input.ptr<float>(), weight.ptr<int8_t>(), scale.ptr<float>(), group_size,
+      bias.is_empty() ? nullptr : bias.ptr<float>(), const_cast<float*>(output.ptr<float>()), M,
+      K);
+}
+
+void matmul_kernel_cu_qint8_tiled(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                  const tensor::Tensor& output, int32_t group_size,
+                                  const tensor::Tensor& scale, const CudaConfig* config) {
+  matmul_kernel_cu_qint8_tiled(input, weight, tensor::Tensor(), output, group_size, scale,
+                               config);
+}
+
+void matmul_bias_kernel_cu_qint8_tiled(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                       const tensor::Tensor& bias, const tensor::Tensor& output,
+                                       int32_t group_size, const tensor::Tensor& scale,
+                                       const CudaConfig* config) {
+  matmul_kernel_cu_qint8_tiled(input, weight, bias, output, group_size, scale, config);
+}
+
+void matmul_swiglu_kernel_cu_qint8_tiled(const tensor::Tensor& input,
+                                         const tensor::Tensor& weight,
+                                         const tensor::Tensor& output, int32_t group_size,
+                                         const tensor::Tensor& scale, const CudaConfig* config) {
+  CHECK(config != nullptr);
+  CHECK(input.is_empty() == false && input.dims_size() <= 2);
+  CHECK(input.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(can_tile_int8_weight(weight, group_size, scale));
+  CHECK_EQ(weight.get_dim(0) % (2 * kInt8TileRows), 0);
+  const int32_t K = weight.get_dim(0) / 2;  // hidden dim
+  const int32_t M = weight.get_dim(1);      // col
+  const int32_t N = input.dims_size() == 2 ? input.get_dim(0) : 1;
+  CHECK_EQ(M, input.get_dim(input.dims_size() - 1));
+  CHECK_EQ(output.size(), N * K);
+  constexpr int out_per_block = kDp4aWarpNum * kInt8TileRows;
+  dim3 grid((K + out_per_block - 1) / out_per_block, N);
+  matmul_swiglu_kernel_cu_dp4a_tiled<<<grid, kDp4aWarpNum * 32, dp4a_smem_size(M, group_size),
+                                       config->stream>>>(
+      input.ptr<float>(), weight.ptr<int8_t>(), scale.ptr<float>(), group_size,
+      const_cast<float*>(output.ptr<float>()), M, K);
+}
+
+constexpr static int kInt4WarpNum = 4;
+constexpr static int kInt4RowPerWarp = 4;
+constexpr static int kInt4OutPerWarp = 2;
+
+static void check_int4_matmul(const tensor::Tensor& input, const tensor::Tensor& weight,
+                              int32_t group_size, const tensor::Tensor& scale,
+                              const tensor::Tensor& zero_point, int32_t M) {
+  CHECK(input.is_empty() == false && input.dims_size() <= 2);
+  CHECK(input.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(weight.is_empty() == false && weight.dims_size() == 2);
+  CHECK(weight.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(scale.data_type() == base::DataType::kDataTypeFp16);
+  CHECK_EQ(M % group_size, 0);
+  CHECK_EQ(group_size % 32, 0);
+  CHECK_EQ(reinterpret_cast<uintptr_t>(weight.ptr<int8_t>()) % 16, 0);
+  CHECK_EQ(M, input.get_dim(input.dims_size() - 1));
+  CHECK(zero_point.is_empty() || zero_point.size() == scale.size());
+}
+
+static const uint8_t* zero_point_ptr(const tensor::Tensor& zero_point) {
+  if (zero_point.is_empty()) {
+    return nullptr;
+  }
+  return reinterpret_cast<const uint8_t*>(zero_point.ptr<int8_t>());
+}
+
+void matmul_kernel_cu_qint4(const tensor::Tensor& input, const tensor::Tensor& weight,
+                            const tensor::Tensor& output, int32_t group_size,
+                            const tensor::Tensor& scale, const tensor::Tensor& zero_point,
+                            const CudaConfig* config) {
+  const int32_t K = weight.get_dim(0);
+  const int32_t M = weight.get_dim(1) * 2;
+  check_int4_matmul(input, weight, group_size, scale, zero_point, M);
+  const int32_t N = input.dims_size() == 2 ? input.get_dim(0) : 1;
+  CHECK_EQ(output.size(), N * K);
+  cudaStream_t stream = config ? config->stream : nullptr;
+  const uint8_t* weight_ptr = reinterpret_cast<const uint8_t*>(weight.ptr<int8_t>());
+  const half* scale_ptr = reinterpret_cast<const half*>(scale.ptr<uint16_t>());
+  if (N > 1) {
+    constexpr int tile = 16;
+    dim3 block(tile, tile);
+    dim3 grid((K + tile - 1) / tile, (N + tile - 1) / tile);
+    matmul_kernel_cu_int4_gemm<tile><<<grid, block, 0, stream>>>(
+        input.ptr<float>(), weight_ptr, scale_ptr, zero_point_ptr(zero_point), group_size,
+        const_cast<float*>(output.ptr<float>()), N, M, K);
+    return;
+  }
+  constexpr int row_per_block = kInt4WarpNum * kInt4RowPerWarp;
+  const int block_num = (K + row_per_block - 1) / row_per_block;
+  matmul_kernel_cu_int4<kInt4RowPerWarp><<<block_num, kInt4WarpNum * 32, 0, stream>>>(
+      input.ptr<float>(), weight_ptr, scale_ptr, zero_point_ptr(zero_point), group_size,
+      const_cast<float*>(output.ptr<float>()), M, K);
+}
+
+void matmul_swiglu_kernel_cu_qint4(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                   const tensor::Tensor& output, int32_t group_size,
+                                   const tensor::Tensor& scale, const tensor::Tensor& zero_point,
+                                   const CudaConfig* config) {
+  CHECK_EQ(weight.get_dim(0) % 2, 0);
+  const int32_t K = weight.get_dim(0) / 2;  // hidden dim
+  const int32_t M = weight.get_dim(1) * 2;
+  check_int4_matmul(input, weight, group_size, scale, zero_point, M);
+  const int32_t N = input.dims_size() == 2 ? input.get_dim(0) : 1;
+  CHECK_EQ(output.size(), N * K);
+  cudaStream_t stream = config ? config->stream : nullptr;
+  const uint8_t* weight_ptr = reinterpret_cast<const uint8_t*>(weight.ptr<int8_t>());
+  const half* scale_ptr = reinterpret_cast<const half*>(scale.ptr<uint16_t>());
+  if (N > 1) {
+    // the gemm writes the gate and up rows, they are combined after it
+    tensor::Tensor gate_up(base::DataType::kDataTypeFp32, N, 2 * K, true,
+                           base::CUDADeviceAllocatorFactory::get_instance());
+    constexpr int tile = 16;
+    dim3 block(tile, tile);
+    dim3 grid((2 * K + tile - 1) / tile, (N + tile - 1) / tile);
+    matmul_kernel_cu_int4_gemm<tile><<<grid, block, 0, stream>>>(
+        input.ptr<float>(), weight_ptr, scale_ptr, zero_point_ptr(zero_point), group_size,
+        gate_up.ptr<float>(), N, M, 2 * K);
+    constexpr int thread_num = 256;
+    const int block_num = (N * K + thread_num - 1) / thread_num;
+    swiglu_rows_kernel_cu_fp32<<<block_num, thread_num, 0, stream>>>(
+        gate_up.ptr<float>(), const_cast<float*>(output.ptr<float>()), N, K);
+    return;
+  }
+  constexpr int out_per_block = kInt4WarpNum * kInt4OutPerWarp;
+  const int block_num = (K + out_per_block - 1) / out_per_block;
+  matmul_swiglu_kernel_cu_int4<kInt4OutPerWarp><<<block_num, kInt4WarpNum * 32, 0, stream>>>(
+      input.ptr<float>(), weight_ptr, scale_ptr, zero_point_ptr(zero_point), group_size,
+      const_cast<float*>(output.ptr<float>()), M, K);
+}
+// the fp8 gemv reads 16 weights of a row with one uint4 load
+constexpr static int kFp8WarpNum = 4;
+constexpr static int kFp8RowPerWarp = 4;
+constexpr static int kFp8OutPerWarp = 2;
+
+__device__ __forceinline__ float2 fp8x2_to_float2(uint16_t packed) {
+  const __half2_raw raw = __nv_cvt_fp8x2_to_halfraw2(packed, __NV_E4M3);
+  return __half22float2(*reinterpret_cast<const half2*>(&raw));
+}
+
+// the dots of the rows of the e4m3 weight with the input, the scale of a row is applied after
+// the sum of the warp
+template <int ROW_NUM>
+__device__ void dot_rows_fp8(const float* input, const uint8_t* weight, const float* scales,
+                             const int (&rows)[ROW_NUM], int M, float (&sums)[ROW_NUM]) {
+  const int lane = threadIdx.x % 32;
+  const int chunk_num = M / 16;
+#pragma unroll
+  for (int r = 0; r < ROW_NUM; ++r) {
+    sums[r] = 0.f;
+  }
+  for (int c = lane; c < chunk_num; c += 32) {
+    float x[16];
+    const float4* input_float4_ptr = reinterpret_cast<const float4*>(input + c * 16);
+#pragma unroll
+    for (int i = 0; i < 4; ++i) {
+      const float4 value = __ldg(input_float4_ptr + i);
+      x[4 * i] = value.x;
+      x[4 * i + 1] = value.y;
+      x[4 * i + 2] = value.z;
+      x[4 * i + 3] = value.w;
+    }
+#pragma unroll
+    for (int r = 0; r < ROW_NUM; ++r) {
+      const uint4 packed =
+          __ldg(reinterpret_cast<const uint4*>(weight + static_cast<int64_t>(rows[r]) * M) + c);
+      const uint32_t words[4] = {packed.x, packed.y, packed.z, packed.w};
+      float dot = 0.f;
+#pragma unroll
+      for (int w = 0; w < 4; ++w) {
+        const float2 low = fp8x2_to_float2(static_cast<uint16_t>(words[w] & 0xffff));
+        const float2 high = fp8x2_to_float2(static_cast<uint16_t>(words[w] >> 16));
+        dot += low.x * x[4 * w] + low.y * x[4 * w + 1] + high.x * x[4 * w + 2] +
+               high.y * x[4 * w + 3];
+      }
+      sums[r] += dot;
+    }
+  }
+#pragma unroll
+  for (int r = 0; r < ROW_NUM; ++r) {
+    for (int offset = 16; offset > 0; offset >>= 1) {
+      sums[r] += __shfl_xor_sync(0xffffffff, sums[r], offset);
+    }
+    sums[r] *= __ldg(scales + rows[r]);
+  }
+}
+
+template <int ROW_PER_WARP>
+__global__ void matmul_kernel_cu_fp8(const float* input, const uint8_t* weight,
+                                     const float* scales, float* output, int M, int K) {
+  input += blockIdx.y * M;
+  output += blockIdx.y * K;
+  const int first_row = (blockIdx.x * (blockDim.x / 32) + threadIdx.x / 32) * ROW_PER_WARP;
+  if (first_row >= K) {
+    return;
+  }
+  int rows[ROW_PER_WARP];
+#pragma unroll
+  for (int r = 0; r < ROW_PER_WARP; ++r) {
+    rows[r] = min(first_row + r, K - 1);
+  }
+  float sums[ROW_PER_WARP];
+  dot_rows_fp8<ROW_PER_WARP>(input, weight, scales, rows, M, sums);
+  if (threadIdx.x % 32 == 0) {
+#pragma unroll
+    for (int r = 0; r < ROW_PER_WARP; ++r) {
+      if (first_row + r < K) {
+        output[first_row + r] = sums[r];
+      }
+    }
+  }
+}
+
+template <int OUT_PER_WARP>
+__global__ void matmul_swiglu_kernel_cu_fp8(const float* input, const uint8_t* weight,
+                                            const float* scales, float* output, int M, int K) {
+  input += blockIdx.y * M;
+  output += blockIdx.y * K;
+  const int first_out = (blockIdx.x * (blockDim.x / 32) + threadIdx.x / 32) * OUT_PER_WARP;
+  if (first_out >= K) {
+    return;
+  }
+  int rows[2 * OUT_PER_WARP];
+#pragma unroll
+  for (int o = 0; o < OUT_PER_WARP; ++o) {
+    const int p = min(first_out + o, K - 1);
+    rows[2 * o] = p;
+    rows[2 * o + 1] = K + p;
+  }
+  float sums[2 * OUT_PER_WARP];
+  dot_rows_fp8<2 * OUT_PER_WARP>(input, weight, scales, rows, M, sums);
+  if (threadIdx.x % 32 == 0) {
+#pragma unroll
+    for (int o = 0; o < OUT_PER_WARP; ++o) {
+      if (first_out + o < K) {
+        const float gate = sums[2 * o];
+        output[first_out + o] = gate / (1.f + expf(-gate)) * sums[2 * o + 1];
+      }
+    }
+  }
+}
+
+// the largest magnitude of the input, amax starts at zero. The bits of non negative floats
+// order as their values, so the blocks combine with an integer atomic
+template <int THREAD_NUM>
+__global__ void absmax_kernel_cu(const float* input, int64_t size, float* amax) {
+  float value = 0.f;
+  for (int64_t i = blockIdx.x * THREAD_NUM + threadIdx.x; i < size;
+       i += static_cast<int64_t>(gridDim.x) * THREAD_NUM) {
+    value = fmaxf(value, fabsf(input[i]));
+  }
+  using BlockReduce = cub::BlockReduce<float, THREAD_NUM>;
+  __shared__ typename BlockReduce::TempStorage temp;
+  value = BlockReduce(temp).Reduce(value, cub::Max());
+  if (threadIdx.x == 0) {
+    atomicMax(reinterpret_cast<int*>(amax), __float_as_int(value));
+  }
+}
+
+// the input in e4m3 with the per tensor scale amax / 448, which is written to scale
+__global__ void quantize_fp8_kernel_cu(const float* input, int64_t size, const float* amax,
+                                       __nv_fp8_e4m3* output, float* scale) {
+  const float input_scale = fmaxf(*amax, 1e-12f) / 448.f;
+  const int64_t idx = static_cast<int64_t>(blockIdx.x) * blockDim.x + threadIdx.x;
+  if (idx == 0) {
+    *scale = input_scale;
+  }
+  if (idx < size) {
+    // the conversion saturates to the largest finite value
+    output[idx] = __nv_fp8_e4m3(input[idx] / input_scale);
+  }
+}
+
+// output: [N, K], every column is multiplied by the scale of its weight row
+__global__ void scale_columns_kernel_cu(float* output, const float* scales, int N, int K) {
+  const int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx >= N * K) {
+    return;
+  }
+  output[idx] *= scales[idx % K];
+}
+
+static void check_fp8_matmul(const tensor::Tensor& input, const tensor::Tensor& weight,
+                             const tensor::Tensor& scale, int32_t M, int32_t K) {
+  CHECK(input.is_empty() == false && input.dims_size() <= 2);
+  CHECK(input.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(weight.is_empty() == false && weight.dims_size() == 2);
+  CHECK(weight.device_type() == base::DeviceType::kDeviceCUDA);
+  CHECK(weight.data_type() == base::DataType::kDataTypeFp8E4M3);
+  CHECK(scale.data_type() == base::DataType::kDataTypeFp32);
+  CHECK_EQ(scale.size(), weight.get_dim(0));
+  CHECK_EQ(M % 16, 0);
+  CHECK_EQ(reinterpret_cast<uintptr_t>(weight.ptr<int8_t>()) % 16, 0);
+  CHECK_EQ(M, input.get_dim(input.dims_size() - 1));
+}
+
+// sm89 and later have the fp8 tensor cores, the capability is read once for the config
+static bool has_fp8_tensor_cores(const CudaConfig* config) {
+  if (config->compute_capability < 0) {
+    int32_t device_id = 0;
+    cudaDeviceProp prop{};
+    if (cudaGetDevice(&device_id) == cudaSuccess &&
+        cudaGetDeviceProperties(&prop, device_id) == cudaSuccess) {
+      config->compute_capability = prop.major * 10 + prop.minor;
+    } else {
+      cudaGetLastError();
+      config->compute_capability = 0;
+    }
+  }
+  return config->compute_capability >= 89;
+}
+
+// several rows run as a cublaslt fp8 gemm of the input quantized with one scale for the tensor,
+// the scales of the weight rows are applied to its output. False before sm89, which has no fp8
+// tensor cores, or for a shape which cublaslt has no algorithm for. Both are known before the
+// input is quantized, the caller falls back to the gemv then
+static bool blas_gemm_fp8(const tensor::Tensor& input, const tensor::Tensor& weight,
+                          const tensor::Tensor& scale, float* output, int32_t N, int32_t M,
+                          int32_t K, const CudaConfig* config) {
+  if (!config || !config->blas_handle || !has_fp8_tensor_cores(config)) {
+    return false;
+  }
+  auto alloc = base::CUDADeviceAllocatorFactory::get_instance();
+  const int64_t size = static_cast<int64_t>(N) * M;
+  tensor::Tensor input_fp8(base::DataType::kDataTypeFp8E4M3, N, M, true, alloc);
+  if (!blas_gemm_plan(blas_gemm_key(input_fp8.ptr<int8_t>(), weight.ptr<int8_t>(),
+                                    CUDA_R_8F_E4M3, output, N, M, K, true, false, config),
+                      config)) {
+    return false;
+  }
+  // the amax and the scale of the input
+  tensor::Tensor input_scale(base::DataType::kDataTypeFp32, 2, true, alloc);
+  cudaMemsetAsync(input_scale.ptr<float>(), 0, sizeof(float), config->stream);
+  constexpr int thread_num = 256;
+  const int reduce_block_num =
+      static_cast<int>(std::min<int64_t>((size + thread_num - 1) / thread_num, 1024));
+  absmax_kernel_cu<thread_num><<<reduce_block_num, thread_num, 0, config->stream>>>(
+      input.ptr<float>(), size, input_scale.ptr<float>());
+  quantize_fp8_kernel_cu<<<(size + thread_num - 1) / thread_num, thread_num, 0,
+                           config->stream>>>(
+      input.ptr<float>(), size, input_scale.ptr<float>(),
+      reinterpret_cast<__nv_fp8_e4m3*>(input_fp8.ptr<int8_t>()), input_scale.ptr<float>() + 1);
+  // the plan of the shape is cached, only a failed launch of cublaslt falls back from here
+  if (!blas_gemm(input_fp8.ptr<int8_t>(), weight.ptr<int8_t>(), CUDA_R_8F_E4M3, output, N, M, K,
+                 1.f, config, input_scale.ptr<float>() + 1)) {
+    return false;
+  }
+  scale_columns_kernel_cu<<<(N * K + thread_num - 1) / thread_num, thread_num, 0,
+                            config->stream>>>(output, scale.ptr<float>(), N, K);
+  return true;
+}
+
+void matmul_kernel_cu_fp8(const tensor::Tensor& input, const tensor::Tensor& weight,
+                          const tensor::Tensor& output, int32_t group_size,
+                          const tensor::Tensor& scale, const CudaConfig* config) {
+  UNUSED(group_size);
+  const int32_t K = weight.get_dim(0);  // row
+  const int32_t M = weight.get_dim(1);  // col
+  check_fp8_matmul(input, weight, scale, M, K);
+  const int32_t N = input.dims_size() == 2 ? input.get_dim(0) : 1;
+  CHECK_EQ(output.size(), N * K);
+  float* output_ptr = const_cast<float*>(output.ptr<float>());
+  if (N > 1 && blas_gemm_fp8(input, weight, scale, output_ptr, N, M, K, config)) {
+    return;
+  }
+  cudaStream_t stream = config ? config->stream : nullptr;
+  constexpr int row_per_block = kFp8WarpNum * kFp8RowPerWarp;
+  dim3 grid((K + row_per_block - 1) / row_per_block, N);
+  matmul_kernel_cu_fp8<kFp8RowPerWarp><<<grid, kFp8WarpNum * 32, 0, stream>>>(
+      input.ptr<float>(), reinterpret_cast<const uint8_t*>(weight.ptr<int8_t>()),
+      scale.ptr<float>(), output_ptr, M, K);
+}
+
+void matmul_swiglu_kernel_cu_fp8(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                 const tensor::Tensor& output, int32_t group_size,
+                                 const tensor::Tensor& scale, const CudaConfig* config) {
+  UNUSED(group_size);
+  CHECK_EQ(weight.get_dim(0) % 2, 0);
+  const int32_t K = weight.get_dim(0) / 2;  // hidden dim
+  const int32_t M = weight.get_dim(1);      // col
+  check_fp8_matmul(input, weight, scale, M, 2 * K);
+  const int32_t N = input.dims_size() == 2 ? input.get_dim(0) : 1;
+  CHECK_EQ(output.size(), N * K);
+  cudaStream_t stream = config ? config->stream : nullptr;
+  float* output_ptr = const_cast<float*>(output.ptr<float>());
+  if (N > 1 && config && config->blas_handle && has_fp8_tensor_cores(config)) {
+    tensor::Tensor gate_up(base::DataType::kDataTypeFp32, N, 2 * K, true,
+                           base::CUDADeviceAllocatorFactory::get_instance());
+    if (blas_gemm_fp8(input, weight, scale, gate_up.ptr<float>(), N, M, 2 * K, config)) {
+      constexpr int thread_num = 256;
+      const int block_num = (N * K + thread_num - 1) / thread_num;
+      swiglu_rows_kernel_cu_fp32<<<block_num, thread_num, 0, stream>>>(gate_up.ptr<float>(),
+                                                                        output_ptr, N, K);
+      return;
+    }
   }
+  constexpr int out_per_block = kFp8WarpNum * kFp8OutPerWarp;
+  dim3 grid((K + out_per_block - 1) / out_per_block, N);
+  matmul_swiglu_kernel_cu_fp8<kFp8OutPerWarp><<<grid, kFp8WarpNum * 32, 0, stream>>>(
+      input.ptr<float>(), reinterpret_cast<const uint8_t*>(weight.ptr<int8_t>()),
+      scale.ptr<float>(), output_ptr, M, K);
 }
-}  // namespace kernel
\ No newline at end of file
+}  // namespace kernel
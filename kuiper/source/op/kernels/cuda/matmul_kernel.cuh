@@ -3,6 +3,15 @@
 #include "../kernels_interface.h"
 #include "tensor/tensor.h"
 namespace kernel {
+// output: [N, K] = input: [N, M] @ weight: [K, M]^T + bias with one block for row_per_block rows
+// of the fp32, fp16 or bf16 weight
+void gemv_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& weight,
+                    const tensor::Tensor& output, const GemvLaunch& launch, cudaStream_t stream,
+                    const float* bias = nullptr);
+
+// the launches the matmul tuner times for a weight shape
+const std::vector<GemvLaunch>& gemv_launch_candidates();
+
 void matmul_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& weight,
                       const tensor::Tensor& output, float scale = 1.f,
                       const CudaConfig* config = nullptr);
@@ -10,6 +19,72 @@ void matmul_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& weight,
 void matmul_kernel_cu_qint8(const tensor::Tensor& input, const tensor::Tensor& weight,
                             const tensor::Tensor& output, int32_t group_size,
                             const tensor::Tensor& scale, const CudaConfig* config = nullptr);
+
+// the matmuls with the bias added in their epilogue
+void matmul_bias_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& weight,
+                           const tensor::Tensor& bias, const tensor::Tensor& output,
+                           const CudaConfig* config);
+
+void matmul_bias_kernel_cu_qint8(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                 const tensor::Tensor& bias, const tensor::Tensor& output,
+                                 int32_t group_size, const tensor::Tensor& scale,
+                                 const CudaConfig* config);
+
+void matmul_swiglu_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& weight,
+                             const tensor::Tensor& output, const CudaConfig* config);
+
+void matmul_swiglu_kernel_cu_qint8(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                   const tensor::Tensor& output, int32_t group_size,
+                                   const tensor::Tensor& scale, const CudaConfig* config);
+
+// the rows of a tile of the tiled int8 layout
+constexpr int32_t kInt8TileRows = 4;
+
+// the int8 weight has rows in whole tiles and the shape of the dp4a kernels, and the scales
+// follow its rows
+bool can_tile_int8_weight(const tensor::Tensor& weight, int32_t group_size,
+                          const tensor::Tensor& scale);
+
+// rearranges the row major int8 weight [K, M] and its scales in place into the tiled layout of
+// the tiled kernels, the rows r of a part of the weight stay in its range when r is a multiple
+// of kInt8TileRows
+void tile_int8_weight_cu(const tensor::Tensor& weight, int32_t group_size,
+                         const tensor::Tensor& scale, cudaStream_t stream);
+
+// the int8 matmuls of a weight in the tiled layout
+void matmul_kernel_cu_qint8_tiled(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                  const tensor::Tensor& output, int32_t group_size,
+                                  const tensor::Tensor& scale, const CudaConfig* config);
+
+void matmul_bias_kernel_cu_qint8_tiled(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                       const tensor::Tensor& bias, const tensor::Tensor& output,
+                                       int32_t group_size, const tensor::Tensor& scale,
+                                       const CudaConfig* config);
+
+void matmul_swiglu_kernel_cu_qint8_tiled(const tensor::Tensor& input,
+                                         const tensor::Tensor& weight,
+                                         const tensor::Tensor& output, int32_t group_size,
+                                         const tensor::Tensor& scale, const CudaConfig* config);
+
+void matmul_kernel_cu_qint4(const tensor::Tensor& input, const tensor::Tensor& weight,
+                            const tensor::Tensor& output, int32_t group_size,
+                            const tensor::Tensor& scale, const tensor::Tensor& zero_point,
+                            const CudaConfig* config);
+
+void matmul_swiglu_kernel_cu_qint4(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                   const tensor::Tensor& output, int32_t group_size,
+                                   const tensor::Tensor& scale, const tensor::Tensor& zero_point,
+                                   const CudaConfig* config);
+
+// weight: [K, M] e4m3, scale: one fp32 scale per weight row. Several input rows run as a
+// cublaslt fp8 gemm on sm89 and later, a single one as a gemv
+void matmul_kernel_cu_fp8(const tensor::Tensor& input, const tensor::Tensor& weight,
+                          const tensor::Tensor& output, int32_t group_size,
+                          const tensor::Tensor& scale, const CudaConfig* config);
+
+void matmul_swiglu_kernel_cu_fp8(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                 const tensor::Tensor& output, int32_t group_size,
+                                 const tensor::Tensor& scale, const CudaConfig* config);
 }  // namespace kernel
 
 #endif  // MATMUL_KERNEL_CU_CUH
@@ -0,0 +1,255 @@
+#include <cooperative_groups.h>
+#include <cub/cub.cuh>
+#include "megakernel.cuh"
+#include "rope_math.cuh"
+namespace kernel {
+namespace cg = cooperative_groups;
+constexpr static int mega_thread_num = 256;
+constexpr static int mega_warp_num = mega_thread_num / 32;
+
+#ifdef QWEN2_SUPPORT
+constexpr static float mega_eps = 1e-6f;
+#else
+constexpr static float mega_eps = 1e-5f;
+#endif
+
+using MegaReduce = cub::BlockReduce<float, mega_thread_num>;
+
+struct MegaShared {
+  MegaReduce::TempStorage temp;
+  float value;
+};
+
+__device__ __forceinline__ float mega_block_sum(float value, MegaShared& shared) {
+  value = MegaReduce(shared.temp).Sum(value);
+  if (threadIdx.x == 0) {
+    shared.value = value;
+  }
+  __syncthreads();
+  value = shared.value;
+  __syncthreads();
+  return value;
+}
+
+__device__ __forceinline__ float mega_block_max(float value, MegaShared& shared) {
+  value = MegaReduce(shared.temp).Reduce(value, cub::Max());
+  if (threadIdx.x == 0) {
+    shared.value = value;
+  }
+  __syncthreads();
+  value = shared.value;
+  __syncthreads();
+  return value;
+}
+
+__device__ __forceinline__ int mega_physical_pos(const MegakernelParams& params, int t) {
+  const int cache_pos = params.window.cache_pos(t);
+  if (!params.block_table) {
+    return cache_pos;
+  }
+  return params.block_table[cache_pos / params.block_size] * params.block_size +
+         cache_pos % params.block_size;
+}
+
+// every block reduces the whole input, the input is a few thousand floats and it saves a
+// barrier, then the blocks normalize their slices of it
+__device__ void mega_rmsnorm(const MegaStep& step, const float* input, float* output,
+                             MegaShared& shared) {
+  float sum = 0.f;
+  for (int i = threadIdx.x; i < step.cols; i += blockDim.x) {
+    sum += input[i] * input[i];
+  }
+  sum = mega_block_sum(sum, shared);
+  const float scale = rsqrtf(sum / static_cast<float>(step.cols) + mega_eps);
+  for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < step.cols;
+       i += gridDim.x * blockDim.x) {
+    output[i] = input[i] * scale * step.weight[i];
+  }
+}
+
+// the dot product of a weight row with the input, summed over the warp. The lanes read the
+// row four floats at a time
+__device__ __forceinline__ float mega_dot_row(const float* weight, int64_t row, int cols,
+                                              const float* input) {
+  const float4* weight4 = reinterpret_cast<const float4*>(weight + row * cols);
+  const float4* input4 = reinterpret_cast<const float4*>(input);
+  float sum = 0.f;
+  for (int i = threadIdx.x % 32; i < cols / 4; i += 32) {
+    const float4 w = weight4[i];
+    const float4 x = input4[i];
+    sum += w.x * x.x + w.y * x.y + w.z * x.z + w.w * x.w;
+  }
+#pragma unroll
+  for (int offset = 16; offset > 0; offset /= 2) {
+    sum += __shfl_xor_sync(0xffffffff, sum, offset);
+  }
+  return sum;
+}
+
+// one warp per output row
+template <bool kSwiGLU>
+__device__ void mega_matmul(const MegaStep& step, const float* input, float* output) {
+  for (int row = blockIdx.x * mega_warp_num + threadIdx.x / 32; row < step.rows;
+       row += gridDim.x * mega_warp_num) {
+    float value = mega_dot_row(step.weight, row, step.cols, input);
+    if (kSwiGLU) {
+      const float up = mega_dot_row(step.weight, step.rows + row, step.cols, input);
+      value = value / (1.f + expf(-value)) * up;
+    } else if (step.bias) {
+      value += step.bias[row];
+    }
+    if (threadIdx.x % 32 == 0) {
+      output[row] = value;
+    }
+  }
+}
+
+template <bool kRotateHalf>
+__device__ void mega_rope(const MegakernelParams& params, const MegaStep& step, int pos) {
+  for (int pair = blockIdx.x * blockDim.x + threadIdx.x; pair < params.dim / 2;
+       pair += gridDim.x * blockDim.x) {
+    int v0_idx = 0;
+    int v1_idx = 0;
+    int freq_idx = 0;
+    rope_pair<kRotateHalf>(pair, params.head_size, &v0_idx, &v1_idx, &freq_idx);
+    float fci = 0.f;
+    float fcr = 0.f;
+    rope_sin_cos(pos, freq_idx, params.sin_cache, params.cos_cache, &fci, &fcr);
+    const float q0 = step.output[v0_idx];
+    const float q1 = step.output[v1_idx];
+    step.output[v0_idx] = fcr * q0 - fci * q1;
+    step.output[v1_idx] = fcr * q1 + fci * q0;
+    if (v1_idx < params.kv_dim) {
+      const float k0 = step.output2[v0_idx];
+      const float k1 = step.output2[v1_idx];
+      step.output2[v0_idx] = fcr * k0 - fci * k1;
+      step.output2[v1_idx] = fcr * k1 + fci * k0;
+    }
+  }
+}
+
+__device__ void mega_kv_write(const MegakernelParams& params, const MegaStep& step, int pos) {
+  const int64_t offset = static_cast<int64_t>(mega_physical_pos(params, pos)) * params.kv_dim;
+  for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < params.kv_dim;
+       i += gridDim.x * blockDim.x) {
+    step.key_cache[offset + i] = step.input[i];
+    step.value_cache[offset + i] = step.input2[i];
+  }
+}
+
+// the blocks take the heads in turn, a head is scored, normalized and weighted by one block
+__device__ void mega_attention(const MegakernelParams& params, const MegaStep& step, int pos,
+                               MegaShared& shared) {
+  const int head_size = params.head_size;
+  const int attended_num = params.window.attended_num(pos);
+  const float scale = 1.f / sqrtf(static_cast<float>(head_size));
+  for (int head = blockIdx.x; head < params.head_num; head += gridDim.x) {
+    const float* query_head = step.input + head * head_size;
+    const int head_offset = (head / params.kv_mul) * head_size;
+    float* score_head = params.score + static_cast<int64_t>(head) * params.seq_len;
+    float max_val = -FLT_MAX;
+    for (int t = threadIdx.x; t < attended_num; t += blockDim.x) {
+      const float* key = step.key_cache +
+                         static_cast<int64_t>(mega_physical_pos(
+                             params, params.window.attended_pos(t, pos))) *
+                             params.kv_dim +
+                         head_offset;
+      float score = 0.f;
+      for (int i = 0; i < head_size; ++i) {
+        score += key[i] * query_head[i];
+      }
+      score *= scale;
+      score_head[t] = score;
+      max_val = fmaxf(max_val, score);
+    }
+    max_val = mega_block_max(max_val, shared);
+    float sum = 0.f;
+    for (int t = threadIdx.x; t < attended_num; t += blockDim.x) {
+      const float prob = expf(score_head[t] - max_val);
+      score_head[t] = prob;
+      sum += prob;
+    }
+    const float inv_sum = 1.f / mega_block_sum(sum, shared);
+    for (int i = threadIdx.x; i < head_size; i += blockDim.x) {
+      float value = 0.f;
+      for (int t = 0; t < attended_num; ++t) {
+        const float* value_row = step.value_cache +
+                                 static_cast<int64_t>(mega_physical_pos(
+                                     params, params.window.attended_pos(t, pos))) *
+                                     params.kv_dim +
+                                 head_offset;
+        value += score_head[t] * value_row[i];
+      }
+      step.output[head * head_size + i] = value * inv_sum;
+    }
+    __syncthreads();
+  }
+}
+
+__global__ void __launch_bounds__(mega_thread_num) decode_megakernel(MegakernelParams params) {
+  cg::grid_group grid = cg::this_grid();
+  __shared__ MegaShared shared;
+  const int pos = params.pos_ptr ? *params.pos_ptr : params.pos;
+  for (int s = 0; s < params.step_num; ++s) {
+    const MegaStep& step = params.steps[s];
+    const float* input = step.input ? step.input : params.hidden;
+    float* output = step.output ? step.output : params.hidden;
+    switch (step.op) {
+      case MegaOp::kRMSNorm:
+        mega_rmsnorm(step, input, output, shared);
+        break;
+      case MegaOp::kMatmul:
+        mega_matmul<false>(step, input, output);
+        break;
+      case MegaOp::kMatmulSwiGLU:
+        mega_matmul<true>(step, input, output);
+        break;
+      case MegaOp::kRope:
+        if (params.is_rotate_half) {
+          mega_rope<true>(params, step, pos);
+        } else {
+          mega_rope<false>(params, step, pos);
+        }
+        break;
+      case MegaOp::kKVWrite:
+        mega_kv_write(params, step, pos);
+        break;
+      case MegaOp::kAttention:
+        mega_attention(params, step, pos, shared);
+        break;
+      case MegaOp::kAdd:
+        for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < step.cols;
+             i += gridDim.x * blockDim.x) {
+          output[i] += input[i];
+        }
+        break;
+    }
+    grid.sync();
+  }
+}
+
+int32_t megakernel_grid_size() {
+  int device = 0;
+  int is_cooperative = 0;
+  int sm_num = 0;
+  int block_num_per_sm = 0;
+  if (cudaGetDevice(&device) != cudaSuccess ||
+      cudaDeviceGetAttribute(&is_cooperative, cudaDevAttrCooperativeLaunch, device) !=
+          cudaSuccess ||
+      !is_cooperative ||
+      cudaDeviceGetAttribute(&sm_num, cudaDevAttrMultiProcessorCount, device) != cudaSuccess ||
+      cudaOccupancyMaxActiveBlocksPerMultiprocessor(&block_num_per_sm, decode_megakernel,
+                                                    mega_thread_num, 0) != cudaSuccess) {
+    return 0;
+  }
+  return sm_num * block_num_per_sm;
+}
+
+cudaError_t launch_megakernel(const MegakernelParams& params, int32_t grid_size,
+                              cudaStream_t stream) {
+  MegakernelParams launch_params = params;
+  void* args[] = {&launch_params};
+  return cudaLaunchCooperativeKernel(reinterpret_cast<void*>(decode_megakernel), grid_size,
+                                     mega_thread_num, args, 0, stream);
+}
+}  // namespace kernel
@@ -0,0 +1,72 @@
+#ifndef MEGAKERNEL_CUH
+#define MEGAKERNEL_CUH
+#include <base/attention_window.h>
+#include <cuda_runtime_api.h>
+#include <cstdint>
+namespace kernel {
+enum class MegaOp : int32_t {
+  // output = rmsnorm(input) * weight over cols elements, output is not input
+  kRMSNorm = 0,
+  // output[rows] = weight[rows, cols] @ input[cols] + bias
+  kMatmul = 1,
+  // output[rows] = silu(gate) * up of the rows p and rows + p of weight[2 * rows, cols]
+  kMatmulSwiGLU = 2,
+  // output is the query and output2 the key, rotated at the position of the launch
+  kRope = 3,
+  // input and input2 are stored into the caches at the position
+  kKVWrite = 4,
+  // output = attention(input) over the caches, score holds a row of seq_len per head
+  kAttention = 5,
+  // output += input over cols elements
+  kAdd = 6,
+};
+
+// One phase of the persistent decode kernel, the grid waits for it before the next one. The
+// fp32 operands are on the device, a null input or output is the hidden state of the launch
+// and the caches point at the layer of the step
+struct MegaStep {
+  MegaOp op = MegaOp::kAdd;
+  int32_t rows = 0;
+  int32_t cols = 0;
+  const float* input = nullptr;
+  const float* input2 = nullptr;
+  float* output = nullptr;
+  float* output2 = nullptr;
+  const float* weight = nullptr;
+  const float* bias = nullptr;
+  float* key_cache = nullptr;
+  float* value_cache = nullptr;
+};
+
+struct MegakernelParams {
+  // the steps of the decode in their order, on the device
+  const MegaStep* steps = nullptr;
+  int32_t step_num = 0;
+  float* hidden = nullptr;
+  // the position is read from pos_ptr when it is not null
+  int32_t pos = 0;
+  const int32_t* pos_ptr = nullptr;
+  int32_t dim = 0;
+  int32_t kv_dim = 0;
+  int32_t head_num = 0;
+  int32_t head_size = 0;
+  int32_t kv_mul = 0;
+  int32_t seq_len = 0;
+  bool is_rotate_half = false;
+  const float* sin_cache = nullptr;
+  const float* cos_cache = nullptr;
+  const int32_t* block_table = nullptr;
+  int32_t block_size = 0;
+  base::AttentionWindow window;
+  float* score = nullptr;
+};
+
+// the blocks of the cooperative grid, every block of it is resident on the device at once, 0
+// when the device can not launch a cooperative kernel
+int32_t megakernel_grid_size();
+
+// runs every step of params in one cooperative launch of grid_size blocks
+cudaError_t launch_megakernel(const MegakernelParams& params, int32_t grid_size,
+                              cudaStream_t stream);
+}  // namespace kernel
+#endif  // MEGAKERNEL_CUH
@@ -1,9 +1,23 @@
+#include <base/attention_window.h>
 #include <base/cuda_config.h>
+#include <cuda_bf16.h>
+#include <cuda_fp16.h>
+#include <base/alloc.h>
 #include <tensor/tensor.h>
 #include <cub/cub.cuh>
+#include "../kernels_interface.h"
+#include "head_size.cuh"
 #include "mha_kernel.cuh"
 namespace kernel {
 constexpr static int thread_num = 256;
+// a decode step at a position past this threshold splits the kv range across blocks
+constexpr static int split_kv_min_pos = 512;
+// the number of positions handled by one split, one score per thread
+constexpr static int split_kv_chunk = thread_num;
+// the positions of the kv tile a grouped block stages in the shared memory
+constexpr static int gqa_tile = 32;
+// the grouped kernel stays in the shared memory every device has without opting in
+constexpr static size_t gqa_max_shared_size = 48 * 1024;
 __device__ void softmax_gpu(float* __restrict__ x, int size) {
   int tid = threadIdx.x;
   int step = blockDim.x;
@@ -44,89 +58,841 @@ __device__ void softmax_gpu(float* __restrict__ x, int size) {
   }
 }
 
-__global__ void multi_head_attention_kernel(int32_t pos, int32_t seq_len, float* query,
-                                            float* score_ptr, float* output, float* key_cache,
-                                            float* value_cache, int32_t kv_dim, int32_t kv_mul,
-                                            int32_t head_num, int32_t head_size,
-                                            int32_t layer_offset) {
+__device__ __forceinline__ int physical_pos(const int32_t* block_table, int block_size, int t) {
+  if (!block_table) {
+    return t;
+  }
+  return block_table[t / block_size] * block_size + t % block_size;
+}
+
+__device__ __forceinline__ float to_float(float value) { return value; }
+
+__device__ __forceinline__ float to_float(half value) { return __half2float(value); }
+
+__device__ __forceinline__ float to_float(__nv_bfloat16 value) { return __bfloat162float(value); }
+
+__device__ __forceinline__ float to_float(int8_t value) { return static_cast<float>(value); }
+
+// the caches of the other data types have no scales
+__device__ __forceinline__ float kv_scale(const float* scale, int64_t head_offset,
+                                          int32_t head_size) {
+  return scale ? scale[head_offset / head_size] : 1.f;
+}
+
+__device__ __forceinline__ float head_dot(const float* key, const float* query, int head_size) {
+  float score = 0.0f;
+#pragma unroll
+  for (int i = 0; i < head_size; i += 4) {
+    float4 key_head_float4 = *reinterpret_cast<const float4*>(key + i);
+    float4 query_head_float4 = *reinterpret_cast<const float4*>(query + i);
+    score += key_head_float4.x * query_head_float4.x;
+    score += key_head_float4.y * query_head_float4.y;
+    score += key_head_float4.z * query_head_float4.z;
+    score += key_head_float4.w * query_head_float4.w;
+  }
+  return score;
+}
+
+// the half precision keys are loaded two at a time and accumulated in fp32
+__device__ __forceinline__ float head_dot(const half* key, const float* query, int head_size) {
+  float score = 0.0f;
+#pragma unroll
+  for (int i = 0; i < head_size; i += 4) {
+    float4 query_head_float4 = *reinterpret_cast<const float4*>(query + i);
+    float2 key01 = __half22float2(*reinterpret_cast<const half2*>(key + i));
+    float2 key23 = __half22float2(*reinterpret_cast<const half2*>(key + i + 2));
+    score += key01.x * query_head_float4.x;
+    score += key01.y * query_head_float4.y;
+    score += key23.x * query_head_float4.z;
+    score += key23.y * query_head_float4.w;
+  }
+  return score;
+}
+
+__device__ __forceinline__ float head_dot(const __nv_bfloat16* key, const float* query,
+                                          int head_size) {
+  float score = 0.0f;
+#pragma unroll
+  for (int i = 0; i < head_size; i += 4) {
+    float4 query_head_float4 = *reinterpret_cast<const float4*>(query + i);
+    float2 key01 = __bfloat1622float2(*reinterpret_cast<const __nv_bfloat162*>(key + i));
+    float2 key23 = __bfloat1622float2(*reinterpret_cast<const __nv_bfloat162*>(key + i + 2));
+    score += key01.x * query_head_float4.x;
+    score += key01.y * query_head_float4.y;
+    score += key23.x * query_head_float4.z;
+    score += key23.y * query_head_float4.w;
+  }
+  return score;
+}
+
+// the int8 keys are widened four at a time, the scale of the head is applied to the dot product
+__device__ __forceinline__ float head_dot(const int8_t* key, const float* query, int head_size) {
+  float score = 0.0f;
+#pragma unroll
+  for (int i = 0; i < head_size; i += 4) {
+    float4 query_head_float4 = *reinterpret_cast<const float4*>(query + i);
+    char4 key0123 = *reinterpret_cast<const char4*>(key + i);
+    score += static_cast<float>(key0123.x) * query_head_float4.x;
+    score += static_cast<float>(key0123.y) * query_head_float4.y;
+    score += static_cast<float>(key0123.z) * query_head_float4.z;
+    score += static_cast<float>(key0123.w) * query_head_float4.w;
+  }
+  return score;
+}
+
+template <typename T, int kHeadSize>
+__global__ void multi_head_attention_kernel(int32_t pos, const int32_t* pos_ptr,
+                                            int32_t num_tokens, int32_t seq_len, float* query,
+                                            float* score_ptr, float* output, const T* key_cache,
+                                            const T* value_cache, const float* key_scale,
+                                            const float* value_scale, int32_t kv_dim,
+                                            int32_t kv_mul, int32_t head_num, int32_t head_size,
+                                            int32_t layer_offset, const int32_t* block_table,
+                                            int32_t block_size, base::AttentionWindow window) {
   int head = blockIdx.x;
   if (head >= head_num) {
     return;
   }
+  if (pos_ptr) {
+    pos = *pos_ptr;
+  }
+  head_size = fixed_head_size<kHeadSize>(head_size);
 
   float scale = 1.f / sqrtf(head_size);
-  float* query_head = query + head * head_size;
   float* score_head = score_ptr + head * seq_len;
   int head_offset = (head / kv_mul) * head_size;
-  for (int t = threadIdx.x; t <= pos; t += blockDim.x) {
-    float* key_head = key_cache + layer_offset + t * kv_dim + head_offset;
-    /**
-     *  在Meta的Llama注意力机制实现中，head_dim等于head_size。
-     *
-     *  xq = xq.transpose(1, 2)  # 转置后形状为 (heads, sequence_length, head_dim)
-     *                            # 如果sequence_length为1，则形状简化为 (heads, head_dim)
-     *  keys = keys.transpose(1, 2)  # 同样转置keys，得到形状 (heads, sequence_length, head_dim)
-     *                              # 若sequence_length为1，则形状也简化为 (heads, head_dim)
-     *
-     *  在我们的代码实现中，计算公式为 (head / kv_mul) * head_size。
-     *  其中，在多头注意力（MHA）机制里，kv_mul的值为1，
-     *  因此计算得到的head_offset就等于head * head_size。
-     *
-     *  这里的head_offset用于定位到当前处理的头部（head），而t * kv_dim (即t *
-     * dim)则用于定位到历史的key向量。
-     */
-
-    // query @ key 逐个头相乘，从上面的代码可以看出
-    float score = 0.0f;
+  const int dim = head_num * head_size;
+  // the rows of a prompt are processed in order, row i is located at pos + i
+  for (int row = 0; row < num_tokens; ++row) {
+    const int row_pos = pos + row;
+    // the score t belongs to the t-th attended position, all of them without a window
+    const int attended_num = window.attended_num(row_pos);
+    float* query_head = query + row * dim + head * head_size;
+    for (int t = threadIdx.x; t < attended_num; t += blockDim.x) {
+      const int64_t key_offset =
+          layer_offset +
+          static_cast<int64_t>(
+              physical_pos(block_table, block_size, window.cache_index(t, row_pos))) *
+              kv_dim +
+          head_offset;
+      const T* key_head = key_cache + key_offset;
+      /**
+       *  在Meta的Llama注意力机制实现中，head_dim等于head_size。
+       *
+       *  xq = xq.transpose(1, 2)  # 转置后形状为 (heads, sequence_length, head_dim)
+       *                            # 如果sequence_length为1，则形状简化为 (heads, head_dim)
+       *  keys = keys.transpose(1, 2)  # 同样转置keys，得到形状 (heads, sequence_length, head_dim)
+       *                              # 若sequence_length为1，则形状也简化为 (heads, head_dim)
+       *
+       *  在我们的代码实现中，计算公式为 (head / kv_mul) * head_size。
+       *  其中，在多头注意力（MHA）机制里，kv_mul的值为1，
+       *  因此计算得到的head_offset就等于head * head_size。
+       *
+       *  这里的head_offset用于定位到当前处理的头部（head），而t * kv_dim (即t *
+       * dim)则用于定位到历史的key向量。
+       */
+
+      // query @ key 逐个头相乘，从上面的代码可以看出
+      float score = head_dot(key_head, query_head, head_size);
+      score *= scale * kv_scale(key_scale, key_offset, head_size);
+      score_head[t] = score;
+    }
+    __syncthreads();
+
+    softmax_gpu(score_head, attended_num);
+    __syncthreads();
+
+    float* output_head = output + row * dim + head * head_size;
+    for (int i = threadIdx.x; i < head_size; i += blockDim.x) {
+      float value = 0.0f;
+#pragma unroll
+      for (int t = 0; t < attended_num; t++) {
+        const int64_t value_offset =
+            layer_offset +
+            static_cast<int64_t>(
+                physical_pos(block_table, block_size, window.cache_index(t, row_pos))) *
+                kv_dim +
+            head_offset;
+        float score = score_head[t] * kv_scale(value_scale, value_offset, head_size);
+        value += score * to_float(value_cache[value_offset + i]);
+      }
+      output_head[i] = value;
+    }
+    __syncthreads();
+  }
+}
+
+// The head major cache keeps the positions of a kv head together, [layer, kv_head, cache_len,
+// head_size], so the lanes of a warp read one position as a contiguous run of the head. Each warp
+// takes every warp_num-th attended position, its dot product is reduced with shuffles, and the
+// weighted values are summed per warp in the shared memory before the warps are combined.
+template <typename T, int kHeadSize>
+__global__ void head_major_attention_kernel(int32_t pos, const int32_t* pos_ptr,
+                                            int32_t num_tokens, int32_t seq_len, float* query,
+                                            float* score_ptr, float* output, const T* key_cache,
+                                            const T* value_cache, int32_t cache_len,
+                                            int32_t kv_mul, int32_t head_num, int32_t head_size,
+                                            int64_t layer_offset, const int32_t* block_table,
+                                            int32_t block_size, base::AttentionWindow window) {
+  const int head = blockIdx.x;
+  if (head >= head_num) {
+    return;
+  }
+  if (pos_ptr) {
+    pos = *pos_ptr;
+  }
+  head_size = fixed_head_size<kHeadSize>(head_size);
+  const int lane = threadIdx.x % warpSize;
+  const int warp = threadIdx.x / warpSize;
+  const int warp_num = blockDim.x / warpSize;
+  extern __shared__ float head_major_shared[];
+  float* query_head = head_major_shared;
+  float* partial_out = query_head + head_size;
+
+  const float scale = 1.f / sqrtf(head_size);
+  float* score_head = score_ptr + head * seq_len;
+  const int64_t head_offset =
+      layer_offset + static_cast<int64_t>(head / kv_mul) * cache_len * head_size;
+  const T* key_head_cache = key_cache + head_offset;
+  const T* value_head_cache = value_cache + head_offset;
+  const int dim = head_num * head_size;
+  for (int row = 0; row < num_tokens; ++row) {
+    const int row_pos = pos + row;
+    const int attended_num = window.attended_num(row_pos);
+    for (int i = threadIdx.x; i < head_size; i += blockDim.x) {
+      query_head[i] = query[row * dim + head * head_size + i];
+    }
+    __syncthreads();
+
+    for (int t = warp; t < attended_num; t += warp_num) {
+      const T* key = key_head_cache +
+                     static_cast<int64_t>(physical_pos(block_table, block_size,
+                                                       window.cache_index(t, row_pos))) *
+                         head_size;
+      float score = 0.0f;
+      for (int i = lane; i < head_size; i += warpSize) {
+        score += to_float(key[i]) * query_head[i];
+      }
 #pragma unroll
-    for (int i = 0; i < head_size; i += 4) {
-      float4 key_head_float4 = *reinterpret_cast<float4*>(key_head + i);
-      float4 query_head_float4 = *reinterpret_cast<float4*>(query_head + i);
-      score += key_head_float4.x * query_head_float4.x;
-      score += key_head_float4.y * query_head_float4.y;
-      score += key_head_float4.z * query_head_float4.z;
-      score += key_head_float4.w * query_head_float4.w;
+      for (int offset = 16; offset > 0; offset /= 2) {
+        score += __shfl_xor_sync(0xffffffff, score, offset);
+      }
+      if (lane == 0) {
+        score_head[t] = score * scale;
+      }
+    }
+    __syncthreads();
+
+    softmax_gpu(score_head, attended_num);
+    __syncthreads();
+
+    for (int i = lane; i < head_size; i += warpSize) {
+      float value = 0.0f;
+      for (int t = warp; t < attended_num; t += warp_num) {
+        const T* value_row = value_head_cache +
+                             static_cast<int64_t>(physical_pos(block_table, block_size,
+                                                               window.cache_index(t, row_pos))) *
+                                 head_size;
+        value += score_head[t] * to_float(value_row[i]);
+      }
+      partial_out[warp * head_size + i] = value;
+    }
+    __syncthreads();
+
+    float* output_head = output + row * dim + head * head_size;
+    for (int i = threadIdx.x; i < head_size; i += blockDim.x) {
+      float value = 0.0f;
+      for (int w = 0; w < warp_num; ++w) {
+        value += partial_out[w * head_size + i];
+      }
+      output_head[i] = value;
+    }
+    __syncthreads();
+  }
+}
+
+static size_t head_major_shared_size(int32_t head_size) {
+  return (thread_num / 32 + 1) * head_size * sizeof(float);
+}
+
+// the tile rows are padded by one float, so the threads of a warp which read the same column of
+// consecutive positions hit different banks
+__device__ __forceinline__ int gqa_tile_stride(int head_size) { return head_size + 1; }
+
+// the tile holds the attended positions [start, start + tile_len) of row_pos
+template <typename T>
+__device__ void load_kv_tile(const T* cache, const float* cache_scale, float* tile, int start,
+                             int tile_len, int row_pos, int64_t head_offset, int32_t kv_dim,
+                             int32_t head_size, const int32_t* block_table, int32_t block_size,
+                             const base::AttentionWindow& window) {
+  const int stride = gqa_tile_stride(head_size);
+  for (int idx = threadIdx.x; idx < tile_len * head_size; idx += blockDim.x) {
+    const int t = idx / head_size;
+    const int i = idx % head_size;
+    const int cache_pos = window.cache_index(start + t, row_pos);
+    const int64_t offset =
+        head_offset + static_cast<int64_t>(physical_pos(block_table, block_size, cache_pos)) *
+                          kv_dim;
+    tile[t * stride + i] = to_float(cache[offset + i]) * kv_scale(cache_scale, offset, head_size);
+  }
+}
+
+// One block per kv head runs the kv_mul query heads which share it, so every key and value of
+// the head is read from the global memory once per row instead of once per query head. The
+// keys and values are staged tile by tile in the shared memory next to the queries of the group
+// and their outputs, the scores keep the [head_num, seq_len] layout of the per head kernel.
+template <typename T, int kHeadSize>
+__global__ void grouped_query_attention_kernel(
+    int32_t pos, const int32_t* pos_ptr, int32_t num_tokens, int32_t seq_len, float* query,
+    float* score_ptr, float* output, const T* key_cache, const T* value_cache,
+    const float* key_scale, const float* value_scale, int32_t kv_dim, int32_t kv_mul,
+    int32_t head_num, int32_t head_size, int32_t layer_offset, const int32_t* block_table,
+    int32_t block_size, base::AttentionWindow window) {
+  const int first_head = blockIdx.x * kv_mul;
+  if (first_head >= head_num) {
+    return;
+  }
+  if (pos_ptr) {
+    pos = *pos_ptr;
+  }
+  head_size = fixed_head_size<kHeadSize>(head_size);
+  const int group_size = kv_mul * head_size;
+  const int stride = gqa_tile_stride(head_size);
+  extern __shared__ float gqa_shared[];
+  float* query_group = gqa_shared;
+  float* output_group = query_group + group_size;
+  float* kv_tile = output_group + group_size;
+
+  const float scale = 1.f / sqrtf(head_size);
+  const int64_t head_offset = layer_offset + blockIdx.x * head_size;
+  const int dim = head_num * head_size;
+  for (int row = 0; row < num_tokens; ++row) {
+    const int row_pos = pos + row;
+    const int attended_num = window.attended_num(row_pos);
+    // the query heads of a group are adjacent
+    const float* query_row = query + row * dim + first_head * head_size;
+    for (int i = threadIdx.x; i < group_size; i += blockDim.x) {
+      query_group[i] = query_row[i];
+      output_group[i] = 0.f;
+    }
+
+    for (int start = 0; start < attended_num; start += gqa_tile) {
+      const int tile_len = min(gqa_tile, attended_num - start);
+      __syncthreads();
+      load_kv_tile(key_cache, key_scale, kv_tile, start, tile_len, row_pos, head_offset, kv_dim,
+                   head_size, block_table, block_size, window);
+      __syncthreads();
+      for (int idx = threadIdx.x; idx < kv_mul * tile_len; idx += blockDim.x) {
+        const int h = idx / tile_len;
+        const int t = idx % tile_len;
+        const float* key = kv_tile + t * stride;
+        const float* query_head = query_group + h * head_size;
+        float score = 0.0f;
+        for (int i = 0; i < head_size; ++i) {
+          score += key[i] * query_head[i];
+        }
+        score_ptr[(first_head + h) * seq_len + start + t] = score * scale;
+      }
+    }
+    __syncthreads();
+    for (int h = 0; h < kv_mul; ++h) {
+      softmax_gpu(score_ptr + (first_head + h) * seq_len, attended_num);
+      __syncthreads();
+    }
+
+    for (int start = 0; start < attended_num; start += gqa_tile) {
+      const int tile_len = min(gqa_tile, attended_num - start);
+      __syncthreads();
+      load_kv_tile(value_cache, value_scale, kv_tile, start, tile_len, row_pos, head_offset,
+                   kv_dim, head_size, block_table, block_size, window);
+      __syncthreads();
+      // an output element always belongs to the same thread, so it is accumulated in place
+      for (int idx = threadIdx.x; idx < group_size; idx += blockDim.x) {
+        const int h = idx / head_size;
+        const int i = idx % head_size;
+        const float* prob = score_ptr + (first_head + h) * seq_len + start;
+        float value = output_group[idx];
+        for (int t = 0; t < tile_len; ++t) {
+          value += prob[t] * kv_tile[t * stride + i];
+        }
+        output_group[idx] = value;
+      }
+    }
+    float* output_row = output + row * dim + first_head * head_size;
+    for (int i = threadIdx.x; i < group_size; i += blockDim.x) {
+      output_row[i] = output_group[i];
     }
+    __syncthreads();
+  }
+}
+
+static size_t gqa_shared_size(int32_t kv_mul, int32_t head_size) {
+  return (2 * kv_mul * head_size + gqa_tile * (head_size + 1)) * sizeof(float);
+}
 
-    score *= scale;
-    score_head[t] = score;
+// Flash decoding, the kv range of every head is split into chunks of split_kv_chunk positions.
+// Each block computes the scores of one chunk, the local max, the local exp sum and the
+// un-normalized weighted sum of the values. The partial results are merged by the reduce kernel.
+template <typename T, int kHeadSize>
+__global__ void split_kv_attention_kernel(int32_t pos, float* query, const T* key_cache,
+                                          const T* value_cache, const float* key_scale,
+                                          const float* value_scale, float* partial_out,
+                                          float* partial_max, float* partial_sum, int32_t kv_dim,
+                                          int32_t kv_mul, int32_t head_num, int32_t head_size,
+                                          int32_t layer_offset, const int32_t* block_table,
+                                          int32_t block_size, base::AttentionWindow window) {
+  const int head = blockIdx.x;
+  const int split = blockIdx.y;
+  const int split_num = gridDim.y;
+  if (head >= head_num) {
+    return;
+  }
+  head_size = fixed_head_size<kHeadSize>(head_size);
+  // the chunks split the attended positions, all of [0, pos] without a window
+  const int start = split * split_kv_chunk;
+  const int end = min(start + split_kv_chunk, window.attended_num(pos));
+  const int head_offset = (head / kv_mul) * head_size;
+  const float* query_head = query + head * head_size;
+  const float scale = 1.f / sqrtf(head_size);
+
+  __shared__ float prob[split_kv_chunk];
+  __shared__ float shared_val;
+  using BlockReduce = cub::BlockReduce<float, thread_num>;
+  __shared__ BlockReduce::TempStorage temp;
+
+  const int t = start + threadIdx.x;
+  float score = -FLT_MAX;
+  if (t < end) {
+    const int64_t key_offset =
+        layer_offset +
+        static_cast<int64_t>(physical_pos(block_table, block_size, window.cache_index(t, pos))) *
+            kv_dim +
+        head_offset;
+    score = head_dot(key_cache + key_offset, query_head, head_size) * scale *
+            kv_scale(key_scale, key_offset, head_size);
+  }
+  float max_val = BlockReduce(temp).Reduce(score, cub::Max());
+  if (threadIdx.x == 0) {
+    shared_val = max_val;
   }
   __syncthreads();
+  max_val = shared_val;
 
-  softmax_gpu(score_head, pos + 1);
+  const float p = t < end ? expf(score - max_val) : 0.f;
+  prob[threadIdx.x] = p;
   __syncthreads();
+  float sum = BlockReduce(temp).Sum(p);
 
-  float* output_head = output + head * head_size;
+  const int partial_idx = head * split_num + split;
+  if (threadIdx.x == 0) {
+    partial_max[partial_idx] = max_val;
+    partial_sum[partial_idx] = sum;
+  }
   for (int i = threadIdx.x; i < head_size; i += blockDim.x) {
     float value = 0.0f;
-#pragma unroll
-    for (int t = 0; t <= pos; t++) {
-      float* value_head = value_cache + layer_offset + t * kv_dim + head_offset;
-      float score = score_head[t];
-      value += score * value_head[i];
+    for (int k = start; k < end; ++k) {
+      const int64_t value_offset =
+          layer_offset +
+          static_cast<int64_t>(physical_pos(block_table, block_size, window.cache_index(k, pos))) *
+              kv_dim +
+          head_offset;
+      value += prob[k - start] * kv_scale(value_scale, value_offset, head_size) *
+               to_float(value_cache[value_offset + i]);
+    }
+    partial_out[partial_idx * head_size + i] = value;
+  }
+}
+
+__global__ void split_kv_reduce_kernel(int32_t split_num, int32_t head_size,
+                                       const float* partial_out, const float* partial_max,
+                                       const float* partial_sum, float* output) {
+  const int head = blockIdx.x;
+  const float* head_max = partial_max + head * split_num;
+  const float* head_sum = partial_sum + head * split_num;
+  float max_val = -FLT_MAX;
+  for (int s = 0; s < split_num; ++s) {
+    max_val = fmaxf(max_val, head_max[s]);
+  }
+  float sum = 0.0f;
+  for (int s = 0; s < split_num; ++s) {
+    sum += expf(head_max[s] - max_val) * head_sum[s];
+  }
+  for (int i = threadIdx.x; i < head_size; i += blockDim.x) {
+    float value = 0.0f;
+    for (int s = 0; s < split_num; ++s) {
+      value += expf(head_max[s] - max_val) * partial_out[(head * split_num + s) * head_size + i];
     }
-    output_head[i] = value;
+    output[head * head_size + i] = value / sum;
   }
 }
 
+template <typename T, int kHeadSize>
+static void split_kv_attention(int32_t pos, int32_t head_num, int32_t kv_dim, int32_t kv_mul,
+                               int32_t head_size, int32_t layer_offset, float* query,
+                               float* output, const T* key_cache, const T* value_cache,
+                               const float* key_scale, const float* value_scale,
+                               const int32_t* block_table, int32_t block_size,
+                               const base::AttentionWindow& window, cudaStream_t stream) {
+  const int32_t split_num = (window.attended_num(pos) + split_kv_chunk - 1) / split_kv_chunk;
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  // the workspace goes back to the allocator after the launch, the kernels on the same stream
+  // are finished before it is handed out again
+  tensor::Tensor partial_out(base::DataType::kDataTypeFp32, head_num * split_num * head_size,
+                             true, alloc_cu);
+  tensor::Tensor partial_max(base::DataType::kDataTypeFp32, head_num * split_num, true, alloc_cu);
+  tensor::Tensor partial_sum(base::DataType::kDataTypeFp32, head_num * split_num, true, alloc_cu);
+
+  dim3 grid(head_num, split_num);
+  split_kv_attention_kernel<T, kHeadSize><<<grid, thread_num, 0, stream>>>(
+      pos, query, key_cache, value_cache, key_scale, value_scale, partial_out.ptr<float>(),
+      partial_max.ptr<float>(),
+      partial_sum.ptr<float>(), kv_dim, kv_mul, head_num, head_size, layer_offset, block_table,
+      block_size, window);
+  split_kv_reduce_kernel<<<head_num, 128, 0, stream>>>(split_num, head_size,
+                                                       partial_out.ptr<float>(),
+                                                       partial_max.ptr<float>(),
+                                                       partial_sum.ptr<float>(), output);
+}
+
 void mha_kernel_cu(int32_t pos, int32_t head_num, int32_t layer_index, int32_t seq_len,
-                   int32_t kv_dim, int32_t kv_mul, int32_t head_size, const tensor::Tensor& mha_out,
-                   const tensor::Tensor& query_tensor, const tensor::Tensor& score_tensor,
-                   const tensor::Tensor& key_cache_tensor, const tensor::Tensor& value_cache_tensor,
+                   int32_t kv_dim, int32_t kv_mul, int32_t head_size, int32_t block_size,
+                   const tensor::Tensor& mha_out, const tensor::Tensor& query_tensor,
+                   const tensor::Tensor& score_tensor, const tensor::Tensor& key_cache_tensor,
+                   const tensor::Tensor& value_cache_tensor,
+                   const tensor::Tensor& key_scale_tensor,
+                   const tensor::Tensor& value_scale_tensor, const tensor::Tensor& block_table,
+                   const tensor::Tensor& pos_tensor, const base::AttentionWindow& window,
                    base::DeviceType device_type, CudaConfig* config) {
   UNUSED(device_type);
-  int32_t layer_offset = layer_index * seq_len * kv_dim;
+  // the cache is [layer_num, cache_len, kv_dim], cache_len is the capacity of the block pool,
+  // or [layer_num, kv_head_num, cache_len, head_size] when it is head major
+  const bool is_head_major = key_cache_tensor.dims_size() == 4;
+  CHECK(is_head_major || key_cache_tensor.dims_size() == 3);
+  const int32_t cache_len = key_cache_tensor.get_dim(is_head_major ? 2 : 1);
+  int32_t layer_offset = layer_index * cache_len * kv_dim;
   float* query = const_cast<float*>(query_tensor.ptr<float>());
   float* score = const_cast<float*>(score_tensor.ptr<float>());
   float* output = const_cast<float*>(mha_out.ptr<float>());
 
-  float* key_cache = const_cast<float*>(key_cache_tensor.ptr<float>());
-  float* value_cache = const_cast<float*>(value_cache_tensor.ptr<float>());
+  const int32_t* block_table_ptr = block_table.is_empty() ? nullptr : block_table.ptr<int32_t>();
+  // a position on the device overrides pos, the launch does not depend on it any more
+  const int32_t* pos_ptr = pos_tensor.is_empty() ? nullptr : pos_tensor.ptr<int32_t>();
 
+  const int32_t num_tokens = query_tensor.dims_size() == 2 ? query_tensor.get_dim(0) : 1;
   cudaStream_t stream = config->stream;
-  multi_head_attention_kernel<<<head_num, thread_num, 0, stream>>>(
-      pos, seq_len, query, score, output, key_cache, value_cache, kv_dim, kv_mul, head_num,
-      head_size, layer_offset);
+  const base::DataType cache_data_type = key_cache_tensor.data_type();
+  // the int8 rows carry one scale per head, the other data types are read as they are
+  const float* key_scale = nullptr;
+  const float* value_scale = nullptr;
+  if (cache_data_type == base::DataType::kDataTypeInt8) {
+    CHECK(!key_scale_tensor.is_empty() && !value_scale_tensor.is_empty());
+    key_scale = key_scale_tensor.ptr<float>();
+    value_scale = value_scale_tensor.ptr<float>();
+  }
+  CHECK(!is_head_major || cache_data_type != base::DataType::kDataTypeInt8)
+      << "The head major kv cache has no scales.";
+  auto launch = [&](auto type_tag, auto fixed_size) {
+    using T = decltype(type_tag);
+    constexpr int kHeadSize = decltype(fixed_size)::value;
+    const T* key_cache = key_cache_tensor.ptr<T>();
+    const T* value_cache = value_cache_tensor.ptr<T>();
+    if (is_head_major) {
+      head_major_attention_kernel<T, kHeadSize>
+          <<<head_num, thread_num, head_major_shared_size(head_size), stream>>>(
+              pos, pos_ptr, num_tokens, seq_len, query, score, output, key_cache, value_cache,
+              cache_len, kv_mul, head_num, head_size, layer_offset, block_table_ptr, block_size,
+              window);
+    } else if (num_tokens == 1 && !pos_ptr && window.attended_num(pos) > split_kv_min_pos) {
+      // one block per head leaves most of the device idle on long contexts
+      split_kv_attention<T, kHeadSize>(pos, head_num, kv_dim, kv_mul, head_size, layer_offset,
+                                       query, output, key_cache, value_cache, key_scale,
+                                       value_scale, block_table_ptr, block_size, window, stream);
+    } else if (kv_mul > 1 && gqa_shared_size(kv_mul, head_size) <= gqa_max_shared_size) {
+      grouped_query_attention_kernel<T, kHeadSize>
+          <<<head_num / kv_mul, thread_num, gqa_shared_size(kv_mul, head_size), stream>>>(
+              pos, pos_ptr, num_tokens, seq_len, query, score, output, key_cache, value_cache,
+              key_scale, value_scale, kv_dim, kv_mul, head_num, head_size, layer_offset,
+              block_table_ptr, block_size, window);
+    } else {
+      multi_head_attention_kernel<T, kHeadSize><<<head_num, thread_num, 0, stream>>>(
+          pos, pos_ptr, num_tokens, seq_len, query, score, output, key_cache, value_cache,
+          key_scale, value_scale, kv_dim, kv_mul, head_num, head_size, layer_offset,
+          block_table_ptr, block_size, window);
+    }
+  };
+  auto launch_type = [&](auto type_tag) {
+    dispatch_head_size(head_size, [&](auto fixed_size) { launch(type_tag, fixed_size); });
+  };
+  if (cache_data_type == base::DataType::kDataTypeFp16) {
+    launch_type(half{});
+  } else if (cache_data_type == base::DataType::kDataTypeBf16) {
+    launch_type(__nv_bfloat16{});
+  } else if (cache_data_type == base::DataType::kDataTypeInt8) {
+    launch_type(int8_t{});
+  } else {
+    launch_type(float{});
+  }
+}
+
+// the query rows and the kv positions of one tile of the flash prefill kernel, a warp runs
+// flash_rows / flash_warp_num rows and a lane scores one position of a kv tile
+constexpr static int flash_rows = 16;
+constexpr static int flash_cols = 32;
+constexpr static int flash_thread_num = 128;
+constexpr static int flash_warp_num = flash_thread_num / 32;
+constexpr static int flash_rows_per_warp = flash_rows / flash_warp_num;
+// the elements of the output of a row a lane accumulates in its registers
+constexpr static int flash_lane_elems = kFlashPrefillMaxHeadSize / 32;
+
+__device__ __forceinline__ void store_cache(float value, float* out) { *out = value; }
+
+__device__ __forceinline__ void store_cache(float value, half* out) { *out = __float2half(value); }
+
+__device__ __forceinline__ void store_cache(float value, __nv_bfloat16* out) {
+  *out = __float2bfloat16(value);
+}
+
+// the element i of the kv head at the physical row of a token major cache, or of a head major
+// one when cache_len is not 0
+__device__ __forceinline__ int64_t flash_cache_offset(int64_t layer_offset, int32_t cache_len,
+                                                      int32_t kv_dim, int32_t head_size,
+                                                      int kv_head, int physical, int i) {
+  if (cache_len > 0) {
+    return layer_offset + (static_cast<int64_t>(kv_head) * cache_len + physical) * head_size + i;
+  }
+  return layer_offset + static_cast<int64_t>(physical) * kv_dim + kv_head * head_size + i;
+}
+
+// One block runs flash_rows rows of the prompt for one query head. The queries stay in the
+// shared memory while the attended positions pass tile by tile, the scores of a tile live in
+// the lanes of a warp and are folded into a running max, a running sum and the output in the
+// registers, so no [rows, positions] score matrix is stored. The positions of the prompt are
+// read from key and value, the earlier ones from the cache. The first query head of a group
+// stores the rows of its kv head into the cache, the blocks only read the cache below
+// start_pos, so the writes and the reads of the launch never meet.
+template <typename T, int kHeadSize>
+__global__ void flash_prefill_kernel(int32_t start_pos, int32_t num_tokens, const float* query,
+                                     const float* key, const float* value, float* output,
+                                     T* key_cache, T* value_cache, int32_t kv_dim, int32_t kv_mul,
+                                     int32_t head_num, int32_t head_size, int64_t layer_offset,
+                                     int32_t cache_len, const int32_t* block_table,
+                                     int32_t block_size, base::AttentionWindow window) {
+  const int head = blockIdx.x;
+  const int row_begin = blockIdx.y * flash_rows;
+  if (head >= head_num || row_begin >= num_tokens) {
+    return;
+  }
+  head_size = fixed_head_size<kHeadSize>(head_size);
+  const int row_end = min(row_begin + flash_rows, num_tokens);
+  const int kv_head = head / kv_mul;
+  const int lane = threadIdx.x % 32;
+  const int warp = threadIdx.x / 32;
+  const int dim = head_num * head_size;
+  const int stride = gqa_tile_stride(head_size);
+  extern __shared__ float flash_shared[];
+  float* query_tile = flash_shared;
+  float* key_tile = query_tile + flash_rows * head_size;
+  float* value_tile = key_tile + flash_cols * stride;
+
+  // the queries are scaled once instead of every score
+  const float scale = 1.f / sqrtf(head_size);
+  for (int idx = threadIdx.x; idx < flash_rows * head_size; idx += blockDim.x) {
+    const int r = idx / head_size;
+    const int i = idx % head_size;
+    query_tile[idx] =
+        row_begin + r < num_tokens ? query[(row_begin + r) * dim + head * head_size + i] * scale
+                                   : 0.f;
+  }
+  if (head % kv_mul == 0) {
+    for (int idx = threadIdx.x; idx < (row_end - row_begin) * head_size; idx += blockDim.x) {
+      const int row = row_begin + idx / head_size;
+      const int i = idx % head_size;
+      const int physical =
+          physical_pos(block_table, block_size, window.cache_pos(start_pos + row));
+      const int64_t offset =
+          flash_cache_offset(layer_offset, cache_len, kv_dim, head_size, kv_head, physical, i);
+      const int64_t src_offset = static_cast<int64_t>(row) * kv_dim + kv_head * head_size + i;
+      store_cache(key[src_offset], key_cache + offset);
+      store_cache(value[src_offset], value_cache + offset);
+    }
+  }
+
+  float row_max[flash_rows_per_warp];
+  float row_sum[flash_rows_per_warp];
+  float acc[flash_rows_per_warp][flash_lane_elems];
+#pragma unroll
+  for (int k = 0; k < flash_rows_per_warp; ++k) {
+    row_max[k] = -FLT_MAX;
+    row_sum[k] = 0.f;
+#pragma unroll
+    for (int e = 0; e < flash_lane_elems; ++e) {
+      acc[k][e] = 0.f;
+    }
+  }
+
+  // the sinks and the window of the rows of the block, the positions [0, last_pos] without a
+  // window. A position outside the window of one of the rows is masked for it
+  const int first_pos = start_pos + row_begin;
+  const int last_pos = start_pos + row_end - 1;
+  const int sink_end = window.is_enabled() ? min(window.sink_num, last_pos + 1) : 0;
+  const int tail_begin =
+      window.is_enabled() ? max(sink_end, window.window_begin(first_pos)) : 0;
+  for (int range = 0; range < 2; ++range) {
+    const int begin = range == 0 ? 0 : tail_begin;
+    const int end = range == 0 ? sink_end : last_pos + 1;
+    for (int t0 = begin; t0 < end; t0 += flash_cols) {
+      const int tile_len = min(flash_cols, end - t0);
+      __syncthreads();
+      for (int idx = threadIdx.x; idx < tile_len * head_size; idx += blockDim.x) {
+        const int j = idx / head_size;
+        const int i = idx % head_size;
+        const int t = t0 + j;
+        float k = 0.f;
+        float v = 0.f;
+        if (t >= start_pos) {
+          const int64_t src_offset =
+              static_cast<int64_t>(t - start_pos) * kv_dim + kv_head * head_size + i;
+          k = key[src_offset];
+          v = value[src_offset];
+        } else {
+          const int physical = physical_pos(block_table, block_size, window.cache_pos(t));
+          const int64_t offset =
+              flash_cache_offset(layer_offset, cache_len, kv_dim, head_size, kv_head, physical, i);
+          k = to_float(key_cache[offset]);
+          v = to_float(value_cache[offset]);
+        }
+        key_tile[j * stride + i] = k;
+        value_tile[j * head_size + i] = v;
+      }
+      __syncthreads();
+
+#pragma unroll
+      for (int k = 0; k < flash_rows_per_warp; ++k) {
+        const int r = warp * flash_rows_per_warp + k;
+        const int row_pos = start_pos + row_begin + r;
+        if (row_begin + r >= num_tokens) {
+          continue;
+        }
+        const int t = t0 + lane;
+        const bool is_attended = lane < tile_len && t <= row_pos &&
+                                 (!window.is_enabled() || t < window.sink_num ||
+                                  t >= window.window_begin(row_pos));
+        float score = -FLT_MAX;
+        if (is_attended) {
+          score = 0.f;
+          const float* query_row = query_tile + r * head_size;
+          const float* key_row = key_tile + lane * stride;
+          for (int i = 0; i < head_size; ++i) {
+            score += query_row[i] * key_row[i];
+          }
+        }
+        float tile_max = score;
+#pragma unroll
+        for (int offset = 16; offset > 0; offset /= 2) {
+          tile_max = fmaxf(tile_max, __shfl_xor_sync(0xffffffff, tile_max, offset));
+        }
+        // the whole tile is masked for this row
+        if (tile_max == -FLT_MAX) {
+          continue;
+        }
+        const float new_max = fmaxf(row_max[k], tile_max);
+        const float correction = expf(row_max[k] - new_max);
+        const float prob = is_attended ? expf(score - new_max) : 0.f;
+        float tile_sum = prob;
+#pragma unroll
+        for (int offset = 16; offset > 0; offset /= 2) {
+          tile_sum += __shfl_xor_sync(0xffffffff, tile_sum, offset);
+        }
+        row_max[k] = new_max;
+        row_sum[k] = row_sum[k] * correction + tile_sum;
+#pragma unroll
+        for (int e = 0; e < flash_lane_elems; ++e) {
+          acc[k][e] *= correction;
+        }
+        for (int j = 0; j < tile_len; ++j) {
+          const float p = __shfl_sync(0xffffffff, prob, j);
+#pragma unroll
+          for (int e = 0; e < flash_lane_elems; ++e) {
+            const int i = lane + 32 * e;
+            if (i < head_size) {
+              acc[k][e] += p * value_tile[j * head_size + i];
+            }
+          }
+        }
+      }
+    }
+  }
+
+#pragma unroll
+  for (int k = 0; k < flash_rows_per_warp; ++k) {
+    const int row = row_begin + warp * flash_rows_per_warp + k;
+    if (row >= num_tokens) {
+      continue;
+    }
+    float* output_row = output + row * dim + head * head_size;
+#pragma unroll
+    for (int e = 0; e < flash_lane_elems; ++e) {
+      const int i = lane + 32 * e;
+      if (i < head_size) {
+        output_row[i] = acc[k][e] / row_sum[k];
+      }
+    }
+  }
+}
+
+static size_t flash_shared_size(int32_t head_size) {
+  return (flash_rows * head_size + flash_cols * (head_size + 1) + flash_cols * head_size) *
+         sizeof(float);
+}
+
+void flash_prefill_kernel_cu(int32_t start_pos, int32_t head_num, int32_t layer_index,
+                             int32_t kv_dim, int32_t kv_mul, int32_t head_size,
+                             int32_t block_size, const tensor::Tensor& mha_out,
+                             const tensor::Tensor& query_tensor, const tensor::Tensor& key_tensor,
+                             const tensor::Tensor& value_tensor,
+                             const tensor::Tensor& key_cache_tensor,
+                             const tensor::Tensor& value_cache_tensor,
+                             const tensor::Tensor& block_table,
+                             const base::AttentionWindow& window, void* stream) {
+  CHECK_LE(head_size, kFlashPrefillMaxHeadSize);
+  const int32_t dim = head_num * head_size;
+  CHECK_EQ(query_tensor.size() % dim, 0);
+  const int32_t num_tokens = static_cast<int32_t>(query_tensor.size()) / dim;
+  CHECK_EQ(key_tensor.size(), static_cast<size_t>(num_tokens) * kv_dim);
+  CHECK_EQ(value_tensor.size(), key_tensor.size());
+  // a later row of the chunk would overwrite the ring row of a position an earlier one attends
+  CHECK(!window.is_enabled() || num_tokens <= window.chunk_size);
+  const bool is_head_major = key_cache_tensor.dims_size() == 4;
+  CHECK(is_head_major || key_cache_tensor.dims_size() == 3);
+  const int32_t cache_len = key_cache_tensor.get_dim(is_head_major ? 2 : 1);
+  const int64_t layer_offset = static_cast<int64_t>(layer_index) * cache_len * kv_dim;
+  const int32_t* block_table_ptr = block_table.is_empty() ? nullptr : block_table.ptr<int32_t>();
+
+  dim3 grid(head_num, (num_tokens + flash_rows - 1) / flash_rows);
+  cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+  auto launch = [&](auto type_tag) {
+    using T = decltype(type_tag);
+    dispatch_head_size(head_size, [&](auto fixed_size) {
+      flash_prefill_kernel<T, decltype(fixed_size)::value>
+          <<<grid, flash_thread_num, flash_shared_size(head_size), stream_>>>(
+              start_pos, num_tokens, query_tensor.ptr<float>(), key_tensor.ptr<float>(),
+              value_tensor.ptr<float>(), const_cast<float*>(mha_out.ptr<float>()),
+              const_cast<T*>(key_cache_tensor.ptr<T>()),
+              const_cast<T*>(value_cache_tensor.ptr<T>()), kv_dim, kv_mul, head_num, head_size,
+              layer_offset, is_head_major ? cache_len : 0, block_table_ptr, block_size, window);
+    });
+  };
+  const base::DataType data_type = key_cache_tensor.data_type();
+  if (data_type == base::DataType::kDataTypeFp16) {
+    launch(half{});
+  } else if (data_type == base::DataType::kDataTypeBf16) {
+    launch(__nv_bfloat16{});
+  } else if (data_type == base::DataType::kDataTypeFp32) {
+    launch(float{});
+  } else {
+    LOG(FATAL) << "The int8 kv cache is quantized per head and can not be written by the flash "
+                  "prefill kernel.";
+  }
 }
 
-}  // namespace kernel
\ No newline at end of file
+}  // namespace kernel
@@ -2,9 +2,23 @@
 #define MHA_KERNEL_H
 namespace kernel {
 void mha_kernel_cu(int32_t pos, int32_t head_num, int32_t layer_index, int32_t seq_len,
-                   int32_t kv_dim, int32_t kv_mul, int32_t head_size, const tensor::Tensor& mha_out,
-                   const tensor::Tensor& query_tensor, const tensor::Tensor& score_tensor,
-                   const tensor::Tensor& key_cache_tensor, const tensor::Tensor& value_cache_tensor,
+                   int32_t kv_dim, int32_t kv_mul, int32_t head_size, int32_t block_size,
+                   const tensor::Tensor& mha_out, const tensor::Tensor& query_tensor,
+                   const tensor::Tensor& score_tensor, const tensor::Tensor& key_cache_tensor,
+                   const tensor::Tensor& value_cache_tensor,
+                   const tensor::Tensor& key_scale_tensor,
+                   const tensor::Tensor& value_scale_tensor, const tensor::Tensor& block_table,
+                   const tensor::Tensor& pos_tensor, const base::AttentionWindow& window,
                    base::DeviceType device_type, CudaConfig* config);
+
+void flash_prefill_kernel_cu(int32_t start_pos, int32_t head_num, int32_t layer_index,
+                             int32_t kv_dim, int32_t kv_mul, int32_t head_size,
+                             int32_t block_size, const tensor::Tensor& mha_out,
+                             const tensor::Tensor& query_tensor, const tensor::Tensor& key_tensor,
+                             const tensor::Tensor& value_tensor,
+                             const tensor::Tensor& key_cache_tensor,
+                             const tensor::Tensor& value_cache_tensor,
+                             const tensor::Tensor& block_table,
+                             const base::AttentionWindow& window, void* stream);
 }
 #endif  // MHA_KERNEL_H
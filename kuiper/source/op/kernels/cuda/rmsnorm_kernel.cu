@@ -1,12 +1,25 @@
+#include <cuda_bf16.h>
+#include <cuda_fp16.h>
 #include <cub/block/block_reduce.cuh>
+#include <type_traits>
 #include "rmsnorm_kernel.cuh"
 namespace kernel {
-template <int32_t BLOCK_DIM>
-static __global__ void row_rmsnorm_f32(float* in, float* wei, float* out, int size, float eps) {
+__device__ __forceinline__ float to_float(float value) { return value; }
+
+__device__ __forceinline__ float to_float(half value) { return __half2float(value); }
+
+__device__ __forceinline__ float to_float(__nv_bfloat16 value) { return __bfloat162float(value); }
+
+template <int32_t BLOCK_DIM, typename T = float>
+static __global__ void row_rmsnorm_f32(float* in, const T* wei, float* out, int size, float eps) {
   const int tid = threadIdx.x;
+  in += blockIdx.x * size;
+  out += blockIdx.x * size;
 
   constexpr int pack_size = 4;
-  const int pack_num = size / pack_size;
+  // the rows past the first are only 16 byte aligned when the size is a multiple of the pack
+  // size, the other sizes take the scalar loops
+  const int pack_num = size % pack_size == 0 ? size / pack_size : 0;
   const int pack_off = pack_size * pack_num;
 
   float sum = 0.0f;
@@ -34,18 +47,170 @@ static __global__ void row_rmsnorm_f32(float* in, float* wei, float* out, int si
   sum = shared_val;
   const float scale = rsqrtf(sum / static_cast<float>(size) + eps);
 
-  float4* wei_pack = reinterpret_cast<float4*>(wei);
   float4* out_pack = reinterpret_cast<float4*>(out);
   for (int i = tid; i < pack_num; i += blockDim.x) {
     float4 in_float4 = *(in_pack + i);
-    float4 wei_float4 = *(wei_pack + i);
-    *(out_pack + i) =
-        make_float4(scale * in_float4.x * wei_float4.x, scale * in_float4.y * wei_float4.y,
-                    scale * in_float4.z * wei_float4.z, scale * in_float4.w * wei_float4.w);
+    const T* wei_pack = wei + i * pack_size;
+    *(out_pack + i) = make_float4(
+        scale * in_float4.x * to_float(wei_pack[0]), scale * in_float4.y * to_float(wei_pack[1]),
+        scale * in_float4.z * to_float(wei_pack[2]), scale * in_float4.w * to_float(wei_pack[3]));
   }
 
   for (int i = pack_off + tid; i < size; i += blockDim.x) {
-    out[i] = wei[i] * in[i] * scale;
+    out[i] = to_float(wei[i]) * in[i] * scale;
+  }
+}
+
+// the residual row is updated and normalized by the same block, each thread reads back only the
+// elements it stored itself, so the second pass needs no barrier
+template <int32_t BLOCK_DIM, typename T = float>
+static __global__ void row_add_rmsnorm_f32(float* residual, const float* in, const T* wei,
+                                           float* out, int size, float eps) {
+  const int tid = threadIdx.x;
+  residual += blockIdx.x * size;
+  in += blockIdx.x * size;
+  out += blockIdx.x * size;
+
+  constexpr int pack_size = 4;
+  // the rows past the first are only 16 byte aligned when the size is a multiple of the pack
+  // size, the other sizes take the scalar loops
+  const int pack_num = size % pack_size == 0 ? size / pack_size : 0;
+  const int pack_off = pack_size * pack_num;
+
+  float sum = 0.0f;
+  float4* residual_pack = reinterpret_cast<float4*>(residual);
+  const float4* in_pack = reinterpret_cast<const float4*>(in);
+  for (int i = tid; i < pack_num; i += blockDim.x) {
+    float4 residual_float4 = *(residual_pack + i);
+    const float4 in_float4 = *(in_pack + i);
+    residual_float4.x += in_float4.x;
+    residual_float4.y += in_float4.y;
+    residual_float4.z += in_float4.z;
+    residual_float4.w += in_float4.w;
+    *(residual_pack + i) = residual_float4;
+    sum += residual_float4.x * residual_float4.x;
+    sum += residual_float4.y * residual_float4.y;
+    sum += residual_float4.z * residual_float4.z;
+    sum += residual_float4.w * residual_float4.w;
+  }
+
+  for (int i = pack_off + tid; i < size; i += blockDim.x) {
+    residual[i] += in[i];
+    sum += residual[i] * residual[i];
+  }
+
+  using BlockReduce = cub::BlockReduce<float, BLOCK_DIM>;
+  __shared__ typename BlockReduce::TempStorage temp;
+  __shared__ float shared_val;
+  sum = BlockReduce(temp).Sum(sum);
+  if (threadIdx.x == 0) {
+    shared_val = sum;
+  }
+  __syncthreads();
+  sum = shared_val;
+  const float scale = rsqrtf(sum / static_cast<float>(size) + eps);
+
+  float4* out_pack = reinterpret_cast<float4*>(out);
+  for (int i = tid; i < pack_num; i += blockDim.x) {
+    const float4 residual_float4 = *(residual_pack + i);
+    const T* wei_pack = wei + i * pack_size;
+    *(out_pack + i) = make_float4(scale * residual_float4.x * to_float(wei_pack[0]),
+                                  scale * residual_float4.y * to_float(wei_pack[1]),
+                                  scale * residual_float4.z * to_float(wei_pack[2]),
+                                  scale * residual_float4.w * to_float(wei_pack[3]));
+  }
+
+  for (int i = pack_off + tid; i < size; i += blockDim.x) {
+    out[i] = to_float(wei[i]) * residual[i] * scale;
+  }
+}
+
+// a row of one of the common model dims is kept in the registers between the sum of squares and
+// the scaling, the general kernels above read it twice. With residual the row is added to the
+// residual first and stored back
+template <int32_t BLOCK_DIM, int32_t kSize, bool kAddResidual, typename T>
+static __global__ void row_rmsnorm_fixed_f32(float* residual, const float* in, const T* wei,
+                                             float* out, float eps) {
+  static_assert(kSize % 4 == 0, "the fixed rmsnorm dims are a multiple of the pack size");
+  constexpr int pack_num = kSize / 4;
+  constexpr int pack_per_thread = (pack_num + BLOCK_DIM - 1) / BLOCK_DIM;
+  const int tid = threadIdx.x;
+  residual += blockIdx.x * kSize;
+  in += blockIdx.x * kSize;
+  out += blockIdx.x * kSize;
+  float4* residual_pack = reinterpret_cast<float4*>(residual);
+  const float4* in_pack = reinterpret_cast<const float4*>(in);
+
+  float4 row_pack[pack_per_thread];
+  float sum = 0.0f;
+#pragma unroll
+  for (int j = 0; j < pack_per_thread; ++j) {
+    const int i = tid + j * BLOCK_DIM;
+    float4 value = make_float4(0.f, 0.f, 0.f, 0.f);
+    if (i < pack_num) {
+      value = in_pack[i];
+      if (kAddResidual) {
+        const float4 residual_float4 = residual_pack[i];
+        value.x += residual_float4.x;
+        value.y += residual_float4.y;
+        value.z += residual_float4.z;
+        value.w += residual_float4.w;
+        residual_pack[i] = value;
+      }
+    }
+    row_pack[j] = value;
+    sum += value.x * value.x + value.y * value.y + value.z * value.z + value.w * value.w;
+  }
+
+  using BlockReduce = cub::BlockReduce<float, BLOCK_DIM>;
+  __shared__ typename BlockReduce::TempStorage temp;
+  __shared__ float shared_val;
+  sum = BlockReduce(temp).Sum(sum);
+  if (threadIdx.x == 0) {
+    shared_val = sum;
+  }
+  __syncthreads();
+  const float scale = rsqrtf(shared_val / static_cast<float>(kSize) + eps);
+
+  float4* out_pack = reinterpret_cast<float4*>(out);
+#pragma unroll
+  for (int j = 0; j < pack_per_thread; ++j) {
+    const int i = tid + j * BLOCK_DIM;
+    if (i < pack_num) {
+      const T* wei_pack = wei + i * 4;
+      out_pack[i] = make_float4(scale * row_pack[j].x * to_float(wei_pack[0]),
+                                scale * row_pack[j].y * to_float(wei_pack[1]),
+                                scale * row_pack[j].z * to_float(wei_pack[2]),
+                                scale * row_pack[j].w * to_float(wei_pack[3]));
+    }
+  }
+}
+
+// calls func with the dim as an std::integral_constant for the hidden sizes of the common
+// llama and qwen models, false is returned for the other dims
+template <typename Func>
+static bool dispatch_rmsnorm_dim(int32_t size, Func&& func) {
+  switch (size) {
+    case 896:
+      func(std::integral_constant<int32_t, 896>{});
+      return true;
+    case 1536:
+      func(std::integral_constant<int32_t, 1536>{});
+      return true;
+    case 2048:
+      func(std::integral_constant<int32_t, 2048>{});
+      return true;
+    case 3072:
+      func(std::integral_constant<int32_t, 3072>{});
+      return true;
+    case 3584:
+      func(std::integral_constant<int32_t, 3584>{});
+      return true;
+    case 4096:
+      func(std::integral_constant<int32_t, 4096>{});
+      return true;
+    default:
+      return false;
   }
 }
 
@@ -64,16 +229,100 @@ void rmsnorm_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& weight
 #else
   const float eps = 1e-5f;
 #endif
-  const int32_t size = static_cast<int32_t>(input.size());
+  const int32_t size = static_cast<int32_t>(weight.size());
+  CHECK_EQ(input.size() % size, 0);
+  CHECK_EQ(input.size(), output.size());
+  const int32_t rows = static_cast<int32_t>(input.size()) / size;
   float* in_ptr = const_cast<float*>(input.ptr<float>());
-  float* wei_ptr = const_cast<float*>(weight.ptr<float>());
   float* out_ptr = const_cast<float*>(output.ptr<float>());
   constexpr int threads_num = 128;
-  if (stream) {
-    cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
-    row_rmsnorm_f32<128><<<1, threads_num, 0, stream_>>>(in_ptr, wei_ptr, out_ptr, size, eps);
+  cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+  auto launch_fixed = [&](auto type_tag) {
+    using T = decltype(type_tag);
+    const T* wei_ptr = reinterpret_cast<const T*>(weight.ptr<int8_t>());
+    return dispatch_rmsnorm_dim(size, [&](auto fixed_size) {
+      row_rmsnorm_fixed_f32<threads_num, decltype(fixed_size)::value, false, T>
+          <<<rows, threads_num, 0, stream_>>>(in_ptr, in_ptr, wei_ptr, out_ptr, eps);
+    });
+  };
+  if (weight.data_type() == base::DataType::kDataTypeFp16) {
+    if (launch_fixed(half{})) {
+      return;
+    }
+    row_rmsnorm_f32<128><<<rows, threads_num, 0, stream_>>>(
+        in_ptr, reinterpret_cast<const half*>(weight.ptr<uint16_t>()), out_ptr, size, eps);
+  } else if (weight.data_type() == base::DataType::kDataTypeBf16) {
+    if (launch_fixed(__nv_bfloat16{})) {
+      return;
+    }
+    row_rmsnorm_f32<128><<<rows, threads_num, 0, stream_>>>(
+        in_ptr, reinterpret_cast<const __nv_bfloat16*>(weight.ptr<uint16_t>()), out_ptr, size,
+        eps);
+  } else {
+    if (launch_fixed(float{})) {
+      return;
+    }
+    row_rmsnorm_f32<128><<<rows, threads_num, 0, stream_>>>(in_ptr, weight.ptr<float>(), out_ptr,
+                                                            size, eps);
+  }
+}
+
+void add_rmsnorm_kernel_cu(const tensor::Tensor& residual, const tensor::Tensor& input,
+                           const tensor::Tensor& weight, const tensor::Tensor& output,
+                           void* stream) {
+  CHECK(!residual.is_empty());
+  CHECK(!input.is_empty());
+  CHECK(!weight.is_empty());
+  CHECK(!output.is_empty());
+
+  CHECK(residual.device_type() == base::DeviceType::kDeviceCUDA &&
+        input.device_type() == base::DeviceType::kDeviceCUDA &&
+        weight.device_type() == base::DeviceType::kDeviceCUDA &&
+        output.device_type() == base::DeviceType::kDeviceCUDA);
+
+#ifdef QWEN2_SUPPORT
+  const float eps = 1e-6f;
+#else
+  const float eps = 1e-5f;
+#endif
+  const int32_t size = static_cast<int32_t>(weight.size());
+  CHECK_EQ(residual.size() % size, 0);
+  CHECK_EQ(residual.size(), input.size());
+  CHECK_EQ(residual.size(), output.size());
+  const int32_t rows = static_cast<int32_t>(residual.size()) / size;
+  float* residual_ptr = const_cast<float*>(residual.ptr<float>());
+  const float* in_ptr = input.ptr<float>();
+  float* out_ptr = const_cast<float*>(output.ptr<float>());
+  constexpr int threads_num = 128;
+  cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+  auto launch_fixed = [&](auto type_tag) {
+    using T = decltype(type_tag);
+    const T* wei_ptr = reinterpret_cast<const T*>(weight.ptr<int8_t>());
+    return dispatch_rmsnorm_dim(size, [&](auto fixed_size) {
+      row_rmsnorm_fixed_f32<threads_num, decltype(fixed_size)::value, true, T>
+          <<<rows, threads_num, 0, stream_>>>(residual_ptr, in_ptr, wei_ptr, out_ptr, eps);
+    });
+  };
+  if (weight.data_type() == base::DataType::kDataTypeFp16) {
+    if (launch_fixed(half{})) {
+      return;
+    }
+    row_add_rmsnorm_f32<128><<<rows, threads_num, 0, stream_>>>(
+        residual_ptr, in_ptr, reinterpret_cast<const half*>(weight.ptr<uint16_t>()), out_ptr,
+        size, eps);
+  } else if (weight.data_type() == base::DataType::kDataTypeBf16) {
+    if (launch_fixed(__nv_bfloat16{})) {
+      return;
+    }
+    row_add_rmsnorm_f32<128><<<rows, threads_num, 0, stream_>>>(
+        residual_ptr, in_ptr, reinterpret_cast<const __nv_bfloat16*>(weight.ptr<uint16_t>()),
+        out_ptr, size, eps);
   } else {
-    row_rmsnorm_f32<128><<<1, threads_num>>>(in_ptr, wei_ptr, out_ptr, size, eps);
+    if (launch_fixed(float{})) {
+      return;
+    }
+    row_add_rmsnorm_f32<128><<<rows, threads_num, 0, stream_>>>(
+        residual_ptr, in_ptr, weight.ptr<float>(), out_ptr, size, eps);
   }
 }
-}  // namespace kernel
\ No newline at end of file
+}  // namespace kernel
@@ -4,5 +4,10 @@
 namespace kernel {
 void rmsnorm_kernel_cu(const tensor::Tensor& input, const tensor::Tensor& weight,
                        const tensor::Tensor& output, void* stream = nullptr);
+
+// residual += input, output = rmsnorm(residual) in one pass over the rows
+void add_rmsnorm_kernel_cu(const tensor::Tensor& residual, const tensor::Tensor& input,
+                           const tensor::Tensor& weight, const tensor::Tensor& output,
+                           void* stream = nullptr);
 }
 #endif  // RMSNORM_KERNEL_CU_CUH
@@ -1,171 +1,217 @@
+#include <cuda_bf16.h>
+#include <cuda_fp16.h>
+#include <vector>
+#include "../cpu/rope_kernel.h"
+#include "head_size.cuh"
 #include "rope_kernel.cuh"
+#include "rope_math.cuh"
 namespace kernel {
-
-#if defined (LLAMA3_SUPPORT)
-__global__ void rope_kernel_cu_fp32(int pos, int dim, int kv_dim, int head_size,
-                                    const float* input_q, const float* input_k,
+template <bool kRotateHalf, int kHeadSize>
+__global__ void rope_kernel_cu_fp32(int pos, const int* pos_ptr, int dim, int kv_dim,
+                                    int head_size, float* input_q, float* input_k,
                                     const float* sin_cache, const float* cos_cache) {
-  int idx = threadIdx.x + blockDim.x * blockIdx.x;
-
-  int num_heads = dim / head_size;
-  int head_pair_count = head_size / 2;
-  int total_pairs = num_heads * head_pair_count;
-  if (idx > total_pairs) {
+  const int pair = threadIdx.x + blockDim.x * blockIdx.x;
+  if (pair >= dim / 2) {
     return;
   }
-
-  int head_idx = idx / head_pair_count;
-  int head_dim = idx % head_pair_count;
-
-  int i = head_idx * head_size;
-  int v0_idx = i + head_dim;
-  int v1_idx = i + head_dim + head_size / 2;
-
-  float fci = sin_cache[pos * head_size + head_dim * 2];
-  float fcr = cos_cache[pos * head_size + head_dim * 2];
-
-  int rotn = i < kv_dim ? 2 : 1;
-
-  for (int v = 0; v < rotn; v++) {
-    float* vec = const_cast<float*>(v == 0 ? input_q : input_k);  // the vector to rotate (query or key)
-    float v0 = vec[v0_idx];
-    float v1 = vec[v1_idx];
-    vec[v0_idx] = fcr * v0 - fci * v1;
-    vec[v1_idx] = fcr * v1 + fci * v0;
+  head_size = fixed_head_size<kHeadSize>(head_size);
+  const int row = blockIdx.y;
+  if (pos_ptr) {
+    pos = *pos_ptr;
   }
-}
-
-__global__ void sin_cos_calc(int head_size, int max_seq_len, float* sin_cache, float* cos_cache) {
-  int idx = threadIdx.x + blockDim.x * blockIdx.x;
-  int head_dim = idx % head_size;
-  for (int pos = 0; pos < max_seq_len; ++pos) {
-    float freq = 1.0f / pow(500000.0f, static_cast<float>(head_dim) / static_cast<float>(head_size));
-    float val = static_cast<float>(pos) * freq;
-    float fcr = cosf(val);
-    float fci = sinf(val);
-    *(sin_cache + pos * head_size + head_dim) = fci;
-    *(cos_cache + pos * head_size + head_dim) = fcr;
-  }
-}
-#elif defined (QWEN2_SUPPORT)
-__global__ void rope_kernel_cu_fp32(int pos, int dim, int kv_dim, int head_size,
-                                    const float* input_q, const float* input_k,
-                                    const float* sin_cache, const float* cos_cache) {
-  int idx = threadIdx.x + blockDim.x * blockIdx.x;
-
-  int num_heads = dim / head_size;
-  int head_pair_count = head_size / 2;
-  int total_pairs = num_heads * head_pair_count;
-  if (idx > total_pairs) {
+  pos += row;
+
+  int v0_idx = 0;
+  int v1_idx = 0;
+  int freq_idx = 0;
+  rope_pair<kRotateHalf>(pair, head_size, &v0_idx, &v1_idx, &freq_idx);
+  float fci = 0.f;
+  float fcr = 0.f;
+  rope_sin_cos(pos, freq_idx, sin_cache, cos_cache, &fci, &fcr);
+
+  float* query = input_q + row * dim;
+  const float q0 = query[v0_idx];
+  const float q1 = query[v1_idx];
+  query[v0_idx] = fcr * q0 - fci * q1;
+  query[v1_idx] = fcr * q1 + fci * q0;
+  // both elements of a pair belong to the same head
+  if (v1_idx >= kv_dim) {
     return;
   }
+  float* key = input_k + row * kv_dim;
+  const float k0 = key[v0_idx];
+  const float k1 = key[v1_idx];
+  key[v0_idx] = fcr * k0 - fci * k1;
+  key[v1_idx] = fcr * k1 + fci * k0;
+}
 
-  int head_idx = idx / head_pair_count;
-  int head_dim = idx % head_pair_count;
-
-  int i = head_idx * head_size;
-  int v0_idx = i + head_dim;
-  int v1_idx = i + head_dim + head_size / 2;
+// calls func with the rope style and the head size as template values
+template <typename Func>
+static void dispatch_rope(bool is_rotate_half, int32_t head_size, Func&& func) {
+  dispatch_head_size(head_size, [&](auto fixed_size) {
+    if (is_rotate_half) {
+      func(std::true_type{}, fixed_size);
+    } else {
+      func(std::false_type{}, fixed_size);
+    }
+  });
+}
 
-  float fci = sin_cache[pos * head_size + head_dim * 2];
-  float fcr = cos_cache[pos * head_size + head_dim * 2];
+__device__ __forceinline__ void store(float val, float* out) { *out = val; }
 
-  int rotn = i < kv_dim ? 2 : 1;
+__device__ __forceinline__ void store(float val, half* out) { *out = __float2half(val); }
 
-  for (int v = 0; v < rotn; v++) {
-    float* vec = const_cast<float*>(v == 0 ? input_q : input_k);  // the vector to rotate (query or key)
-    float v0 = vec[v0_idx];
-    float v1 = vec[v1_idx];
-    vec[v0_idx] = fcr * v0 - fci * v1;
-    vec[v1_idx] = fcr * v1 + fci * v0;
-  }
+__device__ __forceinline__ void store(float val, __nv_bfloat16* out) {
+  *out = __float2bfloat16(val);
 }
 
-__global__ void sin_cos_calc(int head_size, int max_seq_len, float* sin_cache, float* cos_cache) {
-  int idx = threadIdx.x + blockDim.x * blockIdx.x;
-  int head_dim = idx % head_size;
-  for (int pos = 0; pos < max_seq_len; ++pos) {
-    float freq = 1.0f / pow(1000000.0f, static_cast<float>(head_dim) / static_cast<float>(head_size));
-    float val = static_cast<float>(pos) * freq;
-    float fcr = cosf(val);
-    float fci = sinf(val);
-    *(sin_cache + pos * head_size + head_dim) = fci;
-    *(cos_cache + pos * head_size + head_dim) = fcr;
-  }
-}
-#else
-__device__ void rope_calc(float fcr, float fci, float* vec, int32_t idx) {
-  float2* vec_ptr = reinterpret_cast<float2*>(vec + idx);
-  float2 vec_value = *vec_ptr;
-  *vec_ptr =
-      make_float2(vec_value.x * fcr - vec_value.y * fci, vec_value.x * fci + vec_value.y * fcr);
-}
-
-__global__ void rope_kernel_cu_fp32(int pos, int dim, int kv_dim, int head_size,
-                                    const float* input_q, const float* input_k,
-                                    const float* sin_cache, const float* cos_cache) {
-  int idx = threadIdx.x + blockDim.x * blockIdx.x;
-  idx = idx * 2;
-  if (idx >= dim) {
+// the query is rotated in place, the rotated key and the value of row y go straight to the
+// position pos + y of the block table, the key buffer itself is left as it is
+template <typename T, bool kRotateHalf, int kHeadSize>
+__global__ void rope_kv_cache_write_kernel(int pos, const int* pos_ptr, int dim, int kv_dim,
+                                           int head_size, float* query, const float* key,
+                                           const float* value, T* key_cache, T* value_cache,
+                                           const int32_t* block_table, int32_t block_size,
+                                           const float* sin_cache, const float* cos_cache) {
+  const int pair = threadIdx.x + blockDim.x * blockIdx.x;
+  if (pair >= dim / 2) {
     return;
   }
-
-  int head_dim = idx % head_size;
-  float fci = *(sin_cache + pos * head_size + head_dim);
-  float fcr = *(cos_cache + pos * head_size + head_dim);
-
-  rope_calc(fcr, fci, const_cast<float*>(input_q), idx);
-  if (idx >= kv_dim) {
+  head_size = fixed_head_size<kHeadSize>(head_size);
+  const int row = blockIdx.y;
+  if (pos_ptr) {
+    pos = *pos_ptr;
+  }
+  pos += row;
+
+  int v0_idx = 0;
+  int v1_idx = 0;
+  int freq_idx = 0;
+  rope_pair<kRotateHalf>(pair, head_size, &v0_idx, &v1_idx, &freq_idx);
+  float fci = 0.f;
+  float fcr = 0.f;
+  rope_sin_cos(pos, freq_idx, sin_cache, cos_cache, &fci, &fcr);
+
+  float* query_row = query + row * dim;
+  const float q0 = query_row[v0_idx];
+  const float q1 = query_row[v1_idx];
+  query_row[v0_idx] = fcr * q0 - fci * q1;
+  query_row[v1_idx] = fcr * q1 + fci * q0;
+  // both elements of a pair belong to the same head
+  if (v1_idx >= kv_dim) {
     return;
   }
-  rope_calc(fcr, fci, const_cast<float*>(input_k), idx);
-}
 
-__global__ void sin_cos_calc(int head_size, int max_seq_len, float* sin_cache, float* cos_cache) {
-  int idx = threadIdx.x + blockDim.x * blockIdx.x;
-  int head_dim = idx % head_size;
-  for (int pos = 0; pos < max_seq_len; ++pos) {
-    float freq = 1.0f / pow(10000.0f, static_cast<float>(head_dim) / static_cast<float>(head_size));
-    float val = static_cast<float>(pos) * freq;
-    float fcr = cosf(val);
-    float fci = sinf(val);
-    *(sin_cache + pos * head_size + head_dim) = fci;
-    *(cos_cache + pos * head_size + head_dim) = fcr;
-  }
+  const int physical = block_table[pos / block_size] * block_size + pos % block_size;
+  const int64_t cache_offset = static_cast<int64_t>(physical) * kv_dim;
+  const float* key_row = key + row * kv_dim;
+  const float* value_row = value + row * kv_dim;
+  const float k0 = key_row[v0_idx];
+  const float k1 = key_row[v1_idx];
+  store(fcr * k0 - fci * k1, key_cache + cache_offset + v0_idx);
+  store(fcr * k1 + fci * k0, key_cache + cache_offset + v1_idx);
+  store(value_row[v0_idx], value_cache + cache_offset + v0_idx);
+  store(value_row[v1_idx], value_cache + cache_offset + v1_idx);
 }
-#endif
 
-void sin_cos_cache_calc_cu(int head_size, int max_seq_len, const tensor::Tensor& sin_cache,
+void sin_cos_cache_calc_cu(int head_size, int max_seq_len, float theta,
+                           const base::RoPEScaling& scaling, const tensor::Tensor& sin_cache,
                            const tensor::Tensor& cos_cache, cudaStream_t stream) {
   CHECK_EQ(sin_cache.is_empty(), false);
   CHECK_EQ(cos_cache.is_empty(), false);
-  int threads = head_size;
-  if (stream) {
-    sin_cos_calc<<<1, threads, 0, stream>>>(head_size, max_seq_len,
-                                            const_cast<float*>(sin_cache.ptr<float>()),
-                                            const_cast<float*>(cos_cache.ptr<float>()));
+  const size_t table_size = static_cast<size_t>(base::rope_table_rows(max_seq_len)) *
+                            (head_size / 2);
+  CHECK_GE(sin_cache.size(), table_size);
+  CHECK_GE(cos_cache.size(), table_size);
+  // the scaled frequencies are a few hundred values, the tables are filled on the host. The
+  // kernels only read row 0, the tiles are kept so the layout is the same as on the cpu
+  std::vector<float> sin_host(table_size);
+  std::vector<float> cos_host(table_size);
+  sin_cos_cache_calc_cpu(head_size, max_seq_len, theta, scaling, sin_host.data(),
+                         cos_host.data());
+  cudaMemcpyAsync(const_cast<float*>(sin_cache.ptr<float>()), sin_host.data(),
+                  table_size * sizeof(float), cudaMemcpyHostToDevice, stream);
+  cudaMemcpyAsync(const_cast<float*>(cos_cache.ptr<float>()), cos_host.data(),
+                  table_size * sizeof(float), cudaMemcpyHostToDevice, stream);
+  // the sources are freed on return
+  cudaStreamSynchronize(stream);
+}
+
+void rope_kernel_cu(int32_t dim, int32_t kv_dim, int32_t head_size, bool is_rotate_half,
+                    const tensor::Tensor& input_q, const tensor::Tensor& input_k,
+                    const tensor::Tensor& input_pos, const tensor::Tensor& sin_cache,
+                    const tensor::Tensor& cos_cache, void* stream) {
+  // a position on the device is read by the kernel, so the launch can be replayed in a graph
+  int32_t pos = 0;
+  const int32_t* pos_ptr = nullptr;
+  if (input_pos.device_type() == base::DeviceType::kDeviceCUDA) {
+    pos_ptr = input_pos.ptr<int32_t>();
   } else {
-    sin_cos_calc<<<1, threads>>>(head_size, max_seq_len, const_cast<float*>(sin_cache.ptr<float>()),
-                                 const_cast<float*>(cos_cache.ptr<float>()));
+    pos = *input_pos.ptr<int32_t>(0);
   }
+  const int32_t num_tokens = input_q.dims_size() == 2 ? input_q.get_dim(0) : 1;
+  int threads = 128;
+  dim3 blocks((dim / 2 + threads - 1) / threads, num_tokens);
+  cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+  dispatch_rope(is_rotate_half, head_size, [&](auto rotate_half, auto fixed_size) {
+    rope_kernel_cu_fp32<decltype(rotate_half)::value, decltype(fixed_size)::value>
+        <<<blocks, threads, 0, stream_>>>(pos, pos_ptr, dim, kv_dim, head_size,
+                                          const_cast<float*>(input_q.ptr<float>()),
+                                          const_cast<float*>(input_k.ptr<float>()),
+                                          sin_cache.ptr<float>(), cos_cache.ptr<float>());
+  });
 }
 
-void rope_kernel_cu(int32_t dim, int32_t kv_dim, int32_t head_size, const tensor::Tensor& input_q,
-                    const tensor::Tensor& input_k, const tensor::Tensor& input_pos,
-                    const tensor::Tensor& sin_cache, const tensor::Tensor& cos_cache,
-                    void* stream) {
-  const int32_t pos = *input_pos.ptr<int32_t>(0);
+void rope_kv_cache_write_kernel_cu(int32_t dim, int32_t kv_dim, int32_t head_size,
+                                   bool is_rotate_half, const tensor::Tensor& input_q,
+                                   const tensor::Tensor& key, const tensor::Tensor& value,
+                                   const tensor::Tensor& key_cache,
+                                   const tensor::Tensor& value_cache,
+                                   const tensor::Tensor& block_table,
+                                   const tensor::Tensor& pos_tensor,
+                                   const tensor::Tensor& sin_cache,
+                                   const tensor::Tensor& cos_cache, int32_t layer_index,
+                                   int32_t block_size, void* stream) {
+  CHECK_EQ(key.size(), value.size());
+  CHECK_EQ(key_cache.dims_size(), 3);
+  CHECK_EQ(key_cache.get_dim(2), kv_dim);
+  CHECK(block_table.device_type() == base::DeviceType::kDeviceCUDA);
+  int32_t pos = 0;
+  const int32_t* pos_ptr = nullptr;
+  if (pos_tensor.device_type() == base::DeviceType::kDeviceCUDA) {
+    pos_ptr = pos_tensor.ptr<int32_t>();
+  } else {
+    pos = pos_tensor.index<int32_t>(0);
+  }
+  const int32_t num_tokens = static_cast<int32_t>(key.size()) / kv_dim;
+  CHECK_EQ(input_q.size(), static_cast<size_t>(num_tokens) * dim);
+  const int64_t layer_offset = static_cast<int64_t>(layer_index) * key_cache.get_dim(1) * kv_dim;
+
   int threads = 128;
-  int blocks = (dim + threads - 1) / threads;
-  if (stream) {
-    cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
-    rope_kernel_cu_fp32<<<blocks, threads, 0, stream_>>>(
-        pos, dim, kv_dim, head_size, input_q.ptr<float>(), input_k.ptr<float>(),
-        sin_cache.ptr<float>(), cos_cache.ptr<float>());
+  dim3 blocks((dim / 2 + threads - 1) / threads, num_tokens);
+  cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+  auto launch = [&](auto type_tag) {
+    using T = decltype(type_tag);
+    dispatch_rope(is_rotate_half, head_size, [&](auto rotate_half, auto fixed_size) {
+      rope_kv_cache_write_kernel<T, decltype(rotate_half)::value, decltype(fixed_size)::value>
+          <<<blocks, threads, 0, stream_>>>(
+              pos, pos_ptr, dim, kv_dim, head_size, const_cast<float*>(input_q.ptr<float>()),
+              key.ptr<float>(), value.ptr<float>(),
+              const_cast<T*>(key_cache.ptr<T>()) + layer_offset,
+              const_cast<T*>(value_cache.ptr<T>()) + layer_offset, block_table.ptr<int32_t>(),
+              block_size, sin_cache.ptr<float>(), cos_cache.ptr<float>());
+    });
+  };
+  const base::DataType data_type = key_cache.data_type();
+  if (data_type == base::DataType::kDataTypeFp16) {
+    launch(half{});
+  } else if (data_type == base::DataType::kDataTypeBf16) {
+    launch(__nv_bfloat16{});
+  } else if (data_type == base::DataType::kDataTypeFp32) {
+    launch(float{});
   } else {
-    rope_kernel_cu_fp32<<<blocks, threads>>>(pos, dim, kv_dim, head_size, input_q.ptr<float>(),
-                                             input_k.ptr<float>(), sin_cache.ptr<float>(),
-                                             cos_cache.ptr<float>());
+    LOG(FATAL) << "The int8 kv cache is quantized per head and can not be written by the rope "
+                  "kernel.";
   }
 }
-}  // namespace kernel
\ No newline at end of file
+}  // namespace kernel
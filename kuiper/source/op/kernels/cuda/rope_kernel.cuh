@@ -1,12 +1,29 @@
 #ifndef ROPE_KERNEL_CU_CUH
 #define ROPE_KERNEL_CU_CUH
+#include "base/rope.h"
 #include "tensor/tensor.h"
 namespace kernel {
-void rope_kernel_cu(int32_t dim, int32_t kv_dim, int32_t head_size, const tensor::Tensor& input_q,
-                    const tensor::Tensor& input_k, const tensor::Tensor& input_pos,
-                    const tensor::Tensor& sin_cache, const tensor::Tensor& cos_cache, void* stream);
+void rope_kernel_cu(int32_t dim, int32_t kv_dim, int32_t head_size, bool is_rotate_half,
+                    const tensor::Tensor& input_q, const tensor::Tensor& input_k,
+                    const tensor::Tensor& input_pos, const tensor::Tensor& sin_cache,
+                    const tensor::Tensor& cos_cache, void* stream);
 
-void sin_cos_cache_calc_cu(int head_size, int max_seq_len, const tensor::Tensor& sin_cache,
+// rotates the query in place and writes the rotated key together with the value into the
+// fp32, fp16 or bf16 kv cache, one launch instead of the rope and the cache write kernels
+void rope_kv_cache_write_kernel_cu(int32_t dim, int32_t kv_dim, int32_t head_size,
+                                   bool is_rotate_half, const tensor::Tensor& input_q,
+                                   const tensor::Tensor& key, const tensor::Tensor& value,
+                                   const tensor::Tensor& key_cache,
+                                   const tensor::Tensor& value_cache,
+                                   const tensor::Tensor& block_table,
+                                   const tensor::Tensor& pos_tensor,
+                                   const tensor::Tensor& sin_cache,
+                                   const tensor::Tensor& cos_cache, int32_t layer_index,
+                                   int32_t block_size, void* stream);
+
+// fills the tables of base::rope_table_rows(max_seq_len) rows on the device, see base/rope.h
+void sin_cos_cache_calc_cu(int head_size, int max_seq_len, float theta,
+                           const base::RoPEScaling& scaling, const tensor::Tensor& sin_cache,
                            const tensor::Tensor& cos_cache, cudaStream_t stream);
 
 }  // namespace kernel
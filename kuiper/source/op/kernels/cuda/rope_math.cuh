@@ -0,0 +1,44 @@
+#ifndef ROPE_MATH_CUH
+#define ROPE_MATH_CUH
+namespace kernel {
+// the two elements a thread rotates and the pair of the head whose frequency they turn by. The
+// rotate half models pair element i of a head with element i + head_size / 2, the others pair
+// the adjacent elements
+template <bool kRotateHalf>
+__device__ __forceinline__ void rope_pair(int pair, int head_size, int* v0_idx, int* v1_idx,
+                                          int* freq_idx) {
+  const int head_pair_count = head_size / 2;
+  if (kRotateHalf) {
+    const int head_dim = pair % head_pair_count;
+    *v0_idx = pair / head_pair_count * head_size + head_dim;
+    *v1_idx = *v0_idx + head_pair_count;
+    *freq_idx = head_dim;
+  } else {
+    *v0_idx = pair * 2;
+    *v1_idx = *v0_idx + 1;
+    *freq_idx = pair % head_pair_count;
+  }
+}
+
+// the sin and the cos of a pair at pos from row 0 of the tables, so the tables do not grow with
+// the context. __sincosf is only accurate close to zero, the angle is reduced to [-pi, pi] with
+// 2 * pi split into two floats, and the rounding error of the product is added back after the
+// reduction so a far position keeps its accuracy
+__device__ __forceinline__ void rope_sin_cos(int pos, int freq_idx, const float* sin_cache,
+                                             const float* cos_cache, float* fci, float* fcr) {
+  constexpr float kTwoPiHi = 6.28318548202514648f;
+  constexpr float kTwoPiLo = -1.7484555314695172e-7f;
+  constexpr float kInvTwoPi = 0.159154943091895336f;
+  const float freq = sin_cache[freq_idx];
+  const float product = static_cast<float>(pos) * freq;
+  const float product_error = fmaf(static_cast<float>(pos), freq, -product);
+  const float turns = rintf(product * kInvTwoPi);
+  float angle = fmaf(-turns, kTwoPiHi, product);
+  angle = fmaf(-turns, kTwoPiLo, angle) + product_error;
+  __sincosf(angle, fci, fcr);
+  const float attention_factor = cos_cache[freq_idx];
+  *fci *= attention_factor;
+  *fcr *= attention_factor;
+}
+}  // namespace kernel
+#endif  // ROPE_MATH_CUH
@@ -0,0 +1,169 @@
+#include <cfloat>
+#include <cub/block/block_reduce.cuh>
+#include <cub/block/block_scan.cuh>
+#include <curand_kernel.h>
+#include "sampling_kernel.cuh"
+namespace kernel {
+constexpr static int sampling_thread_num = 1024;
+constexpr static int radix_bin_num = 256;
+
+// the unsigned order of the keys is the order of the floats
+__device__ __forceinline__ uint32_t order_key(float val) {
+  const uint32_t bits = __float_as_uint(val);
+  return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+// Finds the largest key such that the tokens with a key of at least this value have a total
+// weight of target, one byte of the key per pass. The weight of a token is 1 for top-k and its
+// unnormalized probability for top-p, the tokens below min_key are skipped.
+template <bool WEIGHTED>
+__device__ uint32_t radix_select(const float* logits, int size, float max_logit,
+                                 float inv_temperature, uint32_t min_key, float target,
+                                 float* hist) {
+  __shared__ uint32_t prefix;
+  __shared__ float remaining;
+  if (threadIdx.x == 0) {
+    prefix = 0;
+    remaining = target;
+  }
+  __syncthreads();
+
+  uint32_t mask = 0;
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    for (int i = threadIdx.x; i < radix_bin_num; i += blockDim.x) {
+      hist[i] = 0.f;
+    }
+    __syncthreads();
+    const uint32_t cur_prefix = prefix;
+    for (int i = threadIdx.x; i < size; i += blockDim.x) {
+      const uint32_t key = order_key(logits[i]);
+      if (key < min_key || (key & mask) != cur_prefix) {
+        continue;
+      }
+      const float weight = WEIGHTED ? __expf((logits[i] - max_logit) * inv_temperature) : 1.f;
+      atomicAdd(&hist[(key >> shift) & 0xff], weight);
+    }
+    __syncthreads();
+    if (threadIdx.x == 0) {
+      float acc = 0.f;
+      int bin = radix_bin_num - 1;
+      for (; bin > 0; --bin) {
+        if (acc + hist[bin] >= remaining) {
+          break;
+        }
+        acc += hist[bin];
+      }
+      remaining -= acc;
+      prefix = cur_prefix | (static_cast<uint32_t>(bin) << shift);
+    }
+    mask |= 0xffu << shift;
+    __syncthreads();
+  }
+  return prefix;
+}
+
+__global__ void sampling_kernel_fp32(const float* logits, int size, float inv_temperature,
+                                     int top_k, float top_p, uint64_t seed, uint64_t* counter,
+                                     const int32_t* tokens, int32_t* output_idx) {
+  using BlockReduce = cub::BlockReduce<float, sampling_thread_num>;
+  using BlockScan = cub::BlockScan<float, sampling_thread_num>;
+  __shared__ union {
+    typename BlockReduce::TempStorage reduce;
+    typename BlockScan::TempStorage scan;
+  } temp;
+  __shared__ float hist[radix_bin_num];
+  __shared__ float shared_val;
+  const int tid = threadIdx.x;
+
+  float thread_max = -FLT_MAX;
+  for (int i = tid; i < size; i += blockDim.x) {
+    thread_max = fmaxf(thread_max, logits[i]);
+  }
+  float max_logit = BlockReduce(temp.reduce).Reduce(thread_max, cub::Max());
+  if (tid == 0) {
+    shared_val = max_logit;
+  }
+  __syncthreads();
+  max_logit = shared_val;
+
+  uint32_t min_key = 0;
+  if (top_k > 0 && top_k < size) {
+    min_key = radix_select<false>(logits, size, max_logit, inv_temperature, 0,
+                                  static_cast<float>(top_k), hist);
+  }
+  auto weight_of = [&](int i) {
+    const float logit = logits[i];
+    return order_key(logit) >= min_key ? __expf((logit - max_logit) * inv_temperature) : 0.f;
+  };
+
+  if (top_p < 1.f) {
+    float thread_sum = 0.f;
+    for (int i = tid; i < size; i += blockDim.x) {
+      thread_sum += weight_of(i);
+    }
+    float sum = BlockReduce(temp.reduce).Sum(thread_sum);
+    if (tid == 0) {
+      shared_val = sum;
+    }
+    __syncthreads();
+    min_key = radix_select<true>(logits, size, max_logit, inv_temperature, min_key,
+                                 top_p * shared_val, hist);
+  }
+
+  // each thread owns a contiguous range, so the prefix of the weights follows the token order
+  const int chunk = (size + blockDim.x - 1) / blockDim.x;
+  const int begin = min(tid * chunk, size);
+  const int end = min(begin + chunk, size);
+  float thread_sum = 0.f;
+  for (int i = begin; i < end; ++i) {
+    thread_sum += weight_of(i);
+  }
+  float prefix_sum = 0.f;
+  float total = 0.f;
+  BlockScan(temp.scan).ExclusiveSum(thread_sum, prefix_sum, total);
+  if (tid == 0) {
+    curandStatePhilox4_32_10_t state;
+    const uint64_t offset = *counter;
+    *counter = offset + 1;
+    curand_init(seed, offset, 0, &state);
+    shared_val = curand_uniform(&state) * total;
+  }
+  __syncthreads();
+  const float threshold = shared_val;
+
+  // the last range starting below the draw holds the token, this also absorbs the rounding
+  // of the scan when the draw is equal to the total
+  const bool is_owner = thread_sum > 0.f && prefix_sum < threshold;
+  float owner = BlockReduce(temp.reduce).Reduce(is_owner ? static_cast<float>(tid) : -1.f,
+                                                cub::Max());
+  if (tid == 0) {
+    shared_val = owner;
+  }
+  __syncthreads();
+  if (tid != static_cast<int>(shared_val)) {
+    return;
+  }
+  float acc = prefix_sum;
+  int32_t picked = begin;
+  for (int i = begin; i < end; ++i) {
+    const float weight = weight_of(i);
+    if (weight > 0.f) {
+      picked = i;
+      acc += weight;
+      if (acc >= threshold) {
+        break;
+      }
+    }
+  }
+  *output_idx = tokens ? tokens[picked] : picked;
+}
+
+void sampling_kernel_cu(const float* logits, size_t size, float temperature, int32_t top_k,
+                        float top_p, uint64_t seed, uint64_t* counter, int32_t* output_idx,
+                        void* stream, const int32_t* tokens) {
+  cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+  sampling_kernel_fp32<<<1, sampling_thread_num, 0, stream_>>>(
+      logits, static_cast<int>(size), 1.f / temperature, top_k, top_p, seed, counter, tokens,
+      output_idx);
+}
+}  // namespace kernel
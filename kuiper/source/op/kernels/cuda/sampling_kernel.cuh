@@ -0,0 +1,14 @@
+#ifndef SAMPLING_KERNEL_CUH
+#define SAMPLING_KERNEL_CUH
+#include <cstddef>
+#include <cstdint>
+namespace kernel {
+// samples one token from softmax(logits / temperature) restricted to the top_k tokens and to
+// the smallest set of them reaching the probability top_p. counter is a device value which
+// selects the random draw and is advanced by the kernel, so the launch can be replayed. The
+// logits of a candidate list are mapped to their tokens through tokens when it is not null
+void sampling_kernel_cu(const float* logits, size_t size, float temperature, int32_t top_k,
+                        float top_p, uint64_t seed, uint64_t* counter, int32_t* output_idx,
+                        void* stream, const int32_t* tokens = nullptr);
+}  // namespace kernel
+#endif  // SAMPLING_KERNEL_CUH
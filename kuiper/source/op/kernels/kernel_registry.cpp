@@ -0,0 +1,169 @@
+#include "kernel_registry.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+#include "kernels_interface.h"
+namespace kernel {
+KernelKey::KernelKey(base::DeviceType device_type, base::DataType data_type,
+                     std::vector<int32_t> dims)
+    : device_type(device_type), data_type(data_type), dims(std::move(dims)) {}
+
+KernelKey::KernelKey(base::DeviceType device_type, const tensor::Tensor& tensor)
+    : device_type(device_type), data_type(tensor.data_type()), dims(tensor.dims()) {}
+
+KernelRegistry& KernelRegistry::global() {
+  static KernelRegistry registry;
+  return registry;
+}
+
+KernelRegistry::KernelRegistry() {
+  register_builtin_kernels(*this);
+  // "op=name" pairs separated by commas
+  const char* env = std::getenv("KUIPER_KERNEL_OVERRIDE");
+  if (env) {
+    std::stringstream stream(env);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+      const size_t split = item.find('=');
+      if (split == std::string::npos || split == 0 || split + 1 == item.size()) {
+        LOG(WARNING) << "Ignoring the kernel override " << item << ", it should be op=name.";
+        continue;
+      }
+      overrides_[item.substr(0, split)] = item.substr(split + 1);
+    }
+  }
+}
+
+void KernelRegistry::add(KernelVariant variant) {
+  CHECK(variant.kernel != nullptr) << "The variant " << variant.name << " of " << variant.op
+                                   << " has no kernel.";
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<KernelVariant>& variants = variants_[variant.op];
+  variants.erase(std::remove_if(variants.begin(), variants.end(),
+                                [&variant](const KernelVariant& other) {
+                                  return other.device_type == variant.device_type &&
+                                         other.name == variant.name;
+                                }),
+                 variants.end());
+  // by priority, the later one of the same priority comes first
+  auto iter = std::find_if(
+      variants.begin(), variants.end(),
+      [&variant](const KernelVariant& other) { return other.priority <= variant.priority; });
+  variants.insert(iter, std::move(variant));
+  generation_ += 1;
+}
+
+const KernelVariant* KernelRegistry::find(const std::string& op, const KernelKey& key) const {
+  auto variants_iter = variants_.find(op);
+  if (variants_iter == variants_.end()) {
+    return nullptr;
+  }
+  const std::vector<KernelVariant>& variants = variants_iter->second;
+  auto by_name = [&variants, &key](const std::string& name) -> const KernelVariant* {
+    for (const KernelVariant& variant : variants) {
+      if (variant.device_type == key.device_type && variant.name == name) {
+        return &variant;
+      }
+    }
+    return nullptr;
+  };
+  // a forced variant skips its predicate, a name unknown on the device falls back
+  auto override_iter = overrides_.find(op);
+  if (override_iter != overrides_.end()) {
+    if (const KernelVariant* variant = by_name(override_iter->second)) {
+      return variant;
+    }
+  }
+  auto winner_iter = winners_.find({op, key});
+  if (winner_iter != winners_.end()) {
+    if (const KernelVariant* variant = by_name(winner_iter->second)) {
+      return variant;
+    }
+  }
+  for (const KernelVariant& variant : variants) {
+    if (variant.device_type == key.device_type && (!variant.predicate || variant.predicate(key))) {
+      return &variant;
+    }
+  }
+  return nullptr;
+}
+
+AnyKernel KernelRegistry::select(const std::string& op, const KernelKey& key) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const KernelVariant* variant = find(op, key);
+  if (!variant) {
+    LOG(FATAL) << "Unknown device type for get a " << op << " kernel.";
+    return nullptr;
+  }
+  return variant->kernel;
+}
+
+std::string KernelRegistry::selected_name(const std::string& op, const KernelKey& key) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const KernelVariant* variant = find(op, key);
+  return variant ? variant->name : "";
+}
+
+std::vector<KernelVariant> KernelRegistry::candidates(const std::string& op,
+                                                      const KernelKey& key) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<KernelVariant> candidates;
+  auto variants_iter = variants_.find(op);
+  if (variants_iter == variants_.end()) {
+    return candidates;
+  }
+  for (const KernelVariant& variant : variants_iter->second) {
+    if (variant.device_type == key.device_type && (!variant.predicate || variant.predicate(key))) {
+      candidates.push_back(variant);
+    }
+  }
+  return candidates;
+}
+
+void KernelRegistry::set_override(const std::string& op, const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  overrides_[op] = name;
+  generation_ += 1;
+}
+
+void KernelRegistry::clear_override(const std::string& op) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  overrides_.erase(op);
+  generation_ += 1;
+}
+
+void KernelRegistry::set_winner(const std::string& op, const KernelKey& key,
+                                const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  winners_[{op, key}] = name;
+  generation_ += 1;
+}
+
+void KernelRegistry::clear_winners() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  winners_.clear();
+  generation_ += 1;
+}
+
+uint64_t KernelRegistry::generation() const { return generation_.load(); }
+
+AnyKernel select_cached(KernelCache& cache, const char* op, base::DeviceType device_type,
+                        base::DataType data_type, const int32_t* dims, size_t dim_num) {
+  KernelRegistry& registry = KernelRegistry::global();
+  const uint64_t generation = registry.generation();
+  if (cache.kernel && cache.generation == generation && cache.device_type == device_type &&
+      cache.data_type == data_type && cache.dims.size() == dim_num &&
+      std::equal(dims, dims + dim_num, cache.dims.begin()) && cache.op == op) {
+    return cache.kernel;
+  }
+  cache.op = op;
+  cache.device_type = device_type;
+  cache.data_type = data_type;
+  cache.dims.assign(dims, dims + dim_num);
+  // a change during the select starts another generation, the next call selects again
+  cache.generation = generation;
+  cache.kernel = registry.select(cache.op, KernelKey(device_type, data_type, cache.dims));
+  return cache.kernel;
+}
+}  // namespace kernel
@@ -0,0 +1,140 @@
+#ifndef KUIPER_SOURCE_OP_KERNELS_KERNEL_REGISTRY_H_
+#define KUIPER_SOURCE_OP_KERNELS_KERNEL_REGISTRY_H_
+#include <atomic>
+#include <functional>
+#include <initializer_list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "base/base.h"
+#include "op/kernel_cache.h"
+#include "tensor/tensor.h"
+namespace kernel {
+// the launch a variant is selected for: the device, the data type of the weight or of the
+// first input and its dims. The matmuls pass their weight, mha passes {head_num, head_size}
+struct KernelKey {
+  base::DeviceType device_type = base::DeviceType::kDeviceUnknown;
+  base::DataType data_type = base::DataType::kDataTypeUnknown;
+  std::vector<int32_t> dims;
+
+  KernelKey() = default;
+
+  explicit KernelKey(base::DeviceType device_type,
+                     base::DataType data_type = base::DataType::kDataTypeUnknown,
+                     std::vector<int32_t> dims = {});
+
+  KernelKey(base::DeviceType device_type, const tensor::Tensor& tensor);
+
+  bool operator<(const KernelKey& other) const {
+    return std::tie(device_type, data_type, dims) <
+           std::tie(other.device_type, other.data_type, other.dims);
+  }
+};
+
+// the function pointers of every op are stored as this type and cast back by select_kernel
+using AnyKernel = void (*)();
+
+// a predicate without a function accepts every key of its device
+using KernelPredicate = std::function<bool(const KernelKey&)>;
+
+struct KernelVariant {
+  std::string op;
+  std::string name;
+  base::DeviceType device_type = base::DeviceType::kDeviceUnknown;
+  // the variant of the highest priority whose predicate accepts the key is selected
+  int32_t priority = 0;
+  KernelPredicate predicate;
+  AnyKernel kernel = nullptr;
+};
+
+// The implementations of every op by device, data type and shape. The built-in kernels are the
+// variants "cpu" and "cuda" of priority 0, an alternative one such as a cublas or a split-k
+// matmul is added next to them with a higher priority and a predicate of the shapes it is
+// faster on.
+//
+// A variant is forced by its name through set_override or the environment variable
+// KUIPER_KERNEL_OVERRIDE="matmul=cublas,mha=cuda", which is read once. The autotuner times
+// the candidates of a key and records the fastest one with set_winner, a winner comes before
+// the priorities but after an override.
+class KernelRegistry {
+ public:
+  static KernelRegistry& global();
+
+  // a variant of the same op, device and name replaces the registered one
+  void add(KernelVariant variant);
+
+  // LOG(FATAL) when no variant of the op accepts the key
+  AnyKernel select(const std::string& op, const KernelKey& key) const;
+
+  // the name of the variant select returns
+  std::string selected_name(const std::string& op, const KernelKey& key) const;
+
+  // the variants which accept the key, the highest priority first
+  std::vector<KernelVariant> candidates(const std::string& op, const KernelKey& key) const;
+
+  void set_override(const std::string& op, const std::string& name);
+
+  void clear_override(const std::string& op);
+
+  void set_winner(const std::string& op, const KernelKey& key, const std::string& name);
+
+  void clear_winners();
+
+  uint64_t generation() const;
+
+ private:
+  KernelRegistry();
+
+  // the variant for the key or nullptr, with the mutex held
+  const KernelVariant* find(const std::string& op, const KernelKey& key) const;
+
+ private:
+  mutable std::mutex mutex_;
+  std::map<std::string, std::vector<KernelVariant>> variants_;
+  std::map<std::string, std::string> overrides_;
+  std::map<std::pair<std::string, KernelKey>, std::string> winners_;
+  std::atomic<uint64_t> generation_{1};
+};
+
+// the kernel of the op for the key of dim_num dims from the cache of a launch site, it is
+// selected from the registry only when the op, the key or the generation of the registry differ
+// from the ones of the cached kernel
+AnyKernel select_cached(KernelCache& cache, const char* op, base::DeviceType device_type,
+                        base::DataType data_type, const int32_t* dims, size_t dim_num);
+
+template <typename Kernel>
+Kernel select_kernel(const std::string& op, const KernelKey& key) {
+  return reinterpret_cast<Kernel>(KernelRegistry::global().select(op, key));
+}
+
+template <typename Kernel>
+Kernel select_kernel(KernelCache& cache, const char* op, base::DeviceType device_type,
+                     base::DataType data_type, const std::vector<int32_t>& dims) {
+  return reinterpret_cast<Kernel>(
+      select_cached(cache, op, device_type, data_type, dims.data(), dims.size()));
+}
+
+template <typename Kernel>
+Kernel select_kernel(KernelCache& cache, const char* op, base::DeviceType device_type,
+                     base::DataType data_type, std::initializer_list<int32_t> dims) {
+  return reinterpret_cast<Kernel>(
+      select_cached(cache, op, device_type, data_type, dims.begin(), dims.size()));
+}
+
+template <typename Kernel>
+KernelVariant make_kernel_variant(const std::string& op, const std::string& name,
+                                  base::DeviceType device_type, Kernel kernel,
+                                  int32_t priority = 0, KernelPredicate predicate = nullptr) {
+  KernelVariant variant;
+  variant.op = op;
+  variant.name = name;
+  variant.device_type = device_type;
+  variant.priority = priority;
+  variant.predicate = std::move(predicate);
+  variant.kernel = reinterpret_cast<AnyKernel>(kernel);
+  return variant;
+}
+}  // namespace kernel
+#endif  // KUIPER_SOURCE_OP_KERNELS_KERNEL_REGISTRY_H_
@@ -1,6 +1,8 @@
 #ifndef KERNELS_INTERFACE_H
 #define KERNELS_INTERFACE_H
+#include <base/attention_window.h>
 #include <base/cuda_config.h>
+#include "kernel_registry.h"
 #include "tensor/tensor.h"
 namespace kernel {
 typedef void (*AddKernel)(const tensor::Tensor& input1, const tensor::Tensor& input2,
@@ -13,6 +15,37 @@ typedef void (*MatmulKernelQuant)(const tensor::Tensor& input, const tensor::Ten
                                   const tensor::Tensor& output, int32_t group_size,
                                   const tensor::Tensor& scale, const CudaConfig* config);
 
+// output = input @ weight^T + bias, the bias of the output rows is added by the epilogue
+typedef void (*MatmulBiasKernel)(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                 const tensor::Tensor& bias, const tensor::Tensor& output,
+                                 const CudaConfig* config);
+
+typedef void (*MatmulBiasKernelQuant)(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                      const tensor::Tensor& bias, const tensor::Tensor& output,
+                                      int32_t group_size, const tensor::Tensor& scale,
+                                      const CudaConfig* config);
+
+// weight: [2 * hidden_dim, dim], output = silu(gate rows @ input) * (up rows @ input)
+typedef void (*MatmulSwiGLUKernel)(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                   const tensor::Tensor& output, const CudaConfig* config);
+
+typedef void (*MatmulSwiGLUKernelQuant)(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                        const tensor::Tensor& output, int32_t group_size,
+                                        const tensor::Tensor& scale, const CudaConfig* config);
+
+// weight: [K, M / 2] int4 pairs, scale: fp16 per group, zero_point: uint8 per group or empty
+typedef void (*MatmulKernelQuant4)(const tensor::Tensor& input, const tensor::Tensor& weight,
+                                   const tensor::Tensor& output, int32_t group_size,
+                                   const tensor::Tensor& scale, const tensor::Tensor& zero_point,
+                                   const CudaConfig* config);
+
+typedef void (*MatmulSwiGLUKernelQuant4)(const tensor::Tensor& input,
+                                         const tensor::Tensor& weight,
+                                         const tensor::Tensor& output, int32_t group_size,
+                                         const tensor::Tensor& scale,
+                                         const tensor::Tensor& zero_point,
+                                         const CudaConfig* config);
+
 typedef void (*EmbeddingKernel)(const tensor::Tensor& input, const tensor::Tensor& weight,
                                 const tensor::Tensor& output, int32_t vocab_size, void* stream);
 
@@ -20,17 +53,42 @@ typedef void (*SwigluKernel)(const tensor::Tensor& input1, const tensor::Tensor&
                              const tensor::Tensor& output, void* stream);
 
 typedef void (*MHAKernel)(int32_t pos, int32_t head_num, int32_t layer_index, int32_t seq_len,
-                          int32_t kv_dim, int32_t kv_mul, int32_t head_size,
+                          int32_t kv_dim, int32_t kv_mul, int32_t head_size, int32_t block_size,
                           const tensor::Tensor& mha_out, const tensor::Tensor& query_tensor,
                           const tensor::Tensor& score_tensor,
                           const tensor::Tensor& key_cache_tensor,
-                          const tensor::Tensor& value_cache_tensor, base::DeviceType device_type,
+                          const tensor::Tensor& value_cache_tensor,
+                          const tensor::Tensor& key_scale_tensor,
+                          const tensor::Tensor& value_scale_tensor,
+                          const tensor::Tensor& block_table,
+                          const tensor::Tensor& pos_tensor,
+                          const base::AttentionWindow& window, base::DeviceType device_type,
                           CudaConfig*);
 
+// the largest head the tiles of the flash prefill kernel hold in the shared memory
+constexpr int32_t kFlashPrefillMaxHeadSize = 128;
+
+// the causal attention of the rows of a prompt from start_pos on, the keys and values of the
+// prompt are read from key_tensor and value_tensor and stored into the caches on the way
+typedef void (*FlashPrefillKernel)(int32_t start_pos, int32_t head_num, int32_t layer_index,
+                                   int32_t kv_dim, int32_t kv_mul, int32_t head_size,
+                                   int32_t block_size, const tensor::Tensor& mha_out,
+                                   const tensor::Tensor& query_tensor,
+                                   const tensor::Tensor& key_tensor,
+                                   const tensor::Tensor& value_tensor,
+                                   const tensor::Tensor& key_cache_tensor,
+                                   const tensor::Tensor& value_cache_tensor,
+                                   const tensor::Tensor& block_table,
+                                   const base::AttentionWindow& window, void* stream);
+
 typedef void (*RMSNormKernel)(const tensor::Tensor& input, const tensor::Tensor& weight,
                               const tensor::Tensor& output, void* stream);
 
-typedef void (*RoPEKernel)(int32_t dim, int32_t kv_dim, int32_t head_size,
+typedef void (*AddRMSNormKernel)(const tensor::Tensor& residual, const tensor::Tensor& input,
+                                 const tensor::Tensor& weight, const tensor::Tensor& output,
+                                 void* stream);
+
+typedef void (*RoPEKernel)(int32_t dim, int32_t kv_dim, int32_t head_size, bool is_rotate_half,
                            const tensor::Tensor& input_q, const tensor::Tensor& input_k,
                            const tensor::Tensor& input_pos, const tensor::Tensor& sin_cache,
                            const tensor::Tensor& cos_cache, void* stream);
@@ -43,22 +101,116 @@ typedef void (*ScaleSumKernel)(const tensor::Tensor& value, const tensor::Tensor
                                const tensor::Tensor& output, int t, int size, int stride,
                                void* stream);
 
+typedef void (*GatherColumnsKernel)(const tensor::Tensor& input, const tensor::Tensor& order,
+                                    const tensor::Tensor& output, void* stream);
+
+// output[n] += scale * (input[n] @ lora_a^T) @ lora_b of the adapter of the row n, adapters has
+// one adapter for every row or one for all of them and the rows of adapter -1 are left alone.
+// lora_a: [adapter_num, rank, M], lora_b: [adapter_num, rank, K], lora_scales: [adapter_num]
+typedef void (*LoraKernel)(const tensor::Tensor& input, const tensor::Tensor& lora_a,
+                           const tensor::Tensor& lora_b, const tensor::Tensor& lora_scales,
+                           const tensor::Tensor& adapters, const tensor::Tensor& workspace,
+                           const tensor::Tensor& output, const CudaConfig* config);
+
+typedef void (*CastKernel)(const tensor::Tensor& input, const tensor::Tensor& output,
+                           void* stream);
+
+typedef void (*KVCacheWriteKernel)(const tensor::Tensor& key, const tensor::Tensor& value,
+                                   const tensor::Tensor& key_cache,
+                                   const tensor::Tensor& value_cache,
+                                   const tensor::Tensor& key_scale,
+                                   const tensor::Tensor& value_scale,
+                                   const tensor::Tensor& block_table,
+                                   const tensor::Tensor& pos_tensor, int32_t layer_index,
+                                   int32_t block_size, const base::AttentionWindow& window,
+                                   void* stream);
+
+typedef void (*RoPEKVCacheWriteKernel)(int32_t dim, int32_t kv_dim, int32_t head_size,
+                                       bool is_rotate_half, const tensor::Tensor& input_q,
+                                       const tensor::Tensor& key,
+                                       const tensor::Tensor& value,
+                                       const tensor::Tensor& key_cache,
+                                       const tensor::Tensor& value_cache,
+                                       const tensor::Tensor& block_table,
+                                       const tensor::Tensor& pos_tensor,
+                                       const tensor::Tensor& sin_cache,
+                                       const tensor::Tensor& cos_cache, int32_t layer_index,
+                                       int32_t block_size, void* stream);
+
 void softmax_inplace_cpu(const float* input_ptr, size_t size);
 
+// the kernels of this tree, KernelRegistry adds them when it is created
+void register_builtin_kernels(KernelRegistry& registry);
+
 AddKernel get_add_kernel(base::DeviceType device_type);
 
 EmbeddingKernel get_emb_kernel(base::DeviceType device_type);
 
 MatmulKernel get_matmul_kernel(base::DeviceType device_type);
 
+// the variant of the weight, see KernelRegistry
+MatmulKernel get_matmul_kernel(const KernelKey& key);
+
 MatmulKernelQuant get_matmul_kernel_quant8(base::DeviceType device_type);
 
+MatmulKernelQuant get_matmul_kernel_quant8(const KernelKey& key);
+
+MatmulSwiGLUKernel get_matmul_swiglu_kernel(base::DeviceType device_type);
+
+MatmulSwiGLUKernel get_matmul_swiglu_kernel(const KernelKey& key);
+
+MatmulSwiGLUKernelQuant get_matmul_swiglu_kernel_quant8(base::DeviceType device_type);
+
+MatmulSwiGLUKernelQuant get_matmul_swiglu_kernel_quant8(const KernelKey& key);
+
+MatmulBiasKernel get_matmul_bias_kernel(const KernelKey& key);
+
+MatmulBiasKernelQuant get_matmul_bias_kernel_quant8(const KernelKey& key);
+
+// the int8 weights in the tiled layout of kernel::tile_int8_weight_cu, only on the cuda device
+MatmulKernelQuant get_matmul_kernel_quant8_tiled(const KernelKey& key);
+
+MatmulSwiGLUKernelQuant get_matmul_swiglu_kernel_quant8_tiled(const KernelKey& key);
+
+MatmulBiasKernelQuant get_matmul_bias_kernel_quant8_tiled(const KernelKey& key);
+
+MatmulKernelQuant4 get_matmul_kernel_quant4(base::DeviceType device_type);
+
+MatmulKernelQuant4 get_matmul_kernel_quant4(const KernelKey& key);
+
+MatmulSwiGLUKernelQuant4 get_matmul_swiglu_kernel_quant4(base::DeviceType device_type);
+
+MatmulSwiGLUKernelQuant4 get_matmul_swiglu_kernel_quant4(const KernelKey& key);
+
+// the e4m3 weights take one fp32 scale per row, so the group is a row
+MatmulKernelQuant get_matmul_kernel_fp8(const KernelKey& key);
+
+MatmulSwiGLUKernelQuant get_matmul_swiglu_kernel_fp8(const KernelKey& key);
+
 MHAKernel get_mha_kernel(base::DeviceType device_type);
 
+// the variant of the key {head_num, head_size}
+MHAKernel get_mha_kernel(const KernelKey& key);
+
+// the variant of the key {head_num, head_size}, there is only one on the cuda device
+FlashPrefillKernel get_flash_prefill_kernel(const KernelKey& key);
+
+CastKernel get_cast_kernel(base::DeviceType device_type);
+
+GatherColumnsKernel get_gather_columns_kernel(base::DeviceType device_type);
+
+LoraKernel get_lora_kernel(base::DeviceType device_type);
+
+KVCacheWriteKernel get_kv_cache_write_kernel(base::DeviceType device_type);
+
 RMSNormKernel get_rmsnorm_kernel(base::DeviceType device_type);
 
+AddRMSNormKernel get_add_rmsnorm_kernel(base::DeviceType device_type);
+
 RoPEKernel get_rope_kernel(base::DeviceType device_type);
 
+RoPEKVCacheWriteKernel get_rope_kv_cache_write_kernel(base::DeviceType device_type);
+
 ScaleKernel get_scale_kernel(base::DeviceType device_type);
 
 SoftmaxInplaceKernel get_softmax_kernel(base::DeviceType device_type);
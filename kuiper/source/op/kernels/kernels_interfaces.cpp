@@ -1,6 +1,8 @@
 #include <base/base.h>
 #include "cpu/add_kernel.h"
 #include "cpu/emb_kernel.h"
+#include "cpu/kv_cache_kernel.h"
+#include "cpu/lora_kernel.h"
 #include "cpu/matmul_kernel.h"
 #include "cpu/mha_kernel.h"
 #include "cpu/rmsnorm_kernel.h"
@@ -10,125 +12,214 @@
 #include "cpu/softmax_kernel.h"
 #include "cpu/swiglu_kernel.h"
 #include "cuda/add_kernel.cuh"
+#include "cuda/cast_kernel.cuh"
 #include "cuda/emb_kernel.cuh"
+#include "cuda/kv_cache_kernel.cuh"
+#include "cuda/lora_kernel.cuh"
 #include "cuda/matmul_kernel.cuh"
 #include "cuda/mha_kernel.cuh"
 #include "cuda/rmsnorm_kernel.cuh"
 #include "cuda/rope_kernel.cuh"
 #include "cuda/swiglu_kernel.cuh"
+#include "kernel_registry.h"
 #include "kernels_interface.h"
 namespace kernel {
-AddKernel get_add_kernel(base::DeviceType device_type) {
-  if (device_type == base::DeviceType::kDeviceCPU) {
-    return add_kernel_cpu;
-  } else if (device_type == base::DeviceType::kDeviceCUDA) {
-    return add_kernel_cu;
-  } else {
-    LOG(FATAL) << "Unknown device type for get a add kernel.";
-    return nullptr;
+// the variants "cpu" and "cuda" of priority 0, an op without a kernel on a device has none
+template <typename Kernel>
+static void add_builtin(KernelRegistry& registry, const char* op, Kernel cpu_kernel,
+                        Kernel cuda_kernel) {
+  if (cpu_kernel) {
+    registry.add(make_kernel_variant(op, "cpu", base::DeviceType::kDeviceCPU, cpu_kernel));
+  }
+  if (cuda_kernel) {
+    registry.add(make_kernel_variant(op, "cuda", base::DeviceType::kDeviceCUDA, cuda_kernel));
   }
 }
 
+void register_builtin_kernels(KernelRegistry& registry) {
+  add_builtin<AddKernel>(registry, "add", add_kernel_cpu, add_kernel_cu);
+  add_builtin<EmbeddingKernel>(registry, "embedding", emb_kernel_normal, emb_kernel_cu);
+  add_builtin<MatmulKernel>(registry, "matmul", matmul_kernel_cpu, matmul_kernel_cu);
+  add_builtin<MatmulKernelQuant>(registry, "matmul_int8", matmul_kernel_cpu_qint8,
+                                 matmul_kernel_cu_qint8);
+  add_builtin<MatmulSwiGLUKernel>(registry, "matmul_swiglu", matmul_swiglu_kernel_cpu,
+                                  matmul_swiglu_kernel_cu);
+  add_builtin<MatmulSwiGLUKernelQuant>(registry, "matmul_swiglu_int8",
+                                       matmul_swiglu_kernel_cpu_qint8,
+                                       matmul_swiglu_kernel_cu_qint8);
+  add_builtin<MatmulKernelQuant>(registry, "matmul_int8_tiled", nullptr,
+                                 matmul_kernel_cu_qint8_tiled);
+  add_builtin<MatmulSwiGLUKernelQuant>(registry, "matmul_swiglu_int8_tiled", nullptr,
+                                       matmul_swiglu_kernel_cu_qint8_tiled);
+  add_builtin<MatmulBiasKernel>(registry, "matmul_bias", matmul_bias_kernel_cpu,
+                                matmul_bias_kernel_cu);
+  add_builtin<MatmulBiasKernelQuant>(registry, "matmul_bias_int8", matmul_bias_kernel_cpu_qint8,
+                                     matmul_bias_kernel_cu_qint8);
+  add_builtin<MatmulBiasKernelQuant>(registry, "matmul_bias_int8_tiled", nullptr,
+                                     matmul_bias_kernel_cu_qint8_tiled);
+  add_builtin<MatmulKernelQuant4>(registry, "matmul_int4", nullptr, matmul_kernel_cu_qint4);
+  add_builtin<MatmulSwiGLUKernelQuant4>(registry, "matmul_swiglu_int4", nullptr,
+                                        matmul_swiglu_kernel_cu_qint4);
+  add_builtin<MatmulKernelQuant>(registry, "matmul_fp8", nullptr, matmul_kernel_cu_fp8);
+  add_builtin<MatmulSwiGLUKernelQuant>(registry, "matmul_swiglu_fp8", nullptr,
+                                       matmul_swiglu_kernel_cu_fp8);
+  add_builtin<MHAKernel>(registry, "mha", mha_kernel, mha_kernel_cu);
+  add_builtin<FlashPrefillKernel>(registry, "flash_prefill", nullptr, flash_prefill_kernel_cu);
+  add_builtin<CastKernel>(registry, "cast", nullptr, cast_kernel_cu);
+  add_builtin<GatherColumnsKernel>(registry, "gather_columns", gather_columns_kernel_cpu,
+                                   gather_columns_kernel_cu);
+  add_builtin<LoraKernel>(registry, "lora", lora_kernel_cpu, lora_kernel_cu);
+  add_builtin<KVCacheWriteKernel>(registry, "kv_cache_write", kv_cache_write_kernel_cpu,
+                                  kv_cache_write_kernel_cu);
+  add_builtin<RoPEKernel>(registry, "rope", rope_kernel_cpu, rope_kernel_cu);
+  add_builtin<RoPEKVCacheWriteKernel>(registry, "rope_kv_cache_write", nullptr,
+                                      rope_kv_cache_write_kernel_cu);
+  add_builtin<ScaleKernel>(registry, "scale", scale_inplace_cpu, nullptr);
+  add_builtin<SoftmaxInplaceKernel>(registry, "softmax", softmax_inplace_cpu, nullptr);
+  add_builtin<SwigluKernel>(registry, "swiglu", swiglu_kernel_cpu, swiglu_kernel_cu);
+  add_builtin<RMSNormKernel>(registry, "rmsnorm", rmsnorm_kernel_cpu, rmsnorm_kernel_cu);
+  add_builtin<AddRMSNormKernel>(registry, "add_rmsnorm", add_rmsnorm_kernel_cpu,
+                                add_rmsnorm_kernel_cu);
+  add_builtin<ScaleSumKernel>(registry, "scale_sum", scale_sum_kernel_cpu, nullptr);
+}
+
+AddKernel get_add_kernel(base::DeviceType device_type) {
+  return select_kernel<AddKernel>("add", KernelKey(device_type));
+}
+
 EmbeddingKernel get_emb_kernel(base::DeviceType device_type) {
-  if (device_type == base::DeviceType::kDeviceCPU) {
-    return emb_kernel_normal;
-  } else if (device_type == base::DeviceType::kDeviceCUDA) {
-    return emb_kernel_cu;
-  } else {
-    LOG(FATAL) << "Unknown device type for get an embedding kernel.";
-    return nullptr;
-  }
+  return select_kernel<EmbeddingKernel>("embedding", KernelKey(device_type));
 }
 
 MatmulKernel get_matmul_kernel(base::DeviceType device_type) {
-  if (device_type == base::DeviceType::kDeviceCPU) {
-    return matmul_kernel_cpu;
-  } else if (device_type == base::DeviceType::kDeviceCUDA) {
-    return matmul_kernel_cu;
-  } else {
-    LOG(FATAL) << "Unknown device type for get an matmul kernel.";
-    return nullptr;
-  }
+  return get_matmul_kernel(KernelKey(device_type));
+}
+
+MatmulKernel get_matmul_kernel(const KernelKey& key) {
+  return select_kernel<MatmulKernel>("matmul", key);
 }
 
 MatmulKernelQuant get_matmul_kernel_quant8(base::DeviceType device_type) {
-  if (device_type == base::DeviceType::kDeviceCUDA) {
-    return matmul_kernel_cu_qint8;
-  } else {
-    LOG(FATAL) << "Unknown device type for get an matmul kernel.";
-    return nullptr;
-  }
+  return get_matmul_kernel_quant8(KernelKey(device_type));
+}
+
+MatmulKernelQuant get_matmul_kernel_quant8(const KernelKey& key) {
+  return select_kernel<MatmulKernelQuant>("matmul_int8", key);
+}
+
+MatmulSwiGLUKernel get_matmul_swiglu_kernel(base::DeviceType device_type) {
+  return get_matmul_swiglu_kernel(KernelKey(device_type));
+}
+
+MatmulSwiGLUKernel get_matmul_swiglu_kernel(const KernelKey& key) {
+  return select_kernel<MatmulSwiGLUKernel>("matmul_swiglu", key);
+}
+
+MatmulSwiGLUKernelQuant get_matmul_swiglu_kernel_quant8(base::DeviceType device_type) {
+  return get_matmul_swiglu_kernel_quant8(KernelKey(device_type));
+}
+
+MatmulSwiGLUKernelQuant get_matmul_swiglu_kernel_quant8(const KernelKey& key) {
+  return select_kernel<MatmulSwiGLUKernelQuant>("matmul_swiglu_int8", key);
+}
+
+MatmulKernelQuant get_matmul_kernel_quant8_tiled(const KernelKey& key) {
+  return select_kernel<MatmulKernelQuant>("matmul_int8_tiled", key);
+}
+
+MatmulSwiGLUKernelQuant get_matmul_swiglu_kernel_quant8_tiled(const KernelKey& key) {
+  return select_kernel<MatmulSwiGLUKernelQuant>("matmul_swiglu_int8_tiled", key);
+}
+
+MatmulBiasKernel get_matmul_bias_kernel(const KernelKey& key) {
+  return select_kernel<MatmulBiasKernel>("matmul_bias", key);
+}
+
+MatmulBiasKernelQuant get_matmul_bias_kernel_quant8(const KernelKey& key) {
+  return select_kernel<MatmulBiasKernelQuant>("matmul_bias_int8", key);
+}
+
+MatmulBiasKernelQuant get_matmul_bias_kernel_quant8_tiled(const KernelKey& key) {
+  return select_kernel<MatmulBiasKernelQuant>("matmul_bias_int8_tiled", key);
+}
+
+MatmulKernelQuant4 get_matmul_kernel_quant4(base::DeviceType device_type) {
+  return get_matmul_kernel_quant4(KernelKey(device_type));
+}
+
+MatmulKernelQuant4 get_matmul_kernel_quant4(const KernelKey& key) {
+  return select_kernel<MatmulKernelQuant4>("matmul_int4", key);
+}
+
+MatmulSwiGLUKernelQuant4 get_matmul_swiglu_kernel_quant4(base::DeviceType device_type) {
+  return get_matmul_swiglu_kernel_quant4(KernelKey(device_type));
+}
+
+MatmulSwiGLUKernelQuant4 get_matmul_swiglu_kernel_quant4(const KernelKey& key) {
+  return select_kernel<MatmulSwiGLUKernelQuant4>("matmul_swiglu_int4", key);
+}
+
+MatmulKernelQuant get_matmul_kernel_fp8(const KernelKey& key) {
+  return select_kernel<MatmulKernelQuant>("matmul_fp8", key);
+}
+
+MatmulSwiGLUKernelQuant get_matmul_swiglu_kernel_fp8(const KernelKey& key) {
+  return select_kernel<MatmulSwiGLUKernelQuant>("matmul_swiglu_fp8", key);
 }
 
 MHAKernel get_mha_kernel(base::DeviceType device_type) {
-  if (device_type == base::DeviceType::kDeviceCPU) {
-    return mha_kernel;
-  } else if (device_type == base::DeviceType::kDeviceCUDA) {
-    return mha_kernel_cu;
-  } else {
-    LOG(FATAL) << "Unknown device type for get an mha kernel.";
-    return nullptr;
-  }
+  return get_mha_kernel(KernelKey(device_type));
+}
+
+MHAKernel get_mha_kernel(const KernelKey& key) {
+  return select_kernel<MHAKernel>("mha", key);
+}
+
+FlashPrefillKernel get_flash_prefill_kernel(const KernelKey& key) {
+  return select_kernel<FlashPrefillKernel>("flash_prefill", key);
+}
+
+CastKernel get_cast_kernel(base::DeviceType device_type) {
+  return select_kernel<CastKernel>("cast", KernelKey(device_type));
+}
+
+GatherColumnsKernel get_gather_columns_kernel(base::DeviceType device_type) {
+  return select_kernel<GatherColumnsKernel>("gather_columns", KernelKey(device_type));
+}
+
+KVCacheWriteKernel get_kv_cache_write_kernel(base::DeviceType device_type) {
+  return select_kernel<KVCacheWriteKernel>("kv_cache_write", KernelKey(device_type));
 }
 
 RoPEKernel get_rope_kernel(base::DeviceType device_type) {
-  if (device_type == base::DeviceType::kDeviceCPU) {
-    return rope_kernel_cpu;
-  } else if (device_type == base::DeviceType::kDeviceCUDA) {
-    return rope_kernel_cu;
-  } else {
-    LOG(FATAL) << "Unknown device type for get a rope kernel.";
-    return nullptr;
-  }
+  return select_kernel<RoPEKernel>("rope", KernelKey(device_type));
+}
+
+RoPEKVCacheWriteKernel get_rope_kv_cache_write_kernel(base::DeviceType device_type) {
+  return select_kernel<RoPEKVCacheWriteKernel>("rope_kv_cache_write", KernelKey(device_type));
 }
 
 ScaleKernel get_scale_kernel(base::DeviceType device_type) {
-  if (device_type == base::DeviceType::kDeviceCPU) {
-    return scale_inplace_cpu;
-  } else {
-    LOG(FATAL) << "Unknown device type for get a rope kernel.";
-    return nullptr;
-  }
+  return select_kernel<ScaleKernel>("scale", KernelKey(device_type));
 }
 
 SoftmaxInplaceKernel get_softmax_kernel(base::DeviceType device_type) {
-  if (device_type == base::DeviceType::kDeviceCPU) {
-    return softmax_inplace_cpu;
-  } else {
-    LOG(FATAL) << "Unknown device type for get an softmax kernel.";
-    return nullptr;
-  }
+  return select_kernel<SoftmaxInplaceKernel>("softmax", KernelKey(device_type));
 }
 
 SwigluKernel get_swiglu_kernel(base::DeviceType device_type, void* stream) {
-  if (device_type == base::DeviceType::kDeviceCPU) {
-    return swiglu_kernel_cpu;
-  } else if (device_type == base::DeviceType::kDeviceCUDA) {
-    return swiglu_kernel_cu;
-  } else {
-    LOG(FATAL) << "Unknown device type for get a swiglu kernel.";
-    return nullptr;
-  }
+  return select_kernel<SwigluKernel>("swiglu", KernelKey(device_type));
 }
 
 RMSNormKernel get_rmsnorm_kernel(base::DeviceType device_type) {
-  if (device_type == base::DeviceType::kDeviceCPU) {
-    return rmsnorm_kernel_cpu;
-  } else if (device_type == base::DeviceType::kDeviceCUDA) {
-    return rmsnorm_kernel_cu;
-  } else {
-    LOG(FATAL) << "Unknown device type for get an rmsnorm kernel.";
-    return nullptr;
-  }
+  return select_kernel<RMSNormKernel>("rmsnorm", KernelKey(device_type));
 }
 
-ScaleSumKernel get_scale_sum_kernel(base::DeviceType device_type) {
-  if (device_type == base::DeviceType::kDeviceCPU) {
-    return scale_sum_kernel_cpu;
-  } else {
-    LOG(FATAL) << "Unknown device type for get a scale and reduce kernel.";
-    return nullptr;
-  }
+AddRMSNormKernel get_add_rmsnorm_kernel(base::DeviceType device_type) {
+  return select_kernel<AddRMSNormKernel>("add_rmsnorm", KernelKey(device_type));
 }
 
+ScaleSumKernel get_scale_sum_kernel(base::DeviceType device_type) {
+  return select_kernel<ScaleSumKernel>("scale_sum", KernelKey(device_type));
+}
 }  // namespace kernel
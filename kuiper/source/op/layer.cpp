@@ -1,6 +1,7 @@
 #include "op/layer.h"
 #include <base/cuda_config.h>
 #include <glog/logging.h>
+#include "base/profiler.h"
 #include <cstdarg>
 #include <numeric>
 #include <utility>
@@ -33,6 +34,10 @@ base::DeviceType BaseLayer::device_type() const { return device_type_; }
 
 void BaseLayer::set_device_type(base::DeviceType device_type) { device_type_ = device_type; }
 
+void BaseLayer::set_check_enabled(bool check_enabled) { check_enabled_ = check_enabled; }
+
+bool BaseLayer::is_check_enabled() const { return check_enabled_; }
+
 Layer::Layer(base::DeviceType device_type, LayerType layer_type, std::string layer_name)
     : BaseLayer(device_type, layer_type, base::DataType::kDataTypeFp32, std::move(layer_name)) {}
 
@@ -40,6 +45,43 @@ base::Status Layer::init() { return base::error::Success(); }
 
 base::Status Layer::forward() { return base::error::FunctionNotImplement(""); }
 
+const char* layer_type_name(LayerType layer_type) {
+  switch (layer_type) {
+    case LayerType::kLayerLinear:
+      return "linear";
+    case LayerType::kLayerEncode:
+      return "encode";
+    case LayerType::kLayerEmbedding:
+      return "embedding";
+    case LayerType::kLayerRMSNorm:
+      return "rmsnorm";
+    case LayerType::kLayerMatmul:
+      return "matmul";
+    case LayerType::kLayerRoPe:
+      return "rope";
+    case LayerType::kLayerMHA:
+      return "mha";
+    case LayerType::kLayerSoftmax:
+      return "softmax";
+    case LayerType::kLayerAdd:
+      return "add";
+    case LayerType::kLayerSwiGLU:
+      return "swiglu";
+    default:
+      return "unknown";
+  }
+}
+
+base::Status Layer::profiled_forward() {
+  if (!base::Profiler::global().is_enabled()) {
+    return this->forward();
+  }
+  const bool is_cuda = device_type_ == base::DeviceType::kDeviceCUDA;
+  base::ProfileRange range(layer_type_name(layer_type_), layer_name_.c_str(), is_cuda,
+                           is_cuda && cuda_config_ ? cuda_config_->stream : nullptr);
+  return this->forward();
+}
+
 base::Status Layer::check_tensor(const tensor::Tensor& tensor, base::DeviceType device_type,
                                  base::DataType data_type) const {
   if (tensor.is_empty()) {
@@ -80,6 +122,25 @@ base::Status Layer::check_tensor_with_dim(const tensor::Tensor& tensor,
   return base::error::Success();
 }
 
+base::Status Layer::check_tensor_with_row_dim(const tensor::Tensor& tensor,
+                                              base::DeviceType device_type,
+                                              base::DataType data_type, int32_t dim) const {
+  // the tensor is a single row [dim] or a batch of rows [rows, dim]
+  auto status = check_tensor(tensor, device_type, data_type);
+  if (!status) {
+    return status;
+  }
+  const int32_t dims = tensor.dims_size();
+  if (dims != 1 && dims != 2) {
+    return base::error::InvalidArgument("The tensor has a wrong dim size.");
+  }
+  if (tensor.get_dim(dims - 1) != dim) {
+    return base::error::InvalidArgument("The tensor has a wrong dim in dim" +
+                                        std::to_string(dims - 1));
+  }
+  return base::error::Success();
+}
+
 void Layer::set_input(int32_t idx, const tensor::Tensor& input) {
   CHECK_GE(idx, 0);
   CHECK_LT(idx, inputs_.size());
@@ -124,6 +185,11 @@ void Layer::reset_input_size(size_t size) { inputs_.resize(size); }
 
 void Layer::reset_output_size(size_t size) { outputs_.resize(size); }
 
+std::shared_ptr<Layer> Layer::clone() const {
+  LOG(FATAL) << "The layer " << layer_name_ << " can not be cloned.";
+  return nullptr;
+}
+
 void Layer::to_cuda() {
   for (auto& input : inputs_) {
     if (!input.is_empty()) {
@@ -146,6 +212,17 @@ void Layer::set_cuda_config(std::shared_ptr<kernel::CudaConfig> config) {
 
 std::shared_ptr<kernel::CudaConfig> Layer::cuda_config() const { return cuda_config_; }
 
+void Layer::set_upload_queue(tensor::UploadQueue* upload_queue) { upload_queue_ = upload_queue; }
+
+void Layer::upload_to_cuda(tensor::Tensor& tensor) const {
+  if (upload_queue_) {
+    upload_queue_->push(tensor);
+  } else {
+    tensor.to_cuda(cuda_config_ ? cuda_config_->stream : nullptr);
+    tensor.get_buffer()->set_tag(base::MemoryTag::kMemoryTagWeight);
+  }
+}
+
 size_t Layer::input_size() const { return inputs_.size(); }
 
 size_t Layer::output_size() const { return outputs_.size(); }
@@ -157,7 +234,7 @@ LayerParam::LayerParam(base::DeviceType device_type, LayerType layer_type, bool
 base::Status LayerParam::set_weight(int32_t idx, const tensor::Tensor& weight) {
   CHECK_GE(idx, 0);
   CHECK_LT(idx, weights_.size());
-  CHECK(weight.data_type() == base::DataType::kDataTypeFp32);
+  CHECK(weight.data_type() == weight_data_type_);
   if (!weight.is_empty()) {
     CHECK(weight.device_type() == device_type_);
   }
@@ -171,13 +248,26 @@ const tensor::Tensor& LayerParam::get_weight(int32_t idx) const {
   return weights_.at(idx);
 }
 
+std::vector<tensor::Tensor*> LayerParam::param_tensors() {
+  std::vector<tensor::Tensor*> tensors;
+  for (auto& weight : weights_) {
+    if (!weight.is_empty()) {
+      tensors.push_back(&weight);
+    }
+  }
+  if (!scales_.is_empty()) {
+    tensors.push_back(&scales_);
+  }
+  return tensors;
+}
+
 void LayerParam::to_cuda() {
   Layer::to_cuda();
   for (auto& weight : weights_) {
-    weight.to_cuda(cuda_config_ ? cuda_config_->stream : nullptr);
+    upload_to_cuda(weight);
   }
   if (!scales_.is_empty()) {
-    scales_.to_cuda(cuda_config_ ? cuda_config_->stream : nullptr);
+    upload_to_cuda(scales_);
   }
 }
 
@@ -225,11 +315,34 @@ void LayerParam::set_scales(const tensor::Tensor& scales) {
 
 void LayerParam::set_group_size(int32_t group_size) { this->group_size_ = group_size; }
 
+void LayerParam::set_weight_data_type(base::DataType data_type) {
+  CHECK(!is_quant_layer_);
+  CHECK(data_type == base::DataType::kDataTypeFp32 || data_type == base::DataType::kDataTypeFp16 ||
+        data_type == base::DataType::kDataTypeBf16);
+  weight_data_type_ = data_type;
+  for (auto& weight : weights_) {
+    if (weight.is_empty() || weight.data_type() == data_type) {
+      continue;
+    }
+    tensor::Tensor view(data_type, weight.dims(), false, nullptr, weight.ptr<int8_t>());
+    view.set_device_type(weight.device_type());
+    weight = view;
+  }
+}
+
+base::DataType LayerParam::weight_data_type() const { return weight_data_type_; }
+
 int32_t LayerParam::get_scale_num() const {
   CHECK(!scales_.is_empty());
   return static_cast<int32_t>(scales_.size());
 }
 
+bool LayerParam::is_quant_layer() const { return is_quant_layer_; }
+
+int32_t LayerParam::get_group_size() const { return group_size_; }
+
+const tensor::Tensor& LayerParam::get_scales() const { return scales_; }
+
 void LayerParam::reset_weight_size(size_t size) { weights_.resize(size); }
 
 size_t LayerParam::weight_size() const { return weights_.size(); }
@@ -237,7 +350,7 @@ size_t LayerParam::weight_size() const { return weights_.size(); }
 base::Status Layer::forward(const tensor::Tensor& input1, const tensor::Tensor& output1) {
   this->set_input(0, input1);
   this->set_output(0, output1);
-  return this->forward();
+  return profiled_forward();
 }
 
 base::Status Layer::forward(const tensor::Tensor& input1, const tensor::Tensor& input2,
@@ -246,7 +359,7 @@ base::Status Layer::forward(const tensor::Tensor& input1, const tensor::Tensor&
   this->set_input(1, input2);
 
   this->set_output(0, output1);
-  return this->forward();
+  return profiled_forward();
 }
 
 base::Status Layer::forward(const tensor::Tensor& input1, const tensor::Tensor& input2,
@@ -256,7 +369,7 @@ base::Status Layer::forward(const tensor::Tensor& input1, const tensor::Tensor&
   this->set_input(2, input3);
 
   this->set_output(0, output1);
-  return this->forward();
+  return profiled_forward();
 }
 
 base::Status Layer::forward(const tensor::Tensor& input1, const tensor::Tensor& input2,
@@ -268,7 +381,7 @@ base::Status Layer::forward(const tensor::Tensor& input1, const tensor::Tensor&
   this->set_input(3, input4);
 
   this->set_output(0, output1);
-  return this->forward();
+  return profiled_forward();
 }
 
 base::Status Layer::forward(const tensor::Tensor& input1, const tensor::Tensor& input2,
@@ -281,7 +394,7 @@ base::Status Layer::forward(const tensor::Tensor& input1, const tensor::Tensor&
   this->set_input(4, input5);
 
   this->set_output(0, output1);
-  return this->forward();
+  return profiled_forward();
 }
 
 tensor::Tensor& LayerParam::get_weight(int32_t idx) {
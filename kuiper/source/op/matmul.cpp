@@ -1,5 +1,6 @@
 #include "op/matmul.h"
 #include "kernels/cpu/matmul_kernel.h"
+#include "kernels/kernel_registry.h"
 #include "kernels/kernels_interface.h"
 namespace op {
 MatmulLayer::MatmulLayer(base::DeviceType device_type, int32_t dim0, int32_t dim1,
@@ -17,18 +18,32 @@ MatmulLayer::MatmulLayer(base::DeviceType device_type, int32_t dim0, int32_t dim
 }
 
 base::Status MatmulLayer::check() const {
-  auto status = check_tensor_with_dim(get_input(0), device_type_, data_type_, dim1_);
+  auto status = check_tensor_with_row_dim(get_input(0), device_type_, data_type_, dim1_);
   if (!status) {
     LOG(ERROR) << "The input tensor error in the matmul layer.";
     return status;
   }
 
   if (!is_quant_layer_) {
-    status = check_tensor_with_dim(get_weight(0), device_type_, data_type_, dim0_, dim1_);
+    status = check_tensor_with_dim(get_weight(0), device_type_, weight_data_type_, dim0_, dim1_);
     if (!status) {
       LOG(ERROR) << "The weight tensor error in the matmul layer.";
       return status;
     }
+  } else if (is_fp8()) {
+    status = check_tensor_with_dim(get_weight(0), device_type_, base::DataType::kDataTypeFp8E4M3,
+                                   dim0_, dim1_);
+    if (!status) {
+      LOG(ERROR) << "The fp8 weight tensor error in the matmul layer.";
+      return status;
+    }
+  } else if (weight_bits_ == 4) {
+    status = check_tensor_with_dim(get_weight(0), device_type_, base::DataType::kDataTypeInt8,
+                                   dim0_, dim1_ / 2);
+    if (!status) {
+      LOG(ERROR) << "The int4 weight tensor error in the matmul layer.";
+      return status;
+    }
   } else {
     status = check_tensor_with_dim(get_weight(0), device_type_, base::DataType::kDataTypeInt8,
                                    dim0_, dim1_);
@@ -39,43 +54,130 @@ base::Status MatmulLayer::check() const {
   }
 
   if (is_quant_layer_) {
-    status = check_tensor_with_dim(scales_, device_type_, base::DataType::kDataTypeFp32, scales_.size());
+    const base::DataType scale_data_type =
+        weight_bits_ == 4 ? base::DataType::kDataTypeFp16 : base::DataType::kDataTypeFp32;
+    status = check_tensor_with_dim(scales_, device_type_, scale_data_type, scales_.size());
     if (!status) {
       LOG(ERROR) << "The scale tensor error in the matmul layer.";
       return status;
     }
   }
+  if (!zero_points_.is_empty()) {
+    status = check_tensor_with_dim(zero_points_, device_type_, base::DataType::kDataTypeInt8,
+                                   scales_.size());
+    if (!status) {
+      LOG(ERROR) << "The zero point tensor error in the matmul layer.";
+      return status;
+    }
+  }
+  if (!input_order_.is_empty()) {
+    status = check_tensor_with_dim(input_order_, device_type_, base::DataType::kDataTypeInt32,
+                                   dim1_);
+    if (!status) {
+      LOG(ERROR) << "The input order tensor error in the matmul layer.";
+      return status;
+    }
+  }
 
-  status = check_tensor_with_dim(get_output(0), device_type_, data_type_, dim0_);
+  const int32_t output_dim = this->output_dim();
+  status = check_tensor_with_row_dim(get_output(0), device_type_, data_type_, output_dim);
   if (!status) {
     LOG(ERROR) << "The output tensor error in the matmul layer.";
     return status;
   }
+  if (get_input(0).size() / dim1_ != get_output(0).size() / output_dim) {
+    LOG(ERROR) << "The input and output tensor have different rows in the matmul layer.";
+    return base::error::InvalidArgument("The rows of input and output tensor is mismatched.");
+  }
   return base::error::Success();
 }
 
+template <typename Kernel>
+Kernel MatmulLayer::weight_kernel(const char* op) {
+  const tensor::Tensor& weight = get_weight(0);
+  return kernel::select_kernel<Kernel>(kernel_cache_, op, device_type_, weight.data_type(),
+                                       weight.dims());
+}
+
 base::Status MatmulLayer::forward() {
-  auto status = check();
-  if (!status) {
-    return status;
+  if (check_enabled_) {
+    auto status = check();
+    if (!status) {
+      return status;
+    }
   }
   if (device_type_ == base::DeviceType::kDeviceCUDA) {
     CHECK(cuda_config_ != nullptr);
   }
-  if (is_quant_layer_) {
-    kernel::get_matmul_kernel_quant8(device_type_)(get_input(0), get_weight(0), get_output(0),
-                                                   group_size_, scales_,
-                                                   cuda_config_ ? cuda_config_.get() : nullptr);
+  tensor::Tensor input = get_input(0);
+  if (!input_order_.is_empty()) {
+    std::shared_ptr<base::DeviceAllocator> alloc;
+    if (device_type_ == base::DeviceType::kDeviceCPU) {
+      alloc = base::CPUDeviceAllocatorFactory::get_instance();
+    } else {
+      alloc = base::CUDADeviceAllocatorFactory::get_instance();
+    }
+    tensor::Tensor ordered_input(base::DataType::kDataTypeFp32, input.dims(), true, alloc);
+    kernel::get_gather_columns_kernel(device_type_)(input, input_order_, ordered_input,
+                                                    cuda_config_ ? cuda_config_->stream : nullptr);
+    input = ordered_input;
+  }
+  // the variant is selected by the data type and the shape of the weight, once per layer
+  const tensor::Tensor& weight = get_weight(0);
+  kernel::CudaConfig* config = cuda_config_ ? cuda_config_.get() : nullptr;
+  if (is_fp8() && swiglu_output_) {
+    weight_kernel<kernel::MatmulSwiGLUKernelQuant>("matmul_swiglu_fp8")(
+        input, weight, get_output(0), dim1_, scales_, config);
+  } else if (is_fp8()) {
+    weight_kernel<kernel::MatmulKernelQuant>("matmul_fp8")(input, weight, get_output(0), dim1_,
+                                                           scales_, config);
+  } else if (weight_bits_ == 4 && swiglu_output_) {
+    weight_kernel<kernel::MatmulSwiGLUKernelQuant4>("matmul_swiglu_int4")(
+        input, weight, get_output(0), group_size_, scales_, zero_points_, config);
+  } else if (weight_bits_ == 4) {
+    weight_kernel<kernel::MatmulKernelQuant4>("matmul_int4")(
+        input, weight, get_output(0), group_size_, scales_, zero_points_, config);
+  } else if (is_tiled_ && swiglu_output_) {
+    weight_kernel<kernel::MatmulSwiGLUKernelQuant>("matmul_swiglu_int8_tiled")(
+        input, weight, get_output(0), group_size_, scales_, config);
+  } else if (is_tiled_ && is_bias_fused()) {
+    weight_kernel<kernel::MatmulBiasKernelQuant>("matmul_bias_int8_tiled")(
+        input, weight, get_bias(0), get_output(0), group_size_, scales_, config);
+  } else if (is_tiled_) {
+    weight_kernel<kernel::MatmulKernelQuant>("matmul_int8_tiled")(input, weight, get_output(0),
+                                                                  group_size_, scales_, config);
+  } else if (swiglu_output_ && is_quant_layer_) {
+    weight_kernel<kernel::MatmulSwiGLUKernelQuant>("matmul_swiglu_int8")(
+        input, weight, get_output(0), group_size_, scales_, config);
+  } else if (swiglu_output_) {
+    weight_kernel<kernel::MatmulSwiGLUKernel>("matmul_swiglu")(input, weight, get_output(0),
+                                                               config);
+  } else if (is_quant_layer_ && is_bias_fused()) {
+    weight_kernel<kernel::MatmulBiasKernelQuant>("matmul_bias_int8")(
+        input, weight, get_bias(0), get_output(0), group_size_, scales_, config);
+  } else if (is_quant_layer_) {
+    weight_kernel<kernel::MatmulKernelQuant>("matmul_int8")(input, weight, get_output(0),
+                                                            group_size_, scales_, config);
+  } else if (is_bias_fused()) {
+    weight_kernel<kernel::MatmulBiasKernel>("matmul_bias")(input, weight, get_bias(0),
+                                                           get_output(0), config);
   } else {
-    kernel::get_matmul_kernel(device_type_)(get_input(0), get_weight(0), get_output(0), 1.f,
-                                            cuda_config_ ? cuda_config_.get() : nullptr);
+    weight_kernel<kernel::MatmulKernel>("matmul")(input, weight, get_output(0), 1.f, config);
   }
 
-  if (has_bias_) {
+  // the int4 and the fp8 kernels have no bias epilogue
+  if (has_bias_ && !is_bias_fused()) {
     kernel::get_add_kernel(device_type_)(get_output(0), get_bias(0), get_output(0),
                                             cuda_config_ ? cuda_config_->stream : nullptr);
   }
 
+  // the low rank update reads the input in the column order of the checkpoint
+  if (has_lora()) {
+    kernel::get_lora_kernel(device_type_)(get_input(0), lora_->a, lora_->b, lora_->scales,
+                                          lora_rows_->adapters, lora_rows_->workspace,
+                                          get_output(0),
+                                          cuda_config_ ? cuda_config_.get() : nullptr);
+  }
   return base::error::Success();
 }
 
@@ -117,6 +219,117 @@ base::Status MatmulLayer::set_bias(int32_t idx, int32_t& dim, const void* bias_p
   return base::error::Success();
 }
 
+static size_t align_int4_part(size_t byte_size) { return (byte_size + 15) / 16 * 16; }
+
+size_t MatmulLayer::int4_byte_size(int32_t dim0, int32_t dim1, int32_t group_size,
+                                   bool has_zero_point) {
+  const size_t weight_num = static_cast<size_t>(dim0) * dim1;
+  const size_t group_num = weight_num / group_size;
+  size_t byte_size =
+      align_int4_part(weight_num / 2) + align_int4_part(group_num * sizeof(uint16_t));
+  if (has_zero_point) {
+    byte_size += align_int4_part(group_num);
+  }
+  return byte_size;
+}
+
+base::Status MatmulLayer::set_weight_int4(const std::vector<int32_t>& dims,
+                                          const void* weight_ptr, bool has_zero_point,
+                                          base::DeviceType device_type) {
+  CHECK(is_quant_layer_) << "The int4 weight needs a quant matmul layer.";
+  CHECK_NE(weight_ptr, nullptr);
+  CHECK_EQ(dims.size(), 2);
+  CHECK_GT(group_size_, 0);
+  // a group never spans two rows and a lane reads 32 columns at a time
+  if (dims.at(1) % group_size_ != 0 || group_size_ % 32 != 0) {
+    return base::error::InvalidArgument("The int4 groups do not line up with the weight rows.");
+  }
+  weight_bits_ = 4;
+  int8_t* part_ptr = static_cast<int8_t*>(const_cast<void*>(weight_ptr));
+  const int32_t group_num = dims.at(0) * dims.at(1) / group_size_;
+
+  tensor::Tensor weight(base::DataType::kDataTypeInt8, dims.at(0), dims.at(1) / 2, false,
+                        nullptr, part_ptr);
+  weight.set_device_type(device_type);
+  weights_.at(0) = weight;
+  part_ptr += align_int4_part(weight.byte_size());
+
+  scales_ = tensor::Tensor(base::DataType::kDataTypeFp16, group_num, false, nullptr, part_ptr);
+  scales_.set_device_type(device_type);
+  part_ptr += align_int4_part(scales_.byte_size());
+
+  if (has_zero_point) {
+    zero_points_ =
+        tensor::Tensor(base::DataType::kDataTypeInt8, group_num, false, nullptr, part_ptr);
+    zero_points_.set_device_type(device_type);
+  }
+  return base::error::Success();
+}
+
+bool MatmulLayer::is_int4() const { return weight_bits_ == 4; }
+
+base::Status MatmulLayer::set_weight_fp8(const std::vector<int32_t>& dims,
+                                         const void* weight_ptr, base::DeviceType device_type) {
+  CHECK(is_quant_layer_) << "The fp8 weight needs a quant matmul layer.";
+  CHECK_NE(weight_ptr, nullptr);
+  CHECK_EQ(dims.size(), 2);
+  // the gemv reads 16 columns at a time, the fp8 gemm of cublaslt needs the same
+  if (dims.at(1) % 16 != 0) {
+    return base::error::InvalidArgument("The fp8 weight columns are not a multiple of 16.");
+  }
+  weight_data_type_ = base::DataType::kDataTypeFp8E4M3;
+  int8_t* part_ptr = static_cast<int8_t*>(const_cast<void*>(weight_ptr));
+  tensor::Tensor weight(base::DataType::kDataTypeFp8E4M3, dims.at(0), dims.at(1), false, nullptr,
+                        part_ptr);
+  weight.set_device_type(device_type);
+  weights_.at(0) = weight;
+
+  scales_ = tensor::Tensor(base::DataType::kDataTypeFp32, dims.at(0), false, nullptr,
+                           part_ptr + weight.byte_size());
+  scales_.set_device_type(device_type);
+  return base::error::Success();
+}
+
+bool MatmulLayer::is_fp8() const {
+  return weight_data_type_ == base::DataType::kDataTypeFp8E4M3;
+}
+
+base::Status MatmulLayer::set_input_order(int32_t dim, const void* order_ptr,
+                                          base::DeviceType device_type) {
+  CHECK_NE(order_ptr, nullptr);
+  if (dim != dim1_) {
+    return base::error::InvalidArgument("The input order does not match the weight columns.");
+  }
+  input_order_ = tensor::Tensor(base::DataType::kDataTypeInt32, dim, false, nullptr,
+                                const_cast<void*>(order_ptr));
+  input_order_.set_device_type(device_type);
+  return base::error::Success();
+}
+
+bool MatmulLayer::has_input_order() const { return !input_order_.is_empty(); }
+
+bool MatmulLayer::has_bias() const { return has_bias_; }
+
+void MatmulLayer::set_lora(std::shared_ptr<LoraWeights> lora, std::shared_ptr<LoraRows> rows) {
+  CHECK(!swiglu_output_) << "The low rank update can not follow the swiglu of the output.";
+  CHECK_EQ(lora == nullptr, rows == nullptr);
+  if (lora) {
+    CHECK_EQ(lora->a.get_dim(2), dim1_);
+    CHECK_EQ(lora->b.get_dim(2), dim0_);
+  }
+  lora_ = std::move(lora);
+  lora_rows_ = std::move(rows);
+}
+
+bool MatmulLayer::has_lora() const {
+  return lora_ != nullptr && !lora_rows_->adapters.is_empty();
+}
+
+bool MatmulLayer::is_bias_fused() const {
+  return has_bias_ && !is_int4() && !is_fp8() &&
+         bias_.at(0).data_type() == base::DataType::kDataTypeFp32;
+}
+
 tensor::Tensor& MatmulLayer::get_bias(int32_t idx) {
   CHECK_GE(idx, 0);
   CHECK_LT(idx, bias_.size());
@@ -131,11 +344,183 @@ const tensor::Tensor& MatmulLayer::get_bias(int32_t idx) const {
 
 void MatmulLayer::to_cuda() {
   LayerParam::to_cuda();
+  if (!zero_points_.is_empty()) {
+    upload_to_cuda(zero_points_);
+  }
+  if (!input_order_.is_empty()) {
+    upload_to_cuda(input_order_);
+  }
+  if (has_bias_) {
+    for (auto& bias : bias_) {
+      upload_to_cuda(bias);
+    }
+  }
+}
+
+std::vector<tensor::Tensor*> MatmulLayer::param_tensors() {
+  std::vector<tensor::Tensor*> tensors = LayerParam::param_tensors();
+  if (!zero_points_.is_empty()) {
+    tensors.push_back(&zero_points_);
+  }
+  if (!input_order_.is_empty()) {
+    tensors.push_back(&input_order_);
+  }
   if (has_bias_) {
     for (auto& bias : bias_) {
-      bias.to_cuda(cuda_config_ ? cuda_config_->stream : nullptr);
+      tensors.push_back(&bias);
+    }
+  }
+  return tensors;
+}
+
+int32_t MatmulLayer::output_dim() const { return swiglu_output_ ? dim0_ / 2 : dim0_; }
+
+int32_t MatmulLayer::input_dim() const { return dim1_; }
+
+void MatmulLayer::set_swiglu_output(bool swiglu_output) {
+  CHECK(!swiglu_output || (dim0_ % 2 == 0 && !has_bias_))
+      << "The swiglu output needs an even number of rows and no bias.";
+  swiglu_output_ = swiglu_output;
+}
+
+bool MatmulLayer::is_swiglu_output() const { return swiglu_output_; }
+
+void MatmulLayer::set_tiled(bool is_tiled) {
+  CHECK(!is_tiled || (is_quant_layer_ && weight_bits_ == 8 && !is_fp8() &&
+                      device_type_ == base::DeviceType::kDeviceCUDA))
+      << "Only the int8 weights of a cuda layer are tiled.";
+  is_tiled_ = is_tiled;
+}
+
+bool MatmulLayer::is_tiled() const { return is_tiled_; }
+
+std::shared_ptr<MatmulLayer> MatmulLayer::fuse(
+    const std::vector<std::shared_ptr<MatmulLayer>>& layers,
+    std::shared_ptr<base::DeviceAllocator> alloc, bool copy_weights) {
+  CHECK(!layers.empty());
+  const auto& first = layers.front();
+  int32_t dim0 = 0;
+  for (const auto& layer : layers) {
+    CHECK_NE(layer, nullptr);
+    CHECK(!layer->is_tiled_);
+    CHECK(layer->device_type_ == first->device_type_);
+    CHECK_EQ(layer->dim1_, first->dim1_);
+    CHECK_EQ(layer->is_quant_layer_, first->is_quant_layer_);
+    CHECK_EQ(layer->has_bias_, first->has_bias_);
+    CHECK_EQ(layer->group_size_, first->group_size_);
+    CHECK_EQ(layer->weight_bits_, first->weight_bits_);
+    CHECK(layer->weight_data_type_ == first->weight_data_type_);
+    CHECK_EQ(layer->zero_points_.is_empty(), first->zero_points_.is_empty());
+    CHECK_EQ(layer->input_order_.is_empty(), first->input_order_.is_empty());
+    dim0 += layer->dim0_;
+  }
+
+  if (!alloc) {
+    if (first->device_type_ == base::DeviceType::kDeviceCPU) {
+      alloc = base::CPUDeviceAllocatorFactory::get_instance();
+    } else {
+      alloc = base::CUDADeviceAllocatorFactory::get_instance();
+    }
+  }
+  const base::DeviceType device_type = alloc->device_type();
+  // the weights may still be in the cpu memory of the model file
+  auto memcpy_kind = [device_type](const tensor::Tensor& src) {
+    if (src.device_type() == base::DeviceType::kDeviceCPU) {
+      return device_type == base::DeviceType::kDeviceCPU ? base::MemcpyKind::kMemcpyCPU2CPU
+                                                         : base::MemcpyKind::kMemcpyCPU2CUDA;
+    }
+    return base::MemcpyKind::kMemcpyCUDA2CUDA;
+  };
+  // concatenates one tensor of every layer and returns the offsets of the parts in bytes
+  auto pack = [&](const std::vector<const tensor::Tensor*>& parts, tensor::Tensor& packed) {
+    std::vector<size_t> offsets;
+    size_t offset = 0;
+    for (const tensor::Tensor* part : parts) {
+      offsets.push_back(offset);
+      if (copy_weights) {
+        alloc->memcpy(part->ptr<void>(), packed.ptr<int8_t>() + offset, part->byte_size(),
+                      memcpy_kind(*part));
+      }
+      offset += part->byte_size();
+    }
+    CHECK_EQ(offset, packed.byte_size());
+    packed.get_buffer()->set_tag(base::MemoryTag::kMemoryTagWeight);
+    return offsets;
+  };
+  auto view = [device_type](const tensor::Tensor& packed, size_t offset,
+                            const tensor::Tensor& part) {
+    tensor::Tensor tensor(part.data_type(), part.dims(), false, nullptr,
+                          const_cast<int8_t*>(packed.ptr<int8_t>()) + offset);
+    tensor.set_device_type(device_type);
+    return tensor;
+  };
+
+  auto fused = std::make_shared<MatmulLayer>(first->device_type_, dim0, first->dim1_,
+                                             first->is_quant_layer_, first->has_bias_);
+  fused->group_size_ = first->group_size_;
+  fused->weight_bits_ = first->weight_bits_;
+  fused->weight_data_type_ = first->weight_data_type_;
+  fused->cuda_config_ = first->cuda_config_;
+  // the layers read the same input, so an act order checkpoint gives them the same order
+  fused->input_order_ = first->input_order_;
+
+  std::vector<const tensor::Tensor*> weights;
+  for (const auto& layer : layers) {
+    weights.push_back(&layer->weights_.at(0));
+  }
+  // an int4 weight keeps two columns in a byte
+  tensor::Tensor weight(first->weights_.at(0).data_type(), dim0, first->weights_.at(0).get_dim(1),
+                        true, alloc);
+  std::vector<size_t> offsets = pack(weights, weight);
+  for (int32_t i = 0; i < layers.size(); ++i) {
+    layers.at(i)->weights_.at(0) = view(weight, offsets.at(i), *weights.at(i));
+  }
+  fused->weights_.at(0) = weight;
+
+  if (first->is_quant_layer_) {
+    std::vector<const tensor::Tensor*> scales;
+    int32_t scale_num = 0;
+    for (const auto& layer : layers) {
+      scales.push_back(&layer->scales_);
+      scale_num += static_cast<int32_t>(layer->scales_.size());
+    }
+    tensor::Tensor scale(first->scales_.data_type(), scale_num, true, alloc);
+    offsets = pack(scales, scale);
+    for (int32_t i = 0; i < layers.size(); ++i) {
+      layers.at(i)->scales_ = view(scale, offsets.at(i), *scales.at(i));
+    }
+    fused->scales_ = scale;
+  }
+
+  if (!first->zero_points_.is_empty()) {
+    std::vector<const tensor::Tensor*> zero_points;
+    int32_t zero_point_num = 0;
+    for (const auto& layer : layers) {
+      zero_points.push_back(&layer->zero_points_);
+      zero_point_num += static_cast<int32_t>(layer->zero_points_.size());
+    }
+    tensor::Tensor zero_point(base::DataType::kDataTypeInt8, zero_point_num, true, alloc);
+    offsets = pack(zero_points, zero_point);
+    for (int32_t i = 0; i < layers.size(); ++i) {
+      layers.at(i)->zero_points_ = view(zero_point, offsets.at(i), *zero_points.at(i));
+    }
+    fused->zero_points_ = zero_point;
+  }
+
+  if (first->has_bias_) {
+    std::vector<const tensor::Tensor*> biases;
+    for (const auto& layer : layers) {
+      biases.push_back(&layer->bias_.at(0));
+    }
+    tensor::Tensor bias(first->bias_.at(0).data_type(), dim0, true, alloc);
+    offsets = pack(biases, bias);
+    for (int32_t i = 0; i < layers.size(); ++i) {
+      layers.at(i)->bias_.at(0) = view(bias, offsets.at(i), *biases.at(i));
     }
+    fused->bias_.at(0) = bias;
   }
+  return fused;
 }
 
+std::shared_ptr<Layer> MatmulLayer::clone() const { return std::make_shared<MatmulLayer>(*this); }
 }  // namespace op
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "op/mha.h"
 #include "kernels/cpu/mha_kernel.h"
+#include "kernels/kernel_registry.h"
 #include "kernels/kernels_interface.h"
 namespace op {
 MultiHeadAttention::MultiHeadAttention(base::DeviceType device_type, int32_t layer_index,
@@ -17,42 +18,161 @@ MultiHeadAttention::MultiHeadAttention(base::DeviceType device_type, int32_t lay
 }
 
 base::Status MultiHeadAttention::forward() {
-  auto status = check();
-  if (!status) {
-    return status;
+  if (check_enabled_) {
+    auto status = check();
+    if (!status) {
+      return status;
+    }
   }
   const tensor::Tensor& mha_out = this->get_output(0);
   const tensor::Tensor& query_tensor = this->get_input(0);
   const tensor::Tensor& score_tensor = this->get_input(1);
   const tensor::Tensor& key_cache_tensor = this->get_input(2);
   const tensor::Tensor& value_cache_tensor = this->get_input(3);
+  // an empty block table means the positions are contiguous in the cache
+  const tensor::Tensor& block_table = this->get_input(4);
 
   if (device_type_ == base::DeviceType::kDeviceCUDA) {
     CHECK(cuda_config_ != nullptr);
   }
-  kernel::get_mha_kernel(device_type_)(pos_, head_num_, layer_index_, seq_len_, kv_dim_, kv_mul_,
-                                       head_size_, mha_out, query_tensor, score_tensor,
-                                       key_cache_tensor, value_cache_tensor, device_type_,
-                                       cuda_config_ ? cuda_config_.get() : nullptr);
+  // a variant of the head size or of the data type of the cache, selected once per layer
+  auto mha_kernel = kernel::select_kernel<kernel::MHAKernel>(
+      kernel_cache_, "mha", device_type_, key_cache_tensor.data_type(), {head_num_, head_size_});
+  mha_kernel(pos_, head_num_, layer_index_, seq_len_, kv_dim_, kv_mul_, head_size_, block_size_,
+             mha_out, query_tensor, score_tensor, key_cache_tensor, value_cache_tensor,
+             key_scale_, value_scale_, block_table, pos_tensor_, window_, device_type_,
+             cuda_config_ ? cuda_config_.get() : nullptr);
   return base::error::Success();
 }
 
-void MultiHeadAttention::set_pos(int32_t pos) { this->pos_ = pos; }
+base::Status MultiHeadAttention::forward_prefill(const tensor::Tensor& query,
+                                                 const tensor::Tensor& key,
+                                                 const tensor::Tensor& value,
+                                                 const tensor::Tensor& key_cache,
+                                                 const tensor::Tensor& value_cache,
+                                                 const tensor::Tensor& block_table,
+                                                 const tensor::Tensor& output) {
+  if (!is_flash_prefill_supported(key_cache.data_type())) {
+    return base::error::FunctionNotImplement(
+        "The flash prefill attention does not support this device, kv cache or head size.");
+  }
+  if (check_enabled_) {
+    for (const tensor::Tensor* tensor : {&query, &key, &value, &output}) {
+      base::Status status = check_tensor(*tensor, device_type_, data_type_);
+      if (!status) {
+        LOG(ERROR) << "The prefill tensor error in the mha layer.";
+        return status;
+      }
+    }
+    if (query.size() != output.size() || key.size() != value.size() ||
+        query.size() / (head_num_ * head_size_) != key.size() / kv_dim_) {
+      return base::error::InvalidArgument("The prefill rows do not match in the mha layer.");
+    }
+    if (window_.is_enabled() &&
+        static_cast<int32_t>(key.size() / kv_dim_) > window_.chunk_size) {
+      return base::error::InvalidArgument("The prefill rows exceed the chunk of the window.");
+    }
+    if (!block_table.is_empty() &&
+        (block_size_ <= 0 || !check_tensor(block_table, device_type_,
+                                           base::DataType::kDataTypeInt32))) {
+      return base::error::InvalidArgument("The block table tensor error in the mha layer.");
+    }
+  }
+  CHECK(cuda_config_ != nullptr);
+  const kernel::KernelKey kernel_key(device_type_, key_cache.data_type(),
+                                     {head_num_, head_size_});
+  kernel::get_flash_prefill_kernel(kernel_key)(pos_, head_num_, layer_index_, kv_dim_, kv_mul_,
+                                               head_size_, block_size_, output, query, key, value,
+                                               key_cache, value_cache, block_table, window_,
+                                               cuda_config_->stream);
+  return base::error::Success();
+}
+
+bool MultiHeadAttention::is_flash_prefill_supported(base::DataType cache_data_type) const {
+  return device_type_ == base::DeviceType::kDeviceCUDA &&
+         cache_data_type != base::DataType::kDataTypeInt8 &&
+         head_size_ <= kernel::kFlashPrefillMaxHeadSize;
+}
+
+void MultiHeadAttention::set_pos(int32_t pos) {
+  this->pos_ = pos;
+  this->pos_tensor_ = tensor::Tensor{};
+}
+
+void MultiHeadAttention::set_pos_tensor(const tensor::Tensor& pos_tensor) {
+  this->pos_tensor_ = pos_tensor;
+}
 
 void MultiHeadAttention::set_layer_idx(int32_t layer_idx) { this->layer_index_ = layer_idx; }
 
+void MultiHeadAttention::set_block_size(int32_t block_size) { this->block_size_ = block_size; }
+
+void MultiHeadAttention::set_kv_scales(const tensor::Tensor& key_scale,
+                                       const tensor::Tensor& value_scale) {
+  this->key_scale_ = key_scale;
+  this->value_scale_ = value_scale;
+}
+
+void MultiHeadAttention::set_window(const base::AttentionWindow& window) {
+  this->window_ = window;
+}
+
 base::Status MultiHeadAttention::check() const {
   base::Status status;
   const int32_t input_tensor_num = 4;
+  // the key and value caches may be stored in half precision or in int8
+  const base::DataType cache_data_type = get_input(2).data_type();
+  if (cache_data_type != base::DataType::kDataTypeFp32 &&
+      cache_data_type != base::DataType::kDataTypeFp16 &&
+      cache_data_type != base::DataType::kDataTypeBf16 &&
+      cache_data_type != base::DataType::kDataTypeInt8) {
+    return base::error::InvalidArgument("The kv cache has a wrong data type in the mha layer.");
+  }
+  if (cache_data_type == base::DataType::kDataTypeInt8) {
+    status = check_tensor(key_scale_, device_type_, base::DataType::kDataTypeFp32);
+    if (status) {
+      status = check_tensor(value_scale_, device_type_, base::DataType::kDataTypeFp32);
+    }
+    if (!status) {
+      LOG(ERROR) << "The kv scale tensor error in the mha layer.";
+      return status;
+    }
+  }
   for (int32_t i = 0; i < input_tensor_num; ++i) {
     // mha score tensor
-    status = check_tensor(get_input(i), device_type_, data_type_);
+    base::DataType data_type = i < 2 ? data_type_ : cache_data_type;
+    status = check_tensor(get_input(i), device_type_, data_type);
     if (!status) {
       LOG(ERROR) << "The input tensor " << std::to_string(i) << " error in the matmul layer.";
       return status;
     }
   }
+  const tensor::Tensor& block_table = get_input(4);
+  if (!block_table.is_empty()) {
+    if (block_size_ <= 0) {
+      return base::error::InvalidArgument("The block size of the paged kv cache is not set.");
+    }
+    status = check_tensor(block_table, device_type_, base::DataType::kDataTypeInt32);
+    if (!status) {
+      LOG(ERROR) << "The block table tensor error in the mha layer.";
+      return status;
+    }
+  }
+  // the scores of the attended positions share the row of a head in the score tensor
+  if (window_.is_enabled() && window_.capacity() > seq_len_) {
+    return base::error::InvalidArgument("The attention window exceeds the score tensor.");
+  }
+  if (!pos_tensor_.is_empty()) {
+    status = check_tensor_with_dim(pos_tensor_, base::DeviceType::kDeviceCUDA,
+                                   base::DataType::kDataTypeInt32, 1);
+    if (!status || device_type_ != base::DeviceType::kDeviceCUDA) {
+      return base::error::InvalidArgument("The device pos tensor error in the mha layer.");
+    }
+  }
   return check_tensor(get_output(0), device_type_, data_type_);
 }
 
+std::shared_ptr<Layer> MultiHeadAttention::clone() const {
+  return std::make_shared<MultiHeadAttention>(*this);
+}
 }  // namespace op
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include "op/rmsnorm.h"
 #include <cuda_runtime_api.h>
 #include <armadillo>
+#include "base/profiler.h"
 #include "kernels/cpu/rmsnorm_kernel.h"
 #include "kernels/kernels_interface.h"
 namespace op {
@@ -12,9 +13,11 @@ RmsNormLayer::RmsNormLayer(base::DeviceType device_type, int32_t dim)
 }
 
 base::Status RmsNormLayer::forward() {
-  auto status = check();
-  if (!status) {
-    return status;
+  if (check_enabled_) {
+    auto status = check();
+    if (!status) {
+      return status;
+    }
   }
   auto input = this->get_input(0);
   auto weight = this->get_weight(0);
@@ -27,25 +30,57 @@ base::Status RmsNormLayer::forward() {
   return base::error::Success();
 }
 
+base::Status RmsNormLayer::forward_add(const tensor::Tensor& residual,
+                                       const tensor::Tensor& input,
+                                       const tensor::Tensor& output) {
+  this->set_input(0, residual);
+  this->set_output(0, output);
+  if (check_enabled_) {
+    auto status = check();
+    if (!status) {
+      return status;
+    }
+    status = check_tensor_with_row_dim(input, device_type_, data_type_, dim_);
+    if (!status || input.size() != residual.size()) {
+      LOG(ERROR) << "The added tensor error in the rmsnorm layer.";
+      return base::error::InvalidArgument("The added tensor does not match the residual stream.");
+    }
+  }
+  if (device_type_ == base::DeviceType::kDeviceCUDA) {
+    CHECK(cuda_config_ != nullptr);
+  }
+  base::ProfileRange range("add_rmsnorm", layer_name_.c_str(),
+                           device_type_ == base::DeviceType::kDeviceCUDA,
+                           cuda_config_ ? cuda_config_->stream : nullptr);
+  kernel::get_add_rmsnorm_kernel(device_type_)(residual, input, get_weight(0), output,
+                                               cuda_config_ ? cuda_config_->stream : nullptr);
+  return base::error::Success();
+}
+
 base::Status RmsNormLayer::check() const {
-  auto status = check_tensor_with_dim(get_input(0), device_type_, data_type_, dim_);
+  auto status = check_tensor_with_row_dim(get_input(0), device_type_, data_type_, dim_);
   if (!status) {
     LOG(ERROR) << "The input tensor error in the rmsnorm layer.";
     return status;
   }
 
-  status = check_tensor_with_dim(get_weight(0), device_type_, data_type_, dim_);
+  status = check_tensor_with_dim(get_weight(0), device_type_, weight_data_type_, dim_);
   if (!status) {
     LOG(ERROR) << "The weight tensor error in the rmsnorm layer.";
     return status;
   }
 
-  status = check_tensor_with_dim(get_output(0), device_type_, data_type_, dim_);
+  status = check_tensor_with_row_dim(get_output(0), device_type_, data_type_, dim_);
   if (!status) {
     LOG(ERROR) << "The output tensor error in the rmsnorm layer.";
     return status;
   }
+  if (get_input(0).size() != get_output(0).size()) {
+    LOG(ERROR) << "The input and output tensor have different rows in the rmsnorm layer.";
+    return base::error::InvalidArgument("The rows of input and output tensor is mismatched.");
+  }
   return base::error::Success();
 }
 
+std::shared_ptr<Layer> RmsNormLayer::clone() const { return std::make_shared<RmsNormLayer>(*this); }
 }  // namespace op
\ No newline at end of file
@@ -3,19 +3,23 @@
 #include "kernels/cpu/rope_kernel.h"
 #include "kernels/kernels_interface.h"
 namespace op {
-RoPELayer::RoPELayer(base::DeviceType device_type, int32_t dim, int32_t kv_dim, int32_t head_size)
+RoPELayer::RoPELayer(base::DeviceType device_type, int32_t dim, int32_t kv_dim, int32_t head_size,
+                     bool is_rotate_half)
     : Layer(device_type, LayerType::kLayerRoPe, "RoPe"),
       dim_(dim),
       kv_dim_(kv_dim),
-      head_size_(head_size) {
+      head_size_(head_size),
+      is_rotate_half_(is_rotate_half) {
   reset_input_size(5);
   reset_output_size(1);
 }
 
 base::Status RoPELayer::forward() {
-  base::Status status = check();
-  if (!status) {
-    return status;
+  if (check_enabled_) {
+    auto status = check();
+    if (!status) {
+      return status;
+    }
   }
 
   tensor::Tensor input_q = this->get_input(0);
@@ -28,33 +32,44 @@ base::Status RoPELayer::forward() {
   if (device_type_ == base::DeviceType::kDeviceCUDA) {
     CHECK(cuda_config_ != nullptr);
   }
-  kernel::get_rope_kernel(device_type_)(dim_, kv_dim_, head_size_, input_q, input_k, input_pos,
-                                        sin_cache, cos_cache,
+  kernel::get_rope_kernel(device_type_)(dim_, kv_dim_, head_size_, is_rotate_half_, input_q,
+                                        input_k, input_pos, sin_cache, cos_cache,
                                         cuda_config_ ? cuda_config_->stream : nullptr);
   return base::error::Success();
 }
 
 base::Status RoPELayer::check() const {
-  // pos tensor
-  auto status = check_tensor_with_dim(get_input(2), base::DeviceType::kDeviceCPU,
-                                      base::DataType::kDataTypeInt32, 1);
+  // pos tensor, the cuda kernel can also read the position from the device
+  const tensor::Tensor& input_pos = get_input(2);
+  base::DeviceType pos_device_type = base::DeviceType::kDeviceCPU;
+  if (device_type_ == base::DeviceType::kDeviceCUDA && !input_pos.is_empty()) {
+    pos_device_type = input_pos.device_type();
+  }
+  auto status =
+      check_tensor_with_dim(input_pos, pos_device_type, base::DataType::kDataTypeInt32, 1);
   if (!status) {
     LOG(ERROR) << "The input tensor 2 error in the add layer.";
     return status;
   }
 
-  status = check_tensor_with_dim(get_input(1), device_type_, data_type_, kv_dim_);
+  status = check_tensor_with_row_dim(get_input(1), device_type_, data_type_, kv_dim_);
   if (!status) {
     LOG(ERROR) << "The input tensor 1 error in the add layer.";
     return status;
   }
 
-  status = check_tensor_with_dim(get_input(0), device_type_, data_type_, dim_);
+  status = check_tensor_with_row_dim(get_input(0), device_type_, data_type_, dim_);
   if (!status) {
     LOG(ERROR) << "The input tensor 0 error in the add layer.";
     return status;
   }
+
+  if (get_input(0).size() / dim_ != get_input(1).size() / kv_dim_) {
+    LOG(ERROR) << "The query and key tensor have different rows in the rope layer.";
+    return base::error::InvalidArgument("The rows of query and key tensor is mismatched.");
+  }
   return base::error::Success();
 }
 
+std::shared_ptr<Layer> RoPELayer::clone() const { return std::make_shared<RoPELayer>(*this); }
 }  // namespace op
\ No newline at end of file
@@ -13,25 +13,31 @@ base::Status SwiGLULayer::check() const {
   base::Status status;
   const int32_t input_tensor_num = 2;
   for (int32_t i = 0; i < input_tensor_num; ++i) {
-    status = check_tensor_with_dim(get_input(0), device_type_, data_type_, hidden_dim_);
+    status = check_tensor_with_row_dim(get_input(i), device_type_, data_type_, hidden_dim_);
     if (!status) {
       LOG(ERROR) << "The input tensor " << std::to_string(i) << " error in the swiglu layer.";
       return status;
     }
   }
 
-  status = check_tensor_with_dim(get_output(0), device_type_, data_type_, hidden_dim_);
+  status = check_tensor_with_row_dim(get_output(0), device_type_, data_type_, hidden_dim_);
   if (!status) {
     LOG(ERROR) << "The output tensor error in the swiglu layer.";
     return status;
   }
+  if (get_input(0).size() != get_input(1).size() || get_input(0).size() != get_output(0).size()) {
+    LOG(ERROR) << "The input and output tensor have different rows in the swiglu layer.";
+    return base::error::InvalidArgument("The rows of input and output tensor is mismatched.");
+  }
   return base::error::Success();
 }
 
 base::Status SwiGLULayer::forward() {
-  auto status = check();
-  if (!status) {
-    return status;
+  if (check_enabled_) {
+    auto status = check();
+    if (!status) {
+      return status;
+    }
   }
   auto input1 = this->get_input(0);
   auto input2 = this->get_input(1);
@@ -44,4 +50,5 @@ base::Status SwiGLULayer::forward() {
   return base::error::Success();
 }
 
+std::shared_ptr<Layer> SwiGLULayer::clone() const { return std::make_shared<SwiGLULayer>(*this); }
 }  // namespace op
@@ -1,14 +1,51 @@
 #include "sampler/argmax_sampler.h"
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
 #include <algorithm>
 #include "../op/kernels/cuda/argmax_kernel.cuh"
 namespace sampler {
+ArgmaxSampler::ArgmaxSampler(base::DeviceType device_type) : Sampler(device_type) {
+  if (device_type_ == base::DeviceType::kDeviceCUDA) {
+    auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+    workspace_ = std::make_shared<base::Buffer>(kernel::argmax_workspace_byte_size(), alloc_cu);
+    index_ = std::make_shared<base::Buffer>(sizeof(int32_t), alloc_cu);
+    CHECK(workspace_->allocate() && index_->allocate());
+  }
+}
+
 size_t ArgmaxSampler::sample(const float* logits, size_t size, void* stream) {
   if (device_type_ == base::DeviceType::kDeviceCPU) {
     size_t next = std::distance(logits, std::max_element(logits, logits + size));
     return next;
-  } else {
-    size_t next = kernel::argmax_kernel_cu(logits, size, stream);
-    return next;
   }
+  CHECK(sample_device(logits, size, static_cast<int32_t*>(index_->ptr()), stream));
+  int32_t next = 0;
+  cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+  cudaMemcpyAsync(&next, index_->ptr(), sizeof(int32_t), cudaMemcpyDeviceToHost, stream_);
+  cudaStreamSynchronize(stream_);
+  return static_cast<size_t>(next);
+}
+
+bool ArgmaxSampler::sample_device(const float* logits, size_t size, int32_t* output_idx,
+                                  void* stream) {
+  if (device_type_ != base::DeviceType::kDeviceCUDA) {
+    return false;
+  }
+  kernel::argmax_kernel_cu(logits, size, output_idx, workspace_->ptr(), stream);
+  return true;
+}
+
+int32_t ArgmaxSampler::candidate_num() const {
+  return device_type_ == base::DeviceType::kDeviceCUDA ? 1 : 0;
+}
+
+bool ArgmaxSampler::sample_candidates_device(const float* values, const int32_t* tokens,
+                                             int32_t* output_idx, void* stream) {
+  if (device_type_ != base::DeviceType::kDeviceCUDA) {
+    return false;
+  }
+  cudaMemcpyAsync(output_idx, tokens, sizeof(int32_t), cudaMemcpyDeviceToDevice,
+                  static_cast<cudaStream_t>(stream));
+  return true;
 }
 }  // namespace sampler
\ No newline at end of file
@@ -0,0 +1,119 @@
+#include "sampler/grammar_sampler.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <limits>
+#include "../op/kernels/cuda/logits_kernel.cuh"
+namespace sampler {
+GrammarSampler::GrammarSampler(base::DeviceType device_type,
+                               std::shared_ptr<const TokenGrammar> grammar,
+                               std::unique_ptr<Sampler> sampler, int32_t slot_num)
+    : Sampler(device_type),
+      grammar_(std::move(grammar)),
+      sampler_(std::move(sampler)),
+      slot_num_(slot_num) {
+  CHECK(grammar_ != nullptr);
+  CHECK(sampler_ != nullptr);
+  CHECK_GT(slot_num_, 0);
+  states_.assign(slot_num_, grammar_->start_state());
+  is_finished_.assign(slot_num_, false);
+  last_tokens_.assign(slot_num_, -1);
+  is_reset_.assign(slot_num_, false);
+}
+
+void GrammarSampler::set_slot(int32_t slot) {
+  CHECK(slot >= 0 && slot < slot_num_) << "The grammar sampler has no state of the slot " << slot
+                                        << ".";
+  slot_ = slot;
+  sampler_->set_slot(slot);
+}
+
+void GrammarSampler::begin_sequence(int32_t slot, void* stream) {
+  set_slot(slot);
+  sampler_->begin_sequence(slot, stream);
+  if (is_reset_.at(slot)) {
+    is_reset_.at(slot) = false;
+    return;
+  }
+  reset();
+}
+
+base::Status GrammarSampler::last_status() const { return last_status_; }
+
+void GrammarSampler::reset() {
+  states_.at(slot_) = grammar_->start_state();
+  is_finished_.at(slot_) = false;
+  last_tokens_.at(slot_) = -1;
+}
+
+base::Status GrammarSampler::reset(int32_t slot, const std::vector<int32_t>& output_tokens) {
+  set_slot(slot);
+  reset();
+  is_reset_.at(slot) = true;
+  for (int32_t token : output_tokens) {
+    if (is_finished_.at(slot)) {
+      return base::error::InvalidArgument("The output goes on after the end of the grammar.");
+    }
+    const int32_t next_state = grammar_->advance(states_.at(slot), token);
+    if (next_state < 0) {
+      return base::error::InvalidArgument("The token " + std::to_string(token) +
+                                          " of the output is not allowed by the grammar.");
+    }
+    states_.at(slot) = next_state;
+    is_finished_.at(slot) = grammar_->is_ending_token(token);
+    last_tokens_.at(slot) = token;
+  }
+  return base::error::Success();
+}
+
+int32_t GrammarSampler::state() const { return states_.at(slot_); }
+
+bool GrammarSampler::is_accepting() const { return grammar_->is_accepting(states_.at(slot_)); }
+
+bool GrammarSampler::is_finished() const { return is_finished_.at(slot_); }
+
+size_t GrammarSampler::sample(const float* logits, size_t size, void* stream) {
+  if (is_finished_.at(slot_)) {
+    last_status_ = base::error::InvalidArgument("The output of the grammar in the slot " +
+                                                std::to_string(slot_) + " is finished.");
+    return static_cast<size_t>(std::max(last_tokens_.at(slot_), 0));
+  }
+  CHECK_GE(size, static_cast<size_t>(grammar_->vocab_size()));
+  const int32_t state = states_.at(slot_);
+  size_t next = 0;
+  if (device_type_ == base::DeviceType::kDeviceCPU) {
+    const uint32_t* mask = grammar_->mask(state);
+    const int32_t vocab_size = grammar_->vocab_size();
+    logits_cpu_.resize(size);
+    for (size_t i = 0; i < size; ++i) {
+      const bool allowed = i < static_cast<size_t>(vocab_size) && ((mask[i / 32] >> (i % 32)) & 1u);
+      logits_cpu_[i] = allowed ? logits[i] : -std::numeric_limits<float>::infinity();
+    }
+    next = sampler_->sample(logits_cpu_.data(), size, stream);
+  } else {
+    CHECK(device_type_ == base::DeviceType::kDeviceCUDA);
+    if (!logits_ || logits_->byte_size() < size * sizeof(float)) {
+      auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+      logits_ = std::make_shared<base::Buffer>(size * sizeof(float), alloc_cu);
+      CHECK(logits_->allocate());
+    }
+    float* masked = static_cast<float*>(logits_->ptr());
+    kernel::token_mask_kernel_cu(logits, size, grammar_->mask_device(state),
+                                 grammar_->vocab_size(), masked, stream);
+    next = sampler_->sample(masked, size, stream);
+  }
+
+  const int32_t token = static_cast<int32_t>(next);
+  const int32_t next_state = grammar_->advance(state, token);
+  last_tokens_.at(slot_) = token;
+  last_status_ = base::error::Success();
+  if (next_state < 0) {
+    // every logit was masked, the state allows no token of the vocab
+    LOG(WARNING) << "The sampled token " << token << " is not allowed by the grammar.";
+    is_finished_.at(slot_) = true;
+  } else {
+    states_.at(slot_) = next_state;
+    is_finished_.at(slot_) = grammar_->is_ending_token(token);
+  }
+  return next;
+}
+}  // namespace sampler
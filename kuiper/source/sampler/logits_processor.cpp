@@ -0,0 +1,146 @@
+#include "sampler/logits_processor.h"
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <algorithm>
+#include <limits>
+#include "../op/kernels/cuda/logits_kernel.cuh"
+namespace sampler {
+LogitsProcessor::LogitsProcessor(base::DeviceType device_type, int32_t vocab_size,
+                                 const LogitsParams& params, std::unique_ptr<Sampler> sampler,
+                                 int32_t slot_num)
+    : Sampler(device_type),
+      params_(params),
+      vocab_size_(vocab_size),
+      sampler_(std::move(sampler)),
+      slot_num_(slot_num) {
+  CHECK(sampler_ != nullptr);
+  CHECK_GT(vocab_size_, 0);
+  CHECK_GT(slot_num_, 0);
+  CHECK_GT(params.repetition_penalty, 0.f);
+  // the biases are a dense table, so the pass reads one value per token
+  bias_cpu_.assign(vocab_size_, 0.f);
+  for (const auto& [token_id, bias] : params.logit_bias) {
+    CHECK(token_id >= 0 && token_id < vocab_size_) << "The biased token is out of the vocab.";
+    bias_cpu_.at(token_id) += bias;
+  }
+  for (int32_t token_id : params.banned_tokens) {
+    CHECK(token_id >= 0 && token_id < vocab_size_) << "The banned token is out of the vocab.";
+    bias_cpu_.at(token_id) = -std::numeric_limits<float>::infinity();
+  }
+  const size_t count_num = static_cast<size_t>(slot_num_) * vocab_size_;
+  counts_cpu_.assign(count_num, 0);
+  is_reset_.assign(slot_num_, false);
+  if (device_type_ == base::DeviceType::kDeviceCUDA) {
+    auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+    counts_ = std::make_shared<base::Buffer>(count_num * sizeof(int32_t), alloc_cu);
+    bias_ = std::make_shared<base::Buffer>(vocab_size_ * sizeof(float), alloc_cu);
+    logits_ = std::make_shared<base::Buffer>(vocab_size_ * sizeof(float), alloc_cu);
+    index_ = std::make_shared<base::Buffer>(sizeof(int32_t), alloc_cu);
+    CHECK(counts_->allocate() && bias_->allocate() && logits_->allocate() && index_->allocate());
+    cudaMemcpy(bias_->ptr(), bias_cpu_.data(), vocab_size_ * sizeof(float),
+               cudaMemcpyHostToDevice);
+    alloc_cu->memset_zero(counts_->ptr(), count_num * sizeof(int32_t), nullptr, true);
+  }
+}
+
+void LogitsProcessor::set_slot(int32_t slot) {
+  CHECK(slot >= 0 && slot < slot_num_) << "The logits processor has no counts of the slot "
+                                        << slot << ".";
+  slot_ = slot;
+  sampler_->set_slot(slot);
+}
+
+void LogitsProcessor::begin_sequence(int32_t slot, void* stream) {
+  set_slot(slot);
+  sampler_->begin_sequence(slot, stream);
+  if (is_reset_.at(slot)) {
+    is_reset_.at(slot) = false;
+    return;
+  }
+  std::fill_n(counts_cpu_.begin() + static_cast<size_t>(slot) * vocab_size_, vocab_size_, 0);
+  if (device_type_ == base::DeviceType::kDeviceCUDA) {
+    base::CUDADeviceAllocatorFactory::get_instance()->memset_zero(
+        slot_counts(), vocab_size_ * sizeof(int32_t), stream, false);
+  }
+}
+
+base::Status LogitsProcessor::last_status() const { return sampler_->last_status(); }
+
+int32_t* LogitsProcessor::slot_counts() const {
+  return static_cast<int32_t*>(counts_->ptr()) + static_cast<size_t>(slot_) * vocab_size_;
+}
+
+const LogitsParams& LogitsProcessor::params() const { return params_; }
+
+void LogitsProcessor::reset(const std::vector<int32_t>& tokens, void* stream) {
+  reset(slot_, tokens, stream);
+}
+
+void LogitsProcessor::reset(int32_t slot, const std::vector<int32_t>& tokens, void* stream) {
+  set_slot(slot);
+  is_reset_.at(slot) = true;
+  int32_t* counts = counts_cpu_.data() + static_cast<size_t>(slot) * vocab_size_;
+  std::fill_n(counts, vocab_size_, 0);
+  for (int32_t token_id : tokens) {
+    if (token_id >= 0 && token_id < vocab_size_) {
+      counts[token_id] += 1;
+    }
+  }
+  if (device_type_ == base::DeviceType::kDeviceCUDA) {
+    cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+    cudaMemcpyAsync(slot_counts(), counts, vocab_size_ * sizeof(int32_t), cudaMemcpyHostToDevice,
+                    stream_);
+    // the source of the copy is the host table, which the next reset overwrites
+    cudaStreamSynchronize(stream_);
+  }
+}
+
+size_t LogitsProcessor::sample(const float* logits, size_t size, void* stream) {
+  CHECK_EQ(size, static_cast<size_t>(vocab_size_));
+  if (device_type_ == base::DeviceType::kDeviceCPU) {
+    process_cpu(logits, size);
+    const size_t next = sampler_->sample(logits_cpu_.data(), size, stream);
+    counts_cpu_.at(static_cast<size_t>(slot_) * vocab_size_ + next) += 1;
+    return next;
+  }
+  CHECK(sample_device(logits, size, static_cast<int32_t*>(index_->ptr()), stream));
+  int32_t next = 0;
+  cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+  cudaMemcpyAsync(&next, index_->ptr(), sizeof(int32_t), cudaMemcpyDeviceToHost, stream_);
+  cudaStreamSynchronize(stream_);
+  return static_cast<size_t>(next);
+}
+
+bool LogitsProcessor::sample_device(const float* logits, size_t size, int32_t* output_idx,
+                                    void* stream) {
+  if (device_type_ != base::DeviceType::kDeviceCUDA) {
+    return false;
+  }
+  CHECK_EQ(size, static_cast<size_t>(vocab_size_));
+  float* processed = static_cast<float*>(logits_->ptr());
+  kernel::logits_process_kernel_cu(logits, size, slot_counts(),
+                                   static_cast<const float*>(bias_->ptr()),
+                                   params_.repetition_penalty, params_.presence_penalty,
+                                   params_.frequency_penalty, processed, stream);
+  if (!sampler_->sample_device(processed, size, output_idx, stream)) {
+    return false;
+  }
+  kernel::count_token_kernel_cu(output_idx, slot_counts(), size, stream);
+  return true;
+}
+
+void LogitsProcessor::process_cpu(const float* logits, size_t size) {
+  logits_cpu_.resize(size);
+  const int32_t* counts = counts_cpu_.data() + static_cast<size_t>(slot_) * vocab_size_;
+  for (size_t i = 0; i < size; ++i) {
+    float value = logits[i] + bias_cpu_[i];
+    const int32_t count = counts[i];
+    if (count > 0) {
+      value = value > 0.f ? value / params_.repetition_penalty
+                          : value * params_.repetition_penalty;
+      value -= params_.presence_penalty + params_.frequency_penalty * static_cast<float>(count);
+    }
+    logits_cpu_[i] = value;
+  }
+}
+}  // namespace sampler
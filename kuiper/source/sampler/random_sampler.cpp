@@ -0,0 +1,131 @@
+#include "sampler/random_sampler.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <cmath>
+#include <cuda_runtime_api.h>
+#include "../op/kernels/cuda/argmax_kernel.cuh"
+#include "../op/kernels/cuda/cls_topk_kernel.cuh"
+#include "../op/kernels/cuda/sampling_kernel.cuh"
+namespace sampler {
+RandomSampler::RandomSampler(base::DeviceType device_type, const SamplingParams& params)
+    : Sampler(device_type), params_(params), engine_(params.seed) {
+  CHECK_GE(params.top_k, 0);
+  CHECK(params.top_p > 0.f && params.top_p <= 1.f);
+  if (device_type_ == base::DeviceType::kDeviceCUDA) {
+    auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+    counter_ = std::make_shared<base::Buffer>(sizeof(uint64_t), alloc_cu);
+    index_ = std::make_shared<base::Buffer>(sizeof(int32_t), alloc_cu);
+    argmax_workspace_ =
+        std::make_shared<base::Buffer>(kernel::argmax_workspace_byte_size(), alloc_cu);
+    CHECK(counter_->allocate() && index_->allocate() && argmax_workspace_->allocate());
+    alloc_cu->memset_zero(counter_->ptr(), sizeof(uint64_t), nullptr, true);
+  }
+}
+
+const SamplingParams& RandomSampler::params() const { return params_; }
+
+size_t RandomSampler::sample(const float* logits, size_t size, void* stream) {
+  if (device_type_ == base::DeviceType::kDeviceCPU) {
+    return sample_cpu(logits, size);
+  }
+  CHECK(sample_device(logits, size, static_cast<int32_t*>(index_->ptr()), stream));
+  int32_t next = 0;
+  cudaStream_t stream_ = static_cast<cudaStream_t>(stream);
+  cudaMemcpyAsync(&next, index_->ptr(), sizeof(int32_t), cudaMemcpyDeviceToHost, stream_);
+  cudaStreamSynchronize(stream_);
+  return static_cast<size_t>(next);
+}
+
+bool RandomSampler::sample_device(const float* logits, size_t size, int32_t* output_idx,
+                                  void* stream) {
+  if (device_type_ != base::DeviceType::kDeviceCUDA) {
+    return false;
+  }
+  if (params_.temperature <= 0.f) {
+    kernel::argmax_kernel_cu(logits, size, output_idx, argmax_workspace_->ptr(), stream);
+  } else {
+    kernel::sampling_kernel_cu(logits, size, params_.temperature, params_.top_k, params_.top_p,
+                               params_.seed, static_cast<uint64_t*>(counter_->ptr()),
+                               output_idx, stream);
+  }
+  return true;
+}
+
+int32_t RandomSampler::candidate_num() const {
+  if (device_type_ != base::DeviceType::kDeviceCUDA) {
+    return 0;
+  }
+  if (params_.temperature <= 0.f) {
+    return 1;
+  }
+  return params_.top_k <= kernel::kClsTopKMaxNum ? params_.top_k : 0;
+}
+
+bool RandomSampler::sample_candidates_device(const float* values, const int32_t* tokens,
+                                             int32_t* output_idx, void* stream) {
+  const int32_t k = candidate_num();
+  if (k == 0) {
+    return false;
+  }
+  if (k == 1) {
+    cudaMemcpyAsync(output_idx, tokens, sizeof(int32_t), cudaMemcpyDeviceToDevice,
+                    static_cast<cudaStream_t>(stream));
+  } else {
+    // the list is the top-k already
+    kernel::sampling_kernel_cu(values, k, params_.temperature, 0, params_.top_p, params_.seed,
+                               static_cast<uint64_t*>(counter_->ptr()), output_idx, stream,
+                               tokens);
+  }
+  return true;
+}
+
+size_t RandomSampler::sample_cpu(const float* logits, size_t size) {
+  if (params_.temperature <= 0.f) {
+    return std::distance(logits, std::max_element(logits, logits + size));
+  }
+  const float max_logit = *std::max_element(logits, logits + size);
+  candidates_.resize(size);
+  for (size_t i = 0; i < size; ++i) {
+    candidates_[i] = {std::exp((logits[i] - max_logit) / params_.temperature),
+                      static_cast<int32_t>(i)};
+  }
+  auto greater = [](const std::pair<float, int32_t>& a, const std::pair<float, int32_t>& b) {
+    return a.first > b.first;
+  };
+  size_t keep_num = size;
+  if (params_.top_k > 0 && params_.top_k < size) {
+    keep_num = params_.top_k;
+    std::nth_element(candidates_.begin(), candidates_.begin() + keep_num - 1, candidates_.end(),
+                     greater);
+  }
+  if (params_.top_p < 1.f) {
+    std::sort(candidates_.begin(), candidates_.begin() + keep_num, greater);
+    float total = 0.f;
+    for (size_t i = 0; i < keep_num; ++i) {
+      total += candidates_[i].first;
+    }
+    float acc = 0.f;
+    for (size_t i = 0; i < keep_num; ++i) {
+      acc += candidates_[i].first;
+      if (acc >= params_.top_p * total) {
+        keep_num = i + 1;
+        break;
+      }
+    }
+  }
+
+  float total = 0.f;
+  for (size_t i = 0; i < keep_num; ++i) {
+    total += candidates_[i].first;
+  }
+  const float threshold = std::uniform_real_distribution<float>(0.f, total)(engine_);
+  float acc = 0.f;
+  for (size_t i = 0; i < keep_num; ++i) {
+    acc += candidates_[i].first;
+    if (acc > threshold) {
+      return candidates_[i].second;
+    }
+  }
+  return candidates_[keep_num - 1].second;
+}
+}  // namespace sampler
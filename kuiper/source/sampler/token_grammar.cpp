@@ -0,0 +1,739 @@
+#include "sampler/token_grammar.h"
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <algorithm>
+#include <bitset>
+#include <cctype>
+#include <map>
+#if defined(LLAMA3_SUPPORT) || defined(QWEN2_SUPPORT)
+#include "nlohmann/json.hpp"
+#endif
+namespace sampler {
+namespace {
+// a thompson automaton, a node either moves on a byte set or only by its epsilon edges
+struct NfaNode {
+  std::vector<int32_t> epsilon;
+  std::bitset<256> bytes;
+  int32_t to = -1;
+};
+
+struct NfaFragment {
+  int32_t start = -1;
+  int32_t end = -1;
+};
+
+class RegexParser {
+ public:
+  explicit RegexParser(const std::string& pattern) : pattern_(pattern) {}
+
+  base::Status parse(std::vector<NfaNode>& nodes, NfaFragment& fragment) {
+    pos_ = 0;
+    nodes_.clear();
+    fragment = parse_alternation();
+    if (!status_) {
+      return status_;
+    }
+    if (pos_ != pattern_.size()) {
+      return error("an unmatched )");
+    }
+    nodes = std::move(nodes_);
+    return base::error::Success();
+  }
+
+ private:
+  int32_t add_node() {
+    nodes_.emplace_back();
+    return static_cast<int32_t>(nodes_.size()) - 1;
+  }
+
+  base::Status error(const std::string& reason) {
+    return base::error::InvalidArgument("The grammar regex has " + reason + " at " +
+                                        std::to_string(pos_) + ".");
+  }
+
+  bool at_end() const { return pos_ >= pattern_.size() || !status_; }
+
+  NfaFragment parse_alternation() {
+    NfaFragment left = parse_concatenation();
+    while (!at_end() && pattern_[pos_] == '|') {
+      pos_ += 1;
+      NfaFragment right = parse_concatenation();
+      NfaFragment both{add_node(), add_node()};
+      nodes_[both.start].epsilon = {left.start, right.start};
+      nodes_[left.end].epsilon.push_back(both.end);
+      nodes_[right.end].epsilon.push_back(both.end);
+      left = both;
+    }
+    return left;
+  }
+
+  NfaFragment parse_concatenation() {
+    const int32_t empty = add_node();
+    NfaFragment fragment{empty, empty};
+    while (!at_end() && pattern_[pos_] != '|' && pattern_[pos_] != ')') {
+      NfaFragment next = parse_repetition();
+      nodes_[fragment.end].epsilon.push_back(next.start);
+      fragment.end = next.end;
+    }
+    return fragment;
+  }
+
+  NfaFragment parse_repetition() {
+    NfaFragment fragment = parse_atom();
+    while (!at_end()) {
+      const char op = pattern_[pos_];
+      if (op != '*' && op != '+' && op != '?') {
+        break;
+      }
+      pos_ += 1;
+      NfaFragment repeated{add_node(), add_node()};
+      nodes_[repeated.start].epsilon.push_back(fragment.start);
+      nodes_[fragment.end].epsilon.push_back(repeated.end);
+      if (op != '+') {
+        nodes_[repeated.start].epsilon.push_back(repeated.end);
+      }
+      if (op != '?') {
+        nodes_[fragment.end].epsilon.push_back(fragment.start);
+      }
+      fragment = repeated;
+    }
+    return fragment;
+  }
+
+  NfaFragment byte_set(const std::bitset<256>& bytes) {
+    NfaFragment fragment{add_node(), add_node()};
+    nodes_[fragment.start].bytes = bytes;
+    nodes_[fragment.start].to = fragment.end;
+    return fragment;
+  }
+
+  NfaFragment parse_atom() {
+    const char c = pattern_[pos_];
+    if (c == '(') {
+      pos_ += 1;
+      NfaFragment fragment = parse_alternation();
+      if (pos_ >= pattern_.size() || pattern_[pos_] != ')') {
+        fail("an unclosed (");
+      } else {
+        pos_ += 1;
+      }
+      return fragment;
+    }
+    if (c == '*' || c == '+' || c == '?') {
+      fail("a repetition of nothing");
+      return byte_set({});
+    }
+    std::bitset<256> bytes;
+    if (c == '[') {
+      pos_ += 1;
+      parse_class(bytes);
+    } else if (c == '.') {
+      pos_ += 1;
+      bytes.set();
+    } else if (c == '\\') {
+      pos_ += 1;
+      parse_escape(bytes);
+    } else {
+      pos_ += 1;
+      bytes.set(static_cast<uint8_t>(c));
+    }
+    return byte_set(bytes);
+  }
+
+  // the byte of the escape after the backslash, the class escapes fill the set and return -1
+  int32_t parse_escape(std::bitset<256>& bytes) {
+    if (pos_ >= pattern_.size()) {
+      fail("a trailing backslash");
+      return -1;
+    }
+    const char c = pattern_[pos_++];
+    int32_t byte = -1;
+    switch (c) {
+      case 'd':
+        for (int32_t b = '0'; b <= '9'; ++b) bytes.set(b);
+        break;
+      case 'w':
+        for (int32_t b = 0; b < 256; ++b) {
+          if (std::isalnum(b) || b == '_') bytes.set(b);
+        }
+        break;
+      case 's':
+        for (char b : std::string(" \t\n\r\f\v")) bytes.set(static_cast<uint8_t>(b));
+        break;
+      case 'n':
+        byte = '\n';
+        break;
+      case 't':
+        byte = '\t';
+        break;
+      case 'r':
+        byte = '\r';
+        break;
+      case 'x': {
+        if (pos_ + 2 > pattern_.size() || !std::isxdigit(static_cast<uint8_t>(pattern_[pos_])) ||
+            !std::isxdigit(static_cast<uint8_t>(pattern_[pos_ + 1]))) {
+          fail("a bad \\x escape");
+          return -1;
+        }
+        byte = std::stoi(pattern_.substr(pos_, 2), nullptr, 16);
+        pos_ += 2;
+        break;
+      }
+      default:
+        byte = static_cast<uint8_t>(c);
+    }
+    if (byte >= 0) {
+      bytes.set(byte);
+    }
+    return byte;
+  }
+
+  void parse_class(std::bitset<256>& bytes) {
+    bool negated = false;
+    if (pos_ < pattern_.size() && pattern_[pos_] == '^') {
+      negated = true;
+      pos_ += 1;
+    }
+    bool first = true;
+    while (true) {
+      if (pos_ >= pattern_.size()) {
+        fail("an unclosed [");
+        return;
+      }
+      if (pattern_[pos_] == ']' && !first) {
+        pos_ += 1;
+        break;
+      }
+      first = false;
+      int32_t low = class_byte(bytes);
+      if (low < 0 || !status_) {
+        continue;
+      }
+      if (pos_ + 1 < pattern_.size() && pattern_[pos_] == '-' && pattern_[pos_ + 1] != ']') {
+        pos_ += 1;
+        const int32_t high = class_byte(bytes);
+        if (high < low) {
+          fail("a reversed range");
+          return;
+        }
+        for (int32_t b = low; b <= high; ++b) {
+          bytes.set(b);
+        }
+      } else {
+        bytes.set(low);
+      }
+    }
+    if (negated) {
+      bytes.flip();
+    }
+  }
+
+  int32_t class_byte(std::bitset<256>& bytes) {
+    const char c = pattern_[pos_++];
+    if (c == '\\') {
+      return parse_escape(bytes);
+    }
+    return static_cast<uint8_t>(c);
+  }
+
+  void fail(const std::string& reason) {
+    if (status_) {
+      status_ = error(reason);
+    }
+  }
+
+ private:
+  const std::string& pattern_;
+  size_t pos_ = 0;
+  std::vector<NfaNode> nodes_;
+  base::Status status_;
+};
+
+void epsilon_closure(const std::vector<NfaNode>& nodes, std::vector<int32_t>& set,
+                     std::vector<char>& visited) {
+  std::fill(visited.begin(), visited.end(), 0);
+  std::vector<int32_t> stack = set;
+  for (int32_t node : set) {
+    visited[node] = 1;
+  }
+  while (!stack.empty()) {
+    const int32_t node = stack.back();
+    stack.pop_back();
+    for (int32_t to : nodes[node].epsilon) {
+      if (!visited[to]) {
+        visited[to] = 1;
+        set.push_back(to);
+        stack.push_back(to);
+      }
+    }
+  }
+  std::sort(set.begin(), set.end());
+  set.erase(std::unique(set.begin(), set.end()), set.end());
+}
+
+// drops the states which can not reach an accepting one, so every live state of the masks can
+// still finish the output
+void prune_dead(ByteDfa& dfa) {
+  const int32_t state_num = dfa.state_num();
+  std::vector<std::vector<int32_t>> from(state_num);
+  for (int32_t s = 0; s < state_num; ++s) {
+    for (int32_t to : dfa.next[s]) {
+      if (to >= 0) from[to].push_back(s);
+    }
+  }
+  std::vector<char> live(state_num, 0);
+  std::vector<int32_t> stack;
+  for (int32_t s = 0; s < state_num; ++s) {
+    if (dfa.accepting[s]) {
+      live[s] = 1;
+      stack.push_back(s);
+    }
+  }
+  while (!stack.empty()) {
+    const int32_t s = stack.back();
+    stack.pop_back();
+    for (int32_t prev : from[s]) {
+      if (!live[prev]) {
+        live[prev] = 1;
+        stack.push_back(prev);
+      }
+    }
+  }
+  for (auto& next : dfa.next) {
+    for (int32_t& to : next) {
+      if (to >= 0 && !live[to]) to = -1;
+    }
+  }
+}
+
+// moore refinement from the accepting split, then renumbers the states reachable from start
+void minimize(ByteDfa& dfa) {
+  const int32_t state_num = dfa.state_num();
+  std::vector<int32_t> block(state_num);
+  for (int32_t s = 0; s < state_num; ++s) {
+    block[s] = dfa.accepting[s] ? 1 : 0;
+  }
+  int32_t block_num = 0;
+  while (true) {
+    std::map<std::vector<int32_t>, int32_t> signatures;
+    std::vector<int32_t> refined(state_num);
+    for (int32_t s = 0; s < state_num; ++s) {
+      std::vector<int32_t> signature(257);
+      signature[0] = block[s];
+      for (int32_t b = 0; b < 256; ++b) {
+        const int32_t to = dfa.next[s][b];
+        signature[b + 1] = to < 0 ? -1 : block[to];
+      }
+      auto it = signatures.emplace(std::move(signature), signatures.size()).first;
+      refined[s] = it->second;
+    }
+    block = std::move(refined);
+    if (static_cast<int32_t>(signatures.size()) == block_num) {
+      break;
+    }
+    block_num = static_cast<int32_t>(signatures.size());
+  }
+
+  std::vector<int32_t> renumber(block_num, -1);
+  std::vector<int32_t> order;
+  std::vector<int32_t> representative(block_num, -1);
+  for (int32_t s = 0; s < state_num; ++s) {
+    if (representative[block[s]] < 0) representative[block[s]] = s;
+  }
+  renumber[block[dfa.start]] = 0;
+  order.push_back(block[dfa.start]);
+  for (size_t i = 0; i < order.size(); ++i) {
+    for (int32_t to : dfa.next[representative[order[i]]]) {
+      if (to >= 0 && renumber[block[to]] < 0) {
+        renumber[block[to]] = static_cast<int32_t>(order.size());
+        order.push_back(block[to]);
+      }
+    }
+  }
+  ByteDfa minimized;
+  minimized.start = 0;
+  minimized.next.resize(order.size());
+  minimized.accepting.resize(order.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    const int32_t s = representative[order[i]];
+    minimized.accepting[i] = dfa.accepting[s];
+    for (int32_t b = 0; b < 256; ++b) {
+      const int32_t to = dfa.next[s][b];
+      minimized.next[i][b] = to < 0 ? -1 : renumber[block[to]];
+    }
+  }
+  dfa = std::move(minimized);
+}
+}  // namespace
+
+int32_t ByteDfa::state_num() const { return static_cast<int32_t>(next.size()); }
+
+int32_t ByteDfa::walk(int32_t state, const std::string& bytes) const {
+  for (char c : bytes) {
+    if (state < 0) {
+      break;
+    }
+    state = next[state][static_cast<uint8_t>(c)];
+  }
+  return state;
+}
+
+bool ByteDfa::matches(const std::string& text) const {
+  const int32_t state = walk(start, text);
+  return state >= 0 && accepting[state];
+}
+
+base::Status ByteDfa::from_regex(const std::string& pattern, ByteDfa& dfa) {
+  std::vector<NfaNode> nodes;
+  NfaFragment fragment;
+  base::Status status = RegexParser(pattern).parse(nodes, fragment);
+  if (!status) {
+    return status;
+  }
+
+  // subset construction, the sets of the nfa nodes are keys of the dfa states
+  ByteDfa result;
+  std::map<std::vector<int32_t>, int32_t> states;
+  std::vector<std::vector<int32_t>> sets;
+  std::vector<char> visited(nodes.size());
+  std::vector<int32_t> start_set = {fragment.start};
+  epsilon_closure(nodes, start_set, visited);
+  states.emplace(start_set, 0);
+  sets.push_back(start_set);
+  for (size_t i = 0; i < sets.size(); ++i) {
+    std::array<int32_t, 256> next;
+    next.fill(-1);
+    std::array<std::vector<int32_t>, 256> moves;
+    for (int32_t node : sets[i]) {
+      const NfaNode& nfa_node = nodes[node];
+      if (nfa_node.to < 0) {
+        continue;
+      }
+      for (int32_t b = 0; b < 256; ++b) {
+        if (nfa_node.bytes.test(b)) moves[b].push_back(nfa_node.to);
+      }
+    }
+    for (int32_t b = 0; b < 256; ++b) {
+      if (moves[b].empty()) {
+        continue;
+      }
+      epsilon_closure(nodes, moves[b], visited);
+      auto it = states.find(moves[b]);
+      if (it == states.end()) {
+        it = states.emplace(moves[b], static_cast<int32_t>(sets.size())).first;
+        sets.push_back(moves[b]);
+      }
+      next[b] = it->second;
+    }
+    result.next.push_back(next);
+    result.accepting.push_back(
+        std::binary_search(sets[i].begin(), sets[i].end(), fragment.end));
+  }
+  result.start = 0;
+  prune_dead(result);
+  minimize(result);
+  dfa = std::move(result);
+  return base::error::Success();
+}
+
+namespace {
+const std::string kJsonSpace = " ?";
+const std::string kJsonString =
+    "\"([^\"\\\\\\x00-\\x1f]|\\\\[\"\\\\/bfnrt]|\\\\u[0-9a-fA-F][0-9a-fA-F][0-9a-fA-F][0-9a-fA-F])"
+    "*\"";
+const std::string kJsonInteger = "-?(0|[1-9][0-9]*)";
+const std::string kJsonNumber = kJsonInteger + "(\\.[0-9]+)?([eE][+-]?[0-9]+)?";
+const std::string kJsonBoolean = "(true|false)";
+const std::string kJsonNull = "null";
+
+std::string json_array_regex(const std::string& item) {
+  const std::string separator = kJsonSpace + "," + kJsonSpace;
+  return "\\[" + kJsonSpace + "(" + item + "(" + separator + item + ")*)?" + kJsonSpace + "\\]";
+}
+
+std::string json_object_regex(const std::string& value) {
+  const std::string member = kJsonString + kJsonSpace + ":" + kJsonSpace + value;
+  const std::string separator = kJsonSpace + "," + kJsonSpace;
+  return "\\{" + kJsonSpace + "(" + member + "(" + separator + member + ")*)?" + kJsonSpace +
+         "\\}";
+}
+
+std::string regex_escape(const std::string& text) {
+  static const std::string meta = "\\.[]()|*+?^-{}";
+  std::string escaped;
+  for (char c : text) {
+    if (meta.find(c) != std::string::npos) {
+      escaped.push_back('\\');
+    }
+    escaped.push_back(c);
+  }
+  return escaped;
+}
+}  // namespace
+
+std::string json_value_regex(int32_t max_depth) {
+  std::string value = "(" + kJsonString + "|" + kJsonNumber + "|" + kJsonBoolean + "|" +
+                      kJsonNull + ")";
+  for (int32_t depth = 0; depth < max_depth; ++depth) {
+    value = "(" + kJsonString + "|" + kJsonNumber + "|" + kJsonBoolean + "|" + kJsonNull + "|" +
+            json_array_regex(value) + "|" + json_object_regex(value) + ")";
+  }
+  return value;
+}
+
+#if defined(LLAMA3_SUPPORT) || defined(QWEN2_SUPPORT)
+namespace {
+using ordered_json = nlohmann::ordered_json;
+
+base::Status schema_regex(const ordered_json& schema, std::string& regex);
+
+base::Status alternatives_regex(const ordered_json& schemas, std::string& regex) {
+  if (!schemas.is_array() || schemas.empty()) {
+    return base::error::InvalidArgument("The anyOf of the schema is not a list of schemas.");
+  }
+  regex = "(";
+  for (size_t i = 0; i < schemas.size(); ++i) {
+    std::string alternative;
+    base::Status status = schema_regex(schemas[i], alternative);
+    if (!status) {
+      return status;
+    }
+    regex += (i == 0 ? "" : "|") + alternative;
+  }
+  regex += ")";
+  return base::error::Success();
+}
+
+base::Status type_regex(const ordered_json& schema, const std::string& type, std::string& regex) {
+  if (type == "string") {
+    regex = kJsonString;
+  } else if (type == "integer") {
+    regex = kJsonInteger;
+  } else if (type == "number") {
+    regex = kJsonNumber;
+  } else if (type == "boolean") {
+    regex = kJsonBoolean;
+  } else if (type == "null") {
+    regex = kJsonNull;
+  } else if (type == "array") {
+    std::string item = json_value_regex(2);
+    if (schema.contains("items")) {
+      base::Status status = schema_regex(schema["items"], item);
+      if (!status) {
+        return status;
+      }
+    }
+    regex = json_array_regex(item);
+  } else if (type == "object") {
+    if (!schema.contains("properties")) {
+      regex = json_object_regex(json_value_regex(2));
+      return base::error::Success();
+    }
+    regex = "\\{" + kJsonSpace;
+    bool first = true;
+    for (const auto& [key, property] : schema["properties"].items()) {
+      std::string value;
+      base::Status status = schema_regex(property, value);
+      if (!status) {
+        return status;
+      }
+      if (!first) {
+        regex += kJsonSpace + "," + kJsonSpace;
+      }
+      first = false;
+      regex += regex_escape(ordered_json(key).dump()) + kJsonSpace + ":" + kJsonSpace + value;
+    }
+    regex += kJsonSpace + "\\}";
+  } else {
+    return base::error::InvalidArgument("The schema type " + type + " is not supported.");
+  }
+  return base::error::Success();
+}
+
+base::Status schema_regex(const ordered_json& schema, std::string& regex) {
+  if (!schema.is_object()) {
+    return base::error::InvalidArgument("The schema is not a json object.");
+  }
+  if (schema.contains("const")) {
+    regex = regex_escape(schema["const"].dump());
+    return base::error::Success();
+  }
+  if (schema.contains("enum")) {
+    const ordered_json& values = schema["enum"];
+    if (!values.is_array() || values.empty()) {
+      return base::error::InvalidArgument("The enum of the schema is not a list of values.");
+    }
+    regex = "(";
+    for (size_t i = 0; i < values.size(); ++i) {
+      regex += (i == 0 ? "" : "|") + regex_escape(values[i].dump());
+    }
+    regex += ")";
+    return base::error::Success();
+  }
+  if (schema.contains("anyOf")) {
+    return alternatives_regex(schema["anyOf"], regex);
+  }
+  if (schema.contains("oneOf")) {
+    return alternatives_regex(schema["oneOf"], regex);
+  }
+  if (!schema.contains("type")) {
+    regex = json_value_regex();
+    return base::error::Success();
+  }
+  const ordered_json& type = schema["type"];
+  if (type.is_string()) {
+    return type_regex(schema, type.get<std::string>(), regex);
+  }
+  if (!type.is_array() || type.empty()) {
+    return base::error::InvalidArgument("The type of the schema is not a name or a list.");
+  }
+  regex = "(";
+  for (size_t i = 0; i < type.size(); ++i) {
+    std::string alternative;
+    base::Status status = type_regex(schema, type[i].get<std::string>(), alternative);
+    if (!status) {
+      return status;
+    }
+    regex += (i == 0 ? "" : "|") + alternative;
+  }
+  regex += ")";
+  return base::error::Success();
+}
+}  // namespace
+
+base::Status json_schema_regex(const std::string& schema, std::string& regex) {
+  ordered_json schema_json;
+  try {
+    schema_json = ordered_json::parse(schema);
+  } catch (nlohmann::json::exception&) {
+    return base::error::InvalidArgument("The schema is not valid json.");
+  }
+  return schema_regex(schema_json, regex);
+}
+#else
+base::Status json_schema_regex(const std::string& schema, std::string& regex) {
+  return base::error::FunctionNotImplement("The json schemas need the json support of a model.");
+}
+#endif
+
+TokenGrammar::TokenGrammar(ByteDfa dfa, const std::vector<std::string>& token_bytes,
+                           const std::vector<int32_t>& ending_tokens)
+    : dfa_(std::move(dfa)), token_bytes_(token_bytes) {
+  CHECK_GT(dfa_.state_num(), 0);
+  vocab_size_ = static_cast<int32_t>(token_bytes_.size());
+  CHECK_GT(vocab_size_, 0);
+  word_num_ = (vocab_size_ + 31) / 32;
+  is_ending_.assign(vocab_size_, false);
+  for (int32_t token : ending_tokens) {
+    if (token >= 0 && token < vocab_size_) {
+      is_ending_[token] = true;
+    }
+  }
+
+  // the tokens in byte order, so a token walks the dfa only from the end of the prefix it
+  // shares with the one before it, the bytes of the vocab are walked once per state as a trie
+  std::vector<int32_t> order;
+  for (int32_t token = 0; token < vocab_size_; ++token) {
+    if (!is_ending_[token] && !token_bytes_[token].empty()) {
+      order.push_back(token);
+    }
+  }
+  std::sort(order.begin(), order.end(), [this](int32_t a, int32_t b) {
+    return token_bytes_[a] < token_bytes_[b];
+  });
+  std::vector<int32_t> shared(order.size(), 0);
+  for (size_t i = 1; i < order.size(); ++i) {
+    const std::string& prev = token_bytes_[order[i - 1]];
+    const std::string& curr = token_bytes_[order[i]];
+    const size_t max_len = std::min(prev.size(), curr.size());
+    size_t len = 0;
+    while (len < max_len && prev[len] == curr[len]) {
+      len += 1;
+    }
+    shared[i] = static_cast<int32_t>(len);
+  }
+
+  const int32_t state_num = dfa_.state_num();
+  masks_.assign(static_cast<size_t>(state_num) * word_num_, 0);
+  std::vector<int32_t> walked;
+  for (int32_t state = 0; state < state_num; ++state) {
+    uint32_t* mask = masks_.data() + static_cast<size_t>(state) * word_num_;
+    walked.assign(1, state);
+    for (size_t i = 0; i < order.size(); ++i) {
+      const std::string& bytes = token_bytes_[order[i]];
+      walked.resize(shared[i] + 1);
+      for (size_t j = shared[i]; j < bytes.size(); ++j) {
+        const int32_t from = walked.back();
+        walked.push_back(from < 0 ? -1 : dfa_.next[from][static_cast<uint8_t>(bytes[j])]);
+      }
+      if (walked.back() >= 0) {
+        mask[order[i] / 32] |= 1u << (order[i] % 32);
+      }
+    }
+    if (dfa_.accepting[state]) {
+      for (int32_t token : ending_tokens) {
+        if (token >= 0 && token < vocab_size_) {
+          mask[token / 32] |= 1u << (token % 32);
+        }
+      }
+    }
+    if (std::all_of(mask, mask + word_num_, [](uint32_t word) { return word == 0; })) {
+      LOG(WARNING) << "No token of the vocab is allowed in the state " << state
+                   << " of the grammar.";
+    }
+  }
+}
+
+int32_t TokenGrammar::start_state() const { return dfa_.start; }
+
+int32_t TokenGrammar::advance(int32_t state, int32_t token) const {
+  if (state < 0 || !is_allowed(state, token)) {
+    return -1;
+  }
+  if (is_ending_[token]) {
+    return state;
+  }
+  return dfa_.walk(state, token_bytes_[token]);
+}
+
+bool TokenGrammar::is_accepting(int32_t state) const {
+  return state >= 0 && dfa_.accepting.at(state);
+}
+
+bool TokenGrammar::is_ending_token(int32_t token) const {
+  return token >= 0 && token < vocab_size_ && is_ending_[token];
+}
+
+bool TokenGrammar::is_allowed(int32_t state, int32_t token) const {
+  if (token < 0 || token >= vocab_size_) {
+    return false;
+  }
+  return (mask(state)[token / 32] >> (token % 32)) & 1u;
+}
+
+int32_t TokenGrammar::vocab_size() const { return vocab_size_; }
+
+int32_t TokenGrammar::word_num() const { return word_num_; }
+
+const uint32_t* TokenGrammar::mask(int32_t state) const {
+  CHECK(state >= 0 && state < dfa_.state_num());
+  return masks_.data() + static_cast<size_t>(state) * word_num_;
+}
+
+void TokenGrammar::to_cuda() {
+  if (masks_cu_) {
+    return;
+  }
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  masks_cu_ = std::make_shared<base::Buffer>(masks_.size() * sizeof(uint32_t), alloc_cu);
+  CHECK(masks_cu_->allocate());
+  cudaMemcpy(masks_cu_->ptr(), masks_.data(), masks_.size() * sizeof(uint32_t),
+             cudaMemcpyHostToDevice);
+}
+
+const uint32_t* TokenGrammar::mask_device(int32_t state) const {
+  CHECK(masks_cu_ != nullptr) << "The masks of the grammar are not on the cuda device.";
+  CHECK(state >= 0 && state < dfa_.state_num());
+  return static_cast<const uint32_t*>(masks_cu_->ptr()) + static_cast<size_t>(state) * word_num_;
+}
+}  // namespace sampler
@@ -0,0 +1,378 @@
+#include "server/engine.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <chrono>
+#include "base/metrics.h"
+namespace server {
+static base::Gauge* queue_depth_gauge() {
+  static base::Gauge* gauge = base::MetricsRegistry::global().gauge(
+      "kuiper_request_queue_depth", "The requests waiting for the decode loop.");
+  return gauge;
+}
+
+static base::Counter* rejected_counter() {
+  static base::Counter* counter = base::MetricsRegistry::global().counter(
+      "kuiper_rejected_requests_total", "The requests the full or closed queue refused.");
+  return counter;
+}
+
+RequestQueue::RequestQueue(int32_t max_waiting_num, int32_t max_prompt_len)
+    : max_waiting_num_(max_waiting_num), max_prompt_len_(max_prompt_len) {
+  CHECK_GT(max_waiting_num, 0);
+  CHECK_GT(max_prompt_len, 0);
+}
+
+base::Status RequestQueue::push(GenerationRequest request) {
+  if (request.prompt_tokens.empty() ||
+      static_cast<int32_t>(request.prompt_tokens.size()) > max_prompt_len_) {
+    return base::error::InvalidArgument("The prompt has " +
+                                        std::to_string(request.prompt_tokens.size()) +
+                                        " tokens, at most " + std::to_string(max_prompt_len_) +
+                                        " are allowed.");
+  }
+  if (request.max_new_tokens <= 0) {
+    return base::error::InvalidArgument("The max new tokens should be positive.");
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (is_closed_) {
+      rejected_counter()->add();
+      return base::error::InternalError("The request queue is closed.");
+    }
+    if (static_cast<int32_t>(requests_.size()) >= max_waiting_num_) {
+      rejected_counter()->add();
+      return base::error::InternalError("The request queue is full.");
+    }
+    request.arrival_time = std::chrono::steady_clock::now();
+    requests_.push_back(std::move(request));
+    queue_depth_gauge()->set(static_cast<double>(requests_.size()));
+  }
+  cond_.notify_one();
+  return base::error::Success();
+}
+
+std::vector<GenerationRequest> RequestQueue::pop_all(bool wait, int32_t timeout_ms) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (wait) {
+    cond_.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                   [this] { return is_closed_ || !requests_.empty(); });
+  }
+  std::vector<GenerationRequest> requests;
+  while (!requests_.empty()) {
+    requests.push_back(std::move(requests_.front()));
+    requests_.pop_front();
+  }
+  queue_depth_gauge()->set(0.);
+  return requests;
+}
+
+void RequestQueue::close() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_closed_ = true;
+  }
+  cond_.notify_all();
+}
+
+int32_t RequestQueue::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return static_cast<int32_t>(requests_.size());
+}
+
+static base::Counter* model_swap_counter() {
+  static base::Counter* counter = base::MetricsRegistry::global().counter(
+      "kuiper_model_swaps_total", "The models swapped in while the engine served.");
+  return counter;
+}
+
+Engine::Generation::Generation(std::shared_ptr<const model::Model> model)
+    : model(std::move(model)), scheduler(*this->model) {}
+
+// the caller owns the model, the pointer does not delete it
+Engine::Engine(const model::Model& model, RequestQueue& queue)
+    : Engine(std::shared_ptr<const model::Model>(&model, [](const model::Model*) {}), queue) {}
+
+Engine::Engine(std::shared_ptr<const model::Model> model, RequestQueue& queue) : queue_(queue) {
+  CHECK(model != nullptr);
+  add_generation(std::move(model));
+}
+
+Engine::~Engine() { stop(); }
+
+void Engine::set_prefill_chunk_size(int32_t chunk_size) {
+  CHECK(!thread_.joinable());
+  prefill_chunk_size_ = chunk_size;
+  generations_.back()->scheduler.set_prefill_chunk_size(chunk_size);
+}
+
+void Engine::set_step_token_budget(int32_t token_budget) {
+  CHECK(!thread_.joinable());
+  step_token_budget_ = token_budget;
+  generations_.back()->scheduler.set_step_token_budget(token_budget);
+}
+
+void Engine::set_host_kv_swap(size_t max_byte_size) {
+  CHECK(!thread_.joinable());
+  host_kv_swap_byte_size_ = max_byte_size;
+  generations_.back()->scheduler.set_host_kv_swap(max_byte_size);
+}
+
+void Engine::set_trace_writer(TraceWriter* trace_writer) {
+  CHECK(!thread_.joinable());
+  trace_writer_ = trace_writer;
+}
+
+void Engine::start() {
+  CHECK(!thread_.joinable());
+  is_stopped_ = false;
+  thread_ = std::thread(&Engine::run, this);
+}
+
+void Engine::stop() {
+  is_stopped_ = true;
+  {
+    std::lock_guard<std::mutex> lock(swap_mutex_);
+    if (load_thread_.joinable()) {
+      load_thread_.join();
+    }
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  // a model loaded after the last step is never swapped in, the swap fails
+  std::function<void(const base::Status&)> on_swapped;
+  {
+    std::lock_guard<std::mutex> lock(model_mutex_);
+    if (!loaded_model_) {
+      return;
+    }
+    loaded_model_.reset();
+    on_swapped = std::move(on_swapped_);
+  }
+  is_swapping_ = false;
+  if (on_swapped) {
+    on_swapped(base::error::InternalError("The engine stopped before the model was swapped in."));
+  }
+}
+
+int32_t Engine::running_size() const { return running_size_; }
+
+base::Status Engine::swap_model(ModelLoader loader,
+                                std::function<void(const base::Status&)> on_swapped) {
+  CHECK(loader != nullptr);
+  std::lock_guard<std::mutex> swap_lock(swap_mutex_);
+  if (is_stopped_) {
+    return base::error::InternalError("The engine is stopped.");
+  }
+  bool is_swapping = false;
+  if (!is_swapping_.compare_exchange_strong(is_swapping, true)) {
+    return base::error::InternalError("Another model is being swapped in.");
+  }
+  // the thread of the last swap has handed its model over
+  if (load_thread_.joinable()) {
+    load_thread_.join();
+  }
+  load_thread_ = std::thread([this, loader = std::move(loader),
+                              on_swapped = std::move(on_swapped)]() mutable {
+    std::shared_ptr<model::Model> model;
+    base::Status status = loader(model);
+    if (status && model == nullptr) {
+      status = base::error::InternalError("The model loader returned no model.");
+    }
+    if (!status) {
+      LOG(ERROR) << "The model swap failed: " << status.get_err_msg();
+      is_swapping_ = false;
+      if (on_swapped) {
+        on_swapped(status);
+      }
+      return;
+    }
+    std::lock_guard<std::mutex> lock(model_mutex_);
+    loaded_model_ = std::move(model);
+    on_swapped_ = std::move(on_swapped);
+  });
+  return base::error::Success();
+}
+
+bool Engine::is_swapping() const { return is_swapping_; }
+
+std::shared_ptr<const model::Model> Engine::model() const {
+  std::lock_guard<std::mutex> lock(model_mutex_);
+  return current_model_;
+}
+
+void Engine::add_generation(std::shared_ptr<const model::Model> model) {
+  auto generation = std::make_unique<Generation>(model);
+  Generation* generation_ptr = generation.get();
+  generation->scheduler.set_prefill_chunk_size(prefill_chunk_size_);
+  generation->scheduler.set_step_token_budget(step_token_budget_);
+  generation->scheduler.set_host_kv_swap(host_kv_swap_byte_size_);
+  generation->scheduler.set_token_callback([this, generation_ptr](int32_t seq_id, int32_t token) {
+    on_token(*generation_ptr, seq_id, token);
+  });
+  generations_.push_back(std::move(generation));
+  std::lock_guard<std::mutex> lock(model_mutex_);
+  current_model_ = std::move(model);
+}
+
+void Engine::install_loaded_model() {
+  std::shared_ptr<const model::Model> model;
+  std::function<void(const base::Status&)> on_swapped;
+  {
+    std::lock_guard<std::mutex> lock(model_mutex_);
+    if (!loaded_model_) {
+      return;
+    }
+    model = std::move(loaded_model_);
+    on_swapped = std::move(on_swapped_);
+  }
+  add_generation(std::move(model));
+  model_swap_counter()->add();
+  LOG(INFO) << "A new model is swapped in, " << generations_.size() - 1
+            << " earlier ones drain.";
+  is_swapping_ = false;
+  if (on_swapped) {
+    on_swapped(base::error::Success());
+  }
+}
+
+void Engine::admit(Generation& generation, std::vector<GenerationRequest> requests) {
+  for (GenerationRequest& request : requests) {
+    const int32_t seq_id =
+        generation.scheduler.add_sequence(request.prompt_tokens, request.max_new_tokens);
+    generation.actives.emplace(
+        seq_id, Active{std::move(request), generation.model->stream_decoder(), ""});
+  }
+}
+
+bool Engine::has_unfinished() const {
+  for (const auto& generation : generations_) {
+    if (generation->scheduler.has_unfinished()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Engine::update_running_size() {
+  int32_t running_size = 0;
+  for (const auto& generation : generations_) {
+    running_size += static_cast<int32_t>(generation->actives.size());
+  }
+  running_size_ = running_size;
+}
+
+void Engine::on_token(Generation& generation, int32_t seq_id, int32_t token) {
+  auto iter = generation.actives.find(seq_id);
+  if (iter == generation.actives.end()) {
+    return;
+  }
+  const std::string text = iter->second.decoder.push(token);
+  // the client is gone, the sequence is cancelled after the step
+  if (!text.empty() && !iter->second.request.on_text(text)) {
+    generation.cancelled.push_back(seq_id);
+  }
+}
+
+void Engine::finish(Generation& generation, const model::Sequence& seq,
+                    const std::string& finish_reason) {
+  auto iter = generation.actives.find(seq.seq_id);
+  if (iter == generation.actives.end()) {
+    return;
+  }
+  Active& active = iter->second;
+  const std::string text = active.decoder.finish();
+  if (!text.empty()) {
+    active.request.on_text(text);
+  }
+  GenerationResult result;
+  result.finish_reason = active.finish_reason.empty() ? finish_reason : active.finish_reason;
+  result.prompt_token_num = static_cast<int32_t>(seq.prompt_tokens.size());
+  result.output_token_num = static_cast<int32_t>(seq.output_tokens.size());
+  if (active.request.on_done) {
+    active.request.on_done(result);
+  }
+  if (trace_writer_) {
+    TraceRecord record;
+    record.arrival_us = trace_writer_->arrival_us(active.request.arrival_time);
+    record.max_new_tokens = active.request.max_new_tokens;
+    // a replay gives the cut requests their whole token limit
+    if (result.finish_reason == "stop" || result.finish_reason == "length") {
+      record.output_len = result.output_token_num;
+    }
+    record.sampling = active.request.sampling;
+    record.prompt_tokens = active.request.prompt_tokens;
+    auto status = trace_writer_->write(record);
+    if (!status) {
+      LOG(ERROR) << status.get_err_msg();
+    }
+  }
+  generation.actives.erase(iter);
+}
+
+void Engine::step(Generation& generation) {
+  model::Scheduler& scheduler = generation.scheduler;
+  if (scheduler.has_unfinished()) {
+    auto status = scheduler.step();
+    if (!status) {
+      LOG(ERROR) << "The decode step failed: " << status.get_err_msg();
+      for (auto& [seq_id, active] : generation.actives) {
+        active.finish_reason = "error";
+        scheduler.cancel(seq_id);
+      }
+    }
+  }
+  for (int32_t seq_id : generation.cancelled) {
+    scheduler.cancel(seq_id);
+  }
+  generation.cancelled.clear();
+
+  for (const model::Sequence& seq : scheduler.pop_finished()) {
+    if (seq.is_failed) {
+      finish(generation, seq, "error");
+    } else if (seq.is_cancelled) {
+      finish(generation, seq, "cancelled");
+    } else if (seq.slot < 0) {
+      // the scheduler dropped it before a prefill
+      finish(generation, seq, "error");
+    } else if (generation.model->is_sentence_ending(seq.next_token)) {
+      finish(generation, seq, "stop");
+    } else {
+      finish(generation, seq, "length");
+    }
+  }
+}
+
+void Engine::run() {
+  while (true) {
+    const bool is_stopped = is_stopped_;
+    if (is_stopped) {
+      // the waiting and the running requests end as cancelled, a last step frees their slots
+      for (auto& generation : generations_) {
+        for (const auto& [seq_id, active] : generation->actives) {
+          generation->scheduler.cancel(seq_id);
+        }
+      }
+    } else {
+      install_loaded_model();
+      admit(*generations_.back(), queue_.pop_all(!has_unfinished()));
+    }
+    update_running_size();
+    // the old generations step between the steps of the new one until they drain
+    for (auto& generation : generations_) {
+      step(*generation);
+    }
+    // a drained model is released with its weights and kv cache, unless a handler still
+    // holds it
+    generations_.erase(std::remove_if(generations_.begin(), generations_.end() - 1,
+                                      [](const std::unique_ptr<Generation>& generation) {
+                                        return !generation->scheduler.has_unfinished();
+                                      }),
+                       generations_.end() - 1);
+    update_running_size();
+    if (is_stopped && !has_unfinished()) {
+      return;
+    }
+  }
+}
+}  // namespace server
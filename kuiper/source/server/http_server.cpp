@@ -0,0 +1,600 @@
+#include "server/http_server.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unordered_map>
+namespace server {
+// the limits of a request, a larger one is answered with an error and the connection is closed
+static constexpr size_t kMaxHeaderSize = 64 * 1024;
+static constexpr size_t kMaxBodySize = 16 * 1024 * 1024;
+
+// the output of one response, the responder and the event loop share it
+class HttpChannel {
+ public:
+  HttpChannel(EventLoop* loop, uint64_t conn_id, bool keep_alive)
+      : loop_(loop), conn_id_(conn_id), keep_alive_(keep_alive) {}
+
+  // queues the bytes and wakes the loop, nothing happens once the client is gone
+  bool write(const std::string& bytes, bool is_done);
+
+  bool keep_alive() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return keep_alive_;
+  }
+
+  void set_keep_alive(bool keep_alive) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    keep_alive_ = keep_alive;
+  }
+
+  bool is_gone() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return loop_ == nullptr;
+  }
+
+  // called by the loop when the connection closes or the loop stops
+  void detach() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    loop_ = nullptr;
+    output_.clear();
+  }
+
+  // moves the queued output to the connection, returns whether the response is complete
+  bool take_output(std::string& output) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    output += output_;
+    output_.clear();
+    return is_done_;
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  EventLoop* loop_ = nullptr;
+  uint64_t conn_id_ = 0;
+  bool keep_alive_ = false;
+  bool is_done_ = false;
+  std::string output_;
+};
+
+struct Connection {
+  uint64_t id = 0;
+  int fd = -1;
+  std::string input;
+  std::string output;
+  // a request is in flight, the next one is parsed after its response
+  bool is_busy = false;
+  bool is_writing = false;
+  std::shared_ptr<HttpChannel> channel;
+};
+
+class EventLoop {
+ public:
+  explicit EventLoop(const HttpServer* server) : server_(server) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    CHECK(epoll_fd_ >= 0 && wake_fd_ >= 0) << "Failed to create the event loop.";
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = 0;
+    CHECK_EQ(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event), 0);
+  }
+
+  ~EventLoop() {
+    stop();
+    close(wake_fd_);
+    close(epoll_fd_);
+  }
+
+  void start() { thread_ = std::thread(&EventLoop::run, this); }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      is_stopped_ = true;
+    }
+    wake();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    for (auto& [id, conn] : connections_) {
+      if (conn->channel) {
+        conn->channel->detach();
+      }
+      close(conn->fd);
+    }
+    connections_.clear();
+  }
+
+  // called from the accept thread
+  void add_connection(int fd) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      new_fds_.push_back(fd);
+    }
+    wake();
+  }
+
+  // called by a channel with new output, from any thread
+  void notify(uint64_t conn_id) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      dirty_ids_.push_back(conn_id);
+    }
+    wake();
+  }
+
+ private:
+  void wake() {
+    const uint64_t one = 1;
+    ssize_t size = ::write(wake_fd_, &one, sizeof(one));
+    UNUSED(size);
+  }
+
+  void run();
+
+  void handle_wake();
+
+  void handle_readable(Connection& conn);
+
+  void parse_requests(Connection& conn);
+
+  void flush(Connection& conn);
+
+  void close_connection(uint64_t conn_id);
+
+  void set_writing(Connection& conn, bool is_writing);
+
+  // answers a malformed request and closes the connection after the response
+  void reject(Connection& conn, int32_t status);
+
+ private:
+  const HttpServer* server_ = nullptr;
+  int epoll_fd_ = -1;
+  int wake_fd_ = -1;
+  std::thread thread_;
+  std::mutex mutex_;
+  bool is_stopped_ = false;
+  std::vector<int> new_fds_;
+  std::vector<uint64_t> dirty_ids_;
+  // the id 0 is the wake fd
+  uint64_t next_conn_id_ = 1;
+  std::unordered_map<uint64_t, std::unique_ptr<Connection>> connections_;
+};
+
+bool HttpChannel::write(const std::string& bytes, bool is_done) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (loop_ == nullptr) {
+    return false;
+  }
+  output_ += bytes;
+  is_done_ = is_done_ || is_done;
+  loop_->notify(conn_id_);
+  return true;
+}
+
+void EventLoop::run() {
+  std::vector<epoll_event> events(64);
+  while (true) {
+    const int event_num = epoll_wait(epoll_fd_, events.data(), events.size(), -1);
+    if (event_num < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG(ERROR) << "The epoll wait failed: " << strerror(errno);
+      return;
+    }
+    for (int i = 0; i < event_num; ++i) {
+      const uint64_t id = events[i].data.u64;
+      if (id == 0) {
+        uint64_t count = 0;
+        ssize_t size = read(wake_fd_, &count, sizeof(count));
+        UNUSED(size);
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          if (is_stopped_) {
+            return;
+          }
+        }
+        handle_wake();
+        continue;
+      }
+      auto iter = connections_.find(id);
+      if (iter == connections_.end()) {
+        continue;
+      }
+      Connection& conn = *iter->second;
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        close_connection(id);
+        continue;
+      }
+      if (events[i].events & EPOLLOUT) {
+        flush(conn);
+      }
+      if (connections_.count(id) == 1 && (events[i].events & EPOLLIN)) {
+        handle_readable(conn);
+      }
+    }
+  }
+}
+
+void EventLoop::handle_wake() {
+  std::vector<int> new_fds;
+  std::vector<uint64_t> dirty_ids;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    new_fds.swap(new_fds_);
+    dirty_ids.swap(dirty_ids_);
+  }
+  for (int fd : new_fds) {
+    auto conn = std::make_unique<Connection>();
+    conn->id = next_conn_id_++;
+    conn->fd = fd;
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.u64 = conn->id;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+      close(fd);
+      continue;
+    }
+    connections_.emplace(conn->id, std::move(conn));
+  }
+  for (uint64_t id : dirty_ids) {
+    auto iter = connections_.find(id);
+    if (iter != connections_.end()) {
+      flush(*iter->second);
+    }
+  }
+}
+
+void EventLoop::handle_readable(Connection& conn) {
+  char buffer[16 * 1024];
+  while (true) {
+    const ssize_t size = read(conn.fd, buffer, sizeof(buffer));
+    if (size > 0) {
+      conn.input.append(buffer, size);
+      continue;
+    }
+    if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (size < 0 && errno == EINTR) {
+      continue;
+    }
+    // the client closed its side, a streaming response has nobody to go to
+    close_connection(conn.id);
+    return;
+  }
+  parse_requests(conn);
+}
+
+void EventLoop::parse_requests(Connection& conn) {
+  if (conn.is_busy) {
+    return;
+  }
+  const size_t header_end = conn.input.find("\r\n\r\n");
+  if (header_end == std::string::npos) {
+    if (conn.input.size() > kMaxHeaderSize) {
+      reject(conn, 431);
+    }
+    return;
+  }
+  HttpRequest request;
+  size_t line_end = conn.input.find("\r\n");
+  const std::string request_line = conn.input.substr(0, line_end);
+  const size_t method_end = request_line.find(' ');
+  const size_t path_end = request_line.find(' ', method_end + 1);
+  if (method_end == std::string::npos || path_end == std::string::npos) {
+    reject(conn, 400);
+    return;
+  }
+  request.method = request_line.substr(0, method_end);
+  request.path = request_line.substr(method_end + 1, path_end - method_end - 1);
+  const std::string version = request_line.substr(path_end + 1);
+
+  while (line_end < header_end) {
+    const size_t next_end = conn.input.find("\r\n", line_end + 2);
+    const std::string line = conn.input.substr(line_end + 2, next_end - line_end - 2);
+    line_end = next_end;
+    const size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    std::string name = line.substr(0, colon);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    const size_t value_begin = line.find_first_not_of(' ', colon + 1);
+    request.headers[name] = value_begin == std::string::npos ? "" : line.substr(value_begin);
+  }
+
+  size_t body_size = 0;
+  auto length_iter = request.headers.find("content-length");
+  if (length_iter != request.headers.end()) {
+    body_size = std::strtoull(length_iter->second.c_str(), nullptr, 10);
+  }
+  if (body_size > kMaxBodySize) {
+    reject(conn, 413);
+    return;
+  }
+  if (conn.input.size() < header_end + 4 + body_size) {
+    return;
+  }
+  request.body = conn.input.substr(header_end + 4, body_size);
+  conn.input.erase(0, header_end + 4 + body_size);
+
+  std::string connection;
+  auto connection_iter = request.headers.find("connection");
+  if (connection_iter != request.headers.end()) {
+    connection = connection_iter->second;
+    std::transform(connection.begin(), connection.end(), connection.begin(), ::tolower);
+  }
+  const bool keep_alive =
+      version == "HTTP/1.1" ? connection != "close" : connection == "keep-alive";
+  conn.is_busy = true;
+  conn.channel = std::make_shared<HttpChannel>(this, conn.id, keep_alive);
+  server_->dispatch(request, std::make_shared<HttpResponder>(conn.channel));
+}
+
+void EventLoop::reject(Connection& conn, int32_t status) {
+  conn.is_busy = true;
+  conn.input.clear();
+  conn.channel = std::make_shared<HttpChannel>(this, conn.id, false);
+  HttpResponder(conn.channel).reply(status, "text/plain", http_status_text(status));
+}
+
+void EventLoop::flush(Connection& conn) {
+  if (!conn.channel) {
+    return;
+  }
+  const bool is_done = conn.channel->take_output(conn.output);
+  while (!conn.output.empty()) {
+    const ssize_t size = send(conn.fd, conn.output.data(), conn.output.size(), MSG_NOSIGNAL);
+    if (size > 0) {
+      conn.output.erase(0, size);
+      continue;
+    }
+    if (size < 0 && errno == EINTR) {
+      continue;
+    }
+    if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      set_writing(conn, true);
+      return;
+    }
+    close_connection(conn.id);
+    return;
+  }
+  set_writing(conn, false);
+  if (!is_done) {
+    return;
+  }
+  if (!conn.channel->keep_alive()) {
+    close_connection(conn.id);
+    return;
+  }
+  // the next request of the connection may already be in the input
+  conn.channel.reset();
+  conn.is_busy = false;
+  parse_requests(conn);
+}
+
+void EventLoop::set_writing(Connection& conn, bool is_writing) {
+  if (conn.is_writing == is_writing) {
+    return;
+  }
+  conn.is_writing = is_writing;
+  epoll_event event{};
+  event.events = EPOLLIN | EPOLLRDHUP | (is_writing ? EPOLLOUT : 0);
+  event.data.u64 = conn.id;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, conn.fd, &event);
+}
+
+void EventLoop::close_connection(uint64_t conn_id) {
+  auto iter = connections_.find(conn_id);
+  if (iter == connections_.end()) {
+    return;
+  }
+  if (iter->second->channel) {
+    iter->second->channel->detach();
+  }
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, iter->second->fd, nullptr);
+  close(iter->second->fd);
+  connections_.erase(iter);
+}
+
+HttpResponder::HttpResponder(std::shared_ptr<HttpChannel> channel)
+    : channel_(std::move(channel)) {
+  CHECK(channel_ != nullptr);
+}
+
+HttpResponder::~HttpResponder() {
+  // a request which got no answer does not hang its connection
+  if (!is_replied_) {
+    reply(500, "text/plain", http_status_text(500));
+  } else {
+    finish();
+  }
+}
+
+void HttpResponder::reply(int32_t status, const std::string& content_type,
+                          const std::string& body,
+                          const std::map<std::string, std::string>& headers) {
+  CHECK(!is_replied_) << "The request is answered twice.";
+  is_replied_ = true;
+  std::string response = "HTTP/1.1 " + std::to_string(status) + " " + http_status_text(status);
+  response += "\r\nContent-Type: " + content_type;
+  response += "\r\nContent-Length: " + std::to_string(body.size());
+  response += channel_->keep_alive() ? "\r\nConnection: keep-alive" : "\r\nConnection: close";
+  for (const auto& [name, value] : headers) {
+    response += "\r\n" + name + ": " + value;
+  }
+  response += "\r\n\r\n" + body;
+  channel_->write(response, true);
+}
+
+void HttpResponder::start_events() {
+  CHECK(!is_replied_) << "The request is answered twice.";
+  is_replied_ = true;
+  // the end of the stream is the end of the connection
+  channel_->set_keep_alive(false);
+  channel_->write(
+      "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+      "Connection: close\r\n\r\n",
+      false);
+}
+
+bool HttpResponder::send_event(const std::string& data) {
+  CHECK(is_replied_) << "The event stream is not started.";
+  // every line of the data is a data field of the same event
+  std::string event;
+  size_t begin = 0;
+  while (true) {
+    const size_t end = data.find('\n', begin);
+    event += "data: " + data.substr(begin, end - begin) + "\n";
+    if (end == std::string::npos) {
+      break;
+    }
+    begin = end + 1;
+  }
+  event += "\n";
+  return channel_->write(event, false);
+}
+
+void HttpResponder::finish() { channel_->write("", true); }
+
+bool HttpResponder::is_gone() const { return channel_->is_gone(); }
+
+HttpServer::HttpServer(int32_t io_thread_num) : io_thread_num_(std::max(io_thread_num, 1)) {}
+
+HttpServer::~HttpServer() { stop(); }
+
+void HttpServer::route(const std::string& method, const std::string& path,
+                       HttpHandler handler) {
+  CHECK(!is_running_) << "The routes should be set before the server is started.";
+  routes_[{method, path}] = std::move(handler);
+}
+
+void HttpServer::dispatch(const HttpRequest& request,
+                          std::shared_ptr<HttpResponder> responder) const {
+  std::string path = request.path.substr(0, request.path.find('?'));
+  auto iter = routes_.find({request.method, path});
+  if (iter == routes_.end()) {
+    responder->reply(404, "text/plain", http_status_text(404));
+    return;
+  }
+  iter->second(request, std::move(responder));
+}
+
+base::Status HttpServer::start(const std::string& host, int32_t port) {
+  CHECK(!is_running_);
+  listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd_ < 0) {
+    return base::error::InternalError("Failed to create the socket of the server.");
+  }
+  const int enable = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(static_cast<uint16_t>(port));
+  if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+    close(listen_fd_);
+    return base::error::InvalidArgument("The host " + host + " is not a valid ipv4 address.");
+  }
+  if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      listen(listen_fd_, SOMAXCONN) != 0) {
+    close(listen_fd_);
+    return base::error::InternalError("Failed to listen on " + host + ":" +
+                                      std::to_string(port) + ", " + strerror(errno) + ".");
+  }
+  socklen_t addr_size = sizeof(addr);
+  getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &addr_size);
+  port_ = ntohs(addr.sin_port);
+
+  stop_fd_ = eventfd(0, EFD_CLOEXEC);
+  for (int32_t i = 0; i < io_thread_num_; ++i) {
+    loops_.push_back(std::make_unique<EventLoop>(this));
+    loops_.back()->start();
+  }
+  is_running_ = true;
+  accept_thread_ = std::thread(&HttpServer::accept_connections, this);
+  return base::error::Success();
+}
+
+void HttpServer::accept_connections() {
+  size_t next_loop = 0;
+  pollfd fds[2] = {{listen_fd_, POLLIN, 0}, {stop_fd_, POLLIN, 0}};
+  while (true) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG(ERROR) << "The poll of the server failed: " << strerror(errno);
+      return;
+    }
+    if (fds[1].revents & POLLIN) {
+      return;
+    }
+    if (!(fds[0].revents & POLLIN)) {
+      continue;
+    }
+    const int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+    const int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    loops_.at(next_loop)->add_connection(fd);
+    next_loop = (next_loop + 1) % loops_.size();
+  }
+}
+
+void HttpServer::stop() {
+  if (!is_running_) {
+    return;
+  }
+  is_running_ = false;
+  const uint64_t one = 1;
+  ssize_t size = write(stop_fd_, &one, sizeof(one));
+  UNUSED(size);
+  if (accept_thread_.joinable()) {
+    accept_thread_.join();
+  }
+  loops_.clear();
+  close(listen_fd_);
+  close(stop_fd_);
+  listen_fd_ = -1;
+  stop_fd_ = -1;
+}
+
+int32_t HttpServer::port() const { return port_; }
+
+const char* http_status_text(int32_t status) {
+  switch (status) {
+    case 200:
+      return "OK";
+    case 400:
+      return "Bad Request";
+    case 404:
+      return "Not Found";
+    case 413:
+      return "Payload Too Large";
+    case 429:
+      return "Too Many Requests";
+    case 431:
+      return "Request Header Fields Too Large";
+    case 500:
+      return "Internal Server Error";
+    case 503:
+      return "Service Unavailable";
+    default:
+      return "Unknown";
+  }
+}
+}  // namespace server
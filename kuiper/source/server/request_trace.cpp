@@ -0,0 +1,167 @@
+#include "server/request_trace.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <cstring>
+namespace server {
+// the fixed width part of a record
+struct TraceRecordHeader {
+  int64_t arrival_us = 0;
+  int32_t max_new_tokens = 0;
+  int32_t output_len = -1;
+  float temperature = 1.f;
+  int32_t top_k = 0;
+  float top_p = 1.f;
+  int32_t prompt_len = 0;
+  uint64_t seed = 0;
+};
+
+static void append_varint(uint32_t value, std::vector<uint8_t>& bytes) {
+  while (value >= 0x80) {
+    bytes.push_back(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  bytes.push_back(static_cast<uint8_t>(value));
+}
+
+TraceWriter::~TraceWriter() { close(); }
+
+base::Status TraceWriter::open(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  CHECK(file_ == nullptr) << "The trace writer is open already.";
+  file_ = std::fopen(path.c_str(), "wb");
+  if (!file_) {
+    return base::error::PathNotValid("Failed to open the trace " + path);
+  }
+  const uint32_t head[2] = {kRequestTraceMagic, kRequestTraceVersion};
+  if (std::fwrite(head, sizeof(head), 1, file_) != 1) {
+    std::fclose(file_);
+    file_ = nullptr;
+    return base::error::InternalError("Failed to write the trace " + path);
+  }
+  start_time_ = std::chrono::steady_clock::now();
+  return base::error::Success();
+}
+
+bool TraceWriter::is_open() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return file_ != nullptr;
+}
+
+int64_t TraceWriter::arrival_us(std::chrono::steady_clock::time_point time) const {
+  return std::chrono::duration_cast<std::chrono::microseconds>(time - start_time_).count();
+}
+
+base::Status TraceWriter::write(const TraceRecord& record) {
+  TraceRecordHeader header;
+  header.arrival_us = record.arrival_us;
+  header.max_new_tokens = record.max_new_tokens;
+  header.output_len = record.output_len;
+  header.temperature = record.sampling.temperature;
+  header.top_k = record.sampling.top_k;
+  header.top_p = record.sampling.top_p;
+  header.seed = record.sampling.seed;
+  header.prompt_len = static_cast<int32_t>(record.prompt_tokens.size());
+  std::vector<uint8_t> bytes(sizeof(TraceRecordHeader));
+  std::memcpy(bytes.data(), &header, sizeof(TraceRecordHeader));
+  for (int32_t token : record.prompt_tokens) {
+    append_varint(static_cast<uint32_t>(token), bytes);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!file_) {
+    return base::error::InternalError("The trace writer is not open.");
+  }
+  if (std::fwrite(bytes.data(), bytes.size(), 1, file_) != 1 || std::fflush(file_) != 0) {
+    return base::error::InternalError("Failed to write a record of the trace.");
+  }
+  return base::error::Success();
+}
+
+base::Status TraceWriter::close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!file_) {
+    return base::error::Success();
+  }
+  const bool is_closed = std::fclose(file_) == 0;
+  file_ = nullptr;
+  if (!is_closed) {
+    return base::error::InternalError("Failed to close the trace.");
+  }
+  return base::error::Success();
+}
+
+base::Status read_trace(const std::string& path, std::vector<TraceRecord>& records) {
+  records.clear();
+  FILE* file = std::fopen(path.c_str(), "rb");
+  if (!file) {
+    return base::error::PathNotValid("Failed to open the trace " + path);
+  }
+  std::vector<uint8_t> bytes;
+  uint8_t chunk[1 << 16];
+  size_t read_size = 0;
+  while ((read_size = std::fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    bytes.insert(bytes.end(), chunk, chunk + read_size);
+  }
+  std::fclose(file);
+
+  uint32_t head[2] = {0, 0};
+  if (bytes.size() < sizeof(head)) {
+    return base::error::ModelParseError("The trace " + path + " has no header.");
+  }
+  std::memcpy(head, bytes.data(), sizeof(head));
+  if (head[0] != kRequestTraceMagic || head[1] != kRequestTraceVersion) {
+    return base::error::ModelParseError("The file " + path + " is not a request trace.");
+  }
+  size_t offset = sizeof(head);
+  while (offset < bytes.size()) {
+    // a record cut by a crash in the middle of a write is dropped with the rest
+    if (bytes.size() - offset < sizeof(TraceRecordHeader)) {
+      LOG(WARNING) << "The trace " << path << " ends in the middle of a record.";
+      break;
+    }
+    TraceRecordHeader header;
+    std::memcpy(&header, bytes.data() + offset, sizeof(TraceRecordHeader));
+    offset += sizeof(TraceRecordHeader);
+    if (header.prompt_len < 0) {
+      return base::error::ModelParseError("The trace " + path + " has a broken record.");
+    }
+    TraceRecord record;
+    record.arrival_us = header.arrival_us;
+    record.max_new_tokens = header.max_new_tokens;
+    record.output_len = header.output_len;
+    record.sampling.temperature = header.temperature;
+    record.sampling.top_k = header.top_k;
+    record.sampling.top_p = header.top_p;
+    record.sampling.seed = header.seed;
+    record.prompt_tokens.reserve(header.prompt_len);
+    bool is_cut = false;
+    for (int32_t i = 0; i < header.prompt_len && !is_cut; ++i) {
+      uint32_t value = 0;
+      int32_t shift = 0;
+      while (true) {
+        if (offset >= bytes.size() || shift > 28) {
+          is_cut = true;
+          break;
+        }
+        const uint8_t byte = bytes.at(offset++);
+        value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+          break;
+        }
+        shift += 7;
+      }
+      record.prompt_tokens.push_back(static_cast<int32_t>(value));
+    }
+    if (is_cut) {
+      LOG(WARNING) << "The trace " << path << " ends in the middle of a record.";
+      break;
+    }
+    records.push_back(std::move(record));
+  }
+  std::stable_sort(records.begin(), records.end(),
+                   [](const TraceRecord& a, const TraceRecord& b) {
+                     return a.arrival_us < b.arrival_us;
+                   });
+  return base::error::Success();
+}
+}  // namespace server
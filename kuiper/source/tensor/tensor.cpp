@@ -19,12 +19,17 @@ static size_t data_type_size(base::DataType data_type) {
     case base::DataType::kDataTypeFp32: {
       return 4;
     }
-    case base::DataType::kDataTypeInt8: {
+    case base::DataType::kDataTypeInt8:
+    case base::DataType::kDataTypeFp8E4M3: {
       return 1;
     }
     case base::DataType::kDataTypeInt32: {
       return 4;
     }
+    case base::DataType::kDataTypeFp16:
+    case base::DataType::kDataTypeBf16: {
+      return 2;
+    }
     default: {
       LOG(FATAL) << "Unknown data type size for " << int(data_type);
       return 0;
@@ -109,7 +114,7 @@ void Tensor::to_cuda(cudaStream_t stream) {
   } else if (device_type == base::DeviceType::kDeviceCPU) {
     size_t byte_size = this->byte_size();
     auto cu_alloc = base::CUDADeviceAllocatorFactory::get_instance();
-    auto cu_buffer = std::make_shared<base::Buffer>(byte_size, cu_alloc);
+    auto cu_buffer = std::make_shared<base::Buffer>(byte_size, cu_alloc, nullptr, false, stream);
     cu_alloc->memcpy(buffer_->ptr(), cu_buffer->ptr(), byte_size, base::MemcpyKind::kMemcpyCPU2CUDA,
                      stream);
     this->buffer_ = cu_buffer;
@@ -171,7 +176,8 @@ bool Tensor::assign(std::shared_ptr<base::Buffer> buffer) {
   return true;
 }
 
-bool Tensor::allocate(std::shared_ptr<base::DeviceAllocator> allocator, bool need_realloc) {
+bool Tensor::allocate(std::shared_ptr<base::DeviceAllocator> allocator, bool need_realloc,
+                      void* stream) {
   if (!allocator) {
     LOG(ERROR) << "The allocator parameter in the allocate function is null "
                   "pointer!";
@@ -190,7 +196,7 @@ bool Tensor::allocate(std::shared_ptr<base::DeviceAllocator> allocator, bool nee
     }
   }
 
-  buffer_ = std::make_shared<base::Buffer>(byte_size, allocator, nullptr);
+  buffer_ = std::make_shared<base::Buffer>(byte_size, allocator, nullptr, false, stream);
   if (!buffer_->ptr()) {
     LOG(ERROR) << "The memory allocated is a null pointer!";
     return false;
@@ -200,6 +206,14 @@ bool Tensor::allocate(std::shared_ptr<base::DeviceAllocator> allocator, bool nee
 
 const std::vector<int32_t>& Tensor::dims() const { return this->dims_; }
 
+void Tensor::set_stream(void* stream) const {
+  if (buffer_) {
+    buffer_->set_stream(stream);
+  }
+}
+
+void* Tensor::stream() const { return buffer_ ? buffer_->stream() : nullptr; }
+
 void Tensor::set_device_type(base::DeviceType device_type) const {
   if (buffer_) {
     buffer_->set_device_type(device_type);
@@ -243,7 +257,8 @@ Tensor Tensor::clone() const {
   size_t byte_size = this->byte_size();
 
   auto allocator = buffer_->allocator();
-  new_tensor.buffer_ = std::make_shared<base::Buffer>(byte_size, allocator);
+  new_tensor.buffer_ =
+      std::make_shared<base::Buffer>(byte_size, allocator, nullptr, false, buffer_->stream());
   new_tensor.buffer_->copy_from(buffer_.get());
   return new_tensor;
 }
@@ -276,4 +291,18 @@ void Tensor::init_buffer(std::shared_ptr<base::DeviceAllocator> alloc, base::Dat
     allocate(alloc, true);
   }
 }
-}  // namespace tensor
\ No newline at end of file
+void Tensor::bind(const TensorView& view) {
+  data_type_ = view.data_type();
+  dims_.resize(view.dims_size());
+  for (int32_t i = 0; i < view.dims_size(); ++i) {
+    dims_[i] = view.get_dim(i);
+  }
+  size_ = view.size();
+  if (buffer_ && buffer_->is_external()) {
+    buffer_->rebind(view.ptr<void>(), view.byte_size());
+  } else {
+    buffer_ = std::make_shared<base::Buffer>(view.byte_size(), nullptr, view.ptr<void>(), true);
+  }
+  buffer_->set_device_type(view.device_type());
+}
+}  // namespace tensor
@@ -0,0 +1,85 @@
+#include "tensor/tensor_view.h"
+#include "tensor/tensor.h"
+namespace tensor {
+TensorView::TensorView(const Tensor& tensor)
+    : ptr_(const_cast<void*>(tensor.ptr<void>())),
+      data_type_(tensor.data_type()),
+      device_type_(tensor.device_type()),
+      dims_size_(tensor.dims_size()) {
+  CHECK_LE(dims_size_, kMaxDims);
+  for (int32_t i = 0; i < dims_size_; ++i) {
+    dims_[i] = tensor.get_dim(i);
+  }
+}
+
+TensorView::TensorView(base::DataType data_type, base::DeviceType device_type, void* ptr,
+                       std::initializer_list<int32_t> dims)
+    : ptr_(ptr),
+      data_type_(data_type),
+      device_type_(device_type),
+      dims_size_(static_cast<int32_t>(dims.size())) {
+  CHECK_LE(dims_size_, kMaxDims);
+  int32_t i = 0;
+  for (int32_t dim : dims) {
+    dims_[i++] = dim;
+  }
+}
+
+bool TensorView::is_empty() const { return ptr_ == nullptr || size() == 0; }
+
+int32_t TensorView::dims_size() const { return dims_size_; }
+
+int32_t TensorView::get_dim(int32_t idx) const {
+  CHECK_GE(idx, 0);
+  CHECK_LT(idx, dims_size_);
+  return dims_[idx];
+}
+
+int64_t TensorView::stride(int32_t idx) const {
+  CHECK_GE(idx, 0);
+  CHECK_LT(idx, dims_size_);
+  int64_t stride = 1;
+  for (int32_t i = idx + 1; i < dims_size_; ++i) {
+    stride *= dims_[i];
+  }
+  return stride;
+}
+
+size_t TensorView::size() const {
+  if (dims_size_ == 0) {
+    return 0;
+  }
+  size_t size = 1;
+  for (int32_t i = 0; i < dims_size_; ++i) {
+    size *= dims_[i];
+  }
+  return size;
+}
+
+size_t TensorView::byte_size() const { return size() * base::DataTypeSize(data_type_); }
+
+base::DataType TensorView::data_type() const { return data_type_; }
+
+base::DeviceType TensorView::device_type() const { return device_type_; }
+
+TensorView TensorView::row(int32_t row) const {
+  CHECK_GT(dims_size_, 1);
+  CHECK(row >= 0 && row < dims_[0]);
+  TensorView view = *this;
+  view.ptr_ = static_cast<uint8_t*>(ptr_) + row * stride(0) * base::DataTypeSize(data_type_);
+  view.dims_size_ = dims_size_ - 1;
+  for (int32_t i = 0; i < view.dims_size_; ++i) {
+    view.dims_[i] = dims_[i + 1];
+  }
+  return view;
+}
+
+TensorView TensorView::rows(int32_t row, int32_t row_num) const {
+  CHECK_GT(dims_size_, 0);
+  CHECK(row >= 0 && row_num > 0 && row + row_num <= dims_[0]);
+  TensorView view = *this;
+  view.ptr_ = static_cast<uint8_t*>(ptr_) + row * stride(0) * base::DataTypeSize(data_type_);
+  view.dims_[0] = row_num;
+  return view;
+}
+}  // namespace tensor
@@ -0,0 +1,127 @@
+#include "tensor/upload_queue.h"
+#include <glog/logging.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstring>
+#include <map>
+#include <thread>
+namespace tensor {
+UploadQueue::UploadQueue(cudaStream_t stream, int32_t thread_num, size_t staging_byte_size,
+                         int32_t staging_num)
+    : stream_(stream), thread_num_(thread_num), staging_byte_size_(staging_byte_size) {
+  CHECK_GT(thread_num, 0);
+  CHECK_GT(staging_byte_size, 0);
+  CHECK_GT(staging_num, 1) << "The staging ring needs two buffers to overlap the copies.";
+  auto alloc_host = base::CUDAHostAllocatorFactory::get_instance();
+  for (int32_t i = 0; i < staging_num; ++i) {
+    auto buffer = std::make_shared<base::Buffer>(staging_byte_size, alloc_host);
+    CHECK(buffer->ptr() != nullptr) << "Failed to allocate the pinned staging buffers.";
+    staging_buffers_.push_back(buffer);
+    cudaEvent_t event;
+    CHECK(cudaEventCreateWithFlags(&event, cudaEventDisableTiming) == cudaSuccess);
+    staging_events_.push_back(event);
+  }
+}
+
+UploadQueue::~UploadQueue() {
+  for (cudaEvent_t event : staging_events_) {
+    cudaEventDestroy(event);
+  }
+}
+
+void UploadQueue::set_device_mapping(DeviceMapping device_mapping) {
+  device_mapping_ = std::move(device_mapping);
+}
+
+void UploadQueue::push(Tensor& tensor) {
+  if (tensor.is_empty() || tensor.device_type() != base::DeviceType::kDeviceCPU) {
+    return;
+  }
+  void* device_ptr =
+      device_mapping_ ? device_mapping_(tensor.ptr<void>(), tensor.byte_size()) : nullptr;
+  if (device_ptr) {
+    // a buffer of its own, the host tensors which share the mapped one stay on the host
+    Tensor mapped(tensor.data_type(), tensor.dims(), false, nullptr, device_ptr);
+    mapped.set_device_type(base::DeviceType::kDeviceCUDA);
+    tensor = mapped;
+    return;
+  }
+  tensors_.push_back(&tensor);
+}
+
+void UploadQueue::prefetch(int32_t thread_idx) const {
+  const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  // the tensors are dealt round robin, so the threads stay close to the copy order
+  for (size_t i = thread_idx; i < tensors_.size(); i += thread_num_) {
+    const uint8_t* begin = tensors_.at(i)->ptr<uint8_t>();
+    const size_t byte_size = tensors_.at(i)->byte_size();
+    uintptr_t aligned = reinterpret_cast<uintptr_t>(begin) / page_size * page_size;
+    madvise(reinterpret_cast<void*>(aligned),
+            byte_size + (reinterpret_cast<uintptr_t>(begin) - aligned), MADV_WILLNEED);
+    volatile uint8_t sink = 0;
+    for (size_t offset = 0; offset < byte_size; offset += page_size) {
+      sink += begin[offset];
+    }
+  }
+}
+
+void UploadQueue::flush() {
+  if (tensors_.empty()) {
+    return;
+  }
+  std::vector<std::thread> workers;
+  for (int32_t i = 0; i < thread_num_; ++i) {
+    workers.emplace_back(&UploadQueue::prefetch, this, i);
+  }
+
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  std::vector<std::shared_ptr<base::Buffer>> device_buffers;
+  std::vector<bool> event_recorded(staging_buffers_.size(), false);
+  size_t chunk_idx = 0;
+  // the tensors which read the same host weights, like a classifier tied to the embedding
+  // table, are copied once and share the device buffer
+  std::map<std::pair<const void*, size_t>, size_t> uploaded;
+  for (Tensor* tensor : tensors_) {
+    const size_t byte_size = tensor->byte_size();
+    auto [it, is_new] =
+        uploaded.emplace(std::make_pair(tensor->ptr<void>(), byte_size), device_buffers.size());
+    if (!is_new) {
+      device_buffers.push_back(device_buffers.at(it->second));
+      continue;
+    }
+    auto device_buffer = std::make_shared<base::Buffer>(byte_size, alloc_cu);
+    CHECK(device_buffer->ptr() != nullptr) << "Failed to allocate the device weight buffer.";
+    device_buffer->set_tag(base::MemoryTag::kMemoryTagWeight);
+    const uint8_t* src_ptr = tensor->ptr<uint8_t>();
+    uint8_t* dst_ptr = static_cast<uint8_t*>(device_buffer->ptr());
+    for (size_t offset = 0; offset < byte_size; offset += staging_byte_size_) {
+      const size_t slot = chunk_idx++ % staging_buffers_.size();
+      const size_t chunk_size = std::min(staging_byte_size_, byte_size - offset);
+      // the staging buffer is reused once its previous copy has finished
+      if (event_recorded.at(slot)) {
+        cudaEventSynchronize(staging_events_.at(slot));
+      }
+      void* staging_ptr = staging_buffers_.at(slot)->ptr();
+      std::memcpy(staging_ptr, src_ptr + offset, chunk_size);
+      cudaMemcpyAsync(dst_ptr + offset, staging_ptr, chunk_size, cudaMemcpyHostToDevice,
+                      stream_);
+      cudaEventRecord(staging_events_.at(slot), stream_);
+      event_recorded.at(slot) = true;
+    }
+    device_buffers.push_back(device_buffer);
+  }
+  cudaStreamSynchronize(stream_);
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  for (size_t i = 0; i < tensors_.size(); ++i) {
+    Tensor* tensor = tensors_.at(i);
+    device_buffers.at(i)->set_device_type(base::DeviceType::kDeviceCUDA);
+    const std::vector<int32_t> dims = tensor->dims();
+    tensor->reset(tensor->data_type(), dims);
+    CHECK(tensor->assign(device_buffers.at(i)));
+  }
+  tensors_.clear();
+}
+}  // namespace tensor
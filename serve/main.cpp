@@ -0,0 +1,275 @@
+#include <base/base.h>
+#include <base/metrics.h>
+#include <glog/logging.h>
+#include <unistd.h>
+#include <algorithm>
+#include <csignal>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include "model/llama3.h"
+#include "nlohmann/json.hpp"
+#include "server/engine.h"
+#include "server/http_server.h"
+using json = nlohmann::json;
+
+static volatile std::sig_atomic_t is_interrupted = 0;
+
+static void on_signal(int) { is_interrupted = 1; }
+
+struct Options {
+  std::string checkpoint_path;
+  std::string tokenizer_path;
+  std::string host = "0.0.0.0";
+  int32_t port = 8080;
+  int32_t max_batch_size = 8;
+  int32_t max_waiting_num = 64;
+  int32_t io_thread_num = 2;
+  int32_t default_max_tokens = 128;
+  // a long prompt is prefilled in chunks between the decode steps of the running requests
+  int32_t prefill_chunk_size = 512;
+  int32_t step_token_budget = 1024;
+  // the requests preempted for the kv cache keep their kv in this much host memory
+  int32_t kv_swap_mb = 1024;
+  // the kv blocks of earlier prompts kept for the requests which start with the same tokens
+  int32_t prefix_cache_block_num = 0;
+  // the requests are recorded into a trace for the replay tool
+  std::string trace_path;
+};
+
+static bool parse_options(int argc, char* argv[], Options& options) {
+  if (argc < 3) {
+    return false;
+  }
+  options.checkpoint_path = argv[1];
+  options.tokenizer_path = argv[2];
+  for (int i = 3; i + 1 < argc; i += 2) {
+    const std::string name = argv[i];
+    const char* value = argv[i + 1];
+    if (name == "--host") {
+      options.host = value;
+    } else if (name == "--port") {
+      options.port = std::atoi(value);
+    } else if (name == "--batch") {
+      options.max_batch_size = std::atoi(value);
+    } else if (name == "--queue") {
+      options.max_waiting_num = std::atoi(value);
+    } else if (name == "--io-threads") {
+      options.io_thread_num = std::atoi(value);
+    } else if (name == "--max-tokens") {
+      options.default_max_tokens = std::atoi(value);
+    } else if (name == "--prefill-chunk") {
+      options.prefill_chunk_size = std::atoi(value);
+    } else if (name == "--step-tokens") {
+      options.step_token_budget = std::atoi(value);
+    } else if (name == "--kv-swap-mb") {
+      options.kv_swap_mb = std::atoi(value);
+    } else if (name == "--prefix-cache-blocks") {
+      options.prefix_cache_block_num = std::atoi(value);
+    } else if (name == "--trace") {
+      options.trace_path = value;
+    } else {
+      return false;
+    }
+  }
+  return (argc - 3) % 2 == 0;
+}
+
+static json usage_json(const server::GenerationResult& result) {
+  return {{"prompt_tokens", result.prompt_token_num},
+          {"completion_tokens", result.output_token_num},
+          {"total_tokens", result.prompt_token_num + result.output_token_num}};
+}
+
+// POST /v1/completions with {"prompt": "...", "max_tokens": n, "stream": true|false}, a stream
+// sends one server-sent event per piece of text and a last one with the finish reason
+static void handle_completion(server::Engine& engine, server::RequestQueue& queue,
+                              int32_t default_max_tokens, const server::HttpRequest& request,
+                              std::shared_ptr<server::HttpResponder> responder) {
+  json body = json::parse(request.body, nullptr, false);
+  if (body.is_discarded() || !body.is_object() || !body.contains("prompt") ||
+      !body["prompt"].is_string()) {
+    responder->reply(400, "application/json",
+                     json{{"error", "The body should be a json with a prompt string."}}.dump());
+    return;
+  }
+  const bool is_stream = body.value("stream", false);
+  server::GenerationRequest generation;
+  // the model of the new requests, it stays alive while the prompt is encoded across a swap
+  generation.prompt_tokens = engine.model()->encode(body["prompt"].get<std::string>());
+  generation.max_new_tokens = body.value("max_tokens", default_max_tokens);
+  generation.sampling.temperature = body.value("temperature", 1.f);
+  generation.sampling.top_p = body.value("top_p", 1.f);
+  generation.sampling.top_k = body.value("top_k", 0);
+  generation.sampling.seed = body.value("seed", static_cast<uint64_t>(0));
+
+  if (is_stream) {
+    generation.on_text = [responder](const std::string& text) {
+      return responder->send_event(json{{"choices", {{{"text", text}, {"index", 0}}}}}.dump());
+    };
+    generation.on_done = [responder](const server::GenerationResult& result) {
+      responder->send_event(json{{"choices", {{{"text", ""}, {"index", 0},
+                                               {"finish_reason", result.finish_reason}}}},
+                                 {"usage", usage_json(result)}}
+                                .dump());
+      responder->send_event("[DONE]");
+      responder->finish();
+    };
+  } else {
+    auto text = std::make_shared<std::string>();
+    generation.on_text = [text, responder](const std::string& piece) {
+      *text += piece;
+      return !responder->is_gone();
+    };
+    generation.on_done = [text, responder](const server::GenerationResult& result) {
+      const json response = {
+          {"choices", {{{"text", *text}, {"index", 0}, {"finish_reason", result.finish_reason}}}},
+          {"usage", usage_json(result)}};
+      responder->reply(result.finish_reason == "error" ? 500 : 200, "application/json",
+                       response.dump());
+    };
+  }
+
+  // the headers go out before the engine can write the first event
+  if (is_stream) {
+    responder->start_events();
+  }
+  auto status = queue.push(std::move(generation));
+  if (!status) {
+    const json error = {{"error", status.get_err_msg()}};
+    if (is_stream) {
+      responder->send_event(error.dump());
+      responder->finish();
+    } else {
+      // an overloaded server asks the client to come back
+      const bool is_full = status.get_err_code() == base::StatusCode::kInternalError;
+      responder->reply(is_full ? 503 : 400, "application/json", error.dump(),
+                       is_full ? std::map<std::string, std::string>{{"Retry-After", "1"}}
+                               : std::map<std::string, std::string>{});
+    }
+  }
+}
+
+static base::Status load_model(const Options& options, const std::string& checkpoint_path,
+                               std::shared_ptr<model::Model>& model) {
+  const bool is_bpe = options.tokenizer_path.size() > 5 &&
+                      options.tokenizer_path.substr(options.tokenizer_path.size() - 5) == ".json";
+  auto llama = std::make_shared<model::LLama2Model>(
+      is_bpe ? base::TokenizerType::kEncodeBpe : base::TokenizerType::kEncodeSpe,
+      options.tokenizer_path, checkpoint_path, false);
+  llama->set_max_batch_size(options.max_batch_size);
+  auto status = llama->init(base::DeviceType::kDeviceCUDA);
+  if (!status) {
+    return status;
+  }
+  if (options.prefix_cache_block_num > 0) {
+    llama->set_prefix_cache(options.prefix_cache_block_num);
+  }
+  model = std::move(llama);
+  return base::error::Success();
+}
+
+// POST /admin/reload with {"checkpoint": "..."}, the checkpoint of the start when it is left
+// out. The new weights load while the current ones serve, the request is answered when the new
+// model takes the new requests or the load failed
+static void handle_reload(server::Engine& engine, const Options& options,
+                          const server::HttpRequest& request,
+                          std::shared_ptr<server::HttpResponder> responder) {
+  json body = request.body.empty() ? json::object() : json::parse(request.body, nullptr, false);
+  if (body.is_discarded() || !body.is_object()) {
+    responder->reply(400, "application/json",
+                     json{{"error", "The body should be a json object."}}.dump());
+    return;
+  }
+  const std::string checkpoint_path = body.value("checkpoint", options.checkpoint_path);
+  auto status = engine.swap_model(
+      [options, checkpoint_path](std::shared_ptr<model::Model>& model) {
+        return load_model(options, checkpoint_path, model);
+      },
+      [responder, checkpoint_path](const base::Status& status) {
+        if (status) {
+          responder->reply(200, "application/json",
+                           json{{"checkpoint", checkpoint_path}}.dump());
+        } else {
+          responder->reply(500, "application/json", json{{"error", status.get_err_msg()}}.dump());
+        }
+      });
+  if (!status) {
+    responder->reply(409, "application/json", json{{"error", status.get_err_msg()}}.dump());
+  }
+}
+
+int main(int argc, char* argv[]) {
+  Options options;
+  if (!parse_options(argc, argv, options)) {
+    LOG(INFO) << "Usage: ./llama_server checkpoint_path tokenizer_path [--host 0.0.0.0] "
+                 "[--port 8080] [--batch 8] [--queue 64] [--io-threads 2] [--max-tokens 128] "
+                 "[--prefill-chunk 512] [--step-tokens 1024] [--kv-swap-mb 1024] "
+                 "[--prefix-cache-blocks 0] [--trace requests.trace]";
+    return -1;
+  }
+  std::shared_ptr<model::Model> model;
+  auto init_status = load_model(options, options.checkpoint_path, model);
+  if (!init_status) {
+    LOG(FATAL) << "The model init failed, the error code is: " << init_status.get_err_msg();
+  }
+
+  server::RequestQueue queue(options.max_waiting_num, model->seq_len() - 1);
+  // the trace outlives the engine which writes to it
+  server::TraceWriter trace_writer;
+  // the engine owns the model, a reload releases it once its requests are done
+  server::Engine engine(std::move(model), queue);
+  engine.set_prefill_chunk_size(options.prefill_chunk_size);
+  engine.set_step_token_budget(options.step_token_budget);
+  engine.set_host_kv_swap(static_cast<size_t>(std::max(options.kv_swap_mb, 0)) << 20);
+  if (!options.trace_path.empty()) {
+    auto status = trace_writer.open(options.trace_path);
+    if (!status) {
+      LOG(FATAL) << status.get_err_msg();
+    }
+    engine.set_trace_writer(&trace_writer);
+  }
+  server::HttpServer http_server(options.io_thread_num);
+  http_server.route("GET", "/health",
+                    [&engine, &queue](const server::HttpRequest&,
+                                      std::shared_ptr<server::HttpResponder> responder) {
+                      const json health = {{"running", engine.running_size()},
+                                           {"waiting", queue.size()}};
+                      responder->reply(200, "application/json", health.dump());
+                    });
+  // the counters of the scheduler, the kv cache, the allocators and the queue for prometheus
+  http_server.route("GET", "/metrics",
+                    [](const server::HttpRequest&,
+                       std::shared_ptr<server::HttpResponder> responder) {
+                      responder->reply(200, "text/plain; version=0.0.4",
+                                       base::MetricsRegistry::global().prometheus_text());
+                    });
+  http_server.route("POST", "/v1/completions",
+                    [&](const server::HttpRequest& request,
+                        std::shared_ptr<server::HttpResponder> responder) {
+                      handle_completion(engine, queue, options.default_max_tokens, request,
+                                        std::move(responder));
+                    });
+  http_server.route("POST", "/admin/reload",
+                    [&](const server::HttpRequest& request,
+                        std::shared_ptr<server::HttpResponder> responder) {
+                      handle_reload(engine, options, request, std::move(responder));
+                    });
+
+  engine.start();
+  auto status = http_server.start(options.host, options.port);
+  if (!status) {
+    LOG(FATAL) << status.get_err_msg();
+  }
+  LOG(INFO) << "Serving on " << options.host << ":" << http_server.port();
+  std::signal(SIGINT, on_signal);
+  std::signal(SIGTERM, on_signal);
+  while (!is_interrupted) {
+    pause();
+  }
+  // the new requests fail while the running ones end as cancelled
+  queue.close();
+  http_server.stop();
+  engine.stop();
+  return 0;
+}
@@ -0,0 +1,122 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include "../utils/toy_model.h"
+#include "model/kv_cache.h"
+
+namespace {
+// every operator new of the test binary, the kv cache calls of a decode step are checked to
+// make none
+std::atomic<uint64_t> heap_allocation_num{0};
+}  // namespace
+
+void* operator new(std::size_t size) {
+  heap_allocation_num.fetch_add(1, std::memory_order_relaxed);
+  if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+
+namespace {
+uint64_t cpu_allocation_num() {
+  uint64_t allocation_num = 0;
+  for (const auto& [device_id, stats] : base::CPUDeviceAllocatorFactory::get_instance()->stats()) {
+    allocation_num += stats.allocation_num;
+  }
+  return allocation_num;
+}
+}  // namespace
+
+TEST(test_decode_batch, steps_allocate_nothing) {
+  test::ToyModelFiles files("decode_batch", test::toy_model_config());
+  auto model = files.create_model();
+  model->set_max_batch_size(2);
+  ASSERT_TRUE(model->init(base::DeviceType::kDeviceCPU));
+  const std::vector<std::vector<int32_t>> prompts = {{1, 5, 9, 12, 7}, {1, 25, 3}};
+  const int32_t max_new_tokens = 8;
+  std::vector<std::vector<int32_t>> references;
+  for (const std::vector<int32_t>& prompt : prompts) {
+    references.push_back(test::greedy_reference(*model, prompt, max_new_tokens));
+  }
+
+  tensor::Tensor pos_tensor(base::DataType::kDataTypeInt32, 1, true,
+                            base::CPUDeviceAllocatorFactory::get_instance());
+  pos_tensor.index<int32_t>(0) = 0;
+  std::vector<int32_t> slots;
+  std::vector<int32_t> positions;
+  std::vector<int32_t> next;
+  std::vector<std::vector<int32_t>> outputs(prompts.size());
+  for (int32_t i = 0; i < prompts.size(); ++i) {
+    int32_t token = -1;
+    ASSERT_TRUE(model->prefill(model->embedding(prompts.at(i)).input_embeddings, pos_tensor,
+                               token, i));
+    slots.push_back(i);
+    positions.push_back(static_cast<int32_t>(prompts.at(i).size()));
+    next.push_back(token);
+    outputs.at(i).push_back(token);
+  }
+
+  // the first step plans the batch activations and binds the rows
+  uint64_t allocation_num = 0;
+  for (int32_t step = 1; step < max_new_tokens; ++step) {
+    if (step == 2) {
+      allocation_num = cpu_allocation_num();
+    }
+    const std::vector<int32_t> tokens = next;
+    ASSERT_TRUE(model->decode_batch(model->embedding(tokens).input_embeddings, slots, positions,
+                                    next));
+    for (int32_t i = 0; i < slots.size(); ++i) {
+      positions.at(i) += 1;
+      outputs.at(i).push_back(next.at(i));
+    }
+  }
+  ASSERT_EQ(cpu_allocation_num(), allocation_num);
+
+  // a decode of one sequence through the input buffers allocates nothing either
+  std::vector<int32_t> token = {next.at(0)};
+  for (int32_t step = 0; step < 4; ++step) {
+    pos_tensor.index<int32_t>(0) = positions.at(0) + step;
+    int32_t out = -1;
+    ASSERT_TRUE(model->predict(model->embedding(token).input_embeddings, pos_tensor, false, out));
+    token.at(0) = out;
+  }
+  ASSERT_EQ(cpu_allocation_num(), allocation_num);
+
+  for (int32_t i = 0; i < prompts.size(); ++i) {
+    ASSERT_EQ(outputs.at(i), references.at(i));
+  }
+}
+
+TEST(test_decode_batch, kv_cache_calls_allocate_nothing) {
+  const int32_t layer_num = 2;
+  const int32_t kv_dim = 8;
+  const int32_t head_size = 4;
+  std::vector<float> key(kv_dim, 1.f);
+  tensor::Tensor key_tensor(base::DataType::kDataTypeFp32, kv_dim, false, nullptr, key.data());
+  key_tensor.set_device_type(base::DeviceType::kDeviceCPU);
+  // the plain, the head major and the int8 caches which a decode step writes on the cpu
+  for (const auto& [data_type, is_head_major] :
+       {std::make_pair(base::DataType::kDataTypeFp32, false),
+        std::make_pair(base::DataType::kDataTypeFp32, true),
+        std::make_pair(base::DataType::kDataTypeInt8, false)}) {
+    model::PagedKVCache kv_cache(base::DeviceType::kDeviceCPU, data_type, layer_num, kv_dim, 4,
+                                 8, 2, 32, head_size, is_head_major);
+    ASSERT_TRUE(kv_cache.reserve(1, 8));
+    const uint64_t heap_begin = heap_allocation_num.load();
+    for (int32_t pos = 0; pos < 8; ++pos) {
+      for (int32_t layer_idx = 0; layer_idx < layer_num; ++layer_idx) {
+        kv_cache.write(layer_idx, 1, pos, key_tensor, key_tensor);
+        ASSERT_FALSE(kv_cache.block_table(1).is_empty());
+      }
+    }
+    ASSERT_EQ(heap_allocation_num.load(), heap_begin);
+  }
+}
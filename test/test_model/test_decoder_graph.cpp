@@ -0,0 +1,111 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <vector>
+#include "model/decoder_graph.h"
+
+namespace {
+model::TransformerConfig small_config(int32_t layer_num) {
+  model::TransformerConfig config;
+  config.layer_num_ = layer_num;
+  return config;
+}
+
+std::vector<model::GraphOp> graph_ops(const model::DecoderGraph& graph) {
+  std::vector<model::GraphOp> ops;
+  for (const model::GraphNode& node : graph.nodes()) {
+    ops.push_back(node.op);
+  }
+  return ops;
+}
+}  // namespace
+
+TEST(test_decoder_graph, unfused) {
+  using model::GraphOp;
+  auto graph = model::DecoderGraph::build(small_config(2), 2, true);
+  // 18 ops per layer with the three bias ops, the final norm and the classifier
+  ASSERT_EQ(graph.nodes().size(), 2 * 18 + 2);
+  EXPECT_EQ(graph.count(GraphOp::kMoveToHost), 0);
+  EXPECT_EQ(graph.count(GraphOp::kQueryBias), 2);
+  EXPECT_EQ(graph.nodes().back().op, GraphOp::kClassifier);
+  EXPECT_EQ(graph.nodes().back().layer_idx, 2);
+
+  // without a fusion only the bias ops are folded into the matmuls
+  graph.fuse(model::FusionOptions{});
+  EXPECT_EQ(graph.nodes().size(), 2 * 15 + 2);
+  EXPECT_EQ(graph.count(GraphOp::kQueryBias), 0);
+  EXPECT_EQ(graph.count(GraphOp::kQuery), 2);
+}
+
+TEST(test_decoder_graph, fused) {
+  using model::GraphOp;
+  auto graph = model::DecoderGraph::build(small_config(2), 2, false);
+  model::FusionOptions options;
+  options.pack_qkv = true;
+  options.gate_up_swiglu = true;
+  options.add_rmsnorm = true;
+  options.rope_kv_write = true;
+  graph.fuse(options);
+
+  const std::vector<GraphOp> layer0 = {
+      GraphOp::kAttentionNorm, GraphOp::kQKV, GraphOp::kRopeKVWrite, GraphOp::kAttention,
+      GraphOp::kAttentionOutput, GraphOp::kAttentionResidualNorm, GraphOp::kGateUpSwiGLU,
+      GraphOp::kDown, GraphOp::kFFNResidualNorm};
+  // the next layer is normalized by the residual add of the first one
+  const std::vector<GraphOp> layer1 = {
+      GraphOp::kQKV, GraphOp::kRopeKVWrite, GraphOp::kAttention, GraphOp::kAttentionOutput,
+      GraphOp::kAttentionResidualNorm, GraphOp::kGateUpSwiGLU, GraphOp::kDown,
+      GraphOp::kFFNResidual};
+  std::vector<GraphOp> expected = layer0;
+  expected.insert(expected.end(), layer1.begin(), layer1.end());
+  expected.push_back(GraphOp::kFinalNorm);
+  expected.push_back(GraphOp::kClassifier);
+  EXPECT_EQ(graph_ops(graph), expected);
+  EXPECT_EQ(graph.nodes().at(8).layer_idx, 0);
+}
+
+TEST(test_decoder_graph, split_layers) {
+  using model::GraphOp;
+  // the second layer runs on the cpu, whose kv cache does not fuse the rope
+  auto graph = model::DecoderGraph::build(small_config(2), 1, false);
+  model::FusionOptions options;
+  options.pack_qkv = true;
+  options.gate_up_swiglu = true;
+  options.add_rmsnorm = true;
+  options.rope_kv_write = true;
+  graph.fuse(options);
+
+  EXPECT_EQ(graph.count(GraphOp::kMoveToHost), 1);
+  EXPECT_EQ(graph.count(GraphOp::kRopeKVWrite), 1);
+  EXPECT_EQ(graph.count(GraphOp::kRope), 1);
+  EXPECT_EQ(graph.count(GraphOp::kKVWrite), 1);
+  // the residual add does not fuse with the norm of a layer on the other device
+  EXPECT_EQ(graph.count(GraphOp::kFFNResidualNorm), 0);
+  EXPECT_EQ(graph.count(GraphOp::kAttentionNorm), 2);
+  for (const model::GraphNode& node : graph.nodes()) {
+    EXPECT_EQ(node.is_host, node.layer_idx >= 1);
+  }
+}
+
+TEST(test_decoder_graph, tensor_parallel) {
+  using model::GraphOp;
+  auto graph = model::DecoderGraph::build(small_config(2), 2, false, true);
+  model::FusionOptions options;
+  options.pack_qkv = true;
+  options.gate_up_swiglu = true;
+  options.add_rmsnorm = true;
+  options.rope_kv_write = true;
+  graph.fuse(options);
+
+  // the partial outputs are summed before the residual adds, which still fuse with the norms
+  EXPECT_EQ(graph.count(GraphOp::kAttentionAllReduce), 2);
+  EXPECT_EQ(graph.count(GraphOp::kFFNAllReduce), 2);
+  EXPECT_EQ(graph.count(GraphOp::kAttentionResidualNorm), 2);
+  EXPECT_EQ(graph.count(GraphOp::kFFNResidualNorm), 1);
+  const std::vector<GraphOp> ops = graph_ops(graph);
+  const std::vector<GraphOp> layer0 = {
+      GraphOp::kAttentionNorm, GraphOp::kQKV, GraphOp::kRopeKVWrite, GraphOp::kAttention,
+      GraphOp::kAttentionOutput, GraphOp::kAttentionAllReduce, GraphOp::kAttentionResidualNorm,
+      GraphOp::kGateUpSwiGLU, GraphOp::kDown, GraphOp::kFFNAllReduce, GraphOp::kFFNResidualNorm};
+  EXPECT_TRUE(std::equal(layer0.begin(), layer0.end(), ops.begin()));
+}
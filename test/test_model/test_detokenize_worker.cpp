@@ -0,0 +1,50 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+#include "model/detokenize_worker.h"
+
+namespace {
+// every token is one letter, the token 0 is the first byte of a character which the token 1
+// completes
+model::StreamDecoder fake_decoder() {
+  return model::StreamDecoder([](int32_t token, bool is_first) -> std::string {
+    if (token == 0) {
+      return "\xC3";
+    } else if (token == 1) {
+      return "\xA9";
+    }
+    return std::string(1, static_cast<char>('a' + token));
+  });
+}
+}  // namespace
+
+TEST(test_detokenize_worker, stream) {
+  std::vector<std::string> pieces;
+  model::DetokenizeWorker worker(fake_decoder(),
+                                 [&pieces](const std::string& piece) { pieces.push_back(piece); });
+  worker.push({2, 3});
+  worker.push({4});
+  worker.push({});
+  worker.push({5, 6});
+  worker.finish();
+  std::string text;
+  for (const std::string& piece : pieces) {
+    text += piece;
+  }
+  EXPECT_EQ(text, "cdefg");
+  EXPECT_EQ(worker.text(), "cdefg");
+}
+
+TEST(test_detokenize_worker, split_character) {
+  std::string text;
+  model::DetokenizeWorker worker(fake_decoder(), [&text](const std::string& piece) {
+    // the half of the character is never written
+    EXPECT_EQ(piece.find("\xEF\xBF\xBD"), std::string::npos);
+    text += piece;
+  });
+  worker.push({2, 0});
+  worker.push({1, 3});
+  worker.finish();
+  EXPECT_EQ(text, "c\xC3\xA9" "d");
+}
@@ -0,0 +1,57 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <vector>
+#include "../utils/toy_model.h"
+
+TEST(test_device_decode, window_runs_past_the_sequence) {
+  const model::ModelConfig config = test::toy_model_config();
+  test::ToyModelFiles files("device_decode", config);
+  auto device_model = files.create_model();
+  auto host_model = files.create_model();
+  device_model->set_attention_window(4, 16, 8);
+  host_model->set_attention_window(4, 16, 8);
+  ASSERT_TRUE(device_model->init(base::DeviceType::kDeviceCUDA));
+  ASSERT_TRUE(host_model->init(base::DeviceType::kDeviceCUDA));
+
+  const std::vector<int32_t> prompt = {1, 5, 9, 12, 7};
+  const auto prompt_len = static_cast<int32_t>(prompt.size());
+  tensor::Tensor pos_tensor(base::DataType::kDataTypeInt32, 1, true,
+                            base::CPUDeviceAllocatorFactory::get_instance());
+  pos_tensor.index<int32_t>(0) = 0;
+  int32_t first = -1;
+  int32_t host_next = -1;
+  ASSERT_TRUE(device_model->prefill(device_model->embedding(prompt).input_embeddings, pos_tensor,
+                                    first));
+  ASSERT_TRUE(host_model->prefill(host_model->embedding(prompt).input_embeddings, pos_tensor,
+                                  host_next));
+  ASSERT_EQ(first, host_next);
+
+  // the reference steps one token at a time from the host, well past the sequence length
+  const int32_t step_num = 3 * config.seq_len;
+  std::vector<int32_t> reference;
+  for (int32_t pos = prompt_len; pos < prompt_len + step_num; ++pos) {
+    const int32_t token = host_next;
+    pos_tensor.index<int32_t>(0) = pos;
+    ASSERT_TRUE(host_model->predict(host_model->embedding({token}).input_embeddings, pos_tensor,
+                                    false, host_next));
+    reference.push_back(host_next);
+  }
+
+  // two launches are queued ahead of every wait, the tokens of all of them wrap around the
+  // buffer of the sampled tokens
+  ASSERT_TRUE(device_model->begin_device_decode(first, prompt_len));
+  ASSERT_FALSE(device_model->launch_device_decode(config.seq_len + 1));
+  const int32_t launch_step_num = config.seq_len / 2 - 5;
+  std::vector<int32_t> tokens;
+  int32_t launched_num = 0;
+  while (launched_num < step_num || device_model->pending_device_decode_num() > 0) {
+    while (launched_num < step_num && device_model->pending_device_decode_num() < 2) {
+      const int32_t num = std::min(launch_step_num, step_num - launched_num);
+      ASSERT_TRUE(device_model->launch_device_decode(num));
+      launched_num += num;
+    }
+    ASSERT_TRUE(device_model->wait_device_decode(tokens));
+  }
+  ASSERT_EQ(tokens, reference);
+}
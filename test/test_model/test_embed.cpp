@@ -0,0 +1,74 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <vector>
+#include "../utils/toy_model.h"
+
+namespace {
+std::vector<float> embed(const model::Model& model, const std::vector<int32_t>& prompt,
+                         model::EmbeddingPooling pooling, int32_t slot) {
+  tensor::Tensor pos_tensor(base::DataType::kDataTypeInt32, 1, true,
+                            base::CPUDeviceAllocatorFactory::get_instance());
+  pos_tensor.index<int32_t>(0) = 0;
+  std::vector<float> output;
+  CHECK(model.embed(model.embedding(prompt).input_embeddings, pos_tensor, pooling, output, slot));
+  model.release_kv_cache(slot);
+  return output;
+}
+
+// the host mean of the [num_tokens, dim] rows
+std::vector<float> mean_rows(const std::vector<float>& rows, int32_t dim) {
+  const int32_t num_tokens = static_cast<int32_t>(rows.size()) / dim;
+  std::vector<float> mean(dim, 0.f);
+  for (int32_t n = 0; n < num_tokens; ++n) {
+    for (int32_t i = 0; i < dim; ++i) {
+      mean.at(i) += rows.at(n * dim + i) / static_cast<float>(num_tokens);
+    }
+  }
+  return mean;
+}
+
+void expect_near(const std::vector<float>& output, const std::vector<float>& expected) {
+  ASSERT_EQ(output.size(), expected.size());
+  for (int32_t i = 0; i < expected.size(); ++i) {
+    ASSERT_NEAR(output.at(i), expected.at(i), 1e-5f) << "element " << i;
+  }
+}
+}  // namespace
+
+TEST(test_embed, pooling) {
+  test::ToyModelFiles files("embed_pooling", test::toy_model_config());
+  auto model = files.create_model();
+  ASSERT_TRUE(model->init(base::DeviceType::kDeviceCPU));
+  const int32_t dim = test::toy_model_config().dim;
+  const std::vector<int32_t> prompt = {1, 5, 9, 12, 7, 30};
+
+  // every position normalized by the final rmsnorm
+  const std::vector<float> rows = embed(*model, prompt, model::EmbeddingPooling::kNone, 0);
+  ASSERT_EQ(rows.size(), prompt.size() * dim);
+  // the last token pooling normalizes only the last row, which matches the one of all rows
+  const std::vector<float> last = embed(*model, prompt, model::EmbeddingPooling::kLast, 0);
+  expect_near(last, std::vector<float>(rows.end() - dim, rows.end()));
+  const std::vector<float> mean = embed(*model, prompt, model::EmbeddingPooling::kMean, 0);
+  expect_near(mean, mean_rows(rows, dim));
+}
+
+TEST(test_embed, batch_pools_every_prompt_on_its_own) {
+  test::ToyModelFiles files("embed_batch", test::toy_model_config());
+  auto model = files.create_model();
+  ASSERT_TRUE(model->init(base::DeviceType::kDeviceCPU));
+  const std::vector<std::vector<int32_t>> prompts = {{1, 5, 9, 12, 7, 30}, {1, 25, 3}};
+
+  for (model::EmbeddingPooling pooling :
+       {model::EmbeddingPooling::kNone, model::EmbeddingPooling::kMean,
+        model::EmbeddingPooling::kLast}) {
+    std::vector<std::vector<float>> outputs;
+    ASSERT_TRUE(model->embed_batch(prompts, pooling, outputs));
+    ASSERT_EQ(outputs.size(), prompts.size());
+    for (int32_t i = 0; i < prompts.size(); ++i) {
+      expect_near(outputs.at(i), embed(*model, prompts.at(i), pooling, 0));
+    }
+  }
+  // an empty prompt fails the batch
+  std::vector<std::vector<float>> outputs;
+  ASSERT_FALSE(model->embed_batch({{1, 5}, {}}, model::EmbeddingPooling::kMean, outputs));
+}
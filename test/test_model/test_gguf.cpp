@@ -0,0 +1,233 @@
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "model/gguf.h"
+
+namespace {
+class GgufWriter {
+ public:
+  template <typename T>
+  void put(T value) {
+    const auto* bytes = reinterpret_cast<const uint8_t*>(&value);
+    data_.insert(data_.end(), bytes, bytes + sizeof(T));
+  }
+
+  void put_string(const std::string& value) {
+    put<uint64_t>(value.size());
+    data_.insert(data_.end(), value.begin(), value.end());
+  }
+
+  void put_u32_kv(const std::string& key, uint32_t value) {
+    put_string(key);
+    put<uint32_t>(4);
+    put<uint32_t>(value);
+  }
+
+  std::vector<uint8_t>& data() { return data_; }
+
+ private:
+  std::vector<uint8_t> data_;
+};
+
+struct TestTensor {
+  std::string name;
+  model::GgufType type;
+  std::vector<uint64_t> ne;
+  std::vector<uint8_t> data;
+};
+
+// the gguf file of a llama model with the tensors, as llama.cpp writes it
+std::string write_gguf(const std::vector<TestTensor>& tensors) {
+  GgufWriter writer;
+  writer.put<uint32_t>(model::kGgufMagic);
+  writer.put<uint32_t>(3);
+  writer.put<uint64_t>(tensors.size());
+  writer.put<uint64_t>(8);
+  writer.put_string("general.architecture");
+  writer.put<uint32_t>(8);
+  writer.put_string("llama");
+  writer.put_u32_kv("llama.embedding_length", 32);
+  writer.put_u32_kv("llama.feed_forward_length", 64);
+  writer.put_u32_kv("llama.block_count", 1);
+  writer.put_u32_kv("llama.attention.head_count", 4);
+  writer.put_u32_kv("llama.context_length", 1 << 20);
+  // an array is skipped
+  writer.put_string("tokenizer.ggml.tokens");
+  writer.put<uint32_t>(9);
+  writer.put<uint32_t>(8);
+  writer.put<uint64_t>(2);
+  writer.put_string("<s>");
+  writer.put_string("</s>");
+  writer.put_string("llama.rope.freq_base");
+  writer.put<uint32_t>(6);
+  writer.put<float>(500000.f);
+
+  uint64_t offset = 0;
+  for (const TestTensor& tensor : tensors) {
+    writer.put_string(tensor.name);
+    writer.put<uint32_t>(tensor.ne.size());
+    for (uint64_t ne : tensor.ne) {
+      writer.put<uint64_t>(ne);
+    }
+    writer.put<uint32_t>(static_cast<uint32_t>(tensor.type));
+    writer.put<uint64_t>(offset);
+    offset += (tensor.data.size() + 31) / 32 * 32;
+  }
+  std::vector<uint8_t>& data = writer.data();
+  data.resize((data.size() + 31) / 32 * 32, 0);
+  for (const TestTensor& tensor : tensors) {
+    data.insert(data.end(), tensor.data.begin(), tensor.data.end());
+    data.resize((data.size() + 31) / 32 * 32, 0);
+  }
+  const std::string path = "./tmp_test_model.gguf";
+  FILE* file = fopen(path.data(), "wb");
+  fwrite(data.data(), 1, data.size(), file);
+  fclose(file);
+  return path;
+}
+
+std::vector<uint8_t> f32_data(const std::vector<float>& values) {
+  std::vector<uint8_t> data(values.size() * sizeof(float));
+  memcpy(data.data(), values.data(), data.size());
+  return data;
+}
+
+void load(const std::string& path, model::RawModelDataGguf& raw_data,
+          model::TensorDirectory& directory, model::GgufModelInfo& info) {
+  raw_data.fd = open(path.data(), O_RDONLY);
+  ASSERT_NE(raw_data.fd, -1);
+  FILE* file = fopen(path.data(), "rb");
+  fseek(file, 0, SEEK_END);
+  raw_data.file_size = ftell(file);
+  fclose(file);
+  ASSERT_TRUE(raw_data.map(model::WeightLoadOptions{}));
+  ASSERT_TRUE(model::load_gguf_model(raw_data, directory, info));
+}
+
+const uint8_t* tensor_data(const model::RawModelDataGguf& raw_data, const model::TensorInfo* info) {
+  if (info->data != nullptr) {
+    return static_cast<const uint8_t*>(info->data);
+  }
+  return static_cast<const uint8_t*>(raw_data.data) + info->offset;
+}
+}  // namespace
+
+TEST(test_gguf, load_q8_0) {
+  std::vector<float> embedding(4 * 32);
+  for (size_t i = 0; i < embedding.size(); ++i) {
+    embedding[i] = std::sin(float(i)) * 0.25f;
+  }
+  // two rows of one q8_0 block each, the scale 0.5 in fp16 is 0x3800
+  std::vector<uint8_t> query;
+  for (int32_t row = 0; row < 2; ++row) {
+    query.push_back(0x00);
+    query.push_back(0x38);
+    for (int32_t i = 0; i < 32; ++i) {
+      query.push_back(static_cast<uint8_t>(static_cast<int8_t>(i - 16 + row)));
+    }
+  }
+  const std::string path =
+      write_gguf({{"token_embd.weight", model::GgufType::kF32, {32, 4}, f32_data(embedding)},
+                  {"blk.0.attn_q.weight", model::GgufType::kQ8_0, {32, 2}, query},
+                  {"rope_freqs.weight", model::GgufType::kF32, {16}, f32_data(embedding)}});
+
+  model::RawModelDataGguf raw_data;
+  model::TensorDirectory directory;
+  model::GgufModelInfo info;
+  load(path, raw_data, directory, info);
+  ASSERT_EQ(info.config.dim, 32);
+  ASSERT_EQ(info.config.kv_head_num, 4);
+  ASSERT_EQ(info.config.vocab_size, 4);
+  ASSERT_EQ(info.config.seq_len, model::kGgufMaxSeqLen);
+  ASSERT_EQ(info.weight_data_type, base::DataType::kDataTypeInt8);
+  ASSERT_FALSE(info.is_int4);
+  ASSERT_EQ(info.group_size, 32);
+  ASSERT_FLOAT_EQ(info.rope_theta, 500000.f);
+  ASSERT_FALSE(info.is_rope_rotate_half);
+  ASSERT_EQ(directory.find("rope_freqs.weight"), nullptr);
+
+  // the fp32 embedding is viewed in place
+  const model::TensorInfo* embedding_info = directory.find("tok_embeddings.weight");
+  ASSERT_NE(embedding_info, nullptr);
+  ASSERT_EQ(embedding_info->data, nullptr);
+  ASSERT_EQ(embedding_info->dims, (std::vector<int32_t>{4, 32}));
+  const auto* embedding_data =
+      reinterpret_cast<const float*>(tensor_data(raw_data, embedding_info));
+  for (size_t i = 0; i < embedding.size(); ++i) {
+    ASSERT_EQ(embedding_data[i], embedding[i]);
+  }
+
+  // the q8_0 blocks become the int8 weights followed by the fp32 scales
+  const model::TensorInfo* query_info = directory.find("layers.0.attention.wq.weight");
+  ASSERT_NE(query_info, nullptr);
+  ASSERT_EQ(query_info->data_type, base::DataType::kDataTypeInt8);
+  ASSERT_EQ(query_info->dims, (std::vector<int32_t>{2, 32}));
+  const uint8_t* query_data = tensor_data(raw_data, query_info);
+  for (int32_t row = 0; row < 2; ++row) {
+    for (int32_t i = 0; i < 32; ++i) {
+      ASSERT_EQ(static_cast<int8_t>(query_data[row * 32 + i]), i - 16 + row);
+    }
+    float scale = 0.f;
+    memcpy(&scale, query_data + 64 + row * sizeof(float), sizeof(float));
+    ASSERT_EQ(scale, 0.5f);
+  }
+
+  // the shared classifier of a quant model is a quant copy of the embedding
+  const model::TensorInfo* cls_info = directory.find("output.weight");
+  ASSERT_NE(cls_info, nullptr);
+  const uint8_t* cls_data = tensor_data(raw_data, cls_info);
+  for (int32_t row = 0; row < 4; ++row) {
+    float scale = 0.f;
+    memcpy(&scale, cls_data + 4 * 32 + row * sizeof(float), sizeof(float));
+    for (int32_t i = 0; i < 32; ++i) {
+      const float value = static_cast<int8_t>(cls_data[row * 32 + i]) * scale;
+      ASSERT_NEAR(value, embedding[row * 32 + i], scale * 0.5f + 1e-6f);
+    }
+  }
+  remove(path.data());
+}
+
+TEST(test_gguf, load_q4_0) {
+  std::vector<float> embedding(2 * 32, 0.5f);
+  // one q4_0 block, the scale 2 in fp16 is 0x4000, the byte j holds the values j and j + 16
+  std::vector<uint8_t> query = {0x00, 0x40};
+  for (int32_t j = 0; j < 16; ++j) {
+    query.push_back(static_cast<uint8_t>(j | ((15 - j) << 4)));
+  }
+  const std::string path =
+      write_gguf({{"token_embd.weight", model::GgufType::kF32, {32, 2}, f32_data(embedding)},
+                  {"blk.0.attn_q.weight", model::GgufType::kQ4_0, {32, 1}, query},
+                  {"output.weight", model::GgufType::kF32, {32, 2}, f32_data(embedding)}});
+
+  model::RawModelDataGguf raw_data;
+  model::TensorDirectory directory;
+  model::GgufModelInfo info;
+  load(path, raw_data, directory, info);
+  ASSERT_TRUE(info.is_int4);
+  ASSERT_EQ(info.config.vocab_size, -2);
+
+  // the adjacent values share a byte, the even one in the low nibble
+  const model::TensorInfo* query_info = directory.find("layers.0.attention.wq.weight");
+  ASSERT_NE(query_info, nullptr);
+  const uint8_t* query_data = tensor_data(raw_data, query_info);
+  for (int32_t i = 0; i < 32; ++i) {
+    const int32_t expected = i < 16 ? i : 15 - (i - 16);
+    const uint8_t byte = query_data[i / 2];
+    ASSERT_EQ((i % 2 == 0) ? (byte & 0xf) : (byte >> 4), expected);
+  }
+  uint16_t scale = 0;
+  memcpy(&scale, query_data + 16, sizeof(uint16_t));
+  ASSERT_EQ(scale, 0x4000);
+
+  // the fp32 classifier is requantized into int4 groups
+  const model::TensorInfo* cls_info = directory.find("output.weight");
+  ASSERT_NE(cls_info, nullptr);
+  ASSERT_NE(cls_info->data, nullptr);
+  ASSERT_EQ(cls_info->data_type, base::DataType::kDataTypeInt8);
+  remove(path.data());
+}
@@ -0,0 +1,184 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <cstring>
+#include <vector>
+#include "base/half.h"
+#include "model/int4_import.h"
+#include "op/matmul.h"
+
+namespace {
+constexpr int32_t kRows = 16;
+constexpr int32_t kCols = 64;
+constexpr int32_t kGroupSize = 32;
+
+// the value of a weight of kRows x kCols in the repacked layout with zero points
+float repacked_value(const std::vector<uint8_t>& packed, int32_t row, int32_t col) {
+  const size_t weight_num = kRows * kCols;
+  const size_t group_num = weight_num / kGroupSize;
+  const uint8_t byte = packed.at((row * kCols + col) / 2);
+  const int32_t q = col % 2 == 0 ? byte & 0xf : byte >> 4;
+  const size_t group = (row * kCols + col) / kGroupSize;
+  const size_t scale_begin = (weight_num / 2 + 15) / 16 * 16;
+  const size_t zero_point_begin = scale_begin + (group_num * sizeof(uint16_t) + 15) / 16 * 16;
+  uint16_t half_scale = 0;
+  memcpy(&half_scale, packed.data() + scale_begin + group * sizeof(uint16_t), sizeof(uint16_t));
+  return static_cast<float>(q - packed.at(zero_point_begin + group)) *
+         base::half_to_float(half_scale);
+}
+
+struct Checkpoint {
+  std::vector<int32_t> q;
+  std::vector<int32_t> zero_points;
+  std::vector<uint16_t> scales;
+  std::vector<int32_t> g_idx;
+
+  int32_t group(int32_t col) const { return g_idx.empty() ? col / kGroupSize : g_idx.at(col); }
+
+  float value(int32_t row, int32_t col) const {
+    const int32_t g = group(col);
+    return static_cast<float>(q.at(row * kCols + col) - zero_points.at(g * kRows + row)) *
+           base::half_to_float(scales.at(g * kRows + row));
+  }
+};
+
+Checkpoint make_checkpoint(bool is_act_order) {
+  Checkpoint checkpoint;
+  for (int32_t i = 0; i < kRows * kCols; ++i) {
+    checkpoint.q.push_back((i * 7 + i / 5) % 16);
+  }
+  const int32_t group_num = kCols / kGroupSize;
+  for (int32_t i = 0; i < group_num * kRows; ++i) {
+    checkpoint.zero_points.push_back(1 + i % 15);
+    checkpoint.scales.push_back(base::float_to_half(0.01f * (1 + i % 9)));
+  }
+  if (is_act_order) {
+    // every group has kGroupSize columns scattered over the row
+    for (int32_t col = 0; col < kCols; ++col) {
+      checkpoint.g_idx.push_back((col + col / 8) % group_num);
+    }
+  }
+  return checkpoint;
+}
+
+// qweight [cols / 8, rows] and qzeros [groups, rows / 8] packed in the order of the nibbles
+std::vector<int32_t> pack_gptq(const Checkpoint& checkpoint, std::vector<int32_t>& qzeros) {
+  std::vector<int32_t> qweight(kCols / 8 * kRows, 0);
+  for (int32_t row = 0; row < kRows; ++row) {
+    for (int32_t col = 0; col < kCols; ++col) {
+      qweight.at(col / 8 * kRows + row) |= checkpoint.q.at(row * kCols + col) << (4 * (col % 8));
+    }
+  }
+  const int32_t group_num = kCols / kGroupSize;
+  qzeros.assign(group_num * kRows / 8, 0);
+  for (int32_t g = 0; g < group_num; ++g) {
+    for (int32_t row = 0; row < kRows; ++row) {
+      // the v1 format stores the zero point minus one
+      qzeros.at(g * kRows / 8 + row / 8) |=
+          (checkpoint.zero_points.at(g * kRows + row) - 1) << (4 * (row % 8));
+    }
+  }
+  return qweight;
+}
+
+// qweight [cols, rows / 8] and qzeros [groups, rows / 8] in the interleaved order of awq
+std::vector<int32_t> pack_awq(const Checkpoint& checkpoint, std::vector<int32_t>& qzeros) {
+  const int32_t order[8] = {0, 2, 4, 6, 1, 3, 5, 7};
+  std::vector<int32_t> qweight(kCols * kRows / 8, 0);
+  for (int32_t col = 0; col < kCols; ++col) {
+    for (int32_t pack = 0; pack < kRows / 8; ++pack) {
+      for (int32_t slot = 0; slot < 8; ++slot) {
+        const int32_t row = pack * 8 + order[slot];
+        qweight.at(col * kRows / 8 + pack) |= checkpoint.q.at(row * kCols + col) << (4 * slot);
+      }
+    }
+  }
+  const int32_t group_num = kCols / kGroupSize;
+  qzeros.assign(group_num * kRows / 8, 0);
+  for (int32_t g = 0; g < group_num; ++g) {
+    for (int32_t pack = 0; pack < kRows / 8; ++pack) {
+      for (int32_t slot = 0; slot < 8; ++slot) {
+        const int32_t row = pack * 8 + order[slot];
+        qzeros.at(g * kRows / 8 + pack) |= checkpoint.zero_points.at(g * kRows + row)
+                                           << (4 * slot);
+      }
+    }
+  }
+  return qweight;
+}
+}  // namespace
+
+TEST(test_int4_import, gptq_act_order) {
+  const Checkpoint checkpoint = make_checkpoint(true);
+  std::vector<int32_t> qzeros;
+  const std::vector<int32_t> qweight = pack_gptq(checkpoint, qzeros);
+  model::Int4Source src;
+  src.format = model::Int4Format::kGptq;
+  src.rows = kRows;
+  src.cols = kCols;
+  src.group_size = kGroupSize;
+  src.is_zero_point_offset = true;
+  src.qweight = qweight.data();
+  src.qzeros = qzeros.data();
+  src.scales = checkpoint.scales.data();
+  src.g_idx = checkpoint.g_idx.data();
+
+  std::vector<uint8_t> packed;
+  std::vector<int32_t> order;
+  ASSERT_TRUE(model::repack_int4_weight(src, kGroupSize, packed, order));
+  ASSERT_EQ(packed.size(), op::MatmulLayer::int4_byte_size(kRows, kCols, kGroupSize, true));
+  ASSERT_EQ(order.size(), kCols);
+  for (int32_t col = 0; col < kCols; ++col) {
+    // the columns of a group of the repacked weight are one group of the checkpoint
+    ASSERT_EQ(checkpoint.group(order.at(col)), checkpoint.group(order.at(col / kGroupSize *
+                                                                         kGroupSize)));
+    for (int32_t row = 0; row < kRows; ++row) {
+      ASSERT_FLOAT_EQ(repacked_value(packed, row, col), checkpoint.value(row, order.at(col)));
+    }
+  }
+
+  // the groups of the repacked weight can not span two groups of the checkpoint
+  ASSERT_FALSE(model::repack_int4_weight(src, 2 * kGroupSize, packed, order));
+}
+
+TEST(test_int4_import, awq) {
+  const Checkpoint checkpoint = make_checkpoint(false);
+  std::vector<int32_t> qzeros;
+  const std::vector<int32_t> qweight = pack_awq(checkpoint, qzeros);
+  model::Int4Source src;
+  src.format = model::Int4Format::kAwq;
+  src.rows = kRows;
+  src.cols = kCols;
+  src.group_size = kGroupSize;
+  src.qweight = qweight.data();
+  src.qzeros = qzeros.data();
+  src.scales = checkpoint.scales.data();
+
+  std::vector<uint8_t> packed;
+  std::vector<int32_t> order;
+  ASSERT_TRUE(model::repack_int4_weight(src, kGroupSize, packed, order));
+  ASSERT_TRUE(order.empty());
+  for (int32_t row = 0; row < kRows; ++row) {
+    for (int32_t col = 0; col < kCols; ++col) {
+      ASSERT_FLOAT_EQ(repacked_value(packed, row, col), checkpoint.value(row, col));
+    }
+  }
+}
+
+TEST(test_int4_import, quantize_row) {
+  std::vector<float> weight(kRows * kCols);
+  for (int32_t i = 0; i < kRows * kCols; ++i) {
+    weight.at(i) = 0.05f * static_cast<float>((i * 13) % 29) - 0.3f;
+  }
+  std::vector<uint8_t> packed(op::MatmulLayer::int4_byte_size(kRows, kCols, kGroupSize, true));
+  for (int32_t row = 0; row < kRows; ++row) {
+    model::quantize_int4_row(weight.data() + row * kCols, row, kRows, kCols, kGroupSize,
+                             packed.data());
+  }
+  // a group spans 1.4, the rounding error is half of a step of 1.4 / 15
+  for (int32_t row = 0; row < kRows; ++row) {
+    for (int32_t col = 0; col < kCols; ++col) {
+      ASSERT_NEAR(repacked_value(packed, row, col), weight.at(row * kCols + col), 0.05f);
+    }
+  }
+  ASSERT_EQ(model::int4_order_name("layers.3.attention.wq.weight"), "layers.3.attention.wq.order");
+}
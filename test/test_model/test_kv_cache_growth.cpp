@@ -0,0 +1,52 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "model/kv_cache.h"
+
+TEST(test_kv_cache_growth, grow_and_shrink) {
+  // a block of one layer takes 2MB, the granularity of the cpu reservation
+  const int32_t block_size = 16;
+  const int32_t kv_dim = 32768;
+  const size_t block_byte_size = static_cast<size_t>(block_size) * kv_dim * sizeof(float);
+  model::PagedKVCache kv_cache(base::DeviceType::kDeviceCPU, base::DataType::kDataTypeFp32, 1,
+                               kv_dim, block_size, 8, 2, 128, 0, false, 2);
+  ASSERT_TRUE(kv_cache.is_growable());
+  ASSERT_EQ(kv_cache.committed_block_num(), 0);
+  ASSERT_EQ(kv_cache.committed_byte_size(), 0);
+  ASSERT_EQ(kv_cache.free_block_num(), 8);
+  tensor::Tensor key_tensor = kv_cache.key_cache();
+  float* key_cache = key_tensor.ptr<float>();
+
+  ASSERT_TRUE(kv_cache.reserve(0, 20));
+  ASSERT_EQ(kv_cache.committed_block_num(), 2);
+  ASSERT_EQ(kv_cache.committed_byte_size(), 2 * 2 * block_byte_size);
+  const int32_t pos = kv_cache.physical_pos(0, 19);
+  key_cache[pos * kv_dim] = 1.5f;
+
+  // the cache grows in place, the written positions keep their values
+  ASSERT_TRUE(kv_cache.reserve(1, 40));
+  ASSERT_EQ(kv_cache.committed_block_num(), 6);
+  ASSERT_EQ(kv_cache.free_block_num(), 3);
+  ASSERT_EQ(kv_cache.key_cache().ptr<float>(), key_tensor.ptr<float>());
+  ASSERT_EQ(key_cache[pos * kv_dim], 1.5f);
+  ASSERT_FALSE(kv_cache.reserve(1, 128));
+  ASSERT_EQ(kv_cache.blocks(1).size(), 3);
+
+  // the blocks of slot 0 are the lowest ones, so the rest can go back
+  kv_cache.release(1);
+  kv_cache.shrink(4);
+  ASSERT_EQ(kv_cache.committed_block_num(), 4);
+  kv_cache.shrink(0);
+  ASSERT_EQ(kv_cache.committed_block_num(), 2);
+  ASSERT_EQ(kv_cache.free_block_num(), 6);
+  ASSERT_EQ(key_cache[pos * kv_dim], 1.5f);
+
+  kv_cache.release(0);
+  kv_cache.shrink(0);
+  ASSERT_EQ(kv_cache.committed_block_num(), 0);
+  ASSERT_EQ(kv_cache.committed_byte_size(), 0);
+  ASSERT_EQ(kv_cache.free_block_num(), 8);
+
+  // the freed blocks are handed out from the lowest id again
+  ASSERT_TRUE(kv_cache.reserve(0, 16));
+  ASSERT_EQ(kv_cache.blocks(0).at(0), 0);
+}
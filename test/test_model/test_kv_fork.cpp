@@ -0,0 +1,104 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "model/kv_cache.h"
+
+TEST(test_kv_fork, copy_on_write) {
+  const int32_t layer_num = 2;
+  const int32_t kv_dim = 8;
+  const int32_t block_size = 4;
+  const int32_t block_num = 8;
+  model::PagedKVCache kv_cache(base::DeviceType::kDeviceCPU, base::DataType::kDataTypeFp32,
+                               layer_num, kv_dim, block_size, block_num, 3, 32);
+  auto key_at = [&](int32_t layer_idx, int32_t slot, int32_t pos) {
+    const int64_t row = static_cast<int64_t>(layer_idx) * block_num * block_size +
+                        kv_cache.physical_pos(slot, pos);
+    return const_cast<float*>(kv_cache.key_cache().ptr<float>(row * kv_dim));
+  };
+
+  // a prompt of 6 positions, the second block is filled up to half
+  ASSERT_TRUE(kv_cache.reserve(0, 6));
+  for (int32_t layer_idx = 0; layer_idx < layer_num; ++layer_idx) {
+    for (int32_t pos = 0; pos < 6; ++pos) {
+      key_at(layer_idx, 0, pos)[0] = static_cast<float>(layer_idx * 100 + pos);
+    }
+  }
+  kv_cache.fork(0, 1, 6);
+  kv_cache.fork(0, 2, 6);
+  ASSERT_EQ(kv_cache.blocks(1), kv_cache.blocks(0));
+  ASSERT_EQ(kv_cache.block_ref(kv_cache.blocks(0).at(1)), 3);
+  ASSERT_EQ(kv_cache.free_block_num(), block_num - 2);
+  ASSERT_EQ(kv_cache.shared_block_num(1, 6, 7), 1);
+
+  // the branch which writes position 6 gets a copy of the partial block, the full one stays
+  // shared
+  const int32_t shared_block = kv_cache.blocks(0).at(1);
+  ASSERT_TRUE(kv_cache.reserve(1, 7));
+  ASSERT_TRUE(kv_cache.make_writable(1, 6, 7));
+  ASSERT_NE(kv_cache.blocks(1).at(1), shared_block);
+  ASSERT_EQ(kv_cache.blocks(1).at(0), kv_cache.blocks(0).at(0));
+  ASSERT_EQ(kv_cache.block_ref(shared_block), 2);
+  for (int32_t layer_idx = 0; layer_idx < layer_num; ++layer_idx) {
+    for (int32_t pos = 4; pos < 6; ++pos) {
+      ASSERT_EQ(key_at(layer_idx, 1, pos)[0], static_cast<float>(layer_idx * 100 + pos));
+    }
+  }
+  key_at(0, 1, 6)[0] = -1.f;
+  key_at(0, 1, 5)[0] = -2.f;
+  ASSERT_EQ(key_at(0, 0, 5)[0], 5.f);
+
+  // the last holder writes the block in place
+  ASSERT_TRUE(kv_cache.make_writable(2, 6, 7));
+  ASSERT_TRUE(kv_cache.make_writable(0, 6, 7));
+  ASSERT_EQ(kv_cache.blocks(0).at(1), shared_block);
+  ASSERT_EQ(kv_cache.block_ref(shared_block), 1);
+
+  kv_cache.release(0);
+  kv_cache.release(1);
+  kv_cache.release(2);
+  ASSERT_EQ(kv_cache.free_block_num(), block_num);
+}
+
+TEST(test_kv_fork, copy_on_write_int8) {
+  const int32_t layer_num = 2;
+  const int32_t kv_dim = 8;
+  const int32_t head_size = 4;
+  const int32_t block_size = 4;
+  const int32_t block_num = 8;
+  const int32_t cache_len = block_num * block_size;
+  model::PagedKVCache kv_cache(base::DeviceType::kDeviceCPU, base::DataType::kDataTypeInt8,
+                               layer_num, kv_dim, block_size, block_num, 2, 32, head_size);
+  // the dequantized key of a position, every head of a row has its own scale
+  auto key_at = [&](int32_t layer_idx, int32_t slot, int32_t pos, int32_t i) {
+    const int64_t row = static_cast<int64_t>(layer_idx) * cache_len +
+                        kv_cache.physical_pos(slot, pos);
+    return kv_cache.key_cache().ptr<int8_t>()[row * kv_dim + i] *
+           kv_cache.key_scale().ptr<float>()[row * (kv_dim / head_size) + i / head_size];
+  };
+
+  ASSERT_TRUE(kv_cache.reserve(0, 6));
+  std::vector<float> key(6 * kv_dim);
+  for (int32_t layer_idx = 0; layer_idx < layer_num; ++layer_idx) {
+    for (int32_t i = 0; i < key.size(); ++i) {
+      key[i] = static_cast<float>((layer_idx + 1) * (i + 1));
+    }
+    tensor::Tensor key_tensor(base::DataType::kDataTypeFp32, key.size(), false, nullptr,
+                              key.data());
+    key_tensor.set_device_type(base::DeviceType::kDeviceCPU);
+    kv_cache.write(layer_idx, 0, 0, key_tensor, key_tensor);
+  }
+  kv_cache.fork(0, 1, 6);
+
+  // the copy of the partial block carries the scales of its rows along
+  ASSERT_TRUE(kv_cache.reserve(1, 7));
+  ASSERT_TRUE(kv_cache.make_writable(1, 6, 7));
+  ASSERT_NE(kv_cache.blocks(1).at(1), kv_cache.blocks(0).at(1));
+  for (int32_t layer_idx = 0; layer_idx < layer_num; ++layer_idx) {
+    for (int32_t pos = 0; pos < 6; ++pos) {
+      for (int32_t i = 0; i < kv_dim; ++i) {
+        ASSERT_EQ(key_at(layer_idx, 1, pos, i), key_at(layer_idx, 0, pos, i));
+        ASSERT_NEAR(key_at(layer_idx, 1, pos, i),
+                    static_cast<float>((layer_idx + 1) * (pos * kv_dim + i + 1)), 0.5f);
+      }
+    }
+  }
+}
@@ -0,0 +1,196 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <cstdio>
+#include "model/kv_cache.h"
+
+namespace {
+// every position keeps its own values, position p of layer l starts at (l * 1000 + p) * 10
+void fill_slot(model::PagedKVCache& kv_cache, int32_t slot, int32_t layer_num, int32_t kv_dim,
+               int32_t token_num) {
+  std::vector<float> key(token_num * kv_dim);
+  std::vector<float> value(token_num * kv_dim);
+  for (int32_t layer = 0; layer < layer_num; ++layer) {
+    for (int32_t i = 0; i < token_num * kv_dim; ++i) {
+      key[i] = static_cast<float>(layer * 10000 + i);
+      value[i] = -key[i];
+    }
+    tensor::Tensor key_tensor(base::DataType::kDataTypeFp32, token_num * kv_dim, false, nullptr,
+                              key.data());
+    tensor::Tensor value_tensor(base::DataType::kDataTypeFp32, token_num * kv_dim, false,
+                                nullptr, value.data());
+    key_tensor.set_device_type(base::DeviceType::kDeviceCPU);
+    value_tensor.set_device_type(base::DeviceType::kDeviceCPU);
+    kv_cache.write(layer, slot, 0, key_tensor, value_tensor);
+  }
+}
+
+// the key of a position of a row major cache
+float key_at(const model::PagedKVCache& kv_cache, int32_t slot, int32_t layer, int32_t pos,
+             int32_t kv_dim, int32_t dim_idx, int32_t cache_len) {
+  const int32_t physical = kv_cache.physical_pos(slot, pos);
+  return kv_cache.key_cache().ptr<float>()[(layer * cache_len + physical) * kv_dim + dim_idx];
+}
+
+// the dequantized keys and values of the first token_num positions of a slot of an int8 cache
+std::vector<float> dequantized(const model::PagedKVCache& kv_cache, int32_t slot,
+                               int32_t layer_num, int32_t kv_dim, int32_t head_size,
+                               int32_t token_num, int32_t cache_len) {
+  const int32_t kv_head_num = kv_dim / head_size;
+  std::vector<float> values;
+  for (int32_t layer = 0; layer < layer_num; ++layer) {
+    for (int32_t pos = 0; pos < token_num; ++pos) {
+      const int64_t row =
+          static_cast<int64_t>(layer) * cache_len + kv_cache.physical_pos(slot, pos);
+      for (int32_t i = 0; i < kv_dim; ++i) {
+        const int64_t scale_idx = row * kv_head_num + i / head_size;
+        values.push_back(kv_cache.key_cache().ptr<int8_t>()[row * kv_dim + i] *
+                         kv_cache.key_scale().ptr<float>()[scale_idx]);
+        values.push_back(kv_cache.value_cache().ptr<int8_t>()[row * kv_dim + i] *
+                         kv_cache.value_scale().ptr<float>()[scale_idx]);
+      }
+    }
+  }
+  return values;
+}
+}  // namespace
+
+TEST(test_kv_snapshot, save_file_and_restore) {
+  const int32_t layer_num = 2;
+  const int32_t kv_dim = 8;
+  const int32_t block_size = 4;
+  const int32_t block_num = 16;
+  const int32_t token_num = 10;
+  model::PagedKVCache kv_cache(base::DeviceType::kDeviceCPU, base::DataType::kDataTypeFp32,
+                               layer_num, kv_dim, block_size, block_num, 4, 64);
+  ASSERT_TRUE(kv_cache.reserve(0, token_num));
+  fill_slot(kv_cache, 0, layer_num, kv_dim, token_num);
+
+  model::KVSnapshot snapshot;
+  kv_cache.save(0, token_num, snapshot);
+  ASSERT_EQ(snapshot.token_num(), token_num);
+  ASSERT_EQ(snapshot.header().block_num, 3);
+  ASSERT_EQ(snapshot.byte_size() % model::kKVSnapshotAlignment, 0);
+  const std::string path = "/tmp/test_kv_snapshot.kvs";
+  ASSERT_TRUE(snapshot.write_file(path));
+  kv_cache.release(0);
+
+  // other blocks are in use, so the restored slot gets different ones
+  ASSERT_TRUE(kv_cache.reserve(1, 6));
+  model::KVSnapshot mapped;
+  ASSERT_TRUE(mapped.map_file(path));
+  ASSERT_EQ(mapped.token_num(), token_num);
+  ASSERT_TRUE(kv_cache.restore(2, mapped));
+  ASSERT_EQ(kv_cache.reserved_token_num(2), 12);
+  ASSERT_NE(kv_cache.blocks(2).at(0), 0);
+  const int32_t cache_len = block_num * block_size;
+  for (int32_t layer = 0; layer < layer_num; ++layer) {
+    for (int32_t pos = 0; pos < token_num; ++pos) {
+      for (int32_t i = 0; i < kv_dim; ++i) {
+        ASSERT_EQ(key_at(kv_cache, 2, layer, pos, kv_dim, i, cache_len),
+                  static_cast<float>(layer * 10000 + pos * kv_dim + i));
+      }
+    }
+  }
+  std::remove(path.c_str());
+}
+
+TEST(test_kv_snapshot, head_major_in_memory) {
+  const int32_t layer_num = 2;
+  const int32_t kv_dim = 8;
+  const int32_t head_size = 4;
+  const int32_t block_size = 4;
+  const int32_t token_num = 7;
+  model::PagedKVCache src(base::DeviceType::kDeviceCPU, base::DataType::kDataTypeFp32, layer_num,
+                          kv_dim, block_size, 8, 2, 32, head_size, true);
+  ASSERT_TRUE(src.reserve(0, token_num));
+  fill_slot(src, 0, layer_num, kv_dim, token_num);
+  model::KVSnapshot snapshot;
+  src.save(0, token_num, snapshot);
+
+  // another cache of the same layout, the context of a resumed session
+  model::PagedKVCache dst(base::DeviceType::kDeviceCPU, base::DataType::kDataTypeFp32, layer_num,
+                          kv_dim, block_size, 8, 2, 32, head_size, true);
+  ASSERT_TRUE(dst.reserve(0, 9));
+  ASSERT_TRUE(dst.restore(1, snapshot));
+  const int32_t cache_len = 8 * block_size;
+  const float* src_key = src.key_cache().ptr<float>();
+  const float* dst_key = dst.key_cache().ptr<float>();
+  const float* dst_value = dst.value_cache().ptr<float>();
+  for (int32_t layer = 0; layer < layer_num; ++layer) {
+    for (int32_t head = 0; head < kv_dim / head_size; ++head) {
+      for (int32_t pos = 0; pos < token_num; ++pos) {
+        const int32_t strip = layer * (kv_dim / head_size) + head;
+        const int32_t src_offset = (strip * cache_len + src.physical_pos(0, pos)) * head_size;
+        const int32_t dst_offset = (strip * cache_len + dst.physical_pos(1, pos)) * head_size;
+        for (int32_t i = 0; i < head_size; ++i) {
+          ASSERT_EQ(dst_key[dst_offset + i], src_key[src_offset + i]);
+          ASSERT_EQ(dst_value[dst_offset + i], -src_key[src_offset + i]);
+        }
+      }
+    }
+  }
+
+  // a cache of another layout refuses it
+  model::PagedKVCache other(base::DeviceType::kDeviceCPU, base::DataType::kDataTypeFp32,
+                            layer_num, kv_dim, 8, 8, 2, 32, head_size, true);
+  ASSERT_FALSE(other.restore(0, snapshot));
+}
+
+TEST(test_kv_snapshot, swap_out_and_in) {
+  const int32_t layer_num = 2;
+  const int32_t kv_dim = 8;
+  const int32_t block_size = 4;
+  const int32_t block_num = 4;
+  const int32_t token_num = 9;
+  model::PagedKVCache kv_cache(base::DeviceType::kDeviceCPU, base::DataType::kDataTypeFp32,
+                               layer_num, kv_dim, block_size, block_num, 2, 16);
+  ASSERT_TRUE(kv_cache.reserve(0, token_num));
+  fill_slot(kv_cache, 0, layer_num, kv_dim, token_num);
+  model::KVSnapshot snapshot;
+  kv_cache.save(0, token_num, snapshot);
+  // the copies of a cpu cache are done at once, the blocks are freed for another sequence
+  ASSERT_TRUE(snapshot.is_ready());
+  kv_cache.release(0);
+  ASSERT_TRUE(kv_cache.reserve(1, block_num * block_size));
+  fill_slot(kv_cache, 1, layer_num, kv_dim, 1);
+  ASSERT_FALSE(kv_cache.restore(0, snapshot));
+
+  kv_cache.release(1);
+  ASSERT_TRUE(kv_cache.restore(0, snapshot));
+  const int32_t cache_len = block_num * block_size;
+  for (int32_t layer = 0; layer < layer_num; ++layer) {
+    for (int32_t pos = 0; pos < token_num; ++pos) {
+      for (int32_t i = 0; i < kv_dim; ++i) {
+        ASSERT_EQ(key_at(kv_cache, 0, layer, pos, kv_dim, i, cache_len),
+                  static_cast<float>(layer * 10000 + pos * kv_dim + i));
+      }
+    }
+  }
+}
+
+TEST(test_kv_snapshot, int8_round_trip) {
+  const int32_t layer_num = 2;
+  const int32_t kv_dim = 8;
+  const int32_t head_size = 4;
+  const int32_t block_size = 4;
+  const int32_t block_num = 8;
+  const int32_t token_num = 7;
+  const int32_t cache_len = block_num * block_size;
+  model::PagedKVCache kv_cache(base::DeviceType::kDeviceCPU, base::DataType::kDataTypeInt8,
+                               layer_num, kv_dim, block_size, block_num, 2, 32, head_size);
+  ASSERT_TRUE(kv_cache.reserve(0, token_num));
+  fill_slot(kv_cache, 0, layer_num, kv_dim, token_num);
+  const std::vector<float> expected =
+      dequantized(kv_cache, 0, layer_num, kv_dim, head_size, token_num, cache_len);
+  model::KVSnapshot snapshot;
+  kv_cache.save(0, token_num, snapshot);
+  kv_cache.release(0);
+
+  // the rows and the scales of every head land in the blocks of the restored slot together
+  ASSERT_TRUE(kv_cache.reserve(1, 5));
+  fill_slot(kv_cache, 1, layer_num, kv_dim, 1);
+  ASSERT_TRUE(kv_cache.restore(0, snapshot));
+  ASSERT_NE(kv_cache.blocks(0).at(0), 0);
+  ASSERT_EQ(dequantized(kv_cache, 0, layer_num, kv_dim, head_size, token_num, cache_len),
+            expected);
+}
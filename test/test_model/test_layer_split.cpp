@@ -0,0 +1,55 @@
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <vector>
+#include "../utils/toy_model.h"
+
+namespace {
+// the logits of the last step, on the host for the classifier of a split model
+std::vector<float> forward_logits(const model::Model& model) {
+  const tensor::Tensor& logits = model.get_buffer(model::ModelBufferType::kForwardOutput);
+  std::vector<float> output(logits.size());
+  cudaDeviceSynchronize();
+  cudaMemcpy(output.data(), logits.ptr<float>(), logits.byte_size(), cudaMemcpyDefault);
+  return output;
+}
+}  // namespace
+
+TEST(test_layer_split, logits_match_the_cuda_model) {
+  test::ToyModelFiles files("layer_split", test::toy_model_config());
+  auto cuda_model = files.create_model();
+  ASSERT_TRUE(cuda_model->init(base::DeviceType::kDeviceCUDA));
+  auto split_model = files.create_model();
+  split_model->set_gpu_layer_num(1);
+  ASSERT_TRUE(split_model->init(base::DeviceType::kDeviceCUDA));
+  ASSERT_TRUE(split_model->is_layer_split());
+
+  const std::vector<int32_t> prompt = {1, 5, 9, 12, 7};
+  tensor::Tensor pos_tensor(base::DataType::kDataTypeInt32, 1, true,
+                            base::CPUDeviceAllocatorFactory::get_instance());
+  pos_tensor.index<int32_t>(0) = 0;
+  int32_t cuda_next = -1;
+  int32_t split_next = -1;
+  ASSERT_TRUE(cuda_model->prefill(cuda_model->embedding(prompt).input_embeddings, pos_tensor,
+                                  cuda_next));
+  ASSERT_TRUE(split_model->prefill(split_model->embedding(prompt).input_embeddings, pos_tensor,
+                                   split_next));
+  ASSERT_EQ(split_next, cuda_next);
+
+  // both models decode the tokens of the cuda one
+  for (int32_t pos = static_cast<int32_t>(prompt.size()); pos < 24; ++pos) {
+    const int32_t token = cuda_next;
+    pos_tensor.index<int32_t>(0) = pos;
+    ASSERT_TRUE(cuda_model->predict(cuda_model->embedding({token}).input_embeddings, pos_tensor,
+                                    false, cuda_next));
+    ASSERT_TRUE(split_model->predict(split_model->embedding({token}).input_embeddings,
+                                     pos_tensor, false, split_next));
+    const std::vector<float> cuda_logits = forward_logits(*cuda_model);
+    const std::vector<float> split_logits = forward_logits(*split_model);
+    ASSERT_EQ(split_logits.size(), cuda_logits.size());
+    for (int32_t i = 0; i < cuda_logits.size(); ++i) {
+      ASSERT_NEAR(split_logits.at(i), cuda_logits.at(i), 1e-4f) << "pos " << pos << " logit " << i;
+    }
+    ASSERT_EQ(split_next, cuda_next);
+  }
+}
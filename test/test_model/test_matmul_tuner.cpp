@@ -0,0 +1,37 @@
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <cstdio>
+#include "model/matmul_tuner.h"
+
+TEST(test_matmul_tuner, tune_and_cache) {
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  const std::string cache_path = "/tmp/kuiper_matmul_tuning_" + std::to_string(getpid());
+  std::remove(cache_path.c_str());
+  tensor::Tensor weight(base::DataType::kDataTypeFp32, 96, 128, true, alloc_cu);
+  const kernel::GemvShape shape{96, 128, static_cast<int32_t>(base::DataType::kDataTypeFp32)};
+
+  kernel::CudaConfig config;
+  cudaStreamCreate(&config.stream);
+  model::MatmulTuner tuner(cache_path);
+  tuner.tune(weight, &config);
+  // a shape is timed only once
+  tuner.tune(weight, &config);
+  ASSERT_EQ(tuner.tuned_num(), 1);
+  ASSERT_EQ(config.gemv_launches.count(shape), 1);
+  ASSERT_TRUE(tuner.save());
+
+  // the next run on the gpu reads the winner from the cache instead of timing it
+  kernel::CudaConfig cached_config;
+  cached_config.stream = config.stream;
+  model::MatmulTuner cached_tuner(cache_path);
+  cached_tuner.tune(weight, &cached_config);
+  ASSERT_EQ(cached_tuner.tuned_num(), 0);
+  ASSERT_EQ(cached_config.gemv_launches.at(shape).thread_num,
+            config.gemv_launches.at(shape).thread_num);
+  ASSERT_EQ(cached_config.gemv_launches.at(shape).row_per_block,
+            config.gemv_launches.at(shape).row_per_block);
+  cached_config.stream = nullptr;
+  std::remove(cache_path.c_str());
+}
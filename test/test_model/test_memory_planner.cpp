@@ -0,0 +1,39 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "model/memory_planner.h"
+
+TEST(test_memory_planner, reuse_dead_tensors) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const base::DataType fp32 = base::DataType::kDataTypeFp32;
+  model::MemoryPlanner planner;
+  const int32_t a = planner.add_tensor(fp32, {64, 64}, 0, 1);
+  const int32_t b = planner.add_tensor(fp32, {64, 64}, 1, 2);
+  const int32_t c = planner.add_tensor(fp32, {64, 64}, 2, 3);
+  const int32_t d = planner.add_tensor(fp32, {32}, 0, 3);
+  ASSERT_TRUE(planner.allocate(alloc_cpu));
+
+  // a and c never live together, so the peak is two matrices and the vector
+  ASSERT_EQ(planner.arena_byte_size(), 2 * 64 * 64 * sizeof(float) + 256);
+  tensor::Tensor ta = planner.get_tensor(a);
+  tensor::Tensor tb = planner.get_tensor(b);
+  tensor::Tensor tc = planner.get_tensor(c);
+  tensor::Tensor td = planner.get_tensor(d);
+  ASSERT_EQ(ta.ptr<float>(), tc.ptr<float>());
+  ASSERT_NE(ta.ptr<float>(), tb.ptr<float>());
+  ASSERT_EQ(tb.get_dim(1), 64);
+  ASSERT_EQ(td.size(), 32);
+  ASSERT_EQ(td.device_type(), base::DeviceType::kDeviceCPU);
+
+  for (int32_t i = 0; i < tb.size(); ++i) {
+    tb.index<float>(i) = 1.f;
+  }
+  for (int32_t i = 0; i < ta.size(); ++i) {
+    ta.index<float>(i) = 2.f;
+  }
+  for (int32_t i = 0; i < td.size(); ++i) {
+    td.index<float>(i) = 3.f;
+  }
+  for (int32_t i = 0; i < tb.size(); ++i) {
+    ASSERT_EQ(tb.index<float>(i), 1.f);
+  }
+}
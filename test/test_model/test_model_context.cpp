@@ -0,0 +1,95 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+#include "../utils/toy_model.h"
+
+namespace {
+// a greedy decode of the prompt in slot 0 of the model, token by token after the prefill
+class Decoder {
+ public:
+  Decoder(const model::Model& model, const std::vector<int32_t>& prompt) : model_(model) {
+    pos_tensor_ = tensor::Tensor(base::DataType::kDataTypeInt32, 1, true,
+                                 base::CPUDeviceAllocatorFactory::get_instance());
+    pos_tensor_.index<int32_t>(0) = 0;
+    CHECK(model_.prefill(model_.embedding(prompt).input_embeddings, pos_tensor_, next_));
+    pos_ = static_cast<int32_t>(prompt.size());
+    output_tokens_.push_back(next_);
+  }
+
+  void step() {
+    pos_tensor_.index<int32_t>(0) = pos_;
+    CHECK(model_.predict(model_.embedding({next_}).input_embeddings, pos_tensor_, false, next_));
+    pos_ += 1;
+    output_tokens_.push_back(next_);
+  }
+
+  const std::vector<int32_t>& output_tokens() const { return output_tokens_; }
+
+ private:
+  const model::Model& model_;
+  tensor::Tensor pos_tensor_;
+  int32_t pos_ = 0;
+  int32_t next_ = -1;
+  std::vector<int32_t> output_tokens_;
+};
+
+const std::vector<std::vector<int32_t>> kPrompts = {{1, 5, 9, 12, 7, 30}, {1, 25, 3}};
+constexpr int32_t kMaxNewTokens = 16;
+}  // namespace
+
+TEST(test_model_context, interleaved_steps) {
+  test::ToyModelFiles files("context_interleaved", test::toy_model_config());
+  auto model = files.create_model();
+  ASSERT_TRUE(model->init(base::DeviceType::kDeviceCPU));
+  std::vector<std::vector<int32_t>> references;
+  for (const std::vector<int32_t>& prompt : kPrompts) {
+    references.push_back(test::greedy_reference(*model, prompt, kMaxNewTokens));
+  }
+
+  std::unique_ptr<model::Model> first;
+  std::unique_ptr<model::Model> second;
+  ASSERT_TRUE(model->create_context(first));
+  ASSERT_TRUE(model->create_context(second));
+  // the steps of the contexts alternate, neither sees the kv or the buffers of the other
+  Decoder first_decoder(*first, kPrompts.at(0));
+  Decoder second_decoder(*second, kPrompts.at(1));
+  for (int32_t i = 1; i < kMaxNewTokens; ++i) {
+    first_decoder.step();
+    second_decoder.step();
+  }
+  ASSERT_EQ(first_decoder.output_tokens(), references.at(0));
+  ASSERT_EQ(second_decoder.output_tokens(), references.at(1));
+}
+
+TEST(test_model_context, concurrent_threads) {
+  test::ToyModelFiles files("context_threads", test::toy_model_config());
+  auto model = files.create_model();
+  ASSERT_TRUE(model->init(base::DeviceType::kDeviceCPU));
+  std::vector<std::vector<int32_t>> references;
+  for (const std::vector<int32_t>& prompt : kPrompts) {
+    references.push_back(test::greedy_reference(*model, prompt, kMaxNewTokens));
+  }
+
+  std::vector<std::unique_ptr<model::Model>> contexts(kPrompts.size());
+  for (std::unique_ptr<model::Model>& context : contexts) {
+    ASSERT_TRUE(model->create_context(context));
+  }
+  std::vector<std::vector<int32_t>> outputs(kPrompts.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kPrompts.size(); ++i) {
+    threads.emplace_back([&, i] {
+      Decoder decoder(*contexts.at(i), kPrompts.at(i));
+      for (int32_t step = 1; step < kMaxNewTokens; ++step) {
+        decoder.step();
+      }
+      outputs.at(i) = decoder.output_tokens();
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  for (size_t i = 0; i < kPrompts.size(); ++i) {
+    ASSERT_EQ(outputs.at(i), references.at(i));
+  }
+}
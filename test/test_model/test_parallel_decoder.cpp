@@ -0,0 +1,111 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "../utils/toy_model.h"
+#include "model/parallel_decoder.h"
+
+namespace {
+// the log probabilities of the next token after the tokens, from a prefill in slot 0
+std::vector<float> next_log_probs(const model::Model& model, const std::vector<int32_t>& tokens) {
+  tensor::Tensor pos_tensor(base::DataType::kDataTypeInt32, 1, true,
+                            base::CPUDeviceAllocatorFactory::get_instance());
+  pos_tensor.index<int32_t>(0) = 0;
+  int32_t next = -1;
+  model.release_kv_cache(0);
+  CHECK(model.prefill(model.embedding(tokens).input_embeddings, pos_tensor, next));
+  model.release_kv_cache(0);
+  const tensor::Tensor& logits = model.get_buffer(model::ModelBufferType::kForwardOutput);
+  std::vector<float> log_probs(logits.ptr<float>(), logits.ptr<float>() + logits.size());
+  const float max_logit = *std::max_element(log_probs.begin(), log_probs.end());
+  float sum = 0.f;
+  for (float logit : log_probs) {
+    sum += std::exp(logit - max_logit);
+  }
+  for (float& log_prob : log_probs) {
+    log_prob -= max_logit + std::log(sum);
+  }
+  return log_probs;
+}
+}  // namespace
+
+TEST(test_parallel_decoder, sample_matches_greedy) {
+  test::ToyModelFiles files("parallel_sample", test::toy_model_config());
+  auto model = files.create_model();
+  model->set_max_batch_size(3);
+  ASSERT_TRUE(model->init(base::DeviceType::kDeviceCPU));
+  const std::vector<int32_t> prompt = {1, 5, 9, 12, 7};
+  const int32_t max_new_tokens = 12;
+  const std::vector<int32_t> reference = test::greedy_reference(*model, prompt, max_new_tokens);
+
+  // one draw of the argmax sampler is the greedy decode
+  model::ParallelDecoder decoder(*model);
+  std::vector<model::Candidate> candidates;
+  ASSERT_TRUE(decoder.sample(prompt, {2}, max_new_tokens, candidates));
+  ASSERT_EQ(candidates.size(), 1);
+  ASSERT_EQ(candidates.front().tokens, reference);
+
+  // so is every branch which shares the prompt, whichever slots they run in
+  ASSERT_TRUE(decoder.sample(prompt, {2, 0}, max_new_tokens, candidates));
+  ASSERT_EQ(candidates.size(), 2);
+  for (const model::Candidate& candidate : candidates) {
+    ASSERT_EQ(candidate.tokens, reference);
+  }
+  ASSERT_FALSE(decoder.sample(prompt, {1, 1}, max_new_tokens, candidates));
+  ASSERT_FALSE(decoder.sample(prompt, {3}, max_new_tokens, candidates));
+}
+
+TEST(test_parallel_decoder, beam_search_matches_brute_force) {
+  const model::ModelConfig config = test::toy_model_config();
+  test::ToyModelFiles files("parallel_beam", config);
+  auto model = files.create_model();
+  model->set_max_batch_size(config.vocab_size);
+  ASSERT_TRUE(model->init(base::DeviceType::kDeviceCPU));
+  const std::vector<int32_t> prompt = {1, 5, 9, 12, 7};
+
+  // a beam as wide as the vocabulary keeps every first token, so the search over two tokens
+  // ranks all the pairs after the first token
+  std::vector<int32_t> slots(config.vocab_size);
+  for (int32_t i = 0; i < config.vocab_size; ++i) {
+    slots.at(i) = config.vocab_size - 1 - i;
+  }
+  model::ParallelDecoder decoder(*model);
+  std::vector<model::Candidate> candidates;
+  ASSERT_TRUE(decoder.beam_search(prompt, slots, 2, candidates));
+  ASSERT_EQ(candidates.size(), config.vocab_size);
+
+  // every continuation of at most two tokens, scored by its log probability per token
+  std::vector<std::pair<float, model::Candidate>> expected;
+  const std::vector<float> first_log_probs = next_log_probs(*model, prompt);
+  int32_t ending_num = 0;
+  for (int32_t first = 0; first < config.vocab_size; ++first) {
+    model::Candidate candidate;
+    candidate.log_prob = first_log_probs.at(first);
+    if (model->is_sentence_ending(first)) {
+      ending_num += 1;
+      expected.emplace_back(candidate.log_prob, candidate);
+      continue;
+    }
+    std::vector<int32_t> tokens = prompt;
+    tokens.push_back(first);
+    const std::vector<float> second_log_probs = next_log_probs(*model, tokens);
+    for (int32_t second = 0; second < config.vocab_size; ++second) {
+      model::Candidate pair;
+      pair.tokens = {first};
+      if (!model->is_sentence_ending(second)) {
+        pair.tokens.push_back(second);
+      }
+      pair.log_prob = candidate.log_prob + second_log_probs.at(second);
+      expected.emplace_back(pair.log_prob / 2.f, pair);
+    }
+  }
+  std::stable_sort(expected.begin(), expected.end(),
+                   [](const auto& a, const auto& b) { return a.first > b.first; });
+  // the ending first tokens take beams of their own, the best ones past them are exact
+  ASSERT_GT(ending_num, 0);
+  for (int32_t i = 0; i < config.vocab_size - ending_num; ++i) {
+    ASSERT_EQ(candidates.at(i).tokens, expected.at(i).second.tokens) << "candidate " << i;
+    ASSERT_NEAR(candidates.at(i).log_prob, expected.at(i).second.log_prob, 1e-4f);
+  }
+}
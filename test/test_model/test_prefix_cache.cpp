@@ -0,0 +1,42 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "model/prefix_cache.h"
+
+TEST(test_prefix_cache, share_and_evict) {
+  const int32_t block_size = 4;
+  model::PagedKVCache kv_cache(base::DeviceType::kDeviceCPU, base::DataType::kDataTypeFp32, 1, 8,
+                               block_size, 8, 2, 32);
+  model::PrefixCache prefix_cache(&kv_cache, 4);
+
+  // the first prompt fills two full blocks and one partial one
+  std::vector<int32_t> prompt{1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+  ASSERT_EQ(prefix_cache.match(prompt, 0), 0);
+  ASSERT_TRUE(kv_cache.reserve(0, static_cast<int32_t>(prompt.size())));
+  prefix_cache.insert(prompt, 0);
+  ASSERT_EQ(prefix_cache.cached_block_num(), 2);
+  const std::vector<int32_t> first_blocks = kv_cache.blocks(0);
+  kv_cache.release(0);
+  // the cached blocks stay out of the pool
+  ASSERT_EQ(kv_cache.free_block_num(), 6);
+
+  // a prompt with the same system part starts after the shared blocks
+  std::vector<int32_t> other{1, 2, 3, 4, 5, 6, 7, 8, 20, 21};
+  ASSERT_EQ(prefix_cache.match(other, 1), 8);
+  ASSERT_EQ(kv_cache.blocks(1).at(0), first_blocks.at(0));
+  ASSERT_EQ(kv_cache.blocks(1).at(1), first_blocks.at(1));
+  ASSERT_EQ(kv_cache.block_ref(first_blocks.at(0)), 2);
+  ASSERT_TRUE(kv_cache.reserve(1, static_cast<int32_t>(other.size())));
+  ASSERT_EQ(kv_cache.physical_pos(1, 8), kv_cache.blocks(1).at(2) * block_size);
+
+  // the last token is always prefilled, so a prompt of exactly the cached blocks matches one less
+  std::vector<int32_t> exact{1, 2, 3, 4, 5, 6, 7, 8};
+  ASSERT_EQ(prefix_cache.match(exact, 0), 4);
+  kv_cache.release(0);
+
+  // the blocks in use by slot 1 can not be evicted
+  ASSERT_FALSE(prefix_cache.evict(8));
+  kv_cache.release(1);
+  ASSERT_TRUE(prefix_cache.evict(8));
+  ASSERT_EQ(prefix_cache.cached_block_num(), 0);
+  ASSERT_EQ(kv_cache.free_block_num(), 8);
+}
@@ -0,0 +1,50 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <vector>
+#include "../utils/toy_model.h"
+#include "model/prompt_lookup.h"
+
+TEST(test_prompt_lookup, longest_suffix) {
+  // the suffix 4 5 recurs once, the suffix 5 alone twice
+  const std::vector<int32_t> history = {1, 5, 9, 4, 5, 6, 7, 8, 4, 5};
+  ASSERT_EQ(model::lookup_ngram_draft(history, 1, 3, 3), std::vector<int32_t>({6, 7, 8}));
+  ASSERT_EQ(model::lookup_ngram_draft(history, 1, 1, 3), std::vector<int32_t>({6, 7, 8}));
+}
+
+TEST(test_prompt_lookup, latest_match) {
+  const std::vector<int32_t> history = {3, 1, 3, 2, 3};
+  ASSERT_EQ(model::lookup_ngram_draft(history, 1, 2, 2), std::vector<int32_t>({2, 3}));
+}
+
+TEST(test_prompt_lookup, draft_is_cut) {
+  // the continuation runs into the suffix itself and stops at the end of the history
+  const std::vector<int32_t> history = {7, 7, 7};
+  ASSERT_EQ(model::lookup_ngram_draft(history, 1, 2, 4), std::vector<int32_t>({7}));
+}
+
+TEST(test_prompt_lookup, no_match) {
+  const std::vector<int32_t> history = {1, 2, 3, 4};
+  ASSERT_TRUE(model::lookup_ngram_draft(history, 1, 3, 4).empty());
+  ASSERT_TRUE(model::lookup_ngram_draft({1}, 1, 3, 4).empty());
+  // a match shorter than min_ngram is not used
+  ASSERT_TRUE(model::lookup_ngram_draft({2, 9, 3, 9}, 2, 3, 4).empty());
+}
+
+TEST(test_prompt_lookup, max_new_tokens) {
+  test::ToyModelFiles files("prompt_lookup", test::toy_model_config());
+  auto model = files.create_model();
+  ASSERT_TRUE(model->init(base::DeviceType::kDeviceCPU));
+  // the repeats let the drafts run up to the limit
+  const std::vector<int32_t> prompt = {1, 5, 6, 7, 8, 5, 6, 7, 8, 5, 6};
+  const std::vector<int32_t> reference = test::greedy_reference(*model, prompt, 16);
+  ASSERT_EQ(reference.size(), 16);
+
+  model::PromptLookupDecoder decoder(*model, 4);
+  for (int32_t max_new_tokens = 1; max_new_tokens <= 16; ++max_new_tokens) {
+    std::vector<int32_t> output_tokens;
+    ASSERT_TRUE(decoder.generate(prompt, max_new_tokens, output_tokens));
+    ASSERT_EQ(output_tokens,
+              std::vector<int32_t>(reference.begin(), reference.begin() + max_new_tokens));
+  }
+  ASSERT_GT(decoder.accepted_num(), 0);
+}
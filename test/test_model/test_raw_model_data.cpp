@@ -0,0 +1,81 @@
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <cstdio>
+#include <vector>
+#include "model/raw_model_data.h"
+
+static void map_and_check(const model::WeightLoadOptions& options) {
+  const std::string path = "./tmp_raw_model_data.bin";
+  std::vector<float> values(3 * 1024 * 1024 / sizeof(float) + 7);
+  for (size_t i = 0; i < values.size(); ++i) {
+    values[i] = float(i % 1000) * 0.5f;
+  }
+  FILE* file = fopen(path.data(), "wb");
+  ASSERT_NE(file, nullptr);
+  ASSERT_EQ(fwrite(values.data(), sizeof(float), values.size(), file), values.size());
+  fclose(file);
+
+  {
+    model::RawModelDataFp32 raw_data;
+    raw_data.fd = open(path.data(), O_RDONLY);
+    ASSERT_NE(raw_data.fd, -1);
+    raw_data.file_size = values.size() * sizeof(float);
+    ASSERT_TRUE(raw_data.map(options));
+    ASSERT_GE(raw_data.map_size, raw_data.file_size);
+    raw_data.weight_data = raw_data.data;
+    if (options.huge_page) {
+      ASSERT_EQ(reinterpret_cast<uintptr_t>(raw_data.data) % (2 << 20), 0);
+    }
+    for (size_t i = 0; i < values.size(); i += 97) {
+      ASSERT_EQ(*static_cast<const float*>(raw_data.weight(i)), values[i]);
+    }
+    ASSERT_EQ(*static_cast<const float*>(raw_data.weight(values.size() - 1)), values.back());
+  }
+  remove(path.data());
+}
+
+TEST(test_raw_model_data, map_lazy) { map_and_check(model::WeightLoadOptions{}); }
+
+TEST(test_raw_model_data, map_populate_lock) {
+  model::WeightLoadOptions options;
+  options.populate = true;
+  options.lock = true;
+  map_and_check(options);
+}
+
+TEST(test_raw_model_data, map_huge_page) {
+  model::WeightLoadOptions options;
+  options.huge_page = true;
+  map_and_check(options);
+}
+
+TEST(test_raw_model_data, device_ptr_alignment) {
+  const std::string path = "./tmp_raw_model_data_device.bin";
+  std::vector<float> values(4096);
+  FILE* file = fopen(path.data(), "wb");
+  ASSERT_NE(file, nullptr);
+  ASSERT_EQ(fwrite(values.data(), sizeof(float), values.size(), file), values.size());
+  fclose(file);
+  {
+    model::RawModelDataFp32 raw_data;
+    raw_data.fd = open(path.data(), O_RDONLY);
+    ASSERT_NE(raw_data.fd, -1);
+    raw_data.file_size = values.size() * sizeof(float);
+    model::WeightLoadOptions options;
+    options.unified_memory = true;
+    ASSERT_TRUE(raw_data.map(options));
+    if (raw_data.device_data == nullptr) {
+      GTEST_SKIP() << "The mapping can not be registered with a cuda device.";
+    }
+    const auto* begin = static_cast<const uint8_t*>(raw_data.data);
+    const auto* device_begin = static_cast<const uint8_t*>(raw_data.device_data);
+    ASSERT_EQ(raw_data.device_ptr(begin + 64, 256), device_begin + 64);
+    // the weights after the 28 bytes of the config of an fp32 file are copied
+    ASSERT_EQ(raw_data.device_ptr(begin + 28, 256), nullptr);
+    ASSERT_EQ(raw_data.device_ptr(begin + 8, 256), nullptr);
+    ASSERT_EQ(raw_data.device_ptr(begin + raw_data.file_size - 16, 32), nullptr);
+  }
+  remove(path.data());
+}
@@ -0,0 +1,172 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "base/half.h"
+#include "model/safetensors.h"
+
+namespace {
+struct TestTensor {
+  std::string name;
+  std::string dtype;
+  std::vector<int32_t> shape;
+  std::vector<uint8_t> data;
+};
+
+std::vector<uint8_t> bf16_data(const std::vector<float>& values) {
+  std::vector<uint8_t> data(values.size() * sizeof(uint16_t));
+  for (size_t i = 0; i < values.size(); ++i) {
+    const uint16_t bf16 = base::float_to_bf16(values[i]);
+    memcpy(data.data() + i * sizeof(uint16_t), &bf16, sizeof(uint16_t));
+  }
+  return data;
+}
+
+std::vector<uint8_t> fp32_data(const std::vector<float>& values) {
+  std::vector<uint8_t> data(values.size() * sizeof(float));
+  memcpy(data.data(), values.data(), data.size());
+  return data;
+}
+
+// a shard as the safetensors library writes it, the header is padded to 8 bytes
+void write_shard(const std::string& path, const std::vector<TestTensor>& tensors) {
+  std::string header = "{\"__metadata__\":{\"format\":\"pt\"}";
+  size_t offset = 0;
+  for (const TestTensor& tensor : tensors) {
+    header += ",\"" + tensor.name + "\":{\"dtype\":\"" + tensor.dtype + "\",\"shape\":[";
+    for (size_t i = 0; i < tensor.shape.size(); ++i) {
+      header += (i == 0 ? "" : ",") + std::to_string(tensor.shape[i]);
+    }
+    header += "],\"data_offsets\":[" + std::to_string(offset) + "," +
+              std::to_string(offset + tensor.data.size()) + "]}";
+    offset += tensor.data.size();
+  }
+  header += "}";
+  header.resize((header.size() + 7) / 8 * 8, ' ');
+  FILE* file = fopen(path.data(), "wb");
+  const uint64_t header_size = header.size();
+  fwrite(&header_size, sizeof(header_size), 1, file);
+  fwrite(header.data(), 1, header.size(), file);
+  for (const TestTensor& tensor : tensors) {
+    fwrite(tensor.data.data(), 1, tensor.data.size(), file);
+  }
+  fclose(file);
+}
+
+// a checkpoint directory with the config.json of a small llama model, removed at the end
+class ModelDir {
+ public:
+  explicit ModelDir(const std::string& name)
+      : dir_("/tmp/kuiper_safetensors_" + name + "_" + std::to_string(getpid())) {
+    mkdir(dir_.data(), 0755);
+    FILE* config = fopen((dir_ + "/config.json").data(), "w");
+    fputs(
+        "{\"model_type\":\"llama\",\"hidden_size\":4,\"intermediate_size\":8,"
+        "\"num_hidden_layers\":1,\"num_attention_heads\":2,\"num_key_value_heads\":1,"
+        "\"max_position_embeddings\":131072,\"rope_theta\":500000.0}",
+        config);
+    fclose(config);
+  }
+
+  ~ModelDir() {
+    for (const std::string& name : files_) {
+      remove((dir_ + "/" + name).data());
+    }
+    remove((dir_ + "/config.json").data());
+    rmdir(dir_.data());
+  }
+
+  std::string add_shard(const std::string& name, const std::vector<TestTensor>& tensors) {
+    files_.push_back(name);
+    write_shard(dir_ + "/" + name, tensors);
+    return dir_ + "/" + name;
+  }
+
+  const std::string& path() const { return dir_; }
+
+ private:
+  std::string dir_;
+  std::vector<std::string> files_;
+};
+}  // namespace
+
+TEST(test_safetensors, sharded_bf16_model) {
+  using namespace base;
+  ModelDir dir("sharded");
+  std::vector<float> query(16);
+  std::vector<float> embedding(32);
+  for (size_t i = 0; i < query.size(); ++i) {
+    query[i] = static_cast<float>(i) * 0.25f - 2.f;
+  }
+  for (size_t i = 0; i < embedding.size(); ++i) {
+    embedding[i] = static_cast<float>(i) * 0.5f;
+  }
+  dir.add_shard("model-00001-of-00002.safetensors",
+                {{"model.embed_tokens.weight", "BF16", {8, 4}, bf16_data(embedding)},
+                 {"model.layers.0.self_attn.q_proj.weight", "BF16", {4, 4}, bf16_data(query)}});
+  dir.add_shard("model-00002-of-00002.safetensors",
+                {{"model.norm.weight", "F32", {4}, fp32_data({1.f, 2.f, 3.f, 4.f})},
+                 {"model.layers.0.self_attn.rotary_emb.inv_freq", "F32", {2},
+                  fp32_data({1.f, 2.f})}});
+
+  ASSERT_TRUE(model::is_safetensors_path(dir.path()));
+  model::RawModelDataSafetensors raw_data;
+  model::TensorDirectory directory;
+  model::SafetensorsModelInfo info;
+  auto status = model::load_safetensors_model(dir.path(), model::WeightLoadOptions{}, raw_data,
+                                              directory, info);
+  ASSERT_TRUE(status);
+
+  ASSERT_EQ(raw_data.shards.size(), 2);
+  EXPECT_EQ(info.weight_data_type, DataType::kDataTypeBf16);
+  EXPECT_EQ(info.config.dim, 4);
+  EXPECT_EQ(info.config.hidden_dim, 8);
+  EXPECT_EQ(info.config.kv_head_num, 1);
+  // no lm_head, the classifier shares the embedding
+  EXPECT_EQ(info.config.vocab_size, 8);
+  EXPECT_EQ(info.config.seq_len, model::kSafetensorsMaxSeqLen);
+  EXPECT_FLOAT_EQ(info.rope_theta, 500000.f);
+  EXPECT_TRUE(info.is_rope_rotate_half);
+
+  // the bf16 tensors are viewed in the mapped shard
+  const model::TensorInfo* wq = directory.find("layers.0.attention.wq.weight");
+  ASSERT_NE(wq, nullptr);
+  const auto* shard_begin = static_cast<const uint8_t*>(raw_data.shards[0]->data);
+  const auto* wq_data = static_cast<const uint8_t*>(wq->data);
+  EXPECT_GE(wq_data, shard_begin);
+  EXPECT_LT(wq_data, shard_begin + raw_data.shards[0]->file_size);
+  EXPECT_EQ(wq->dims, std::vector<int32_t>({4, 4}));
+  for (size_t i = 0; i < query.size(); ++i) {
+    uint16_t value = 0;
+    memcpy(&value, wq_data + i * sizeof(uint16_t), sizeof(uint16_t));
+    EXPECT_FLOAT_EQ(bf16_to_float(value), query[i]);
+  }
+
+  // the fp32 norm follows the weight type
+  const model::TensorInfo* norm = directory.find("norm.weight");
+  ASSERT_NE(norm, nullptr);
+  EXPECT_EQ(norm->data_type, DataType::kDataTypeBf16);
+  EXPECT_EQ(norm->byte_size, 4 * sizeof(uint16_t));
+  ASSERT_EQ(raw_data.converted.size(), 1);
+  EXPECT_EQ(norm->data, raw_data.converted[0].data());
+  const auto* norm_data = static_cast<const uint16_t*>(norm->data);
+  EXPECT_FLOAT_EQ(bf16_to_float(norm_data[3]), 4.f);
+
+  EXPECT_EQ(directory.find("layers.0.rotary_emb.inv_freq"), nullptr);
+}
+
+TEST(test_safetensors, truncated_shard) {
+  ModelDir dir("truncated");
+  const std::string path = dir.add_shard(
+      "model.safetensors", {{"model.norm.weight", "F32", {8}, fp32_data({1.f, 2.f, 3.f, 4.f})}});
+  model::RawModelDataSafetensors raw_data;
+  model::TensorDirectory directory;
+  model::SafetensorsModelInfo info;
+  auto status =
+      model::load_safetensors_model(path, model::WeightLoadOptions{}, raw_data, directory, info);
+  EXPECT_FALSE(status);
+}
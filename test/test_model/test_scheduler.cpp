@@ -0,0 +1,200 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <vector>
+#include "../utils/toy_model.h"
+#include "base/metrics.h"
+#include "model/scheduler.h"
+
+namespace {
+// counts the samples of the model around an argmax sampler
+class CountingSampler : public sampler::Sampler {
+ public:
+  explicit CountingSampler(int32_t* sample_num)
+      : Sampler(base::DeviceType::kDeviceCPU),
+        sampler_(base::DeviceType::kDeviceCPU),
+        sample_num_(sample_num) {}
+
+  size_t sample(const float* logits, size_t size, void* stream) override {
+    *sample_num_ += 1;
+    return sampler_.sample(logits, size, stream);
+  }
+
+ private:
+  sampler::ArgmaxSampler sampler_;
+  int32_t* sample_num_ = nullptr;
+};
+
+// an argmax sampler whose samples all fail
+class FailingSampler : public sampler::ArgmaxSampler {
+ public:
+  FailingSampler() : ArgmaxSampler(base::DeviceType::kDeviceCPU) {}
+
+  base::Status last_status() const override {
+    return base::error::InternalError("The sample failed.");
+  }
+};
+
+// the finished sequences by their seq id
+std::vector<model::Sequence> run_to_end(model::Scheduler& scheduler) {
+  while (scheduler.has_unfinished()) {
+    CHECK(scheduler.step());
+  }
+  std::vector<model::Sequence> finished = scheduler.pop_finished();
+  std::sort(finished.begin(), finished.end(),
+            [](const model::Sequence& a, const model::Sequence& b) { return a.seq_id < b.seq_id; });
+  return finished;
+}
+
+int64_t counter_value(const std::string& name) {
+  return base::MetricsRegistry::global().counter(name, "")->value();
+}
+
+// three sequences which take 12 blocks of 4 positions at their end in a cache of 8 blocks, the
+// ones admitted last are preempted as the batch grows
+struct PreemptionRun {
+  std::vector<std::vector<int32_t>> references;
+  std::vector<model::Sequence> finished;
+  int32_t sample_num = 0;
+  int64_t preemption_num = 0;
+  int64_t prefill_token_num = 0;
+};
+
+PreemptionRun run_with_preemption(const std::string& name, size_t max_swap_byte_size) {
+  test::ToyModelFiles files(name, test::toy_model_config());
+  auto model = files.create_model();
+  model->set_max_batch_size(3);
+  model->set_kv_cache_blocks(4, 8);
+  CHECK(model->init(base::DeviceType::kDeviceCPU));
+  const std::vector<std::vector<int32_t>> prompts = {
+      {1, 5, 9, 12, 7}, {1, 25, 3, 14, 8}, {1, 30, 4, 18, 22}};
+  const int32_t max_new_tokens = 10;
+  PreemptionRun run;
+  for (const std::vector<int32_t>& prompt : prompts) {
+    run.references.push_back(test::greedy_reference(*model, prompt, max_new_tokens));
+  }
+
+  model->set_sampler(std::make_unique<CountingSampler>(&run.sample_num));
+  model::Scheduler scheduler(*model);
+  scheduler.set_host_kv_swap(max_swap_byte_size);
+  for (const std::vector<int32_t>& prompt : prompts) {
+    scheduler.add_sequence(prompt, max_new_tokens);
+  }
+  const int64_t preemption_num = counter_value("kuiper_preemptions_total");
+  const int64_t prefill_token_num = counter_value("kuiper_prefill_tokens_total");
+  run.finished = run_to_end(scheduler);
+  run.preemption_num = counter_value("kuiper_preemptions_total") - preemption_num;
+  run.prefill_token_num = counter_value("kuiper_prefill_tokens_total") - prefill_token_num;
+  return run;
+}
+
+void check_outputs(const PreemptionRun& run) {
+  ASSERT_EQ(run.finished.size(), run.references.size());
+  for (int32_t i = 0; i < run.references.size(); ++i) {
+    ASSERT_EQ(run.finished.at(i).output_tokens, run.references.at(i));
+  }
+  // a preempted sequence keeps the token it sampled last, nothing is sampled twice
+  ASSERT_EQ(run.sample_num, run.references.size() * run.references.front().size());
+  ASSERT_GT(run.preemption_num, 0);
+}
+}  // namespace
+
+TEST(test_scheduler, chunked_prefill) {
+  test::ToyModelFiles files("scheduler_chunks", test::toy_model_config());
+  auto model = files.create_model();
+  model->set_max_batch_size(2);
+  ASSERT_TRUE(model->init(base::DeviceType::kDeviceCPU));
+  const std::vector<std::vector<int32_t>> prompts = {{1, 5, 9, 12, 7, 30, 4, 18, 22, 6, 11},
+                                                     {1, 25, 3, 14, 8}};
+  const int32_t max_new_tokens = 6;
+  std::vector<std::vector<int32_t>> references;
+  for (const std::vector<int32_t>& prompt : prompts) {
+    references.push_back(test::greedy_reference(*model, prompt, max_new_tokens));
+  }
+
+  int32_t sample_num = 0;
+  model->set_sampler(std::make_unique<CountingSampler>(&sample_num));
+  model::Scheduler scheduler(*model);
+  scheduler.set_prefill_chunk_size(3);
+  for (const std::vector<int32_t>& prompt : prompts) {
+    scheduler.add_sequence(prompt, max_new_tokens);
+  }
+  const std::vector<model::Sequence> finished = run_to_end(scheduler);
+  ASSERT_EQ(finished.size(), prompts.size());
+  for (int32_t i = 0; i < prompts.size(); ++i) {
+    ASSERT_EQ(finished.at(i).output_tokens, references.at(i));
+  }
+  // the chunks before the last one of a prompt are not sampled, every other sample is an output
+  ASSERT_EQ(sample_num, prompts.size() * max_new_tokens);
+}
+
+TEST(test_scheduler, preemption_prefills_again) {
+  const PreemptionRun run = run_with_preemption("scheduler_prefill_again", 0);
+  check_outputs(run);
+  // the prompts and the outputs of the preempted sequences are prefilled again
+  ASSERT_GT(run.prefill_token_num, 15);
+}
+
+TEST(test_scheduler, preemption_swaps) {
+  const PreemptionRun run = run_with_preemption("scheduler_swap", 1 << 24);
+  check_outputs(run);
+  // the swapped kv is restored, only the prompts are prefilled
+  ASSERT_EQ(run.prefill_token_num, 15);
+}
+
+TEST(test_scheduler, preemption_swap_budget) {
+  // the budget is smaller than the kv of any sequence, which is prefilled again instead
+  const PreemptionRun run = run_with_preemption("scheduler_swap_budget", 1);
+  check_outputs(run);
+  ASSERT_GT(run.prefill_token_num, 15);
+}
+
+TEST(test_scheduler, prefix_cache) {
+  test::ToyModelFiles files("scheduler_prefix", test::toy_model_config());
+  auto model = files.create_model();
+  model->set_max_batch_size(1);
+  model->set_kv_cache_blocks(4, 8);
+  ASSERT_TRUE(model->init(base::DeviceType::kDeviceCPU));
+  const std::vector<std::vector<int32_t>> prompts = {{1, 5, 9, 12, 7, 30, 4, 18, 22, 6},
+                                                     {1, 5, 9, 12, 7, 30, 4, 18, 3, 14, 8}};
+  const int32_t max_new_tokens = 8;
+  std::vector<std::vector<int32_t>> references;
+  for (const std::vector<int32_t>& prompt : prompts) {
+    references.push_back(test::greedy_reference(*model, prompt, max_new_tokens));
+  }
+
+  // the prompts run one at a time, the later ones share the blocks which the earlier ones cached
+  model->set_prefix_cache(16);
+  model::Scheduler scheduler(*model);
+  for (int32_t round = 0; round < 2; ++round) {
+    for (const std::vector<int32_t>& prompt : prompts) {
+      scheduler.add_sequence(prompt, max_new_tokens);
+    }
+  }
+  const int64_t prefill_token_num = counter_value("kuiper_prefill_tokens_total");
+  const std::vector<model::Sequence> finished = run_to_end(scheduler);
+  ASSERT_EQ(finished.size(), 2 * prompts.size());
+  for (int32_t i = 0; i < finished.size(); ++i) {
+    ASSERT_EQ(finished.at(i).output_tokens, references.at(i % prompts.size()));
+  }
+  // the first prompt is prefilled whole, the later ones after their cached blocks of 4 tokens
+  ASSERT_EQ(counter_value("kuiper_prefill_tokens_total") - prefill_token_num, 10 + 3 + 2 + 3);
+}
+
+TEST(test_scheduler, failed_prefill) {
+  test::ToyModelFiles files("scheduler_failed", test::toy_model_config());
+  auto model = files.create_model();
+  ASSERT_TRUE(model->init(base::DeviceType::kDeviceCPU));
+  model->set_sampler(std::make_unique<FailingSampler>());
+  model::Scheduler scheduler(*model);
+  const int32_t seq_id = scheduler.add_sequence({1, 5, 9, 12, 7}, 4);
+  ASSERT_FALSE(scheduler.step());
+
+  // the sequence is handed back as failed and not as cancelled
+  ASSERT_FALSE(scheduler.has_unfinished());
+  const std::vector<model::Sequence> finished = scheduler.pop_finished();
+  ASSERT_EQ(finished.size(), 1);
+  ASSERT_EQ(finished.at(0).seq_id, seq_id);
+  ASSERT_TRUE(finished.at(0).is_failed);
+  ASSERT_FALSE(finished.at(0).is_cancelled);
+}
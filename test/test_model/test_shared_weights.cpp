@@ -0,0 +1,47 @@
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include "../utils/matmul_layers.h"
+#include "model/shared_weights.h"
+
+TEST(test_shared_weights, export_fused_layers) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  const int32_t dim = 64;
+  const int32_t out_dim = 32;
+  const std::string handle_path = "/tmp/kuiper_shared_weights_" + std::to_string(getpid());
+
+  auto config = std::make_shared<kernel::CudaConfig>();
+  cudaStreamCreate(&config->stream);
+  test::MatmulLayers matmul_layers = test::constant_matmul_layers(2, out_dim, dim, config);
+  std::vector<std::shared_ptr<op::MatmulLayer>>& layers = matmul_layers.layers;
+  // the parts of the fused weight are views into it and are placed with it
+  auto fused = op::MatmulLayer::fuse(layers, alloc_cpu);
+  std::vector<std::shared_ptr<op::Layer>> shared_layers{layers.at(0), layers.at(1), fused};
+
+  model::SharedWeights owner(handle_path, true);
+  ASSERT_TRUE(owner.bind(shared_layers));
+  ASSERT_EQ(owner.byte_size(), 2 * out_dim * dim * sizeof(float));
+  ASSERT_EQ(access(handle_path.c_str(), F_OK), 0);
+
+  tensor::Tensor input = test::cuda_ones(dim, config->stream);
+  for (int32_t layer_idx = 0; layer_idx < 2; ++layer_idx) {
+    ASSERT_EQ(layers.at(layer_idx)->get_weight(0).device_type(), base::DeviceType::kDeviceCUDA);
+    tensor::Tensor output(base::DataType::kDataTypeFp32, out_dim, true, alloc_cu);
+    ASSERT_TRUE(shared_layers.at(layer_idx)->forward(input, output));
+    cudaStreamSynchronize(config->stream);
+    output.to_cpu();
+    for (int32_t i = 0; i < out_dim; ++i) {
+      ASSERT_NEAR(output.index<float>(i), float(layer_idx + 1) * dim, 1e-3f);
+    }
+  }
+
+  // a process with other layers must not attach to the exported weights
+  tensor::Tensor other_weight(base::DataType::kDataTypeFp32, out_dim, out_dim, true, alloc_cpu);
+  auto other = std::make_shared<op::MatmulLayer>(base::DeviceType::kDeviceCUDA, out_dim, out_dim);
+  other->set_weight(0, {out_dim, out_dim}, other_weight.ptr<float>(),
+                    base::DeviceType::kDeviceCPU);
+  model::SharedWeights attached(handle_path, false);
+  ASSERT_FALSE(attached.bind({other}));
+}
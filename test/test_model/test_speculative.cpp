@@ -0,0 +1,49 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <vector>
+#include "../utils/toy_model.h"
+#include "model/speculative.h"
+
+// the output of every length up to 16 is the greedy decode of the target alone
+static void expect_target_output(const model::Model& target, model::SpeculativeDecoder& decoder) {
+  const std::vector<int32_t> prompt = {1, 5, 6, 7, 8, 9};
+  const std::vector<int32_t> reference = test::greedy_reference(target, prompt, 16);
+  ASSERT_EQ(reference.size(), 16);
+  for (int32_t max_new_tokens = 1; max_new_tokens <= 16; ++max_new_tokens) {
+    std::vector<int32_t> output_tokens;
+    ASSERT_TRUE(decoder.generate(prompt, max_new_tokens, output_tokens));
+    ASSERT_EQ(output_tokens,
+              std::vector<int32_t>(reference.begin(), reference.begin() + max_new_tokens));
+  }
+}
+
+TEST(test_speculative, draft_of_the_target) {
+  test::ToyModelFiles files("speculative_same", test::toy_model_config());
+  auto draft = files.create_model();
+  auto target = files.create_model();
+  ASSERT_TRUE(draft->init(base::DeviceType::kDeviceCPU));
+  ASSERT_TRUE(target->init(base::DeviceType::kDeviceCPU));
+
+  // every proposal is accepted, so the drafts run up to the limit
+  model::SpeculativeDecoder decoder(*draft, *target, 4);
+  expect_target_output(*target, decoder);
+  ASSERT_EQ(decoder.accepted_num(), decoder.proposed_num());
+  ASSERT_GT(decoder.accepted_num(), 0);
+}
+
+TEST(test_speculative, draft_of_other_weights) {
+  test::ToyModelFiles draft_files("speculative_draft", test::toy_model_config(), 2);
+  test::ToyModelFiles target_files("speculative_target", test::toy_model_config(), 1);
+  auto draft = draft_files.create_model();
+  auto target = target_files.create_model();
+  ASSERT_TRUE(draft->init(base::DeviceType::kDeviceCPU));
+  ASSERT_TRUE(target->init(base::DeviceType::kDeviceCPU));
+
+  model::SpeculativeDecoder decoder(*draft, *target, 3);
+  expect_target_output(*target, decoder);
+  ASSERT_LT(decoder.accepted_num(), decoder.proposed_num());
+
+  std::vector<int32_t> output_tokens;
+  ASSERT_FALSE(decoder.generate({1, 2}, 0, output_tokens));
+  ASSERT_FALSE(decoder.generate({}, 4, output_tokens));
+}
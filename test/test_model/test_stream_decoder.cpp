@@ -0,0 +1,60 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+#include "model/stream_decoder.h"
+
+namespace {
+// the pieces of a small vocab, the token 0 is a control token and the tokens from 10 on are
+// the single bytes 0x80 + token - 10 of the byte fallback
+model::StreamDecoder vocab_decoder() {
+  static const std::vector<std::string> pieces = {"", " hello", " world", "\xC3", "\xE4\xBD",
+                                                  "\xA0", "\xF0\x9F", "\x98", "\x80", "!"};
+  return model::StreamDecoder([](int32_t token, bool is_first) -> std::string {
+    std::string bytes = token < 10 ? pieces.at(token)
+                                   : std::string(1, static_cast<char>(0x80 + token - 10));
+    if (is_first && !bytes.empty() && bytes.front() == ' ') {
+      bytes.erase(0, 1);
+    }
+    return bytes;
+  });
+}
+}  // namespace
+
+TEST(test_stream_decoder, utf8_complete_size) {
+  ASSERT_EQ(model::utf8_complete_size(""), 0);
+  ASSERT_EQ(model::utf8_complete_size("ab"), 2);
+  ASSERT_EQ(model::utf8_complete_size("a\xC3"), 1);
+  ASSERT_EQ(model::utf8_complete_size("a\xC3\xA9"), 3);
+  ASSERT_EQ(model::utf8_complete_size("\xE4\xBD"), 0);
+  ASSERT_EQ(model::utf8_complete_size("\xF0\x9F\x98"), 0);
+  ASSERT_EQ(model::utf8_complete_size("\xF0\x9F\x98\x80"), 4);
+  // the stray continuation bytes are not held back
+  ASSERT_EQ(model::utf8_complete_size("a\x80\x80\x80\x80"), 5);
+}
+
+TEST(test_stream_decoder, hold_back_split_characters) {
+  model::StreamDecoder decoder = vocab_decoder();
+  // the control token writes nothing and the space of the first piece is dropped
+  ASSERT_EQ(decoder.push(0), "");
+  ASSERT_EQ(decoder.push(1), "hello");
+  ASSERT_EQ(decoder.push(2), " world");
+  // U+4F60 in two tokens
+  ASSERT_EQ(decoder.push(4), "");
+  ASSERT_EQ(decoder.push(5), "\xE4\xBD\xA0");
+  // U+1F600 in three tokens, the last byte from the byte fallback
+  ASSERT_EQ(decoder.push(std::vector<int32_t>{6, 7}), "");
+  ASSERT_EQ(decoder.push(10), "\xF0\x9F\x98\x80");
+  ASSERT_EQ(decoder.push(9), "!");
+  ASSERT_EQ(decoder.finish(), "");
+}
+
+TEST(test_stream_decoder, finish_and_reset) {
+  model::StreamDecoder decoder = vocab_decoder();
+  ASSERT_EQ(decoder.push(std::vector<int32_t>{1, 3}), "hello");
+  // the character never completes
+  ASSERT_EQ(decoder.finish(), "\xEF\xBF\xBD");
+  ASSERT_EQ(decoder.finish(), "");
+  decoder.reset();
+  ASSERT_EQ(decoder.push(2), "world");
+}
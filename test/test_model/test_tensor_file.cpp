@@ -0,0 +1,90 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "model/tensor_file.h"
+
+static model::TensorFileEntry make_entry(const char* name, std::vector<int32_t> dims,
+                                         int64_t offset) {
+  model::TensorFileEntry entry;
+  strncpy(entry.name, name, model::kTensorFileNameSize - 1);
+  entry.data_type = static_cast<int32_t>(base::DataType::kDataTypeFp32);
+  entry.dim_num = static_cast<int32_t>(dims.size());
+  int64_t size = 1;
+  for (size_t i = 0; i < dims.size(); ++i) {
+    entry.dims[i] = dims[i];
+    size *= dims[i];
+  }
+  entry.offset = offset;
+  entry.byte_size = size * static_cast<int64_t>(sizeof(float));
+  return entry;
+}
+
+static FILE* write_tensor_file(const std::vector<model::TensorFileEntry>& entries) {
+  FILE* file = tmpfile();
+  model::TensorFileHeader header;
+  header.config.dim = 8;
+  header.config.layer_num = 1;
+  header.weight_data_type = static_cast<int32_t>(base::DataType::kDataTypeFp32);
+  header.tensor_num = static_cast<int32_t>(entries.size());
+  fwrite(&header, sizeof(header), 1, file);
+  fwrite(entries.data(), sizeof(model::TensorFileEntry), entries.size(), file);
+  std::vector<char> data(3 * model::kTensorFileAlignment - ftell(file), 0);
+  fwrite(data.data(), 1, data.size(), file);
+  fflush(file);
+  return file;
+}
+
+TEST(test_tensor_file, read_directory) {
+  const size_t file_size = 3 * model::kTensorFileAlignment;
+  std::vector<model::TensorFileEntry> entries = {
+      make_entry("tok_embeddings.weight", {16, 8}, model::kTensorFileAlignment),
+      make_entry(model::layer_tensor_name(0, "attention_norm.weight").data(), {8},
+                 2 * model::kTensorFileAlignment)};
+  FILE* file = write_tensor_file(entries);
+
+  model::TensorDirectory directory;
+  bool is_tensor_file = false;
+  ASSERT_TRUE(directory.read(file, file_size, is_tensor_file));
+  ASSERT_TRUE(is_tensor_file);
+  ASSERT_EQ(directory.header().config.dim, 8);
+
+  const model::TensorInfo* embedding = directory.find("tok_embeddings.weight");
+  ASSERT_NE(embedding, nullptr);
+  ASSERT_EQ(embedding->dims, (std::vector<int32_t>{16, 8}));
+  ASSERT_EQ(embedding->offset, model::kTensorFileAlignment);
+  ASSERT_EQ(embedding->size(), 128);
+  const model::TensorInfo* norm = directory.find("layers.0.attention_norm.weight");
+  ASSERT_NE(norm, nullptr);
+  ASSERT_EQ(norm->offset, 2 * model::kTensorFileAlignment);
+  ASSERT_EQ(directory.find("norm.weight"), nullptr);
+  fclose(file);
+}
+
+TEST(test_tensor_file, reject_unaligned) {
+  const size_t file_size = 3 * model::kTensorFileAlignment;
+  FILE* file = write_tensor_file({make_entry("norm.weight", {8}, 1000)});
+  model::TensorDirectory directory;
+  bool is_tensor_file = false;
+  ASSERT_FALSE(directory.read(file, file_size, is_tensor_file));
+  fclose(file);
+
+  file = write_tensor_file({make_entry("norm.weight", {8}, 3 * model::kTensorFileAlignment)});
+  ASSERT_FALSE(directory.read(file, file_size, is_tensor_file));
+  fclose(file);
+}
+
+TEST(test_tensor_file, legacy_file) {
+  FILE* file = tmpfile();
+  model::ModelConfig config;
+  config.dim = 16;
+  fwrite(&config, sizeof(config), 1, file);
+  fflush(file);
+  model::TensorDirectory directory;
+  bool is_tensor_file = true;
+  ASSERT_TRUE(directory.read(file, sizeof(config), is_tensor_file));
+  ASSERT_FALSE(is_tensor_file);
+  ASSERT_TRUE(directory.empty());
+  fclose(file);
+}
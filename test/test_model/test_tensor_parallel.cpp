@@ -0,0 +1,130 @@
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include "../utils/toy_model.h"
+#include "model/tensor_parallel.h"
+
+namespace {
+// the logits of step_num decode steps after the prompt, every step takes the token which the
+// model sampled last
+std::vector<std::vector<float>> decode_logits(const model::Model& model,
+                                              const std::vector<int32_t>& prompt,
+                                              int32_t step_num, std::vector<int32_t>& tokens) {
+  tensor::Tensor pos_tensor(base::DataType::kDataTypeInt32, 1, true,
+                            base::CPUDeviceAllocatorFactory::get_instance());
+  pos_tensor.index<int32_t>(0) = 0;
+  int32_t next = -1;
+  CHECK(model.prefill(model.embedding(prompt).input_embeddings, pos_tensor, next));
+  std::vector<std::vector<float>> step_logits;
+  for (int32_t step = 0; step < step_num; ++step) {
+    tokens.push_back(next);
+    pos_tensor.index<int32_t>(0) = static_cast<int32_t>(prompt.size()) + step;
+    CHECK(model.predict(model.embedding({next}).input_embeddings, pos_tensor, false, next));
+    const tensor::Tensor& logits = model.get_buffer(model::ModelBufferType::kForwardOutput);
+    std::vector<float> output(logits.size());
+    cudaDeviceSynchronize();
+    cudaMemcpy(output.data(), logits.ptr<float>(), logits.byte_size(), cudaMemcpyDefault);
+    step_logits.push_back(std::move(output));
+  }
+  return step_logits;
+}
+}  // namespace
+
+TEST(test_tensor_parallel, shard_range) {
+  const model::ShardRange first = model::shard_range(12, 0, 4);
+  EXPECT_EQ(first.begin, 0);
+  EXPECT_EQ(first.size, 3);
+  const model::ShardRange last = model::shard_range(12, 3, 4);
+  EXPECT_EQ(last.begin, 9);
+  EXPECT_EQ(last.size, 3);
+}
+
+TEST(test_tensor_parallel, slice_columns) {
+  // a [3, 4] matrix split into two column halves
+  std::vector<float> matrix(12);
+  for (int32_t i = 0; i < 12; ++i) {
+    matrix[i] = static_cast<float>(i);
+  }
+  const model::ShardRange range = model::shard_range(4, 1, 2);
+  std::vector<uint8_t> slice = model::slice_columns(matrix.data(), 3, 4, sizeof(float), range);
+  ASSERT_EQ(slice.size(), 3 * 2 * sizeof(float));
+  const float* values = reinterpret_cast<const float*>(slice.data());
+  const std::vector<float> expected = {2.f, 3.f, 6.f, 7.f, 10.f, 11.f};
+  for (int32_t i = 0; i < 6; ++i) {
+    EXPECT_FLOAT_EQ(values[i], expected[i]);
+  }
+
+  // 16 bit elements are copied as they are
+  std::vector<uint16_t> half_matrix = {1, 2, 3, 4, 5, 6};
+  slice = model::slice_columns(half_matrix.data(), 2, 3, sizeof(uint16_t),
+                               model::ShardRange{2, 1});
+  ASSERT_EQ(slice.size(), 2 * sizeof(uint16_t));
+  const uint16_t* half_values = reinterpret_cast<const uint16_t*>(slice.data());
+  EXPECT_EQ(half_values[0], 3);
+  EXPECT_EQ(half_values[1], 6);
+}
+
+TEST(test_tensor_parallel, invalid_rank) {
+  std::unique_ptr<model::TensorParallelGroup> group;
+  auto status = model::TensorParallelGroup::create(2, 2, "/tmp/kuiper_nccl_id", group);
+  EXPECT_FALSE(status);
+  EXPECT_EQ(group, nullptr);
+}
+
+#ifdef KUIPER_USE_NCCL
+TEST(test_tensor_parallel, sharded_logits_match_the_model) {
+  int device_num = 0;
+  cudaGetDeviceCount(&device_num);
+  if (device_num < 2) {
+    GTEST_SKIP() << "The tensor parallel needs two cuda devices.";
+  }
+  test::ToyModelFiles files("tensor_parallel", test::toy_model_config());
+  const std::vector<int32_t> prompt = {1, 5, 9, 12, 7};
+  const int32_t step_num = 16;
+  auto model = files.create_model();
+  ASSERT_TRUE(model->init(base::DeviceType::kDeviceCUDA));
+  std::vector<int32_t> tokens;
+  const std::vector<std::vector<float>> logits = decode_logits(*model, prompt, step_num, tokens);
+
+  // the ranks block in init until both have joined, so each one runs on its own thread
+  const std::string id_path = "/tmp/kuiper_test_nccl_id";
+  std::remove(id_path.c_str());
+  const int32_t world_size = 2;
+  std::vector<std::vector<std::vector<float>>> rank_logits(world_size);
+  std::vector<std::vector<int32_t>> rank_tokens(world_size);
+  std::vector<std::thread> threads;
+  for (int32_t rank = 0; rank < world_size; ++rank) {
+    threads.emplace_back([&, rank] {
+      auto rank_model = files.create_model();
+      rank_model->set_tensor_parallel(rank, world_size, id_path);
+      CHECK(rank_model->init(base::DeviceType::kDeviceCUDA));
+      CHECK(rank_model->is_tensor_parallel());
+      rank_logits.at(rank) = decode_logits(*rank_model, prompt, step_num, rank_tokens.at(rank));
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  // no id is left for the next group
+  FILE* id_file = fopen(id_path.c_str(), "rb");
+  EXPECT_EQ(id_file, nullptr);
+  if (id_file) {
+    fclose(id_file);
+  }
+
+  for (int32_t rank = 0; rank < world_size; ++rank) {
+    ASSERT_EQ(rank_tokens.at(rank), tokens);
+    for (int32_t step = 0; step < step_num; ++step) {
+      const std::vector<float>& sharded = rank_logits.at(rank).at(step);
+      ASSERT_EQ(sharded.size(), logits.at(step).size());
+      for (int32_t i = 0; i < sharded.size(); ++i) {
+        ASSERT_NEAR(sharded.at(i), logits.at(step).at(i), 1e-4f)
+            << "rank " << rank << " step " << step << " logit " << i;
+      }
+    }
+  }
+}
+#endif
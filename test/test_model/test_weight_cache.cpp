@@ -0,0 +1,82 @@
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <cstdio>
+#include "../utils/matmul_layers.h"
+#include "model/weight_cache.h"
+#include "op/matmul.h"
+
+namespace {
+constexpr int32_t kDim = 64;
+constexpr int32_t kOutDim = 32;
+
+// the host copy of the output of the layer for an input of ones
+std::vector<float> forward(const std::shared_ptr<op::Layer>& layer, int32_t out_dim,
+                           const std::shared_ptr<kernel::CudaConfig>& config) {
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  tensor::Tensor input = test::cuda_ones(kDim, config->stream);
+  tensor::Tensor output(base::DataType::kDataTypeFp32, out_dim, true, alloc_cu);
+  CHECK(layer->forward(input, output));
+  cudaStreamSynchronize(config->stream);
+  output.to_cpu();
+  return std::vector<float>(output.ptr<float>(), output.ptr<float>() + out_dim);
+}
+}  // namespace
+
+TEST(test_weight_cache, write_then_read) {
+  const std::string cache_path = "/tmp/kuiper_weight_cache_" + std::to_string(getpid());
+  const std::string model_path = cache_path + ".model";
+  FILE* model_file = fopen(model_path.c_str(), "wb");
+  ASSERT_NE(model_file, nullptr);
+  fputs("model", model_file);
+  fclose(model_file);
+  auto config = std::make_shared<kernel::CudaConfig>();
+  cudaStreamCreate(&config->stream);
+
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  {
+    test::MatmulLayers parts = test::constant_matmul_layers(2, kOutDim, kDim, config);
+    std::vector<std::shared_ptr<op::Layer>> layers(parts.layers.begin(), parts.layers.end());
+    model::WeightCache cache(cache_path);
+    cache.open(model_path, layers);
+    ASSERT_FALSE(cache.is_hit());
+    layers.push_back(op::MatmulLayer::fuse(parts.layers, alloc_cpu, true));
+    ASSERT_TRUE(cache.bind(layers, config->stream));
+    ASSERT_EQ(cache.byte_size(), 2 * kOutDim * kDim * sizeof(float));
+    ASSERT_EQ(access(cache_path.c_str(), F_OK), 0);
+  }
+
+  // the weights of the second init are other values, so the outputs can only come from the
+  // image, and the fused weight is never filled on the host
+  test::MatmulLayers parts = test::constant_matmul_layers(2, kOutDim, kDim, config, -5.f);
+  std::vector<std::shared_ptr<op::Layer>> layers(parts.layers.begin(), parts.layers.end());
+  model::WeightCache cache(cache_path);
+  cache.open(model_path, layers);
+  ASSERT_TRUE(cache.is_hit());
+  layers.push_back(op::MatmulLayer::fuse(parts.layers, alloc_cpu, false));
+  ASSERT_TRUE(cache.bind(layers, config->stream));
+  for (int32_t layer_idx = 0; layer_idx < 2; ++layer_idx) {
+    ASSERT_EQ(parts.layers.at(layer_idx)->get_weight(0).device_type(),
+              base::DeviceType::kDeviceCUDA);
+    const std::vector<float> output = forward(layers.at(layer_idx), kOutDim, config);
+    for (float value : output) {
+      ASSERT_NEAR(value, float(layer_idx + 1) * kDim, 1e-3f);
+    }
+  }
+  const std::vector<float> fused_output = forward(layers.at(2), 2 * kOutDim, config);
+  for (int32_t i = 0; i < 2 * kOutDim; ++i) {
+    ASSERT_NEAR(fused_output.at(i), float(i / kOutDim + 1) * kDim, 1e-3f);
+  }
+
+  // layers of another shape do not match the key of the image
+  tensor::Tensor other_weight(base::DataType::kDataTypeFp32, kOutDim, kOutDim, true, alloc_cpu);
+  auto other = std::make_shared<op::MatmulLayer>(base::DeviceType::kDeviceCUDA, kOutDim, kOutDim);
+  other->set_weight(0, {kOutDim, kOutDim}, other_weight.ptr<float>(),
+                    base::DeviceType::kDeviceCPU);
+  model::WeightCache other_cache(cache_path);
+  other_cache.open(model_path, {other});
+  ASSERT_FALSE(other_cache.is_hit());
+  std::remove(cache_path.c_str());
+  std::remove(model_path.c_str());
+}
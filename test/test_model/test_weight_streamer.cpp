@@ -0,0 +1,45 @@
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "../utils/matmul_layers.h"
+#include "model/weight_streamer.h"
+
+TEST(test_weight_streamer, stream_through_window) {
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  const int32_t dim = 64;
+  const int32_t out_dim = 32;
+  const int32_t layer_num = 3;
+
+  auto config = std::make_shared<kernel::CudaConfig>();
+  cudaStreamCreate(&config->stream);
+  test::MatmulLayers matmul_layers =
+      test::constant_matmul_layers(layer_num, out_dim, dim, config);
+  std::vector<std::shared_ptr<op::Layer>> layers;
+  model::WeightStreamer streamer;
+  for (int32_t layer_idx = 0; layer_idx < layer_num; ++layer_idx) {
+    std::shared_ptr<op::Layer> layer = matmul_layers.layers.at(layer_idx);
+    streamer.add_layer(layer_idx, {layer});
+    layers.push_back(layer);
+  }
+  ASSERT_TRUE(streamer.is_streamed(layer_num - 1));
+  ASSERT_EQ(streamer.window_byte_size(), 2 * out_dim * dim * sizeof(float));
+
+  tensor::Tensor input = test::cuda_ones(dim, config->stream);
+  // two passes, the window wraps around to the first layer in between
+  std::vector<tensor::Tensor> outputs;
+  for (int32_t step = 0; step < 2 * layer_num; ++step) {
+    const int32_t layer_idx = step % layer_num;
+    streamer.acquire(layer_idx, config->stream);
+    tensor::Tensor output(base::DataType::kDataTypeFp32, out_dim, true, alloc_cu);
+    ASSERT_TRUE(layers.at(layer_idx)->forward(input, output));
+    outputs.push_back(output);
+  }
+  cudaStreamSynchronize(config->stream);
+  for (int32_t step = 0; step < outputs.size(); ++step) {
+    tensor::Tensor& output = outputs.at(step);
+    output.to_cpu();
+    for (int32_t i = 0; i < out_dim; ++i) {
+      ASSERT_NEAR(output.index<float>(i), float(step % layer_num + 1) * dim, 1e-3f);
+    }
+  }
+}
@@ -0,0 +1,158 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <cmath>
+#include <random>
+#include "../source/op/kernels/cpu/gemv_kernel.h"
+#include "../source/op/kernels/kernels_interface.h"
+#include "base/buffer.h"
+#include "base/thread_pool.h"
+TEST(test_matmul_cpu, gemv_simd) {
+  // the row and column numbers leave tails for the four row and the vector loops
+  for (int32_t rows : {1, 37, 1030}) {
+    for (int32_t cols : {7, 133, 1024}) {
+      std::vector<float> input(cols);
+      std::vector<float> weight(rows * cols);
+      std::vector<float> output(rows);
+      for (int32_t i = 0; i < cols; ++i) {
+        input.at(i) = float(i % 5) - 2.f;
+      }
+      for (int32_t i = 0; i < rows * cols; ++i) {
+        weight.at(i) = float(i % 13) - 6.f;
+      }
+      kernel::gemv_kernel_cpu(input.data(), weight.data(), output.data(), rows, cols, 0.5f);
+      for (int32_t row = 0; row < rows; ++row) {
+        float sum = 0.f;
+        for (int32_t i = 0; i < cols; ++i) {
+          sum += weight.at(row * cols + i) * input.at(i);
+        }
+        ASSERT_NEAR(output.at(row), sum * 0.5f, 1e-3f) << kernel::gemv_isa_name();
+      }
+    }
+  }
+}
+
+TEST(test_matmul_cpu, gemm_blocked) {
+  // the input rows leave an odd row and a partial block, the weight rows a partial tile
+  for (int32_t in_rows : {3, 35}) {
+    for (int32_t rows : {37, 1030}) {
+      for (int32_t cols : {7, 128}) {
+        std::vector<float> input(in_rows * cols);
+        std::vector<float> weight(rows * cols);
+        std::vector<float> output(in_rows * rows);
+        for (int32_t i = 0; i < in_rows * cols; ++i) {
+          input.at(i) = float(i % 5) - 2.f;
+        }
+        for (int32_t i = 0; i < rows * cols; ++i) {
+          weight.at(i) = float(i % 13) - 6.f;
+        }
+        kernel::gemm_kernel_cpu(input.data(), weight.data(), output.data(), in_rows, rows, cols,
+                                0.5f);
+        std::vector<float> expected(rows);
+        for (int32_t n = 0; n < in_rows; ++n) {
+          kernel::gemv_kernel_cpu(input.data() + n * cols, weight.data(), expected.data(), rows,
+                                  cols, 0.5f);
+          for (int32_t row = 0; row < rows; ++row) {
+            ASSERT_NEAR(output.at(n * rows + row), expected.at(row), 1e-3f)
+                << kernel::gemv_isa_name();
+          }
+        }
+
+        // the int8 rows are quantized like the rows of the gemv, so the sums are the same
+        if (cols % 32 == 0) {
+          std::vector<int8_t> weight_q8(rows * cols);
+          std::vector<float> scales(rows * cols / 32);
+          for (int32_t i = 0; i < rows * cols; ++i) {
+            weight_q8.at(i) = static_cast<int8_t>(i % 251 - 125);
+          }
+          for (size_t i = 0; i < scales.size(); ++i) {
+            scales.at(i) = 0.01f * float(i % 7 + 1);
+          }
+          kernel::gemm_q8_kernel_cpu(input.data(), weight_q8.data(), scales.data(),
+                                     output.data(), in_rows, rows, cols, 32);
+          for (int32_t n = 0; n < in_rows; ++n) {
+            kernel::gemv_q8_kernel_cpu(input.data() + n * cols, weight_q8.data(), scales.data(),
+                                       expected.data(), rows, cols, 32);
+            for (int32_t row = 0; row < rows; ++row) {
+              ASSERT_FLOAT_EQ(output.at(n * rows + row), expected.at(row))
+                  << kernel::gemv_q8_isa_name();
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST(test_matmul_cpu, matmul_qint8) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const int32_t dim = 256;
+  const int32_t hidden_dim = 37;
+  const int32_t group_size = 64;
+  const int32_t group_num = 2 * hidden_dim * dim / group_size;
+  tensor::Tensor weight(base::DataType::kDataTypeInt8, 2 * hidden_dim, dim, true, alloc_cpu);
+  tensor::Tensor scale(base::DataType::kDataTypeFp32, group_num, true, alloc_cpu);
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  std::uniform_int_distribution<int32_t> int_dist(-127, 127);
+  for (int32_t i = 0; i < weight.size(); ++i) {
+    weight.index<int8_t>(i) = static_cast<int8_t>(int_dist(mt));
+  }
+  for (int32_t i = 0; i < group_num; ++i) {
+    scale.index<float>(i) = 1e-3f * (1.f + dist(mt) * 0.5f);
+  }
+
+  // one row goes through the gemv, more rows through the gemm
+  for (int32_t rows : {1, 3}) {
+    tensor::Tensor input(base::DataType::kDataTypeFp32, rows, dim, true, alloc_cpu);
+    for (int32_t i = 0; i < input.size(); ++i) {
+      input.index<float>(i) = dist(mt);
+    }
+    tensor::Tensor out(base::DataType::kDataTypeFp32, rows, 2 * hidden_dim, true, alloc_cpu);
+    tensor::Tensor swiglu(base::DataType::kDataTypeFp32, rows, hidden_dim, true, alloc_cpu);
+    kernel::get_matmul_kernel_quant8(base::DeviceType::kDeviceCPU)(input, weight, out,
+                                                                   group_size, scale, nullptr);
+    kernel::get_matmul_swiglu_kernel_quant8(base::DeviceType::kDeviceCPU)(
+        input, weight, swiglu, group_size, scale, nullptr);
+
+    // the input is quantized by the weight groups, so the sums only agree to its precision
+    auto dot = [&](int32_t r, int32_t o) {
+      float sum = 0.f;
+      for (int32_t i = 0; i < dim; ++i) {
+        const int32_t weight_idx = o * dim + i;
+        sum += input.index<float>(r * dim + i) * scale.index<float>(weight_idx / group_size) *
+               static_cast<float>(weight.index<int8_t>(weight_idx));
+      }
+      return sum;
+    };
+    for (int32_t r = 0; r < rows; ++r) {
+      for (int32_t o = 0; o < hidden_dim; ++o) {
+        const float gate = dot(r, o);
+        const float up = dot(r, hidden_dim + o);
+        ASSERT_NEAR(out.index<float>(r * 2 * hidden_dim + o), gate, 1e-2f)
+            << kernel::gemv_q8_isa_name();
+        ASSERT_NEAR(out.index<float>(r * 2 * hidden_dim + hidden_dim + o), up, 1e-2f);
+        ASSERT_NEAR(swiglu.index<float>(r * hidden_dim + o),
+                    gate / (1.f + std::exp(-gate)) * up, 1e-2f);
+      }
+    }
+  }
+}
+
+TEST(test_matmul_cpu, gemv_place_rows) {
+  const int32_t rows = 1030;
+  const int32_t cols = 133;
+  std::vector<int8_t> weight(rows * cols);
+  for (int32_t i = 0; i < rows * cols; ++i) {
+    weight.at(i) = static_cast<int8_t>(i % 251 - 125);
+  }
+  std::vector<int8_t> placed(rows * cols, 0);
+  kernel::gemv_place_rows_cpu(weight.data(), placed.data(), rows, cols, sizeof(int8_t));
+  ASSERT_EQ(placed, weight);
+
+  // the node number stays one where the sysfs has a single node or none
+  auto* pool = base::ThreadPoolFactory::get_instance();
+  const int32_t node_num = pool->pin_to_numa_nodes();
+  ASSERT_EQ(node_num, std::max<int32_t>(base::numa_node_cpus().size(), 1));
+  ASSERT_EQ(pool->numa_node_num(), node_num);
+}
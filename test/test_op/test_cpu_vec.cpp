@@ -0,0 +1,45 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include "../source/op/kernels/cpu/vec_kernel.h"
+TEST(test_vec_cpu, vec_kernels) {
+  // the sizes leave a tail behind the widest vectors
+  for (int32_t size : {1, 7, 16, 37, 151 * 32 + 5}) {
+    std::mt19937 mt(size);
+    std::uniform_real_distribution<float> dist(-20.f, 20.f);
+    std::vector<float> gate(size);
+    std::vector<float> up(size);
+    for (int32_t i = 0; i < size; ++i) {
+      gate[i] = dist(mt);
+      up[i] = dist(mt);
+    }
+
+    std::vector<float> output(size);
+    kernel::swiglu_row_kernel_cpu(gate.data(), up.data(), output.data(), size);
+    for (int32_t i = 0; i < size; ++i) {
+      const float expect = gate[i] / (1.f + std::exp(-gate[i])) * up[i];
+      ASSERT_NEAR(output[i], expect, 1e-5f * std::max(std::fabs(expect), 1.f))
+          << kernel::vec_isa_name();
+    }
+
+    std::vector<float> softmax = gate;
+    kernel::softmax_row_kernel_cpu(softmax.data(), size);
+    const float max_value = *std::max_element(gate.begin(), gate.end());
+    double sum = 0.0;
+    for (int32_t i = 0; i < size; ++i) {
+      sum += std::exp(static_cast<double>(gate[i] - max_value));
+    }
+    for (int32_t i = 0; i < size; ++i) {
+      const double expect = std::exp(static_cast<double>(gate[i] - max_value)) / sum;
+      ASSERT_NEAR(softmax[i], expect, 1e-5 * expect + 1e-12) << kernel::vec_isa_name();
+    }
+
+    double square_sum = 0.0;
+    for (int32_t i = 0; i < size; ++i) {
+      square_sum += static_cast<double>(gate[i]) * gate[i];
+    }
+    ASSERT_NEAR(kernel::square_sum_kernel_cpu(gate.data(), size), square_sum, 1e-5 * square_sum);
+  }
+}
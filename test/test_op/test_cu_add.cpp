@@ -4,6 +4,7 @@
 #include "../source/op/kernels/kernels_interface.h"
 #include "../utils.cuh"
 #include "base/buffer.h"
+#include "op/add.h"
 TEST(test_add_cu, add1_nostream) {
   auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
 
@@ -73,4 +74,33 @@ TEST(test_add_cu, add_align1) {
   }
 
   delete[] output;
-}
\ No newline at end of file
+}
+TEST(test_add_cu, add_layer_check_disabled) {
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  auto config = std::make_shared<kernel::CudaConfig>();
+  op::VecAddLayer add_layer(base::DeviceType::kDeviceCUDA);
+  add_layer.set_cuda_config(config);
+
+  int32_t size = 32 * 151;
+  tensor::Tensor t1(base::DataType::kDataTypeFp32, size, true, alloc_cu);
+  tensor::Tensor t2(base::DataType::kDataTypeFp32, size, true, alloc_cu);
+  tensor::Tensor out(base::DataType::kDataTypeFp32, size, true, alloc_cu);
+  tensor::Tensor short_out(base::DataType::kDataTypeFp32, size / 2, true, alloc_cu);
+  set_value_cu(static_cast<float*>(t1.get_buffer()->ptr()), size, 2.f);
+  set_value_cu(static_cast<float*>(t2.get_buffer()->ptr()), size, 3.f);
+
+  // the checked forward rejects the output of the wrong size
+  ASSERT_TRUE(add_layer.is_check_enabled());
+  ASSERT_FALSE(add_layer.forward(t1, t2, short_out));
+
+  // the execution plan checked the operands already, the kernel runs right away
+  add_layer.set_check_enabled(false);
+  ASSERT_TRUE(add_layer.forward(t1, t2, out));
+  cudaDeviceSynchronize();
+  float* output = new float[size];
+  cudaMemcpy(output, out.ptr<float>(), size * sizeof(float), cudaMemcpyDeviceToHost);
+  for (int i = 0; i < size; ++i) {
+    ASSERT_EQ(output[i], 5.f);
+  }
+  delete[] output;
+}
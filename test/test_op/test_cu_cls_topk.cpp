@@ -0,0 +1,125 @@
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <random>
+#include "../source/op/kernels/cuda/cls_topk_kernel.cuh"
+#include "sampler/random_sampler.h"
+#include "tensor/tensor.h"
+
+namespace {
+constexpr int32_t kVocabSize = 1000;
+constexpr int32_t kDim = 64;
+
+struct ClsTopK {
+  tensor::Tensor input;
+  tensor::Tensor weight;
+  std::vector<float> logits;
+};
+
+// the vocab is not a multiple of the rows of a block, so the last block is partial
+ClsTopK make_cls_topk() {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  std::mt19937 mt(3);
+  std::uniform_real_distribution<float> dist(-0.5f, 0.5f);
+  ClsTopK cls;
+  cls.input = tensor::Tensor(base::DataType::kDataTypeFp32, kDim, true, alloc_cpu);
+  cls.weight = tensor::Tensor(base::DataType::kDataTypeFp32, kVocabSize, kDim, true, alloc_cpu);
+  for (int32_t i = 0; i < kDim; ++i) {
+    cls.input.index<float>(i) = dist(mt);
+  }
+  for (int32_t i = 0; i < kVocabSize * kDim; ++i) {
+    cls.weight.index<float>(i) = dist(mt);
+  }
+  cls.logits.assign(kVocabSize, 0.f);
+  for (int32_t row = 0; row < kVocabSize; ++row) {
+    for (int32_t col = 0; col < kDim; ++col) {
+      cls.logits[row] += cls.weight.index<float>(row * kDim + col) * cls.input.index<float>(col);
+    }
+  }
+  cls.input.to_cuda();
+  cls.weight.to_cuda();
+  return cls;
+}
+}  // namespace
+
+TEST(test_cls_topk_cu, topk_and_lse) {
+  ClsTopK cls = make_cls_topk();
+  const int32_t k = 8;
+  float* values_cu = nullptr;
+  int32_t* indices_cu = nullptr;
+  void* workspace_cu = nullptr;
+  cudaMalloc(&values_cu, (k + 1) * sizeof(float));
+  cudaMalloc(&indices_cu, k * sizeof(int32_t));
+  cudaMalloc(&workspace_cu, kernel::cls_topk_workspace_byte_size(kVocabSize));
+  kernel::cls_topk_kernel_cu(cls.input, cls.weight, k, values_cu, indices_cu, workspace_cu,
+                             nullptr);
+  std::vector<float> values(k + 1);
+  std::vector<int32_t> indices(k);
+  cudaMemcpy(values.data(), values_cu, values.size() * sizeof(float), cudaMemcpyDeviceToHost);
+  cudaMemcpy(indices.data(), indices_cu, indices.size() * sizeof(int32_t),
+             cudaMemcpyDeviceToHost);
+
+  std::vector<int32_t> order(kVocabSize);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+                   [&](int32_t a, int32_t b) { return cls.logits[a] > cls.logits[b]; });
+  for (int32_t j = 0; j < k; ++j) {
+    ASSERT_EQ(indices[j], order[j]);
+    ASSERT_NEAR(values[j], cls.logits[order[j]], 1e-4f);
+  }
+  const float max_logit = cls.logits[order[0]];
+  float sum = 0.f;
+  for (float logit : cls.logits) {
+    sum += std::exp(logit - max_logit);
+  }
+  ASSERT_NEAR(values[k], max_logit + std::log(sum), 1e-3f);
+  cudaFree(values_cu);
+  cudaFree(indices_cu);
+  cudaFree(workspace_cu);
+}
+
+TEST(test_cls_topk_cu, sample_candidates) {
+  ClsTopK cls = make_cls_topk();
+  sampler::SamplingParams params;
+  params.temperature = 0.8f;
+  params.top_k = 16;
+  params.seed = 5;
+  sampler::RandomSampler sampler(base::DeviceType::kDeviceCUDA, params);
+  const int32_t k = sampler.candidate_num();
+  ASSERT_EQ(k, params.top_k);
+
+  float* values_cu = nullptr;
+  int32_t* indices_cu = nullptr;
+  int32_t* output_cu = nullptr;
+  void* workspace_cu = nullptr;
+  cudaMalloc(&values_cu, (k + 1) * sizeof(float));
+  cudaMalloc(&indices_cu, k * sizeof(int32_t));
+  cudaMalloc(&output_cu, sizeof(int32_t));
+  cudaMalloc(&workspace_cu, kernel::cls_topk_workspace_byte_size(kVocabSize));
+  kernel::cls_topk_kernel_cu(cls.input, cls.weight, k, values_cu, indices_cu, workspace_cu,
+                             nullptr);
+
+  std::vector<float> sorted = cls.logits;
+  std::sort(sorted.begin(), sorted.end(), std::greater<float>());
+  bool all_same = true;
+  int32_t first = -1;
+  for (int i = 0; i < 64; ++i) {
+    ASSERT_TRUE(sampler.sample_candidates_device(values_cu, indices_cu, output_cu, nullptr));
+    int32_t next = -1;
+    cudaMemcpy(&next, output_cu, sizeof(int32_t), cudaMemcpyDeviceToHost);
+    ASSERT_GE(next, 0);
+    ASSERT_LT(next, kVocabSize);
+    // the draws are tokens of the vocab from the top-k, not positions in the candidates
+    ASSERT_GE(cls.logits[next], sorted[k - 1]);
+    first = i == 0 ? next : first;
+    all_same &= next == first;
+  }
+  ASSERT_FALSE(all_same);
+  cudaFree(values_cu);
+  cudaFree(indices_cu);
+  cudaFree(output_cu);
+  cudaFree(workspace_cu);
+}
@@ -1,6 +1,7 @@
 #include <cuda_runtime_api.h>
 #include <glog/logging.h>
 #include <gtest/gtest.h>
+#include "../source/op/kernels/cuda/emb_kernel.cuh"
 #include "../source/op/kernels/kernels_interface.h"
 #include "base/buffer.h"
 TEST(test_emb_cu, emb1_nostream) {
@@ -87,3 +88,194 @@ TEST(test_emb_cu, emb1_stream) {
 
   cudaStreamDestroy(stream);
 }
+
+TEST(test_emb_cu, emb_device_token) {
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+
+  int32_t token = 4;
+  int32_t dim = 512;
+  int32_t size = 2048;
+
+  // the token and the position of a decode step which stay on the device
+  tensor::Tensor input(base::DataType::kDataTypeInt32, 1, true, alloc_cpu);
+  input.index<int32_t>(0) = 3;
+  input.to_cuda();
+  tensor::Tensor pos(base::DataType::kDataTypeInt32, 1, true, alloc_cpu);
+  pos.index<int32_t>(0) = 5;
+  pos.to_cuda();
+  tensor::Tensor tokens(base::DataType::kDataTypeInt32, 8, true, alloc_cu);
+
+  tensor::Tensor weight(base::DataType::kDataTypeFp32, token, dim, true, alloc_cpu);
+  tensor::Tensor output(base::DataType::kDataTypeFp32, dim, true, alloc_cu);
+  for (int i = 0; i < size; ++i) {
+    weight.index<float>(i) = static_cast<float>(i);
+  }
+  weight.to_cuda();
+  kernel::get_emb_kernel(base::DeviceType::kDeviceCUDA)(input, weight, output, token,
+                                                        nullptr);
+  kernel::advance_token_kernel_cu(input, pos, tokens);
+  // the token at the end of the sequence is not stored
+  kernel::advance_token_kernel_cu(input, pos, tokens);
+  kernel::advance_token_kernel_cu(input, pos, tokens);
+
+  output.to_cpu();
+  for (int i = 0; i < dim; ++i) {
+    ASSERT_EQ(output.index<float>(i), 1536 + i);
+  }
+  pos.to_cpu();
+  tokens.to_cpu();
+  ASSERT_EQ(pos.index<int32_t>(0), 8);
+  ASSERT_EQ(tokens.index<int32_t>(6), 3);
+  ASSERT_EQ(tokens.index<int32_t>(7), 3);
+}
+
+TEST(test_emb_cu, emb_packed_batch) {
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+
+  int32_t token = 4;
+  int32_t dim = 64;
+  // the tokens of several prompts, more than the blocks of the kernel
+  int32_t token_num = 1500;
+
+  tensor::Tensor input(base::DataType::kDataTypeInt32, token_num, true, alloc_cpu);
+  for (int i = 0; i < token_num; ++i) {
+    input.index<int32_t>(i) = i % token;
+  }
+  tensor::Tensor weight(base::DataType::kDataTypeFp32, token, dim, true, alloc_cpu);
+  for (int i = 0; i < token * dim; ++i) {
+    weight.index<float>(i) = static_cast<float>(i);
+  }
+  weight.to_cuda();
+  tensor::Tensor output(base::DataType::kDataTypeFp32, token_num, dim, true, alloc_cu);
+  kernel::get_emb_kernel(base::DeviceType::kDeviceCUDA)(input, weight, output, token,
+                                                        nullptr);
+
+  output.to_cpu();
+  for (int i = 0; i < token_num; ++i) {
+    for (int j = 0; j < dim; ++j) {
+      ASSERT_EQ(output.index<float>(i * dim + j), (i % token) * dim + j);
+    }
+  }
+}
+
+TEST(test_emb_cu, emb_device_stop) {
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+
+  tensor::Tensor token(base::DataType::kDataTypeInt32, 1, true, alloc_cu);
+  tensor::Tensor pos(base::DataType::kDataTypeInt32, 1, true, alloc_cu);
+  tensor::Tensor tokens(base::DataType::kDataTypeInt32, 16, true, alloc_cu);
+  tensor::Tensor stop_table(base::DataType::kDataTypeInt32,
+                            kernel::kMaxStopSequenceNum * kernel::kStopSequenceWidth, true,
+                            alloc_cu);
+  tensor::Tensor stop_state(base::DataType::kDataTypeInt32, kernel::kStopStateSize, true,
+                            alloc_cu);
+
+  // the stop sequence 7 8 and a limit of 5 tokens, the decode samples after position 2
+  std::vector<int32_t> table(stop_table.size(), 0);
+  table[0] = 2;
+  table[1] = 7;
+  table[2] = 8;
+  std::vector<int32_t> state = {0, 5, 3, -1};
+  int32_t start_pos = 2;
+  cudaMemcpy(const_cast<int32_t*>(stop_table.ptr<int32_t>()), table.data(),
+             table.size() * sizeof(int32_t), cudaMemcpyHostToDevice);
+  cudaMemcpy(const_cast<int32_t*>(stop_state.ptr<int32_t>()), state.data(),
+             state.size() * sizeof(int32_t), cudaMemcpyHostToDevice);
+  cudaMemcpy(const_cast<int32_t*>(pos.ptr<int32_t>()), &start_pos, sizeof(int32_t),
+             cudaMemcpyHostToDevice);
+  // a 7 at the position of the input, which belongs to the prompt
+  std::vector<int32_t> stored(tokens.size(), 0);
+  stored[2] = 7;
+  cudaMemcpy(const_cast<int32_t*>(tokens.ptr<int32_t>()), stored.data(),
+             stored.size() * sizeof(int32_t), cudaMemcpyHostToDevice);
+
+  // the first 8 does not stop, only the sampled tokens are matched, and the tokens sampled
+  // behind the stop are dropped
+  const std::vector<int32_t> sampled = {8, 7, 8, 9, 9};
+  for (int32_t next : sampled) {
+    cudaMemcpy(const_cast<int32_t*>(token.ptr<int32_t>()), &next, sizeof(int32_t),
+               cudaMemcpyHostToDevice);
+    kernel::advance_token_stop_kernel_cu(token, pos, tokens, stop_table, stop_state);
+  }
+
+  int32_t end_pos = 0;
+  int32_t end_token = 0;
+  cudaMemcpy(&end_pos, pos.ptr<int32_t>(), sizeof(int32_t), cudaMemcpyDeviceToHost);
+  cudaMemcpy(&end_token, token.ptr<int32_t>(), sizeof(int32_t), cudaMemcpyDeviceToHost);
+  cudaMemcpy(state.data(), stop_state.ptr<int32_t>(), state.size() * sizeof(int32_t),
+             cudaMemcpyDeviceToHost);
+  cudaMemcpy(stored.data(), tokens.ptr<int32_t>(), stored.size() * sizeof(int32_t),
+             cudaMemcpyDeviceToHost);
+  ASSERT_EQ(state[kernel::kStopReason], 1);
+  ASSERT_EQ(state[kernel::kStopPos], 5);
+  ASSERT_EQ(state[kernel::kStopRemaining], 3);
+  ASSERT_EQ(end_pos, 5);
+  ASSERT_EQ(end_token, 8);
+  ASSERT_EQ(stored[3], 8);
+  ASSERT_EQ(stored[4], 7);
+  ASSERT_EQ(stored[5], 8);
+  ASSERT_EQ(stored[6], 0);
+
+  // the limit stops the decode at the last token it allows
+  state = {0, 2, 6, -1};
+  cudaMemcpy(const_cast<int32_t*>(stop_state.ptr<int32_t>()), state.data(),
+             state.size() * sizeof(int32_t), cudaMemcpyHostToDevice);
+  for (int32_t i = 0; i < 3; ++i) {
+    kernel::advance_token_stop_kernel_cu(token, pos, tokens, stop_table, stop_state);
+  }
+  cudaMemcpy(&end_pos, pos.ptr<int32_t>(), sizeof(int32_t), cudaMemcpyDeviceToHost);
+  cudaMemcpy(state.data(), stop_state.ptr<int32_t>(), state.size() * sizeof(int32_t),
+             cudaMemcpyDeviceToHost);
+  ASSERT_EQ(state[kernel::kStopReason], 2);
+  ASSERT_EQ(state[kernel::kStopPos], 7);
+  ASSERT_EQ(end_pos, 7);
+}
+
+TEST(test_emb_cu, emb_device_stop_ring) {
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+
+  tensor::Tensor token(base::DataType::kDataTypeInt32, 1, true, alloc_cu);
+  tensor::Tensor pos(base::DataType::kDataTypeInt32, 1, true, alloc_cu);
+  tensor::Tensor tokens(base::DataType::kDataTypeInt32, 4, true, alloc_cu);
+  tensor::Tensor stop_table(base::DataType::kDataTypeInt32,
+                            kernel::kMaxStopSequenceNum * kernel::kStopSequenceWidth, true,
+                            alloc_cu);
+  tensor::Tensor stop_state(base::DataType::kDataTypeInt32, kernel::kStopStateSize, true,
+                            alloc_cu);
+
+  // the stop sequence 7 8 is sampled at the positions 7 and 8, across the end of the ring
+  std::vector<int32_t> table(stop_table.size(), 0);
+  table[0] = 2;
+  table[1] = 7;
+  table[2] = 8;
+  std::vector<int32_t> state = {0, -1, 3, -1};
+  int32_t start_pos = 2;
+  cudaMemcpy(const_cast<int32_t*>(stop_table.ptr<int32_t>()), table.data(),
+             table.size() * sizeof(int32_t), cudaMemcpyHostToDevice);
+  cudaMemcpy(const_cast<int32_t*>(stop_state.ptr<int32_t>()), state.data(),
+             state.size() * sizeof(int32_t), cudaMemcpyHostToDevice);
+  cudaMemcpy(const_cast<int32_t*>(pos.ptr<int32_t>()), &start_pos, sizeof(int32_t),
+             cudaMemcpyHostToDevice);
+
+  const std::vector<int32_t> sampled = {1, 2, 3, 4, 7, 8, 9};
+  for (int32_t next : sampled) {
+    cudaMemcpy(const_cast<int32_t*>(token.ptr<int32_t>()), &next, sizeof(int32_t),
+               cudaMemcpyHostToDevice);
+    kernel::advance_token_stop_kernel_cu(token, pos, tokens, stop_table, stop_state);
+  }
+
+  int32_t end_pos = 0;
+  std::vector<int32_t> stored(tokens.size(), 0);
+  cudaMemcpy(&end_pos, pos.ptr<int32_t>(), sizeof(int32_t), cudaMemcpyDeviceToHost);
+  cudaMemcpy(state.data(), stop_state.ptr<int32_t>(), state.size() * sizeof(int32_t),
+             cudaMemcpyDeviceToHost);
+  cudaMemcpy(stored.data(), tokens.ptr<int32_t>(), stored.size() * sizeof(int32_t),
+             cudaMemcpyDeviceToHost);
+  ASSERT_EQ(state[kernel::kStopReason], 1);
+  ASSERT_EQ(state[kernel::kStopPos], 8);
+  ASSERT_EQ(end_pos, 8);
+  // the positions 5 to 8 are left in the ring
+  ASSERT_EQ(stored, std::vector<int32_t>({8, 3, 4, 7}));
+}
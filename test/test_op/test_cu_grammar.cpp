@@ -0,0 +1,193 @@
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <cmath>
+#include "../source/op/kernels/cuda/logits_kernel.cuh"
+#include "sampler/argmax_sampler.h"
+#include "sampler/grammar_sampler.h"
+#include "sampler/token_grammar.h"
+#include "tensor/tensor.h"
+
+TEST(test_grammar, regex_dfa) {
+  sampler::ByteDfa dfa;
+  ASSERT_TRUE(sampler::ByteDfa::from_regex("(ab|a)*c", dfa));
+  ASSERT_EQ(dfa.state_num(), 3);
+  ASSERT_TRUE(dfa.matches("c"));
+  ASSERT_TRUE(dfa.matches("ababac"));
+  ASSERT_FALSE(dfa.matches("ab"));
+  ASSERT_FALSE(dfa.matches("abbc"));
+
+  ASSERT_TRUE(sampler::ByteDfa::from_regex("[a-c]+\\d?", dfa));
+  ASSERT_TRUE(dfa.matches("abc1"));
+  ASSERT_FALSE(dfa.matches("1"));
+  ASSERT_FALSE(sampler::ByteDfa::from_regex("(ab", dfa));
+  ASSERT_FALSE(sampler::ByteDfa::from_regex("ab)", dfa));
+  ASSERT_FALSE(sampler::ByteDfa::from_regex("*a", dfa));
+}
+
+TEST(test_grammar, json_value) {
+  sampler::ByteDfa dfa;
+  ASSERT_TRUE(sampler::ByteDfa::from_regex(sampler::json_value_regex(), dfa));
+  ASSERT_TRUE(dfa.matches(R"({"a": [1, 2.5e3, {"b": null}], "c": true})"));
+  ASSERT_TRUE(dfa.matches(R"("x\"y")"));
+  ASSERT_FALSE(dfa.matches("[1,]"));
+  ASSERT_FALSE(dfa.matches("01"));
+}
+
+#if defined(LLAMA3_SUPPORT) || defined(QWEN2_SUPPORT)
+TEST(test_grammar, json_schema) {
+  std::string regex;
+  ASSERT_TRUE(sampler::json_schema_regex(
+      R"({"type": "object", "properties": {"name": {"type": "string"},
+          "age": {"type": "integer"}, "tags": {"type": "array", "items": {"enum": ["a", "b"]}}}})",
+      regex));
+  sampler::ByteDfa dfa;
+  ASSERT_TRUE(sampler::ByteDfa::from_regex(regex, dfa));
+  ASSERT_TRUE(dfa.matches(R"({"name": "x", "age": -12, "tags": ["a", "b"]})"));
+  ASSERT_TRUE(dfa.matches(R"({"name":"","age":0,"tags":[]})"));
+  // the properties keep the declared order
+  ASSERT_FALSE(dfa.matches(R"({"age":0,"name":"","tags":[]})"));
+  ASSERT_FALSE(dfa.matches(R"({"name":"","age":1.5,"tags":[]})"));
+  ASSERT_FALSE(dfa.matches(R"({"name":"","age":1,"tags":["c"]})"));
+}
+#endif
+
+TEST(test_grammar, token_masks) {
+  sampler::ByteDfa dfa;
+  ASSERT_TRUE(sampler::ByteDfa::from_regex("(yes|no)", dfa));
+  const std::vector<std::string> vocab = {"", "y", "ye", "yes", "s", "n", "no", "o", "x", "</s>"};
+  sampler::TokenGrammar grammar(dfa, vocab, {9});
+  ASSERT_EQ(grammar.word_num(), 1);
+
+  int32_t state = grammar.start_state();
+  ASSERT_EQ(grammar.mask(state)[0], 0b0001101110u);
+  state = grammar.advance(state, 2);
+  ASSERT_EQ(grammar.mask(state)[0], 0b0000010000u);
+  ASSERT_EQ(grammar.advance(state, 7), -1);
+  state = grammar.advance(state, 4);
+  ASSERT_TRUE(grammar.is_accepting(state));
+  // only the ending token is left once the output is whole
+  ASSERT_EQ(grammar.mask(state)[0], 0b1000000000u);
+}
+
+TEST(test_grammar, sampler_cpu) {
+  sampler::ByteDfa dfa;
+  ASSERT_TRUE(sampler::ByteDfa::from_regex("(yes|no)", dfa));
+  const std::vector<std::string> vocab = {"", "y", "ye", "yes", "s", "n", "no", "o", "x", "</s>"};
+  auto grammar = std::make_shared<sampler::TokenGrammar>(dfa, vocab, std::vector<int32_t>{9});
+  sampler::GrammarSampler sampler(
+      base::DeviceType::kDeviceCPU, grammar,
+      std::make_unique<sampler::ArgmaxSampler>(base::DeviceType::kDeviceCPU));
+
+  // the model prefers the tokens the grammar does not allow
+  std::vector<float> logits = {9.f, 1.f, 2.f, 0.f, 1.f, 3.f, 0.5f, 4.f, 8.f, 5.f};
+  ASSERT_EQ(sampler.sample(logits.data(), logits.size(), nullptr), 5);
+  ASSERT_EQ(sampler.sample(logits.data(), logits.size(), nullptr), 7);
+  ASSERT_TRUE(sampler.is_accepting());
+  ASSERT_FALSE(sampler.is_finished());
+  ASSERT_EQ(sampler.sample(logits.data(), logits.size(), nullptr), 9);
+  ASSERT_TRUE(sampler.is_finished());
+
+  sampler.reset();
+  ASSERT_EQ(sampler.state(), grammar->start_state());
+  ASSERT_FALSE(sampler.is_finished());
+}
+
+TEST(test_grammar, sampler_slots) {
+  sampler::ByteDfa dfa;
+  ASSERT_TRUE(sampler::ByteDfa::from_regex("(yes|no)", dfa));
+  const std::vector<std::string> vocab = {"", "y", "ye", "yes", "s", "n", "no", "o", "x", "</s>"};
+  auto grammar = std::make_shared<sampler::TokenGrammar>(dfa, vocab, std::vector<int32_t>{9});
+  sampler::GrammarSampler sampler(
+      base::DeviceType::kDeviceCPU, grammar,
+      std::make_unique<sampler::ArgmaxSampler>(base::DeviceType::kDeviceCPU), 2);
+  const std::vector<float> prefer_no = {9.f, 1.f, 2.f, 0.f, 1.f, 3.f, 0.5f, 4.f, 8.f, 5.f};
+  const std::vector<float> prefer_yes = {9.f, 1.f, 2.f, 6.f, 1.f, 3.f, 0.5f, 4.f, 8.f, 5.f};
+
+  // the steps of the two sequences alternate, each one walks its own state
+  sampler.begin_sequence(0, nullptr);
+  ASSERT_EQ(sampler.sample(prefer_no.data(), prefer_no.size(), nullptr), 5);
+  sampler.begin_sequence(1, nullptr);
+  ASSERT_EQ(sampler.sample(prefer_yes.data(), prefer_yes.size(), nullptr), 3);
+  ASSERT_TRUE(sampler.is_accepting());
+  sampler.set_slot(0);
+  ASSERT_FALSE(sampler.is_accepting());
+  ASSERT_EQ(sampler.sample(prefer_no.data(), prefer_no.size(), nullptr), 7);
+  ASSERT_EQ(sampler.sample(prefer_no.data(), prefer_no.size(), nullptr), 9);
+  ASSERT_TRUE(sampler.last_status());
+  ASSERT_TRUE(sampler.is_finished());
+  sampler.set_slot(1);
+  ASSERT_FALSE(sampler.is_finished());
+  ASSERT_EQ(sampler.sample(prefer_yes.data(), prefer_yes.size(), nullptr), 9);
+
+  // a finished slot repeats its ending token with an error instead of sampling
+  sampler.set_slot(0);
+  ASSERT_EQ(sampler.sample(prefer_no.data(), prefer_no.size(), nullptr), 9);
+  ASSERT_FALSE(sampler.last_status());
+
+  // the rejected draft of the slot 1 is walked back to its accepted output
+  ASSERT_TRUE(sampler.reset(1, {5}));
+  ASSERT_FALSE(sampler.is_finished());
+  ASSERT_EQ(sampler.sample(prefer_no.data(), prefer_no.size(), nullptr), 7);
+  ASSERT_TRUE(sampler.last_status());
+  ASSERT_FALSE(sampler.reset(1, {8}));
+  // a reset slot keeps its state through the prefill which starts again
+  ASSERT_TRUE(sampler.reset(0, {5, 7}));
+  sampler.begin_sequence(0, nullptr);
+  ASSERT_TRUE(sampler.is_accepting());
+  sampler.begin_sequence(0, nullptr);
+  ASSERT_EQ(sampler.state(), grammar->start_state());
+}
+
+TEST(test_grammar_cu, token_mask) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const int32_t vocab_size = 1000;
+  const int32_t size = 1024;
+  tensor::Tensor logits(base::DataType::kDataTypeFp32, size, true, alloc_cpu);
+  tensor::Tensor mask(base::DataType::kDataTypeInt32, (vocab_size + 31) / 32, true, alloc_cpu);
+  for (int32_t i = 0; i < size; ++i) {
+    logits.index<float>(i) = static_cast<float>(i);
+  }
+  for (int32_t w = 0; w < mask.size(); ++w) {
+    mask.index<int32_t>(w) = static_cast<int32_t>(0x55555555u);
+  }
+  logits.to_cuda();
+  mask.to_cuda();
+
+  tensor::Tensor output(base::DataType::kDataTypeFp32, size, true, alloc_cpu);
+  output.to_cuda();
+  kernel::token_mask_kernel_cu(logits.ptr<float>(), size,
+                               reinterpret_cast<const uint32_t*>(mask.ptr<int32_t>()), vocab_size,
+                               output.ptr<float>(), nullptr);
+  output.to_cpu();
+  for (int32_t i = 0; i < size; ++i) {
+    if (i < vocab_size && i % 2 == 0) {
+      ASSERT_EQ(output.index<float>(i), static_cast<float>(i));
+    } else {
+      ASSERT_TRUE(std::isinf(output.index<float>(i)));
+    }
+  }
+}
+
+TEST(test_grammar_cu, sampler_cu) {
+  sampler::ByteDfa dfa;
+  ASSERT_TRUE(sampler::ByteDfa::from_regex("(yes|no)", dfa));
+  const std::vector<std::string> vocab = {"", "y", "ye", "yes", "s", "n", "no", "o", "x", "</s>"};
+  auto grammar = std::make_shared<sampler::TokenGrammar>(dfa, vocab, std::vector<int32_t>{9});
+  grammar->to_cuda();
+  sampler::GrammarSampler sampler(
+      base::DeviceType::kDeviceCUDA, grammar,
+      std::make_unique<sampler::ArgmaxSampler>(base::DeviceType::kDeviceCUDA));
+
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  tensor::Tensor logits(base::DataType::kDataTypeFp32, 10, true, alloc_cpu);
+  const std::vector<float> values = {9.f, 1.f, 2.f, 0.f, 1.f, 3.f, 0.5f, 4.f, 8.f, 5.f};
+  for (int32_t i = 0; i < 10; ++i) {
+    logits.index<float>(i) = values.at(i);
+  }
+  logits.to_cuda();
+  ASSERT_EQ(sampler.sample(logits.ptr<float>(), 10, nullptr), 5);
+  ASSERT_EQ(sampler.sample(logits.ptr<float>(), 10, nullptr), 7);
+  ASSERT_EQ(sampler.sample(logits.ptr<float>(), 10, nullptr), 9);
+  ASSERT_TRUE(sampler.is_finished());
+}
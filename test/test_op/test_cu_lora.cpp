@@ -0,0 +1,142 @@
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <random>
+#include "op/matmul.h"
+
+namespace {
+constexpr int32_t kAdapterNum = 2;
+constexpr int32_t kRank = 8;
+constexpr int32_t kInDim = 96;
+constexpr int32_t kOutDim = 80;
+constexpr int32_t kRowNum = 3;
+
+struct LoraCase {
+  tensor::Tensor weight;
+  tensor::Tensor input;
+  std::shared_ptr<op::LoraWeights> lora = std::make_shared<op::LoraWeights>();
+};
+
+LoraCase make_lora_case() {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  std::mt19937 mt(7);
+  std::uniform_real_distribution<float> dist(-0.5f, 0.5f);
+  LoraCase lora_case;
+  lora_case.weight = tensor::Tensor(base::DataType::kDataTypeFp32, kOutDim, kInDim, true, alloc_cpu);
+  lora_case.input = tensor::Tensor(base::DataType::kDataTypeFp32, kRowNum, kInDim, true, alloc_cpu);
+  op::LoraWeights& lora = *lora_case.lora;
+  lora.a = tensor::Tensor(base::DataType::kDataTypeFp32, kAdapterNum, kRank, kInDim, true,
+                          alloc_cpu);
+  lora.b = tensor::Tensor(base::DataType::kDataTypeFp32, kAdapterNum, kRank, kOutDim, true,
+                          alloc_cpu);
+  lora.scales = tensor::Tensor(base::DataType::kDataTypeFp32, kAdapterNum, true, alloc_cpu);
+  for (tensor::Tensor* tensor : {&lora_case.weight, &lora_case.input, &lora.a, &lora.b}) {
+    for (int32_t i = 0; i < tensor->size(); ++i) {
+      tensor->index<float>(i) = dist(mt);
+    }
+  }
+  lora.scales.index<float>(0) = 2.f;
+  lora.scales.index<float>(1) = 0.5f;
+  return lora_case;
+}
+
+// weight @ input + scale * b^T @ (a @ input) of the adapter of every row
+std::vector<float> lora_reference(const LoraCase& lora_case, const std::vector<int32_t>& adapters) {
+  const op::LoraWeights& lora = *lora_case.lora;
+  std::vector<float> output(kRowNum * kOutDim, 0.f);
+  for (int32_t n = 0; n < kRowNum; ++n) {
+    const float* x = lora_case.input.ptr<float>(n * kInDim);
+    for (int32_t k = 0; k < kOutDim; ++k) {
+      for (int32_t i = 0; i < kInDim; ++i) {
+        output[n * kOutDim + k] += lora_case.weight.index<float>(k * kInDim + i) * x[i];
+      }
+    }
+    const int32_t adapter = adapters.at(adapters.size() == 1 ? 0 : n);
+    if (adapter < 0) {
+      continue;
+    }
+    for (int32_t r = 0; r < kRank; ++r) {
+      const float* a = lora.a.ptr<float>((adapter * kRank + r) * kInDim);
+      const float* b = lora.b.ptr<float>((adapter * kRank + r) * kOutDim);
+      float shrunk = 0.f;
+      for (int32_t i = 0; i < kInDim; ++i) {
+        shrunk += a[i] * x[i];
+      }
+      shrunk *= lora.scales.index<float>(adapter);
+      for (int32_t k = 0; k < kOutDim; ++k) {
+        output[n * kOutDim + k] += shrunk * b[k];
+      }
+    }
+  }
+  return output;
+}
+
+std::vector<float> lora_forward(LoraCase& lora_case, const std::vector<int32_t>& adapters,
+                                base::DeviceType device_type) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const bool is_cuda = device_type == base::DeviceType::kDeviceCUDA;
+  op::MatmulLayer layer(device_type, kOutDim, kInDim);
+  layer.set_weight(0, {kOutDim, kInDim}, lora_case.weight.ptr<float>(),
+                   base::DeviceType::kDeviceCPU);
+  auto rows = std::make_shared<op::LoraRows>();
+  rows->adapters = tensor::Tensor(base::DataType::kDataTypeInt32,
+                                  static_cast<int32_t>(adapters.size()), true, alloc_cpu);
+  for (int32_t i = 0; i < adapters.size(); ++i) {
+    rows->adapters.index<int32_t>(i) = adapters.at(i);
+  }
+  // the workspace only holds one row, the prompt of three rows takes a buffer of its own
+  rows->workspace = tensor::Tensor(base::DataType::kDataTypeFp32, 1, kRank, true, alloc_cpu);
+  auto lora = std::make_shared<op::LoraWeights>(*lora_case.lora);
+  tensor::Tensor input = lora_case.input.clone();
+  std::shared_ptr<kernel::CudaConfig> config;
+  if (is_cuda) {
+    config = std::make_shared<kernel::CudaConfig>();
+    cudaStreamCreate(&config->stream);
+    layer.set_cuda_config(config);
+    layer.to_cuda();
+    for (tensor::Tensor* tensor : {&lora->a, &lora->b, &lora->scales, &rows->adapters,
+                                   &rows->workspace, &input}) {
+      *tensor = tensor->clone();
+      tensor->to_cuda(config->stream);
+    }
+  }
+  layer.set_lora(lora, rows);
+  EXPECT_TRUE(layer.has_lora());
+
+  std::shared_ptr<base::DeviceAllocator> alloc =
+      is_cuda ? std::shared_ptr<base::DeviceAllocator>(
+                    base::CUDADeviceAllocatorFactory::get_instance())
+              : alloc_cpu;
+  tensor::Tensor output(base::DataType::kDataTypeFp32, kRowNum, kOutDim, true, alloc);
+  CHECK(layer.forward(input, output));
+  if (is_cuda) {
+    cudaStreamSynchronize(config->stream);
+    output.to_cpu();
+  }
+  return std::vector<float>(output.ptr<float>(), output.ptr<float>() + output.size());
+}
+}  // namespace
+
+TEST(test_lora_cu, mixed_adapters) {
+  LoraCase lora_case = make_lora_case();
+  const std::vector<int32_t> adapters = {1, -1, 0};
+  const std::vector<float> expected = lora_reference(lora_case, adapters);
+  for (base::DeviceType device_type :
+       {base::DeviceType::kDeviceCPU, base::DeviceType::kDeviceCUDA}) {
+    const std::vector<float> output = lora_forward(lora_case, adapters, device_type);
+    for (int32_t i = 0; i < output.size(); ++i) {
+      ASSERT_NEAR(output.at(i), expected.at(i), 1e-3f);
+    }
+  }
+}
+
+TEST(test_lora_cu, broadcast_adapter) {
+  LoraCase lora_case = make_lora_case();
+  const std::vector<int32_t> adapters = {1};
+  const std::vector<float> expected = lora_reference(lora_case, adapters);
+  const std::vector<float> output =
+      lora_forward(lora_case, adapters, base::DeviceType::kDeviceCUDA);
+  for (int32_t i = 0; i < output.size(); ++i) {
+    ASSERT_NEAR(output.at(i), expected.at(i), 1e-3f);
+  }
+}
@@ -3,9 +3,12 @@
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 #include "../source/op/kernels/cpu/matmul_kernel.h"
+#include "../source/op/kernels/cuda/matmul_kernel.cuh"
 #include "../source/op/kernels/kernels_interface.h"
 #include "../utils.cuh"
 #include "base/buffer.h"
+#include "base/half.h"
+#include "op/matmul.h"
 using namespace kernel;
 TEST(test_matmul_cu, matmul_linear_stream5) {
   auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
@@ -103,4 +106,729 @@ TEST(test_matmul_cu, matmul_linear_course_cuda) {
   ASSERT_EQ(out_cpu.index<float>(0), 0);
   ASSERT_EQ(out_cpu.index<float>(1), 3);
   ASSERT_EQ(out_cpu.index<float>(2), 6);
-}
\ No newline at end of file
+}
+
+TEST(test_matmul_cu, matmul_linear_rows) {
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+
+  const int32_t rows = 37;
+  const int32_t in_dim = 136;
+  const int32_t out_dim = 75;
+  tensor::Tensor input(base::DataType::kDataTypeFp32, rows, in_dim, true, alloc_cpu);
+  tensor::Tensor weight(base::DataType::kDataTypeFp32, out_dim, in_dim, true, alloc_cpu);
+
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(0.f, 1.f);
+  for (int i = 0; i < input.size(); ++i) {
+    input.index<float>(i) = dist(mt);
+  }
+  for (int i = 0; i < weight.size(); ++i) {
+    weight.index<float>(i) = dist(mt);
+  }
+  tensor::Tensor input_cpu = input.clone();
+  tensor::Tensor weight_cpu = weight.clone();
+
+  input.to_cuda(nullptr);
+  weight.to_cuda(nullptr);
+
+  tensor::Tensor out_cu(base::DataType::kDataTypeFp32, rows, out_dim, true, alloc_cu);
+  tensor::Tensor out_cpu(base::DataType::kDataTypeFp32, rows, out_dim, true, alloc_cpu);
+
+  kernel::get_matmul_kernel(base::DeviceType::kDeviceCUDA)(input, weight, out_cu, 1.f, nullptr);
+  kernel::get_matmul_kernel(base::DeviceType::kDeviceCPU)(input_cpu, weight_cpu, out_cpu, 1.f,
+                                                          nullptr);
+  out_cu.to_cpu();
+  for (int r = 0; r < rows; ++r) {
+    for (int o = 0; o < out_dim; ++o) {
+      float expect = 0.f;
+      for (int i = 0; i < in_dim; ++i) {
+        expect += input_cpu.index<float>(r * in_dim + i) * weight_cpu.index<float>(o * in_dim + i);
+      }
+      ASSERT_NEAR(out_cpu.index<float>(r * out_dim + o), expect, 1e-3f);
+      ASSERT_NEAR(out_cu.index<float>(r * out_dim + o), expect, 1e-3f);
+    }
+  }
+}
+
+TEST(test_matmul_cu, matmul_fuse_layers) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const int32_t dim = 64;
+  const std::vector<int32_t> out_dims{64, 16, 16};
+
+  auto config = std::make_shared<CudaConfig>();
+  cudaStreamCreate(&config->stream);
+  std::vector<tensor::Tensor> weights;
+  std::vector<tensor::Tensor> biases;
+  std::vector<std::shared_ptr<op::MatmulLayer>> layers;
+  for (int32_t out_dim : out_dims) {
+    tensor::Tensor weight(base::DataType::kDataTypeFp32, out_dim, dim, true, alloc_cpu);
+    tensor::Tensor bias(base::DataType::kDataTypeFp32, out_dim, true, alloc_cpu);
+    for (int32_t i = 0; i < weight.size(); ++i) {
+      weight.index<float>(i) = float(i % 7) * 0.1f;
+    }
+    for (int32_t i = 0; i < bias.size(); ++i) {
+      bias.index<float>(i) = float(i % 3);
+    }
+    auto layer = std::make_shared<op::MatmulLayer>(base::DeviceType::kDeviceCUDA, out_dim, dim,
+                                                   false, true);
+    layer->set_weight(0, {out_dim, dim}, weight.ptr<float>(), base::DeviceType::kDeviceCPU);
+    layer->set_bias(0, out_dim, bias.ptr<float>(), base::DeviceType::kDeviceCPU);
+    layer->set_cuda_config(config);
+    layer->to_cuda();
+    weights.push_back(weight);
+    biases.push_back(bias);
+    layers.push_back(layer);
+  }
+  auto fused = op::MatmulLayer::fuse(layers);
+  ASSERT_EQ(fused->output_dim(), 96);
+
+  tensor::Tensor input(base::DataType::kDataTypeFp32, dim, true, alloc_cpu);
+  for (int32_t i = 0; i < dim; ++i) {
+    input.index<float>(i) = float(i % 5) - 2.f;
+  }
+  input.to_cuda(nullptr);
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  tensor::Tensor fused_out(base::DataType::kDataTypeFp32, fused->output_dim(), true, alloc_cu);
+  std::shared_ptr<op::Layer> fused_layer = fused;
+  ASSERT_TRUE(fused_layer->forward(input, fused_out));
+  std::vector<tensor::Tensor> outs;
+  for (int32_t i = 0; i < layers.size(); ++i) {
+    // the layers keep working on their views of the packed weights
+    tensor::Tensor out(base::DataType::kDataTypeFp32, out_dims.at(i), true, alloc_cu);
+    std::shared_ptr<op::Layer> layer = layers.at(i);
+    ASSERT_TRUE(layer->forward(input, out));
+    outs.push_back(out);
+  }
+  cudaStreamSynchronize(config->stream);
+  fused_out.to_cpu();
+  int32_t row = 0;
+  for (auto& out : outs) {
+    out.to_cpu();
+    for (int32_t i = 0; i < out.size(); ++i) {
+      ASSERT_NEAR(out.index<float>(i), fused_out.index<float>(row + i), 1e-4f);
+    }
+    row += static_cast<int32_t>(out.size());
+  }
+}
+
+TEST(test_matmul_cu, matmul_rows_blas) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const int32_t rows = 19;
+  const int32_t dim = 136;
+  const int32_t hidden_dim = 72;
+  tensor::Tensor input(base::DataType::kDataTypeFp32, rows, dim, true, alloc_cpu);
+  tensor::Tensor weight(base::DataType::kDataTypeFp32, 2 * hidden_dim, dim, true, alloc_cpu);
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  for (int32_t i = 0; i < input.size(); ++i) {
+    input.index<float>(i) = dist(mt);
+  }
+  for (int32_t i = 0; i < weight.size(); ++i) {
+    weight.index<float>(i) = dist(mt) * 0.1f;
+  }
+
+  CudaConfig config;
+  cudaStreamCreate(&config.stream);
+  ASSERT_TRUE(config.create_blas());
+  // full fp32 so the gemm matches the reference closely
+  config.use_tf32 = false;
+  tensor::Tensor input_cu = input.clone();
+  tensor::Tensor weight_cu = weight.clone();
+  input_cu.to_cuda(nullptr);
+  weight_cu.to_cuda(nullptr);
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  tensor::Tensor out_cu(base::DataType::kDataTypeFp32, rows, 2 * hidden_dim, true, alloc_cu);
+  tensor::Tensor swiglu_cu(base::DataType::kDataTypeFp32, rows, hidden_dim, true, alloc_cu);
+  kernel::get_matmul_kernel(base::DeviceType::kDeviceCUDA)(input_cu, weight_cu, out_cu, 0.5f,
+                                                           &config);
+  kernel::get_matmul_swiglu_kernel(base::DeviceType::kDeviceCUDA)(input_cu, weight_cu, swiglu_cu,
+                                                                  &config);
+  cudaStreamSynchronize(config.stream);
+  out_cu.to_cpu();
+  swiglu_cu.to_cpu();
+
+  for (int32_t r = 0; r < rows; ++r) {
+    for (int32_t o = 0; o < hidden_dim; ++o) {
+      float gate = 0.f;
+      float up = 0.f;
+      for (int32_t i = 0; i < dim; ++i) {
+        gate += weight.index<float>(o * dim + i) * input.index<float>(r * dim + i);
+        up += weight.index<float>((hidden_dim + o) * dim + i) * input.index<float>(r * dim + i);
+      }
+      ASSERT_NEAR(out_cu.index<float>(r * 2 * hidden_dim + o), 0.5f * gate, 1e-4f);
+      ASSERT_NEAR(out_cu.index<float>(r * 2 * hidden_dim + hidden_dim + o), 0.5f * up, 1e-4f);
+      ASSERT_NEAR(swiglu_cu.index<float>(r * hidden_dim + o), gate / (1.f + std::exp(-gate)) * up,
+                  1e-4f);
+    }
+  }
+
+  // the gemms of a shape seen before run the plan which the config keeps for it
+  const size_t plan_num = config.blas_gemm_plans.size();
+  ASSERT_GT(plan_num, 0);
+  kernel::get_matmul_kernel(base::DeviceType::kDeviceCUDA)(input_cu, weight_cu, out_cu, 0.5f,
+                                                           &config);
+  cudaStreamSynchronize(config.stream);
+  ASSERT_EQ(config.blas_gemm_plans.size(), plan_num);
+}
+
+TEST(test_matmul_cu, matmul_bias_epilogue) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  const int32_t dim = 128;
+  const int32_t out_dim = 40;
+  const int32_t group_size = 32;
+  tensor::Tensor weight(base::DataType::kDataTypeFp32, out_dim, dim, true, alloc_cpu);
+  tensor::Tensor weight_int8(base::DataType::kDataTypeInt8, out_dim, dim, true, alloc_cpu);
+  tensor::Tensor scale(base::DataType::kDataTypeFp32, out_dim * dim / group_size, true,
+                       alloc_cpu);
+  tensor::Tensor bias(base::DataType::kDataTypeFp32, out_dim, true, alloc_cpu);
+  std::mt19937 mt(11);
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  for (int32_t i = 0; i < weight.size(); ++i) {
+    weight.index<float>(i) = dist(mt) * 0.1f;
+    weight_int8.index<int8_t>(i) = static_cast<int8_t>(i % 255 - 127);
+  }
+  for (int32_t i = 0; i < scale.size(); ++i) {
+    scale.index<float>(i) = 1e-3f;
+  }
+  for (int32_t i = 0; i < out_dim; ++i) {
+    bias.index<float>(i) = dist(mt);
+  }
+  tensor::Tensor weight_cu = weight.clone();
+  tensor::Tensor weight_int8_cu = weight_int8.clone();
+  tensor::Tensor scale_cu = scale.clone();
+  tensor::Tensor bias_cu = bias.clone();
+  weight_cu.to_cuda(nullptr);
+  weight_int8_cu.to_cuda(nullptr);
+  scale_cu.to_cuda(nullptr);
+  bias_cu.to_cuda(nullptr);
+
+  CudaConfig config;
+  cudaStreamCreate(&config.stream);
+  CudaConfig blas_config;
+  cudaStreamCreate(&blas_config.stream);
+  ASSERT_TRUE(blas_config.create_blas());
+  blas_config.use_tf32 = false;
+  const kernel::KernelKey cpu_key(base::DeviceType::kDeviceCPU);
+  const kernel::KernelKey cu_key(base::DeviceType::kDeviceCUDA);
+  // one row runs the gemv, several rows the gemm of cublaslt or the tiled fallback
+  for (int32_t rows : {1, 5}) {
+    tensor::Tensor input(base::DataType::kDataTypeFp32, rows, dim, true, alloc_cpu);
+    for (int32_t i = 0; i < input.size(); ++i) {
+      input.index<float>(i) = dist(mt);
+    }
+    tensor::Tensor input_cu = input.clone();
+    input_cu.to_cuda(nullptr);
+    std::vector<float> expected(rows * out_dim);
+    std::vector<float> expected_int8(rows * out_dim);
+    for (int32_t r = 0; r < rows; ++r) {
+      for (int32_t o = 0; o < out_dim; ++o) {
+        float sum = bias.index<float>(o);
+        float sum_int8 = bias.index<float>(o);
+        for (int32_t i = 0; i < dim; ++i) {
+          const int32_t weight_idx = o * dim + i;
+          sum += weight.index<float>(weight_idx) * input.index<float>(r * dim + i);
+          sum_int8 += scale.index<float>(weight_idx / group_size) *
+                      weight_int8.index<int8_t>(weight_idx) * input.index<float>(r * dim + i);
+        }
+        expected.at(r * out_dim + o) = sum;
+        expected_int8.at(r * out_dim + o) = sum_int8;
+      }
+    }
+
+    std::vector<tensor::Tensor> outputs;
+    for (int32_t i = 0; i < 3; ++i) {
+      outputs.emplace_back(base::DataType::kDataTypeFp32, rows, out_dim, true, alloc_cu);
+    }
+    kernel::get_matmul_bias_kernel(cu_key)(input_cu, weight_cu, bias_cu, outputs.at(0), &config);
+    kernel::get_matmul_bias_kernel(cu_key)(input_cu, weight_cu, bias_cu, outputs.at(1),
+                                           &blas_config);
+    kernel::get_matmul_bias_kernel_quant8(cu_key)(input_cu, weight_int8_cu, bias_cu,
+                                                  outputs.at(2), group_size, scale_cu, &config);
+    tensor::Tensor out_cpu(base::DataType::kDataTypeFp32, rows, out_dim, true, alloc_cpu);
+    tensor::Tensor out_int8_cpu(base::DataType::kDataTypeFp32, rows, out_dim, true, alloc_cpu);
+    kernel::get_matmul_bias_kernel(cpu_key)(input, weight, bias, out_cpu, nullptr);
+    kernel::get_matmul_bias_kernel_quant8(cpu_key)(input, weight_int8, bias, out_int8_cpu,
+                                                   group_size, scale, nullptr);
+    cudaDeviceSynchronize();
+    for (int32_t i = 0; i < 3; ++i) {
+      outputs.at(i).to_cpu();
+    }
+    for (int32_t i = 0; i < rows * out_dim; ++i) {
+      ASSERT_NEAR(outputs.at(0).index<float>(i), expected.at(i), 1e-4f);
+      ASSERT_NEAR(outputs.at(1).index<float>(i), expected.at(i), 1e-4f);
+      ASSERT_NEAR(out_cpu.index<float>(i), expected.at(i), 1e-4f);
+      // the int8 kernels quantize the input per group as well
+      ASSERT_NEAR(outputs.at(2).index<float>(i), expected_int8.at(i), 1e-2f);
+      ASSERT_NEAR(out_int8_cpu.index<float>(i), expected_int8.at(i), 1e-2f);
+    }
+  }
+}
+
+TEST(test_matmul_cu, matmul_swiglu) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const int32_t dim = 128;
+  const int32_t hidden_dim = 72;
+
+  tensor::Tensor input(base::DataType::kDataTypeFp32, dim, true, alloc_cpu);
+  tensor::Tensor weight(base::DataType::kDataTypeFp32, 2 * hidden_dim, dim, true, alloc_cpu);
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  for (int32_t i = 0; i < dim; ++i) {
+    input.index<float>(i) = dist(mt);
+  }
+  for (int32_t i = 0; i < weight.size(); ++i) {
+    weight.index<float>(i) = dist(mt) * 0.1f;
+  }
+
+  tensor::Tensor out_cpu(base::DataType::kDataTypeFp32, hidden_dim, true, alloc_cpu);
+  kernel::get_matmul_swiglu_kernel(base::DeviceType::kDeviceCPU)(input, weight, out_cpu, nullptr);
+
+  CudaConfig config;
+  cudaStreamCreate(&config.stream);
+  tensor::Tensor input_cu = input.clone();
+  tensor::Tensor weight_cu = weight.clone();
+  tensor::Tensor out_cu = out_cpu.clone();
+  input_cu.to_cuda(nullptr);
+  weight_cu.to_cuda(nullptr);
+  out_cu.to_cuda(nullptr);
+  kernel::get_matmul_swiglu_kernel(base::DeviceType::kDeviceCUDA)(input_cu, weight_cu, out_cu,
+                                                                  &config);
+  cudaStreamSynchronize(config.stream);
+  out_cu.to_cpu();
+
+  for (int32_t o = 0; o < hidden_dim; ++o) {
+    float gate = 0.f;
+    float up = 0.f;
+    for (int32_t i = 0; i < dim; ++i) {
+      gate += weight.index<float>(o * dim + i) * input.index<float>(i);
+      up += weight.index<float>((hidden_dim + o) * dim + i) * input.index<float>(i);
+    }
+    const float expect = gate / (1.f + std::exp(-gate)) * up;
+    ASSERT_NEAR(out_cpu.index<float>(o), expect, 1e-4f);
+    ASSERT_NEAR(out_cu.index<float>(o), expect, 1e-4f);
+  }
+}
+
+TEST(test_matmul_cu, matmul_qint8_dp4a) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const int32_t rows = 2;
+  const int32_t dim = 256;
+  const int32_t hidden_dim = 37;
+  const int32_t group_size = 64;
+  const int32_t group_num = 2 * hidden_dim * dim / group_size;
+  tensor::Tensor input(base::DataType::kDataTypeFp32, rows, dim, true, alloc_cpu);
+  tensor::Tensor weight(base::DataType::kDataTypeInt8, 2 * hidden_dim, dim, true, alloc_cpu);
+  tensor::Tensor scale(base::DataType::kDataTypeFp32, group_num, true, alloc_cpu);
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  std::uniform_int_distribution<int32_t> int_dist(-127, 127);
+  for (int32_t i = 0; i < input.size(); ++i) {
+    input.index<float>(i) = dist(mt);
+  }
+  for (int32_t i = 0; i < weight.size(); ++i) {
+    weight.index<int8_t>(i) = static_cast<int8_t>(int_dist(mt));
+  }
+  for (int32_t i = 0; i < group_num; ++i) {
+    scale.index<float>(i) = 1e-3f * (1.f + dist(mt) * 0.5f);
+  }
+
+  CudaConfig config;
+  cudaStreamCreate(&config.stream);
+  tensor::Tensor input_cu = input.clone();
+  tensor::Tensor weight_cu = weight.clone();
+  tensor::Tensor scale_cu = scale.clone();
+  input_cu.to_cuda(nullptr);
+  weight_cu.to_cuda(nullptr);
+  scale_cu.to_cuda(nullptr);
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  tensor::Tensor out_cu(base::DataType::kDataTypeFp32, rows, 2 * hidden_dim, true, alloc_cu);
+  tensor::Tensor swiglu_cu(base::DataType::kDataTypeFp32, rows, hidden_dim, true, alloc_cu);
+  kernel::get_matmul_kernel_quant8(base::DeviceType::kDeviceCUDA)(input_cu, weight_cu, out_cu,
+                                                                  group_size, scale_cu, &config);
+  kernel::get_matmul_swiglu_kernel_quant8(base::DeviceType::kDeviceCUDA)(
+      input_cu, weight_cu, swiglu_cu, group_size, scale_cu, &config);
+  cudaStreamSynchronize(config.stream);
+  out_cu.to_cpu();
+  swiglu_cu.to_cpu();
+
+  // the input is quantized per group as well, so the sums only agree to its precision
+  auto dot = [&](int32_t r, int32_t o) {
+    float sum = 0.f;
+    for (int32_t i = 0; i < dim; ++i) {
+      const int32_t weight_idx = o * dim + i;
+      sum += input.index<float>(r * dim + i) * scale.index<float>(weight_idx / group_size) *
+             static_cast<float>(weight.index<int8_t>(weight_idx));
+    }
+    return sum;
+  };
+  for (int32_t r = 0; r < rows; ++r) {
+    for (int32_t o = 0; o < hidden_dim; ++o) {
+      const float gate = dot(r, o);
+      const float up = dot(r, hidden_dim + o);
+      ASSERT_NEAR(out_cu.index<float>(r * 2 * hidden_dim + o), gate, 1e-2f);
+      ASSERT_NEAR(out_cu.index<float>(r * 2 * hidden_dim + hidden_dim + o), up, 1e-2f);
+      ASSERT_NEAR(swiglu_cu.index<float>(r * hidden_dim + o),
+                  gate / (1.f + std::exp(-gate)) * up, 1e-2f);
+    }
+  }
+}
+
+TEST(test_matmul_cu, matmul_qint8_tiled) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const int32_t dim = 256;
+  const int32_t hidden_dim = 36;
+  const int32_t group_size = 64;
+  const int32_t group_num = 2 * hidden_dim * dim / group_size;
+  tensor::Tensor input(base::DataType::kDataTypeFp32, dim, true, alloc_cpu);
+  tensor::Tensor weight(base::DataType::kDataTypeInt8, 2 * hidden_dim, dim, true, alloc_cpu);
+  tensor::Tensor scale(base::DataType::kDataTypeFp32, group_num, true, alloc_cpu);
+  std::mt19937 mt(7);
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  std::uniform_int_distribution<int32_t> int_dist(-127, 127);
+  for (int32_t i = 0; i < input.size(); ++i) {
+    input.index<float>(i) = dist(mt);
+  }
+  for (int32_t i = 0; i < weight.size(); ++i) {
+    weight.index<int8_t>(i) = static_cast<int8_t>(int_dist(mt));
+  }
+  for (int32_t i = 0; i < group_num; ++i) {
+    scale.index<float>(i) = 1e-3f * (1.f + dist(mt) * 0.5f);
+  }
+
+  CudaConfig config;
+  cudaStreamCreate(&config.stream);
+  input.to_cuda(nullptr);
+  weight.to_cuda(nullptr);
+  scale.to_cuda(nullptr);
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  tensor::Tensor out_cu(base::DataType::kDataTypeFp32, 2 * hidden_dim, true, alloc_cu);
+  tensor::Tensor swiglu_cu(base::DataType::kDataTypeFp32, hidden_dim, true, alloc_cu);
+  kernel::get_matmul_kernel_quant8(base::DeviceType::kDeviceCUDA)(input, weight, out_cu,
+                                                                  group_size, scale, &config);
+  kernel::get_matmul_swiglu_kernel_quant8(base::DeviceType::kDeviceCUDA)(
+      input, weight, swiglu_cu, group_size, scale, &config);
+
+  // the same sums come out of the tiled copy of the weight
+  ASSERT_TRUE(kernel::can_tile_int8_weight(weight, group_size, scale));
+  kernel::tile_int8_weight_cu(weight, group_size, scale, config.stream);
+  tensor::Tensor tiled_out_cu(base::DataType::kDataTypeFp32, 2 * hidden_dim, true, alloc_cu);
+  tensor::Tensor tiled_swiglu_cu(base::DataType::kDataTypeFp32, hidden_dim, true, alloc_cu);
+  const kernel::KernelKey key(base::DeviceType::kDeviceCUDA);
+  kernel::get_matmul_kernel_quant8_tiled(key)(input, weight, tiled_out_cu, group_size, scale,
+                                              &config);
+  kernel::get_matmul_swiglu_kernel_quant8_tiled(key)(input, weight, tiled_swiglu_cu, group_size,
+                                                     scale, &config);
+  cudaStreamSynchronize(config.stream);
+  out_cu.to_cpu();
+  swiglu_cu.to_cpu();
+  tiled_out_cu.to_cpu();
+  tiled_swiglu_cu.to_cpu();
+  for (int32_t o = 0; o < 2 * hidden_dim; ++o) {
+    ASSERT_NEAR(tiled_out_cu.index<float>(o), out_cu.index<float>(o), 1e-4f);
+  }
+  for (int32_t o = 0; o < hidden_dim; ++o) {
+    ASSERT_NEAR(tiled_swiglu_cu.index<float>(o), swiglu_cu.index<float>(o), 1e-4f);
+  }
+}
+
+TEST(test_matmul_cu, matmul_qint4) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  const int32_t dim = 256;
+  const int32_t hidden_dim = 37;
+  const int32_t group_size = 64;
+  const int32_t out_dim = 2 * hidden_dim;
+  const int32_t group_num = out_dim * dim / group_size;
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  std::uniform_int_distribution<int32_t> nibble_dist(0, 15);
+  std::uniform_int_distribution<int32_t> mantissa_dist(0, 1023);
+
+  // the weight, the fp16 scales and the zero points in the layout of the model file
+  const size_t byte_size = op::MatmulLayer::int4_byte_size(out_dim, dim, group_size, true);
+  std::vector<uint8_t> file(byte_size);
+  std::vector<int32_t> quant(out_dim * dim);
+  for (int32_t i = 0; i < quant.size(); ++i) {
+    quant.at(i) = nibble_dist(mt);
+    file.at(i / 2) |= static_cast<uint8_t>(quant.at(i) << (4 * (i % 2)));
+  }
+  std::vector<float> scales(group_num);
+  std::vector<int32_t> zero_points(group_num);
+  uint16_t* scale_ptr = reinterpret_cast<uint16_t*>(file.data() + out_dim * dim / 2);
+  uint8_t* zero_point_ptr = reinterpret_cast<uint8_t*>(scale_ptr + group_num);
+  for (int32_t g = 0; g < group_num; ++g) {
+    // exact in fp16, the exponent 9 puts the scale around 2^-6
+    const int32_t mantissa = mantissa_dist(mt);
+    scale_ptr[g] = static_cast<uint16_t>((9 << 10) | mantissa);
+    scales.at(g) = std::ldexp(1.f + mantissa / 1024.f, 9 - 15);
+    zero_points.at(g) = nibble_dist(mt);
+    zero_point_ptr[g] = static_cast<uint8_t>(zero_points.at(g));
+  }
+
+  for (int32_t rows : {1, 3}) {
+    tensor::Tensor input(base::DataType::kDataTypeFp32, rows, dim, true, alloc_cpu);
+    for (int32_t i = 0; i < input.size(); ++i) {
+      input.index<float>(i) = dist(mt);
+    }
+    auto dot = [&](int32_t r, int32_t o, bool has_zero_point) {
+      float sum = 0.f;
+      for (int32_t i = 0; i < dim; ++i) {
+        const int32_t weight_idx = o * dim + i;
+        const int32_t g = weight_idx / group_size;
+        const int32_t zero_point = has_zero_point ? zero_points.at(g) : 8;
+        sum += input.index<float>(r * dim + i) * scales.at(g) *
+               static_cast<float>(quant.at(weight_idx) - zero_point);
+      }
+      return sum;
+    };
+
+    auto config = std::make_shared<CudaConfig>();
+    cudaStreamCreate(&config->stream);
+    std::shared_ptr<op::MatmulLayer> layer =
+        std::make_shared<op::MatmulLayer>(base::DeviceType::kDeviceCUDA, out_dim, dim, true);
+    layer->set_group_size(group_size);
+    ASSERT_TRUE(layer->set_weight_int4({out_dim, dim}, file.data(), true,
+                                       base::DeviceType::kDeviceCPU));
+    ASSERT_TRUE(layer->is_int4());
+    layer->set_cuda_config(config);
+    layer->to_cuda();
+
+    tensor::Tensor input_cu = input.clone();
+    input_cu.to_cuda(nullptr);
+    tensor::Tensor out_cu(base::DataType::kDataTypeFp32, rows, out_dim, true, alloc_cu);
+    std::shared_ptr<op::Layer> base_layer = layer;
+    ASSERT_TRUE(base_layer->forward(input_cu, out_cu));
+
+    // the same weight without the zero points, through the swiglu kernel
+    tensor::Tensor weight_cu(base::DataType::kDataTypeInt8, out_dim, dim / 2, true, alloc_cpu);
+    tensor::Tensor scale_cu(base::DataType::kDataTypeFp16, group_num, true, alloc_cpu);
+    std::memcpy(weight_cu.ptr<int8_t>(), file.data(), weight_cu.byte_size());
+    std::memcpy(scale_cu.ptr<uint16_t>(), scale_ptr, scale_cu.byte_size());
+    weight_cu.to_cuda(nullptr);
+    scale_cu.to_cuda(nullptr);
+    tensor::Tensor swiglu_cu(base::DataType::kDataTypeFp32, rows, hidden_dim, true, alloc_cu);
+    kernel::get_matmul_swiglu_kernel_quant4(base::DeviceType::kDeviceCUDA)(
+        input_cu, weight_cu, swiglu_cu, group_size, scale_cu, tensor::Tensor{}, config.get());
+    cudaStreamSynchronize(config->stream);
+    out_cu.to_cpu();
+    swiglu_cu.to_cpu();
+
+    for (int32_t r = 0; r < rows; ++r) {
+      for (int32_t o = 0; o < out_dim; ++o) {
+        ASSERT_NEAR(out_cu.index<float>(r * out_dim + o), dot(r, o, true), 1e-3f);
+      }
+      for (int32_t o = 0; o < hidden_dim; ++o) {
+        const float gate = dot(r, o, false);
+        const float up = dot(r, hidden_dim + o, false);
+        ASSERT_NEAR(swiglu_cu.index<float>(r * hidden_dim + o),
+                    gate / (1.f + std::exp(-gate)) * up, 1e-3f);
+      }
+    }
+  }
+}
+
+TEST(test_matmul_cu, matmul_fp8) {
+  // every finite e4m3 value survives the round trip, larger ones saturate to 448
+  for (int32_t bits = 0; bits < 256; ++bits) {
+    if ((bits & 0x7f) == 0x7f) {
+      continue;
+    }
+    const float value = base::fp8_e4m3_to_float(static_cast<uint8_t>(bits));
+    ASSERT_EQ(base::fp8_e4m3_to_float(base::float_to_fp8_e4m3(value)), value);
+  }
+  ASSERT_EQ(base::fp8_e4m3_to_float(base::float_to_fp8_e4m3(1000.f)), base::kFp8E4M3Max);
+  // 1.0625 lies halfway between 1 and 1.125 and rounds to the even mantissa
+  ASSERT_EQ(base::fp8_e4m3_to_float(base::float_to_fp8_e4m3(1.0625f)), 1.f);
+
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  const int32_t dim = 256;
+  const int32_t hidden_dim = 37;
+  const int32_t out_dim = 2 * hidden_dim;
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+
+  // the e4m3 weight and one fp32 scale per row in the layout of the model file
+  std::vector<uint8_t> file(out_dim * dim + out_dim * sizeof(float));
+  std::vector<float> weight(out_dim * dim);
+  float* scale_ptr = reinterpret_cast<float*>(file.data() + out_dim * dim);
+  for (int32_t o = 0; o < out_dim; ++o) {
+    scale_ptr[o] = 1.f / 256.f * static_cast<float>(1 + o % 5);
+    for (int32_t i = 0; i < dim; ++i) {
+      file.at(o * dim + i) = base::float_to_fp8_e4m3(400.f * dist(mt));
+      weight.at(o * dim + i) = base::fp8_e4m3_to_float(file.at(o * dim + i)) * scale_ptr[o];
+    }
+  }
+
+  for (int32_t rows : {1, 3}) {
+    tensor::Tensor input(base::DataType::kDataTypeFp32, rows, dim, true, alloc_cpu);
+    for (int32_t i = 0; i < input.size(); ++i) {
+      input.index<float>(i) = dist(mt);
+    }
+    auto dot = [&](int32_t r, int32_t o, float& abs_sum) {
+      float sum = 0.f;
+      abs_sum = 0.f;
+      for (int32_t i = 0; i < dim; ++i) {
+        sum += input.index<float>(r * dim + i) * weight.at(o * dim + i);
+        abs_sum += std::abs(input.index<float>(r * dim + i) * weight.at(o * dim + i));
+      }
+      return sum;
+    };
+
+    auto config = std::make_shared<CudaConfig>();
+    cudaStreamCreate(&config->stream);
+    ASSERT_TRUE(config->create_blas());
+    std::shared_ptr<op::MatmulLayer> layer =
+        std::make_shared<op::MatmulLayer>(base::DeviceType::kDeviceCUDA, out_dim, dim, true);
+    ASSERT_TRUE(layer->set_weight_fp8({out_dim, dim}, file.data(), base::DeviceType::kDeviceCPU));
+    ASSERT_TRUE(layer->is_fp8());
+    layer->set_cuda_config(config);
+    layer->to_cuda();
+
+    tensor::Tensor input_cu = input.clone();
+    input_cu.to_cuda(nullptr);
+    tensor::Tensor out_cu(base::DataType::kDataTypeFp32, rows, out_dim, true, alloc_cu);
+    std::shared_ptr<op::Layer> base_layer = layer;
+    ASSERT_TRUE(base_layer->forward(input_cu, out_cu));
+    layer->set_swiglu_output(true);
+    tensor::Tensor swiglu_cu(base::DataType::kDataTypeFp32, rows, hidden_dim, true, alloc_cu);
+    ASSERT_TRUE(base_layer->forward(input_cu, swiglu_cu));
+    cudaStreamSynchronize(config->stream);
+    out_cu.to_cpu();
+    swiglu_cu.to_cpu();
+    // before sm89 the rows fall back to the gemv without asking cublaslt for an fp8 gemm
+    if (rows > 1 && config->compute_capability < 89) {
+      ASSERT_GE(config->compute_capability, 0);
+      ASSERT_TRUE(config->blas_gemm_plans.empty());
+    }
+
+    // the gemm of several rows quantizes the input to e4m3 on sm89 and later, an element is off
+    // by up to half of its 2^-3 step then
+    const float rel_tol = rows == 1 ? 1e-5f : 0.07f;
+    for (int32_t r = 0; r < rows; ++r) {
+      for (int32_t o = 0; o < out_dim; ++o) {
+        float abs_sum = 0.f;
+        const float expected = dot(r, o, abs_sum);
+        ASSERT_NEAR(out_cu.index<float>(r * out_dim + o), expected, rel_tol * abs_sum + 1e-3f);
+      }
+      for (int32_t o = 0; o < hidden_dim; ++o) {
+        float gate_abs_sum = 0.f;
+        float up_abs_sum = 0.f;
+        const float gate = dot(r, o, gate_abs_sum);
+        const float up = dot(r, hidden_dim + o, up_abs_sum);
+        const float tol = rel_tol * (gate_abs_sum * std::abs(up) + up_abs_sum * std::abs(gate) +
+                                     gate_abs_sum * up_abs_sum * rel_tol) +
+                          1e-3f;
+        ASSERT_NEAR(swiglu_cu.index<float>(r * hidden_dim + o),
+                    gate / (1.f + std::exp(-gate)) * up, tol);
+      }
+    }
+  }
+}
+
+TEST(test_matmul_cu, matmul_half_weights) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  const int32_t dim = 136;
+  const int32_t hidden_dim = 72;
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  tensor::Tensor weight(base::DataType::kDataTypeFp32, 2 * hidden_dim, dim, true, alloc_cpu);
+  for (int32_t i = 0; i < weight.size(); ++i) {
+    weight.index<float>(i) = dist(mt) * 0.1f;
+  }
+  tensor::Tensor weight_cu = weight.clone();
+  weight_cu.to_cuda(nullptr);
+
+  CudaConfig config;
+  cudaStreamCreate(&config.stream);
+  ASSERT_TRUE(config.create_blas());
+  // the weights are rounded to the 16 bit type, bf16 keeps only 8 bits of the mantissa
+  for (auto [data_type, tolerance] :
+       {std::pair{base::DataType::kDataTypeFp16, 2e-3f},
+        std::pair{base::DataType::kDataTypeBf16, 2e-2f}}) {
+    tensor::Tensor weight_half(data_type, 2 * hidden_dim, dim, true, alloc_cu);
+    kernel::get_cast_kernel(base::DeviceType::kDeviceCUDA)(weight_cu, weight_half, config.stream);
+
+    // one row runs through the gemv, several through the gemm of the cast input
+    for (int32_t rows : {1, 7}) {
+      tensor::Tensor input(base::DataType::kDataTypeFp32, rows, dim, true, alloc_cpu);
+      for (int32_t i = 0; i < input.size(); ++i) {
+        input.index<float>(i) = dist(mt);
+      }
+      tensor::Tensor input_cu = input.clone();
+      input_cu.to_cuda(nullptr);
+      tensor::Tensor out_cu(base::DataType::kDataTypeFp32, rows, 2 * hidden_dim, true, alloc_cu);
+      tensor::Tensor swiglu_cu(base::DataType::kDataTypeFp32, rows, hidden_dim, true, alloc_cu);
+      kernel::get_matmul_kernel(base::DeviceType::kDeviceCUDA)(input_cu, weight_half, out_cu, 1.f,
+                                                               &config);
+      kernel::get_matmul_swiglu_kernel(base::DeviceType::kDeviceCUDA)(input_cu, weight_half,
+                                                                      swiglu_cu, &config);
+      cudaStreamSynchronize(config.stream);
+      out_cu.to_cpu();
+      swiglu_cu.to_cpu();
+
+      for (int32_t r = 0; r < rows; ++r) {
+        for (int32_t o = 0; o < hidden_dim; ++o) {
+          float gate = 0.f;
+          float up = 0.f;
+          for (int32_t i = 0; i < dim; ++i) {
+            gate += weight.index<float>(o * dim + i) * input.index<float>(r * dim + i);
+            up += weight.index<float>((hidden_dim + o) * dim + i) * input.index<float>(r * dim + i);
+          }
+          ASSERT_NEAR(out_cu.index<float>(r * 2 * hidden_dim + o), gate, tolerance);
+          ASSERT_NEAR(out_cu.index<float>(r * 2 * hidden_dim + hidden_dim + o), up, tolerance);
+          ASSERT_NEAR(swiglu_cu.index<float>(r * hidden_dim + o),
+                      gate / (1.f + std::exp(-gate)) * up, tolerance);
+        }
+      }
+    }
+  }
+}
+
+TEST(test_matmul_cu, gemv_launch_candidates) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  // the rows are not a multiple of the rows of a block
+  const int32_t rows = 37;
+  const int32_t dim = 264;
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  tensor::Tensor weight(base::DataType::kDataTypeFp32, rows, dim, true, alloc_cpu);
+  tensor::Tensor input(base::DataType::kDataTypeFp32, dim, true, alloc_cpu);
+  for (int32_t i = 0; i < weight.size(); ++i) {
+    weight.index<float>(i) = dist(mt);
+  }
+  for (int32_t i = 0; i < input.size(); ++i) {
+    input.index<float>(i) = dist(mt);
+  }
+  tensor::Tensor weight_cu = weight.clone();
+  weight_cu.to_cuda(nullptr);
+  tensor::Tensor input_cu = input.clone();
+  input_cu.to_cuda(nullptr);
+
+  for (const GemvLaunch& launch : gemv_launch_candidates()) {
+    tensor::Tensor out_cu(base::DataType::kDataTypeFp32, rows, true, alloc_cu);
+    gemv_kernel_cu(input_cu, weight_cu, out_cu, launch, nullptr);
+    cudaDeviceSynchronize();
+    out_cu.to_cpu();
+    for (int32_t r = 0; r < rows; ++r) {
+      float sum = 0.f;
+      for (int32_t i = 0; i < dim; ++i) {
+        sum += weight.index<float>(r * dim + i) * input.index<float>(i);
+      }
+      ASSERT_NEAR(out_cu.index<float>(r), sum, 1e-3f)
+          << launch.thread_num << " threads, " << launch.row_per_block << " rows per block";
+    }
+  }
+}
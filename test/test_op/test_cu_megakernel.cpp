@@ -0,0 +1,271 @@
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include "../source/op/kernels/cuda/megakernel.cuh"
+#include "base/buffer.h"
+
+namespace {
+constexpr int32_t kDim = 64;
+constexpr int32_t kHeadNum = 4;
+constexpr int32_t kHeadSize = 16;
+constexpr int32_t kKVMul = 2;
+constexpr int32_t kKVDim = kDim / kKVMul;
+constexpr int32_t kHiddenDim = 96;
+constexpr int32_t kVocabSize = 40;
+constexpr int32_t kSeqLen = 16;
+constexpr int32_t kBlockSize = 4;
+constexpr int32_t kPos = 9;
+#ifdef QWEN2_SUPPORT
+constexpr float kEps = 1e-6f;
+#else
+constexpr float kEps = 1e-5f;
+#endif
+
+std::vector<float> random_vector(int32_t size, std::mt19937& mt) {
+  std::uniform_real_distribution<float> dist(-0.5f, 0.5f);
+  std::vector<float> values(size);
+  for (float& value : values) {
+    value = dist(mt);
+  }
+  return values;
+}
+
+std::vector<float> rmsnorm(const std::vector<float>& input, const std::vector<float>& weight) {
+  float sum = 0.f;
+  for (float value : input) {
+    sum += value * value;
+  }
+  const float scale = 1.f / std::sqrt(sum / static_cast<float>(input.size()) + kEps);
+  std::vector<float> output(input.size());
+  for (size_t i = 0; i < input.size(); ++i) {
+    output[i] = input[i] * scale * weight[i];
+  }
+  return output;
+}
+
+std::vector<float> matmul(const std::vector<float>& weight, const std::vector<float>& input,
+                          int32_t rows) {
+  std::vector<float> output(rows, 0.f);
+  for (int32_t row = 0; row < rows; ++row) {
+    for (size_t col = 0; col < input.size(); ++col) {
+      output[row] += weight[row * input.size() + col] * input[col];
+    }
+  }
+  return output;
+}
+
+// copies the values to the device, the buffers live until the end of the test
+template <typename T>
+T* to_device(const std::vector<T>& values, std::vector<std::shared_ptr<base::Buffer>>& own) {
+  auto alloc = base::CUDADeviceAllocatorFactory::get_instance();
+  own.push_back(std::make_shared<base::Buffer>(values.size() * sizeof(T), alloc));
+  cudaMemcpy(own.back()->ptr(), values.data(), values.size() * sizeof(T),
+             cudaMemcpyHostToDevice);
+  return static_cast<T*>(own.back()->ptr());
+}
+}  // namespace
+
+// one decoder layer with its final norm and classifier in one launch, against the host
+TEST(test_megakernel_cu, decode_layer) {
+  const int32_t grid_size = kernel::megakernel_grid_size();
+  if (grid_size <= 0) {
+    GTEST_SKIP() << "The device can not launch a cooperative kernel.";
+  }
+  std::mt19937 mt(7);
+  const int32_t qkv_dim = kDim + 2 * kKVDim;
+  std::vector<float> hidden = random_vector(kDim, mt);
+  const std::vector<float> attention_norm = random_vector(kDim, mt);
+  const std::vector<float> wqkv = random_vector(qkv_dim * kDim, mt);
+  const std::vector<float> qkv_bias = random_vector(qkv_dim, mt);
+  const std::vector<float> wo = random_vector(kDim * kDim, mt);
+  const std::vector<float> ffn_norm = random_vector(kDim, mt);
+  const std::vector<float> w13 = random_vector(2 * kHiddenDim * kDim, mt);
+  const std::vector<float> w2 = random_vector(kDim * kHiddenDim, mt);
+  const std::vector<float> final_norm = random_vector(kDim, mt);
+  const std::vector<float> cls = random_vector(kVocabSize * kDim, mt);
+  std::vector<float> freqs(kHeadSize / 2);
+  for (int32_t i = 0; i < kHeadSize / 2; ++i) {
+    freqs[i] = 1.f / std::pow(10000.f, 2.f * i / kHeadSize);
+  }
+  const std::vector<float> factors(kHeadSize / 2, 1.f);
+  // the positions before kPos are in the cache already, scattered over its blocks
+  const std::vector<int32_t> blocks{2, 0, 3, 1};
+  std::vector<float> key_history = random_vector(kSeqLen * kKVDim, mt);
+  std::vector<float> value_history = random_vector(kSeqLen * kKVDim, mt);
+  std::vector<float> key_cache(kSeqLen * kKVDim, 0.f);
+  std::vector<float> value_cache(kSeqLen * kKVDim, 0.f);
+  for (int32_t t = 0; t < kPos; ++t) {
+    const int32_t physical = blocks.at(t / kBlockSize) * kBlockSize + t % kBlockSize;
+    for (int32_t i = 0; i < kKVDim; ++i) {
+      key_cache[physical * kKVDim + i] = key_history[t * kKVDim + i];
+      value_cache[physical * kKVDim + i] = value_history[t * kKVDim + i];
+    }
+  }
+
+  std::vector<std::shared_ptr<base::Buffer>> own;
+  float* d_hidden = to_device(hidden, own);
+  float* d_rms = to_device(std::vector<float>(kDim), own);
+  float* d_qkv = to_device(std::vector<float>(qkv_dim), own);
+  float* d_mha = to_device(std::vector<float>(kDim), own);
+  float* d_attn = to_device(std::vector<float>(kDim), own);
+  float* d_w1 = to_device(std::vector<float>(kHiddenDim), own);
+  float* d_w2 = to_device(std::vector<float>(kDim), own);
+  float* d_norm = to_device(std::vector<float>(kDim), own);
+  float* d_logits = to_device(std::vector<float>(kVocabSize), own);
+  float* d_score = to_device(std::vector<float>(kHeadNum * kSeqLen), own);
+  float* d_key_cache = to_device(key_cache, own);
+  float* d_value_cache = to_device(value_cache, own);
+  const int32_t* d_block_table = to_device(blocks, own);
+
+  auto step = [](kernel::MegaOp op, const float* input, float* output) {
+    kernel::MegaStep mega_step;
+    mega_step.op = op;
+    mega_step.input = input;
+    mega_step.output = output;
+    return mega_step;
+  };
+  std::vector<kernel::MegaStep> steps;
+  steps.push_back(step(kernel::MegaOp::kRMSNorm, nullptr, d_rms));
+  steps.back().cols = kDim;
+  steps.back().weight = to_device(attention_norm, own);
+  steps.push_back(step(kernel::MegaOp::kMatmul, d_rms, d_qkv));
+  steps.back().rows = qkv_dim;
+  steps.back().cols = kDim;
+  steps.back().weight = to_device(wqkv, own);
+  steps.back().bias = to_device(qkv_bias, own);
+  steps.push_back(step(kernel::MegaOp::kRope, nullptr, d_qkv));
+  steps.back().output2 = d_qkv + kDim;
+  steps.push_back(step(kernel::MegaOp::kKVWrite, d_qkv + kDim, nullptr));
+  steps.back().input2 = d_qkv + kDim + kKVDim;
+  steps.back().key_cache = d_key_cache;
+  steps.back().value_cache = d_value_cache;
+  steps.push_back(step(kernel::MegaOp::kAttention, d_qkv, d_mha));
+  steps.back().key_cache = d_key_cache;
+  steps.back().value_cache = d_value_cache;
+  steps.push_back(step(kernel::MegaOp::kMatmul, d_mha, d_attn));
+  steps.back().rows = kDim;
+  steps.back().cols = kDim;
+  steps.back().weight = to_device(wo, own);
+  steps.push_back(step(kernel::MegaOp::kAdd, d_attn, nullptr));
+  steps.back().cols = kDim;
+  steps.push_back(step(kernel::MegaOp::kRMSNorm, nullptr, d_rms));
+  steps.back().cols = kDim;
+  steps.back().weight = to_device(ffn_norm, own);
+  steps.push_back(step(kernel::MegaOp::kMatmulSwiGLU, d_rms, d_w1));
+  steps.back().rows = kHiddenDim;
+  steps.back().cols = kDim;
+  steps.back().weight = to_device(w13, own);
+  steps.push_back(step(kernel::MegaOp::kMatmul, d_w1, d_w2));
+  steps.back().rows = kDim;
+  steps.back().cols = kHiddenDim;
+  steps.back().weight = to_device(w2, own);
+  steps.push_back(step(kernel::MegaOp::kAdd, d_w2, nullptr));
+  steps.back().cols = kDim;
+  steps.push_back(step(kernel::MegaOp::kRMSNorm, nullptr, d_norm));
+  steps.back().cols = kDim;
+  steps.back().weight = to_device(final_norm, own);
+  steps.push_back(step(kernel::MegaOp::kMatmul, d_norm, d_logits));
+  steps.back().rows = kVocabSize;
+  steps.back().cols = kDim;
+  steps.back().weight = to_device(cls, own);
+
+  auto alloc = base::CUDADeviceAllocatorFactory::get_instance();
+  base::Buffer step_buffer(steps.size() * sizeof(kernel::MegaStep), alloc);
+  cudaMemcpy(step_buffer.ptr(), steps.data(), step_buffer.byte_size(), cudaMemcpyHostToDevice);
+  kernel::MegakernelParams params;
+  params.steps = static_cast<const kernel::MegaStep*>(step_buffer.ptr());
+  params.step_num = static_cast<int32_t>(steps.size());
+  params.hidden = d_hidden;
+  params.pos = kPos;
+  params.dim = kDim;
+  params.kv_dim = kKVDim;
+  params.head_num = kHeadNum;
+  params.head_size = kHeadSize;
+  params.kv_mul = kKVMul;
+  params.seq_len = kSeqLen;
+  params.sin_cache = to_device(freqs, own);
+  params.cos_cache = to_device(factors, own);
+  params.block_table = d_block_table;
+  params.block_size = kBlockSize;
+  params.score = d_score;
+  ASSERT_EQ(kernel::launch_megakernel(params, grid_size, nullptr), cudaSuccess);
+  std::vector<float> logits(kVocabSize);
+  cudaMemcpy(logits.data(), d_logits, kVocabSize * sizeof(float), cudaMemcpyDeviceToHost);
+
+  // the same layer on the host
+  std::vector<float> qkv = matmul(wqkv, rmsnorm(hidden, attention_norm), qkv_dim);
+  for (int32_t i = 0; i < qkv_dim; ++i) {
+    qkv[i] += qkv_bias[i];
+  }
+  for (int32_t i = 0; i < kDim; i += 2) {
+    const float angle = static_cast<float>(kPos) * freqs[(i % kHeadSize) / 2];
+    const float fcr = std::cos(angle);
+    const float fci = std::sin(angle);
+    // the query and, in the first kKVDim elements, the key
+    for (int32_t part = 0; part < (i < kKVDim ? 2 : 1); ++part) {
+      float* v = qkv.data() + part * kDim + i;
+      const float v0 = v[0];
+      const float v1 = v[1];
+      v[0] = fcr * v0 - fci * v1;
+      v[1] = fcr * v1 + fci * v0;
+    }
+  }
+  for (int32_t i = 0; i < kKVDim; ++i) {
+    key_history[kPos * kKVDim + i] = qkv[kDim + i];
+    value_history[kPos * kKVDim + i] = qkv[kDim + kKVDim + i];
+  }
+  std::vector<float> mha(kDim, 0.f);
+  for (int32_t h = 0; h < kHeadNum; ++h) {
+    const int32_t kv_offset = (h / kKVMul) * kHeadSize;
+    std::vector<float> score(kPos + 1);
+    float max_score = -INFINITY;
+    for (int32_t t = 0; t <= kPos; ++t) {
+      score[t] = 0.f;
+      for (int32_t i = 0; i < kHeadSize; ++i) {
+        score[t] += qkv[h * kHeadSize + i] * key_history[t * kKVDim + kv_offset + i];
+      }
+      score[t] /= std::sqrt(static_cast<float>(kHeadSize));
+      max_score = std::max(max_score, score[t]);
+    }
+    float sum = 0.f;
+    for (float& s : score) {
+      s = std::exp(s - max_score);
+      sum += s;
+    }
+    for (int32_t t = 0; t <= kPos; ++t) {
+      for (int32_t i = 0; i < kHeadSize; ++i) {
+        mha[h * kHeadSize + i] += score[t] / sum * value_history[t * kKVDim + kv_offset + i];
+      }
+    }
+  }
+  const std::vector<float> attn = matmul(wo, mha, kDim);
+  for (int32_t i = 0; i < kDim; ++i) {
+    hidden[i] += attn[i];
+  }
+  const std::vector<float> gate_up = matmul(w13, rmsnorm(hidden, ffn_norm), 2 * kHiddenDim);
+  std::vector<float> swiglu(kHiddenDim);
+  for (int32_t i = 0; i < kHiddenDim; ++i) {
+    const float gate = gate_up[i];
+    swiglu[i] = gate / (1.f + std::exp(-gate)) * gate_up[kHiddenDim + i];
+  }
+  const std::vector<float> down = matmul(w2, swiglu, kDim);
+  for (int32_t i = 0; i < kDim; ++i) {
+    hidden[i] += down[i];
+  }
+  const std::vector<float> expected = matmul(cls, rmsnorm(hidden, final_norm), kVocabSize);
+  for (int32_t i = 0; i < kVocabSize; ++i) {
+    ASSERT_NEAR(logits[i], expected[i], 2e-3f) << i;
+  }
+
+  // the key and the value of kPos are stored in its block
+  std::vector<float> stored_key(kSeqLen * kKVDim);
+  cudaMemcpy(stored_key.data(), d_key_cache, stored_key.size() * sizeof(float),
+             cudaMemcpyDeviceToHost);
+  const int32_t physical = blocks.at(kPos / kBlockSize) * kBlockSize + kPos % kBlockSize;
+  for (int32_t i = 0; i < kKVDim; ++i) {
+    ASSERT_NEAR(stored_key[physical * kKVDim + i], key_history[kPos * kKVDim + i], 1e-4f);
+  }
+}
@@ -0,0 +1,965 @@
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "../source/op/kernels/cpu/rope_kernel.h"
+#include "../source/op/kernels/cuda/rope_kernel.cuh"
+#include "../source/op/kernels/kernels_interface.h"
+#include "base/buffer.h"
+#include "base/cuda_config.h"
+#include "model/config.h"
+#include "model/kv_cache.h"
+
+TEST(test_mha_cu, mha_paged_kv_cache) {
+  using namespace base;
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const int32_t head_num = 4;
+  const int32_t head_size = 16;
+  const int32_t kv_dim = head_num * head_size;
+  const int32_t seq_len = 40;
+  const int32_t block_size = 8;
+  const int32_t block_num = 5;
+  const int32_t pos = 29;
+  // the four blocks used by the sequence are scattered over the pool
+  const std::vector<int32_t> blocks{3, 0, 4, 1};
+
+  tensor::Tensor query(DataType::kDataTypeFp32, kv_dim, true, alloc_cpu);
+  tensor::Tensor key_cache(DataType::kDataTypeFp32, 1, seq_len, kv_dim, true, alloc_cpu);
+  tensor::Tensor val_cache(DataType::kDataTypeFp32, 1, seq_len, kv_dim, true, alloc_cpu);
+  tensor::Tensor paged_key(DataType::kDataTypeFp32, 1, block_num * block_size, kv_dim, true,
+                           alloc_cpu);
+  tensor::Tensor paged_val(DataType::kDataTypeFp32, 1, block_num * block_size, kv_dim, true,
+                           alloc_cpu);
+  tensor::Tensor block_table(DataType::kDataTypeInt32, block_num, true, alloc_cpu);
+  for (int32_t i = 0; i < blocks.size(); ++i) {
+    block_table.index<int32_t>(i) = blocks.at(i);
+  }
+
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  for (int32_t i = 0; i < kv_dim; ++i) {
+    query.index<float>(i) = dist(mt);
+  }
+  for (int32_t t = 0; t <= pos; ++t) {
+    const int32_t physical = blocks.at(t / block_size) * block_size + t % block_size;
+    for (int32_t i = 0; i < kv_dim; ++i) {
+      float k = dist(mt);
+      float v = dist(mt);
+      key_cache.index<float>(t * kv_dim + i) = k;
+      val_cache.index<float>(t * kv_dim + i) = v;
+      paged_key.index<float>(physical * kv_dim + i) = k;
+      paged_val.index<float>(physical * kv_dim + i) = v;
+    }
+  }
+
+  tensor::Tensor score(DataType::kDataTypeFp32, head_num, seq_len, true, alloc_cpu);
+  tensor::Tensor out(DataType::kDataTypeFp32, kv_dim, true, alloc_cpu);
+  tensor::Tensor out_paged(DataType::kDataTypeFp32, kv_dim, true, alloc_cpu);
+  kernel::get_mha_kernel(DeviceType::kDeviceCPU)(
+      pos, head_num, 0, seq_len, kv_dim, 1, head_size, block_size, out, query, score, key_cache,
+      val_cache, tensor::Tensor{}, tensor::Tensor{}, tensor::Tensor{}, tensor::Tensor{},
+      base::AttentionWindow{}, DeviceType::kDeviceCPU, nullptr);
+  kernel::get_mha_kernel(DeviceType::kDeviceCPU)(
+      pos, head_num, 0, seq_len, kv_dim, 1, head_size, block_size, out_paged, query, score,
+      paged_key, paged_val, tensor::Tensor{}, tensor::Tensor{}, block_table, tensor::Tensor{},
+      base::AttentionWindow{}, DeviceType::kDeviceCPU, nullptr);
+  for (int32_t i = 0; i < kv_dim; ++i) {
+    ASSERT_NEAR(out.index<float>(i), out_paged.index<float>(i), 1e-5f);
+  }
+
+  kernel::CudaConfig config;
+  cudaStreamCreate(&config.stream);
+  tensor::Tensor query_cu = query.clone();
+  tensor::Tensor score_cu = score.clone();
+  tensor::Tensor key_cu = paged_key.clone();
+  tensor::Tensor val_cu = paged_val.clone();
+  tensor::Tensor table_cu = block_table.clone();
+  tensor::Tensor out_cu = out_paged.clone();
+  query_cu.to_cuda(nullptr);
+  score_cu.to_cuda(nullptr);
+  key_cu.to_cuda(nullptr);
+  val_cu.to_cuda(nullptr);
+  table_cu.to_cuda(nullptr);
+  out_cu.to_cuda(nullptr);
+  kernel::get_mha_kernel(DeviceType::kDeviceCUDA)(
+      pos, head_num, 0, seq_len, kv_dim, 1, head_size, block_size, out_cu, query_cu, score_cu,
+      key_cu, val_cu, tensor::Tensor{}, tensor::Tensor{}, table_cu, tensor::Tensor{},
+      base::AttentionWindow{}, DeviceType::kDeviceCUDA, &config);
+  cudaStreamSynchronize(config.stream);
+  out_cu.to_cpu();
+  for (int32_t i = 0; i < kv_dim; ++i) {
+    ASSERT_NEAR(out_cu.index<float>(i), out.index<float>(i), 1e-4f);
+  }
+}
+
+TEST(test_mha_cu, mha_fp16_kv_cache) {
+  using namespace base;
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  const int32_t head_num = 8;
+  const int32_t head_size = 32;
+  const int32_t kv_dim = head_num * head_size;
+  const int32_t seq_len = 64;
+  const int32_t pos = 47;
+
+  tensor::Tensor query(DataType::kDataTypeFp32, kv_dim, true, alloc_cpu);
+  tensor::Tensor key_cache(DataType::kDataTypeFp32, 1, seq_len, kv_dim, true, alloc_cpu);
+  tensor::Tensor val_cache(DataType::kDataTypeFp32, 1, seq_len, kv_dim, true, alloc_cpu);
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  for (int32_t i = 0; i < kv_dim; ++i) {
+    query.index<float>(i) = dist(mt);
+  }
+  for (int32_t i = 0; i < seq_len * kv_dim; ++i) {
+    key_cache.index<float>(i) = dist(mt);
+    val_cache.index<float>(i) = dist(mt);
+  }
+
+  tensor::Tensor score(DataType::kDataTypeFp32, head_num, seq_len, true, alloc_cpu);
+  tensor::Tensor out(DataType::kDataTypeFp32, kv_dim, true, alloc_cpu);
+  kernel::get_mha_kernel(DeviceType::kDeviceCPU)(pos, head_num, 0, seq_len, kv_dim, 1, head_size,
+                                                 0, out, query, score, key_cache, val_cache,
+                                                 tensor::Tensor{}, tensor::Tensor{},
+                                                 tensor::Tensor{}, tensor::Tensor{},
+                                                 base::AttentionWindow{}, DeviceType::kDeviceCPU,
+                                                 nullptr);
+
+  kernel::CudaConfig config;
+  cudaStreamCreate(&config.stream);
+  tensor::Tensor query_cu = query.clone();
+  tensor::Tensor score_cu = score.clone();
+  tensor::Tensor key_cu = key_cache.clone();
+  tensor::Tensor val_cu = val_cache.clone();
+  tensor::Tensor out_cu = out.clone();
+  query_cu.to_cuda(nullptr);
+  score_cu.to_cuda(nullptr);
+  key_cu.to_cuda(nullptr);
+  val_cu.to_cuda(nullptr);
+  out_cu.to_cuda(nullptr);
+
+  tensor::Tensor key_fp16(DataType::kDataTypeFp16, 1, seq_len, kv_dim, true, alloc_cu);
+  tensor::Tensor val_fp16(DataType::kDataTypeFp16, 1, seq_len, kv_dim, true, alloc_cu);
+  kernel::get_cast_kernel(DeviceType::kDeviceCUDA)(key_cu, key_fp16, config.stream);
+  kernel::get_cast_kernel(DeviceType::kDeviceCUDA)(val_cu, val_fp16, config.stream);
+  kernel::get_mha_kernel(DeviceType::kDeviceCUDA)(
+      pos, head_num, 0, seq_len, kv_dim, 1, head_size, 0, out_cu, query_cu, score_cu, key_fp16,
+      val_fp16, tensor::Tensor{}, tensor::Tensor{}, tensor::Tensor{}, tensor::Tensor{},
+      base::AttentionWindow{}, DeviceType::kDeviceCUDA, &config);
+  cudaStreamSynchronize(config.stream);
+  out_cu.to_cpu();
+  for (int32_t i = 0; i < kv_dim; ++i) {
+    ASSERT_NEAR(out_cu.index<float>(i), out.index<float>(i), 1e-2f);
+  }
+}
+
+TEST(test_mha_cu, mha_split_kv_long_context) {
+  using namespace base;
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const int32_t head_num = 4;
+  const int32_t kv_head_num = 2;
+  const int32_t head_size = 64;
+  const int32_t dim = head_num * head_size;
+  const int32_t kv_dim = kv_head_num * head_size;
+  const int32_t kv_mul = head_num / kv_head_num;
+  const int32_t seq_len = 2048;
+  // long enough to be split across several blocks, the last chunk is partially filled
+  const int32_t pos = 1500;
+
+  tensor::Tensor query(DataType::kDataTypeFp32, dim, true, alloc_cpu);
+  tensor::Tensor key_cache(DataType::kDataTypeFp32, 1, seq_len, kv_dim, true, alloc_cpu);
+  tensor::Tensor val_cache(DataType::kDataTypeFp32, 1, seq_len, kv_dim, true, alloc_cpu);
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  for (int32_t i = 0; i < dim; ++i) {
+    query.index<float>(i) = dist(mt);
+  }
+  for (int32_t i = 0; i < seq_len * kv_dim; ++i) {
+    key_cache.index<float>(i) = dist(mt);
+    val_cache.index<float>(i) = dist(mt);
+  }
+
+  tensor::Tensor score(DataType::kDataTypeFp32, head_num, seq_len, true, alloc_cpu);
+  tensor::Tensor out(DataType::kDataTypeFp32, dim, true, alloc_cpu);
+  kernel::get_mha_kernel(DeviceType::kDeviceCPU)(pos, head_num, 0, seq_len, kv_dim, kv_mul,
+                                                 head_size, 0, out, query, score, key_cache,
+                                                 val_cache, tensor::Tensor{}, tensor::Tensor{},
+                                                 tensor::Tensor{}, tensor::Tensor{},
+                                                 base::AttentionWindow{}, DeviceType::kDeviceCPU,
+                                                 nullptr);
+
+  kernel::CudaConfig config;
+  cudaStreamCreate(&config.stream);
+  tensor::Tensor query_cu = query.clone();
+  tensor::Tensor score_cu = score.clone();
+  tensor::Tensor key_cu = key_cache.clone();
+  tensor::Tensor val_cu = val_cache.clone();
+  tensor::Tensor out_cu = out.clone();
+  query_cu.to_cuda(nullptr);
+  score_cu.to_cuda(nullptr);
+  key_cu.to_cuda(nullptr);
+  val_cu.to_cuda(nullptr);
+  out_cu.to_cuda(nullptr);
+  kernel::get_mha_kernel(DeviceType::kDeviceCUDA)(
+      pos, head_num, 0, seq_len, kv_dim, kv_mul, head_size, 0, out_cu, query_cu, score_cu,
+      key_cu, val_cu, tensor::Tensor{}, tensor::Tensor{}, tensor::Tensor{}, tensor::Tensor{},
+      base::AttentionWindow{}, DeviceType::kDeviceCUDA, &config);
+  cudaStreamSynchronize(config.stream);
+  out_cu.to_cpu();
+  for (int32_t i = 0; i < dim; ++i) {
+    ASSERT_NEAR(out_cu.index<float>(i), out.index<float>(i), 1e-4f);
+  }
+}
+
+TEST(test_mha_cu, mha_device_pos) {
+  using namespace base;
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const int32_t head_num = 4;
+  const int32_t head_size = 32;
+  const int32_t kv_dim = head_num * head_size;
+  const int32_t seq_len = 32;
+  const int32_t pos = 19;
+
+  tensor::Tensor query(DataType::kDataTypeFp32, kv_dim, true, alloc_cpu);
+  tensor::Tensor key_cache(DataType::kDataTypeFp32, 1, seq_len, kv_dim, true, alloc_cpu);
+  tensor::Tensor val_cache(DataType::kDataTypeFp32, 1, seq_len, kv_dim, true, alloc_cpu);
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  for (int32_t i = 0; i < kv_dim; ++i) {
+    query.index<float>(i) = dist(mt);
+  }
+  for (int32_t i = 0; i < seq_len * kv_dim; ++i) {
+    key_cache.index<float>(i) = dist(mt);
+    val_cache.index<float>(i) = dist(mt);
+  }
+  tensor::Tensor score(DataType::kDataTypeFp32, head_num, seq_len, true, alloc_cpu);
+  tensor::Tensor out(DataType::kDataTypeFp32, kv_dim, true, alloc_cpu);
+  tensor::Tensor pos_tensor(DataType::kDataTypeInt32, 1, true, alloc_cpu);
+  pos_tensor.index<int32_t>(0) = pos;
+
+  kernel::CudaConfig config;
+  cudaStreamCreate(&config.stream);
+  tensor::Tensor query_cu = query.clone();
+  tensor::Tensor score_cu = score.clone();
+  tensor::Tensor key_cu = key_cache.clone();
+  tensor::Tensor val_cu = val_cache.clone();
+  tensor::Tensor out_cu = out.clone();
+  tensor::Tensor out_pos_cu = out.clone();
+  tensor::Tensor pos_cu = pos_tensor.clone();
+  query_cu.to_cuda(nullptr);
+  score_cu.to_cuda(nullptr);
+  key_cu.to_cuda(nullptr);
+  val_cu.to_cuda(nullptr);
+  out_cu.to_cuda(nullptr);
+  out_pos_cu.to_cuda(nullptr);
+  pos_cu.to_cuda(nullptr);
+  // the position argument is ignored when it is read from the device
+  kernel::get_mha_kernel(DeviceType::kDeviceCUDA)(
+      pos, head_num, 0, seq_len, kv_dim, 1, head_size, 0, out_cu, query_cu, score_cu, key_cu,
+      val_cu, tensor::Tensor{}, tensor::Tensor{}, tensor::Tensor{}, tensor::Tensor{},
+      base::AttentionWindow{}, DeviceType::kDeviceCUDA, &config);
+  kernel::get_mha_kernel(DeviceType::kDeviceCUDA)(
+      0, head_num, 0, seq_len, kv_dim, 1, head_size, 0, out_pos_cu, query_cu, score_cu, key_cu,
+      val_cu, tensor::Tensor{}, tensor::Tensor{}, tensor::Tensor{}, pos_cu,
+      base::AttentionWindow{}, DeviceType::kDeviceCUDA, &config);
+  cudaStreamSynchronize(config.stream);
+  out_cu.to_cpu();
+  out_pos_cu.to_cpu();
+  for (int32_t i = 0; i < kv_dim; ++i) {
+    ASSERT_EQ(out_cu.index<float>(i), out_pos_cu.index<float>(i));
+  }
+}
+
+TEST(test_mha_cu, mha_int8_kv_cache) {
+  using namespace base;
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const int32_t head_num = 4;
+  const int32_t head_size = 32;
+  const int32_t kv_dim = head_num * head_size;
+  const int32_t seq_len = 48;
+  const int32_t pos = 37;
+
+  tensor::Tensor query(DataType::kDataTypeFp32, kv_dim, true, alloc_cpu);
+  tensor::Tensor key_cache(DataType::kDataTypeFp32, 1, seq_len, kv_dim, true, alloc_cpu);
+  tensor::Tensor val_cache(DataType::kDataTypeFp32, 1, seq_len, kv_dim, true, alloc_cpu);
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  for (int32_t i = 0; i < kv_dim; ++i) {
+    query.index<float>(i) = dist(mt);
+  }
+  for (int32_t i = 0; i < seq_len * kv_dim; ++i) {
+    key_cache.index<float>(i) = dist(mt);
+    val_cache.index<float>(i) = dist(mt);
+  }
+
+  // the sequence is one block, the rows are quantized with one scale per head
+  tensor::Tensor block_table(DataType::kDataTypeInt32, 1, true, alloc_cpu);
+  block_table.index<int32_t>(0) = 0;
+  tensor::Tensor start_pos(DataType::kDataTypeInt32, 1, true, alloc_cpu);
+  start_pos.index<int32_t>(0) = 0;
+  tensor::Tensor key_int8(DataType::kDataTypeInt8, 1, seq_len, kv_dim, true, alloc_cpu);
+  tensor::Tensor val_int8(DataType::kDataTypeInt8, 1, seq_len, kv_dim, true, alloc_cpu);
+  tensor::Tensor key_scale(DataType::kDataTypeFp32, 1, seq_len, head_num, true, alloc_cpu);
+  tensor::Tensor val_scale(DataType::kDataTypeFp32, 1, seq_len, head_num, true, alloc_cpu);
+  kernel::get_kv_cache_write_kernel(DeviceType::kDeviceCPU)(
+      key_cache, val_cache, key_int8, val_int8, key_scale, val_scale, block_table, start_pos, 0,
+      seq_len, base::AttentionWindow{}, nullptr);
+
+  tensor::Tensor score(DataType::kDataTypeFp32, head_num, seq_len, true, alloc_cpu);
+  tensor::Tensor out(DataType::kDataTypeFp32, kv_dim, true, alloc_cpu);
+  tensor::Tensor out_int8(DataType::kDataTypeFp32, kv_dim, true, alloc_cpu);
+  kernel::get_mha_kernel(DeviceType::kDeviceCPU)(
+      pos, head_num, 0, seq_len, kv_dim, 1, head_size, 0, out, query, score, key_cache,
+      val_cache, tensor::Tensor{}, tensor::Tensor{}, tensor::Tensor{}, tensor::Tensor{},
+      base::AttentionWindow{}, DeviceType::kDeviceCPU, nullptr);
+  kernel::get_mha_kernel(DeviceType::kDeviceCPU)(
+      pos, head_num, 0, seq_len, kv_dim, 1, head_size, seq_len, out_int8, query, score, key_int8,
+      val_int8, key_scale, val_scale, block_table, tensor::Tensor{}, base::AttentionWindow{},
+      DeviceType::kDeviceCPU, nullptr);
+  for (int32_t i = 0; i < kv_dim; ++i) {
+    ASSERT_NEAR(out_int8.index<float>(i), out.index<float>(i), 2e-2f);
+  }
+
+  kernel::CudaConfig config;
+  cudaStreamCreate(&config.stream);
+  tensor::Tensor query_cu = query.clone();
+  tensor::Tensor score_cu = score.clone();
+  tensor::Tensor key_cu = key_int8.clone();
+  tensor::Tensor val_cu = val_int8.clone();
+  tensor::Tensor key_scale_cu = key_scale.clone();
+  tensor::Tensor val_scale_cu = val_scale.clone();
+  tensor::Tensor table_cu = block_table.clone();
+  tensor::Tensor out_cu = out_int8.clone();
+  query_cu.to_cuda(nullptr);
+  score_cu.to_cuda(nullptr);
+  key_cu.to_cuda(nullptr);
+  val_cu.to_cuda(nullptr);
+  key_scale_cu.to_cuda(nullptr);
+  val_scale_cu.to_cuda(nullptr);
+  table_cu.to_cuda(nullptr);
+  out_cu.to_cuda(nullptr);
+  kernel::get_mha_kernel(DeviceType::kDeviceCUDA)(
+      pos, head_num, 0, seq_len, kv_dim, 1, head_size, seq_len, out_cu, query_cu, score_cu,
+      key_cu, val_cu, key_scale_cu, val_scale_cu, table_cu, tensor::Tensor{},
+      base::AttentionWindow{}, DeviceType::kDeviceCUDA, &config);
+  cudaStreamSynchronize(config.stream);
+  out_cu.to_cpu();
+  for (int32_t i = 0; i < kv_dim; ++i) {
+    ASSERT_NEAR(out_cu.index<float>(i), out_int8.index<float>(i), 1e-4f);
+  }
+}
+
+TEST(test_mha_cu, mha_grouped_query) {
+  using namespace base;
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const int32_t head_num = 8;
+  const int32_t kv_head_num = 2;
+  const int32_t head_size = 64;
+  const int32_t dim = head_num * head_size;
+  const int32_t kv_dim = kv_head_num * head_size;
+  const int32_t kv_mul = head_num / kv_head_num;
+  const int32_t seq_len = 128;
+  // three rows of a prompt, the last kv tile of every row is partially filled
+  const int32_t num_tokens = 3;
+  const int32_t pos = 70;
+
+  tensor::Tensor query(DataType::kDataTypeFp32, num_tokens, dim, true, alloc_cpu);
+  tensor::Tensor key_cache(DataType::kDataTypeFp32, 1, seq_len, kv_dim, true, alloc_cpu);
+  tensor::Tensor val_cache(DataType::kDataTypeFp32, 1, seq_len, kv_dim, true, alloc_cpu);
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  for (int32_t i = 0; i < query.size(); ++i) {
+    query.index<float>(i) = dist(mt);
+  }
+  for (int32_t i = 0; i < seq_len * kv_dim; ++i) {
+    key_cache.index<float>(i) = dist(mt);
+    val_cache.index<float>(i) = dist(mt);
+  }
+
+  tensor::Tensor score(DataType::kDataTypeFp32, head_num, seq_len, true, alloc_cpu);
+  tensor::Tensor out(DataType::kDataTypeFp32, num_tokens, dim, true, alloc_cpu);
+  kernel::get_mha_kernel(DeviceType::kDeviceCPU)(pos, head_num, 0, seq_len, kv_dim, kv_mul,
+                                                 head_size, 0, out, query, score, key_cache,
+                                                 val_cache, tensor::Tensor{}, tensor::Tensor{},
+                                                 tensor::Tensor{}, tensor::Tensor{},
+                                                 base::AttentionWindow{}, DeviceType::kDeviceCPU,
+                                                 nullptr);
+
+  kernel::CudaConfig config;
+  cudaStreamCreate(&config.stream);
+  tensor::Tensor query_cu = query.clone();
+  tensor::Tensor score_cu = score.clone();
+  tensor::Tensor key_cu = key_cache.clone();
+  tensor::Tensor val_cu = val_cache.clone();
+  tensor::Tensor out_cu = out.clone();
+  query_cu.to_cuda(nullptr);
+  score_cu.to_cuda(nullptr);
+  key_cu.to_cuda(nullptr);
+  val_cu.to_cuda(nullptr);
+  out_cu.to_cuda(nullptr);
+  kernel::get_mha_kernel(DeviceType::kDeviceCUDA)(
+      pos, head_num, 0, seq_len, kv_dim, kv_mul, head_size, 0, out_cu, query_cu, score_cu,
+      key_cu, val_cu, tensor::Tensor{}, tensor::Tensor{}, tensor::Tensor{}, tensor::Tensor{},
+      base::AttentionWindow{}, DeviceType::kDeviceCUDA, &config);
+  cudaStreamSynchronize(config.stream);
+  out_cu.to_cpu();
+  for (int32_t i = 0; i < out.size(); ++i) {
+    ASSERT_NEAR(out_cu.index<float>(i), out.index<float>(i), 1e-4f);
+  }
+}
+
+TEST(test_mha_cu, rope_kv_cache_write) {
+  using namespace base;
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  const bool is_rotate_half = model::kDefaultRoPERotateHalf;
+  const int32_t head_size = 32;
+  const int32_t dim = 8 * head_size;
+  const int32_t kv_dim = 2 * head_size;
+  const int32_t seq_len = 32;
+  const int32_t block_size = 8;
+  const int32_t num_tokens = 3;
+  // the rows cross from the physical block 2 into the block 3
+  const int32_t pos = 6;
+
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  tensor::Tensor query(DataType::kDataTypeFp32, num_tokens, dim, true, alloc_cpu);
+  tensor::Tensor key(DataType::kDataTypeFp32, num_tokens, kv_dim, true, alloc_cpu);
+  tensor::Tensor val(DataType::kDataTypeFp32, num_tokens, kv_dim, true, alloc_cpu);
+  for (int32_t i = 0; i < query.size(); ++i) {
+    query.index<float>(i) = dist(mt);
+  }
+  for (int32_t i = 0; i < key.size(); ++i) {
+    key.index<float>(i) = dist(mt);
+    val.index<float>(i) = dist(mt);
+  }
+  tensor::Tensor block_table(DataType::kDataTypeInt32, seq_len / block_size, true, alloc_cpu);
+  for (int32_t i = 0; i < block_table.size(); ++i) {
+    block_table.index<int32_t>(i) = (i + 2) % block_table.size();
+  }
+  tensor::Tensor pos_tensor(DataType::kDataTypeInt32, 1, true, alloc_cpu);
+  pos_tensor.index<int32_t>(0) = pos;
+
+  kernel::CudaConfig config;
+  cudaStreamCreate(&config.stream);
+  const int32_t rope_size = base::rope_table_rows(seq_len) * head_size / 2;
+  tensor::Tensor sin_cache(DataType::kDataTypeFp32, rope_size, true, alloc_cu);
+  tensor::Tensor cos_cache(DataType::kDataTypeFp32, rope_size, true, alloc_cu);
+  kernel::sin_cos_cache_calc_cu(head_size, seq_len, model::kDefaultRoPETheta,
+                                base::RoPEScaling{}, sin_cache, cos_cache, config.stream);
+  tensor::Tensor table_cu = block_table.clone();
+  table_cu.to_cuda(config.stream);
+
+  // the reference rotates the query and key first and writes the cache after that
+  tensor::Tensor query_ref = query.clone();
+  tensor::Tensor key_ref = key.clone();
+  tensor::Tensor val_cu = val.clone();
+  query_ref.to_cuda(config.stream);
+  key_ref.to_cuda(config.stream);
+  val_cu.to_cuda(config.stream);
+  tensor::Tensor key_cache_ref(DataType::kDataTypeFp32, 1, seq_len, kv_dim, true, alloc_cu);
+  tensor::Tensor val_cache_ref(DataType::kDataTypeFp32, 1, seq_len, kv_dim, true, alloc_cu);
+  kernel::get_rope_kernel(DeviceType::kDeviceCUDA)(dim, kv_dim, head_size, is_rotate_half,
+                                                   query_ref, key_ref, pos_tensor, sin_cache,
+                                                   cos_cache, config.stream);
+  kernel::get_kv_cache_write_kernel(DeviceType::kDeviceCUDA)(
+      key_ref, val_cu, key_cache_ref, val_cache_ref, tensor::Tensor{}, tensor::Tensor{},
+      table_cu, pos_tensor, 0, block_size, base::AttentionWindow{}, config.stream);
+
+  tensor::Tensor query_cu = query.clone();
+  tensor::Tensor key_cu = key.clone();
+  query_cu.to_cuda(config.stream);
+  key_cu.to_cuda(config.stream);
+  tensor::Tensor key_cache(DataType::kDataTypeFp32, 1, seq_len, kv_dim, true, alloc_cu);
+  tensor::Tensor val_cache(DataType::kDataTypeFp32, 1, seq_len, kv_dim, true, alloc_cu);
+  kernel::get_rope_kv_cache_write_kernel(DeviceType::kDeviceCUDA)(
+      dim, kv_dim, head_size, is_rotate_half, query_cu, key_cu, val_cu, key_cache, val_cache,
+      table_cu, pos_tensor, sin_cache, cos_cache, 0, block_size, config.stream);
+
+  cudaStreamSynchronize(config.stream);
+  query_ref.to_cpu();
+  query_cu.to_cpu();
+  for (int32_t i = 0; i < query.size(); ++i) {
+    ASSERT_NEAR(query_cu.index<float>(i), query_ref.index<float>(i), 1e-5f);
+  }
+  key_cache_ref.to_cpu();
+  val_cache_ref.to_cpu();
+  key_cache.to_cpu();
+  val_cache.to_cpu();
+  for (int32_t row = 0; row < num_tokens; ++row) {
+    const int32_t t = pos + row;
+    const int32_t physical = block_table.index<int32_t>(t / block_size) * block_size +
+                             t % block_size;
+    for (int32_t i = 0; i < kv_dim; ++i) {
+      const int32_t offset = physical * kv_dim + i;
+      ASSERT_NEAR(key_cache.index<float>(offset), key_cache_ref.index<float>(offset), 1e-5f);
+      ASSERT_EQ(val_cache.index<float>(offset), val_cache_ref.index<float>(offset));
+    }
+  }
+}
+
+TEST(test_mha_cu, rope_styles_and_head_sizes) {
+  using namespace base;
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  const int32_t seq_len = 16;
+  const int32_t num_tokens = 3;
+  const int32_t pos = 5;
+  std::mt19937 mt(7);
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  // 64 and 128 run the kernels specialized for the head size, 96 the generic one
+  for (bool is_rotate_half : {false, true}) {
+    for (int32_t head_size : {64, 96, 128}) {
+      const int32_t dim = 4 * head_size;
+      const int32_t kv_dim = 2 * head_size;
+      const float theta = is_rotate_half ? 1000000.f : 10000.f;
+      const int32_t rope_size = base::rope_table_rows(seq_len) * head_size / 2;
+      const base::RoPEScaling scaling;
+      tensor::Tensor sin_cache(DataType::kDataTypeFp32, rope_size, true, alloc_cpu);
+      tensor::Tensor cos_cache(DataType::kDataTypeFp32, rope_size, true, alloc_cpu);
+      kernel::sin_cos_cache_calc_cpu(head_size, seq_len, theta, scaling, sin_cache.ptr<float>(),
+                                     cos_cache.ptr<float>());
+      tensor::Tensor sin_cu(DataType::kDataTypeFp32, rope_size, true, alloc_cu);
+      tensor::Tensor cos_cu(DataType::kDataTypeFp32, rope_size, true, alloc_cu);
+      kernel::sin_cos_cache_calc_cu(head_size, seq_len, theta, scaling, sin_cu, cos_cu,
+                                    nullptr);
+
+      tensor::Tensor query(DataType::kDataTypeFp32, num_tokens, dim, true, alloc_cpu);
+      tensor::Tensor key(DataType::kDataTypeFp32, num_tokens, kv_dim, true, alloc_cpu);
+      for (int32_t i = 0; i < query.size(); ++i) {
+        query.index<float>(i) = dist(mt);
+      }
+      for (int32_t i = 0; i < key.size(); ++i) {
+        key.index<float>(i) = dist(mt);
+      }
+      tensor::Tensor pos_tensor(DataType::kDataTypeInt32, 1, true, alloc_cpu);
+      pos_tensor.index<int32_t>(0) = pos;
+      tensor::Tensor query_cpu = query.clone();
+      tensor::Tensor key_cpu = key.clone();
+      tensor::Tensor query_cu = query.clone();
+      tensor::Tensor key_cu = key.clone();
+      query_cu.to_cuda(nullptr);
+      key_cu.to_cuda(nullptr);
+      kernel::get_rope_kernel(DeviceType::kDeviceCPU)(dim, kv_dim, head_size, is_rotate_half,
+                                                      query_cpu, key_cpu, pos_tensor, sin_cache,
+                                                      cos_cache, nullptr);
+      kernel::get_rope_kernel(DeviceType::kDeviceCUDA)(dim, kv_dim, head_size, is_rotate_half,
+                                                       query_cu, key_cu, pos_tensor, sin_cu,
+                                                       cos_cu, nullptr);
+      cudaDeviceSynchronize();
+      query_cu.to_cpu();
+      key_cu.to_cpu();
+      for (int32_t i = 0; i < query.size(); ++i) {
+        ASSERT_NEAR(query_cu.index<float>(i), query_cpu.index<float>(i), 1e-4f);
+      }
+      for (int32_t i = 0; i < key.size(); ++i) {
+        ASSERT_NEAR(key_cu.index<float>(i), key_cpu.index<float>(i), 1e-4f);
+      }
+
+      // the first pair of a head turns by one radian per position
+      const int32_t partner = is_rotate_half ? head_size / 2 : 1;
+      const float q0 = query.index<float>(0);
+      const float q1 = query.index<float>(partner);
+      ASSERT_NEAR(query_cpu.index<float>(0), q0 * std::cos(pos) - q1 * std::sin(pos), 1e-4f);
+      ASSERT_NEAR(query_cpu.index<float>(partner), q0 * std::sin(pos) + q1 * std::cos(pos),
+                  1e-4f);
+    }
+  }
+}
+
+TEST(test_mha_cu, rope_scaled_long_context) {
+  using namespace base;
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  const int32_t head_size = 128;
+  const int32_t dim = 2 * head_size;
+  const int32_t kv_dim = head_size;
+  const int32_t seq_len = 131072;
+  const int32_t num_tokens = 2;
+  base::RoPEScaling scaling;
+  scaling.type = RoPEScalingType::kRoPEScalingLlama3;
+  scaling.factor = 8.f;
+  scaling.original_max_pos = 8192;
+  const int32_t rope_size = base::rope_table_rows(seq_len) * head_size / 2;
+  tensor::Tensor sin_cache(DataType::kDataTypeFp32, rope_size, true, alloc_cpu);
+  tensor::Tensor cos_cache(DataType::kDataTypeFp32, rope_size, true, alloc_cpu);
+  kernel::sin_cos_cache_calc_cpu(head_size, seq_len, 500000.f, scaling, sin_cache.ptr<float>(),
+                                 cos_cache.ptr<float>());
+  tensor::Tensor sin_cu(DataType::kDataTypeFp32, rope_size, true, alloc_cu);
+  tensor::Tensor cos_cu(DataType::kDataTypeFp32, rope_size, true, alloc_cu);
+  kernel::sin_cos_cache_calc_cu(head_size, seq_len, 500000.f, scaling, sin_cu, cos_cu, nullptr);
+
+  std::mt19937 mt(11);
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  // the tiles of the cpu and the angles computed in the cuda kernel agree far from the start
+  for (int32_t pos : {0, 4095, 100000, seq_len - num_tokens}) {
+    tensor::Tensor query(DataType::kDataTypeFp32, num_tokens, dim, true, alloc_cpu);
+    tensor::Tensor key(DataType::kDataTypeFp32, num_tokens, kv_dim, true, alloc_cpu);
+    for (int32_t i = 0; i < query.size(); ++i) {
+      query.index<float>(i) = dist(mt);
+    }
+    for (int32_t i = 0; i < key.size(); ++i) {
+      key.index<float>(i) = dist(mt);
+    }
+    tensor::Tensor pos_tensor(DataType::kDataTypeInt32, 1, true, alloc_cpu);
+    pos_tensor.index<int32_t>(0) = pos;
+    tensor::Tensor query_cu = query.clone();
+    tensor::Tensor key_cu = key.clone();
+    query_cu.to_cuda(nullptr);
+    key_cu.to_cuda(nullptr);
+    kernel::get_rope_kernel(DeviceType::kDeviceCPU)(dim, kv_dim, head_size, true, query, key,
+                                                    pos_tensor, sin_cache, cos_cache, nullptr);
+    kernel::get_rope_kernel(DeviceType::kDeviceCUDA)(dim, kv_dim, head_size, true, query_cu,
+                                                     key_cu, pos_tensor, sin_cu, cos_cu,
+                                                     nullptr);
+    cudaDeviceSynchronize();
+    query_cu.to_cpu();
+    key_cu.to_cpu();
+    for (int32_t i = 0; i < query.size(); ++i) {
+      ASSERT_NEAR(query_cu.index<float>(i), query.index<float>(i), 1e-4f);
+    }
+    for (int32_t i = 0; i < key.size(); ++i) {
+      ASSERT_NEAR(key_cu.index<float>(i), key.index<float>(i), 1e-4f);
+    }
+  }
+}
+
+TEST(test_mha_cu, mha_head_major_kv_cache) {
+  using namespace base;
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const int32_t head_num = 4;
+  const int32_t kv_mul = 2;
+  const int32_t head_size = 32;
+  const int32_t dim = head_num * head_size;
+  const int32_t kv_dim = dim / kv_mul;
+  const int32_t block_size = 4;
+  const int32_t seq_len = 32;
+  const int32_t pos = 13;
+
+  // the same rows are written to a token major and a head major cache with two layers
+  model::PagedKVCache token_major(DeviceType::kDeviceCPU, DataType::kDataTypeFp32, 2, kv_dim,
+                                  block_size, 8, 1, seq_len, head_size);
+  model::PagedKVCache head_major(DeviceType::kDeviceCPU, DataType::kDataTypeFp32, 2, kv_dim,
+                                 block_size, 8, 1, seq_len, head_size, true);
+  ASSERT_EQ(head_major.key_cache().dims_size(), 4);
+  ASSERT_TRUE(token_major.reserve(0, pos + 1));
+  ASSERT_TRUE(head_major.reserve(0, pos + 1));
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  tensor::Tensor key(DataType::kDataTypeFp32, pos + 1, kv_dim, true, alloc_cpu);
+  tensor::Tensor val(DataType::kDataTypeFp32, pos + 1, kv_dim, true, alloc_cpu);
+  tensor::Tensor query(DataType::kDataTypeFp32, dim, true, alloc_cpu);
+  for (int32_t i = 0; i < key.size(); ++i) {
+    key.index<float>(i) = dist(mt);
+    val.index<float>(i) = dist(mt);
+  }
+  for (int32_t i = 0; i < dim; ++i) {
+    query.index<float>(i) = dist(mt);
+  }
+  token_major.write(1, 0, 0, key, val);
+  head_major.write(1, 0, 0, key, val);
+
+  tensor::Tensor score(DataType::kDataTypeFp32, head_num, seq_len, true, alloc_cpu);
+  tensor::Tensor out(DataType::kDataTypeFp32, dim, true, alloc_cpu);
+  tensor::Tensor out_head_major(DataType::kDataTypeFp32, dim, true, alloc_cpu);
+  kernel::get_mha_kernel(DeviceType::kDeviceCPU)(
+      pos, head_num, 1, seq_len, kv_dim, kv_mul, head_size, block_size, out, query, score,
+      token_major.key_cache(), token_major.value_cache(), tensor::Tensor{}, tensor::Tensor{},
+      token_major.block_table(0), tensor::Tensor{}, base::AttentionWindow{},
+      DeviceType::kDeviceCPU, nullptr);
+  kernel::get_mha_kernel(DeviceType::kDeviceCPU)(
+      pos, head_num, 1, seq_len, kv_dim, kv_mul, head_size, block_size, out_head_major, query,
+      score, head_major.key_cache(), head_major.value_cache(), tensor::Tensor{},
+      tensor::Tensor{}, head_major.block_table(0), tensor::Tensor{}, base::AttentionWindow{},
+      DeviceType::kDeviceCPU, nullptr);
+  for (int32_t i = 0; i < dim; ++i) {
+    ASSERT_NEAR(out_head_major.index<float>(i), out.index<float>(i), 1e-5f);
+  }
+}
+
+TEST(test_mha_cu, mha_head_major_kv_cache_cu) {
+  using namespace base;
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const int32_t head_num = 8;
+  const int32_t kv_mul = 4;
+  const int32_t head_size = 64;
+  const int32_t dim = head_num * head_size;
+  const int32_t kv_dim = dim / kv_mul;
+  const int32_t block_size = 8;
+  const int32_t seq_len = 64;
+  const int32_t pos = 45;
+
+  // the cpu reference reads a token major cache, the device one is head major in fp16
+  model::PagedKVCache token_major(DeviceType::kDeviceCPU, DataType::kDataTypeFp32, 2, kv_dim,
+                                  block_size, 8, 1, seq_len, head_size);
+  model::PagedKVCache head_major(DeviceType::kDeviceCUDA, DataType::kDataTypeFp16, 2, kv_dim,
+                                 block_size, 8, 1, seq_len, head_size, true);
+  ASSERT_EQ(head_major.key_cache().dims_size(), 4);
+  ASSERT_FALSE(head_major.is_rope_fused());
+  ASSERT_TRUE(token_major.reserve(0, pos + 1));
+  ASSERT_TRUE(head_major.reserve(0, pos + 1));
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  tensor::Tensor key(DataType::kDataTypeFp32, pos + 1, kv_dim, true, alloc_cpu);
+  tensor::Tensor val(DataType::kDataTypeFp32, pos + 1, kv_dim, true, alloc_cpu);
+  tensor::Tensor query(DataType::kDataTypeFp32, dim, true, alloc_cpu);
+  for (int32_t i = 0; i < key.size(); ++i) {
+    key.index<float>(i) = dist(mt);
+    val.index<float>(i) = dist(mt);
+  }
+  for (int32_t i = 0; i < dim; ++i) {
+    query.index<float>(i) = dist(mt);
+  }
+  token_major.write(1, 0, 0, key, val);
+  tensor::Tensor key_cu = key.clone();
+  tensor::Tensor val_cu = val.clone();
+  key_cu.to_cuda(nullptr);
+  val_cu.to_cuda(nullptr);
+  tensor::Tensor pos_cu(DataType::kDataTypeInt32, 1, true, alloc_cpu);
+  pos_cu.index<int32_t>(0) = pos;
+  pos_cu.to_cuda(nullptr);
+  // the prompt rows are written at a position of the host, the last row at one of the device
+  auto rows = [](const tensor::Tensor& tensor, int32_t row, int32_t row_num, int32_t cols) {
+    tensor::Tensor slice(DataType::kDataTypeFp32, row_num, cols, false, nullptr,
+                         const_cast<float*>(tensor.ptr<float>(row * cols)));
+    slice.set_device_type(DeviceType::kDeviceCUDA);
+    return slice;
+  };
+  head_major.write(1, 0, 0, rows(key_cu, 0, pos, kv_dim), rows(val_cu, 0, pos, kv_dim));
+  head_major.write(1, 0, pos_cu, rows(key_cu, pos, 1, kv_dim), rows(val_cu, pos, 1, kv_dim));
+  cudaDeviceSynchronize();
+
+  tensor::Tensor score(DataType::kDataTypeFp32, head_num, seq_len, true, alloc_cpu);
+  tensor::Tensor out(DataType::kDataTypeFp32, dim, true, alloc_cpu);
+  kernel::get_mha_kernel(DeviceType::kDeviceCPU)(
+      pos, head_num, 1, seq_len, kv_dim, kv_mul, head_size, block_size, out, query, score,
+      token_major.key_cache(), token_major.value_cache(), tensor::Tensor{}, tensor::Tensor{},
+      token_major.block_table(0), tensor::Tensor{}, base::AttentionWindow{},
+      DeviceType::kDeviceCPU, nullptr);
+
+  kernel::CudaConfig config;
+  cudaStreamCreate(&config.stream);
+  tensor::Tensor query_cu = query.clone();
+  tensor::Tensor score_cu = score.clone();
+  tensor::Tensor out_cu = out.clone();
+  query_cu.to_cuda(nullptr);
+  score_cu.to_cuda(nullptr);
+  out_cu.to_cuda(nullptr);
+  for (const tensor::Tensor& pos_tensor : {tensor::Tensor{}, pos_cu}) {
+    kernel::get_mha_kernel(DeviceType::kDeviceCUDA)(
+        pos, head_num, 1, seq_len, kv_dim, kv_mul, head_size, block_size, out_cu, query_cu,
+        score_cu, head_major.key_cache(), head_major.value_cache(), tensor::Tensor{},
+        tensor::Tensor{}, head_major.block_table(0), pos_tensor, base::AttentionWindow{},
+        DeviceType::kDeviceCUDA, &config);
+    cudaStreamSynchronize(config.stream);
+    tensor::Tensor out_host = out_cu.clone();
+    out_host.to_cpu();
+    for (int32_t i = 0; i < dim; ++i) {
+      ASSERT_NEAR(out_host.index<float>(i), out.index<float>(i), 2e-3f);
+    }
+  }
+}
+
+TEST(test_mha_cu, mha_attention_window) {
+  using namespace base;
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const int32_t head_num = 4;
+  const int32_t kv_mul = 2;
+  const int32_t head_size = 16;
+  const int32_t dim = head_num * head_size;
+  const int32_t kv_dim = dim / kv_mul;
+  const int32_t block_size = 4;
+  const int32_t seq_len = 16;
+  // the sequence runs past seq_len, the cache keeps the sinks and a ring of 7 rows
+  const int32_t token_num = 30;
+  base::AttentionWindow window;
+  window.sink_num = 2;
+  window.window_size = 5;
+  window.chunk_size = 3;
+  ASSERT_EQ(window.capacity(), 9);
+  ASSERT_EQ(window.attended_num(1), 2);
+  ASSERT_EQ(window.attended_num(4), 5);
+  ASSERT_EQ(window.attended_num(29), 7);
+  ASSERT_EQ(window.attended_pos(2, 29), 25);
+  ASSERT_EQ(window.cache_pos(29), 2 + 27 % 7);
+
+  model::PagedKVCache kv_cache(DeviceType::kDeviceCPU, DataType::kDataTypeFp32, 1, kv_dim,
+                               block_size, 8, 1, seq_len, head_size);
+  kv_cache.set_window(window);
+  ASSERT_TRUE(kv_cache.reserve(0, token_num));
+  ASSERT_EQ(kv_cache.reserved_token_num(0), 12);
+  ASSERT_FALSE(kv_cache.is_rope_fused());
+
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  tensor::Tensor key(DataType::kDataTypeFp32, token_num, kv_dim, true, alloc_cpu);
+  tensor::Tensor val(DataType::kDataTypeFp32, token_num, kv_dim, true, alloc_cpu);
+  tensor::Tensor query(DataType::kDataTypeFp32, token_num, dim, true, alloc_cpu);
+  for (int32_t i = 0; i < key.size(); ++i) {
+    key.index<float>(i) = dist(mt);
+    val.index<float>(i) = dist(mt);
+  }
+  for (int32_t i = 0; i < query.size(); ++i) {
+    query.index<float>(i) = dist(mt);
+  }
+  auto rows = [](const tensor::Tensor& tensor, int32_t row, int32_t row_num) {
+    const int32_t cols = tensor.get_dim(1);
+    tensor::Tensor view(DataType::kDataTypeFp32, row_num, cols, false, nullptr,
+                        const_cast<float*>(tensor.ptr<float>(row * cols)));
+    view.set_device_type(DeviceType::kDeviceCPU);
+    return view;
+  };
+
+  tensor::Tensor score(DataType::kDataTypeFp32, head_num, seq_len, true, alloc_cpu);
+  tensor::Tensor out(DataType::kDataTypeFp32, token_num, dim, true, alloc_cpu);
+  // every chunk is written and then attended, as the prefill of a windowed prompt does
+  for (int32_t begin = 0; begin < token_num; begin += window.chunk_size) {
+    kv_cache.write(0, 0, begin, rows(key, begin, window.chunk_size),
+                   rows(val, begin, window.chunk_size));
+    kernel::get_mha_kernel(DeviceType::kDeviceCPU)(
+        begin, head_num, 0, seq_len, kv_dim, kv_mul, head_size, block_size,
+        rows(out, begin, window.chunk_size), rows(query, begin, window.chunk_size), score,
+        kv_cache.key_cache(), kv_cache.value_cache(), tensor::Tensor{}, tensor::Tensor{},
+        kv_cache.block_table(0), tensor::Tensor{}, window, DeviceType::kDeviceCPU, nullptr);
+  }
+
+  // the reference attends a contiguous cache of only the positions in the window
+  tensor::Tensor ref_key(DataType::kDataTypeFp32, 1, seq_len, kv_dim, true, alloc_cpu);
+  tensor::Tensor ref_val(DataType::kDataTypeFp32, 1, seq_len, kv_dim, true, alloc_cpu);
+  tensor::Tensor ref_out(DataType::kDataTypeFp32, dim, true, alloc_cpu);
+  for (int32_t r = 0; r < token_num; ++r) {
+    const int32_t attended_num = window.attended_num(r);
+    for (int32_t j = 0; j < attended_num; ++j) {
+      const int32_t t = window.attended_pos(j, r);
+      for (int32_t i = 0; i < kv_dim; ++i) {
+        ref_key.index<float>(j * kv_dim + i) = key.index<float>(t * kv_dim + i);
+        ref_val.index<float>(j * kv_dim + i) = val.index<float>(t * kv_dim + i);
+      }
+    }
+    tensor::Tensor query_row(DataType::kDataTypeFp32, dim, false, nullptr,
+                             const_cast<float*>(query.ptr<float>(r * dim)));
+    kernel::get_mha_kernel(DeviceType::kDeviceCPU)(
+        attended_num - 1, head_num, 0, seq_len, kv_dim, kv_mul, head_size, 0, ref_out,
+        query_row, score, ref_key, ref_val, tensor::Tensor{}, tensor::Tensor{}, tensor::Tensor{},
+        tensor::Tensor{}, base::AttentionWindow{}, DeviceType::kDeviceCPU, nullptr);
+    for (int32_t i = 0; i < dim; ++i) {
+      ASSERT_NEAR(out.index<float>(r * dim + i), ref_out.index<float>(i), 1e-5f);
+    }
+  }
+}
+
+TEST(test_mha_cu, mha_flash_prefill) {
+  using namespace base;
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const int32_t head_num = 8;
+  const int32_t kv_mul = 2;
+  const int32_t head_size = 64;
+  const int32_t dim = head_num * head_size;
+  const int32_t kv_dim = dim / kv_mul;
+  const int32_t block_size = 8;
+  const int32_t seq_len = 64;
+  // the prompt continues a sequence, its rows span three tiles of the kernel
+  const int32_t start_pos = 20;
+  const int32_t num_tokens = 37;
+  const int32_t token_num = start_pos + num_tokens;
+
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  tensor::Tensor key(DataType::kDataTypeFp32, token_num, kv_dim, true, alloc_cpu);
+  tensor::Tensor val(DataType::kDataTypeFp32, token_num, kv_dim, true, alloc_cpu);
+  tensor::Tensor query(DataType::kDataTypeFp32, num_tokens, dim, true, alloc_cpu);
+  for (int32_t i = 0; i < key.size(); ++i) {
+    key.index<float>(i) = dist(mt);
+    val.index<float>(i) = dist(mt);
+  }
+  for (int32_t i = 0; i < query.size(); ++i) {
+    query.index<float>(i) = dist(mt);
+  }
+  tensor::Tensor key_cu = key.clone();
+  tensor::Tensor val_cu = val.clone();
+  tensor::Tensor query_cu = query.clone();
+  key_cu.to_cuda(nullptr);
+  val_cu.to_cuda(nullptr);
+  query_cu.to_cuda(nullptr);
+  auto rows = [](const tensor::Tensor& tensor, int32_t row, int32_t row_num, int32_t cols,
+                 DeviceType device_type) {
+    tensor::Tensor slice(DataType::kDataTypeFp32, row_num, cols, false, nullptr,
+                         const_cast<float*>(tensor.ptr<float>(row * cols)));
+    slice.set_device_type(device_type);
+    return slice;
+  };
+
+  kernel::CudaConfig config;
+  cudaStreamCreate(&config.stream);
+  // the whole prompt attends its sequence, or the sinks and the window of a ring
+  const std::vector<base::AttentionWindow> windows{base::AttentionWindow{},
+                                                   base::AttentionWindow{2, 8, num_tokens}};
+  for (const base::AttentionWindow& window : windows) {
+    for (bool is_head_major : {false, true}) {
+      model::PagedKVCache reference(DeviceType::kDeviceCPU, DataType::kDataTypeFp32, 2, kv_dim,
+                                    block_size, 8, 1, seq_len, head_size);
+      model::PagedKVCache kv_cache(DeviceType::kDeviceCUDA, DataType::kDataTypeFp16, 2, kv_dim,
+                                   block_size, 8, 1, seq_len, head_size, is_head_major);
+      reference.set_window(window);
+      kv_cache.set_window(window);
+      ASSERT_TRUE(reference.reserve(0, token_num));
+      ASSERT_TRUE(kv_cache.reserve(0, token_num));
+      reference.write(1, 0, 0, rows(key, 0, start_pos, kv_dim, DeviceType::kDeviceCPU),
+                      rows(val, 0, start_pos, kv_dim, DeviceType::kDeviceCPU));
+      reference.write(1, 0, start_pos,
+                      rows(key, start_pos, num_tokens, kv_dim, DeviceType::kDeviceCPU),
+                      rows(val, start_pos, num_tokens, kv_dim, DeviceType::kDeviceCPU));
+      kv_cache.write(1, 0, 0, rows(key_cu, 0, start_pos, kv_dim, DeviceType::kDeviceCUDA),
+                     rows(val_cu, 0, start_pos, kv_dim, DeviceType::kDeviceCUDA));
+
+      tensor::Tensor score(DataType::kDataTypeFp32, head_num, seq_len, true, alloc_cpu);
+      tensor::Tensor out(DataType::kDataTypeFp32, num_tokens, dim, true, alloc_cpu);
+      kernel::get_mha_kernel(DeviceType::kDeviceCPU)(
+          start_pos, head_num, 1, seq_len, kv_dim, kv_mul, head_size, block_size, out, query,
+          score, reference.key_cache(), reference.value_cache(), tensor::Tensor{},
+          tensor::Tensor{}, reference.block_table(0), tensor::Tensor{}, window,
+          DeviceType::kDeviceCPU, nullptr);
+
+      // no score tensor, the rows of the prompt are stored into the cache by the kernel
+      tensor::Tensor out_cu = out.clone();
+      out_cu.to_cuda(nullptr);
+      kernel::get_flash_prefill_kernel(kernel::KernelKey(DeviceType::kDeviceCUDA))(
+          start_pos, head_num, 1, kv_dim, kv_mul, head_size, block_size, out_cu, query_cu,
+          rows(key_cu, start_pos, num_tokens, kv_dim, DeviceType::kDeviceCUDA),
+          rows(val_cu, start_pos, num_tokens, kv_dim, DeviceType::kDeviceCUDA),
+          kv_cache.key_cache(), kv_cache.value_cache(), kv_cache.block_table(0), window,
+          config.stream);
+      cudaStreamSynchronize(config.stream);
+      tensor::Tensor out_host = out_cu.clone();
+      out_host.to_cpu();
+      for (int32_t i = 0; i < out.size(); ++i) {
+        ASSERT_NEAR(out_host.index<float>(i), out.index<float>(i), 2e-3f);
+      }
+
+      // the per row kernel reads the rows the flash kernel stored
+      tensor::Tensor score_cu = score.clone();
+      score_cu.to_cuda(nullptr);
+      kernel::get_mha_kernel(DeviceType::kDeviceCUDA)(
+          start_pos, head_num, 1, seq_len, kv_dim, kv_mul, head_size, block_size, out_cu,
+          query_cu, score_cu, kv_cache.key_cache(), kv_cache.value_cache(), tensor::Tensor{},
+          tensor::Tensor{}, kv_cache.block_table(0), tensor::Tensor{}, window,
+          DeviceType::kDeviceCUDA, &config);
+      cudaStreamSynchronize(config.stream);
+      out_host = out_cu.clone();
+      out_host.to_cpu();
+      for (int32_t i = 0; i < out.size(); ++i) {
+        ASSERT_NEAR(out_host.index<float>(i), out.index<float>(i), 2e-3f);
+      }
+    }
+  }
+}
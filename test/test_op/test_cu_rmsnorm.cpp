@@ -116,4 +116,128 @@ TEST(test_rmsnorm_cu, rmsnorm_stream2) {
     ASSERT_NEAR(out_cu.index<float>(i), out_cpu.index<float>(i), 1e-5f);
   }
   cudaStreamDestroy(stream);
-}
\ No newline at end of file
+}
+
+TEST(test_rmsnorm_cu, rmsnorm_rows) {
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+
+  int32_t rows = 17;
+  int32_t size = 32 * 15;
+
+  tensor::Tensor in_cpu(base::DataType::kDataTypeFp32, rows, size, true, alloc_cpu);
+  tensor::Tensor wei_cpu(base::DataType::kDataTypeFp32, size, true, alloc_cpu);
+  tensor::Tensor out_cpu(base::DataType::kDataTypeFp32, rows, size, true, alloc_cpu);
+
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(0.f, 1.f);
+  for (int i = 0; i < rows * size; ++i) {
+    in_cpu.index<float>(i) = dist(mt);
+  }
+  for (int i = 0; i < size; ++i) {
+    wei_cpu.index<float>(i) = dist(mt);
+  }
+
+  tensor::Tensor in_cu = in_cpu.clone();
+  tensor::Tensor wei_cu = wei_cpu.clone();
+  tensor::Tensor out_cu = out_cpu.clone();
+  in_cu.to_cuda(nullptr);
+  wei_cu.to_cuda(nullptr);
+  out_cu.to_cuda(nullptr);
+  cudaStream_t stream;
+  cudaStreamCreate(&stream);
+  kernel::get_rmsnorm_kernel(base::DeviceType::kDeviceCUDA)(in_cu, wei_cu, out_cu, stream);
+  out_cu.to_cpu();
+
+  kernel::get_rmsnorm_kernel(base::DeviceType::kDeviceCPU)(in_cpu, wei_cpu, out_cpu, nullptr);
+
+  for (int i = 0; i < rows * size; ++i) {
+    ASSERT_NEAR(out_cu.index<float>(i), out_cpu.index<float>(i), 1e-5f);
+  }
+  cudaStreamDestroy(stream);
+}
+
+TEST(test_rmsnorm_cu, rmsnorm_half_weight) {
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  const int32_t rows = 3;
+  const int32_t size = 32 * 15;
+
+  tensor::Tensor in_cpu(base::DataType::kDataTypeFp32, rows, size, true, alloc_cpu);
+  tensor::Tensor wei_cpu(base::DataType::kDataTypeFp32, size, true, alloc_cpu);
+  tensor::Tensor out_cpu(base::DataType::kDataTypeFp32, rows, size, true, alloc_cpu);
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(0.f, 1.f);
+  for (int i = 0; i < in_cpu.size(); ++i) {
+    in_cpu.index<float>(i) = dist(mt);
+  }
+  for (int i = 0; i < size; ++i) {
+    wei_cpu.index<float>(i) = dist(mt);
+  }
+  kernel::get_rmsnorm_kernel(base::DeviceType::kDeviceCPU)(in_cpu, wei_cpu, out_cpu, nullptr);
+
+  tensor::Tensor in_cu = in_cpu.clone();
+  tensor::Tensor wei_cu = wei_cpu.clone();
+  in_cu.to_cuda(nullptr);
+  wei_cu.to_cuda(nullptr);
+  for (auto [data_type, tolerance] : {std::pair{base::DataType::kDataTypeFp16, 2e-3f},
+                                      std::pair{base::DataType::kDataTypeBf16, 1e-2f}}) {
+    tensor::Tensor wei_half(data_type, size, true, alloc_cu);
+    kernel::get_cast_kernel(base::DeviceType::kDeviceCUDA)(wei_cu, wei_half, nullptr);
+    tensor::Tensor out_cu(base::DataType::kDataTypeFp32, rows, size, true, alloc_cu);
+    kernel::get_rmsnorm_kernel(base::DeviceType::kDeviceCUDA)(in_cu, wei_half, out_cu, nullptr);
+    out_cu.to_cpu();
+    for (int i = 0; i < out_cu.size(); ++i) {
+      ASSERT_NEAR(out_cu.index<float>(i), out_cpu.index<float>(i), tolerance);
+    }
+  }
+}
+
+TEST(test_rmsnorm_cu, add_rmsnorm_rows) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  // the row is not a multiple of the float4 packs
+  const int32_t size = 32 * 15 + 3;
+  const int32_t rows = 3;
+
+  tensor::Tensor residual_cpu(base::DataType::kDataTypeFp32, rows, size, true, alloc_cpu);
+  tensor::Tensor in_cpu(base::DataType::kDataTypeFp32, rows, size, true, alloc_cpu);
+  tensor::Tensor wei_cpu(base::DataType::kDataTypeFp32, size, true, alloc_cpu);
+  tensor::Tensor out_cpu(base::DataType::kDataTypeFp32, rows, size, true, alloc_cpu);
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  for (int i = 0; i < rows * size; ++i) {
+    residual_cpu.index<float>(i) = dist(mt);
+    in_cpu.index<float>(i) = dist(mt);
+  }
+  for (int i = 0; i < size; ++i) {
+    wei_cpu.index<float>(i) = dist(mt);
+  }
+  tensor::Tensor residual_cu = residual_cpu.clone();
+  tensor::Tensor in_cu = in_cpu.clone();
+  tensor::Tensor wei_cu = wei_cpu.clone();
+  tensor::Tensor out_cu = out_cpu.clone();
+  residual_cu.to_cuda(nullptr);
+  in_cu.to_cuda(nullptr);
+  wei_cu.to_cuda(nullptr);
+  out_cu.to_cuda(nullptr);
+
+  kernel::get_add_rmsnorm_kernel(base::DeviceType::kDeviceCUDA)(residual_cu, in_cu, wei_cu,
+                                                                out_cu, nullptr);
+  cudaDeviceSynchronize();
+  residual_cu.to_cpu();
+  out_cu.to_cpu();
+
+  // the reference runs the add and the rmsnorm one after the other
+  for (int i = 0; i < rows * size; ++i) {
+    residual_cpu.index<float>(i) += in_cpu.index<float>(i);
+  }
+  kernel::get_rmsnorm_kernel(base::DeviceType::kDeviceCPU)(residual_cpu, wei_cpu, out_cpu,
+                                                           nullptr);
+  for (int i = 0; i < rows * size; ++i) {
+    ASSERT_NEAR(residual_cu.index<float>(i), residual_cpu.index<float>(i), 1e-6f);
+    ASSERT_NEAR(out_cu.index<float>(i), out_cpu.index<float>(i), 1e-5f);
+  }
+}
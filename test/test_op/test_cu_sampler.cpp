@@ -0,0 +1,171 @@
+#include <cuda_runtime_api.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <algorithm>
+#include "sampler/argmax_sampler.h"
+#include "sampler/logits_processor.h"
+#include "sampler/random_sampler.h"
+#include "tensor/tensor.h"
+
+TEST(test_sampler_cu, top_k_one_is_argmax) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  int32_t size = 32000;
+  tensor::Tensor logits(base::DataType::kDataTypeFp32, size, true, alloc_cpu);
+  srand(0);
+  for (int i = 0; i < size; ++i) {
+    logits.index<float>(i) = static_cast<float>(rand() % 2000) / 100.f;
+  }
+  logits.index<float>(1234) = 40.f;
+  logits.to_cuda();
+
+  sampler::SamplingParams params;
+  params.temperature = 0.8f;
+  params.top_k = 1;
+  sampler::RandomSampler sampler(base::DeviceType::kDeviceCUDA, params);
+  for (int i = 0; i < 8; ++i) {
+    ASSERT_EQ(sampler.sample(logits.ptr<float>(), size, nullptr), 1234);
+  }
+}
+
+TEST(test_sampler_cu, top_k_top_p) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  int32_t size = 151936;
+  tensor::Tensor logits(base::DataType::kDataTypeFp32, size, true, alloc_cpu);
+  srand(1);
+  for (int i = 0; i < size; ++i) {
+    logits.index<float>(i) = static_cast<float>(rand() % 100000) / 10000.f;
+  }
+  std::vector<float> sorted(logits.ptr<float>(), logits.ptr<float>() + size);
+  std::sort(sorted.begin(), sorted.end(), std::greater<float>());
+  logits.to_cuda();
+
+  cudaStream_t stream;
+  cudaStreamCreate(&stream);
+  sampler::SamplingParams params;
+  params.temperature = 0.7f;
+  params.top_k = 40;
+  params.top_p = 0.9f;
+  params.seed = 7;
+  sampler::RandomSampler sampler(base::DeviceType::kDeviceCUDA, params);
+
+  std::vector<float> host_logits(size);
+  cudaMemcpy(host_logits.data(), logits.ptr<float>(), size * sizeof(float),
+             cudaMemcpyDeviceToHost);
+  bool all_same = true;
+  size_t first = sampler.sample(logits.ptr<float>(), size, stream);
+  for (int i = 0; i < 64; ++i) {
+    size_t next = sampler.sample(logits.ptr<float>(), size, stream);
+    ASSERT_LT(next, size);
+    // every draw comes from the top-k tokens
+    ASSERT_GE(host_logits.at(next), sorted.at(params.top_k - 1));
+    all_same &= next == first;
+  }
+  ASSERT_FALSE(all_same);
+  cudaStreamDestroy(stream);
+}
+
+TEST(test_sampler_cu, cpu_top_k) {
+  std::vector<float> logits(1000);
+  for (int i = 0; i < 1000; ++i) {
+    logits.at(i) = static_cast<float>(i % 97) / 10.f;
+  }
+  sampler::SamplingParams params;
+  params.top_k = 5;
+  sampler::RandomSampler sampler(base::DeviceType::kDeviceCPU, params);
+  for (int i = 0; i < 64; ++i) {
+    size_t next = sampler.sample(logits.data(), logits.size(), nullptr);
+    ASSERT_EQ(next % 97, 96);
+  }
+}
+
+TEST(test_sampler_cu, argmax_large_vocab) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  sampler::ArgmaxSampler sampler(base::DeviceType::kDeviceCUDA);
+  // the qwen2 vocabulary spans every block of the grid, a tiny one leaves threads idle
+  for (int32_t size : {151936, 5}) {
+    tensor::Tensor logits(base::DataType::kDataTypeFp32, size, true, alloc_cpu);
+    srand(0);
+    for (int i = 0; i < size; ++i) {
+      logits.index<float>(i) = -static_cast<float>(rand() % 2000) / 100.f;
+    }
+    // the first of two equal maxima wins
+    logits.index<float>(size - 1) = 1.f;
+    logits.index<float>(size - 3) = 1.f;
+    logits.to_cuda();
+    ASSERT_EQ(sampler.sample(logits.ptr<float>(), size, nullptr), size - 3);
+  }
+}
+
+TEST(test_sampler_cu, logits_processor) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  int32_t size = 8;
+  sampler::LogitsParams params;
+  params.frequency_penalty = 1.5f;
+  params.banned_tokens = {7};
+  params.logit_bias = {{0, 10.f}};
+  // the two devices sample the same tokens, the sampled ones are counted like the prompt
+  for (auto device_type : {base::DeviceType::kDeviceCPU, base::DeviceType::kDeviceCUDA}) {
+    tensor::Tensor logits(base::DataType::kDataTypeFp32, size, true, alloc_cpu);
+    for (int i = 0; i < size; ++i) {
+      logits.index<float>(i) = static_cast<float>(i);
+    }
+    if (device_type == base::DeviceType::kDeviceCUDA) {
+      logits.to_cuda();
+    }
+    sampler::LogitsProcessor processor(
+        device_type, size, params, std::make_unique<sampler::ArgmaxSampler>(device_type));
+    processor.reset({0, 0, 0, 0, 0, 0, 6});
+    std::vector<size_t> sampled;
+    for (int i = 0; i < 3; ++i) {
+      sampled.push_back(processor.sample(logits.ptr<float>(), size, nullptr));
+    }
+    ASSERT_EQ(sampled, std::vector<size_t>({5, 6, 4}));
+  }
+
+  // the repetition penalty divides the logits above zero
+  sampler::LogitsParams repetition_params;
+  repetition_params.repetition_penalty = 2.f;
+  std::vector<float> small_logits = {-1.f, 0.5f, 0.8f};
+  sampler::LogitsProcessor processor(
+      base::DeviceType::kDeviceCPU, 3, repetition_params,
+      std::make_unique<sampler::ArgmaxSampler>(base::DeviceType::kDeviceCPU));
+  processor.reset({2});
+  ASSERT_EQ(processor.sample(small_logits.data(), 3, nullptr), 1);
+  ASSERT_EQ(processor.sample(small_logits.data(), 3, nullptr), 2);
+}
+
+TEST(test_sampler_cu, logits_processor_slots) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  int32_t size = 4;
+  sampler::LogitsParams params;
+  params.presence_penalty = 2.5f;
+  for (auto device_type : {base::DeviceType::kDeviceCPU, base::DeviceType::kDeviceCUDA}) {
+    tensor::Tensor logits(base::DataType::kDataTypeFp32, size, true, alloc_cpu);
+    for (int i = 0; i < size; ++i) {
+      logits.index<float>(i) = static_cast<float>(i);
+    }
+    if (device_type == base::DeviceType::kDeviceCUDA) {
+      logits.to_cuda();
+    }
+    sampler::LogitsProcessor processor(
+        device_type, size, params, std::make_unique<sampler::ArgmaxSampler>(device_type), 2);
+    // the rows of a batch count into the slots of their sequences
+    processor.begin_sequence(0, nullptr);
+    ASSERT_EQ(processor.sample(logits.ptr<float>(), size, nullptr), 3);
+    processor.begin_sequence(1, nullptr);
+    ASSERT_EQ(processor.sample(logits.ptr<float>(), size, nullptr), 3);
+    processor.set_slot(0);
+    ASSERT_EQ(processor.sample(logits.ptr<float>(), size, nullptr), 2);
+    processor.set_slot(1);
+    ASSERT_EQ(processor.sample(logits.ptr<float>(), size, nullptr), 2);
+    ASSERT_EQ(processor.sample(logits.ptr<float>(), size, nullptr), 1);
+
+    // a new sequence in slot 0 starts without the counts of the last one
+    processor.begin_sequence(0, nullptr);
+    ASSERT_EQ(processor.sample(logits.ptr<float>(), size, nullptr), 3);
+    // the tokens given by reset are kept through the prefill of the sequence
+    processor.reset(1, {3, 2});
+    processor.begin_sequence(1, nullptr);
+    ASSERT_EQ(processor.sample(logits.ptr<float>(), size, nullptr), 1);
+  }
+}
@@ -77,4 +77,4 @@ TEST(test_swiglu_cu, swiglu_stream) {
     ASSERT_NEAR(out_cu.index<float>(i), out_cpu.index<float>(i), 1e-5f);
   }
   cudaStreamDestroy(stream);
-}
\ No newline at end of file
+}
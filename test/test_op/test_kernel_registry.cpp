@@ -0,0 +1,118 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "../source/op/kernels/kernel_registry.h"
+#include "../source/op/kernels/kernels_interface.h"
+
+namespace {
+typedef int32_t (*TestKernel)();
+
+int32_t generic_kernel() { return 0; }
+
+int32_t wide_kernel() { return 1; }
+
+int32_t split_kernel() { return 2; }
+
+int32_t run(const kernel::KernelKey& key) {
+  return kernel::select_kernel<TestKernel>("test_registry", key)();
+}
+}  // namespace
+
+TEST(test_kernel_registry, builtin_kernels) {
+  kernel::KernelRegistry& registry = kernel::KernelRegistry::global();
+  const kernel::KernelKey key(base::DeviceType::kDeviceCPU);
+  ASSERT_EQ(registry.selected_name("matmul", key), "cpu");
+  ASSERT_EQ(registry.selected_name("rmsnorm", kernel::KernelKey(base::DeviceType::kDeviceCUDA)),
+            "cuda");
+  ASSERT_EQ(kernel::get_add_kernel(base::DeviceType::kDeviceCPU),
+            kernel::select_kernel<kernel::AddKernel>("add", key));
+  // the int4 matmuls only run on the cuda device
+  ASSERT_TRUE(registry.candidates("matmul_int4", key).empty());
+}
+
+TEST(test_kernel_registry, select_variants) {
+  kernel::KernelRegistry& registry = kernel::KernelRegistry::global();
+  const base::DeviceType device = base::DeviceType::kDeviceCPU;
+  registry.add(kernel::make_kernel_variant<TestKernel>("test_registry", "generic", device,
+                                                       generic_kernel));
+  // faster on the wide fp32 weights only
+  registry.add(kernel::make_kernel_variant<TestKernel>(
+      "test_registry", "wide", device, wide_kernel, 10, [](const kernel::KernelKey& key) {
+        return key.data_type == base::DataType::kDataTypeFp32 && key.dims.size() == 2 &&
+               key.dims.at(1) >= 4096;
+      }));
+  registry.add(kernel::make_kernel_variant<TestKernel>("test_registry", "split", device,
+                                                       split_kernel, 5));
+
+  const kernel::KernelKey wide_key(device, base::DataType::kDataTypeFp32, {32, 8192});
+  const kernel::KernelKey narrow_key(device, base::DataType::kDataTypeFp32, {32, 64});
+  const kernel::KernelKey int8_key(device, base::DataType::kDataTypeInt8, {32, 8192});
+  ASSERT_EQ(run(wide_key), 1);
+  ASSERT_EQ(run(narrow_key), 2);
+  ASSERT_EQ(run(int8_key), 2);
+
+  const std::vector<kernel::KernelVariant> candidates = registry.candidates("test_registry",
+                                                                             wide_key);
+  ASSERT_EQ(candidates.size(), 3);
+  ASSERT_EQ(candidates.at(0).name, "wide");
+  ASSERT_EQ(candidates.at(1).name, "split");
+  ASSERT_EQ(candidates.at(2).name, "generic");
+  ASSERT_EQ(registry.candidates("test_registry", narrow_key).size(), 2);
+
+  // the tuner picks the winner of one key
+  registry.set_winner("test_registry", narrow_key, "generic");
+  ASSERT_EQ(run(narrow_key), 0);
+  ASSERT_EQ(run(int8_key), 2);
+
+  // an override comes first and skips the predicate, an unknown name falls back
+  registry.set_override("test_registry", "wide");
+  ASSERT_EQ(run(narrow_key), 1);
+  registry.set_override("test_registry", "cublas");
+  ASSERT_EQ(run(narrow_key), 0);
+  registry.clear_override("test_registry");
+  registry.clear_winners();
+  ASSERT_EQ(run(narrow_key), 2);
+
+  // the same name replaces the registered variant
+  registry.add(kernel::make_kernel_variant<TestKernel>("test_registry", "split", device,
+                                                       generic_kernel, 5));
+  ASSERT_EQ(run(narrow_key), 0);
+  ASSERT_EQ(registry.candidates("test_registry", narrow_key).size(), 2);
+}
+
+TEST(test_kernel_registry, kernel_cache) {
+  kernel::KernelRegistry& registry = kernel::KernelRegistry::global();
+  const base::DeviceType device = base::DeviceType::kDeviceCPU;
+  registry.add(kernel::make_kernel_variant<TestKernel>("test_cache", "generic", device,
+                                                       generic_kernel));
+  registry.add(kernel::make_kernel_variant<TestKernel>("test_cache", "split", device,
+                                                       split_kernel, 5));
+  const std::vector<int32_t> dims = {32, 64};
+  kernel::KernelCache cache;
+  auto run_cached = [&cache, device](const std::vector<int32_t>& dims) {
+    return kernel::select_kernel<TestKernel>(cache, "test_cache", device,
+                                             base::DataType::kDataTypeFp32, dims)();
+  };
+  ASSERT_EQ(run_cached(dims), 2);
+  const uint64_t generation = cache.generation;
+  ASSERT_EQ(run_cached(dims), 2);
+  ASSERT_EQ(cache.generation, generation);
+
+  // a winner or an override of the key invalidates the cached kernel
+  const kernel::KernelKey key(device, base::DataType::kDataTypeFp32, dims);
+  registry.set_winner("test_cache", key, "generic");
+  ASSERT_EQ(run_cached(dims), 0);
+  ASSERT_GT(cache.generation, generation);
+  registry.clear_winners();
+  ASSERT_EQ(run_cached(dims), 2);
+  registry.set_override("test_cache", "generic");
+  ASSERT_EQ(run_cached(dims), 0);
+  registry.clear_override("test_cache");
+  ASSERT_EQ(run_cached(dims), 2);
+
+  // another shape is selected for itself
+  registry.add(kernel::make_kernel_variant<TestKernel>(
+      "test_cache", "wide", device, wide_kernel, 10,
+      [](const kernel::KernelKey& key) { return key.dims.at(1) >= 4096; }));
+  ASSERT_EQ(run_cached({32, 8192}), 1);
+  ASSERT_EQ(run_cached(dims), 2);
+}
@@ -0,0 +1,71 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <thread>
+#include "base/alloc.h"
+#include "base/metrics.h"
+
+static double sample_value(const std::string& name, const std::string& labels = "") {
+  for (const base::MetricSample& sample : base::MetricsRegistry::global().snapshot()) {
+    if (sample.name == name && sample.labels == labels) {
+      return sample.value;
+    }
+  }
+  return -1.;
+}
+
+TEST(test_metrics, counter_from_threads) {
+  base::MetricsRegistry& registry = base::MetricsRegistry::global();
+  base::Counter* counter = registry.counter("test_metrics_events_total", "The test events.");
+  // the same name and labels give the same metric
+  ASSERT_EQ(registry.counter("test_metrics_events_total", "The test events."), counter);
+  ASSERT_NE(registry.counter("test_metrics_events_total", "The test events.", "kind=\"a\""),
+            counter);
+
+  std::vector<std::thread> threads;
+  for (int32_t i = 0; i < 4; ++i) {
+    threads.emplace_back([counter] {
+      for (int32_t j = 0; j < 1000; ++j) {
+        counter->add();
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  ASSERT_EQ(counter->value(), 4000);
+  ASSERT_EQ(sample_value("test_metrics_events_total"), 4000.);
+  ASSERT_EQ(sample_value("test_metrics_events_total", "kind=\"a\""), 0.);
+}
+
+TEST(test_metrics, histogram_buckets) {
+  base::Histogram* histogram = base::MetricsRegistry::global().histogram(
+      "test_metrics_seconds", "The test latencies.", {0.1, 1.});
+  histogram->observe(0.05);
+  histogram->observe(0.1);
+  histogram->observe(0.5);
+  histogram->observe(3.);
+  const std::vector<uint64_t> counts = histogram->cumulative_counts();
+  ASSERT_EQ(counts.size(), 3);
+  ASSERT_EQ(counts.at(0), 2);
+  ASSERT_EQ(counts.at(1), 3);
+  ASSERT_EQ(counts.at(2), 4);
+  ASSERT_NEAR(histogram->sum(), 3.65, 1e-9);
+
+  const std::string text = base::MetricsRegistry::global().prometheus_text();
+  ASSERT_NE(text.find("# TYPE test_metrics_seconds histogram\n"), std::string::npos);
+  ASSERT_NE(text.find("test_metrics_seconds_bucket{le=\"0.1\"} 2\n"), std::string::npos);
+  ASSERT_NE(text.find("test_metrics_seconds_bucket{le=\"+Inf\"} 4\n"), std::string::npos);
+  ASSERT_NE(text.find("test_metrics_seconds_count 4\n"), std::string::npos);
+}
+
+TEST(test_metrics, allocator_bytes) {
+  base::Gauge* gauge = base::MetricsRegistry::global().gauge(
+      "kuiper_allocator_allocated_bytes", "The bytes of the live allocations.",
+      "device=\"cpu\"");
+  auto alloc = base::CPUDeviceAllocatorFactory::get_instance();
+  const double before = gauge->value();
+  void* ptr = alloc->allocate(4096);
+  ASSERT_EQ(gauge->value(), before + 4096.);
+  alloc->release(ptr);
+  ASSERT_EQ(gauge->value(), before);
+}
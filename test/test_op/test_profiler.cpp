@@ -0,0 +1,118 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include "base/profiler.h"
+#include "op/layer.h"
+
+namespace {
+// a cpu layer which only counts its forwards
+class CountLayer : public op::Layer {
+ public:
+  explicit CountLayer(op::LayerType layer_type)
+      : op::Layer(base::DeviceType::kDeviceCPU, layer_type) {
+    reset_input_size(2);
+    reset_output_size(1);
+  }
+
+  using op::Layer::forward;
+
+  base::Status forward() override {
+    forward_num_ += 1;
+    return base::error::Success();
+  }
+
+  int32_t forward_num() const { return forward_num_; }
+
+ private:
+  int32_t forward_num_ = 0;
+};
+}  // namespace
+
+TEST(test_profiler, layer_ranges) {
+  CountLayer add(op::LayerType::kLayerAdd);
+  CountLayer matmul(op::LayerType::kLayerMatmul);
+  matmul.set_layer_name("wq");
+  tensor::Tensor tensor;
+
+  // nothing is recorded before the start
+  add.forward(tensor, tensor, tensor);
+  base::Profiler& profiler = base::Profiler::global();
+  profiler.start();
+  for (int32_t layer_idx = 0; layer_idx < 3; ++layer_idx) {
+    base::ProfileLayerScope scope(layer_idx);
+    add.forward(tensor, tensor, tensor);
+    matmul.forward(tensor, tensor);
+    matmul.forward(tensor, tensor);
+  }
+  {
+    // the layer in an open range is timed as a part of it
+    base::ProfileRange range("plan", "final_norm", false, nullptr);
+    add.forward(tensor, tensor, tensor);
+  }
+  profiler.stop();
+  add.forward(tensor, tensor, tensor);
+  ASSERT_EQ(add.forward_num(), 6);
+  ASSERT_EQ(matmul.forward_num(), 6);
+
+  const std::vector<base::ProfileRecord>& records = profiler.records();
+  ASSERT_EQ(records.size(), 10);
+  ASSERT_STREQ(records.at(0).category, "add");
+  ASSERT_EQ(records.at(0).layer_idx, 0);
+  ASSERT_EQ(records.at(1).name, "wq");
+  ASSERT_STREQ(records.at(1).category, "matmul");
+  ASSERT_EQ(records.at(8).layer_idx, 2);
+  ASSERT_STREQ(records.at(9).category, "plan");
+  ASSERT_EQ(records.at(9).layer_idx, -1);
+  for (const base::ProfileRecord& record : records) {
+    ASSERT_FALSE(record.is_cuda);
+    ASSERT_GE(record.duration_us, 0.);
+  }
+
+  std::map<std::string, int32_t> op_counts;
+  for (const base::ProfileSummary& summary : profiler.op_summary()) {
+    op_counts[summary.key] = summary.count;
+  }
+  ASSERT_EQ(op_counts.size(), 3);
+  ASSERT_EQ(op_counts.at("add"), 3);
+  ASSERT_EQ(op_counts.at("matmul"), 6);
+  ASSERT_EQ(op_counts.at("plan"), 1);
+
+  const std::vector<base::ProfileSummary> layers = profiler.layer_summary();
+  ASSERT_EQ(layers.size(), 3);
+  for (int32_t layer_idx = 0; layer_idx < 3; ++layer_idx) {
+    ASSERT_EQ(layers.at(layer_idx).key, std::to_string(layer_idx));
+    ASSERT_EQ(layers.at(layer_idx).count, 3);
+  }
+
+  // a new start drops the records of the last run
+  profiler.start();
+  profiler.stop();
+  ASSERT_TRUE(profiler.records().empty());
+}
+
+TEST(test_profiler, chrome_trace) {
+  CountLayer swiglu(op::LayerType::kLayerSwiGLU);
+  swiglu.set_layer_name("swiglu \"0\"");
+  tensor::Tensor tensor;
+  base::Profiler& profiler = base::Profiler::global();
+  profiler.start();
+  {
+    base::ProfileLayerScope scope(4);
+    swiglu.forward(tensor, tensor, tensor);
+  }
+  profiler.stop();
+
+  const std::string path = "./profile_trace.json";
+  ASSERT_TRUE(profiler.write_chrome_trace(path));
+  std::ifstream file(path);
+  std::stringstream content;
+  content << file.rdbuf();
+  const std::string trace = content.str();
+  ASSERT_NE(trace.find("\"traceEvents\""), std::string::npos);
+  ASSERT_NE(trace.find("\"name\":\"swiglu \\\"0\\\"\",\"cat\":\"swiglu\",\"ph\":\"X\""),
+            std::string::npos);
+  ASSERT_NE(trace.find("\"tid\":1,\"args\":{\"layer_idx\":4}"), std::string::npos);
+  std::remove(path.c_str());
+}
@@ -0,0 +1,95 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <cmath>
+#include <vector>
+#include "../source/op/kernels/cpu/rope_kernel.h"
+#include "base/rope.h"
+
+TEST(test_rope_scaling, inv_freq) {
+  const int32_t head_size = 128;
+  const float theta = 500000.f;
+  const std::vector<float> plain = base::rope_inv_freq(head_size, theta, base::RoPEScaling{});
+  ASSERT_EQ(plain.size(), head_size / 2);
+  EXPECT_FLOAT_EQ(plain.at(0), 1.f);
+  EXPECT_NEAR(plain.at(1), 1.f / std::pow(theta, 2.f / head_size), 1e-7f);
+
+  base::RoPEScaling linear;
+  linear.type = base::RoPEScalingType::kRoPEScalingLinear;
+  linear.factor = 4.f;
+  const std::vector<float> linear_freq = base::rope_inv_freq(head_size, theta, linear);
+  for (int32_t j = 0; j < head_size / 2; ++j) {
+    EXPECT_NEAR(linear_freq.at(j), plain.at(j) / 4.f, 1e-7f);
+  }
+
+  // llama 3.1 keeps the fast pairs and interpolates the slow ones by the whole factor
+  base::RoPEScaling llama3;
+  llama3.type = base::RoPEScalingType::kRoPEScalingLlama3;
+  llama3.factor = 8.f;
+  llama3.original_max_pos = 8192;
+  const std::vector<float> llama3_freq = base::rope_inv_freq(head_size, theta, llama3);
+  EXPECT_FLOAT_EQ(llama3_freq.at(0), plain.at(0));
+  EXPECT_NEAR(llama3_freq.back(), plain.back() / 8.f, 1e-12f);
+  for (int32_t j = 1; j < head_size / 2; ++j) {
+    EXPECT_LE(llama3_freq.at(j), llama3_freq.at(j - 1));
+  }
+
+  base::RoPEScaling yarn;
+  yarn.type = base::RoPEScalingType::kRoPEScalingYaRN;
+  yarn.factor = 4.f;
+  yarn.original_max_pos = 32768;
+  const std::vector<float> yarn_freq = base::rope_inv_freq(head_size, theta, yarn);
+  EXPECT_FLOAT_EQ(yarn_freq.at(0), plain.at(0));
+  EXPECT_NEAR(yarn_freq.back(), plain.back() / 4.f, 1e-12f);
+  EXPECT_NEAR(base::rope_attention_factor(yarn), 0.1f * std::log(4.f) + 1.f, 1e-6f);
+  EXPECT_FLOAT_EQ(base::rope_attention_factor(llama3), 1.f);
+
+  base::RoPEScalingType type;
+  EXPECT_TRUE(base::parse_rope_scaling_type("dynamic", type));
+  EXPECT_EQ(type, base::RoPEScalingType::kRoPEScalingNTK);
+  EXPECT_FALSE(base::parse_rope_scaling_type("longrope", type));
+}
+
+TEST(test_rope_scaling, tiled_table) {
+  const int32_t head_size = 64;
+  const int32_t pair_num = head_size / 2;
+  const int32_t seq_len = 131072;
+  base::RoPEScaling scaling;
+  scaling.type = base::RoPEScalingType::kRoPEScalingYaRN;
+  scaling.factor = 4.f;
+  scaling.original_max_pos = 32768;
+  // the tables hold the tiles and not one row per position
+  const int32_t rows = base::rope_table_rows(seq_len);
+  EXPECT_EQ(rows, 1 + base::kRoPETileSize + seq_len / base::kRoPETileSize);
+  std::vector<float> sin_cache(rows * pair_num);
+  std::vector<float> cos_cache(rows * pair_num);
+  kernel::sin_cos_cache_calc_cpu(head_size, seq_len, 10000.f, scaling, sin_cache.data(),
+                                 cos_cache.data());
+  const std::vector<float> inv_freq = base::rope_inv_freq(head_size, 10000.f, scaling);
+  const float attention_factor = base::rope_attention_factor(scaling);
+  EXPECT_FLOAT_EQ(sin_cache.at(0), inv_freq.at(0));
+  EXPECT_FLOAT_EQ(cos_cache.at(0), attention_factor);
+
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  tensor::Tensor sin_tensor(base::DataType::kDataTypeFp32, rows * pair_num, false, nullptr,
+                            sin_cache.data());
+  tensor::Tensor cos_tensor(base::DataType::kDataTypeFp32, rows * pair_num, false, nullptr,
+                            cos_cache.data());
+  for (int32_t pos : {0, 255, 256, 70001, seq_len - 1}) {
+    tensor::Tensor query(base::DataType::kDataTypeFp32, head_size, true, alloc_cpu);
+    tensor::Tensor key(base::DataType::kDataTypeFp32, head_size, true, alloc_cpu);
+    for (int32_t i = 0; i < head_size; ++i) {
+      query.index<float>(i) = i % 2 == 0 ? 1.f : 0.f;
+      key.index<float>(i) = 0.f;
+    }
+    tensor::Tensor pos_tensor(base::DataType::kDataTypeInt32, 1, true, alloc_cpu);
+    pos_tensor.index<int32_t>(0) = pos;
+    kernel::rope_kernel_cpu(head_size, head_size, head_size, false, query, key, pos_tensor,
+                            sin_tensor, cos_tensor, nullptr);
+    // a unit pair turns by the angle of the position, the yarn factor scales it
+    for (int32_t j = 0; j < pair_num; ++j) {
+      const double angle = static_cast<double>(pos) * inv_freq.at(j);
+      ASSERT_NEAR(query.index<float>(2 * j), attention_factor * std::cos(angle), 1e-5);
+      ASSERT_NEAR(query.index<float>(2 * j + 1), attention_factor * std::sin(angle), 1e-5);
+    }
+  }
+}
@@ -0,0 +1,126 @@
+#if defined(LLAMA3_SUPPORT) || defined(QWEN2_SUPPORT)
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <fstream>
+#include <random>
+#include "base/tiktoken.h"
+
+static const std::string kPattern =
+    R"((?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?:$|[^\S])|\s+)";
+
+static ankerl::unordered_dense::map<std::string, int> test_ranks() {
+  ankerl::unordered_dense::map<std::string, int> ranks;
+  for (int byte = 0; byte < 256; ++byte) {
+    ranks.insert({std::string(1, static_cast<char>(byte)), byte});
+  }
+  int rank = 256;
+  for (const char* merge : {"th", "he", "in", "er", "an", " t", "the", " the", "ing", "re", "on",
+                            "at", "en", "ll", "ee", "eee", " a", "ab", "ba", "aba"}) {
+    ranks.insert({merge, rank++});
+  }
+  return ranks;
+}
+
+// the scan of all the parts before every merge
+static std::vector<int> reference_merge(
+    const std::string& piece, const ankerl::unordered_dense::map<std::string, int>& ranks) {
+  std::vector<size_t> bounds;
+  for (size_t i = 0; i <= piece.size(); ++i) {
+    bounds.push_back(i);
+  }
+  while (bounds.size() > 2) {
+    int min_rank = std::numeric_limits<int>::max();
+    size_t min_idx = 0;
+    for (size_t i = 0; i + 2 < bounds.size(); ++i) {
+      auto iter = ranks.find(piece.substr(bounds[i], bounds[i + 2] - bounds[i]));
+      if (iter != ranks.end() && iter->second < min_rank) {
+        min_rank = iter->second;
+        min_idx = i;
+      }
+    }
+    if (min_rank == std::numeric_limits<int>::max()) {
+      break;
+    }
+    bounds.erase(bounds.begin() + min_idx + 1);
+  }
+  std::vector<int> tokens;
+  for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+    tokens.push_back(ranks.at(piece.substr(bounds[i], bounds[i + 1] - bounds[i])));
+  }
+  return tokens;
+}
+
+TEST(test_tiktoken, heap_merge) {
+  const auto ranks = test_ranks();
+  for (const std::string piece : {"the", "theeeee", "abababa", "inthering", "xyz", "eeeeeee",
+                                  " the thing", "baababab"}) {
+    ASSERT_EQ(tiktoken::byte_pair_encode(piece, ranks), reference_merge(piece, ranks));
+  }
+}
+
+TEST(test_tiktoken, parallel_segments) {
+  const auto ranks = test_ranks();
+  tiktoken::tiktoken serial(ranks, {{"<|eot|>", 1000}}, kPattern);
+  tiktoken::tiktoken parallel(ranks, {{"<|eot|>", 1000}}, kPattern, 0);
+  parallel.set_parallel_segment_size(256);
+
+  // long texts of words, numbers, punctuation and line breaks
+  const std::vector<std::string> words = {"the", "thing", "ring", "aba", "eee", "  ", "\n",
+                                          "\n\n", "42", "it's", "!", ", ", "\t", " \n"};
+  for (uint32_t seed = 0; seed < 16; ++seed) {
+    std::mt19937 engine(seed);
+    std::string text;
+    while (text.size() < 40000) {
+      if (text.size() > 20000 && text.find("<|eot|>") == std::string::npos) {
+        text += "<|eot|>";
+      }
+      // the lines which start with a letter are where the text is cut
+      text += words[engine() % words.size()];
+      if (engine() % 2 == 0) {
+        text += ' ';
+      }
+    }
+    const std::vector<int> tokens = serial.encode(text);
+    ASSERT_EQ(parallel.encode(text), tokens);
+    // the cached pieces give the same tokens
+    ASSERT_EQ(serial.encode(text), tokens);
+    ASSERT_EQ(serial.decode(tokens), text);
+  }
+}
+
+TEST(test_tiktoken, token_cache) {
+  const std::string source_path = "/tmp/kuiper_tokenizer_" + std::to_string(getpid()) + ".json";
+  const std::string cache_path = source_path + ".kcache";
+  std::ofstream(source_path) << "{}";
+  const auto ranks = test_ranks();
+  const ankerl::unordered_dense::map<std::string, int> special = {{"<|eot|>", 1000}};
+  ASSERT_TRUE(base::TokenCache::write_file(cache_path, source_path, ranks, special));
+
+  std::shared_ptr<base::TokenCache> cache;
+  ASSERT_TRUE(base::TokenCache::map_file(cache_path, source_path, cache));
+  ASSERT_EQ(cache->token_num(), static_cast<int32_t>(ranks.size()));
+  for (const auto& [bytes, id] : ranks) {
+    ASSERT_EQ(cache->find(bytes), id);
+  }
+  for (const std::string missing : {"", "xyz", "thee", "<|eot|>"}) {
+    ASSERT_EQ(cache->find(missing), -1);
+  }
+  ASSERT_EQ(cache->special_encoder().at("<|eot|>"), 1000);
+
+  tiktoken::tiktoken from_ranks(ranks, special, kPattern);
+  tiktoken::tiktoken from_cache(cache, kPattern);
+  const std::string text = "the thing<|eot|> in the ring, it's 42 abababa\n\n eeeee";
+  const std::vector<int> tokens = from_ranks.encode(text);
+  ASSERT_EQ(from_cache.encode(text), tokens);
+  ASSERT_EQ(from_cache.decode(tokens), text);
+
+  // a cache of another version of the tokenizer file is not mapped
+  std::ofstream(source_path) << "{\"model\": {}}";
+  std::shared_ptr<base::TokenCache> stale;
+  ASSERT_FALSE(base::TokenCache::map_file(cache_path, source_path, stale));
+  ASSERT_EQ(stale, nullptr);
+  std::remove(cache_path.c_str());
+  std::remove(source_path.c_str());
+}
+#endif
@@ -0,0 +1,115 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "../utils/toy_model.h"
+#include "server/engine.h"
+
+namespace {
+// the results of the requests and of the swaps, in the order they finish
+struct Completions {
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::vector<server::GenerationResult> results;
+  std::vector<base::Status> swaps;
+
+  server::GenerationRequest request(const std::vector<int32_t>& prompt_tokens,
+                                    int32_t max_new_tokens) {
+    server::GenerationRequest request;
+    request.prompt_tokens = prompt_tokens;
+    request.max_new_tokens = max_new_tokens;
+    request.on_text = [](const std::string&) { return true; };
+    request.on_done = [this](const server::GenerationResult& result) {
+      std::lock_guard<std::mutex> lock(mutex);
+      results.push_back(result);
+      cond.notify_all();
+    };
+    return request;
+  }
+
+  std::function<void(const base::Status&)> on_swapped() {
+    return [this](const base::Status& status) {
+      std::lock_guard<std::mutex> lock(mutex);
+      swaps.push_back(status);
+      cond.notify_all();
+    };
+  }
+
+  void wait(size_t result_num, size_t swap_num) {
+    std::unique_lock<std::mutex> lock(mutex);
+    CHECK(cond.wait_for(lock, std::chrono::seconds(30), [&] {
+      return results.size() >= result_num && swaps.size() >= swap_num;
+    }));
+  }
+};
+
+std::shared_ptr<model::Model> init_model(const test::ToyModelFiles& files) {
+  std::shared_ptr<model::Model> model = files.create_model();
+  model->set_max_batch_size(2);
+  CHECK(model->init(base::DeviceType::kDeviceCPU));
+  return model;
+}
+}  // namespace
+
+TEST(test_engine, swap_model_with_requests_in_flight) {
+  test::ToyModelFiles files("engine_old", test::toy_model_config(), 1);
+  test::ToyModelFiles new_files("engine_new", test::toy_model_config(), 2);
+  std::shared_ptr<const model::Model> old_model = init_model(files);
+  std::shared_ptr<model::Model> new_model;
+
+  Completions completions;
+  server::RequestQueue queue(16, 32);
+  server::Engine engine(old_model, queue);
+  engine.start();
+  const int32_t max_new_tokens = 48;
+  for (const std::vector<int32_t>& prompt : {std::vector<int32_t>{1, 5, 9, 12},
+                                             std::vector<int32_t>{1, 25, 3},
+                                             std::vector<int32_t>{1, 30, 4, 18, 22}}) {
+    ASSERT_TRUE(queue.push(completions.request(prompt, max_new_tokens)));
+  }
+  ASSERT_TRUE(engine.swap_model(
+      [&](std::shared_ptr<model::Model>& model) {
+        // the old model has requests in flight when the new one is handed over
+        while (engine.running_size() == 0) {
+          std::this_thread::yield();
+        }
+        new_model = init_model(new_files);
+        model = new_model;
+        return base::error::Success();
+      },
+      completions.on_swapped()));
+  completions.wait(0, 1);
+  ASSERT_TRUE(completions.swaps.front());
+  ASSERT_EQ(engine.model(), new_model);
+  ASSERT_FALSE(engine.is_swapping());
+
+  // the requests admitted after the swap run on the new model
+  ASSERT_TRUE(queue.push(completions.request({1, 7, 11}, max_new_tokens)));
+  completions.wait(4, 1);
+  engine.stop();
+  for (const server::GenerationResult& result : completions.results) {
+    ASSERT_EQ(result.finish_reason, "length");
+    ASSERT_EQ(result.output_token_num, max_new_tokens);
+  }
+  ASSERT_EQ(engine.running_size(), 0);
+}
+
+TEST(test_engine, stop_fails_the_swap_in_flight) {
+  test::ToyModelFiles files("engine_stop_old", test::toy_model_config(), 1);
+  test::ToyModelFiles new_files("engine_stop_new", test::toy_model_config(), 2);
+  Completions completions;
+  server::RequestQueue queue(16, 32);
+  server::Engine engine(init_model(files), queue);
+  // the decode loop does not run, so the loaded model is never swapped in
+  ASSERT_TRUE(engine.swap_model(
+      [&](std::shared_ptr<model::Model>& model) {
+        model = init_model(new_files);
+        return base::error::Success();
+      },
+      completions.on_swapped()));
+  engine.stop();
+  ASSERT_EQ(completions.swaps.size(), 1);
+  ASSERT_FALSE(completions.swaps.front());
+  ASSERT_FALSE(engine.is_swapping());
+}
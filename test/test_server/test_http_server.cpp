@@ -0,0 +1,95 @@
+#include <arpa/inet.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <thread>
+#include "server/engine.h"
+#include "server/http_server.h"
+
+namespace {
+// sends the raw request and reads until the server closes the connection
+std::string round_trip(int32_t port, const std::string& request) {
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(static_cast<uint16_t>(port));
+  inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+  CHECK_EQ(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+  CHECK_EQ(write(fd, request.data(), request.size()), request.size());
+  std::string response;
+  char buffer[4096];
+  ssize_t size = 0;
+  while ((size = read(fd, buffer, sizeof(buffer))) > 0) {
+    response.append(buffer, size);
+  }
+  close(fd);
+  return response;
+}
+}  // namespace
+
+TEST(test_http_server, reply_and_keep_alive) {
+  server::HttpServer http_server(2);
+  http_server.route("POST", "/echo",
+                    [](const server::HttpRequest& request,
+                       std::shared_ptr<server::HttpResponder> responder) {
+                      responder->reply(200, "text/plain", request.body);
+                    });
+  ASSERT_TRUE(http_server.start("127.0.0.1", 0));
+  ASSERT_GT(http_server.port(), 0);
+
+  // two requests on one connection, the second one closes it
+  const std::string response = round_trip(
+      http_server.port(),
+      "POST /echo HTTP/1.1\r\nContent-Length: 5\r\n\r\nhelloPOST /echo HTTP/1.1\r\n"
+      "Connection: close\r\nContent-Length: 5\r\n\r\nworld");
+  ASSERT_NE(response.find("Connection: keep-alive"), std::string::npos);
+  ASSERT_NE(response.find("\r\n\r\nhello"), std::string::npos);
+  ASSERT_NE(response.find("\r\n\r\nworld"), std::string::npos);
+
+  const std::string missing = round_trip(http_server.port(), "GET /none HTTP/1.0\r\n\r\n");
+  ASSERT_EQ(missing.find("HTTP/1.1 404"), 0);
+  http_server.stop();
+}
+
+TEST(test_http_server, event_stream_from_another_thread) {
+  server::HttpServer http_server(1);
+  std::thread writer;
+  http_server.route("GET", "/events",
+                    [&writer](const server::HttpRequest&,
+                              std::shared_ptr<server::HttpResponder> responder) {
+                      responder->start_events();
+                      writer = std::thread([responder] {
+                        for (int32_t i = 0; i < 3; ++i) {
+                          ASSERT_TRUE(responder->send_event(std::to_string(i)));
+                        }
+                        responder->finish();
+                      });
+                    });
+  ASSERT_TRUE(http_server.start("127.0.0.1", 0));
+  const std::string response = round_trip(http_server.port(), "GET /events HTTP/1.1\r\n\r\n");
+  writer.join();
+  ASSERT_NE(response.find("Content-Type: text/event-stream"), std::string::npos);
+  ASSERT_NE(response.find("data: 0\n\ndata: 1\n\ndata: 2\n\n"), std::string::npos);
+  http_server.stop();
+}
+
+TEST(test_http_server, request_queue_admission) {
+  server::RequestQueue queue(2, 8);
+  server::GenerationRequest request;
+  request.prompt_tokens = {1, 2, 3};
+  request.max_new_tokens = 4;
+  ASSERT_TRUE(queue.push(request));
+  ASSERT_TRUE(queue.push(request));
+  // the queue is full
+  ASSERT_FALSE(queue.push(request));
+  ASSERT_EQ(queue.pop_all(false).size(), 2);
+
+  server::GenerationRequest long_request = request;
+  long_request.prompt_tokens.resize(9, 1);
+  ASSERT_FALSE(queue.push(long_request));
+  queue.close();
+  ASSERT_FALSE(queue.push(request));
+  ASSERT_TRUE(queue.pop_all(true).empty());
+}
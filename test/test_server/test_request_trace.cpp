@@ -0,0 +1,62 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <cstdio>
+#include "server/request_trace.h"
+
+TEST(test_request_trace, write_and_read) {
+  const std::string path = "./test_request.trace";
+  server::TraceWriter writer;
+  ASSERT_TRUE(writer.open(path));
+  const auto start = std::chrono::steady_clock::now();
+  ASSERT_GE(writer.arrival_us(start), 0);
+
+  server::TraceRecord late;
+  late.arrival_us = 2500;
+  late.max_new_tokens = 64;
+  late.output_len = 17;
+  late.sampling.temperature = 0.7f;
+  late.sampling.top_k = 40;
+  late.sampling.top_p = 0.9f;
+  late.sampling.seed = 1234567890123ull;
+  // the varints of the large ids take several bytes
+  late.prompt_tokens = {1, 127, 128, 16384, 151935, 0};
+  server::TraceRecord early;
+  early.arrival_us = 100;
+  early.max_new_tokens = 8;
+  early.prompt_tokens = {42};
+  // the records are written as the requests finish
+  ASSERT_TRUE(writer.write(late));
+  ASSERT_TRUE(writer.write(early));
+  ASSERT_TRUE(writer.close());
+  ASSERT_FALSE(writer.write(early));
+
+  std::vector<server::TraceRecord> records;
+  ASSERT_TRUE(server::read_trace(path, records));
+  ASSERT_EQ(records.size(), 2);
+  ASSERT_EQ(records.at(0).arrival_us, 100);
+  ASSERT_EQ(records.at(0).output_len, -1);
+  ASSERT_EQ(records.at(0).prompt_tokens, early.prompt_tokens);
+  const server::TraceRecord& record = records.at(1);
+  ASSERT_EQ(record.arrival_us, 2500);
+  ASSERT_EQ(record.max_new_tokens, 64);
+  ASSERT_EQ(record.output_len, 17);
+  ASSERT_FLOAT_EQ(record.sampling.temperature, 0.7f);
+  ASSERT_EQ(record.sampling.top_k, 40);
+  ASSERT_FLOAT_EQ(record.sampling.top_p, 0.9f);
+  ASSERT_EQ(record.sampling.seed, 1234567890123ull);
+  ASSERT_EQ(record.prompt_tokens, late.prompt_tokens);
+
+  // a record cut by a crash is dropped, the ones before it are kept
+  FILE* file = std::fopen(path.c_str(), "rb");
+  std::fseek(file, 0, SEEK_END);
+  const long size = std::ftell(file);
+  std::fclose(file);
+  ASSERT_EQ(truncate(path.c_str(), size - 1), 0);
+  ASSERT_TRUE(server::read_trace(path, records));
+  ASSERT_EQ(records.size(), 1);
+  ASSERT_EQ(records.at(0).arrival_us, 2500);
+  std::remove(path.c_str());
+
+  ASSERT_FALSE(server::read_trace(path, records));
+}
@@ -117,4 +117,110 @@ TEST(test_buffer, cuda_memcpy4) {
   for (int i = 0; i < size; ++i) {
     ASSERT_EQ(ptr3[i],ptr4[i]);
   }
-}
\ No newline at end of file
+}
+TEST(test_buffer, cuda_alloc_reuse) {
+  using namespace base;
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  alloc_cu->empty_cache();
+
+  // a released small block is handed out again for the same size class
+  void* small1 = alloc_cu->allocate(1000);
+  alloc_cu->release(small1);
+  void* small2 = alloc_cu->allocate(1024);
+  ASSERT_EQ(small1, small2);
+  alloc_cu->release(small2);
+
+  // the split halves of a segment are merged back when both are released
+  void* large = alloc_cu->allocate(16 * 1024 * 1024);
+  alloc_cu->release(large);
+  void* first = alloc_cu->allocate(8 * 1024 * 1024);
+  void* second = alloc_cu->allocate(8 * 1024 * 1024);
+  ASSERT_EQ(first, large);
+  ASSERT_EQ(static_cast<int8_t*>(second), static_cast<int8_t*>(first) + 8 * 1024 * 1024);
+  alloc_cu->release(first);
+  alloc_cu->release(second);
+  void* merged = alloc_cu->allocate(16 * 1024 * 1024);
+  ASSERT_EQ(merged, large);
+  alloc_cu->release(merged);
+  alloc_cu->empty_cache();
+}
+
+TEST(test_buffer, cuda_stream_ordered) {
+  using namespace base;
+  auto alloc_cu = base::DeviceAlloctorFactory::get_instance(DeviceType::kDeviceCUDA, true);
+  cudaStream_t stream;
+  cudaStreamCreate(&stream);
+
+  int32_t size = 1024;
+  float* ptr = new float[size];
+  {
+    Buffer cu_buffer(size * sizeof(float), alloc_cu, nullptr, false, stream);
+    ASSERT_NE(cu_buffer.ptr(), nullptr);
+    ASSERT_EQ(cu_buffer.stream(), stream);
+    alloc_cu->memset_zero(cu_buffer.ptr(), size * sizeof(float), stream);
+    cudaMemcpyAsync(ptr, cu_buffer.ptr(), size * sizeof(float), cudaMemcpyDeviceToHost, stream);
+  }
+  // the buffer is freed in stream order after the copy
+  cudaStreamSynchronize(stream);
+  for (int i = 0; i < size; ++i) {
+    ASSERT_EQ(ptr[i], 0.f);
+  }
+  delete[] ptr;
+  cudaStreamDestroy(stream);
+}
+
+TEST(test_buffer, cuda_pinned_host) {
+  using namespace base;
+  auto alloc_host = base::CUDAHostAllocatorFactory::get_instance();
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  cudaStream_t stream;
+  cudaStreamCreate(&stream);
+
+  int32_t size = 4096;
+  Buffer host_buffer(size * sizeof(float), alloc_host);
+  ASSERT_EQ(host_buffer.device_type(), DeviceType::kDeviceCPU);
+  float* host_ptr = static_cast<float*>(host_buffer.ptr());
+  for (int i = 0; i < size; ++i) {
+    host_ptr[i] = float(i);
+  }
+  Buffer cu_buffer(size * sizeof(float), alloc_cu);
+  alloc_cu->memcpy(host_ptr, cu_buffer.ptr(), size * sizeof(float), MemcpyKind::kMemcpyCPU2CUDA,
+                   stream);
+  Buffer back_buffer(size * sizeof(float), alloc_host);
+  alloc_cu->memcpy(cu_buffer.ptr(), back_buffer.ptr(), size * sizeof(float),
+                   MemcpyKind::kMemcpyCUDA2CPU, stream);
+  cudaStreamSynchronize(stream);
+  const float* back_ptr = static_cast<const float*>(back_buffer.ptr());
+  for (int i = 0; i < size; ++i) {
+    ASSERT_EQ(back_ptr[i], float(i));
+  }
+  cudaStreamDestroy(stream);
+}
+
+TEST(test_buffer, cuda_alloc_stats) {
+  using namespace base;
+  auto alloc_cu = base::CUDADeviceAllocatorFactory::get_instance();
+  alloc_cu->empty_cache();
+  int id = -1;
+  cudaGetDevice(&id);
+  const AllocatorStats before = alloc_cu->stats()[id];
+  const int32_t kv_tag = static_cast<int32_t>(MemoryTag::kMemoryTagKVCache);
+  {
+    Buffer buffer(4 * 1024 * 1024, alloc_cu);
+    buffer.set_tag(MemoryTag::kMemoryTagKVCache);
+    const AllocatorStats during = alloc_cu->stats()[id];
+    ASSERT_EQ(during.allocated_byte_size, before.allocated_byte_size + 4 * 1024 * 1024);
+    ASSERT_EQ(during.tag_byte_sizes[kv_tag], before.tag_byte_sizes[kv_tag] + 4 * 1024 * 1024);
+    ASSERT_GE(during.peak_allocated_byte_size, during.allocated_byte_size);
+    ASSERT_EQ(during.allocation_num, before.allocation_num + 1);
+  }
+  // the released block stays cached, it is reserved but no longer allocated
+  const AllocatorStats after = alloc_cu->stats()[id];
+  ASSERT_EQ(after.allocated_byte_size, before.allocated_byte_size);
+  ASSERT_EQ(after.tag_byte_sizes[kv_tag], before.tag_byte_sizes[kv_tag]);
+  ASSERT_EQ(after.release_num, before.release_num + 1);
+  ASSERT_GE(after.cached_byte_size, 4 * 1024 * 1024);
+  ASSERT_GE(after.reserved_byte_size, after.cached_byte_size);
+  ASSERT_FALSE(alloc_cu->dump_stats().empty());
+  alloc_cu->empty_cache();
+}
@@ -2,6 +2,7 @@
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 #include <tensor/tensor.h>
+#include <tensor/upload_queue.h>
 #include "../utils.cuh"
 #include "base/buffer.h"
 
@@ -141,4 +142,79 @@ TEST(test_tensor, assign1) {
   ASSERT_EQ(t1_cpu.is_empty(), false);
   ASSERT_NE(t1_cpu.ptr<float>(), nullptr);
   delete[] ptr;
-}
\ No newline at end of file
+}
+TEST(test_tensor, view_rows) {
+  using namespace base;
+  auto alloc_cpu = CPUDeviceAllocatorFactory::get_instance();
+  tensor::Tensor t1_cpu(DataType::kDataTypeFp32, 4, 8, true, alloc_cpu);
+  for (int i = 0; i < t1_cpu.size(); ++i) {
+    t1_cpu.index<float>(i) = float(i);
+  }
+  tensor::TensorView view(t1_cpu);
+  ASSERT_EQ(view.dims_size(), 2);
+  ASSERT_EQ(view.stride(0), 8);
+  ASSERT_EQ(view.stride(1), 1);
+
+  tensor::TensorView row = view.row(2);
+  ASSERT_EQ(row.dims_size(), 1);
+  ASSERT_EQ(row.get_dim(0), 8);
+  ASSERT_EQ(*row.ptr<float>(), 16.f);
+
+  tensor::TensorView rows = view.rows(1, 2);
+  ASSERT_EQ(rows.get_dim(0), 2);
+  ASSERT_EQ(rows.size(), 16);
+  ASSERT_EQ(*rows.ptr<float>(), 8.f);
+}
+
+TEST(test_tensor, bind_view) {
+  using namespace base;
+  auto alloc_cpu = CPUDeviceAllocatorFactory::get_instance();
+  tensor::Tensor t1_cpu(DataType::kDataTypeFp32, 4, 8, true, alloc_cpu);
+  for (int i = 0; i < t1_cpu.size(); ++i) {
+    t1_cpu.index<float>(i) = float(i);
+  }
+  tensor::TensorView view(t1_cpu);
+  tensor::Tensor row;
+  row.bind(view.row(0));
+  const base::Buffer* buffer = row.get_buffer().get();
+  for (int32_t i = 1; i < 4; ++i) {
+    row.bind(view.row(i));
+    // the external buffer is kept, only its pointer moves
+    ASSERT_EQ(row.get_buffer().get(), buffer);
+    ASSERT_EQ(row.dims_size(), 1);
+    ASSERT_EQ(row.size(), 8);
+    ASSERT_EQ(row.index<float>(0), float(i * 8));
+    ASSERT_EQ(row.device_type(), DeviceType::kDeviceCPU);
+  }
+}
+
+TEST(test_tensor, upload_tied_weights) {
+  using namespace base;
+  std::vector<float> host(64 * 16);
+  for (int i = 0; i < host.size(); ++i) {
+    host[i] = float(i);
+  }
+  // a classifier tied to the embedding table reads the same host weights
+  tensor::Tensor embedding(DataType::kDataTypeFp32, 64, 16, false, nullptr, host.data());
+  tensor::Tensor cls(DataType::kDataTypeFp32, 64, 16, false, nullptr, host.data());
+  tensor::Tensor other(DataType::kDataTypeFp32, 16, false, nullptr, host.data() + 16);
+  for (tensor::Tensor* tensor : {&embedding, &cls, &other}) {
+    tensor->set_device_type(DeviceType::kDeviceCPU);
+  }
+  tensor::UploadQueue upload_queue(nullptr);
+  upload_queue.push(embedding);
+  upload_queue.push(cls);
+  upload_queue.push(other);
+  upload_queue.flush();
+
+  ASSERT_EQ(embedding.device_type(), DeviceType::kDeviceCUDA);
+  ASSERT_EQ(cls.device_type(), DeviceType::kDeviceCUDA);
+  ASSERT_EQ(embedding.get_buffer(), cls.get_buffer());
+  ASSERT_NE(other.get_buffer(), cls.get_buffer());
+  cls.to_cpu();
+  other.to_cpu();
+  for (int i = 0; i < cls.size(); ++i) {
+    ASSERT_EQ(cls.index<float>(i), float(i));
+  }
+  ASSERT_EQ(other.index<float>(0), 16.f);
+}
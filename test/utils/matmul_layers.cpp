@@ -0,0 +1,31 @@
+#include "matmul_layers.h"
+
+namespace test {
+MatmulLayers constant_matmul_layers(int32_t layer_num, int32_t out_dim, int32_t dim,
+                                    std::shared_ptr<kernel::CudaConfig> config, float scale) {
+  auto alloc_cpu = base::CPUDeviceAllocatorFactory::get_instance();
+  MatmulLayers matmul_layers;
+  for (int32_t layer_idx = 0; layer_idx < layer_num; ++layer_idx) {
+    tensor::Tensor weight(base::DataType::kDataTypeFp32, out_dim, dim, true, alloc_cpu);
+    for (int32_t i = 0; i < weight.size(); ++i) {
+      weight.index<float>(i) = scale * float(layer_idx + 1);
+    }
+    auto layer = std::make_shared<op::MatmulLayer>(base::DeviceType::kDeviceCUDA, out_dim, dim);
+    layer->set_weight(0, {out_dim, dim}, weight.ptr<float>(), base::DeviceType::kDeviceCPU);
+    layer->set_cuda_config(config);
+    matmul_layers.weights.push_back(weight);
+    matmul_layers.layers.push_back(layer);
+  }
+  return matmul_layers;
+}
+
+tensor::Tensor cuda_ones(int32_t dim, cudaStream_t stream) {
+  tensor::Tensor input(base::DataType::kDataTypeFp32, dim, true,
+                       base::CPUDeviceAllocatorFactory::get_instance());
+  for (int32_t i = 0; i < dim; ++i) {
+    input.index<float>(i) = 1.f;
+  }
+  input.to_cuda(stream);
+  return input;
+}
+}  // namespace test
@@ -0,0 +1,24 @@
+#ifndef TEST_UTILS_MATMUL_LAYERS_H
+#define TEST_UTILS_MATMUL_LAYERS_H
+#include <cuda_runtime_api.h>
+#include <memory>
+#include <vector>
+#include "op/matmul.h"
+
+namespace test {
+// cuda fp32 matmul layers of out_dim x dim on the config, every weight of the layer i is
+// scale * (i + 1) so the output of an input of ones is scale * (i + 1) * dim. The host weights
+// are kept with the layers
+struct MatmulLayers {
+  std::vector<tensor::Tensor> weights;
+  std::vector<std::shared_ptr<op::MatmulLayer>> layers;
+};
+
+MatmulLayers constant_matmul_layers(int32_t layer_num, int32_t out_dim, int32_t dim,
+                                    std::shared_ptr<kernel::CudaConfig> config,
+                                    float scale = 1.f);
+
+// an fp32 input of dim ones, copied to the device on the stream
+tensor::Tensor cuda_ones(int32_t dim, cudaStream_t stream);
+}  // namespace test
+#endif  // TEST_UTILS_MATMUL_LAYERS_H
@@ -0,0 +1,159 @@
+#include "toy_model.h"
+#include <glog/logging.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+namespace test {
+namespace {
+constexpr int32_t kControlPieceNum = 3;
+
+void append_varint(std::string& data, uint64_t value) {
+  while (value >= 0x80) {
+    data.push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  data.push_back(static_cast<char>(value));
+}
+
+void append_bytes_field(std::string& data, int32_t field, const std::string& bytes) {
+  append_varint(data, (field << 3) | 2);
+  append_varint(data, bytes.size());
+  data += bytes;
+}
+
+// a ModelProto of the pieces only, a unigram model with the default specs
+std::string sentencepiece_model(int32_t vocab_size) {
+  // the types of SentencePiece::Type
+  constexpr int32_t kNormal = 1;
+  constexpr int32_t kUnknown = 2;
+  constexpr int32_t kControl = 3;
+  std::string proto;
+  for (int32_t id = 0; id < vocab_size; ++id) {
+    std::string piece_text = "t" + std::to_string(id);
+    int32_t type = kNormal;
+    if (id == 0) {
+      piece_text = "<unk>";
+      type = kUnknown;
+    } else if (id == 1) {
+      piece_text = "<s>";
+      type = kControl;
+    } else if (id == 2) {
+      piece_text = "</s>";
+      type = kControl;
+    }
+    std::string piece;
+    append_bytes_field(piece, 1, piece_text);
+    const float score = -static_cast<float>(id);
+    append_varint(piece, (2 << 3) | 5);
+    piece.append(reinterpret_cast<const char*>(&score), sizeof(score));
+    append_varint(piece, 3 << 3);
+    append_varint(piece, type);
+    append_bytes_field(proto, 1, piece);
+  }
+  return proto;
+}
+
+void append_random(std::vector<float>& weights, size_t size, std::mt19937& mt) {
+  std::uniform_real_distribution<float> dist(-0.5f, 0.5f);
+  for (size_t i = 0; i < size; ++i) {
+    weights.push_back(dist(mt));
+  }
+}
+}  // namespace
+
+model::ModelConfig toy_model_config() {
+  model::ModelConfig config;
+  config.dim = 16;
+  config.hidden_dim = 32;
+  config.layer_num = 2;
+  config.head_num = 4;
+  config.kv_head_num = 2;
+  config.vocab_size = 32;
+  config.seq_len = 64;
+  return config;
+}
+
+ToyModelFiles::ToyModelFiles(const std::string& name, const model::ModelConfig& config,
+                             uint32_t seed) {
+  const std::string prefix = "/tmp/kuiper_toy_" + name + "_" + std::to_string(getpid());
+  model_path_ = prefix + ".bin";
+  token_path_ = prefix + ".model";
+  CHECK_GT(config.vocab_size, kControlPieceNum);
+
+  const int32_t dim = config.dim;
+  const int32_t kv_dim = config.dim * config.kv_head_num / config.head_num;
+  const int32_t layer_num = config.layer_num;
+  const size_t hidden_size = static_cast<size_t>(layer_num) * config.hidden_dim * dim;
+  std::mt19937 mt(seed);
+  std::vector<float> weights;
+  // the embedding, which is the classifier as well
+  weights.resize(static_cast<size_t>(kControlPieceNum) * dim, 0.f);
+  for (int32_t row = kControlPieceNum; row < config.vocab_size; ++row) {
+    if ((row - kControlPieceNum) % 2 == 1) {
+      for (int32_t i = 0; i < dim; ++i) {
+        weights.push_back(-weights.at(weights.size() - dim));
+      }
+    } else {
+      append_random(weights, dim, mt);
+    }
+  }
+  weights.resize(weights.size() + layer_num * dim, 1.f);
+  append_random(weights, static_cast<size_t>(layer_num) * dim * dim, mt);
+  append_random(weights, static_cast<size_t>(layer_num) * kv_dim * dim * 2, mt);
+  append_random(weights, static_cast<size_t>(layer_num) * dim * dim, mt);
+  weights.resize(weights.size() + layer_num * dim, 1.f);
+  append_random(weights, hidden_size * 3, mt);
+  weights.resize(weights.size() + dim, 1.f);
+  // the rope tables of the exporter, the model computes its own
+  weights.resize(weights.size() + static_cast<size_t>(config.seq_len) * dim / config.head_num,
+                 0.f);
+
+  FILE* model_file = fopen(model_path_.data(), "wb");
+  CHECK(model_file != nullptr);
+  fwrite(&config, sizeof(config), 1, model_file);
+  fwrite(weights.data(), sizeof(float), weights.size(), model_file);
+  fclose(model_file);
+
+  const std::string proto = sentencepiece_model(config.vocab_size);
+  FILE* token_file = fopen(token_path_.data(), "wb");
+  CHECK(token_file != nullptr);
+  fwrite(proto.data(), 1, proto.size(), token_file);
+  fclose(token_file);
+}
+
+ToyModelFiles::~ToyModelFiles() {
+  remove(model_path_.data());
+  remove(token_path_.data());
+}
+
+const std::string& ToyModelFiles::model_path() const { return model_path_; }
+
+const std::string& ToyModelFiles::token_path() const { return token_path_; }
+
+std::unique_ptr<model::LLama2Model> ToyModelFiles::create_model() const {
+  return std::make_unique<model::LLama2Model>(base::TokenizerType::kEncodeSpe, token_path_,
+                                              model_path_, false);
+}
+
+std::vector<int32_t> greedy_reference(const model::Model& model, std::vector<int32_t> tokens,
+                                      int32_t max_new_tokens) {
+  tensor::Tensor pos_tensor(base::DataType::kDataTypeInt32, 1, true,
+                            base::CPUDeviceAllocatorFactory::get_instance());
+  pos_tensor.index<int32_t>(0) = 0;
+  std::vector<int32_t> output_tokens;
+  while (output_tokens.size() < max_new_tokens) {
+    model.release_kv_cache(0);
+    int32_t next = -1;
+    CHECK(model.prefill(model.embedding(tokens).input_embeddings, pos_tensor, next));
+    if (model.is_sentence_ending(next)) {
+      break;
+    }
+    output_tokens.push_back(next);
+    tokens.push_back(next);
+  }
+  model.release_kv_cache(0);
+  return output_tokens;
+}
+}  // namespace test
@@ -0,0 +1,45 @@
+#ifndef TEST_UTILS_TOY_MODEL_H
+#define TEST_UTILS_TOY_MODEL_H
+#include <memory>
+#include <string>
+#include <vector>
+#include "model/config.h"
+#include "model/llama3.h"
+
+namespace test {
+// the config of the toy model, small enough for the cpu kernels
+model::ModelConfig toy_model_config();
+
+// A legacy fp32 llama2 file of random weights with the classifier shared with the embedding,
+// and a sentencepiece tokenizer with a piece for every row of it. The rows of the control
+// pieces are zero and the other rows come in pairs of opposite sign, so one logit of a pair is
+// positive and a greedy decode never samples the eos. Both files are removed with the object
+class ToyModelFiles {
+ public:
+  explicit ToyModelFiles(const std::string& name, const model::ModelConfig& config,
+                         uint32_t seed = 1);
+
+  ~ToyModelFiles();
+
+  ToyModelFiles(const ToyModelFiles&) = delete;
+
+  ToyModelFiles& operator=(const ToyModelFiles&) = delete;
+
+  const std::string& model_path() const;
+
+  const std::string& token_path() const;
+
+  // a model of the files which is not initialized yet
+  std::unique_ptr<model::LLama2Model> create_model() const;
+
+ private:
+  std::string model_path_;
+  std::string token_path_;
+};
+
+// the greedy continuation of the tokens which the model alone gives, every token is sampled
+// from a prefill of the whole history in slot 0
+std::vector<int32_t> greedy_reference(const model::Model& model, std::vector<int32_t> tokens,
+                                      int32_t max_new_tokens);
+}  // namespace test
+#endif  // TEST_UTILS_TOY_MODEL_H
@@ -39,6 +39,12 @@ def serialize_fp32(file, tensor):
     file.write(b)
 
 
+def serialize_half(file, tensor, dtype):
+    """ writes one fp16 or bf16 tensor to file that is open in wb mode """
+    d = tensor.detach().cpu().view(-1).to(dtype).view(torch.int16).numpy()
+    file.write(d.tobytes())
+
+
 def serialize_int8(file, tensor):
     """ writes one int8 tensor to file that is open in wb mode """
     d = tensor.detach().cpu().view(-1).numpy().astype(np.int8)
@@ -73,12 +79,76 @@ def quantize_q80(w, group_size):
     return int8val, scale, maxerr
 
 
+def quantize_q40(w, group_size, zero_point=False):
+    """
+    takes a tensor and returns the Q4 quantized version, two values per byte
+    with the even column in the low nibble. Without a zero point the range is
+    symmetric and the stored value q + 8 is in [1, 15], with it the groups use
+    their own [min, max] range and the zero point is stored next to the scale
+    """
+    assert w.numel() % group_size == 0
+    w = w.float()
+    w = w.reshape(-1, group_size)
+    if zero_point:
+        wmin = torch.clamp(w.min(dim=1).values, max=0.0)
+        wmax = torch.clamp(w.max(dim=1).values, min=0.0)
+        scale = torch.clamp((wmax - wmin) / 15.0, min=1e-8)
+        zero = torch.clamp(torch.round(-wmin / scale), 0, 15)
+    else:
+        scale = torch.clamp(torch.abs(w).max(dim=1).values / 7.0, min=1e-8)
+        zero = torch.full_like(scale, 8.0)
+    # the scale is stored in fp16, round with it so the error matches the kernels
+    scale = scale.half().float()
+    quant = torch.clamp(torch.round(w / scale[:, None]) + zero[:, None], 0, 15)
+    # dequantize by rescaling
+    fp32val = (quant - zero[:, None]) * scale[:, None]
+    maxerr = torch.abs(fp32val - w).max().item()
+    quant = quant.to(torch.uint8).view(-1)
+    packed = quant[0::2] | (quant[1::2] << 4)
+    return packed, scale.half(), zero.to(torch.uint8), maxerr
+
+
+def quantize_fp8(w, per_channel=True):
+    """
+    takes a 2d tensor and returns its e4m3 fp8 bytes and one fp32 scale per
+    row, the largest value of a row (or of the tensor) maps to 448. A per tensor
+    scaled weight repeats the one scale for every row
+    """
+    assert w.dim() == 2
+    w = w.float()
+    if per_channel:
+        wmax = torch.abs(w).max(dim=1).values
+    else:
+        wmax = torch.abs(w).max().expand(w.shape[0])
+    scale = torch.clamp(wmax / 448.0, min=1e-12)
+    quant = (w / scale[:, None]).to(torch.float8_e4m3fn)
+    # dequantize by rescaling
+    fp32val = quant.float() * scale[:, None]
+    maxerr = torch.abs(fp32val - w).max().item()
+    return quant.view(torch.uint8), scale.contiguous(), maxerr
+
+
+def serialize_aligned(file, data, alignment=16):
+    """ writes the bytes of a numpy array and pads them up to the alignment """
+    b = data.tobytes()
+    file.write(b)
+    file.write(b'\0' * (-len(b) % alignment))
+
+
 # -----------------------------------------------------------------------------
 # legacy
 
-def legacy_export(model, filepath):
-    """ Original export of llama2.c bin files, i.e. version v0 """
+def legacy_export(model, filepath, dtype=torch.float32):
+    """
+    Original export of llama2.c bin files, i.e. version v0. With a fp16 or bf16
+    dtype the config is followed by a magic and the data type, and every
+    tensor is stored in that dtype
+    """
     out_file = open(filepath, 'wb')
+    if dtype == torch.float32:
+        serialize = serialize_fp32
+    else:
+        serialize = lambda file, tensor: serialize_half(file, tensor, dtype)
 
     # first write out the header
     hidden_dim = model.layers[0].feed_forward.w1.weight.shape[0]
@@ -91,40 +161,44 @@ def legacy_export(model, filepath):
     header = struct.pack('iiiiiii', p.dim, hidden_dim, p.n_layers, p.n_heads,
                          n_kv_heads, p.vocab_size, p.max_seq_len)
     out_file.write(header)
+    if dtype != torch.float32:
+        # the values of base::DataType, magic "KF2\0"
+        data_type = {torch.float16: 4, torch.bfloat16: 5}[dtype]
+        out_file.write(struct.pack('iiiii', 0x0032464b, data_type, 0, 0, 0))
 
     # next write out the embedding weights
-    serialize_fp32(out_file, model.tok_embeddings.weight)
+    serialize(out_file, model.tok_embeddings.weight)
 
     # now all the layers
     # attention weights
     for layer in model.layers:
-        serialize_fp32(out_file, layer.attention_norm.weight)
+        serialize(out_file, layer.attention_norm.weight)
     for layer in model.layers:
-        serialize_fp32(out_file, layer.attention.wq.weight)
+        serialize(out_file, layer.attention.wq.weight)
     for layer in model.layers:
-        serialize_fp32(out_file, layer.attention.wk.weight)
+        serialize(out_file, layer.attention.wk.weight)
     for layer in model.layers:
-        serialize_fp32(out_file, layer.attention.wv.weight)
+        serialize(out_file, layer.attention.wv.weight)
     for layer in model.layers:
-        serialize_fp32(out_file, layer.attention.wo.weight)
+        serialize(out_file, layer.attention.wo.weight)
     # ffn weights
     for layer in model.layers:
-        serialize_fp32(out_file, layer.ffn_norm.weight)
+        serialize(out_file, layer.ffn_norm.weight)
     for layer in model.layers:
-        serialize_fp32(out_file, layer.feed_forward.w1.weight)
+        serialize(out_file, layer.feed_forward.w1.weight)
     for layer in model.layers:
-        serialize_fp32(out_file, layer.feed_forward.w2.weight)
+        serialize(out_file, layer.feed_forward.w2.weight)
     for layer in model.layers:
-        serialize_fp32(out_file, layer.feed_forward.w3.weight)
+        serialize(out_file, layer.feed_forward.w3.weight)
     # final rmsnorm
-    serialize_fp32(out_file, model.norm.weight)
+    serialize(out_file, model.norm.weight)
     # freqs_cis
-    serialize_fp32(out_file, model.freqs_cos[:p.max_seq_len])
-    serialize_fp32(out_file, model.freqs_sin[:p.max_seq_len])
+    serialize(out_file, model.freqs_cos[:p.max_seq_len])
+    serialize(out_file, model.freqs_sin[:p.max_seq_len])
 
     # final classifier weights
     if not shared_classifier:
-        serialize_fp32(out_file, model.output.weight)
+        serialize(out_file, model.output.weight)
 
     # write to binary file
     out_file.close()
@@ -210,6 +284,62 @@ def legacy_export_quant(model, filepath):
     print(f"wrote {filepath}")
 
 
+def legacy_export_quant4(model, filepath, group_size=64, zero_point=False):
+    """
+    the layout of legacy_export_quant with int4 weights. The int8 group size is
+    replaced by a magic and followed by the group size, the flags and two
+    reserved ints. Every weight, its fp16 scales and its uint8 zero points each
+    start on a 16 byte boundary
+    """
+    print('export int4 quant model')
+    out_file = open(filepath, 'wb')
+
+    hidden_dim = model.layers[0].feed_forward.w1.weight.shape[0]
+    p = model.params
+    shared_classifier = torch.equal(model.tok_embeddings.weight, model.output.weight)
+    if not shared_classifier:
+        p.vocab_size = -p.vocab_size
+    n_kv_heads = p.n_heads if p.n_kv_heads is None else p.n_kv_heads
+    magic = 0x0034514b
+    flags = 1 if zero_point else 0
+    header = struct.pack('iiiiiiii', p.dim, hidden_dim, p.n_layers, p.n_heads,
+                         n_kv_heads, p.vocab_size, p.max_seq_len, magic)
+    out_file.write(header)
+    out_file.write(struct.pack('iiii', group_size, flags, 0, 0))
+
+    def serialize_q40(w):
+        q, s, z, err = quantize_q40(w, group_size, zero_point)
+        serialize_aligned(out_file, q.numpy())
+        serialize_aligned(out_file, s.numpy())
+        if zero_point:
+            serialize_aligned(out_file, z.numpy())
+        return err
+
+    weights = [layer.attention.wq.weight for layer in model.layers]
+    weights += [layer.attention.wk.weight for layer in model.layers]
+    weights += [layer.attention.wv.weight for layer in model.layers]
+    weights += [layer.attention.wo.weight for layer in model.layers]
+    weights += [layer.feed_forward.w1.weight for layer in model.layers]
+    weights += [layer.feed_forward.w2.weight for layer in model.layers]
+    weights += [layer.feed_forward.w3.weight for layer in model.layers]
+    # final classifier weights
+    if not shared_classifier:
+        weights.append(model.output.weight)
+    maxerr = max(serialize_q40(w) for w in weights)
+    print(f"max int4 quantization group error across all weights: {maxerr}")
+
+    # next write out the embedding weights
+    serialize_fp32(out_file, model.tok_embeddings.weight)
+    for layer in model.layers:
+        serialize_fp32(out_file, layer.attention_norm.weight)
+    for layer in model.layers:
+        serialize_fp32(out_file, layer.ffn_norm.weight)
+    serialize_fp32(out_file, model.norm.weight)
+
+    out_file.close()
+    print(f"wrote {filepath}")
+
+
 # -----------------------------------------------------------------------------
 # new version
 
@@ -590,16 +720,139 @@ def load_hf_model(model_path):
     return model
 
 
+# -----------------------------------------------------------------------------
+# tensor file
+
+TENSOR_FILE_MAGIC = 0x3146544b  # "KTF1"
+TENSOR_FILE_VERSION = 1
+TENSOR_FILE_ALIGNMENT = 4096
+TENSOR_FILE_HEADER_SIZE = 64
+TENSOR_FILE_ENTRY_SIZE = 128
+TENSOR_FILE_NAME_SIZE = 80
+# the values of base::DataType
+TENSOR_DTYPES = {torch.float32: 1, torch.int8: 2, torch.float16: 4, torch.bfloat16: 5}
+TENSOR_FP8_DTYPE = 6
+
+
+def model_tensors(model, with_output):
+    """ the (name, tensor) pairs of the model in the order they are written """
+    tensors = [('tok_embeddings.weight', model.tok_embeddings.weight)]
+    for i, layer in enumerate(model.layers):
+        prefix = f'layers.{i}.'
+        tensors.append((prefix + 'attention_norm.weight', layer.attention_norm.weight))
+        for name in ('wq', 'wk', 'wv', 'wo'):
+            linear = getattr(layer.attention, name)
+            tensors.append((prefix + f'attention.{name}.weight', linear.weight))
+            if linear.bias is not None:
+                tensors.append((prefix + f'attention.{name}.bias', linear.bias))
+        tensors.append((prefix + 'ffn_norm.weight', layer.ffn_norm.weight))
+        for name in ('w1', 'w2', 'w3'):
+            linear = getattr(layer.feed_forward, name)
+            tensors.append((prefix + f'feed_forward.{name}.weight', linear.weight))
+    tensors.append(('norm.weight', model.norm.weight))
+    if with_output:
+        tensors.append(('output.weight', model.output.weight))
+    return tensors
+
+
+def tensor_export(model, filepath, dtype=torch.float32, quant=None, group_size=64,
+                  zero_point=False, fp8_scaling='channel'):
+    """
+    the versioned tensor file of kuiper/include/model/tensor_file.h, version 6.
+    A 64 byte header and a directory of 128 byte entries (name, dtype, shape,
+    offset, byte size) are followed by the tensors, each of them starts on a
+    4KB boundary. quant is None, 'int8', 'int4' or 'fp8', a quant file keeps
+    the embedding, the norms and the biases in fp32 and always has a quant copy
+    of the classifier, even when it shares the embedding. The fp8 weights are
+    e4m3 with one fp32 scale per row, fp8_scaling 'tensor' gives all the rows
+    of a weight the same one
+    """
+    assert quant in (None, 'int8', 'int4', 'fp8')
+    assert fp8_scaling in ('tensor', 'channel')
+    assert quant is None or dtype == torch.float32, "the quant export starts from fp32"
+    hidden_dim = model.layers[0].feed_forward.w1.weight.shape[0]
+    p = model.params
+    shared_classifier = torch.equal(model.tok_embeddings.weight, model.output.weight)
+    vocab_size = p.vocab_size if shared_classifier else -p.vocab_size
+    n_kv_heads = p.n_heads if p.n_kv_heads is None else p.n_kv_heads
+    tensors = model_tensors(model, quant is not None or not shared_classifier)
+
+    weight_dtype = TENSOR_DTYPES[torch.int8] if quant else TENSOR_DTYPES[dtype]
+    if quant == 'fp8':
+        weight_dtype = TENSOR_FP8_DTYPE
+    flags = 0
+    if quant == 'int4':
+        flags |= 1
+        if zero_point:
+            flags |= 2
+    out_file = open(filepath, 'wb')
+    out_file.write(struct.pack('ii', TENSOR_FILE_MAGIC, TENSOR_FILE_VERSION))
+    out_file.write(struct.pack('iiiiiii', p.dim, hidden_dim, p.n_layers, p.n_heads,
+                               n_kv_heads, vocab_size, p.max_seq_len))
+    has_groups = quant in ('int8', 'int4')
+    out_file.write(struct.pack('iiiiiii', weight_dtype, group_size if has_groups else 0, flags,
+                               len(tensors), 0, 0, 0))
+    # the directory is rewritten once the offsets are known
+    directory_offset = out_file.tell()
+    out_file.write(b'\0' * (TENSOR_FILE_ENTRY_SIZE * len(tensors)))
+
+    def encode(name, tensor):
+        is_matmul = tensor.dim() == 2 and name != 'tok_embeddings.weight'
+        if quant == 'int8' and is_matmul:
+            q, s, err = quantize_q80(tensor, group_size)
+            data = q.numpy().astype(np.int8).tobytes() + s.numpy().astype(np.float32).tobytes()
+            return TENSOR_DTYPES[torch.int8], data
+        if quant == 'int4' and is_matmul:
+            q, s, z, err = quantize_q40(tensor, group_size, zero_point)
+            parts = [q.numpy().tobytes(), s.numpy().tobytes()]
+            if zero_point:
+                parts.append(z.numpy().tobytes())
+            # every part starts on a 16 byte boundary, as in the legacy int4 layout
+            return TENSOR_DTYPES[torch.int8], b''.join(b + b'\0' * (-len(b) % 16) for b in parts)
+        if quant == 'fp8' and is_matmul:
+            q, s, err = quantize_fp8(tensor, fp8_scaling == 'channel')
+            return TENSOR_FP8_DTYPE, q.numpy().tobytes() + s.numpy().astype(np.float32).tobytes()
+        tensor_dtype = torch.float32 if quant else dtype
+        d = tensor.detach().cpu().contiguous().to(tensor_dtype)
+        if tensor_dtype != torch.float32:
+            d = d.view(torch.int16)
+        return TENSOR_DTYPES[tensor_dtype], d.numpy().tobytes()
+
+    entries = []
+    for name, tensor in tensors:
+        assert len(name) < TENSOR_FILE_NAME_SIZE, name
+        assert tensor.dim() <= 4, name
+        out_file.write(b'\0' * (-out_file.tell() % TENSOR_FILE_ALIGNMENT))
+        offset = out_file.tell()
+        data_type, data = encode(name, tensor)
+        out_file.write(data)
+        dims = list(tensor.shape) + [0] * (4 - tensor.dim())
+        entries.append(struct.pack(f'{TENSOR_FILE_NAME_SIZE}sii4iqqii', name.encode(),
+                                   data_type, tensor.dim(), *dims, offset, len(data), 0, 0))
+
+    out_file.seek(directory_offset)
+    for entry in entries:
+        assert len(entry) == TENSOR_FILE_ENTRY_SIZE
+        out_file.write(entry)
+    out_file.close()
+    print(f"wrote {filepath}")
+
+
 # -----------------------------------------------------------------------------
 # API entrypoint
 
-def model_export(model, filepath, version, dtype=torch.float32):
+def model_export(model, filepath, version, dtype=torch.float32, zero_point=False, quant=None,
+                 fp8_scaling='channel'):
     """
     Versions docs:
     v-1:huggingface export, i.e. intended for use outside of this repo, in HF
     v0: legacy llama2.c float format, DEPRECATED
     v1: float32 export
     v2: int8 quantized Q8_0 export, similar to llama.cpp, in groups
+    v3: legacy layout with int8 quantized weights, the format of the quant models
+    v4: legacy layout with int4 quantized weights, optionally with zero points
+    v5: legacy layout in the dtype, fp16 or bf16 weights
+    v6: aligned tensor file with a directory, in the dtype or quant to int8/int4/fp8
     # TODO: add dtype export support for other versions (?)
     """
     if version == 0:
@@ -610,8 +863,16 @@ def model_export(model, filepath, version, dtype=torch.float32):
         version2_export(model, filepath)
     elif version == 3:
         legacy_export_quant(model, filepath)
+    elif version == 4:
+        legacy_export_quant4(model, filepath, zero_point=zero_point)
+    elif version == 5:
+        assert dtype in (torch.float16, torch.bfloat16), "version 5 needs a 16 bit dtype"
+        legacy_export(model, filepath, dtype)
+    elif version == 6:
+        tensor_export(model, filepath, dtype, quant, zero_point=zero_point,
+                      fp8_scaling=fp8_scaling)
     elif version == -1:
-        hf_export(model, filepath, dtype)
+        hf_export(model, filepath, dtype=dtype)
     else:
         raise ValueError(f"unknown version {version}")
 
@@ -653,13 +914,20 @@ if __name__ == "__main__":
     parser = argparse.ArgumentParser()
     parser.add_argument("filepath", type=str, help="the output filepath")
     parser.add_argument("--version", default=0, type=int, help="the version to export with")
-    parser.add_argument("--dtype", type=str, help="dtype of the model (fp16, fp32)", default="fp32")
+    parser.add_argument("--dtype", type=str, help="dtype of the model (fp16, bf16, fp32)",
+                        default="fp32")
+    parser.add_argument("--zero-point", action="store_true",
+                        help="asymmetric int4 groups with zero points (version 4 and 6)")
+    parser.add_argument("--quant", type=str, choices=["int8", "int4", "fp8"], default=None,
+                        help="quantize the matmul weights of a version 6 export")
+    parser.add_argument("--fp8-scaling", type=str, choices=["tensor", "channel"],
+                        default="channel", help="the scale of an fp8 weight, per tensor or row")
     group = parser.add_mutually_exclusive_group(required=True)
     group.add_argument("--checkpoint", type=str, help="model checkpoint, .pt file")
     group.add_argument("--meta-llama", type=str, help="meta llama model path")
     group.add_argument("--hf", type=str, help="huggingface model path")
     args = parser.parse_args()
-    dtype = {"fp16": torch.float16, "fp32": torch.float32}[args.dtype]
+    dtype = {"fp16": torch.float16, "bf16": torch.bfloat16, "fp32": torch.float32}[args.dtype]
 
     if args.checkpoint:
         model = load_checkpoint(args.checkpoint)
@@ -672,4 +940,5 @@ if __name__ == "__main__":
         parser.error("Can't load input model!")
 
     # export
-    model_export(model, args.filepath, args.version, args.dtype)
+    model_export(model, args.filepath, args.version, dtype, args.zero_point, args.quant,
+                 args.fp8_scaling)
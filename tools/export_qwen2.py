@@ -608,6 +608,7 @@ def model_export(model, filepath, version, dtype=torch.float32):
     v0: legacy llama2.c float format, DEPRECATED
     v1: float32 export
     v2: int8 quantized Q8_0 export, similar to llama.cpp, in groups
+    v6: aligned fp32 tensor file with a directory, see tensor_export of export.py
     # TODO: add dtype export support for other versions (?)
     """
     if version == 0:
@@ -618,6 +619,9 @@ def model_export(model, filepath, version, dtype=torch.float32):
         version2_export(model, filepath)
     elif version == 3:
         legacy_export_quant(model, filepath)
+    elif version == 6:
+        from export import tensor_export
+        tensor_export(model, filepath)
     elif version == -1:
         hf_export(model, filepath, dtype)
     else: